@@ -1 +1,5 @@
+# Set to true to link dbus-daemon against a static libdbus with its
+# locking compiled out; see dbus/dbus-threads-internal.h
+DBUS_SINGLE_THREADED_DAEMON := false
+
 include $(call all-subdir-makefiles)
@@ -20,7 +20,9 @@ LOCAL_CFLAGS+=-Wno-address
 
 LOCAL_SRC_FILES:= \
 	activation.c \
+	bridge.c \
 	bus.c \
+	capture.c \
 	config-loader-expat.c \
 	config-parser.c \
     config-parser-common.c \
@@ -30,17 +32,52 @@ LOCAL_SRC_FILES:= \
 	dispatch.c \
 	driver.c \
 	expirelist.c \
+	intern.c \
+	metrics.c \
 	main.c \
 	policy.c \
+	readahead.c \
 	selinux.c \
 	services.c \
 	signals.c \
-	utils.c
+	stats.c \
+	utils.c \
+	validator.c
+
+ifeq ($(DBUS_SINGLE_THREADED_DAEMON),true)
+LOCAL_CFLAGS+=-DDBUS_SINGLE_THREADED
+
+LOCAL_STATIC_LIBRARIES := \
+	libdbus-daemon-internal
 
+LOCAL_SHARED_LIBRARIES := \
+	libexpat \
+	libcutils
+else
 LOCAL_SHARED_LIBRARIES := \
 	libexpat \
 	libdbus
+endif
 
 LOCAL_MODULE:=dbus-daemon
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES:= \
+	$(call include-path-for, dbus) \
+	$(call include-path-for, dbus)/dbus
+
+LOCAL_CFLAGS:=-O3
+LOCAL_CFLAGS+=-DDBUS_COMPILATION
+
+LOCAL_SRC_FILES:= \
+	spawn-helper-bin.c
+
+LOCAL_SHARED_LIBRARIES := \
+	libdbus
+
+LOCAL_MODULE:=dbus-daemon-spawn-helper
+
+include $(BUILD_EXECUTABLE)
@@ -27,10 +27,15 @@
 #include "activation.h"
 #include "activation-exit-codes.h"
 #include "desktop-file.h"
+#include "dir-watch.h"
 #include "dispatch.h"
+#include "readahead.h"
 #include "services.h"
 #include "test.h"
 #include "utils.h"
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-file.h>
+#include <dbus/dbus-flight-recorder.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-list.h>
@@ -55,6 +60,13 @@ struct BusActivation
                               */
   DBusHashTable *directories;
   DBusHashTable *environment;
+  char *cache_file; /**< where parsed .service files are cached, or NULL */
+  dbus_bool_t cache_stale; /**< entries changed since the cache was written */
+  char *boot_profile_file; /**< where the boot profile is saved, NULL once it was */
+  DBusList *boot_profile; /**< BootProfileEntry recorded since startup, in order */
+  long boot_profile_sec;  /**< When recording started, seconds */
+  long boot_profile_usec; /**< When recording started, microseconds */
+  DBusTimeout *boot_profile_timeout; /**< Ends the recording */
 };
 
 typedef struct
@@ -74,6 +86,8 @@ typedef struct
   unsigned long mtime;
   BusServiceDirectory *s_dir;
   char *filename;
+  long accounted; /**< bytes reported to memory accounting */
+  unsigned int listed : 1; /**< seen by the current update_directory() */
 } BusActivationEntry;
 
 typedef struct BusPendingActivationEntry BusPendingActivationEntry;
@@ -98,9 +112,15 @@ typedef struct
   DBusBabysitter *babysitter;
   DBusTimeout *timeout;
   unsigned int timeout_added : 1;
+  unsigned int prestarted : 1; /**< started from the boot profile, not for a request */
 } BusPendingActivation;
 
-#if 0
+typedef struct
+{
+  char *name;
+  dbus_uint32_t offset; /**< Milliseconds after startup it was first asked for */
+} BootProfileEntry;
+
 static BusServiceDirectory *
 bus_service_directory_ref (BusServiceDirectory *dir)
 {
@@ -110,7 +130,6 @@ bus_service_directory_ref (BusServiceDirectory *dir)
 
   return dir;
 }
-#endif
 
 static void
 bus_service_directory_unref (BusServiceDirectory *dir)
@@ -140,6 +159,8 @@ bus_pending_activation_entry_free (BusPendingActivationEntry *entry)
   if (entry->connection)
     dbus_connection_unref (entry->connection);
 
+  _dbus_memory_account (DBUS_MEMORY_ACTIVATION,
+                        -(long) sizeof (BusPendingActivationEntry));
   dbus_free (entry);
 }
 
@@ -219,6 +240,8 @@ bus_pending_activation_unref (BusPendingActivation *pending_activation)
 
   _dbus_assert (pending_activation->activation->n_pending_activations >= 0);
 
+  _dbus_memory_account (DBUS_MEMORY_ACTIVATION,
+                        -(long) sizeof (BusPendingActivation));
   dbus_free (pending_activation);
 }
 
@@ -249,9 +272,37 @@ bus_activation_entry_unref (BusActivationEntry *entry)
   dbus_free (entry->filename);
   dbus_free (entry->systemd_service);
 
+  _dbus_memory_account (DBUS_MEMORY_ACTIVATION, -entry->accounted);
   dbus_free (entry);
 }
 
+static long
+string_size (const char *str)
+{
+  return str != NULL ? (long) strlen (str) + 1 : 0;
+}
+
+/* Brings the entry's share of DBUS_MEMORY_ACTIVATION up to date after
+ * it was filled in or its strings were replaced.
+ */
+static void
+bus_activation_entry_account (BusActivationEntry *entry)
+{
+  long size;
+
+  if (!_dbus_memory_accounting_enabled)
+    return;
+
+  size = sizeof (BusActivationEntry) +
+    string_size (entry->name) + string_size (entry->exec) +
+    string_size (entry->user) + string_size (entry->systemd_service) +
+    string_size (entry->filename);
+
+  _dbus_memory_account_bytes (DBUS_MEMORY_ACTIVATION,
+                              size - entry->accounted);
+  entry->accounted = size;
+}
+
 static dbus_bool_t
 update_desktop_file_entry (BusActivation       *activation,
                            BusServiceDirectory *s_dir,
@@ -445,6 +496,8 @@ update_desktop_file_entry (BusActivation       *activation,
     }
 
   entry->mtime = stat_buf.mtime;
+  bus_activation_entry_account (entry);
+  activation->cache_stale = TRUE;
 
   _dbus_string_free (&file_path);
   bus_activation_entry_unref (entry);
@@ -502,6 +555,7 @@ check_service_file (BusActivation       *activation,
 
       _dbus_hash_table_remove_string (activation->entries, entry->name);
       _dbus_hash_table_remove_string (entry->s_dir->entries, entry->filename);
+      activation->cache_stale = TRUE;
 
       tmp_entry = NULL;
       retval = TRUE;
@@ -509,7 +563,10 @@ check_service_file (BusActivation       *activation,
     }
   else
     {
-      if (stat_buf.mtime > entry->mtime)
+      /* not just newer: an entry from the service cache may be older
+       * than a file that was replaced by an older copy
+       */
+      if (stat_buf.mtime != entry->mtime)
         {
           BusDesktopFile *desktop_file;
           DBusError tmp_error;
@@ -564,6 +621,84 @@ out:
 }
 
 
+/* Adds a service file that isn't in s_dir->entries yet. Only fails on OOM,
+ * a file that can't be loaded or names a service we already have is just
+ * skipped.
+ */
+static dbus_bool_t
+load_service_file (BusActivation       *activation,
+                   BusServiceDirectory *s_dir,
+                   DBusString          *filename,
+                   DBusError           *error)
+{
+  BusDesktopFile *desktop_file;
+  DBusString full_path;
+  DBusError tmp_error;
+  dbus_bool_t retval;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!_dbus_string_init (&full_path))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_append (&full_path, s_dir->dir_c) ||
+      !_dbus_concat_dir_and_file (&full_path, filename))
+    {
+      BUS_SET_OOM (error);
+      _dbus_string_free (&full_path);
+      return FALSE;
+    }
+
+  retval = TRUE;
+  dbus_error_init (&tmp_error);
+
+  desktop_file = bus_desktop_file_load (&full_path, &tmp_error);
+  if (desktop_file == NULL)
+    {
+      _dbus_verbose ("Could not load %s: %s\n",
+                     _dbus_string_get_const_data (&full_path),
+                     tmp_error.message);
+
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          retval = FALSE;
+        }
+      else
+        dbus_error_free (&tmp_error);
+
+      goto out;
+    }
+
+  /* @todo We can return OOM or a DBUS_ERROR_FAILED error
+   *       Handle these both better
+   */
+  if (!update_desktop_file_entry (activation, s_dir, filename, desktop_file,
+                                  &tmp_error))
+    {
+      _dbus_verbose ("Could not add %s to activation entry list: %s\n",
+                     _dbus_string_get_const_data (&full_path), tmp_error.message);
+
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          retval = FALSE;
+        }
+      else
+        dbus_error_free (&tmp_error);
+    }
+
+  bus_desktop_file_free (desktop_file);
+
+ out:
+  _dbus_string_free (&full_path);
+
+  return retval;
+}
+
 /* warning: this doesn't fully "undo" itself on failure, i.e. doesn't strip
  * hash entries it already added.
  */
@@ -574,29 +709,27 @@ update_directory (BusActivation       *activation,
 {
   DBusDirIter *iter;
   DBusString dir, filename;
-  BusDesktopFile *desktop_file;
   DBusError tmp_error;
   dbus_bool_t retval;
   BusActivationEntry *entry;
-  DBusString full_path;
+  DBusHashIter hash_iter;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
   iter = NULL;
-  desktop_file = NULL;
 
   _dbus_string_init_const (&dir, s_dir->dir_c);
 
-  if (!_dbus_string_init (&filename))
+  _dbus_hash_iter_init (s_dir->entries, &hash_iter);
+  while (_dbus_hash_iter_next (&hash_iter))
     {
-      BUS_SET_OOM (error);
-      return FALSE;
+      entry = _dbus_hash_iter_get_value (&hash_iter);
+      entry->listed = FALSE;
     }
 
-  if (!_dbus_string_init (&full_path))
+  if (!_dbus_string_init (&filename))
     {
       BUS_SET_OOM (error);
-      _dbus_string_free (&filename);
       return FALSE;
     }
 
@@ -619,8 +752,6 @@ update_directory (BusActivation       *activation,
     {
       _dbus_assert (!dbus_error_is_set (&tmp_error));
 
-      _dbus_string_set_length (&full_path, 0);
-
       if (!_dbus_string_ends_with_c_str (&filename, ".service"))
         {
           _dbus_verbose ("Skipping non-.service file %s\n",
@@ -631,63 +762,21 @@ update_directory (BusActivation       *activation,
       entry = _dbus_hash_table_lookup_string (s_dir->entries, _dbus_string_get_const_data (&filename));
       if (entry) /* Already has this service file in the cache */
         {
-          if (!check_service_file (activation, entry, NULL, error))
+          if (!check_service_file (activation, entry, &entry, error))
             goto out;
-
-          continue;
-        }
-
-      if (!_dbus_string_append (&full_path, s_dir->dir_c) ||
-          !_dbus_concat_dir_and_file (&full_path, &filename))
-        {
-          BUS_SET_OOM (error);
-          goto out;
         }
-
-      /* New file */
-      desktop_file = bus_desktop_file_load (&full_path, &tmp_error);
-      if (desktop_file == NULL)
+      else
         {
-          _dbus_verbose ("Could not load %s: %s\n",
-                         _dbus_string_get_const_data (&full_path),
-                         tmp_error.message);
-
-          if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
-            {
-              dbus_move_error (&tmp_error, error);
-              goto out;
-            }
+          /* New file */
+          if (!load_service_file (activation, s_dir, &filename, error))
+            goto out;
 
-          dbus_error_free (&tmp_error);
-          continue;
+          entry = _dbus_hash_table_lookup_string (s_dir->entries,
+                                                  _dbus_string_get_const_data (&filename));
         }
 
-      /* @todo We can return OOM or a DBUS_ERROR_FAILED error
-       *       Handle these both better
-       */
-      if (!update_desktop_file_entry (activation, s_dir, &filename, desktop_file, &tmp_error))
-        {
-          bus_desktop_file_free (desktop_file);
-          desktop_file = NULL;
-
-          _dbus_verbose ("Could not add %s to activation entry list: %s\n",
-                         _dbus_string_get_const_data (&full_path), tmp_error.message);
-
-          if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
-            {
-              dbus_move_error (&tmp_error, error);
-              goto out;
-            }
-
-          dbus_error_free (&tmp_error);
-          continue;
-        }
-      else
-        {
-          bus_desktop_file_free (desktop_file);
-          desktop_file = NULL;
-          continue;
-        }
+      if (entry != NULL)
+        entry->listed = TRUE;
     }
 
   if (dbus_error_is_set (&tmp_error))
@@ -696,6 +785,23 @@ update_directory (BusActivation       *activation,
       goto out;
     }
 
+  /* Drop entries whose file is gone, such as ones from the service cache */
+  _dbus_hash_iter_init (s_dir->entries, &hash_iter);
+  while (_dbus_hash_iter_next (&hash_iter))
+    {
+      entry = _dbus_hash_iter_get_value (&hash_iter);
+      if (entry->listed)
+        continue;
+
+      _dbus_verbose ("Service file %s is gone, removing from cache\n",
+                     entry->filename);
+
+      if (_dbus_hash_table_lookup_string (activation->entries, entry->name) == entry)
+        _dbus_hash_table_remove_string (activation->entries, entry->name);
+      _dbus_hash_iter_remove_entry (&hash_iter);
+      activation->cache_stale = TRUE;
+    }
+
   retval = TRUE;
 
  out:
@@ -707,173 +813,831 @@ update_directory (BusActivation       *activation,
   if (iter != NULL)
     _dbus_directory_close (iter);
   _dbus_string_free (&filename);
-  _dbus_string_free (&full_path);
 
   return retval;
 }
 
-static dbus_bool_t
-populate_environment (BusActivation *activation)
+/* The service cache is a marshalled message whose body is a version and,
+ * for each service directory, its path and the entries of its .service
+ * files with their mtimes. Restored entries go through update_directory()
+ * like any others, so only files whose mtime changed are parsed again.
+ */
+#define SERVICE_CACHE_VERSION 1
+#define SERVICE_CACHE_SIGNATURE "ua(sa(sussss))"
+
+/* Reads a message saved by save_message(), or returns #NULL if the
+ * file is missing, corrupt or from another version
+ */
+static DBusMessage *
+load_message (const char    *filename_c,
+              const char    *what,
+              const char    *signature,
+              dbus_uint32_t  expected_version)
 {
-  DBusString   key;
-  DBusString   value;
-  int          i;
-  char       **environment;
-  dbus_bool_t  retval = FALSE;
+  DBusString filename, contents;
+  DBusMessage *message;
+  DBusMessageIter iter;
+  DBusError error;
+  dbus_uint32_t version;
 
-  environment = _dbus_get_environment ();
+  message = NULL;
+  dbus_error_init (&error);
+  _dbus_string_init_const (&filename, filename_c);
 
-  if (environment == NULL)
-    return FALSE;
+  if (!_dbus_string_init (&contents))
+    return NULL;
 
-  if (!_dbus_string_init (&key))
+  if (!_dbus_file_get_contents (&contents, &filename, &error))
     {
-        dbus_free_string_array (environment);
-        return FALSE;
+      _dbus_verbose ("Not using %s %s: %s\n",
+                     what, filename_c, error.message);
+      dbus_error_free (&error);
+      goto out;
     }
 
-  if (!_dbus_string_init (&value))
+  message = dbus_message_demarshal (_dbus_string_get_const_data (&contents),
+                                    _dbus_string_get_length (&contents),
+                                    &error);
+  if (message == NULL)
     {
-      _dbus_string_free (&key);
-      dbus_free_string_array (environment);
-      return FALSE;
+      _dbus_verbose ("Not using %s %s: %s\n",
+                     what, filename_c, error.message);
+      dbus_error_free (&error);
+      goto out;
     }
 
-  for (i = 0; environment[i] != NULL; i++)
+  version = 0;
+  if (dbus_message_has_signature (message, signature) &&
+      dbus_message_iter_init (message, &iter))
+    dbus_message_iter_get_basic (&iter, &version);
+
+  if (version != expected_version)
     {
-      if (!_dbus_string_append (&key, environment[i]))
-        break;
+      _dbus_verbose ("Not using %s %s: wrong version\n",
+                     what, filename_c);
+      dbus_message_unref (message);
+      message = NULL;
+    }
 
-      if (_dbus_string_split_on_byte (&key, '=', &value))
-        {
-          char *hash_key, *hash_value;
+ out:
+  _dbus_string_free (&contents);
+  return message;
+}
 
-          if (!_dbus_string_steal_data (&key, &hash_key))
-            break;
+static DBusMessage *
+service_cache_load (BusActivation *activation)
+{
+  DBusMessage *cache;
 
-          if (!_dbus_string_steal_data (&value, &hash_value))
-            break;
+  cache = load_message (activation->cache_file, "service cache",
+                        SERVICE_CACHE_SIGNATURE, SERVICE_CACHE_VERSION);
 
-          if (!_dbus_hash_table_insert_string (activation->environment,
-                                               hash_key, hash_value))
-            break;
-        }
-      _dbus_string_set_length (&key, 0);
-      _dbus_string_set_length (&value, 0);
-    }
+  /* only rewritten if what we restore from it turns out to be out
+   * of date
+   */
+  if (cache != NULL)
+    activation->cache_stale = FALSE;
 
-  if (environment[i] != NULL)
-    goto out;
+  return cache;
+}
 
-  retval = TRUE;
-out:
+static dbus_bool_t
+service_cache_add_entry (BusActivation       *activation,
+                         BusServiceDirectory *s_dir,
+                         DBusMessageIter     *struct_iter)
+{
+  BusActivationEntry *entry;
+  const char *filename, *name, *exec, *user, *systemd_service;
+  dbus_uint32_t mtime;
+
+  dbus_message_iter_get_basic (struct_iter, &filename);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &mtime);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &name);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &exec);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &user);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &systemd_service);
+
+  /* an earlier directory provides it now; the file will be refused
+   * again by update_directory()
+   */
+  if (_dbus_hash_table_lookup_string (activation->entries, name) ||
+      _dbus_hash_table_lookup_string (s_dir->entries, filename))
+    return TRUE;
 
-  _dbus_string_free (&key);
-  _dbus_string_free (&value);
-  dbus_free_string_array (environment);
+  entry = dbus_new0 (BusActivationEntry, 1);
+  if (entry == NULL)
+    return FALSE;
 
-  return retval;
-}
+  entry->refcount = 1;
+  entry->s_dir = s_dir;
+  entry->mtime = mtime;
+  entry->filename = _dbus_strdup (filename);
+  entry->name = _dbus_strdup (name);
+  entry->exec = _dbus_strdup (exec);
+  if (*user != '\0')
+    entry->user = _dbus_strdup (user);
+  if (*systemd_service != '\0')
+    entry->systemd_service = _dbus_strdup (systemd_service);
 
-dbus_bool_t
-bus_activation_reload (BusActivation     *activation,
-                       const DBusString  *address,
-                       DBusList         **directories,
-                       DBusError         *error)
-{
-  DBusList      *link;
-  char          *dir;
+  if (entry->filename == NULL || entry->name == NULL || entry->exec == NULL ||
+      (*user != '\0' && entry->user == NULL) ||
+      (*systemd_service != '\0' && entry->systemd_service == NULL))
+    goto oom;
 
-  if (activation->server_address != NULL)
-    dbus_free (activation->server_address);
-  if (!_dbus_string_copy_data (address, &activation->server_address))
+  if (!_dbus_hash_table_insert_string (activation->entries, entry->name,
+                                       bus_activation_entry_ref (entry)))
     {
-      BUS_SET_OOM (error);
-      goto failed;
+      bus_activation_entry_unref (entry);
+      goto oom;
     }
 
-  if (activation->entries != NULL)
-    _dbus_hash_table_unref (activation->entries);
-  activation->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                             (DBusFreeFunction)bus_activation_entry_unref);
-  if (activation->entries == NULL)
+  if (!_dbus_hash_table_insert_string (s_dir->entries, entry->filename,
+                                       bus_activation_entry_ref (entry)))
     {
-      BUS_SET_OOM (error);
-      goto failed;
+      _dbus_hash_table_remove_string (activation->entries, entry->name);
+      bus_activation_entry_unref (entry);
+      goto oom;
     }
 
-  if (activation->directories != NULL)
-    _dbus_hash_table_unref (activation->directories);
-  activation->directories = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                                  (DBusFreeFunction)bus_service_directory_unref);
+  bus_activation_entry_account (entry);
+  bus_activation_entry_unref (entry);
+  return TRUE;
 
-  if (activation->directories == NULL)
-    {
-      BUS_SET_OOM (error);
-      goto failed;
-    }
+ oom:
+  bus_activation_entry_unref (entry);
+  return FALSE;
+}
 
-  link = _dbus_list_get_first_link (directories);
-  while (link != NULL)
+/* Fills in the entries cached for s_dir. Only fails on OOM. */
+static dbus_bool_t
+service_cache_restore (BusActivation       *activation,
+                       DBusMessage         *cache,
+                       BusServiceDirectory *s_dir)
+{
+  DBusMessageIter iter, dirs_iter;
+
+  dbus_message_iter_init (cache, &iter);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &dirs_iter);
+
+  while (dbus_message_iter_get_arg_type (&dirs_iter) == DBUS_TYPE_STRUCT)
     {
-      BusServiceDirectory *s_dir;
+      DBusMessageIter dir_iter, entries_iter;
+      const char *dir;
 
-      dir = _dbus_strdup ((const char *) link->data);
-      if (!dir)
-        {
-          BUS_SET_OOM (error);
-          goto failed;
-        }
+      dbus_message_iter_recurse (&dirs_iter, &dir_iter);
+      dbus_message_iter_get_basic (&dir_iter, &dir);
 
-      s_dir = dbus_new0 (BusServiceDirectory, 1);
-      if (!s_dir)
+      if (strcmp (dir, s_dir->dir_c) == 0)
         {
-          dbus_free (dir);
-          BUS_SET_OOM (error);
-          goto failed;
-        }
+          dbus_message_iter_next (&dir_iter);
+          dbus_message_iter_recurse (&dir_iter, &entries_iter);
 
-      s_dir->refcount = 1;
-      s_dir->dir_c = dir;
+          while (dbus_message_iter_get_arg_type (&entries_iter) == DBUS_TYPE_STRUCT)
+            {
+              DBusMessageIter struct_iter;
 
-      s_dir->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                             (DBusFreeFunction)bus_activation_entry_unref);
+              dbus_message_iter_recurse (&entries_iter, &struct_iter);
+              if (!service_cache_add_entry (activation, s_dir, &struct_iter))
+                return FALSE;
 
-      if (!s_dir->entries)
-        {
-          bus_service_directory_unref (s_dir);
-          BUS_SET_OOM (error);
-          goto failed;
-        }
+              dbus_message_iter_next (&entries_iter);
+            }
 
-      if (!_dbus_hash_table_insert_string (activation->directories, s_dir->dir_c, s_dir))
-        {
-          bus_service_directory_unref (s_dir);
-          BUS_SET_OOM (error);
-          goto failed;
+          _dbus_verbose ("Restored %d cached entries of %s\n",
+                         _dbus_hash_table_get_n_entries (s_dir->entries),
+                         s_dir->dir_c);
+          return TRUE;
         }
 
-      /* only fail on OOM, it is ok if we can't read the directory */
-      if (!update_directory (activation, s_dir, error))
-        {
-          if (dbus_error_has_name (error, DBUS_ERROR_NO_MEMORY))
-            goto failed;
-          else
-            dbus_error_free (error);
+      dbus_message_iter_next (&dirs_iter);
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+service_cache_append_directory (DBusMessageIter     *dirs_iter,
+                                BusServiceDirectory *s_dir)
+{
+  DBusMessageIter dir_iter, entries_iter;
+  DBusHashIter iter;
+
+  if (!dbus_message_iter_open_container (dirs_iter, DBUS_TYPE_STRUCT, NULL,
+                                         &dir_iter) ||
+      !dbus_message_iter_append_basic (&dir_iter, DBUS_TYPE_STRING,
+                                       &s_dir->dir_c) ||
+      !dbus_message_iter_open_container (&dir_iter, DBUS_TYPE_ARRAY,
+                                         "(sussss)", &entries_iter))
+    return FALSE;
+
+  _dbus_hash_iter_init (s_dir->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusActivationEntry *entry;
+      DBusMessageIter struct_iter;
+      dbus_uint32_t mtime;
+      const char *user, *systemd_service;
+
+      entry = _dbus_hash_iter_get_value (&iter);
+      mtime = entry->mtime;
+      user = entry->user != NULL ? entry->user : "";
+      systemd_service = entry->systemd_service != NULL ?
+        entry->systemd_service : "";
+
+      if (!dbus_message_iter_open_container (&entries_iter, DBUS_TYPE_STRUCT,
+                                             NULL, &struct_iter) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &entry->filename) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT32,
+                                           &mtime) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &entry->name) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &entry->exec) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &user) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &systemd_service) ||
+          !dbus_message_iter_close_container (&entries_iter, &struct_iter))
+        return FALSE;
+    }
+
+  return dbus_message_iter_close_container (&dir_iter, &entries_iter) &&
+    dbus_message_iter_close_container (dirs_iter, &dir_iter);
+}
+
+/* Writes the message to the file, for load_message() to read */
+static dbus_bool_t
+save_message (DBusMessage *message,
+              const char  *filename_c,
+              const char  *what)
+{
+  DBusString filename, contents;
+  DBusError error;
+  dbus_bool_t retval;
+  char *data;
+  int len;
+
+  /* the loader refuses serial 0 */
+  dbus_message_set_serial (message, 1);
+
+  if (!dbus_message_marshal (message, &data, &len))
+    return FALSE;
+
+  dbus_error_init (&error);
+  _dbus_string_init_const (&filename, filename_c);
+  _dbus_string_init_const_len (&contents, data, len);
+
+  retval = _dbus_string_save_to_file (&contents, &filename, FALSE, &error);
+  if (retval)
+    {
+      _dbus_verbose ("Saved %s %s\n", what, filename_c);
+    }
+  else
+    {
+      _dbus_verbose ("Could not save %s %s: %s\n",
+                     what, filename_c, error.message);
+      dbus_error_free (&error);
+    }
+
+  dbus_free (data);
+  return retval;
+}
+
+/* Failing to write the cache only costs parsing the files next time */
+static void
+service_cache_save (BusActivation *activation)
+{
+  DBusMessage *cache;
+  DBusMessageIter iter, dirs_iter;
+  DBusHashIter hash_iter;
+  dbus_uint32_t version;
+
+  cache = dbus_message_new_signal (DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                                   "ServiceCache");
+  if (cache == NULL)
+    return;
+
+  version = SERVICE_CACHE_VERSION;
+  dbus_message_iter_init_append (cache, &iter);
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &version) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         "(sa(sussss))", &dirs_iter))
+    goto out;
+
+  _dbus_hash_iter_init (activation->directories, &hash_iter);
+  while (_dbus_hash_iter_next (&hash_iter))
+    {
+      if (!service_cache_append_directory (&dirs_iter,
+                                           _dbus_hash_iter_get_value (&hash_iter)))
+        goto out;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &dirs_iter))
+    goto out;
+
+  if (save_message (cache, activation->cache_file, "service cache"))
+    activation->cache_stale = FALSE;
+
+ out:
+  dbus_message_unref (cache);
+}
+
+/* The boot profile is a marshalled message whose body is a version and
+ * the services asked for in the first seconds after startup, in the
+ * order they were first asked for, each with how many milliseconds
+ * after startup that was. At the next startup they are all started
+ * straight away, instead of one at a time as clients ask for them.
+ */
+#define BOOT_PROFILE_VERSION 1
+#define BOOT_PROFILE_SIGNATURE "ua(su)"
+
+static void
+boot_profile_entry_free (BootProfileEntry *entry)
+{
+  dbus_free (entry->name);
+  dbus_free (entry);
+}
+
+/* Adds the service to the profile if one is being recorded. A service
+ * left out only gets started on demand next time, so running out of
+ * memory just leaves it out.
+ */
+static void
+boot_profile_record (BusActivation *activation,
+                     const char    *service_name)
+{
+  BootProfileEntry *entry;
+  DBusList *link;
+  long sec, usec;
+  long offset;
+
+  if (activation->boot_profile_file == NULL)
+    return;
+
+  link = _dbus_list_get_first_link (&activation->boot_profile);
+  while (link != NULL)
+    {
+      entry = link->data;
+      if (strcmp (entry->name, service_name) == 0)
+        return;
+
+      link = _dbus_list_get_next_link (&activation->boot_profile, link);
+    }
+
+  entry = dbus_new0 (BootProfileEntry, 1);
+  if (entry == NULL)
+    return;
+
+  entry->name = _dbus_strdup (service_name);
+  if (entry->name == NULL ||
+      !_dbus_list_append (&activation->boot_profile, entry))
+    {
+      boot_profile_entry_free (entry);
+      return;
+    }
+
+  _dbus_get_current_time (&sec, &usec);
+  offset = (sec - activation->boot_profile_sec) * 1000 +
+    (usec - activation->boot_profile_usec) / 1000;
+  entry->offset = offset > 0 ? offset : 0;
+}
+
+static void
+boot_profile_save (BusActivation *activation)
+{
+  DBusMessage *profile;
+  DBusMessageIter iter, array_iter, struct_iter;
+  DBusList *link;
+  dbus_uint32_t version;
+
+  profile = dbus_message_new_signal (DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                                     "BootProfile");
+  if (profile == NULL)
+    return;
+
+  version = BOOT_PROFILE_VERSION;
+  dbus_message_iter_init_append (profile, &iter);
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &version) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(su)",
+                                         &array_iter))
+    goto out;
+
+  link = _dbus_list_get_first_link (&activation->boot_profile);
+  while (link != NULL)
+    {
+      BootProfileEntry *entry = link->data;
+
+      if (!dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT,
+                                             NULL, &struct_iter) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &entry->name) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT32,
+                                           &entry->offset) ||
+          !dbus_message_iter_close_container (&array_iter, &struct_iter))
+        goto out;
+
+      link = _dbus_list_get_next_link (&activation->boot_profile, link);
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array_iter))
+    goto out;
+
+  save_message (profile, activation->boot_profile_file, "boot profile");
+
+ out:
+  dbus_message_unref (profile);
+}
+
+static void
+boot_profile_timeout_callback (DBusTimeout *timeout,
+                               void        *data)
+{
+  while (!dbus_timeout_handle (timeout))
+    _dbus_wait_for_memory ();
+}
+
+/* Stops recording without saving anything */
+static void
+boot_profile_stop (BusActivation *activation)
+{
+  if (activation->boot_profile_timeout != NULL)
+    {
+      _dbus_loop_remove_timeout (bus_context_get_loop (activation->context),
+                                 activation->boot_profile_timeout,
+                                 boot_profile_timeout_callback, activation);
+      _dbus_timeout_unref (activation->boot_profile_timeout);
+      activation->boot_profile_timeout = NULL;
+    }
+
+  _dbus_list_foreach (&activation->boot_profile,
+                      (DBusForeachFunction) boot_profile_entry_free, NULL);
+  _dbus_list_clear (&activation->boot_profile);
+
+  dbus_free (activation->boot_profile_file);
+  activation->boot_profile_file = NULL;
+}
+
+static dbus_bool_t
+boot_profile_timed_out (void *data)
+{
+  BusActivation *activation = data;
+
+  /* the last profile stays in place if this one can't be written */
+  boot_profile_save (activation);
+  boot_profile_stop (activation);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+populate_environment (BusActivation *activation)
+{
+  DBusString   key;
+  DBusString   value;
+  int          i;
+  char       **environment;
+  dbus_bool_t  retval = FALSE;
+
+  environment = _dbus_get_environment ();
+
+  if (environment == NULL)
+    return FALSE;
+
+  if (!_dbus_string_init (&key))
+    {
+        dbus_free_string_array (environment);
+        return FALSE;
+    }
+
+  if (!_dbus_string_init (&value))
+    {
+      _dbus_string_free (&key);
+      dbus_free_string_array (environment);
+      return FALSE;
+    }
+
+  for (i = 0; environment[i] != NULL; i++)
+    {
+      if (!_dbus_string_append (&key, environment[i]))
+        break;
+
+      if (_dbus_string_split_on_byte (&key, '=', &value))
+        {
+          char *hash_key, *hash_value;
+
+          if (!_dbus_string_steal_data (&key, &hash_key))
+            break;
+
+          if (!_dbus_string_steal_data (&value, &hash_value))
+            break;
+
+          if (!_dbus_hash_table_insert_string (activation->environment,
+                                               hash_key, hash_value))
+            break;
+        }
+      _dbus_string_set_length (&key, 0);
+      _dbus_string_set_length (&value, 0);
+    }
+
+  if (environment[i] != NULL)
+    goto out;
+
+  retval = TRUE;
+out:
+
+  _dbus_string_free (&key);
+  _dbus_string_free (&value);
+  dbus_free_string_array (environment);
+
+  return retval;
+}
+
+/* Moves the entries of a directory we already had into the new
+ * activation->entries, so a reload doesn't parse its files again. An
+ * entry whose name an earlier directory now provides is dropped again,
+ * as update_directory() would have refused it.
+ */
+static dbus_bool_t
+adopt_directory_entries (BusActivation       *activation,
+                         BusServiceDirectory *s_dir)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (s_dir->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusActivationEntry *entry;
+
+      entry = _dbus_hash_iter_get_value (&iter);
+
+      if (_dbus_hash_table_lookup_string (activation->entries, entry->name))
+        {
+          _dbus_verbose ("Service %s of %s is now provided by an earlier directory\n",
+                         entry->name, entry->filename);
+          _dbus_hash_iter_remove_entry (&iter);
+          continue;
+        }
+
+      if (!_dbus_hash_table_insert_string (activation->entries, entry->name,
+                                           bus_activation_entry_ref (entry)))
+        {
+          bus_activation_entry_unref (entry);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_activation_reload (BusActivation     *activation,
+                       const DBusString  *address,
+                       DBusList         **directories,
+                       const char        *cache_file,
+                       DBusError         *error)
+{
+  DBusList      *link;
+  char          *dir;
+  DBusHashTable *old_directories;
+  DBusMessage   *cache;
+  dbus_bool_t    cache_loaded;
+
+  cache = NULL;
+  cache_loaded = FALSE;
+  old_directories = NULL;
+
+  if (cache_file == NULL ? activation->cache_file != NULL :
+      (activation->cache_file == NULL ||
+       strcmp (activation->cache_file, cache_file) != 0))
+    {
+      dbus_free (activation->cache_file);
+      activation->cache_file = NULL;
+      activation->cache_stale = TRUE;
+
+      if (cache_file != NULL)
+        {
+          activation->cache_file = _dbus_strdup (cache_file);
+          if (activation->cache_file == NULL)
+            {
+              BUS_SET_OOM (error);
+              goto failed;
+            }
+        }
+    }
+
+  if (activation->server_address != NULL)
+    dbus_free (activation->server_address);
+  if (!_dbus_string_copy_data (address, &activation->server_address))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (activation->entries != NULL)
+    _dbus_hash_table_unref (activation->entries);
+  activation->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                             (DBusFreeFunction)bus_activation_entry_unref);
+  if (activation->entries == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  /* Directories in both the old and new set keep their entries, and are
+   * only rescanned if nothing told us about changes to their files.
+   */
+  old_directories = activation->directories;
+  activation->directories = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                                  (DBusFreeFunction)bus_service_directory_unref);
+
+  if (activation->directories == NULL)
+    {
+      activation->directories = old_directories;
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  link = _dbus_list_get_first_link (directories);
+  while (link != NULL)
+    {
+      BusServiceDirectory *s_dir;
+
+      s_dir = NULL;
+      if (old_directories != NULL)
+        s_dir = _dbus_hash_table_lookup_string (old_directories, link->data);
+
+      if (s_dir != NULL)
+        {
+          if (!_dbus_hash_table_insert_string (activation->directories,
+                                               s_dir->dir_c,
+                                               bus_service_directory_ref (s_dir)))
+            {
+              bus_service_directory_unref (s_dir);
+              BUS_SET_OOM (error);
+              goto failed;
+            }
+
+          if (!adopt_directory_entries (activation, s_dir))
+            {
+              BUS_SET_OOM (error);
+              goto failed;
+            }
+
+          if (bus_dir_watch_reports_files (s_dir->dir_c))
+            {
+              _dbus_verbose ("Kept the %d entries of watched directory %s\n",
+                             _dbus_hash_table_get_n_entries (s_dir->entries),
+                             s_dir->dir_c);
+              link = _dbus_list_get_next_link (directories, link);
+              continue;
+            }
+        }
+      else
+        {
+          dir = _dbus_strdup ((const char *) link->data);
+          if (!dir)
+            {
+              BUS_SET_OOM (error);
+              goto failed;
+            }
+
+          s_dir = dbus_new0 (BusServiceDirectory, 1);
+          if (!s_dir)
+            {
+              dbus_free (dir);
+              BUS_SET_OOM (error);
+              goto failed;
+            }
+
+          s_dir->refcount = 1;
+          s_dir->dir_c = dir;
+
+          s_dir->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                                 (DBusFreeFunction)bus_activation_entry_unref);
+
+          if (!s_dir->entries)
+            {
+              bus_service_directory_unref (s_dir);
+              BUS_SET_OOM (error);
+              goto failed;
+            }
+
+          if (!_dbus_hash_table_insert_string (activation->directories, s_dir->dir_c, s_dir))
+            {
+              bus_service_directory_unref (s_dir);
+              BUS_SET_OOM (error);
+              goto failed;
+            }
+
+          if (activation->cache_file != NULL && !cache_loaded)
+            {
+              cache = service_cache_load (activation);
+              cache_loaded = TRUE;
+            }
+
+          if (cache != NULL && !service_cache_restore (activation, cache, s_dir))
+            {
+              BUS_SET_OOM (error);
+              goto failed;
+            }
+
+          /* every file is going to be parsed, not just stat()ed */
+          if (_dbus_hash_table_get_n_entries (s_dir->entries) == 0)
+            bus_readahead_directory (s_dir->dir_c, ".service");
+        }
+
+      /* only fail on OOM, it is ok if we can't read the directory */
+      if (!update_directory (activation, s_dir, error))
+        {
+          if (dbus_error_has_name (error, DBUS_ERROR_NO_MEMORY))
+            goto failed;
+          else
+            dbus_error_free (error);
         }
 
       link = _dbus_list_get_next_link (directories, link);
     }
 
+  if (old_directories != NULL)
+    _dbus_hash_table_unref (old_directories);
+
+  if (cache != NULL)
+    dbus_message_unref (cache);
+
+  if (activation->cache_file != NULL && activation->cache_stale)
+    service_cache_save (activation);
+
   return TRUE;
  failed:
+  if (old_directories != NULL && old_directories != activation->directories)
+    _dbus_hash_table_unref (old_directories);
+  if (cache != NULL)
+    dbus_message_unref (cache);
   return FALSE;
 }
 
+/* Called by the directory watch for a file in dir that was written,
+ * moved or deleted. Returns FALSE if dir isn't a service directory, or
+ * on OOM, in which case the caller should reload the configuration.
+ */
+dbus_bool_t
+bus_activation_service_file_changed (BusActivation *activation,
+                                     const char    *dir,
+                                     const char    *filename)
+{
+  BusServiceDirectory *s_dir;
+  BusActivationEntry *entry;
+  DBusString filename_str;
+  DBusError error;
+
+  s_dir = _dbus_hash_table_lookup_string (activation->directories, dir);
+  if (s_dir == NULL)
+    return FALSE;
+
+  _dbus_string_init_const (&filename_str, filename);
+
+  if (!_dbus_string_ends_with_c_str (&filename_str, ".service"))
+    return TRUE;
+
+  _dbus_verbose ("Service file %s/%s changed\n", dir, filename);
+
+  /* Whatever happened to it, drop what we had and read it again if it's
+   * still there.
+   */
+  entry = _dbus_hash_table_lookup_string (s_dir->entries, filename);
+  if (entry != NULL)
+    {
+      /* it may have lost its name to another file when it last changed */
+      if (_dbus_hash_table_lookup_string (activation->entries, entry->name) == entry)
+        _dbus_hash_table_remove_string (activation->entries, entry->name);
+      _dbus_hash_table_remove_string (s_dir->entries, filename);
+      activation->cache_stale = TRUE;
+    }
+
+  dbus_error_init (&error);
+  if (!load_service_file (activation, s_dir, &filename_str, &error))
+    {
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 BusActivation*
 bus_activation_new (BusContext        *context,
                     const DBusString  *address,
                     DBusList         **directories,
+                    const char        *cache_file,
                     DBusError         *error)
 {
   BusActivation *activation;
@@ -893,7 +1657,8 @@ bus_activation_new (BusContext        *context,
   activation->context = context;
   activation->n_pending_activations = 0;
 
-  if (!bus_activation_reload (activation, address, directories, error))
+  if (!bus_activation_reload (activation, address, directories, cache_file,
+                              error))
     goto failed;
 
    /* Initialize this hash table once, we don't want to lose pending
@@ -950,7 +1715,10 @@ bus_activation_unref (BusActivation *activation)
   if (activation->refcount > 0)
     return;
 
+  boot_profile_stop (activation);
+
   dbus_free (activation->server_address);
+  dbus_free (activation->cache_file);
   if (activation->entries)
     _dbus_hash_table_unref (activation->entries);
   if (activation->pending_activations)
@@ -1091,6 +1859,12 @@ bus_activation_service_created (BusActivation  *activation,
   if (!pending_activation)
     return TRUE;
 
+  /* Keep services started from the boot profile in the next one while
+   * they still start, even though nobody had to ask for them
+   */
+  if (pending_activation->prestarted)
+    boot_profile_record (activation, service_name);
+
   link = _dbus_list_get_first_link (&pending_activation->entries);
   while (link != NULL)
     {
@@ -1160,6 +1934,8 @@ bus_activation_send_pending_auto_activation_messages (BusActivation  *activation
   if (!pending_activation)
     return TRUE;
 
+  _dbus_flight_record (DBUS_FLIGHT_ACTIVATED, 0, 0, TRUE);
+
   link = _dbus_list_get_first_link (&pending_activation->entries);
   while (link != NULL)
     {
@@ -1254,6 +2030,8 @@ static void
 pending_activation_failed (BusPendingActivation *pending_activation,
                            const DBusError      *how)
 {
+  _dbus_flight_record (DBUS_FLIGHT_ACTIVATED, 0, 0, FALSE);
+
   /* FIXME use preallocated OOM messages instead of bus_wait_for_memory() */
   while (!try_send_activation_failure (pending_activation, how))
     _dbus_wait_for_memory ();
@@ -1429,6 +2207,15 @@ remove_babysitter_watch (DBusWatch      *watch,
                            watch, babysitter_watch_callback, pending_activation);
 }
 
+static void
+toggle_babysitter_watch (DBusWatch      *watch,
+                         void           *data)
+{
+  BusPendingActivation *pending_activation = data;
+
+  _dbus_loop_toggle_watch (bus_context_get_loop (pending_activation->activation->context), watch);
+}
+
 static dbus_bool_t
 pending_activation_timed_out (void *data)
 {
@@ -1507,6 +2294,10 @@ update_service_cache (BusActivation *activation, DBusError *error)
 
       s_dir = _dbus_hash_iter_get_value (&iter);
 
+      /* its entries are kept up to date as the files change */
+      if (bus_dir_watch_reports_files (s_dir->dir_c))
+        continue;
+
       dbus_error_init (&tmp_error);
       if (!update_directory (activation, s_dir, &tmp_error))
         {
@@ -1531,6 +2322,11 @@ activation_find_entry (BusActivation *activation,
 {
   BusActivationEntry *entry;
 
+  /* catch up with service files that changed since the main loop last
+   * looked at the directory watch
+   */
+  bus_dir_watch_flush ();
+
   entry = _dbus_hash_table_lookup_string (activation->entries, service_name);
   if (!entry)
     {
@@ -1540,7 +2336,7 @@ activation_find_entry (BusActivation *activation,
       entry = _dbus_hash_table_lookup_string (activation->entries,
                                               service_name);
     }
-  else
+  else if (!bus_dir_watch_reports_files (entry->s_dir->dir_c))
     {
       BusActivationEntry *updated_entry;
 
@@ -1608,46 +2404,261 @@ bus_activation_get_environment (BusActivation *activation)
       environment = NULL;
     }
 
-  return environment;
-}
-
-dbus_bool_t
-bus_activation_set_environment_variable (BusActivation     *activation,
-                                         const char        *key,
-                                         const char        *value,
-                                         DBusError         *error)
-{
-  char        *hash_key;
-  char        *hash_value;
-  dbus_bool_t  retval;
+  return environment;
+}
+
+dbus_bool_t
+bus_activation_set_environment_variable (BusActivation     *activation,
+                                         const char        *key,
+                                         const char        *value,
+                                         DBusError         *error)
+{
+  char        *hash_key;
+  char        *hash_value;
+  dbus_bool_t  retval;
+
+  retval = FALSE;
+  hash_key = NULL;
+  hash_value = NULL;
+  hash_key = _dbus_strdup (key);
+
+  if (hash_key == NULL)
+    goto out;
+
+  hash_value = _dbus_strdup (value);
+
+  if (hash_value == NULL)
+    goto out;
+
+  if (!_dbus_hash_table_insert_string (activation->environment,
+                                       hash_key, hash_value))
+    goto out;
+
+  retval = TRUE;
+out:
+  if (retval == FALSE)
+    {
+      dbus_free (hash_key);
+      dbus_free (hash_value);
+      BUS_SET_OOM (error);
+    }
+
+  return retval;
+}
+
+static BusPendingActivation *
+bus_pending_activation_new (BusActivation      *activation,
+                            BusActivationEntry *entry,
+                            const char         *service_name,
+                            DBusError          *error)
+{
+  BusPendingActivation *pending_activation;
+
+  pending_activation = dbus_new0 (BusPendingActivation, 1);
+  if (!pending_activation)
+    {
+      _dbus_verbose ("Failed to create pending activation\n");
+
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  _dbus_memory_account (DBUS_MEMORY_ACTIVATION,
+                        sizeof (BusPendingActivation));
+  pending_activation->activation = activation;
+  pending_activation->refcount = 1;
+
+  pending_activation->service_name = _dbus_strdup (service_name);
+  if (!pending_activation->service_name)
+    {
+      _dbus_verbose ("Failed to copy service name for pending activation\n");
+
+      BUS_SET_OOM (error);
+      bus_pending_activation_unref (pending_activation);
+      return NULL;
+    }
+
+  pending_activation->exec = _dbus_strdup (entry->exec);
+  if (!pending_activation->exec)
+    {
+      _dbus_verbose ("Failed to copy service exec for pending activation\n");
+      BUS_SET_OOM (error);
+      bus_pending_activation_unref (pending_activation);
+      return NULL;
+    }
+
+  if (entry->systemd_service)
+    {
+      pending_activation->systemd_service = _dbus_strdup (entry->systemd_service);
+      if (!pending_activation->systemd_service)
+        {
+          _dbus_verbose ("Failed to copy systemd service for pending activation\n");
+          BUS_SET_OOM (error);
+          bus_pending_activation_unref (pending_activation);
+          return NULL;
+        }
+    }
+
+  pending_activation->timeout =
+    _dbus_timeout_new (bus_context_get_activation_timeout (activation->context),
+                       pending_activation_timed_out,
+                       pending_activation,
+                       NULL);
+  if (!pending_activation->timeout)
+    {
+      _dbus_verbose ("Failed to create timeout for pending activation\n");
+
+      BUS_SET_OOM (error);
+      bus_pending_activation_unref (pending_activation);
+      return NULL;
+    }
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (activation->context),
+                               pending_activation->timeout,
+                               handle_timeout_callback,
+                               pending_activation,
+                               NULL))
+    {
+      _dbus_verbose ("Failed to add timeout for pending activation\n");
+
+      BUS_SET_OOM (error);
+      bus_pending_activation_unref (pending_activation);
+      return NULL;
+    }
+
+  pending_activation->timeout_added = TRUE;
+
+  return pending_activation;
+}
+
+/* Runs the service's executable, directly or through the helper, once
+ * pending_activation is in the table
+ */
+static dbus_bool_t
+spawn_pending_activation (BusActivation        *activation,
+                          BusPendingActivation *pending_activation,
+                          BusActivationEntry   *entry,
+                          const char           *service_name,
+                          DBusError            *error)
+{
+  const char *servicehelper;
+  char **argv;
+  char **envp = NULL;
+  int argc;
+  DBusString command;
+
+  /* use command as system and session different */
+  if (!_dbus_string_init (&command))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  /* does the bus use a helper? */
+  servicehelper = bus_context_get_servicehelper (activation->context);
+  if (servicehelper != NULL)
+    {
+      if (entry->user == NULL)
+        {
+          _dbus_string_free (&command);
+          dbus_set_error (error, DBUS_ERROR_SPAWN_FILE_INVALID,
+                          "Cannot do system-bus activation with no user\n");
+          return FALSE;
+        }
+
+      /* join the helper path and the service name */
+      if (!_dbus_string_append (&command, servicehelper))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+      if (!_dbus_string_append (&command, " "))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+      if (!_dbus_string_append (&command, service_name))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+    }
+  else
+    {
+      /* the bus does not use a helper, so we can append arguments with the exec line */
+      if (!_dbus_string_append (&command, entry->exec))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+    }
+
+  /* convert command into arguments */
+  if (!_dbus_shell_parse_argv (_dbus_string_get_const_data (&command), &argc, &argv, error))
+    {
+      _dbus_verbose ("Failed to parse command line: %s\n", entry->exec);
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+
+      _dbus_hash_table_remove_string (activation->pending_activations,
+                                      pending_activation->service_name);
+
+      _dbus_string_free (&command);
+      return FALSE;
+    }
+  _dbus_string_free (&command);
+
+  if (!add_bus_environment (activation, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      dbus_free_string_array (argv);
+      return FALSE;
+    }
+
+  envp = bus_activation_get_environment (activation);
 
-  retval = FALSE;
-  hash_key = NULL;
-  hash_value = NULL;
-  hash_key = _dbus_strdup (key);
+  if (envp == NULL)
+    {
+      BUS_SET_OOM (error);
+      dbus_free_string_array (argv);
+      return FALSE;
+    }
 
-  if (hash_key == NULL)
-    goto out;
+  _dbus_verbose ("Spawning %s ...\n", argv[0]);
+  if (!_dbus_spawn_async_with_babysitter (&pending_activation->babysitter, argv,
+                                          envp,
+                                          NULL, activation,
+                                          error))
+    {
+      _dbus_verbose ("Failed to spawn child\n");
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      dbus_free_string_array (argv);
+      dbus_free_string_array (envp);
 
-  hash_value = _dbus_strdup (value);
+      return FALSE;
+    }
 
-  if (hash_value == NULL)
-    goto out;
+  dbus_free_string_array (argv);
+  envp = NULL;
 
-  if (!_dbus_hash_table_insert_string (activation->environment,
-                                       hash_key, hash_value))
-    goto out;
+  _dbus_assert (pending_activation->babysitter != NULL);
 
-  retval = TRUE;
-out:
-  if (retval == FALSE)
+  if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
+                                             add_babysitter_watch,
+                                             remove_babysitter_watch,
+                                             toggle_babysitter_watch,
+                                             pending_activation,
+                                             NULL))
     {
-      dbus_free (hash_key);
-      dbus_free (hash_value);
       BUS_SET_OOM (error);
+      _dbus_verbose ("Failed to set babysitter watch functions\n");
+      return FALSE;
     }
 
-  return retval;
+  return TRUE;
 }
 
 dbus_bool_t
@@ -1664,19 +2675,18 @@ bus_activation_activate_service (BusActivation  *activation,
   BusPendingActivationEntry *pending_activation_entry;
   DBusMessage *message;
   DBusString service_str;
-  const char *servicehelper;
-  char **argv;
-  char **envp = NULL;
-  int argc;
   dbus_bool_t retval;
   DBusHashIter iter;
   dbus_bool_t activated;
-  DBusString command;
 
   activated = TRUE;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
+  _dbus_flight_record (DBUS_FLIGHT_ACTIVATING,
+                       _dbus_connection_get_flight_id (connection),
+                       dbus_message_get_serial (activation_message), 0);
+
   if (activation->n_pending_activations >=
       bus_context_get_max_pending_activations (activation->context))
     {
@@ -1690,6 +2700,8 @@ bus_activation_activate_service (BusActivation  *activation,
   if (!entry)
     return FALSE;
 
+  boot_profile_record (activation, service_name);
+
   /* Bypass the registry lookup if we're auto-activating, bus_dispatch would not
    * call us if the service is already active.
    */
@@ -1744,6 +2756,8 @@ bus_activation_activate_service (BusActivation  *activation,
       return FALSE;
     }
 
+  _dbus_memory_account (DBUS_MEMORY_ACTIVATION,
+                        sizeof (BusPendingActivationEntry));
   pending_activation_entry->auto_activation = auto_activation;
 
   pending_activation_entry->activation_message = activation_message;
@@ -1769,84 +2783,14 @@ bus_activation_activate_service (BusActivation  *activation,
     }
   else
     {
-      pending_activation = dbus_new0 (BusPendingActivation, 1);
+      pending_activation = bus_pending_activation_new (activation, entry,
+                                                       service_name, error);
       if (!pending_activation)
         {
-          _dbus_verbose ("Failed to create pending activation\n");
-
-          BUS_SET_OOM (error);
-          bus_pending_activation_entry_free (pending_activation_entry);
-          return FALSE;
-        }
-
-      pending_activation->activation = activation;
-      pending_activation->refcount = 1;
-
-      pending_activation->service_name = _dbus_strdup (service_name);
-      if (!pending_activation->service_name)
-        {
-          _dbus_verbose ("Failed to copy service name for pending activation\n");
-
-          BUS_SET_OOM (error);
-          bus_pending_activation_unref (pending_activation);
-          bus_pending_activation_entry_free (pending_activation_entry);
-          return FALSE;
-        }
-
-      pending_activation->exec = _dbus_strdup (entry->exec);
-      if (!pending_activation->exec)
-        {
-          _dbus_verbose ("Failed to copy service exec for pending activation\n");
-          BUS_SET_OOM (error);
-          bus_pending_activation_unref (pending_activation);
-          bus_pending_activation_entry_free (pending_activation_entry);
-          return FALSE;
-        }
-
-      if (entry->systemd_service)
-        {
-          pending_activation->systemd_service = _dbus_strdup (entry->systemd_service);
-          if (!pending_activation->systemd_service)
-            {
-              _dbus_verbose ("Failed to copy systemd service for pending activation\n");
-              BUS_SET_OOM (error);
-              bus_pending_activation_unref (pending_activation);
-              bus_pending_activation_entry_free (pending_activation_entry);
-              return FALSE;
-            }
-        }
-
-      pending_activation->timeout =
-        _dbus_timeout_new (bus_context_get_activation_timeout (activation->context),
-                           pending_activation_timed_out,
-                           pending_activation,
-                           NULL);
-      if (!pending_activation->timeout)
-        {
-          _dbus_verbose ("Failed to create timeout for pending activation\n");
-
-          BUS_SET_OOM (error);
-          bus_pending_activation_unref (pending_activation);
-          bus_pending_activation_entry_free (pending_activation_entry);
-          return FALSE;
-        }
-
-      if (!_dbus_loop_add_timeout (bus_context_get_loop (activation->context),
-                                   pending_activation->timeout,
-                                   handle_timeout_callback,
-                                   pending_activation,
-                                   NULL))
-        {
-          _dbus_verbose ("Failed to add timeout for pending activation\n");
-
-          BUS_SET_OOM (error);
-          bus_pending_activation_unref (pending_activation);
           bus_pending_activation_entry_free (pending_activation_entry);
           return FALSE;
         }
 
-      pending_activation->timeout_added = TRUE;
-
       if (!_dbus_list_append (&pending_activation->entries, pending_activation_entry))
         {
           _dbus_verbose ("Failed to add entry to just-created pending activation\n");
@@ -1987,162 +2931,172 @@ bus_activation_activate_service (BusActivation  *activation,
          proceed with traditional activation. */
     }
 
-  /* use command as system and session different */
-  if (!_dbus_string_init (&command))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  return spawn_pending_activation (activation, pending_activation, entry,
+                                   service_name, error);
+}
 
-  /* does the bus use a helper? */
-  servicehelper = bus_context_get_servicehelper (activation->context);
-  if (servicehelper != NULL)
-    {
-      if (entry->user == NULL)
-        {
-          _dbus_string_free (&command);
-          dbus_set_error (error, DBUS_ERROR_SPAWN_FILE_INVALID,
-                          "Cannot do system-bus activation with no user\n");
-          return FALSE;
-        }
+/* Starts a service from the boot profile as if someone had asked for
+ * it, except that nobody waits for it; if it can't be started now, it
+ * is started on demand as usual
+ */
+static void
+prestart_service (BusActivation *activation,
+                  const char    *service_name)
+{
+  BusActivationEntry *entry;
+  BusPendingActivation *pending_activation;
+  DBusString service_str;
+  DBusHashIter iter;
+  DBusError error;
 
-      /* join the helper path and the service name */
-      if (!_dbus_string_append (&command, servicehelper))
-        {
-          _dbus_string_free (&command);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-      if (!_dbus_string_append (&command, " "))
-        {
-          _dbus_string_free (&command);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-      if (!_dbus_string_append (&command, service_name))
-        {
-          _dbus_string_free (&command);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-    }
-  else
+  dbus_error_init (&error);
+
+  entry = activation_find_entry (activation, service_name, &error);
+  if (entry == NULL)
+    goto failed;
+
+  _dbus_string_init_const (&service_str, service_name);
+  if (bus_registry_lookup (bus_context_get_registry (activation->context),
+                           &service_str) != NULL ||
+      _dbus_hash_table_lookup_string (activation->pending_activations,
+                                      service_name) != NULL)
+    return;
+
+  /* systemd decides for itself what to start at boot */
+  if (bus_context_get_systemd_activation (activation->context) &&
+      entry->systemd_service != NULL)
+    return;
+
+  /* the executable is already starting for another of its names */
+  _dbus_hash_iter_init (activation->pending_activations, &iter);
+  while (_dbus_hash_iter_next (&iter))
     {
-      /* the bus does not use a helper, so we can append arguments with the exec line */
-      if (!_dbus_string_append (&command, entry->exec))
-        {
-          _dbus_string_free (&command);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
+      BusPendingActivation *p = _dbus_hash_iter_get_value (&iter);
+
+      if (strcmp (p->exec, entry->exec) == 0)
+        return;
     }
 
-  /* convert command into arguments */
-  if (!_dbus_shell_parse_argv (_dbus_string_get_const_data (&command), &argc, &argv, error))
-    {
-      _dbus_verbose ("Failed to parse command line: %s\n", entry->exec);
-      _DBUS_ASSERT_ERROR_IS_SET (error);
+  pending_activation = bus_pending_activation_new (activation, entry,
+                                                   service_name, &error);
+  if (pending_activation == NULL)
+    goto failed;
 
-      _dbus_hash_table_remove_string (activation->pending_activations,
-                                      pending_activation->service_name);
+  pending_activation->prestarted = TRUE;
 
-      _dbus_string_free (&command);
-      return FALSE;
+  if (!_dbus_hash_table_insert_string (activation->pending_activations,
+                                       pending_activation->service_name,
+                                       pending_activation))
+    {
+      bus_pending_activation_unref (pending_activation);
+      BUS_SET_OOM (&error);
+      goto failed;
     }
-  _dbus_string_free (&command);
 
-  if (!add_bus_environment (activation, error))
+  if (!spawn_pending_activation (activation, pending_activation, entry,
+                                 service_name, &error))
     {
-      _DBUS_ASSERT_ERROR_IS_SET (error);
-      dbus_free_string_array (argv);
-      return FALSE;
+      _dbus_hash_table_remove_string (activation->pending_activations,
+                                      service_name);
+      goto failed;
     }
 
-  envp = bus_activation_get_environment (activation);
+  _dbus_verbose ("Prestarted %s from the boot profile\n", service_name);
+  return;
 
-  if (envp == NULL)
+ failed:
+  _dbus_verbose ("Not prestarting %s: %s\n", service_name, error.message);
+  dbus_error_free (&error);
+}
+
+/**
+ * Starts the services in the boot profile saved at the last startup,
+ * as many at once as max_pending_activations allows, then records
+ * which services are asked for during the next window_ms milliseconds
+ * and saves that as the new profile. Only done once, at startup, after
+ * the bus has switched to the user activated services run as.
+ *
+ * @param activation the activation
+ * @param filename where the profile is kept
+ * @param window_ms how long to record for
+ */
+void
+bus_activation_start_boot_profile (BusActivation *activation,
+                                   const char    *filename,
+                                   int            window_ms)
+{
+  DBusMessage *profile;
+  DBusMessageIter iter, array_iter, struct_iter;
+  const char *service_name;
+  int max_pending;
+
+  _dbus_assert (activation->boot_profile_file == NULL);
+
+  activation->boot_profile_file = _dbus_strdup (filename);
+  if (activation->boot_profile_file == NULL)
+    return;
+
+  _dbus_get_current_time (&activation->boot_profile_sec,
+                          &activation->boot_profile_usec);
+
+  activation->boot_profile_timeout =
+    _dbus_timeout_new (window_ms, boot_profile_timed_out, activation, NULL);
+  if (activation->boot_profile_timeout == NULL)
     {
-      BUS_SET_OOM (error);
-      dbus_free_string_array (argv);
-      return FALSE;
+      boot_profile_stop (activation);
+      return;
     }
 
-  _dbus_verbose ("Spawning %s ...\n", argv[0]);
-  if (!_dbus_spawn_async_with_babysitter (&pending_activation->babysitter, argv,
-                                          envp,
-                                          NULL, activation,
-                                          error))
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (activation->context),
+                               activation->boot_profile_timeout,
+                               boot_profile_timeout_callback,
+                               activation, NULL))
     {
-      _dbus_verbose ("Failed to spawn child\n");
-      _DBUS_ASSERT_ERROR_IS_SET (error);
-      dbus_free_string_array (argv);
-      dbus_free_string_array (envp);
-
-      return FALSE;
+      _dbus_timeout_unref (activation->boot_profile_timeout);
+      activation->boot_profile_timeout = NULL;
+      boot_profile_stop (activation);
+      return;
     }
 
-  dbus_free_string_array (argv);
-  envp = NULL;
+  profile = load_message (filename, "boot profile",
+                          BOOT_PROFILE_SIGNATURE, BOOT_PROFILE_VERSION);
+  if (profile == NULL)
+    return;
 
-  _dbus_assert (pending_activation->babysitter != NULL);
+  max_pending = bus_context_get_max_pending_activations (activation->context);
 
-  if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
-                                             add_babysitter_watch,
-                                             remove_babysitter_watch,
-                                             NULL,
-                                             pending_activation,
-                                             NULL))
+  dbus_message_iter_init (profile, &iter);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT &&
+         _dbus_hash_table_get_n_entries (activation->pending_activations) < max_pending)
     {
-      BUS_SET_OOM (error);
-      _dbus_verbose ("Failed to set babysitter watch functions\n");
-      return FALSE;
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &service_name);
+
+      prestart_service (activation, service_name);
+
+      dbus_message_iter_next (&array_iter);
     }
 
-  return TRUE;
+  dbus_message_unref (profile);
 }
 
-dbus_bool_t
-bus_activation_list_services (BusActivation *activation,
-			      char        ***listp,
-			      int           *array_len)
+void
+bus_activation_foreach_service (BusActivation                *activation,
+                                BusActivationForeachFunction  function,
+                                void                         *data)
 {
-  int i, j, len;
-  char **retval;
   DBusHashIter iter;
 
-  len = _dbus_hash_table_get_n_entries (activation->entries);
-  retval = dbus_new (char *, len + 1);
-
-  if (retval == NULL)
-    return FALSE;
-
   _dbus_hash_iter_init (activation->entries, &iter);
-  i = 0;
   while (_dbus_hash_iter_next (&iter))
     {
       BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
 
-      retval[i] = _dbus_strdup (entry->name);
-      if (retval[i] == NULL)
-	goto error;
-
-      i++;
+      (* function) (entry->name, data);
     }
-
-  retval[i] = NULL;
-
-  if (array_len)
-    *array_len = len;
-
-  *listp = retval;
-  return TRUE;
-
- error:
-  for (j = 0; j < i; j++)
-    dbus_free (retval[i]);
-  dbus_free (retval);
-
-  return FALSE;
 }
 
 dbus_bool_t
@@ -2424,7 +3378,7 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)))
     return FALSE;
 
-  activation = bus_activation_new (NULL, &address, &directories, NULL);
+  activation = bus_activation_new (NULL, &address, &directories, NULL, NULL);
   if (!activation)
     return FALSE;
 
@@ -28,15 +28,26 @@
 #include <dbus/dbus-list.h>
 #include "bus.h"
 
+typedef void (* BusActivationForeachFunction) (const char *service_name,
+                                               void       *data);
+
 BusActivation* bus_activation_new              (BusContext        *context,
 						const DBusString  *address,
 						DBusList         **directories,
+						const char        *cache_file,
 						DBusError         *error);
 dbus_bool_t bus_activation_reload           (BusActivation     *activation,
 						const DBusString  *address,
 						DBusList         **directories,
+						const char        *cache_file,
 						DBusError         *error);
+dbus_bool_t bus_activation_service_file_changed (BusActivation     *activation,
+						const char        *dir,
+						const char        *filename);
 BusActivation* bus_activation_ref              (BusActivation     *activation);
+void           bus_activation_start_boot_profile (BusActivation   *activation,
+                                                  const char      *filename,
+                                                  int              window_ms);
 void           bus_activation_unref            (BusActivation     *activation);
 
 dbus_bool_t   bus_activation_set_environment_variable (BusActivation     *activation,
@@ -54,9 +65,9 @@ dbus_bool_t    bus_activation_service_created  (BusActivation     *activation,
 						const char        *service_name,
 						BusTransaction    *transaction,
 						DBusError         *error);
-dbus_bool_t    bus_activation_list_services    (BusActivation     *registry,
-						char            ***listp,
-						int               *array_len);
+void           bus_activation_foreach_service  (BusActivation     *activation,
+						BusActivationForeachFunction function,
+						void              *data);
 dbus_bool_t    dbus_activation_systemd_failure (BusActivation     *activation,
                                                 DBusMessage       *message);
 
@@ -0,0 +1,594 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* bridge.c  Forwarding signals to the buses on other machines
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "bridge.h"
+#include "signals.h"
+#include "utils.h"
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-timeout.h>
+#include <string.h>
+
+/* Each peer bus is connected to as an ordinary client, which asks the
+ * peer's driver every so often for a summary of its match rules; local
+ * broadcast signals go over only if the summary says someone there
+ * might want them. A link that's down is retried at the same interval.
+ */
+#define BRIDGE_POLL_MILLISECONDS 2000
+
+typedef struct
+{
+  BusBridges *bridges;
+  char *address;
+  DBusConnection *connection;   /**< NULL while the link is down */
+  DBusPendingCall *pending;     /**< Hello or GetMatchSummary in flight */
+  dbus_bool_t registered;       /**< Hello has been answered */
+  dbus_bool_t have_summary;     /**< summary is worth consulting */
+  dbus_bool_t failing;          /**< last attempt failed, already logged */
+  unsigned char summary[BUS_MATCH_SUMMARY_BYTES];
+} BusBridge;
+
+struct BusBridges
+{
+  BusContext *context;
+  DBusList *bridges;            /**< BusBridge, one per <bridge> */
+  DBusTimeout *timeout;
+};
+
+static void bridge_request_summary (BusBridge *bridge);
+
+static DBusLoop *
+bridge_get_loop (BusBridge *bridge)
+{
+  return bus_context_get_loop (bridge->bridges->context);
+}
+
+static dbus_bool_t
+bridge_watch_callback (DBusWatch    *watch,
+                       unsigned int  condition,
+                       void         *data)
+{
+  return dbus_watch_handle (watch, condition);
+}
+
+static dbus_bool_t
+add_bridge_watch (DBusWatch *watch,
+                  void      *data)
+{
+  BusBridge *bridge = data;
+
+  return _dbus_loop_add_watch (bridge_get_loop (bridge), watch,
+                               bridge_watch_callback, bridge, NULL);
+}
+
+static void
+remove_bridge_watch (DBusWatch *watch,
+                     void      *data)
+{
+  BusBridge *bridge = data;
+
+  _dbus_loop_remove_watch (bridge_get_loop (bridge), watch,
+                           bridge_watch_callback, bridge);
+}
+
+static void
+toggle_bridge_watch (DBusWatch *watch,
+                     void      *data)
+{
+  BusBridge *bridge = data;
+
+  _dbus_loop_toggle_watch (bridge_get_loop (bridge), watch);
+}
+
+static void
+bridge_timeout_callback (DBusTimeout *timeout,
+                         void        *data)
+{
+  /* can return FALSE on OOM but we just let it fire again later */
+  dbus_timeout_handle (timeout);
+}
+
+static dbus_bool_t
+add_bridge_timeout (DBusTimeout *timeout,
+                    void        *data)
+{
+  BusBridge *bridge = data;
+
+  return _dbus_loop_add_timeout (bridge_get_loop (bridge), timeout,
+                                 bridge_timeout_callback, bridge, NULL);
+}
+
+static void
+remove_bridge_timeout (DBusTimeout *timeout,
+                       void        *data)
+{
+  BusBridge *bridge = data;
+
+  _dbus_loop_remove_timeout (bridge_get_loop (bridge), timeout,
+                             bridge_timeout_callback, bridge);
+}
+
+static void
+bridge_dispatch_status (DBusConnection     *connection,
+                        DBusDispatchStatus  new_status,
+                        void               *data)
+{
+  BusBridge *bridge = data;
+
+  if (new_status != DBUS_DISPATCH_COMPLETE)
+    {
+      while (!_dbus_loop_queue_dispatch (bridge_get_loop (bridge), connection))
+        _dbus_wait_for_memory ();
+    }
+}
+
+static void
+bridge_log_failure (BusBridge  *bridge,
+                    const char *what,
+                    const char *message)
+{
+  /* once per outage, not every poll */
+  if (!bridge->failing)
+    bus_context_log (bridge->bridges->context, DBUS_SYSTEM_LOG_INFO,
+                     "Bridge to %s: %s: %s", bridge->address, what, message);
+
+  bridge->failing = TRUE;
+}
+
+static void
+bridge_disconnect (BusBridge *bridge)
+{
+  DBusConnection *connection;
+
+  if (bridge->connection == NULL)
+    return;
+
+  if (bridge->pending != NULL)
+    {
+      dbus_pending_call_cancel (bridge->pending);
+      dbus_pending_call_unref (bridge->pending);
+      bridge->pending = NULL;
+    }
+
+  connection = bridge->connection;
+  bridge->connection = NULL;
+  bridge->registered = FALSE;
+  bridge->have_summary = FALSE;
+
+  dbus_connection_close (connection);
+  dbus_connection_set_watch_functions (connection, NULL, NULL, NULL,
+                                       NULL, NULL);
+  dbus_connection_set_timeout_functions (connection, NULL, NULL, NULL,
+                                         NULL, NULL);
+  dbus_connection_set_dispatch_status_function (connection, NULL,
+                                                NULL, NULL);
+  dbus_connection_unref (connection);
+}
+
+static DBusHandlerResult
+bridge_filter (DBusConnection *connection,
+               DBusMessage    *message,
+               void           *data)
+{
+  BusBridge *bridge = data;
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    {
+      bridge_log_failure (bridge, "lost the connection", "disconnected");
+      bridge_disconnect (bridge);
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Steals the answer to the pending call; NULL if it was an error, which
+ * has then been logged and the link dropped
+ */
+static DBusMessage *
+bridge_steal_reply (BusBridge   *bridge,
+                    const char  *what)
+{
+  DBusMessage *reply;
+  DBusError error;
+
+  reply = dbus_pending_call_steal_reply (bridge->pending);
+  dbus_pending_call_unref (bridge->pending);
+  bridge->pending = NULL;
+
+  _dbus_assert (reply != NULL);
+
+  dbus_error_init (&error);
+  if (dbus_set_error_from_message (&error, reply))
+    {
+      bridge_log_failure (bridge, what, error.message);
+      dbus_error_free (&error);
+      dbus_message_unref (reply);
+      bridge_disconnect (bridge);
+      return NULL;
+    }
+
+  return reply;
+}
+
+static void
+bridge_summary_reply (DBusPendingCall *pending,
+                      void            *data)
+{
+  BusBridge *bridge = data;
+  DBusMessage *reply;
+  DBusError error;
+  const unsigned char *summary;
+  int len;
+
+  reply = bridge_steal_reply (bridge, "GetMatchSummary failed");
+  if (reply == NULL)
+    return;
+
+  dbus_error_init (&error);
+  if (!dbus_message_get_args (reply, &error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &summary, &len,
+                              DBUS_TYPE_INVALID))
+    {
+      bridge_log_failure (bridge, "bad GetMatchSummary reply", error.message);
+      dbus_error_free (&error);
+    }
+  else if (len != BUS_MATCH_SUMMARY_BYTES)
+    {
+      bridge_log_failure (bridge, "bad GetMatchSummary reply",
+                          "wrong length");
+    }
+  else
+    {
+      if (bridge->failing)
+        bus_context_log (bridge->bridges->context, DBUS_SYSTEM_LOG_INFO,
+                         "Bridge to %s is up", bridge->address);
+
+      memcpy (bridge->summary, summary, BUS_MATCH_SUMMARY_BYTES);
+      bridge->have_summary = TRUE;
+      bridge->failing = FALSE;
+    }
+
+  dbus_message_unref (reply);
+}
+
+static void
+bridge_hello_reply (DBusPendingCall *pending,
+                    void            *data)
+{
+  BusBridge *bridge = data;
+  DBusMessage *reply;
+
+  reply = bridge_steal_reply (bridge, "Hello failed");
+  if (reply == NULL)
+    return;
+
+  dbus_message_unref (reply);
+  bridge->registered = TRUE;
+
+  bridge_request_summary (bridge);
+}
+
+/* On OOM the call just isn't made, and the next poll tries again */
+static void
+bridge_call (BusBridge                    *bridge,
+             const char                   *interface,
+             const char                   *method,
+             DBusPendingCallNotifyFunction notify)
+{
+  DBusMessage *message;
+
+  _dbus_assert (bridge->pending == NULL);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                          interface, method);
+  if (message == NULL)
+    return;
+
+  if (!dbus_connection_send_with_reply (bridge->connection, message,
+                                        &bridge->pending, -1) ||
+      bridge->pending == NULL)
+    {
+      dbus_message_unref (message);
+      return;
+    }
+
+  dbus_message_unref (message);
+
+  if (!dbus_pending_call_set_notify (bridge->pending, notify, bridge, NULL))
+    {
+      dbus_pending_call_cancel (bridge->pending);
+      dbus_pending_call_unref (bridge->pending);
+      bridge->pending = NULL;
+    }
+}
+
+static void
+bridge_request_summary (BusBridge *bridge)
+{
+  bridge_call (bridge, BUS_INTERFACE_BRIDGE, "GetMatchSummary",
+               bridge_summary_reply);
+}
+
+static void
+bridge_connect (BusBridge *bridge)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  _dbus_assert (bridge->connection == NULL);
+
+  dbus_error_init (&error);
+  connection = dbus_connection_open_private (bridge->address, &error);
+  if (connection == NULL)
+    {
+      bridge_log_failure (bridge, "cannot connect", error.message);
+      dbus_error_free (&error);
+      return;
+    }
+
+  if (!dbus_connection_set_watch_functions (connection,
+                                            add_bridge_watch,
+                                            remove_bridge_watch,
+                                            toggle_bridge_watch,
+                                            bridge, NULL) ||
+      !dbus_connection_set_timeout_functions (connection,
+                                              add_bridge_timeout,
+                                              remove_bridge_timeout,
+                                              NULL,
+                                              bridge, NULL) ||
+      !dbus_connection_add_filter (connection, bridge_filter, bridge, NULL))
+    {
+      bridge->connection = connection;
+      bridge_disconnect (bridge);
+      return;
+    }
+
+  dbus_connection_set_dispatch_status_function (connection,
+                                                bridge_dispatch_status,
+                                                bridge, NULL);
+
+  bridge->connection = connection;
+
+  bridge_call (bridge, DBUS_INTERFACE_DBUS, "Hello", bridge_hello_reply);
+  if (bridge->pending == NULL)
+    bridge_disconnect (bridge);
+}
+
+static dbus_bool_t
+bridges_poll (void *data)
+{
+  BusBridges *bridges = data;
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&bridges->bridges);
+       link != NULL;
+       link = _dbus_list_get_next_link (&bridges->bridges, link))
+    {
+      BusBridge *bridge = link->data;
+
+      if (bridge->connection == NULL)
+        bridge_connect (bridge);
+      else if (bridge->registered && bridge->pending == NULL)
+        bridge_request_summary (bridge);
+    }
+
+  return TRUE;
+}
+
+static void
+call_timeout_callback (DBusTimeout *timeout,
+                       void        *data)
+{
+  /* can return FALSE on OOM but we just let it fire again later */
+  dbus_timeout_handle (timeout);
+}
+
+static void
+bridge_free (BusBridge *bridge)
+{
+  bridge_disconnect (bridge);
+  dbus_free (bridge->address);
+  dbus_free (bridge);
+}
+
+/**
+ * Sets up a bridge to each of the given peer buses. The links come up
+ * in the background and are retried while they're down, so an
+ * unreachable peer is not an error here, only a malformed address.
+ *
+ * @param context the bus context
+ * @param addresses the addresses from <bridge> elements
+ * @param error return location for errors
+ * @returns the bridges, or #NULL with error set
+ */
+BusBridges *
+bus_bridges_new (BusContext  *context,
+                 DBusList   **addresses,
+                 DBusError   *error)
+{
+  BusBridges *bridges;
+  DBusList *link;
+
+  bridges = dbus_new0 (BusBridges, 1);
+  if (bridges == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  bridges->context = context;
+
+  for (link = _dbus_list_get_first_link (addresses);
+       link != NULL;
+       link = _dbus_list_get_next_link (addresses, link))
+    {
+      DBusAddressEntry **entries;
+      BusBridge *bridge;
+      int n_entries;
+
+      if (!dbus_parse_address (link->data, &entries, &n_entries, error))
+        goto failed;
+
+      dbus_address_entries_free (entries);
+
+      bridge = dbus_new0 (BusBridge, 1);
+      if (bridge == NULL)
+        goto oom;
+
+      bridge->bridges = bridges;
+      bridge->address = _dbus_strdup (link->data);
+
+      if (bridge->address == NULL ||
+          !_dbus_list_append (&bridges->bridges, bridge))
+        {
+          dbus_free (bridge->address);
+          dbus_free (bridge);
+          goto oom;
+        }
+    }
+
+  bridges->timeout = _dbus_timeout_new (BRIDGE_POLL_MILLISECONDS,
+                                        bridges_poll, bridges, NULL);
+  if (bridges->timeout == NULL)
+    goto oom;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               bridges->timeout,
+                               call_timeout_callback, NULL, NULL))
+    {
+      _dbus_timeout_unref (bridges->timeout);
+      bridges->timeout = NULL;
+      goto oom;
+    }
+
+  return bridges;
+
+ oom:
+  BUS_SET_OOM (error);
+ failed:
+  bus_bridges_free (bridges);
+  return NULL;
+}
+
+void
+bus_bridges_free (BusBridges *bridges)
+{
+  if (bridges->timeout != NULL)
+    {
+      _dbus_loop_remove_timeout (bus_context_get_loop (bridges->context),
+                                 bridges->timeout,
+                                 call_timeout_callback, NULL);
+      _dbus_timeout_unref (bridges->timeout);
+    }
+
+  _dbus_list_foreach (&bridges->bridges, (DBusForeachFunction) bridge_free,
+                      NULL);
+  _dbus_list_clear (&bridges->bridges);
+
+  dbus_free (bridges);
+}
+
+/**
+ * Passes a broadcast signal that was sent on this bus to each peer bus
+ * where some rule might match it. Forwarding is best effort: a signal
+ * is dropped if a link is down, backed up past max_outgoing_bytes or
+ * out of memory, as it would be for a slow local recipient.
+ *
+ * @param bridges the bridges
+ * @param message the signal
+ */
+void
+bus_bridges_forward (BusBridges  *bridges,
+                     DBusMessage *message)
+{
+  DBusList *link;
+  long max_outgoing;
+
+  max_outgoing = bus_context_get_max_outgoing_bytes (bridges->context);
+
+  for (link = _dbus_list_get_first_link (&bridges->bridges);
+       link != NULL;
+       link = _dbus_list_get_next_link (&bridges->bridges, link))
+    {
+      BusBridge *bridge = link->data;
+
+      if (!bridge->have_summary ||
+          !bus_match_summary_may_match (bridge->summary, message))
+        continue;
+
+      if (dbus_message_contains_unix_fds (message) &&
+          !dbus_connection_can_send_type (bridge->connection,
+                                          DBUS_TYPE_UNIX_FD))
+        continue;
+
+      if (dbus_connection_get_outgoing_size (bridge->connection) > max_outgoing)
+        continue;
+
+      dbus_connection_send (bridge->connection, message, NULL);
+    }
+}
+
+dbus_bool_t
+bus_bridge_handle_get_match_summary (DBusConnection *connection,
+                                     BusTransaction *transaction,
+                                     DBusMessage    *message,
+                                     DBusError      *error)
+{
+  BusContext *context;
+  DBusMessage *reply;
+  const unsigned char *summary;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  context = bus_transaction_get_context (transaction);
+  summary = bus_matchmaker_get_summary (bus_context_get_matchmaker (context));
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  if (!dbus_message_append_args (reply,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                 &summary, BUS_MATCH_SUMMARY_BYTES,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+
+  /* Only another bus's bridge asks; what it sends us came from that
+   * bus, so it isn't bridged on again and a full mesh doesn't loop
+   */
+  bus_connection_set_is_bridge (connection);
+
+  return TRUE;
+
+ oom:
+  BUS_SET_OOM (error);
+
+  if (reply)
+    dbus_message_unref (reply);
+  return FALSE;
+}
@@ -0,0 +1,42 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* bridge.h  Forwarding signals to the buses on other machines
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_BRIDGE_H
+#define BUS_BRIDGE_H
+
+#include <dbus/dbus.h>
+#include "connection.h"
+
+#define BUS_INTERFACE_BRIDGE "org.freedesktop.DBus.Bridge"
+
+BusBridges* bus_bridges_new     (BusContext     *context,
+                                 DBusList      **addresses,
+                                 DBusError      *error);
+void        bus_bridges_free    (BusBridges     *bridges);
+void        bus_bridges_forward (BusBridges     *bridges,
+                                 DBusMessage    *message);
+
+dbus_bool_t bus_bridge_handle_get_match_summary (DBusConnection *connection,
+                                                 BusTransaction *transaction,
+                                                 DBusMessage    *message,
+                                                 DBusError      *error);
+
+#endif /* BUS_BRIDGE_H */
@@ -24,6 +24,9 @@
 #include <config.h>
 #include "bus.h"
 #include "activation.h"
+#include "bridge.h"
+#include "capture.h"
+#include "metrics.h"
 #include "connection.h"
 #include "services.h"
 #include "utils.h"
@@ -32,10 +35,18 @@
 #include "signals.h"
 #include "selinux.h"
 #include "dir-watch.h"
+#include "validator.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-credentials.h>
+#include <dbus/dbus-spawn.h>
+#ifndef DBUS_WIN
+#include <dbus/dbus-server-socket.h>
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-latency.h>
+#include <dbus/dbus-probes.h>
 #ifdef DBUS_CYGWIN
 #include <signal.h>
 #endif
@@ -60,16 +71,51 @@ struct BusContext
   BusRegistry *registry;
   BusPolicy *policy;
   BusMatchmaker *matchmaker;
+  BusCapture *capture;
+  BusBridges *bridges;  /**< Links to the peer buses of <bridge>, or NULL */
+  BusValidator *validator; /**< Threads for huge message bodies, or NULL */
+  BusMetrics *metrics;  /**< Exporter for <metrics_listen>, or NULL */
   BusLimits limits;
+  DBusHashTable *coalesced_signals; /**< "interface" or "interface member" of <coalesce> signals */
   unsigned int fork : 1;
   unsigned int syslog : 1;
   unsigned int keep_umask : 1;
+  unsigned int activation_launcher : 1;
   unsigned int allow_anonymous : 1;
   unsigned int systemd_activation : 1;
+  unsigned int realtime : 1;
+  int realtime_priority;  /**< SCHED_FIFO priority from <realtime>, or 0 */
+  long realtime_reserve;  /**< Bytes of heap for <realtime> to prefault */
+  long phase_usec[BUS_N_PHASES]; /**< Timings of the last startup or reload */
+  unsigned int phases_are_reload : 1;
 };
 
 static dbus_int32_t server_data_slot = -1;
 
+typedef struct
+{
+  long tv_sec;
+  long tv_usec;
+} BusPhaseStart;
+
+static void
+phase_begin (BusPhaseStart *start)
+{
+  _dbus_get_current_time (&start->tv_sec, &start->tv_usec);
+}
+
+static void
+phase_end (BusContext          *context,
+           BusPhase             phase,
+           const BusPhaseStart *start)
+{
+  long sec, usec;
+
+  _dbus_get_current_time (&sec, &usec);
+  context->phase_usec[phase] = (sec - start->tv_sec) * 1000000L +
+    (usec - start->tv_usec);
+}
+
 typedef struct
 {
   BusContext *context;
@@ -140,6 +186,17 @@ remove_server_watch (DBusWatch  *watch,
                            watch, server_watch_callback, server);
 }
 
+static void
+toggle_server_watch (DBusWatch  *watch,
+                     void       *data)
+{
+  DBusServer *server = data;
+  BusContext *context;
+
+  context = server_get_context (server);
+
+  _dbus_loop_toggle_watch (context->loop, watch);
+}
 
 static void
 server_timeout_callback (DBusTimeout   *timeout,
@@ -253,7 +310,7 @@ setup_server (BusContext *context,
   if (!dbus_server_set_watch_functions (server,
                                         add_server_watch,
                                         remove_server_watch,
-                                        NULL,
+                                        toggle_server_watch,
                                         server,
                                         NULL))
     {
@@ -291,6 +348,8 @@ process_config_first_time_only (BusContext       *context,
   const char *user, *pidfile;
   char **auth_mechanisms;
   DBusList **auth_mechanisms_list;
+  DBusList **cpu_affinity;
+  BusPhaseStart listen_start;
   int len;
   dbus_bool_t retval;
 
@@ -387,6 +446,28 @@ process_config_first_time_only (BusContext       *context,
     goto oom;
   _dbus_string_free (&log_prefix);
 
+  /* Pin ourselves before listening, so the connections, loader buffers
+   * and mempools allocated from here on come from the chosen CPUs'
+   * NUMA node rather than wherever we happened to start
+   */
+  cpu_affinity = bus_config_parser_get_cpu_affinity (parser);
+  if (*cpu_affinity != NULL)
+    {
+      DBusError tmp_error = DBUS_ERROR_INIT;
+
+      if (!_dbus_set_cpu_affinity (cpu_affinity, &tmp_error))
+        {
+          if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_error_free (&tmp_error);
+              goto oom;
+            }
+
+          _dbus_warn ("Ignoring <cpu_affinity>: %s\n", tmp_error.message);
+          dbus_error_free (&tmp_error);
+        }
+    }
+
   /* Build an array of auth mechanisms */
 
   auth_mechanisms_list = bus_config_parser_get_mechanisms (parser);
@@ -417,6 +498,8 @@ process_config_first_time_only (BusContext       *context,
 
   /* Listen on our addresses */
 
+  phase_begin (&listen_start);
+
   if (address)
     {
       DBusServer *server;
@@ -464,10 +547,16 @@ process_config_first_time_only (BusContext       *context,
         }
     }
 
+  phase_end (context, BUS_PHASE_LISTEN, &listen_start);
+
   context->fork = bus_config_parser_get_fork (parser);
   context->syslog = bus_config_parser_get_syslog (parser);
   context->keep_umask = bus_config_parser_get_keep_umask (parser);
+  context->activation_launcher = bus_config_parser_get_activation_launcher (parser);
   context->allow_anonymous = bus_config_parser_get_allow_anonymous (parser);
+  context->realtime = bus_config_parser_get_realtime (parser,
+                                                      &context->realtime_priority,
+                                                      &context->realtime_reserve);
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   retval = TRUE;
@@ -488,6 +577,42 @@ process_config_first_time_only (BusContext       *context,
  * since it can do a "half reload" in out-of-memory
  * situations. Realistically, unlikely to ever matter.
  */
+static dbus_bool_t
+load_coalesced_signals (BusContext      *context,
+                        BusConfigParser *parser)
+{
+  DBusHashTable *table;
+  DBusList **keys;
+  DBusList *link;
+
+  table = _dbus_hash_table_new (DBUS_HASH_STRING, dbus_free, NULL);
+  if (table == NULL)
+    return FALSE;
+
+  keys = bus_config_parser_get_coalesced_signals (parser);
+  for (link = _dbus_list_get_first_link (keys);
+       link != NULL;
+       link = _dbus_list_get_next_link (keys, link))
+    {
+      char *key;
+
+      key = _dbus_strdup (link->data);
+      if (key == NULL ||
+          !_dbus_hash_table_insert_string (table, key, key))
+        {
+          dbus_free (key);
+          _dbus_hash_table_unref (table);
+          return FALSE;
+        }
+    }
+
+  if (context->coalesced_signals)
+    _dbus_hash_table_unref (context->coalesced_signals);
+  context->coalesced_signals = table;
+
+  return TRUE;
+}
+
 static dbus_bool_t
 process_config_every_time (BusContext      *context,
 			   BusConfigParser *parser,
@@ -501,6 +626,7 @@ process_config_every_time (BusContext      *context,
   char *addr;
   const char *servicehelper;
   char *s;
+  BusPhaseStart activation_start;
 
   dbus_bool_t retval;
 
@@ -518,6 +644,30 @@ process_config_every_time (BusContext      *context,
   /* get our limits and timeout lengths */
   bus_config_parser_get_limits (parser, &context->limits);
 
+  _dbus_string_set_mapped_threshold (context->limits.mapped_buffer_threshold);
+
+  /* the threads are only started once; a reload can't change how many */
+  if (!is_reload && context->limits.validation_threads > 0)
+    {
+      context->validator = bus_validator_new (context,
+                                              context->limits.validation_threads,
+                                              error);
+      if (context->validator == NULL && dbus_error_is_set (error))
+        goto failed;
+    }
+
+  if (context->validator != NULL)
+    bus_validator_set_min_size (context->validator,
+                                context->limits.offloaded_validation_size);
+
+  _dbus_latency_set_enabled (bus_config_parser_get_latency_histograms (parser));
+
+  if (!load_coalesced_signals (context, parser))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
   if (context->policy)
     bus_policy_unref (context->policy);
   context->policy = bus_config_parser_steal_policy (parser);
@@ -585,14 +735,20 @@ process_config_every_time (BusContext      *context,
     }
 
   /* Create activation subsystem */
+  phase_begin (&activation_start);
+
   if (context->activation)
     {
-      if (!bus_activation_reload (context->activation, &full_address, dirs, error))
+      if (!bus_activation_reload (context->activation, &full_address, dirs,
+                                  bus_config_parser_get_servicecache (parser),
+                                  error))
         goto failed;
     }
   else
     {
-      context->activation = bus_activation_new (context, &full_address, dirs, error);
+      context->activation = bus_activation_new (context, &full_address, dirs,
+                                                 bus_config_parser_get_servicecache (parser),
+                                                 error);
     }
 
   if (context->activation == NULL)
@@ -601,6 +757,8 @@ process_config_every_time (BusContext      *context,
       goto failed;
     }
 
+  phase_end (context, BUS_PHASE_ACTIVATION, &activation_start);
+
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   retval = TRUE;
 
@@ -688,11 +846,17 @@ bus_context_new (const DBusString *config_file,
   DBusString log_prefix;
   BusContext *context;
   BusConfigParser *parser;
+  char *boot_profile;
+  BusPhaseStart start;
+  BusPhaseStart phase_start;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
   context = NULL;
   parser = NULL;
+  boot_profile = NULL;
+
+  phase_begin (&start);
 
   if (!dbus_server_allocate_data_slot (&server_data_slot))
     {
@@ -730,23 +894,30 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
+  phase_begin (&phase_start);
   parser = bus_config_load (config_file, TRUE, NULL, error);
   if (parser == NULL)
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
+  phase_end (context, BUS_PHASE_PARSE, &phase_start);
 
+  phase_begin (&phase_start);
   if (!process_config_first_time_only (context, parser, address, systemd_activation, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
+  phase_end (context, BUS_PHASE_FIRST_TIME, &phase_start);
+
+  phase_begin (&phase_start);
   if (!process_config_every_time (context, parser, FALSE, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
+  phase_end (context, BUS_PHASE_EVERY_TIME, &phase_start);
 
   /* we need another ref of the server data slot for the context
    * to own
@@ -888,11 +1059,49 @@ bus_context_new (const DBusString *config_file,
       bus_context_log (context, DBUS_SYSTEM_LOG_FATAL, "SELinux enabled but AVC initialization failed; check system log\n");
     }
 
+  phase_begin (&phase_start);
   if (!process_config_postinit (context, parser, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
+  phase_end (context, BUS_PHASE_POSTINIT, &phase_start);
+
+  /* the peers are only given at startup, reloading leaves them be */
+  if (*bus_config_parser_get_bridges (parser) != NULL)
+    {
+      context->bridges = bus_bridges_new (context,
+                                          bus_config_parser_get_bridges (parser),
+                                          error);
+      if (context->bridges == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+    }
+
+  /* like the bridges, only set up at startup */
+  if (bus_config_parser_get_metrics_listen (parser) != NULL)
+    {
+      context->metrics = bus_metrics_new (context,
+                                          bus_config_parser_get_metrics_listen (parser),
+                                          error);
+      if (context->metrics == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+    }
+
+  if (bus_config_parser_get_bootprofile (parser) != NULL)
+    {
+      boot_profile = _dbus_strdup (bus_config_parser_get_bootprofile (parser));
+      if (boot_profile == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
 
   if (parser != NULL)
     {
@@ -917,11 +1126,42 @@ bus_context_new (const DBusString *config_file,
 #endif
     }
 
+  /* Fork the launcher while we are still small and already running
+   * as the user that activated services get; it's only an
+   * optimization, so carry on without it if need be
+   */
+  if (context->activation_launcher)
+    {
+      DBusError tmp_error;
+
+      dbus_error_init (&tmp_error);
+      if (!_dbus_spawn_start_launcher (&tmp_error))
+        {
+          bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                           "Not using an activation launcher: %s",
+                           tmp_error.message);
+          dbus_error_free (&tmp_error);
+        }
+    }
+
+  /* Services started from the boot profile are spawned by the
+   * launcher too, and the new profile is written as the bus user
+   */
+  if (boot_profile != NULL)
+    {
+      bus_activation_start_boot_profile (context->activation, boot_profile,
+                                         context->limits.boot_profile_window);
+      dbus_free (boot_profile);
+    }
+
   dbus_server_free_data_slot (&server_data_slot);
 
+  phase_end (context, BUS_PHASE_TOTAL, &start);
+
   return context;
 
  failed:
+  dbus_free (boot_profile);
   if (parser != NULL)
     bus_config_parser_unref (parser);
   if (context != NULL)
@@ -946,30 +1186,44 @@ bus_context_reload_config (BusContext *context,
 {
   BusConfigParser *parser;
   DBusString config_file;
+  BusPhaseStart start;
+  BusPhaseStart phase_start;
   dbus_bool_t ret;
 
+  phase_begin (&start);
+  _DBUS_ZERO (context->phase_usec);
+  context->phases_are_reload = TRUE;
+
   /* Flush the user database cache */
   _dbus_flush_caches ();
 
   ret = FALSE;
   _dbus_string_init_const (&config_file, context->config_file);
+  phase_begin (&phase_start);
   parser = bus_config_load (&config_file, TRUE, NULL, error);
   if (parser == NULL)
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
+  phase_end (context, BUS_PHASE_PARSE, &phase_start);
 
+  phase_begin (&phase_start);
   if (!process_config_every_time (context, parser, TRUE, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
+  phase_end (context, BUS_PHASE_EVERY_TIME, &phase_start);
+
+  phase_begin (&phase_start);
   if (!process_config_postinit (context, parser, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
+  phase_end (context, BUS_PHASE_POSTINIT, &phase_start);
+  phase_end (context, BUS_PHASE_TOTAL, &start);
   ret = TRUE;
 
   bus_context_log (context, DBUS_SYSTEM_LOG_INFO, "Reloaded configuration");
@@ -981,6 +1235,97 @@ bus_context_reload_config (BusContext *context,
   return ret;
 }
 
+/**
+ * Replaces the running daemon with a fresh copy of the given program,
+ * handing it our listening sockets as if systemd had passed them in.
+ * Clients that connect while the new copy starts up wait in the
+ * sockets' backlog instead of being refused. The argv should make the
+ * new copy listen on "systemd:" and not fork.
+ *
+ * Connections that are already set up are closed by the exec.
+ *
+ * @param context the bus context
+ * @param path the daemon binary to run
+ * @param argv its arguments
+ * @param error return location for errors
+ * @returns #FALSE with error set; does not return on success
+ */
+dbus_bool_t
+bus_context_restart (BusContext  *context,
+                     const char  *path,
+                     char       **argv,
+                     DBusError   *error)
+{
+#ifndef DBUS_WIN
+  DBusList *link;
+  int *fds;
+  int n_fds;
+  dbus_bool_t retval;
+
+  n_fds = 0;
+  for (link = _dbus_list_get_first_link (&context->servers);
+       link != NULL;
+       link = _dbus_list_get_next_link (&context->servers, link))
+    {
+      const int *server_fds;
+
+      n_fds += _dbus_server_socket_get_fds (link->data, &server_fds);
+    }
+
+  fds = dbus_new (int, n_fds + 1);
+  if (fds == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  n_fds = 0;
+  for (link = _dbus_list_get_first_link (&context->servers);
+       link != NULL;
+       link = _dbus_list_get_next_link (&context->servers, link))
+    {
+      const int *server_fds;
+      int i, n;
+
+      n = _dbus_server_socket_get_fds (link->data, &server_fds);
+      for (i = 0; i < n; i++)
+        {
+          if (server_fds[i] >= 0)
+            fds[n_fds++] = server_fds[i];
+        }
+    }
+
+  if (n_fds == 0)
+    {
+      dbus_free (fds);
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "No listening sockets to hand over");
+      return FALSE;
+    }
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Restarting, handing over %d listening sockets", n_fds);
+
+  /* Flush queued log messages; the exec would discard them */
+  _dbus_system_log_stop_thread ();
+
+  retval = _dbus_exec_with_listen_fds (path, argv, fds, n_fds, error);
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Unable to restart: %s", error->message);
+
+  if (!_dbus_system_log_start_thread (NULL))
+    _dbus_verbose ("Could not restart the log thread, logging synchronously\n");
+
+  dbus_free (fds);
+  return retval;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Restarting with socket handover needs a Unix system");
+  return FALSE;
+#endif
+}
+
 static void
 shutdown_server (BusContext *context,
                  DBusServer *server)
@@ -1041,6 +1386,13 @@ bus_context_unref (BusContext *context)
 
       bus_context_shutdown (context);
 
+      /* its jobs hold references to connections */
+      if (context->validator)
+        {
+          bus_validator_free (context->validator);
+          context->validator = NULL;
+        }
+
       if (context->connections)
         {
           bus_connections_unref (context->connections);
@@ -1074,6 +1426,23 @@ bus_context_unref (BusContext *context)
           context->policy = NULL;
         }
 
+      /* the capture's watch is on the loop */
+      bus_context_set_capture (context, NULL);
+
+      /* and so are the bridges' connections */
+      if (context->bridges)
+        {
+          bus_bridges_free (context->bridges);
+          context->bridges = NULL;
+        }
+
+      /* and the exporter's sockets */
+      if (context->metrics)
+        {
+          bus_metrics_free (context->metrics);
+          context->metrics = NULL;
+        }
+
       if (context->loop)
         {
           _dbus_loop_unref (context->loop);
@@ -1086,6 +1455,12 @@ bus_context_unref (BusContext *context)
           context->matchmaker = NULL;
         }
 
+      if (context->coalesced_signals)
+        {
+          _dbus_hash_table_unref (context->coalesced_signals);
+          context->coalesced_signals = NULL;
+        }
+
       dbus_free (context->config_file);
       dbus_free (context->log_prefix);
       dbus_free (context->type);
@@ -1163,12 +1538,41 @@ bus_context_get_matchmaker (BusContext  *context)
   return context->matchmaker;
 }
 
+BusCapture*
+bus_context_get_capture (BusContext *context)
+{
+  return context->capture;
+}
+
+/* Takes ownership of capture, and stops any previous one */
+void
+bus_context_set_capture (BusContext *context,
+                         BusCapture *capture)
+{
+  if (context->capture != NULL)
+    bus_capture_free (context->capture);
+
+  context->capture = capture;
+}
+
+BusBridges*
+bus_context_get_bridges (BusContext *context)
+{
+  return context->bridges;
+}
+
 DBusLoop*
 bus_context_get_loop (BusContext *context)
 {
   return context->loop;
 }
 
+BusValidator*
+bus_context_get_validator (BusContext *context)
+{
+  return context->validator;
+}
+
 dbus_bool_t
 bus_context_allow_unix_user (BusContext   *context,
                              unsigned long uid)
@@ -1260,12 +1664,178 @@ bus_context_get_max_replies_per_connection (BusContext *context)
   return context->limits.max_replies_per_connection;
 }
 
+long
+bus_context_get_max_incoming_bytes (BusContext *context)
+{
+  return context->limits.max_incoming_bytes;
+}
+
+long
+bus_context_get_max_outgoing_bytes (BusContext *context)
+{
+  return context->limits.max_outgoing_bytes;
+}
+
 int
 bus_context_get_reply_timeout (BusContext *context)
 {
   return context->limits.reply_timeout;
 }
 
+int
+bus_context_get_dispatch_quantum (BusContext *context)
+{
+  return context->limits.dispatch_quantum;
+}
+
+int
+bus_context_get_max_messages_per_second (BusContext *context)
+{
+  return context->limits.max_messages_per_second;
+}
+
+long
+bus_context_get_max_bytes_per_second (BusContext *context)
+{
+  return context->limits.max_bytes_per_second;
+}
+
+int
+bus_context_get_max_messages_per_second_per_user (BusContext *context)
+{
+  return context->limits.max_messages_per_second_per_user;
+}
+
+long
+bus_context_get_max_bytes_per_second_per_user (BusContext *context)
+{
+  return context->limits.max_bytes_per_second_per_user;
+}
+
+long
+bus_context_get_coalesce_threshold (BusContext *context)
+{
+  return context->limits.coalesce_threshold;
+}
+
+int
+bus_context_get_reload_delay (BusContext *context)
+{
+  return context->limits.reload_delay;
+}
+
+/**
+ * Gets how long a phase of the last startup or configuration reload
+ * took. Phases that did not run, or did not finish, report 0.
+ *
+ * @param context the bus context
+ * @param phase the phase
+ * @returns the wall-clock time in microseconds
+ */
+long
+bus_context_get_phase_usec (BusContext *context,
+                            BusPhase    phase)
+{
+  _dbus_assert (phase < BUS_N_PHASES);
+
+  return context->phase_usec[phase];
+}
+
+/**
+ * Gets whether bus_context_get_phase_usec() describes a reload
+ * rather than the startup.
+ *
+ * @param context the bus context
+ * @returns #TRUE after the first reload
+ */
+dbus_bool_t
+bus_context_get_phases_are_reload (BusContext *context)
+{
+  return context->phases_are_reload;
+}
+
+/**
+ * Gets the name of a phase, for reports and statistics keys.
+ *
+ * @param phase the phase
+ * @returns a CamelCase name
+ */
+const char*
+bus_phase_name (BusPhase phase)
+{
+  static const char * const names[BUS_N_PHASES] = {
+    "Parse",
+    "FirstTime",
+    "Listen",
+    "EveryTime",
+    "Activation",
+    "PostInit",
+    "Total"
+  };
+
+  _dbus_assert (phase < BUS_N_PHASES);
+
+  return names[phase];
+}
+
+dbus_bool_t
+bus_context_get_realtime (BusContext *context,
+                          int        *priority,
+                          long       *reserve)
+{
+  *priority = context->realtime_priority;
+  *reserve = context->realtime_reserve;
+  return context->realtime;
+}
+
+/**
+ * Checks whether a signal was named by a <coalesce> element, so that
+ * it may replace an older copy still waiting in a slow recipient's
+ * outgoing queue.
+ *
+ * @param context the bus context
+ * @param message the message
+ * @returns #TRUE if the message is a signal to coalesce
+ */
+dbus_bool_t
+bus_context_get_signal_coalesces (BusContext  *context,
+                                  DBusMessage *message)
+{
+  const char *interface;
+  const char *member;
+  DBusString key;
+  dbus_bool_t found;
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_SIGNAL ||
+      _dbus_hash_table_get_n_entries (context->coalesced_signals) == 0)
+    return FALSE;
+
+  interface = dbus_message_get_interface (message);
+  member = dbus_message_get_member (message);
+
+  if (interface == NULL || member == NULL)
+    return FALSE;
+
+  if (_dbus_hash_table_lookup_string (context->coalesced_signals,
+                                      interface) != NULL)
+    return TRUE;
+
+  /* on OOM just don't coalesce */
+  if (!_dbus_string_init (&key))
+    return FALSE;
+
+  found = FALSE;
+  if (_dbus_string_append (&key, interface) &&
+      _dbus_string_append_byte (&key, ' ') &&
+      _dbus_string_append (&key, member))
+    found = _dbus_hash_table_lookup_string (context->coalesced_signals,
+                                            _dbus_string_get_const_data (&key)) != NULL;
+
+  _dbus_string_free (&key);
+
+  return found;
+}
+
 void
 bus_context_log (BusContext *context, DBusSystemLogSeverity severity, const char *msg, ...) _DBUS_GNUC_PRINTF (3, 4);
 
@@ -1314,14 +1884,14 @@ out:
  * NULL for addressed_recipient may mean the bus driver, or may mean
  * no destination was specified in the message (e.g. a signal).
  */
-dbus_bool_t
-bus_context_check_security_policy (BusContext     *context,
-                                   BusTransaction *transaction,
-                                   DBusConnection *sender,
-                                   DBusConnection *addressed_recipient,
-                                   DBusConnection *proposed_recipient,
-                                   DBusMessage    *message,
-                                   DBusError      *error)
+static dbus_bool_t
+check_security_policy_internal (BusContext     *context,
+                                BusTransaction *transaction,
+                                DBusConnection *sender,
+                                DBusConnection *addressed_recipient,
+                                DBusConnection *proposed_recipient,
+                                DBusMessage    *message,
+                                DBusError      *error)
 {
   const char *dest;
   BusClientPolicy *sender_policy;
@@ -1556,6 +2126,8 @@ bus_context_check_security_policy (BusContext     *context,
                                   dest ? dest : DBUS_SERVICE_DBUS,
                                   proposed_recipient_loginfo);
       _dbus_verbose ("security policy disallowing message due to sender policy\n");
+      if (sender != NULL && addressed_recipient == proposed_recipient)
+        bus_connection_count_policy_denial (sender);
       return FALSE;
     }
 
@@ -1621,6 +2193,8 @@ bus_context_check_security_policy (BusContext     *context,
                                   dest ? dest : DBUS_SERVICE_DBUS,
                                   proposed_recipient_loginfo);
       _dbus_verbose ("security policy disallowing message due to recipient policy\n");
+      if (sender != NULL && addressed_recipient == proposed_recipient)
+        bus_connection_count_policy_denial (sender);
       return FALSE;
     }
 
@@ -1635,6 +2209,8 @@ bus_context_check_security_policy (BusContext     *context,
                                      bus_connection_get_name (proposed_recipient) :
                                      DBUS_SERVICE_DBUS));
       _dbus_verbose ("security policy disallowing message due to full message queue\n");
+      _DBUS_PROBE3 (message__dropped, proposed_recipient, message,
+                    "queue full");
       return FALSE;
     }
 
@@ -1658,3 +2234,25 @@ bus_context_check_security_policy (BusContext     *context,
   _dbus_verbose ("security policy allowing message\n");
   return TRUE;
 }
+
+dbus_bool_t
+bus_context_check_security_policy (BusContext     *context,
+                                   BusTransaction *transaction,
+                                   DBusConnection *sender,
+                                   DBusConnection *addressed_recipient,
+                                   DBusConnection *proposed_recipient,
+                                   DBusMessage    *message,
+                                   DBusError      *error)
+{
+  DBusLatencyStart timing;
+  dbus_bool_t retval;
+
+  _dbus_latency_begin (&timing);
+  retval = check_security_policy_internal (context, transaction, sender,
+                                           addressed_recipient,
+                                           proposed_recipient,
+                                           message, error);
+  _dbus_latency_end (DBUS_LATENCY_POLICY, &timing);
+
+  return retval;
+}
@@ -31,6 +31,10 @@
 #include <dbus/dbus-sysdeps.h>
 
 typedef struct BusActivation    BusActivation;
+typedef struct BusBridges       BusBridges;
+typedef struct BusCapture       BusCapture;
+typedef struct BusValidator     BusValidator;
+typedef struct BusMetrics       BusMetrics;
 typedef struct BusConnections   BusConnections;
 typedef struct BusContext       BusContext;
 typedef struct BusPolicy        BusPolicy;
@@ -38,6 +42,7 @@ typedef struct BusClientPolicy  BusClientPolicy;
 typedef struct BusPolicyRule    BusPolicyRule;
 typedef struct BusRegistry      BusRegistry;
 typedef struct BusSELinuxID     BusSELinuxID;
+typedef struct BusSELinuxSendCache BusSELinuxSendCache;
 typedef struct BusService       BusService;
 typedef struct BusOwner		BusOwner;
 typedef struct BusTransaction   BusTransaction;
@@ -58,10 +63,21 @@ typedef struct
   int max_incomplete_connections;   /**< Max number of incomplete connections */
   int max_connections_per_user;     /**< Max number of connections auth'd as same user */
   int max_pending_activations;      /**< Max number of pending activations for the entire bus */
+  int boot_profile_window;          /**< Milliseconds after startup recorded in the boot profile */
   int max_services_per_connection;  /**< Max number of owned services for a single connection */
   int max_match_rules_per_connection; /**< Max number of match rules for a single connection */
   int max_replies_per_connection;     /**< Max number of replies that can be pending for each connection */
   int reply_timeout;                  /**< How long to wait before timing out a reply */
+  int dispatch_quantum;               /**< Max messages dispatched from a connection before the next one's turn, 0 for no limit */
+  long coalesce_threshold;            /**< Outgoing bytes queued for a connection before <coalesce> signals to it replace older ones */
+  int reload_delay;                   /**< Milliseconds without further reload requests before the config is reloaded */
+  int mapped_buffer_threshold;        /**< Buffers at least this big are mapped rather than malloced, 0 for never */
+  int validation_threads;             /**< Threads to validate huge message bodies on, 0 for none */
+  long offloaded_validation_size;     /**< Message bodies at least this big are validated on those threads */
+  int max_messages_per_second;        /**< Messages a connection may send each second on average, 0 for no limit */
+  long max_bytes_per_second;          /**< Bytes a connection may send each second on average, 0 for no limit */
+  int max_messages_per_second_per_user; /**< Same, for all of a user's connections together */
+  long max_bytes_per_second_per_user;   /**< Same, for all of a user's connections together */
 } BusLimits;
 
 typedef enum
@@ -71,6 +87,22 @@ typedef enum
   FORK_NEVER
 } ForceForkSetting;
 
+/* What the last startup or reload spent its time on; phases nest the
+ * same way the functions do, and a reload leaves the startup-only
+ * ones at zero.
+ */
+typedef enum
+{
+  BUS_PHASE_PARSE,         /**< bus_config_load(), which also builds the policy */
+  BUS_PHASE_FIRST_TIME,    /**< process_config_first_time_only() */
+  BUS_PHASE_LISTEN,        /**< setting up the sockets, within the above */
+  BUS_PHASE_EVERY_TIME,    /**< process_config_every_time() */
+  BUS_PHASE_ACTIVATION,    /**< reading service files, within the above */
+  BUS_PHASE_POSTINIT,      /**< process_config_postinit() */
+  BUS_PHASE_TOTAL,         /**< bus_context_new() or the reload as a whole */
+  BUS_N_PHASES
+} BusPhase;
+
 BusContext*       bus_context_new                                (const DBusString *config_file,
                                                                   ForceForkSetting  force_fork,
                                                                   DBusPipe         *print_addr_pipe,
@@ -78,6 +110,10 @@ BusContext*       bus_context_new                                (const DBusStri
                                                                   const DBusString *address,
                                                                   dbus_bool_t      systemd_activation,
                                                                   DBusError        *error);
+dbus_bool_t       bus_context_restart                            (BusContext       *context,
+                                                                  const char       *path,
+                                                                  char            **argv,
+                                                                  DBusError        *error);
 dbus_bool_t       bus_context_reload_config                      (BusContext       *context,
 								  DBusError        *error);
 void              bus_context_shutdown                           (BusContext       *context);
@@ -93,7 +129,12 @@ BusRegistry*      bus_context_get_registry                       (BusContext
 BusConnections*   bus_context_get_connections                    (BusContext       *context);
 BusActivation*    bus_context_get_activation                     (BusContext       *context);
 BusMatchmaker*    bus_context_get_matchmaker                     (BusContext       *context);
+BusCapture*       bus_context_get_capture                        (BusContext       *context);
+void              bus_context_set_capture                        (BusContext       *context,
+                                                                  BusCapture       *capture);
+BusBridges*       bus_context_get_bridges                        (BusContext       *context);
 DBusLoop*         bus_context_get_loop                           (BusContext       *context);
+BusValidator*     bus_context_get_validator                      (BusContext       *context);
 dbus_bool_t       bus_context_allow_unix_user                    (BusContext       *context,
                                                                   unsigned long     uid);
 dbus_bool_t       bus_context_allow_windows_user                 (BusContext       *context,
@@ -112,7 +153,25 @@ int               bus_context_get_max_pending_activations        (BusContext
 int               bus_context_get_max_services_per_connection    (BusContext       *context);
 int               bus_context_get_max_match_rules_per_connection (BusContext       *context);
 int               bus_context_get_max_replies_per_connection     (BusContext       *context);
+long              bus_context_get_max_incoming_bytes             (BusContext       *context);
+long              bus_context_get_max_outgoing_bytes             (BusContext       *context);
 int               bus_context_get_reply_timeout                  (BusContext       *context);
+int               bus_context_get_dispatch_quantum               (BusContext       *context);
+int               bus_context_get_max_messages_per_second        (BusContext       *context);
+long              bus_context_get_max_bytes_per_second           (BusContext       *context);
+int               bus_context_get_max_messages_per_second_per_user (BusContext     *context);
+long              bus_context_get_max_bytes_per_second_per_user  (BusContext       *context);
+long              bus_context_get_coalesce_threshold             (BusContext       *context);
+int               bus_context_get_reload_delay                   (BusContext       *context);
+long              bus_context_get_phase_usec                     (BusContext       *context,
+                                                                  BusPhase          phase);
+dbus_bool_t       bus_context_get_phases_are_reload              (BusContext       *context);
+const char*       bus_phase_name                                 (BusPhase          phase);
+dbus_bool_t       bus_context_get_realtime                       (BusContext       *context,
+                                                                  int              *priority,
+                                                                  long             *reserve);
+dbus_bool_t       bus_context_get_signal_coalesces               (BusContext       *context,
+                                                                  DBusMessage      *message);
 void              bus_context_log                                (BusContext       *context,
                                                                   DBusSystemLogSeverity severity,
                                                                   const char       *msg,
@@ -0,0 +1,497 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* capture.c  Binary capture of the messages the bus routes
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "capture.h"
+#include "signals.h"
+#include "utils.h"
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-watch.h>
+#ifndef DBUS_WIN
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
+
+/* The capture is a pcap file, so that existing tools can read it:
+ * a file header, then per message a record header followed by the
+ * message exactly as it goes over the wire.
+ */
+#define PCAP_MAGIC         0xa1b2c3d4u
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+#define PCAP_LINKTYPE_DBUS 231
+
+/* Messages queue up here while the reader catches up; past this,
+ * they're counted as dropped rather than slowing down the bus.
+ */
+#define MAX_CAPTURE_BUFFERED (4 * 1024 * 1024)
+
+#ifndef DBUS_WIN
+
+struct BusCapture
+{
+  BusContext *context;
+  int fd;                     /**< -1 once the reader has gone away */
+  DBusWatch *watch;
+  dbus_bool_t watch_added;    /**< only watched while there's data to write */
+  DBusString buffer;
+  DBusList *rules;            /**< BusMatchRule, any of which selects a message */
+  dbus_uint64_t n_captured;
+  dbus_uint64_t n_dropped;
+};
+
+static dbus_bool_t
+append_uint32 (DBusString    *str,
+               dbus_uint32_t  value)
+{
+  return _dbus_string_append_len (str, (const char *) &value, sizeof (value));
+}
+
+static dbus_bool_t
+append_uint16 (DBusString    *str,
+               dbus_uint16_t  value)
+{
+  return _dbus_string_append_len (str, (const char *) &value, sizeof (value));
+}
+
+static dbus_bool_t
+capture_watch_callback (DBusWatch    *watch,
+                        unsigned int  condition,
+                        void         *data)
+{
+  return dbus_watch_handle (watch, condition);
+}
+
+static void
+capture_start_watching (BusCapture *capture)
+{
+  /* on OOM the data just waits for the next message to try again */
+  if (!capture->watch_added &&
+      _dbus_loop_add_watch (bus_context_get_loop (capture->context),
+                            capture->watch, capture_watch_callback,
+                            NULL, NULL))
+    capture->watch_added = TRUE;
+}
+
+static void
+capture_stop_watching (BusCapture *capture)
+{
+  if (capture->watch_added)
+    {
+      _dbus_loop_remove_watch (bus_context_get_loop (capture->context),
+                               capture->watch, capture_watch_callback, NULL);
+      capture->watch_added = FALSE;
+    }
+}
+
+static void
+capture_close (BusCapture *capture)
+{
+  if (capture->fd < 0)
+    return;
+
+  capture_stop_watching (capture);
+
+  _dbus_close (capture->fd, NULL);
+  capture->fd = -1;
+
+  if (capture->watch != NULL)
+    bus_context_log (capture->context, DBUS_SYSTEM_LOG_INFO,
+                     "Message capture stopped after %lu messages, %lu dropped",
+                     (unsigned long) capture->n_captured,
+                     (unsigned long) capture->n_dropped);
+}
+
+static dbus_bool_t
+capture_handle_watch (DBusWatch    *watch,
+                      unsigned int  flags,
+                      void         *data)
+{
+  BusCapture *capture = data;
+  int written;
+
+  if (capture->fd < 0)
+    return TRUE;
+
+  if (flags & (DBUS_WATCH_ERROR | DBUS_WATCH_HANGUP))
+    {
+      capture_close (capture);
+      return TRUE;
+    }
+
+  written = _dbus_write (capture->fd, &capture->buffer, 0,
+                         _dbus_string_get_length (&capture->buffer));
+
+  if (written < 0)
+    {
+      if (!_dbus_get_is_errno_eagain_or_ewouldblock ())
+        capture_close (capture);
+      return TRUE;
+    }
+
+  _dbus_string_delete (&capture->buffer, 0, written);
+
+  if (_dbus_string_get_length (&capture->buffer) == 0)
+    capture_stop_watching (capture);
+
+  return TRUE;
+}
+
+/* Takes ownership of fd and of the rules, even on failure */
+BusCapture*
+bus_capture_new (BusContext  *context,
+                 int          fd,
+                 DBusList   **rules,
+                 DBusError   *error)
+{
+  BusCapture *capture;
+
+  capture = dbus_new0 (BusCapture, 1);
+  if (capture == NULL)
+    goto oom;
+
+  capture->context = context;
+  capture->fd = fd;
+  capture->rules = *rules;
+  *rules = NULL;
+
+  if (!_dbus_string_init (&capture->buffer))
+    {
+      *rules = capture->rules;
+      dbus_free (capture);
+      capture = NULL;
+      goto oom;
+    }
+
+  if (!_dbus_set_fd_nonblocking (fd, error))
+    {
+      bus_capture_free (capture);
+      return NULL;
+    }
+
+  capture->watch = _dbus_watch_new (fd, DBUS_WATCH_WRITABLE, TRUE,
+                                    capture_handle_watch, capture, NULL);
+  if (capture->watch == NULL)
+    goto oom;
+
+  if (!append_uint32 (&capture->buffer, PCAP_MAGIC) ||
+      !append_uint16 (&capture->buffer, PCAP_VERSION_MAJOR) ||
+      !append_uint16 (&capture->buffer, PCAP_VERSION_MINOR) ||
+      !append_uint32 (&capture->buffer, 0) || /* UTC */
+      !append_uint32 (&capture->buffer, 0) || /* timestamp accuracy */
+      !append_uint32 (&capture->buffer, DBUS_MAXIMUM_MESSAGE_LENGTH) ||
+      !append_uint32 (&capture->buffer, PCAP_LINKTYPE_DBUS))
+    goto oom;
+
+  capture_start_watching (capture);
+
+  return capture;
+
+ oom:
+  if (capture != NULL)
+    bus_capture_free (capture);
+  else
+    {
+      while (*rules != NULL)
+        bus_match_rule_unref (_dbus_list_pop_first (rules));
+      _dbus_close (fd, NULL);
+    }
+
+  BUS_SET_OOM (error);
+  return NULL;
+}
+
+void
+bus_capture_free (BusCapture *capture)
+{
+  capture_close (capture);
+
+  if (capture->watch != NULL)
+    {
+      _dbus_watch_invalidate (capture->watch);
+      _dbus_watch_unref (capture->watch);
+    }
+
+  while (capture->rules != NULL)
+    bus_match_rule_unref (_dbus_list_pop_first (&capture->rules));
+
+  _dbus_string_free (&capture->buffer);
+  dbus_free (capture);
+}
+
+static dbus_bool_t
+capture_wants (BusCapture     *capture,
+               DBusConnection *sender,
+               DBusConnection *addressed_recipient,
+               DBusMessage    *message)
+{
+  DBusList *link;
+
+  if (capture->rules == NULL)
+    return TRUE;
+
+  for (link = _dbus_list_get_first_link (&capture->rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (&capture->rules, link))
+    {
+      if (bus_match_rule_matches_message (link->data, sender,
+                                          addressed_recipient, message))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Never fails: a message that can't be captured is counted as dropped */
+void
+bus_capture_message (BusCapture     *capture,
+                     DBusConnection *sender,
+                     DBusConnection *addressed_recipient,
+                     DBusMessage    *message)
+{
+  const DBusString *header;
+  const DBusString *body;
+  const DBusString *tail;
+  long tv_sec, tv_usec;
+  int start;
+  dbus_uint32_t size;
+
+  if (capture->fd < 0 ||
+      !capture_wants (capture, sender, addressed_recipient, message))
+    return;
+
+  _dbus_message_get_network_data (message, &header, &body, &tail);
+  size = _dbus_message_get_size (message);
+
+  start = _dbus_string_get_length (&capture->buffer);
+
+  if (start + 16 + size > MAX_CAPTURE_BUFFERED)
+    {
+      capture->n_dropped += 1;
+      return;
+    }
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  if (!append_uint32 (&capture->buffer, tv_sec) ||
+      !append_uint32 (&capture->buffer, tv_usec) ||
+      !append_uint32 (&capture->buffer, size) ||
+      !append_uint32 (&capture->buffer, size) ||
+      !_dbus_string_copy (header, 0, &capture->buffer,
+                          _dbus_string_get_length (&capture->buffer)) ||
+      !_dbus_string_copy (body, 0, &capture->buffer,
+                          _dbus_string_get_length (&capture->buffer)) ||
+      !_dbus_string_copy (tail, 0, &capture->buffer,
+                          _dbus_string_get_length (&capture->buffer)))
+    {
+      _dbus_string_set_length (&capture->buffer, start);
+      capture->n_dropped += 1;
+      return;
+    }
+
+  capture->n_captured += 1;
+  capture_start_watching (capture);
+}
+
+#else /* DBUS_WIN */
+
+/* There's no Unix fd to write to, so StartCapture never gets this far */
+
+BusCapture*
+bus_capture_new (BusContext  *context,
+                 int          fd,
+                 DBusList   **rules,
+                 DBusError   *error)
+{
+  while (*rules != NULL)
+    bus_match_rule_unref (_dbus_list_pop_first (rules));
+
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Message capture is not supported on this platform");
+  return NULL;
+}
+
+void
+bus_capture_free (BusCapture *capture)
+{
+  _dbus_assert_not_reached ("no captures on this platform");
+}
+
+void
+bus_capture_message (BusCapture     *capture,
+                     DBusConnection *sender,
+                     DBusConnection *addressed_recipient,
+                     DBusMessage    *message)
+{
+}
+
+#endif /* DBUS_WIN */
+
+/* Everything on the bus goes through a capture, so only the user the
+ * bus runs as (or root) may start one
+ */
+static dbus_bool_t
+check_capture_allowed (DBusConnection *connection,
+                       DBusError      *error)
+{
+  unsigned long uid;
+
+  if (dbus_connection_get_unix_user (connection, &uid) &&
+      (uid == 0 || _dbus_unix_user_is_process_owner (uid)))
+    return TRUE;
+
+  dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                  "Only the bus owner or root may capture messages");
+  return FALSE;
+}
+
+static dbus_bool_t
+send_empty_reply (DBusConnection *connection,
+                  BusTransaction *transaction,
+                  DBusMessage    *message,
+                  DBusError      *error)
+{
+  DBusMessage *reply;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    {
+      BUS_SET_OOM (error);
+      dbus_message_unref (reply);
+      return FALSE;
+    }
+
+  dbus_message_unref (reply);
+  return TRUE;
+}
+
+/* StartCapture (h fd, as rules): writes a pcap stream of every message
+ * matching any of the rules (or every message, if there are none) to
+ * fd until it's closed or StopCapture is called. Replaces any capture
+ * already running.
+ */
+dbus_bool_t
+bus_capture_handle_start (DBusConnection *connection,
+                          BusTransaction *transaction,
+                          DBusMessage    *message,
+                          DBusError      *error)
+{
+  BusContext *context;
+  BusCapture *capture;
+  DBusList *rules;
+  char **texts;
+  int n_texts;
+  int fd;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  rules = NULL;
+  texts = NULL;
+  fd = -1;
+
+  if (!check_capture_allowed (connection, error))
+    return FALSE;
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_UNIX_FD, &fd,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &texts, &n_texts,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  for (i = 0; i < n_texts; i++)
+    {
+      DBusString str;
+      BusMatchRule *rule;
+
+      _dbus_string_init_const (&str, texts[i]);
+
+      rule = bus_match_rule_parse (connection, &str, error);
+      if (rule == NULL)
+        goto failed;
+
+      if (!_dbus_list_append (&rules, rule))
+        {
+          bus_match_rule_unref (rule);
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
+  dbus_free_string_array (texts);
+  texts = NULL;
+
+  context = bus_transaction_get_context (transaction);
+
+  capture = bus_capture_new (context, fd, &rules, error);
+  if (capture == NULL)
+    return FALSE;
+
+  if (!send_empty_reply (connection, transaction, message, error))
+    {
+      bus_capture_free (capture);
+      return FALSE;
+    }
+
+  bus_context_set_capture (context, capture);
+
+  return TRUE;
+
+ failed:
+  dbus_free_string_array (texts);
+  while (rules != NULL)
+    bus_match_rule_unref (_dbus_list_pop_first (&rules));
+#ifndef DBUS_WIN
+  if (fd >= 0)
+    _dbus_close (fd, NULL);
+#endif
+  return FALSE;
+}
+
+dbus_bool_t
+bus_capture_handle_stop (DBusConnection *connection,
+                         BusTransaction *transaction,
+                         DBusMessage    *message,
+                         DBusError      *error)
+{
+  BusContext *context;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!check_capture_allowed (connection, error))
+    return FALSE;
+
+  if (!send_empty_reply (connection, transaction, message, error))
+    return FALSE;
+
+  context = bus_transaction_get_context (transaction);
+  bus_context_set_capture (context, NULL);
+
+  return TRUE;
+}
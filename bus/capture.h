@@ -0,0 +1,49 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* capture.h  Binary capture of the messages the bus routes
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_CAPTURE_H
+#define BUS_CAPTURE_H
+
+#include <dbus/dbus.h>
+#include "connection.h"
+
+#define BUS_INTERFACE_CAPTURE "org.freedesktop.DBus.Debug.Capture"
+
+BusCapture* bus_capture_new     (BusContext     *context,
+                                 int             fd,
+                                 DBusList      **rules,
+                                 DBusError      *error);
+void        bus_capture_free    (BusCapture     *capture);
+void        bus_capture_message (BusCapture     *capture,
+                                 DBusConnection *sender,
+                                 DBusConnection *addressed_recipient,
+                                 DBusMessage    *message);
+
+dbus_bool_t bus_capture_handle_start (DBusConnection *connection,
+                                      BusTransaction *transaction,
+                                      DBusMessage    *message,
+                                      DBusError      *error);
+dbus_bool_t bus_capture_handle_stop  (DBusConnection *connection,
+                                      BusTransaction *transaction,
+                                      DBusMessage    *message,
+                                      DBusError      *error);
+
+#endif /* BUS_CAPTURE_H */
@@ -79,6 +79,14 @@ bus_config_parser_element_name_to_type (const char *name)
     {
       return ELEMENT_SERVICEHELPER;
     }
+  else if (strcmp (name, "servicecache") == 0)
+    {
+      return ELEMENT_SERVICECACHE;
+    }
+  else if (strcmp (name, "bootprofile") == 0)
+    {
+      return ELEMENT_BOOTPROFILE;
+    }
   else if (strcmp (name, "includedir") == 0)
     {
       return ELEMENT_INCLUDEDIR;
@@ -127,6 +135,34 @@ bus_config_parser_element_name_to_type (const char *name)
     {
       return ELEMENT_ALLOW_ANONYMOUS;
     }
+  else if (strcmp (name, "coalesce") == 0)
+    {
+      return ELEMENT_COALESCE;
+    }
+  else if (strcmp (name, "activation_launcher") == 0)
+    {
+      return ELEMENT_ACTIVATION_LAUNCHER;
+    }
+  else if (strcmp (name, "latency_histograms") == 0)
+    {
+      return ELEMENT_LATENCY_HISTOGRAMS;
+    }
+  else if (strcmp (name, "bridge") == 0)
+    {
+      return ELEMENT_BRIDGE;
+    }
+  else if (strcmp (name, "cpu_affinity") == 0)
+    {
+      return ELEMENT_CPU_AFFINITY;
+    }
+  else if (strcmp (name, "realtime") == 0)
+    {
+      return ELEMENT_REALTIME;
+    }
+  else if (strcmp (name, "metrics_listen") == 0)
+    {
+      return ELEMENT_METRICS_LISTEN;
+    }
   return ELEMENT_NONE;
 }
 
@@ -167,6 +203,10 @@ bus_config_parser_element_type_to_name (ElementType type)
       return "servicedir";
     case ELEMENT_SERVICEHELPER:
       return "servicehelper";
+    case ELEMENT_SERVICECACHE:
+      return "servicecache";
+    case ELEMENT_BOOTPROFILE:
+      return "bootprofile";
     case ELEMENT_INCLUDEDIR:
       return "includedir";
     case ELEMENT_TYPE:
@@ -181,6 +221,20 @@ bus_config_parser_element_type_to_name (ElementType type)
       return "keep_umask";
     case ELEMENT_ALLOW_ANONYMOUS:
       return "allow_anonymous";
+    case ELEMENT_COALESCE:
+      return "coalesce";
+    case ELEMENT_ACTIVATION_LAUNCHER:
+      return "activation_launcher";
+    case ELEMENT_LATENCY_HISTOGRAMS:
+      return "latency_histograms";
+    case ELEMENT_BRIDGE:
+      return "bridge";
+    case ELEMENT_CPU_AFFINITY:
+      return "cpu_affinity";
+    case ELEMENT_REALTIME:
+      return "realtime";
+    case ELEMENT_METRICS_LISTEN:
+      return "metrics_listen";
     }
 
   _dbus_assert_not_reached ("bad element type");
@@ -40,6 +40,8 @@ typedef enum
   ELEMENT_PIDFILE,
   ELEMENT_SERVICEDIR,
   ELEMENT_SERVICEHELPER,
+  ELEMENT_SERVICECACHE,
+  ELEMENT_BOOTPROFILE,
   ELEMENT_INCLUDEDIR,
   ELEMENT_TYPE,
   ELEMENT_SELINUX,
@@ -48,7 +50,14 @@ typedef enum
   ELEMENT_STANDARD_SYSTEM_SERVICEDIRS,
   ELEMENT_KEEP_UMASK,
   ELEMENT_SYSLOG,
-  ELEMENT_ALLOW_ANONYMOUS
+  ELEMENT_ALLOW_ANONYMOUS,
+  ELEMENT_COALESCE,
+  ELEMENT_ACTIVATION_LAUNCHER,
+  ELEMENT_LATENCY_HISTOGRAMS,
+  ELEMENT_BRIDGE,
+  ELEMENT_CPU_AFFINITY,
+  ELEMENT_REALTIME,
+  ELEMENT_METRICS_LISTEN
 } ElementType;
 
 ElementType bus_config_parser_element_name_to_type (const char *element_name);
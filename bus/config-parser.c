@@ -27,9 +27,12 @@
 #include "test.h"
 #include "utils.h"
 #include "policy.h"
+#include "readahead.h"
+#include "intern.h"
 #include "selinux.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-marshal-validate.h>
 #include <string.h>
 
 typedef enum
@@ -70,6 +73,8 @@ typedef struct
     {
       char *name;
       long value;
+      PolicyType type;             /**< POLICY_DEFAULT unless user= or group= */
+      unsigned long gid_or_uid;
     } limit;
     
   } d;
@@ -91,6 +96,10 @@ struct BusConfigParser
 
   char *servicehelper; /**< location of the setuid helper */
 
+  char *servicecache; /**< where parsed .service files are cached, or NULL */
+
+  char *bootprofile; /**< where services asked for at startup are recorded, or NULL */
+
   char *bus_type;          /**< Message bus type */
   
   DBusList *listen_on; /**< List of addresses to listen to */
@@ -101,12 +110,23 @@ struct BusConfigParser
 
   DBusList *conf_dirs;   /**< Directories to look for policy configuration in */
 
+  DBusList *coalesced_signals; /**< Signals to coalesce, "interface" or "interface member" */
+
+  DBusList *bridges;     /**< Addresses of peer buses to bridge signals to */
+
   BusPolicy *policy;     /**< Security policy */
 
   BusLimits limits;      /**< Limits */
 
   char *pidfile;         /**< PID file */
 
+  char *metrics_listen;  /**< Address to serve OpenMetrics text on, or NULL */
+
+  DBusList *cpu_affinity; /**< CPUs to run on, as _DBUS_INT_TO_POINTER() */
+
+  int realtime_priority;  /**< SCHED_FIFO priority for <realtime>, or 0 */
+  long realtime_reserve;  /**< Bytes of heap to prefault for <realtime> */
+
   DBusList *included_files;  /**< Included files stack */
 
   DBusHashTable *service_context_table; /**< Map service names to SELinux contexts */
@@ -115,6 +135,9 @@ struct BusConfigParser
 
   unsigned int syslog : 1; /**< TRUE to enable syslog */
   unsigned int keep_umask : 1; /**< TRUE to keep original umask when forking */
+  unsigned int activation_launcher : 1; /**< TRUE to spawn activated services from a pre-forked launcher */
+  unsigned int latency_histograms : 1; /**< TRUE to time each stage of message handling */
+  unsigned int realtime : 1; /**< TRUE to lock memory and optionally use real-time scheduling */
 
   unsigned int is_toplevel : 1; /**< FALSE if we are a sub-config-file inside another one */
 
@@ -316,12 +339,53 @@ merge_included (BusConfigParser *parser,
   if (included->keep_umask)
     parser->keep_umask = TRUE;
 
+  if (included->activation_launcher)
+    parser->activation_launcher = TRUE;
+
+  if (included->latency_histograms)
+    parser->latency_histograms = TRUE;
+
+  if (included->realtime)
+    {
+      parser->realtime = TRUE;
+      parser->realtime_priority = included->realtime_priority;
+      parser->realtime_reserve = included->realtime_reserve;
+    }
+
   if (included->pidfile != NULL)
     {
       dbus_free (parser->pidfile);
       parser->pidfile = included->pidfile;
       included->pidfile = NULL;
     }
+
+  if (included->metrics_listen != NULL)
+    {
+      dbus_free (parser->metrics_listen);
+      parser->metrics_listen = included->metrics_listen;
+      included->metrics_listen = NULL;
+    }
+
+  if (included->cpu_affinity != NULL)
+    {
+      _dbus_list_clear (&parser->cpu_affinity);
+      parser->cpu_affinity = included->cpu_affinity;
+      included->cpu_affinity = NULL;
+    }
+
+  if (included->servicecache != NULL)
+    {
+      dbus_free (parser->servicecache);
+      parser->servicecache = included->servicecache;
+      included->servicecache = NULL;
+    }
+
+  if (included->bootprofile != NULL)
+    {
+      dbus_free (parser->bootprofile);
+      parser->bootprofile = included->bootprofile;
+      included->bootprofile = NULL;
+    }
   
   while ((link = _dbus_list_pop_first_link (&included->listen_on)))
     _dbus_list_append_link (&parser->listen_on, link);
@@ -334,6 +398,12 @@ merge_included (BusConfigParser *parser,
 
   while ((link = _dbus_list_pop_first_link (&included->conf_dirs)))
     _dbus_list_append_link (&parser->conf_dirs, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->coalesced_signals)))
+    _dbus_list_append_link (&parser->coalesced_signals, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->bridges)))
+    _dbus_list_append_link (&parser->bridges, link);
   
   return TRUE;
 }
@@ -375,7 +445,9 @@ bus_config_parser_new (const DBusString      *basedir,
       return NULL;
     }
 
-  if (((parser->policy = bus_policy_new ()) == NULL) ||
+  /* an included file's rules are allocated along with its parent's */
+  if (((parser->policy =
+        bus_policy_new (parent ? parent->policy : NULL)) == NULL) ||
       !_dbus_string_copy (basedir, 0, &parser->basedir, 0) ||
       ((parser->service_context_table = _dbus_hash_table_new (DBUS_HASH_STRING,
 							      dbus_free,
@@ -438,6 +510,7 @@ bus_config_parser_new (const DBusString      *basedir,
       parser->limits.max_completed_connections = 2048;
       
       parser->limits.max_pending_activations = 512;
+      parser->limits.boot_profile_window = 30000; /* 30 seconds */
       parser->limits.max_services_per_connection = 512;
 
       /* For this one, keep in mind that it isn't only the memory used
@@ -456,6 +529,36 @@ bus_config_parser_new (const DBusString      *basedir,
        * that require a reply
        */
       parser->limits.max_replies_per_connection = 1024*8;
+
+      /* messages dispatched from one connection before the next
+       * connection with incoming messages gets a turn
+       */
+      parser->limits.dispatch_quantum = 32;
+
+      /* only coalesce signals for recipients that have fallen this
+       * far behind
+       */
+      parser->limits.coalesce_threshold = _DBUS_ONE_MEGABYTE;
+
+      /* a package install drops many config files in a row; wait for
+       * them to settle so it costs one reload rather than dozens
+       */
+      parser->limits.reload_delay = 250; /* 0.25 seconds */
+
+      /* keep big buffers on the heap unless asked otherwise */
+      parser->limits.mapped_buffer_threshold = 0;
+
+      /* a body this big takes long enough to walk that other
+       * connections would notice the main loop doing it
+       */
+      parser->limits.validation_threads = 2;
+      parser->limits.offloaded_validation_size = _DBUS_ONE_MEGABYTE;
+
+      /* nobody is held back for sending quickly unless asked */
+      parser->limits.max_messages_per_second = 0;
+      parser->limits.max_bytes_per_second = 0;
+      parser->limits.max_messages_per_second_per_user = 0;
+      parser->limits.max_bytes_per_second_per_user = 0;
     }
       
   parser->refcount = 1;
@@ -487,8 +590,13 @@ bus_config_parser_unref (BusConfigParser *parser)
 
       dbus_free (parser->user);
       dbus_free (parser->servicehelper);
+      dbus_free (parser->servicecache);
+      dbus_free (parser->bootprofile);
       dbus_free (parser->bus_type);
       dbus_free (parser->pidfile);
+      dbus_free (parser->metrics_listen);
+
+      _dbus_list_clear (&parser->cpu_affinity);
       
       _dbus_list_foreach (&parser->listen_on,
                           (DBusForeachFunction) dbus_free,
@@ -513,6 +621,18 @@ bus_config_parser_unref (BusConfigParser *parser)
                           NULL);
 
       _dbus_list_clear (&parser->mechanisms);
+
+      _dbus_list_foreach (&parser->coalesced_signals,
+                          (DBusForeachFunction) dbus_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->coalesced_signals);
+
+      _dbus_list_foreach (&parser->bridges,
+                          (DBusForeachFunction) dbus_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->bridges);
       
       _dbus_string_free (&parser->basedir);
 
@@ -665,6 +785,37 @@ check_no_attributes (BusConfigParser  *parser,
   return TRUE;
 }
 
+/* Largest SCHED_FIFO priority and heap reserve <realtime> accepts */
+#define MAXIMUM_REALTIME_PRIORITY 99
+#define MAXIMUM_REALTIME_RESERVE (1024 * 1024 * 1024)
+
+static dbus_bool_t
+parse_long_attribute (const char  *element_name,
+                      const char  *attribute_name,
+                      const char  *value,
+                      long         min,
+                      long         max,
+                      long        *result,
+                      DBusError   *error)
+{
+  DBusString str;
+  int end;
+
+  _dbus_string_init_const (&str, value);
+
+  if (!_dbus_string_parse_int (&str, 0, result, &end) ||
+      end != _dbus_string_get_length (&str) ||
+      *result < min || *result > max)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "\"%s\" attribute on <%s> element must be an integer from %ld to %ld",
+                      attribute_name, element_name, min, max);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static dbus_bool_t
 start_busconfig_child (BusConfigParser   *parser,
                        const char        *element_name,
@@ -745,6 +896,36 @@ start_busconfig_child (BusConfigParser   *parser,
 
       parser->keep_umask = TRUE;
       
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_ACTIVATION_LAUNCHER)
+    {
+      if (!check_no_attributes (parser, "activation_launcher", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_ACTIVATION_LAUNCHER) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      parser->activation_launcher = TRUE;
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_LATENCY_HISTOGRAMS)
+    {
+      if (!check_no_attributes (parser, "latency_histograms", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_LATENCY_HISTOGRAMS) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      parser->latency_histograms = TRUE;
+
       return TRUE;
     }
   else if (element_type == ELEMENT_PIDFILE)
@@ -758,6 +939,74 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
 
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_METRICS_LISTEN)
+    {
+      if (!check_no_attributes (parser, "metrics_listen", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_METRICS_LISTEN) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_REALTIME)
+    {
+      const char *priority;
+      const char *reserve;
+      long priority_value;
+      long reserve_value;
+
+      if (!locate_attributes (parser, "realtime",
+                              attribute_names,
+                              attribute_values,
+                              error,
+                              "priority", &priority,
+                              "reserve", &reserve,
+                              NULL))
+        return FALSE;
+
+      priority_value = 0;
+      if (priority != NULL &&
+          !parse_long_attribute ("realtime", "priority", priority,
+                                 1, MAXIMUM_REALTIME_PRIORITY,
+                                 &priority_value, error))
+        return FALSE;
+
+      reserve_value = 0;
+      if (reserve != NULL &&
+          !parse_long_attribute ("realtime", "reserve", reserve,
+                                 0, MAXIMUM_REALTIME_RESERVE,
+                                 &reserve_value, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_REALTIME) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      parser->realtime = TRUE;
+      parser->realtime_priority = priority_value;
+      parser->realtime_reserve = reserve_value;
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_CPU_AFFINITY)
+    {
+      if (!check_no_attributes (parser, "cpu_affinity", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_CPU_AFFINITY) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
       return TRUE;
     }
   else if (element_type == ELEMENT_LISTEN)
@@ -771,6 +1020,19 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
 
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_BRIDGE)
+    {
+      if (!check_no_attributes (parser, "bridge", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_BRIDGE) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
       return TRUE;
     }
   else if (element_type == ELEMENT_AUTH)
@@ -797,6 +1059,32 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
 
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_SERVICECACHE)
+    {
+      if (!check_no_attributes (parser, "servicecache", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_SERVICECACHE) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_BOOTPROFILE)
+    {
+      if (!check_no_attributes (parser, "bootprofile", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_BOOTPROFILE) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
       return TRUE;
     }
   else if (element_type == ELEMENT_INCLUDEDIR)
@@ -878,6 +1166,84 @@ start_busconfig_child (BusConfigParser   *parser,
       parser->allow_anonymous = TRUE;
       return TRUE;
     }
+  else if (element_type == ELEMENT_COALESCE)
+    {
+      const char *interface;
+      const char *member;
+      DBusString key;
+      char *s;
+
+      if (!locate_attributes (parser, "coalesce",
+                              attribute_names,
+                              attribute_values,
+                              error,
+                              "interface", &interface,
+                              "member", &member,
+                              NULL))
+        return FALSE;
+
+      if (interface == NULL)
+        {
+          dbus_set_error (error, DBUS_ERROR_FAILED,
+                          "<coalesce> element must have an \"interface\" attribute");
+          return FALSE;
+        }
+
+      _dbus_string_init_const (&key, interface);
+      if (!_dbus_validate_interface (&key, 0, _dbus_string_get_length (&key)))
+        {
+          dbus_set_error (error, DBUS_ERROR_FAILED,
+                          "\"%s\" is not a valid interface name in <coalesce>",
+                          interface);
+          return FALSE;
+        }
+
+      if (member != NULL)
+        {
+          _dbus_string_init_const (&key, member);
+          if (!_dbus_validate_member (&key, 0, _dbus_string_get_length (&key)))
+            {
+              dbus_set_error (error, DBUS_ERROR_FAILED,
+                              "\"%s\" is not a valid member name in <coalesce>",
+                              member);
+              return FALSE;
+            }
+        }
+
+      if (push_element (parser, ELEMENT_COALESCE) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      if (!_dbus_string_init (&key))
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      if (!_dbus_string_append (&key, interface) ||
+          (member != NULL &&
+           (!_dbus_string_append_byte (&key, ' ') ||
+            !_dbus_string_append (&key, member))) ||
+          !_dbus_string_steal_data (&key, &s))
+        {
+          _dbus_string_free (&key);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      _dbus_string_free (&key);
+
+      if (!_dbus_list_append (&parser->coalesced_signals, s))
+        {
+          dbus_free (s);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
   else if (element_type == ELEMENT_SERVICEDIR)
     {
       if (!check_no_attributes (parser, "servicedir", attribute_names, attribute_values, error))
@@ -1075,6 +1441,8 @@ start_busconfig_child (BusConfigParser   *parser,
     {
       Element *e;
       const char *name;
+      const char *user;
+      const char *group;
 
       if ((e = push_element (parser, ELEMENT_LIMIT)) == NULL)
         {
@@ -1087,6 +1455,8 @@ start_busconfig_child (BusConfigParser   *parser,
                               attribute_values,
                               error,
                               "name", &name,
+                              "user", &user,
+                              "group", &group,
                               NULL))
         return FALSE;
 
@@ -1097,6 +1467,46 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
 
+      if (user != NULL && group != NULL)
+        {
+          dbus_set_error (error, DBUS_ERROR_FAILED,
+                          "<limit> element can't have both \"user\" and \"group\" attributes");
+          return FALSE;
+        }
+
+      e->d.limit.type = POLICY_DEFAULT;
+
+      if (user != NULL)
+        {
+          DBusString username;
+          _dbus_string_init_const (&username, user);
+
+          if (_dbus_parse_unix_user_from_config (&username,
+                                                 &e->d.limit.gid_or_uid))
+            e->d.limit.type = POLICY_USER;
+          else
+            {
+              _dbus_warn ("Unknown username \"%s\" in message bus configuration file\n",
+                          user);
+              e->d.limit.type = POLICY_IGNORED;
+            }
+        }
+      else if (group != NULL)
+        {
+          DBusString group_name;
+          _dbus_string_init_const (&group_name, group);
+
+          if (_dbus_parse_unix_group_from_config (&group_name,
+                                                  &e->d.limit.gid_or_uid))
+            e->d.limit.type = POLICY_GROUP;
+          else
+            {
+              _dbus_warn ("Unknown group \"%s\" in message bus configuration file\n",
+                          group);
+              e->d.limit.type = POLICY_IGNORED;
+            }
+        }
+
       e->d.limit.name = _dbus_strdup (name);
       if (e->d.limit.name == NULL)
         {
@@ -1378,7 +1788,7 @@ append_rule_from_element (BusConfigParser   *parser,
           return FALSE;
         }
       
-      rule = bus_policy_rule_new (BUS_POLICY_RULE_SEND, allow); 
+      rule = bus_policy_new_rule (parser->policy, BUS_POLICY_RULE_SEND, allow); 
       if (rule == NULL)
         goto nomem;
       
@@ -1392,11 +1802,11 @@ append_rule_from_element (BusConfigParser   *parser,
         rule->d.send.requested_reply = (strcmp (send_requested_reply, "true") == 0);
 
       rule->d.send.message_type = message_type;
-      rule->d.send.path = _dbus_strdup (send_path);
-      rule->d.send.interface = _dbus_strdup (send_interface);
-      rule->d.send.member = _dbus_strdup (send_member);
-      rule->d.send.error = _dbus_strdup (send_error);
-      rule->d.send.destination = _dbus_strdup (send_destination);
+      rule->d.send.path = bus_intern_string (send_path);
+      rule->d.send.interface = bus_intern_string (send_interface);
+      rule->d.send.member = bus_intern_string (send_member);
+      rule->d.send.error = bus_intern_string (send_error);
+      rule->d.send.destination = bus_intern_string (send_destination);
       if (send_path && rule->d.send.path == NULL)
         goto nomem;
       if (send_interface && rule->d.send.interface == NULL)
@@ -1460,7 +1870,7 @@ append_rule_from_element (BusConfigParser   *parser,
           return FALSE;
         }
       
-      rule = bus_policy_rule_new (BUS_POLICY_RULE_RECEIVE, allow); 
+      rule = bus_policy_new_rule (parser->policy, BUS_POLICY_RULE_RECEIVE, allow); 
       if (rule == NULL)
         goto nomem;
 
@@ -1471,11 +1881,11 @@ append_rule_from_element (BusConfigParser   *parser,
         rule->d.receive.requested_reply = (strcmp (receive_requested_reply, "true") == 0);
       
       rule->d.receive.message_type = message_type;
-      rule->d.receive.path = _dbus_strdup (receive_path);
-      rule->d.receive.interface = _dbus_strdup (receive_interface);
-      rule->d.receive.member = _dbus_strdup (receive_member);
-      rule->d.receive.error = _dbus_strdup (receive_error);
-      rule->d.receive.origin = _dbus_strdup (receive_sender);
+      rule->d.receive.path = bus_intern_string (receive_path);
+      rule->d.receive.interface = bus_intern_string (receive_interface);
+      rule->d.receive.member = bus_intern_string (receive_member);
+      rule->d.receive.error = bus_intern_string (receive_error);
+      rule->d.receive.origin = bus_intern_string (receive_sender);
 
       if (receive_path && rule->d.receive.path == NULL)
         goto nomem;
@@ -1490,14 +1900,14 @@ append_rule_from_element (BusConfigParser   *parser,
     }
   else if (own)
     {
-      rule = bus_policy_rule_new (BUS_POLICY_RULE_OWN, allow); 
+      rule = bus_policy_new_rule (parser->policy, BUS_POLICY_RULE_OWN, allow); 
       if (rule == NULL)
         goto nomem;
 
       if (IS_WILDCARD (own))
         own = NULL;
       
-      rule->d.own.service_name = _dbus_strdup (own);
+      rule->d.own.service_name = bus_intern_string (own);
       if (own && rule->d.own.service_name == NULL)
         goto nomem;
     }
@@ -1505,7 +1915,7 @@ append_rule_from_element (BusConfigParser   *parser,
     {      
       if (IS_WILDCARD (user))
         {
-          rule = bus_policy_rule_new (BUS_POLICY_RULE_USER, allow); 
+          rule = bus_policy_new_rule (parser->policy, BUS_POLICY_RULE_USER, allow); 
           if (rule == NULL)
             goto nomem;
 
@@ -1520,7 +1930,7 @@ append_rule_from_element (BusConfigParser   *parser,
       
           if (_dbus_parse_unix_user_from_config (&username, &uid))
             {
-              rule = bus_policy_rule_new (BUS_POLICY_RULE_USER, allow); 
+              rule = bus_policy_new_rule (parser->policy, BUS_POLICY_RULE_USER, allow); 
               if (rule == NULL)
                 goto nomem;
 
@@ -1537,7 +1947,7 @@ append_rule_from_element (BusConfigParser   *parser,
     {
       if (IS_WILDCARD (group))
         {
-          rule = bus_policy_rule_new (BUS_POLICY_RULE_GROUP, allow); 
+          rule = bus_policy_new_rule (parser->policy, BUS_POLICY_RULE_GROUP, allow); 
           if (rule == NULL)
             goto nomem;
 
@@ -1552,7 +1962,7 @@ append_rule_from_element (BusConfigParser   *parser,
           
           if (_dbus_parse_unix_group_from_config (&groupname, &gid))
             {
-              rule = bus_policy_rule_new (BUS_POLICY_RULE_GROUP, allow); 
+              rule = bus_policy_new_rule (parser->policy, BUS_POLICY_RULE_GROUP, allow); 
               if (rule == NULL)
                 goto nomem;
 
@@ -1906,6 +2316,12 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_pending_activations = value;
     }
+  else if (strcmp (name, "boot_profile_window") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.boot_profile_window = value;
+    }
   else if (strcmp (name, "max_names_per_connection") == 0)
     {
       must_be_positive = TRUE;
@@ -1924,6 +2340,62 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_replies_per_connection = value;
     }
+  else if (strcmp (name, "coalesce_threshold") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.coalesce_threshold = value;
+    }
+  else if (strcmp (name, "dispatch_quantum") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.dispatch_quantum = value;
+    }
+  else if (strcmp (name, "reload_delay") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.reload_delay = value;
+    }
+  else if (strcmp (name, "mapped_buffer_threshold") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.mapped_buffer_threshold = value;
+    }
+  else if (strcmp (name, "validation_threads") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.validation_threads = value;
+    }
+  else if (strcmp (name, "offloaded_validation_size") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.offloaded_validation_size = value;
+    }
+  else if (strcmp (name, "max_messages_per_second") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_messages_per_second = value;
+    }
+  else if (strcmp (name, "max_bytes_per_second") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_bytes_per_second = value;
+    }
+  else if (strcmp (name, "max_messages_per_second_per_user") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_messages_per_second_per_user = value;
+    }
+  else if (strcmp (name, "max_bytes_per_second_per_user") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_bytes_per_second_per_user = value;
+    }
   else
     {
       dbus_set_error (error, DBUS_ERROR_FAILED,
@@ -1952,6 +2424,69 @@ set_limit (BusConfigParser *parser,
   return TRUE;  
 }
 
+/* <limit user="..."> or <limit group="...">; only the dispatch
+ * quantum can be set per user or group
+ */
+static dbus_bool_t
+set_user_or_group_limit (BusConfigParser *parser,
+                         Element         *e,
+                         DBusError       *error)
+{
+  if (strcmp (e->d.limit.name, "dispatch_quantum") != 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "<limit name=\"%s\"> can't be set for a user or group\n",
+                      e->d.limit.name);
+      return FALSE;
+    }
+
+  if (e->d.limit.value < 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "<limit name=\"%s\"> must be a positive number\n",
+                      e->d.limit.name);
+      return FALSE;
+    }
+
+  if (e->d.limit.value >= _DBUS_INT_MAX)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "<limit name=\"%s\"> value is too large\n",
+                      e->d.limit.name);
+      return FALSE;
+    }
+
+  switch (e->d.limit.type)
+    {
+    case POLICY_USER:
+      if (!bus_policy_set_user_dispatch_quantum (parser->policy,
+                                                 e->d.limit.gid_or_uid,
+                                                 e->d.limit.value))
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+      break;
+    case POLICY_GROUP:
+      if (!bus_policy_set_group_dispatch_quantum (parser->policy,
+                                                  e->d.limit.gid_or_uid,
+                                                  e->d.limit.value))
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+      break;
+    case POLICY_IGNORED:
+      /* unknown user or group, already warned about */
+      break;
+    default:
+      _dbus_assert_not_reached ("limit has no user or group");
+      break;
+    }
+
+  return TRUE;
+}
+
 dbus_bool_t
 bus_config_parser_end_element (BusConfigParser   *parser,
                                const char        *element_name,
@@ -2003,10 +2538,15 @@ bus_config_parser_end_element (BusConfigParser   *parser,
     case ELEMENT_USER:
     case ELEMENT_TYPE:
     case ELEMENT_LISTEN:
+    case ELEMENT_BRIDGE:
     case ELEMENT_PIDFILE:
+    case ELEMENT_METRICS_LISTEN:
+    case ELEMENT_CPU_AFFINITY:
     case ELEMENT_AUTH:
     case ELEMENT_SERVICEDIR:
     case ELEMENT_SERVICEHELPER:
+    case ELEMENT_SERVICECACHE:
+    case ELEMENT_BOOTPROFILE:
     case ELEMENT_INCLUDEDIR:
     case ELEMENT_LIMIT:
       if (!e->had_content)
@@ -2019,8 +2559,13 @@ bus_config_parser_end_element (BusConfigParser   *parser,
 
       if (e->type == ELEMENT_LIMIT)
         {
-          if (!set_limit (parser, e->d.limit.name, e->d.limit.value,
-                          error))
+          if (e->d.limit.type == POLICY_DEFAULT)
+            {
+              if (!set_limit (parser, e->d.limit.name, e->d.limit.value,
+                              error))
+                return FALSE;
+            }
+          else if (!set_user_or_group_limit (parser, e, error))
             return FALSE;
         }
       break;
@@ -2037,6 +2582,10 @@ bus_config_parser_end_element (BusConfigParser   *parser,
     case ELEMENT_STANDARD_SESSION_SERVICEDIRS:
     case ELEMENT_STANDARD_SYSTEM_SERVICEDIRS:
     case ELEMENT_ALLOW_ANONYMOUS:
+    case ELEMENT_COALESCE:
+    case ELEMENT_ACTIVATION_LAUNCHER:
+    case ELEMENT_LATENCY_HISTOGRAMS:
+    case ELEMENT_REALTIME:
       break;
     }
 
@@ -2055,6 +2604,77 @@ all_whitespace (const DBusString *str)
   return i == _dbus_string_get_length (str);
 }
 
+/* Largest CPU number <cpu_affinity> accepts */
+#define MAXIMUM_CPU_NUMBER 4095
+
+/* Replaces the CPU list with the one in content, such as "0-3,8" */
+static dbus_bool_t
+parse_cpu_list (BusConfigParser  *parser,
+                const DBusString *content,
+                DBusError        *error)
+{
+  DBusList *cpus;
+  int len;
+  int pos;
+
+  cpus = NULL;
+  len = _dbus_string_get_length (content);
+  pos = 0;
+
+  while (TRUE)
+    {
+      long first;
+      long last;
+      long cpu;
+      int end;
+
+      if (!_dbus_string_parse_int (content, pos, &first, &end) ||
+          first < 0 || first > MAXIMUM_CPU_NUMBER)
+        goto invalid;
+
+      last = first;
+      _dbus_string_skip_white (content, end, &pos);
+
+      if (pos < len && _dbus_string_get_byte (content, pos) == '-')
+        {
+          if (!_dbus_string_parse_int (content, pos + 1, &last, &end) ||
+              last < first || last > MAXIMUM_CPU_NUMBER)
+            goto invalid;
+
+          _dbus_string_skip_white (content, end, &pos);
+        }
+
+      for (cpu = first; cpu <= last; cpu++)
+        {
+          if (!_dbus_list_append (&cpus, _DBUS_INT_TO_POINTER (cpu)))
+            {
+              _dbus_list_clear (&cpus);
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+        }
+
+      if (pos == len)
+        break;
+
+      if (_dbus_string_get_byte (content, pos) != ',')
+        goto invalid;
+
+      pos++;
+    }
+
+  _dbus_list_clear (&parser->cpu_affinity);
+  parser->cpu_affinity = cpus;
+
+  return TRUE;
+
+ invalid:
+  _dbus_list_clear (&cpus);
+  dbus_set_error (error, DBUS_ERROR_FAILED,
+                  "<cpu_affinity> element has invalid value (expected CPU numbers or ranges such as \"0-3,8\")");
+  return FALSE;
+}
+
 static dbus_bool_t
 make_full_path (const DBusString *basedir,
                 const DBusString *filename,
@@ -2201,6 +2821,8 @@ include_dir (BusConfigParser   *parser,
     }
 
   retval = FALSE;
+
+  bus_readahead_directory (_dbus_string_get_const_data (dirname), ".conf");
   
   dir = _dbus_directory_open (dirname, error);
 
@@ -2323,6 +2945,10 @@ bus_config_parser_content (BusConfigParser   *parser,
     case ELEMENT_STANDARD_SESSION_SERVICEDIRS:    
     case ELEMENT_STANDARD_SYSTEM_SERVICEDIRS:    
     case ELEMENT_ALLOW_ANONYMOUS:
+    case ELEMENT_COALESCE:
+    case ELEMENT_ACTIVATION_LAUNCHER:
+    case ELEMENT_LATENCY_HISTOGRAMS:
+    case ELEMENT_REALTIME:
     case ELEMENT_SELINUX:
     case ELEMENT_ASSOCIATE:
       if (all_whitespace (content))
@@ -2349,6 +2975,29 @@ bus_config_parser_content (BusConfigParser   *parser,
       }
       break;
 
+    case ELEMENT_METRICS_LISTEN:
+      {
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_string_copy_data (content, &s))
+          goto nomem;
+
+        dbus_free (parser->metrics_listen);
+        parser->metrics_listen = s;
+      }
+      break;
+
+    case ELEMENT_CPU_AFFINITY:
+      {
+        e->had_content = TRUE;
+
+        if (!parse_cpu_list (parser, content, error))
+          return FALSE;
+      }
+      break;
+
     case ELEMENT_INCLUDE:
       {
         DBusString full_path, selinux_policy_root;
@@ -2396,6 +3045,54 @@ bus_config_parser_content (BusConfigParser   *parser,
       }
       break;
 
+    case ELEMENT_SERVICECACHE:
+      {
+        DBusString full_path;
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_string_init (&full_path))
+          goto nomem;
+
+        if (!make_full_path (&parser->basedir, content, &full_path) ||
+            !_dbus_string_steal_data (&full_path, &s))
+          {
+            _dbus_string_free (&full_path);
+            goto nomem;
+          }
+
+        _dbus_string_free (&full_path);
+
+        dbus_free (parser->servicecache);
+        parser->servicecache = s;
+      }
+      break;
+
+    case ELEMENT_BOOTPROFILE:
+      {
+        DBusString full_path;
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_string_init (&full_path))
+          goto nomem;
+
+        if (!make_full_path (&parser->basedir, content, &full_path) ||
+            !_dbus_string_steal_data (&full_path, &s))
+          {
+            _dbus_string_free (&full_path);
+            goto nomem;
+          }
+
+        _dbus_string_free (&full_path);
+
+        dbus_free (parser->bootprofile);
+        parser->bootprofile = s;
+      }
+      break;
+
     case ELEMENT_SERVICEHELPER:
       {
         DBusString full_path;
@@ -2492,6 +3189,23 @@ bus_config_parser_content (BusConfigParser   *parser,
       }
       break;
 
+    case ELEMENT_BRIDGE:
+      {
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_string_copy_data (content, &s))
+          goto nomem;
+
+        if (!_dbus_list_append (&parser->bridges, s))
+          {
+            dbus_free (s);
+            goto nomem;
+          }
+      }
+      break;
+
     case ELEMENT_AUTH:
       {
         char *s;
@@ -2637,6 +3351,24 @@ bus_config_parser_get_conf_dirs (BusConfigParser *parser)
   return &parser->conf_dirs;
 }
 
+DBusList**
+bus_config_parser_get_coalesced_signals (BusConfigParser *parser)
+{
+  return &parser->coalesced_signals;
+}
+
+DBusList**
+bus_config_parser_get_bridges (BusConfigParser *parser)
+{
+  return &parser->bridges;
+}
+
+DBusList**
+bus_config_parser_get_cpu_affinity (BusConfigParser *parser)
+{
+  return &parser->cpu_affinity;
+}
+
 dbus_bool_t
 bus_config_parser_get_fork (BusConfigParser   *parser)
 {
@@ -2655,6 +3387,28 @@ bus_config_parser_get_keep_umask (BusConfigParser   *parser)
   return parser->keep_umask;
 }
 
+dbus_bool_t
+bus_config_parser_get_activation_launcher (BusConfigParser   *parser)
+{
+  return parser->activation_launcher;
+}
+
+dbus_bool_t
+bus_config_parser_get_latency_histograms (BusConfigParser   *parser)
+{
+  return parser->latency_histograms;
+}
+
+dbus_bool_t
+bus_config_parser_get_realtime (BusConfigParser   *parser,
+                                int               *priority,
+                                long              *reserve)
+{
+  *priority = parser->realtime_priority;
+  *reserve = parser->realtime_reserve;
+  return parser->realtime;
+}
+
 dbus_bool_t
 bus_config_parser_get_allow_anonymous (BusConfigParser   *parser)
 {
@@ -2667,12 +3421,30 @@ bus_config_parser_get_pidfile (BusConfigParser   *parser)
   return parser->pidfile;
 }
 
+const char *
+bus_config_parser_get_metrics_listen (BusConfigParser *parser)
+{
+  return parser->metrics_listen;
+}
+
 const char *
 bus_config_parser_get_servicehelper (BusConfigParser   *parser)
 {
   return parser->servicehelper;
 }
 
+const char *
+bus_config_parser_get_servicecache (BusConfigParser   *parser)
+{
+  return parser->servicecache;
+}
+
+const char *
+bus_config_parser_get_bootprofile (BusConfigParser   *parser)
+{
+  return parser->bootprofile;
+}
+
 BusPolicy*
 bus_config_parser_steal_policy (BusConfigParser *parser)
 {
@@ -2999,6 +3771,27 @@ lists_of_c_strings_equal (DBusList *a,
   return ia == NULL && ib == NULL;
 }
 
+static dbus_bool_t
+lists_of_ints_equal (DBusList *a,
+                     DBusList *b)
+{
+  DBusList *ia;
+  DBusList *ib;
+
+  ia = a;
+  ib = b;
+
+  while (ia != NULL && ib != NULL)
+    {
+      if (ia->data != ib->data)
+        return FALSE;
+      ia = _dbus_list_get_next_link (&a, ia);
+      ib = _dbus_list_get_next_link (&b, ib);
+    }
+
+  return ia == NULL && ib == NULL;
+}
+
 static dbus_bool_t
 limits_equal (const BusLimits *a,
 	      const BusLimits *b)
@@ -3016,9 +3809,20 @@ limits_equal (const BusLimits *a,
      || a->max_incomplete_connections == b->max_incomplete_connections
      || a->max_connections_per_user == b->max_connections_per_user
      || a->max_pending_activations == b->max_pending_activations
+     || a->boot_profile_window == b->boot_profile_window
      || a->max_services_per_connection == b->max_services_per_connection
      || a->max_match_rules_per_connection == b->max_match_rules_per_connection
      || a->max_replies_per_connection == b->max_replies_per_connection
+     || a->dispatch_quantum == b->dispatch_quantum
+     || a->coalesce_threshold == b->coalesce_threshold
+     || a->reload_delay == b->reload_delay
+     || a->mapped_buffer_threshold == b->mapped_buffer_threshold
+     || a->validation_threads == b->validation_threads
+     || a->offloaded_validation_size == b->offloaded_validation_size
+     || a->max_messages_per_second == b->max_messages_per_second
+     || a->max_bytes_per_second == b->max_bytes_per_second
+     || a->max_messages_per_second_per_user == b->max_messages_per_second_per_user
+     || a->max_bytes_per_second_per_user == b->max_bytes_per_second_per_user
      || a->reply_timeout == b->reply_timeout);
 }
 
@@ -3043,6 +3847,15 @@ config_parsers_equal (const BusConfigParser *a,
 
   if (!lists_of_c_strings_equal (a->service_dirs, b->service_dirs))
     return FALSE;
+
+  if (!lists_of_c_strings_equal (a->coalesced_signals, b->coalesced_signals))
+    return FALSE;
+
+  if (!lists_of_c_strings_equal (a->bridges, b->bridges))
+    return FALSE;
+
+  if (!lists_of_ints_equal (a->cpu_affinity, b->cpu_affinity))
+    return FALSE;
   
   /* FIXME: compare policy */
 
@@ -3054,12 +3867,34 @@ config_parsers_equal (const BusConfigParser *a,
   if (!strings_equal_or_both_null (a->pidfile, b->pidfile))
     return FALSE;
 
+  if (!strings_equal_or_both_null (a->metrics_listen, b->metrics_listen))
+    return FALSE;
+
+  if (!strings_equal_or_both_null (a->servicecache, b->servicecache))
+    return FALSE;
+
+  if (!strings_equal_or_both_null (a->bootprofile, b->bootprofile))
+    return FALSE;
+
   if (! bools_equal (a->fork, b->fork))
     return FALSE;
 
   if (! bools_equal (a->keep_umask, b->keep_umask))
     return FALSE;
 
+  if (! bools_equal (a->activation_launcher, b->activation_launcher))
+    return FALSE;
+
+  if (! bools_equal (a->latency_histograms, b->latency_histograms))
+    return FALSE;
+
+  if (! bools_equal (a->realtime, b->realtime))
+    return FALSE;
+
+  if (a->realtime_priority != b->realtime_priority ||
+      a->realtime_reserve != b->realtime_reserve)
+    return FALSE;
+
   if (! bools_equal (a->is_toplevel, b->is_toplevel))
     return FALSE;
 
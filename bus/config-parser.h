@@ -62,12 +62,23 @@ const char* bus_config_parser_get_user         (BusConfigParser *parser);
 const char* bus_config_parser_get_type         (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_addresses    (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_mechanisms   (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_coalesced_signals (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_bridges      (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_cpu_affinity (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_fork         (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_allow_anonymous (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_syslog       (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_keep_umask   (BusConfigParser *parser);
+dbus_bool_t bus_config_parser_get_activation_launcher (BusConfigParser *parser);
+dbus_bool_t bus_config_parser_get_latency_histograms (BusConfigParser *parser);
+dbus_bool_t bus_config_parser_get_realtime     (BusConfigParser *parser,
+                                                int             *priority,
+                                                long            *reserve);
 const char* bus_config_parser_get_pidfile      (BusConfigParser *parser);
+const char* bus_config_parser_get_metrics_listen (BusConfigParser *parser);
 const char* bus_config_parser_get_servicehelper (BusConfigParser *parser);
+const char* bus_config_parser_get_servicecache (BusConfigParser *parser);
+const char* bus_config_parser_get_bootprofile  (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_service_dirs (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_conf_dirs    (BusConfigParser *parser);
 BusPolicy*  bus_config_parser_steal_policy     (BusConfigParser *parser);
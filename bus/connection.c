@@ -23,23 +23,62 @@
 
 #include <config.h>
 #include "connection.h"
+#include "capture.h"
 #include "dispatch.h"
 #include "policy.h"
 #include "services.h"
 #include "utils.h"
 #include "signals.h"
 #include "expirelist.h"
+#include "intern.h"
 #include "selinux.h"
+#include "validator.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
+#include <dbus/dbus-mempool.h>
 #include <dbus/dbus-timeout.h>
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-flight-recorder.h>
+#include <dbus/dbus-probes.h>
 
 /* Trim executed commands to this length; we want to keep logs readable */
 #define MAX_LOG_COMMAND_LEN 50
 
+/* How often we look for connections that have gone quiet; one that
+ * neither sent nor received anything over a whole interval gives
+ * back its spare buffer space
+ */
+#define TRIM_INTERVAL_MILLISECONDS (60 * 1000)
+
+/* How often the buckets of connections held back for sending too
+ * fast are refilled, to see whether they may send again
+ */
+#define RATE_REFILL_MILLISECONDS 20
+
 static void bus_connection_remove_transactions (DBusConnection *connection);
 
+/* Token buckets for the max_messages_per_second and
+ * max_bytes_per_second limits, counted in thousandths so a refill
+ * every few milliseconds adds whole units. Each holds at most a
+ * second's worth; sending takes from it, and a connection that
+ * takes it below zero is not read from until it has refilled.
+ */
+typedef struct
+{
+  dbus_int64_t messages;  /**< Thousandths of a message that may still be sent */
+  dbus_int64_t bytes;     /**< Thousandths of a byte that may still be sent */
+  long last_ms;           /**< When last refilled */
+} BusRateBucket;
+
 typedef struct
+{
+  int refcount;           /**< Connections of the user holding it */
+  BusRateBucket bucket;   /**< Shared by all of them */
+} BusUserRate;
+
+typedef struct BusPendingReply BusPendingReply;
+struct BusPendingReply
 {
   BusExpireItem expire_item;
 
@@ -47,8 +86,11 @@ typedef struct
   DBusConnection *will_send_reply;
 
   dbus_uint32_t reply_serial;
-  
-} BusPendingReply;
+
+  DBusList *link; /**< Our link in the expire list */
+  BusPendingReply *next_in_bucket; /**< Next entry with the same index key */
+  unsigned int replied : 1; /**< Reply seen, waiting for the transaction */
+};
 
 struct BusConnections
 {
@@ -57,11 +99,51 @@ struct BusConnections
   int n_completed;      /**< Length of completed list */
   DBusList *incomplete; /**< List of all not-yet-active connections */
   int n_incomplete;     /**< Length of incomplete list */
+  DBusList *incomplete_open; /**< First link in incomplete that we have not
+                              *   closed ourselves, or #NULL; the ones
+                              *   before it are waiting to be disconnected
+                              */
   BusContext *context;
   DBusHashTable *completed_by_user; /**< Number of completed connections for each UID */
   DBusTimeout *expire_timeout; /**< Timeout for expiring incomplete connections. */
+  DBusTimeout *trim_timeout;   /**< Timeout for trimming idle connections */
   int stamp;                   /**< Incrementing number */
+  unsigned long names_stamp;   /**< Bumped whenever a connection's owned names change */
   BusExpireList *pending_replies; /**< List of pending replies */
+  DBusHashTable *pending_replies_by_key; /**< Index of pending replies by receiver and serial */
+  DBusMemPool *transaction_pool;     /**< BusTransaction */
+  DBusMemPool *message_to_send_pool; /**< MessageToSend, one per recipient of each transaction */
+  DBusMemPool *cancel_hook_pool;     /**< CancelHook */
+  DBusMemPool *connection_data_pool; /**< BusConnectionData, one per connection */
+  DBusList *spare_oom_messages; /**< OOM errors left over by closed connections */
+  int n_spare_oom_messages;     /**< Length of spare_oom_messages */
+  BusConnectionStats totals;  /**< Traffic of all connections, past and present */
+  int n_match_rules;          /**< Match rules held by all connections */
+  DBusHashTable *rate_by_user; /**< BusUserRate for each UID with connections being rate limited */
+  DBusList *rate_paused;       /**< Connections not read from until their buckets refill */
+  DBusTimeout *rate_timeout;   /**< Refills the buckets of rate_paused, enabled while it's non-empty */
+};
+
+typedef struct
+{
+  BusTransaction *transaction;
+  DBusMessage    *message;
+  DBusPreallocatedSend *preallocated;
+} MessageToSend;
+
+typedef struct
+{
+  BusTransactionCancelFunction cancel_function;
+  DBusFreeFunction free_data_function;
+  void *data;
+} CancelHook;
+
+struct BusTransaction
+{
+  DBusList *connections;
+  BusContext *context;
+  BusConnections *bus_connections; /**< Owns the pools the transaction's pieces come from */
+  DBusList *cancel_hooks;
 };
 
 static dbus_int32_t connection_data_slot = -1;
@@ -75,18 +157,31 @@ typedef struct
   int n_services_owned;
   DBusList *match_rules;
   int n_match_rules;
+  int n_pending_replies;   /**< Replies we await that are in connections->pending_replies */
+  int n_replies_owed;      /**< Replies we should send that are in connections->pending_replies */
+  DBusHashTable *match_rules_by_key; /**< bus_match_rule_get_key() to rule */
   char *name;
   DBusList *transaction_messages; /**< Stuff we need to send as part of a transaction */
-  DBusMessage *oom_message;
+  DBusMessage *oom_message;   /**< Held from dispatch until we go idle */
   DBusPreallocatedSend *oom_preallocated;
   BusClientPolicy *policy;
+  int dispatch_quantum;    /**< Messages dispatched per turn in the main loop, 0 for no limit */
 
-  char *cached_loginfo_string;
+  const char *cached_loginfo_string; /**< Interned, so shared by connections with the same peer */
   BusSELinuxID *selinux_id;
+  BusSELinuxSendCache *selinux_send_cache; /**< Recent send_msg verdicts, created on first use */
 
   long connection_tv_sec;  /**< Time when we connected (seconds component) */
   long connection_tv_usec; /**< Time when we connected (microsec component) */
   int stamp;               /**< connections->stamp last time we were traversed */
+  unsigned long names_stamp; /**< connections->names_stamp when services_owned last changed */
+  BusConnectionStats stats; /**< Traffic counters, see bus_connection_get_stats() */
+  dbus_uint64_t trim_messages; /**< Messages in and out as of the last trim pass */
+  dbus_bool_t trimmed;         /**< Nothing sent or received since we trimmed */
+  dbus_bool_t is_bridge;       /**< A bridge from another bus, see bridge.c */
+  BusRateBucket rate;          /**< What we may still send under the per-connection rate limits */
+  BusUserRate *user_rate;      /**< Our user's share of the per-user ones, or #NULL */
+  DBusList *rate_paused_link;  /**< Our link in connections->rate_paused, or #NULL */
 } BusConnectionData;
 
 static dbus_bool_t bus_pending_reply_expired (BusExpireList *list,
@@ -98,6 +193,21 @@ static void bus_connection_drop_pending_replies (BusConnections  *connections,
 
 static dbus_bool_t expire_incomplete_timeout (void *data);
 
+static void unlink_incomplete (BusConnections *connections,
+                               DBusList       *link);
+
+static dbus_bool_t trim_idle_timeout (void *data);
+
+static dbus_bool_t rate_refill_timeout (void *data);
+
+static void release_user_rate (BusConnectionData *d);
+
+static void count_outgoing (BusConnectionData *d,
+                            DBusMessage       *message);
+
+static void charge_rate (BusConnectionData *d,
+                         long               size);
+
 #define BUS_CONNECTION_DATA(connection) (dbus_connection_get_data ((connection), connection_data_slot))
 
 static DBusLoop*
@@ -182,8 +292,10 @@ bus_connection_disconnected (DBusConnection *connection)
   _dbus_verbose ("%s disconnected, dropping all service ownership and releasing\n",
                  d->name ? d->name : "(inactive)");
 
-  /* Delete our match rules */
-  if (d->n_match_rules > 0)
+  /* Delete our match rules, and other connections' rules on our
+   * unique name; cheap when there are none of either
+   */
+  if (d->name != NULL)
     {
       matchmaker = bus_context_get_matchmaker (d->connections->context);
       bus_matchmaker_disconnected (matchmaker, connection);
@@ -195,21 +307,38 @@ bus_connection_disconnected (DBusConnection *connection)
    * disconnecting a client, and preallocating a broadcast "service is
    * now gone" message for every client-service pair seems kind of
    * involved.
+   *
+   * All the names go in one transaction. A name we owned only stays
+   * on services_owned until the transaction is done with it, so we
+   * walk the list rather than pop it; cancelling on OOM gives those
+   * back, and we start over with what's left.
    */
-  while ((service = _dbus_list_get_last (&d->services_owned)))
+  while (d->services_owned != NULL)
     {
       BusTransaction *transaction;
       DBusError error;
+      DBusList *link;
 
-    retry:
-      
       dbus_error_init (&error);
         
       while ((transaction = bus_transaction_new (d->connections->context)) == NULL)
         _dbus_wait_for_memory ();
-        
-      if (!bus_service_remove_owner (service, connection,
-                                     transaction, &error))
+
+      link = _dbus_list_get_last_link (&d->services_owned);
+      while (link != NULL)
+        {
+          /* leaving a queue unlinks this link, and only this one */
+          DBusList *prev = _dbus_list_get_prev_link (&d->services_owned, link);
+
+          service = link->data;
+          if (!bus_service_remove_owner (service, connection,
+                                         transaction, &error))
+            break;
+
+          link = prev;
+        }
+
+      if (dbus_error_is_set (&error))
         {
           _DBUS_ASSERT_ERROR_CONTENT_IS_SET (&error);
           
@@ -218,7 +347,7 @@ bus_connection_disconnected (DBusConnection *connection)
               dbus_error_free (&error);
               bus_transaction_cancel_and_free (transaction);
               _dbus_wait_for_memory ();
-              goto retry;
+              continue;
             }
           else
             {
@@ -253,6 +382,8 @@ bus_connection_disconnected (DBusConnection *connection)
   
   dbus_connection_set_dispatch_status_function (connection,
                                                 NULL, NULL, NULL);
+  _dbus_connection_set_defer_write_function (connection, NULL, NULL);
+  _dbus_connection_set_body_check_function (connection, 0, NULL, NULL);
   
   bus_connection_remove_transactions (connection);
 
@@ -275,9 +406,9 @@ bus_connection_disconnected (DBusConnection *connection)
         }
       else
         {
-          _dbus_list_remove_link (&d->connections->incomplete, d->link_in_connection_list);
+          unlink_incomplete (d->connections, d->link_in_connection_list);
+          _dbus_list_free_link (d->link_in_connection_list);
           d->link_in_connection_list = NULL;
-          d->connections->n_incomplete -= 1;
         }
       
       _dbus_assert (d->connections->n_incomplete >= 0);
@@ -285,6 +416,19 @@ bus_connection_disconnected (DBusConnection *connection)
     }
 
   bus_connection_drop_pending_replies (d->connections, connection);
+
+  if (d->rate_paused_link != NULL)
+    {
+      _dbus_list_unlink (&d->connections->rate_paused, d->rate_paused_link);
+      _dbus_list_free_link (d->rate_paused_link);
+      d->rate_paused_link = NULL;
+
+      if (d->connections->rate_paused == NULL)
+        _dbus_timeout_set_enabled (d->connections->rate_timeout, FALSE);
+    }
+
+  if (d->user_rate != NULL)
+    release_user_rate (d);
   
   /* frees "d" as side effect */
   dbus_connection_set_data (connection,
@@ -331,6 +475,15 @@ remove_connection_watch (DBusWatch      *watch,
                            watch, connection_watch_callback, connection);
 }
 
+static void
+toggle_connection_watch (DBusWatch      *watch,
+                         void           *data)
+{
+  DBusConnection *connection = data;
+
+  _dbus_loop_toggle_watch (connection_get_loop (connection), watch);
+}
+
 static void
 connection_timeout_callback (DBusTimeout   *timeout,
                              void          *data)
@@ -367,14 +520,32 @@ dispatch_status_function (DBusConnection    *connection,
                           void              *data)
 {
   DBusLoop *loop = data;
+  BusConnectionData *d;
   
   if (new_status != DBUS_DISPATCH_COMPLETE)
     {
-      while (!_dbus_loop_queue_dispatch (loop, connection))
+      d = BUS_CONNECTION_DATA (connection);
+      _dbus_assert (d != NULL);
+
+      while (!_dbus_loop_queue_dispatch_with_quantum (loop, connection,
+                                                      d->dispatch_quantum))
         _dbus_wait_for_memory ();
     }
 }
 
+/* What one iteration of the main loop sends a connection, such as
+ * a burst of signals, goes out in one write at the end of it rather
+ * than one write per message
+ */
+static dbus_bool_t
+defer_write_function (DBusConnection *connection,
+                      void           *data)
+{
+  DBusLoop *loop = data;
+
+  return _dbus_loop_queue_flush (loop, connection);
+}
+
 static dbus_bool_t
 allow_unix_user_function (DBusConnection *connection,
                           unsigned long   uid,
@@ -389,6 +560,26 @@ allow_unix_user_function (DBusConnection *connection,
   return bus_context_allow_unix_user (d->connections->context, uid);
 }
 
+/* Enough to cover a burst of short-lived clients, without keeping
+ * much memory around once they are gone
+ */
+#define MAX_SPARE_OOM_MESSAGES 16
+
+/* Keeps the unused OOM error of a connection that closed or went idle
+ * for the next one; it belongs to no connection until it is handed out
+ * again.
+ */
+static void
+stash_oom_message (BusConnections *connections,
+                   DBusMessage    *message)
+{
+  if (connections->n_spare_oom_messages < MAX_SPARE_OOM_MESSAGES &&
+      _dbus_list_prepend (&connections->spare_oom_messages, message))
+    connections->n_spare_oom_messages += 1;
+  else
+    dbus_message_unref (message);
+}
+
 static void
 free_connection_data (void *data)
 {
@@ -404,19 +595,25 @@ free_connection_data (void *data)
     dbus_connection_free_preallocated_send (d->connection, d->oom_preallocated);
 
   if (d->oom_message)
-    dbus_message_unref (d->oom_message);
+    stash_oom_message (d->connections, d->oom_message);
 
   if (d->policy)
     bus_client_policy_unref (d->policy);
 
   if (d->selinux_id)
     bus_selinux_id_unref (d->selinux_id);
+
+  if (d->selinux_send_cache)
+    bus_selinux_send_cache_free (d->selinux_send_cache);
   
-  dbus_free (d->cached_loginfo_string);
+  bus_intern_unref (d->cached_loginfo_string);
+
+  if (d->match_rules_by_key)
+    _dbus_hash_table_unref (d->match_rules_by_key);
   
   dbus_free (d->name);
   
-  dbus_free (d);
+  _dbus_mem_pool_dealloc (d->connections->connection_data_pool, d);
 }
 
 static void
@@ -452,26 +649,110 @@ bus_connections_new (BusContext *context)
 
   _dbus_timeout_set_enabled (connections->expire_timeout, FALSE);
 
+  connections->trim_timeout = _dbus_timeout_new (TRIM_INTERVAL_MILLISECONDS,
+                                                 trim_idle_timeout,
+                                                 connections, NULL);
+  if (connections->trim_timeout == NULL)
+    goto failed_3a;
+
+  connections->rate_by_user = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                    NULL, NULL);
+  if (connections->rate_by_user == NULL)
+    goto failed_3b;
+
+  connections->rate_timeout = _dbus_timeout_new (RATE_REFILL_MILLISECONDS,
+                                                 rate_refill_timeout,
+                                                 connections, NULL);
+  if (connections->rate_timeout == NULL)
+    goto failed_3c;
+
+  _dbus_timeout_set_enabled (connections->rate_timeout, FALSE);
+
   connections->pending_replies = bus_expire_list_new (bus_context_get_loop (context),
                                                       bus_context_get_reply_timeout (context),
                                                       bus_pending_reply_expired,
                                                       connections);
   if (connections->pending_replies == NULL)
     goto failed_4;
+
+  connections->pending_replies_by_key = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                              NULL, NULL);
+  if (connections->pending_replies_by_key == NULL)
+    goto failed_5;
+
+  /* Every routed message makes a transaction with a MessageToSend
+   * per recipient, all freed again before the next message is
+   * routed; the pools hand the same blocks back out each time
+   */
+  connections->transaction_pool = _dbus_mem_pool_new (sizeof (BusTransaction),
+                                                      TRUE);
+  connections->message_to_send_pool = _dbus_mem_pool_new (sizeof (MessageToSend),
+                                                          FALSE);
+  connections->cancel_hook_pool = _dbus_mem_pool_new (sizeof (CancelHook),
+                                                      FALSE);
+  /* Likewise for the per-connection data of clients that connect,
+   * make a call or two and go away again
+   */
+  connections->connection_data_pool = _dbus_mem_pool_new (sizeof (BusConnectionData),
+                                                          TRUE);
+  if (connections->transaction_pool == NULL ||
+      connections->message_to_send_pool == NULL ||
+      connections->cancel_hook_pool == NULL ||
+      connections->connection_data_pool == NULL)
+    goto failed_6;
   
   if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
                                connections->expire_timeout,
                                call_timeout_callback, NULL, NULL))
-    goto failed_5;
+    goto failed_6;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               connections->trim_timeout,
+                               call_timeout_callback, NULL, NULL))
+    {
+      _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                                 connections->expire_timeout,
+                                 call_timeout_callback, NULL);
+      goto failed_6;
+    }
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               connections->rate_timeout,
+                               call_timeout_callback, NULL, NULL))
+    {
+      _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                                 connections->trim_timeout,
+                                 call_timeout_callback, NULL);
+      _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                                 connections->expire_timeout,
+                                 call_timeout_callback, NULL);
+      goto failed_6;
+    }
   
   connections->refcount = 1;
   connections->context = context;
   
   return connections;
 
+ failed_6:
+  if (connections->transaction_pool)
+    _dbus_mem_pool_free (connections->transaction_pool);
+  if (connections->message_to_send_pool)
+    _dbus_mem_pool_free (connections->message_to_send_pool);
+  if (connections->cancel_hook_pool)
+    _dbus_mem_pool_free (connections->cancel_hook_pool);
+  if (connections->connection_data_pool)
+    _dbus_mem_pool_free (connections->connection_data_pool);
+  _dbus_hash_table_unref (connections->pending_replies_by_key);
  failed_5:
   bus_expire_list_free (connections->pending_replies);
  failed_4:
+  _dbus_timeout_unref (connections->rate_timeout);
+ failed_3c:
+  _dbus_hash_table_unref (connections->rate_by_user);
+ failed_3b:
+  _dbus_timeout_unref (connections->trim_timeout);
+ failed_3a:
   _dbus_timeout_unref (connections->expire_timeout);
  failed_3:
   _dbus_hash_table_unref (connections->completed_by_user);
@@ -529,6 +810,9 @@ bus_connections_unref (BusConnections *connections)
 
       _dbus_assert (connections->n_completed == 0);
 
+      _dbus_assert (_dbus_hash_table_get_n_entries (connections->pending_replies_by_key) == 0);
+      _dbus_hash_table_unref (connections->pending_replies_by_key);
+
       bus_expire_list_free (connections->pending_replies);
       
       _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
@@ -536,8 +820,34 @@ bus_connections_unref (BusConnections *connections)
                                  call_timeout_callback, NULL);
       
       _dbus_timeout_unref (connections->expire_timeout);
+
+      _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                 connections->trim_timeout,
+                                 call_timeout_callback, NULL);
+
+      _dbus_timeout_unref (connections->trim_timeout);
+
+      _dbus_assert (connections->rate_paused == NULL);
+      _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                 connections->rate_timeout,
+                                 call_timeout_callback, NULL);
+
+      _dbus_timeout_unref (connections->rate_timeout);
+
+      _dbus_assert (_dbus_hash_table_get_n_entries (connections->rate_by_user) == 0);
+      _dbus_hash_table_unref (connections->rate_by_user);
       
       _dbus_hash_table_unref (connections->completed_by_user);
+
+      _dbus_mem_pool_free (connections->transaction_pool);
+      _dbus_mem_pool_free (connections->message_to_send_pool);
+      _dbus_mem_pool_free (connections->cancel_hook_pool);
+      _dbus_mem_pool_free (connections->connection_data_pool);
+
+      _dbus_list_foreach (&connections->spare_oom_messages,
+                          (DBusForeachFunction) dbus_message_unref,
+                          NULL);
+      _dbus_list_clear (&connections->spare_oom_messages);
       
       dbus_free (connections);
 
@@ -591,7 +901,12 @@ cache_peer_loginfo_string (BusConnectionData *d,
       dbus_free (windows_sid);
     }
 
-  if (!_dbus_string_steal_data (&loginfo_buf, &(d->cached_loginfo_string)))
+  /* A client that opens many connections gets the same string for
+   * each of them
+   */
+  d->cached_loginfo_string =
+    bus_intern_string (_dbus_string_get_const_data (&loginfo_buf));
+  if (d->cached_loginfo_string == NULL)
     goto oom;
 
   _dbus_string_free (&loginfo_buf); 
@@ -608,17 +923,25 @@ bus_connections_setup_connection (BusConnections *connections,
 {
 
   BusConnectionData *d;
+  BusValidator *validator;
+  DBusList *link;
   dbus_bool_t retval;
   DBusError error;
+  int fd;
 
   
-  d = dbus_new0 (BusConnectionData, 1);
+  d = _dbus_mem_pool_alloc (connections->connection_data_pool);
   
   if (d == NULL)
     return FALSE;
 
   d->connections = connections;
   d->connection = connection;
+  d->dispatch_quantum = bus_context_get_dispatch_quantum (connections->context);
+
+  /* never equal to a stamp some earlier connection at this address had */
+  connections->names_stamp += 1;
+  d->names_stamp = connections->names_stamp;
   
   _dbus_get_current_time (&d->connection_tv_sec,
                           &d->connection_tv_usec);
@@ -629,7 +952,7 @@ bus_connections_setup_connection (BusConnections *connections,
                                  connection_data_slot,
                                  d, free_connection_data))
     {
-      dbus_free (d);
+      _dbus_mem_pool_dealloc (connections->connection_data_pool, d);
       return FALSE;
     }
 
@@ -654,7 +977,7 @@ bus_connections_setup_connection (BusConnections *connections,
   if (!dbus_connection_set_watch_functions (connection,
                                             add_connection_watch,
                                             remove_connection_watch,
-                                            NULL,
+                                            toggle_connection_watch,
                                             connection,
                                             NULL))
     goto out;
@@ -680,6 +1003,14 @@ bus_connections_setup_connection (BusConnections *connections,
                                                 bus_context_get_loop (connections->context),
                                                 NULL);
 
+  _dbus_connection_set_defer_write_function (connection,
+                                             defer_write_function,
+                                             bus_context_get_loop (connections->context));
+
+  validator = bus_context_get_validator (connections->context);
+  if (validator != NULL)
+    bus_validator_setup_connection (validator, connection);
+
   d->link_in_connection_list = _dbus_list_alloc_link (connection);
   if (d->link_in_connection_list == NULL)
     goto out;
@@ -690,7 +1021,8 @@ bus_connections_setup_connection (BusConnections *connections,
 
   if (dbus_connection_get_dispatch_status (connection) != DBUS_DISPATCH_COMPLETE)
     {
-      if (!_dbus_loop_queue_dispatch (bus_context_get_loop (connections->context), connection))
+      if (!_dbus_loop_queue_dispatch_with_quantum (bus_context_get_loop (connections->context),
+                                                   connection, d->dispatch_quantum))
         {
           bus_dispatch_remove_connection (connection);
           goto out;
@@ -699,6 +1031,9 @@ bus_connections_setup_connection (BusConnections *connections,
 
   _dbus_list_append_link (&connections->incomplete, d->link_in_connection_list);
   connections->n_incomplete += 1;
+
+  if (connections->incomplete_open == NULL)
+    connections->incomplete_open = d->link_in_connection_list;
   
   dbus_connection_ref (connection);
 
@@ -718,15 +1053,26 @@ bus_connections_setup_connection (BusConnections *connections,
       _dbus_verbose ("Number of incomplete connections exceeds max, dropping oldest one\n");
       
       _dbus_assert (connections->incomplete != NULL);
-      /* Disconnect the oldest unauthenticated connection.  FIXME
+      /* Disconnect the oldest unauthenticated connection we have not
+       * already closed; closing one of those again would do nothing.
+       * There is always one, since we only just added ourselves.  FIXME
        * would it be more secure to drop a *random* connection?  This
        * algorithm seems to mean that if someone can create new
        * connections quickly enough, they can keep anyone else from
        * completing authentication. But random may or may not really
        * help with that, a more elaborate solution might be required.
        */
-      dbus_connection_close (connections->incomplete->data);
+      link = connections->incomplete_open;
+      _dbus_assert (link != NULL);
+      connections->incomplete_open =
+        _dbus_list_get_next_link (&connections->incomplete, link);
+      dbus_connection_close (link->data);
     }
+
+  _DBUS_PROBE1 (connection__accepted, connection);
+  _dbus_flight_record (DBUS_FLIGHT_ACCEPTED,
+                       _dbus_connection_get_flight_id (connection), 0,
+                       dbus_connection_get_socket (connection, &fd) ? fd : -1);
   
   retval = TRUE;
 
@@ -757,6 +1103,8 @@ bus_connections_setup_connection (BusConnections *connections,
       
       dbus_connection_set_dispatch_status_function (connection,
                                                     NULL, NULL, NULL);
+      _dbus_connection_set_defer_write_function (connection, NULL, NULL);
+      _dbus_connection_set_body_check_function (connection, 0, NULL, NULL);
 
       if (d->link_in_connection_list != NULL)
         {
@@ -777,6 +1125,21 @@ bus_connections_setup_connection (BusConnections *connections,
   return retval;
 }
 
+/* Unlinks a connection from the incomplete list, without freeing
+ * the link, keeping incomplete_open pointing into the list.
+ */
+static void
+unlink_incomplete (BusConnections *connections,
+                   DBusList       *link)
+{
+  if (connections->incomplete_open == link)
+    connections->incomplete_open =
+      _dbus_list_get_next_link (&connections->incomplete, link);
+
+  _dbus_list_unlink (&connections->incomplete, link);
+  connections->n_incomplete -= 1;
+}
+
 void
 bus_connections_expire_incomplete (BusConnections *connections)
 {    
@@ -784,7 +1147,11 @@ bus_connections_expire_incomplete (BusConnections *connections)
 
   next_interval = -1;
   
-  if (connections->incomplete != NULL)
+  /* Connections we closed stay on the list until we get back to the
+   * main loop and see them disconnect; during a flood we are called
+   * for every new connection before that, so start after them.
+   */
+  if (connections->incomplete_open != NULL)
     {
       long tv_sec, tv_usec;
       DBusList *link;
@@ -793,10 +1160,9 @@ bus_connections_expire_incomplete (BusConnections *connections)
       _dbus_get_current_time (&tv_sec, &tv_usec);
       auth_timeout = bus_context_get_auth_timeout (connections->context);
   
-      link = _dbus_list_get_first_link (&connections->incomplete);
+      link = connections->incomplete_open;
       while (link != NULL)
         {
-          DBusList *next = _dbus_list_get_next_link (&connections->incomplete, link);
           DBusConnection *connection;
           BusConnectionData *d;
           double elapsed;
@@ -814,6 +1180,8 @@ bus_connections_expire_incomplete (BusConnections *connections)
           if (elapsed >= (double) auth_timeout)
             {
               _dbus_verbose ("Timing out authentication for connection %p\n", connection);
+              connections->incomplete_open =
+                _dbus_list_get_next_link (&connections->incomplete, link);
               dbus_connection_close (connection);
             }
           else
@@ -826,7 +1194,7 @@ bus_connections_expire_incomplete (BusConnections *connections)
               break;
             }
       
-          link = next;
+          link = connections->incomplete_open;
         }
     }
 
@@ -847,6 +1215,127 @@ expire_incomplete_timeout (void *data)
   return TRUE;
 }
 
+/* Gives back what the connection only needs while it's busy: the
+ * OOM error dispatching preallocates goes to the spares, to be taken
+ * again with the next message, and the SELinux verdicts are only a
+ * cache.
+ */
+static void
+release_busy_state (BusConnectionData *d)
+{
+  if (d->oom_preallocated != NULL)
+    {
+      dbus_connection_free_preallocated_send (d->connection,
+                                              d->oom_preallocated);
+      d->oom_preallocated = NULL;
+    }
+
+  if (d->oom_message != NULL)
+    {
+      stash_oom_message (d->connections, d->oom_message);
+      d->oom_message = NULL;
+    }
+
+  if (d->selinux_send_cache != NULL)
+    {
+      bus_selinux_send_cache_free (d->selinux_send_cache);
+      d->selinux_send_cache = NULL;
+    }
+}
+
+static void
+trim_connection (BusConnectionData *d)
+{
+  _dbus_connection_trim (d->connection);
+
+  if (d->match_rules_by_key != NULL)
+    _dbus_hash_table_compact (d->match_rules_by_key);
+
+  release_busy_state (d);
+
+  d->trim_messages = d->stats.messages_in + d->stats.messages_out;
+  d->trimmed = TRUE;
+}
+
+static dbus_bool_t
+trim_idle_timeout (void *data)
+{
+  BusConnections *connections = data;
+  DBusList *link;
+  int n_trimmed;
+
+  n_trimmed = 0;
+
+  /* Busy connections keep their buffers, they would only have to
+   * grow them again; and one we've trimmed stays trimmed until it
+   * does something
+   */
+  link = _dbus_list_get_first_link (&connections->completed);
+  while (link != NULL)
+    {
+      BusConnectionData *d = BUS_CONNECTION_DATA (link->data);
+      dbus_uint64_t messages;
+
+      _dbus_assert (d != NULL);
+
+      messages = d->stats.messages_in + d->stats.messages_out;
+      if (messages != d->trim_messages)
+        {
+          d->trim_messages = messages;
+          d->trimmed = FALSE;
+        }
+      else if (!d->trimmed)
+        {
+          trim_connection (d);
+          n_trimmed += 1;
+        }
+
+      link = _dbus_list_get_next_link (&connections->completed, link);
+    }
+
+  if (n_trimmed > 0)
+    _dbus_verbose ("Trimmed %d idle connections\n", n_trimmed);
+
+  return TRUE;
+}
+
+/**
+ * Gives back all the memory the bus can do without for now, for when
+ * the system is short: every connection's spare buffer space whether
+ * idle or not, the slack in the connection tables, and libdbus's
+ * cache of freed messages. Nothing is dropped that can't be
+ * reallocated when next needed.
+ *
+ * @param connections the connections
+ */
+void
+bus_connections_trim_memory (BusConnections *connections)
+{
+  DBusList *link;
+
+  link = _dbus_list_get_first_link (&connections->completed);
+  while (link != NULL)
+    {
+      trim_connection (BUS_CONNECTION_DATA (link->data));
+      link = _dbus_list_get_next_link (&connections->completed, link);
+    }
+
+  link = _dbus_list_get_first_link (&connections->incomplete);
+  while (link != NULL)
+    {
+      trim_connection (BUS_CONNECTION_DATA (link->data));
+      link = _dbus_list_get_next_link (&connections->incomplete, link);
+    }
+
+  _dbus_hash_table_compact (connections->completed_by_user);
+  _dbus_hash_table_compact (connections->pending_replies_by_key);
+
+  _dbus_message_cache_trim ();
+
+  _dbus_verbose ("Trimmed %d connections on memory pressure\n",
+                 connections->n_completed + connections->n_incomplete);
+}
+
 dbus_bool_t
 bus_connection_get_unix_groups  (DBusConnection   *connection,
                                  unsigned long   **groups,
@@ -1033,6 +1522,19 @@ bus_connections_increment_stamp (BusConnections *connections)
   connections->stamp += 1;
 }
 
+/* Whether the connection was marked since the stamp was last incremented */
+dbus_bool_t
+bus_connection_has_stamp (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  _dbus_assert (d != NULL);
+
+  return d->stamp == d->connections->stamp;
+}
+
 /* Mark connection with current stamp, return TRUE if it
  * didn't already have that stamp
  */
@@ -1126,6 +1628,22 @@ bus_connection_get_selinux_id (DBusConnection *connection)
   return d->selinux_id;
 }
 
+BusSELinuxSendCache*
+bus_connection_get_selinux_send_cache (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  _dbus_assert (d != NULL);
+
+  /* Without memory we just go without the cache */
+  if (d->selinux_send_cache == NULL && d->selinux_id != NULL)
+    d->selinux_send_cache = bus_selinux_send_cache_new ();
+
+  return d->selinux_send_cache;
+}
+
 /**
  * Checks whether the connection is registered with the message bus.
  *
@@ -1142,6 +1660,34 @@ bus_connection_is_active (DBusConnection *connection)
   return d != NULL && d->name != NULL;
 }
 
+/**
+ * Checks whether the connection is another bus's bridge to this one,
+ * whose signals have come from that bus and mustn't be bridged on.
+ *
+ * @param connection the connection
+ * @returns #TRUE if bus_connection_set_is_bridge() was called on it
+ */
+dbus_bool_t
+bus_connection_is_bridge (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  return d != NULL && d->is_bridge;
+}
+
+void
+bus_connection_set_is_bridge (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  d->is_bridge = TRUE;
+}
+
 dbus_bool_t
 bus_connection_preallocate_oom_error (DBusConnection *connection)
 {
@@ -1160,6 +1706,25 @@ bus_connection_preallocate_oom_error (DBusConnection *connection)
   if (preallocated == NULL)
     return FALSE;
 
+  /* A spare is already fully built apart from the destination */
+  message = _dbus_list_pop_first (&d->connections->spare_oom_messages);
+  if (message != NULL)
+    {
+      d->connections->n_spare_oom_messages -= 1;
+
+      if (!dbus_message_set_destination (message, d->name))
+        {
+          dbus_connection_free_preallocated_send (connection, preallocated);
+          dbus_message_unref (message);
+          return FALSE;
+        }
+
+      d->oom_message = message;
+      d->oom_preallocated = preallocated;
+
+      return TRUE;
+    }
+
   message = dbus_message_new (DBUS_MESSAGE_TYPE_ERROR);
 
   if (message == NULL)
@@ -1212,9 +1777,12 @@ bus_connection_send_oom_error (DBusConnection *connection,
     _dbus_assert_not_reached ("Failed to set reply serial for preallocated oom message");
 
   _dbus_assert (dbus_message_get_sender (d->oom_message) != NULL);
-  
+
+  bus_connection_count_oom_retry (connection);
+
   dbus_connection_send_preallocated (connection, d->oom_preallocated,
                                      d->oom_message, NULL);
+  count_outgoing (d, d->oom_message);
 
   dbus_message_unref (d->oom_message);
   d->oom_message = NULL;
@@ -1222,7 +1790,453 @@ bus_connection_send_oom_error (DBusConnection *connection,
 }
 
 void
-bus_connection_add_match_rule_link (DBusConnection *connection,
+bus_connection_count_incoming (DBusConnection *connection,
+                               DBusMessage    *message)
+{
+  BusConnectionData *d;
+  long size;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  size = _dbus_message_get_size (message);
+
+  d->stats.messages_in += 1;
+  d->stats.bytes_in += size;
+  d->connections->totals.messages_in += 1;
+  d->connections->totals.bytes_in += size;
+
+  charge_rate (d, size);
+}
+
+static long
+rate_now_ms (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  return tv_sec * 1000 + tv_usec / 1000;
+}
+
+/* Adds what the rates allow for the time since the last refill, up
+ * to a second's worth; a rate of 0 is no limit and leaves its count
+ * alone
+ */
+static void
+rate_bucket_refill (BusRateBucket *bucket,
+                    long           now_ms,
+                    int            messages_per_second,
+                    long           bytes_per_second)
+{
+  long elapsed;
+
+  elapsed = now_ms - bucket->last_ms;
+  if (elapsed <= 0)
+    return;
+
+  /* Nothing is added beyond a second's worth anyway */
+  if (elapsed > 1000)
+    elapsed = 1000;
+
+  bucket->last_ms = now_ms;
+
+  if (messages_per_second > 0)
+    bucket->messages = MIN (bucket->messages + (dbus_int64_t) elapsed * messages_per_second,
+                            (dbus_int64_t) messages_per_second * 1000);
+
+  if (bytes_per_second > 0)
+    bucket->bytes = MIN (bucket->bytes + (dbus_int64_t) elapsed * bytes_per_second,
+                         (dbus_int64_t) bytes_per_second * 1000);
+}
+
+static dbus_bool_t
+rate_bucket_overdrawn (BusRateBucket *bucket,
+                       int            messages_per_second,
+                       long           bytes_per_second)
+{
+  return (messages_per_second > 0 && bucket->messages < 0) ||
+    (bytes_per_second > 0 && bucket->bytes < 0);
+}
+
+/* Takes a message of size bytes from the bucket, returning TRUE if
+ * that overdrew it
+ */
+static dbus_bool_t
+rate_bucket_take (BusRateBucket *bucket,
+                  long           now_ms,
+                  int            messages_per_second,
+                  long           bytes_per_second,
+                  long           size)
+{
+  rate_bucket_refill (bucket, now_ms, messages_per_second, bytes_per_second);
+
+  if (messages_per_second > 0)
+    bucket->messages -= 1000;
+  if (bytes_per_second > 0)
+    bucket->bytes -= (dbus_int64_t) size * 1000;
+
+  return rate_bucket_overdrawn (bucket, messages_per_second, bytes_per_second);
+}
+
+/* Looks up or makes the bucket our user's connections share; on OOM
+ * we just go without, and try again with the next message
+ */
+static void
+attach_user_rate (BusConnectionData *d)
+{
+  BusUserRate *user_rate;
+  unsigned long uid;
+
+  if (!dbus_connection_get_unix_user (d->connection, &uid))
+    return;
+
+  user_rate = _dbus_hash_table_lookup_uintptr (d->connections->rate_by_user,
+                                               uid);
+  if (user_rate == NULL)
+    {
+      user_rate = dbus_new0 (BusUserRate, 1);
+      if (user_rate == NULL)
+        return;
+
+      if (!_dbus_hash_table_insert_uintptr (d->connections->rate_by_user,
+                                            uid, user_rate))
+        {
+          dbus_free (user_rate);
+          return;
+        }
+    }
+
+  user_rate->refcount += 1;
+  d->user_rate = user_rate;
+}
+
+static void
+release_user_rate (BusConnectionData *d)
+{
+  _dbus_assert (d->user_rate->refcount > 0);
+
+  d->user_rate->refcount -= 1;
+  if (d->user_rate->refcount == 0)
+    {
+      unsigned long uid;
+
+      /* only attached once the uid was known, and it doesn't change */
+      if (!dbus_connection_get_unix_user (d->connection, &uid) ||
+          !_dbus_hash_table_remove_uintptr (d->connections->rate_by_user, uid))
+        _dbus_assert_not_reached ("user rate not in the table");
+
+      dbus_free (d->user_rate);
+    }
+
+  d->user_rate = NULL;
+}
+
+/* Charges a message we've read from the connection against the rate
+ * limits. One that overdraws a bucket gets no further messages read
+ * until rate_refill_timeout() finds it back within them; it isn't
+ * disconnected, it just has to wait, as it would for a busy bus.
+ */
+static void
+charge_rate (BusConnectionData *d,
+             long               size)
+{
+  BusContext *context = d->connections->context;
+  int messages_per_second;
+  long bytes_per_second;
+  int user_messages_per_second;
+  long user_bytes_per_second;
+  dbus_bool_t overdrawn;
+  long now_ms;
+
+  /* A bridge carries a whole other bus, which has limits of its own */
+  if (d->is_bridge)
+    return;
+
+  messages_per_second = bus_context_get_max_messages_per_second (context);
+  bytes_per_second = bus_context_get_max_bytes_per_second (context);
+  user_messages_per_second = bus_context_get_max_messages_per_second_per_user (context);
+  user_bytes_per_second = bus_context_get_max_bytes_per_second_per_user (context);
+
+  if (messages_per_second == 0 && bytes_per_second == 0 &&
+      user_messages_per_second == 0 && user_bytes_per_second == 0)
+    return;
+
+  now_ms = rate_now_ms ();
+  overdrawn = FALSE;
+
+  if (messages_per_second > 0 || bytes_per_second > 0)
+    overdrawn = rate_bucket_take (&d->rate, now_ms,
+                                  messages_per_second, bytes_per_second,
+                                  size);
+
+  if (user_messages_per_second > 0 || user_bytes_per_second > 0)
+    {
+      if (d->user_rate == NULL)
+        attach_user_rate (d);
+
+      if (d->user_rate != NULL &&
+          rate_bucket_take (&d->user_rate->bucket, now_ms,
+                            user_messages_per_second, user_bytes_per_second,
+                            size))
+        overdrawn = TRUE;
+    }
+
+  /* Messages read before it was held back still count against it */
+  if (!overdrawn || d->rate_paused_link != NULL)
+    return;
+
+  /* Without the link it simply isn't held back this time */
+  d->rate_paused_link = _dbus_list_alloc_link (d->connection);
+  if (d->rate_paused_link == NULL)
+    return;
+
+  _dbus_verbose ("%s is sending too fast, not reading from it for now\n",
+                 d->name ? d->name : "(inactive)");
+
+  _dbus_list_append_link (&d->connections->rate_paused, d->rate_paused_link);
+  _dbus_timeout_set_enabled (d->connections->rate_timeout, TRUE);
+  _dbus_connection_set_read_paused (d->connection, TRUE);
+}
+
+static dbus_bool_t
+rate_refill_timeout (void *data)
+{
+  BusConnections *connections = data;
+  BusContext *context = connections->context;
+  int messages_per_second;
+  long bytes_per_second;
+  int user_messages_per_second;
+  long user_bytes_per_second;
+  DBusList *link;
+  long now_ms;
+
+  messages_per_second = bus_context_get_max_messages_per_second (context);
+  bytes_per_second = bus_context_get_max_bytes_per_second (context);
+  user_messages_per_second = bus_context_get_max_messages_per_second_per_user (context);
+  user_bytes_per_second = bus_context_get_max_bytes_per_second_per_user (context);
+
+  now_ms = rate_now_ms ();
+
+  link = _dbus_list_get_first_link (&connections->rate_paused);
+  while (link != NULL)
+    {
+      DBusList *next = _dbus_list_get_next_link (&connections->rate_paused, link);
+      BusConnectionData *d = BUS_CONNECTION_DATA (link->data);
+      dbus_bool_t overdrawn;
+
+      _dbus_assert (d != NULL);
+
+      /* A reload may have lifted or lowered the limits meanwhile */
+      rate_bucket_refill (&d->rate, now_ms,
+                          messages_per_second, bytes_per_second);
+      overdrawn = rate_bucket_overdrawn (&d->rate,
+                                         messages_per_second, bytes_per_second);
+
+      if (d->user_rate != NULL)
+        {
+          rate_bucket_refill (&d->user_rate->bucket, now_ms,
+                              user_messages_per_second, user_bytes_per_second);
+          if (rate_bucket_overdrawn (&d->user_rate->bucket,
+                                     user_messages_per_second,
+                                     user_bytes_per_second))
+            overdrawn = TRUE;
+        }
+
+      if (!overdrawn)
+        {
+          _dbus_list_unlink (&connections->rate_paused, link);
+          _dbus_list_free_link (link);
+          d->rate_paused_link = NULL;
+          _dbus_connection_set_read_paused (d->connection, FALSE);
+        }
+
+      link = next;
+    }
+
+  if (connections->rate_paused == NULL)
+    _dbus_timeout_set_enabled (connections->rate_timeout, FALSE);
+
+  return TRUE;
+}
+
+static void
+count_outgoing (BusConnectionData *d,
+                DBusMessage       *message)
+{
+  long size;
+
+  size = _dbus_message_get_size (message);
+
+  d->stats.messages_out += 1;
+  d->stats.bytes_out += size;
+  d->connections->totals.messages_out += 1;
+  d->connections->totals.bytes_out += size;
+}
+
+/* Called each time we fail to handle one of the client's messages
+ * for lack of memory, so they have to try again
+ */
+void
+bus_connection_count_oom_retry (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  d->stats.oom_retries += 1;
+  d->connections->totals.oom_retries += 1;
+}
+
+/* Called when the send or receive policy rejects a message the client
+ * sent to a particular destination
+ */
+void
+bus_connection_count_policy_denial (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  d->stats.policy_denials += 1;
+  d->connections->totals.policy_denials += 1;
+}
+
+static int
+count_pending_replies (BusConnections *connections,
+                       DBusConnection *will_get_reply)
+{
+  DBusList *link;
+  int count;
+
+  count = 0;
+  link = bus_expire_list_get_first_link (connections->pending_replies);
+  while (link != NULL)
+    {
+      BusPendingReply *pending = link->data;
+
+      if (will_get_reply == NULL || pending->will_get_reply == will_get_reply)
+        ++count;
+
+      link = bus_expire_list_get_next_link (connections->pending_replies,
+                                            link);
+    }
+
+  return count;
+}
+
+/* The bus' own per-connection state: not the transport and its
+ * buffers, nor the rules and names, which are counted elsewhere. A
+ * loginfo string shared with other connections counts in full for
+ * each of them.
+ */
+static dbus_uint32_t
+connection_state_size (BusConnectionData *d)
+{
+  dbus_uint32_t size;
+
+  size = sizeof (BusConnectionData);
+
+  if (d->name != NULL)
+    size += strlen (d->name) + 1;
+
+  if (d->cached_loginfo_string != NULL)
+    size += strlen (d->cached_loginfo_string) + 1;
+
+  if (d->oom_message != NULL)
+    size += _dbus_message_get_size (d->oom_message);
+
+  return size;
+}
+
+void
+bus_connection_get_stats (DBusConnection     *connection,
+                          BusConnectionStats *stats)
+{
+  BusConnectionData *d;
+  int read_budget, write_budget;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  *stats = d->stats;
+  stats->match_rules = d->n_match_rules;
+  stats->names_owned = d->n_services_owned;
+  stats->pending_replies = d->n_pending_replies;
+  stats->incoming_bytes = _dbus_connection_get_incoming_size (connection);
+  stats->outgoing_bytes = dbus_connection_get_outgoing_size (connection);
+  _dbus_connection_get_io_budgets (connection, &read_budget, &write_budget);
+  stats->read_budget = read_budget;
+  stats->write_budget = write_budget;
+  stats->state_bytes = connection_state_size (d);
+}
+
+static void
+add_queue_sizes (DBusList           *list,
+                 BusConnectionStats *totals)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&list);
+       link != NULL;
+       link = _dbus_list_get_next_link (&list, link))
+    {
+      int read_budget, write_budget;
+
+      totals->incoming_bytes += _dbus_connection_get_incoming_size (link->data);
+      totals->outgoing_bytes += dbus_connection_get_outgoing_size (link->data);
+      _dbus_connection_get_io_budgets (link->data, &read_budget, &write_budget);
+      totals->read_budget += read_budget;
+      totals->write_budget += write_budget;
+      totals->state_bytes +=
+        connection_state_size (BUS_CONNECTION_DATA (link->data));
+    }
+}
+
+/* The traffic counters here include connections that have since gone
+ * away; the rest describe the connections we have now.
+ */
+void
+bus_connections_get_stats (BusConnections     *connections,
+                           BusConnectionStats *totals,
+                           int                *n_completed,
+                           int                *n_incomplete)
+{
+  DBusList *link;
+
+  *totals = connections->totals;
+  totals->match_rules = connections->n_match_rules;
+  totals->pending_replies = count_pending_replies (connections, NULL);
+
+  for (link = _dbus_list_get_first_link (&connections->completed);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    totals->names_owned += bus_connection_get_n_services_owned (link->data);
+
+  add_queue_sizes (connections->completed, totals);
+  add_queue_sizes (connections->incomplete, totals);
+
+  for (link = _dbus_list_get_first_link (&connections->completed);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    {
+      BusConnectionData *d = BUS_CONNECTION_DATA (link->data);
+
+      if (d->trimmed)
+        {
+          totals->idle_connections += 1;
+          totals->idle_state_bytes += connection_state_size (d);
+        }
+    }
+
+  *n_completed = connections->n_completed;
+  *n_incomplete = connections->n_incomplete;
+}
+
+static void
+bus_connection_add_match_rule_link (DBusConnection *connection,
                                     DBusList       *link)
 {
   BusConnectionData *d;
@@ -1233,20 +2247,39 @@ bus_connection_add_match_rule_link (DBusConnection *connection,
   _dbus_list_append_link (&d->match_rules, link);
 
   d->n_match_rules += 1;
+  if (d->n_match_rules > d->stats.peak_match_rules)
+    d->stats.peak_match_rules = d->n_match_rules;
+
+  d->connections->n_match_rules += 1;
+  if (d->connections->n_match_rules > d->connections->totals.peak_match_rules)
+    d->connections->totals.peak_match_rules = d->connections->n_match_rules;
 }
 
 dbus_bool_t
 bus_connection_add_match_rule (DBusConnection *connection,
                                BusMatchRule   *rule)
 {
-    DBusList *link;
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
 
-  link = _dbus_list_alloc_link (rule);
+  if (d->match_rules_by_key == NULL)
+    {
+      /* the keys belong to the rules, which outlive their entries */
+      d->match_rules_by_key = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                    NULL, NULL);
+      if (d->match_rules_by_key == NULL)
+        return FALSE;
+    }
 
-  if (link == NULL)
+  if (!_dbus_hash_table_insert_string (d->match_rules_by_key,
+                                       (char *) bus_match_rule_get_key (rule),
+                                       rule))
     return FALSE;
 
-  bus_connection_add_match_rule_link (connection, link);
+  bus_connection_add_match_rule_link (connection,
+                                      bus_match_rule_get_owner_link (rule));
 
   return TRUE;
 }
@@ -1260,10 +2293,14 @@ bus_connection_remove_match_rule (DBusConnection *connection,
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
 
-  _dbus_list_remove_last (&d->match_rules, rule);
+  _dbus_list_unlink (&d->match_rules, bus_match_rule_get_owner_link (rule));
+  _dbus_hash_table_remove_string (d->match_rules_by_key,
+                                  bus_match_rule_get_key (rule));
 
   d->n_match_rules -= 1;
   _dbus_assert (d->n_match_rules >= 0);
+
+  d->connections->n_match_rules -= 1;
 }
 
 int
@@ -1277,6 +2314,32 @@ bus_connection_get_n_match_rules (DBusConnection *connection)
   return d->n_match_rules;
 }
 
+BusMatchRule*
+bus_connection_lookup_match_rule (DBusConnection *connection,
+                                  const char     *key)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (d->match_rules_by_key == NULL)
+    return NULL;
+
+  return _dbus_hash_table_lookup_string (d->match_rules_by_key, key);
+}
+
+DBusList**
+bus_connection_get_match_rules (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->match_rules;
+}
+
 void
 bus_connection_add_owned_service_link (DBusConnection *connection,
                                        DBusList       *link)
@@ -1289,6 +2352,12 @@ bus_connection_add_owned_service_link (DBusConnection *connection,
   _dbus_list_append_link (&d->services_owned, link);
 
   d->n_services_owned += 1;
+
+  _DBUS_PROBE2 (name__acquired, connection,
+                bus_service_get_name (link->data));
+
+  d->connections->names_stamp += 1;
+  d->names_stamp = d->connections->names_stamp;
 }
 
 dbus_bool_t
@@ -1319,7 +2388,12 @@ bus_connection_remove_owned_service (DBusConnection *connection,
   _dbus_list_remove_last (&d->services_owned, service);
 
   d->n_services_owned -= 1;
+
+  _DBUS_PROBE2 (name__released, connection, bus_service_get_name (service));
   _dbus_assert (d->n_services_owned >= 0);
+
+  d->connections->names_stamp += 1;
+  d->names_stamp = d->connections->names_stamp;
 }
 
 int
@@ -1333,6 +2407,31 @@ bus_connection_get_n_services_owned (DBusConnection *connection)
   return d->n_services_owned;
 }
 
+DBusList**
+bus_connection_get_services_owned (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->services_owned;
+}
+
+/* Changes whenever services_owned does; no two connections of a bus
+ * ever have the same stamp, so it also tells connections apart.
+ */
+unsigned long
+bus_connection_get_names_stamp (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return d->names_stamp;
+}
+
 dbus_bool_t
 bus_connection_complete (DBusConnection   *connection,
 			 const DBusString *name,
@@ -1376,6 +2475,21 @@ bus_connection_complete (DBusConnection   *connection,
       d->name = NULL;
       return FALSE;
     }
+
+  /* per-user or per-group quantum, now we know who it is */
+  if (!bus_policy_get_dispatch_quantum (bus_context_get_policy (d->connections->context),
+                                        connection,
+                                        bus_context_get_dispatch_quantum (d->connections->context),
+                                        &d->dispatch_quantum,
+                                        error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      dbus_free (d->name);
+      d->name = NULL;
+      bus_client_policy_unref (d->policy);
+      d->policy = NULL;
+      return FALSE;
+    }
   
   if (dbus_connection_get_unix_user (connection, &uid))
     {
@@ -1391,9 +2505,7 @@ bus_connection_complete (DBusConnection   *connection,
     goto fail;
 
   /* Now the connection is active, move it between lists */
-  _dbus_list_unlink (&d->connections->incomplete,
-                     d->link_in_connection_list);
-  d->connections->n_incomplete -= 1;
+  unlink_incomplete (d->connections, d->link_in_connection_list);
   _dbus_list_append_link (&d->connections->completed,
                           d->link_in_connection_list);
   d->connections->n_completed += 1;
@@ -1480,6 +2592,129 @@ bus_pending_reply_free (BusPendingReply *pending)
   dbus_free (pending);
 }
 
+/* Keeps both ends' counts of the pending replies in the expire list,
+ * which are the ones still awaited; the replier's end is gone once it
+ * has disconnected
+ */
+static void
+count_pending_reply (BusPendingReply *pending,
+                     int              delta)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (pending->will_get_reply);
+  _dbus_assert (d != NULL);
+
+  d->n_pending_replies += delta;
+  _dbus_assert (d->n_pending_replies >= 0);
+
+  if (pending->will_send_reply != NULL)
+    {
+      d = BUS_CONNECTION_DATA (pending->will_send_reply);
+      _dbus_assert (d != NULL);
+
+      d->n_replies_owed += delta;
+      _dbus_assert (d->n_replies_owed >= 0);
+    }
+}
+
+/* Serials are small and dense within each connection, so mix them
+ * into the pointer; entries whose keys collide share a bucket chain.
+ */
+static uintptr_t
+pending_reply_key (DBusConnection *will_get_reply,
+                   dbus_uint32_t   reply_serial)
+{
+  return ((uintptr_t) will_get_reply) ^ (((uintptr_t) reply_serial) * 2654435761u);
+}
+
+static dbus_bool_t
+pending_reply_index_add (BusConnections  *connections,
+                         BusPendingReply *pending)
+{
+  BusPendingReply *head;
+  uintptr_t key;
+
+  key = pending_reply_key (pending->will_get_reply, pending->reply_serial);
+  head = _dbus_hash_table_lookup_uintptr (connections->pending_replies_by_key,
+                                          key);
+
+  if (head != NULL)
+    {
+      /* linking after the head doesn't need a new hash entry */
+      pending->next_in_bucket = head->next_in_bucket;
+      head->next_in_bucket = pending;
+      return TRUE;
+    }
+
+  pending->next_in_bucket = NULL;
+  return _dbus_hash_table_insert_uintptr (connections->pending_replies_by_key,
+                                          key, pending);
+}
+
+/* never allocates, so it's safe from cancel hooks */
+static void
+pending_reply_index_remove (BusConnections  *connections,
+                            BusPendingReply *pending)
+{
+  DBusHashIter iter;
+  BusPendingReply *head;
+  BusPendingReply *prev;
+
+  if (!_dbus_hash_iter_lookup (connections->pending_replies_by_key,
+                               (void *) pending_reply_key (pending->will_get_reply,
+                                                           pending->reply_serial),
+                               FALSE, &iter))
+    _dbus_assert_not_reached ("pending reply was not indexed");
+
+  head = _dbus_hash_iter_get_value (&iter);
+
+  if (head == pending)
+    {
+      if (pending->next_in_bucket != NULL)
+        _dbus_hash_iter_set_value (&iter, pending->next_in_bucket);
+      else
+        _dbus_hash_iter_remove_entry (&iter);
+
+      return;
+    }
+
+  for (prev = head; prev->next_in_bucket != NULL; prev = prev->next_in_bucket)
+    {
+      if (prev->next_in_bucket == pending)
+        {
+          prev->next_in_bucket = pending->next_in_bucket;
+          return;
+        }
+    }
+
+  _dbus_assert_not_reached ("pending reply was not in its bucket");
+}
+
+static BusPendingReply *
+pending_reply_index_lookup (BusConnections *connections,
+                            DBusConnection *will_get_reply,
+                            DBusConnection *will_send_reply,
+                            dbus_uint32_t   reply_serial)
+{
+  BusPendingReply *pending;
+
+  pending = _dbus_hash_table_lookup_uintptr (connections->pending_replies_by_key,
+                                             pending_reply_key (will_get_reply,
+                                                                reply_serial));
+
+  for (; pending != NULL; pending = pending->next_in_bucket)
+    {
+      if (pending->reply_serial == reply_serial &&
+          pending->will_get_reply == will_get_reply &&
+          pending->will_send_reply == will_send_reply &&
+          !pending->replied)
+        return pending;
+    }
+
+  return NULL;
+}
+
 static dbus_bool_t
 bus_pending_reply_send_no_reply (BusConnections  *connections,
                                  BusTransaction  *transaction,
@@ -1555,6 +2790,8 @@ bus_pending_reply_expired (BusExpireList *list,
     }
 
   bus_expire_list_remove_link (connections->pending_replies, link);
+  count_pending_reply (pending, -1);
+  pending_reply_index_remove (connections, pending);
 
   bus_pending_reply_free (pending);
   bus_transaction_execute_and_free (transaction);
@@ -1569,8 +2806,19 @@ bus_connection_drop_pending_replies (BusConnections  *connections,
   /* The DBusConnection is almost 100% finalized here, so you can't
    * do anything with it except check for pointer equality
    */
+  BusConnectionData *d;
   DBusList *link;
 
+  /* Most clients have no call in either direction outstanding when
+   * they go; without this, many leaving at once would each walk
+   * everyone's pending replies
+   */
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (d->n_pending_replies == 0 && d->n_replies_owed == 0)
+    return;
+
   _dbus_verbose ("Dropping pending replies that involve connection %p\n",
                  connection);
   
@@ -1596,6 +2844,8 @@ bus_connection_drop_pending_replies (BusConnections  *connections,
           
           bus_expire_list_remove_link (connections->pending_replies,
                                        link);
+          count_pending_reply (pending, -1);
+          pending_reply_index_remove (connections, pending);
           bus_pending_reply_free (pending);
         }
       else if (pending->will_send_reply == connection)
@@ -1609,11 +2859,11 @@ bus_connection_drop_pending_replies (BusConnections  *connections,
                          pending->will_get_reply,
                          pending->reply_serial);
           
+          d->n_replies_owed -= 1;
           pending->will_send_reply = NULL;
-          pending->expire_item.added_tv_sec = 0;
-          pending->expire_item.added_tv_usec = 0;
 
-          bus_expire_list_recheck_immediately (connections->pending_replies);
+          bus_expire_list_expire_link_now (connections->pending_replies,
+                                           link);
         }
       
       link = next;
@@ -1634,9 +2884,11 @@ cancel_pending_reply (void *data)
 
   _dbus_verbose ("d = %p\n", d);
   
-  if (!bus_expire_list_remove (d->connections->pending_replies,
-                               &d->pending->expire_item))
-    _dbus_assert_not_reached ("pending reply did not exist to be cancelled");
+  bus_expire_list_remove_link (d->connections->pending_replies,
+                               d->pending->link);
+  count_pending_reply (d->pending, -1);
+
+  pending_reply_index_remove (d->connections, d->pending);
 
   bus_pending_reply_free (d->pending); /* since it's been cancelled */
 }
@@ -1669,9 +2921,8 @@ bus_connections_expect_reply (BusConnections  *connections,
 {
   BusPendingReply *pending;
   dbus_uint32_t reply_serial;
-  DBusList *link;
   CancelPendingReplyData *cprd;
-  int count;
+  BusConnectionData *d;
 
   _dbus_assert (will_get_reply != NULL);
   _dbus_assert (will_send_reply != NULL);
@@ -1682,32 +2933,24 @@ bus_connections_expect_reply (BusConnections  *connections,
   
   reply_serial = dbus_message_get_serial (reply_to_this);
 
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  count = 0;
-  while (link != NULL)
+  if (pending_reply_index_lookup (connections, will_get_reply,
+                                  will_send_reply, reply_serial) != NULL)
     {
-      pending = link->data;
-
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == will_get_reply &&
-          pending->will_send_reply == will_send_reply)
-        {
-          dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
-                          "Message has the same reply serial as a currently-outstanding existing method call");
-          return FALSE;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-      if (pending->will_get_reply == will_get_reply)
-        ++count;
+      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                      "Message has the same reply serial as a currently-outstanding existing method call");
+      return FALSE;
     }
-  
-  if (count >=
+
+  d = BUS_CONNECTION_DATA (will_get_reply);
+  _dbus_assert (d != NULL);
+
+  if (d->n_pending_replies >=
       bus_context_get_max_replies_per_connection (connections->context))
     {
       dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
 		      "The maximum number of pending replies per connection has been reached");
+      _DBUS_PROBE3 (message__dropped, will_send_reply, reply_to_this,
+                    "too many pending replies");
       return FALSE;
     }
 
@@ -1718,12 +2961,6 @@ bus_connections_expect_reply (BusConnections  *connections,
       return FALSE;
     }
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-  /* so we can see a not-yet-added pending reply */
-  pending->expire_item.added_tv_sec = 1;
-  pending->expire_item.added_tv_usec = 1;
-#endif
-
   pending->will_get_reply = will_get_reply;
   pending->will_send_reply = will_send_reply;
   pending->reply_serial = reply_serial;
@@ -1736,8 +2973,9 @@ bus_connections_expect_reply (BusConnections  *connections,
       return FALSE;
     }
   
-  if (!bus_expire_list_add (connections->pending_replies,
-                            &pending->expire_item))
+  /* we keep the link so check_reply can unlink it without a search */
+  pending->link = _dbus_list_alloc_link (pending);
+  if (pending->link == NULL)
     {
       BUS_SET_OOM (error);
       dbus_free (cprd);
@@ -1745,13 +2983,31 @@ bus_connections_expect_reply (BusConnections  *connections,
       return FALSE;
     }
 
+  if (!pending_reply_index_add (connections, pending))
+    {
+      BUS_SET_OOM (error);
+      _dbus_list_free_link (pending->link);
+      dbus_free (cprd);
+      bus_pending_reply_free (pending);
+      return FALSE;
+    }
+
+  /* the expire list is kept in order of this time */
+  _dbus_get_current_time (&pending->expire_item.added_tv_sec,
+                          &pending->expire_item.added_tv_usec);
+
+  bus_expire_list_add_link (connections->pending_replies, pending->link);
+  count_pending_reply (pending, 1);
+
   if (!bus_transaction_add_cancel_hook (transaction,
                                         cancel_pending_reply,
                                         cprd,
                                         cancel_pending_reply_data_free))
     {
       BUS_SET_OOM (error);
-      bus_expire_list_remove (connections->pending_replies, &pending->expire_item);
+      bus_expire_list_remove_link (connections->pending_replies, pending->link);
+      count_pending_reply (pending, -1);
+      pending_reply_index_remove (connections, pending);
       dbus_free (cprd);
       bus_pending_reply_free (pending);
       return FALSE;
@@ -1759,9 +3015,6 @@ bus_connections_expect_reply (BusConnections  *connections,
                                         
   cprd->pending = pending;
   cprd->connections = connections;
-  
-  _dbus_get_current_time (&pending->expire_item.added_tv_sec,
-                          &pending->expire_item.added_tv_usec);
 
   _dbus_verbose ("Added pending reply %p, replier %p receiver %p serial %u\n",
                  pending,
@@ -1782,11 +3035,16 @@ static void
 cancel_check_pending_reply (void *data)
 {
   CheckPendingReplyData *d = data;
+  BusPendingReply *pending;
 
   _dbus_verbose ("d = %p\n",d);
 
+  pending = d->link->data;
+  pending->replied = FALSE;
+
   bus_expire_list_add_link (d->connections->pending_replies,
                             d->link);
+  count_pending_reply (pending, 1);
   d->link = NULL;
 }
 
@@ -1803,7 +3061,8 @@ check_pending_reply_data_free (void *data)
       
       _dbus_assert (!bus_expire_list_contains_item (d->connections->pending_replies,
                                                     &pending->expire_item));
-      
+
+      pending_reply_index_remove (d->connections, pending);
       bus_pending_reply_free (pending);
       _dbus_list_free_link (d->link);
     }
@@ -1824,6 +3083,7 @@ bus_connections_check_reply (BusConnections *connections,
                              DBusError      *error)
 {
   CheckPendingReplyData *cprd;
+  BusPendingReply *pending;
   DBusList *link;
   dbus_uint32_t reply_serial;
   
@@ -1832,30 +3092,20 @@ bus_connections_check_reply (BusConnections *connections,
 
   reply_serial = dbus_message_get_reply_serial (reply);
 
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  while (link != NULL)
-    {
-      BusPendingReply *pending = link->data;
-
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == receiving_reply &&
-          pending->will_send_reply == sending_reply)
-        {
-          _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
-          break;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-    }
+  pending = pending_reply_index_lookup (connections, receiving_reply,
+                                        sending_reply, reply_serial);
 
-  if (link == NULL)
+  if (pending == NULL)
     {
       _dbus_verbose ("No pending reply expected\n");
 
       return FALSE;
     }
 
+  _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
+
+  link = pending->link;
+
   cprd = dbus_new0 (CheckPendingReplyData, 1);
   if (cprd == NULL)
     {
@@ -1878,6 +3128,8 @@ bus_connections_check_reply (BusConnections *connections,
   
   bus_expire_list_unlink (connections->pending_replies,
                           link);
+  count_pending_reply (pending, -1);
+  pending->replied = TRUE;
   
   _dbus_assert (!bus_expire_list_contains_item (connections->pending_replies, link->data));
 
@@ -1891,27 +3143,6 @@ bus_connections_check_reply (BusConnections *connections,
  * one transaction across any main loop iterations.
  */
 
-typedef struct
-{
-  BusTransaction *transaction;
-  DBusMessage    *message;
-  DBusPreallocatedSend *preallocated;
-} MessageToSend;
-
-typedef struct
-{
-  BusTransactionCancelFunction cancel_function;
-  DBusFreeFunction free_data_function;
-  void *data;
-} CancelHook;
-
-struct BusTransaction
-{
-  DBusList *connections;
-  BusContext *context;
-  DBusList *cancel_hooks;
-};
-
 static void
 message_to_send_free (DBusConnection *connection,
                       MessageToSend  *to_send)
@@ -1922,7 +3153,8 @@ message_to_send_free (DBusConnection *connection,
   if (to_send->preallocated)
     dbus_connection_free_preallocated_send (connection, to_send->preallocated);
 
-  dbus_free (to_send);
+  _dbus_mem_pool_dealloc (to_send->transaction->bus_connections->message_to_send_pool,
+                          to_send);
 }
 
 static void
@@ -1942,32 +3174,44 @@ cancel_hook_free (void *element,
                   void *data)
 {
   CancelHook *ch = element;
+  BusTransaction *transaction = data;
 
   if (ch->free_data_function)
     (* ch->free_data_function) (ch->data);
 
-  dbus_free (ch);
+  _dbus_mem_pool_dealloc (transaction->bus_connections->cancel_hook_pool, ch);
 }
 
 static void
 free_cancel_hooks (BusTransaction *transaction)
 {
   _dbus_list_foreach (&transaction->cancel_hooks,
-                      cancel_hook_free, NULL);
+                      cancel_hook_free, transaction);
   
   _dbus_list_clear (&transaction->cancel_hooks);
 }
 
+static void
+transaction_free (BusTransaction *transaction)
+{
+  _dbus_mem_pool_dealloc (transaction->bus_connections->transaction_pool,
+                          transaction);
+}
+
 BusTransaction*
 bus_transaction_new (BusContext *context)
 {
   BusTransaction *transaction;
+  BusConnections *connections;
+
+  connections = bus_context_get_connections (context);
 
-  transaction = dbus_new0 (BusTransaction, 1);
+  transaction = _dbus_mem_pool_alloc (connections->transaction_pool);
   if (transaction == NULL)
     return NULL;
 
   transaction->context = context;
+  transaction->bus_connections = connections;
   
   return transaction;
 }
@@ -1989,6 +3233,8 @@ bus_transaction_send_from_driver (BusTransaction *transaction,
                                   DBusConnection *connection,
                                   DBusMessage    *message)
 {
+  BusContext *context;
+
   /* We have to set the sender to the driver, and have
    * to check security policy since it was not done in
    * dispatch.c
@@ -2013,12 +3259,16 @@ bus_transaction_send_from_driver (BusTransaction *transaction,
   
   /* bus driver never wants a reply */
   dbus_message_set_no_reply (message, TRUE);
+
+  context = bus_transaction_get_context (transaction);
+  if (bus_context_get_capture (context) != NULL)
+    bus_capture_message (bus_context_get_capture (context),
+                         NULL, connection, message);
   
   /* If security policy doesn't allow the message, we silently
    * eat it; the driver doesn't care about getting a reply.
    */
-  if (!bus_context_check_security_policy (bus_transaction_get_context (transaction),
-                                          transaction,
+  if (!bus_context_check_security_policy (context, transaction,
                                           NULL, connection, connection, message, NULL))
     return TRUE;
 
@@ -2055,7 +3305,7 @@ bus_transaction_send (BusTransaction *transaction,
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
   
-  to_send = dbus_new (MessageToSend, 1);
+  to_send = _dbus_mem_pool_alloc (transaction->bus_connections->message_to_send_pool);
   if (to_send == NULL)
     {
       return FALSE;
@@ -2064,7 +3314,8 @@ bus_transaction_send (BusTransaction *transaction,
   to_send->preallocated = dbus_connection_preallocate_send (connection);
   if (to_send->preallocated == NULL)
     {
-      dbus_free (to_send);
+      _dbus_mem_pool_dealloc (transaction->bus_connections->message_to_send_pool,
+                              to_send);
       return FALSE;
     }  
   
@@ -2158,7 +3409,7 @@ bus_transaction_cancel_and_free (BusTransaction *transaction)
 
   free_cancel_hooks (transaction);
   
-  dbus_free (transaction);
+  transaction_free (transaction);
 }
 
 static void
@@ -2167,10 +3418,13 @@ connection_execute_transaction (DBusConnection *connection,
 {
   DBusList *link;
   BusConnectionData *d;
+  BusContext *context;
   
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
 
+  context = d->connections->context;
+
   /* Send the queue in order (FIFO) */
   link = _dbus_list_get_last_link (&d->transaction_messages);
   while (link != NULL)
@@ -2184,11 +3438,20 @@ connection_execute_transaction (DBusConnection *connection,
                                   link);
 
           _dbus_assert (dbus_message_get_sender (m->message) != NULL);
+
+          /* A recipient that's fallen behind only gets the latest
+           * of the signals named by <coalesce>
+           */
+          if (dbus_connection_get_outgoing_size (connection) >
+              bus_context_get_coalesce_threshold (context) &&
+              bus_context_get_signal_coalesces (context, m->message))
+            _dbus_connection_drop_superseded_signals (connection, m->message);
           
           dbus_connection_send_preallocated (connection,
                                              m->preallocated,
                                              m->message,
                                              NULL);
+          count_outgoing (d, m->message);
 
           m->preallocated = NULL; /* so we don't double-free it */
           
@@ -2216,7 +3479,7 @@ bus_transaction_execute_and_free (BusTransaction *transaction)
 
   free_cancel_hooks (transaction);
   
-  dbus_free (transaction);
+  transaction_free (transaction);
 }
 
 static void
@@ -2281,7 +3544,7 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
 {
   CancelHook *ch;
 
-  ch = dbus_new (CancelHook, 1);
+  ch = _dbus_mem_pool_alloc (transaction->bus_connections->cancel_hook_pool);
   if (ch == NULL)
     return FALSE;
 
@@ -2297,7 +3560,7 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
    */
   if (!_dbus_list_prepend (&transaction->cancel_hooks, ch))
     {
-      dbus_free (ch);
+      _dbus_mem_pool_dealloc (transaction->bus_connections->cancel_hook_pool, ch);
       return FALSE;
     }
 
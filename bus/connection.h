@@ -31,6 +31,31 @@
 typedef dbus_bool_t (* BusConnectionForeachFunction) (DBusConnection *connection, 
                                                       void           *data);
 
+/* What the Debug.Stats interface reports, for one connection or
+ * summed over the bus. Only the traffic counters and the peak are
+ * kept as we go; the rest is read when asked for.
+ */
+typedef struct
+{
+  dbus_uint64_t messages_in;      /**< Messages received from the client */
+  dbus_uint64_t bytes_in;         /**< Bytes of those messages */
+  dbus_uint64_t messages_out;     /**< Messages sent to the client */
+  dbus_uint64_t bytes_out;        /**< Bytes of those messages */
+  dbus_uint32_t oom_retries;      /**< Times a message of theirs hit out-of-memory */
+  dbus_uint32_t policy_denials;   /**< Messages of theirs the policy rejected */
+  dbus_uint32_t peak_match_rules; /**< Most match rules held at once */
+  dbus_uint32_t match_rules;
+  dbus_uint32_t names_owned;
+  dbus_uint32_t pending_replies;  /**< Method calls from the client awaiting a reply */
+  dbus_uint32_t incoming_bytes;   /**< Received messages not yet finalized */
+  dbus_uint32_t outgoing_bytes;   /**< Messages queued and not yet written */
+  dbus_uint32_t read_budget;      /**< Most bytes read per main loop iteration */
+  dbus_uint32_t write_budget;     /**< Most bytes written per main loop iteration */
+  dbus_uint32_t state_bytes;      /**< What the bus holds for the client itself */
+  dbus_uint32_t idle_connections; /**< Bus-wide only: connections trimmed as idle */
+  dbus_uint32_t idle_state_bytes; /**< Bus-wide only: state_bytes of those */
+} BusConnectionStats;
+
 
 BusConnections* bus_connections_new               (BusContext                   *context);
 BusConnections* bus_connections_ref               (BusConnections               *connections);
@@ -45,6 +70,11 @@ void            bus_connections_foreach_active    (BusConnections
                                                    void                         *data);
 BusContext*     bus_connections_get_context       (BusConnections               *connections);
 void            bus_connections_increment_stamp   (BusConnections               *connections);
+void            bus_connections_get_stats         (BusConnections               *connections,
+                                                   BusConnectionStats           *totals,
+                                                   int                          *n_completed,
+                                                   int                          *n_incomplete);
+void            bus_connections_trim_memory       (BusConnections               *connections);
 BusContext*     bus_connection_get_context        (DBusConnection               *connection);
 BusConnections* bus_connection_get_connections    (DBusConnection               *connection);
 BusRegistry*    bus_connection_get_registry       (DBusConnection               *connection);
@@ -52,6 +82,7 @@ BusActivation*  bus_connection_get_activation     (DBusConnection
 BusMatchmaker*  bus_connection_get_matchmaker     (DBusConnection               *connection);
 const char *    bus_connection_get_loginfo        (DBusConnection        *connection);
 BusSELinuxID*   bus_connection_get_selinux_id     (DBusConnection               *connection);
+BusSELinuxSendCache* bus_connection_get_selinux_send_cache (DBusConnection           *connection);
 dbus_bool_t     bus_connections_check_limits      (BusConnections               *connections,
                                                    DBusConnection               *requesting_completion,
                                                    DBusError                    *error);
@@ -71,22 +102,34 @@ dbus_bool_t     bus_connections_check_reply       (BusConnections
                                                    DBusError                    *error);
 
 dbus_bool_t     bus_connection_mark_stamp         (DBusConnection               *connection);
+dbus_bool_t     bus_connection_has_stamp          (DBusConnection               *connection);
 
 dbus_bool_t bus_connection_is_active (DBusConnection *connection);
 const char *bus_connection_get_name  (DBusConnection *connection);
+dbus_bool_t bus_connection_is_bridge (DBusConnection *connection);
+void        bus_connection_set_is_bridge (DBusConnection *connection);
 
 dbus_bool_t bus_connection_preallocate_oom_error (DBusConnection *connection);
 void        bus_connection_send_oom_error        (DBusConnection *connection,
                                                   DBusMessage    *in_reply_to);
 
+/* called by dispatch.c for each message a client sends us */
+void        bus_connection_count_incoming        (DBusConnection *connection,
+                                                  DBusMessage    *message);
+void        bus_connection_count_oom_retry       (DBusConnection *connection);
+void        bus_connection_count_policy_denial   (DBusConnection *connection);
+void        bus_connection_get_stats             (DBusConnection     *connection,
+                                                  BusConnectionStats *stats);
+
 /* called by signals.c */
 dbus_bool_t bus_connection_add_match_rule      (DBusConnection *connection,
                                                 BusMatchRule   *rule);
-void        bus_connection_add_match_rule_link (DBusConnection *connection,
-                                                DBusList       *link);
 void        bus_connection_remove_match_rule   (DBusConnection *connection,
                                                 BusMatchRule   *rule);
 int         bus_connection_get_n_match_rules   (DBusConnection *connection);
+DBusList**  bus_connection_get_match_rules     (DBusConnection *connection);
+BusMatchRule* bus_connection_lookup_match_rule (DBusConnection *connection,
+                                                const char     *key);
 
 
 /* called by services.c */
@@ -97,6 +140,8 @@ void        bus_connection_remove_owned_service   (DBusConnection *connection,
 void        bus_connection_add_owned_service_link (DBusConnection *connection,
                                                    DBusList       *link);
 int         bus_connection_get_n_services_owned   (DBusConnection *connection);
+DBusList**  bus_connection_get_services_owned     (DBusConnection *connection);
+unsigned long bus_connection_get_names_stamp      (DBusConnection *connection);
 
 /* called by driver.c */
 dbus_bool_t bus_connection_complete (DBusConnection               *connection,
@@ -28,15 +28,20 @@
 #include "desktop-file.h"
 #include "utils.h"
 
+/* Section names, keys and values are not copied out of the file: they
+ * are unescaped where they are and nul-terminated in place, which never
+ * makes them longer, and point into BusDesktopFile::data.
+ */
+
 typedef struct
 {
-  char *key;
-  char *value;
+  const char *key;
+  const char *value;
 } BusDesktopFileLine;
 
 typedef struct
 {
-  char *section_name;
+  const char *section_name;
   
   int n_lines;
   BusDesktopFileLine *lines;
@@ -45,6 +50,8 @@ typedef struct
 
 struct BusDesktopFile
 {
+  DBusString data; /**< The file, which everything below points into */
+
   int n_sections;
   BusDesktopFileSection *sections;
   int n_allocated_sections;
@@ -55,7 +62,7 @@ struct BusDesktopFile
  */
 typedef struct
 {
-  DBusString data; /**< The data from the file */
+  DBusString *data; /**< The data from the file, owned by desktop_file */
 
   BusDesktopFile *desktop_file; /**< The resulting object */
   int current_section;    /**< The current section being parsed */
@@ -96,27 +103,6 @@ static void
 parser_free (BusDesktopFileParser *parser)
 {
   bus_desktop_file_free (parser->desktop_file);
-  
-  _dbus_string_free (&parser->data);
-}
-
-static void
-bus_desktop_file_line_free (BusDesktopFileLine *line)
-{
-  dbus_free (line->key);
-  dbus_free (line->value);
-}
-
-static void
-bus_desktop_file_section_free (BusDesktopFileSection *section)
-{
-  int i;
-
-  for (i = 0; i < section->n_lines; i++)
-    bus_desktop_file_line_free (&section->lines[i]);
-
-  dbus_free (section->lines);
-  dbus_free (section->section_name);
 }
 
 void
@@ -125,9 +111,10 @@ bus_desktop_file_free (BusDesktopFile *desktop_file)
   int i;
 
   for (i = 0; i < desktop_file->n_sections; i++)
-    bus_desktop_file_section_free (&desktop_file->sections[i]);
+    dbus_free (desktop_file->sections[i].lines);
   dbus_free (desktop_file->sections);
 
+  _dbus_string_free (&desktop_file->data);
   dbus_free (desktop_file);
 }
 
@@ -178,9 +165,12 @@ grow_sections (BusDesktopFile *desktop_file)
   return TRUE;
 }
 
-static char *
+/* Unescapes the text from pos to end_pos where it is, and
+ * nul-terminates it, overwriting at most the byte at end_pos
+ */
+static const char *
 unescape_string (BusDesktopFileParser *parser,
-                 const DBusString     *str,
+                 DBusString           *str,
                  int                   pos,
                  int                   end_pos,
                  DBusError            *error)
@@ -189,16 +179,7 @@ unescape_string (BusDesktopFileParser *parser,
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   
-  /* len + 1 is enough, because unescaping never makes the
-   * string longer
-   */
-  retval = dbus_malloc (end_pos - pos + 1);
-  if (retval == NULL)
-    {
-      BUS_SET_OOM (error);
-      return NULL;
-    }
-
+  retval = _dbus_string_get_data_len (str, pos, end_pos - pos);
   q = retval;
   
   while (pos < end_pos)
@@ -206,7 +187,6 @@ unescape_string (BusDesktopFileParser *parser,
       if (_dbus_string_get_byte (str, pos) == 0)
 	{
 	  /* Found an embedded null */
-	  dbus_free (retval);
           report_error (parser, "Text to be unescaped contains embedded nul",
                         BUS_DESKTOP_PARSE_ERROR_INVALID_ESCAPES, error);
 	  return NULL;
@@ -219,7 +199,6 @@ unescape_string (BusDesktopFileParser *parser,
 	  if (pos >= end_pos)
 	    {
 	      /* Escape at end of string */
-	      dbus_free (retval);
               report_error (parser, "Text to be unescaped ended in \\",
                             BUS_DESKTOP_PARSE_ERROR_INVALID_ESCAPES, error);
 	      return NULL;
@@ -244,7 +223,6 @@ unescape_string (BusDesktopFileParser *parser,
               break;
            default:
 	     /* Invalid escape code */
-	     dbus_free (retval);
              report_error (parser, "Text to be unescaped had invalid escape sequence",
                            BUS_DESKTOP_PARSE_ERROR_INVALID_ESCAPES, error);
              return NULL;
@@ -269,7 +247,6 @@ new_section (BusDesktopFile *desktop_file,
              const char     *name)
 {
   int n;
-  char *name_copy;
   
   if (desktop_file->n_allocated_sections == desktop_file->n_sections)
     {
@@ -277,23 +254,15 @@ new_section (BusDesktopFile *desktop_file,
         return NULL;
     }
 
-  name_copy = _dbus_strdup (name);
-  if (name_copy == NULL)
-    return NULL;
-
   n = desktop_file->n_sections;
-  desktop_file->sections[n].section_name = name_copy;
+  desktop_file->sections[n].section_name = name;
 
   desktop_file->sections[n].n_lines = 0;
   desktop_file->sections[n].lines = NULL;
   desktop_file->sections[n].n_allocated_lines = 0;
 
   if (!grow_lines_in_section (&desktop_file->sections[n]))
-    {
-      dbus_free (desktop_file->sections[n].section_name);
-      desktop_file->sections[n].section_name = NULL;
-      return NULL;
-    }
+    return NULL;
 
   desktop_file->n_sections += 1;
   
@@ -302,7 +271,7 @@ new_section (BusDesktopFile *desktop_file,
 
 static BusDesktopFileSection* 
 open_section (BusDesktopFileParser *parser,
-              char                 *name)
+              const char           *name)
 {  
   BusDesktopFileSection *section;
 
@@ -345,7 +314,7 @@ is_blank_line (BusDesktopFileParser *parser)
   
   p = parser->pos;
 
-  c = _dbus_string_get_byte (&parser->data, p);
+  c = _dbus_string_get_byte (parser->data, p);
 
   while (c && c != '\n')
     {
@@ -353,7 +322,7 @@ is_blank_line (BusDesktopFileParser *parser)
 	return FALSE;
       
       p++;
-      c = _dbus_string_get_byte (&parser->data, p);
+      c = _dbus_string_get_byte (parser->data, p);
     }
 
   return TRUE;
@@ -364,7 +333,7 @@ parse_comment_or_blank (BusDesktopFileParser *parser)
 {
   int line_end, eol_len;
   
-  if (!_dbus_string_find_eol (&parser->data, parser->pos, &line_end, &eol_len))
+  if (!_dbus_string_find_eol (parser->data, parser->pos, &line_end, &eol_len))
     line_end = parser->len;
 
   if (line_end == parser->len)
@@ -396,15 +365,15 @@ static dbus_bool_t
 parse_section_start (BusDesktopFileParser *parser, DBusError *error)
 {
   int line_end, eol_len;
-  char *section_name;
+  const char *section_name;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
     
-  if (!_dbus_string_find_eol (&parser->data, parser->pos, &line_end, &eol_len))
+  if (!_dbus_string_find_eol (parser->data, parser->pos, &line_end, &eol_len))
     line_end = parser->len;
   
   if (line_end - parser->pos <= 2 ||
-      _dbus_string_get_byte (&parser->data, line_end - 1) != ']')
+      _dbus_string_get_byte (parser->data, line_end - 1) != ']')
     {
       report_error (parser, "Invalid syntax for section header", BUS_DESKTOP_PARSE_ERROR_INVALID_SYNTAX, error);
       parser_free (parser);
@@ -412,7 +381,7 @@ parse_section_start (BusDesktopFileParser *parser, DBusError *error)
     }
 
   section_name = unescape_string (parser,
-                                  &parser->data, parser->pos + 1, line_end - 1,
+                                  parser->data, parser->pos + 1, line_end - 1,
                                   error);
 
   if (section_name == NULL)
@@ -425,13 +394,11 @@ parse_section_start (BusDesktopFileParser *parser, DBusError *error)
     {
       report_error (parser, "Invalid characters in section name", BUS_DESKTOP_PARSE_ERROR_INVALID_CHARS, error);
       parser_free (parser);
-      dbus_free (section_name);
       return FALSE;
     }
 
   if (open_section (parser, section_name) == NULL)
     {
-      dbus_free (section_name);
       parser_free (parser);
       BUS_SET_OOM (error);
       return FALSE;
@@ -443,8 +410,6 @@ parse_section_start (BusDesktopFileParser *parser, DBusError *error)
     parser->pos = line_end + eol_len;
   
   parser->line_num += 1;
-
-  dbus_free (section_name);
   
   return TRUE;
 }
@@ -456,19 +421,25 @@ parse_key_value (BusDesktopFileParser *parser, DBusError *error)
   int key_start, key_end;
   int value_start;
   int p;
-  char *value, *tmp;
-  DBusString key;
+  const char *value;
   BusDesktopFileLine *line;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   
-  if (!_dbus_string_find_eol (&parser->data, parser->pos, &line_end, &eol_len))
+  if (parser->current_section == -1)
+    {
+      report_error (parser, "Key/value pair before the first section", BUS_DESKTOP_PARSE_ERROR_INVALID_SYNTAX, error);
+      parser_free (parser);
+      return FALSE;
+    }
+
+  if (!_dbus_string_find_eol (parser->data, parser->pos, &line_end, &eol_len))
     line_end = parser->len;
   
   p = parser->pos;
   key_start = p;
   while (p < line_end &&
-	 (valid[_dbus_string_get_byte (&parser->data, p)] & VALID_KEY_CHAR))
+	 (valid[_dbus_string_get_byte (parser->data, p)] & VALID_KEY_CHAR))
     p++;
   key_end = p;
   
@@ -480,7 +451,7 @@ parse_key_value (BusDesktopFileParser *parser, DBusError *error)
     }
 
   /* We ignore locales for now */
-  if (p < line_end && _dbus_string_get_byte (&parser->data, p) == '[')
+  if (p < line_end && _dbus_string_get_byte (parser->data, p) == '[')
     {
       if (line_end == parser->len)
 	parser->pos = parser->len;
@@ -493,10 +464,10 @@ parse_key_value (BusDesktopFileParser *parser, DBusError *error)
     }
   
   /* Skip space before '=' */
-  while (p < line_end && _dbus_string_get_byte (&parser->data, p) == ' ')
+  while (p < line_end && _dbus_string_get_byte (parser->data, p) == ' ')
     p++;
 
-  if (p < line_end && _dbus_string_get_byte (&parser->data, p) != '=')
+  if (p < line_end && _dbus_string_get_byte (parser->data, p) != '=')
     {
       report_error (parser, "Invalid characters in key name", BUS_DESKTOP_PARSE_ERROR_INVALID_CHARS, error);
       parser_free (parser);
@@ -514,12 +485,12 @@ parse_key_value (BusDesktopFileParser *parser, DBusError *error)
   p++;
 
   /* Skip space after '=' */
-  while (p < line_end && _dbus_string_get_byte (&parser->data, p) == ' ')
+  while (p < line_end && _dbus_string_get_byte (parser->data, p) == ' ')
     p++;
 
   value_start = p;
   
-  value = unescape_string (parser, &parser->data, value_start, line_end, error);
+  value = unescape_string (parser, parser->data, value_start, line_end, error);
   if (value == NULL)
     {
       parser_free (parser);
@@ -529,42 +500,16 @@ parse_key_value (BusDesktopFileParser *parser, DBusError *error)
   line = new_line (parser);
   if (line == NULL)
     {
-      dbus_free (value);
       parser_free (parser);
       BUS_SET_OOM (error);
       return FALSE;
     }
-  
-  if (!_dbus_string_init (&key))
-    {
-      dbus_free (value);
-      parser_free (parser);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  
-  if (!_dbus_string_copy_len (&parser->data, key_start, key_end - key_start,
-                              &key, 0))
-    {
-      _dbus_string_free (&key);
-      dbus_free (value);
-      parser_free (parser);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  
-  if (!_dbus_string_steal_data (&key, &tmp))
-    {
-      _dbus_string_free (&key);
-      dbus_free (value);
-      parser_free (parser);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  
-  _dbus_string_free (&key);
-  
-  line->key = tmp;
+
+  /* the byte at key_end is the '=' or space before it, done with now */
+  _dbus_string_set_byte (parser->data, key_end, '\0');
+
+  line->key = _dbus_string_get_const_data_len (parser->data, key_start,
+                                               key_end - key_start);
   line->value = value;
 
   if (line_end == parser->len)
@@ -670,15 +615,17 @@ bus_desktop_file_load (DBusString *filename,
       return NULL;
     }
   
-  parser.data = str;
+  parser.desktop_file->data = str;
+  _dbus_string_relocated (&parser.desktop_file->data);
+  parser.data = &parser.desktop_file->data;
   parser.line_num = 1;
   parser.pos = 0;
-  parser.len = _dbus_string_get_length (&parser.data);
+  parser.len = _dbus_string_get_length (parser.data);
   parser.current_section = -1;
 
   while (parser.pos < parser.len)
     {
-      if (_dbus_string_get_byte (&parser.data, parser.pos) == '[')
+      if (_dbus_string_get_byte (parser.data, parser.pos) == '[')
 	{
 	  if (!parse_section_start (&parser, error))
             {
@@ -686,7 +633,7 @@ bus_desktop_file_load (DBusString *filename,
             }
 	}
       else if (is_blank_line (&parser) ||
-	       _dbus_string_get_byte (&parser.data, parser.pos) == '#')
+	       _dbus_string_get_byte (parser.data, parser.pos) == '#')
 	parse_comment_or_blank (&parser);
       else
 	{
@@ -697,8 +644,6 @@ bus_desktop_file_load (DBusString *filename,
 	}
     }
 
-  _dbus_string_free (&parser.data);
-
   return parser.desktop_file;
 }
 
@@ -33,3 +33,14 @@ void
 bus_set_watched_dirs (BusContext *context, DBusList **directories)
 {
 }
+
+dbus_bool_t
+bus_dir_watch_reports_files (const char *dir)
+{
+  return FALSE;
+}
+
+void
+bus_dir_watch_flush (void)
+{
+}
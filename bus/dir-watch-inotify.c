@@ -35,6 +35,7 @@
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-watch.h>
+#include "activation.h"
 #include "dir-watch.h"
 
 #define MAX_DIRS_TO_WATCH 128
@@ -48,6 +49,11 @@ static int num_wds = 0;
 static int inotify_fd = -1;
 static DBusWatch *watch = NULL;
 static DBusLoop *loop = NULL;
+static BusContext *watched_context = NULL;
+/* Events were lost, so directories have to be rescanned on the reload
+ * that follows; cleared when the reload sets the watched dirs again.
+ */
+static dbus_bool_t queue_overflowed = FALSE;
 
 static dbus_bool_t
 _inotify_watch_callback (DBusWatch *watch, unsigned int condition, void *data)
@@ -55,6 +61,42 @@ _inotify_watch_callback (DBusWatch *watch, unsigned int condition, void *data)
   return dbus_watch_handle (watch, condition);
 }
 
+/* Returns TRUE if the event was a change to a service file, which
+ * activation takes care of without a reload
+ */
+static dbus_bool_t
+_handle_service_file_event (struct inotify_event *ev)
+{
+  BusActivation *activation;
+  int i;
+
+  if (ev->mask & IN_Q_OVERFLOW)
+    {
+      queue_overflowed = TRUE;
+      return FALSE;
+    }
+
+  for (i = 0; i < num_wds; i++)
+    {
+      if (wds[i] == ev->wd)
+        break;
+    }
+
+  /* left over from a watch we already removed */
+  if (i == num_wds)
+    return TRUE;
+
+  /* the directory itself went away or moved */
+  if (ev->len == 0 || queue_overflowed || watched_context == NULL)
+    return FALSE;
+
+  activation = bus_context_get_activation (watched_context);
+  if (activation == NULL)
+    return FALSE;
+
+  return bus_activation_service_file_changed (activation, dirs[i], ev->name);
+}
+
 static dbus_bool_t
 _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
 {
@@ -82,6 +124,9 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
         _dbus_verbose ("event name: '%s'\n", ev->name);
       _dbus_verbose ("inotify event: wd=%d mask=%u cookie=%u len=%u\n", ev->wd, ev->mask, ev->cookie, ev->len);
 #endif
+      if (_handle_service_file_event (ev))
+        continue;
+
       _dbus_verbose ("Sending SIGHUP signal on reception of a inotify event\n");
       have_change = TRUE;
     }
@@ -214,6 +259,7 @@ _shutdown_inotify (void *data)
     }
   watch = NULL;
   loop = NULL;
+  watched_context = NULL;
 }
 
 static int
@@ -274,5 +320,40 @@ bus_set_watched_dirs (BusContext *context, DBusList **directories)
   if (!_init_inotify (context))
     return;
 
+  watched_context = context;
   _set_watched_dirs_internal (directories);
+  queue_overflowed = FALSE;
+}
+
+dbus_bool_t
+bus_dir_watch_reports_files (const char *dir)
+{
+  int i;
+
+  if (inotify_fd == -1 || queue_overflowed)
+    return FALSE;
+
+  for (i = 0; i < num_wds; i++)
+    {
+      if (dirs[i] != NULL && strcmp (dirs[i], dir) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+void
+bus_dir_watch_flush (void)
+{
+  DBusPollFD poll_fd;
+
+  if (inotify_fd == -1 || watch == NULL)
+    return;
+
+  poll_fd.fd = inotify_fd;
+  poll_fd.events = _DBUS_POLLIN;
+  poll_fd.revents = 0;
+
+  if (_dbus_poll (&poll_fd, 1, 0) > 0 && (poll_fd.revents & _DBUS_POLLIN))
+    _handle_inotify_watch (watch, DBUS_WATCH_READABLE, NULL);
 }
@@ -253,3 +253,15 @@ bus_set_watched_dirs (BusContext *context, DBusList **directories)
  out:
   ;
 }
+
+/* kqueue only says that a directory changed, not which file */
+dbus_bool_t
+bus_dir_watch_reports_files (const char *dir)
+{
+  return FALSE;
+}
+
+void
+bus_dir_watch_flush (void)
+{
+}
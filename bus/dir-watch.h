@@ -37,4 +37,20 @@
  */
 void bus_set_watched_dirs (BusContext *context, DBusList **dirs);
 
+/**
+ * Whether the files in a directory are watched individually, i.e.
+ * each change is passed to bus_activation_service_file_changed() as
+ * it happens, so the directory never needs to be scanned for changes.
+ *
+ * @param dir The directory path
+ * @returns #TRUE if changes to dir's files are reported one by one
+ */
+dbus_bool_t bus_dir_watch_reports_files (const char *dir);
+
+/**
+ * Handle any changes the operating system has already reported but
+ * the main loop hasn't got to yet.
+ */
+void bus_dir_watch_flush (void);
+
 #endif /* DIR_WATCH_H */
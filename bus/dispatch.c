@@ -25,6 +25,8 @@
 
 #include <config.h>
 #include "dispatch.h"
+#include "bridge.h"
+#include "capture.h"
 #include "connection.h"
 #include "driver.h"
 #include "services.h"
@@ -34,6 +36,11 @@
 #include "signals.h"
 #include "test.h"
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-credentials.h>
+#include <dbus/dbus-flight-recorder.h>
+#include <dbus/dbus-latency.h>
+#include <dbus/dbus-probes.h>
 #include <string.h>
 
 #ifdef HAVE_UNIX_FD_PASSING
@@ -94,10 +101,12 @@ bus_dispatch_matches (BusTransaction *transaction,
 {
   DBusError tmp_error;
   BusConnections *connections;
-  DBusList *recipients;
+  BusRecipients recipients;
   BusMatchmaker *matchmaker;
-  DBusList *link;
   BusContext *context;
+  DBusLatencyStart timing;
+  dbus_bool_t ok;
+  int i;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -110,6 +119,10 @@ bus_dispatch_matches (BusTransaction *transaction,
 
   context = bus_transaction_get_context (transaction);
 
+  if (bus_context_get_capture (context) != NULL)
+    bus_capture_message (bus_context_get_capture (context),
+                         sender, addressed_recipient, message);
+
   /* First, send the message to the addressed_recipient, if there is one. */
   if (addressed_recipient != NULL)
     {
@@ -143,38 +156,53 @@ bus_dispatch_matches (BusTransaction *transaction,
   dbus_error_init (&tmp_error);
   matchmaker = bus_context_get_matchmaker (context);
 
-  recipients = NULL;
-  if (!bus_matchmaker_get_recipients (matchmaker, connections,
+  bus_recipients_init (&recipients);
+  _dbus_latency_begin (&timing);
+  ok = bus_matchmaker_get_recipients (matchmaker, connections,
                                       sender, addressed_recipient, message,
-                                      &recipients))
+                                      &recipients);
+  _dbus_latency_end (DBUS_LATENCY_MATCH, &timing);
+  if (!ok)
     {
+      bus_recipients_free (&recipients);
       BUS_SET_OOM (error);
       return FALSE;
     }
 
-  link = _dbus_list_get_first_link (&recipients);
-  while (link != NULL)
-    {
-      DBusConnection *dest;
-
-      dest = link->data;
+  _DBUS_PROBE3 (message__routed, sender, message,
+                recipients.n_connections + (addressed_recipient != NULL));
+  _dbus_flight_record (DBUS_FLIGHT_ROUTED,
+                       sender != NULL ? _dbus_connection_get_flight_id (sender) : 0,
+                       dbus_message_get_serial (message),
+                       recipients.n_connections + (addressed_recipient != NULL));
 
-      if (!send_one_message (dest, context, sender, addressed_recipient,
-                             message, transaction, &tmp_error))
+  for (i = 0; i < recipients.n_connections; i++)
+    {
+      if (!send_one_message (recipients.connections[i], context, sender,
+                             addressed_recipient, message, transaction,
+                             &tmp_error))
         break;
-
-      link = _dbus_list_get_next_link (&recipients, link);
     }
 
-  _dbus_list_clear (&recipients);
+  bus_recipients_free (&recipients);
 
   if (dbus_error_is_set (&tmp_error))
     {
       dbus_move_error (&tmp_error, error);
       return FALSE;
     }
-  else
-    return TRUE;
+
+  /* Broadcasts from our own clients go on to any peer bus that wants
+   * them; not the driver's, which are about this bus, nor ones that
+   * another bus bridged in
+   */
+  if (bus_context_get_bridges (context) != NULL &&
+      addressed_recipient == NULL && sender != NULL &&
+      dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL &&
+      !bus_connection_is_bridge (sender))
+    bus_bridges_forward (bus_context_get_bridges (context), message);
+
+  return TRUE;
 }
 
 static DBusHandlerResult
@@ -201,11 +229,17 @@ bus_dispatch (DBusConnection *connection,
    * until we can.
    */
   while (!bus_connection_preallocate_oom_error (connection))
-    _dbus_wait_for_memory ();
+    {
+      bus_connection_count_oom_retry (connection);
+      _dbus_wait_for_memory ();
+    }
 
   /* Ref connection in case we disconnect it at some point in here */
   dbus_connection_ref (connection);
 
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    bus_connection_count_incoming (connection, message);
+
   service_name = dbus_message_get_destination (message);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
@@ -410,7 +444,23 @@ bus_dispatch_message_filter (DBusConnection     *connection,
                              DBusMessage        *message,
                              void               *user_data)
 {
-  return bus_dispatch (connection, message);
+  DBusLatencyStart timing;
+  DBusHandlerResult result;
+
+  _dbus_flight_record (DBUS_FLIGHT_DISPATCH,
+                       _dbus_connection_get_flight_id (connection),
+                       dbus_message_get_serial (message),
+                       dbus_message_get_type (message));
+
+  _dbus_latency_begin (&timing);
+  result = bus_dispatch (connection, message);
+  _dbus_latency_end (DBUS_LATENCY_DISPATCH, &timing);
+
+  _dbus_flight_record (DBUS_FLIGHT_DISPATCHED,
+                       _dbus_connection_get_flight_id (connection),
+                       dbus_message_get_serial (message), result);
+
+  return result;
 }
 
 dbus_bool_t
@@ -4059,10 +4109,15 @@ check1_try_iterations (BusContext *context,
     _dbus_assert_not_reached ("test failed");
 }
 
+/* after and limit are for the paged methods; pass NULL and 0 for
+ * the others
+ */
 static dbus_bool_t
 check_get_services (BusContext     *context,
 		    DBusConnection *connection,
 		    const char     *method,
+		    const char     *after,
+		    dbus_uint32_t   limit,
 		    char         ***services,
 		    int            *len)
 {
@@ -4085,6 +4140,16 @@ check_get_services (BusContext     *context,
   if (message == NULL)
     return TRUE;
 
+  if (after != NULL &&
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &after,
+                                 DBUS_TYPE_UINT32, &limit,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
   if (!dbus_connection_send (connection, message, &serial))
     {
       dbus_message_unref (message);
@@ -4189,201 +4254,928 @@ check_get_services (BusContext     *context,
   return retval;
 }
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
+/* Asks ListNamesPaged for one page and checks it against the names
+ * from ListNames: the first limit of them sorting after after, in
+ * order. Returns TRUE if the correct thing happens, but the correct
+ * thing may include OOM errors.
  */
 static dbus_bool_t
-check_list_services (BusContext     *context,
-		     DBusConnection *connection)
+check_list_names_page (BusContext     *context,
+                       DBusConnection *connection,
+                       char          **all,
+                       int             n_all,
+                       const char     *after,
+                       dbus_uint32_t   limit)
 {
-  DBusMessage  *message;
-  DBusMessage  *base_service_message;
-  const char   *base_service;
-  dbus_uint32_t serial;
-  dbus_bool_t   retval;
-  const char   *existent = EXISTENT_SERVICE_NAME;
-  dbus_uint32_t flags;
-  char        **services;
-  int           len;
+  const char *prev;
+  const char *expected;
+  char **page;
+  int len;
+  int i, j;
+
+  page = NULL;
+  len = 0;
+  if (!check_get_services (context, connection, "ListNamesPaged",
+                           after, limit, &page, &len))
+    return FALSE;
 
-  _dbus_verbose ("check_list_services for %p\n", connection);
+  /* ran out of memory somewhere */
+  if (page == NULL)
+    return TRUE;
 
-  if (!check_get_services (context, connection, "ListActivatableNames", &services, &len))
+  prev = after;
+  for (i = 0; i < (int) limit; i++)
     {
-      return TRUE;
+      /* the smallest name after the previous one */
+      expected = NULL;
+      for (j = 0; j < n_all; j++)
+        {
+          if (strcmp (all[j], prev) > 0 &&
+              (expected == NULL || strcmp (all[j], expected) < 0))
+            expected = all[j];
+        }
+
+      if (expected == NULL)
+        break;
+
+      if (i >= len || strcmp (page[i], expected) != 0)
+        {
+          _dbus_warn ("ListNamesPaged after \"%s\" returned %s where %s was expected\n",
+                      after, i < len ? page[i] : "nothing", expected);
+          dbus_free_string_array (page);
+          return FALSE;
+        }
+
+      prev = expected;
     }
 
-  if (!_dbus_string_array_contains ((const char **)services, existent))
+  if (len != i)
     {
-      _dbus_warn ("Did not get the expected %s from ListActivatableNames\n", existent);
-      dbus_free_string_array (services);
+      _dbus_warn ("ListNamesPaged after \"%s\" returned %d names, expected %d\n",
+                  after, len, i);
+      dbus_free_string_array (page);
       return FALSE;
     }
 
-  dbus_free_string_array (services);
-
-  base_service_message = NULL;
-
-  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
-					  DBUS_PATH_DBUS,
-					  DBUS_INTERFACE_DBUS,
-					  "StartServiceByName");
+  dbus_free_string_array (page);
+  return TRUE;
+}
 
-  if (message == NULL)
+/* Sends a call to the bus driver that has bad arguments and checks
+ * that it gets InvalidArgs. Returns TRUE if the correct thing
+ * happens, but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_invalid_args_reply (BusContext     *context,
+                          DBusConnection *connection,
+                          DBusMessage    *message)
+{
+  if (!dbus_connection_send (connection, message, NULL))
     return TRUE;
 
-  dbus_message_set_auto_start (message, FALSE);
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection, "InvalidArgs from the bus driver");
 
-  flags = 0;
-  if (!dbus_message_append_args (message,
-				 DBUS_TYPE_STRING, &existent,
-				 DBUS_TYPE_UINT32, &flags,
-				 DBUS_TYPE_INVALID))
+  if (!dbus_connection_get_is_connected (connection))
     {
-      dbus_message_unref (message);
+      _dbus_verbose ("connection was disconnected\n");
       return TRUE;
     }
 
-  if (!dbus_connection_send (connection, message, &serial))
+  if (!check_got_error (context, connection,
+                        DBUS_ERROR_INVALID_ARGS,
+                        DBUS_ERROR_NO_MEMORY,
+                        NULL))
+    return FALSE;
+
+  return check_no_leftovers (context);
+}
+
+/* Sends ListNamesPaged with bad arguments, without the page size if
+ * with_limit is FALSE, and checks that it gets InvalidArgs. Returns
+ * TRUE if the correct thing happens, but the correct thing may
+ * include OOM errors.
+ */
+static dbus_bool_t
+check_list_names_paged_error (BusContext     *context,
+                              DBusConnection *connection,
+                              const char     *after,
+                              dbus_bool_t     with_limit,
+                              dbus_uint32_t   limit)
+{
+  DBusMessage *message;
+  dbus_bool_t retval;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "ListNamesPaged");
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &after,
+                                 DBUS_TYPE_INVALID) ||
+      (with_limit &&
+       !dbus_message_append_args (message,
+                                  DBUS_TYPE_UINT32, &limit,
+                                  DBUS_TYPE_INVALID)))
     {
       dbus_message_unref (message);
       return TRUE;
     }
 
+  retval = check_invalid_args_reply (context, connection, message);
   dbus_message_unref (message);
-  message = NULL;
-
-  bus_test_run_everything (context);
 
-  /* now wait for the message bus to hear back from the activated
-   * service.
-   */
-  block_connection_until_message_from_bus (context, connection, "activated service to connect");
+  return retval;
+}
 
-  bus_test_run_everything (context);
+/* Walks ListNamesPaged two names at a time and checks that it
+ * returns the same names as ListNames, in order; then checks the
+ * pages at the end of the list, cursors that aren't names and bad
+ * page sizes. Returns TRUE if the correct thing happens, but the
+ * correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_list_names_paged (BusContext     *context,
+                        DBusConnection *connection,
+                        char          **all,
+                        int             n_all)
+{
+  const char *last;
+  const char *next_to_last;
+  char *after;
+  int n_seen;
+  int i;
+
+  after = _dbus_strdup ("");
+  if (after == NULL)
+    return TRUE;
 
-  if (!dbus_connection_get_is_connected (connection))
+  n_seen = 0;
+  while (TRUE)
     {
-      _dbus_verbose ("connection was disconnected\n");
-      return TRUE;
-    }
+      char **page;
+      int len;
 
-  retval = FALSE;
+      page = NULL;
+      len = 0;
+      if (!check_get_services (context, connection, "ListNamesPaged",
+                               after, 2, &page, &len))
+        {
+          dbus_free (after);
+          return FALSE;
+        }
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
-    {
-      _dbus_warn ("Did not receive any messages after %s %d on %p\n",
-		  "StartServiceByName", serial, connection);
-      goto out;
-    }
+      /* ran out of memory somewhere */
+      if (page == NULL)
+        {
+          dbus_free (after);
+          return TRUE;
+        }
 
-  verbose_message_received (connection, message);
-  _dbus_verbose ("  (after sending %s)\n", "StartServiceByName");
+      for (i = 0; i < len; i++)
+        {
+          if (strcmp (page[i], after) <= 0 ||
+              !_dbus_string_array_contains ((const char **) all, page[i]))
+            {
+              _dbus_warn ("ListNamesPaged returned %s after %s\n",
+                          page[i], after);
+              dbus_free_string_array (page);
+              dbus_free (after);
+              return FALSE;
+            }
 
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
-    {
-      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
-	{
-	  _dbus_warn ("Message has wrong sender %s\n",
-		      dbus_message_get_sender (message) ?
-		      dbus_message_get_sender (message) : "(none)");
-	  goto out;
-	}
+          dbus_free (after);
+          after = _dbus_strdup (page[i]);
+          if (after == NULL)
+            {
+              dbus_free_string_array (page);
+              return TRUE;
+            }
+        }
 
-      if (dbus_message_is_error (message,
-				 DBUS_ERROR_NO_MEMORY))
-	{
-	  ; /* good, this is a valid response */
-	}
-      else if (dbus_message_is_error (message,
-				      DBUS_ERROR_SPAWN_CHILD_EXITED) ||
-	       dbus_message_is_error (message,
-				      DBUS_ERROR_SPAWN_CHILD_SIGNALED) ||
-	       dbus_message_is_error (message,
-				      DBUS_ERROR_SPAWN_EXEC_FAILED))
-	{
-	  ; /* good, this is expected also */
-	}
-      else
-	{
-	  _dbus_warn ("Did not expect error %s\n",
-		      dbus_message_get_error_name (message));
-	  goto out;
-	}
+      n_seen += len;
+      dbus_free_string_array (page);
+
+      if (len < 2)
+        break;
     }
-  else
-    {
-      GotServiceInfo message_kind;
 
-      if (!check_base_service_activated (context, connection,
-					 message, &base_service))
-	goto out;
+  dbus_free (after);
 
-      base_service_message = message;
-      message = NULL;
+  if (n_seen != n_all)
+    {
+      _dbus_warn ("ListNamesPaged returned %d names, ListNames %d\n",
+                  n_seen, n_all);
+      return FALSE;
+    }
 
-      /* We may need to block here for the test service to exit or finish up */
-      block_connection_until_message_from_bus (context, connection, "test service to exit or finish up");
+  _dbus_assert (n_all >= 2);
 
-      message = dbus_connection_borrow_message (connection);
-      if (message == NULL)
-	{
-	  _dbus_warn ("Did not receive any messages after base service creation notification\n");
-	  goto out;
-	}
+  /* A last page with fewer names than asked for, a page bigger than
+   * the whole list, and an empty page after the last name
+   */
+  last = all[0];
+  next_to_last = NULL;
+  for (i = 1; i < n_all; i++)
+    {
+      if (strcmp (all[i], last) > 0)
+        {
+          next_to_last = last;
+          last = all[i];
+        }
+      else if (next_to_last == NULL || strcmp (all[i], next_to_last) > 0)
+        next_to_last = all[i];
+    }
 
-      message_kind = check_got_service_info (message);
+  if (!check_list_names_page (context, connection, all, n_all,
+                              next_to_last, 2) ||
+      !check_list_names_page (context, connection, all, n_all,
+                              "", n_all + 5) ||
+      !check_list_names_page (context, connection, all, n_all,
+                              last, 2))
+    return FALSE;
 
-      dbus_connection_return_message (connection, message);
-      message = NULL;
+  /* A cursor needn't be a name, current or otherwise: it is only a
+   * place in the sort order, which may be past the end
+   */
+  if (!check_list_names_page (context, connection, all, n_all,
+                              "org.freedesktop.DBus.TestSuite.NoSuchName", 2) ||
+      !check_list_names_page (context, connection, all, n_all,
+                              "not a bus name", 2) ||
+      !check_list_names_page (context, connection, all, n_all,
+                              "~", 2))
+    return FALSE;
 
-      switch (message_kind)
-	{
-	case GOT_SOMETHING_ELSE:
-	case GOT_ERROR:
-	case GOT_SERVICE_DELETED:
-	  _dbus_warn ("Unexpected message after ActivateService "
-		      "(should be an error or a service announcement)\n");
-	  goto out;
+  /* An empty page size, or none at all, is an error */
+  if (!check_list_names_paged_error (context, connection, "", TRUE, 0) ||
+      !check_list_names_paged_error (context, connection, "", FALSE, 0))
+    return FALSE;
 
-	case GOT_SERVICE_CREATED:
-	  message = pop_message_waiting_for_memory (connection);
-	  if (message == NULL)
-	    {
-	      _dbus_warn ("Failed to pop message we just put back! "
-			  "should have been a NameOwnerChanged (creation)\n");
-	      goto out;
-	    }
+  return TRUE;
+}
 
-	  if (!check_service_activated (context, connection, EXISTENT_SERVICE_NAME,
-					base_service, message))
-	    goto out;
+#define NO_SUCH_BATCH_NAME "org.freedesktop.DBus.TestSuite.NoSuchName"
+#define NO_SUCH_BATCH_UNIQUE_NAME ":1.999999"
 
-	  dbus_message_unref (message);
-	  message = NULL;
+/* Calls method, which takes an array of names, and waits for the
+ * reply. Sets *reply_p to the method return, or to NULL if we ran out
+ * of memory or got disconnected. Returns FALSE if some other reply
+ * came.
+ */
+static dbus_bool_t
+call_with_names (BusContext      *context,
+                 DBusConnection  *connection,
+                 const char      *method,
+                 const char     **names,
+                 int              n_names,
+                 DBusMessage    **reply_p)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
 
-	  if (!check_no_leftovers (context))
-	    {
-	      _dbus_warn ("Messages were left over after successful activation\n");
-	      goto out;
-	    }
+  *reply_p = NULL;
 
-	  break;
-	}
-    }
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
+  if (message == NULL)
+    return TRUE;
 
-  if (!check_get_services (context, connection, "ListNames", &services, &len))
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                 &names, n_names,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (connection, message, &serial))
     {
+      dbus_message_unref (message);
       return TRUE;
     }
 
-  if (!_dbus_string_array_contains ((const char **)services, existent))
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection, method);
+
+  if (!dbus_connection_get_is_connected (connection))
     {
-      _dbus_warn ("Did not get the expected %s from ListNames\n", existent);
-      goto out;
+      _dbus_verbose ("connection was disconnected\n");
+      return TRUE;
     }
 
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  method, serial, connection);
+      return FALSE;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      warn_unexpected (connection, message, "method_return");
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  *reply_p = message;
+  return TRUE;
+}
+
+/* Checks GetNameOwners with owned and unknown names mixed: only the
+ * owned ones are in the reply, in the order asked for. Also checks
+ * that a call without an array of names gets InvalidArgs.
+ * Returns TRUE if the correct thing happens, but the correct thing
+ * may include OOM errors.
+ */
+static dbus_bool_t
+check_get_name_owners (BusContext     *context,
+                       DBusConnection *connection)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, dict_iter;
+  const char *names[4];
+  const char *unique_name;
+  const char *text;
+  dbus_bool_t retval;
+  int n_entries;
+
+  unique_name = dbus_bus_get_unique_name (connection);
+
+  names[0] = DBUS_SERVICE_DBUS;
+  names[1] = NO_SUCH_BATCH_NAME;
+  names[2] = unique_name;
+  names[3] = NO_SUCH_BATCH_UNIQUE_NAME;
+
+  if (!call_with_names (context, connection, "GetNameOwners",
+                        names, _DBUS_N_ELEMENTS (names), &message))
+    return FALSE;
+
+  if (message == NULL)
+    return TRUE;
+
+  retval = FALSE;
+
+  if (!dbus_message_has_signature (message, "a{ss}"))
+    {
+      _dbus_warn ("GetNameOwners replied with signature %s\n",
+                  dbus_message_get_signature (message));
+      goto out;
+    }
+
+  /* names[0] and names[2] own themselves */
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_recurse (&iter, &dict_iter);
+  n_entries = 0;
+  while (dbus_message_iter_get_arg_type (&dict_iter) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter entry_iter;
+      const char *name;
+      const char *owner;
+
+      dbus_message_iter_recurse (&dict_iter, &entry_iter);
+      dbus_message_iter_get_basic (&entry_iter, &name);
+      dbus_message_iter_next (&entry_iter);
+      dbus_message_iter_get_basic (&entry_iter, &owner);
+
+      if (n_entries >= 2 ||
+          strcmp (name, names[2 * n_entries]) != 0 ||
+          strcmp (owner, names[2 * n_entries]) != 0)
+        {
+          _dbus_warn ("GetNameOwners returned %s owned by %s\n", name, owner);
+          goto out;
+        }
+
+      n_entries += 1;
+      dbus_message_iter_next (&dict_iter);
+    }
+
+  if (n_entries != 2)
+    {
+      _dbus_warn ("GetNameOwners returned %d owners, expected 2\n", n_entries);
+      goto out;
+    }
+
+  dbus_message_unref (message);
+
+  if (!check_no_leftovers (context))
+    return FALSE;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "GetNameOwners");
+  if (message == NULL)
+    return TRUE;
+
+  text = unique_name;
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &text,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  retval = check_invalid_args_reply (context, connection, message);
+
+ out:
+  dbus_message_unref (message);
+
+  return retval;
+}
+
+/* Sends SetReplyPriority with enabled and checks for an empty method
+ * return. Sets *done_p if it got one. Returns TRUE if the correct
+ * thing happens, but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+set_reply_priority (BusContext     *context,
+                    DBusConnection *connection,
+                    dbus_bool_t     enabled,
+                    dbus_bool_t    *done_p)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+
+  *done_p = FALSE;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "SetReplyPriority");
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_BOOLEAN, &enabled,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection, "SetReplyPriority");
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to SetReplyPriority %d on %p\n",
+                  serial, connection);
+      return FALSE;
+    }
+
+  verbose_message_received (connection, message);
+
+  retval = FALSE;
+
+  if (dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY))
+    retval = TRUE;
+  else if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+           dbus_message_get_reply_serial (message) != serial)
+    warn_unexpected (connection, message, "method_return");
+  else if (!dbus_message_has_signature (message, ""))
+    _dbus_warn ("SetReplyPriority replied with signature %s\n",
+                dbus_message_get_signature (message));
+  else
+    retval = *done_p = TRUE;
+
+  dbus_message_unref (message);
+
+  return retval;
+}
+
+/* Checks that SetReplyPriority can be turned on and back off, leaving
+ * the connection with the default ordering, and that a call without a
+ * boolean gets InvalidArgs. Returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_set_reply_priority (BusContext     *context,
+                          DBusConnection *connection)
+{
+  DBusMessage *message;
+  const char *text;
+  dbus_bool_t done;
+  dbus_bool_t retval;
+
+  if (!set_reply_priority (context, connection, TRUE, &done))
+    return FALSE;
+
+  /* whatever happened to the first call, always try to turn it off */
+  do
+    {
+      if (!set_reply_priority (context, connection, FALSE, &done))
+        return FALSE;
+
+      if (!dbus_connection_get_is_connected (connection))
+        return TRUE;
+    }
+  while (!done);
+
+  if (!check_no_leftovers (context))
+    return FALSE;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "SetReplyPriority");
+  if (message == NULL)
+    return TRUE;
+
+  text = "yes";
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &text,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  retval = check_invalid_args_reply (context, connection, message);
+  dbus_message_unref (message);
+
+  return retval;
+}
+
+/* Checks GetConnectionCredentialsBatch with owned and unknown names
+ * mixed: only the owned one is in the reply, with our own user and
+ * process ID where they are known. Also checks that a call without
+ * an array of names gets InvalidArgs. Returns TRUE if the correct
+ * thing happens, but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_get_connection_credentials_batch (BusContext     *context,
+                                        DBusConnection *connection)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, dict_iter, entry_iter, creds_iter;
+  DBusCredentials *credentials;
+  const char *names[3];
+  const char *name;
+  const char *text;
+  dbus_uid_t uid;
+  dbus_bool_t have_uid;
+  dbus_bool_t have_pid;
+  dbus_bool_t retval;
+
+  /* the bus is in this process, so it is run by the same user as us */
+  credentials = _dbus_credentials_new_from_current_process ();
+  if (credentials == NULL)
+    return TRUE;
+  uid = _dbus_credentials_get_unix_uid (credentials);
+  _dbus_credentials_unref (credentials);
+
+  names[0] = NO_SUCH_BATCH_NAME;
+  names[1] = dbus_bus_get_unique_name (connection);
+  names[2] = NO_SUCH_BATCH_UNIQUE_NAME;
+
+  if (!call_with_names (context, connection, "GetConnectionCredentialsBatch",
+                        names, _DBUS_N_ELEMENTS (names), &message))
+    return FALSE;
+
+  if (message == NULL)
+    return TRUE;
+
+  retval = FALSE;
+
+  if (!dbus_message_has_signature (message, "a{sa{sv}}"))
+    {
+      _dbus_warn ("GetConnectionCredentialsBatch replied with signature %s\n",
+                  dbus_message_get_signature (message));
+      goto out;
+    }
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_recurse (&iter, &dict_iter);
+  if (dbus_message_iter_get_arg_type (&dict_iter) != DBUS_TYPE_DICT_ENTRY)
+    {
+      _dbus_warn ("GetConnectionCredentialsBatch returned no credentials\n");
+      goto out;
+    }
+
+  dbus_message_iter_recurse (&dict_iter, &entry_iter);
+  dbus_message_iter_get_basic (&entry_iter, &name);
+  if (strcmp (name, names[1]) != 0)
+    {
+      _dbus_warn ("GetConnectionCredentialsBatch returned credentials for %s\n",
+                  name);
+      goto out;
+    }
+
+  have_uid = FALSE;
+  have_pid = FALSE;
+  dbus_message_iter_next (&entry_iter);
+  dbus_message_iter_recurse (&entry_iter, &creds_iter);
+  while (dbus_message_iter_get_arg_type (&creds_iter) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter cred_iter, variant_iter;
+      const char *key;
+      dbus_uint32_t value;
+
+      dbus_message_iter_recurse (&creds_iter, &cred_iter);
+      dbus_message_iter_get_basic (&cred_iter, &key);
+      dbus_message_iter_next (&cred_iter);
+      dbus_message_iter_recurse (&cred_iter, &variant_iter);
+
+      if (strcmp (key, "UnixUserID") == 0)
+        {
+          dbus_message_iter_get_basic (&variant_iter, &value);
+          if (value != uid)
+            {
+              _dbus_warn ("GetConnectionCredentialsBatch returned user %u\n",
+                          value);
+              goto out;
+            }
+          have_uid = TRUE;
+        }
+      else if (strcmp (key, "ProcessID") == 0)
+        {
+          dbus_message_iter_get_basic (&variant_iter, &value);
+          if (value != (dbus_uint32_t) _dbus_getpid ())
+            {
+              _dbus_warn ("GetConnectionCredentialsBatch returned process %u\n",
+                          value);
+              goto out;
+            }
+          have_pid = TRUE;
+        }
+
+      dbus_message_iter_next (&creds_iter);
+    }
+
+  if (have_uid != (uid != DBUS_UID_UNSET))
+    {
+      _dbus_warn ("GetConnectionCredentialsBatch left out our user\n");
+      goto out;
+    }
+
+#ifndef DBUS_WIN
+  if (!have_pid)
+    {
+      _dbus_warn ("GetConnectionCredentialsBatch left out our process\n");
+      goto out;
+    }
+#endif
+
+  /* and nothing for the unknown names */
+  if (dbus_message_iter_next (&dict_iter))
+    {
+      _dbus_warn ("GetConnectionCredentialsBatch returned credentials for unknown names\n");
+      goto out;
+    }
+
+  dbus_message_unref (message);
+
+  if (!check_no_leftovers (context))
+    return FALSE;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "GetConnectionCredentialsBatch");
+  if (message == NULL)
+    return TRUE;
+
+  text = names[1];
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &text,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  retval = check_invalid_args_reply (context, connection, message);
+
+ out:
+  dbus_message_unref (message);
+
+  return retval;
+}
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_list_services (BusContext     *context,
+		     DBusConnection *connection)
+{
+  DBusMessage  *message;
+  DBusMessage  *base_service_message;
+  const char   *base_service;
+  dbus_uint32_t serial;
+  dbus_bool_t   retval;
+  const char   *existent = EXISTENT_SERVICE_NAME;
+  dbus_uint32_t flags;
+  char        **services;
+  int           len;
+
+  _dbus_verbose ("check_list_services for %p\n", connection);
+
+  if (!check_get_services (context, connection, "ListActivatableNames",
+                           NULL, 0, &services, &len))
+    {
+      return TRUE;
+    }
+
+  if (!_dbus_string_array_contains ((const char **)services, existent))
+    {
+      _dbus_warn ("Did not get the expected %s from ListActivatableNames\n", existent);
+      dbus_free_string_array (services);
+      return FALSE;
+    }
+
+  dbus_free_string_array (services);
+
+  base_service_message = NULL;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+					  DBUS_PATH_DBUS,
+					  DBUS_INTERFACE_DBUS,
+					  "StartServiceByName");
+
+  if (message == NULL)
+    return TRUE;
+
+  dbus_message_set_auto_start (message, FALSE);
+
+  flags = 0;
+  if (!dbus_message_append_args (message,
+				 DBUS_TYPE_STRING, &existent,
+				 DBUS_TYPE_UINT32, &flags,
+				 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+
+  /* now wait for the message bus to hear back from the activated
+   * service.
+   */
+  block_connection_until_message_from_bus (context, connection, "activated service to connect");
+
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive any messages after %s %d on %p\n",
+		  "StartServiceByName", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+  _dbus_verbose ("  (after sending %s)\n", "StartServiceByName");
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+	{
+	  _dbus_warn ("Message has wrong sender %s\n",
+		      dbus_message_get_sender (message) ?
+		      dbus_message_get_sender (message) : "(none)");
+	  goto out;
+	}
+
+      if (dbus_message_is_error (message,
+				 DBUS_ERROR_NO_MEMORY))
+	{
+	  ; /* good, this is a valid response */
+	}
+      else if (dbus_message_is_error (message,
+				      DBUS_ERROR_SPAWN_CHILD_EXITED) ||
+	       dbus_message_is_error (message,
+				      DBUS_ERROR_SPAWN_CHILD_SIGNALED) ||
+	       dbus_message_is_error (message,
+				      DBUS_ERROR_SPAWN_EXEC_FAILED))
+	{
+	  ; /* good, this is expected also */
+	}
+      else
+	{
+	  _dbus_warn ("Did not expect error %s\n",
+		      dbus_message_get_error_name (message));
+	  goto out;
+	}
+    }
+  else
+    {
+      GotServiceInfo message_kind;
+
+      if (!check_base_service_activated (context, connection,
+					 message, &base_service))
+	goto out;
+
+      base_service_message = message;
+      message = NULL;
+
+      /* We may need to block here for the test service to exit or finish up */
+      block_connection_until_message_from_bus (context, connection, "test service to exit or finish up");
+
+      message = dbus_connection_borrow_message (connection);
+      if (message == NULL)
+	{
+	  _dbus_warn ("Did not receive any messages after base service creation notification\n");
+	  goto out;
+	}
+
+      message_kind = check_got_service_info (message);
+
+      dbus_connection_return_message (connection, message);
+      message = NULL;
+
+      switch (message_kind)
+	{
+	case GOT_SOMETHING_ELSE:
+	case GOT_ERROR:
+	case GOT_SERVICE_DELETED:
+	  _dbus_warn ("Unexpected message after ActivateService "
+		      "(should be an error or a service announcement)\n");
+	  goto out;
+
+	case GOT_SERVICE_CREATED:
+	  message = pop_message_waiting_for_memory (connection);
+	  if (message == NULL)
+	    {
+	      _dbus_warn ("Failed to pop message we just put back! "
+			  "should have been a NameOwnerChanged (creation)\n");
+	      goto out;
+	    }
+
+	  if (!check_service_activated (context, connection, EXISTENT_SERVICE_NAME,
+					base_service, message))
+	    goto out;
+
+	  dbus_message_unref (message);
+	  message = NULL;
+
+	  if (!check_no_leftovers (context))
+	    {
+	      _dbus_warn ("Messages were left over after successful activation\n");
+	      goto out;
+	    }
+
+	  break;
+	}
+    }
+
+  if (!check_get_services (context, connection, "ListNames",
+                           NULL, 0, &services, &len))
+    {
+      return TRUE;
+    }
+
+  if (!_dbus_string_array_contains ((const char **)services, existent))
+    {
+      _dbus_warn ("Did not get the expected %s from ListNames\n", existent);
+      goto out;
+    }
+
+  if (!check_list_names_paged (context, connection, services, len))
+    goto out;
+
   dbus_free_string_array (services);
 
   if (!check_send_exit_to_service (context, connection,
@@ -4402,6 +5194,413 @@ check_list_services (BusContext     *context,
   return retval;
 }
 
+#define N_MASS_CLIENTS 100
+#define MASS_NAME_PREFIX "org.freedesktop.DBus.TestSuite.Mass"
+
+/* more than tearing down one client takes */
+#define N_DISCONNECT_OOM_ALLOCATIONS 200
+
+typedef struct
+{
+  int expected;
+  DBusConnection *caller;   /**< Called the clients that went away */
+  int expected_no_reply;    /**< Calls to them the caller gets NoReply for */
+  dbus_bool_t failed;
+} CheckNamesReleasedData;
+
+/* Every remaining client has a match-all rule, so each must hear that
+ * every name went away, in whatever order the bus released them; the
+ * caller also gets a NoReply for each call the clients still owed
+ */
+static dbus_bool_t
+check_names_released_foreach (DBusConnection *connection,
+                              void           *data)
+{
+  CheckNamesReleasedData *d = data;
+  DBusMessage *message;
+  int n_released = 0;
+  int n_no_reply = 0;
+
+  while ((message = pop_message_waiting_for_memory (connection)) != NULL)
+    {
+      const char *name, *old_owner, *new_owner;
+
+      if (dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                                  "NameOwnerChanged") &&
+          dbus_message_get_args (message, NULL,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_STRING, &old_owner,
+                                 DBUS_TYPE_STRING, &new_owner,
+                                 DBUS_TYPE_INVALID) &&
+          *old_owner != '\0' && *new_owner == '\0')
+        {
+          n_released += 1;
+        }
+      else if (connection == d->caller &&
+               dbus_message_is_error (message, DBUS_ERROR_NO_REPLY))
+        {
+          n_no_reply += 1;
+        }
+      else
+        {
+          warn_unexpected (connection, message, "NameOwnerChanged (deletion)");
+          d->failed = TRUE;
+        }
+
+      dbus_message_unref (message);
+    }
+
+  if (n_released != d->expected)
+    {
+      _dbus_warn ("%p heard %d names released, expected %d\n",
+                  connection, n_released, d->expected);
+      d->failed = TRUE;
+    }
+
+  if (connection == d->caller && n_no_reply != d->expected_no_reply)
+    {
+      _dbus_warn ("%p got %d NoReply errors, expected %d\n",
+                  connection, n_no_reply, d->expected_no_reply);
+      d->failed = TRUE;
+    }
+
+  return !d->failed;
+}
+
+static dbus_bool_t
+drain_client_foreach (DBusConnection *connection,
+                      void           *data)
+{
+  DBusMessage *message;
+
+  while ((message = pop_message_waiting_for_memory (connection)) != NULL)
+    dbus_message_unref (message);
+
+  return TRUE;
+}
+
+static void
+request_mass_name (DBusConnection *connection,
+                   int             i)
+{
+  DBusMessage *message;
+  char name[64];
+  const char *name_p = name;
+  dbus_uint32_t flags = 0;
+
+  snprintf (name, sizeof (name), MASS_NAME_PREFIX "%d", i);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS, "RequestName");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name_p,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (connection, message, NULL))
+    _dbus_assert_not_reached ("no memory for RequestName");
+  dbus_message_unref (message);
+}
+
+/* Connects a client that owns a well-known name, calls the watcher
+ * and is called by it, neither call being answered
+ */
+static DBusConnection *
+connect_mass_client (BusContext     *context,
+                     DBusConnection *watcher,
+                     int             i)
+{
+  DBusConnection *connection;
+  DBusMessage *message;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private (TEST_CONNECTION, &error);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, connection);
+
+  if (!check_hello_message (context, connection))
+    _dbus_assert_not_reached ("hello message failed");
+
+  /* check_hello_message() wants every client to see the next one */
+  if (!check_add_match_all (context, connection))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  request_mass_name (connection, i);
+
+  message = dbus_message_new_method_call (dbus_bus_get_unique_name (watcher),
+                                          "/", "org.freedesktop.TestSuite",
+                                          "Wait");
+  if (message == NULL || !dbus_connection_send (connection, message, NULL))
+    _dbus_assert_not_reached ("no memory for the call to the watcher");
+  dbus_message_unref (message);
+
+  message = dbus_message_new_method_call (dbus_bus_get_unique_name (connection),
+                                          "/", "org.freedesktop.TestSuite",
+                                          "Wait");
+  if (message == NULL || !dbus_connection_send (watcher, message, NULL))
+    _dbus_assert_not_reached ("no memory for the call from the watcher");
+  dbus_message_unref (message);
+
+  bus_test_run_clients_loop (SEND_PENDING (connection) || SEND_PENDING (watcher));
+  bus_test_run_everything (context);
+
+  bus_test_clients_foreach (drain_client_foreach, NULL);
+
+  return connection;
+}
+
+/* Closes all the clients before the bus gets to look at any of them,
+ * so it tears them down together, and checks that none of the names,
+ * pending replies or connections they held are left
+ */
+static void
+check_mass_disconnect (BusContext     *context,
+                       DBusConnection *watcher)
+{
+  DBusConnection *clients[N_MASS_CLIENTS];
+  BusConnections *connections;
+  BusConnectionStats before, after;
+  CheckNamesReleasedData d;
+  int n_before, n_after, n_incomplete;
+  int i;
+
+  connections = bus_context_get_connections (context);
+  bus_connections_get_stats (connections, &before, &n_before, &n_incomplete);
+
+  for (i = 0; i < N_MASS_CLIENTS; i++)
+    clients[i] = connect_mass_client (context, watcher, i);
+
+  for (i = 0; i < N_MASS_CLIENTS; i++)
+    {
+      dbus_connection_ref (clients[i]);
+      dbus_connection_close (clients[i]);
+    }
+
+  bus_test_run_everything (context);
+
+  for (i = 0; i < N_MASS_CLIENTS; i++)
+    {
+      /* Run disconnect handler in test.c */
+      if (bus_connection_dispatch_one_message (clients[i]))
+        _dbus_assert_not_reached ("something received on connection being killed other than the disconnect");
+
+      _dbus_assert (!bus_test_client_listed (clients[i]));
+      dbus_connection_unref (clients[i]);
+    }
+
+  /* the unique name and the well-known one of each */
+  d.expected = 2 * N_MASS_CLIENTS;
+  d.caller = watcher;
+  d.expected_no_reply = N_MASS_CLIENTS;
+  d.failed = FALSE;
+  bus_test_clients_foreach (check_names_released_foreach, &d);
+  if (d.failed)
+    _dbus_assert_not_reached ("didn't get the expected NameOwnerChanged (deletion) messages");
+
+  for (i = 0; i < N_MASS_CLIENTS; i++)
+    {
+      DBusString name;
+      char buf[64];
+
+      snprintf (buf, sizeof (buf), MASS_NAME_PREFIX "%d", i);
+      _dbus_string_init_const (&name, buf);
+      if (bus_registry_lookup (bus_context_get_registry (context),
+                               &name) != NULL)
+        _dbus_assert_not_reached ("a name outlived its owner");
+    }
+
+  bus_connections_get_stats (connections, &after, &n_after, &n_incomplete);
+  if (n_after != n_before ||
+      after.names_owned != before.names_owned ||
+      after.pending_replies != before.pending_replies)
+    _dbus_assert_not_reached ("disconnected clients left state behind");
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("stuff left in message queues after disconnecting clients");
+}
+
+/* Fails each allocation in turn while a client that owns several
+ * names disconnects, so that releasing them is cancelled part way
+ * and tried again with some already given back
+ */
+static void
+check_disconnect_oom (BusContext     *context,
+                      DBusConnection *watcher)
+{
+  int fail_at;
+
+  for (fail_at = 0; fail_at < N_DISCONNECT_OOM_ALLOCATIONS; fail_at++)
+    {
+      DBusConnection *client;
+      CheckNamesReleasedData d;
+
+      client = connect_mass_client (context, watcher, 0);
+      request_mass_name (client, 1);
+      request_mass_name (client, 2);
+      bus_test_run_clients_loop (SEND_PENDING (client));
+      bus_test_run_everything (context);
+      bus_test_clients_foreach (drain_client_foreach, NULL);
+
+      dbus_connection_ref (client);
+      dbus_connection_close (client);
+
+      _dbus_set_fail_alloc_counter (fail_at);
+      bus_test_run_everything (context);
+      _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
+      bus_test_run_everything (context);
+
+      if (bus_connection_dispatch_one_message (client))
+        _dbus_assert_not_reached ("something received on connection being killed other than the disconnect");
+      _dbus_assert (!bus_test_client_listed (client));
+      dbus_connection_unref (client);
+
+      /* the unique name and the three well-known ones */
+      d.expected = 4;
+      d.caller = watcher;
+      d.expected_no_reply = 1;
+      d.failed = FALSE;
+      bus_test_clients_foreach (check_names_released_foreach, &d);
+      if (d.failed)
+        _dbus_assert_not_reached ("didn't get the expected NameOwnerChanged (deletion) messages after OOM");
+    }
+}
+
+#define ARG0_NAME_OTHER "org.freedesktop.DBus.TestSuite.Arg0.Other"
+#define ARG0_NAME_WATCHED "org.freedesktop.DBus.TestSuite.Arg0.Watched"
+
+static void
+request_name_and_drain (BusContext     *context,
+                        DBusConnection *owner,
+                        const char     *name)
+{
+  DBusMessage *message;
+  dbus_uint32_t flags = 0;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS, "RequestName");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (owner, message, NULL))
+    _dbus_assert_not_reached ("no memory for RequestName");
+  dbus_message_unref (message);
+
+  bus_test_run_clients_loop (SEND_PENDING (owner));
+  bus_test_run_everything (context);
+}
+
+/* Counts the NameOwnerChanged signals for name the subscriber got,
+ * and fails on anything else
+ */
+static int
+count_name_owner_changed (DBusConnection *subscriber,
+                          const char     *name)
+{
+  DBusMessage *message;
+  int n = 0;
+
+  while ((message = pop_message_waiting_for_memory (subscriber)) != NULL)
+    {
+      const char *arg0;
+
+      if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                                   "NameOwnerChanged") ||
+          !dbus_message_get_args (message, NULL,
+                                  DBUS_TYPE_STRING, &arg0,
+                                  DBUS_TYPE_INVALID) ||
+          strcmp (arg0, name) != 0)
+        {
+          warn_unexpected (subscriber, message, "NameOwnerChanged");
+          _dbus_assert_not_reached ("subscriber got a message its rule doesn't match");
+        }
+
+      n += 1;
+      dbus_message_unref (message);
+    }
+
+  return n;
+}
+
+/* The first NameOwnerChanged from the driver puts its recipients in
+ * the recipient cache. A rule on some other arg0 wasn't looked at for
+ * it, so that set mustn't be reused for the NameOwnerChanged the rule
+ * does match.
+ */
+static void
+check_arg0_match_not_cached (BusContext *context)
+{
+  DBusConnection *owner, *subscriber;
+  DBusMessage *message;
+  DBusError error;
+  const char *rule = "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+    "member='NameOwnerChanged',arg0='" ARG0_NAME_WATCHED "'";
+
+  dbus_error_init (&error);
+
+  owner = dbus_connection_open_private (TEST_CONNECTION, &error);
+  if (owner == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+  if (!bus_setup_debug_client (owner))
+    _dbus_assert_not_reached ("could not set up connection");
+  spin_connection_until_authenticated (context, owner);
+  if (!check_hello_message (context, owner))
+    _dbus_assert_not_reached ("hello message failed");
+  if (!check_add_match_all (context, owner))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  subscriber = dbus_connection_open_private (TEST_CONNECTION, &error);
+  if (subscriber == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+  if (!bus_setup_debug_client (subscriber))
+    _dbus_assert_not_reached ("could not set up connection");
+  spin_connection_until_authenticated (context, subscriber);
+  if (!check_hello_message (context, subscriber))
+    _dbus_assert_not_reached ("hello message failed");
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS, "AddMatch");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &rule,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (subscriber, message, NULL))
+    _dbus_assert_not_reached ("no memory for AddMatch");
+  dbus_message_unref (message);
+
+  bus_test_run_clients_loop (SEND_PENDING (subscriber));
+  block_connection_until_message_from_bus (context, subscriber,
+                                           "reply to AddMatch");
+  message = pop_message_waiting_for_memory (subscriber);
+  if (message == NULL ||
+      dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    _dbus_assert_not_reached ("AddMatch with arg0 failed");
+  dbus_message_unref (message);
+
+  request_name_and_drain (context, owner, ARG0_NAME_OTHER);
+  if (count_name_owner_changed (subscriber, ARG0_NAME_WATCHED) != 0)
+    _dbus_assert_not_reached ("subscriber heard about the name it doesn't watch");
+  bus_test_clients_foreach (drain_client_foreach, NULL);
+
+  request_name_and_drain (context, owner, ARG0_NAME_WATCHED);
+  if (count_name_owner_changed (subscriber, ARG0_NAME_WATCHED) != 1)
+    _dbus_assert_not_reached ("NameOwnerChanged for the name in the arg0 rule not delivered");
+  bus_test_clients_foreach (drain_client_foreach, NULL);
+
+  kill_client_connection_unchecked (subscriber);
+  kill_client_connection_unchecked (owner);
+  bus_test_run_everything (context);
+  bus_test_clients_foreach (drain_client_foreach, NULL);
+}
+
 typedef struct
 {
   Check2Func func;
@@ -4549,6 +5748,12 @@ bus_dispatch_test_conf (const DBusString *test_data_dir,
   if (!check_add_match_all (context, baz))
     _dbus_assert_not_reached ("AddMatch message failed");
 
+  /* giving memory back must not lose anything, the checks below
+   * carry on over the trimmed connections
+   */
+  bus_connections_trim_memory (bus_context_get_connections (context));
+  _dbus_connection_trim (foo);
+
 #ifdef DBUS_WIN_FIXME
   _dbus_warn("TODO: testing of GetConnectionUnixUser message skipped for now\n");
   _dbus_warn("TODO: testing of GetConnectionUnixProcessID message skipped for now\n");
@@ -4572,6 +5777,19 @@ bus_dispatch_test_conf (const DBusString *test_data_dir,
   check1_try_iterations (context, "create_and_hello",
                          check_hello_connection);
 
+  check_mass_disconnect (context, foo);
+  check_disconnect_oom (context, foo);
+  check_arg0_match_not_cached (context);
+
+  check2_try_iterations (context, foo, "get_name_owners",
+                         check_get_name_owners);
+
+  check2_try_iterations (context, foo, "get_connection_credentials_batch",
+                         check_get_connection_credentials_batch);
+
+  check2_try_iterations (context, foo, "set_reply_priority",
+                         check_set_reply_priority);
+
   check2_try_iterations (context, foo, "nonexistent_service_no_auto_start",
                          check_nonexistent_service_no_auto_start);
 
@@ -24,17 +24,23 @@
 
 #include <config.h>
 #include "activation.h"
+#include "bridge.h"
+#include "capture.h"
 #include "connection.h"
 #include "driver.h"
 #include "dispatch.h"
 #include "services.h"
 #include "selinux.h"
 #include "signals.h"
+#include "stats.h"
 #include "utils.h"
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-flight-recorder.h>
 #include <dbus/dbus-message.h>
 #include <dbus/dbus-marshal-recursive.h>
+#include <stdlib.h>
 #include <string.h>
 
 static dbus_bool_t bus_driver_send_welcome_message (DBusConnection *connection,
@@ -317,6 +323,23 @@ bus_driver_handle_hello (DBusConnection *connection,
   _dbus_assert (bus_connection_is_active (connection));
   retval = TRUE;
 
+  if (_dbus_flight_recorder_enabled)
+    {
+      int dot;
+      long minor;
+
+      /* the records only have room for the number after the dot */
+      if (!_dbus_string_find_byte_backward (&unique_name,
+                                            _dbus_string_get_length (&unique_name),
+                                            '.', &dot) ||
+          !_dbus_string_parse_int (&unique_name, dot + 1, &minor, NULL))
+        minor = -1;
+
+      _dbus_flight_record (DBUS_FLIGHT_HELLO,
+                           _dbus_connection_get_flight_id (connection),
+                           dbus_message_get_serial (message), minor);
+    }
+
  out_0:
   _dbus_string_free (&unique_name);
   return retval;
@@ -367,97 +390,240 @@ bus_driver_send_welcome_message (DBusConnection *connection,
     }
 }
 
-static dbus_bool_t
-bus_driver_handle_list_services (DBusConnection *connection,
-                                 BusTransaction *transaction,
-                                 DBusMessage    *message,
-                                 DBusError      *error)
+/* ListNames and friends marshal straight from the registry's and the
+ * activation table's hash iterators, with no array of copies in
+ * between.
+ */
+typedef struct
 {
-  DBusMessage *reply;
-  int len;
-  char **services;
-  BusRegistry *registry;
+  DBusMessageIter *array; /**< the as being filled */
+  dbus_bool_t failed;     /**< we ran out of memory, skip the rest */
+} NameAppendData;
+
+static void
+append_name (const char *name,
+             void       *data)
+{
+  NameAppendData *d = data;
+
+  if (!d->failed &&
+      !dbus_message_iter_append_basic (d->array, DBUS_TYPE_STRING, &name))
+    d->failed = TRUE;
+}
+
+static void
+append_service_name (BusService *service,
+                     void       *data)
+{
+  append_name (bus_service_get_name (service), data);
+}
+
+/* The paged variants return the first limit names sorted after a
+ * given one, which stays correct however the tables change between
+ * calls: a name that exists throughout is seen exactly once. Each
+ * call scans the whole table, keeping the smallest names in a
+ * max-heap of at most limit pointers, so memory and message size
+ * are bounded by the page.
+ */
+#define MAX_NAMES_PER_PAGE 4096
+
+typedef struct
+{
+  const char *after;  /**< only names sorting after this */
+  const char **names; /**< max-heap on strcmp() while filling */
+  int n_names;        /**< names in the heap */
+  int max_names;      /**< page size */
+} NamePage;
+
+static void
+name_page_add (const char *name,
+               void       *data)
+{
+  NamePage *page = data;
+  const char **names = page->names;
   int i;
-  DBusMessageIter iter;
-  DBusMessageIter sub;
 
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  if (strcmp (name, page->after) <= 0)
+    return;
 
-  registry = bus_connection_get_registry (connection);
+  if (page->n_names < page->max_names)
+    {
+      /* sift up */
+      i = page->n_names++;
+      while (i > 0 && strcmp (names[(i - 1) / 2], name) < 0)
+        {
+          names[i] = names[(i - 1) / 2];
+          i = (i - 1) / 2;
+        }
+      names[i] = name;
+      return;
+    }
 
-  reply = dbus_message_new_method_return (message);
-  if (reply == NULL)
+  if (strcmp (name, names[0]) >= 0)
+    return;
+
+  /* replace the largest and sift down */
+  i = 0;
+  while (TRUE)
     {
-      BUS_SET_OOM (error);
+      int child = 2 * i + 1;
+
+      if (child >= page->n_names)
+        break;
+      if (child + 1 < page->n_names &&
+          strcmp (names[child + 1], names[child]) > 0)
+        child += 1;
+      if (strcmp (names[child], name) <= 0)
+        break;
+
+      names[i] = names[child];
+      i = child;
+    }
+  names[i] = name;
+}
+
+static void
+name_page_add_service (BusService *service,
+                       void       *data)
+{
+  name_page_add (bus_service_get_name (service), data);
+}
+
+static int
+compare_names (const void *a,
+               const void *b)
+{
+  return strcmp (*(const char * const *) a, *(const char * const *) b);
+}
+
+/* The page is empty until filled by the caller */
+static dbus_bool_t
+name_page_init (NamePage       *page,
+                DBusMessage    *message,
+                DBusError      *error)
+{
+  dbus_uint32_t limit;
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &page->after,
+                              DBUS_TYPE_UINT32, &limit,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (limit == 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "The page size must be at least 1");
       return FALSE;
     }
 
-  if (!bus_registry_list_services (registry, &services, &len))
+  page->max_names = MIN (limit, MAX_NAMES_PER_PAGE);
+  page->n_names = 0;
+  page->names = dbus_new (const char *, page->max_names);
+  if (page->names == NULL)
     {
-      dbus_message_unref (reply);
       BUS_SET_OOM (error);
       return FALSE;
     }
 
+  return TRUE;
+}
+
+static dbus_bool_t
+send_name_list (DBusConnection *connection,
+                BusTransaction *transaction,
+                DBusMessage    *message,
+                void          (* fill) (void *source, NameAppendData *d),
+                void           *source,
+                DBusError      *error)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter;
+  DBusMessageIter sub;
+  NameAppendData d;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
   dbus_message_iter_init_append (reply, &iter);
 
   if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
                                          DBUS_TYPE_STRING_AS_STRING,
                                          &sub))
-    {
-      dbus_free_string_array (services);
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+    goto oom;
 
-  {
-    /* Include the bus driver in the list */
-    const char *v_STRING = DBUS_SERVICE_DBUS;
-    if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-                                         &v_STRING))
-      {
-        dbus_free_string_array (services);
-        dbus_message_unref (reply);
-        BUS_SET_OOM (error);
-        return FALSE;
-      }
-  }
+  d.array = &sub;
+  d.failed = FALSE;
+  (* fill) (source, &d);
 
-  i = 0;
-  while (i < len)
+  if (d.failed)
     {
-      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-                                           &services[i]))
-        {
-          dbus_free_string_array (services);
-          dbus_message_unref (reply);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-      ++i;
+      dbus_message_iter_abandon_container (&iter, &sub);
+      goto oom;
     }
 
-  dbus_free_string_array (services);
-
   if (!dbus_message_iter_close_container (&iter, &sub))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+    goto oom;
 
   if (!bus_transaction_send_from_driver (transaction, connection, reply))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  else
-    {
-      dbus_message_unref (reply);
-      return TRUE;
-    }
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+/* Full lists start with the bus driver itself */
+static void
+fill_from_registry (void           *source,
+                    NameAppendData *d)
+{
+  append_name (DBUS_SERVICE_DBUS, d);
+  bus_registry_foreach (source, append_service_name, d);
+}
+
+static void
+fill_from_activation (void           *source,
+                      NameAppendData *d)
+{
+  append_name (DBUS_SERVICE_DBUS, d);
+  bus_activation_foreach_service (source, append_name, d);
+}
+
+/* The caller offered the bus driver's name to the page like any
+ * other
+ */
+static void
+fill_from_page (void           *source,
+                NameAppendData *d)
+{
+  NamePage *page = source;
+  int i;
+
+  qsort (page->names, page->n_names, sizeof (page->names[0]), compare_names);
+
+  for (i = 0; i < page->n_names; i++)
+    append_name (page->names[i], d);
+}
+
+static dbus_bool_t
+bus_driver_handle_list_services (DBusConnection *connection,
+                                 BusTransaction *transaction,
+                                 DBusMessage    *message,
+                                 DBusError      *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  return send_name_list (connection, transaction, message,
+                         fill_from_registry,
+                         bus_connection_get_registry (connection),
+                         error);
 }
 
 static dbus_bool_t
@@ -466,91 +632,60 @@ bus_driver_handle_list_activatable_services (DBusConnection *connection,
 					     DBusMessage    *message,
 					     DBusError      *error)
 {
-  DBusMessage *reply;
-  int len;
-  char **services;
-  BusActivation *activation;
-  int i;
-  DBusMessageIter iter;
-  DBusMessageIter sub;
-
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  activation = bus_connection_get_activation (connection);
+  return send_name_list (connection, transaction, message,
+                         fill_from_activation,
+                         bus_connection_get_activation (connection),
+                         error);
+}
 
-  reply = dbus_message_new_method_return (message);
-  if (reply == NULL)
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+static dbus_bool_t
+bus_driver_handle_list_services_paged (DBusConnection *connection,
+                                       BusTransaction *transaction,
+                                       DBusMessage    *message,
+                                       DBusError      *error)
+{
+  NamePage page;
+  dbus_bool_t retval;
 
-  if (!bus_activation_list_services (activation, &services, &len))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  dbus_message_iter_init_append (reply, &iter);
+  if (!name_page_init (&page, message, error))
+    return FALSE;
 
-  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
-					 DBUS_TYPE_STRING_AS_STRING,
-					 &sub))
-    {
-      dbus_free_string_array (services);
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  name_page_add (DBUS_SERVICE_DBUS, &page);
+  bus_registry_foreach (bus_connection_get_registry (connection),
+                        name_page_add_service, &page);
 
-  {
-    /* Include the bus driver in the list */
-    const char *v_STRING = DBUS_SERVICE_DBUS;
-    if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-					 &v_STRING))
-      {
-	dbus_free_string_array (services);
-	dbus_message_unref (reply);
-	BUS_SET_OOM (error);
-	return FALSE;
-      }
-  }
+  retval = send_name_list (connection, transaction, message,
+                           fill_from_page, &page, error);
+  dbus_free (page.names);
+  return retval;
+}
 
-  i = 0;
-  while (i < len)
-    {
-      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-					   &services[i]))
-	{
-	  dbus_free_string_array (services);
-	  dbus_message_unref (reply);
-	  BUS_SET_OOM (error);
-	  return FALSE;
-	}
-      ++i;
-    }
+static dbus_bool_t
+bus_driver_handle_list_activatable_services_paged (DBusConnection *connection,
+                                                   BusTransaction *transaction,
+                                                   DBusMessage    *message,
+                                                   DBusError      *error)
+{
+  NamePage page;
+  dbus_bool_t retval;
 
-  dbus_free_string_array (services);
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  if (!dbus_message_iter_close_container (&iter, &sub))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  if (!name_page_init (&page, message, error))
+    return FALSE;
 
-  if (!bus_transaction_send_from_driver (transaction, connection, reply))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  else
-    {
-      dbus_message_unref (reply);
-      return TRUE;
-    }
+  name_page_add (DBUS_SERVICE_DBUS, &page);
+  bus_activation_foreach_service (bus_connection_get_activation (connection),
+                                  name_page_add, &page);
+
+  retval = send_name_list (connection, transaction, message,
+                           fill_from_page, &page, error);
+  dbus_free (page.names);
+  return retval;
 }
 
 static dbus_bool_t
@@ -1063,6 +1198,248 @@ bus_driver_handle_remove_match (DBusConnection *connection,
   return FALSE;
 }
 
+/* Parses every rule in texts, or none; rules is filled in order */
+static dbus_bool_t
+parse_match_rules (DBusConnection  *connection,
+                   char           **texts,
+                   int              n_texts,
+                   BusMatchRule   **rules,
+                   DBusError       *error)
+{
+  int i;
+
+  for (i = 0; i < n_texts; i++)
+    {
+      DBusString str;
+
+      _dbus_string_init_const (&str, texts[i]);
+
+      rules[i] = bus_match_rule_parse (connection, &str, error);
+      if (rules[i] == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+
+          while (i > 0)
+            {
+              i -= 1;
+              bus_match_rule_unref (rules[i]);
+              rules[i] = NULL;
+            }
+
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* AddMatches adds all of the rules or none of them, so a client
+ * subscribing to many signals at startup takes one round trip, and
+ * doesn't have to clean up after a partial failure.
+ */
+static dbus_bool_t
+bus_driver_handle_add_matches (DBusConnection *connection,
+                               BusTransaction *transaction,
+                               DBusMessage    *message,
+                               DBusError      *error)
+{
+  BusMatchRule **rules;
+  BusMatchmaker *matchmaker;
+  char **texts;
+  int n_texts;
+  int n_added;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  texts = NULL;
+  rules = NULL;
+  n_added = 0;
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &texts, &n_texts,
+                              DBUS_TYPE_INVALID))
+    {
+      _dbus_verbose ("No memory to get arguments to AddMatches\n");
+      goto failed;
+    }
+
+  if (bus_connection_get_n_match_rules (connection) + n_texts >
+      bus_context_get_max_match_rules_per_connection (bus_transaction_get_context (transaction)))
+    {
+      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "Connection \"%s\" is not allowed to add %d more match rules "
+                      "(increase limits in configuration file if required)",
+                      bus_connection_is_active (connection) ?
+                      bus_connection_get_name (connection) :
+                      "(inactive)", n_texts);
+      goto failed;
+    }
+
+  rules = dbus_new0 (BusMatchRule *, n_texts + 1);
+  if (rules == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!parse_match_rules (connection, texts, n_texts, rules, error))
+    goto failed;
+
+  for (n_added = 0; n_added < n_texts; n_added++)
+    {
+      if (!bus_matchmaker_add_rule (matchmaker, rules[n_added]))
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
+  if (!send_ack_reply (connection, transaction,
+                       message, error))
+    goto failed;
+
+  for (i = 0; i < n_texts; i++)
+    bus_match_rule_unref (rules[i]);
+  dbus_free (rules);
+  dbus_free_string_array (texts);
+
+  return TRUE;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  if (rules != NULL)
+    {
+      for (i = 0; i < n_added; i++)
+        bus_matchmaker_remove_rule (matchmaker, rules[i]);
+
+      for (i = 0; i < n_texts && rules[i] != NULL; i++)
+        bus_match_rule_unref (rules[i]);
+      dbus_free (rules);
+    }
+  dbus_free_string_array (texts);
+  return FALSE;
+}
+
+/* RemoveMatches answers with whether each rule was found and removed;
+ * one that wasn't added is not an error here, unlike with
+ * RemoveMatch, so a client can drop everything it may have added. A
+ * rule that doesn't parse fails the whole call and nothing is removed.
+ */
+static dbus_bool_t
+bus_driver_handle_remove_matches (DBusConnection *connection,
+                                  BusTransaction *transaction,
+                                  DBusMessage    *message,
+                                  DBusError      *error)
+{
+  BusMatchRule **rules;
+  BusMatchmaker *matchmaker;
+  DBusMessage *reply;
+  dbus_bool_t *removed;
+  char **texts;
+  int n_texts;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  texts = NULL;
+  rules = NULL;
+  removed = NULL;
+  reply = NULL;
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &texts, &n_texts,
+                              DBUS_TYPE_INVALID))
+    {
+      _dbus_verbose ("No memory to get arguments to RemoveMatches\n");
+      goto failed;
+    }
+
+  rules = dbus_new0 (BusMatchRule *, n_texts + 1);
+  removed = dbus_new0 (dbus_bool_t, n_texts + 1);
+  if (rules == NULL || removed == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!parse_match_rules (connection, texts, n_texts, rules, error))
+    goto failed;
+
+  /* Work out what will be removed before removing anything, since the
+   * reply is undone on transaction cancel but rule removal isn't. A
+   * rule listed twice needs to have been added twice.
+   */
+  for (i = 0; i < n_texts; i++)
+    {
+      int n_earlier;
+      int j;
+
+      n_earlier = 0;
+      for (j = 0; j < i; j++)
+        {
+          if (strcmp (bus_match_rule_get_key (rules[j]),
+                      bus_match_rule_get_key (rules[i])) == 0)
+            n_earlier += 1;
+        }
+
+      removed[i] = bus_matchmaker_get_n_additions (matchmaker, rules[i]) > n_earlier;
+    }
+
+  if (!dbus_message_get_no_reply (message))
+    {
+      reply = dbus_message_new_method_return (message);
+      if (reply == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      if (!dbus_message_append_args (reply,
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_BOOLEAN, &removed, n_texts,
+                                     DBUS_TYPE_INVALID) ||
+          !bus_transaction_send_from_driver (transaction, connection, reply))
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      dbus_message_unref (reply);
+      reply = NULL;
+    }
+
+  for (i = 0; i < n_texts; i++)
+    {
+      if (removed[i] &&
+          !bus_matchmaker_remove_rule_by_value (matchmaker, rules[i], NULL))
+        _dbus_assert_not_reached ("rule counted as added was not found");
+
+      bus_match_rule_unref (rules[i]);
+    }
+
+  dbus_free (rules);
+  dbus_free (removed);
+  dbus_free_string_array (texts);
+
+  return TRUE;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  if (rules != NULL)
+    {
+      for (i = 0; i < n_texts && rules[i] != NULL; i++)
+        bus_match_rule_unref (rules[i]);
+      dbus_free (rules);
+    }
+  dbus_free (removed);
+  dbus_free_string_array (texts);
+  return FALSE;
+}
+
 static dbus_bool_t
 bus_driver_handle_get_service_owner (DBusConnection *connection,
 				     BusTransaction *transaction,
@@ -1117,21 +1494,241 @@ bus_driver_handle_get_service_owner (DBusConnection *connection,
       _dbus_assert (*base_name == ':');
     }
 
-  _dbus_assert (base_name != NULL);
+  _dbus_assert (base_name != NULL);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  if (! dbus_message_append_args (reply,
+				  DBUS_TYPE_STRING, &base_name,
+				  DBUS_TYPE_INVALID))
+    goto oom;
+
+  if (! bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+
+  return TRUE;
+
+ oom:
+  BUS_SET_OOM (error);
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  if (reply)
+    dbus_message_unref (reply);
+  return FALSE;
+}
+
+/* GetNameOwners answers for many names in one reply; names that have
+ * no owner are left out rather than failing the whole call, so a
+ * snapshot of the bus's state costs one round trip
+ */
+static dbus_bool_t
+bus_driver_handle_get_name_owners (DBusConnection *connection,
+                                   BusTransaction *transaction,
+                                   DBusMessage    *message,
+                                   DBusError      *error)
+{
+  BusRegistry *registry;
+  DBusMessage *reply;
+  DBusMessageIter iter, dict_iter;
+  char **names;
+  int n_names;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  registry = bus_connection_get_registry (connection);
+
+  names = NULL;
+  reply = NULL;
+
+  if (! dbus_message_get_args (message, error,
+                               DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &names, &n_names,
+                               DBUS_TYPE_INVALID))
+    goto failed;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                                         &dict_iter))
+    goto oom;
+
+  for (i = 0; i < n_names; i++)
+    {
+      DBusMessageIter entry_iter;
+      BusService *service;
+      const char *base_name;
+      DBusString str;
+
+      _dbus_string_init_const (&str, names[i]);
+      service = bus_registry_lookup (registry, &str);
+      if (service == NULL &&
+          _dbus_string_equal_c_str (&str, DBUS_SERVICE_DBUS))
+        base_name = DBUS_SERVICE_DBUS; /* owns itself */
+      else if (service == NULL)
+        continue;
+      else
+        base_name = bus_connection_get_name (bus_service_get_primary_owners_connection (service));
+
+      if (base_name == NULL)
+        continue;
+
+      if (!dbus_message_iter_open_container (&dict_iter, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry_iter) ||
+          !dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING,
+                                           &names[i]) ||
+          !dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING,
+                                           &base_name) ||
+          !dbus_message_iter_close_container (&dict_iter, &entry_iter))
+        goto oom;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &dict_iter))
+    goto oom;
+
+  if (! bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  dbus_free_string_array (names);
+
+  return TRUE;
+
+ oom:
+  BUS_SET_OOM (error);
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  if (reply)
+    dbus_message_unref (reply);
+  dbus_free_string_array (names);
+  return FALSE;
+}
+
+static dbus_bool_t
+append_credential (DBusMessageIter *creds_iter,
+                   const char      *key,
+                   dbus_uint32_t    value)
+{
+  DBusMessageIter entry_iter, variant_iter;
+
+  return dbus_message_iter_open_container (creds_iter, DBUS_TYPE_DICT_ENTRY,
+                                           NULL, &entry_iter) &&
+    dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING, &key) &&
+    dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_VARIANT,
+                                      DBUS_TYPE_UINT32_AS_STRING,
+                                      &variant_iter) &&
+    dbus_message_iter_append_basic (&variant_iter, DBUS_TYPE_UINT32, &value) &&
+    dbus_message_iter_close_container (&entry_iter, &variant_iter) &&
+    dbus_message_iter_close_container (creds_iter, &entry_iter);
+}
+
+/* Like GetConnectionUnixUser and GetConnectionUnixProcessID for many
+ * names in one reply. Each owned name maps to an a{sv} holding
+ * UnixUserID and ProcessID where they are known, so more can be added
+ * later; names with no owner are left out.
+ */
+static dbus_bool_t
+bus_driver_handle_get_connection_credentials_batch (DBusConnection *connection,
+                                                    BusTransaction *transaction,
+                                                    DBusMessage    *message,
+                                                    DBusError      *error)
+{
+  BusRegistry *registry;
+  DBusMessage *reply;
+  DBusMessageIter iter, dict_iter;
+  char **names;
+  int n_names;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  registry = bus_connection_get_registry (connection);
+
+  names = NULL;
+  reply = NULL;
+
+  if (! dbus_message_get_args (message, error,
+                               DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &names, &n_names,
+                               DBUS_TYPE_INVALID))
+    goto failed;
 
   reply = dbus_message_new_method_return (message);
   if (reply == NULL)
     goto oom;
 
-  if (! dbus_message_append_args (reply,
-				  DBUS_TYPE_STRING, &base_name,
-				  DBUS_TYPE_INVALID))
+  dbus_message_iter_init_append (reply, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_TYPE_ARRAY_AS_STRING
+                                         DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_TYPE_VARIANT_AS_STRING
+                                         DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+                                         DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                                         &dict_iter))
+    goto oom;
+
+  for (i = 0; i < n_names; i++)
+    {
+      DBusMessageIter entry_iter, creds_iter;
+      DBusConnection *conn;
+      BusService *service;
+      unsigned long id;
+      DBusString str;
+
+      _dbus_string_init_const (&str, names[i]);
+      service = bus_registry_lookup (registry, &str);
+      if (service == NULL)
+        continue;
+
+      conn = bus_service_get_primary_owners_connection (service);
+
+      if (!dbus_message_iter_open_container (&dict_iter, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry_iter) ||
+          !dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING,
+                                           &names[i]) ||
+          !dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_ARRAY,
+                                             DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                             DBUS_TYPE_STRING_AS_STRING
+                                             DBUS_TYPE_VARIANT_AS_STRING
+                                             DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                                             &creds_iter))
+        goto oom;
+
+      if (dbus_connection_get_unix_user (conn, &id) &&
+          !append_credential (&creds_iter, "UnixUserID", id))
+        goto oom;
+
+      if (dbus_connection_get_unix_process_id (conn, &id) &&
+          !append_credential (&creds_iter, "ProcessID", id))
+        goto oom;
+
+      if (!dbus_message_iter_close_container (&entry_iter, &creds_iter) ||
+          !dbus_message_iter_close_container (&dict_iter, &entry_iter))
+        goto oom;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &dict_iter))
     goto oom;
 
   if (! bus_transaction_send_from_driver (transaction, connection, reply))
     goto oom;
 
   dbus_message_unref (reply);
+  dbus_free_string_array (names);
 
   return TRUE;
 
@@ -1142,6 +1739,7 @@ bus_driver_handle_get_service_owner (DBusConnection *connection,
   _DBUS_ASSERT_ERROR_IS_SET (error);
   if (reply)
     dbus_message_unref (reply);
+  dbus_free_string_array (names);
   return FALSE;
 }
 
@@ -1589,6 +2187,50 @@ bus_driver_handle_reload_config (DBusConnection *connection,
   return FALSE;
 }
 
+/* Replies to the caller may then overtake signals from other senders
+ * that were queued for it earlier, including our own NameOwnerChanged;
+ * see _dbus_connection_set_replies_jump_queue(). Off unless asked for.
+ */
+static dbus_bool_t
+bus_driver_handle_set_reply_priority (DBusConnection *connection,
+                                      BusTransaction *transaction,
+                                      DBusMessage    *message,
+                                      DBusError      *error)
+{
+  DBusMessage *reply;
+  dbus_bool_t enabled;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  reply = NULL;
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_BOOLEAN, &enabled,
+                              DBUS_TYPE_INVALID))
+    goto failed;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  if (! bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  _dbus_connection_set_replies_jump_queue (connection, enabled);
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  BUS_SET_OOM (error);
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  if (reply)
+    dbus_message_unref (reply);
+  return FALSE;
+}
+
 static dbus_bool_t
 bus_driver_handle_get_id (DBusConnection *connection,
                           BusTransaction *transaction,
@@ -1644,11 +2286,7 @@ bus_driver_handle_get_id (DBusConnection *connection,
   return FALSE;
 }
 
-/* For speed it might be useful to sort this in order of
- * frequency of use (but doesn't matter with only a few items
- * anyhow)
- */
-static struct
+typedef struct
 {
   const char *name;
   const char *in_args;
@@ -1657,7 +2295,12 @@ static struct
                            BusTransaction *transaction,
                            DBusMessage    *message,
                            DBusError      *error);
-} message_handlers[] = {
+} MessageHandler;
+
+/* Calls are looked up by member through handler_index below, so the
+ * order here only matters for introspection.
+ */
+static const MessageHandler message_handlers[] = {
   { "Hello",
     "",
     DBUS_TYPE_STRING_AS_STRING,
@@ -1690,6 +2333,14 @@ static struct
     "",
     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
     bus_driver_handle_list_activatable_services },
+  { "ListNamesPaged",
+    DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UINT32_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    bus_driver_handle_list_services_paged },
+  { "ListActivatableNamesPaged",
+    DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UINT32_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    bus_driver_handle_list_activatable_services_paged },
   { "AddMatch",
     DBUS_TYPE_STRING_AS_STRING,
     "",
@@ -1698,10 +2349,22 @@ static struct
     DBUS_TYPE_STRING_AS_STRING,
     "",
     bus_driver_handle_remove_match },
+  { "AddMatches",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    "",
+    bus_driver_handle_add_matches },
+  { "RemoveMatches",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_BOOLEAN_AS_STRING,
+    bus_driver_handle_remove_matches },
   { "GetNameOwner",
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_STRING_AS_STRING,
     bus_driver_handle_get_service_owner },
+  { "GetNameOwners",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_driver_handle_get_name_owners },
   { "ListQueuedOwners",
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
@@ -1714,6 +2377,10 @@ static struct
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_UINT32_AS_STRING,
     bus_driver_handle_get_connection_unix_process_id },
+  { "GetConnectionCredentialsBatch",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_driver_handle_get_connection_credentials_batch },
   { "GetAdtAuditSessionData",
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_BYTE_AS_STRING,
@@ -1726,12 +2393,141 @@ static struct
     "",
     "",
     bus_driver_handle_reload_config },
+  { "SetReplyPriority",
+    DBUS_TYPE_BOOLEAN_AS_STRING,
+    "",
+    bus_driver_handle_set_reply_priority },
   { "GetId",
     "",
     DBUS_TYPE_STRING_AS_STRING,
     bus_driver_handle_get_id }
 };
 
+/* BUS_INTERFACE_STATS, few enough to search in order */
+static const MessageHandler stats_message_handlers[] = {
+  { "GetStats",
+    "",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_stats_handle_get_stats },
+  { "GetConnectionStats",
+    DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_stats_handle_get_connection_stats },
+  { "GetLatencyHistograms",
+    "",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_ARRAY_AS_STRING DBUS_STRUCT_BEGIN_CHAR_AS_STRING DBUS_TYPE_UINT32_AS_STRING DBUS_TYPE_UINT32_AS_STRING DBUS_STRUCT_END_CHAR_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_stats_handle_get_latency_histograms },
+  { "GetMatchRuleCosts",
+    DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_STRUCT_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UINT32_AS_STRING DBUS_TYPE_UINT32_AS_STRING DBUS_TYPE_UINT64_AS_STRING DBUS_STRUCT_END_CHAR_AS_STRING,
+    bus_stats_handle_get_match_rule_costs },
+  { "GetFlightRecord",
+    "",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_STRUCT_BEGIN_CHAR_AS_STRING DBUS_TYPE_UINT32_AS_STRING DBUS_TYPE_UINT32_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UINT32_AS_STRING DBUS_TYPE_UINT32_AS_STRING DBUS_TYPE_UINT32_AS_STRING DBUS_STRUCT_END_CHAR_AS_STRING,
+    bus_stats_handle_get_flight_record }
+};
+
+/* BUS_INTERFACE_CAPTURE */
+static const MessageHandler capture_message_handlers[] = {
+  { "StartCapture",
+    DBUS_TYPE_UNIX_FD_AS_STRING DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    "",
+    bus_capture_handle_start },
+  { "StopCapture",
+    "",
+    "",
+    bus_capture_handle_stop }
+};
+
+/* BUS_INTERFACE_BRIDGE */
+static const MessageHandler bridge_message_handlers[] = {
+  { "GetMatchSummary",
+    "",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_BYTE_AS_STRING,
+    bus_bridge_handle_get_match_summary }
+};
+
+/* Open-addressed index from member name to message_handlers[] entry,
+ * holding the entry's position plus one so that 0 is an empty slot.
+ * It has to stay comfortably larger than the table.
+ */
+#define HANDLER_INDEX_SIZE 64
+
+static int handler_index[HANDLER_INDEX_SIZE];
+static dbus_bool_t handler_index_built = FALSE;
+
+static unsigned int
+handler_name_hash (const char *name)
+{
+  unsigned int h;
+
+  /* the same string hash dbus-hash.c uses */
+  h = 0;
+  while (*name)
+    {
+      h = (h << 5) - h + (unsigned char) *name;
+      ++name;
+    }
+
+  return h;
+}
+
+static void
+build_handler_index (void)
+{
+  int i;
+
+  _dbus_assert (_DBUS_N_ELEMENTS (message_handlers) * 2 <= HANDLER_INDEX_SIZE);
+
+  i = 0;
+  while (i < _DBUS_N_ELEMENTS (message_handlers))
+    {
+      unsigned int slot;
+
+      /* checked here once instead of on every call */
+      _dbus_assert (dbus_signature_validate (message_handlers[i].in_args, NULL));
+      _dbus_assert (dbus_signature_validate (message_handlers[i].out_args, NULL));
+
+      slot = handler_name_hash (message_handlers[i].name) % HANDLER_INDEX_SIZE;
+      while (handler_index[slot] != 0)
+        {
+          _dbus_assert (strcmp (message_handlers[handler_index[slot] - 1].name,
+                                message_handlers[i].name) != 0);
+          slot = (slot + 1) % HANDLER_INDEX_SIZE;
+        }
+
+      handler_index[slot] = i + 1;
+      ++i;
+    }
+
+  handler_index_built = TRUE;
+}
+
+/* Returns the position of the handler for the given member of the
+ * DBUS_INTERFACE_DBUS interface, or -1 if there isn't one.
+ */
+static int
+find_handler (const char *name)
+{
+  unsigned int slot;
+
+  if (!handler_index_built)
+    build_handler_index ();
+
+  slot = handler_name_hash (name) % HANDLER_INDEX_SIZE;
+  while (handler_index[slot] != 0)
+    {
+      int i = handler_index[slot] - 1;
+
+      if (strcmp (message_handlers[i].name, name) == 0)
+        return i;
+
+      slot = (slot + 1) % HANDLER_INDEX_SIZE;
+    }
+
+  return -1;
+}
+
 static dbus_bool_t
 write_args_for_direction (DBusString *xml,
 			  const char *signature,
@@ -1767,10 +2563,39 @@ write_args_for_direction (DBusString *xml,
   return FALSE;
 }
 
+static dbus_bool_t
+write_methods (DBusString           *xml,
+               const MessageHandler *handlers,
+               int                   n_handlers)
+{
+  int i;
+
+  i = 0;
+  while (i < n_handlers)
+    {
+
+      if (!_dbus_string_append_printf (xml, "    <method name=\"%s\">\n",
+                                       handlers[i].name))
+        return FALSE;
+
+      if (!write_args_for_direction (xml, handlers[i].in_args, TRUE))
+	return FALSE;
+
+      if (!write_args_for_direction (xml, handlers[i].out_args, FALSE))
+	return FALSE;
+
+      if (!_dbus_string_append (xml, "    </method>\n"))
+	return FALSE;
+
+      ++i;
+    }
+
+  return TRUE;
+}
+
 dbus_bool_t
 bus_driver_generate_introspect_string (DBusString *xml)
 {
-  int i;
 
   if (!_dbus_string_append (xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
     return FALSE;
@@ -1791,25 +2616,9 @@ bus_driver_generate_introspect_string (DBusString *xml)
                                    DBUS_INTERFACE_DBUS))
     return FALSE;
 
-  i = 0;
-  while (i < _DBUS_N_ELEMENTS (message_handlers))
-    {
-
-      if (!_dbus_string_append_printf (xml, "    <method name=\"%s\">\n",
-                                       message_handlers[i].name))
-        return FALSE;
-
-      if (!write_args_for_direction (xml, message_handlers[i].in_args, TRUE))
-	return FALSE;
-
-      if (!write_args_for_direction (xml, message_handlers[i].out_args, FALSE))
-	return FALSE;
-
-      if (!_dbus_string_append (xml, "    </method>\n"))
-	return FALSE;
-
-      ++i;
-    }
+  if (!write_methods (xml, message_handlers,
+                      _DBUS_N_ELEMENTS (message_handlers)))
+    return FALSE;
 
   if (!_dbus_string_append_printf (xml, "    <signal name=\"NameOwnerChanged\">\n"))
     return FALSE;
@@ -1851,6 +2660,39 @@ bus_driver_generate_introspect_string (DBusString *xml)
   if (!_dbus_string_append (xml, "  </interface>\n"))
     return FALSE;
 
+  if (!_dbus_string_append_printf (xml, "  <interface name=\"%s\">\n",
+                                   BUS_INTERFACE_STATS))
+    return FALSE;
+
+  if (!write_methods (xml, stats_message_handlers,
+                      _DBUS_N_ELEMENTS (stats_message_handlers)))
+    return FALSE;
+
+  if (!_dbus_string_append (xml, "  </interface>\n"))
+    return FALSE;
+
+  if (!_dbus_string_append_printf (xml, "  <interface name=\"%s\">\n",
+                                   BUS_INTERFACE_CAPTURE))
+    return FALSE;
+
+  if (!write_methods (xml, capture_message_handlers,
+                      _DBUS_N_ELEMENTS (capture_message_handlers)))
+    return FALSE;
+
+  if (!_dbus_string_append (xml, "  </interface>\n"))
+    return FALSE;
+
+  if (!_dbus_string_append_printf (xml, "  <interface name=\"%s\">\n",
+                                   BUS_INTERFACE_BRIDGE))
+    return FALSE;
+
+  if (!write_methods (xml, bridge_message_handlers,
+                      _DBUS_N_ELEMENTS (bridge_message_handlers)))
+    return FALSE;
+
+  if (!_dbus_string_append (xml, "  </interface>\n"))
+    return FALSE;
+
   if (!_dbus_string_append (xml, "</node>\n"))
     return FALSE;
 
@@ -1919,6 +2761,46 @@ bus_driver_handle_introspect (DBusConnection *connection,
   return FALSE;
 }
 
+static dbus_bool_t
+call_handler (const MessageHandler *handler,
+              DBusConnection       *connection,
+              BusTransaction       *transaction,
+              DBusMessage          *message,
+              DBusError            *error)
+{
+  const char *name = handler->name;
+
+  _dbus_verbose ("Found driver handler for %s\n", name);
+
+  if (!dbus_message_has_signature (message, handler->in_args))
+    {
+      _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+      _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
+                     name, dbus_message_get_signature (message),
+                     handler->in_args);
+
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Call to %s has wrong args (%s, expected %s)\n",
+                      name, dbus_message_get_signature (message),
+                      handler->in_args);
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return FALSE;
+    }
+
+  if ((* handler->handler) (connection, transaction, message, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+      _dbus_verbose ("Driver handler succeeded\n");
+      return TRUE;
+    }
+  else
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      _dbus_verbose ("Driver handler returned failure\n");
+      return FALSE;
+    }
+}
+
 dbus_bool_t
 bus_driver_handle_message (DBusConnection *connection,
                            BusTransaction *transaction,
@@ -1958,6 +2840,52 @@ bus_driver_handle_message (DBusConnection *connection,
   name = dbus_message_get_member (message);
   sender = dbus_message_get_sender (message);
 
+  if (strcmp (interface, BUS_INTERFACE_STATS) == 0)
+    {
+      /* anyone talking to the driver has said Hello by now */
+      if (sender == NULL)
+        goto unknown;
+
+      for (i = 0; i < _DBUS_N_ELEMENTS (stats_message_handlers); i++)
+        {
+          if (strcmp (stats_message_handlers[i].name, name) == 0)
+            return call_handler (&stats_message_handlers[i], connection,
+                                 transaction, message, error);
+        }
+
+      goto unknown;
+    }
+
+  if (strcmp (interface, BUS_INTERFACE_CAPTURE) == 0)
+    {
+      if (sender == NULL)
+        goto unknown;
+
+      for (i = 0; i < _DBUS_N_ELEMENTS (capture_message_handlers); i++)
+        {
+          if (strcmp (capture_message_handlers[i].name, name) == 0)
+            return call_handler (&capture_message_handlers[i], connection,
+                                 transaction, message, error);
+        }
+
+      goto unknown;
+    }
+
+  if (strcmp (interface, BUS_INTERFACE_BRIDGE) == 0)
+    {
+      if (sender == NULL)
+        goto unknown;
+
+      for (i = 0; i < _DBUS_N_ELEMENTS (bridge_message_handlers); i++)
+        {
+          if (strcmp (bridge_message_handlers[i].name, name) == 0)
+            return call_handler (&bridge_message_handlers[i], connection,
+                                 transaction, message, error);
+        }
+
+      goto unknown;
+    }
+
   if (strcmp (interface,
               DBUS_INTERFACE_DBUS) != 0)
     {
@@ -1972,44 +2900,10 @@ bus_driver_handle_message (DBusConnection *connection,
   /* security checks should have kept this from getting here */
   _dbus_assert (sender != NULL || strcmp (name, "Hello") == 0);
 
-  i = 0;
-  while (i < _DBUS_N_ELEMENTS (message_handlers))
-    {
-      if (strcmp (message_handlers[i].name, name) == 0)
-        {
-          _dbus_verbose ("Found driver handler for %s\n", name);
-
-          if (!dbus_message_has_signature (message, message_handlers[i].in_args))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
-                             name, dbus_message_get_signature (message),
-                             message_handlers[i].in_args);
-
-              dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
-                              "Call to %s has wrong args (%s, expected %s)\n",
-                              name, dbus_message_get_signature (message),
-                              message_handlers[i].in_args);
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              return FALSE;
-            }
-
-          if ((* message_handlers[i].handler) (connection, transaction, message, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Driver handler succeeded\n");
-              return TRUE;
-            }
-          else
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_verbose ("Driver handler returned failure\n");
-              return FALSE;
-            }
-        }
-
-      ++i;
-    }
+  i = find_handler (name);
+  if (i >= 0)
+    return call_handler (&message_handlers[i], connection, transaction,
+                         message, error);
 
  unknown:
   _dbus_verbose ("No driver handler for message \"%s\"\n",
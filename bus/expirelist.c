@@ -30,7 +30,7 @@
 
 struct BusExpireList
 {
-  DBusList      *items; /**< List of BusExpireItem */
+  DBusList      *items; /**< List of BusExpireItem, oldest first */
   DBusTimeout   *timeout;
   DBusLoop      *loop;
   BusExpireFunc  expire_func;
@@ -139,12 +139,14 @@ do_expiration_with_current_time (BusExpireList *list,
                                  long           tv_usec)
 {
   DBusList *link;
-  int next_interval, min_wait_time, items_to_expire;
+  int next_interval;
 
   next_interval = -1;
-  min_wait_time = 3600 * 1000; /* this is reset anyway if used */
-  items_to_expire = 0;
-  
+
+  /* Every item has the same lifetime and the list is sorted by the
+   * time they were added, so we can stop at the first item that
+   * isn't due yet instead of looking at all of them.
+   */
   link = _dbus_list_get_first_link (&list->items);
   while (link != NULL)
     {
@@ -175,22 +177,17 @@ do_expiration_with_current_time (BusExpireList *list,
               break;
             }
         }
-      else if (list->expire_after > 0)
+      else
         {
-          double to_wait;
+          if (list->expire_after > 0)
+            next_interval = (double) list->expire_after - elapsed;
 
-          items_to_expire = 1;
-          to_wait = (double) list->expire_after - elapsed;
-          if (min_wait_time > to_wait)
-            min_wait_time = to_wait;
+          break;
         }
 
       link = next;
     }
 
-  if (next_interval < 0 && items_to_expire)
-    next_interval = min_wait_time;
-
   return next_interval;
 }
 
@@ -226,6 +223,35 @@ expire_timeout_handler (void *data)
   return TRUE;
 }
 
+static dbus_bool_t
+item_added_before (BusExpireItem *a,
+                   BusExpireItem *b)
+{
+  if (a->added_tv_sec != b->added_tv_sec)
+    return a->added_tv_sec < b->added_tv_sec;
+
+  return a->added_tv_usec < b->added_tv_usec;
+}
+
+/* New items are almost always the newest, so search from the end;
+ * this is O(1) unless the clock goes backwards.
+ */
+static void
+insert_link_sorted (BusExpireList *list,
+                    DBusList      *link)
+{
+  DBusList *prev;
+
+  prev = _dbus_list_get_last_link (&list->items);
+  while (prev != NULL && item_added_before (link->data, prev->data))
+    prev = _dbus_list_get_prev_link (&list->items, prev);
+
+  if (prev == NULL)
+    _dbus_list_prepend_link (&list->items, link);
+  else
+    _dbus_list_insert_after_link (&list->items, prev, link);
+}
+
 void
 bus_expire_list_remove_link (BusExpireList *list,
                              DBusList      *link)
@@ -247,17 +273,20 @@ bus_expire_list_unlink (BusExpireList *list,
   _dbus_list_unlink (&list->items, link);
 }
 
+/* The item's added time must be set before it is added. */
 dbus_bool_t
 bus_expire_list_add (BusExpireList *list,
                      BusExpireItem *item)
 {
-  dbus_bool_t ret;
+  DBusList *link;
 
-  ret = _dbus_list_prepend (&list->items, item);
-  if (ret && !dbus_timeout_get_enabled (list->timeout))
-    bus_expire_timeout_set_interval (list->timeout, 0);
+  link = _dbus_list_alloc_link (item);
+  if (link == NULL)
+    return FALSE;
 
-  return ret;
+  bus_expire_list_add_link (list, link);
+
+  return TRUE;
 }
 
 void
@@ -266,12 +295,30 @@ bus_expire_list_add_link (BusExpireList *list,
 {
   _dbus_assert (link->data != NULL);
   
-  _dbus_list_prepend_link (&list->items, link);
+  insert_link_sorted (list, link);
 
   if (!dbus_timeout_get_enabled (list->timeout))
     bus_expire_timeout_set_interval (list->timeout, 0);
 }
 
+/* Make an item already in the list expire on the next check,
+ * keeping the list in order.
+ */
+void
+bus_expire_list_expire_link_now (BusExpireList *list,
+                                 DBusList      *link)
+{
+  BusExpireItem *item = link->data;
+
+  item->added_tv_sec = 0;
+  item->added_tv_usec = 0;
+
+  _dbus_list_unlink (&list->items, link);
+  _dbus_list_prepend_link (&list->items, link);
+
+  bus_expire_list_recheck_immediately (list);
+}
+
 DBusList*
 bus_expire_list_get_first_link (BusExpireList *list)
 {
@@ -338,6 +385,9 @@ bus_expire_list_test (const DBusString *test_data_dir)
   long tv_sec_expired, tv_usec_expired;
   long tv_sec_past, tv_usec_past;
   TestExpireItem *item;
+  TestExpireItem *item_old;
+  TestExpireItem *item_new;
+  DBusList *link;
   int next_interval;
   dbus_bool_t result = FALSE;
 
@@ -398,6 +448,54 @@ bus_expire_list_test (const DBusString *test_data_dir)
   _dbus_verbose ("next_interval = %d\n", next_interval);
   _dbus_assert (next_interval == 1000 + EXPIRE_AFTER);
 
+  /* older items go first, wherever they are added */
+  item_old = dbus_new0 (TestExpireItem, 1);
+  item_new = dbus_new0 (TestExpireItem, 1);
+
+  if (item_old == NULL || item_new == NULL)
+    goto oom;
+
+  item_new->item.added_tv_sec = tv_sec_not_expired;
+  item_new->item.added_tv_usec = tv_usec_not_expired;
+  if (!bus_expire_list_add (list, &item_new->item))
+    _dbus_assert_not_reached ("out of memory");
+
+  item_old->item.added_tv_sec = tv_sec_past;
+  item_old->item.added_tv_usec = tv_usec_past;
+  if (!bus_expire_list_add (list, &item_old->item))
+    _dbus_assert_not_reached ("out of memory");
+
+  link = bus_expire_list_get_first_link (list);
+  _dbus_assert (link->data == item_old);
+  link = bus_expire_list_get_next_link (list, link);
+  _dbus_assert (link->data == item);
+  link = bus_expire_list_get_next_link (list, link);
+  _dbus_assert (link->data == item_new);
+
+  /* only the items that are due get looked at */
+  next_interval =
+    do_expiration_with_current_time (list, tv_sec, tv_usec);
+  _dbus_assert (item_old->expire_count == 1);
+  _dbus_assert (item->expire_count == 1);
+  _dbus_assert (item_new->expire_count == 0);
+  _dbus_verbose ("next_interval = %d\n", next_interval);
+  _dbus_assert (next_interval == EXPIRE_AFTER);
+
+  bus_expire_list_expire_link_now (list, link);
+  _dbus_assert (bus_expire_list_get_first_link (list)->data == item_new);
+
+  next_interval =
+    do_expiration_with_current_time (list, tv_sec, tv_usec);
+  _dbus_assert (item_new->expire_count == 1);
+  _dbus_assert (item_old->expire_count == 2);
+  _dbus_assert (item->expire_count == 1);
+  _dbus_assert (next_interval == EXPIRE_AFTER);
+
+  bus_expire_list_remove (list, &item_old->item);
+  bus_expire_list_remove (list, &item_new->item);
+  dbus_free (item_old);
+  dbus_free (item_new);
+
   bus_expire_list_remove (list, &item->item);
   dbus_free (item);
   
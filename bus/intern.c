@@ -0,0 +1,367 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* intern.c  Shared, refcounted copies of names the bus keeps many of
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "intern.h"
+#include "test.h"
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-internals.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Match rules, policy rules and the service registry name the same
+ * interfaces, members, paths and bus names over and over. Each
+ * distinct string is stored once here, with its hash and a refcount
+ * in front of it, and everyone holding it shares the copy. Two
+ * interned strings are equal exactly when the pointers are.
+ *
+ * The table belongs to the process, not to a BusContext, since
+ * strings outlive any one context in the tests; it is freed again
+ * once the last string goes away. The bus is single-threaded, so
+ * there is no locking.
+ */
+
+typedef struct BusInternedString BusInternedString;
+
+struct BusInternedString
+{
+  BusInternedString *next; /**< next string in the same bucket */
+  unsigned int hash;       /**< hash of str, computed once */
+  int refcount;            /**< holders of this string */
+  char str[1];             /**< the string itself, allocated inline */
+};
+
+#define INITIAL_BUCKETS 64
+
+static BusInternedString **buckets = NULL;
+static int n_buckets = 0;
+static int n_strings = 0;
+
+static BusInternedString *
+interned_from_string (const char *str)
+{
+  return (BusInternedString *) (str - _DBUS_STRUCT_OFFSET (BusInternedString, str));
+}
+
+/* Same keyed hash as DBusHashTable, for the same reason: clients
+ * choose these strings. The key is set up when the table is created.
+ */
+static unsigned int
+hash_string (const char *str,
+             int        *len_p)
+{
+  *len_p = strlen (str);
+  return _dbus_hash_string (str, *len_p);
+}
+
+static BusInternedString *
+find_string (const char   *str,
+             unsigned int  hash)
+{
+  BusInternedString *s;
+
+  if (buckets == NULL)
+    return NULL;
+
+  for (s = buckets[hash & (n_buckets - 1)]; s != NULL; s = s->next)
+    {
+      if (s->hash == hash && strcmp (s->str, str) == 0)
+        return s;
+    }
+
+  return NULL;
+}
+
+/* Keep chains short; failing to grow only costs speed. */
+static void
+maybe_grow (void)
+{
+  BusInternedString **new_buckets;
+  int new_n_buckets;
+  int i;
+
+  if (n_strings < n_buckets * 2)
+    return;
+
+  new_n_buckets = n_buckets * 4;
+  new_buckets = dbus_new0 (BusInternedString *, new_n_buckets);
+  if (new_buckets == NULL)
+    return;
+
+  for (i = 0; i < n_buckets; i++)
+    {
+      BusInternedString *s = buckets[i];
+
+      while (s != NULL)
+        {
+          BusInternedString *next = s->next;
+          int b = s->hash & (new_n_buckets - 1);
+
+          s->next = new_buckets[b];
+          new_buckets[b] = s;
+          s = next;
+        }
+    }
+
+  dbus_free (buckets);
+  buckets = new_buckets;
+  n_buckets = new_n_buckets;
+}
+
+/**
+ * Returns the shared copy of a string, creating it if needed. The
+ * caller owns a reference and must drop it with bus_intern_unref().
+ * Passing #NULL returns #NULL, like _dbus_strdup().
+ *
+ * @param str the string
+ * @returns the interned string, or #NULL if no memory
+ */
+const char *
+bus_intern_string (const char *str)
+{
+  BusInternedString *s;
+  unsigned int hash;
+  int len;
+  int b;
+
+  if (str == NULL)
+    return NULL;
+
+  if (buckets == NULL)
+    {
+      _dbus_hash_key_init ();
+
+      buckets = dbus_new0 (BusInternedString *, INITIAL_BUCKETS);
+      if (buckets == NULL)
+        return NULL;
+      n_buckets = INITIAL_BUCKETS;
+    }
+
+  hash = hash_string (str, &len);
+
+  s = find_string (str, hash);
+  if (s != NULL)
+    {
+      s->refcount += 1;
+      return s->str;
+    }
+
+  s = dbus_malloc (_DBUS_STRUCT_OFFSET (BusInternedString, str) + len + 1);
+  if (s == NULL)
+    {
+      if (n_strings == 0)
+        {
+          dbus_free (buckets);
+          buckets = NULL;
+          n_buckets = 0;
+        }
+      return NULL;
+    }
+
+  s->hash = hash;
+  s->refcount = 1;
+  memcpy (s->str, str, len + 1);
+
+  b = hash & (n_buckets - 1);
+  s->next = buckets[b];
+  buckets[b] = s;
+  n_strings += 1;
+
+  maybe_grow ();
+
+  return s->str;
+}
+
+/**
+ * Adds a reference to an interned string.
+ *
+ * @param interned a string from bus_intern_string()
+ * @returns the same string
+ */
+const char *
+bus_intern_ref (const char *interned)
+{
+  BusInternedString *s = interned_from_string (interned);
+
+  _dbus_assert (s->refcount > 0);
+
+  s->refcount += 1;
+  return interned;
+}
+
+/**
+ * Drops a reference to an interned string, freeing it with the
+ * last one. #NULL is ignored.
+ *
+ * @param interned a string from bus_intern_string(), or #NULL
+ */
+void
+bus_intern_unref (const char *interned)
+{
+  BusInternedString *s;
+  BusInternedString **p;
+
+  if (interned == NULL)
+    return;
+
+  s = interned_from_string (interned);
+
+  _dbus_assert (s->refcount > 0);
+
+  s->refcount -= 1;
+  if (s->refcount > 0)
+    return;
+
+  p = &buckets[s->hash & (n_buckets - 1)];
+  while (*p != s)
+    p = &(*p)->next;
+  *p = s->next;
+
+  dbus_free (s);
+  n_strings -= 1;
+
+  if (n_strings == 0)
+    {
+      dbus_free (buckets);
+      buckets = NULL;
+      n_buckets = 0;
+    }
+}
+
+/**
+ * Finds the interned copy of a string without adding a reference or
+ * creating it. Since anything interned compares equal only to
+ * itself, a #NULL result means no interned string can match str.
+ *
+ * @param str the string, or #NULL
+ * @returns the interned string or #NULL
+ */
+const char *
+bus_intern_lookup (const char *str)
+{
+  BusInternedString *s;
+  unsigned int hash;
+  int len;
+
+  if (str == NULL || n_strings == 0)
+    return NULL;
+
+  hash = hash_string (str, &len);
+  s = find_string (str, hash);
+
+  return s != NULL ? s->str : NULL;
+}
+
+/**
+ * Gets the hash computed when the string was interned.
+ *
+ * @param interned a string from bus_intern_string()
+ * @returns its hash
+ */
+unsigned int
+bus_intern_hash (const char *interned)
+{
+  return interned_from_string (interned)->hash;
+}
+
+/**
+ * Gets the number of distinct strings currently interned.
+ *
+ * @returns the count
+ */
+int
+bus_intern_get_n_strings (void)
+{
+  return n_strings;
+}
+
+#ifdef DBUS_BUILD_TESTS
+
+static dbus_bool_t
+intern_many (void *data)
+{
+  const char *interned[1000];
+  char buf[64];
+  const char *a;
+  const char *b;
+  int n;
+  int i;
+
+  /* Running out of memory is fine, as long as nothing leaks */
+  a = bus_intern_string ("org.freedesktop.DBus.Properties");
+  if (a == NULL)
+    return TRUE;
+
+  b = bus_intern_string ("org.freedesktop.DBus.Properties");
+  _dbus_assert (b != NULL); /* an existing string never allocates */
+
+  _dbus_assert (a == b);
+  _dbus_assert (bus_intern_lookup ("org.freedesktop.DBus.Properties") == a);
+  _dbus_assert (bus_intern_lookup ("org.freedesktop.DBus.Propertie") == NULL);
+  bus_intern_unref (b);
+
+  n = 0;
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (interned); i++)
+    {
+      snprintf (buf, sizeof (buf), "/org/freedesktop/Test/%d", i % 500);
+      interned[i] = bus_intern_string (buf);
+      if (interned[i] == NULL)
+        break;
+      n++;
+    }
+
+  if (n == (int) _DBUS_N_ELEMENTS (interned))
+    {
+      _dbus_assert (bus_intern_get_n_strings () == 501);
+
+      for (i = 0; i < 500; i++)
+        {
+          _dbus_assert (interned[i] == interned[i + 500]);
+          _dbus_assert (bus_intern_hash (interned[i]) ==
+                        bus_intern_hash (interned[i + 500]));
+        }
+    }
+
+  for (i = 0; i < n; i++)
+    bus_intern_unref (interned[i]);
+
+  _dbus_assert (bus_intern_lookup ("org.freedesktop.DBus.Properties") == a);
+  bus_intern_unref (a);
+  _dbus_assert (bus_intern_lookup ("org.freedesktop.DBus.Properties") == NULL);
+  _dbus_assert (bus_intern_get_n_strings () == 0);
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_intern_test (const DBusString *test_data_dir)
+{
+  _dbus_assert (bus_intern_get_n_strings () == 0);
+
+  if (!_dbus_test_oom_handling ("interning strings", intern_many, NULL))
+    return FALSE;
+
+  _dbus_assert (bus_intern_get_n_strings () == 0);
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
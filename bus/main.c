@@ -24,8 +24,13 @@
 #include <config.h>
 #include "bus.h"
 #include "driver.h"
+#include "stats.h"
+#include "connection.h"
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-flight-recorder.h>
 #include <dbus/dbus-watch.h>
+#include <dbus/dbus-timeout.h>
+#include <dbus/dbus-spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,9 +50,72 @@ static int reload_pipe[2];
 
 static void close_reload_pipe (void);
 
+/* bytes read from the reload pipe at once */
+#define RELOAD_PIPE_DRAIN 64
+
+/* A reload waits until requests have stopped for reload_delay, but
+ * never more than this many reload_delays after the first one.
+ */
+#define RELOAD_MAX_DELAYS 8
+
+static dbus_bool_t print_startup_timings = FALSE;
+
+static DBusTimeout *reload_timeout = NULL;
+static dbus_bool_t reload_pending = FALSE;
+static long reload_first_sec, reload_first_usec;
+static long reload_last_sec, reload_last_usec;
+
+/* what the signal handler writes to the reload pipe */
+#define RELOAD_REQUEST "h"
+#define RESTART_REQUEST "r"
+#define LOG_LATENCY_REQUEST "l"
+#define TRIM_MEMORY_REQUEST "m"
+#define DUMP_FLIGHT_RECORD_REQUEST "f"
+
+/* There's no standard signal for "memory is short"; on Linux, and
+ * so Android, whatever watches for low memory can send us this one.
+ * It is looked up once, since SIGRTMIN is not a constant.
+ */
+#ifdef SIGRTMIN
+static int trim_memory_signal = -1;
+/* and this one for a copy of the flight recorder on stderr */
+static int dump_flight_record_signal = -1;
+#endif
+
+/* our command line, for restarting */
+static int saved_argc;
+static char **saved_argv;
+
+static void
+write_to_reload_pipe (const char *request)
+{
+  DBusString str;
+
+  _dbus_string_init_const (&str, request);
+  if ((reload_pipe[RELOAD_WRITE_END] > 0) &&
+      !_dbus_write_socket (reload_pipe[RELOAD_WRITE_END], &str, 0, 1))
+    {
+      _dbus_warn ("Unable to write to reload pipe.\n");
+      close_reload_pipe ();
+    }
+}
+
 static void
 signal_handler (int sig)
 {
+#ifdef SIGRTMIN
+  if (sig == trim_memory_signal)
+    {
+      write_to_reload_pipe (TRIM_MEMORY_REQUEST);
+      return;
+    }
+
+  if (sig == dump_flight_record_signal)
+    {
+      write_to_reload_pipe (DUMP_FLIGHT_RECORD_REQUEST);
+      return;
+    }
+#endif
 
   switch (sig)
     {
@@ -57,16 +125,17 @@ signal_handler (int sig)
 #endif /* DBUS_BUS_ENABLE_DNOTIFY_ON_LINUX  */
 #ifdef SIGHUP
     case SIGHUP:
-      {
-        DBusString str;
-        _dbus_string_init_const (&str, "foo");
-        if ((reload_pipe[RELOAD_WRITE_END] > 0) &&
-            !_dbus_write_socket (reload_pipe[RELOAD_WRITE_END], &str, 0, 1))
-          {
-            _dbus_warn ("Unable to write to reload pipe.\n");
-            close_reload_pipe ();
-          }
-      }
+      write_to_reload_pipe (RELOAD_REQUEST);
+      break;
+#endif
+#ifdef SIGUSR2
+    case SIGUSR2:
+      write_to_reload_pipe (RESTART_REQUEST);
+      break;
+#endif
+#ifdef SIGUSR1
+    case SIGUSR1:
+      write_to_reload_pipe (LOG_LATENCY_REQUEST);
       break;
 #endif
     }
@@ -75,7 +144,7 @@ signal_handler (int sig)
 static void
 usage (void)
 {
-  fprintf (stderr, DBUS_DAEMON_NAME " [--version] [--session] [--system] [--config-file=FILE] [--print-address[=DESCRIPTOR]] [--print-pid[=DESCRIPTOR]] [--fork] [--nofork] [--introspect] [--address=ADDRESS] [--systemd-activation]\n");
+  fprintf (stderr, DBUS_DAEMON_NAME " [--version] [--session] [--system] [--config-file=FILE] [--print-address[=DESCRIPTOR]] [--print-pid[=DESCRIPTOR]] [--fork] [--nofork] [--introspect] [--address=ADDRESS] [--systemd-activation] [--print-startup-timings]\n");
   exit (1);
 }
 
@@ -163,40 +232,229 @@ check_two_pid_descriptors (const DBusString *pid_fd,
     }
 }
 
+static void
+print_phase_timings (void)
+{
+  int phase;
+
+  for (phase = 0; phase < BUS_N_PHASES; phase++)
+    {
+      long usec = bus_context_get_phase_usec (context, phase);
+
+      fprintf (stderr, "%s %s: %ld.%03ld ms\n",
+               bus_context_get_phases_are_reload (context) ? "reload" : "startup",
+               bus_phase_name (phase), usec / 1000, usec % 1000);
+    }
+}
+
+static void
+reload_config (void)
+{
+  DBusError error;
+
+  /* this can only fail if we don't understand the config file
+   * or OOM.  Either way we should just stick with the currently
+   * loaded config.
+   */
+  dbus_error_init (&error);
+  if (! bus_context_reload_config (context, &error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (&error);
+      _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_FAILED) ||
+		    dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY));
+      _dbus_warn ("Unable to reload configuration: %s\n",
+		  error.message);
+      dbus_error_free (&error);
+    }
+  else if (print_startup_timings)
+    print_phase_timings ();
+}
+
+static long
+elapsed_milliseconds (long since_sec,
+                      long since_usec,
+                      long now_sec,
+                      long now_usec)
+{
+  return (now_sec - since_sec) * 1000 + (now_usec - since_usec) / 1000;
+}
+
+static dbus_bool_t
+handle_reload_timeout (void *data)
+{
+  long now_sec, now_usec;
+  long quiet, waited, delay;
+
+  _dbus_get_current_time (&now_sec, &now_usec);
+  quiet = elapsed_milliseconds (reload_last_sec, reload_last_usec,
+                                now_sec, now_usec);
+  waited = elapsed_milliseconds (reload_first_sec, reload_first_usec,
+                                 now_sec, now_usec);
+  delay = bus_context_get_reload_delay (context);
+
+  /* still getting requests; give them time to settle, but don't let
+   * a steady trickle put the reload off forever
+   */
+  if (quiet >= 0 && quiet < delay &&
+      waited >= 0 && waited < delay * RELOAD_MAX_DELAYS)
+    {
+      _dbus_timeout_set_interval (reload_timeout,
+                                  MIN (delay - quiet,
+                                       delay * RELOAD_MAX_DELAYS - waited));
+      return TRUE;
+    }
+
+  _dbus_timeout_set_enabled (reload_timeout, FALSE);
+  reload_pending = FALSE;
+
+  _dbus_verbose ("Reloading configuration after %ld milliseconds\n", waited);
+  reload_config ();
+
+  return TRUE;
+}
+
+static void
+reload_timeout_callback (DBusTimeout *timeout,
+                         void        *data)
+{
+  /* can return FALSE on OOM but we just let it fire again later */
+  dbus_timeout_handle (timeout);
+}
+
+static dbus_bool_t
+is_restart_arg (const char *arg,
+                const char *option)
+{
+  int len = strlen (option);
+
+  return strncmp (arg, option, len) == 0 &&
+    (arg[len] == '\0' || arg[len] == '=');
+}
+
+/* Execs a fresh daemon with our command line, except that it picks
+ * up our listening sockets rather than opening its own, and doesn't
+ * fork or print its address and pid again. Only returns on failure.
+ */
+static void
+restart_daemon (void)
+{
+  DBusError error;
+  char **argv;
+  int i, j;
+
+  argv = dbus_new0 (char *, saved_argc + 3);
+  if (argv == NULL)
+    {
+      _dbus_warn ("Unable to restart: out of memory\n");
+      return;
+    }
+
+  argv[0] = DBUS_DAEMONDIR "/" DBUS_DAEMON_NAME;
+  j = 1;
+  for (i = 1; i < saved_argc; i++)
+    {
+      const char *arg = saved_argv[i];
+
+      if (strcmp (arg, "--fork") == 0 ||
+          strcmp (arg, "--nofork") == 0)
+        continue;
+
+      if (is_restart_arg (arg, "--address") ||
+          is_restart_arg (arg, "--print-address") ||
+          is_restart_arg (arg, "--print-pid"))
+        {
+          /* "--option value" form; --print-* may also have no value */
+          if (strchr (arg, '=') == NULL && i + 1 < saved_argc &&
+              strncmp (saved_argv[i + 1], "--", 2) != 0)
+            i++;
+          continue;
+        }
+
+      argv[j++] = saved_argv[i];
+    }
+  argv[j++] = "--nofork";
+  argv[j++] = "--address=systemd:";
+
+  dbus_error_init (&error);
+  if (!bus_context_restart (context, argv[0], argv, &error))
+    {
+      _dbus_warn ("Unable to restart: %s\n", error.message);
+      dbus_error_free (&error);
+    }
+
+  dbus_free (argv);
+}
+
 static dbus_bool_t
 handle_reload_watch (DBusWatch    *watch,
 		     unsigned int  flags,
 		     void         *data)
 {
-  DBusError error;
   DBusString str;
+  dbus_bool_t reload;
+  int delay;
 
   while (!_dbus_string_init (&str))
     _dbus_wait_for_memory ();
 
+  /* take every request that has piled up, they all get the same
+   * reload
+   */
   if ((reload_pipe[RELOAD_READ_END] > 0) &&
-      _dbus_read_socket (reload_pipe[RELOAD_READ_END], &str, 1) != 1)
+      _dbus_read_socket (reload_pipe[RELOAD_READ_END], &str,
+                         RELOAD_PIPE_DRAIN) <= 0)
     {
       _dbus_warn ("Couldn't read from reload pipe.\n");
       close_reload_pipe ();
       return TRUE;
     }
+
+  /* a restart reads the configuration anyway */
+  if (_dbus_string_find (&str, 0, RESTART_REQUEST, NULL))
+    {
+      _dbus_string_free (&str);
+      restart_daemon ();
+      return TRUE;
+    }
+
+  if (_dbus_string_find (&str, 0, LOG_LATENCY_REQUEST, NULL))
+    bus_stats_log_latency (context);
+
+  if (_dbus_string_find (&str, 0, TRIM_MEMORY_REQUEST, NULL))
+    bus_connections_trim_memory (bus_context_get_connections (context));
+
+  if (_dbus_string_find (&str, 0, DUMP_FLIGHT_RECORD_REQUEST, NULL))
+    bus_stats_dump_flight_record ();
+
+  reload = _dbus_string_find (&str, 0, RELOAD_REQUEST, NULL);
   _dbus_string_free (&str);
 
-  /* this can only fail if we don't understand the config file
-   * or OOM.  Either way we should just stick with the currently
-   * loaded config.
-   */
-  dbus_error_init (&error);
-  if (! bus_context_reload_config (context, &error))
+  if (!reload)
+    return TRUE;
+
+  delay = bus_context_get_reload_delay (context);
+  if (delay == 0 || reload_timeout == NULL)
     {
-      _DBUS_ASSERT_ERROR_IS_SET (&error);
-      _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_FAILED) ||
-		    dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY));
-      _dbus_warn ("Unable to reload configuration: %s\n",
-		  error.message);
-      dbus_error_free (&error);
+      reload_config ();
+      return TRUE;
+    }
+
+  _dbus_get_current_time (&reload_last_sec, &reload_last_usec);
+
+  if (!reload_pending)
+    {
+      reload_pending = TRUE;
+      reload_first_sec = reload_last_sec;
+      reload_first_usec = reload_last_usec;
+
+      /* the main loop counts from when the timeout last fired, which
+       * may be long ago; if so handle_reload_timeout() just sets the
+       * remaining interval on its first run
+       */
+      _dbus_timeout_set_interval (reload_timeout, delay);
+      _dbus_timeout_set_enabled (reload_timeout, TRUE);
     }
+
   return TRUE;
 }
 
@@ -246,6 +504,22 @@ setup_reload_pipe (DBusLoop *loop)
       exit (1);
     }
 
+  reload_timeout = _dbus_timeout_new (100, /* irrelevant */
+                                      handle_reload_timeout, NULL, NULL);
+  if (reload_timeout == NULL)
+    {
+      _dbus_warn ("Unable to create reload timeout\n");
+      exit (1);
+    }
+
+  _dbus_timeout_set_enabled (reload_timeout, FALSE);
+
+  if (!_dbus_loop_add_timeout (loop, reload_timeout, reload_timeout_callback,
+                               NULL, NULL))
+    {
+      _dbus_warn ("Unable to add reload timeout to main loop\n");
+      exit (1);
+    }
 }
 
 static void
@@ -275,6 +549,11 @@ main (int argc, char **argv)
   dbus_bool_t is_session_bus;
   int force_fork;
   dbus_bool_t systemd_activation;
+  int realtime_priority;
+  long realtime_reserve;
+
+  saved_argc = argc;
+  saved_argv = argv;
 
   if (!_dbus_string_init (&config_file))
     return 1;
@@ -314,6 +593,8 @@ main (int argc, char **argv)
         force_fork = FORK_ALWAYS;
       else if (strcmp (arg, "--systemd-activation") == 0)
         systemd_activation = TRUE;
+      else if (strcmp (arg, "--print-startup-timings") == 0)
+        print_startup_timings = TRUE;
       else if (strcmp (arg, "--system") == 0)
         {
           check_two_config_files (&config_file, "system");
@@ -488,6 +769,12 @@ main (int argc, char **argv)
       exit (1);
     }
 
+  /* spawn activated services without copying ourselves */
+  _dbus_spawn_set_babysitter_helper (DBUS_DAEMONDIR "/dbus-daemon-spawn-helper");
+
+  /* before the context exists, so the configuration it loads is counted */
+  _dbus_memory_set_accounting (TRUE);
+
   dbus_error_init (&error);
   context = bus_context_new (&config_file, force_fork,
                              &print_addr_pipe, &print_pid_pipe,
@@ -503,6 +790,29 @@ main (int argc, char **argv)
       exit (1);
     }
 
+  /* Memory locks don't survive fork(), so this waits until
+   * bus_context_new() has daemonized us
+   */
+  if (bus_context_get_realtime (context, &realtime_priority,
+                                &realtime_reserve) &&
+      !_dbus_become_realtime (realtime_priority, realtime_reserve, &error))
+    {
+      _dbus_warn ("Not running in real-time mode: %s\n", error.message);
+      dbus_error_free (&error);
+    }
+
+  /* A slow syslogd must not hold up message routing; started after
+   * forking, since threads don't survive that either
+   */
+  if (!_dbus_system_log_start_thread (&error))
+    {
+      _dbus_warn ("Logging synchronously: %s\n", error.message);
+      dbus_error_free (&error);
+    }
+
+  if (!_dbus_flight_recorder_set_enabled (TRUE))
+    _dbus_warn ("Not enough memory for the flight recorder\n");
+
   is_session_bus = bus_context_get_type(context) != NULL
       && strcmp(bus_context_get_type(context),"session") == 0;
 
@@ -518,16 +828,33 @@ main (int argc, char **argv)
 #ifdef SIGHUP
   _dbus_set_signal_handler (SIGHUP, signal_handler);
 #endif
+#ifdef SIGUSR2
+  _dbus_set_signal_handler (SIGUSR2, signal_handler);
+#endif
+#ifdef SIGUSR1
+  _dbus_set_signal_handler (SIGUSR1, signal_handler);
+#endif
+#ifdef SIGRTMIN
+  trim_memory_signal = SIGRTMIN + 1;
+  _dbus_set_signal_handler (trim_memory_signal, signal_handler);
+  dump_flight_record_signal = SIGRTMIN + 2;
+  _dbus_set_signal_handler (dump_flight_record_signal, signal_handler);
+#endif
 #ifdef DBUS_BUS_ENABLE_DNOTIFY_ON_LINUX
   _dbus_set_signal_handler (SIGIO, signal_handler);
 #endif /* DBUS_BUS_ENABLE_DNOTIFY_ON_LINUX */
 
+  /* last, so that whoever reads them can send us signals */
+  if (print_startup_timings)
+    print_phase_timings ();
+
   _dbus_verbose ("We are on D-Bus...\n");
   _dbus_loop_run (bus_context_get_loop (context));
 
   bus_context_shutdown (context);
   bus_context_unref (context);
   bus_selinux_shutdown ();
+  _dbus_system_log_stop_thread ();
 
   if (is_session_bus)
     _dbus_daemon_unpublish_session_bus_address ();
@@ -0,0 +1,543 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* metrics.c  Serving the bus statistics to Prometheus-style scrapers
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "metrics.h"
+#include "stats.h"
+#include "utils.h"
+#include <dbus/dbus-file.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-watch.h>
+#ifndef DBUS_WIN
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
+
+/* Each scrape is one HTTP/1.0 exchange: the request is read up to its
+ * blank line and mostly ignored, the reply is the snapshot, and then
+ * the socket is closed. The snapshot is rebuilt at most once per
+ * METRICS_MAX_AGE_MILLISECONDS however many scrapers there are, so
+ * their cost to the bus stays that of a GetStats call now and then.
+ */
+#define METRICS_MAX_AGE_MILLISECONDS 1000
+#define METRICS_MAX_REQUEST 8192
+#define METRICS_MAX_CLIENTS 8
+
+#ifndef DBUS_WIN
+
+typedef struct
+{
+  BusMetrics *metrics;
+  int fd;
+  DBusWatch *watch;           /**< Readable until the request is in, then writable */
+  DBusString buffer;          /**< The request as it comes, then the reply */
+  int written;                /**< Bytes of the reply sent so far */
+  dbus_bool_t replying;
+} MetricsClient;
+
+struct BusMetrics
+{
+  BusContext *context;
+  int *fds;                   /**< Listening sockets */
+  DBusWatch **watches;        /**< One per listening socket, on the loop */
+  int n_fds;
+  char *path;                 /**< Socket file to remove, for unix:path= */
+  DBusList *clients;          /**< MetricsClient, oldest first */
+  DBusString snapshot;
+  long snapshot_sec;
+  long snapshot_usec;
+  dbus_bool_t snapshot_valid;
+};
+
+static dbus_bool_t
+metrics_watch_callback (DBusWatch    *watch,
+                        unsigned int  condition,
+                        void         *data)
+{
+  return dbus_watch_handle (watch, condition);
+}
+
+static void
+client_drop_watch (MetricsClient *client)
+{
+  if (client->watch == NULL)
+    return;
+
+  _dbus_loop_remove_watch (bus_context_get_loop (client->metrics->context),
+                           client->watch, metrics_watch_callback, NULL);
+  _dbus_watch_invalidate (client->watch);
+  _dbus_watch_unref (client->watch);
+  client->watch = NULL;
+}
+
+static void
+client_free (MetricsClient *client)
+{
+  client_drop_watch (client);
+  _dbus_close_socket (client->fd, NULL);
+  _dbus_string_free (&client->buffer);
+  dbus_free (client);
+}
+
+static void
+client_close (MetricsClient *client)
+{
+  _dbus_list_remove (&client->metrics->clients, client);
+  client_free (client);
+}
+
+static dbus_bool_t client_handle_watch (DBusWatch    *watch,
+                                        unsigned int  flags,
+                                        void         *data);
+
+static dbus_bool_t
+client_watch (MetricsClient *client,
+              unsigned int   flags)
+{
+  client_drop_watch (client);
+
+  client->watch = _dbus_watch_new (client->fd, flags, TRUE,
+                                   client_handle_watch, client, NULL);
+  if (client->watch == NULL)
+    return FALSE;
+
+  if (!_dbus_loop_add_watch (bus_context_get_loop (client->metrics->context),
+                             client->watch, metrics_watch_callback,
+                             NULL, NULL))
+    {
+      _dbus_watch_invalidate (client->watch);
+      _dbus_watch_unref (client->watch);
+      client->watch = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* The snapshot as of at most METRICS_MAX_AGE_MILLISECONDS ago, or
+ * #NULL if it couldn't be built
+ */
+static const DBusString *
+metrics_get_snapshot (BusMetrics *metrics)
+{
+  long sec, usec, age;
+
+  _dbus_get_current_time (&sec, &usec);
+  age = (sec - metrics->snapshot_sec) * 1000 +
+    (usec - metrics->snapshot_usec) / 1000;
+
+  if (metrics->snapshot_valid && age >= 0 &&
+      age < METRICS_MAX_AGE_MILLISECONDS)
+    return &metrics->snapshot;
+
+  _dbus_string_set_length (&metrics->snapshot, 0);
+  metrics->snapshot_valid =
+    bus_stats_append_openmetrics (metrics->context, &metrics->snapshot);
+
+  if (!metrics->snapshot_valid)
+    return NULL;
+
+  metrics->snapshot_sec = sec;
+  metrics->snapshot_usec = usec;
+
+  return &metrics->snapshot;
+}
+
+/* Replaces the request in the buffer with the reply to it */
+static dbus_bool_t
+client_build_reply (MetricsClient *client)
+{
+  const DBusString *snapshot;
+
+  if (!_dbus_string_starts_with_c_str (&client->buffer, "GET "))
+    {
+      _dbus_string_set_length (&client->buffer, 0);
+      return _dbus_string_append (&client->buffer,
+                                  "HTTP/1.0 405 Method Not Allowed\r\n"
+                                  "Allow: GET\r\n"
+                                  "Content-Length: 0\r\n"
+                                  "Connection: close\r\n\r\n");
+    }
+
+  _dbus_string_set_length (&client->buffer, 0);
+
+  snapshot = metrics_get_snapshot (client->metrics);
+  if (snapshot == NULL)
+    return _dbus_string_append (&client->buffer,
+                                "HTTP/1.0 503 Service Unavailable\r\n"
+                                "Content-Length: 0\r\n"
+                                "Connection: close\r\n\r\n");
+
+  return
+    _dbus_string_append_printf (&client->buffer,
+                                "HTTP/1.0 200 OK\r\n"
+                                "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                                "Content-Length: %d\r\n"
+                                "Connection: close\r\n\r\n",
+                                _dbus_string_get_length (snapshot)) &&
+    _dbus_string_copy (snapshot, 0, &client->buffer,
+                       _dbus_string_get_length (&client->buffer));
+}
+
+static dbus_bool_t
+client_handle_watch (DBusWatch    *watch,
+                     unsigned int  flags,
+                     void         *data)
+{
+  MetricsClient *client = data;
+
+  if (flags & DBUS_WATCH_ERROR)
+    {
+      client_close (client);
+      return TRUE;
+    }
+
+  if (!client->replying)
+    {
+      int start;
+      int n;
+
+      /* look for the blank line a little before where new data goes,
+       * in case it straddles two reads
+       */
+      start = MAX (_dbus_string_get_length (&client->buffer) - 3, 0);
+
+      n = _dbus_read_socket (client->fd, &client->buffer, 1024);
+      if (n < 0 && _dbus_get_is_errno_eagain_or_ewouldblock ())
+        return TRUE;
+
+      if (n <= 0 ||
+          _dbus_string_get_length (&client->buffer) > METRICS_MAX_REQUEST)
+        {
+          client_close (client);
+          return TRUE;
+        }
+
+      if (!_dbus_string_find (&client->buffer, start, "\r\n\r\n", NULL) &&
+          !_dbus_string_find (&client->buffer, start, "\n\n", NULL))
+        return TRUE;
+
+      if (!client_build_reply (client) ||
+          !client_watch (client, DBUS_WATCH_WRITABLE))
+        {
+          client_close (client);
+          return TRUE;
+        }
+
+      client->replying = TRUE;
+      return TRUE;
+    }
+
+  if (flags & DBUS_WATCH_WRITABLE)
+    {
+      int n;
+
+      n = _dbus_write_socket (client->fd, &client->buffer, client->written,
+                              _dbus_string_get_length (&client->buffer) -
+                              client->written);
+      if (n < 0 && _dbus_get_is_errno_eagain_or_ewouldblock ())
+        return TRUE;
+
+      if (n > 0)
+        client->written += n;
+
+      if (n < 0 || client->written == _dbus_string_get_length (&client->buffer))
+        client_close (client);
+
+      return TRUE;
+    }
+
+  if (flags & DBUS_WATCH_HANGUP)
+    client_close (client);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+metrics_handle_listen_watch (DBusWatch    *watch,
+                             unsigned int  flags,
+                             void         *data)
+{
+  BusMetrics *metrics = data;
+  MetricsClient *client;
+  int fd;
+
+  fd = _dbus_accept (dbus_watch_get_socket (watch));
+  if (fd < 0)
+    return TRUE;
+
+  if (!_dbus_set_fd_nonblocking (fd, NULL))
+    {
+      _dbus_close_socket (fd, NULL);
+      return TRUE;
+    }
+
+  /* a scraper that never finishes its request shouldn't lock out the
+   * others, so the longest-waiting one makes room
+   */
+  if (_dbus_list_get_length (&metrics->clients) >= METRICS_MAX_CLIENTS)
+    client_close (_dbus_list_get_first (&metrics->clients));
+
+  client = dbus_new0 (MetricsClient, 1);
+  if (client == NULL)
+    {
+      _dbus_close_socket (fd, NULL);
+      return TRUE;
+    }
+
+  client->metrics = metrics;
+  client->fd = fd;
+
+  if (!_dbus_string_init (&client->buffer))
+    {
+      _dbus_close_socket (fd, NULL);
+      dbus_free (client);
+      return TRUE;
+    }
+
+  if (!_dbus_list_append (&metrics->clients, client))
+    {
+      client_free (client);
+      return TRUE;
+    }
+
+  if (!client_watch (client, DBUS_WATCH_READABLE))
+    client_close (client);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+metrics_listen (BusMetrics  *metrics,
+                const char  *address,
+                DBusError   *error)
+{
+  DBusAddressEntry **entries;
+  const char *method;
+  int n_entries;
+  dbus_bool_t ok;
+
+  if (!dbus_parse_address (address, &entries, &n_entries, error))
+    return FALSE;
+
+  ok = FALSE;
+  method = n_entries == 1 ? dbus_address_entry_get_method (entries[0]) : "";
+
+  if (n_entries != 1)
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "<metrics_listen> takes a single address, not \"%s\"",
+                      address);
+    }
+  else if (strcmp (method, "unix") == 0 &&
+           dbus_address_entry_get_value (entries[0], "path") != NULL)
+    {
+      const char *path = dbus_address_entry_get_value (entries[0], "path");
+
+      metrics->fds = dbus_new (int, 1);
+      metrics->path = _dbus_strdup (path);
+      if (metrics->fds == NULL || metrics->path == NULL)
+        {
+          BUS_SET_OOM (error);
+        }
+      else
+        {
+          metrics->fds[0] = _dbus_listen_unix_socket (path, FALSE, error);
+          if (metrics->fds[0] >= 0)
+            {
+              metrics->n_fds = 1;
+              ok = TRUE;
+            }
+          else
+            {
+              /* nothing to remove at shutdown */
+              dbus_free (metrics->path);
+              metrics->path = NULL;
+            }
+        }
+    }
+  else if (strcmp (method, "tcp") == 0 &&
+           dbus_address_entry_get_value (entries[0], "port") != NULL)
+    {
+      const char *host = dbus_address_entry_get_value (entries[0], "host");
+      DBusString port;
+
+      if (!_dbus_string_init (&port))
+        {
+          BUS_SET_OOM (error);
+        }
+      else
+        {
+          metrics->n_fds = _dbus_listen_tcp_socket (host != NULL ? host : "localhost",
+                                                    dbus_address_entry_get_value (entries[0], "port"),
+                                                    dbus_address_entry_get_value (entries[0], "family"),
+                                                    &port, &metrics->fds, error);
+          if (metrics->n_fds > 0)
+            ok = TRUE;
+          else
+            metrics->n_fds = 0;
+
+          _dbus_string_free (&port);
+        }
+    }
+  else
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "<metrics_listen> needs unix:path= or tcp:port=, not \"%s\"",
+                      address);
+    }
+
+  dbus_address_entries_free (entries);
+  return ok;
+}
+
+/**
+ * Starts serving the bus statistics as OpenMetrics text to whoever
+ * connects to the address, for <metrics_listen>.
+ *
+ * @param context the bus
+ * @param address a unix:path= or tcp: address
+ * @param error return location for errors
+ * @returns the exporter, or #NULL with error set
+ */
+BusMetrics*
+bus_metrics_new (BusContext *context,
+                 const char *address,
+                 DBusError  *error)
+{
+  BusMetrics *metrics;
+  int i;
+
+  metrics = dbus_new0 (BusMetrics, 1);
+  if (metrics == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  metrics->context = context;
+
+  if (!_dbus_string_init (&metrics->snapshot))
+    {
+      dbus_free (metrics);
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (!metrics_listen (metrics, address, error))
+    goto failed;
+
+  metrics->watches = dbus_new0 (DBusWatch *, metrics->n_fds);
+  if (metrics->watches == NULL)
+    goto oom;
+
+  for (i = 0; i < metrics->n_fds; i++)
+    {
+      metrics->watches[i] = _dbus_watch_new (metrics->fds[i],
+                                             DBUS_WATCH_READABLE, TRUE,
+                                             metrics_handle_listen_watch,
+                                             metrics, NULL);
+      if (metrics->watches[i] == NULL)
+        goto oom;
+
+      if (!_dbus_loop_add_watch (bus_context_get_loop (context),
+                                 metrics->watches[i], metrics_watch_callback,
+                                 NULL, NULL))
+        {
+          _dbus_watch_invalidate (metrics->watches[i]);
+          _dbus_watch_unref (metrics->watches[i]);
+          metrics->watches[i] = NULL;
+          goto oom;
+        }
+    }
+
+  return metrics;
+
+ oom:
+  BUS_SET_OOM (error);
+ failed:
+  bus_metrics_free (metrics);
+  return NULL;
+}
+
+/**
+ * Stops listening and drops any scrape in progress.
+ *
+ * @param metrics the exporter
+ */
+void
+bus_metrics_free (BusMetrics *metrics)
+{
+  int i;
+
+  while (metrics->clients != NULL)
+    client_free (_dbus_list_pop_first (&metrics->clients));
+
+  for (i = 0; i < metrics->n_fds; i++)
+    {
+      if (metrics->watches != NULL && metrics->watches[i] != NULL)
+        {
+          _dbus_loop_remove_watch (bus_context_get_loop (metrics->context),
+                                   metrics->watches[i], metrics_watch_callback,
+                                   NULL);
+          _dbus_watch_invalidate (metrics->watches[i]);
+          _dbus_watch_unref (metrics->watches[i]);
+        }
+
+      _dbus_close_socket (metrics->fds[i], NULL);
+    }
+
+  if (metrics->path != NULL)
+    {
+      DBusString path;
+
+      _dbus_string_init_const (&path, metrics->path);
+      _dbus_delete_file (&path, NULL);
+      dbus_free (metrics->path);
+    }
+
+  dbus_free (metrics->watches);
+  dbus_free (metrics->fds);
+  _dbus_string_free (&metrics->snapshot);
+  dbus_free (metrics);
+}
+
+#else /* DBUS_WIN */
+
+BusMetrics*
+bus_metrics_new (BusContext *context,
+                 const char *address,
+                 DBusError  *error)
+{
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "<metrics_listen> is not supported on this platform");
+  return NULL;
+}
+
+void
+bus_metrics_free (BusMetrics *metrics)
+{
+  _dbus_assert_not_reached ("no metrics exporter on this platform");
+}
+
+#endif /* DBUS_WIN */
@@ -24,22 +24,69 @@
 #include <config.h>
 #include "policy.h"
 #include "services.h"
+#include "connection.h"
+#include "intern.h"
 #include "test.h"
 #include "utils.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-mempool.h>
 
-BusPolicyRule*
-bus_policy_rule_new (BusPolicyRuleType type,
-                     dbus_bool_t       allow)
+/* All the rules of one configuration, the top-level file and the ones
+ * it includes, are allocated from one pool: consecutive rules sit
+ * next to each other, and a reload frees a handful of blocks instead
+ * of every rule. Each rule holds a reference, since a client policy
+ * can outlive the configuration its rules came from.
+ */
+struct BusPolicyRuleArena
 {
-  BusPolicyRule *rule;
+  int refcount;
+  DBusMemPool *pool;
+};
 
-  rule = dbus_new0 (BusPolicyRule, 1);
-  if (rule == NULL)
+static BusPolicyRuleArena*
+rule_arena_new (void)
+{
+  BusPolicyRuleArena *arena;
+
+  arena = dbus_new0 (BusPolicyRuleArena, 1);
+  if (arena == NULL)
     return NULL;
 
+  arena->pool = _dbus_mem_pool_new (sizeof (BusPolicyRule), TRUE);
+  if (arena->pool == NULL)
+    {
+      dbus_free (arena);
+      return NULL;
+    }
+
+  arena->refcount = 1;
+
+  return arena;
+}
+
+static void
+rule_arena_unref (BusPolicyRuleArena *arena)
+{
+  _dbus_assert (arena->refcount > 0);
+
+  arena->refcount -= 1;
+
+  if (arena->refcount == 0)
+    {
+      _dbus_mem_pool_free (arena->pool);
+      dbus_free (arena);
+    }
+}
+
+static void
+rule_init (BusPolicyRule     *rule,
+           BusPolicyRuleType  type,
+           dbus_bool_t        allow)
+{
+  _dbus_memory_account (DBUS_MEMORY_POLICY, sizeof (BusPolicyRule));
+
   rule->type = type;
   rule->refcount = 1;
   rule->allow = allow;
@@ -70,7 +117,28 @@ bus_policy_rule_new (BusPolicyRuleType type,
     case BUS_POLICY_RULE_OWN:
       break;
     }
-  
+}
+
+/**
+ * Creates a rule of its own, for rules that are not part of a
+ * configuration.
+ *
+ * @param type what the rule is about
+ * @param allow #TRUE for an allow rule, #FALSE for deny
+ * @returns the rule or #NULL if no memory
+ */
+BusPolicyRule*
+bus_policy_rule_new (BusPolicyRuleType type,
+                     dbus_bool_t       allow)
+{
+  BusPolicyRule *rule;
+
+  rule = dbus_new0 (BusPolicyRule, 1);
+  if (rule == NULL)
+    return NULL;
+
+  rule_init (rule, type, allow);
+
   return rule;
 }
 
@@ -96,29 +164,39 @@ bus_policy_rule_unref (BusPolicyRule *rule)
       switch (rule->type)
         {
         case BUS_POLICY_RULE_SEND:
-          dbus_free (rule->d.send.path);
-          dbus_free (rule->d.send.interface);
-          dbus_free (rule->d.send.member);
-          dbus_free (rule->d.send.error);
-          dbus_free (rule->d.send.destination);
+          bus_intern_unref (rule->d.send.path);
+          bus_intern_unref (rule->d.send.interface);
+          bus_intern_unref (rule->d.send.member);
+          bus_intern_unref (rule->d.send.error);
+          bus_intern_unref (rule->d.send.destination);
           break;
         case BUS_POLICY_RULE_RECEIVE:
-          dbus_free (rule->d.receive.path);
-          dbus_free (rule->d.receive.interface);
-          dbus_free (rule->d.receive.member);
-          dbus_free (rule->d.receive.error);
-          dbus_free (rule->d.receive.origin);
+          bus_intern_unref (rule->d.receive.path);
+          bus_intern_unref (rule->d.receive.interface);
+          bus_intern_unref (rule->d.receive.member);
+          bus_intern_unref (rule->d.receive.error);
+          bus_intern_unref (rule->d.receive.origin);
           break;
         case BUS_POLICY_RULE_OWN:
-          dbus_free (rule->d.own.service_name);
+          bus_intern_unref (rule->d.own.service_name);
           break;
         case BUS_POLICY_RULE_USER:
           break;
         case BUS_POLICY_RULE_GROUP:
           break;
         }
-      
-      dbus_free (rule);
+
+      _dbus_memory_account (DBUS_MEMORY_POLICY, -(long) sizeof (BusPolicyRule));
+
+      if (rule->arena != NULL)
+        {
+          BusPolicyRuleArena *arena = rule->arena;
+
+          _dbus_mem_pool_dealloc (arena->pool, rule);
+          rule_arena_unref (arena);
+        }
+      else
+        dbus_free (rule);
     }
 }
 
@@ -126,12 +204,16 @@ struct BusPolicy
 {
   int refcount;
 
+  BusPolicyRuleArena *arena;       /**< where bus_policy_new_rule() allocates */
   DBusList *default_rules;         /**< Default policy rules */
   DBusList *mandatory_rules;       /**< Mandatory policy rules */
   DBusHashTable *rules_by_uid;     /**< per-UID policy rules */
   DBusHashTable *rules_by_gid;     /**< per-GID policy rules */
   DBusList *at_console_true_rules; /**< console user policy rules where at_console="true"*/
   DBusList *at_console_false_rules; /**< console user policy rules where at_console="false"*/
+  DBusHashTable *quantum_by_uid;   /**< per-UID dispatch quantum, stored plus one */
+  DBusHashTable *quantum_by_gid;   /**< per-GID dispatch quantum, stored plus one */
+  DBusHashTable *client_policies;  /**< shared BusClientPolicy by the rule lists it's made of */
 };
 
 static void
@@ -158,8 +240,18 @@ free_rule_list_func (void *data)
   dbus_free (list);
 }
 
+static void free_client_policy_func (void      *data);
+static void prune_client_policies   (BusPolicy *policy);
+
+/**
+ * Creates an empty policy.
+ *
+ * @param parent the policy of the file that includes this one, whose
+ *   rules this one's are allocated with; or #NULL
+ * @returns the policy or #NULL if no memory
+ */
 BusPolicy*
-bus_policy_new (void)
+bus_policy_new (BusPolicy *parent)
 {
   BusPolicy *policy;
 
@@ -168,6 +260,18 @@ bus_policy_new (void)
     return NULL;
 
   policy->refcount = 1;
+
+  if (parent != NULL)
+    {
+      policy->arena = parent->arena;
+      policy->arena->refcount += 1;
+    }
+  else
+    {
+      policy->arena = rule_arena_new ();
+      if (policy->arena == NULL)
+        goto failed;
+    }
   
   policy->rules_by_uid = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
                                                NULL,
@@ -181,6 +285,22 @@ bus_policy_new (void)
   if (policy->rules_by_gid == NULL)
     goto failed;
 
+  policy->quantum_by_uid = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                 NULL, NULL);
+  if (policy->quantum_by_uid == NULL)
+    goto failed;
+
+  policy->quantum_by_gid = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                 NULL, NULL);
+  if (policy->quantum_by_gid == NULL)
+    goto failed;
+
+  policy->client_policies = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                  dbus_free,
+                                                  free_client_policy_func);
+  if (policy->client_policies == NULL)
+    goto failed;
+
   return policy;
   
  failed:
@@ -230,11 +350,52 @@ bus_policy_unref (BusPolicy *policy)
           _dbus_hash_table_unref (policy->rules_by_gid);
           policy->rules_by_gid = NULL;
         }
+
+      if (policy->quantum_by_uid)
+        _dbus_hash_table_unref (policy->quantum_by_uid);
+
+      if (policy->quantum_by_gid)
+        _dbus_hash_table_unref (policy->quantum_by_gid);
+
+      if (policy->client_policies)
+        _dbus_hash_table_unref (policy->client_policies);
+
+      if (policy->arena)
+        rule_arena_unref (policy->arena);
       
       dbus_free (policy);
     }
 }
 
+/**
+ * Creates a rule for the given policy. It shares its memory with the
+ * other rules of the same configuration, but is otherwise like one
+ * from bus_policy_rule_new(), and still has to be added to the
+ * policy.
+ *
+ * @param policy the policy the rule is for
+ * @param type what the rule is about
+ * @param allow #TRUE for an allow rule, #FALSE for deny
+ * @returns the rule or #NULL if no memory
+ */
+BusPolicyRule*
+bus_policy_new_rule (BusPolicy         *policy,
+                     BusPolicyRuleType  type,
+                     dbus_bool_t        allow)
+{
+  BusPolicyRule *rule;
+
+  rule = _dbus_mem_pool_alloc (policy->arena->pool);
+  if (rule == NULL)
+    return NULL;
+
+  rule_init (rule, type, allow);
+  rule->arena = policy->arena;
+  rule->arena->refcount += 1;
+
+  return rule;
+}
+
 static dbus_bool_t
 add_list_to_client (DBusList        **list,
                     BusClientPolicy  *client)
@@ -267,93 +428,129 @@ add_list_to_client (DBusList        **list,
   return TRUE;
 }
 
+/* Connections whose credentials pick the same rule lists share one
+ * BusClientPolicy. Entries only the cache still refers to are dropped
+ * when it gets this big.
+ */
+#define MAX_SHARED_CLIENT_POLICIES 128
+
 BusClientPolicy*
 bus_policy_create_client_policy (BusPolicy      *policy,
                                  DBusConnection *connection,
                                  DBusError      *error)
 {
   BusClientPolicy *client;
+  DBusString key;
+  DBusList **user_list;
+  unsigned long *groups;
+  int n_groups;
+  int i;
   dbus_uid_t uid;
+  dbus_bool_t have_uid;
   dbus_bool_t at_console;
+  char *key_str;
 
   _dbus_assert (dbus_connection_get_is_authenticated (connection));
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   
-  client = bus_client_policy_new ();
-  if (client == NULL)
-    goto nomem;
+  client = NULL;
+  groups = NULL;
+  n_groups = 0;
+  user_list = NULL;
+  at_console = FALSE;
 
-  if (!add_list_to_client (&policy->default_rules,
-                           client))
+  if (!_dbus_string_init (&key))
     goto nomem;
 
+  /* The key names exactly the lists the client policy is made of,
+   * in the order they are added
+   */
+
   /* we avoid the overhead of looking up user's groups
    * if we don't have any group rules anyway
    */
   if (_dbus_hash_table_get_n_entries (policy->rules_by_gid) > 0)
     {
-      unsigned long *groups;
-      int n_groups;
-      int i;
-      
       if (!bus_connection_get_unix_groups (connection, &groups, &n_groups, error))
         goto failed;
-      
-      i = 0;
-      while (i < n_groups)
+
+      for (i = 0; i < n_groups; i++)
         {
-          DBusList **list;
-          
-          list = _dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
-                                                groups[i]);
-          
-          if (list != NULL)
-            {
-              if (!add_list_to_client (list, client))
-                {
-                  dbus_free (groups);
-                  goto nomem;
-                }
-            }
-          
-          ++i;
+          if (_dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
+                                               groups[i]) != NULL &&
+              !_dbus_string_append_printf (&key, "g%lu ", groups[i]))
+            goto nomem;
         }
-
-      dbus_free (groups);
     }
   
-  if (dbus_connection_get_unix_user (connection, &uid))
+  have_uid = dbus_connection_get_unix_user (connection, &uid);
+  if (have_uid)
     {
       if (_dbus_hash_table_get_n_entries (policy->rules_by_uid) > 0)
         {
-          DBusList **list;
+          user_list = _dbus_hash_table_lookup_uintptr (policy->rules_by_uid,
+                                                       uid);
           
-          list = _dbus_hash_table_lookup_uintptr (policy->rules_by_uid,
-                                                uid);
-          
-          if (list != NULL)
-            {
-              if (!add_list_to_client (list, client))
-                goto nomem;
-            }
+          if (user_list != NULL &&
+              !_dbus_string_append_printf (&key, "u%lu ", (unsigned long) uid))
+            goto nomem;
         }
 
-      /* Add console rules */
       at_console = _dbus_unix_user_is_at_console (uid, error);
-      
-      if (at_console)
+
+      if (!at_console && dbus_error_is_set (error))
+        goto failed;
+
+      if (!_dbus_string_append (&key, at_console ? "console" : "not-console"))
+        goto nomem;
+    }
+
+  client = _dbus_hash_table_lookup_string (policy->client_policies,
+                                           _dbus_string_get_const_data (&key));
+  if (client != NULL)
+    {
+      _dbus_verbose ("Sharing client policy \"%s\"\n",
+                     _dbus_string_get_const_data (&key));
+      bus_client_policy_ref (client);
+      goto out;
+    }
+
+  client = bus_client_policy_new ();
+  if (client == NULL)
+    goto nomem;
+
+  if (!add_list_to_client (&policy->default_rules,
+                           client))
+    goto nomem;
+
+  for (i = 0; i < n_groups; i++)
+    {
+      DBusList **list;
+
+      list = _dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
+                                              groups[i]);
+
+      if (list != NULL)
         {
-          if (!add_list_to_client (&policy->at_console_true_rules, client))
+          if (!add_list_to_client (list, client))
             goto nomem;
         }
-      else if (dbus_error_is_set (error) == TRUE)
-        {
-          goto failed;
-        }
-      else if (!add_list_to_client (&policy->at_console_false_rules, client))
-        {
-          goto nomem;
-        }
+    }
+
+  if (user_list != NULL)
+    {
+      if (!add_list_to_client (user_list, client))
+        goto nomem;
+    }
+
+  /* Add console rules */
+  if (have_uid)
+    {
+      if (!add_list_to_client (at_console ?
+                               &policy->at_console_true_rules :
+                               &policy->at_console_false_rules,
+                               client))
+        goto nomem;
     }
 
   if (!add_list_to_client (&policy->mandatory_rules,
@@ -361,6 +558,24 @@ bus_policy_create_client_policy (BusPolicy      *policy,
     goto nomem;
 
   bus_client_policy_optimize (client);
+
+  /* Failing to remember it only means the next one is built again */
+  if (_dbus_hash_table_get_n_entries (policy->client_policies) >=
+      MAX_SHARED_CLIENT_POLICIES)
+    prune_client_policies (policy);
+
+  if (_dbus_string_steal_data (&key, &key_str))
+    {
+      if (_dbus_hash_table_insert_string (policy->client_policies, key_str,
+                                          client))
+        bus_client_policy_ref (client);
+      else
+        dbus_free (key_str);
+    }
+
+ out:
+  _dbus_string_free (&key);
+  dbus_free (groups);
   
   return client;
 
@@ -368,6 +583,8 @@ bus_policy_create_client_policy (BusPolicy      *policy,
   BUS_SET_OOM (error);
  failed:
   _DBUS_ASSERT_ERROR_IS_SET (error);
+  _dbus_string_free (&key);
+  dbus_free (groups);
   if (client)
     bus_client_policy_unref (client);
   return NULL;
@@ -653,6 +870,24 @@ merge_id_hash (DBusHashTable *dest,
   return TRUE;
 }
 
+static dbus_bool_t
+merge_quantum_hash (DBusHashTable *dest,
+                    DBusHashTable *to_absorb)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (to_absorb, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      if (!_dbus_hash_table_insert_uintptr (dest,
+                                            _dbus_hash_iter_get_uintptr_key (&iter),
+                                            _dbus_hash_iter_get_value (&iter)))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 dbus_bool_t
 bus_policy_merge (BusPolicy *policy,
                   BusPolicy *to_absorb)
@@ -685,84 +920,581 @@ bus_policy_merge (BusPolicy *policy,
                       to_absorb->rules_by_gid))
     return FALSE;
 
+  if (!merge_quantum_hash (policy->quantum_by_uid,
+                           to_absorb->quantum_by_uid))
+    return FALSE;
+
+  if (!merge_quantum_hash (policy->quantum_by_gid,
+                           to_absorb->quantum_by_gid))
+    return FALSE;
+
   return TRUE;
 }
 
-struct BusClientPolicy
+dbus_bool_t
+bus_policy_set_user_dispatch_quantum (BusPolicy  *policy,
+                                      dbus_uid_t  uid,
+                                      int         quantum)
 {
-  int refcount;
+  _dbus_assert (quantum >= 0 && quantum < _DBUS_INT_MAX);
 
-  DBusList *rules;
-};
+  return _dbus_hash_table_insert_uintptr (policy->quantum_by_uid, uid,
+                                          _DBUS_INT_TO_POINTER (quantum + 1));
+}
 
-BusClientPolicy*
-bus_client_policy_new (void)
+dbus_bool_t
+bus_policy_set_group_dispatch_quantum (BusPolicy  *policy,
+                                       dbus_gid_t  gid,
+                                       int         quantum)
 {
-  BusClientPolicy *policy;
-
-  policy = dbus_new0 (BusClientPolicy, 1);
-  if (policy == NULL)
-    return NULL;
-
-  policy->refcount = 1;
+  _dbus_assert (quantum >= 0 && quantum < _DBUS_INT_MAX);
 
-  return policy;
+  return _dbus_hash_table_insert_uintptr (policy->quantum_by_gid, gid,
+                                          _DBUS_INT_TO_POINTER (quantum + 1));
 }
 
-BusClientPolicy *
-bus_client_policy_ref (BusClientPolicy *policy)
+/**
+ * Works out how many messages the connection may have dispatched
+ * per turn. A <limit name="dispatch_quantum" user="..."> for its
+ * user wins; otherwise it gets the most generous of the ones for its
+ * groups (0, no limit, being the most generous), and failing those
+ * the default.
+ *
+ * @param policy the policy
+ * @param connection an authenticated connection
+ * @param default_quantum the quantum if no user or group has one
+ * @param quantum_p return location for the quantum
+ * @param error error to set if the groups can't be looked up
+ * @returns #FALSE if error was set
+ */
+dbus_bool_t
+bus_policy_get_dispatch_quantum (BusPolicy      *policy,
+                                 DBusConnection *connection,
+                                 int             default_quantum,
+                                 int            *quantum_p,
+                                 DBusError      *error)
 {
-  _dbus_assert (policy->refcount > 0);
+  dbus_uid_t uid;
+  void *value;
 
-  policy->refcount += 1;
+  *quantum_p = default_quantum;
 
-  return policy;
-}
+  if (_dbus_hash_table_get_n_entries (policy->quantum_by_uid) > 0 &&
+      dbus_connection_get_unix_user (connection, &uid))
+    {
+      value = _dbus_hash_table_lookup_uintptr (policy->quantum_by_uid, uid);
+      if (value != NULL)
+        {
+          *quantum_p = _DBUS_POINTER_TO_INT (value) - 1;
+          return TRUE;
+        }
+    }
 
-static void
-rule_unref_foreach (void *data,
-                    void *user_data)
-{
-  BusPolicyRule *rule = data;
+  /* as for the group rules, don't look up the groups unless there
+   * is a group quantum
+   */
+  if (_dbus_hash_table_get_n_entries (policy->quantum_by_gid) > 0)
+    {
+      unsigned long *groups;
+      int n_groups;
+      int i;
+      int best;
 
-  bus_policy_rule_unref (rule);
-}
+      if (!bus_connection_get_unix_groups (connection, &groups, &n_groups, error))
+        return FALSE;
 
-void
-bus_client_policy_unref (BusClientPolicy *policy)
-{
-  _dbus_assert (policy->refcount > 0);
+      best = -1;
+      for (i = 0; i < n_groups; i++)
+        {
+          int quantum;
 
-  policy->refcount -= 1;
+          value = _dbus_hash_table_lookup_uintptr (policy->quantum_by_gid,
+                                                   groups[i]);
+          if (value == NULL)
+            continue;
 
-  if (policy->refcount == 0)
-    {
-      _dbus_list_foreach (&policy->rules,
-                          rule_unref_foreach,
-                          NULL);
+          quantum = _DBUS_POINTER_TO_INT (value) - 1;
+          if (quantum == 0)
+            {
+              best = 0;
+              break;
+            }
+          else if (quantum > best)
+            best = quantum;
+        }
 
-      _dbus_list_clear (&policy->rules);
+      dbus_free (groups);
 
-      dbus_free (policy);
+      if (best >= 0)
+        *quantum_p = best;
     }
+
+  return TRUE;
 }
 
-static void
-remove_rules_by_type_up_to (BusClientPolicy   *policy,
-                            BusPolicyRuleType  type,
-                            DBusList          *up_to)
+/* The send or receive rules of a client policy, in config file order,
+ * with the indices of the rules that name a peer (send_destination or
+ * receive_sender) grouped by that name. A rule naming a peer can only
+ * apply if the peer owns or is queued for that name, so a check only
+ * looks at the rules that name no peer plus the groups for the few
+ * names the peer actually has.
+ */
+typedef struct
 {
-  DBusList *link;
+  BusPolicyRule **rules;  /**< rules of one type, in config file order */
+  int n_rules;            /**< length of rules */
+  DBusList *unnamed;      /**< indices of rules that don't name a peer */
+  DBusHashTable *by_name; /**< peer name -> DBusList of indices */
 
-  link = _dbus_list_get_first_link (&policy->rules);
-  while (link != up_to)
+  /* The by_name indices for all names of the last peer checked, so a run
+   * of messages to the same peer doesn't look up its names each time
+   */
+  DBusConnection *resolved_peer; /**< peer of resolved, or NULL */
+  unsigned long resolved_stamp;  /**< bus_connection_get_names_stamp() of it */
+  int *resolved;                 /**< indices of rules naming one of its names */
+  int n_resolved;                /**< entries in use in resolved */
+  int n_resolved_allocated;      /**< room in resolved */
+} BusPolicyRuleIndex;
+
+struct BusClientPolicy
+{
+  int refcount;
+
+  DBusList *rules;
+
+  BusPolicyRuleIndex send_index;    /**< valid if indexed is set */
+  BusPolicyRuleIndex receive_index; /**< valid if indexed is set */
+  unsigned int indexed : 1; /**< the indexes are built and up to date */
+};
+
+static void
+rule_index_clear (BusPolicyRuleIndex *index)
+{
+  if (index->by_name != NULL)
     {
-      BusPolicyRule *rule = link->data;
-      DBusList *next = _dbus_list_get_next_link (&policy->rules, link);
+      DBusHashIter iter;
 
-      if (rule->type == type)
+      _dbus_hash_iter_init (index->by_name, &iter);
+      while (_dbus_hash_iter_next (&iter))
         {
-          _dbus_list_remove_link (&policy->rules, link);
+          DBusList *indices = _dbus_hash_iter_get_value (&iter);
+
+          _dbus_list_clear (&indices);
+        }
+
+      _dbus_hash_table_unref (index->by_name);
+    }
+
+  _dbus_list_clear (&index->unnamed);
+  dbus_free (index->rules);
+  dbus_free (index->resolved);
+
+  index->rules = NULL;
+  index->n_rules = 0;
+  index->by_name = NULL;
+  index->resolved_peer = NULL;
+  index->resolved = NULL;
+  index->n_resolved = 0;
+  index->n_resolved_allocated = 0;
+}
+
+static const char *
+rule_get_peer_name (BusPolicyRule *rule)
+{
+  switch (rule->type)
+    {
+    case BUS_POLICY_RULE_SEND:
+      return rule->d.send.destination;
+    case BUS_POLICY_RULE_RECEIVE:
+      return rule->d.receive.origin;
+    default:
+      _dbus_assert_not_reached ("rule type is not indexed");
+      return NULL;
+    }
+}
+
+static dbus_bool_t
+rule_index_build (BusPolicyRuleIndex *index,
+                  DBusList          **rules,
+                  BusPolicyRuleType   type)
+{
+  DBusList *link;
+  int n;
+
+  _dbus_assert (index->rules == NULL);
+
+  n = 0;
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+
+      if (rule->type == type)
+        n += 1;
+    }
+
+  index->by_name = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (index->by_name == NULL)
+    goto failed;
+
+  if (n > 0)
+    {
+      index->rules = dbus_new (BusPolicyRule*, n);
+      if (index->rules == NULL)
+        goto failed;
+    }
+
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+      const char *name;
+      void *idx;
+
+      if (rule->type != type)
+        continue;
+
+      idx = _DBUS_INT_TO_POINTER (index->n_rules);
+      index->rules[index->n_rules] = rule;
+      index->n_rules += 1;
+
+      name = rule_get_peer_name (rule);
+
+      if (name == NULL)
+        {
+          if (!_dbus_list_append (&index->unnamed, idx))
+            goto failed;
+        }
+      else
+        {
+          DBusHashIter iter;
+          DBusList *indices;
+
+          if (!_dbus_hash_iter_lookup (index->by_name, (char *) name, TRUE, &iter))
+            goto failed;
+
+          indices = _dbus_hash_iter_get_value (&iter);
+          if (!_dbus_list_append (&indices, idx))
+            {
+              if (indices == NULL)
+                _dbus_hash_iter_remove_entry (&iter);
+              goto failed;
+            }
+          _dbus_hash_iter_set_value (&iter, indices);
+        }
+    }
+
+  _dbus_assert (index->n_rules == n);
+
+  return TRUE;
+
+ failed:
+  rule_index_clear (index);
+  return FALSE;
+}
+
+/* Called whenever the rule list changes; if we run out of memory the
+ * checks just fall back to walking the whole list.
+ */
+static void
+client_policy_build_indexes (BusClientPolicy *policy)
+{
+  if (policy->indexed)
+    {
+      rule_index_clear (&policy->send_index);
+      rule_index_clear (&policy->receive_index);
+      policy->indexed = FALSE;
+    }
+
+  if (!rule_index_build (&policy->send_index, &policy->rules,
+                         BUS_POLICY_RULE_SEND))
+    return;
+
+  if (!rule_index_build (&policy->receive_index, &policy->rules,
+                         BUS_POLICY_RULE_RECEIVE))
+    {
+      rule_index_clear (&policy->send_index);
+      return;
+    }
+
+  policy->indexed = TRUE;
+}
+
+/** What a rule is checked against, apart from its peer name */
+typedef struct
+{
+  DBusMessage *message;
+  dbus_bool_t requested_reply;
+  dbus_bool_t eavesdropping;
+} RuleCheck;
+
+typedef dbus_bool_t (* RuleAppliesFunc) (BusPolicyRule   *rule,
+                                         const RuleCheck *check);
+
+/* Checks the rules whose indices are in the given list, counting the
+ * ones that apply and remembering the last of them in config order.
+ */
+static void
+rule_index_scan (BusPolicyRuleIndex *index,
+                 DBusList          **indices,
+                 RuleAppliesFunc     applies,
+                 const RuleCheck    *check,
+                 int                *last,
+                 dbus_int32_t       *toggles)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (indices);
+       link != NULL;
+       link = _dbus_list_get_next_link (indices, link))
+    {
+      int i = _DBUS_POINTER_TO_INT (link->data);
+
+      _dbus_assert (i >= 0 && i < index->n_rules);
+
+      if ((* applies) (index->rules[i], check))
+        {
+          (*toggles)++;
+          if (i > *last)
+            *last = i;
+        }
+    }
+}
+
+/* Fills index->resolved in with the indices of the rules naming one of
+ * the names peer owns or is queued for. Returns FALSE on OOM.
+ */
+static dbus_bool_t
+rule_index_resolve_peer (BusPolicyRuleIndex *index,
+                         DBusConnection     *peer)
+{
+  DBusList **owned;
+  DBusList *link;
+
+  index->resolved_peer = NULL;
+  index->n_resolved = 0;
+
+  owned = bus_connection_get_services_owned (peer);
+
+  for (link = _dbus_list_get_first_link (owned);
+       link != NULL;
+       link = _dbus_list_get_next_link (owned, link))
+    {
+      BusService *service = link->data;
+      DBusList *indices;
+      DBusList *idx_link;
+
+      indices = _dbus_hash_table_lookup_string (index->by_name,
+                                                bus_service_get_name (service));
+
+      for (idx_link = _dbus_list_get_first_link (&indices);
+           idx_link != NULL;
+           idx_link = _dbus_list_get_next_link (&indices, idx_link))
+        {
+          if (index->n_resolved == index->n_resolved_allocated)
+            {
+              int *resolved;
+              int n;
+
+              n = MAX (index->n_resolved_allocated * 2, 8);
+              resolved = dbus_realloc (index->resolved, n * sizeof (int));
+              if (resolved == NULL)
+                return FALSE;
+
+              index->resolved = resolved;
+              index->n_resolved_allocated = n;
+            }
+
+          index->resolved[index->n_resolved] =
+            _DBUS_POINTER_TO_INT (idx_link->data);
+          index->n_resolved += 1;
+        }
+    }
+
+  index->resolved_peer = peer;
+  index->resolved_stamp = bus_connection_get_names_stamp (peer);
+
+  return TRUE;
+}
+
+/* Scans the rules that apply regardless of peer, then those naming a
+ * name held by peer. With no peer connection (the bus driver) a rule's
+ * name is compared with peer_name from the message instead.
+ */
+static BusPolicyRule *
+rule_index_check (BusPolicyRuleIndex *index,
+                  DBusConnection     *peer,
+                  const char         *peer_name,
+                  RuleAppliesFunc     applies,
+                  const RuleCheck    *check,
+                  dbus_int32_t       *toggles)
+{
+  DBusList *indices;
+  int last;
+
+  last = -1;
+  *toggles = 0;
+
+  rule_index_scan (index, &index->unnamed, applies, check, &last, toggles);
+
+  if (peer == NULL)
+    {
+      if (peer_name != NULL)
+        {
+          indices = _dbus_hash_table_lookup_string (index->by_name, peer_name);
+          rule_index_scan (index, &indices, applies, check, &last, toggles);
+        }
+    }
+  else if (_dbus_hash_table_get_n_entries (index->by_name) == 0)
+    {
+      /* nothing names a peer */
+    }
+  else if ((index->resolved_peer == peer &&
+            index->resolved_stamp == bus_connection_get_names_stamp (peer)) ||
+           rule_index_resolve_peer (index, peer))
+    {
+      int i;
+
+      for (i = 0; i < index->n_resolved; i++)
+        {
+          int r = index->resolved[i];
+
+          if ((* applies) (index->rules[r], check))
+            {
+              (*toggles)++;
+              if (r > last)
+                last = r;
+            }
+        }
+    }
+  else
+    {
+      DBusList **owned;
+      DBusList *link;
+
+      owned = bus_connection_get_services_owned (peer);
+
+      for (link = _dbus_list_get_first_link (owned);
+           link != NULL;
+           link = _dbus_list_get_next_link (owned, link))
+        {
+          BusService *service = link->data;
+
+          indices = _dbus_hash_table_lookup_string (index->by_name,
+                                                    bus_service_get_name (service));
+          rule_index_scan (index, &indices, applies, check, &last, toggles);
+        }
+    }
+
+  if (last < 0)
+    return NULL;
+
+  return index->rules[last];
+}
+
+BusClientPolicy*
+bus_client_policy_new (void)
+{
+  BusClientPolicy *policy;
+
+  policy = dbus_new0 (BusClientPolicy, 1);
+  if (policy == NULL)
+    return NULL;
+
+  _dbus_memory_account (DBUS_MEMORY_POLICY, sizeof (BusClientPolicy));
+  policy->refcount = 1;
+
+  return policy;
+}
+
+BusClientPolicy *
+bus_client_policy_ref (BusClientPolicy *policy)
+{
+  _dbus_assert (policy->refcount > 0);
+
+  policy->refcount += 1;
+
+  return policy;
+}
+
+static void
+rule_unref_foreach (void *data,
+                    void *user_data)
+{
+  BusPolicyRule *rule = data;
+
+  bus_policy_rule_unref (rule);
+}
+
+void
+bus_client_policy_unref (BusClientPolicy *policy)
+{
+  _dbus_assert (policy->refcount > 0);
+
+  policy->refcount -= 1;
+
+  if (policy->refcount == 0)
+    {
+      if (policy->indexed)
+        {
+          rule_index_clear (&policy->send_index);
+          rule_index_clear (&policy->receive_index);
+        }
+
+      _dbus_list_foreach (&policy->rules,
+                          rule_unref_foreach,
+                          NULL);
+
+      _dbus_list_clear (&policy->rules);
+
+      _dbus_memory_account (DBUS_MEMORY_POLICY,
+                            -(long) sizeof (BusClientPolicy));
+      dbus_free (policy);
+    }
+}
+
+static void
+free_client_policy_func (void *data)
+{
+  BusClientPolicy *client = data;
+
+  if (client != NULL)
+    bus_client_policy_unref (client);
+}
+
+static void
+prune_client_policies (BusPolicy *policy)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (policy->client_policies, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusClientPolicy *client = _dbus_hash_iter_get_value (&iter);
+
+      if (client->refcount == 1)
+        _dbus_hash_iter_remove_entry (&iter);
+    }
+}
+
+static void
+remove_rules_by_type_up_to (BusClientPolicy   *policy,
+                            BusPolicyRuleType  type,
+                            DBusList          *up_to)
+{
+  DBusList *link;
+
+  link = _dbus_list_get_first_link (&policy->rules);
+  while (link != up_to)
+    {
+      BusPolicyRule *rule = link->data;
+      DBusList *next = _dbus_list_get_next_link (&policy->rules, link);
+
+      if (rule->type == type)
+        {
+          _dbus_list_remove_link (&policy->rules, link);
           bus_policy_rule_unref (rule);
         }
       
@@ -845,6 +1577,8 @@ bus_client_policy_optimize (BusClientPolicy *policy)
 
   _dbus_verbose ("After optimization, policy has %d rules\n",
                  _dbus_list_get_length (&policy->rules));
+
+  client_policy_build_indexes (policy);
 }
 
 dbus_bool_t
@@ -857,11 +1591,174 @@ bus_client_policy_append_rule (BusClientPolicy *policy,
   if (!_dbus_list_append (&policy->rules, rule))
     return FALSE;
 
-  bus_policy_rule_ref (rule);
+  bus_policy_rule_ref (rule);
+
+  /* rebuilt by bus_client_policy_optimize() */
+  if (policy->indexed)
+    {
+      rule_index_clear (&policy->send_index);
+      rule_index_clear (&policy->receive_index);
+      policy->indexed = FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+send_rule_applies (BusPolicyRule   *rule,
+                   const RuleCheck *check)
+{
+  DBusMessage *message = check->message;
+
+  _dbus_assert (rule->type == BUS_POLICY_RULE_SEND);
+
+  /* Rule is skipped if it specifies a different
+   * message name from the message
+   */
+
+  if (rule->d.send.message_type != DBUS_MESSAGE_TYPE_INVALID)
+    {
+      if (dbus_message_get_type (message) != rule->d.send.message_type)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different message type\n");
+          return FALSE;
+        }
+    }
+
+  /* If it's a reply, the requested_reply flag kicks in */
+  if (dbus_message_get_reply_serial (message) != 0)
+    {
+      /* for allow, requested_reply=true means the rule applies
+       * only when reply was requested. requested_reply=false means
+       * always allow.
+       */
+      if (!check->requested_reply && rule->allow && rule->d.send.requested_reply && !rule->d.send.eavesdrop)
+        {
+          _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
+          return FALSE;
+        }
+
+      /* for deny, requested_reply=false means the rule applies only
+       * when the reply was not requested. requested_reply=true means the
+       * rule always applies.
+       */
+      if (check->requested_reply && !rule->allow && !rule->d.send.requested_reply)
+        {
+          _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
+          return FALSE;
+        }
+    }
+  
+  if (rule->d.send.path != NULL)
+    {
+      if (dbus_message_get_path (message) != NULL &&
+          strcmp (dbus_message_get_path (message),
+                  rule->d.send.path) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different path\n");
+          return FALSE;
+        }
+    }
+  
+  if (rule->d.send.interface != NULL)
+    {
+      /* The interface is optional in messages. For allow rules, if the message
+       * has no interface we want to skip the rule (and thus not allow);
+       * for deny rules, if the message has no interface we want to use the
+       * rule (and thus deny).
+       */
+      dbus_bool_t no_interface;
+
+      no_interface = dbus_message_get_interface (message) == NULL;
+      
+      if ((no_interface && rule->allow) ||
+          (!no_interface && 
+           strcmp (dbus_message_get_interface (message),
+                   rule->d.send.interface) != 0))
+        {
+          _dbus_verbose ("  (policy) skipping rule for different interface\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.send.member != NULL)
+    {
+      if (dbus_message_get_member (message) != NULL &&
+          strcmp (dbus_message_get_member (message),
+                  rule->d.send.member) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different member\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.send.error != NULL)
+    {
+      if (dbus_message_get_error_name (message) != NULL &&
+          strcmp (dbus_message_get_error_name (message),
+                  rule->d.send.error) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different error name\n");
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+send_rule_destination_matches (BusPolicyRule  *rule,
+                               BusRegistry    *registry,
+                               DBusConnection *receiver,
+                               DBusMessage    *message)
+{
+  if (rule->d.send.destination == NULL)
+    return TRUE;
+
+  /* receiver can be NULL for messages that are sent to the
+   * message bus itself, we check the strings in that case as
+   * built-in services don't have a DBusConnection but messages
+   * to them have a destination service name.
+   */
+  if (receiver == NULL)
+    {
+      if (!dbus_message_has_destination (message,
+                                         rule->d.send.destination))
+        {
+          _dbus_verbose ("  (policy) skipping rule because message dest is not %s\n",
+                         rule->d.send.destination);
+          return FALSE;
+        }
+    }
+  else
+    {
+      DBusString str;
+      BusService *service;
+      
+      _dbus_string_init_const (&str, rule->d.send.destination);
+      
+      service = bus_registry_lookup (registry, &str);
+      if (service == NULL)
+        {
+          _dbus_verbose ("  (policy) skipping rule because dest %s doesn't exist\n",
+                         rule->d.send.destination);
+          return FALSE;
+        }
+
+      if (!bus_service_has_owner (service, receiver))
+        {
+          _dbus_verbose ("  (policy) skipping rule because dest %s isn't owned by receiver\n",
+                         rule->d.send.destination);
+          return FALSE;
+        }
+    }
 
   return TRUE;
 }
 
+/* See docs on what the args mean on bus_context_check_security_policy()
+ * comment
+ */
 dbus_bool_t
 bus_client_policy_check_can_send (BusClientPolicy *policy,
                                   BusRegistry     *registry,
@@ -873,12 +1770,34 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
 {
   DBusList *link;
   dbus_bool_t allowed;
+  RuleCheck check;
   
+  _dbus_verbose ("  (policy) checking send rules\n");
+
+  check.message = message;
+  check.requested_reply = requested_reply;
+  check.eavesdropping = FALSE;
+
+  if (policy->indexed)
+    {
+      BusPolicyRule *rule;
+
+      rule = rule_index_check (&policy->send_index,
+                               receiver,
+                               dbus_message_get_destination (message),
+                               send_rule_applies, &check, toggles);
+
+      if (rule == NULL)
+        return FALSE;
+
+      *log = rule->d.send.log;
+      return rule->allow;
+    }
+
   /* policy->rules is in the order the rules appeared
    * in the config file, i.e. last rule that applies wins
    */
 
-  _dbus_verbose ("  (policy) checking send rules\n");
   *toggles = 0;
   
   allowed = FALSE;
@@ -889,155 +1808,193 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
 
       link = _dbus_list_get_next_link (&policy->rules, link);
       
-      /* Rule is skipped if it specifies a different
-       * message name from the message, or a different
-       * destination from the message
-       */
-      
       if (rule->type != BUS_POLICY_RULE_SEND)
         {
           _dbus_verbose ("  (policy) skipping non-send rule\n");
           continue;
         }
 
-      if (rule->d.send.message_type != DBUS_MESSAGE_TYPE_INVALID)
+      if (!send_rule_applies (rule, &check) ||
+          !send_rule_destination_matches (rule, registry, receiver, message))
+        continue;
+
+      /* Use this rule */
+      allowed = rule->allow;
+      *log = rule->d.send.log;
+      (*toggles)++;
+
+      _dbus_verbose ("  (policy) used rule, allow now = %d\n",
+                     allowed);
+    }
+
+  return allowed;
+}
+
+static dbus_bool_t
+receive_rule_applies (BusPolicyRule   *rule,
+                      const RuleCheck *check)
+{
+  DBusMessage *message = check->message;
+
+  _dbus_assert (rule->type == BUS_POLICY_RULE_RECEIVE);
+
+  if (rule->d.receive.message_type != DBUS_MESSAGE_TYPE_INVALID)
+    {
+      if (dbus_message_get_type (message) != rule->d.receive.message_type)
         {
-          if (dbus_message_get_type (message) != rule->d.send.message_type)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different message type\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different message type\n");
+          return FALSE;
         }
+    }
+
+  /* for allow, eavesdrop=false means the rule doesn't apply when
+   * eavesdropping. eavesdrop=true means always allow.
+   */
+  if (check->eavesdropping && rule->allow && !rule->d.receive.eavesdrop)
+    {
+      _dbus_verbose ("  (policy) skipping allow rule since it doesn't apply to eavesdropping\n");
+      return FALSE;
+    }
 
-      /* If it's a reply, the requested_reply flag kicks in */
-      if (dbus_message_get_reply_serial (message) != 0)
+  /* for deny, eavesdrop=true means the rule applies only when
+   * eavesdropping; eavesdrop=false means always deny.
+   */
+  if (!check->eavesdropping && !rule->allow && rule->d.receive.eavesdrop)
+    {
+      _dbus_verbose ("  (policy) skipping deny rule since it only applies to eavesdropping\n");
+      return FALSE;
+    }
+
+  /* If it's a reply, the requested_reply flag kicks in */
+  if (dbus_message_get_reply_serial (message) != 0)
+    {
+      /* for allow, requested_reply=true means the rule applies
+       * only when reply was requested. requested_reply=false means
+       * always allow.
+       */
+      if (!check->requested_reply && rule->allow && rule->d.receive.requested_reply && !rule->d.receive.eavesdrop)
         {
-          /* for allow, requested_reply=true means the rule applies
-           * only when reply was requested. requested_reply=false means
-           * always allow.
-           */
-          if (!requested_reply && rule->allow && rule->d.send.requested_reply && !rule->d.send.eavesdrop)
-            {
-              _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
+          return FALSE;
+        }
 
-          /* for deny, requested_reply=false means the rule applies only
-           * when the reply was not requested. requested_reply=true means the
-           * rule always applies.
-           */
-          if (requested_reply && !rule->allow && !rule->d.send.requested_reply)
-            {
-              _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
-              continue;
-            }
+      /* for deny, requested_reply=false means the rule applies only
+       * when the reply was not requested. requested_reply=true means the
+       * rule always applies.
+       */
+      if (check->requested_reply && !rule->allow && !rule->d.receive.requested_reply)
+        {
+          _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
+          return FALSE;
         }
-      
-      if (rule->d.send.path != NULL)
+    }
+  
+  if (rule->d.receive.path != NULL)
+    {
+      if (dbus_message_get_path (message) != NULL &&
+          strcmp (dbus_message_get_path (message),
+                  rule->d.receive.path) != 0)
         {
-          if (dbus_message_get_path (message) != NULL &&
-              strcmp (dbus_message_get_path (message),
-                      rule->d.send.path) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different path\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different path\n");
+          return FALSE;
         }
+    }
+  
+  if (rule->d.receive.interface != NULL)
+    {
+      /* The interface is optional in messages. For allow rules, if the message
+       * has no interface we want to skip the rule (and thus not allow);
+       * for deny rules, if the message has no interface we want to use the
+       * rule (and thus deny).
+       */
+      dbus_bool_t no_interface;
+
+      no_interface = dbus_message_get_interface (message) == NULL;
       
-      if (rule->d.send.interface != NULL)
+      if ((no_interface && rule->allow) ||
+          (!no_interface &&
+           strcmp (dbus_message_get_interface (message),
+                   rule->d.receive.interface) != 0))
         {
-          /* The interface is optional in messages. For allow rules, if the message
-           * has no interface we want to skip the rule (and thus not allow);
-           * for deny rules, if the message has no interface we want to use the
-           * rule (and thus deny).
-           */
-          dbus_bool_t no_interface;
-
-          no_interface = dbus_message_get_interface (message) == NULL;
-          
-          if ((no_interface && rule->allow) ||
-              (!no_interface && 
-               strcmp (dbus_message_get_interface (message),
-                       rule->d.send.interface) != 0))
-            {
-              _dbus_verbose ("  (policy) skipping rule for different interface\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different interface\n");
+          return FALSE;
         }
+    }      
 
-      if (rule->d.send.member != NULL)
+  if (rule->d.receive.member != NULL)
+    {
+      if (dbus_message_get_member (message) != NULL &&
+          strcmp (dbus_message_get_member (message),
+                  rule->d.receive.member) != 0)
         {
-          if (dbus_message_get_member (message) != NULL &&
-              strcmp (dbus_message_get_member (message),
-                      rule->d.send.member) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different member\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different member\n");
+          return FALSE;
         }
+    }
 
-      if (rule->d.send.error != NULL)
+  if (rule->d.receive.error != NULL)
+    {
+      if (dbus_message_get_error_name (message) != NULL &&
+          strcmp (dbus_message_get_error_name (message),
+                  rule->d.receive.error) != 0)
         {
-          if (dbus_message_get_error_name (message) != NULL &&
-              strcmp (dbus_message_get_error_name (message),
-                      rule->d.send.error) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different error name\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different error name\n");
+          return FALSE;
         }
-      
-      if (rule->d.send.destination != NULL)
-        {
-          /* receiver can be NULL for messages that are sent to the
-           * message bus itself, we check the strings in that case as
-           * built-in services don't have a DBusConnection but messages
-           * to them have a destination service name.
-           */
-          if (receiver == NULL)
-            {
-              if (!dbus_message_has_destination (message,
-                                                 rule->d.send.destination))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because message dest is not %s\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
-            }
-          else
-            {
-              DBusString str;
-              BusService *service;
-              
-              _dbus_string_init_const (&str, rule->d.send.destination);
-              
-              service = bus_registry_lookup (registry, &str);
-              if (service == NULL)
-                {
-                  _dbus_verbose ("  (policy) skipping rule because dest %s doesn't exist\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
+    }
 
-              if (!bus_service_has_owner (service, receiver))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because dest %s isn't owned by receiver\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
-            }
+  return TRUE;
+}
+
+static dbus_bool_t
+receive_rule_origin_matches (BusPolicyRule  *rule,
+                             BusRegistry    *registry,
+                             DBusConnection *sender,
+                             DBusMessage    *message)
+{
+  if (rule->d.receive.origin == NULL)
+    return TRUE;
+
+  /* sender can be NULL for messages that originate from the
+   * message bus itself, we check the strings in that case as
+   * built-in services don't have a DBusConnection but will
+   * still set the sender on their messages.
+   */
+  if (sender == NULL)
+    {
+      if (!dbus_message_has_sender (message,
+                                    rule->d.receive.origin))
+        {
+          _dbus_verbose ("  (policy) skipping rule because message sender is not %s\n",
+                         rule->d.receive.origin);
+          return FALSE;
         }
+    }
+  else
+    {
+      BusService *service;
+      DBusString str;
 
-      /* Use this rule */
-      allowed = rule->allow;
-      *log = rule->d.send.log;
-      (*toggles)++;
+      _dbus_string_init_const (&str, rule->d.receive.origin);
+      
+      service = bus_registry_lookup (registry, &str);
+      
+      if (service == NULL)
+        {
+          _dbus_verbose ("  (policy) skipping rule because origin %s doesn't exist\n",
+                         rule->d.receive.origin);
+          return FALSE;
+        }
 
-      _dbus_verbose ("  (policy) used rule, allow now = %d\n",
-                     allowed);
+      if (!bus_service_has_owner (service, sender))
+        {
+          _dbus_verbose ("  (policy) skipping rule because origin %s isn't owned by sender\n",
+                         rule->d.receive.origin);
+          return FALSE;
+        }
     }
 
-  return allowed;
+  return TRUE;
 }
 
 /* See docs on what the args mean on bus_context_check_security_policy()
@@ -1055,17 +2012,32 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
 {
   DBusList *link;
   dbus_bool_t allowed;
-  dbus_bool_t eavesdropping;
+  RuleCheck check;
 
-  eavesdropping =
+  check.message = message;
+  check.requested_reply = requested_reply;
+  check.eavesdropping =
     addressed_recipient != proposed_recipient &&
     dbus_message_get_destination (message) != NULL;
   
+  _dbus_verbose ("  (policy) checking receive rules, eavesdropping = %d\n", check.eavesdropping);
+
+  if (policy->indexed)
+    {
+      BusPolicyRule *rule;
+
+      rule = rule_index_check (&policy->receive_index,
+                               sender,
+                               dbus_message_get_sender (message),
+                               receive_rule_applies, &check, toggles);
+
+      return rule != NULL && rule->allow;
+    }
+
   /* policy->rules is in the order the rules appeared
    * in the config file, i.e. last rule that applies wins
    */
 
-  _dbus_verbose ("  (policy) checking receive rules, eavesdropping = %d\n", eavesdropping);
   *toggles = 0;
   
   allowed = FALSE;
@@ -1082,152 +2054,9 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
           continue;
         }
 
-      if (rule->d.receive.message_type != DBUS_MESSAGE_TYPE_INVALID)
-        {
-          if (dbus_message_get_type (message) != rule->d.receive.message_type)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different message type\n");
-              continue;
-            }
-        }
-
-      /* for allow, eavesdrop=false means the rule doesn't apply when
-       * eavesdropping. eavesdrop=true means always allow.
-       */
-      if (eavesdropping && rule->allow && !rule->d.receive.eavesdrop)
-        {
-          _dbus_verbose ("  (policy) skipping allow rule since it doesn't apply to eavesdropping\n");
-          continue;
-        }
-
-      /* for deny, eavesdrop=true means the rule applies only when
-       * eavesdropping; eavesdrop=false means always deny.
-       */
-      if (!eavesdropping && !rule->allow && rule->d.receive.eavesdrop)
-        {
-          _dbus_verbose ("  (policy) skipping deny rule since it only applies to eavesdropping\n");
-          continue;
-        }
-
-      /* If it's a reply, the requested_reply flag kicks in */
-      if (dbus_message_get_reply_serial (message) != 0)
-        {
-          /* for allow, requested_reply=true means the rule applies
-           * only when reply was requested. requested_reply=false means
-           * always allow.
-           */
-          if (!requested_reply && rule->allow && rule->d.receive.requested_reply && !rule->d.receive.eavesdrop)
-            {
-              _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
-              continue;
-            }
-
-          /* for deny, requested_reply=false means the rule applies only
-           * when the reply was not requested. requested_reply=true means the
-           * rule always applies.
-           */
-          if (requested_reply && !rule->allow && !rule->d.receive.requested_reply)
-            {
-              _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
-              continue;
-            }
-        }
-      
-      if (rule->d.receive.path != NULL)
-        {
-          if (dbus_message_get_path (message) != NULL &&
-              strcmp (dbus_message_get_path (message),
-                      rule->d.receive.path) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different path\n");
-              continue;
-            }
-        }
-      
-      if (rule->d.receive.interface != NULL)
-        {
-          /* The interface is optional in messages. For allow rules, if the message
-           * has no interface we want to skip the rule (and thus not allow);
-           * for deny rules, if the message has no interface we want to use the
-           * rule (and thus deny).
-           */
-          dbus_bool_t no_interface;
-
-          no_interface = dbus_message_get_interface (message) == NULL;
-          
-          if ((no_interface && rule->allow) ||
-              (!no_interface &&
-               strcmp (dbus_message_get_interface (message),
-                       rule->d.receive.interface) != 0))
-            {
-              _dbus_verbose ("  (policy) skipping rule for different interface\n");
-              continue;
-            }
-        }      
-
-      if (rule->d.receive.member != NULL)
-        {
-          if (dbus_message_get_member (message) != NULL &&
-              strcmp (dbus_message_get_member (message),
-                      rule->d.receive.member) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different member\n");
-              continue;
-            }
-        }
-
-      if (rule->d.receive.error != NULL)
-        {
-          if (dbus_message_get_error_name (message) != NULL &&
-              strcmp (dbus_message_get_error_name (message),
-                      rule->d.receive.error) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different error name\n");
-              continue;
-            }
-        }
-      
-      if (rule->d.receive.origin != NULL)
-        {          
-          /* sender can be NULL for messages that originate from the
-           * message bus itself, we check the strings in that case as
-           * built-in services don't have a DBusConnection but will
-           * still set the sender on their messages.
-           */
-          if (sender == NULL)
-            {
-              if (!dbus_message_has_sender (message,
-                                            rule->d.receive.origin))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because message sender is not %s\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
-            }
-          else
-            {
-              BusService *service;
-              DBusString str;
-
-              _dbus_string_init_const (&str, rule->d.receive.origin);
-              
-              service = bus_registry_lookup (registry, &str);
-              
-              if (service == NULL)
-                {
-                  _dbus_verbose ("  (policy) skipping rule because origin %s doesn't exist\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
-
-              if (!bus_service_has_owner (service, sender))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because origin %s isn't owned by sender\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
-            }
-        }
+      if (!receive_rule_applies (rule, &check) ||
+          !receive_rule_origin_matches (rule, registry, sender, message))
+        continue;
       
       /* Use this rule */
       allowed = rule->allow;
@@ -1283,14 +2112,255 @@ bus_client_policy_check_can_own (BusClientPolicy  *policy,
 
 #ifdef DBUS_BUILD_TESTS
 
+static BusPolicyRule *
+test_send_rule (dbus_bool_t allow,
+                int         message_type,
+                const char *destination,
+                const char *interface,
+                const char *member)
+{
+  BusPolicyRule *rule;
+
+  rule = bus_policy_rule_new (BUS_POLICY_RULE_SEND, allow);
+  if (rule == NULL)
+    return NULL;
+
+  rule->d.send.message_type = message_type;
+  rule->d.send.log = !allow;
+  rule->d.send.destination = bus_intern_string (destination);
+  rule->d.send.interface = bus_intern_string (interface);
+  rule->d.send.member = bus_intern_string (member);
+
+  if ((destination && !rule->d.send.destination) ||
+      (interface && !rule->d.send.interface) ||
+      (member && !rule->d.send.member))
+    {
+      bus_policy_rule_unref (rule);
+      return NULL;
+    }
+
+  return rule;
+}
+
+static BusPolicyRule *
+test_receive_rule (dbus_bool_t allow,
+                   int         message_type,
+                   const char *origin,
+                   const char *interface,
+                   const char *member)
+{
+  BusPolicyRule *rule;
+
+  rule = bus_policy_rule_new (BUS_POLICY_RULE_RECEIVE, allow);
+  if (rule == NULL)
+    return NULL;
+
+  rule->d.receive.message_type = message_type;
+  rule->d.receive.origin = bus_intern_string (origin);
+  rule->d.receive.interface = bus_intern_string (interface);
+  rule->d.receive.member = bus_intern_string (member);
+
+  if ((origin && !rule->d.receive.origin) ||
+      (interface && !rule->d.receive.interface) ||
+      (member && !rule->d.receive.member))
+    {
+      bus_policy_rule_unref (rule);
+      return NULL;
+    }
+
+  return rule;
+}
+
+static dbus_bool_t
+test_append_rule (BusClientPolicy *linear,
+                  BusClientPolicy *indexed,
+                  BusPolicyRule   *rule)
+{
+  if (rule == NULL)
+    return FALSE;
+
+  if (!bus_client_policy_append_rule (linear, rule) ||
+      !bus_client_policy_append_rule (indexed, rule))
+    {
+      bus_policy_rule_unref (rule);
+      return FALSE;
+    }
+
+  bus_policy_rule_unref (rule);
+  return TRUE;
+}
+
+static dbus_bool_t
+test_indexed_checks (void *data)
+{
+  static const char *names[] = { "org.a", "org.b", "org.c", NULL };
+  static const char *interfaces[] = { "org.a.Secret", "org.b.Iface", "org.x", NULL };
+  static const char *members[] = { "Ping", "Pong" };
+  static const int types[] = { DBUS_MESSAGE_TYPE_METHOD_CALL,
+                               DBUS_MESSAGE_TYPE_SIGNAL };
+  BusClientPolicy *linear;
+  BusClientPolicy *indexed;
+  DBusMessage *message;
+  int t, n, i, m;
+
+  message = NULL;
+
+  linear = bus_client_policy_new ();
+  indexed = bus_client_policy_new ();
+  if (linear == NULL || indexed == NULL)
+    goto out;
+
+  if (!test_append_rule (linear, indexed,
+                         test_send_rule (TRUE, DBUS_MESSAGE_TYPE_INVALID,
+                                         "org.a", NULL, NULL)) ||
+      !test_append_rule (linear, indexed,
+                         test_send_rule (FALSE, DBUS_MESSAGE_TYPE_INVALID,
+                                         "org.a", "org.a.Secret", NULL)) ||
+      !test_append_rule (linear, indexed,
+                         test_send_rule (TRUE, DBUS_MESSAGE_TYPE_INVALID,
+                                         NULL, "org.b.Iface", NULL)) ||
+      !test_append_rule (linear, indexed,
+                         test_send_rule (FALSE, DBUS_MESSAGE_TYPE_INVALID,
+                                         "org.c", NULL, NULL)) ||
+      !test_append_rule (linear, indexed,
+                         test_send_rule (TRUE, DBUS_MESSAGE_TYPE_INVALID,
+                                         "org.c", NULL, "Ping")) ||
+      !test_append_rule (linear, indexed,
+                         test_send_rule (FALSE, DBUS_MESSAGE_TYPE_SIGNAL,
+                                         NULL, NULL, NULL)) ||
+      !test_append_rule (linear, indexed,
+                         test_receive_rule (TRUE, DBUS_MESSAGE_TYPE_INVALID,
+                                            "org.a", NULL, NULL)) ||
+      !test_append_rule (linear, indexed,
+                         test_receive_rule (FALSE, DBUS_MESSAGE_TYPE_INVALID,
+                                            NULL, "org.a.Secret", NULL)) ||
+      !test_append_rule (linear, indexed,
+                         test_receive_rule (TRUE, DBUS_MESSAGE_TYPE_SIGNAL,
+                                            "org.b", NULL, NULL)) ||
+      !test_append_rule (linear, indexed,
+                         test_receive_rule (FALSE, DBUS_MESSAGE_TYPE_INVALID,
+                                            "org.b", NULL, "Pong")))
+    goto out;
+
+  client_policy_build_indexes (indexed);
+  if (!indexed->indexed)
+    goto out;
+
+  _dbus_assert (!linear->indexed);
+  _dbus_assert (indexed->send_index.n_rules == 6);
+  _dbus_assert (indexed->receive_index.n_rules == 4);
+
+  for (t = 0; t < (int) _DBUS_N_ELEMENTS (types); t++)
+    for (n = 0; n < (int) _DBUS_N_ELEMENTS (names); n++)
+      for (i = 0; i < (int) _DBUS_N_ELEMENTS (interfaces); i++)
+        for (m = 0; m < (int) _DBUS_N_ELEMENTS (members); m++)
+          {
+            dbus_int32_t linear_toggles, indexed_toggles;
+            dbus_bool_t linear_log, indexed_log;
+            dbus_bool_t linear_allowed, indexed_allowed;
+
+            message = dbus_message_new (types[t]);
+            if (message == NULL)
+              goto out;
+
+            if (!dbus_message_set_path (message, "/") ||
+                !dbus_message_set_member (message, members[m]) ||
+                (interfaces[i] != NULL &&
+                 !dbus_message_set_interface (message, interfaces[i])) ||
+                (names[n] != NULL &&
+                 (!dbus_message_set_destination (message, names[n]) ||
+                  !dbus_message_set_sender (message, names[n]))))
+              goto out;
+
+            linear_log = indexed_log = FALSE;
+            linear_allowed =
+              bus_client_policy_check_can_send (linear, NULL, FALSE, NULL,
+                                                message, &linear_toggles,
+                                                &linear_log);
+            indexed_allowed =
+              bus_client_policy_check_can_send (indexed, NULL, FALSE, NULL,
+                                                message, &indexed_toggles,
+                                                &indexed_log);
+
+            _dbus_assert (linear_allowed == indexed_allowed);
+            _dbus_assert (linear_toggles == indexed_toggles);
+            _dbus_assert (linear_log == indexed_log);
+
+            linear_allowed =
+              bus_client_policy_check_can_receive (linear, NULL, FALSE,
+                                                   NULL, NULL, NULL,
+                                                   message, &linear_toggles);
+            indexed_allowed =
+              bus_client_policy_check_can_receive (indexed, NULL, FALSE,
+                                                   NULL, NULL, NULL,
+                                                   message, &indexed_toggles);
+
+            _dbus_assert (linear_allowed == indexed_allowed);
+            _dbus_assert (linear_toggles == indexed_toggles);
+
+            /* a few verdicts spelled out */
+            if (types[t] == DBUS_MESSAGE_TYPE_METHOD_CALL && n == 0)
+              {
+                linear_allowed =
+                  bus_client_policy_check_can_send (indexed, NULL, FALSE, NULL,
+                                                    message, &indexed_toggles,
+                                                    &indexed_log);
+                /* a deny rule naming an interface also denies messages
+                 * without one */
+                _dbus_assert (linear_allowed == (i == 1 || i == 2));
+              }
+            if (types[t] == DBUS_MESSAGE_TYPE_METHOD_CALL && n == 2 && i == 2)
+              {
+                linear_allowed =
+                  bus_client_policy_check_can_send (indexed, NULL, FALSE, NULL,
+                                                    message, &indexed_toggles,
+                                                    &indexed_log);
+                _dbus_assert (linear_allowed == (m == 0));
+              }
+            if (types[t] == DBUS_MESSAGE_TYPE_SIGNAL && n == 1 && (i == 1 || i == 2))
+              {
+                linear_allowed =
+                  bus_client_policy_check_can_receive (indexed, NULL, FALSE,
+                                                       NULL, NULL, NULL,
+                                                       message, &indexed_toggles);
+                _dbus_assert (linear_allowed == (m == 0));
+              }
+
+            dbus_message_unref (message);
+            message = NULL;
+          }
+
+  /* appending a rule drops the indexes until the next optimize */
+  if (!test_append_rule (linear, indexed,
+                         test_send_rule (TRUE, DBUS_MESSAGE_TYPE_INVALID,
+                                         NULL, NULL, NULL)))
+    goto out;
+  _dbus_assert (!indexed->indexed);
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+  if (linear)
+    bus_client_policy_unref (linear);
+  if (indexed)
+    bus_client_policy_unref (indexed);
+
+  /* running out of memory isn't a failure, the checks are all asserts */
+  return TRUE;
+}
+
 dbus_bool_t
 bus_policy_test (const DBusString *test_data_dir)
 {
-  /* This doesn't do anything for now because I decided to do it in
-   * dispatch.c instead by having some of the clients in dispatch.c
-   * have particular policies applied to them.
+  /* The rest of the policy is tested in dispatch.c instead, by having
+   * some of the clients in dispatch.c have particular policies applied
+   * to them.
    */
-  
+
+  if (!_dbus_test_oom_handling ("indexed client policy checks",
+                                test_indexed_checks, NULL))
+    _dbus_assert_not_reached ("indexed client policy checks failed");
+
   return TRUE;
 }
 
@@ -30,6 +30,8 @@
 #include <dbus/dbus-sysdeps.h>
 #include "bus.h"
 
+typedef struct BusPolicyRuleArena BusPolicyRuleArena;
+
 typedef enum
 {
   BUS_POLICY_RULE_SEND,
@@ -46,6 +48,8 @@ typedef enum
 struct BusPolicyRule
 {
   int refcount;
+
+  BusPolicyRuleArena *arena; /**< what it was allocated from, or NULL */
   
   BusPolicyRuleType type;
 
@@ -58,11 +62,11 @@ struct BusPolicyRule
       /* message type can be DBUS_MESSAGE_TYPE_INVALID meaning "any" */
       int   message_type;
       /* any of these can be NULL meaning "any" */
-      char *path;
-      char *interface;
-      char *member;
-      char *error;
-      char *destination;
+      const char *path;
+      const char *interface;
+      const char *member;
+      const char *error;
+      const char *destination;
       unsigned int eavesdrop : 1;
       unsigned int requested_reply : 1;
       unsigned int log : 1;
@@ -73,11 +77,11 @@ struct BusPolicyRule
       /* message type can be DBUS_MESSAGE_TYPE_INVALID meaning "any" */
       int   message_type;
       /* any of these can be NULL meaning "any" */
-      char *path;
-      char *interface;
-      char *member;
-      char *error;
-      char *origin;
+      const char *path;
+      const char *interface;
+      const char *member;
+      const char *error;
+      const char *origin;
       unsigned int eavesdrop : 1;
       unsigned int requested_reply : 1;
     } receive;
@@ -85,7 +89,7 @@ struct BusPolicyRule
     struct
     {
       /* can be NULL meaning "any" */
-      char *service_name;
+      const char *service_name;
     } own;
 
     struct
@@ -108,7 +112,10 @@ BusPolicyRule* bus_policy_rule_new   (BusPolicyRuleType type,
 BusPolicyRule* bus_policy_rule_ref   (BusPolicyRule    *rule);
 void           bus_policy_rule_unref (BusPolicyRule    *rule);
 
-BusPolicy*       bus_policy_new                   (void);
+BusPolicy*       bus_policy_new                   (BusPolicy        *parent);
+BusPolicyRule*   bus_policy_new_rule              (BusPolicy        *policy,
+                                                   BusPolicyRuleType type,
+                                                   dbus_bool_t       allow);
 BusPolicy*       bus_policy_ref                   (BusPolicy        *policy);
 void             bus_policy_unref                 (BusPolicy        *policy);
 BusClientPolicy* bus_policy_create_client_policy  (BusPolicy        *policy,
@@ -134,6 +141,17 @@ dbus_bool_t      bus_policy_append_console_rule   (BusPolicy        *policy,
 
 dbus_bool_t      bus_policy_merge                 (BusPolicy        *policy,
                                                    BusPolicy        *to_absorb);
+dbus_bool_t      bus_policy_set_user_dispatch_quantum  (BusPolicy      *policy,
+                                                        dbus_uid_t      uid,
+                                                        int             quantum);
+dbus_bool_t      bus_policy_set_group_dispatch_quantum (BusPolicy      *policy,
+                                                        dbus_gid_t      gid,
+                                                        int             quantum);
+dbus_bool_t      bus_policy_get_dispatch_quantum       (BusPolicy      *policy,
+                                                        DBusConnection *connection,
+                                                        int             default_quantum,
+                                                        int            *quantum_p,
+                                                        DBusError      *error);
 
 BusClientPolicy* bus_client_policy_new               (void);
 BusClientPolicy* bus_client_policy_ref               (BusClientPolicy  *policy);
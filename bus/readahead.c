@@ -0,0 +1,247 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* readahead.c  Read a directory's files on a few threads before parsing them
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "readahead.h"
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-string.h>
+#include <dbus/dbus-sysdeps.h>
+
+#ifndef DBUS_WIN
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* On slow storage, reading the files of a service or include directory
+ * one at a time is what startup waits for. The threads here only read
+ * the files, so the kernel has them cached when they are loaded and
+ * parsed afterwards, on the main thread and in the usual order; that
+ * keeps the result the same as without them. They don't allocate or
+ * touch anything but the path array, and are gone before returning.
+ */
+
+#define MAX_READAHEAD_THREADS 4
+
+/* Same limit as the .service file loader; anything bigger is rejected
+ * there without being read anyway
+ */
+#define MAX_READAHEAD_SIZE (_DBUS_ONE_KILOBYTE * 128)
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  char **paths;
+  int n_paths;
+  int next;         /**< Next path to read, under lock */
+} Readahead;
+
+static void
+read_file (const char *path)
+{
+  char buf[4096];
+  ssize_t bytes;
+  long total;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  total = 0;
+  do
+    {
+      bytes = read (fd, buf, sizeof (buf));
+      if (bytes > 0)
+        total += bytes;
+    }
+  while ((bytes > 0 || (bytes < 0 && errno == EINTR)) &&
+         total < MAX_READAHEAD_SIZE);
+
+  close (fd);
+}
+
+static void *
+readahead_thread_main (void *data)
+{
+  Readahead *ra = data;
+
+  while (TRUE)
+    {
+      int i;
+
+      pthread_mutex_lock (&ra->lock);
+      i = ra->next++;
+      pthread_mutex_unlock (&ra->lock);
+
+      if (i >= ra->n_paths)
+        break;
+
+      read_file (ra->paths[i]);
+    }
+
+  return NULL;
+}
+
+static dbus_bool_t
+list_files (Readahead  *ra,
+            const char *dir_c,
+            const char *suffix)
+{
+  DBusString dir, filename, full_path;
+  DBusDirIter *iter;
+  DBusList *names;
+  dbus_bool_t retval;
+  char *path;
+  int n_paths;
+  int i;
+
+  names = NULL;
+  retval = FALSE;
+  iter = NULL;
+  _dbus_string_init_const (&dir, dir_c);
+
+  if (!_dbus_string_init (&filename))
+    return FALSE;
+
+  if (!_dbus_string_init (&full_path))
+    {
+      _dbus_string_free (&filename);
+      return FALSE;
+    }
+
+  iter = _dbus_directory_open (&dir, NULL);
+  if (iter == NULL)
+    goto out;
+
+  while (_dbus_directory_get_next_file (iter, &filename, NULL))
+    {
+      if (!_dbus_string_ends_with_c_str (&filename, suffix))
+        continue;
+
+      _dbus_string_set_length (&full_path, 0);
+      if (!_dbus_string_append (&full_path, dir_c) ||
+          !_dbus_concat_dir_and_file (&full_path, &filename) ||
+          !_dbus_string_copy_data (&full_path, &path))
+        goto out;
+
+      if (!_dbus_list_append (&names, path))
+        {
+          dbus_free (path);
+          goto out;
+        }
+    }
+
+  n_paths = _dbus_list_get_length (&names);
+  ra->paths = dbus_new (char *, n_paths);
+  if (ra->paths == NULL)
+    goto out;
+
+  for (i = 0; i < n_paths; i++)
+    ra->paths[i] = _dbus_list_pop_first (&names);
+  ra->n_paths = n_paths;
+
+  retval = TRUE;
+
+ out:
+  _dbus_list_foreach (&names, (DBusForeachFunction) dbus_free, NULL);
+  _dbus_list_clear (&names);
+  if (iter != NULL)
+    _dbus_directory_close (iter);
+  _dbus_string_free (&full_path);
+  _dbus_string_free (&filename);
+
+  return retval;
+}
+
+/**
+ * Reads the files in the directory whose name ends with suffix on a
+ * few threads, and waits for them, so that loading them afterwards
+ * doesn't wait for the storage one file at a time. This is only an
+ * optimization: nothing is reported if it fails.
+ *
+ * @param dir_c the directory
+ * @param suffix only files ending in this are read
+ */
+void
+bus_readahead_directory (const char *dir_c,
+                         const char *suffix)
+{
+  Readahead ra;
+  pthread_t threads[MAX_READAHEAD_THREADS];
+  sigset_t all_signals;
+  sigset_t old_signals;
+  int n_threads;
+  int i;
+
+  ra.paths = NULL;
+  ra.n_paths = 0;
+  ra.next = 0;
+
+  if (!list_files (&ra, dir_c, suffix))
+    return;
+
+  /* no point in threads for a file or two */
+  if (ra.n_paths < 2)
+    goto out;
+
+  pthread_mutex_init (&ra.lock, NULL);
+
+  sigfillset (&all_signals);
+  pthread_sigmask (SIG_SETMASK, &all_signals, &old_signals);
+
+  for (n_threads = 0;
+       n_threads < MAX_READAHEAD_THREADS && n_threads < ra.n_paths;
+       n_threads++)
+    {
+      if (pthread_create (&threads[n_threads], NULL,
+                          readahead_thread_main, &ra) != 0)
+        break;
+    }
+
+  pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+
+  for (i = 0; i < n_threads; i++)
+    pthread_join (threads[i], NULL);
+
+  _dbus_verbose ("Read ahead %d files of %s on %d threads\n",
+                 ra.n_paths, dir_c, n_threads);
+
+  pthread_mutex_destroy (&ra.lock);
+
+ out:
+  for (i = 0; i < ra.n_paths; i++)
+    dbus_free (ra.paths[i]);
+  dbus_free (ra.paths);
+}
+
+#else /* DBUS_WIN */
+
+void
+bus_readahead_directory (const char *dir_c,
+                         const char *suffix)
+{
+}
+
+#endif /* DBUS_WIN */
@@ -72,6 +72,30 @@ static security_id_t bus_sid = SECSID_WILD;
 /* Thread to listen for SELinux status changes via netlink. */
 static pthread_t avc_notify_thread;
 
+/* Bumped from the AVC notify thread whenever the AVC is reset (policy
+ * load, or a switch to enforcing mode); cached send verdicts from an
+ * older generation are stale.
+ */
+static DBusAtomic policy_generation = { 0 };
+
+#define SEND_CACHE_SIZE 8
+
+/* Direct-mapped cache of send_msg verdicts the AVC allowed, kept per
+ * sending connection and keyed by the recipient's SID.  Only allows are
+ * cached so every denial still goes through avc_has_perm() and gets
+ * audited with its auxdata.
+ */
+struct BusSELinuxSendCache
+{
+  struct
+  {
+    security_id_t recipient_sid;
+    dbus_int32_t generation;
+  } entries[SEND_CACHE_SIZE];
+};
+
+#define SEND_CACHE_SLOT(sid) ((((unsigned long) (sid)) >> 4) % SEND_CACHE_SIZE)
+
 /* Prototypes for AVC callback functions.  */
 static void log_callback (const char *fmt, ...);
 static void log_audit_callback (void *data, security_class_t class, char *buf, size_t bufleft);
@@ -164,7 +188,8 @@ log_callback (const char *fmt, ...)
   }
 #endif /* HAVE_LIBAUDIT */
   
-  vsyslog (LOG_INFO, fmt, ap);
+  /* May be called on the AVC thread as well as the main one */
+  _dbus_system_logv (DBUS_SYSTEM_LOG_SECURITY, fmt, ap);
   va_end(ap);
 }
 
@@ -178,7 +203,10 @@ policy_reload_callback (u_int32_t event, security_id_t ssid,
                         access_vector_t perms, access_vector_t *out_retained)
 {
   if (event == AVC_CALLBACK_RESET)
-    return raise (SIGHUP);
+    {
+      _dbus_atomic_inc (&policy_generation);
+      return raise (SIGHUP);
+    }
   
   return 0;
 }
@@ -410,6 +438,32 @@ bus_selinux_id_ref (BusSELinuxID *sid)
 #endif /* HAVE_SELINUX */
 }
 
+/**
+ * Creates an empty cache of send_msg verdicts for one sending
+ * connection, see bus_selinux_allows_send().
+ *
+ * @returns the new cache, or #NULL if no memory or SELinux is disabled
+ */
+BusSELinuxSendCache*
+bus_selinux_send_cache_new (void)
+{
+#ifdef HAVE_SELINUX
+  if (!selinux_enabled)
+    return NULL;
+
+  /* A NULL recipient_sid never matches, so zeroed entries are empty */
+  return dbus_new0 (BusSELinuxSendCache, 1);
+#else
+  return NULL;
+#endif /* HAVE_SELINUX */
+}
+
+void
+bus_selinux_send_cache_free (BusSELinuxSendCache *cache)
+{
+  dbus_free (cache);
+}
+
 /**
  * Determine if the SELinux security policy allows the given sender
  * security context to go to the given recipient security context.
@@ -553,10 +607,32 @@ bus_selinux_allows_send (DBusConnection     *sender,
   DBusString auxdata;
   dbus_bool_t ret;
   dbus_bool_t string_alloced;
+  BusSELinuxSendCache *cache;
+  dbus_int32_t generation;
+  int slot;
 
   if (!selinux_enabled)
     return TRUE;
 
+  sender_sid = bus_connection_get_selinux_id (sender);
+  /* A NULL proposed_recipient means the bus itself. */
+  if (proposed_recipient)
+    recipient_sid = bus_connection_get_selinux_id (proposed_recipient);
+  else
+    recipient_sid = BUS_SID_FROM_SELINUX (bus_sid);
+
+  /* The verdict only depends on the two SIDs, and the AVC's SIDs are
+   * unique per context, so a cached allow stands in for avc_has_perm()
+   * and spares building the auxdata below.
+   */
+  cache = bus_connection_get_selinux_send_cache (sender);
+  generation = policy_generation.value;
+  slot = SEND_CACHE_SLOT (recipient_sid);
+  if (cache != NULL && recipient_sid != NULL &&
+      cache->entries[slot].recipient_sid == SELINUX_SID_FROM_BUS (recipient_sid) &&
+      cache->entries[slot].generation == generation)
+    return TRUE;
+
   if (!sender || !dbus_connection_get_unix_process_id (sender, &spid))
     spid = 0;
   if (!proposed_recipient || !dbus_connection_get_unix_process_id (proposed_recipient, &tpid))
@@ -623,13 +699,6 @@ bus_selinux_allows_send (DBusConnection     *sender,
 	goto oom;
     }
 
-  sender_sid = bus_connection_get_selinux_id (sender);
-  /* A NULL proposed_recipient means the bus itself. */
-  if (proposed_recipient)
-    recipient_sid = bus_connection_get_selinux_id (proposed_recipient);
-  else
-    recipient_sid = BUS_SID_FROM_SELINUX (bus_sid);
-
   ret = bus_selinux_check (sender_sid, 
 			   recipient_sid,
 			   SECCLASS_DBUS, 
@@ -638,6 +707,15 @@ bus_selinux_allows_send (DBusConnection     *sender,
 
   _dbus_string_free (&auxdata);
 
+  /* generation was read before the check, so a reset racing with it
+   * leaves an entry that is already stale.
+   */
+  if (ret && cache != NULL && recipient_sid != NULL)
+    {
+      cache->entries[slot].recipient_sid = SELINUX_SID_FROM_BUS (recipient_sid);
+      cache->entries[slot].generation = generation;
+    }
+
   return ret;
 
  oom:
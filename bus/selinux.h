@@ -36,6 +36,9 @@ dbus_bool_t bus_selinux_enabled  (void);
 void bus_selinux_id_ref    (BusSELinuxID *sid);
 void bus_selinux_id_unref  (BusSELinuxID *sid);
 
+BusSELinuxSendCache* bus_selinux_send_cache_new  (void);
+void                 bus_selinux_send_cache_free (BusSELinuxSendCache *cache);
+
 DBusHashTable* bus_selinux_id_table_new    (void);
 BusSELinuxID*  bus_selinux_id_table_lookup (DBusHashTable    *service_table,
                                             const DBusString *service_name);
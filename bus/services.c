@@ -30,6 +30,7 @@
 
 #include "driver.h"
 #include "services.h"
+#include "intern.h"
 #include "connection.h"
 #include "utils.h"
 #include "activation.h"
@@ -42,10 +43,19 @@ struct BusService
   int refcount;
 
   BusRegistry *registry;
-  char *name;
+  const char *name;   /**< interned */
   DBusList *owners;
+  int n_owners;                /**< length of owners */
+  DBusHashTable *owner_links;  /**< connection to its link in owners, or NULL */
 };
 
+/* Below this many owners the queue is just scanned; names that are
+ * only ever owned by one connection, which is nearly all of them, don't
+ * pay for a hash table. The table is only an index, so if it can't be
+ * kept up to date for lack of memory it's dropped and rebuilt later.
+ */
+#define MIN_OWNERS_FOR_HASH 8
+
 struct BusOwner
 {
   int refcount;
@@ -64,6 +74,7 @@ struct BusRegistry
   BusContext *context;
   
   DBusHashTable *service_hash;
+  DBusHashTable *unique_hash;   /**< The ":1.N" entries of service_hash again, by N */
   DBusMemPool   *service_pool;
   DBusMemPool   *owner_pool;
 
@@ -86,6 +97,11 @@ bus_registry_new (BusContext *context)
                                                  NULL, NULL);
   if (registry->service_hash == NULL)
     goto failed;
+
+  registry->unique_hash = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                NULL, NULL);
+  if (registry->unique_hash == NULL)
+    goto failed;
   
   registry->service_pool = _dbus_mem_pool_new (sizeof (BusService),
                                                TRUE);
@@ -127,6 +143,8 @@ bus_registry_unref  (BusRegistry *registry)
     {
       if (registry->service_hash)
         _dbus_hash_table_unref (registry->service_hash);
+      if (registry->unique_hash)
+        _dbus_hash_table_unref (registry->unique_hash);
       if (registry->service_pool)
         _dbus_mem_pool_free (registry->service_pool);
       if (registry->owner_pool)
@@ -138,16 +156,166 @@ bus_registry_unref  (BusRegistry *registry)
     }
 }
 
+/* Gets N out of a unique name ":1.N" as the driver hands them out,
+ * which is what most messages are addressed to. Anything else, later
+ * majors included, is only in the string table.
+ */
+static dbus_bool_t
+parse_unique_name (const char *name,
+                   uintptr_t  *n)
+{
+  uintptr_t value;
+  const char *p;
+
+  if (name[0] != ':' || name[1] != '1' || name[2] != '.')
+    return FALSE;
+
+  p = name + 3;
+
+  /* only the spelling _dbus_string_append_int() gives */
+  if (*p == '\0' || (*p == '0' && p[1] != '\0'))
+    return FALSE;
+
+  value = 0;
+  for (; *p != '\0'; p++)
+    {
+      if (*p < '0' || *p > '9')
+        return FALSE;
+
+      value = value * 10 + (*p - '0');
+      if (value > _DBUS_INT_MAX)
+        return FALSE;
+    }
+
+  *n = value;
+  return TRUE;
+}
+
+/* unique_hash only speeds up lookups, so it may miss an entry, when
+ * there was no memory to add it, but never has one service_hash
+ * doesn't
+ */
+static void
+add_unique_name (BusRegistry *registry,
+                 BusService  *service)
+{
+  uintptr_t n;
+
+  if (parse_unique_name (service->name, &n))
+    _dbus_hash_table_insert_uintptr (registry->unique_hash, n, service);
+}
+
+static void
+remove_unique_name (BusRegistry *registry,
+                    BusService  *service)
+{
+  uintptr_t n;
+
+  if (parse_unique_name (service->name, &n) &&
+      _dbus_hash_table_lookup_uintptr (registry->unique_hash, n) == service)
+    _dbus_hash_table_remove_uintptr (registry->unique_hash, n);
+}
+
+static BusService*
+lookup_name (BusRegistry *registry,
+             const char  *name)
+{
+  BusService *service;
+  uintptr_t n;
+
+  if (parse_unique_name (name, &n))
+    {
+      service = _dbus_hash_table_lookup_uintptr (registry->unique_hash, n);
+      if (service != NULL)
+        return service;
+    }
+
+  return _dbus_hash_table_lookup_string (registry->service_hash, name);
+}
+
 BusService*
 bus_registry_lookup (BusRegistry      *registry,
                      const DBusString *service_name)
 {
-  BusService *service;
+  return lookup_name (registry, _dbus_string_get_const_data (service_name));
+}
 
-  service = _dbus_hash_table_lookup_string (registry->service_hash,
-                                            _dbus_string_get_const_data (service_name));
+static void
+bus_service_drop_owner_links (BusService *service)
+{
+  if (service->owner_links != NULL)
+    {
+      _dbus_hash_table_unref (service->owner_links);
+      service->owner_links = NULL;
+    }
+}
 
-  return service;
+static void
+bus_service_index_owners (BusService *service)
+{
+  DBusList *link;
+
+  _dbus_assert (service->owner_links == NULL);
+
+  service->owner_links = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL, NULL);
+  if (service->owner_links == NULL)
+    return;
+
+  link = _dbus_list_get_first_link (&service->owners);
+  while (link != NULL)
+    {
+      BusOwner *owner = link->data;
+
+      if (!_dbus_hash_table_insert_uintptr (service->owner_links,
+                                            (uintptr_t) owner->conn, link))
+        {
+          bus_service_drop_owner_links (service);
+          return;
+        }
+
+      link = _dbus_list_get_next_link (&service->owners, link);
+    }
+}
+
+/* Call after link was put in owners */
+static void
+bus_service_owner_link_added (BusService *service,
+                              DBusList   *link)
+{
+  BusOwner *owner = link->data;
+
+  service->n_owners += 1;
+
+  if (service->owner_links != NULL)
+    {
+      if (!_dbus_hash_table_insert_uintptr (service->owner_links,
+                                            (uintptr_t) owner->conn, link))
+        bus_service_drop_owner_links (service);
+    }
+  else if (service->n_owners >= MIN_OWNERS_FOR_HASH)
+    {
+      bus_service_index_owners (service);
+    }
+}
+
+/* Call after link was taken out of owners */
+static void
+bus_service_owner_link_removed (BusService *service,
+                                DBusList   *link)
+{
+  BusOwner *owner = link->data;
+
+  _dbus_assert (service->n_owners > 0);
+  service->n_owners -= 1;
+
+  if (service->owner_links != NULL)
+    {
+      if (service->n_owners == 0)
+        bus_service_drop_owner_links (service);
+      else
+        _dbus_hash_table_remove_uintptr (service->owner_links,
+                                         (uintptr_t) owner->conn);
+    }
 }
 
 static DBusList *
@@ -155,7 +323,11 @@ _bus_service_find_owner_link (BusService *service,
                               DBusConnection *connection)
 {
   DBusList *link;
-  
+
+  if (service->owner_links != NULL)
+    return _dbus_hash_table_lookup_uintptr (service->owner_links,
+                                            (uintptr_t) connection);
+
   link = _dbus_list_get_first_link (&service->owners);
 
   while (link != NULL)
@@ -193,6 +365,7 @@ bus_owner_new (BusService *service,
   result = _dbus_mem_pool_alloc (service->registry->owner_pool);
   if (result != NULL)
     {
+      _dbus_memory_account (DBUS_MEMORY_REGISTRY, sizeof (BusOwner));
       result->refcount = 1;
       /* don't ref the connection because we don't want
          to block the connection from going away.
@@ -206,6 +379,8 @@ bus_owner_new (BusService *service,
 
       if (!bus_connection_add_owned_service (conn, service))
         {
+          _dbus_memory_account (DBUS_MEMORY_REGISTRY,
+                                -(long) sizeof (BusOwner));
           _dbus_mem_pool_dealloc (service->registry->owner_pool, result);
           return NULL;
         }
@@ -233,6 +408,7 @@ bus_owner_unref  (BusOwner *owner)
   if (owner->refcount == 0)
     {
       bus_connection_remove_owned_service (owner->conn, owner->service);
+      _dbus_memory_account (DBUS_MEMORY_REGISTRY, -(long) sizeof (BusOwner));
       _dbus_mem_pool_dealloc (owner->service->registry->owner_pool, owner);
     }
 }
@@ -252,8 +428,7 @@ bus_registry_ensure (BusRegistry               *registry,
   _dbus_assert (owner_connection_if_created != NULL);
   _dbus_assert (transaction != NULL);
 
-  service = _dbus_hash_table_lookup_string (registry->service_hash,
-                                            _dbus_string_get_const_data (service_name));
+  service = lookup_name (registry, _dbus_string_get_const_data (service_name));
   if (service != NULL)
     return service;
   
@@ -264,20 +439,18 @@ bus_registry_ensure (BusRegistry               *registry,
       return NULL;
     }
 
+  _dbus_memory_account (DBUS_MEMORY_REGISTRY, sizeof (BusService));
   service->registry = registry;  
   service->refcount = 1;
 
-  _dbus_verbose ("copying string %p '%s' to service->name\n",
-                 service_name, _dbus_string_get_const_data (service_name));
-  if (!_dbus_string_copy_data (service_name, &service->name))
+  service->name = bus_intern_string (_dbus_string_get_const_data (service_name));
+  if (service->name == NULL)
     {
+      _dbus_memory_account (DBUS_MEMORY_REGISTRY, -(long) sizeof (BusService));
       _dbus_mem_pool_dealloc (registry->service_pool, service);
       BUS_SET_OOM (error);
       return NULL;
     }
-  _dbus_verbose ("copied string %p '%s' to '%s'\n",
-                 service_name, _dbus_string_get_const_data (service_name),
-                 service->name);
 
   if (!bus_driver_send_service_owner_changed (service->name, 
 					      NULL,
@@ -303,13 +476,15 @@ bus_registry_ensure (BusRegistry               *registry,
     }
   
   if (!_dbus_hash_table_insert_string (registry->service_hash,
-                                       service->name,
+                                       (char *) service->name,
                                        service))
     {
       /* The add_owner gets reverted on transaction cancel */
       BUS_SET_OOM (error);
       return NULL;
     }
+
+  add_unique_name (registry, service);
   
   return service;
 }
@@ -330,50 +505,6 @@ bus_registry_foreach (BusRegistry               *registry,
     }
 }
 
-dbus_bool_t
-bus_registry_list_services (BusRegistry *registry,
-                            char      ***listp,
-                            int         *array_len)
-{
-  int i, j, len;
-  char **retval;
-  DBusHashIter iter;
-   
-  len = _dbus_hash_table_get_n_entries (registry->service_hash);
-  retval = dbus_new (char *, len + 1);
-
-  if (retval == NULL)
-    return FALSE;
-
-  _dbus_hash_iter_init (registry->service_hash, &iter);
-  i = 0;
-  while (_dbus_hash_iter_next (&iter))
-    {
-      BusService *service = _dbus_hash_iter_get_value (&iter);
-
-      retval[i] = _dbus_strdup (service->name);
-      if (retval[i] == NULL)
-	goto error;
-
-      i++;
-    }
-
-  retval[i] = NULL;
-  
-  if (array_len)
-    *array_len = len;
-  
-  *listp = retval;
-  return TRUE;
-  
- error:
-  for (j = 0; j < i; j++)
-    dbus_free (retval[i]);
-  dbus_free (retval);
-
-  return FALSE;
-}
-
 dbus_bool_t
 bus_registry_acquire_service (BusRegistry      *registry,
                               DBusConnection   *connection,
@@ -538,6 +669,7 @@ bus_registry_acquire_service (BusRegistry      *registry,
       if (link != NULL)
         {
           _dbus_list_unlink (&service->owners, link);
+          bus_service_owner_link_removed (service, link);
           temp_owner = (BusOwner *)link->data;
           bus_owner_unref (temp_owner); 
           _dbus_list_free_link (link);
@@ -709,7 +841,14 @@ static void
 bus_service_unlink_owner (BusService      *service,
                           BusOwner        *owner)
 {
-  _dbus_list_remove_last (&service->owners, owner);
+  DBusList *link;
+
+  link = _bus_service_find_owner_link (service, owner->conn);
+  _dbus_assert (link != NULL && link->data == owner);
+
+  _dbus_list_unlink (&service->owners, link);
+  bus_service_owner_link_removed (service, link);
+  _dbus_list_free_link (link);
   bus_owner_unref (owner);
 }
 
@@ -724,6 +863,7 @@ bus_service_unlink (BusService *service)
    */
   _dbus_hash_table_remove_string (service->registry->service_hash,
                                   service->name);
+  remove_unique_name (service->registry, service);
   
   bus_service_unref (service);
 }
@@ -737,8 +877,9 @@ bus_service_relink (BusService           *service,
 
   _dbus_hash_table_insert_string_preallocated (service->registry->service_hash,
                                                preallocated,
-                                               service->name,
+                                               (char *) service->name,
                                                service);
+  add_unique_name (service->registry, service);
   
   bus_service_ref (service);
 }
@@ -842,27 +983,23 @@ bus_service_add_owner (BusService     *service,
         }
 
       bus_owner_set_flags (bus_owner, flags);
-      if (!(flags & DBUS_NAME_FLAG_REPLACE_EXISTING) || service->owners == NULL)
+
+      bus_owner_link = _dbus_list_alloc_link (bus_owner);
+      if (bus_owner_link == NULL)
         {
-          if (!_dbus_list_append (&service->owners,
-                                  bus_owner))
-            {
-              bus_owner_unref (bus_owner);
-              BUS_SET_OOM (error);
-              return FALSE;
-            }
+          bus_owner_unref (bus_owner);
+          BUS_SET_OOM (error);
+          return FALSE;
         }
+
+      if (!(flags & DBUS_NAME_FLAG_REPLACE_EXISTING) || service->owners == NULL)
+        _dbus_list_append_link (&service->owners, bus_owner_link);
       else
-        {
-          if (!_dbus_list_insert_after (&service->owners,
-                                         _dbus_list_get_first_link (&service->owners),
-                                         bus_owner))
-            {
-              bus_owner_unref (bus_owner);
-              BUS_SET_OOM (error);
-              return FALSE;
-            }
-        }      
+        _dbus_list_insert_after_link (&service->owners,
+                                      _dbus_list_get_first_link (&service->owners),
+                                      bus_owner_link);
+
+      bus_service_owner_link_added (service, bus_owner_link);
     } 
   else 
     {
@@ -903,7 +1040,6 @@ typedef struct
   BusService     *service;
   BusOwner       *before_owner; /* restore to position before this connection in owners list */
   DBusList       *owner_link;
-  DBusList       *service_link;
   DBusPreallocatedHash *hash_entry;
 } OwnershipRestoreData;
 
@@ -913,19 +1049,24 @@ restore_ownership (void *data)
   OwnershipRestoreData *d = data;
   DBusList *link;
 
-  _dbus_assert (d->service_link != NULL);
+  DBusList *swapped;
+
   _dbus_assert (d->owner_link != NULL);
-  
+  _dbus_assert (d->hash_entry != NULL);
+
   if (d->service->owners == NULL)
     {
-      _dbus_assert (d->hash_entry != NULL);
       bus_service_relink (d->service, d->hash_entry);
+      d->hash_entry = NULL;
     }
-  else
-    {
-      _dbus_assert (d->hash_entry == NULL);
-    }
-  
+
+  /* A swap leaves the owner in the queue; take it out to put it back
+   * where it was
+   */
+  swapped = _bus_service_find_owner_link (d->service, d->owner->conn);
+  if (swapped != NULL)
+    _dbus_list_unlink (&d->service->owners, swapped);
+
   /* We don't need to send messages notifying of these
    * changes, since we're reverting something that was
    * cancelled (effectively never really happened)
@@ -939,18 +1080,20 @@ restore_ownership (void *data)
       link = _dbus_list_get_next_link (&d->service->owners, link);
     }
   
-  _dbus_list_insert_before_link (&d->service->owners, link, d->owner_link);
+  if (swapped != NULL)
+    {
+      _dbus_list_insert_before_link (&d->service->owners, link, swapped);
+      return;
+    }
 
-  /* Note that removing then restoring this changes the order in which
-   * ServiceDeleted messages are sent on destruction of the
-   * connection.  This should be OK as the only guarantee there is
-   * that the base service is destroyed last, and we never even
-   * tentatively remove the base service.
+  /* The owners list takes a reference of its own, so the owner
+   * outlives ours; and since ours kept it alive all along, it never
+   * left the connection's services_owned, which must not get it twice.
    */
-  bus_connection_add_owned_service_link (d->owner->conn, d->service_link);
-  
-  d->hash_entry = NULL;
-  d->service_link = NULL;
+  _dbus_list_insert_before_link (&d->service->owners, link, d->owner_link);
+  bus_owner_ref (d->owner);
+  bus_service_owner_link_added (d->service, d->owner_link);
+
   d->owner_link = NULL;
 }
 
@@ -959,8 +1102,6 @@ free_ownership_restore_data (void *data)
 {
   OwnershipRestoreData *d = data;
 
-  if (d->service_link)
-    _dbus_list_free_link (d->service_link);
   if (d->owner_link)
     _dbus_list_free_link (d->owner_link);
   if (d->hash_entry)
@@ -988,7 +1129,6 @@ add_restore_ownership_to_transaction (BusTransaction *transaction,
   
   d->service = service;
   d->owner = owner;
-  d->service_link = _dbus_list_alloc_link (service);
   d->owner_link = _dbus_list_alloc_link (owner);
   d->hash_entry = _dbus_hash_table_preallocate_entry (service->registry->service_hash);
   
@@ -1013,8 +1153,7 @@ add_restore_ownership_to_transaction (BusTransaction *transaction,
       link = _dbus_list_get_next_link (&service->owners, link);
     }
   
-  if (d->service_link == NULL ||
-      d->owner_link == NULL ||
+  if (d->owner_link == NULL ||
       d->hash_entry == NULL ||
       !bus_transaction_add_cancel_hook (transaction, restore_ownership, d,
                                         free_ownership_restore_data))
@@ -1134,6 +1273,7 @@ bus_service_remove_owner (BusService     *service,
 
       link = _bus_service_find_owner_link (service, connection);
       _dbus_list_unlink (&service->owners, link);
+      bus_service_owner_link_removed (service, link);
       temp_owner = (BusOwner *)link->data;
       bus_owner_unref (temp_owner); 
       _dbus_list_free_link (link);
@@ -1214,8 +1354,10 @@ bus_service_unref (BusService *service)
   if (service->refcount == 0)
     {
       _dbus_assert (service->owners == NULL);
+      _dbus_assert (service->owner_links == NULL);
       
-      dbus_free (service->name);
+      bus_intern_unref (service->name);
+      _dbus_memory_account (DBUS_MEMORY_REGISTRY, -(long) sizeof (BusService));
       _dbus_mem_pool_dealloc (service->registry->service_pool, service);
     }
 }
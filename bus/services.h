@@ -47,9 +47,6 @@ BusService*  bus_registry_ensure          (BusRegistry                 *registry
 void         bus_registry_foreach         (BusRegistry                 *registry,
                                            BusServiceForeachFunction    function,
                                            void                        *data);
-dbus_bool_t  bus_registry_list_services   (BusRegistry                 *registry,
-                                           char                      ***listp,
-                                           int                         *array_len);
 dbus_bool_t  bus_registry_acquire_service (BusRegistry                 *registry,
                                            DBusConnection              *connection,
                                            const DBusString            *service_name,
@@ -23,9 +23,12 @@
 
 #include <config.h>
 #include "signals.h"
+#include "intern.h"
 #include "services.h"
 #include "utils.h"
 #include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-latency.h>
 
 struct BusMatchRule
 {
@@ -36,36 +39,70 @@ struct BusMatchRule
   unsigned int flags; /**< BusMatchFlags */
 
   int   message_type;
-  char *interface;
-  char *member;
-  char *sender;
-  char *destination;
-  char *path;
-
-  unsigned int *arg_lens;
-  char **args;
+  const char *interface;   /**< interned, like the four below */
+  const char *member;
+  const char *sender;
+  const char *destination;
+  const char *path;
+
+  const char **args;       /**< args_len values then NULL; NULL where unset */
+  unsigned int *arg_lens;  /**< their lengths, | BUS_MATCH_ARG_IS_PATH */
   int args_len;
+
+  dbus_uint32_t n_evaluations; /**< times the rule was checked against a message */
+  dbus_uint32_t n_matches;     /**< times it matched */
+  dbus_uint64_t usec_spent;    /**< time spent checking, if latency timing is on */
+
+  const char *key;    /**< canonical form, see match_rule_append_key() */
+  BusMatchRule *shape; /**< first added rule with this key, while added */
+  int n_additions;    /**< AddMatch calls this rule stands for */
+  int size;           /**< bytes in the block, for memory accounting */
+
+  DBusList link;          /**< in the matchmaker's list, while added */
+  DBusList owner_link;    /**< in the owner's list of rules, while added */
+  DBusList name_links[2]; /**< in the sender and destination name index */
 };
 
+/* A rule is a single allocation: the struct, then args and arg_lens,
+ * then the argument values and the key, each nul-terminated. The
+ * other strings are interned and the list links are built in, so
+ * adding a rule allocates nothing more than its hash table entries.
+ * Rules are put together in a MatchRuleDraft, whose args point
+ * into the rule text, and copied out with match_rule_new_from_draft().
+ */
+typedef struct
+{
+  BusMatchRule rule;
+  const char *args[DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER + 2];
+  unsigned int arg_lens[DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER + 2];
+} MatchRuleDraft;
+
 #define BUS_MATCH_ARG_IS_PATH  0x8000000u
 
-BusMatchRule*
-bus_match_rule_new (DBusConnection *matches_go_to)
+static void
+match_rule_draft_init (MatchRuleDraft *draft,
+                       DBusConnection *matches_go_to)
 {
-  BusMatchRule *rule;
-
-  rule = dbus_new0 (BusMatchRule, 1);
-  if (rule == NULL)
-    return NULL;
+  memset (draft, '\0', sizeof (MatchRuleDraft));
 
-  rule->refcount = 1;
-  rule->matches_go_to = matches_go_to;
+  draft->rule.refcount = 1;
+  draft->rule.matches_go_to = matches_go_to;
+  draft->rule.args = draft->args;
+  draft->rule.arg_lens = draft->arg_lens;
 
 #ifndef DBUS_BUILD_TESTS
-  _dbus_assert (rule->matches_go_to != NULL);
+  _dbus_assert (matches_go_to != NULL);
 #endif
-  
-  return rule;
+}
+
+static void
+match_rule_draft_clear (MatchRuleDraft *draft)
+{
+  bus_intern_unref (draft->rule.interface);
+  bus_intern_unref (draft->rule.member);
+  bus_intern_unref (draft->rule.sender);
+  bus_intern_unref (draft->rule.destination);
+  bus_intern_unref (draft->rule.path);
 }
 
 BusMatchRule *
@@ -86,52 +123,198 @@ bus_match_rule_unref (BusMatchRule *rule)
   rule->refcount -= 1;
   if (rule->refcount == 0)
     {
-      dbus_free (rule->interface);
-      dbus_free (rule->member);
-      dbus_free (rule->sender);
-      dbus_free (rule->destination);
-      dbus_free (rule->path);
-      dbus_free (rule->arg_lens);
+      bus_intern_unref (rule->interface);
+      bus_intern_unref (rule->member);
+      bus_intern_unref (rule->sender);
+      bus_intern_unref (rule->destination);
+      bus_intern_unref (rule->path);
 
-      /* can't use dbus_free_string_array() since there
-       * are embedded NULL
-       */
-      if (rule->args)
+      /* the arguments and key are in the same block */
+      _dbus_memory_account (DBUS_MEMORY_MATCH_RULES, -rule->size);
+      dbus_free (rule);
+    }
+}
+
+/* Unlike bus_match_rule_to_string(), every field is prefixed with its
+ * length, so two rules have the same key exactly when they're equal
+ * (apart from their owner, which the per-connection table takes care
+ * of).
+ */
+static dbus_bool_t
+match_rule_append_key (BusMatchRule *rule,
+                       DBusString   *str)
+{
+  int i;
+
+  if (!_dbus_string_append_printf (str, "%x", rule->flags))
+    return FALSE;
+
+  if ((rule->flags & BUS_MATCH_MESSAGE_TYPE) &&
+      !_dbus_string_append_printf (str, " t%d", rule->message_type))
+    return FALSE;
+
+#define APPEND_FIELD(flag, tag, field)                                  \
+  if ((rule->flags & (flag)) &&                                         \
+      (!_dbus_string_append_printf (str, " " tag "%lu:",                \
+                                    (unsigned long) strlen (field)) ||  \
+       !_dbus_string_append (str, (field))))                            \
+    return FALSE;
+
+  APPEND_FIELD (BUS_MATCH_INTERFACE, "i", rule->interface);
+  APPEND_FIELD (BUS_MATCH_MEMBER, "m", rule->member);
+  APPEND_FIELD (BUS_MATCH_SENDER, "s", rule->sender);
+  APPEND_FIELD (BUS_MATCH_DESTINATION, "d", rule->destination);
+  APPEND_FIELD (BUS_MATCH_PATH, "p", rule->path);
+
+#undef APPEND_FIELD
+
+  if (rule->flags & BUS_MATCH_ARGS)
+    {
+      if (!_dbus_string_append_printf (str, " n%d", rule->args_len))
+        return FALSE;
+
+      for (i = 0; i < rule->args_len; i++)
+        {
+          int length;
+
+          if (rule->args[i] == NULL)
+            continue;
+
+          length = rule->arg_lens[i] & ~BUS_MATCH_ARG_IS_PATH;
+
+          if (!_dbus_string_append_printf (str, " a%d/%x:", i,
+                                           rule->arg_lens[i]) ||
+              !_dbus_string_append_len (str, rule->args[i], length))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Copies the draft into a block of its own, taking over its interned
+ * strings on success. Returns NULL on OOM, leaving the draft as it was.
+ */
+static BusMatchRule *
+match_rule_new_from_draft (MatchRuleDraft *draft)
+{
+  BusMatchRule *rule;
+  DBusString key;
+  size_t size;
+  char *p;
+  int n_args;
+  int i;
+
+  if (!_dbus_string_init (&key))
+    return NULL;
+
+  if (!match_rule_append_key (&draft->rule, &key))
+    {
+      _dbus_string_free (&key);
+      return NULL;
+    }
+
+  n_args = draft->rule.args_len;
+
+  /* sizeof (BusMatchRule) keeps the pointers after it aligned */
+  size = sizeof (BusMatchRule) + _dbus_string_get_length (&key) + 1;
+  if (n_args > 0)
+    size += (n_args + 1) * (sizeof (char *) + sizeof (unsigned int));
+  for (i = 0; i < n_args; i++)
+    {
+      if (draft->args[i] != NULL)
+        size += (draft->arg_lens[i] & ~BUS_MATCH_ARG_IS_PATH) + 1;
+    }
+
+  rule = dbus_malloc (size);
+  if (rule == NULL)
+    {
+      _dbus_string_free (&key);
+      return NULL;
+    }
+
+  *rule = draft->rule;
+  p = (char *) (rule + 1);
+
+  if (n_args > 0)
+    {
+      rule->args = (const char **) p;
+      p += (n_args + 1) * sizeof (char *);
+      rule->arg_lens = (unsigned int *) p;
+      p += (n_args + 1) * sizeof (unsigned int);
+
+      for (i = 0; i < n_args; i++)
         {
-          int i;
+          rule->arg_lens[i] = draft->arg_lens[i];
+          rule->args[i] = NULL;
 
-          i = 0;
-          while (i < rule->args_len)
+          if (draft->args[i] != NULL)
             {
-              if (rule->args[i])
-                dbus_free (rule->args[i]);
-              ++i;
-            }
+              int length = draft->arg_lens[i] & ~BUS_MATCH_ARG_IS_PATH;
 
-          dbus_free (rule->args);
+              memcpy (p, draft->args[i], length);
+              p[length] = '\0';
+              rule->args[i] = p;
+              p += length + 1;
+            }
         }
-      
-      dbus_free (rule);
+
+      rule->args[n_args] = NULL;
+      rule->arg_lens[n_args] = 0;
+    }
+  else
+    {
+      rule->args = NULL;
+      rule->arg_lens = NULL;
     }
+
+  memcpy (p, _dbus_string_get_const_data (&key),
+          _dbus_string_get_length (&key) + 1);
+  rule->key = p;
+  _dbus_string_free (&key);
+
+  rule->size = size;
+  _dbus_memory_account (DBUS_MEMORY_MATCH_RULES, size);
+
+  rule->link.data = rule;
+  rule->owner_link.data = rule;
+  rule->name_links[0].data = rule;
+  rule->name_links[1].data = rule;
+
+  /* the interned strings are the rule's now */
+  draft->rule.interface = NULL;
+  draft->rule.member = NULL;
+  draft->rule.sender = NULL;
+  draft->rule.destination = NULL;
+  draft->rule.path = NULL;
+
+  return rule;
 }
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-/* Note this function does not do escaping, so it's only
- * good for debug spew at the moment
+const char*
+bus_match_rule_get_key (BusMatchRule *rule)
+{
+  return rule->key;
+}
+
+/* For the owning connection's list of its rules */
+DBusList*
+bus_match_rule_get_owner_link (BusMatchRule *rule)
+{
+  return &rule->owner_link;
+}
+
+/* Note this function does not do escaping, so it's only good for
+ * debug spew and statistics at the moment. Returns NULL on OOM.
  */
-static char*
-match_rule_to_string (BusMatchRule *rule)
+char*
+bus_match_rule_to_string (BusMatchRule *rule)
 {
   DBusString str;
   char *ret;
   
   if (!_dbus_string_init (&str))
-    {
-      char *s;
-      while ((s = _dbus_strdup ("nomem")) == NULL)
-        ; /* only OK for debug spew... */
-      return s;
-    }
+    return NULL;
   
   if (rule->flags & BUS_MATCH_MESSAGE_TYPE)
     {
@@ -240,16 +423,35 @@ match_rule_to_string (BusMatchRule *rule)
   
  nomem:
   _dbus_string_free (&str);
-  {
-    char *s;
-    while ((s = _dbus_strdup ("nomem")) == NULL)
-      ;  /* only OK for debug spew... */
-    return s;
-  }
+  return NULL;
+}
+
+void
+bus_match_rule_get_costs (BusMatchRule  *rule,
+                          dbus_uint32_t *n_evaluations,
+                          dbus_uint32_t *n_matches,
+                          dbus_uint64_t *usec_spent)
+{
+  *n_evaluations = rule->n_evaluations;
+  *n_matches = rule->n_matches;
+  *usec_spent = rule->usec_spent;
+}
+
+#ifdef DBUS_ENABLE_VERBOSE_MODE
+static char*
+match_rule_to_string (BusMatchRule *rule)
+{
+  char *s;
+
+  s = bus_match_rule_to_string (rule);
+  while (s == NULL)
+    s = _dbus_strdup ("nomem"); /* only OK for debug spew... */
+
+  return s;
 }
 #endif /* DBUS_ENABLE_VERBOSE_MODE */
 
-dbus_bool_t
+static dbus_bool_t
 bus_match_rule_set_message_type (BusMatchRule *rule,
                                  int           type)
 {
@@ -260,177 +462,121 @@ bus_match_rule_set_message_type (BusMatchRule *rule,
   return TRUE;
 }
 
-dbus_bool_t
+static dbus_bool_t
 bus_match_rule_set_interface (BusMatchRule *rule,
                               const char   *interface)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (interface != NULL);
 
-  new = _dbus_strdup (interface);
+  new = bus_intern_string (interface);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_INTERFACE;
-  dbus_free (rule->interface);
+  bus_intern_unref (rule->interface);
   rule->interface = new;
 
   return TRUE;
 }
 
-dbus_bool_t
+static dbus_bool_t
 bus_match_rule_set_member (BusMatchRule *rule,
                            const char   *member)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (member != NULL);
 
-  new = _dbus_strdup (member);
+  new = bus_intern_string (member);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_MEMBER;
-  dbus_free (rule->member);
+  bus_intern_unref (rule->member);
   rule->member = new;
 
   return TRUE;
 }
 
-dbus_bool_t
+static dbus_bool_t
 bus_match_rule_set_sender (BusMatchRule *rule,
                            const char   *sender)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (sender != NULL);
 
-  new = _dbus_strdup (sender);
+  new = bus_intern_string (sender);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_SENDER;
-  dbus_free (rule->sender);
+  bus_intern_unref (rule->sender);
   rule->sender = new;
 
   return TRUE;
 }
 
-dbus_bool_t
+static dbus_bool_t
 bus_match_rule_set_destination (BusMatchRule *rule,
                                 const char   *destination)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (destination != NULL);
 
-  new = _dbus_strdup (destination);
+  new = bus_intern_string (destination);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_DESTINATION;
-  dbus_free (rule->destination);
+  bus_intern_unref (rule->destination);
   rule->destination = new;
 
   return TRUE;
 }
 
-dbus_bool_t
+static dbus_bool_t
 bus_match_rule_set_path (BusMatchRule *rule,
                          const char   *path)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (path != NULL);
 
-  new = _dbus_strdup (path);
+  new = bus_intern_string (path);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_PATH;
-  dbus_free (rule->path);
+  bus_intern_unref (rule->path);
   rule->path = new;
 
   return TRUE;
 }
 
-dbus_bool_t
-bus_match_rule_set_arg (BusMatchRule     *rule,
-                        int                arg,
-                        const DBusString *value,
-                        dbus_bool_t       is_path)
+/* The value is not copied; it must last as long as the draft */
+static void
+match_rule_draft_set_arg (MatchRuleDraft   *draft,
+                          int               arg,
+                          const DBusString *value,
+                          dbus_bool_t       is_path)
 {
-  int length;
-  char *new;
-
   _dbus_assert (value != NULL);
+  _dbus_assert (arg <= DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER);
 
-  /* args_len is the number of args not including null termination
-   * in the char**
-   */
-  if (arg >= rule->args_len)
-    {
-      unsigned int *new_arg_lens;
-      char **new_args;
-      int new_args_len;
-      int i;
-
-      new_args_len = arg + 1;
-
-      /* add another + 1 here for null termination */
-      new_args = dbus_realloc (rule->args,
-                               sizeof (char *) * (new_args_len + 1));
-      if (new_args == NULL)
-        return FALSE;
-
-      /* NULL the new slots */
-      i = rule->args_len;
-      while (i <= new_args_len) /* <= for null termination */
-        {
-          new_args[i] = NULL;
-          ++i;
-        }
-      
-      rule->args = new_args;
-
-      /* and now add to the lengths */
-      new_arg_lens = dbus_realloc (rule->arg_lens,
-                                   sizeof (int) * (new_args_len + 1));
-
-      if (new_arg_lens == NULL)
-        return FALSE;
-
-      /* zero the new slots */
-      i = rule->args_len;
-      while (i <= new_args_len) /* <= for null termination */
-        {
-          new_arg_lens[i] = 0;
-          ++i;
-        }
-
-      rule->arg_lens = new_arg_lens;
-      rule->args_len = new_args_len;
-    }
-
-  length = _dbus_string_get_length (value);
-  if (!_dbus_string_copy_data (value, &new))
-    return FALSE;
-
-  rule->flags |= BUS_MATCH_ARGS;
+  draft->rule.flags |= BUS_MATCH_ARGS;
 
-  dbus_free (rule->args[arg]);
-  rule->arg_lens[arg] = length;
-  rule->args[arg] = new;
+  draft->args[arg] = _dbus_string_get_const_data (value);
+  draft->arg_lens[arg] = _dbus_string_get_length (value);
 
   if (is_path)
-    rule->arg_lens[arg] |= BUS_MATCH_ARG_IS_PATH;
-
-  /* NULL termination didn't get busted */
-  _dbus_assert (rule->args[rule->args_len] == NULL);
-  _dbus_assert (rule->arg_lens[rule->args_len] == 0);
+    draft->arg_lens[arg] |= BUS_MATCH_ARG_IS_PATH;
 
-  return TRUE;
+  if (arg >= draft->rule.args_len)
+    draft->rule.args_len = arg + 1;
 }
 
 #define ISWHITE(c) (((c) == ' ') || ((c) == '\t') || ((c) == '\n') || ((c) == '\r'))
@@ -715,7 +861,7 @@ tokenize_rule (const DBusString *rule_text,
 }
 
 static dbus_bool_t
-bus_match_rule_parse_arg_match (BusMatchRule     *rule,
+bus_match_rule_parse_arg_match (MatchRuleDraft   *draft,
                                 const char       *key,
                                 const DBusString *value,
                                 DBusError        *error)
@@ -770,20 +916,14 @@ bus_match_rule_parse_arg_match (BusMatchRule     *rule,
       goto failed;
     }
   
-  if ((rule->flags & BUS_MATCH_ARGS) &&
-      rule->args_len > (int) arg &&
-      rule->args[arg] != NULL)
+  if (draft->args[arg] != NULL)
     {
       dbus_set_error (error, DBUS_ERROR_MATCH_RULE_INVALID,
                       "Argument %d matched more than once in match rule\n", key);
       goto failed;
     }
   
-  if (!bus_match_rule_set_arg (rule, arg, value, is_path))
-    {
-      BUS_SET_OOM (error);
-      goto failed;
-    }
+  match_rule_draft_set_arg (draft, arg, value, is_path);
 
   return TRUE;
 
@@ -805,6 +945,7 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
                       const DBusString *rule_text,
                       DBusError        *error)
 {
+  MatchRuleDraft draft;
   BusMatchRule *rule;
   RuleToken tokens[MAX_RULE_TOKENS+1]; /* NULL termination + 1 */
   int i;
@@ -821,13 +962,9 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
     }
   
   memset (tokens, '\0', sizeof (tokens));
-  
-  rule = bus_match_rule_new (matches_go_to);
-  if (rule == NULL)
-    {
-      BUS_SET_OOM (error);
-      goto failed;
-    }
+
+  match_rule_draft_init (&draft, matches_go_to);
+  rule = &draft.rule;
   
   if (!tokenize_rule (rule_text, tokens, error))
     goto failed;
@@ -981,7 +1118,8 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
         }
       else if (strncmp (key, "arg", 3) == 0)
         {
-          if (!bus_match_rule_parse_arg_match (rule, key, &tmp_str, error))
+          /* the value stays in tokens[] until the rule is copied out */
+          if (!bus_match_rule_parse_arg_match (&draft, key, &tmp_str, error))
             goto failed;
         }
       else
@@ -994,19 +1132,22 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
 
       ++i;
     }
-  
+
+  rule = match_rule_new_from_draft (&draft);
+  if (rule == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
 
   goto out;
   
  failed:
   _DBUS_ASSERT_ERROR_IS_SET (error);
-  if (rule)
-    {
-      bus_match_rule_unref (rule);
-      rule = NULL;
-    }
+  rule = NULL;
 
  out:
+  match_rule_draft_clear (&draft);
   
   i = 0;
   while (tokens[i].key || tokens[i].value)
@@ -1020,16 +1161,47 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
   return rule;
 }
 
+/* Within a pool, rules are further split on the most selective field
+ * they constrain, so that a message is only tested against rules that
+ * could plausibly match it. Each rule lives on exactly one list.
+ */
+typedef enum
+{
+  RULE_INDEX_ARG0,
+  RULE_INDEX_PATH,
+  RULE_INDEX_SENDER,
+  RULE_INDEX_MEMBER,
+  RULE_INDEX_LAST
+} RuleIndex;
+
+typedef struct RuleSet RuleSet;
+struct RuleSet
+{
+  /* Maps an exact arg0, path, unique sender name or member to
+   * non-NULL (DBusList **)s; created on demand
+   */
+  DBusHashTable *rules_by_key[RULE_INDEX_LAST];
+
+  /* List of BusMatchRules which specify none of the indexed fields */
+  DBusList *rules_unindexed;
+};
+
 typedef struct RulePool RulePool;
 struct RulePool
 {
-  /* Maps non-NULL interface names to non-NULL (DBusList **)s */
+  /* Maps non-NULL interface names to non-NULL (RuleSet *)s */
   DBusHashTable *rules_by_iface;
 
-  /* List of BusMatchRules which don't specify an interface */
-  DBusList *rules_without_iface;
+  /* Rules which don't specify an interface */
+  RuleSet rules_without_iface;
 };
 
+/* Most broadcast signals on a busy bus are repeats (same sender, interface,
+ * member and path), so their recipients are remembered as long as no rule
+ * could have come out differently: see get_recipients_from_list().
+ */
+#define MAX_CACHED_RECIPIENT_SETS 64
+
 struct BusMatchmaker
 {
   int refcount;
@@ -1039,6 +1211,42 @@ struct BusMatchmaker
    * type.
    */
   RulePool rules_by_type[DBUS_NUM_MESSAGE_TYPES];
+
+  /* How many rules are in each of rules_by_type, so that messages no
+   * rule could be for (in practice, most method calls and replies)
+   * don't have to look at all
+   */
+  int n_rules_by_type[DBUS_NUM_MESSAGE_TYPES];
+
+  /* Maps "sender interface member path" of a broadcast signal to
+   * non-NULL (BusRecipients *)s of the connections it went to
+   */
+  DBusHashTable *recipient_cache;
+
+  /* Bumped whenever a rule is added or removed; recipient_cache is only
+   * valid while cache_generation matches it
+   */
+  unsigned int generation;
+  unsigned int cache_generation;
+
+  /* Maps a unique name to the (DBusList **) of rules naming it as
+   * sender or destination, so that disconnecting doesn't have to scan
+   * every rule on the bus. The lists don't hold references.
+   */
+  DBusHashTable *rules_by_name;
+
+  /* Maps the interned key of every added rule to the rule that was
+   * added first with that key, which is evaluated once per message on
+   * behalf of all the others. Those sit right after it on its list.
+   */
+  DBusHashTable *rules_by_shape;
+
+  /* What bus_matchmaker_get_summary() last returned, as of
+   * summary_generation
+   */
+  unsigned char summary[BUS_MATCH_SUMMARY_BYTES];
+  unsigned int summary_generation;
+  dbus_bool_t summary_valid;
 };
 
 static void
@@ -1046,11 +1254,11 @@ rule_list_free (DBusList **rules)
 {
   while (*rules != NULL)
     {
-      BusMatchRule *rule;
+      DBusList *link = *rules;
 
-      rule = (*rules)->data;
-      bus_match_rule_unref (rule);
-      _dbus_list_remove_link (rules, *rules);
+      /* the link is part of the rule */
+      _dbus_list_unlink (rules, link);
+      bus_match_rule_unref (link->data);
     }
 }
 
@@ -1067,54 +1275,271 @@ rule_list_ptr_free (DBusList **list)
     }
 }
 
-BusMatchmaker*
-bus_matchmaker_new (void)
+static void
+name_list_free (DBusList **list)
 {
-  BusMatchmaker *matchmaker;
-  int i;
-
-  matchmaker = dbus_new0 (BusMatchmaker, 1);
-  if (matchmaker == NULL)
-    return NULL;
-
-  matchmaker->refcount = 1;
-
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+  /* same NULL caveat as rule_list_ptr_free() */
+  if (list != NULL)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
-
-      p->rules_by_iface = _dbus_hash_table_new (DBUS_HASH_STRING,
-          dbus_free, (DBusFreeFunction) rule_list_ptr_free);
+      while (*list != NULL)
+        _dbus_list_unlink (list, *list);
+      dbus_free (list);
+    }
+}
 
-      if (p->rules_by_iface == NULL)
-        goto nomem;
+static void
+recipient_set_free (BusRecipients *set)
+{
+  /* same NULL caveat as rule_list_ptr_free(); the connections aren't
+   * ours, the cache is dropped before any of them can go away
+   */
+  if (set != NULL)
+    {
+      bus_recipients_free (set);
+      dbus_free (set);
     }
+}
 
-  return matchmaker;
+static void
+rule_set_clear (RuleSet *set)
+{
+  int i;
 
- nomem:
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+  for (i = 0; i < RULE_INDEX_LAST; i++)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
-
-      if (p->rules_by_iface == NULL)
-        break;
-      else
-        _dbus_hash_table_unref (p->rules_by_iface);
+      if (set->rules_by_key[i] != NULL)
+        {
+          _dbus_hash_table_unref (set->rules_by_key[i]);
+          set->rules_by_key[i] = NULL;
+        }
     }
 
-  return NULL;
+  rule_list_free (&set->rules_unindexed);
 }
 
-static DBusList **
-bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
-                          int            message_type,
-                          const char    *interface,
-                          dbus_bool_t    create)
+static void
+rule_set_free (RuleSet *set)
 {
-  RulePool *p;
-
-  _dbus_assert (message_type >= 0);
+  /* same NULL caveat as rule_list_ptr_free() */
+  if (set != NULL)
+    {
+      rule_set_clear (set);
+      dbus_free (set);
+    }
+}
+
+static dbus_bool_t
+rule_set_is_empty (RuleSet *set)
+{
+  int i;
+
+  if (set->rules_unindexed != NULL)
+    return FALSE;
+
+  for (i = 0; i < RULE_INDEX_LAST; i++)
+    {
+      if (set->rules_by_key[i] != NULL &&
+          _dbus_hash_table_get_n_entries (set->rules_by_key[i]) > 0)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Picks the list a rule belongs on. An exact arg0 comes first: it's
+ * what tells apart the many NameOwnerChanged subscriptions, which all
+ * share a sender and member. Only unique names are indexed by sender,
+ * because a well-known name can change owner while the rule is
+ * installed.
+ */
+static RuleIndex
+rule_get_index (BusMatchRule  *rule,
+                const char   **key_p)
+{
+  if ((rule->flags & BUS_MATCH_ARGS) && rule->args_len > 0 &&
+      rule->args[0] != NULL &&
+      (rule->arg_lens[0] & BUS_MATCH_ARG_IS_PATH) == 0)
+    {
+      *key_p = rule->args[0];
+      return RULE_INDEX_ARG0;
+    }
+
+  if (rule->flags & BUS_MATCH_PATH)
+    {
+      *key_p = rule->path;
+      return RULE_INDEX_PATH;
+    }
+
+  if ((rule->flags & BUS_MATCH_SENDER) && rule->sender[0] == ':')
+    {
+      *key_p = rule->sender;
+      return RULE_INDEX_SENDER;
+    }
+
+  if (rule->flags & BUS_MATCH_MEMBER)
+    {
+      *key_p = rule->member;
+      return RULE_INDEX_MEMBER;
+    }
+
+  *key_p = NULL;
+  return RULE_INDEX_LAST;
+}
+
+static DBusList **
+rule_set_get_list (RuleSet      *set,
+                   BusMatchRule *rule,
+                   dbus_bool_t   create)
+{
+  RuleIndex index;
+  const char *key;
+  DBusList **list;
+  const char *interned_key;
+
+  index = rule_get_index (rule, &key);
+
+  if (index == RULE_INDEX_LAST)
+    return &set->rules_unindexed;
+
+  if (set->rules_by_key[index] == NULL)
+    {
+      if (!create)
+        return NULL;
+
+      set->rules_by_key[index] = _dbus_hash_table_new (DBUS_HASH_STRING,
+          (DBusFreeFunction) bus_intern_unref,
+          (DBusFreeFunction) rule_list_ptr_free);
+
+      if (set->rules_by_key[index] == NULL)
+        return NULL;
+    }
+
+  list = _dbus_hash_table_lookup_string (set->rules_by_key[index], key);
+
+  if (list != NULL || !create)
+    return list;
+
+  list = dbus_new0 (DBusList *, 1);
+  if (list == NULL)
+    return NULL;
+
+  /* path, sender and member are interned already; arg0 is not */
+  interned_key = bus_intern_string (key);
+  if (interned_key == NULL)
+    {
+      dbus_free (list);
+      return NULL;
+    }
+
+  if (!_dbus_hash_table_insert_string (set->rules_by_key[index],
+                                       (char *) interned_key, list))
+    {
+      dbus_free (list);
+      bus_intern_unref (interned_key);
+      return NULL;
+    }
+
+  return list;
+}
+
+static void
+rule_set_gc_list (RuleSet      *set,
+                  BusMatchRule *rule,
+                  DBusList    **rules)
+{
+  RuleIndex index;
+  const char *key;
+
+  if (*rules != NULL)
+    return;
+
+  index = rule_get_index (rule, &key);
+
+  if (index == RULE_INDEX_LAST)
+    return;
+
+  _dbus_assert (_dbus_hash_table_lookup_string (set->rules_by_key[index], key)
+      == rules);
+
+  _dbus_hash_table_remove_string (set->rules_by_key[index], key);
+}
+
+BusMatchmaker*
+bus_matchmaker_new (void)
+{
+  BusMatchmaker *matchmaker;
+  int i;
+
+  matchmaker = dbus_new0 (BusMatchmaker, 1);
+  if (matchmaker == NULL)
+    return NULL;
+
+  matchmaker->refcount = 1;
+
+  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      RulePool *p = matchmaker->rules_by_type + i;
+
+      p->rules_by_iface = _dbus_hash_table_new (DBUS_HASH_STRING,
+          (DBusFreeFunction) bus_intern_unref,
+          (DBusFreeFunction) rule_set_free);
+
+      if (p->rules_by_iface == NULL)
+        goto nomem;
+    }
+
+  matchmaker->recipient_cache = _dbus_hash_table_new (DBUS_HASH_STRING,
+      dbus_free, (DBusFreeFunction) recipient_set_free);
+
+  if (matchmaker->recipient_cache == NULL)
+    goto nomem;
+
+  matchmaker->rules_by_name = _dbus_hash_table_new (DBUS_HASH_STRING,
+      (DBusFreeFunction) bus_intern_unref,
+      (DBusFreeFunction) name_list_free);
+
+  if (matchmaker->rules_by_name == NULL)
+    goto nomem;
+
+  matchmaker->rules_by_shape = _dbus_hash_table_new (DBUS_HASH_STRING,
+      (DBusFreeFunction) bus_intern_unref, NULL);
+
+  if (matchmaker->rules_by_shape == NULL)
+    goto nomem;
+
+  return matchmaker;
+
+ nomem:
+  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      RulePool *p = matchmaker->rules_by_type + i;
+
+      if (p->rules_by_iface == NULL)
+        break;
+      else
+        _dbus_hash_table_unref (p->rules_by_iface);
+    }
+
+  if (matchmaker->recipient_cache != NULL)
+    _dbus_hash_table_unref (matchmaker->recipient_cache);
+
+  if (matchmaker->rules_by_name != NULL)
+    _dbus_hash_table_unref (matchmaker->rules_by_name);
+
+  dbus_free (matchmaker);
+
+  return NULL;
+}
+
+static RuleSet *
+bus_matchmaker_get_rule_set (BusMatchmaker *matchmaker,
+                             int            message_type,
+                             const char    *interface,
+                             dbus_bool_t    create)
+{
+  RulePool *p;
+
+  _dbus_assert (message_type >= 0);
   _dbus_assert (message_type < DBUS_NUM_MESSAGE_TYPES);
 
   _dbus_verbose ("Looking up rules for message_type %d, interface %s\n",
@@ -1129,64 +1554,186 @@ bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
     }
   else
     {
-      DBusList **list;
+      RuleSet *set;
 
-      list = _dbus_hash_table_lookup_string (p->rules_by_iface, interface);
+      set = _dbus_hash_table_lookup_string (p->rules_by_iface, interface);
 
-      if (list == NULL && create)
+      if (set == NULL && create)
         {
-          char *dupped_interface;
-
-          list = dbus_new0 (DBusList *, 1);
-          if (list == NULL)
+          set = dbus_new0 (RuleSet, 1);
+          if (set == NULL)
             return NULL;
 
-          dupped_interface = _dbus_strdup (interface);
-          if (dupped_interface == NULL)
-            {
-              dbus_free (list);
-              return NULL;
-            }
-
-          _dbus_verbose ("Adding list for type %d, iface %s\n", message_type,
+          _dbus_verbose ("Adding rule set for type %d, iface %s\n", message_type,
                          interface);
 
+          /* only rules create sets, and their interface is interned */
           if (!_dbus_hash_table_insert_string (p->rules_by_iface,
-                                               dupped_interface, list))
+                                               (char *) bus_intern_ref (interface),
+                                               set))
             {
-              dbus_free (list);
-              dbus_free (dupped_interface);
+              dbus_free (set);
+              bus_intern_unref (interface);
               return NULL;
             }
         }
 
-      return list;
+      return set;
     }
 }
 
+static DBusList **
+bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
+                          BusMatchRule  *rule,
+                          dbus_bool_t    create)
+{
+  RuleSet *set;
+
+  set = bus_matchmaker_get_rule_set (matchmaker, rule->message_type,
+                                     rule->interface, create);
+
+  if (set == NULL)
+    return NULL;
+
+  return rule_set_get_list (set, rule, create);
+}
+
 static void
 bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
-                         int            message_type,
-                         const char    *interface,
+                         BusMatchRule  *rule,
                          DBusList     **rules)
 {
   RulePool *p;
+  RuleSet *set;
 
-  if (interface == NULL)
+  if (*rules != NULL)
     return;
 
-  if (*rules != NULL)
+  set = bus_matchmaker_get_rule_set (matchmaker, rule->message_type,
+                                     rule->interface, FALSE);
+  _dbus_assert (set != NULL);
+
+  rule_set_gc_list (set, rule, rules);
+
+  if (rule->interface == NULL)
+    return;
+
+  if (!rule_set_is_empty (set))
     return;
 
   _dbus_verbose ("GCing HT entry for message_type %u, interface %s\n",
-                 message_type, interface);
+                 rule->message_type, rule->interface);
 
-  p = matchmaker->rules_by_type + message_type;
+  p = matchmaker->rules_by_type + rule->message_type;
 
-  _dbus_assert (_dbus_hash_table_lookup_string (p->rules_by_iface, interface)
-      == rules);
+  _dbus_hash_table_remove_string (p->rules_by_iface, rule->interface);
+}
+
+/* The unique names a rule refers to, each at most once. Well-known
+ * names aren't indexed: they outlive any one owner.
+ */
+static void
+rule_get_referenced_names (BusMatchRule  *rule,
+                           const char   **sender_p,
+                           const char   **destination_p)
+{
+  *sender_p = NULL;
+  *destination_p = NULL;
+
+  if ((rule->flags & BUS_MATCH_SENDER) && rule->sender[0] == ':')
+    *sender_p = rule->sender;
+
+  if ((rule->flags & BUS_MATCH_DESTINATION) && rule->destination[0] == ':' &&
+      (*sender_p == NULL || strcmp (*sender_p, rule->destination) != 0))
+    *destination_p = rule->destination;
+}
+
+static dbus_bool_t
+name_index_add (BusMatchmaker *matchmaker,
+                const char    *name,
+                DBusList      *link)
+{
+  DBusList **list;
+
+  list = _dbus_hash_table_lookup_string (matchmaker->rules_by_name, name);
+
+  if (list == NULL)
+    {
+      list = dbus_new0 (DBusList *, 1);
+      if (list == NULL)
+        return FALSE;
+
+      /* name is the rule's own sender or destination, so interned */
+      if (!_dbus_hash_table_insert_string (matchmaker->rules_by_name,
+                                           (char *) bus_intern_ref (name),
+                                           list))
+        {
+          dbus_free (list);
+          bus_intern_unref (name);
+          return FALSE;
+        }
+    }
+
+  _dbus_list_append_link (list, link);
 
-  _dbus_hash_table_remove_string (p->rules_by_iface, interface);
+  return TRUE;
+}
+
+static void
+name_index_remove (BusMatchmaker *matchmaker,
+                   const char    *name,
+                   DBusList      *link)
+{
+  DBusList **list;
+
+  list = _dbus_hash_table_lookup_string (matchmaker->rules_by_name, name);
+
+  /* missing while bus_matchmaker_disconnected() is emptying it */
+  if (list == NULL)
+    return;
+
+  _dbus_list_unlink (list, link);
+
+  if (*list == NULL)
+    _dbus_hash_table_remove_string (matchmaker->rules_by_name, name);
+}
+
+static dbus_bool_t
+rule_index_by_name (BusMatchmaker *matchmaker,
+                    BusMatchRule  *rule)
+{
+  const char *sender, *destination;
+
+  rule_get_referenced_names (rule, &sender, &destination);
+
+  if (sender != NULL &&
+      !name_index_add (matchmaker, sender, &rule->name_links[0]))
+    return FALSE;
+
+  if (destination != NULL &&
+      !name_index_add (matchmaker, destination, &rule->name_links[1]))
+    {
+      if (sender != NULL)
+        name_index_remove (matchmaker, sender, &rule->name_links[0]);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+rule_unindex_by_name (BusMatchmaker *matchmaker,
+                      BusMatchRule  *rule)
+{
+  const char *sender, *destination;
+
+  rule_get_referenced_names (rule, &sender, &destination);
+
+  if (sender != NULL)
+    name_index_remove (matchmaker, sender, &rule->name_links[0]);
+
+  if (destination != NULL)
+    name_index_remove (matchmaker, destination, &rule->name_links[1]);
 }
 
 BusMatchmaker *
@@ -1214,44 +1761,144 @@ bus_matchmaker_unref (BusMatchmaker *matchmaker)
           RulePool *p = matchmaker->rules_by_type + i;
 
           _dbus_hash_table_unref (p->rules_by_iface);
-          rule_list_free (&p->rules_without_iface);
+          rule_set_clear (&p->rules_without_iface);
         }
 
+      _dbus_hash_table_unref (matchmaker->recipient_cache);
+      _dbus_hash_table_unref (matchmaker->rules_by_name);
+      _dbus_hash_table_unref (matchmaker->rules_by_shape);
+
       dbus_free (matchmaker);
     }
 }
 
-/* The rule can't be modified after it's added. */
+/* Puts the rule on its list next to the others with the same key, if
+ * any; otherwise at the end, as the one evaluated for its key.
+ */
+static dbus_bool_t
+rule_link_by_shape (BusMatchmaker *matchmaker,
+                    DBusList     **rules,
+                    BusMatchRule  *rule)
+{
+  BusMatchRule *shape;
+  const char *interned_key;
+
+  shape = _dbus_hash_table_lookup_string (matchmaker->rules_by_shape,
+                                          rule->key);
+  if (shape != NULL)
+    {
+      _dbus_list_insert_after_link (rules, &shape->link, &rule->link);
+      rule->shape = shape;
+      return TRUE;
+    }
+
+  interned_key = bus_intern_string (rule->key);
+  if (interned_key == NULL)
+    return FALSE;
+
+  if (!_dbus_hash_table_insert_string (matchmaker->rules_by_shape,
+                                       (char *) interned_key, rule))
+    {
+      bus_intern_unref (interned_key);
+      return FALSE;
+    }
+
+  _dbus_list_append_link (rules, &rule->link);
+  rule->shape = rule;
+  return TRUE;
+}
+
+/* Takes the rule off its list. If it was the one evaluated for its key,
+ * the next with the same key takes over.
+ */
+static void
+rule_unlink_by_shape (BusMatchmaker *matchmaker,
+                      DBusList     **rules,
+                      BusMatchRule  *rule)
+{
+  DBusList *link;
+  BusMatchRule *successor;
+  DBusHashIter iter;
+
+  if (rule->shape != rule)
+    {
+      _dbus_list_unlink (rules, &rule->link);
+      rule->shape = NULL;
+      return;
+    }
+
+  link = _dbus_list_get_next_link (rules, &rule->link);
+  _dbus_list_unlink (rules, &rule->link);
+  rule->shape = NULL;
+
+  if (link == NULL || ((BusMatchRule *) link->data)->shape != rule)
+    {
+      _dbus_hash_table_remove_string (matchmaker->rules_by_shape, rule->key);
+      return;
+    }
+
+  successor = link->data;
+  for (; link != NULL && ((BusMatchRule *) link->data)->shape == rule;
+       link = _dbus_list_get_next_link (rules, link))
+    ((BusMatchRule *) link->data)->shape = successor;
+
+  if (!_dbus_hash_iter_lookup (matchmaker->rules_by_shape, (char *) rule->key,
+                               FALSE, &iter))
+    _dbus_assert_not_reached ("rule shape was not indexed");
+  _dbus_hash_iter_set_value (&iter, successor);
+}
+
+/* The rule can't be modified after it's added. If the connection
+ * already has an equal rule, that one just counts one more addition.
+ */
 dbus_bool_t
 bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
                          BusMatchRule    *rule)
 {
   DBusList **rules;
+  BusMatchRule *existing;
 
   _dbus_assert (bus_connection_is_active (rule->matches_go_to));
+  _dbus_assert (rule->n_additions == 0); /* its links are free */
 
   _dbus_verbose ("Adding rule with message_type %d, interface %s\n",
                  rule->message_type,
                  rule->interface != NULL ? rule->interface : "<null>");
 
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, TRUE);
+  existing = bus_connection_lookup_match_rule (rule->matches_go_to,
+                                               rule->key);
+  if (existing != NULL)
+    {
+      existing->n_additions += 1;
+      _dbus_verbose ("Rule already added, now %d times\n",
+                     existing->n_additions);
+      return TRUE;
+    }
+
+  rules = bus_matchmaker_get_rules (matchmaker, rule, TRUE);
 
   if (rules == NULL)
     return FALSE;
 
-  if (!_dbus_list_append (rules, rule))
-    return FALSE;
+  if (!rule_link_by_shape (matchmaker, rules, rule))
+    {
+      bus_matchmaker_gc_rules (matchmaker, rule, rules);
+      return FALSE;
+    }
+
+  if (!rule_index_by_name (matchmaker, rule))
+    goto failed;
 
   if (!bus_connection_add_match_rule (rule->matches_go_to, rule))
     {
-      _dbus_list_remove_last (rules, rule);
-      bus_matchmaker_gc_rules (matchmaker, rule->message_type,
-                               rule->interface, rules);
-      return FALSE;
+      rule_unindex_by_name (matchmaker, rule);
+      goto failed;
     }
 
   bus_match_rule_ref (rule);
+  rule->n_additions = 1;
+  matchmaker->generation += 1;
+  matchmaker->n_rules_by_type[rule->message_type] += 1;
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
@@ -1264,8 +1911,14 @@ bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
 #endif
   
   return TRUE;
+
+ failed:
+  rule_unlink_by_shape (matchmaker, rules, rule);
+  bus_matchmaker_gc_rules (matchmaker, rule, rules);
+  return FALSE;
 }
 
+#ifdef DBUS_BUILD_TESTS
 static dbus_bool_t
 match_rule_equal (BusMatchRule *a,
                   BusMatchRule *b)
@@ -1281,23 +1934,23 @@ match_rule_equal (BusMatchRule *a,
     return FALSE;
 
   if ((a->flags & BUS_MATCH_MEMBER) &&
-      strcmp (a->member, b->member) != 0)
+      a->member != b->member)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_PATH) &&
-      strcmp (a->path, b->path) != 0)
+      a->path != b->path)
     return FALSE;
   
   if ((a->flags & BUS_MATCH_INTERFACE) &&
-      strcmp (a->interface, b->interface) != 0)
+      a->interface != b->interface)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_SENDER) &&
-      strcmp (a->sender, b->sender) != 0)
+      a->sender != b->sender)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_DESTINATION) &&
-      strcmp (a->destination, b->destination) != 0)
+      a->destination != b->destination)
     return FALSE;
 
   if (a->flags & BUS_MATCH_ARGS)
@@ -1333,32 +1986,12 @@ match_rule_equal (BusMatchRule *a,
   
   return TRUE;
 }
+#endif /* DBUS_BUILD_TESTS */
 
+/* Takes the rule out of the matchmaker however many times it was added */
 static void
-bus_matchmaker_remove_rule_link (DBusList       **rules,
-                                 DBusList        *link)
-{
-  BusMatchRule *rule = link->data;
-  
-  bus_connection_remove_match_rule (rule->matches_go_to, rule);
-  _dbus_list_remove_link (rules, link);
-
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-  {
-    char *s = match_rule_to_string (rule);
-
-    _dbus_verbose ("Removed match rule %s for connection %p\n",
-                   s, rule->matches_go_to);
-    dbus_free (s);
-  }
-#endif
-  
-  bus_match_rule_unref (rule);  
-}
-
-void
-bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
-                            BusMatchRule    *rule)
+bus_matchmaker_drop_rule (BusMatchmaker   *matchmaker,
+                          BusMatchRule    *rule)
 {
   DBusList **rules;
 
@@ -1367,18 +2000,16 @@ bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
                  rule->interface != NULL ? rule->interface : "<null>");
 
   bus_connection_remove_match_rule (rule->matches_go_to, rule);
+  rule_unindex_by_name (matchmaker, rule);
 
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, FALSE);
-
-  /* We should only be asked to remove a rule by identity right after it was
-   * added, so there should be a list for it.
-   */
+  rules = bus_matchmaker_get_rules (matchmaker, rule, FALSE);
   _dbus_assert (rules != NULL);
 
-  _dbus_list_remove (rules, rule);
-  bus_matchmaker_gc_rules (matchmaker, rule->message_type, rule->interface,
-      rules);
+  rule_unlink_by_shape (matchmaker, rules, rule);
+  bus_matchmaker_gc_rules (matchmaker, rule, rules);
+  matchmaker->generation += 1;
+  matchmaker->n_rules_by_type[rule->message_type] -= 1;
+  _dbus_assert (matchmaker->n_rules_by_type[rule->message_type] >= 0);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
@@ -1393,141 +2024,121 @@ bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
   bus_match_rule_unref (rule);
 }
 
+/* Undoes one bus_matchmaker_add_rule() of this rule or an equal one */
+void
+bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
+                            BusMatchRule    *rule)
+{
+  BusMatchRule *added;
+
+  /* We should only be asked to remove a rule by identity right after it was
+   * added, so its key was computed and there is a rule for it.
+   */
+  added = bus_connection_lookup_match_rule (rule->matches_go_to,
+                                            bus_match_rule_get_key (rule));
+  _dbus_assert (added != NULL);
+
+  added->n_additions -= 1;
+  if (added->n_additions == 0)
+    bus_matchmaker_drop_rule (matchmaker, added);
+}
+
 /* Remove a single rule which is equal to the given rule by value */
 dbus_bool_t
 bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
                                      BusMatchRule    *value,
                                      DBusError       *error)
 {
-  DBusList **rules;
-  DBusList *link = NULL;
-
-  _dbus_verbose ("Removing rule by value with message_type %d, interface %s\n",
-                 value->message_type,
-                 value->interface != NULL ? value->interface : "<null>");
-
-  rules = bus_matchmaker_get_rules (matchmaker, value->message_type,
-      value->interface, FALSE);
-
-  if (rules != NULL)
-    {
-      /* we traverse backward because bus_connection_remove_match_rule()
-       * removes the most-recently-added rule
-       */
-      link = _dbus_list_get_last_link (rules);
-      while (link != NULL)
-        {
-          BusMatchRule *rule;
-          DBusList *prev;
-
-          rule = link->data;
-          prev = _dbus_list_get_prev_link (rules, link);
+  BusMatchRule *rule;
 
-          if (match_rule_equal (rule, value))
-            {
-              bus_matchmaker_remove_rule_link (rules, link);
-              break;
-            }
+  _dbus_verbose ("Removing rule by value with message_type %d, interface %s\n",
+                 value->message_type,
+                 value->interface != NULL ? value->interface : "<null>");
 
-          link = prev;
-        }
-    }
+  rule = bus_connection_lookup_match_rule (value->matches_go_to, value->key);
 
-  if (link == NULL)
+  if (rule == NULL)
     {
       dbus_set_error (error, DBUS_ERROR_MATCH_RULE_NOT_FOUND,
                       "The given match rule wasn't found and can't be removed");
       return FALSE;
     }
 
-  bus_matchmaker_gc_rules (matchmaker, value->message_type, value->interface,
-      rules);
+  rule->n_additions -= 1;
+  if (rule->n_additions == 0)
+    bus_matchmaker_drop_rule (matchmaker, rule);
 
   return TRUE;
 }
 
-static void
-rule_list_remove_by_connection (DBusList       **rules,
-                                DBusConnection  *connection)
+/* How many times a rule equal to the given one can still be removed */
+int
+bus_matchmaker_get_n_additions (BusMatchmaker   *matchmaker,
+                                BusMatchRule    *value)
 {
-  DBusList *link;
-
-  link = _dbus_list_get_first_link (rules);
-  while (link != NULL)
-    {
-      BusMatchRule *rule;
-      DBusList *next;
-
-      rule = link->data;
-      next = _dbus_list_get_next_link (rules, link);
+  BusMatchRule *rule;
 
-      if (rule->matches_go_to == connection)
-        {
-          bus_matchmaker_remove_rule_link (rules, link);
-        }
-      else if (((rule->flags & BUS_MATCH_SENDER) && *rule->sender == ':') ||
-               ((rule->flags & BUS_MATCH_DESTINATION) && *rule->destination == ':'))
-        {
-          /* The rule matches to/from a base service, see if it's the
-           * one being disconnected, since we know this service name
-           * will never be recycled.
-           */
-          const char *name;
-
-          name = bus_connection_get_name (connection);
-          _dbus_assert (name != NULL); /* because we're an active connection */
-
-          if (((rule->flags & BUS_MATCH_SENDER) &&
-               strcmp (rule->sender, name) == 0) ||
-              ((rule->flags & BUS_MATCH_DESTINATION) &&
-               strcmp (rule->destination, name) == 0))
-            {
-              bus_matchmaker_remove_rule_link (rules, link);
-            }
-        }
+  rule = bus_connection_lookup_match_rule (value->matches_go_to, value->key);
 
-      link = next;
-    }
+  return rule != NULL ? rule->n_additions : 0;
 }
 
 void
 bus_matchmaker_disconnected (BusMatchmaker   *matchmaker,
                              DBusConnection  *connection)
 {
-  int i;
-
-  /* FIXME
-   *
-   * This scans all match rules on the bus. We could avoid that
-   * for the rules belonging to the connection, since we keep
-   * a list of those; but for the rules that just refer to
-   * the connection we'd need to do something more elaborate.
-   */
+  DBusList **owned;
+  DBusList **naming;
+  DBusList *referring;
+  BusMatchRule *rule;
+  const char *name;
 
   _dbus_assert (bus_connection_is_active (connection));
 
   _dbus_verbose ("Removing all rules for connection %p\n", connection);
 
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
-    {
-      RulePool *p = matchmaker->rules_by_type + i;
-      DBusHashIter iter;
+  /* Our own rules */
+  owned = bus_connection_get_match_rules (connection);
+  while ((rule = _dbus_list_get_last (owned)) != NULL)
+    bus_matchmaker_drop_rule (matchmaker, rule);
+
+  /* Other connections' rules on our unique name, which will never be
+   * recycled so they can't match anything again. The index entry is
+   * detached first so that dropping each rule leaves it alone.
+   */
+  name = bus_connection_get_name (connection);
+  _dbus_assert (name != NULL); /* because we're an active connection */
 
-      rule_list_remove_by_connection (&p->rules_without_iface, connection);
+  naming = _dbus_hash_table_lookup_string (matchmaker->rules_by_name, name);
+  if (naming != NULL)
+    {
+      referring = *naming;
+      *naming = NULL;
+      _dbus_hash_table_remove_string (matchmaker->rules_by_name, name);
 
-      _dbus_hash_iter_init (p->rules_by_iface, &iter);
-      while (_dbus_hash_iter_next (&iter))
+      while (referring != NULL)
         {
-          DBusList **items = _dbus_hash_iter_get_value (&iter);
+          DBusList *link = referring;
 
-          rule_list_remove_by_connection (items, connection);
-
-          if (*items == NULL)
-            _dbus_hash_iter_remove_entry (&iter);
+          _dbus_list_unlink (&referring, link);
+          bus_matchmaker_drop_rule (matchmaker, link->data);
         }
     }
+
+  /* Dropping a rule already bumped the generation. Without any, the
+   * cached recipient sets stay good: only rules put a connection into
+   * them. When many clients go away at once, which is when the same
+   * NameOwnerChanged goes out over and over, that spares a full match
+   * for each one.
+   */
 }
 
+/* Connections rarely hold more than a few names, and a rule on a
+ * well-known sender is tested against every broadcast, so walking the
+ * connection's own names beats hashing service_name into the registry.
+ */
+#define MAX_OWNED_NAMES_TO_SCAN 8
+
 static dbus_bool_t
 connection_is_primary_owner (DBusConnection *connection,
                              const char     *service_name)
@@ -1537,6 +2148,26 @@ connection_is_primary_owner (DBusConnection *connection,
   BusRegistry *registry;
 
   _dbus_assert (connection != NULL);
+
+  if (bus_connection_get_n_services_owned (connection) <= MAX_OWNED_NAMES_TO_SCAN)
+    {
+      DBusList **owned;
+      DBusList *link;
+
+      owned = bus_connection_get_services_owned (connection);
+
+      for (link = _dbus_list_get_first_link (owned);
+           link != NULL;
+           link = _dbus_list_get_next_link (owned, link))
+        {
+          service = link->data;
+
+          if (strcmp (bus_service_get_name (service), service_name) == 0)
+            return bus_service_get_primary_owners_connection (service) == connection;
+        }
+
+      return FALSE;
+    }
   
   registry = bus_connection_get_registry (connection);
 
@@ -1549,11 +2180,86 @@ connection_is_primary_owner (DBusConnection *connection,
   return bus_service_get_primary_owners_connection (service) == connection;
 }
 
+/* The string arguments of the message being matched, which every rule
+ * with argN or argNpath keys shares. Filled in by the first such rule,
+ * so messages that no such rule reaches are never walked at all.
+ *
+ * Likewise the interned copies of the message's interface, member and
+ * path, which let rules compare those by pointer. A field is NULL when
+ * the message lacks it or no rule names that string.
+ */
+typedef struct
+{
+  dbus_bool_t walked;
+  int n_args;   /**< arguments seen, up to the last one a rule can name */
+  const char *values[DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER + 1]; /**< NULL if not a string */
+  int lengths[DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER + 1];
+
+  dbus_bool_t interned;
+  const char *interface;
+  const char *member;
+  const char *path;
+} MessageArgs;
+
+static void
+message_args_init (MessageArgs *args)
+{
+  args->walked = FALSE;
+  args->n_args = 0;
+  args->interned = FALSE;
+}
+
+static void
+message_args_intern (MessageArgs *args,
+                     DBusMessage *message)
+{
+  args->interface = bus_intern_lookup (dbus_message_get_interface (message));
+  args->member = bus_intern_lookup (dbus_message_get_member (message));
+  args->path = bus_intern_lookup (dbus_message_get_path (message));
+  args->interned = TRUE;
+}
+
+static void
+message_args_walk (MessageArgs *args,
+                   DBusMessage *message)
+{
+  DBusMessageIter iter;
+  int current_type;
+
+  /* only strings are compared, which read fine in either byte
+   * order, so don't swap a message we're just forwarding
+   */
+  _dbus_message_iter_init_unswapped (message, &iter);
+
+  args->n_args = 0;
+  while (args->n_args <= DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER &&
+         (current_type = dbus_message_iter_get_arg_type (&iter)) != DBUS_TYPE_INVALID)
+    {
+      const char *value;
+
+      value = NULL;
+      if (current_type == DBUS_TYPE_STRING)
+        {
+          dbus_message_iter_get_basic (&iter, &value);
+          _dbus_assert (value != NULL);
+          args->lengths[args->n_args] = strlen (value);
+        }
+
+      args->values[args->n_args] = value;
+      args->n_args += 1;
+
+      dbus_message_iter_next (&iter);
+    }
+
+  args->walked = TRUE;
+}
+
 static dbus_bool_t
 match_rule_matches (BusMatchRule    *rule,
                     DBusConnection  *sender,
                     DBusConnection  *addressed_recipient,
                     DBusMessage     *message,
+                    MessageArgs     *args,
                     BusMatchFlags    already_matched)
 {
   int flags;
@@ -1578,31 +2284,23 @@ match_rule_matches (BusMatchRule    *rule,
         return FALSE;
     }
 
+  if ((flags & (BUS_MATCH_INTERFACE | BUS_MATCH_MEMBER | BUS_MATCH_PATH)) &&
+      !args->interned)
+    message_args_intern (args, message);
+
   if (flags & BUS_MATCH_INTERFACE)
     {
-      const char *iface;
-
       _dbus_assert (rule->interface != NULL);
 
-      iface = dbus_message_get_interface (message);
-      if (iface == NULL)
-        return FALSE;
-
-      if (strcmp (iface, rule->interface) != 0)
+      if (args->interface != rule->interface)
         return FALSE;
     }
 
   if (flags & BUS_MATCH_MEMBER)
     {
-      const char *member;
-
       _dbus_assert (rule->member != NULL);
 
-      member = dbus_message_get_member (message);
-      if (member == NULL)
-        return FALSE;
-
-      if (strcmp (member, rule->member) != 0)
+      if (args->member != rule->member)
         return FALSE;
     }
 
@@ -1648,141 +2346,433 @@ match_rule_matches (BusMatchRule    *rule,
 
   if (flags & BUS_MATCH_PATH)
     {
-      const char *path;
-
       _dbus_assert (rule->path != NULL);
 
-      path = dbus_message_get_path (message);
-      if (path == NULL)
-        return FALSE;
-
-      if (strcmp (path, rule->path) != 0)
+      if (args->path != rule->path)
         return FALSE;
     }
 
   if (flags & BUS_MATCH_ARGS)
     {
       int i;
-      DBusMessageIter iter;
       
       _dbus_assert (rule->args != NULL);
 
-      dbus_message_iter_init (message, &iter);
-      
-      i = 0;
-      while (i < rule->args_len)
+      if (!args->walked)
+        message_args_walk (args, message);
+
+      for (i = 0; i < rule->args_len; i++)
         {
-          int current_type;
           const char *expected_arg;
           int expected_length;
+          const char *actual_arg;
+          int actual_length;
           dbus_bool_t is_path;
 
           expected_arg = rule->args[i];
+          if (expected_arg == NULL)
+            continue;
+
           expected_length = rule->arg_lens[i] & ~BUS_MATCH_ARG_IS_PATH;
           is_path = (rule->arg_lens[i] & BUS_MATCH_ARG_IS_PATH) != 0;
-          
-          current_type = dbus_message_iter_get_arg_type (&iter);
 
-          if (expected_arg != NULL)
+          if (i >= args->n_args || args->values[i] == NULL)
+            return FALSE;
+
+          actual_arg = args->values[i];
+          actual_length = args->lengths[i];
+
+          if (is_path)
             {
-              const char *actual_arg;
-              int actual_length;
-              
-              if (current_type != DBUS_TYPE_STRING)
+              if (actual_length < expected_length &&
+                  actual_arg[actual_length - 1] != '/')
                 return FALSE;
 
-              actual_arg = NULL;
-              dbus_message_iter_get_basic (&iter, &actual_arg);
-              _dbus_assert (actual_arg != NULL);
+              if (expected_length < actual_length &&
+                  expected_arg[expected_length - 1] != '/')
+                return FALSE;
 
-              actual_length = strlen (actual_arg);
+              if (memcmp (actual_arg, expected_arg,
+                          MIN (actual_length, expected_length)) != 0)
+                return FALSE;
+            }
+          else
+            {
+              if (expected_length != actual_length ||
+                  memcmp (expected_arg, actual_arg, expected_length) != 0)
+                return FALSE;
+            }
+        }
+    }
+  
+  return TRUE;
+}
 
-              if (is_path)
-                {
-                  if (actual_length < expected_length &&
-                      actual_arg[actual_length - 1] != '/')
-                    return FALSE;
+/* For matching outside the matchmaker, one message at a time */
+dbus_bool_t
+bus_match_rule_matches_message (BusMatchRule   *rule,
+                                DBusConnection *sender,
+                                DBusConnection *addressed_recipient,
+                                DBusMessage    *message)
+{
+  MessageArgs args;
 
-                  if (expected_length < actual_length &&
-                      expected_arg[expected_length - 1] != '/')
-                    return FALSE;
+  message_args_init (&args);
 
-                  if (memcmp (actual_arg, expected_arg,
-                              MIN (actual_length, expected_length)) != 0)
-                    return FALSE;
-                }
-              else
-                {
-                  if (expected_length != actual_length ||
-                      memcmp (expected_arg, actual_arg, expected_length) != 0)
-                    return FALSE;
-                }
+  return match_rule_matches (rule, sender, addressed_recipient, message,
+                             &args, 0);
+}
 
-            }
-          
-          if (current_type != DBUS_TYPE_INVALID)
-            dbus_message_iter_next (&iter);
+/* Whether the rule matches a broadcast signal based on nothing but its
+ * sender, interface, member and path. Arguments are in the body, and
+ * a well-known sender name can change owner at any time.
+ */
+static dbus_bool_t
+match_rule_is_cacheable (BusMatchRule   *rule,
+                         DBusConnection *sender)
+{
+  if (rule->flags & BUS_MATCH_ARGS)
+    return FALSE;
+
+  if ((rule->flags & BUS_MATCH_SENDER) && sender != NULL &&
+      rule->sender[0] != ':')
+    return FALSE;
+
+  return TRUE;
+}
+
+void
+bus_recipients_init (BusRecipients *recipients)
+{
+  recipients->connections = NULL;
+  recipients->n_connections = 0;
+  recipients->n_allocated = 0;
+}
+
+static dbus_bool_t
+bus_recipients_reserve (BusRecipients *recipients,
+                        int            n_connections)
+{
+  DBusConnection **connections;
+  int n_allocated;
+
+  if (n_connections <= recipients->n_allocated)
+    return TRUE;
+
+  n_allocated = MAX (recipients->n_allocated * 2, 8);
+  while (n_allocated < n_connections)
+    n_allocated *= 2;
+
+  connections = dbus_realloc (recipients->connections,
+                              n_allocated * sizeof (DBusConnection *));
+  if (connections == NULL)
+    return FALSE;
+
+  recipients->connections = connections;
+  recipients->n_allocated = n_allocated;
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_recipients_append (BusRecipients  *recipients,
+                       DBusConnection *connection)
+{
+  if (!bus_recipients_reserve (recipients, recipients->n_connections + 1))
+    return FALSE;
+
+  recipients->connections[recipients->n_connections] = connection;
+  recipients->n_connections += 1;
+
+  return TRUE;
+}
+
+/* Replaces the contents of dest with those of src */
+static dbus_bool_t
+bus_recipients_copy (BusRecipients       *dest,
+                     const BusRecipients *src)
+{
+  int i;
+
+  if (!bus_recipients_reserve (dest, src->n_connections))
+    return FALSE;
+
+  for (i = 0; i < src->n_connections; i++)
+    dest->connections[i] = src->connections[i];
+  dest->n_connections = src->n_connections;
 
-          ++i;
-        }
-    }
-  
   return TRUE;
 }
 
+void
+bus_recipients_free (BusRecipients *recipients)
+{
+  dbus_free (recipients->connections);
+  bus_recipients_init (recipients);
+}
+
 static dbus_bool_t
 get_recipients_from_list (DBusList       **rules,
                           DBusConnection  *sender,
                           DBusConnection  *addressed_recipient,
                           DBusMessage     *message,
-                          DBusList       **recipients_p)
+                          MessageArgs     *args,
+                          BusMatchFlags    already_matched,
+                          BusRecipients   *recipients,
+                          dbus_bool_t     *cacheable_p)
 {
   DBusList *link;
+  DBusLatencyStart start;
+  BusMatchRule *shape;
+  dbus_bool_t evaluated;
+  dbus_bool_t matched;
 
   if (rules == NULL)
     return TRUE;
 
+  /* Rules with the same key come one after the other, and whether they
+   * match doesn't depend on who owns them, so each run is evaluated
+   * at most once. Rules whose owner is getting the message anyway
+   * needn't be evaluated at all.
+   */
+  shape = NULL;
+  evaluated = FALSE;
+  matched = FALSE;
+
   link = _dbus_list_get_first_link (rules);
   while (link != NULL)
     {
-      BusMatchRule *rule;
+      BusMatchRule *rule;
+
+      rule = link->data;
+      link = _dbus_list_get_next_link (rules, link);
+
+      if (*cacheable_p && !match_rule_is_cacheable (rule, sender))
+        *cacheable_p = FALSE;
+
+      if (rule->shape != shape)
+        {
+          shape = rule->shape;
+          evaluated = FALSE;
+        }
+
+      if (bus_connection_has_stamp (rule->matches_go_to))
+        {
+          _dbus_verbose ("Connection %p already receiving this message, not checking its rule\n",
+                         rule->matches_go_to);
+          continue;
+        }
+
+#ifdef DBUS_ENABLE_VERBOSE_MODE
+      {
+        char *s = match_rule_to_string (rule);
+
+        _dbus_verbose ("Checking whether message matches rule %s for connection %p\n",
+                       s, rule->matches_go_to);
+        dbus_free (s);
+      }
+#endif
+
+      rule->n_evaluations += 1;
+
+      if (!evaluated)
+        {
+          evaluated = TRUE;
+
+          _dbus_latency_begin (&start);
+          matched = match_rule_matches (rule,
+                                        sender, addressed_recipient, message,
+                                        args, already_matched);
+          if (start.tv_sec >= 0)
+            {
+              long sec, usec;
+
+              /* Each delta is quantized to a microsecond, but the sum over
+               * many evaluations is still an unbiased estimate.
+               */
+              _dbus_get_current_time (&sec, &usec);
+              rule->usec_spent += (sec - start.tv_sec) * 1000000 + (usec - start.tv_usec);
+            }
+        }
+
+      if (matched)
+        {
+          _dbus_verbose ("Rule matched\n");
+
+          rule->n_matches += 1;
+
+          bus_connection_mark_stamp (rule->matches_go_to);
+          if (!bus_recipients_append (recipients, rule->matches_go_to))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static DBusList **
+rule_set_lookup (RuleSet    *set,
+                 RuleIndex   index,
+                 const char *key)
+{
+  if (key == NULL || set->rules_by_key[index] == NULL)
+    return NULL;
+
+  return _dbus_hash_table_lookup_string (set->rules_by_key[index], key);
+}
+
+static dbus_bool_t
+rule_set_has_arg0_rules (RuleSet *set)
+{
+  return set->rules_by_key[RULE_INDEX_ARG0] != NULL &&
+    _dbus_hash_table_get_n_entries (set->rules_by_key[RULE_INDEX_ARG0]) > 0;
+}
+
+/* Only walks the message if some rule in the set is keyed on arg0 */
+static DBusList **
+rule_set_lookup_arg0 (RuleSet     *set,
+                      DBusMessage *message,
+                      MessageArgs *args)
+{
+  if (!rule_set_has_arg0_rules (set))
+    return NULL;
+
+  if (!args->walked)
+    message_args_walk (args, message);
+
+  if (args->n_args == 0)
+    return NULL;
+
+  return rule_set_lookup (set, RULE_INDEX_ARG0, args->values[0]);
+}
+
+static dbus_bool_t
+get_recipients_from_set (RuleSet         *set,
+                         DBusConnection  *sender,
+                         DBusConnection  *addressed_recipient,
+                         DBusMessage     *message,
+                         MessageArgs     *args,
+                         const char      *sender_name,
+                         BusRecipients   *recipients,
+                         dbus_bool_t     *cacheable_p)
+{
+  const BusMatchFlags in_pool = BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_INTERFACE;
+
+  if (set == NULL)
+    return TRUE;
+
+  /* Rules keyed on arg0 are only looked at when arg0 is their key, so
+   * match_rule_is_cacheable() never sees the others; and arg0 isn't
+   * part of the recipient cache key.
+   */
+  if (rule_set_has_arg0_rules (set))
+    *cacheable_p = FALSE;
+
+  /* Being on a keyed list already implies that field matched, except
+   * for arg0 which shares BUS_MATCH_ARGS with the other arguments
+   */
+  return
+    get_recipients_from_list (rule_set_lookup_arg0 (set, message, args),
+                              sender, addressed_recipient, message, args,
+                              in_pool, recipients, cacheable_p) &&
+    get_recipients_from_list (rule_set_lookup (set, RULE_INDEX_PATH,
+                                               dbus_message_get_path (message)),
+                              sender, addressed_recipient, message, args,
+                              in_pool | BUS_MATCH_PATH, recipients, cacheable_p) &&
+    get_recipients_from_list (rule_set_lookup (set, RULE_INDEX_SENDER,
+                                               sender_name),
+                              sender, addressed_recipient, message, args,
+                              in_pool | BUS_MATCH_SENDER, recipients, cacheable_p) &&
+    get_recipients_from_list (rule_set_lookup (set, RULE_INDEX_MEMBER,
+                                               dbus_message_get_member (message)),
+                              sender, addressed_recipient, message, args,
+                              in_pool | BUS_MATCH_MEMBER, recipients, cacheable_p) &&
+    get_recipients_from_list (&set->rules_unindexed,
+                              sender, addressed_recipient, message, args,
+                              in_pool, recipients, cacheable_p);
+}
+
+/* Builds the recipient cache key for message, or returns FALSE if its
+ * recipients can't be cached: only broadcast signals from the bus
+ * driver or a connection with a unique name qualify.
+ */
+static dbus_bool_t
+recipient_cache_key (DBusString     *key,
+                     DBusConnection *addressed_recipient,
+                     DBusMessage    *message,
+                     const char     *sender_name,
+                     dbus_bool_t    *oom_p)
+{
+  const char *interface, *member, *path;
+
+  *oom_p = FALSE;
+
+  if (addressed_recipient != NULL ||
+      dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_SIGNAL ||
+      dbus_message_get_destination (message) != NULL ||
+      sender_name == NULL)
+    return FALSE;
+
+  interface = dbus_message_get_interface (message);
+  member = dbus_message_get_member (message);
+  path = dbus_message_get_path (message);
+
+  if (interface == NULL || member == NULL || path == NULL)
+    return FALSE;
+
+  /* none of these can contain a space */
+  if (!_dbus_string_append (key, sender_name) ||
+      !_dbus_string_append_byte (key, ' ') ||
+      !_dbus_string_append (key, interface) ||
+      !_dbus_string_append_byte (key, ' ') ||
+      !_dbus_string_append (key, member) ||
+      !_dbus_string_append_byte (key, ' ') ||
+      !_dbus_string_append (key, path))
+    {
+      *oom_p = TRUE;
+      return FALSE;
+    }
 
-      rule = link->data;
+  return TRUE;
+}
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-      {
-        char *s = match_rule_to_string (rule);
+/* Failing to remember a set is not an error, we just compute it again */
+static void
+recipient_cache_insert (BusMatchmaker *matchmaker,
+                        DBusString    *key,
+                        BusRecipients *recipients)
+{
+  BusRecipients *cached;
+  char *key_str;
 
-        _dbus_verbose ("Checking whether message matches rule %s for connection %p\n",
-                       s, rule->matches_go_to);
-        dbus_free (s);
-      }
-#endif
+  if (_dbus_hash_table_get_n_entries (matchmaker->recipient_cache) >=
+      MAX_CACHED_RECIPIENT_SETS)
+    _dbus_hash_table_remove_all (matchmaker->recipient_cache);
 
-      if (match_rule_matches (rule,
-                              sender, addressed_recipient, message,
-                              BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_INTERFACE))
-        {
-          _dbus_verbose ("Rule matched\n");
+  cached = dbus_new (BusRecipients, 1);
+  if (cached == NULL)
+    return;
 
-          /* Append to the list if we haven't already */
-          if (bus_connection_mark_stamp (rule->matches_go_to))
-            {
-              if (!_dbus_list_append (recipients_p, rule->matches_go_to))
-                return FALSE;
-            }
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-          else
-            {
-              _dbus_verbose ("Connection already receiving this message, so not adding again\n");
-            }
-#endif /* DBUS_ENABLE_VERBOSE_MODE */
-        }
+  bus_recipients_init (cached);
 
-      link = _dbus_list_get_next_link (rules, link);
+  if (!bus_recipients_copy (cached, recipients))
+    {
+      recipient_set_free (cached);
+      return;
     }
 
-  return TRUE;
+  if (!_dbus_string_steal_data (key, &key_str))
+    {
+      recipient_set_free (cached);
+      return;
+    }
+
+  if (!_dbus_hash_table_insert_string (matchmaker->recipient_cache,
+                                       key_str, cached))
+    {
+      dbus_free (key_str);
+      recipient_set_free (cached);
+    }
 }
 
 dbus_bool_t
@@ -1791,13 +2781,25 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
                                DBusConnection  *sender,
                                DBusConnection  *addressed_recipient,
                                DBusMessage     *message,
-                               DBusList       **recipients_p)
+                               BusRecipients   *recipients)
 {
   int type;
   const char *interface;
-  DBusList **neither, **just_type, **just_iface, **both;
+  const char *sender_name;
+  RuleSet *neither, *just_type, *just_iface, *both;
+  DBusString key;
+  dbus_bool_t cacheable, oom;
+  MessageArgs args;
+
+  _dbus_assert (recipients->n_connections == 0);
+
+  type = dbus_message_get_type (message);
 
-  _dbus_assert (*recipients_p == NULL);
+  /* Only rules without a type, or with this one, can match */
+  if (matchmaker->n_rules_by_type[DBUS_MESSAGE_TYPE_INVALID] == 0 &&
+      (type <= DBUS_MESSAGE_TYPE_INVALID || type >= DBUS_NUM_MESSAGE_TYPES ||
+       matchmaker->n_rules_by_type[type] == 0))
+    return TRUE;
 
   /* This avoids sending same message to the same connection twice.
    * Purpose of the stamp instead of a bool is to avoid iterating over
@@ -1812,41 +2814,274 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
   if (addressed_recipient != NULL)
     bus_connection_mark_stamp (addressed_recipient);
 
-  type = dbus_message_get_type (message);
   interface = dbus_message_get_interface (message);
 
-  neither = bus_matchmaker_get_rules (matchmaker, DBUS_MESSAGE_TYPE_INVALID,
+  /* Only rules on unique names are indexed by sender; NULL means the
+   * bus driver, or a connection which hasn't said Hello yet, neither of
+   * which can own a unique name.
+   */
+  sender_name = NULL;
+  if (sender != NULL && bus_connection_is_active (sender))
+    sender_name = bus_connection_get_name (sender);
+
+  if (matchmaker->cache_generation != matchmaker->generation)
+    {
+      _dbus_hash_table_remove_all (matchmaker->recipient_cache);
+      matchmaker->cache_generation = matchmaker->generation;
+    }
+
+  if (!_dbus_string_init (&key))
+    return FALSE;
+
+  cacheable = recipient_cache_key (&key, addressed_recipient, message,
+                                   sender == NULL ? DBUS_SERVICE_DBUS : sender_name,
+                                   &oom);
+  if (oom)
+    {
+      _dbus_string_free (&key);
+      return FALSE;
+    }
+
+  if (cacheable)
+    {
+      BusRecipients *cached;
+
+      cached = _dbus_hash_table_lookup_string (matchmaker->recipient_cache,
+                                               _dbus_string_get_const_data (&key));
+
+      if (cached != NULL)
+        {
+          _dbus_verbose ("Using cached recipients for %s\n",
+                         _dbus_string_get_const_data (&key));
+
+          _dbus_string_free (&key);
+
+          return bus_recipients_copy (recipients, cached);
+        }
+    }
+
+  neither = bus_matchmaker_get_rule_set (matchmaker, DBUS_MESSAGE_TYPE_INVALID,
       NULL, FALSE);
   just_type = just_iface = both = NULL;
 
   if (interface != NULL)
-    just_iface = bus_matchmaker_get_rules (matchmaker,
+    just_iface = bus_matchmaker_get_rule_set (matchmaker,
         DBUS_MESSAGE_TYPE_INVALID, interface, FALSE);
 
   if (type > DBUS_MESSAGE_TYPE_INVALID && type < DBUS_NUM_MESSAGE_TYPES)
     {
-      just_type = bus_matchmaker_get_rules (matchmaker, type, NULL, FALSE);
+      just_type = bus_matchmaker_get_rule_set (matchmaker, type, NULL, FALSE);
 
       if (interface != NULL)
-        both = bus_matchmaker_get_rules (matchmaker, type, interface, FALSE);
+        both = bus_matchmaker_get_rule_set (matchmaker, type, interface, FALSE);
     }
 
-  if (!(get_recipients_from_list (neither, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_iface, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_type, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (both, sender, addressed_recipient,
-                                  message, recipients_p)))
+  message_args_init (&args);
+
+  if (!(get_recipients_from_set (neither, sender, addressed_recipient,
+                                 message, &args, sender_name, recipients,
+                                 &cacheable) &&
+        get_recipients_from_set (just_iface, sender, addressed_recipient,
+                                 message, &args, sender_name, recipients,
+                                 &cacheable) &&
+        get_recipients_from_set (just_type, sender, addressed_recipient,
+                                 message, &args, sender_name, recipients,
+                                 &cacheable) &&
+        get_recipients_from_set (both, sender, addressed_recipient,
+                                 message, &args, sender_name, recipients,
+                                 &cacheable)))
     {
-      _dbus_list_clear (recipients_p);
+      _dbus_string_free (&key);
+      recipients->n_connections = 0;
       return FALSE;
     }
 
+  if (cacheable)
+    recipient_cache_insert (matchmaker, &key, recipients);
+
+  _dbus_string_free (&key);
+
+  return TRUE;
+}
+
+/* The summary is a Bloom filter over the (interface, member) pairs that
+ * signal rules ask for, "*" standing for a field the rule leaves open;
+ * each pair sets BUS_MATCH_SUMMARY_HASHES bits.
+ */
+#define BUS_MATCH_SUMMARY_BITS (BUS_MATCH_SUMMARY_BYTES * 8)
+#define BUS_MATCH_SUMMARY_HASHES 3
+
+static dbus_uint32_t
+match_summary_hash (const char *interface,
+                    const char *member)
+{
+  /* 32-bit FNV-1a over "interface\0member" */
+  dbus_uint32_t h = 2166136261u;
+  const char *p;
+
+  for (p = interface; *p != '\0'; p++)
+    h = (h ^ (unsigned char) *p) * 16777619u;
+
+  h *= 16777619u;
+
+  for (p = member; *p != '\0'; p++)
+    h = (h ^ (unsigned char) *p) * 16777619u;
+
+  return h;
+}
+
+static void
+match_summary_add (unsigned char *summary,
+                   const char    *interface,
+                   const char    *member)
+{
+  dbus_uint32_t h, step;
+  int i;
+
+  h = match_summary_hash (interface != NULL ? interface : "*",
+                          member != NULL ? member : "*");
+  step = (h >> 17) | 1;
+
+  for (i = 0; i < BUS_MATCH_SUMMARY_HASHES; i++)
+    {
+      dbus_uint32_t bit = (h + i * step) % BUS_MATCH_SUMMARY_BITS;
+
+      summary[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+static dbus_bool_t
+match_summary_has (const unsigned char *summary,
+                   const char          *interface,
+                   const char          *member)
+{
+  dbus_uint32_t h, step;
+  int i;
+
+  h = match_summary_hash (interface, member);
+  step = (h >> 17) | 1;
+
+  for (i = 0; i < BUS_MATCH_SUMMARY_HASHES; i++)
+    {
+      dbus_uint32_t bit = (h + i * step) % BUS_MATCH_SUMMARY_BITS;
+
+      if ((summary[bit / 8] & (1 << (bit % 8))) == 0)
+        return FALSE;
+    }
+
   return TRUE;
 }
 
+static void
+match_summary_add_list (unsigned char *summary,
+                        DBusList      *rules)
+{
+  DBusList *link;
+
+  for (link = rules; link != NULL; link = _dbus_list_get_next_link (&rules, link))
+    {
+      BusMatchRule *rule = link->data;
+
+      /* a rule on neither field could match any signal at all */
+      if (rule->interface == NULL && rule->member == NULL)
+        memset (summary, 0xff, BUS_MATCH_SUMMARY_BYTES);
+      else
+        match_summary_add (summary, rule->interface, rule->member);
+    }
+}
+
+static void
+match_summary_add_set (unsigned char *summary,
+                       RuleSet       *set)
+{
+  int i;
+
+  for (i = 0; i < RULE_INDEX_LAST; i++)
+    {
+      DBusHashIter iter;
+
+      if (set->rules_by_key[i] == NULL)
+        continue;
+
+      _dbus_hash_iter_init (set->rules_by_key[i], &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          DBusList **list = _dbus_hash_iter_get_value (&iter);
+
+          match_summary_add_list (summary, *list);
+        }
+    }
+
+  match_summary_add_list (summary, set->rules_unindexed);
+}
+
+/**
+ * Summarizes which signals the rules on this bus could select, for
+ * bridges on other buses to decide what is worth sending over; see
+ * bus_match_summary_may_match(). The summary stays valid until the
+ * next rule is added or removed.
+ *
+ * @param matchmaker the matchmaker
+ * @returns BUS_MATCH_SUMMARY_BYTES bytes owned by the matchmaker
+ */
+const unsigned char *
+bus_matchmaker_get_summary (BusMatchmaker *matchmaker)
+{
+  int types[] = { DBUS_MESSAGE_TYPE_INVALID, DBUS_MESSAGE_TYPE_SIGNAL };
+  int i;
+
+  if (matchmaker->summary_valid &&
+      matchmaker->summary_generation == matchmaker->generation)
+    return matchmaker->summary;
+
+  memset (matchmaker->summary, 0, BUS_MATCH_SUMMARY_BYTES);
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (types); i++)
+    {
+      RulePool *p = matchmaker->rules_by_type + types[i];
+      DBusHashIter iter;
+
+      _dbus_hash_iter_init (p->rules_by_iface, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        match_summary_add_set (matchmaker->summary,
+                               _dbus_hash_iter_get_value (&iter));
+
+      match_summary_add_set (matchmaker->summary, &p->rules_without_iface);
+    }
+
+  matchmaker->summary_generation = matchmaker->generation;
+  matchmaker->summary_valid = TRUE;
+
+  return matchmaker->summary;
+}
+
+/**
+ * Checks a signal against a summary from bus_matchmaker_get_summary(),
+ * possibly one fetched from another bus. False positives are possible,
+ * false negatives are not: FALSE means no rule there wants it.
+ *
+ * @param summary BUS_MATCH_SUMMARY_BYTES bytes
+ * @param message the signal
+ * @returns #FALSE if the signal certainly matches no rule
+ */
+dbus_bool_t
+bus_match_summary_may_match (const unsigned char *summary,
+                             DBusMessage         *message)
+{
+  const char *interface, *member;
+
+  interface = dbus_message_get_interface (message);
+  member = dbus_message_get_member (message);
+
+  /* signals always have both, but be safe */
+  if (interface == NULL || member == NULL)
+    return TRUE;
+
+  return match_summary_has (summary, interface, member) ||
+    match_summary_has (summary, interface, "*") ||
+    match_summary_has (summary, "*", member);
+}
+
 #ifdef DBUS_BUILD_TESTS
 #include "test.h"
 #include <stdlib.h>
@@ -2134,6 +3369,14 @@ test_equality (void)
           exit (1);
         }
 
+      if (strcmp (first->key, second->key) != 0)
+        {
+          _dbus_warn ("rule %s and %s should have had the same key\n",
+                      equality_tests[i].first,
+                      equality_tests[i].second);
+          exit (1);
+        }
+
       bus_match_rule_unref (second);
 
       /* Check that the rule is not equal to any of the
@@ -2153,6 +3396,14 @@ test_equality (void)
                               equality_tests[j].second);
                   exit (1);
                 }
+
+              if (strcmp (first->key, second->key) == 0)
+                {
+                  _dbus_warn ("rule %s and %s should not have had the same key\n",
+                              equality_tests[i].first,
+                              equality_tests[j].second);
+                  exit (1);
+                }
               
               bus_match_rule_unref (second);
             }
@@ -2203,13 +3454,15 @@ check_matches (dbus_bool_t  expected_to_match,
                const char  *rule_text)
 {
   BusMatchRule *rule;
+  MessageArgs args;
   dbus_bool_t matched;
 
   rule = check_parse (TRUE, rule_text);
   _dbus_assert (rule != NULL);
 
   /* We can't test sender/destination rules since we pass NULL here */
-  matched = match_rule_matches (rule, NULL, NULL, message, 0);
+  message_args_init (&args);
+  matched = match_rule_matches (rule, NULL, NULL, message, &args, 0);
 
   if (matched != expected_to_match)
     {
@@ -2272,6 +3525,203 @@ test_matching (void)
   dbus_message_unref (message1);
 }
 
+static struct {
+  const char *text;
+  RuleIndex index;
+  const char *key;
+} index_tests[] = {
+  { "type='signal'", RULE_INDEX_LAST, NULL },
+  { "member='Foo'", RULE_INDEX_MEMBER, "Foo" },
+  { "member='Foo',path='/foo'", RULE_INDEX_PATH, "/foo" },
+  { "member='Foo',sender=':1.42'", RULE_INDEX_SENDER, ":1.42" },
+  { "sender=':1.42',path='/foo'", RULE_INDEX_PATH, "/foo" },
+  { "member='Foo',sender='org.example.Foo'", RULE_INDEX_MEMBER, "Foo" },
+  { "sender='org.example.Foo'", RULE_INDEX_LAST, NULL },
+  { "member='NameOwnerChanged',arg0='com.example.X'", RULE_INDEX_ARG0, "com.example.X" },
+  { "path='/foo',arg0='bar'", RULE_INDEX_ARG0, "bar" },
+  { "member='Foo',arg0path='/bar/'", RULE_INDEX_MEMBER, "Foo" },
+  { "member='Foo',arg1='bar'", RULE_INDEX_MEMBER, "Foo" }
+};
+
+static void
+test_indexing (void)
+{
+  int i;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (index_tests); i++)
+    {
+      BusMatchRule *rule;
+      const char *key;
+
+      rule = check_parse (TRUE, index_tests[i].text);
+      _dbus_assert (rule != NULL);
+
+      if (rule_get_index (rule, &key) != index_tests[i].index)
+        {
+          _dbus_warn ("rule \"%s\" was put on the wrong index\n",
+                      index_tests[i].text);
+          exit (1);
+        }
+
+      if (index_tests[i].key == NULL ? key != NULL :
+          (key == NULL || strcmp (key, index_tests[i].key) != 0))
+        {
+          _dbus_warn ("rule \"%s\" was indexed under the wrong key\n",
+                      index_tests[i].text);
+          exit (1);
+        }
+
+      bus_match_rule_unref (rule);
+    }
+}
+
+static struct {
+  const char *text;
+  dbus_bool_t from_driver;
+  dbus_bool_t from_client;
+} cache_tests[] = {
+  { "type='signal'", TRUE, TRUE },
+  { "member='Foo',path='/foo'", TRUE, TRUE },
+  { "sender=':1.42'", TRUE, TRUE },
+  { "sender='org.freedesktop.DBus'", TRUE, FALSE },
+  { "sender='org.example.Foo',member='Foo'", TRUE, FALSE },
+  { "member='Foo',arg0='bar'", FALSE, FALSE },
+  { "arg0path='/bar/'", FALSE, FALSE }
+};
+
+static void
+test_caching (void)
+{
+  DBusMessage *message;
+  DBusString key;
+  dbus_bool_t oom;
+  int i;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (cache_tests); i++)
+    {
+      BusMatchRule *rule;
+
+      rule = check_parse (TRUE, cache_tests[i].text);
+      _dbus_assert (rule != NULL);
+
+      /* any non-NULL connection will do, it's only compared to NULL */
+      if (match_rule_is_cacheable (rule, NULL) != cache_tests[i].from_driver ||
+          match_rule_is_cacheable (rule, (DBusConnection *) rule) !=
+            cache_tests[i].from_client)
+        {
+          _dbus_warn ("rule \"%s\" has the wrong cacheability\n",
+                      cache_tests[i].text);
+          exit (1);
+        }
+
+      bus_match_rule_unref (rule);
+    }
+
+  message = dbus_message_new_signal ("/foo", "org.example.Foo", "Changed");
+  if (message == NULL || !_dbus_string_init (&key))
+    _dbus_assert_not_reached ("oom");
+
+  if (!recipient_cache_key (&key, NULL, message, ":1.42", &oom))
+    _dbus_assert_not_reached ("broadcast not cacheable");
+  _dbus_assert (_dbus_string_equal_c_str (&key,
+                                          ":1.42 org.example.Foo Changed /foo"));
+
+  _dbus_string_set_length (&key, 0);
+  _dbus_assert (!recipient_cache_key (&key, NULL, message, NULL, &oom));
+  _dbus_assert (!oom);
+
+  if (!dbus_message_set_destination (message, ":1.1"))
+    _dbus_assert_not_reached ("oom");
+  _dbus_assert (!recipient_cache_key (&key, NULL, message, ":1.42", &oom));
+  _dbus_assert (!oom);
+
+  _dbus_string_free (&key);
+  dbus_message_unref (message);
+}
+
+static void
+test_recipients (void)
+{
+  BusRecipients recipients, copy;
+  int i;
+
+  bus_recipients_init (&recipients);
+  bus_recipients_init (&copy);
+
+  /* only the pointers are stored, so they needn't be real connections */
+  for (i = 0; i < 100; i++)
+    {
+      if (!bus_recipients_append (&recipients,
+                                  (DBusConnection *) &cache_tests[i % 7]))
+        _dbus_assert_not_reached ("oom");
+    }
+
+  _dbus_assert (recipients.n_connections == 100);
+  _dbus_assert (recipients.n_allocated >= 100);
+
+  if (!bus_recipients_copy (&copy, &recipients))
+    _dbus_assert_not_reached ("oom");
+
+  _dbus_assert (copy.n_connections == 100);
+  for (i = 0; i < 100; i++)
+    _dbus_assert (copy.connections[i] == (DBusConnection *) &cache_tests[i % 7]);
+
+  bus_recipients_free (&recipients);
+  _dbus_assert (recipients.connections == NULL &&
+                recipients.n_connections == 0);
+
+  /* copying an empty set empties the destination */
+  if (!bus_recipients_copy (&copy, &recipients))
+    _dbus_assert_not_reached ("oom");
+  _dbus_assert (copy.n_connections == 0);
+
+  bus_recipients_free (&copy);
+}
+
+static void
+test_summary (void)
+{
+  unsigned char summary[BUS_MATCH_SUMMARY_BYTES];
+  DBusMessage *message;
+
+  memset (summary, 0, sizeof (summary));
+  match_summary_add (summary, "org.example.Foo", "Changed");
+  match_summary_add (summary, "org.example.Bar", NULL);
+  match_summary_add (summary, NULL, "Ping");
+
+  message = dbus_message_new_signal ("/", "org.example.Foo", "Changed");
+  if (message == NULL)
+    _dbus_assert_not_reached ("oom");
+  _dbus_assert (bus_match_summary_may_match (summary, message));
+  dbus_message_unref (message);
+
+  /* one wildcard field or the other */
+  message = dbus_message_new_signal ("/", "org.example.Bar", "Anything");
+  if (message == NULL)
+    _dbus_assert_not_reached ("oom");
+  _dbus_assert (bus_match_summary_may_match (summary, message));
+  dbus_message_unref (message);
+
+  message = dbus_message_new_signal ("/", "org.example.Baz", "Ping");
+  if (message == NULL)
+    _dbus_assert_not_reached ("oom");
+  _dbus_assert (bus_match_summary_may_match (summary, message));
+  dbus_message_unref (message);
+
+  /* with only nine bits set, these happen not to collide */
+  message = dbus_message_new_signal ("/", "org.example.Foo", "Removed");
+  if (message == NULL)
+    _dbus_assert_not_reached ("oom");
+  _dbus_assert (!bus_match_summary_may_match (summary, message));
+  dbus_message_unref (message);
+
+  message = dbus_message_new_signal ("/", "org.example.Baz", "Changed");
+  if (message == NULL)
+    _dbus_assert_not_reached ("oom");
+  _dbus_assert (!bus_match_summary_may_match (summary, message));
+  dbus_message_unref (message);
+}
+
 dbus_bool_t
 bus_signals_test (const DBusString *test_data_dir)
 {
@@ -2288,6 +3738,14 @@ bus_signals_test (const DBusString *test_data_dir)
   test_equality ();
 
   test_matching ();
+
+  test_indexing ();
+
+  test_caching ();
+
+  test_recipients ();
+
+  test_summary ();
   
   return TRUE;
 }
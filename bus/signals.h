@@ -40,31 +40,41 @@ typedef enum
   BUS_MATCH_ARGS         = 1 << 6
 } BusMatchFlags;
 
-BusMatchRule* bus_match_rule_new   (DBusConnection *matches_go_to);
+/* The connections a message is going to, in the order they were found */
+typedef struct
+{
+  DBusConnection **connections; /**< n_connections entries */
+  int n_connections;            /**< entries in use */
+  int n_allocated;              /**< room for this many */
+} BusRecipients;
+
+void        bus_recipients_init   (BusRecipients  *recipients);
+dbus_bool_t bus_recipients_append (BusRecipients  *recipients,
+                                   DBusConnection *connection);
+void        bus_recipients_free   (BusRecipients  *recipients);
+
 BusMatchRule* bus_match_rule_ref   (BusMatchRule   *rule);
 void          bus_match_rule_unref (BusMatchRule   *rule);
 
-dbus_bool_t bus_match_rule_set_message_type (BusMatchRule     *rule,
-                                             int               type);
-dbus_bool_t bus_match_rule_set_interface    (BusMatchRule     *rule,
-                                             const char       *interface);
-dbus_bool_t bus_match_rule_set_member       (BusMatchRule     *rule,
-                                             const char       *member);
-dbus_bool_t bus_match_rule_set_sender       (BusMatchRule     *rule,
-                                             const char       *sender);
-dbus_bool_t bus_match_rule_set_destination  (BusMatchRule     *rule,
-                                             const char       *destination);
-dbus_bool_t bus_match_rule_set_path         (BusMatchRule     *rule,
-                                             const char       *path);
-dbus_bool_t bus_match_rule_set_arg          (BusMatchRule     *rule,
-                                             int               arg,
-                                             const DBusString *value,
-                                             dbus_bool_t       is_path);
+char*         bus_match_rule_to_string (BusMatchRule  *rule);
+const char*   bus_match_rule_get_key   (BusMatchRule  *rule);
+DBusList*     bus_match_rule_get_owner_link (BusMatchRule *rule);
+dbus_bool_t   bus_match_rule_matches_message (BusMatchRule   *rule,
+                                              DBusConnection *sender,
+                                              DBusConnection *addressed_recipient,
+                                              DBusMessage    *message);
+void          bus_match_rule_get_costs (BusMatchRule  *rule,
+                                        dbus_uint32_t *n_evaluations,
+                                        dbus_uint32_t *n_matches,
+                                        dbus_uint64_t *usec_spent);
 
 BusMatchRule* bus_match_rule_parse (DBusConnection   *matches_go_to,
                                     const DBusString *rule_text,
                                     DBusError        *error);
 
+/* Size of a bus_matchmaker_get_summary() */
+#define BUS_MATCH_SUMMARY_BYTES 256
+
 BusMatchmaker* bus_matchmaker_new   (void);
 BusMatchmaker* bus_matchmaker_ref   (BusMatchmaker *matchmaker);
 void           bus_matchmaker_unref (BusMatchmaker *matchmaker);
@@ -76,6 +86,8 @@ dbus_bool_t bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
                                                  DBusError       *error);
 void        bus_matchmaker_remove_rule          (BusMatchmaker   *matchmaker,
                                                  BusMatchRule    *rule);
+int         bus_matchmaker_get_n_additions      (BusMatchmaker   *matchmaker,
+                                                 BusMatchRule    *value);
 void        bus_matchmaker_disconnected         (BusMatchmaker   *matchmaker,
                                                  DBusConnection  *connection);
 dbus_bool_t bus_matchmaker_get_recipients       (BusMatchmaker   *matchmaker,
@@ -83,6 +95,10 @@ dbus_bool_t bus_matchmaker_get_recipients       (BusMatchmaker   *matchmaker,
                                                  DBusConnection  *sender,
                                                  DBusConnection  *addressed_recipient,
                                                  DBusMessage     *message,
-                                                 DBusList       **recipients_p);
+                                                 BusRecipients   *recipients);
+
+const unsigned char* bus_matchmaker_get_summary  (BusMatchmaker       *matchmaker);
+dbus_bool_t          bus_match_summary_may_match (const unsigned char *summary,
+                                                  DBusMessage         *message);
 
 #endif /* BUS_SIGNALS_H */
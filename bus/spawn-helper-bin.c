@@ -0,0 +1,42 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* spawn-helper-bin.c  babysitter for services spawned by the bus
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+
+#include <dbus/dbus-spawn.h>
+
+#include <stdio.h>
+
+/* Started by _dbus_spawn_async_with_babysitter() with vfork(), so the
+ * bus daemon never has to copy itself to spawn a service; not meant
+ * to be run by hand.
+ */
+int
+main (int argc, char **argv)
+{
+  int retval;
+
+  retval = _dbus_babysitter_helper_main (argc, argv);
+
+  fprintf (stderr, "dbus-daemon-spawn-helper is started by dbus-daemon, not by hand\n");
+
+  return retval;
+}
@@ -0,0 +1,960 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* stats.c  Bus statistics interface
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "stats.h"
+#include "services.h"
+#include "utils.h"
+#include "signals.h"
+#include <dbus/dbus-flight-recorder.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-latency.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* only configure.in finds the right one; C99 has ll everywhere */
+#ifndef DBUS_INT64_PRINTF_MODIFIER
+#define DBUS_INT64_PRINTF_MODIFIER "ll"
+#endif
+
+/* Both calls reply with an a{sv} so that keys can be added later
+ * without breaking anyone who reads the old ones.
+ */
+
+static dbus_bool_t
+append_entry (DBusMessageIter *dict,
+              const char      *key,
+              int              type,
+              const void      *value)
+{
+  DBusMessageIter entry;
+  DBusMessageIter variant;
+  char signature[2];
+
+  signature[0] = type;
+  signature[1] = '\0';
+
+  if (!dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY,
+                                         NULL, &entry))
+    return FALSE;
+
+  if (!dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &key) ||
+      !dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                                         signature, &variant))
+    {
+      dbus_message_iter_abandon_container (dict, &entry);
+      return FALSE;
+    }
+
+  if (!dbus_message_iter_append_basic (&variant, type, value))
+    {
+      dbus_message_iter_abandon_container (&entry, &variant);
+      dbus_message_iter_abandon_container (dict, &entry);
+      return FALSE;
+    }
+
+  if (!dbus_message_iter_close_container (&entry, &variant))
+    {
+      dbus_message_iter_abandon_container (dict, &entry);
+      return FALSE;
+    }
+
+  return dbus_message_iter_close_container (dict, &entry);
+}
+
+static dbus_bool_t
+append_uint32 (DBusMessageIter *dict,
+               const char      *key,
+               dbus_uint32_t    value)
+{
+  return append_entry (dict, key, DBUS_TYPE_UINT32, &value);
+}
+
+static dbus_bool_t
+append_uint64 (DBusMessageIter *dict,
+               const char      *key,
+               dbus_uint64_t    value)
+{
+  return append_entry (dict, key, DBUS_TYPE_UINT64, &value);
+}
+
+/* One Memory<Tag> entry per accounted subsystem, only while the
+ * daemon keeps the counters.
+ */
+static dbus_bool_t
+append_memory_accounting (DBusMessageIter *dict)
+{
+  char key[64];
+  int tag;
+
+  if (!_dbus_memory_accounting_enabled)
+    return TRUE;
+
+  for (tag = 0; tag < DBUS_MEMORY_N_TAGS; tag++)
+    {
+      long bytes = _dbus_memory_get_accounted (tag);
+
+      snprintf (key, sizeof (key), "Memory%s", _dbus_memory_tag_name (tag));
+
+      if (!append_uint64 (dict, key, bytes > 0 ? bytes : 0))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* ConfigLoad<Phase>Microseconds for the last startup or reload */
+static dbus_bool_t
+append_phase_timings (DBusMessageIter *dict,
+                      BusContext      *context)
+{
+  char key[64];
+  dbus_bool_t is_reload;
+  int phase;
+
+  is_reload = bus_context_get_phases_are_reload (context);
+  if (!append_entry (dict, "ConfigLoadIsReload", DBUS_TYPE_BOOLEAN,
+                     &is_reload))
+    return FALSE;
+
+  for (phase = 0; phase < BUS_N_PHASES; phase++)
+    {
+      snprintf (key, sizeof (key), "ConfigLoad%sMicroseconds",
+                bus_phase_name (phase));
+
+      if (!append_uint64 (dict, key,
+                          bus_context_get_phase_usec (context, phase)))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+append_stats (DBusMessageIter          *dict,
+              const BusConnectionStats *stats,
+              BusContext               *context)
+{
+  return
+    append_uint64 (dict, "IncomingMessages", stats->messages_in) &&
+    append_uint64 (dict, "IncomingBytes", stats->bytes_in) &&
+    append_uint64 (dict, "OutgoingMessages", stats->messages_out) &&
+    append_uint64 (dict, "OutgoingBytes", stats->bytes_out) &&
+    append_uint32 (dict, "IncomingQueueBytes", stats->incoming_bytes) &&
+    append_uint32 (dict, "OutgoingQueueBytes", stats->outgoing_bytes) &&
+    append_uint32 (dict, "ReadBudget", stats->read_budget) &&
+    append_uint32 (dict, "WriteBudget", stats->write_budget) &&
+    append_uint32 (dict, "StateBytes", stats->state_bytes) &&
+    append_uint32 (dict, "MaxIncomingQueueBytes",
+                   bus_context_get_max_incoming_bytes (context)) &&
+    append_uint32 (dict, "MaxOutgoingQueueBytes",
+                   bus_context_get_max_outgoing_bytes (context)) &&
+    append_uint32 (dict, "MatchRules", stats->match_rules) &&
+    append_uint32 (dict, "PeakMatchRules", stats->peak_match_rules) &&
+    append_uint32 (dict, "NamesOwned", stats->names_owned) &&
+    append_uint32 (dict, "PendingReplies", stats->pending_replies) &&
+    append_uint32 (dict, "OOMRetries", stats->oom_retries) &&
+    append_uint32 (dict, "PolicyDenials", stats->policy_denials);
+}
+
+static dbus_bool_t
+send_stats_reply (DBusConnection           *connection,
+                  BusTransaction           *transaction,
+                  DBusMessage              *message,
+                  const BusConnectionStats *stats,
+                  const char               *unique_name,
+                  int                       n_completed,
+                  int                       n_incomplete)
+{
+  BusContext *context;
+  DBusMessage *reply;
+  DBusMessageIter iter;
+  DBusMessageIter dict;
+
+  context = bus_connection_get_context (connection);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    return FALSE;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}",
+                                         &dict))
+    goto oom;
+
+  if (unique_name != NULL)
+    {
+      if (!append_entry (&dict, "UniqueName", DBUS_TYPE_STRING, &unique_name))
+        goto oom;
+    }
+  else
+    {
+      /* what each idle client costs, the figure that matters with
+       * thousands of them
+       */
+      dbus_uint32_t per_idle = stats->idle_connections > 0 ?
+        stats->idle_state_bytes / stats->idle_connections : 0;
+
+      if (!append_uint32 (&dict, "ActiveConnections", n_completed) ||
+          !append_uint32 (&dict, "IncompleteConnections", n_incomplete) ||
+          !append_uint32 (&dict, "IdleConnections", stats->idle_connections) ||
+          !append_uint32 (&dict, "StateBytesPerIdleConnection", per_idle) ||
+          !append_uint64 (&dict, "DroppedLogMessages",
+                          _dbus_system_log_get_dropped ()) ||
+          !append_memory_accounting (&dict) ||
+          !append_phase_timings (&dict, context))
+        goto oom;
+    }
+
+  if (!append_stats (&dict, stats, context))
+    goto oom;
+
+  if (!dbus_message_iter_close_container (&iter, &dict))
+    goto oom;
+
+  _dbus_assert (dbus_message_has_signature (reply, "a{sv}"));
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  dbus_message_unref (reply);
+  return FALSE;
+}
+
+dbus_bool_t
+bus_stats_handle_get_stats (DBusConnection *connection,
+                            BusTransaction *transaction,
+                            DBusMessage    *message,
+                            DBusError      *error)
+{
+  BusConnectionStats totals;
+  int n_completed;
+  int n_incomplete;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  bus_connections_get_stats (bus_connection_get_connections (connection),
+                             &totals, &n_completed, &n_incomplete);
+
+  if (!send_stats_reply (connection, transaction, message, &totals, NULL,
+                         n_completed, n_incomplete))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_stats_handle_get_connection_stats (DBusConnection *connection,
+                                       BusTransaction *transaction,
+                                       DBusMessage    *message,
+                                       DBusError      *error)
+{
+  const char *name;
+  DBusString str;
+  BusService *service;
+  DBusConnection *owner;
+  BusConnectionStats stats;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (bus_connection_get_registry (connection),
+                                 &str);
+  if (service == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NAME_HAS_NO_OWNER,
+                      "Could not get statistics of name '%s': no such name",
+                      name);
+      return FALSE;
+    }
+
+  owner = bus_service_get_primary_owners_connection (service);
+  bus_connection_get_stats (owner, &stats);
+
+  if (!send_stats_reply (connection, transaction, message, &stats,
+                         bus_connection_get_name (owner), 0, 0))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+append_histogram (DBusMessageIter  *dict,
+                  DBusLatencyStage  stage)
+{
+  dbus_uint32_t counts[DBUS_LATENCY_N_BUCKETS];
+  DBusMessageIter entry;
+  DBusMessageIter buckets;
+  const char *name;
+  int i;
+
+  _dbus_latency_get_counts (stage, counts);
+  name = _dbus_latency_stage_name (stage);
+
+  if (!dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY,
+                                         NULL, &entry))
+    return FALSE;
+
+  if (!dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &name) ||
+      !dbus_message_iter_open_container (&entry, DBUS_TYPE_ARRAY, "(uu)",
+                                         &buckets))
+    {
+      dbus_message_iter_abandon_container (dict, &entry);
+      return FALSE;
+    }
+
+  /* only the buckets something landed in */
+  for (i = 0; i < DBUS_LATENCY_N_BUCKETS; i++)
+    {
+      DBusMessageIter bucket;
+      dbus_uint32_t lower;
+
+      if (counts[i] == 0)
+        continue;
+
+      lower = _dbus_latency_bucket_lower_bound (i);
+
+      if (!dbus_message_iter_open_container (&buckets, DBUS_TYPE_STRUCT,
+                                             NULL, &bucket))
+        goto failed;
+
+      if (!dbus_message_iter_append_basic (&bucket, DBUS_TYPE_UINT32, &lower) ||
+          !dbus_message_iter_append_basic (&bucket, DBUS_TYPE_UINT32, &counts[i]))
+        {
+          dbus_message_iter_abandon_container (&buckets, &bucket);
+          goto failed;
+        }
+
+      if (!dbus_message_iter_close_container (&buckets, &bucket))
+        goto failed;
+    }
+
+  if (!dbus_message_iter_close_container (&entry, &buckets))
+    {
+      dbus_message_iter_abandon_container (dict, &entry);
+      return FALSE;
+    }
+
+  return dbus_message_iter_close_container (dict, &entry);
+
+ failed:
+  dbus_message_iter_abandon_container (&entry, &buckets);
+  dbus_message_iter_abandon_container (dict, &entry);
+  return FALSE;
+}
+
+/* Replies with an a{sa(uu)}: for each stage, the lower bound in
+ * microseconds and the count of every non-empty bucket. Empty if
+ * <latency_histograms/> isn't set.
+ */
+dbus_bool_t
+bus_stats_handle_get_latency_histograms (DBusConnection *connection,
+                                         BusTransaction *transaction,
+                                         DBusMessage    *message,
+                                         DBusError      *error)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter;
+  DBusMessageIter dict;
+  int stage;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sa(uu)}",
+                                         &dict))
+    goto oom;
+
+  if (_dbus_latency_enabled)
+    {
+      for (stage = 0; stage < DBUS_LATENCY_N_STAGES; stage++)
+        {
+          if (!append_histogram (&dict, stage))
+            goto oom;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &dict))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+/* Most expensive first; time only means something with
+ * <latency_histograms/> set, so evaluations break ties
+ */
+static int
+compare_rule_costs (const void *a,
+                    const void *b)
+{
+  BusMatchRule *rule_a = *(BusMatchRule * const *) a;
+  BusMatchRule *rule_b = *(BusMatchRule * const *) b;
+  dbus_uint32_t evals_a, evals_b, matches;
+  dbus_uint64_t usec_a, usec_b;
+
+  bus_match_rule_get_costs (rule_a, &evals_a, &matches, &usec_a);
+  bus_match_rule_get_costs (rule_b, &evals_b, &matches, &usec_b);
+
+  if (usec_a != usec_b)
+    return usec_a > usec_b ? -1 : 1;
+  if (evals_a != evals_b)
+    return evals_a > evals_b ? -1 : 1;
+  return 0;
+}
+
+static dbus_bool_t
+append_rule_cost (DBusMessageIter *array,
+                  BusMatchRule    *rule)
+{
+  DBusMessageIter entry;
+  dbus_uint32_t n_evaluations, n_matches;
+  dbus_uint64_t usec_spent;
+  char *str;
+
+  bus_match_rule_get_costs (rule, &n_evaluations, &n_matches, &usec_spent);
+
+  str = bus_match_rule_to_string (rule);
+  if (str == NULL)
+    return FALSE;
+
+  if (!dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT,
+                                         NULL, &entry))
+    {
+      dbus_free (str);
+      return FALSE;
+    }
+
+  if (!dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &str) ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_UINT32, &n_evaluations) ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_UINT32, &n_matches) ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_UINT64, &usec_spent))
+    {
+      dbus_free (str);
+      dbus_message_iter_abandon_container (array, &entry);
+      return FALSE;
+    }
+
+  dbus_free (str);
+  return dbus_message_iter_close_container (array, &entry);
+}
+
+/* Replies with an a(suut) of the named connection's match rules, most
+ * expensive first: the rule, how often it was evaluated, how often it
+ * matched, and the microseconds spent evaluating it.
+ */
+dbus_bool_t
+bus_stats_handle_get_match_rule_costs (DBusConnection *connection,
+                                       BusTransaction *transaction,
+                                       DBusMessage    *message,
+                                       DBusError      *error)
+{
+  const char *name;
+  DBusString str;
+  BusService *service;
+  DBusConnection *owner;
+  DBusList **rules;
+  DBusList *link;
+  BusMatchRule **sorted;
+  DBusMessage *reply;
+  DBusMessageIter iter;
+  DBusMessageIter array;
+  int n_rules;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  sorted = NULL;
+  reply = NULL;
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (bus_connection_get_registry (connection),
+                                 &str);
+  if (service == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NAME_HAS_NO_OWNER,
+                      "Could not get match rule costs of name '%s': no such name",
+                      name);
+      return FALSE;
+    }
+
+  owner = bus_service_get_primary_owners_connection (service);
+  rules = bus_connection_get_match_rules (owner);
+  n_rules = bus_connection_get_n_match_rules (owner);
+
+  if (n_rules > 0)
+    {
+      sorted = dbus_new (BusMatchRule *, n_rules);
+      if (sorted == NULL)
+        goto oom;
+
+      i = 0;
+      for (link = _dbus_list_get_first_link (rules);
+           link != NULL;
+           link = _dbus_list_get_next_link (rules, link))
+        sorted[i++] = link->data;
+      _dbus_assert (i == n_rules);
+
+      qsort (sorted, n_rules, sizeof (BusMatchRule *), compare_rule_costs);
+    }
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(suut)",
+                                         &array))
+    goto oom;
+
+  for (i = 0; i < n_rules; i++)
+    {
+      if (!append_rule_cost (&array, sorted[i]))
+        {
+          dbus_message_iter_abandon_container (&iter, &array);
+          goto oom;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_free (sorted);
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  dbus_free (sorted);
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+/* The upper bound of a bucket; the last one holds everything up to
+ * the minute that _dbus_latency_record() clamps to
+ */
+static long
+bucket_upper_bound (int bucket)
+{
+  if (bucket + 1 < DBUS_LATENCY_N_BUCKETS)
+    return _dbus_latency_bucket_lower_bound (bucket + 1);
+  else
+    return 60 * 1000000L;
+}
+
+/* The upper bound of the bucket holding the given fraction of samples */
+static long
+histogram_percentile (const dbus_uint32_t *counts,
+                      dbus_uint64_t        total,
+                      int                  percent)
+{
+  dbus_uint64_t wanted;
+  dbus_uint64_t seen;
+  int i;
+
+  wanted = (total * percent + 99) / 100;
+  seen = 0;
+
+  for (i = 0; i < DBUS_LATENCY_N_BUCKETS - 1; i++)
+    {
+      seen += counts[i];
+      if (seen >= wanted)
+        break;
+    }
+
+  return bucket_upper_bound (i);
+}
+
+/* For SIGUSR1: a line per stage with enough to tell where time goes */
+void
+bus_stats_log_latency (BusContext *context)
+{
+  dbus_uint32_t counts[DBUS_LATENCY_N_BUCKETS];
+  int stage;
+
+  if (!_dbus_latency_enabled)
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                       "Latency histograms are not enabled; add <latency_histograms/> to the configuration");
+      return;
+    }
+
+  for (stage = 0; stage < DBUS_LATENCY_N_STAGES; stage++)
+    {
+      dbus_uint64_t total;
+      long p50, p99, max;
+      int i;
+
+      _dbus_latency_get_counts (stage, counts);
+
+      total = 0;
+      max = 0;
+      for (i = 0; i < DBUS_LATENCY_N_BUCKETS; i++)
+        {
+          total += counts[i];
+          if (counts[i] != 0)
+            max = bucket_upper_bound (i);
+        }
+
+      if (total == 0)
+        {
+          bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                           "Latency of %s: no samples",
+                           _dbus_latency_stage_name (stage));
+          continue;
+        }
+
+      p50 = histogram_percentile (counts, total, 50);
+      p99 = histogram_percentile (counts, total, 99);
+
+      bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                       "Latency of %s: %lu samples, 50%% under %ldus, 99%% under %ldus, max under %ldus",
+                       _dbus_latency_stage_name (stage),
+                       (unsigned long) total, p50, p99, max);
+    }
+}
+
+/* Metric names follow the Stats keys; counters get OpenMetrics' _total */
+static dbus_bool_t
+append_metric (DBusString    *str,
+               const char    *name,
+               const char    *type,
+               const char    *help,
+               dbus_uint64_t  value)
+{
+  return _dbus_string_append_printf (str,
+                                     "# TYPE dbus_daemon_%s %s\n"
+                                     "# HELP dbus_daemon_%s %s\n"
+                                     "dbus_daemon_%s%s %" DBUS_INT64_PRINTF_MODIFIER "u\n",
+                                     name, type, name, help, name,
+                                     strcmp (type, "counter") == 0 ? "_total" : "",
+                                     value);
+}
+
+static dbus_bool_t
+append_seconds (DBusString *str,
+                long        usec)
+{
+  return _dbus_string_append_printf (str, "%ld.%06ld",
+                                     usec / 1000000, usec % 1000000);
+}
+
+/* Cumulative, at every power of two rather than all the buckets */
+static dbus_bool_t
+append_latency_metrics (DBusString       *str,
+                        DBusLatencyStage  stage)
+{
+  dbus_uint32_t counts[DBUS_LATENCY_N_BUCKETS];
+  const char *name;
+  dbus_uint64_t total;
+  int i;
+
+  _dbus_latency_get_counts (stage, counts);
+  name = _dbus_latency_stage_name (stage);
+  total = 0;
+
+  for (i = 0; i < DBUS_LATENCY_N_BUCKETS; i++)
+    {
+      total += counts[i];
+
+      if (i % 4 != 3 || i == DBUS_LATENCY_N_BUCKETS - 1)
+        continue;
+
+      if (!_dbus_string_append_printf (str,
+                                       "dbus_daemon_latency_seconds_bucket{stage=\"%s\",le=\"",
+                                       name) ||
+          !append_seconds (str, bucket_upper_bound (i)) ||
+          !_dbus_string_append_printf (str, "\"} %" DBUS_INT64_PRINTF_MODIFIER "u\n",
+                                       total))
+        return FALSE;
+    }
+
+  return _dbus_string_append_printf (str,
+                                     "dbus_daemon_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %" DBUS_INT64_PRINTF_MODIFIER "u\n"
+                                     "dbus_daemon_latency_seconds_count{stage=\"%s\"} %" DBUS_INT64_PRINTF_MODIFIER "u\n",
+                                     name, total, name, total);
+}
+
+/**
+ * Writes what GetStats and GetLatencyHistograms report as OpenMetrics
+ * text, for <metrics_listen>. This costs the same as a GetStats call.
+ *
+ * @param context the bus
+ * @param str where to append the text
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_stats_append_openmetrics (BusContext *context,
+                              DBusString *str)
+{
+  BusConnectionStats totals;
+  int n_completed;
+  int n_incomplete;
+  int i;
+
+  bus_connections_get_stats (bus_context_get_connections (context),
+                             &totals, &n_completed, &n_incomplete);
+
+  if (!append_metric (str, "active_connections", "gauge",
+                      "Connections that have authenticated", n_completed) ||
+      !append_metric (str, "incomplete_connections", "gauge",
+                      "Connections still authenticating", n_incomplete) ||
+      !append_metric (str, "idle_connections", "gauge",
+                      "Connections trimmed for having been idle",
+                      totals.idle_connections) ||
+      !append_metric (str, "idle_connection_state_bytes", "gauge",
+                      "Bus state held for the idle connections",
+                      totals.idle_state_bytes) ||
+      !append_metric (str, "incoming_messages", "counter",
+                      "Messages received from clients", totals.messages_in) ||
+      !append_metric (str, "incoming_bytes", "counter",
+                      "Bytes of messages received from clients", totals.bytes_in) ||
+      !append_metric (str, "outgoing_messages", "counter",
+                      "Messages sent to clients", totals.messages_out) ||
+      !append_metric (str, "outgoing_bytes", "counter",
+                      "Bytes of messages sent to clients", totals.bytes_out) ||
+      !append_metric (str, "incoming_queue_bytes", "gauge",
+                      "Received messages not yet handled", totals.incoming_bytes) ||
+      !append_metric (str, "outgoing_queue_bytes", "gauge",
+                      "Messages queued and not yet written", totals.outgoing_bytes) ||
+      !append_metric (str, "match_rules", "gauge",
+                      "Match rules held by all connections", totals.match_rules) ||
+      !append_metric (str, "names_owned", "gauge",
+                      "Names owned by all connections", totals.names_owned) ||
+      !append_metric (str, "pending_replies", "gauge",
+                      "Method calls awaiting a reply", totals.pending_replies) ||
+      !append_metric (str, "oom_retries", "counter",
+                      "Messages that hit out-of-memory", totals.oom_retries) ||
+      !append_metric (str, "policy_denials", "counter",
+                      "Messages the policy rejected", totals.policy_denials) ||
+      !append_metric (str, "dropped_log_messages", "counter",
+                      "System log messages dropped",
+                      _dbus_system_log_get_dropped ()))
+    return FALSE;
+
+  if (_dbus_memory_accounting_enabled)
+    {
+      if (!_dbus_string_append (str,
+                                "# TYPE dbus_daemon_memory_bytes gauge\n"
+                                "# HELP dbus_daemon_memory_bytes Memory held, by subsystem\n"))
+        return FALSE;
+
+      for (i = 0; i < DBUS_MEMORY_N_TAGS; i++)
+        {
+          long bytes = _dbus_memory_get_accounted (i);
+
+          if (!_dbus_string_append_printf (str,
+                                           "dbus_daemon_memory_bytes{tag=\"%s\"} %ld\n",
+                                           _dbus_memory_tag_name (i),
+                                           bytes > 0 ? bytes : 0))
+            return FALSE;
+        }
+    }
+
+  if (!_dbus_string_append (str,
+                            "# TYPE dbus_daemon_config_load_seconds gauge\n"
+                            "# HELP dbus_daemon_config_load_seconds Time the last startup or reload spent in each phase\n"))
+    return FALSE;
+
+  for (i = 0; i < BUS_N_PHASES; i++)
+    {
+      if (!_dbus_string_append_printf (str,
+                                       "dbus_daemon_config_load_seconds{phase=\"%s\"} ",
+                                       bus_phase_name (i)) ||
+          !append_seconds (str, bus_context_get_phase_usec (context, i)) ||
+          !_dbus_string_append (str, "\n"))
+        return FALSE;
+    }
+
+  if (_dbus_latency_enabled)
+    {
+      if (!_dbus_string_append (str,
+                                "# TYPE dbus_daemon_latency_seconds histogram\n"
+                                "# HELP dbus_daemon_latency_seconds Time spent in each stage of handling a message\n"))
+        return FALSE;
+
+      for (i = 0; i < DBUS_LATENCY_N_STAGES; i++)
+        {
+          if (!append_latency_metrics (str, i))
+            return FALSE;
+        }
+    }
+
+  return _dbus_string_append (str, "# EOF\n");
+}
+
+/* Replies with an a(uusuuu): the time in seconds and microseconds,
+ * event, connection, serial and payload of each record, oldest first
+ */
+dbus_bool_t
+bus_stats_handle_get_flight_record (DBusConnection *connection,
+                                    BusTransaction *transaction,
+                                    DBusMessage    *message,
+                                    DBusError      *error)
+{
+  DBusFlightRecord *records;
+  DBusMessage *reply;
+  DBusMessageIter iter;
+  DBusMessageIter array;
+  int n_records;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  reply = NULL;
+
+  /* copied first, so that sending the reply isn't in it */
+  records = dbus_new (DBusFlightRecord, DBUS_FLIGHT_RECORDER_SIZE);
+  if (records == NULL)
+    goto oom;
+
+  n_records = _dbus_flight_recorder_get_records (records);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(uusuuu)",
+                                         &array))
+    goto oom;
+
+  for (i = 0; i < n_records; i++)
+    {
+      DBusMessageIter record;
+      const char *event;
+
+      event = _dbus_flight_event_name (records[i].event);
+
+      if (!dbus_message_iter_open_container (&array, DBUS_TYPE_STRUCT,
+                                             NULL, &record))
+        {
+          dbus_message_iter_abandon_container (&iter, &array);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_append_basic (&record, DBUS_TYPE_UINT32, &records[i].tv_sec) ||
+          !dbus_message_iter_append_basic (&record, DBUS_TYPE_UINT32, &records[i].tv_usec) ||
+          !dbus_message_iter_append_basic (&record, DBUS_TYPE_STRING, &event) ||
+          !dbus_message_iter_append_basic (&record, DBUS_TYPE_UINT32, &records[i].connection) ||
+          !dbus_message_iter_append_basic (&record, DBUS_TYPE_UINT32, &records[i].serial) ||
+          !dbus_message_iter_append_basic (&record, DBUS_TYPE_UINT32, &records[i].payload))
+        {
+          dbus_message_iter_abandon_container (&array, &record);
+          dbus_message_iter_abandon_container (&iter, &array);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_close_container (&array, &record))
+        {
+          dbus_message_iter_abandon_container (&iter, &array);
+          goto oom;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_free (records);
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  dbus_free (records);
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+/* For SIGRTMIN+2: the same as GetFlightRecord, a line per record.
+ * It goes to stderr rather than the system log, which would drop
+ * most of it.
+ */
+void
+bus_stats_dump_flight_record (void)
+{
+  DBusFlightRecord *records;
+  int n_records;
+  int i;
+
+  records = dbus_new (DBusFlightRecord, DBUS_FLIGHT_RECORDER_SIZE);
+  if (records == NULL)
+    {
+      _dbus_warn ("Not enough memory to dump the flight recorder\n");
+      return;
+    }
+
+  n_records = _dbus_flight_recorder_get_records (records);
+
+  for (i = 0; i < n_records; i++)
+    fprintf (stderr, "%u.%06u %s connection=%u serial=%u payload=%u\n",
+             records[i].tv_sec, records[i].tv_usec,
+             _dbus_flight_event_name (records[i].event),
+             records[i].connection, records[i].serial, records[i].payload);
+
+  fflush (stderr);
+  dbus_free (records);
+}
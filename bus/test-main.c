@@ -105,6 +105,12 @@ main (int argc, char **argv)
     die ("expire list");
   test_post_hook ();
  
+  test_pre_hook ();
+  printf ("%s: Running string interning test\n", argv[0]);
+  if (!bus_intern_test (&test_data_dir))
+    die ("intern");
+  test_post_hook ();
+
   test_pre_hook ();
   printf ("%s: Running config file parser test\n", argv[0]);
   if (!bus_config_parser_test (&test_data_dir))
@@ -70,6 +70,13 @@ remove_client_watch (DBusWatch      *watch,
                            watch, client_watch_callback, connection);
 }
 
+static void
+toggle_client_watch (DBusWatch      *watch,
+                     void           *data)
+{
+  _dbus_loop_toggle_watch (client_loop, watch);
+}
+
 static void
 client_timeout_callback (DBusTimeout   *timeout,
                          void          *data)
@@ -150,7 +157,7 @@ bus_setup_debug_client (DBusConnection *connection)
   if (!dbus_connection_set_watch_functions (connection,
                                             add_client_watch,
                                             remove_client_watch,
-                                            NULL,
+                                            toggle_client_watch,
                                             connection,
                                             NULL))
     goto out;
@@ -0,0 +1,383 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* validator.c  Threads that validate the bodies of huge messages
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "validator.h"
+#include "utils.h"
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-watch.h>
+
+#ifndef DBUS_WIN
+
+#include <pthread.h>
+#include <signal.h>
+
+/* Walking the body of a message near the maximum size takes long
+ * enough that every other connection would notice if the main loop
+ * did it. The connection the message came from stops reading until
+ * its body has been validated here, so its messages stay in order;
+ * everyone else carries on.
+ *
+ * The threads only ever touch the checks. Everything that allocates,
+ * or touches a connection, happens on the main loop: jobs are created
+ * when the loader hands over a check, and the threads just move their
+ * list links from one list to the other.
+ */
+
+typedef struct
+{
+  DBusConnection *connection; /**< Where the message came from */
+  DBusBodyCheck *check;
+} ValidatorJob;
+
+struct BusValidator
+{
+  BusContext *context;
+  long min_size;              /**< Smallest body validated here */
+
+  pthread_mutex_t lock;       /**< Protects the fields up to threads */
+  pthread_cond_t cond;        /**< Signalled when there is a job or quit is set */
+  DBusList *queued;           /**< ValidatorJob waiting for a thread */
+  DBusList *finished;         /**< ValidatorJob waiting for the main loop */
+  dbus_bool_t signalled;      /**< wakeup was written and not drained yet */
+  dbus_bool_t quit;
+
+  pthread_t *threads;
+  int n_threads;              /**< How many of threads were started */
+
+  DBusWakeupPipe wakeup;      /**< Readable when something is finished */
+  DBusWatch *watch;           /**< Watch on wakeup, on the bus's loop */
+  dbus_bool_t watch_added;
+};
+
+static void
+job_free (ValidatorJob *job)
+{
+  _dbus_body_check_unref (job->check);
+  dbus_connection_unref (job->connection);
+  dbus_free (job);
+}
+
+static void *
+validator_thread_main (void *data)
+{
+  BusValidator *validator = data;
+  DBusList *link;
+
+  pthread_mutex_lock (&validator->lock);
+
+  while (!validator->quit)
+    {
+      ValidatorJob *job;
+
+      link = _dbus_list_pop_first_link (&validator->queued);
+      if (link == NULL)
+        {
+          pthread_cond_wait (&validator->cond, &validator->lock);
+          continue;
+        }
+
+      pthread_mutex_unlock (&validator->lock);
+
+      job = link->data;
+      _dbus_body_check_run (job->check);
+
+      pthread_mutex_lock (&validator->lock);
+
+      _dbus_list_append_link (&validator->finished, link);
+      if (!validator->signalled)
+        {
+          validator->signalled = TRUE;
+          _dbus_wakeup_pipe_signal (&validator->wakeup);
+        }
+    }
+
+  pthread_mutex_unlock (&validator->lock);
+
+  return NULL;
+}
+
+static dbus_bool_t
+validator_handle_watch (DBusWatch    *watch,
+                        unsigned int  flags,
+                        void         *data)
+{
+  BusValidator *validator = data;
+  DBusList *finished;
+  DBusList *link;
+
+  pthread_mutex_lock (&validator->lock);
+  _dbus_wakeup_pipe_drain (&validator->wakeup);
+  validator->signalled = FALSE;
+  finished = validator->finished;
+  validator->finished = NULL;
+  pthread_mutex_unlock (&validator->lock);
+
+  while ((link = _dbus_list_pop_first_link (&finished)) != NULL)
+    {
+      ValidatorJob *job = link->data;
+
+      _dbus_list_free_link (link);
+
+      _dbus_connection_body_check_done (job->connection, job->check);
+      job_free (job);
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+validator_watch_callback (DBusWatch    *watch,
+                          unsigned int  condition,
+                          void         *data)
+{
+  return dbus_watch_handle (watch, condition);
+}
+
+/* Called by the connection with its lock held */
+static dbus_bool_t
+validator_check_body (DBusConnection *connection,
+                      DBusBodyCheck  *check,
+                      void           *data)
+{
+  BusValidator *validator = data;
+  ValidatorJob *job;
+  DBusList *link;
+
+  job = dbus_new (ValidatorJob, 1);
+  if (job == NULL)
+    return FALSE;
+
+  link = _dbus_list_alloc_link (job);
+  if (link == NULL)
+    {
+      dbus_free (job);
+      return FALSE;
+    }
+
+  job->connection = _dbus_connection_ref_unlocked (connection);
+  job->check = _dbus_body_check_ref (check);
+
+  pthread_mutex_lock (&validator->lock);
+  _dbus_list_append_link (&validator->queued, link);
+  pthread_cond_signal (&validator->cond);
+  pthread_mutex_unlock (&validator->lock);
+
+  return TRUE;
+}
+
+/**
+ * Starts n_threads threads to validate the bodies of messages on, and
+ * watches for them finishing on the bus's main loop.
+ *
+ * @param context the bus
+ * @param n_threads how many threads to start
+ * @param error return location for errors
+ * @returns the validator, or #NULL with error set
+ */
+BusValidator*
+bus_validator_new (BusContext *context,
+                   int         n_threads,
+                   DBusError  *error)
+{
+  BusValidator *validator;
+  sigset_t all_signals;
+  sigset_t old_signals;
+  int rc = 0;
+
+  _dbus_assert (n_threads > 0);
+
+  validator = dbus_new0 (BusValidator, 1);
+  if (validator == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  validator->context = context;
+  validator->min_size = _DBUS_ONE_MEGABYTE;
+  pthread_mutex_init (&validator->lock, NULL);
+  pthread_cond_init (&validator->cond, NULL);
+  validator->wakeup.read_fd = -1;
+  validator->wakeup.write_fd = -1;
+
+  validator->threads = dbus_new (pthread_t, n_threads);
+  if (validator->threads == NULL)
+    goto oom;
+
+  if (!_dbus_wakeup_pipe_open (&validator->wakeup, error))
+    goto failed;
+
+  validator->watch = _dbus_watch_new (validator->wakeup.read_fd,
+                                      DBUS_WATCH_READABLE, TRUE,
+                                      validator_handle_watch, validator,
+                                      NULL);
+  if (validator->watch == NULL)
+    goto oom;
+
+  if (!_dbus_loop_add_watch (bus_context_get_loop (context),
+                             validator->watch, validator_watch_callback,
+                             NULL, NULL))
+    goto oom;
+  validator->watch_added = TRUE;
+
+  /* Signals are for the main loop, not for the validator threads */
+  sigfillset (&all_signals);
+  pthread_sigmask (SIG_SETMASK, &all_signals, &old_signals);
+
+  while (validator->n_threads < n_threads)
+    {
+      rc = pthread_create (&validator->threads[validator->n_threads], NULL,
+                           validator_thread_main, validator);
+      if (rc != 0)
+        break;
+
+      validator->n_threads += 1;
+    }
+
+  pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+
+  if (validator->n_threads < n_threads)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (rc),
+                      "Failed to start validator thread: %s",
+                      _dbus_strerror (rc));
+      goto failed;
+    }
+
+  return validator;
+
+ oom:
+  BUS_SET_OOM (error);
+ failed:
+  bus_validator_free (validator);
+  return NULL;
+}
+
+/**
+ * Stops the threads, and drops whatever they had not handed back;
+ * only done as the bus goes away, so nobody is told.
+ *
+ * @param validator the validator
+ */
+void
+bus_validator_free (BusValidator *validator)
+{
+  int i;
+
+  pthread_mutex_lock (&validator->lock);
+  validator->quit = TRUE;
+  pthread_cond_broadcast (&validator->cond);
+  pthread_mutex_unlock (&validator->lock);
+
+  for (i = 0; i < validator->n_threads; i++)
+    pthread_join (validator->threads[i], NULL);
+
+  while (validator->queued != NULL)
+    job_free (_dbus_list_pop_first (&validator->queued));
+
+  while (validator->finished != NULL)
+    job_free (_dbus_list_pop_first (&validator->finished));
+
+  if (validator->watch != NULL)
+    {
+      if (validator->watch_added)
+        _dbus_loop_remove_watch (bus_context_get_loop (validator->context),
+                                 validator->watch, validator_watch_callback,
+                                 NULL);
+      _dbus_watch_invalidate (validator->watch);
+      _dbus_watch_unref (validator->watch);
+    }
+
+  if (validator->wakeup.read_fd >= 0)
+    _dbus_wakeup_pipe_close (&validator->wakeup);
+
+  pthread_cond_destroy (&validator->cond);
+  pthread_mutex_destroy (&validator->lock);
+  dbus_free (validator->threads);
+  dbus_free (validator);
+}
+
+/**
+ * Sets the smallest body that connections set up from now on have
+ * validated on the threads.
+ *
+ * @param validator the validator
+ * @param min_size size in bytes
+ */
+void
+bus_validator_set_min_size (BusValidator *validator,
+                            long          min_size)
+{
+  validator->min_size = min_size;
+}
+
+/**
+ * Has the connection's huge message bodies validated on the threads.
+ * While one is, the connection doesn't read any further.
+ *
+ * @param validator the validator
+ * @param connection a new connection
+ */
+void
+bus_validator_setup_connection (BusValidator   *validator,
+                                DBusConnection *connection)
+{
+  _dbus_connection_set_body_check_function (connection, validator->min_size,
+                                            validator_check_body, validator);
+}
+
+#else /* DBUS_WIN */
+
+/* No threads here; bodies are validated on the main loop as they are read */
+
+BusValidator*
+bus_validator_new (BusContext *context,
+                   int         n_threads,
+                   DBusError  *error)
+{
+  return NULL;
+}
+
+void
+bus_validator_free (BusValidator *validator)
+{
+  _dbus_assert_not_reached ("no validator on this platform");
+}
+
+void
+bus_validator_set_min_size (BusValidator *validator,
+                            long          min_size)
+{
+}
+
+void
+bus_validator_setup_connection (BusValidator   *validator,
+                                DBusConnection *connection)
+{
+}
+
+#endif /* DBUS_WIN */
@@ -0,0 +1,37 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* validator.h  Threads that validate the bodies of huge messages
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_VALIDATOR_H
+#define BUS_VALIDATOR_H
+
+#include <dbus/dbus.h>
+#include "bus.h"
+
+BusValidator* bus_validator_new              (BusContext     *context,
+                                              int             n_threads,
+                                              DBusError      *error);
+void          bus_validator_free             (BusValidator   *validator);
+void          bus_validator_set_min_size     (BusValidator   *validator,
+                                              long            min_size);
+void          bus_validator_setup_connection (BusValidator   *validator,
+                                              DBusConnection *connection);
+
+#endif /* BUS_VALIDATOR_H */
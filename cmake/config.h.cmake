@@ -69,6 +69,18 @@
 #undef DBUS_PATH_OR_ABSTRACT_VALUE
 #endif
 
+/* epoll */
+#cmakedefine DBUS_HAVE_LINUX_EPOLL 1
+
+/* zlib compression of TCP connections, see dbus/dbus-compress.c */
+#cmakedefine HAVE_ZLIB 1
+
+/* USDT probes, see dbus/dbus-probes.h */
+#cmakedefine DBUS_ENABLE_USDT 1
+
+/* native recursive pthread mutexes, see dbus/dbus-threads-internal.h */
+#cmakedefine DBUS_NATIVE_MUTEXES 1
+
 /* selinux */
 #cmakedefine DBUS_BUS_ENABLE_DNOTIFY_ON_LINUX 1
 /* kqueue */
@@ -125,6 +137,9 @@
 /* Define to 1 if you have wspiapi.h */
 #cmakedefine   HAVE_WSPIAPI_H 1
 
+/* Define to 1 if you have afunix.h */
+#cmakedefine   HAVE_AFUNIX_H 1
+
 /* Define to 1 if you have unistd.h */
 #cmakedefine   HAVE_UNISTD_H 1
 
@@ -168,6 +183,18 @@
 /* Define to 1 if you have socketpair */
 #cmakedefine   HAVE_SOCKETPAIR 1
 
+/* Define to 1 if you have eventfd */
+#cmakedefine   HAVE_EVENTFD 1
+
+/* Define to 1 if you have mlockall */
+#cmakedefine   HAVE_MLOCKALL 1
+
+/* Define to 1 if you have mallopt */
+#cmakedefine   HAVE_MALLOPT 1
+
+/* Define to 1 if you have sched_setscheduler */
+#cmakedefine   HAVE_SCHED_SETSCHEDULER 1
+
 /* Define to 1 if you have setenv */
 #cmakedefine   HAVE_SETENV 1
 
@@ -52,6 +52,9 @@
         #endif
       
 
+/* Define to use epoll(4) on Linux */
+#define DBUS_HAVE_LINUX_EPOLL 1
+
 /* Defined if we have gcc 3.3 and thus the new gcov format */
 #undef DBUS_HAVE_GCC33_GCOV
 
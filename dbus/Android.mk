@@ -9,15 +9,19 @@ LOCAL_SRC_FILES:= \
 dbus-address.c \
 dbus-auth.c \
 dbus-bus.c \
+dbus-compress.c \
 dbus-connection.c \
+dbus-connection-pool.c \
 dbus-credentials.c \
 dbus-dataslot.c \
 dbus-errors.c \
 dbus-file.c \
 dbus-file-unix.c \
+dbus-flight-recorder.c \
 dbus-hash.c \
 dbus-internals.c \
 dbus-keyring.c \
+dbus-latency.c \
 dbus-list.c \
 dbus-mainloop.c \
 dbus-marshal-basic.c \
@@ -32,6 +36,7 @@ dbus-nonce.c \
 dbus-pending-call.c \
 dbus-pipe.c \
 dbus-pipe-unix.c \
+dbus-property-cache.c \
 dbus-resources.c \
 dbus-server.c \
 dbus-server-socket.c \
@@ -39,6 +44,9 @@ dbus-server-unix.c \
 dbus-sha.c \
 dbus-shell.c \
 dbus-signature.c \
+dbus-socket-set.c \
+dbus-socket-set-epoll.c \
+dbus-socket-set-poll.c \
 dbus-spawn.c \
 dbus-string.c \
 dbus-string-util.c \
@@ -49,6 +57,7 @@ dbus-sysdeps-util-unix.c \
 dbus-timeout.c \
 dbus-threads.c \
 dbus-transport.c \
+dbus-transport-mux.c \
 dbus-transport-socket.c \
 dbus-transport-unix.c \
 dbus-object-tree.c \
@@ -77,3 +86,23 @@ LOCAL_SHARED_LIBRARIES+= libcutils
 endif
 
 include $(BUILD_SHARED_LIBRARY)
+
+ifeq ($(DBUS_SINGLE_THREADED_DAEMON),true)
+# The same sources again with the locking compiled out, linked only
+# into dbus-daemon; see bus/Android.mk
+libdbus_src_files := $(LOCAL_SRC_FILES)
+libdbus_cflags := $(LOCAL_CFLAGS)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= $(libdbus_src_files)
+
+LOCAL_C_INCLUDES+= \
+	$(call include-path-for, dbus)
+
+LOCAL_MODULE:=libdbus-daemon-internal
+
+LOCAL_CFLAGS:= $(libdbus_cflags) -DDBUS_SINGLE_THREADED
+
+include $(BUILD_STATIC_LIBRARY)
+endif
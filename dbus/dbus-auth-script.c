@@ -462,6 +462,24 @@ _dbus_auth_script_run (const DBusString *filename)
         {
           auth_set_unix_credentials (auth, 4312, DBUS_PID_UNSET);
         }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "COMPRESSION_POSSIBLE"))
+        {
+          if (!_dbus_compression_available ())
+            {
+              /* skip this file */
+              _dbus_warn ("skipping compression auth script, built without compression\n");
+              retval = TRUE;
+              goto out;
+            }
+
+          _dbus_auth_set_compression_possible (auth, TRUE);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "MULTIPLEX_POSSIBLE"))
+        {
+          _dbus_auth_set_multiplex_possible (auth, TRUE);
+        }
       else if (_dbus_string_starts_with_c_str (&line,
                                                "ALLOWED_MECHS"))
         {
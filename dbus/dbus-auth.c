@@ -30,6 +30,7 @@
 #include "dbus-sha.h"
 #include "dbus-protocol.h"
 #include "dbus-credentials.h"
+#include "dbus-compress.h"
 
 /**
  * @defgroup DBusAuth Authentication
@@ -126,7 +127,11 @@ typedef enum {
   DBUS_AUTH_COMMAND_ERROR,
   DBUS_AUTH_COMMAND_UNKNOWN,
   DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD,
-  DBUS_AUTH_COMMAND_AGREE_UNIX_FD
+  DBUS_AUTH_COMMAND_AGREE_UNIX_FD,
+  DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION,
+  DBUS_AUTH_COMMAND_AGREE_COMPRESSION,
+  DBUS_AUTH_COMMAND_NEGOTIATE_MULTIPLEX,
+  DBUS_AUTH_COMMAND_AGREE_MULTIPLEX
 } DBusAuthCommand;
 
 /**
@@ -191,6 +196,17 @@ struct DBusAuth
 
   unsigned int unix_fd_possible : 1;  /**< This side could do unix fd passing */
   unsigned int unix_fd_negotiated : 1; /**< Unix fd was successfully negotiated */
+  unsigned int unix_fd_negotiate_pipelined : 1; /**< Client sent NEGOTIATE_UNIX_FD along with its first AUTH */
+  unsigned int unix_fd_negotiate_pending : 1; /**< Pipelined NEGOTIATE_UNIX_FD is answered once we get OK */
+  unsigned int unix_fd_negotiate_error_expected : 1; /**< AUTH was rejected, so the server errors the pipelined NEGOTIATE_UNIX_FD */
+
+  unsigned int compression_possible : 1;   /**< This side could compress the message stream */
+  unsigned int compression_negotiated : 1; /**< Compression was successfully negotiated */
+
+  DBusCompressor *compressor;       /**< Stream compression state once negotiated, or #NULL */
+
+  unsigned int multiplex_possible : 1;   /**< This side could carry channels over the stream */
+  unsigned int multiplex_negotiated : 1; /**< Multiplexing was successfully negotiated */
 };
 
 /**
@@ -234,6 +250,8 @@ static dbus_bool_t send_begin                (DBusAuth *auth);
 static dbus_bool_t send_cancel               (DBusAuth *auth);
 static dbus_bool_t send_negotiate_unix_fd    (DBusAuth *auth);
 static dbus_bool_t send_agree_unix_fd        (DBusAuth *auth);
+static dbus_bool_t send_negotiate_compression_or_begin (DBusAuth *auth);
+static dbus_bool_t send_negotiate_multiplex_or_begin (DBusAuth *auth);
 
 /**
  * Client states
@@ -275,6 +293,12 @@ static dbus_bool_t handle_client_state_waiting_for_reject (DBusAuth         *aut
 static dbus_bool_t handle_client_state_waiting_for_agree_unix_fd (DBusAuth         *auth,
                                                            DBusAuthCommand   command,
                                                            const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_compression (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_multiplex (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
 
 static const DBusAuthStateData client_state_need_send_auth = {
   "NeedSendAuth", NULL
@@ -291,6 +315,12 @@ static const DBusAuthStateData client_state_waiting_for_reject = {
 static const DBusAuthStateData client_state_waiting_for_agree_unix_fd = {
   "WaitingForAgreeUnixFD", handle_client_state_waiting_for_agree_unix_fd
 };
+static const DBusAuthStateData client_state_waiting_for_agree_compression = {
+  "WaitingForAgreeCompression", handle_client_state_waiting_for_agree_compression
+};
+static const DBusAuthStateData client_state_waiting_for_agree_multiplex = {
+  "WaitingForAgreeMultiplex", handle_client_state_waiting_for_agree_multiplex
+};
 
 /**
  * Common terminal states.  Terminal states have handler == NULL.
@@ -1583,11 +1613,18 @@ process_ok(DBusAuth *auth,
   _dbus_verbose ("Got GUID '%s' from the server\n",
                  _dbus_string_get_const_data (& DBUS_AUTH_CLIENT (auth)->guid_from_server));
 
+  if (auth->unix_fd_negotiate_pending)
+    {
+      /* Already asked; the server's answer is the next line */
+      goto_state (auth, &client_state_waiting_for_agree_unix_fd);
+      return TRUE;
+    }
+
   if (auth->unix_fd_possible)
     return send_negotiate_unix_fd(auth);
 
   _dbus_verbose("Not negotiating unix fd passing, since not possible\n");
-  return send_begin (auth);
+  return send_negotiate_compression_or_begin (auth);
 }
 
 static dbus_bool_t
@@ -1673,6 +1710,113 @@ send_agree_unix_fd (DBusAuth *auth)
   return TRUE;
 }
 
+static dbus_bool_t
+send_negotiate_compression_or_begin (DBusAuth *auth)
+{
+  if (!auth->compression_possible)
+    return send_negotiate_multiplex_or_begin (auth);
+
+  if (!_dbus_string_append (&auth->outgoing,
+                            "NEGOTIATE_COMPRESSION " DBUS_COMPRESSION_DEFLATE "\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_agree_compression);
+  return TRUE;
+}
+
+/* Only one algorithm exists so far; args is the client's list of
+ * algorithms it would accept, in order of preference.
+ */
+static dbus_bool_t
+args_offer_deflate (const DBusString *args)
+{
+  DBusString word;
+  int next;
+  int len;
+  dbus_bool_t found;
+
+  len = _dbus_string_get_length (args);
+  next = 0;
+  found = FALSE;
+  while (!found && next < len)
+    {
+      int start;
+      int end;
+
+      _dbus_string_skip_blank (args, next, &start);
+      _dbus_string_find_blank (args, start, &end);
+      if (end == start)
+        break;
+
+      _dbus_string_init_const (&word, DBUS_COMPRESSION_DEFLATE);
+      found = end - start == _dbus_string_get_length (&word) &&
+        _dbus_string_equal_substring (args, start, end - start, &word, 0);
+      next = end;
+    }
+
+  return found;
+}
+
+static dbus_bool_t
+send_agree_compression (DBusAuth *auth)
+{
+  int orig_len;
+
+  _dbus_assert (auth->compression_possible);
+
+  if (auth->compressor == NULL)
+    {
+      auth->compressor = _dbus_compressor_new ();
+      if (auth->compressor == NULL)
+        return FALSE;
+    }
+
+  orig_len = _dbus_string_get_length (&auth->outgoing);
+  if (!_dbus_string_append (&auth->outgoing,
+                            "AGREE_COMPRESSION " DBUS_COMPRESSION_DEFLATE "\r\n"))
+    {
+      _dbus_string_set_length (&auth->outgoing, orig_len);
+      return FALSE;
+    }
+
+  auth->compression_negotiated = TRUE;
+  _dbus_verbose ("Agreed to " DBUS_COMPRESSION_DEFLATE " compression\n");
+
+  goto_state (auth, &server_state_waiting_for_begin);
+  return TRUE;
+}
+
+/* A compressed stream is never also multiplexed, so a client that got
+ * compression goes straight to BEGIN
+ */
+static dbus_bool_t
+send_negotiate_multiplex_or_begin (DBusAuth *auth)
+{
+  if (!auth->multiplex_possible)
+    return send_begin (auth);
+
+  if (!_dbus_string_append (&auth->outgoing, "NEGOTIATE_MULTIPLEX\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_agree_multiplex);
+  return TRUE;
+}
+
+static dbus_bool_t
+send_agree_multiplex (DBusAuth *auth)
+{
+  _dbus_assert (auth->multiplex_possible);
+
+  if (!_dbus_string_append (&auth->outgoing, "AGREE_MULTIPLEX\r\n"))
+    return FALSE;
+
+  auth->multiplex_negotiated = TRUE;
+  _dbus_verbose ("Agreed to multiplexing\n");
+
+  goto_state (auth, &server_state_waiting_for_begin);
+  return TRUE;
+}
+
 static dbus_bool_t
 handle_auth (DBusAuth *auth, const DBusString *args)
 {
@@ -1765,12 +1909,16 @@ handle_server_state_waiting_for_auth  (DBusAuth         *auth,
       return send_rejected (auth);
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MULTIPLEX:
+    case DBUS_AUTH_COMMAND_AGREE_MULTIPLEX:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1798,12 +1946,16 @@ handle_server_state_waiting_for_data  (DBusAuth         *auth,
       return TRUE;
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MULTIPLEX:
+    case DBUS_AUTH_COMMAND_AGREE_MULTIPLEX:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1832,10 +1984,26 @@ handle_server_state_waiting_for_begin (DBusAuth         *auth,
       else
         return send_error(auth, "Unix FD passing not supported, not authenticated or otherwise not possible");
 
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+      if (auth->compression_possible && !auth->compression_negotiated &&
+          args_offer_deflate (args))
+        return send_agree_compression (auth);
+      else
+        return send_error (auth, "Compression not supported, no common algorithm or already negotiated");
+
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MULTIPLEX:
+      if (auth->multiplex_possible && !auth->multiplex_negotiated &&
+          !auth->compression_negotiated)
+        return send_agree_multiplex (auth);
+      else
+        return send_error (auth, "Multiplexing not supported or not possible on a compressed stream");
+
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_MULTIPLEX:
     default:
       return send_error (auth, "Unknown command");
 
@@ -1953,6 +2121,16 @@ process_rejected (DBusAuth *auth, const DBusString *args)
 
   client = DBUS_AUTH_CLIENT (auth);
 
+  if (auth->unix_fd_negotiate_pending)
+    {
+      /* The server answers the NEGOTIATE_UNIX_FD we sent along with
+       * the rejected AUTH with an ERROR, which isn't about whatever we
+       * try next.
+       */
+      auth->unix_fd_negotiate_pending = FALSE;
+      auth->unix_fd_negotiate_error_expected = TRUE;
+    }
+
   if (!auth->already_got_mechanisms)
     {
       if (!record_mechanisms (auth, args))
@@ -2011,6 +2189,10 @@ handle_client_state_waiting_for_data (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MULTIPLEX:
+    case DBUS_AUTH_COMMAND_AGREE_MULTIPLEX:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2039,6 +2221,10 @@ handle_client_state_waiting_for_ok (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MULTIPLEX:
+    case DBUS_AUTH_COMMAND_AGREE_MULTIPLEX:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2063,6 +2249,10 @@ handle_client_state_waiting_for_reject (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MULTIPLEX:
+    case DBUS_AUTH_COMMAND_AGREE_MULTIPLEX:
     default:
       goto_state (auth, &common_state_need_disconnect);
       return TRUE;
@@ -2079,13 +2269,110 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
       _dbus_assert(auth->unix_fd_possible);
       auth->unix_fd_negotiated = TRUE;
+      auth->unix_fd_negotiate_pending = FALSE;
       _dbus_verbose("Sucessfully negotiated UNIX FD passing\n");
-      return send_begin (auth);
+      return send_negotiate_compression_or_begin (auth);
 
     case DBUS_AUTH_COMMAND_ERROR:
       _dbus_assert(auth->unix_fd_possible);
       auth->unix_fd_negotiated = FALSE;
+      auth->unix_fd_negotiate_pending = FALSE;
       _dbus_verbose("Failed to negotiate UNIX FD passing\n");
+      return send_negotiate_compression_or_begin (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MULTIPLEX:
+    case DBUS_AUTH_COMMAND_AGREE_MULTIPLEX:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_compression (DBusAuth         *auth,
+                                                   DBusAuthCommand   command,
+                                                   const DBusString *args)
+{
+  DBusString word;
+
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+      _dbus_assert (auth->compression_possible);
+      _dbus_string_init_const (&word, DBUS_COMPRESSION_DEFLATE);
+      if (!_dbus_string_equal (args, &word))
+        {
+          /* We only offered one algorithm */
+          _dbus_verbose ("Server agreed to an algorithm we did not offer\n");
+          goto_state (auth, &common_state_need_disconnect);
+          return TRUE;
+        }
+
+      /* On OOM we get the same line again, so keep what we have */
+      if (auth->compressor == NULL)
+        {
+          auth->compressor = _dbus_compressor_new ();
+          if (auth->compressor == NULL)
+            return FALSE;
+        }
+
+      if (!send_begin (auth))
+        return FALSE;
+
+      auth->compression_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated " DBUS_COMPRESSION_DEFLATE " compression\n");
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert (auth->compression_possible);
+      auth->compression_negotiated = FALSE;
+      _dbus_verbose ("Failed to negotiate compression\n");
+      return send_negotiate_multiplex_or_begin (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_multiplex (DBusAuth         *auth,
+                                                 DBusAuthCommand   command,
+                                                 const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_MULTIPLEX:
+      _dbus_assert (auth->multiplex_possible);
+      if (!send_begin (auth))
+        return FALSE;
+
+      auth->multiplex_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated multiplexing\n");
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert (auth->multiplex_possible);
+      auth->multiplex_negotiated = FALSE;
+      _dbus_verbose ("Failed to negotiate multiplexing\n");
       return send_begin (auth);
 
     case DBUS_AUTH_COMMAND_OK:
@@ -2096,6 +2383,10 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_BEGIN:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MULTIPLEX:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2118,7 +2409,11 @@ static const DBusAuthCommandName auth_command_names[] = {
   { "OK",                DBUS_AUTH_COMMAND_OK },
   { "ERROR",             DBUS_AUTH_COMMAND_ERROR },
   { "NEGOTIATE_UNIX_FD", DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD },
-  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD }
+  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD },
+  { "NEGOTIATE_COMPRESSION", DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION },
+  { "AGREE_COMPRESSION", DBUS_AUTH_COMMAND_AGREE_COMPRESSION },
+  { "NEGOTIATE_MULTIPLEX", DBUS_AUTH_COMMAND_NEGOTIATE_MULTIPLEX },
+  { "AGREE_MULTIPLEX",   DBUS_AUTH_COMMAND_AGREE_MULTIPLEX }
 };
 
 static DBusAuthCommand
@@ -2212,6 +2507,16 @@ process_command (DBusAuth *auth)
    */
   
   command = lookup_command_from_name (&line);
+
+  if (command == DBUS_AUTH_COMMAND_ERROR &&
+      auth->unix_fd_negotiate_error_expected)
+    {
+      _dbus_verbose ("%s: ignoring ERROR for pipelined NEGOTIATE_UNIX_FD\n",
+                     DBUS_AUTH_NAME (auth));
+      auth->unix_fd_negotiate_error_expected = FALSE;
+      goto next_command;
+    }
+
   if (!(* auth->state->handler) (auth, command, &args))
     goto out;
 
@@ -2284,6 +2589,7 @@ _dbus_auth_server_new (const DBusString *guid)
   server_auth = DBUS_AUTH_SERVER (auth);
 
   server_auth->guid = guid_copy;
+  _dbus_string_relocated (&server_auth->guid);
   
   /* perhaps this should be per-mechanism with a lower
    * max
@@ -2318,6 +2624,7 @@ _dbus_auth_client_new (void)
     }
 
   DBUS_AUTH_CLIENT (auth)->guid_from_server = guid_str;
+  _dbus_string_relocated (&DBUS_AUTH_CLIENT (auth)->guid_from_server);
 
   auth->side = auth_side_client;
   auth->state = &client_state_need_send_auth;
@@ -2391,6 +2698,9 @@ _dbus_auth_unref (DBusAuth *auth)
       _dbus_credentials_unref (auth->credentials);
       _dbus_credentials_unref (auth->authorized_identity);
       _dbus_credentials_unref (auth->desired_identity);
+
+      if (auth->compressor)
+        _dbus_compressor_free (auth->compressor);
       
       dbus_free (auth);
     }
@@ -2432,6 +2742,34 @@ _dbus_auth_set_mechanisms (DBusAuth    *auth,
  */
 #define DBUS_AUTH_IN_END_STATE(auth) ((auth)->state->handler == NULL)
 
+/* The client's first AUTH is queued by _dbus_auth_client_new(), before
+ * the transport has told us whether unix fd passing is possible. For
+ * EXTERNAL the server answers right away with OK or REJECTED, and either
+ * way processes the next line in a well-defined state, so we can send
+ * NEGOTIATE_UNIX_FD in the same write instead of waiting a round trip
+ * for the OK. Nothing else is pipelined: BEGIN after a rejected AUTH
+ * makes the server disconnect.
+ */
+static dbus_bool_t
+maybe_pipeline_negotiate_unix_fd (DBusAuth *auth)
+{
+  if (!DBUS_AUTH_IS_CLIENT (auth) ||
+      auth->unix_fd_negotiate_pipelined ||
+      !auth->unix_fd_possible ||
+      auth->state != &client_state_waiting_for_data ||
+      auth->mech != &all_mechanisms[0] ||
+      _dbus_string_get_length (&auth->incoming) > 0)
+    return TRUE;
+
+  if (!_dbus_string_append (&auth->outgoing,
+                            "NEGOTIATE_UNIX_FD\r\n"))
+    return FALSE;
+
+  auth->unix_fd_negotiate_pipelined = TRUE;
+  auth->unix_fd_negotiate_pending = TRUE;
+  return TRUE;
+}
+
 /**
  * Analyzes buffered input and moves the auth conversation forward,
  * returning the new state of the auth conversation.
@@ -2444,6 +2782,12 @@ _dbus_auth_do_work (DBusAuth *auth)
 {
   auth->needed_memory = FALSE;
 
+  if (!maybe_pipeline_negotiate_unix_fd (auth))
+    {
+      auth->needed_memory = TRUE;
+      return DBUS_AUTH_STATE_WAITING_FOR_MEMORY;
+    }
+
   /* Max amount we'll buffer up before deciding someone's on crack */
 #define MAX_BUFFER (16 * _DBUS_ONE_KILOBYTE)
 
@@ -2817,6 +3161,66 @@ _dbus_auth_get_unix_fd_negotiated(DBusAuth *auth)
   return auth->unix_fd_negotiated;
 }
 
+/**
+ * Sets whether compressing the message stream after authentication is
+ * acceptable on the transport and hence shall be negotiated. Has no
+ * effect if libdbus was built without compression support.
+ *
+ * @param auth the auth conversation
+ * @param b TRUE when compression shall be negotiated, otherwise FALSE
+ */
+void
+_dbus_auth_set_compression_possible (DBusAuth    *auth,
+                                     dbus_bool_t  b)
+{
+  auth->compression_possible = b && _dbus_compression_available ();
+}
+
+/**
+ * Gets the compressor for the message stream, if compression was
+ * negotiated. Only valid once authenticated.
+ *
+ * @param auth the auth conversation
+ * @returns the compressor, or #NULL if the stream is not compressed
+ */
+DBusCompressor*
+_dbus_auth_get_compressor (DBusAuth *auth)
+{
+  if (auth->state != &common_state_authenticated ||
+      !auth->compression_negotiated)
+    return NULL;
+
+  return auth->compressor;
+}
+
+/**
+ * Sets whether carrying several logical connections over the message
+ * stream is acceptable on the transport and hence shall be negotiated.
+ *
+ * @param auth the auth conversation
+ * @param b TRUE when multiplexing shall be negotiated, otherwise FALSE
+ */
+void
+_dbus_auth_set_multiplex_possible (DBusAuth    *auth,
+                                   dbus_bool_t  b)
+{
+  auth->multiplex_possible = b;
+}
+
+/**
+ * Queries whether multiplexing was negotiated. Only valid once
+ * authenticated.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if the message stream carries channels
+ */
+dbus_bool_t
+_dbus_auth_get_multiplexed (DBusAuth *auth)
+{
+  return auth->state == &common_state_authenticated &&
+    auth->multiplex_negotiated;
+}
+
 /** @} */
 
 /* tests in dbus-auth-util.c */
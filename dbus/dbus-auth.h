@@ -27,6 +27,7 @@
 #include <dbus/dbus-errors.h>
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-compress.h>
 
 DBUS_BEGIN_DECLS
 
@@ -77,6 +78,12 @@ const char*   _dbus_auth_get_guid_from_server(DBusAuth               *auth);
 
 void          _dbus_auth_set_unix_fd_possible(DBusAuth               *auth, dbus_bool_t b);
 dbus_bool_t   _dbus_auth_get_unix_fd_negotiated(DBusAuth             *auth);
+void          _dbus_auth_set_compression_possible (DBusAuth          *auth,
+                                                   dbus_bool_t        b);
+DBusCompressor* _dbus_auth_get_compressor       (DBusAuth               *auth);
+void          _dbus_auth_set_multiplex_possible (DBusAuth            *auth,
+                                                 dbus_bool_t          b);
+dbus_bool_t   _dbus_auth_get_multiplexed     (DBusAuth               *auth);
 
 DBUS_END_DECLS
 
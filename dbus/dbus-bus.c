@@ -27,9 +27,11 @@
 #include "dbus-protocol.h"
 #include "dbus-internals.h"
 #include "dbus-message.h"
+#include "dbus-pending-call.h"
 #include "dbus-marshal-validate.h"
 #include "dbus-threads-internal.h"
 #include "dbus-connection-internal.h"
+#include "dbus-hash.h"
 #include "dbus-string.h"
 
 /**
@@ -77,10 +79,29 @@ typedef struct
 {
   DBusConnection *connection; /**< Connection we're associated with */
   char *unique_name; /**< Unique name of this connection */
+  DBusHashTable *watched_names; /**< Names from dbus_bus_watch_name() to #BusWatchedName, or #NULL */
+  DBusList *pool_rules; /**< Match rules added since a #DBusConnectionPool handed us out */
+  DBusList *pool_names; /**< Names requested since a #DBusConnectionPool handed us out */
 
   unsigned int is_well_known : 1; /**< Is one of the well-known connections in our global array */
+  unsigned int have_watch_filter : 1; /**< watched_names_filter() is on the connection */
+  unsigned int pooled : 1; /**< Remember rules and names in pool_rules and pool_names */
+  unsigned int pool_lost_track : 1; /**< Ran out of memory remembering one, so we can't be reset */
 } BusData;
 
+/**
+ * What we know about the owner of a name someone is watching.
+ */
+typedef struct
+{
+  int refcount;          /**< Number of dbus_bus_watch_name() calls for the name */
+  char *owner;           /**< Unique name of the owner, #NULL if none */
+  unsigned int known : 1; /**< owner has been seeded from GetNameOwner */
+  unsigned int updated : 1; /**< A NameOwnerChanged was dispatched since GetNameOwner was sent */
+  unsigned int lost : 1;  /**< Ran out of memory applying a NameOwnerChanged, so owner can't be trusted */
+  unsigned int have_match : 1; /**< We added a match rule for the name */
+} BusWatchedName;
+
 /** The slot we have reserved to store BusData.
  */
 static dbus_int32_t bus_data_slot = -1;
@@ -88,7 +109,10 @@ static dbus_int32_t bus_data_slot = -1;
 /** Number of bus types */
 #define N_BUS_TYPES 3
 
-static DBusConnection *bus_connections[N_BUS_TYPES];
+/* Written under the bus lock, but read without it by dbus_bus_get(),
+ * see bus_connection_get_published()
+ */
+static DBusConnection * volatile bus_connections[N_BUS_TYPES];
 static char *bus_connection_addresses[N_BUS_TYPES] = { NULL, NULL, NULL };
 
 static DBusBusType activation_bus_type = DBUS_BUS_STARTER;
@@ -108,6 +132,59 @@ _DBUS_DEFINE_GLOBAL_LOCK (bus);
  */
 _DBUS_DEFINE_GLOBAL_LOCK (bus_datas);
 
+/** dbus_bus_get() calls between reading bus_connections and reffing */
+static DBusAtomic bus_get_readers = { 0 };
+
+/* The lock-free side of dbus_bus_get(). The weak ref in
+ * bus_connections is only valid while the connection is connected,
+ * since dbus-connection.c drops its strong ref after disconnecting;
+ * so a reader announces itself before looking, and
+ * bus_connection_unpublish_unlocked() waits for readers to finish
+ * before the disconnection goes any further.
+ */
+static DBusConnection *
+bus_connection_get_published (DBusBusType type)
+{
+  DBusConnection *connection;
+
+  _dbus_atomic_inc (&bus_get_readers);
+
+  connection = _dbus_atomic_pointer_get ((void * volatile *) &bus_connections[type]);
+  if (connection != NULL)
+    dbus_connection_ref (connection);
+
+  _dbus_atomic_dec (&bus_get_readers);
+
+  return connection;
+}
+
+static void
+bus_connection_publish_unlocked (DBusBusType     type,
+                                 DBusConnection *connection)
+{
+  _dbus_atomic_pointer_set ((void * volatile *) &bus_connections[type],
+                            connection);
+}
+
+static void
+bus_connection_unpublish_unlocked (DBusBusType type)
+{
+  dbus_int32_t readers;
+
+  bus_connection_publish_unlocked (type, NULL);
+
+  /* There is no _dbus_atomic_get; see
+   * _dbus_connection_close_if_only_one_ref(). The count includes
+   * our own increment.
+   */
+  do
+    {
+      _dbus_atomic_inc (&bus_get_readers);
+      readers = _dbus_atomic_dec (&bus_get_readers);
+    }
+  while (readers > 1);
+}
+
 static void
 addresses_shutdown_func (void *data)
 {
@@ -340,13 +417,21 @@ bus_data_free (void *data)
       while (i < N_BUS_TYPES)
         {
           if (bus_connections[i] == bd->connection)
-            bus_connections[i] = NULL;
+            bus_connection_unpublish_unlocked (i);
           
           ++i;
         }
       _DBUS_UNLOCK (bus);
     }
   
+  if (bd->watched_names != NULL)
+    _dbus_hash_table_unref (bd->watched_names);
+
+  _dbus_list_foreach (&bd->pool_rules, (DBusForeachFunction) dbus_free, NULL);
+  _dbus_list_clear (&bd->pool_rules);
+  _dbus_list_foreach (&bd->pool_names, (DBusForeachFunction) dbus_free, NULL);
+  _dbus_list_clear (&bd->pool_names);
+
   dbus_free (bd->unique_name);
   dbus_free (bd);
 
@@ -414,13 +499,217 @@ _dbus_bus_notify_shared_connection_disconnected_unlocked (DBusConnection *connec
     {
       if (bus_connections[i] == connection)
         {
-          bus_connections[i] = NULL;
+          bus_connection_unpublish_unlocked (i);
         }
     }
 
   _DBUS_UNLOCK (bus);
 }
 
+/* Called with the bus_datas lock held. Returns the connection's
+ * BusData if a pool handed it out, without creating one.
+ */
+static BusData *
+get_pooled_bus_data_unlocked (DBusConnection *connection)
+{
+  BusData *bd;
+
+  if (bus_data_slot < 0)
+    return NULL;
+
+  bd = dbus_connection_get_data (connection, bus_data_slot);
+  if (bd == NULL || !bd->pooled)
+    return NULL;
+
+  return bd;
+}
+
+/* Remembers a rule or name for _dbus_bus_reset_for_pool(); names are
+ * only remembered once, rules as often as they are added
+ */
+static void
+pool_remember_unlocked (BusData     *bd,
+                        DBusList   **list,
+                        const char  *str)
+{
+  DBusList *link;
+  char *copy;
+
+  if (list == &bd->pool_names)
+    {
+      for (link = _dbus_list_get_first_link (list);
+           link != NULL;
+           link = _dbus_list_get_next_link (list, link))
+        {
+          if (strcmp (link->data, str) == 0)
+            return;
+        }
+    }
+
+  copy = _dbus_strdup (str);
+  if (copy == NULL || !_dbus_list_append (list, copy))
+    {
+      dbus_free (copy);
+      bd->pool_lost_track = TRUE;
+    }
+}
+
+/* Forgets the most recently remembered copy of a rule or name */
+static void
+pool_forget_unlocked (BusData     *bd,
+                      DBusList   **list,
+                      const char  *str)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_last_link (list);
+       link != NULL;
+       link = _dbus_list_get_prev_link (list, link))
+    {
+      if (strcmp (link->data, str) == 0)
+        {
+          dbus_free (link->data);
+          _dbus_list_remove_link (list, link);
+          return;
+        }
+    }
+}
+
+/* Remembers or forgets a rule or name if a pool handed out the connection */
+static void
+pool_update (DBusConnection *connection,
+             dbus_bool_t     is_rule,
+             dbus_bool_t     remember,
+             const char     *str)
+{
+  BusData *bd;
+
+  _DBUS_LOCK (bus_datas);
+
+  bd = get_pooled_bus_data_unlocked (connection);
+  if (bd != NULL)
+    {
+      DBusList **list = is_rule ? &bd->pool_rules : &bd->pool_names;
+
+      if (remember)
+        pool_remember_unlocked (bd, list, str);
+      else
+        pool_forget_unlocked (bd, list, str);
+    }
+
+  _DBUS_UNLOCK (bus_datas);
+}
+
+/**
+ * Starts remembering the match rules a connection adds and the names
+ * it requests through the dbus_bus_* functions, so that
+ * _dbus_bus_reset_for_pool() can take them back. Used by
+ * #DBusConnectionPool on the connections it opens.
+ *
+ * @param connection a registered connection
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_bus_track_for_pool (DBusConnection *connection)
+{
+  BusData *bd;
+
+  _DBUS_LOCK (bus_datas);
+
+  bd = ensure_bus_data (connection);
+  if (bd != NULL)
+    bd->pooled = TRUE;
+
+  _DBUS_UNLOCK (bus_datas);
+
+  return bd != NULL;
+}
+
+/* Sends one of our own cleanup calls; nobody waits for the reply */
+static dbus_bool_t
+send_pool_cleanup (DBusConnection *connection,
+                   const char     *method,
+                   const char     *arg)
+{
+  DBusMessage *message;
+  dbus_bool_t retval;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
+  if (message == NULL)
+    return FALSE;
+
+  dbus_message_set_no_reply (message, TRUE);
+  retval = dbus_message_append_args (message,
+                                     DBUS_TYPE_STRING, &arg,
+                                     DBUS_TYPE_INVALID) &&
+    dbus_connection_send (connection, message, NULL);
+
+  dbus_message_unref (message);
+  return retval;
+}
+
+/**
+ * Releases the names and removes the match rules remembered since
+ * _dbus_bus_track_for_pool(). The calls are only queued, not waited
+ * for; the bus handles them before anything sent on the connection
+ * afterwards.
+ *
+ * Rules added or names requested with plain messages instead of the
+ * dbus_bus_* functions aren't known here and stay in place.
+ *
+ * @param connection the connection
+ * @returns #FALSE if the connection can't be reset: it watches names
+ * with dbus_bus_watch_name(), we lost track of something or no memory
+ */
+dbus_bool_t
+_dbus_bus_reset_for_pool (DBusConnection *connection)
+{
+  BusData *bd;
+  DBusList *rules;
+  DBusList *names;
+  dbus_bool_t retval;
+  char *str;
+
+  _DBUS_LOCK (bus_datas);
+
+  bd = get_pooled_bus_data_unlocked (connection);
+  if (bd == NULL || bd->pool_lost_track ||
+      (bd->watched_names != NULL &&
+       _dbus_hash_table_get_n_entries (bd->watched_names) > 0))
+    {
+      _DBUS_UNLOCK (bus_datas);
+      return FALSE;
+    }
+
+  rules = bd->pool_rules;
+  bd->pool_rules = NULL;
+  names = bd->pool_names;
+  bd->pool_names = NULL;
+
+  _DBUS_UNLOCK (bus_datas);
+
+  retval = TRUE;
+
+  while ((str = _dbus_list_pop_first (&names)) != NULL)
+    {
+      if (retval)
+        retval = send_pool_cleanup (connection, "ReleaseName", str);
+      dbus_free (str);
+    }
+
+  while ((str = _dbus_list_pop_first (&rules)) != NULL)
+    {
+      if (retval)
+        retval = send_pool_cleanup (connection, "RemoveMatch", str);
+      dbus_free (str);
+    }
+
+  return retval;
+}
+
 static DBusConnection *
 internal_bus_get (DBusBusType  type,
                   dbus_bool_t  private,
@@ -434,6 +723,16 @@ internal_bus_get (DBusBusType  type,
   _dbus_return_val_if_fail (type >= 0 && type < N_BUS_TYPES, NULL);
   _dbus_return_val_if_error_is_set (error, NULL);
 
+  /* Once connected, a well-known bus needs no lock. The starter bus
+   * may really be another type, which is decided under the lock.
+   */
+  if (!private && type != DBUS_BUS_STARTER)
+    {
+      connection = bus_connection_get_published (type);
+      if (connection != NULL)
+        return connection;
+    }
+
   _DBUS_LOCK (bus);
 
   if (!init_connections_unlocked ())
@@ -498,15 +797,6 @@ internal_bus_get (DBusBusType  type,
       return NULL;
     }
 
-  if (!private)
-    {
-      /* store a weak ref to the connection (dbus-connection.c is
-       * supposed to have a strong ref that it drops on disconnect,
-       * since this is a shared connection)
-       */
-      bus_connections[type] = connection;
-    }
-
   /* By default we're bound to the lifecycle of
    * the message bus.
    */
@@ -520,6 +810,15 @@ internal_bus_get (DBusBusType  type,
   bd->is_well_known = TRUE;
   _DBUS_UNLOCK (bus_datas);
 
+  if (!private)
+    {
+      /* store a weak ref to the connection (dbus-connection.c is
+       * supposed to have a strong ref that it drops on disconnect,
+       * since this is a shared connection); last, since from here on
+       * dbus_bus_get() may return it without the lock
+       */
+      bus_connection_publish_unlocked (type, connection);
+    }
   
   _DBUS_UNLOCK (bus);
 
@@ -730,99 +1029,334 @@ dbus_bus_register (DBusConnection *connection,
 }
 
 
-/**
- * Sets the unique name of the connection, as assigned by the message
- * bus.  Can only be used if you registered with the bus manually
- * (i.e. if you did not call dbus_bus_register()). Can only be called
- * once per connection.  After the unique name is set, you can get it
- * with dbus_bus_get_unique_name().
- *
- * The only reason to use this function is to re-implement the
- * equivalent of dbus_bus_register() yourself. One (probably unusual)
- * reason to do that might be to do the bus registration call
- * asynchronously instead of synchronously.
- *
- * @note Just use dbus_bus_get() or dbus_bus_get_private(), or worst
- * case dbus_bus_register(), instead of messing with this
- * function. There's really no point creating pain for yourself by
- * doing things manually.
- *
- * It's hard to use this function safely on shared connections
- * (created by dbus_connection_open()) in a multithreaded application,
- * because only one registration attempt can be sent to the bus. If
- * two threads are both sending the registration message, there is no
- * mechanism in libdbus itself to avoid sending it twice.
- *
- * Thus, you need a way to coordinate which thread sends the
- * registration attempt; which also means you know which thread
- * will call dbus_bus_set_unique_name(). If you don't know
- * about all threads in the app (for example, if some libraries
- * you're using might start libdbus-using threads), then you
- * need to avoid using this function on shared connections.
- *
- * @param connection the connection
- * @param unique_name the unique name
- * @returns #FALSE if not enough memory
+/* Sends one bus method call, dropping our reference to the message;
+ * returns FALSE if no memory, including when message is NULL.
  */
-dbus_bool_t
-dbus_bus_set_unique_name (DBusConnection *connection,
-                          const char     *unique_name)
+static dbus_bool_t
+queue_bus_call (DBusConnection   *connection,
+                DBusMessage      *message,
+                DBusPendingCall **pending_p)
 {
-  BusData *bd;
-  dbus_bool_t success;
-
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (unique_name != NULL, FALSE);
+  dbus_bool_t retval;
 
-  _DBUS_LOCK (bus_datas);
-  
-  bd = ensure_bus_data (connection);
-  if (bd == NULL)
+  if (message == NULL)
     return FALSE;
 
-  _dbus_assert (bd->unique_name == NULL);
-  
-  bd->unique_name = _dbus_strdup (unique_name);
-  success = bd->unique_name != NULL;
-  
-  _DBUS_UNLOCK (bus_datas);
-  
-  return success;
+  retval = dbus_connection_send_with_reply (connection, message, pending_p, -1);
+  dbus_message_unref (message);
+
+  return retval;
 }
 
 /**
- * Gets the unique name of the connection as assigned by the message
- * bus. Only possible after the connection has been registered with
- * the message bus. All connections returned by dbus_bus_get() or
- * dbus_bus_get_private() have been successfully registered.
- *
- * The name remains valid until the connection is freed, and
- * should not be freed by the caller.
+ * Like dbus_bus_register(), but also adds the given match rules and
+ * requests the given names. All the method calls are sent in one go
+ * and their replies collected afterwards, so a service starting up
+ * waits for one round trip to the bus instead of one per call.
+ *
+ * The bus handles the calls in order, so the match rules are in
+ * place before the names are requested. If any call fails, the
+ * error from the first failure is returned and the replies to the
+ * remaining calls are discarded (the calls themselves can't be
+ * taken back, so some rules may have been added and some names
+ * acquired regardless).
  *
- * Other than dbus_bus_get(), there are two ways to set the unique
- * name; one is dbus_bus_register(), the other is
- * dbus_bus_set_unique_name().  You are responsible for calling
- * dbus_bus_set_unique_name() if you register by hand instead of using
- * dbus_bus_register().
- * 
  * @param connection the connection
- * @returns the unique name or #NULL on error
+ * @param match_rules #NULL-terminated array of match rules, or #NULL
+ * @param names #NULL-terminated array of names to request, or #NULL
+ * @param flags flags for every name request, as for dbus_bus_request_name()
+ * @param results array to receive the request result code of each name, or #NULL
+ * @param error place to store errors
+ * @returns #TRUE on success
  */
-const char*
-dbus_bus_get_unique_name (DBusConnection *connection)
+dbus_bool_t
+dbus_bus_register_full (DBusConnection  *connection,
+                        const char     **match_rules,
+                        const char     **names,
+                        unsigned int     flags,
+                        int             *results,
+                        DBusError       *error)
 {
+  DBusMessage *message, *reply;
+  DBusPendingCall **pendings;
   BusData *bd;
-  const char *unique_name;
+  char *unique_name;
+  dbus_uint32_t result;
+  int n_rules, n_names, n_pendings, first_rule, first_name, i;
+  dbus_bool_t retval;
 
-  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  n_rules = 0;
+  while (match_rules != NULL && match_rules[n_rules] != NULL)
+    ++n_rules;
+
+  n_names = 0;
+  while (names != NULL && names[n_names] != NULL)
+    {
+      _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (names[n_names]), FALSE);
+      ++n_names;
+    }
+
+  retval = FALSE;
+  reply = NULL;
 
   _DBUS_LOCK (bus_datas);
-  
+
   bd = ensure_bus_data (connection);
   if (bd == NULL)
-    return NULL;
-
-  unique_name = bd->unique_name;
+    {
+      _DBUS_SET_OOM (error);
+      _DBUS_UNLOCK (bus_datas);
+      return FALSE;
+    }
+
+  if (bd->unique_name != NULL)
+    _dbus_verbose ("Ignoring attempt to register the same DBusConnection %s with the message bus a second time.\n",
+                   bd->unique_name);
+
+  first_rule = bd->unique_name == NULL ? 1 : 0;
+  first_name = first_rule + n_rules;
+  n_pendings = first_name + n_names;
+
+  if (n_pendings == 0)
+    {
+      _DBUS_UNLOCK (bus_datas);
+
+      /* Success! */
+      return TRUE;
+    }
+
+  pendings = dbus_new0 (DBusPendingCall*, n_pendings);
+  if (pendings == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      _DBUS_UNLOCK (bus_datas);
+      return FALSE;
+    }
+
+  if (first_rule > 0)
+    {
+      message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                              DBUS_PATH_DBUS,
+                                              DBUS_INTERFACE_DBUS,
+                                              "Hello");
+      if (!queue_bus_call (connection, message, &pendings[0]))
+        goto oom;
+    }
+
+  for (i = 0; i < n_rules; i++)
+    {
+      message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                              DBUS_PATH_DBUS,
+                                              DBUS_INTERFACE_DBUS,
+                                              "AddMatch");
+      if (message != NULL &&
+          !dbus_message_append_args (message,
+                                     DBUS_TYPE_STRING, &match_rules[i],
+                                     DBUS_TYPE_INVALID))
+        {
+          dbus_message_unref (message);
+          message = NULL;
+        }
+
+      if (!queue_bus_call (connection, message, &pendings[first_rule + i]))
+        goto oom;
+
+      if (bd->pooled)
+        pool_remember_unlocked (bd, &bd->pool_rules, match_rules[i]);
+    }
+
+  for (i = 0; i < n_names; i++)
+    {
+      message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                              DBUS_PATH_DBUS,
+                                              DBUS_INTERFACE_DBUS,
+                                              "RequestName");
+      if (message != NULL &&
+          !dbus_message_append_args (message,
+                                     DBUS_TYPE_STRING, &names[i],
+                                     DBUS_TYPE_UINT32, &flags,
+                                     DBUS_TYPE_INVALID))
+        {
+          dbus_message_unref (message);
+          message = NULL;
+        }
+
+      if (!queue_bus_call (connection, message, &pendings[first_name + i]))
+        goto oom;
+
+      if (bd->pooled)
+        pool_remember_unlocked (bd, &bd->pool_names, names[i]);
+    }
+
+  retval = TRUE;
+
+  for (i = 0; i < n_pendings && retval; i++)
+    {
+      /* send_with_reply gives back no pending call once disconnected */
+      if (pendings[i] == NULL)
+        {
+          dbus_set_error (error, DBUS_ERROR_DISCONNECTED, "Connection is closed");
+          retval = FALSE;
+          break;
+        }
+
+      dbus_pending_call_block (pendings[i]);
+      reply = dbus_pending_call_steal_reply (pendings[i]);
+      _dbus_assert (reply != NULL);
+
+      if (dbus_set_error_from_message (error, reply))
+        retval = FALSE;
+      else if (i < first_rule)
+        {
+          if (!dbus_message_get_args (reply, error,
+                                      DBUS_TYPE_STRING, &unique_name,
+                                      DBUS_TYPE_INVALID))
+            retval = FALSE;
+          else
+            {
+              bd->unique_name = _dbus_strdup (unique_name);
+              if (bd->unique_name == NULL)
+                {
+                  _DBUS_SET_OOM (error);
+                  retval = FALSE;
+                }
+            }
+        }
+      else if (i >= first_name)
+        {
+          if (!dbus_message_get_args (reply, error,
+                                      DBUS_TYPE_UINT32, &result,
+                                      DBUS_TYPE_INVALID))
+            retval = FALSE;
+          else if (results != NULL)
+            results[i - first_name] = result;
+        }
+
+      dbus_message_unref (reply);
+      reply = NULL;
+    }
+
+  goto out;
+
+ oom:
+  _DBUS_SET_OOM (error);
+
+ out:
+  for (i = 0; i < n_pendings; i++)
+    {
+      if (pendings[i] == NULL)
+        continue;
+
+      if (!dbus_pending_call_get_completed (pendings[i]))
+        dbus_pending_call_cancel (pendings[i]);
+      dbus_pending_call_unref (pendings[i]);
+    }
+  dbus_free (pendings);
+
+  if (!retval)
+    _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  _DBUS_UNLOCK (bus_datas);
+
+  return retval;
+}
+
+/**
+ * Sets the unique name of the connection, as assigned by the message
+ * bus.  Can only be used if you registered with the bus manually
+ * (i.e. if you did not call dbus_bus_register()). Can only be called
+ * once per connection.  After the unique name is set, you can get it
+ * with dbus_bus_get_unique_name().
+ *
+ * The only reason to use this function is to re-implement the
+ * equivalent of dbus_bus_register() yourself. One (probably unusual)
+ * reason to do that might be to do the bus registration call
+ * asynchronously instead of synchronously.
+ *
+ * @note Just use dbus_bus_get() or dbus_bus_get_private(), or worst
+ * case dbus_bus_register(), instead of messing with this
+ * function. There's really no point creating pain for yourself by
+ * doing things manually.
+ *
+ * It's hard to use this function safely on shared connections
+ * (created by dbus_connection_open()) in a multithreaded application,
+ * because only one registration attempt can be sent to the bus. If
+ * two threads are both sending the registration message, there is no
+ * mechanism in libdbus itself to avoid sending it twice.
+ *
+ * Thus, you need a way to coordinate which thread sends the
+ * registration attempt; which also means you know which thread
+ * will call dbus_bus_set_unique_name(). If you don't know
+ * about all threads in the app (for example, if some libraries
+ * you're using might start libdbus-using threads), then you
+ * need to avoid using this function on shared connections.
+ *
+ * @param connection the connection
+ * @param unique_name the unique name
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_bus_set_unique_name (DBusConnection *connection,
+                          const char     *unique_name)
+{
+  BusData *bd;
+  dbus_bool_t success;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (unique_name != NULL, FALSE);
+
+  _DBUS_LOCK (bus_datas);
+  
+  bd = ensure_bus_data (connection);
+  if (bd == NULL)
+    return FALSE;
+
+  _dbus_assert (bd->unique_name == NULL);
+  
+  bd->unique_name = _dbus_strdup (unique_name);
+  success = bd->unique_name != NULL;
+  
+  _DBUS_UNLOCK (bus_datas);
+  
+  return success;
+}
+
+/**
+ * Gets the unique name of the connection as assigned by the message
+ * bus. Only possible after the connection has been registered with
+ * the message bus. All connections returned by dbus_bus_get() or
+ * dbus_bus_get_private() have been successfully registered.
+ *
+ * The name remains valid until the connection is freed, and
+ * should not be freed by the caller.
+ *
+ * Other than dbus_bus_get(), there are two ways to set the unique
+ * name; one is dbus_bus_register(), the other is
+ * dbus_bus_set_unique_name().  You are responsible for calling
+ * dbus_bus_set_unique_name() if you register by hand instead of using
+ * dbus_bus_register().
+ * 
+ * @param connection the connection
+ * @returns the unique name or #NULL on error
+ */
+const char*
+dbus_bus_get_unique_name (DBusConnection *connection)
+{
+  BusData *bd;
+  const char *unique_name;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+
+  _DBUS_LOCK (bus_datas);
+  
+  bd = ensure_bus_data (connection);
+  if (bd == NULL)
+    return NULL;
+
+  unique_name = bd->unique_name;
 
   _DBUS_UNLOCK (bus_datas);
   
@@ -1162,6 +1696,9 @@ dbus_bus_request_name (DBusConnection *connection,
     }
 
   dbus_message_unref (reply);
+
+  if (result != DBUS_REQUEST_NAME_REPLY_EXISTS)
+    pool_update (connection, FALSE, TRUE, name);
   
   return result;
 }
@@ -1247,9 +1784,193 @@ dbus_bus_release_name (DBusConnection *connection,
 
   dbus_message_unref (reply);
 
+  pool_update (connection, FALSE, FALSE, name);
+
   return result;
 }
 
+static void
+watched_name_free (void *data)
+{
+  BusWatchedName *w = data;
+
+  /* the hash table passes NULL when inserting a new entry */
+  if (w == NULL)
+    return;
+
+  dbus_free (w->owner);
+  dbus_free (w);
+}
+
+/* Only to be called with the bus_datas lock held */
+static BusWatchedName *
+lookup_watched_name_unlocked (DBusConnection  *connection,
+                              const char      *name,
+                              DBusHashTable  **table_p)
+{
+  BusData *bd;
+
+  if (bus_data_slot < 0)
+    return NULL;
+
+  bd = dbus_connection_get_data (connection, bus_data_slot);
+  if (bd == NULL || bd->watched_names == NULL)
+    return NULL;
+
+  if (table_p != NULL)
+    *table_p = bd->watched_names;
+
+  return _dbus_hash_table_lookup_string (bd->watched_names, name);
+}
+
+/* Signals are applied in the order they are dispatched. Their serials
+ * can't be compared with each other or with a reply's: the bus sends
+ * one NameOwnerChanged to all its recipients, numbered by whichever
+ * connection it went out on first.
+ */
+static void
+update_watched_name_unlocked (BusWatchedName *w,
+                              const char     *owner)
+{
+  char *copy;
+
+  w->updated = TRUE;
+
+  copy = NULL;
+  if (owner != NULL && *owner != '\0')
+    {
+      copy = _dbus_strdup (owner);
+
+      /* No memory; stop trusting what we have */
+      if (copy == NULL)
+        {
+          w->known = FALSE;
+          w->lost = TRUE;
+          return;
+        }
+    }
+
+  dbus_free (w->owner);
+  w->owner = copy;
+}
+
+static DBusHandlerResult
+watched_names_filter (DBusConnection *connection,
+                      DBusMessage    *message,
+                      void           *user_data)
+{
+  BusWatchedName *w;
+  const char *name;
+  const char *old_owner;
+  const char *new_owner;
+
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                               "NameOwnerChanged") ||
+      !dbus_message_has_sender (message, DBUS_SERVICE_DBUS) ||
+      !dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_STRING, &old_owner,
+                              DBUS_TYPE_STRING, &new_owner,
+                              DBUS_TYPE_INVALID))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  _DBUS_LOCK (bus_datas);
+
+  w = lookup_watched_name_unlocked (connection, name, NULL);
+  if (w != NULL)
+    update_watched_name_unlocked (w, new_owner);
+
+  _DBUS_UNLOCK (bus_datas);
+
+  /* the application may be watching too */
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static char *
+watch_rule_new (const char *name)
+{
+  DBusString rule;
+  char *str;
+
+  if (!_dbus_string_init (&rule))
+    return NULL;
+
+  if (!_dbus_string_append_printf (&rule,
+                                   "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+                                   "interface='" DBUS_INTERFACE_DBUS "',"
+                                   "member='NameOwnerChanged',arg0='%s'",
+                                   name) ||
+      !_dbus_string_steal_data (&rule, &str))
+    str = NULL;
+
+  _dbus_string_free (&rule);
+
+  return str;
+}
+
+/* Asks the bus with GetNameOwner. Returns #NULL without setting
+ * error if the name has no owner.
+ */
+static char *
+get_name_owner (DBusConnection *connection,
+                const char     *name,
+                DBusError      *error)
+{
+  DBusMessage *message, *reply;
+  DBusError tmp_error;
+  const char *owner;
+  char *copy;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "GetNameOwner");
+  if (message == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  dbus_error_init (&tmp_error);
+  reply = dbus_connection_send_with_reply_and_block (connection, message, -1,
+                                                     &tmp_error);
+  dbus_message_unref (message);
+
+  if (reply == NULL)
+    {
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NAME_HAS_NO_OWNER))
+        dbus_error_free (&tmp_error);
+      else
+        dbus_move_error (&tmp_error, error);
+      return NULL;
+    }
+
+  if (!dbus_message_get_args (reply, error,
+                              DBUS_TYPE_STRING, &owner,
+                              DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  copy = _dbus_strdup (owner);
+  dbus_message_unref (reply);
+
+  if (copy == NULL)
+    _DBUS_SET_OOM (error);
+
+  return copy;
+}
+
 /**
  * Asks the bus whether a certain name has an owner.
  *
@@ -1261,6 +1982,9 @@ dbus_bus_release_name (DBusConnection *connection,
  * if you want to avoid replacing a current owner,
  * don't specify #DBUS_NAME_FLAG_REPLACE_EXISTING and
  * you will get an error if there's already an owner.
+ *
+ * If the name is being watched with dbus_bus_watch_name(), the
+ * answer comes from memory instead of the bus.
  * 
  * @param connection the connection
  * @param name the name
@@ -1273,12 +1997,23 @@ dbus_bus_name_has_owner (DBusConnection *connection,
                          DBusError      *error)
 {
   DBusMessage *message, *reply;
+  BusWatchedName *w;
   dbus_bool_t exists;
 
   _dbus_return_val_if_fail (connection != NULL, FALSE);
   _dbus_return_val_if_fail (name != NULL, FALSE);
   _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), FALSE);
   _dbus_return_val_if_error_is_set (error, FALSE);
+
+  _DBUS_LOCK (bus_datas);
+  w = lookup_watched_name_unlocked (connection, name, NULL);
+  if (w != NULL && w->known && dbus_connection_get_is_connected (connection))
+    {
+      exists = w->owner != NULL;
+      _DBUS_UNLOCK (bus_datas);
+      return exists;
+    }
+  _DBUS_UNLOCK (bus_datas);
   
   message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
                                           DBUS_PATH_DBUS,
@@ -1321,6 +2056,243 @@ dbus_bus_name_has_owner (DBusConnection *connection,
   return exists;
 }
 
+/**
+ * Starts keeping track of who owns a name, so that
+ * dbus_bus_name_has_owner() and dbus_bus_get_cached_name_owner()
+ * can answer without asking the bus. This adds a match rule for the
+ * name's NameOwnerChanged signals and asks the bus for the current
+ * owner, blocking until both are done.
+ *
+ * The signals are seen through a filter on the connection, so the
+ * cached owner is only as fresh as the last dispatch.
+ *
+ * Calls nest: each one needs a matching dbus_bus_unwatch_name().
+ *
+ * @param connection the connection
+ * @param name the name to watch
+ * @param error location to store any errors
+ * @returns #TRUE if the name is now watched, #FALSE with error set if not
+ */
+dbus_bool_t
+dbus_bus_watch_name (DBusConnection *connection,
+                     const char     *name,
+                     DBusError      *error)
+{
+  BusData *bd;
+  BusWatchedName *w;
+  DBusError tmp_error;
+  char *owner;
+  char *key;
+  char *rule;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (name != NULL, FALSE);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  _DBUS_LOCK (bus_datas);
+
+  bd = ensure_bus_data (connection);
+  if (bd == NULL)
+    goto oom_locked;
+
+  if (bd->watched_names == NULL)
+    {
+      bd->watched_names = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                dbus_free,
+                                                watched_name_free);
+      if (bd->watched_names == NULL)
+        goto oom_locked;
+    }
+
+  /* Someone else already watches it, and has seeded it or is about
+   * to
+   */
+  w = _dbus_hash_table_lookup_string (bd->watched_names, name);
+  if (w != NULL)
+    {
+      w->refcount += 1;
+      _DBUS_UNLOCK (bus_datas);
+      return TRUE;
+    }
+
+  if (!bd->have_watch_filter)
+    {
+      if (!dbus_connection_add_filter (connection, watched_names_filter,
+                                       NULL, NULL))
+        goto oom_locked;
+      bd->have_watch_filter = TRUE;
+    }
+
+  w = dbus_new0 (BusWatchedName, 1);
+  key = _dbus_strdup (name);
+  if (w == NULL || key == NULL ||
+      !_dbus_hash_table_insert_string (bd->watched_names, key, w))
+    {
+      dbus_free (w);
+      dbus_free (key);
+      goto oom_locked;
+    }
+  w->refcount = 1;
+
+  _DBUS_UNLOCK (bus_datas);
+
+  dbus_error_init (&tmp_error);
+
+  rule = watch_rule_new (name);
+  if (rule == NULL)
+    {
+      _DBUS_SET_OOM (&tmp_error);
+      goto failed;
+    }
+
+  dbus_bus_add_match (connection, rule, &tmp_error);
+  dbus_free (rule);
+  if (dbus_error_is_set (&tmp_error))
+    goto failed;
+
+  /* We hold a reference, so w stays put */
+  _DBUS_LOCK (bus_datas);
+  w = lookup_watched_name_unlocked (connection, name, NULL);
+  _dbus_assert (w != NULL);
+  w->have_match = TRUE;
+  w->updated = FALSE;
+  _DBUS_UNLOCK (bus_datas);
+
+  owner = get_name_owner (connection, name, &tmp_error);
+  if (dbus_error_is_set (&tmp_error))
+    goto failed;
+
+  _DBUS_LOCK (bus_datas);
+  w = lookup_watched_name_unlocked (connection, name, NULL);
+  _dbus_assert (w != NULL);
+
+  /* If another thread dispatched a signal for the name meanwhile, we
+   * can't tell whether it is newer than the reply. Keep what it said:
+   * if it is older, the signals for any later change are still to be
+   * dispatched.
+   */
+  if (!w->updated)
+    {
+      dbus_free (w->owner);
+      w->owner = owner;
+      owner = NULL;
+    }
+  w->known = !w->lost;
+  _DBUS_UNLOCK (bus_datas);
+
+  dbus_free (owner);
+  return TRUE;
+
+ oom_locked:
+  _DBUS_UNLOCK (bus_datas);
+  _DBUS_SET_OOM (error);
+  return FALSE;
+
+ failed:
+  dbus_move_error (&tmp_error, error);
+  dbus_bus_unwatch_name (connection, name);
+  return FALSE;
+}
+
+/**
+ * Undoes one dbus_bus_watch_name() call. Once the last one is
+ * undone, the match rule is removed without waiting for the bus, and
+ * the name is looked up on the bus again.
+ *
+ * @param connection the connection
+ * @param name the watched name
+ */
+void
+dbus_bus_unwatch_name (DBusConnection *connection,
+                       const char     *name)
+{
+  DBusHashTable *table;
+  BusWatchedName *w;
+  dbus_bool_t have_match;
+  char *rule;
+
+  _dbus_return_if_fail (connection != NULL);
+  _dbus_return_if_fail (name != NULL);
+
+  _DBUS_LOCK (bus_datas);
+
+  w = lookup_watched_name_unlocked (connection, name, &table);
+  if (w == NULL)
+    {
+      _DBUS_UNLOCK (bus_datas);
+      _dbus_warn_check_failed ("Attempt to unwatch name %s, which is not watched\n",
+                               name);
+      return;
+    }
+
+  w->refcount -= 1;
+  if (w->refcount > 0)
+    {
+      _DBUS_UNLOCK (bus_datas);
+      return;
+    }
+
+  have_match = w->have_match;
+  _dbus_hash_table_remove_string (table, name);
+
+  _DBUS_UNLOCK (bus_datas);
+
+  if (!have_match)
+    return;
+
+  /* if this fails, we only get some signals we ignore */
+  rule = watch_rule_new (name);
+  if (rule != NULL)
+    {
+      dbus_bus_remove_match (connection, rule, NULL);
+      dbus_free (rule);
+    }
+}
+
+/**
+ * Gets the unique name of a name's owner. For a name watched with
+ * dbus_bus_watch_name(), this needs no round trip to the bus;
+ * otherwise it calls GetNameOwner and blocks.
+ *
+ * @param connection the connection
+ * @param name the name
+ * @param error location to store any errors
+ * @returns the owner's unique name, to be freed with dbus_free(), or
+ *   #NULL if the name has no owner or error is set
+ */
+char*
+dbus_bus_get_cached_name_owner (DBusConnection *connection,
+                                const char     *name,
+                                DBusError      *error)
+{
+  BusWatchedName *w;
+  char *owner;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (name != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  _DBUS_LOCK (bus_datas);
+  w = lookup_watched_name_unlocked (connection, name, NULL);
+  if (w != NULL && w->known && dbus_connection_get_is_connected (connection))
+    {
+      owner = NULL;
+      if (w->owner != NULL)
+        {
+          owner = _dbus_strdup (w->owner);
+          if (owner == NULL)
+            _DBUS_SET_OOM (error);
+        }
+      _DBUS_UNLOCK (bus_datas);
+      return owner;
+    }
+  _DBUS_UNLOCK (bus_datas);
+
+  return get_name_owner (connection, name, error);
+}
+
 /**
  * Starts a service that will request ownership of the given name.
  * The returned result will be one of be one of
@@ -1538,6 +2510,9 @@ dbus_bus_add_match (DBusConnection *connection,
   send_no_return_values (connection, msg, error);
 
   dbus_message_unref (msg);
+
+  if (error == NULL || !dbus_error_is_set (error))
+    pool_update (connection, TRUE, TRUE, rule);
 }
 
 /**
@@ -1582,6 +2557,262 @@ dbus_bus_remove_match (DBusConnection *connection,
   send_no_return_values (connection, msg, error);
 
   dbus_message_unref (msg);
+
+  pool_update (connection, TRUE, FALSE, rule);
+}
+
+/* Sends each rule as its own AddMatch or RemoveMatch, without waiting
+ * for replies; for buses that predate the batched calls
+ */
+static dbus_bool_t
+send_match_calls (DBusConnection  *connection,
+                  const char      *method,
+                  const char     **rules,
+                  int              n_rules)
+{
+  int i;
+
+  for (i = 0; i < n_rules; i++)
+    {
+      DBusMessage *msg;
+      dbus_bool_t sent;
+
+      msg = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
+      if (msg == NULL)
+        return FALSE;
+
+      dbus_message_set_no_reply (msg, TRUE);
+      sent = dbus_message_append_args (msg, DBUS_TYPE_STRING, &rules[i],
+                                       DBUS_TYPE_INVALID) &&
+        dbus_connection_send (connection, msg, NULL);
+      dbus_message_unref (msg);
+
+      if (!sent)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct
+{
+  DBusConnection *connection; /**< Not a reference; we only use it while it dispatches our reply */
+  const char *method; /**< The single-rule call to fall back to */
+  char **rules;
+  int n_rules;
+} MatchesFallback;
+
+static void
+matches_fallback_free (void *data)
+{
+  MatchesFallback *fallback = data;
+
+  dbus_free_string_array (fallback->rules);
+  dbus_free (fallback);
+}
+
+/* Nobody waits for the reply to a batch sent without an error to set,
+ * but if the bus doesn't know the batched call we still have to get
+ * the rules to it one at a time
+ */
+static void
+matches_fallback_notify (DBusPendingCall *pending,
+                         void            *data)
+{
+  MatchesFallback *fallback = data;
+  DBusMessage *reply;
+
+  reply = dbus_pending_call_steal_reply (pending);
+  if (reply == NULL)
+    return;
+
+  if (dbus_message_is_error (reply, DBUS_ERROR_UNKNOWN_METHOD))
+    send_match_calls (fallback->connection, fallback->method,
+                      (const char **) fallback->rules, fallback->n_rules);
+
+  dbus_message_unref (reply);
+}
+
+/* Sends AddMatches or RemoveMatches. With an error to set, blocks for
+ * the reply and returns it, leaving the caller to fall back on
+ * UnknownMethod; without, returns #NULL at once and falls back to
+ * single calls later if the bus turns out not to know the batched one.
+ */
+static DBusMessage*
+send_matches (DBusConnection  *connection,
+              const char      *method,
+              const char      *single_method,
+              const char     **rules,
+              int              n_rules,
+              DBusError       *error)
+{
+  MatchesFallback *fallback;
+  DBusPendingCall *pending;
+  DBusMessage *msg;
+  DBusMessage *reply;
+
+  msg = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                      DBUS_PATH_DBUS,
+                                      DBUS_INTERFACE_DBUS,
+                                      method);
+  if (msg == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (!dbus_message_append_args (msg,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &rules, n_rules,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (msg);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (error != NULL)
+    {
+      reply = dbus_connection_send_with_reply_and_block (connection, msg,
+                                                         -1, error);
+      dbus_message_unref (msg);
+
+      return reply;
+    }
+
+  /* Silently-fail nonblocking codepath, as for a single rule */
+  fallback = dbus_new0 (MatchesFallback, 1);
+  if (fallback == NULL)
+    goto out;
+
+  fallback->connection = connection;
+  fallback->method = single_method;
+  fallback->n_rules = n_rules;
+  fallback->rules = _dbus_dup_string_array (rules);
+  if (fallback->rules == NULL && n_rules > 0)
+    {
+      dbus_free (fallback);
+      goto out;
+    }
+
+  if (!dbus_connection_send_with_reply (connection, msg, &pending, -1))
+    {
+      matches_fallback_free (fallback);
+      goto out;
+    }
+
+  if (pending == NULL ||
+      !dbus_pending_call_set_notify (pending, matches_fallback_notify,
+                                     fallback, matches_fallback_free))
+    matches_fallback_free (fallback);
+
+  if (pending != NULL)
+    dbus_pending_call_unref (pending);
+
+ out:
+  dbus_message_unref (msg);
+  return NULL;
+}
+
+/**
+ * Adds several match rules in one call, as if by
+ * dbus_bus_add_match() for each of them, but in a single round trip
+ * to the bus. Either all of the rules are added or, on error, none
+ * of them.
+ *
+ * As with dbus_bus_add_match(), passing #NULL for the error means not
+ * blocking and not finding out about errors. A bus too old to know
+ * the batched call is sent one AddMatch per rule instead.
+ *
+ * @param connection connection to the message bus
+ * @param rules textual forms of the match rules
+ * @param n_rules number of rules
+ * @param error location to store any errors
+ */
+void
+dbus_bus_add_matches (DBusConnection  *connection,
+                      const char     **rules,
+                      int              n_rules,
+                      DBusError       *error)
+{
+  DBusMessage *reply;
+  int i;
+
+  _dbus_return_if_fail (rules != NULL || n_rules == 0);
+  _dbus_return_if_fail (n_rules >= 0);
+
+  reply = send_matches (connection, "AddMatches", "AddMatch",
+                        rules, n_rules, error);
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  else if (error != NULL && dbus_error_has_name (error, DBUS_ERROR_UNKNOWN_METHOD))
+    {
+      /* An older bus; dbus_bus_add_match() remembers each rule itself */
+      dbus_error_free (error);
+
+      for (i = 0; i < n_rules; i++)
+        {
+          dbus_bus_add_match (connection, rules[i], error);
+          if (dbus_error_is_set (error))
+            {
+              while (i > 0)
+                dbus_bus_remove_match (connection, rules[--i], NULL);
+              break;
+            }
+        }
+
+      return;
+    }
+
+  if (error == NULL || !dbus_error_is_set (error))
+    {
+      for (i = 0; i < n_rules; i++)
+        pool_update (connection, TRUE, TRUE, rules[i]);
+    }
+}
+
+/**
+ * Removes several match rules in one call, as if by
+ * dbus_bus_remove_match() for each of them, but in a single round
+ * trip to the bus. A rule that wasn't added is skipped rather than
+ * being an error.
+ *
+ * If you pass #NULL for the error, this function will not block;
+ * otherwise it will. See dbus_bus_add_matches().
+ *
+ * @param connection connection to the message bus
+ * @param rules textual forms of the match rules
+ * @param n_rules number of rules
+ * @param error location to store any errors
+ */
+void
+dbus_bus_remove_matches (DBusConnection  *connection,
+                         const char     **rules,
+                         int              n_rules,
+                         DBusError       *error)
+{
+  DBusMessage *reply;
+  int i;
+
+  _dbus_return_if_fail (rules != NULL || n_rules == 0);
+  _dbus_return_if_fail (n_rules >= 0);
+
+  reply = send_matches (connection, "RemoveMatches", "RemoveMatch",
+                        rules, n_rules, error);
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  else if (error != NULL && dbus_error_has_name (error, DBUS_ERROR_UNKNOWN_METHOD))
+    {
+      /* An older bus; rules it doesn't have are skipped either way */
+      dbus_error_free (error);
+      if (!send_match_calls (connection, "RemoveMatch", rules, n_rules))
+        _DBUS_SET_OOM (error);
+    }
+
+  for (i = 0; i < n_rules; i++)
+    pool_update (connection, TRUE, FALSE, rules[i]);
 }
 
 /** @} */
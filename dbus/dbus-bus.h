@@ -47,6 +47,13 @@ DBUS_EXPORT
 dbus_bool_t     dbus_bus_register         (DBusConnection *connection,
 					   DBusError      *error);
 DBUS_EXPORT
+dbus_bool_t     dbus_bus_register_full    (DBusConnection  *connection,
+                                           const char     **match_rules,
+                                           const char     **names,
+                                           unsigned int     flags,
+                                           int             *results,
+                                           DBusError       *error);
+DBUS_EXPORT
 dbus_bool_t     dbus_bus_set_unique_name  (DBusConnection *connection,
 					   const char     *unique_name);
 DBUS_EXPORT
@@ -71,6 +78,17 @@ DBUS_EXPORT
 dbus_bool_t     dbus_bus_name_has_owner   (DBusConnection *connection,
 					   const char     *name,
 					   DBusError      *error);
+DBUS_EXPORT
+dbus_bool_t     dbus_bus_watch_name       (DBusConnection *connection,
+                                           const char     *name,
+                                           DBusError      *error);
+DBUS_EXPORT
+void            dbus_bus_unwatch_name     (DBusConnection *connection,
+                                           const char     *name);
+DBUS_EXPORT
+char*           dbus_bus_get_cached_name_owner (DBusConnection *connection,
+                                                const char     *name,
+                                                DBusError      *error);
 
 DBUS_EXPORT
 dbus_bool_t     dbus_bus_start_service_by_name (DBusConnection *connection,
@@ -87,6 +105,16 @@ DBUS_EXPORT
 void            dbus_bus_remove_match     (DBusConnection *connection,
                                            const char     *rule,
                                            DBusError      *error);
+DBUS_EXPORT
+void            dbus_bus_add_matches      (DBusConnection  *connection,
+                                           const char     **rules,
+                                           int              n_rules,
+                                           DBusError       *error);
+DBUS_EXPORT
+void            dbus_bus_remove_matches   (DBusConnection  *connection,
+                                           const char     **rules,
+                                           int              n_rules,
+                                           DBusError       *error);
 
 /** @} */
 
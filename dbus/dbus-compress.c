@@ -0,0 +1,582 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-compress.c Stream compression for negotiated transports
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-compress.h"
+#include "dbus-internals.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/**
+ * @defgroup DBusCompress Stream compression
+ * @ingroup  DBusInternals
+ * @brief Compression of the message stream on transports that negotiated it
+ *
+ * When both ends agree on it during authentication (see
+ * NEGOTIATE_COMPRESSION in dbus-auth.c), each direction of the
+ * connection is a single raw deflate stream. The sender compresses whatever
+ * batch of messages it is about to write and flushes the stream to a
+ * byte boundary at the end of it, so the receiver can decode every
+ * batch as soon as it arrives, while small messages still benefit
+ * from the history of everything sent before them.
+ *
+ * @{
+ */
+
+/** Batches smaller than this are sent as stored (uncompressed) blocks */
+#define COMPRESSION_THRESHOLD 256
+
+/** Level for batches worth compressing; these links are short of bandwidth, not CPU */
+#define COMPRESSION_LEVEL 6
+
+/** Least space to decompress into at a time */
+#define DECOMPRESS_ROOM 4096
+
+/** Raw deflate with a 32k window; negative means no zlib header, since
+ * both ends already agreed on what the stream is
+ */
+#define COMPRESSION_WINDOW_BITS (-15)
+
+#ifdef HAVE_ZLIB
+
+/**
+ * Both directions of one connection's compressed stream.
+ */
+struct DBusCompressor
+{
+  z_stream deflater;  /**< Outgoing stream */
+  z_stream inflater;  /**< Incoming stream */
+  DBusString pending; /**< Received bytes not yet decompressed */
+  int level;          /**< Level the deflater is currently set to */
+};
+
+/* Routing zlib's allocations through dbus_malloc() lets the OOM
+ * tests reach them
+ */
+static voidpf
+compress_alloc (voidpf opaque,
+                uInt   items,
+                uInt   size)
+{
+  if (size != 0 && items > _DBUS_INT_MAX / size)
+    return NULL;
+
+  return dbus_malloc (items * size);
+}
+
+static void
+compress_free (voidpf opaque,
+               voidpf address)
+{
+  dbus_free (address);
+}
+
+static const Bytef no_dictionary[1] = { 0 };
+
+/**
+ * Whether this build of libdbus can compress at all.
+ *
+ * @returns #TRUE if compression can be negotiated
+ */
+dbus_bool_t
+_dbus_compression_available (void)
+{
+  return TRUE;
+}
+
+/**
+ * Creates the compression state for one connection.
+ *
+ * @returns the new compressor, or #NULL if no memory
+ */
+DBusCompressor*
+_dbus_compressor_new (void)
+{
+  DBusCompressor *compressor;
+
+  compressor = dbus_new0 (DBusCompressor, 1);
+  if (compressor == NULL)
+    return NULL;
+
+  if (!_dbus_string_init (&compressor->pending))
+    goto failed_0;
+
+  compressor->deflater.zalloc = compress_alloc;
+  compressor->deflater.zfree = compress_free;
+  compressor->level = COMPRESSION_LEVEL;
+  if (deflateInit2 (&compressor->deflater, compressor->level, Z_DEFLATED,
+                    COMPRESSION_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    goto failed_1;
+
+  compressor->inflater.zalloc = compress_alloc;
+  compressor->inflater.zfree = compress_free;
+  if (inflateInit2 (&compressor->inflater, COMPRESSION_WINDOW_BITS) != Z_OK)
+    goto failed_2;
+
+  /* inflate() allocates its window on first use, and if that fails
+   * the stream is dead for good; setting an empty dictionary
+   * allocates it now, while failing is still harmless
+   */
+  if (inflateSetDictionary (&compressor->inflater, no_dictionary, 0) != Z_OK)
+    goto failed_3;
+
+  return compressor;
+
+ failed_3:
+  inflateEnd (&compressor->inflater);
+ failed_2:
+  deflateEnd (&compressor->deflater);
+ failed_1:
+  _dbus_string_free (&compressor->pending);
+ failed_0:
+  dbus_free (compressor);
+  return NULL;
+}
+
+/**
+ * Frees a compressor.
+ *
+ * @param compressor the compressor
+ */
+void
+_dbus_compressor_free (DBusCompressor *compressor)
+{
+  deflateEnd (&compressor->deflater);
+  inflateEnd (&compressor->inflater);
+  _dbus_string_free (&compressor->pending);
+  dbus_free (compressor);
+}
+
+/**
+ * Compresses a batch of bytes, given as chunks like those
+ * _dbus_write_socket_chunks() takes, and appends the result to dest.
+ * The output ends on a flush point, so the peer can decode all of
+ * the batch from it alone. Batches too small to be worth the effort
+ * are stored rather than compressed.
+ *
+ * Nothing is compressed unless all the memory needed was available,
+ * so on failure the call can simply be repeated.
+ *
+ * @param compressor the compressor
+ * @param chunks the bytes to compress, in order
+ * @param n_chunks number of chunks
+ * @param dest string to append to
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_compressor_compress (DBusCompressor       *compressor,
+                           const DBusWriteChunk *chunks,
+                           int                   n_chunks,
+                           DBusString           *dest)
+{
+  z_stream *z = &compressor->deflater;
+  int orig_len;
+  int total;
+  int room;
+  int level;
+  int i;
+
+  total = 0;
+  for (i = 0; i < n_chunks; i++)
+    total += chunks[i].len;
+
+  _dbus_assert (total > 0);
+
+  /* Stored blocks cost 5 bytes per 16k or so and each flush a few
+   * more, so this is far more than zlib can need even for data that
+   * does not compress at all; reserving it up front means we never
+   * run out halfway through and leave the stream inconsistent.
+   */
+  room = total + total / 8 + 64;
+
+  orig_len = _dbus_string_get_length (dest);
+  if (!_dbus_string_lengthen (dest, room))
+    return FALSE;
+
+  z->next_out = (Bytef *) _dbus_string_get_data_len (dest, orig_len, room);
+  z->avail_out = room;
+
+  level = total < COMPRESSION_THRESHOLD ? Z_NO_COMPRESSION : COMPRESSION_LEVEL;
+  if (level != compressor->level)
+    {
+      /* Nothing is pending after the last batch's flush, so this
+       * only changes how the next block is written
+       */
+      if (deflateParams (z, level, Z_DEFAULT_STRATEGY) != Z_OK)
+        _dbus_assert_not_reached ("deflateParams() failed with room to spare");
+      compressor->level = level;
+    }
+
+  for (i = 0; i < n_chunks; i++)
+    {
+      /* deflate() reports an error when given nothing to do */
+      if (chunks[i].len == 0)
+        continue;
+
+      z->next_in = (Bytef *) _dbus_string_get_const_data_len (chunks[i].buffer,
+                                                              chunks[i].start,
+                                                              chunks[i].len);
+      z->avail_in = chunks[i].len;
+
+      if (deflate (z, Z_NO_FLUSH) != Z_OK)
+        _dbus_assert_not_reached ("deflate() failed with room to spare");
+
+      _dbus_assert (z->avail_in == 0);
+    }
+
+  if (deflate (z, Z_SYNC_FLUSH) != Z_OK)
+    _dbus_assert_not_reached ("deflate() failed to flush with room to spare");
+
+  _dbus_assert (z->avail_out > 0);
+
+  _dbus_string_set_length (dest, orig_len + room - z->avail_out);
+
+  return TRUE;
+}
+
+/**
+ * Queues received bytes for _dbus_compressor_decompress(). Nothing
+ * is queued if there is no memory.
+ *
+ * @param compressor the compressor
+ * @param src string holding the bytes
+ * @param start where they start
+ * @param len how many there are
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_compressor_feed (DBusCompressor   *compressor,
+                       const DBusString *src,
+                       int               start,
+                       int               len)
+{
+  return _dbus_string_copy_len (src, start, len,
+                                &compressor->pending,
+                                _dbus_string_get_length (&compressor->pending));
+}
+
+/**
+ * Whether received bytes are still waiting to be decompressed,
+ * because _dbus_compressor_decompress() ran out of memory.
+ *
+ * @param compressor the compressor
+ * @returns #TRUE if there is pending input
+ */
+dbus_bool_t
+_dbus_compressor_has_input (DBusCompressor *compressor)
+{
+  return _dbus_string_get_length (&compressor->pending) > 0;
+}
+
+/**
+ * Decompresses as much of the queued input as possible and appends
+ * it to dest. If there is not enough memory for all of the output,
+ * what was decompressed so far is still appended and the rest of the
+ * input stays queued for the next call. A block that has not arrived
+ * completely stays inside zlib until the rest is fed in.
+ *
+ * @param compressor the compressor
+ * @param dest string to append to
+ * @param corrupt_p set to #TRUE if the input is not a valid stream
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_compressor_decompress (DBusCompressor *compressor,
+                             DBusString     *dest,
+                             dbus_bool_t    *corrupt_p)
+{
+  z_stream *z = &compressor->inflater;
+
+  *corrupt_p = FALSE;
+
+  while (_dbus_string_get_length (&compressor->pending) > 0)
+    {
+      int n_in;
+      int orig_len;
+      int room;
+      int ret;
+
+      n_in = _dbus_string_get_length (&compressor->pending);
+      room = MAX (n_in * 4, DECOMPRESS_ROOM);
+
+      orig_len = _dbus_string_get_length (dest);
+      if (!_dbus_string_lengthen (dest, room))
+        return FALSE;
+
+      z->next_in = (Bytef *) _dbus_string_get_data (&compressor->pending);
+      z->avail_in = n_in;
+      z->next_out = (Bytef *) _dbus_string_get_data_len (dest, orig_len, room);
+      z->avail_out = room;
+
+      ret = inflate (z, Z_SYNC_FLUSH);
+
+      _dbus_string_set_length (dest, orig_len + room - z->avail_out);
+      _dbus_string_delete (&compressor->pending, 0, n_in - z->avail_in);
+
+      /* inflate() has all the memory it needs from the start, and
+       * the peer never ends its stream, so anything else means the
+       * data is bad
+       */
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+          _dbus_verbose ("Invalid compressed data: %s\n",
+                         z->msg ? z->msg : "(no message)");
+          *corrupt_p = TRUE;
+          return TRUE;
+        }
+
+      /* With output space left over, zlib has taken all the input it can */
+      if (z->avail_out > 0)
+        break;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Frees the space held for received data, for idle connections.
+ *
+ * @param compressor the compressor
+ */
+void
+_dbus_compressor_trim (DBusCompressor *compressor)
+{
+  _dbus_string_compact (&compressor->pending, 0);
+}
+
+#else /* !HAVE_ZLIB */
+
+dbus_bool_t
+_dbus_compression_available (void)
+{
+  return FALSE;
+}
+
+DBusCompressor*
+_dbus_compressor_new (void)
+{
+  return NULL;
+}
+
+void
+_dbus_compressor_free (DBusCompressor *compressor)
+{
+  _dbus_assert_not_reached ("built without compression");
+}
+
+dbus_bool_t
+_dbus_compressor_compress (DBusCompressor       *compressor,
+                           const DBusWriteChunk *chunks,
+                           int                   n_chunks,
+                           DBusString           *dest)
+{
+  _dbus_assert_not_reached ("built without compression");
+  return FALSE;
+}
+
+dbus_bool_t
+_dbus_compressor_feed (DBusCompressor   *compressor,
+                       const DBusString *src,
+                       int               start,
+                       int               len)
+{
+  _dbus_assert_not_reached ("built without compression");
+  return FALSE;
+}
+
+dbus_bool_t
+_dbus_compressor_has_input (DBusCompressor *compressor)
+{
+  return FALSE;
+}
+
+dbus_bool_t
+_dbus_compressor_decompress (DBusCompressor *compressor,
+                             DBusString     *dest,
+                             dbus_bool_t    *corrupt_p)
+{
+  _dbus_assert_not_reached ("built without compression");
+  return FALSE;
+}
+
+void
+_dbus_compressor_trim (DBusCompressor *compressor)
+{
+}
+
+#endif /* !HAVE_ZLIB */
+
+/** @} */
+
+#ifdef DBUS_BUILD_TESTS
+#include "dbus-test.h"
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+
+/* Pushes everything in encoded through the receiving side, in pieces
+ * of the given size, retrying on OOM the way a transport would
+ */
+static dbus_bool_t
+compress_test_receive (DBusCompressor   *receiver,
+                       const DBusString *encoded,
+                       int               piece,
+                       DBusString       *decoded)
+{
+  int start;
+  int len;
+
+  for (start = 0; start < _dbus_string_get_length (encoded); start += piece)
+    {
+      dbus_bool_t corrupt;
+
+      len = MIN (piece, _dbus_string_get_length (encoded) - start);
+
+      /* a failed malloc only fails once under _dbus_test_oom_handling() */
+      while (!_dbus_compressor_feed (receiver, encoded, start, len))
+        ;
+
+      while (!_dbus_compressor_decompress (receiver, decoded, &corrupt))
+        ;
+
+      if (corrupt)
+        return FALSE;
+    }
+
+  return !_dbus_compressor_has_input (receiver);
+}
+
+static dbus_bool_t
+compress_round_trip (void *data)
+{
+  DBusCompressor *sender;
+  DBusCompressor *receiver;
+  DBusString plain;
+  DBusString encoded;
+  DBusString decoded;
+  DBusWriteChunk chunks[3];
+  int i;
+
+  sender = NULL;
+  receiver = NULL;
+
+  if (!_dbus_string_init (&plain))
+    return TRUE;
+  if (!_dbus_string_init (&encoded))
+    {
+      _dbus_string_free (&plain);
+      return TRUE;
+    }
+  if (!_dbus_string_init (&decoded))
+    {
+      _dbus_string_free (&encoded);
+      _dbus_string_free (&plain);
+      return TRUE;
+    }
+
+  /* Something string-heavy and repetitive, like introspection data */
+  for (i = 0; i < 200; i++)
+    {
+      if (!_dbus_string_append (&plain, "<method name=\"Frobnicate\"><arg type=\"s\" direction=\"in\"/>"))
+        goto oom;
+      if (!_dbus_string_append_int (&plain, i))
+        goto oom;
+    }
+
+  sender = _dbus_compressor_new ();
+  receiver = _dbus_compressor_new ();
+  if (sender == NULL || receiver == NULL)
+    goto oom;
+
+  /* A big batch in three chunks, then a small one that is stored */
+  chunks[0].buffer = &plain;
+  chunks[0].start = 0;
+  chunks[0].len = 10;
+  chunks[1].buffer = &plain;
+  chunks[1].start = 10;
+  chunks[1].len = 5000;
+  chunks[2].buffer = &plain;
+  chunks[2].start = 5010;
+  chunks[2].len = _dbus_string_get_length (&plain) - 5010;
+
+  if (!_dbus_compressor_compress (sender, chunks, 3, &encoded))
+    goto oom;
+
+  _dbus_assert (_dbus_string_get_length (&encoded) <
+                _dbus_string_get_length (&plain) / 4);
+
+  chunks[0].start = 100;
+  chunks[0].len = 50;
+
+  if (!_dbus_compressor_compress (sender, chunks, 1, &encoded))
+    goto oom;
+
+  /* Odd-sized pieces split the blocks anywhere */
+  if (!compress_test_receive (receiver, &encoded, 7, &decoded))
+    _dbus_assert_not_reached ("compressed stream did not decode");
+
+  _dbus_assert (_dbus_string_get_length (&decoded) ==
+                _dbus_string_get_length (&plain) + 50);
+  _dbus_assert (memcmp (_dbus_string_get_const_data (&decoded),
+                        _dbus_string_get_const_data (&plain),
+                        _dbus_string_get_length (&plain)) == 0);
+  _dbus_assert (memcmp (_dbus_string_get_const_data (&decoded) +
+                        _dbus_string_get_length (&plain),
+                        _dbus_string_get_const_data (&plain) + 100,
+                        50) == 0);
+
+  /* Garbage is reported, not decoded */
+  _dbus_string_set_length (&decoded, 0);
+  _dbus_string_set_length (&encoded, 0);
+  if (!_dbus_string_append (&encoded, "this is not deflate data"))
+    goto oom;
+
+  if (compress_test_receive (receiver, &encoded, 64, &decoded))
+    _dbus_assert_not_reached ("garbage decoded as a compressed stream");
+
+ oom:
+  if (sender)
+    _dbus_compressor_free (sender);
+  if (receiver)
+    _dbus_compressor_free (receiver);
+  _dbus_string_free (&decoded);
+  _dbus_string_free (&encoded);
+  _dbus_string_free (&plain);
+
+  return TRUE;
+}
+
+#endif /* HAVE_ZLIB */
+
+dbus_bool_t
+_dbus_compress_test (void)
+{
+#ifdef HAVE_ZLIB
+  if (!_dbus_test_oom_handling ("compression", compress_round_trip, NULL))
+    return FALSE;
+#endif
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-compress.h Stream compression for negotiated transports
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef DBUS_COMPRESS_H
+#define DBUS_COMPRESS_H
+
+#include <dbus/dbus-macros.h>
+#include <dbus/dbus-types.h>
+#include <dbus/dbus-string.h>
+#include <dbus/dbus-sysdeps.h>
+
+DBUS_BEGIN_DECLS
+
+/** Name of the one algorithm we know, as used in the auth protocol */
+#define DBUS_COMPRESSION_DEFLATE "deflate"
+
+typedef struct DBusCompressor DBusCompressor;
+
+dbus_bool_t     _dbus_compression_available  (void);
+
+DBusCompressor* _dbus_compressor_new         (void);
+void            _dbus_compressor_free        (DBusCompressor       *compressor);
+dbus_bool_t     _dbus_compressor_compress    (DBusCompressor       *compressor,
+                                              const DBusWriteChunk *chunks,
+                                              int                   n_chunks,
+                                              DBusString           *dest);
+dbus_bool_t     _dbus_compressor_feed        (DBusCompressor       *compressor,
+                                              const DBusString     *src,
+                                              int                   start,
+                                              int                   len);
+dbus_bool_t     _dbus_compressor_has_input   (DBusCompressor       *compressor);
+dbus_bool_t     _dbus_compressor_decompress  (DBusCompressor       *compressor,
+                                              DBusString           *dest,
+                                              dbus_bool_t          *corrupt_p);
+void            _dbus_compressor_trim        (DBusCompressor       *compressor);
+
+DBUS_END_DECLS
+
+#endif /* DBUS_COMPRESS_H */
@@ -41,6 +41,27 @@ typedef enum
   DBUS_ITERATION_BLOCK      = 1 << 2  /**< Block if nothing to do. */
 } DBusIterationFlags;
 
+/**
+ * Called with the connection lock held instead of writing out a
+ * message just sent; it must arrange for
+ * _dbus_connection_write_deferred() to be called soon, and must not
+ * call back into the connection. Returns #FALSE if it could not,
+ * and the message is written straight away after all.
+ */
+typedef dbus_bool_t (* DBusDeferWriteFunction) (DBusConnection *connection,
+                                                void           *data);
+
+/**
+ * Called with the connection lock held to have the body of a big
+ * message validated elsewhere; it must arrange for
+ * _dbus_body_check_run() and then _dbus_connection_body_check_done()
+ * to be called, and must not call back into the connection. Returns
+ * #FALSE if it could not, and the body is validated straight away.
+ */
+typedef dbus_bool_t (* DBusConnectionBodyCheckFunction) (DBusConnection *connection,
+                                                         DBusBodyCheck  *check,
+                                                         void           *data);
+
 /** default timeout value when waiting for a message reply, 25 seconds */
 #define _DBUS_DEFAULT_TIMEOUT_VALUE (25 * 1000)
 
@@ -54,8 +75,36 @@ void              _dbus_connection_queue_received_message_link (DBusConnection
                                                                 DBusList           *link);
 dbus_bool_t       _dbus_connection_has_messages_to_send_unlocked (DBusConnection     *connection);
 DBusMessage*      _dbus_connection_get_message_to_send         (DBusConnection     *connection);
+int               _dbus_connection_get_messages_to_send        (DBusConnection     *connection,
+                                                                DBusMessage       **messages,
+                                                                int                 max_messages);
 void              _dbus_connection_message_sent                (DBusConnection     *connection,
                                                                 DBusMessage        *message);
+int               _dbus_connection_drop_superseded_signals     (DBusConnection     *connection,
+                                                                DBusMessage        *message);
+void              _dbus_connection_trim                        (DBusConnection     *connection);
+void              _dbus_connection_set_read_paused             (DBusConnection     *connection,
+                                                                dbus_bool_t         paused);
+void              _dbus_connection_set_defer_write_function    (DBusConnection     *connection,
+                                                                DBusDeferWriteFunction function,
+                                                                void               *data);
+void              _dbus_connection_write_deferred              (DBusConnection     *connection);
+void              _dbus_connection_set_replies_jump_queue      (DBusConnection     *connection,
+                                                                dbus_bool_t         enabled);
+void              _dbus_connection_set_body_check_function     (DBusConnection     *connection,
+                                                                long                min_size,
+                                                                DBusConnectionBodyCheckFunction function,
+                                                                void               *data);
+void              _dbus_connection_body_check_done             (DBusConnection     *connection,
+                                                                DBusBodyCheck      *check);
+DBusDispatchStatus _dbus_connection_dispatch_batch             (DBusConnection     *connection,
+                                                                int                 max_messages,
+                                                                int                *n_dispatched_p);
+long              _dbus_connection_get_incoming_size           (DBusConnection     *connection);
+void              _dbus_connection_get_io_budgets              (DBusConnection     *connection,
+                                                                int                *read_budget_p,
+                                                                int                *write_budget_p);
+dbus_uint32_t     _dbus_connection_get_flight_id               (DBusConnection     *connection);
 dbus_bool_t       _dbus_connection_add_watch_unlocked          (DBusConnection     *connection,
                                                                 DBusWatch          *watch);
 void              _dbus_connection_remove_watch_unlocked       (DBusConnection     *connection,
@@ -63,6 +112,8 @@ void              _dbus_connection_remove_watch_unlocked       (DBusConnection
 void              _dbus_connection_toggle_watch_unlocked       (DBusConnection     *connection,
                                                                 DBusWatch          *watch,
                                                                 dbus_bool_t         enabled);
+void              _dbus_connection_rearm_watch_unlocked        (DBusConnection     *connection,
+                                                                DBusWatch          *watch);
 dbus_bool_t       _dbus_connection_handle_watch                (DBusWatch          *watch,
                                                                 unsigned int        condition,
                                                                 void               *data);
@@ -78,13 +129,21 @@ void              _dbus_connection_do_iteration_unlocked       (DBusConnection
                                                                 DBusPendingCall    *pending,
                                                                 unsigned int        flags,
                                                                 int                 timeout_milliseconds);
+void              _dbus_connection_iterate                     (DBusConnection     *connection,
+                                                                unsigned int        flags,
+                                                                int                 timeout_milliseconds);
+void              _dbus_connection_update_dispatch_status      (DBusConnection     *connection);
 void              _dbus_connection_close_possibly_shared       (DBusConnection     *connection);
 void              _dbus_connection_close_if_only_one_ref       (DBusConnection     *connection);
+dbus_bool_t       _dbus_connection_reset_for_pool              (DBusConnection     *connection);
 
 DBusPendingCall*  _dbus_pending_call_new                       (DBusConnection     *connection,
                                                                 int                 timeout_milliseconds,
                                                                 DBusTimeoutHandler  timeout_handler);
 void              _dbus_pending_call_notify                    (DBusPendingCall    *pending);
+DBusPendingCall*  _dbus_connection_take_cached_pending_call_unlocked (DBusConnection *connection);
+dbus_bool_t       _dbus_connection_cache_pending_call          (DBusConnection     *connection,
+                                                                DBusPendingCall    *pending);
 void              _dbus_connection_remove_pending_call         (DBusConnection     *connection,
                                                                 DBusPendingCall    *pending);
 void              _dbus_connection_block_pending_call          (DBusPendingCall    *pending);
@@ -104,7 +163,7 @@ void              _dbus_connection_test_get_locks                 (DBusConnectio
                                                                    DBusCondVar **io_path_cond_loc);
 
 /* This _dbus_bus_* stuff doesn't really belong here, but dbus-bus-internal.h seems
- * silly for one function
+ * silly for a few functions
  */
 /**
  * @addtogroup DBusBusInternals
@@ -112,6 +171,8 @@ void              _dbus_connection_test_get_locks                 (DBusConnectio
  */
 
 void           _dbus_bus_notify_shared_connection_disconnected_unlocked (DBusConnection *connection);
+dbus_bool_t    _dbus_bus_track_for_pool                                 (DBusConnection *connection);
+dbus_bool_t    _dbus_bus_reset_for_pool                                 (DBusConnection *connection);
 
 /** @} */
 
@@ -0,0 +1,547 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-connection-pool.c Warm private bus connections to hand out
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-internals.h"
+#include "dbus-connection-pool.h"
+#include "dbus-bus.h"
+#include "dbus-connection-internal.h"
+#include "dbus-list.h"
+#include "dbus-threads-internal.h"
+#include "dbus-test.h"
+#include <string.h>
+
+/**
+ * @defgroup DBusConnectionPool DBusConnectionPool
+ * @ingroup  DBus
+ * @brief Warm private bus connections to hand out
+ *
+ * A DBusConnectionPool keeps a number of private connections to one
+ * message bus open, authenticated and registered with Hello, so that
+ * code which wants a connection of its own for a short task (a worker
+ * in a job runner, say) does not pay for connecting each time.
+ * dbus_connection_pool_acquire() hands one out without any I/O to
+ * speak of, and dbus_connection_pool_release() gives it back.
+ *
+ * A released connection is cleaned up before it is handed out again:
+ * the names it requested and the match rules it added through
+ * dbus_bus_request_name(), dbus_bus_add_match() or
+ * dbus_bus_register_full() are dropped, its object paths are
+ * unregistered and messages it has not dispatched are thrown away.
+ * It keeps its unique name, so the next user gets the same one.
+ * Connections that can't be cleaned up safely are closed instead:
+ * ones that still have filters, ones that watch names with
+ * dbus_bus_watch_name() and ones that were disconnected.
+ *
+ * Nothing refills the pool behind your back; call
+ * dbus_connection_pool_fill() when it suits you. When the pool is
+ * empty, dbus_connection_pool_acquire() opens a connection on the spot.
+ *
+ * @{
+ */
+
+/**
+ * Internals of DBusConnectionPool
+ */
+struct DBusConnectionPool
+{
+  DBusAtomic refcount;          /**< Reference count */
+  DBusMutex *mutex;             /**< Protects idle and n_idle */
+
+  char *address;                /**< Address of the bus */
+  int size;                     /**< Number of idle connections to keep */
+
+  DBusList *idle;               /**< Registered connections not handed out */
+  int n_idle;                   /**< Length of idle */
+};
+
+#define POOL_LOCK(pool)   _dbus_mutex_lock ((pool)->mutex)
+#define POOL_UNLOCK(pool) _dbus_mutex_unlock ((pool)->mutex)
+
+static void
+discard_connection (DBusConnection *connection)
+{
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+}
+
+static DBusConnection *
+open_connection (DBusConnectionPool *pool,
+                 DBusError          *error)
+{
+  DBusConnection *connection;
+
+  connection = dbus_connection_open_private (pool->address, error);
+  if (connection == NULL)
+    return NULL;
+
+  if (!dbus_bus_register (connection, error))
+    {
+      discard_connection (connection);
+      return NULL;
+    }
+
+  if (!_dbus_bus_track_for_pool (connection))
+    {
+      _DBUS_SET_OOM (error);
+      discard_connection (connection);
+      return NULL;
+    }
+
+  return connection;
+}
+
+/* Takes over the caller's reference; returns FALSE if the pool is full
+ * or no memory, and then the caller still has it
+ */
+static dbus_bool_t
+add_idle (DBusConnectionPool *pool,
+          DBusConnection     *connection)
+{
+  dbus_bool_t added;
+
+  POOL_LOCK (pool);
+  added = pool->n_idle < pool->size &&
+    _dbus_list_append (&pool->idle, connection);
+  if (added)
+    pool->n_idle += 1;
+  POOL_UNLOCK (pool);
+
+  return added;
+}
+
+/** @} */
+
+/**
+ * @addtogroup DBusConnectionPool
+ * @{
+ */
+
+/**
+ * Creates a pool of private connections to the message bus at the
+ * given address. No connection is opened yet; see
+ * dbus_connection_pool_fill().
+ *
+ * @param address the address of the bus
+ * @param size the number of idle connections to keep open
+ * @returns the pool, or #NULL if no memory
+ */
+DBusConnectionPool*
+dbus_connection_pool_new (const char *address,
+                          int         size)
+{
+  DBusConnectionPool *pool;
+
+  _dbus_return_val_if_fail (address != NULL, NULL);
+  _dbus_return_val_if_fail (size >= 0, NULL);
+
+  pool = dbus_new0 (DBusConnectionPool, 1);
+  if (pool == NULL)
+    return NULL;
+
+  pool->refcount.value = 1;
+  pool->size = size;
+
+  pool->address = _dbus_strdup (address);
+  if (pool->address == NULL)
+    {
+      dbus_free (pool);
+      return NULL;
+    }
+
+  _dbus_mutex_new_at_location (&pool->mutex);
+  if (pool->mutex == NULL)
+    {
+      dbus_free (pool->address);
+      dbus_free (pool);
+      return NULL;
+    }
+
+  return pool;
+}
+
+/**
+ * Increments the reference count on a connection pool.
+ *
+ * @param pool the pool
+ * @returns the pool
+ */
+DBusConnectionPool*
+dbus_connection_pool_ref (DBusConnectionPool *pool)
+{
+  _dbus_return_val_if_fail (pool != NULL, NULL);
+
+  _dbus_atomic_inc (&pool->refcount);
+
+  return pool;
+}
+
+/**
+ * Decrements the reference count on a connection pool, closing its
+ * idle connections and freeing it if the count reaches 0.
+ * Connections that are checked out stay open; release them with
+ * dbus_connection_pool_release() before dropping the last reference,
+ * or close them yourself.
+ *
+ * @param pool the pool
+ */
+void
+dbus_connection_pool_unref (DBusConnectionPool *pool)
+{
+  DBusConnection *connection;
+  dbus_int32_t old_refcount;
+
+  _dbus_return_if_fail (pool != NULL);
+
+  old_refcount = _dbus_atomic_dec (&pool->refcount);
+  _dbus_assert (old_refcount > 0);
+
+  if (old_refcount != 1)
+    return;
+
+  while ((connection = _dbus_list_pop_first (&pool->idle)) != NULL)
+    discard_connection (connection);
+
+  _dbus_mutex_free_at_location (&pool->mutex);
+  dbus_free (pool->address);
+  dbus_free (pool);
+}
+
+/**
+ * Opens, authenticates and registers connections until the pool holds
+ * as many idle ones as it was created for. Blocks for as long as that
+ * takes, without holding up other threads using the pool.
+ *
+ * @param pool the pool
+ * @param error location to store an error, or #NULL
+ * @returns #FALSE with error set if a connection could not be opened
+ */
+dbus_bool_t
+dbus_connection_pool_fill (DBusConnectionPool *pool,
+                           DBusError          *error)
+{
+  DBusConnection *connection;
+  dbus_bool_t full;
+
+  _dbus_return_val_if_fail (pool != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  while (TRUE)
+    {
+      POOL_LOCK (pool);
+      full = pool->n_idle >= pool->size;
+      POOL_UNLOCK (pool);
+
+      if (full)
+        return TRUE;
+
+      connection = open_connection (pool, error);
+      if (connection == NULL)
+        return FALSE;
+
+      /* Another thread may have filled it meanwhile */
+      if (!add_idle (pool, connection))
+        {
+          discard_connection (connection);
+
+          POOL_LOCK (pool);
+          full = pool->n_idle >= pool->size;
+          POOL_UNLOCK (pool);
+
+          if (!full)
+            {
+              _DBUS_SET_OOM (error);
+              return FALSE;
+            }
+        }
+    }
+}
+
+/**
+ * Hands out a registered connection to the bus. An idle one is
+ * checked for a hangup without blocking and returned; if there is
+ * none left, a new one is opened, which blocks.
+ *
+ * The caller gets the pool's reference to the connection, and gives
+ * it back with dbus_connection_pool_release() (or closes and unrefs
+ * the connection if it doesn't want it recycled).
+ *
+ * @param pool the pool
+ * @param error location to store an error, or #NULL
+ * @returns the connection, or #NULL with error set
+ */
+DBusConnection*
+dbus_connection_pool_acquire (DBusConnectionPool *pool,
+                              DBusError          *error)
+{
+  DBusConnection *connection;
+
+  _dbus_return_val_if_fail (pool != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  while (TRUE)
+    {
+      POOL_LOCK (pool);
+      connection = _dbus_list_pop_first (&pool->idle);
+      if (connection != NULL)
+        pool->n_idle -= 1;
+      POOL_UNLOCK (pool);
+
+      if (connection == NULL)
+        return open_connection (pool, error);
+
+      /* Notice if the bus went away while it was idle */
+      dbus_connection_read_write (connection, 0);
+      if (dbus_connection_get_is_connected (connection))
+        return connection;
+
+      discard_connection (connection);
+    }
+}
+
+/**
+ * Gives back a connection handed out by dbus_connection_pool_acquire().
+ * It is cleaned up as described for #DBusConnectionPool and kept for
+ * the next dbus_connection_pool_acquire(), or closed if it can't be
+ * cleaned up or the pool already has enough idle connections. Either
+ * way, the caller's reference is consumed; other references the
+ * caller took must be dropped before.
+ *
+ * @param pool the pool
+ * @param connection the connection
+ */
+void
+dbus_connection_pool_release (DBusConnectionPool *pool,
+                              DBusConnection     *connection)
+{
+  _dbus_return_if_fail (pool != NULL);
+  _dbus_return_if_fail (connection != NULL);
+
+  if (dbus_connection_get_is_connected (connection) &&
+      _dbus_bus_reset_for_pool (connection) &&
+      _dbus_connection_reset_for_pool (connection))
+    {
+      /* Get the cleanup calls on their way before anyone waits on
+       * the connection again
+       */
+      dbus_connection_flush (connection);
+
+      if (add_idle (pool, connection))
+        return;
+    }
+
+  discard_connection (connection);
+}
+
+/**
+ * Gets the number of idle connections in the pool, ready to be handed
+ * out without blocking.
+ *
+ * @param pool the pool
+ * @returns the number of idle connections
+ */
+int
+dbus_connection_pool_get_idle_count (DBusConnectionPool *pool)
+{
+  int n_idle;
+
+  _dbus_return_val_if_fail (pool != NULL, 0);
+
+  POOL_LOCK (pool);
+  n_idle = pool->n_idle;
+  POOL_UNLOCK (pool);
+
+  return n_idle;
+}
+
+/** @} */
+
+#ifdef DBUS_BUILD_TESTS
+#include "dbus-server.h"
+
+static void
+pool_test_new_connection (DBusServer     *server,
+                          DBusConnection *connection,
+                          void           *data)
+{
+  DBusConnection **peer_p = data;
+
+  *peer_p = dbus_connection_ref (connection);
+}
+
+static DBusHandlerResult
+pool_test_message (DBusConnection *connection,
+                   DBusMessage    *message,
+                   void           *data)
+{
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static void
+pool_test_unregister (DBusConnection *connection,
+                      void           *data)
+{
+  int *n_unregistered = data;
+
+  *n_unregistered += 1;
+}
+
+static DBusHandlerResult
+pool_test_filter (DBusConnection *connection,
+                  DBusMessage    *message,
+                  void           *data)
+{
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Both ends live in this thread, so each has to be kept moving while
+ * we wait for the other
+ */
+static void
+pool_test_iterate (DBusConnection *connection,
+                   DBusConnection *peer)
+{
+  dbus_connection_read_write (connection, 0);
+  dbus_connection_read_write (peer, 0);
+}
+
+static void
+pool_test_expect (DBusConnection *connection,
+                  DBusConnection *peer,
+                  const char     *member,
+                  const char     *arg)
+{
+  DBusMessage *message;
+  const char *s;
+
+  while ((message = dbus_connection_pop_message (peer)) == NULL)
+    pool_test_iterate (connection, peer);
+
+  _dbus_assert (dbus_message_is_method_call (message, DBUS_INTERFACE_DBUS,
+                                             member));
+  _dbus_assert (dbus_message_get_no_reply (message));
+  if (!dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_STRING, &s,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (strcmp (s, arg) == 0);
+
+  dbus_message_unref (message);
+}
+
+/**
+ * Unit test for DBusConnectionPool. There is no bus to register
+ * with, so the test sets the connection up the way the pool would
+ * have and checks what happens to it when it is released.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_connection_pool_test (const char *test_data_dir)
+{
+  DBusObjectPathVTable vtable = { pool_test_unregister, pool_test_message };
+  DBusConnectionPool *pool;
+  DBusServer *server;
+  DBusConnection *connection;
+  DBusConnection *peer;
+  DBusMessage *message;
+  int n_unregistered;
+
+  server = dbus_server_listen ("debug-pipe:name=test-connection-pool", NULL);
+  if (server == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  peer = NULL;
+  dbus_server_set_new_connection_function (server, pool_test_new_connection,
+                                           &peer, NULL);
+
+  connection = dbus_connection_open_private ("debug-pipe:name=test-connection-pool",
+                                             NULL);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (peer != NULL);
+
+  pool = dbus_connection_pool_new ("debug-pipe:name=test-connection-pool", 1);
+  if (pool == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (dbus_connection_pool_get_idle_count (pool) == 0);
+
+  if (!dbus_bus_set_unique_name (connection, ":1.1") ||
+      !_dbus_bus_track_for_pool (connection))
+    _dbus_assert_not_reached ("no memory");
+
+  /* What a task might leave behind. Without an error, the match calls
+   * don't wait for the bus.
+   */
+  n_unregistered = 0;
+  dbus_bus_add_match (connection, "type='signal',member='A'", NULL);
+  dbus_bus_add_match (connection, "type='signal',member='B'", NULL);
+  dbus_bus_add_match (connection, "type='signal',member='B'", NULL);
+  dbus_bus_remove_match (connection, "type='signal',member='A'", NULL);
+  if (!dbus_connection_register_object_path (connection, "/a/b", &vtable,
+                                             &n_unregistered) ||
+      !dbus_connection_register_fallback (connection, "/c", &vtable,
+                                          &n_unregistered))
+    _dbus_assert_not_reached ("no memory");
+
+  message = dbus_message_new_signal ("/", "org.freedesktop.Test", "Left");
+  if (message == NULL || !dbus_connection_send (peer, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+  while (dbus_connection_get_dispatch_status (connection) !=
+         DBUS_DISPATCH_DATA_REMAINS)
+    pool_test_iterate (connection, peer);
+
+  /* Drain the match calls so only the cleanup is left to see */
+  pool_test_expect (connection, peer, "AddMatch", "type='signal',member='A'");
+  pool_test_expect (connection, peer, "AddMatch", "type='signal',member='B'");
+  pool_test_expect (connection, peer, "AddMatch", "type='signal',member='B'");
+  pool_test_expect (connection, peer, "RemoveMatch", "type='signal',member='A'");
+
+  dbus_connection_ref (connection);
+  dbus_connection_pool_release (pool, connection);
+  _dbus_assert (dbus_connection_pool_get_idle_count (pool) == 1);
+  _dbus_assert (n_unregistered == 2);
+  _dbus_assert (dbus_connection_pop_message (connection) == NULL);
+  pool_test_expect (connection, peer, "RemoveMatch", "type='signal',member='B'");
+  pool_test_expect (connection, peer, "RemoveMatch", "type='signal',member='B'");
+
+  /* The same connection comes out again, with nothing to undo */
+  _dbus_assert (dbus_connection_pool_acquire (pool, NULL) == connection);
+  _dbus_assert (dbus_connection_pool_get_idle_count (pool) == 0);
+
+  /* A filter left behind means it gets closed instead */
+  if (!dbus_connection_add_filter (connection, pool_test_filter, NULL, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_connection_pool_release (pool, connection);
+  _dbus_assert (dbus_connection_pool_get_idle_count (pool) == 0);
+  _dbus_assert (!dbus_connection_get_is_connected (connection));
+
+  dbus_connection_unref (connection);
+  dbus_connection_pool_unref (pool);
+  dbus_connection_close (peer);
+  dbus_connection_unref (peer);
+  dbus_server_disconnect (server);
+  dbus_server_unref (server);
+
+  return TRUE;
+}
+#endif /* DBUS_BUILD_TESTS */
@@ -0,0 +1,65 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-connection-pool.h Warm private bus connections to hand out
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#if !defined (DBUS_INSIDE_DBUS_H) && !defined (DBUS_COMPILATION)
+#error "Only <dbus/dbus.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#ifndef DBUS_CONNECTION_POOL_H
+#define DBUS_CONNECTION_POOL_H
+
+#include <dbus/dbus-macros.h>
+#include <dbus/dbus-types.h>
+#include <dbus/dbus-connection.h>
+#include <dbus/dbus-errors.h>
+
+DBUS_BEGIN_DECLS
+
+/**
+ * @addtogroup DBusConnectionPool
+ * @{
+ */
+
+typedef struct DBusConnectionPool DBusConnectionPool;
+
+DBUS_EXPORT
+DBusConnectionPool* dbus_connection_pool_new            (const char         *address,
+                                                         int                 size);
+DBUS_EXPORT
+DBusConnectionPool* dbus_connection_pool_ref            (DBusConnectionPool *pool);
+DBUS_EXPORT
+void                dbus_connection_pool_unref          (DBusConnectionPool *pool);
+DBUS_EXPORT
+dbus_bool_t         dbus_connection_pool_fill           (DBusConnectionPool *pool,
+                                                         DBusError          *error);
+DBUS_EXPORT
+DBusConnection*     dbus_connection_pool_acquire        (DBusConnectionPool *pool,
+                                                         DBusError          *error);
+DBUS_EXPORT
+void                dbus_connection_pool_release        (DBusConnectionPool *pool,
+                                                         DBusConnection     *connection);
+DBUS_EXPORT
+int                 dbus_connection_pool_get_idle_count (DBusConnectionPool *pool);
+
+/** @} */
+
+DBUS_END_DECLS
+
+#endif /* DBUS_CONNECTION_POOL_H */
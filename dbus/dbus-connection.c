@@ -43,6 +43,10 @@
 #include "dbus-threads-internal.h"
 #include "dbus-bus.h"
 #include "dbus-marshal-basic.h"
+#include "dbus-marshal-validate.h"
+#include "dbus-probes.h"
+#include "dbus-server.h"
+#include "dbus-test.h"
 
 #ifdef DBUS_DISABLE_CHECKS
 #define TOOK_LOCK_CHECK(connection)
@@ -220,8 +224,22 @@ struct DBusMessageFilter
   DBusHandleMessageFunction function; /**< Function to call to filter */
   void *user_data; /**< User data for the function */
   DBusFreeFunction free_user_data_function; /**< Function to free the user data */
+  dbus_uint32_t order; /**< When it was added, relative to the connection's other filters */
+  int message_type; /**< Type of message to filter, or #DBUS_MESSAGE_TYPE_INVALID for any */
+  char *interface; /**< Interface to filter, or #NULL for an unkeyed filter that sees everything */
+  char *member; /**< Member to filter, or #NULL for any */
 };
 
+/**
+ * The filters added with dbus_connection_add_filter_for() for one
+ * interface, in the order they were added.
+ */
+typedef struct
+{
+  char *interface;  /**< The interface, and our key in filter_index */
+  DBusList *filters; /**< The #DBusMessageFilter for it */
+} DBusFilterBucket;
+
 
 /**
  * Internals of DBusPreallocatedSend
@@ -230,7 +248,6 @@ struct DBusPreallocatedSend
 {
   DBusConnection *connection; /**< Connection we'd send the message to */
   DBusList *queue_link;       /**< Preallocated link in the queue */
-  DBusList *counter_link;     /**< Preallocated link in the resource counter */
 };
 
 #ifdef HAVE_DECL_MSG_NOSIGNAL
@@ -239,6 +256,38 @@ static dbus_bool_t _dbus_modify_sigpipe = FALSE;
 static dbus_bool_t _dbus_modify_sigpipe = TRUE;
 #endif
 
+/**
+ * A thread blocked in _dbus_connection_acquire_io_path() on behalf of
+ * a pending call. It sleeps on the pending call's condvar rather than
+ * io_path_cond, so the thread holding the io path can wake it as soon
+ * as its reply is queued.
+ */
+typedef struct
+{
+  DBusPendingCall *pending;    /**< The call the thread waits for */
+  DBusCondVar *cond;           /**< The call's condvar */
+  dbus_bool_t reply_arrived;   /**< Set when the reply got queued, protected by io_path_mutex */
+} IOPathReplyWaiter;
+
+/**
+ * When a pending call times out. The connection keeps these in a
+ * binary min-heap, so the main loop only ever sees one timeout, for
+ * the earliest deadline, however many calls are outstanding.
+ */
+typedef struct
+{
+  long tv_sec;                 /**< Deadline, seconds */
+  long tv_usec;                /**< Deadline, microseconds */
+  DBusPendingCall *pending;    /**< The call that times out then */
+} DBusPendingDeadline;
+
+/**
+ * How many finalized pending calls a connection keeps for reuse, so
+ * a client with a few calls in flight at a time stops allocating
+ * them.
+ */
+#define MAX_CACHED_PENDING_CALLS 8
+
 /**
  * Implementation details of DBusConnection. All fields are private.
  */
@@ -259,8 +308,13 @@ struct DBusConnection
   DBusMessage *message_borrowed; /**< Filled in if the first incoming message has been borrowed;
                                   *   dispatch_acquired will be set by the borrower
                                   */
+  DBusList *dispatching; /**< Links of the messages being dispatched by concurrent dispatchers */
   
   int n_outgoing;              /**< Length of outgoing queue. */
+  int n_outgoing_ahead;        /**< Messages at the send end of the outgoing queue that
+                                *   a reply can't be queued ahead of; see
+                                *   _dbus_connection_queue_outgoing_link()
+                                */
   int n_incoming;              /**< Length of incoming queue. */
 
   DBusCounter *outgoing_counter; /**< Counts size of outgoing messages. */
@@ -269,15 +323,27 @@ struct DBusConnection
   DBusWatchList *watches;      /**< Stores active watches. */
   DBusTimeoutList *timeouts;   /**< Stores active timeouts. */
   
-  DBusList *filter_list;        /**< List of filters. */
+  DBusList *filter_list;        /**< List of filters not keyed on an interface. */
+  DBusHashTable *filter_index;  /**< #DBusFilterBucket of keyed filters by interface, or #NULL if none were ever added */
+  dbus_uint32_t next_filter_order; /**< Order given to the next filter added */
 
   DBusMutex *slot_mutex;        /**< Lock on slot_list so overall connection lock need not be taken */
   DBusDataSlotList slot_list;   /**< Data stored by allocated integer ID */
 
   DBusHashTable *pending_replies;  /**< Hash of message serials to #DBusPendingCall. */  
+  DBusPendingDeadline *deadlines;  /**< Heap of pending call deadlines, earliest first */
+  int n_deadlines;                 /**< Deadlines in the heap */
+  int n_deadlines_allocated;       /**< Allocated size of the heap */
+  DBusTimeout *deadline_timeout;   /**< Timeout for the earliest deadline, created on demand */
+  DBusPendingCall *pending_call_cache[MAX_CACHED_PENDING_CALLS]; /**< Memory of finalized pending calls, for new ones to reuse */
+  int n_cached_pending_calls;      /**< Entries used in pending_call_cache */
   
   dbus_uint32_t client_serial;       /**< Client serial. Increments each time a message is sent  */
-  DBusList *disconnect_message_link; /**< Preallocated list node for queueing the disconnection message */
+  DBusList *disconnect_message_link; /**< Queue link of the preallocated disconnection message */
+
+  DBusWakeupPipe wakeup_pipe;   /**< Woken by other threads if there is no wakeup_main_function */
+  DBusWatch *wakeup_watch;      /**< Watch on wakeup_pipe, #NULL if there is no pipe */
+  dbus_bool_t wakeup_signalled; /**< wakeup_pipe was written and not drained yet */
 
   DBusWakeupMainFunction wakeup_main_function; /**< Function to wake up the mainloop  */
   void *wakeup_main_data; /**< Application data for wakeup_main_function */
@@ -289,6 +355,11 @@ struct DBusConnection
 
   DBusDispatchStatus last_dispatch_status; /**< The last dispatch status we reported to the application. */
 
+  DBusDeferWriteFunction defer_write_function; /**< Called instead of writing on send, if set */
+  void *defer_write_data; /**< Data for defer_write_function */
+  DBusConnectionBodyCheckFunction body_check_function; /**< Validates big bodies elsewhere, or #NULL */
+  void *body_check_data; /**< Data for body_check_function */
+
   DBusList *link_cache; /**< A cache of linked list links to prevent contention
                          *   for the global linked list mempool lock
                          */
@@ -302,6 +373,8 @@ struct DBusConnection
    */
   dbus_bool_t dispatch_acquired; /**< Someone has dispatch path (can drain incoming queue) */
   dbus_bool_t io_path_acquired;  /**< Someone has transport io path (can use the transport to read/write messages) */
+  int io_path_waiters;           /**< Number of threads waiting for the io path, protected by io_path_mutex */
+  DBusList *io_path_reply_waiters; /**< IOPathReplyWaiter of those threads waiting on their pending call's own condvar, protected by io_path_mutex */
   
   unsigned int shareable : 1; /**< #TRUE if libdbus owns a reference to the connection and can return it from dbus_connection_open() more than once */
   
@@ -316,6 +389,12 @@ struct DBusConnection
   unsigned int disconnected_message_processed : 1; /**< We did our default handling of the disconnected message,
                                                     * such as closing the connection.
                                                     */
+
+  unsigned int write_deferred : 1; /**< defer_write_function was called and the write has not happened yet */
+
+  unsigned int concurrent_dispatch : 1; /**< If #TRUE, threads dispatch concurrently, see dbus_connection_set_concurrent_dispatch() */
+
+  unsigned int replies_jump_queue : 1; /**< If #TRUE, replies can be queued ahead of other senders' messages, see _dbus_connection_set_replies_jump_queue() */
   
 #ifndef DBUS_DISABLE_CHECKS
   unsigned int have_connection_lock : 1; /**< Used to check locking */
@@ -337,6 +416,9 @@ static void               _dbus_connection_close_possibly_shared_and_unlock  (DB
 static dbus_bool_t        _dbus_connection_get_is_connected_unlocked         (DBusConnection     *connection);
 static dbus_bool_t        _dbus_connection_peek_for_reply_unlocked           (DBusConnection     *connection,
                                                                               dbus_uint32_t       client_serial);
+static void               connection_remove_deadline_unlocked                (DBusConnection     *connection,
+                                                                              DBusPendingCall    *pending);
+static dbus_bool_t        _dbus_connection_has_dispatchable_unlocked         (DBusConnection     *connection);
 
 static DBusMessageFilter *
 _dbus_message_filter_ref (DBusMessageFilter *filter)
@@ -356,11 +438,45 @@ _dbus_message_filter_unref (DBusMessageFilter *filter)
     {
       if (filter->free_user_data_function)
         (* filter->free_user_data_function) (filter->user_data);
-      
+
+      dbus_free (filter->interface);
+      dbus_free (filter->member);
       dbus_free (filter);
     }
 }
 
+static void
+_dbus_filter_bucket_free (void *data)
+{
+  DBusFilterBucket *bucket = data;
+
+  /* the hash table frees the NULL value of a new entry */
+  if (bucket == NULL)
+    return;
+
+  _dbus_list_clear (&bucket->filters);
+  dbus_free (bucket->interface);
+  dbus_free (bucket);
+}
+
+static dbus_bool_t
+_dbus_message_filter_matches (DBusMessageFilter *filter,
+                              DBusMessage       *message)
+{
+  const char *member;
+
+  if (filter->message_type != DBUS_MESSAGE_TYPE_INVALID &&
+      filter->message_type != dbus_message_get_type (message))
+    return FALSE;
+
+  if (filter->member == NULL)
+    return TRUE;
+
+  member = dbus_message_get_member (message);
+
+  return member != NULL && strcmp (member, filter->member) == 0;
+}
+
 /**
  * Acquires the connection lock.
  *
@@ -388,38 +504,45 @@ _dbus_connection_unlock (DBusConnection *connection)
  * Needed if we're e.g. queueing outgoing messages
  * on a thread while the mainloop sleeps.
  *
+ * Without a wakeup_main_function, writes the connection's own wakeup
+ * pipe, which the main loop watches; but only once until the main
+ * loop has handled it, so a loop that is awake costs no syscalls.
+ *
  * @param connection the connection.
  */
 static void
 _dbus_connection_wakeup_mainloop (DBusConnection *connection)
 {
+  HAVE_LOCK_CHECK (connection);
+
   if (connection->wakeup_main_function)
     (*connection->wakeup_main_function) (connection->wakeup_main_data);
+  else if (connection->wakeup_watch != NULL && !connection->wakeup_signalled)
+    {
+      connection->wakeup_signalled = TRUE;
+      _dbus_wakeup_pipe_signal (&connection->wakeup_pipe);
+    }
 }
 
 #ifdef DBUS_BUILD_TESTS
 /* For now this function isn't used */
 /**
- * Adds a message to the incoming message queue, returning #FALSE
- * if there's insufficient memory to queue the message.
+ * Adds a message to the incoming message queue. Queueing uses the
+ * message's own link, so this can't fail; the return value is kept
+ * for callers written when it could.
  * Does not take over refcount of the message.
  *
  * @param connection the connection.
  * @param message the message to queue.
- * @returns #TRUE on success.
+ * @returns #TRUE
  */
 dbus_bool_t
 _dbus_connection_queue_received_message (DBusConnection *connection,
                                          DBusMessage    *message)
 {
-  DBusList *link;
-
-  link = _dbus_list_alloc_link (message);
-  if (link == NULL)
-    return FALSE;
-
   dbus_message_ref (message);
-  _dbus_connection_queue_received_message_link (connection, link);
+  _dbus_connection_queue_received_message_link (connection,
+                                                _dbus_message_get_queue_link (message));
 
   return TRUE;
 }
@@ -453,9 +576,46 @@ _dbus_connection_test_get_locks (DBusConnection *connection,
 #endif
 
 /**
- * Adds a message-containing list link to the incoming message queue,
- * taking ownership of the link and the message's current refcount.
- * Cannot fail due to lack of memory.
+ * Wakes the thread, if any, that waits for the io path on behalf of
+ * the given pending call, so it can pick up its reply without waiting
+ * for the io path to be released. Called with the connection lock
+ * held, by whoever holds the io path.
+ *
+ * @param connection the connection.
+ * @param pending the pending call whose reply was queued.
+ */
+static void
+wake_io_path_reply_waiter (DBusConnection  *connection,
+                           DBusPendingCall *pending)
+{
+  DBusList *link;
+
+  _dbus_mutex_lock (connection->io_path_mutex);
+
+  link = _dbus_list_get_first_link (&connection->io_path_reply_waiters);
+  while (link != NULL)
+    {
+      IOPathReplyWaiter *waiter = link->data;
+
+      if (waiter->pending == pending)
+        {
+          _dbus_verbose ("waking thread waiting for reply serial %u\n",
+                         _dbus_pending_call_get_reply_serial_unlocked (pending));
+          waiter->reply_arrived = TRUE;
+          _dbus_condvar_wake_one (waiter->cond);
+          break;
+        }
+
+      link = _dbus_list_get_next_link (&connection->io_path_reply_waiters, link);
+    }
+
+  _dbus_mutex_unlock (connection->io_path_mutex);
+}
+
+/**
+ * Adds a message to the incoming message queue by its queue link
+ * (see _dbus_message_get_queue_link()), taking ownership of the
+ * message's current refcount. Cannot fail due to lack of memory.
  *
  * @param connection the connection.
  * @param link the message link to queue.
@@ -474,6 +634,8 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
                           link);
   message = link->data;
 
+  _DBUS_PROBE2 (message__received, connection, message);
+
   /* If this is a reply we're waiting on, remove timeout for it */
   reply_serial = dbus_message_get_reply_serial (message);
   if (reply_serial != 0)
@@ -482,11 +644,9 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
                                              reply_serial);
       if (pending != NULL)
 	{
-	  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-            _dbus_connection_remove_timeout_unlocked (connection,
-                                                      _dbus_pending_call_get_timeout_unlocked (pending));
+          connection_remove_deadline_unlocked (connection, pending);
 
-	  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+          wake_io_path_reply_waiter (connection, pending);
 	}
     }
   
@@ -514,8 +674,8 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
                  connection->n_incoming);}
 
 /**
- * Adds a link + message to the incoming message queue.
- * Can't fail. Takes ownership of both link and message.
+ * Adds a message to the incoming message queue by its queue link.
+ * Can't fail. Takes ownership of the message.
  *
  * @param connection the connection.
  * @param link the list node and message to queue.
@@ -590,6 +750,89 @@ _dbus_connection_get_message_to_send (DBusConnection *connection)
   return _dbus_list_get_last (&connection->outgoing_messages);
 }
 
+/**
+ * Gets up to max_messages outgoing messages in the order they will
+ * be sent, starting with the one _dbus_connection_get_message_to_send()
+ * returns. The messages remain in the queue, and the caller does not
+ * own references to them.
+ *
+ * @param connection the connection.
+ * @param messages array to fill in
+ * @param max_messages size of the array
+ * @returns number of messages stored
+ */
+int
+_dbus_connection_get_messages_to_send (DBusConnection  *connection,
+                                       DBusMessage    **messages,
+                                       int              max_messages)
+{
+  DBusList *link;
+  int n_messages;
+
+  HAVE_LOCK_CHECK (connection);
+
+  n_messages = 0;
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+  while (link != NULL && n_messages < max_messages)
+    {
+      messages[n_messages] = link->data;
+      n_messages += 1;
+      link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+    }
+
+  return n_messages;
+}
+
+/* Charges a message queued for sending to outgoing_counter, or with
+ * a negative sign takes it off again. Messages are locked while they
+ * are queued, so the size doesn't change in between, and unlike the
+ * counters a message carries this needs no allocation; a broadcast
+ * in the bus would otherwise need a counter link per recipient.
+ */
+static void
+adjust_outgoing_counter (DBusConnection *connection,
+                         DBusMessage    *message,
+                         int             sign)
+{
+  long size;
+
+  size = _dbus_message_get_size (message);
+  _dbus_counter_adjust_size (connection->outgoing_counter, sign * size);
+  _dbus_memory_account (DBUS_MEMORY_OUTGOING, sign * size);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  {
+    const int *fds;
+    unsigned n_fds;
+
+    _dbus_message_get_unix_fds (message, &fds, &n_fds);
+    _dbus_counter_adjust_unix_fd (connection->outgoing_counter,
+                                  sign * (long) n_fds);
+  }
+#endif
+}
+
+/* Takes a message off the outgoing queue, given its link in
+ * outgoing_messages, and drops the queue's reference to it.
+ */
+static void
+remove_outgoing_link (DBusConnection *connection,
+                      DBusList       *link)
+{
+  DBusMessage *message = link->data;
+
+  /* Save this link in the link cache */
+  _dbus_list_unlink (&connection->outgoing_messages,
+                     link);
+  _dbus_list_prepend_link (&connection->link_cache, link);
+
+  connection->n_outgoing -= 1;
+
+  adjust_outgoing_counter (connection, message, -1);
+  
+  dbus_message_unref (message);
+}
+
 /**
  * Notifies the connection that a message has been sent, so the
  * message can be removed from the outgoing queue.
@@ -615,12 +858,10 @@ _dbus_connection_message_sent (DBusConnection *connection,
   _dbus_assert (link != NULL);
   _dbus_assert (link->data == message);
 
-  /* Save this link in the link cache */
-  _dbus_list_unlink (&connection->outgoing_messages,
-                     link);
-  _dbus_list_prepend_link (&connection->link_cache, link);
-  
-  connection->n_outgoing -= 1;
+  if (connection->n_outgoing_ahead > 0)
+    connection->n_outgoing_ahead -= 1;
+
+  _DBUS_PROBE2 (message__written, connection, message);
 
   _dbus_verbose ("Message %p (%s %s %s %s '%s') removed from outgoing queue %p, %d left to send\n",
                  message,
@@ -635,14 +876,131 @@ _dbus_connection_message_sent (DBusConnection *connection,
                  dbus_message_get_member (message) :
                  "no member",
                  dbus_message_get_signature (message),
-                 connection, connection->n_outgoing);
+                 connection, connection->n_outgoing - 1);
 
-  /* Save this link in the link cache also */
-  _dbus_message_remove_counter (message, connection->outgoing_counter,
-                                &link);
-  _dbus_list_prepend_link (&connection->link_cache, link);
-  
-  dbus_message_unref (message);
+  remove_outgoing_link (connection, link);
+}
+
+static dbus_bool_t
+strings_equal_or_both_null (const char *a,
+                            const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+
+  return strcmp (a, b) == 0;
+}
+
+static dbus_bool_t
+signal_supersedes (DBusMessage *newer,
+                   DBusMessage *older)
+{
+  if (dbus_message_get_type (older) != DBUS_MESSAGE_TYPE_SIGNAL)
+    return FALSE;
+
+  /* member first, it's the likeliest to differ */
+  return strings_equal_or_both_null (dbus_message_get_member (newer),
+                                     dbus_message_get_member (older)) &&
+    strings_equal_or_both_null (dbus_message_get_interface (newer),
+                                dbus_message_get_interface (older)) &&
+    strings_equal_or_both_null (dbus_message_get_path (newer),
+                                dbus_message_get_path (older)) &&
+    strings_equal_or_both_null (dbus_message_get_sender (newer),
+                                dbus_message_get_sender (older));
+}
+
+/**
+ * Removes from the outgoing queue any signal with the same sender,
+ * path, interface and member as the given one, for when only the
+ * latest value of a signal matters and a consumer has fallen behind.
+ * The message at the front of the queue is always left alone, since
+ * it may be partly written already.
+ *
+ * @param connection the connection.
+ * @param message the signal that supersedes the queued ones
+ * @returns number of messages removed
+ */
+int
+_dbus_connection_drop_superseded_signals (DBusConnection *connection,
+                                          DBusMessage    *message)
+{
+  DBusList *link;
+  int n_from_end;
+  int n_dropped;
+
+  _dbus_assert (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL);
+
+  CONNECTION_LOCK (connection);
+
+  n_dropped = 0;
+
+  /* walk from the send end, skipping the first message */
+  n_from_end = 1;
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+  if (link != NULL)
+    link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+
+  while (link != NULL)
+    {
+      DBusList *prev = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+
+      if (signal_supersedes (message, link->data))
+        {
+          if (n_from_end < connection->n_outgoing_ahead)
+            connection->n_outgoing_ahead -= 1;
+
+          remove_outgoing_link (connection, link);
+          n_dropped += 1;
+        }
+      else
+        n_from_end += 1;
+
+      link = prev;
+    }
+
+  if (n_dropped > 0)
+    _dbus_verbose ("Dropped %d signals superseded by %p from outgoing queue %p, %d left to send\n",
+                   n_dropped, message, connection, connection->n_outgoing);
+
+  CONNECTION_UNLOCK (connection);
+
+  return n_dropped;
+}
+
+/**
+ * Frees memory the connection holds on to for reuse: the spare
+ * capacity of the transport's buffers and the cached list links.
+ * Worth calling on a connection that has gone quiet after a burst
+ * of traffic; everything freed is reallocated on demand.
+ *
+ * @param connection the connection.
+ */
+void
+_dbus_connection_trim (DBusConnection *connection)
+{
+  CONNECTION_LOCK (connection);
+
+  _dbus_transport_trim (connection->transport);
+  _dbus_list_clear (&connection->link_cache);
+
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Stops reading from the connection for now, or starts again.
+ * Messages already read are still dispatched; the rest wait in the
+ * socket, so the peer is slowed down rather than cut off.
+ *
+ * @param connection the connection.
+ * @param paused #TRUE to stop reading
+ */
+void
+_dbus_connection_set_read_paused (DBusConnection *connection,
+                                  dbus_bool_t     paused)
+{
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_read_paused (connection->transport, paused);
+  CONNECTION_UNLOCK (connection);
 }
 
 /** Function to be called in protected_change_watch() with refcount held */
@@ -769,6 +1127,27 @@ _dbus_connection_toggle_watch_unlocked (DBusConnection *connection,
                           enabled);
 }
 
+/**
+ * Asks the app to look at an enabled watch again, via the
+ * connection's DBusWatchToggledFunction, without changing whether it
+ * is enabled. Only used with edge-triggered watches.
+ * Connection lock should be held when calling this.
+ *
+ * @param connection the connection.
+ * @param watch the watch to re-arm.
+ */
+void
+_dbus_connection_rearm_watch_unlocked (DBusConnection *connection,
+                                       DBusWatch      *watch)
+{
+  _dbus_assert (watch != NULL);
+
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->watches)
+    _dbus_watch_list_rearm_watch (connection->watches, watch);
+}
+
 /** Function to be called in protected_change_timeout() with refcount held */
 typedef dbus_bool_t (* DBusTimeoutAddFunction)    (DBusTimeoutList *list,
                                                    DBusTimeout     *timeout);
@@ -892,78 +1271,350 @@ _dbus_connection_toggle_timeout_unlocked (DBusConnection   *connection,
 }
 
 static dbus_bool_t
-_dbus_connection_attach_pending_call_unlocked (DBusConnection  *connection,
-                                               DBusPendingCall *pending)
+deadline_is_before (const DBusPendingDeadline *a,
+                    const DBusPendingDeadline *b)
 {
-  dbus_uint32_t reply_serial;
-  DBusTimeout *timeout;
-
-  HAVE_LOCK_CHECK (connection);
+  return a->tv_sec < b->tv_sec ||
+    (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
 
-  reply_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
+static void
+deadline_heap_set (DBusConnection            *connection,
+                   int                        i,
+                   const DBusPendingDeadline *deadline)
+{
+  connection->deadlines[i] = *deadline;
+  _dbus_pending_call_set_timer_index_unlocked (deadline->pending, i);
+}
 
-  _dbus_assert (reply_serial != 0);
+/* Moves the deadline at i to where it belongs; either way, since
+ * removal fills a hole with the last deadline.
+ */
+static int
+deadline_heap_fix (DBusConnection *connection,
+                   int             i)
+{
+  DBusPendingDeadline deadline;
 
-  timeout = _dbus_pending_call_get_timeout_unlocked (pending);
+  deadline = connection->deadlines[i];
 
-  if (timeout)
+  while (i > 0 &&
+         deadline_is_before (&deadline, &connection->deadlines[(i - 1) / 2]))
     {
-      if (!_dbus_connection_add_timeout_unlocked (connection, timeout))
-        return FALSE;
-      
-      if (!_dbus_hash_table_insert_int (connection->pending_replies,
-                                        reply_serial,
-                                        pending))
-        {
-          _dbus_connection_remove_timeout_unlocked (connection, timeout);
-
-          _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
-          HAVE_LOCK_CHECK (connection);
-          return FALSE;
-        }
-      
-      _dbus_pending_call_set_timeout_added_unlocked (pending, TRUE);
+      deadline_heap_set (connection, i, &connection->deadlines[(i - 1) / 2]);
+      i = (i - 1) / 2;
     }
-  else
+
+  while (TRUE)
     {
-      if (!_dbus_hash_table_insert_int (connection->pending_replies,
-                                        reply_serial,
-                                        pending))
-        {
-          HAVE_LOCK_CHECK (connection);
-          return FALSE;
-        }
+      int child = 2 * i + 1;
+
+      if (child >= connection->n_deadlines)
+        break;
+
+      if (child + 1 < connection->n_deadlines &&
+          deadline_is_before (&connection->deadlines[child + 1],
+                              &connection->deadlines[child]))
+        child += 1;
+
+      if (!deadline_is_before (&connection->deadlines[child], &deadline))
+        break;
+
+      deadline_heap_set (connection, i, &connection->deadlines[child]);
+      i = child;
     }
 
-  _dbus_pending_call_ref_unlocked (pending);
+  deadline_heap_set (connection, i, &deadline);
 
-  HAVE_LOCK_CHECK (connection);
-  
-  return TRUE;
+  return i;
 }
 
-static void
-free_pending_call_on_hash_removal (void *data)
+/* Milliseconds until the earliest deadline, 0 if it has passed */
+static int
+deadline_get_remaining (const DBusPendingDeadline *deadline,
+                        long                       tv_sec,
+                        long                       tv_usec)
 {
-  DBusPendingCall *pending;
-  DBusConnection  *connection;
-  
-  if (data == NULL)
-    return;
+  long remaining;
 
-  pending = data;
+  remaining = (deadline->tv_sec - tv_sec) * 1000 +
+    (deadline->tv_usec - tv_usec) / 1000;
 
-  connection = _dbus_pending_call_get_connection_unlocked (pending);
+  return remaining > 0 ? remaining : 0;
+}
 
-  HAVE_LOCK_CHECK (connection);
-  
-  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-    {
-      _dbus_connection_remove_timeout_unlocked (connection,
-                                                _dbus_pending_call_get_timeout_unlocked (pending));
-      
-      _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
-    }
+/* Points the deadline timeout at the earliest deadline; toggling it
+ * is how the application learns about the new interval.
+ */
+static void
+connection_schedule_deadline_timeout_unlocked (DBusConnection *connection)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_assert (connection->n_deadlines > 0);
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  _dbus_timeout_set_interval (connection->deadline_timeout,
+                              deadline_get_remaining (&connection->deadlines[0],
+                                                      tv_sec, tv_usec));
+
+  _dbus_connection_toggle_timeout_unlocked (connection,
+                                            connection->deadline_timeout,
+                                            FALSE);
+  _dbus_connection_toggle_timeout_unlocked (connection,
+                                            connection->deadline_timeout,
+                                            TRUE);
+}
+
+static dbus_bool_t
+deadline_timeout_handler (void *data)
+{
+  DBusConnection *connection = data;
+  DBusDispatchStatus status;
+  long tv_sec, tv_usec;
+
+  CONNECTION_LOCK (connection);
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  while (connection->n_deadlines > 0 &&
+         deadline_get_remaining (&connection->deadlines[0],
+                                 tv_sec, tv_usec) == 0)
+    {
+      DBusPendingCall *pending = connection->deadlines[0].pending;
+
+      _dbus_pending_call_queue_timeout_error_unlocked (pending,
+                                                       connection);
+      connection_remove_deadline_unlocked (connection, pending);
+    }
+
+  /* Replies that arrived in the meantime leave the timeout where it
+   * was, so this may also just be catching up with them.
+   */
+  if (connection->n_deadlines > 0)
+    connection_schedule_deadline_timeout_unlocked (connection);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* Unlocks, and calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+  
+  return TRUE;
+}
+
+/**
+ * Queues the deadline of a pending call that has a timeout. The
+ * application only hears about this when the call is the first to
+ * time out.
+ *
+ * @param connection the connection
+ * @param pending the pending call
+ * @returns #FALSE if no memory
+ */
+static dbus_bool_t
+connection_add_deadline_unlocked (DBusConnection  *connection,
+                                  DBusPendingCall *pending)
+{
+  DBusPendingDeadline deadline;
+  int timeout_milliseconds;
+  int i;
+
+  _dbus_assert (_dbus_pending_call_get_timer_index_unlocked (pending) < 0);
+
+  if (connection->deadline_timeout == NULL)
+    {
+      connection->deadline_timeout =
+        _dbus_timeout_new (0, deadline_timeout_handler, connection, NULL);
+      if (connection->deadline_timeout == NULL)
+        return FALSE;
+    }
+
+  if (connection->n_deadlines == connection->n_deadlines_allocated)
+    {
+      DBusPendingDeadline *deadlines;
+      int n_allocated;
+
+      n_allocated = connection->n_deadlines_allocated > 0 ?
+        connection->n_deadlines_allocated * 2 : 8;
+
+      deadlines = dbus_realloc (connection->deadlines,
+                                n_allocated * sizeof (DBusPendingDeadline));
+      if (deadlines == NULL)
+        return FALSE;
+
+      connection->deadlines = deadlines;
+      connection->n_deadlines_allocated = n_allocated;
+    }
+
+  /* Limited to a smallish value in _dbus_pending_call_new_unlocked() */
+  timeout_milliseconds = _dbus_pending_call_get_timeout_unlocked (pending);
+
+  _dbus_get_current_time (&deadline.tv_sec, &deadline.tv_usec);
+  deadline.tv_sec += timeout_milliseconds / 1000;
+  deadline.tv_usec += (timeout_milliseconds % 1000) * 1000;
+  if (deadline.tv_usec >= 1000000)
+    {
+      deadline.tv_sec += 1;
+      deadline.tv_usec -= 1000000;
+    }
+  deadline.pending = pending;
+
+  connection->n_deadlines += 1;
+  deadline_heap_set (connection, connection->n_deadlines - 1, &deadline);
+  i = deadline_heap_fix (connection, connection->n_deadlines - 1);
+
+  if (connection->n_deadlines == 1)
+    {
+      _dbus_timeout_set_interval (connection->deadline_timeout,
+                                  timeout_milliseconds);
+
+      if (!_dbus_connection_add_timeout_unlocked (connection,
+                                                  connection->deadline_timeout))
+        {
+          connection->n_deadlines = 0;
+          _dbus_pending_call_set_timer_index_unlocked (pending, -1);
+          return FALSE;
+        }
+    }
+  else if (i == 0)
+    connection_schedule_deadline_timeout_unlocked (connection);
+
+  return TRUE;
+}
+
+/**
+ * Dequeues the deadline of a pending call, if it has one queued.
+ *
+ * @param connection the connection
+ * @param pending the pending call
+ */
+static void
+connection_remove_deadline_unlocked (DBusConnection  *connection,
+                                     DBusPendingCall *pending)
+{
+  int i;
+
+  i = _dbus_pending_call_get_timer_index_unlocked (pending);
+  if (i < 0)
+    return;
+
+  _dbus_assert (i < connection->n_deadlines);
+  _dbus_assert (connection->deadlines[i].pending == pending);
+
+  _dbus_pending_call_set_timer_index_unlocked (pending, -1);
+
+  connection->n_deadlines -= 1;
+  if (i < connection->n_deadlines)
+    {
+      deadline_heap_set (connection, i,
+                         &connection->deadlines[connection->n_deadlines]);
+      deadline_heap_fix (connection, i);
+    }
+
+  /* If the earliest deadline went, the timeout fires early once and
+   * reschedules itself, rather than telling the application now.
+   */
+  if (connection->n_deadlines == 0)
+    _dbus_connection_remove_timeout_unlocked (connection,
+                                              connection->deadline_timeout);
+}
+
+/**
+ * Gets the memory of a finalized pending call to build a new one in,
+ * if the connection kept one.
+ *
+ * @param connection the connection
+ * @returns memory for a #DBusPendingCall, or #NULL
+ */
+DBusPendingCall*
+_dbus_connection_take_cached_pending_call_unlocked (DBusConnection *connection)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->n_cached_pending_calls == 0)
+    return NULL;
+
+  connection->n_cached_pending_calls -= 1;
+  return connection->pending_call_cache[connection->n_cached_pending_calls];
+}
+
+/**
+ * Keeps the memory of a finalized pending call for the connection's
+ * next one. Called without the lock, by the pending call, which
+ * still holds its reference to the connection.
+ *
+ * @param connection the connection
+ * @param pending a pending call whose contents were all freed
+ * @returns #FALSE if the cache is full and the caller should free it
+ */
+dbus_bool_t
+_dbus_connection_cache_pending_call (DBusConnection  *connection,
+                                     DBusPendingCall *pending)
+{
+  dbus_bool_t cached;
+
+  CONNECTION_LOCK (connection);
+
+  cached = connection->n_cached_pending_calls < MAX_CACHED_PENDING_CALLS;
+  if (cached)
+    {
+      connection->pending_call_cache[connection->n_cached_pending_calls] = pending;
+      connection->n_cached_pending_calls += 1;
+    }
+
+  CONNECTION_UNLOCK (connection);
+
+  return cached;
+}
+
+static dbus_bool_t
+_dbus_connection_attach_pending_call_unlocked (DBusConnection  *connection,
+                                               DBusPendingCall *pending)
+{
+  dbus_uint32_t reply_serial;
+
+  HAVE_LOCK_CHECK (connection);
+
+  reply_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
+
+  _dbus_assert (reply_serial != 0);
+
+  if (_dbus_pending_call_get_timeout_unlocked (pending) >= 0 &&
+      !connection_add_deadline_unlocked (connection, pending))
+    return FALSE;
+
+  if (!_dbus_hash_table_insert_int (connection->pending_replies,
+                                    reply_serial,
+                                    pending))
+    {
+      connection_remove_deadline_unlocked (connection, pending);
+      HAVE_LOCK_CHECK (connection);
+      return FALSE;
+    }
+
+  _dbus_pending_call_ref_unlocked (pending);
+
+  HAVE_LOCK_CHECK (connection);
+  
+  return TRUE;
+}
+
+static void
+free_pending_call_on_hash_removal (void *data)
+{
+  DBusPendingCall *pending;
+  DBusConnection  *connection;
+  
+  if (data == NULL)
+    return;
+
+  pending = data;
+
+  connection = _dbus_pending_call_get_connection_unlocked (pending);
+
+  HAVE_LOCK_CHECK (connection);
+  
+  connection_remove_deadline_unlocked (connection, pending);
 
   /* FIXME 1.0? this is sort of dangerous and undesirable to drop the lock 
    * here, but the pending call finalizer could in principle call out to 
@@ -1002,11 +1653,7 @@ _dbus_connection_detach_pending_call_and_unlock (DBusConnection  *connection,
   _dbus_hash_table_remove_int (connection->pending_replies,
                                _dbus_pending_call_get_reply_serial_unlocked (pending));
 
-  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-      _dbus_connection_remove_timeout_unlocked (connection,
-              _dbus_pending_call_get_timeout_unlocked (pending));
-
-  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+  connection_remove_deadline_unlocked (connection, pending);
 
   _dbus_pending_call_unref_and_unlock (pending);
 }
@@ -1032,40 +1679,80 @@ _dbus_connection_remove_pending_call (DBusConnection  *connection,
  * doing any I/O in the transporter. May sleep and drop the
  * IO path mutex while waiting for the I/O path.
  *
+ * If pending is not #NULL the wait is on behalf of that pending call,
+ * and also ends (without acquiring the I/O path) when its reply is
+ * queued by the thread holding the I/O path.
+ *
  * @param connection the connection.
+ * @param pending the pending call we're waiting for, or #NULL
  * @param timeout_milliseconds maximum blocking time, or -1 for no limit.
  * @returns TRUE if the I/O path was acquired.
  */
 static dbus_bool_t
-_dbus_connection_acquire_io_path (DBusConnection *connection,
-				  int             timeout_milliseconds)
+_dbus_connection_acquire_io_path (DBusConnection  *connection,
+                                  DBusPendingCall *pending,
+				  int              timeout_milliseconds)
 {
+  IOPathReplyWaiter waiter;
+  DBusList *waiter_link;
+  DBusCondVar *cond;
   dbus_bool_t we_acquired;
   
   HAVE_LOCK_CHECK (connection);
 
+  /* Sleep on the pending call's own condvar if we can, so that the
+   * reply wakes just us instead of every thread making a blocking
+   * call on this connection waiting their turn at the I/O path.
+   * Without the memory for it, io_path_cond works as it always did.
+   */
+  cond = connection->io_path_cond;
+  waiter_link = NULL;
+  waiter.reply_arrived = FALSE;
+  if (pending != NULL && timeout_milliseconds != 0)
+    {
+      waiter.pending = pending;
+      waiter.cond = _dbus_pending_call_get_reply_condvar_unlocked (pending);
+      if (waiter.cond != NULL)
+        waiter_link = _dbus_list_alloc_link (&waiter);
+      if (waiter_link != NULL)
+        cond = waiter.cond;
+    }
+
   /* We don't want the connection to vanish */
   _dbus_connection_ref_unlocked (connection);
 
-  /* We will only touch io_path_acquired which is protected by our mutex */
-  CONNECTION_UNLOCK (connection);
-  
+  /* Take io_path_mutex before dropping the connection lock: replies
+   * are queued under the connection lock, so one that wasn't there
+   * when our caller looked can't slip in before we're on
+   * io_path_reply_waiters to be woken for it.
+   */
   _dbus_verbose ("locking io_path_mutex\n");
   _dbus_mutex_lock (connection->io_path_mutex);
 
+  /* We will only touch io_path_acquired which is protected by our mutex */
+  CONNECTION_UNLOCK (connection);
+
   _dbus_verbose ("start connection->io_path_acquired = %d timeout = %d\n",
                  connection->io_path_acquired, timeout_milliseconds);
 
   we_acquired = FALSE;
   
-  if (connection->io_path_acquired)
+  /* A zero timeout is what every dbus_connection_send() uses to try
+   * and write right away; with the path busy it can only time out, so
+   * don't bother sleeping on the condvar for it.
+   */
+  if (connection->io_path_acquired && timeout_milliseconds != 0)
     {
+      connection->io_path_waiters += 1;
+      if (waiter_link != NULL)
+        _dbus_list_append_link (&connection->io_path_reply_waiters, waiter_link);
+
       if (timeout_milliseconds != -1)
         {
           _dbus_verbose ("waiting %d for IO path to be acquirable\n",
                          timeout_milliseconds);
 
-          if (!_dbus_condvar_wait_timeout (connection->io_path_cond,
+          if (!_dbus_condvar_wait_timeout (cond,
                                            connection->io_path_mutex,
                                            timeout_milliseconds))
             {
@@ -1081,13 +1768,18 @@ _dbus_connection_acquire_io_path (DBusConnection *connection,
         }
       else
         {
-          while (connection->io_path_acquired)
+          while (connection->io_path_acquired && !waiter.reply_arrived)
             {
               _dbus_verbose ("waiting for IO path to be acquirable\n");
-              _dbus_condvar_wait (connection->io_path_cond, 
+              _dbus_condvar_wait (cond, 
                                   connection->io_path_mutex);
             }
         }
+
+      if (waiter_link != NULL)
+        _dbus_list_unlink (&connection->io_path_reply_waiters, waiter_link);
+      connection->io_path_waiters -= 1;
+      _dbus_assert (connection->io_path_waiters >= 0);
     }
   
   if (!connection->io_path_acquired)
@@ -1096,12 +1788,15 @@ _dbus_connection_acquire_io_path (DBusConnection *connection,
       connection->io_path_acquired = TRUE;
     }
   
-  _dbus_verbose ("end connection->io_path_acquired = %d we_acquired = %d\n",
-                 connection->io_path_acquired, we_acquired);
+  _dbus_verbose ("end connection->io_path_acquired = %d we_acquired = %d reply_arrived = %d\n",
+                 connection->io_path_acquired, we_acquired, waiter.reply_arrived);
 
   _dbus_verbose ("unlocking io_path_mutex\n");
   _dbus_mutex_unlock (connection->io_path_mutex);
 
+  if (waiter_link != NULL)
+    _dbus_list_free_link (waiter_link);
+
   CONNECTION_LOCK (connection);
   
   HAVE_LOCK_CHECK (connection);
@@ -1132,7 +1827,24 @@ _dbus_connection_release_io_path (DBusConnection *connection)
                  connection->io_path_acquired);
   
   connection->io_path_acquired = FALSE;
-  _dbus_condvar_wake_one (connection->io_path_cond);
+
+  if (connection->io_path_waiters > 0)
+    {
+      /* Prefer a thread on io_path_cond if there is one; otherwise
+       * every waiter sleeps on its own condvar, and the first one
+       * takes over.
+       */
+      if (connection->io_path_waiters >
+          _dbus_list_get_length (&connection->io_path_reply_waiters))
+        _dbus_condvar_wake_one (connection->io_path_cond);
+      else
+        {
+          IOPathReplyWaiter *waiter;
+
+          waiter = _dbus_list_get_first (&connection->io_path_reply_waiters);
+          _dbus_condvar_wake_one (waiter->cond);
+        }
+    }
 
   _dbus_verbose ("unlocking io_path_mutex\n");
   _dbus_mutex_unlock (connection->io_path_mutex);
@@ -1179,17 +1891,36 @@ _dbus_connection_do_iteration_unlocked (DBusConnection *connection,
                                         unsigned int    flags,
                                         int             timeout_milliseconds)
 {
+  unsigned int requested_flags;
+
   _dbus_verbose ("start\n");
   
   HAVE_LOCK_CHECK (connection);
   
+  requested_flags = flags;
   if (connection->n_outgoing == 0)
     flags &= ~DBUS_ITERATION_DO_WRITING;
 
-  if (_dbus_connection_acquire_io_path (connection,
+  if (_dbus_connection_acquire_io_path (connection, pending,
 					(flags & DBUS_ITERATION_BLOCK) ? timeout_milliseconds : 0))
     {
       HAVE_LOCK_CHECK (connection);
+
+      /* Other threads may have queued messages while we waited for
+       * the io path; with the path ours, nobody else can write them,
+       * and a blocked reader might be waiting on a reply to one.
+       */
+      if ((requested_flags & DBUS_ITERATION_DO_WRITING) &&
+          connection->n_outgoing > 0)
+        flags |= DBUS_ITERATION_DO_WRITING;
+
+      /* A concurrent dispatcher may have finished a message while we
+       * waited, leaving the next one for its sender and path free to
+       * take; don't sleep on the socket in front of it.
+       */
+      if (pending == NULL && connection->concurrent_dispatch &&
+          _dbus_connection_has_dispatchable_unlocked (connection))
+        flags &= ~DBUS_ITERATION_BLOCK;
       
       if ( (pending != NULL) && _dbus_pending_call_get_completed_unlocked(pending))
         {
@@ -1215,6 +1946,65 @@ _dbus_connection_do_iteration_unlocked (DBusConnection *connection,
   _dbus_verbose ("end\n");
 }
 
+/**
+ * Runs an iteration of the connection's transport on behalf of some
+ * other code, as a channel does to get the I/O of its link done (see
+ * dbus-transport-mux.c). Unlike _dbus_connection_do_iteration_unlocked()
+ * it writes when asked to even if this connection has no messages of
+ * its own to send, and it updates the dispatch status afterwards.
+ * Takes and releases the connection lock.
+ *
+ * @param connection the connection.
+ * @param flags iteration flags.
+ * @param timeout_milliseconds maximum blocking time, or -1 for no limit.
+ */
+void
+_dbus_connection_iterate (DBusConnection *connection,
+                          unsigned int    flags,
+                          int             timeout_milliseconds)
+{
+  DBusDispatchStatus status;
+
+  CONNECTION_LOCK (connection);
+
+  if (_dbus_connection_acquire_io_path (connection, NULL,
+                                        (flags & DBUS_ITERATION_BLOCK) ? timeout_milliseconds : 0))
+    {
+      _dbus_transport_do_iteration (connection->transport,
+                                    flags, timeout_milliseconds);
+      _dbus_connection_release_io_path (connection);
+    }
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* this calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+}
+
+/**
+ * Queues whatever the transport has received and notifies the
+ * application if the dispatch status changed, for transports whose
+ * input arrives other than through the connection's own watches.
+ * Takes and releases the connection lock.
+ *
+ * @param connection the connection.
+ */
+void
+_dbus_connection_update_dispatch_status (DBusConnection *connection)
+{
+  DBusDispatchStatus status;
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_transport_queue_messages (connection->transport))
+    status = DBUS_DISPATCH_NEED_MEMORY;
+  else
+    status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* this calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+}
+
 /**
  * Creates a new connection for the given transport.  A transport
  * represents a message stream that uses some concrete mechanism, such
@@ -1295,9 +2085,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   if (disconnect_message == NULL)
     goto error;
 
-  disconnect_link = _dbus_list_alloc_link (disconnect_message);
-  if (disconnect_link == NULL)
-    goto error;
+  disconnect_link = _dbus_message_get_queue_link (disconnect_message);
 
   outgoing_counter = _dbus_counter_new ();
   if (outgoing_counter == NULL)
@@ -1317,11 +2105,14 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   connection->pending_replies = pending_replies;
   connection->outgoing_counter = outgoing_counter;
   connection->filter_list = NULL;
+  connection->filter_index = NULL;
+  connection->next_filter_order = 0;
   connection->last_dispatch_status = DBUS_DISPATCH_COMPLETE; /* so we're notified first time there's data */
   connection->objects = objects;
   connection->exit_on_disconnect = FALSE;
   connection->shareable = FALSE;
   connection->route_peer_messages = FALSE;
+  connection->replies_jump_queue = FALSE;
   connection->disconnected_message_arrived = FALSE;
   connection->disconnected_message_processed = FALSE;
   
@@ -1354,9 +2145,6 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   if (disconnect_message != NULL)
     dbus_message_unref (disconnect_message);
   
-  if (disconnect_link != NULL)
-    _dbus_list_free_link (disconnect_link);
-  
   if (connection != NULL)
     {
       _dbus_condvar_free_at_location (&connection->io_path_cond);
@@ -1467,7 +2255,7 @@ _dbus_connection_handle_watch (DBusWatch                   *watch,
   
   CONNECTION_LOCK (connection);
 
-  if (!_dbus_connection_acquire_io_path (connection, 1))
+  if (!_dbus_connection_acquire_io_path (connection, NULL, 1))
     {
       /* another thread is handling the message */
       CONNECTION_UNLOCK (connection);
@@ -1494,30 +2282,113 @@ _dbus_connection_handle_watch (DBusWatch                   *watch,
   return retval;
 }
 
-_DBUS_DEFINE_GLOBAL_LOCK (shared_connections);
-static DBusHashTable *shared_connections = NULL;
-static DBusList *shared_connections_no_guid = NULL;
-
-static void
-close_connection_on_shutdown (DBusConnection *connection)
+static dbus_bool_t
+wakeup_watch_handler (DBusWatch    *watch,
+                      unsigned int  condition,
+                      void         *data)
 {
-  DBusMessage *message;
+  DBusConnection *connection = data;
+  DBusDispatchStatus status;
 
-  dbus_connection_ref (connection);
-  _dbus_connection_close_possibly_shared (connection);
+  CONNECTION_LOCK (connection);
 
-  /* Churn through to the Disconnected message */
-  while ((message = dbus_connection_pop_message (connection)))
-    {
-      dbus_message_unref (message);
-    }
-  dbus_connection_unref (connection);
+  _dbus_wakeup_pipe_drain (&connection->wakeup_pipe);
+  connection->wakeup_signalled = FALSE;
+
+  /* Write out whatever other threads queued meanwhile */
+  _dbus_connection_do_iteration_unlocked (connection,
+                                          NULL,
+                                          DBUS_ITERATION_DO_WRITING,
+                                          0);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* this calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+  return TRUE;
 }
 
+/* Best effort; without the pipe, other threads just can't wake the
+ * main loop, as before there was one.
+ */
 static void
-shared_connections_shutdown (void *data)
+connection_add_wakeup_watch_unlocked (DBusConnection *connection)
 {
-  int n_entries;
+  DBusError error = DBUS_ERROR_INIT;
+
+  HAVE_LOCK_CHECK (connection);
+
+  if (!_dbus_wakeup_pipe_open (&connection->wakeup_pipe, &error))
+    {
+      _dbus_verbose ("No wakeup pipe: %s\n", error.message);
+      dbus_error_free (&error);
+      return;
+    }
+
+  connection->wakeup_watch = _dbus_watch_new (connection->wakeup_pipe.read_fd,
+                                              DBUS_WATCH_READABLE, TRUE,
+                                              wakeup_watch_handler,
+                                              connection, NULL);
+  if (connection->wakeup_watch == NULL)
+    {
+      _dbus_wakeup_pipe_close (&connection->wakeup_pipe);
+      return;
+    }
+
+  if (!_dbus_connection_add_watch_unlocked (connection,
+                                            connection->wakeup_watch))
+    {
+      _dbus_watch_unref (connection->wakeup_watch);
+      connection->wakeup_watch = NULL;
+      _dbus_wakeup_pipe_close (&connection->wakeup_pipe);
+      return;
+    }
+
+  connection->wakeup_signalled = FALSE;
+}
+
+static void
+connection_remove_wakeup_watch_unlocked (DBusConnection *connection)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->wakeup_watch == NULL)
+    return;
+
+  _dbus_connection_remove_watch_unlocked (connection,
+                                          connection->wakeup_watch);
+  _dbus_watch_invalidate (connection->wakeup_watch);
+  _dbus_watch_unref (connection->wakeup_watch);
+  connection->wakeup_watch = NULL;
+
+  _dbus_wakeup_pipe_close (&connection->wakeup_pipe);
+}
+
+_DBUS_DEFINE_GLOBAL_LOCK (shared_connections);
+static DBusHashTable *shared_connections = NULL;
+static DBusList *shared_connections_no_guid = NULL;
+
+static void
+close_connection_on_shutdown (DBusConnection *connection)
+{
+  DBusMessage *message;
+
+  dbus_connection_ref (connection);
+  _dbus_connection_close_possibly_shared (connection);
+
+  /* Churn through to the Disconnected message */
+  while ((message = dbus_connection_pop_message (connection)))
+    {
+      dbus_message_unref (message);
+    }
+  dbus_connection_unref (connection);
+}
+
+static void
+shared_connections_shutdown (void *data)
+{
+  int n_entries;
   
   _DBUS_LOCK (shared_connections);
   
@@ -1900,19 +2771,19 @@ _dbus_connection_close_possibly_shared (DBusConnection *connection)
   _dbus_connection_close_possibly_shared_and_unlock (connection);
 }
 
-static DBusPreallocatedSend*
-_dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
+/* Fills in a caller-provided DBusPreallocatedSend; the internal send
+ * paths keep it on the stack, and dbus_connection_preallocate_send()
+ * allocates it before taking the lock, so a send doesn't malloc and
+ * free it while holding the connection lock.
+ */
+static dbus_bool_t
+_dbus_connection_init_preallocated_send_unlocked (DBusConnection       *connection,
+                                                  DBusPreallocatedSend *preallocated)
 {
-  DBusPreallocatedSend *preallocated;
-
   HAVE_LOCK_CHECK (connection);
   
   _dbus_assert (connection != NULL);
   
-  preallocated = dbus_new (DBusPreallocatedSend, 1);
-  if (preallocated == NULL)
-    return NULL;
-
   if (connection->link_cache != NULL)
     {
       preallocated->queue_link =
@@ -1923,55 +2794,96 @@ _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
     {
       preallocated->queue_link = _dbus_list_alloc_link (NULL);
       if (preallocated->queue_link == NULL)
-        goto failed_0;
+        return FALSE;
     }
+
+  preallocated->connection = connection;
   
-  if (connection->link_cache != NULL)
+  return TRUE;
+}
+
+static dbus_bool_t
+messages_have_same_sender (DBusMessage *a,
+                           DBusMessage *b)
+{
+  return strings_equal_or_both_null (dbus_message_get_sender (a),
+                                     dbus_message_get_sender (b));
+}
+
+/* Puts a message on the outgoing queue. If the connection has
+ * replies_jump_queue set, method returns and errors go ahead of the
+ * other messages waiting to be sent, so that a reply doesn't wait
+ * behind a backlog of signals; but never ahead of the first message
+ * in the queue, which may be partly written already, of replies
+ * queued earlier, or of anything from the same sender, so each
+ * sender's messages still arrive in the order it sent them.
+ *
+ * This does change the order between senders: the peer can see a
+ * reply before a signal from some other sender that was queued
+ * earlier, including the bus's own signals. The bus only turns it on
+ * for a client that asks with SetReplyPriority. Before a message has
+ * a sender (en route from a client to the bus) nothing is ever
+ * reordered.
+ */
+static void
+_dbus_connection_queue_outgoing_link (DBusConnection *connection,
+                                      DBusList       *queue_link)
+{
+  DBusMessage *message = queue_link->data;
+  DBusList *link;
+  int n_behind;
+  int i;
+  int type;
+
+  type = dbus_message_get_type (message);
+
+  if (!connection->replies_jump_queue ||
+      connection->outgoing_messages == NULL ||
+      (type != DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+       type != DBUS_MESSAGE_TYPE_ERROR))
     {
-      preallocated->counter_link =
-        _dbus_list_pop_first_link (&connection->link_cache);
-      preallocated->counter_link->data = connection->outgoing_counter;
+      _dbus_list_prepend_link (&connection->outgoing_messages, queue_link);
+      return;
     }
-  else
+
+  /* the most recently queued messages are at the start of the list */
+  n_behind = connection->n_outgoing - MAX (connection->n_outgoing_ahead, 1);
+
+  i = 0;
+  link = _dbus_list_get_first_link (&connection->outgoing_messages);
+  while (i < n_behind && !messages_have_same_sender (link->data, message))
     {
-      preallocated->counter_link = _dbus_list_alloc_link (connection->outgoing_counter);
-      if (preallocated->counter_link == NULL)
-        goto failed_1;
+      link = _dbus_list_get_next_link (&connection->outgoing_messages, link);
+      ++i;
     }
 
-  _dbus_counter_ref (preallocated->counter_link->data);
+  _dbus_assert (link != NULL);
+
+  _dbus_list_insert_before_link (&connection->outgoing_messages,
+                                 link, queue_link);
 
-  preallocated->connection = connection;
-  
-  return preallocated;
-  
- failed_1:
-  _dbus_list_free_link (preallocated->queue_link);
- failed_0:
-  dbus_free (preallocated);
-  
-  return NULL;
+  /* a later reply goes behind this one */
+  connection->n_outgoing_ahead = connection->n_outgoing - i + 1;
+
+  if (i > 0)
+    _dbus_verbose ("Reply %p queued ahead of %d messages\n", message, i);
 }
 
-/* Called with lock held, does not update dispatch status */
+/* Queues the message without trying to write it; takes over the
+ * links in preallocated, but not preallocated itself
+ */
 static void
-_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
-                                                       DBusPreallocatedSend *preallocated,
-                                                       DBusMessage          *message,
-                                                       dbus_uint32_t        *client_serial)
+_dbus_connection_queue_preallocated_unlocked (DBusConnection       *connection,
+                                              DBusPreallocatedSend *preallocated,
+                                              DBusMessage          *message,
+                                              dbus_uint32_t        *client_serial)
 {
   dbus_uint32_t serial;
   const char *sig;
 
   preallocated->queue_link->data = message;
-  _dbus_list_prepend_link (&connection->outgoing_messages,
-                           preallocated->queue_link);
-
-  _dbus_message_add_counter_link (message,
-                                  preallocated->counter_link);
-
-  dbus_free (preallocated);
-  preallocated = NULL;
+  _dbus_connection_queue_outgoing_link (connection,
+                                        preallocated->queue_link);
   
   dbus_message_ref (message);
   
@@ -2016,6 +2928,31 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
   
   dbus_message_lock (message);
 
+  adjust_outgoing_counter (connection, message, 1);
+
+  _DBUS_PROBE3 (message__queued, connection, message, connection->n_outgoing);
+}
+
+/* Writes out what was just queued, or leaves it to whoever set the
+ * defer_write_function, so that several messages sent in a row can
+ * go out in one write
+ */
+static void
+_dbus_connection_write_or_defer_unlocked (DBusConnection *connection)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->write_deferred)
+    return;
+
+  if (connection->defer_write_function != NULL &&
+      (* connection->defer_write_function) (connection,
+                                            connection->defer_write_data))
+    {
+      connection->write_deferred = TRUE;
+      return;
+    }
+
   /* Now we need to run an iteration to hopefully just write the messages
    * out immediately, and otherwise get them queued up
    */
@@ -2029,6 +2966,19 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
     _dbus_connection_wakeup_mainloop (connection);
 }
 
+/* Takes over the links in preallocated, but not preallocated itself */
+static void
+_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
+                                                       DBusPreallocatedSend *preallocated,
+                                                       DBusMessage          *message,
+                                                       dbus_uint32_t        *client_serial)
+{
+  _dbus_connection_queue_preallocated_unlocked (connection, preallocated,
+                                                message, client_serial);
+
+  _dbus_connection_write_or_defer_unlocked (connection);
+}
+
 static void
 _dbus_connection_send_preallocated_and_unlock (DBusConnection       *connection,
 					       DBusPreallocatedSend *preallocated,
@@ -2064,20 +3014,20 @@ _dbus_connection_send_and_unlock (DBusConnection *connection,
 				  DBusMessage    *message,
 				  dbus_uint32_t  *client_serial)
 {
-  DBusPreallocatedSend *preallocated;
+  DBusPreallocatedSend preallocated;
 
   _dbus_assert (connection != NULL);
   _dbus_assert (message != NULL);
   
-  preallocated = _dbus_connection_preallocate_send_unlocked (connection);
-  if (preallocated == NULL)
+  if (!_dbus_connection_init_preallocated_send_unlocked (connection,
+                                                         &preallocated))
     {
       CONNECTION_UNLOCK (connection);
       return FALSE;
     }
 
   _dbus_connection_send_preallocated_and_unlock (connection,
-						 preallocated,
+						 &preallocated,
 						 message,
 						 client_serial);
   return TRUE;
@@ -2247,7 +3197,7 @@ check_for_reply_unlocked (DBusConnection *connection,
 
       if (dbus_message_get_reply_serial (reply) == client_serial)
 	{
-	  _dbus_list_remove_link (&connection->incoming_messages, link);
+	  _dbus_list_unlink (&connection->incoming_messages, link);
 	  connection->n_incoming  -= 1;
 	  return reply;
 	}
@@ -2279,10 +3229,7 @@ connection_timeout_and_complete_all_pending_calls_unlocked (DBusConnection *conn
       _dbus_pending_call_queue_timeout_error_unlocked (pending, 
                                                        connection);
 
-      if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-          _dbus_connection_remove_timeout_unlocked (connection,
-                                                    _dbus_pending_call_get_timeout_unlocked (pending));
-      _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);       
+      connection_remove_deadline_unlocked (connection, pending);
       _dbus_hash_iter_remove_entry (&iter);
 
       _dbus_pending_call_unref_and_unlock (pending);
@@ -2356,7 +3303,6 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
   DBusDispatchStatus status;
   DBusConnection *connection;
   dbus_uint32_t client_serial;
-  DBusTimeout *timeout;
   int timeout_milliseconds, elapsed_milliseconds;
 
   _dbus_assert (pending != NULL);
@@ -2377,10 +3323,9 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
    * in _dbus_pending_call_new() so overflows aren't possible
    * below
    */
-  timeout = _dbus_pending_call_get_timeout_unlocked (pending);
-  if (timeout)
+  timeout_milliseconds = _dbus_pending_call_get_timeout_unlocked (pending);
+  if (timeout_milliseconds >= 0)
     {
-      timeout_milliseconds = dbus_timeout_get_interval (timeout);
       _dbus_get_current_time (&start_tv_sec, &start_tv_usec);
 
       _dbus_verbose ("dbus_connection_send_with_reply_and_block(): will block %d milliseconds for reply serial %u from %ld sec %ld usec\n",
@@ -2390,8 +3335,6 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
     }
   else
     {
-      timeout_milliseconds = -1;
-
       _dbus_verbose ("dbus_connection_send_with_reply_and_block(): will block for reply serial %u\n", client_serial);
     }
 
@@ -2405,6 +3348,7 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
   _dbus_connection_do_iteration_unlocked (connection,
                                           pending,
                                           DBUS_ITERATION_DO_READING |
+                                          DBUS_ITERATION_DO_WRITING |
                                           DBUS_ITERATION_BLOCK,
                                           timeout_milliseconds);
 
@@ -2454,7 +3398,7 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
     }
   else if (connection->disconnect_message_link == NULL)
     _dbus_verbose ("dbus_connection_send_with_reply_and_block(): disconnected\n");
-  else if (timeout == NULL)
+  else if (timeout_milliseconds < 0)
     {
        if (status == DBUS_DISPATCH_NEED_MEMORY)
         {
@@ -2472,6 +3416,7 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
           _dbus_connection_do_iteration_unlocked (connection,
                                                   pending,
                                                   DBUS_ITERATION_DO_READING |
+                                                  DBUS_ITERATION_DO_WRITING |
                                                   DBUS_ITERATION_BLOCK,
                                                   timeout_milliseconds - elapsed_milliseconds);
         }
@@ -2498,8 +3443,9 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
         {          
           /* block again, we don't have the reply buffered yet. */
           _dbus_connection_do_iteration_unlocked (connection,
-                                                  NULL,
+                                                  pending,
                                                   DBUS_ITERATION_DO_READING |
+                                                  DBUS_ITERATION_DO_WRITING |
                                                   DBUS_ITERATION_BLOCK,
                                                   timeout_milliseconds - elapsed_milliseconds);
         }
@@ -2522,6 +3468,75 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
   dbus_pending_call_unref (pending);
 }
 
+/**
+ * Gets a connection that was handed out by a #DBusConnectionPool
+ * ready to be handed out again: every object path handler is
+ * unregistered and every queued incoming message thrown away.
+ *
+ * Filters can't be removed without their user data, so a connection
+ * that still has any can't be reset; it could end up calling into
+ * memory the previous user freed.
+ *
+ * @param connection the connection
+ * @returns #FALSE if the connection has filters or no memory
+ */
+dbus_bool_t
+_dbus_connection_reset_for_pool (DBusConnection *connection)
+{
+  DBusMessage *message;
+  char **paths;
+  int i;
+
+  CONNECTION_LOCK (connection);
+
+  if (connection->filter_list != NULL)
+    {
+      CONNECTION_UNLOCK (connection);
+      return FALSE;
+    }
+
+  if (connection->filter_index != NULL)
+    {
+      DBusHashIter iter;
+
+      _dbus_hash_iter_init (connection->filter_index, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          DBusFilterBucket *bucket = _dbus_hash_iter_get_value (&iter);
+
+          if (bucket->filters != NULL)
+            {
+              CONNECTION_UNLOCK (connection);
+              return FALSE;
+            }
+        }
+    }
+
+  if (!_dbus_object_tree_list_paths_unlocked (connection->objects, &paths))
+    {
+      CONNECTION_UNLOCK (connection);
+      return FALSE;
+    }
+
+  CONNECTION_UNLOCK (connection);
+
+  /* Unregister functions are application code, so they run unlocked */
+  for (i = 0; paths[i] != NULL; i++)
+    {
+      if (!dbus_connection_unregister_object_path (connection, paths[i]))
+        {
+          dbus_free_string_array (paths);
+          return FALSE;
+        }
+    }
+  dbus_free_string_array (paths);
+
+  while ((message = dbus_connection_pop_message (connection)))
+    dbus_message_unref (message);
+
+  return TRUE;
+}
+
 /** @} */
 
 /**
@@ -2617,6 +3632,58 @@ dbus_connection_open_private (const char     *address,
   return connection;
 }
 
+/**
+ * Opens another connection to the same server over the stream of an
+ * existing one, which must have negotiated multiplexing; a client asks
+ * for that with multiplex=true in a tcp: address, and the existing
+ * connection must have finished authenticating, for instance with
+ * dbus_bus_register().
+ *
+ * The new connection, or channel, shares the authentication of
+ * @p connection but is otherwise independent: it has its own unique
+ * name once registered with a bus, its own message queues, handlers
+ * and dispatch status, and it is closed on its own. It has no watches
+ * of its own though; all I/O happens on @p connection, so the two
+ * must be used from the same thread and main loop, and the channel is
+ * disconnected when @p connection is.
+ *
+ * Like connections from dbus_connection_open_private(), channels
+ * must be closed with dbus_connection_close() before the last
+ * dbus_connection_unref().
+ *
+ * @param connection a multiplexed client connection
+ * @param error address where an error can be returned.
+ * @returns new connection, or #NULL on failure.
+ */
+DBusConnection*
+dbus_connection_open_channel (DBusConnection *connection,
+                              DBusError      *error)
+{
+  DBusTransport *transport;
+  DBusConnection *channel;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  CONNECTION_LOCK (connection);
+  transport = _dbus_transport_open_channel (connection->transport, error);
+  CONNECTION_UNLOCK (connection);
+
+  if (transport == NULL)
+    return NULL;
+
+  channel = _dbus_connection_new_for_transport (transport);
+  _dbus_transport_unref (transport);
+
+  if (channel == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  return channel;
+}
+
 /**
  * Increments the reference count of a DBusConnection.
  *
@@ -2641,9 +3708,7 @@ free_outgoing_message (void *element,
   DBusMessage *message = element;
   DBusConnection *connection = data;
 
-  _dbus_message_remove_counter (message,
-                                connection->outgoing_counter,
-                                NULL);
+  adjust_outgoing_counter (connection, message, -1);
   dbus_message_unref (message);
 }
 
@@ -2665,6 +3730,7 @@ _dbus_connection_last_unref (DBusConnection *connection)
    */
   _dbus_assert (!_dbus_transport_get_is_connected (connection->transport));
   _dbus_assert (connection->server_guid == NULL);
+  _dbus_assert (connection->dispatching == NULL);
   
   /* ---- We're going to call various application callbacks here, hope it doesn't break anything... */
   _dbus_object_tree_free_all_unlocked (connection->objects);
@@ -2675,10 +3741,29 @@ _dbus_connection_last_unref (DBusConnection *connection)
   
   _dbus_watch_list_free (connection->watches);
   connection->watches = NULL;
+
+  if (connection->wakeup_watch != NULL)
+    {
+      _dbus_watch_invalidate (connection->wakeup_watch);
+      _dbus_watch_unref (connection->wakeup_watch);
+      _dbus_wakeup_pipe_close (&connection->wakeup_pipe);
+    }
   
   _dbus_timeout_list_free (connection->timeouts);
   connection->timeouts = NULL;
 
+  _dbus_assert (connection->n_deadlines == 0);
+  dbus_free (connection->deadlines);
+  if (connection->deadline_timeout != NULL)
+    _dbus_timeout_unref (connection->deadline_timeout);
+
+  /* only memory; _dbus_pending_call_last_unref() freed what was in them */
+  while (connection->n_cached_pending_calls > 0)
+    {
+      connection->n_cached_pending_calls -= 1;
+      dbus_free (connection->pending_call_cache[connection->n_cached_pending_calls]);
+    }
+
   _dbus_data_slot_list_free (&connection->slot_list);
   
   link = _dbus_list_get_first_link (&connection->filter_list);
@@ -2694,6 +3779,33 @@ _dbus_connection_last_unref (DBusConnection *connection)
       link = next;
     }
   _dbus_list_clear (&connection->filter_list);
+
+  if (connection->filter_index != NULL)
+    {
+      DBusHashIter iter;
+
+      _dbus_hash_iter_init (connection->filter_index, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          DBusFilterBucket *bucket = _dbus_hash_iter_get_value (&iter);
+
+          link = _dbus_list_get_first_link (&bucket->filters);
+          while (link != NULL)
+            {
+              DBusMessageFilter *filter = link->data;
+              DBusList *next = _dbus_list_get_next_link (&bucket->filters, link);
+
+              filter->function = NULL;
+              _dbus_message_filter_unref (filter); /* calls app callback */
+              link->data = NULL;
+
+              link = next;
+            }
+        }
+
+      _dbus_hash_table_unref (connection->filter_index);
+      connection->filter_index = NULL;
+    }
   
   /* ---- Done with stuff that invokes application callbacks */
 
@@ -2709,10 +3821,7 @@ _dbus_connection_last_unref (DBusConnection *connection)
 		      connection);
   _dbus_list_clear (&connection->outgoing_messages);
   
-  _dbus_list_foreach (&connection->incoming_messages,
-		      (DBusForeachFunction) dbus_message_unref,
-		      NULL);
-  _dbus_list_clear (&connection->incoming_messages);
+  _dbus_message_queue_clear (&connection->incoming_messages);
 
   _dbus_counter_unref (connection->outgoing_counter);
 
@@ -2722,7 +3831,6 @@ _dbus_connection_last_unref (DBusConnection *connection)
     {
       DBusMessage *message = connection->disconnect_message_link->data;
       dbus_message_unref (message);
-      _dbus_list_free_link (connection->disconnect_message_link);
     }
 
   _dbus_list_clear (&connection->link_cache);
@@ -3111,10 +4219,18 @@ dbus_connection_preallocate_send (DBusConnection *connection)
 
   _dbus_return_val_if_fail (connection != NULL, NULL);
 
+  preallocated = dbus_new (DBusPreallocatedSend, 1);
+  if (preallocated == NULL)
+    return NULL;
+
   CONNECTION_LOCK (connection);
   
-  preallocated =
-    _dbus_connection_preallocate_send_unlocked (connection);
+  if (!_dbus_connection_init_preallocated_send_unlocked (connection,
+                                                         preallocated))
+    {
+      dbus_free (preallocated);
+      preallocated = NULL;
+    }
 
   CONNECTION_UNLOCK (connection);
 
@@ -3139,8 +4255,6 @@ dbus_connection_free_preallocated_send (DBusConnection       *connection,
   _dbus_return_if_fail (connection == preallocated->connection);
 
   _dbus_list_free_link (preallocated->queue_link);
-  _dbus_counter_unref (preallocated->counter_link->data);
-  _dbus_list_free_link (preallocated->counter_link);
   dbus_free (preallocated);
 }
 
@@ -3191,6 +4305,8 @@ dbus_connection_send_preallocated (DBusConnection       *connection,
   _dbus_connection_send_preallocated_and_unlock (connection,
 						 preallocated,
 						 message, client_serial);
+
+  dbus_free (preallocated);
 }
 
 static dbus_bool_t
@@ -3198,17 +4314,17 @@ _dbus_connection_send_unlocked_no_update (DBusConnection *connection,
                                           DBusMessage    *message,
                                           dbus_uint32_t  *client_serial)
 {
-  DBusPreallocatedSend *preallocated;
+  DBusPreallocatedSend preallocated;
 
   _dbus_assert (connection != NULL);
   _dbus_assert (message != NULL);
   
-  preallocated = _dbus_connection_preallocate_send_unlocked (connection);
-  if (preallocated == NULL)
+  if (!_dbus_connection_init_preallocated_send_unlocked (connection,
+                                                         &preallocated))
     return FALSE;
 
   _dbus_connection_send_preallocated_unlocked_no_update (connection,
-                                                         preallocated,
+                                                         &preallocated,
                                                          message,
                                                          client_serial);
   return TRUE;
@@ -3270,31 +4386,97 @@ dbus_connection_send (DBusConnection *connection,
 					   serial);
 }
 
-static dbus_bool_t
-reply_handler_timeout (void *data)
+/**
+ * Adds several messages to the outgoing message queue at once, as if
+ * each had been passed to dbus_connection_send() in turn, but taking
+ * the connection lock only once. Messages that have no serial yet get
+ * consecutive ones, and nothing else can be queued between them; the
+ * connection then tries to write them all out together.
+ *
+ * Either all of the messages are queued or, if there is not enough
+ * memory or one of them carries Unix file descriptors the connection
+ * cannot pass, none is.
+ *
+ * @param connection the connection.
+ * @param messages the messages to write, in order
+ * @param n_messages the number of messages
+ * @param serials return location for the n_messages serials of the
+ * messages, or #NULL if you don't care
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+dbus_connection_send_batch (DBusConnection  *connection,
+                            DBusMessage    **messages,
+                            int              n_messages,
+                            dbus_uint32_t   *serials)
 {
-  DBusConnection *connection;
+  DBusPreallocatedSend preallocated;
   DBusDispatchStatus status;
-  DBusPendingCall *pending = data;
-
-  connection = _dbus_pending_call_get_connection_and_lock (pending);
+  DBusList *links;
+  DBusList *link;
+  int i;
 
-  _dbus_pending_call_queue_timeout_error_unlocked (pending, 
-                                                   connection);
-  _dbus_connection_remove_timeout_unlocked (connection,
-				            _dbus_pending_call_get_timeout_unlocked (pending));
-  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (messages != NULL || n_messages == 0, FALSE);
+  _dbus_return_val_if_fail (n_messages >= 0, FALSE);
 
-  _dbus_verbose ("middle\n");
-  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  CONNECTION_LOCK (connection);
 
-  /* Unlocks, and calls out to user code */
-  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-  
-  return TRUE;
-}
+#ifdef HAVE_UNIX_FD_PASSING
 
-/**
+  if (!_dbus_transport_can_pass_unix_fd(connection->transport))
+    {
+      for (i = 0; i < n_messages; i++)
+        {
+          if (messages[i]->n_unix_fds > 0)
+            {
+              CONNECTION_UNLOCK (connection);
+              return FALSE;
+            }
+        }
+    }
+
+#endif
+
+  /* Get all the queue links first, so running out of memory leaves
+   * nothing half-sent
+   */
+  links = NULL;
+  for (i = 0; i < n_messages; i++)
+    {
+      if (!_dbus_connection_init_preallocated_send_unlocked (connection,
+                                                             &preallocated))
+        {
+          while ((link = _dbus_list_pop_first_link (&links)) != NULL)
+            _dbus_list_prepend_link (&connection->link_cache, link);
+
+          CONNECTION_UNLOCK (connection);
+          return FALSE;
+        }
+
+      _dbus_list_append_link (&links, preallocated.queue_link);
+    }
+
+  for (i = 0; i < n_messages; i++)
+    {
+      preallocated.queue_link = _dbus_list_pop_first_link (&links);
+      _dbus_connection_queue_preallocated_unlocked (connection,
+                                                    &preallocated,
+                                                    messages[i],
+                                                    serials ? &serials[i] : NULL);
+    }
+
+  _dbus_connection_write_or_defer_unlocked (connection);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* this calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+  return TRUE;
+}
+
+/**
  * Queues a message to send, as with dbus_connection_send(),
  * but also returns a #DBusPendingCall used to receive a reply to the
  * message. If no reply is received in the given timeout_milliseconds,
@@ -3375,8 +4557,7 @@ dbus_connection_send_with_reply (DBusConnection     *connection,
     }
 
   pending = _dbus_pending_call_new_unlocked (connection,
-                                             timeout_milliseconds,
-                                             reply_handler_timeout);
+                                             timeout_milliseconds);
 
   if (pending == NULL)
     {
@@ -3527,6 +4708,194 @@ dbus_connection_send_with_reply_and_block (DBusConnection     *connection,
     return reply;
 }
 
+/**
+ * Sends several method calls at once and blocks until every one of
+ * them has its reply, like calling
+ * dbus_connection_send_with_reply_and_block() for each in turn but
+ * without waiting a round trip per call: all the calls are queued
+ * under one lock and written out together before blocking.
+ *
+ * Unlike dbus_connection_send_with_reply_and_block(), error replies
+ * are not converted to a #DBusError, since each call can fail on its
+ * own. replies[i] is the reply to messages[i], which may be an error
+ * reply; a call that got no reply in time or before the connection
+ * was lost has a locally generated one, as with
+ * dbus_pending_call_steal_reply(). Use dbus_set_error_from_message()
+ * to check each.
+ *
+ * The same warning about deadlocks as for
+ * dbus_connection_send_with_reply_and_block() applies.
+ *
+ * @param connection the connection
+ * @param messages the method calls to send, in order
+ * @param n_messages the number of calls
+ * @param timeout_milliseconds timeout for each reply in milliseconds, -1 for default or INT_MAX for no timeout
+ * @param replies return location for n_messages replies, which the caller must unref
+ * @param error return location for error message
+ * @returns #FALSE with the error set if no call could be sent, in which case no replies are returned
+ */
+dbus_bool_t
+dbus_connection_call_many_and_block (DBusConnection  *connection,
+                                     DBusMessage    **messages,
+                                     int              n_messages,
+                                     int              timeout_milliseconds,
+                                     DBusMessage    **replies,
+                                     DBusError       *error)
+{
+  DBusPendingCall **pendings;
+  DBusPreallocatedSend preallocated;
+  DBusDispatchStatus status;
+  DBusList *links;
+  DBusList *link;
+  dbus_uint32_t serial;
+  int i;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (messages != NULL || n_messages == 0, FALSE);
+  _dbus_return_val_if_fail (n_messages >= 0, FALSE);
+  _dbus_return_val_if_fail (timeout_milliseconds >= 0 || timeout_milliseconds == -1, FALSE);
+  _dbus_return_val_if_fail (replies != NULL || n_messages == 0, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  if (n_messages == 0)
+    return TRUE;
+
+  pendings = dbus_new0 (DBusPendingCall*, n_messages);
+  if (pendings == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  links = NULL;
+
+  CONNECTION_LOCK (connection);
+
+#ifdef HAVE_UNIX_FD_PASSING
+
+  if (!_dbus_transport_can_pass_unix_fd(connection->transport))
+    {
+      for (i = 0; i < n_messages; i++)
+        {
+          if (messages[i]->n_unix_fds > 0)
+            {
+              CONNECTION_UNLOCK (connection);
+              dbus_free (pendings);
+              dbus_set_error (error, DBUS_ERROR_FAILED, "Cannot send file descriptors on this connection.");
+              return FALSE;
+            }
+        }
+    }
+
+#endif
+
+  if (!_dbus_connection_get_is_connected_unlocked (connection))
+    {
+      CONNECTION_UNLOCK (connection);
+      dbus_free (pendings);
+      dbus_set_error (error, DBUS_ERROR_DISCONNECTED, "Connection is closed");
+      return FALSE;
+    }
+
+  /* Set up every call before queueing any, so running out of memory
+   * leaves nothing half-sent
+   */
+  for (i = 0; i < n_messages; i++)
+    {
+      pendings[i] = _dbus_pending_call_new_unlocked (connection,
+                                                     timeout_milliseconds);
+      if (pendings[i] == NULL)
+        goto oom;
+
+      serial = dbus_message_get_serial (messages[i]);
+      if (serial == 0)
+        {
+          serial = _dbus_connection_get_next_client_serial (connection);
+          dbus_message_set_serial (messages[i], serial);
+        }
+
+      if (!_dbus_pending_call_set_timeout_error_unlocked (pendings[i],
+                                                          messages[i],
+                                                          serial))
+        goto oom;
+
+      if (!_dbus_connection_attach_pending_call_unlocked (connection,
+                                                          pendings[i]))
+        goto oom;
+
+      if (!_dbus_connection_init_preallocated_send_unlocked (connection,
+                                                             &preallocated))
+        {
+          _dbus_connection_detach_pending_call_unlocked (connection,
+                                                         pendings[i]);
+          goto oom;
+        }
+
+      _dbus_list_append_link (&links, preallocated.queue_link);
+    }
+
+  for (i = 0; i < n_messages; i++)
+    {
+      preallocated.queue_link = _dbus_list_pop_first_link (&links);
+      _dbus_connection_queue_preallocated_unlocked (connection,
+                                                    &preallocated,
+                                                    messages[i], NULL);
+    }
+
+  _dbus_connection_do_iteration_unlocked (connection,
+                                          NULL,
+                                          DBUS_ITERATION_DO_WRITING,
+                                          -1);
+
+  if (connection->n_outgoing > 0)
+    _dbus_connection_wakeup_mainloop (connection);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* this calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+  /* Blocking for the first reply reads whatever else has arrived, so
+   * the later ones are mostly there already
+   */
+  for (i = 0; i < n_messages; i++)
+    {
+      dbus_pending_call_block (pendings[i]);
+
+      replies[i] = dbus_pending_call_steal_reply (pendings[i]);
+      dbus_pending_call_unref (pendings[i]);
+
+      /* call_complete_and_unlock() called from pending_call_block() should
+       * always fill this in.
+       */
+      _dbus_assert (replies[i] != NULL);
+    }
+
+  dbus_free (pendings);
+
+  return TRUE;
+
+ oom:
+  while ((link = _dbus_list_pop_first_link (&links)) != NULL)
+    _dbus_list_prepend_link (&connection->link_cache, link);
+
+  /* our own refs keep the calls alive, so detaching doesn't finalize
+   * them with the lock held
+   */
+  for (i = 0; i < n_messages && pendings[i] != NULL; i++)
+    _dbus_connection_detach_pending_call_unlocked (connection, pendings[i]);
+
+  CONNECTION_UNLOCK (connection);
+
+  for (i = 0; i < n_messages && pendings[i] != NULL; i++)
+    dbus_pending_call_unref (pendings[i]);
+
+  dbus_free (pendings);
+
+  _DBUS_SET_OOM (error);
+  return FALSE;
+}
+
 /**
  * Blocks until the outgoing message queue is empty.
  * Assumes connection lock already held.
@@ -3654,8 +5023,19 @@ _dbus_connection_read_write_dispatch (DBusConnection *connection,
    * as long as the transport is open.
    */
   if (dispatch)
-    progress_possible = connection->n_incoming != 0 ||
-      connection->disconnect_message_link != NULL;
+    {
+      progress_possible = connection->n_incoming != 0 ||
+        connection->disconnect_message_link != NULL;
+
+      /* Once disconnected, whatever is left may all be waiting on
+       * messages other threads are dispatching; those threads will
+       * finish the job, so don't have this one spin on it.
+       */
+      if (progress_possible && connection->dispatching != NULL &&
+          !_dbus_connection_get_is_connected_unlocked (connection) &&
+          !_dbus_connection_has_dispatchable_unlocked (connection))
+        progress_possible = FALSE;
+    }
   else
     progress_possible = _dbus_connection_get_is_connected_unlocked (connection);
 
@@ -3919,7 +5299,7 @@ dbus_connection_steal_borrowed_message (DBusConnection *connection,
  
   _dbus_assert (message == connection->message_borrowed);
 
-  pop_message = _dbus_list_pop_first (&connection->incoming_messages);
+  pop_message = _dbus_list_pop_first_link (&connection->incoming_messages)->data;
   _dbus_assert (message == pop_message);
   
   connection->n_incoming -= 1;
@@ -3987,18 +5367,8 @@ _dbus_connection_pop_message_unlocked (DBusConnection *connection)
   
   link = _dbus_connection_pop_message_link_unlocked (connection);
 
-  if (link != NULL)
-    {
-      DBusMessage *message;
-      
-      message = link->data;
-      
-      _dbus_list_free_link (link);
-      
-      return message;
-    }
-  else
-    return NULL;
+  /* the link belongs to the message */
+  return link != NULL ? link->data : NULL;
 }
 
 static void
@@ -4030,6 +5400,141 @@ _dbus_connection_putback_message_link_unlocked (DBusConnection *connection,
                  connection, connection->n_incoming);
 }
 
+/* Whether two strings are equal, or both absent */
+static dbus_bool_t
+same_string_or_null (const char *a,
+                     const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+
+  return strcmp (a, b) == 0;
+}
+
+/* The longest way into the incoming queue that a concurrent dispatcher
+ * looks for a message it may take; beyond that, it waits its turn
+ */
+#define MAX_CONCURRENT_DISPATCH_SCAN 64
+
+/* Finds the first message that a concurrent dispatcher may take: one
+ * whose sender and object path no message being dispatched has, so
+ * that those are still handled in the order they arrived. Disconnected
+ * waits until nothing else is being dispatched.
+ */
+static DBusList*
+_dbus_connection_find_claimable_link_unlocked (DBusConnection *connection)
+{
+  DBusList *link;
+  int scanned;
+
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->dispatching == NULL)
+    return _dbus_list_get_first_link (&connection->incoming_messages);
+
+  link = _dbus_list_get_first_link (&connection->incoming_messages);
+  for (scanned = 0;
+       link != NULL && scanned < MAX_CONCURRENT_DISPATCH_SCAN;
+       scanned++)
+    {
+      DBusMessage *message = link->data;
+      const char *sender;
+      const char *path;
+      DBusList *busy;
+
+      if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL,
+                                  "Disconnected"))
+        return NULL;
+
+      sender = dbus_message_get_sender (message);
+      path = dbus_message_get_path (message);
+
+      busy = _dbus_list_get_first_link (&connection->dispatching);
+      while (busy != NULL)
+        {
+          if (same_string_or_null (sender, dbus_message_get_sender (busy->data)) &&
+              same_string_or_null (path, dbus_message_get_path (busy->data)))
+            break;
+
+          busy = _dbus_list_get_next_link (&connection->dispatching, busy);
+        }
+
+      if (busy == NULL)
+        return link;
+
+      link = _dbus_list_get_next_link (&connection->incoming_messages, link);
+    }
+
+  return NULL;
+}
+
+/* Like _dbus_connection_pop_message_link_unlocked() for a concurrent
+ * dispatcher: takes the first message it may, and keeps its link on
+ * the dispatching list until _dbus_connection_unclaim_message_link_unlocked().
+ * Acquires the dispatcher only while doing so.
+ */
+static DBusList*
+_dbus_connection_claim_message_link_unlocked (DBusConnection *connection)
+{
+  DBusList *link;
+
+  HAVE_LOCK_CHECK (connection);
+
+  _dbus_connection_acquire_dispatch (connection);
+
+  link = _dbus_connection_find_claimable_link_unlocked (connection);
+  if (link != NULL)
+    {
+      _dbus_list_unlink (&connection->incoming_messages, link);
+      connection->n_incoming -= 1;
+
+      check_disconnected_message_arrived_unlocked (connection, link->data);
+
+      _dbus_list_append_link (&connection->dispatching, link);
+    }
+
+  _dbus_connection_release_dispatch (connection);
+
+  return link;
+}
+
+/* Ends the dispatch of a message taken with
+ * _dbus_connection_claim_message_link_unlocked(), putting it back at
+ * the head of the queue if it needs memory to be handled
+ */
+static void
+_dbus_connection_unclaim_message_link_unlocked (DBusConnection    *connection,
+                                                DBusList          *message_link,
+                                                DBusHandlerResult  result)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+    {
+      _dbus_connection_acquire_dispatch (connection);
+      _dbus_list_unlink (&connection->dispatching, message_link);
+      _dbus_connection_putback_message_link_unlocked (connection,
+                                                      message_link);
+      _dbus_connection_release_dispatch (connection);
+    }
+  else
+    {
+      _dbus_list_unlink (&connection->dispatching, message_link);
+      dbus_message_unref (message_link->data);
+    }
+}
+
+/* Whether the queue has something a dispatcher may take now */
+static dbus_bool_t
+_dbus_connection_has_dispatchable_unlocked (DBusConnection *connection)
+{
+  if (connection->n_incoming == 0)
+    return FALSE;
+
+  return connection->dispatching == NULL ||
+    _dbus_connection_find_claimable_link_unlocked (connection) != NULL;
+}
+
 /**
  * Returns the first-received message from the incoming message queue,
  * removing it from the queue. The caller owns a reference to the
@@ -4140,15 +5645,6 @@ _dbus_connection_release_dispatch (DBusConnection *connection)
   _dbus_mutex_unlock (connection->dispatch_mutex);
 }
 
-static void
-_dbus_connection_failed_pop (DBusConnection *connection,
-			     DBusList       *message_link)
-{
-  _dbus_list_prepend_link (&connection->incoming_messages,
-			   message_link);
-  connection->n_incoming += 1;
-}
-
 /* Note this may be called multiple times since we don't track whether we already did it */
 static void
 notify_disconnected_unlocked (DBusConnection *connection)
@@ -4163,6 +5659,9 @@ notify_disconnected_unlocked (DBusConnection *connection)
    */
   _dbus_bus_notify_shared_connection_disconnected_unlocked (connection);
 
+  /* Nobody needs waking up for a connection that can't send */
+  connection_remove_wakeup_watch_unlocked (connection);
+
   /* Dump the outgoing queue, we aren't going to be able to
    * send it now, and we'd like accessors like
    * dbus_connection_get_outgoing_size() to be accurate.
@@ -4214,7 +5713,7 @@ _dbus_connection_get_dispatch_status_unlocked (DBusConnection *connection)
 {
   HAVE_LOCK_CHECK (connection);
   
-  if (connection->n_incoming > 0)
+  if (_dbus_connection_has_dispatchable_unlocked (connection))
     return DBUS_DISPATCH_DATA_REMAINS;
   else if (!_dbus_transport_queue_messages (connection->transport))
     return DBUS_DISPATCH_NEED_MEMORY;
@@ -4250,7 +5749,7 @@ _dbus_connection_get_dispatch_status_unlocked (DBusConnection *connection)
       
       if (status != DBUS_DISPATCH_COMPLETE)
         return status;
-      else if (connection->n_incoming > 0)
+      else if (_dbus_connection_has_dispatchable_unlocked (connection))
         return DBUS_DISPATCH_DATA_REMAINS;
       else
         return DBUS_DISPATCH_COMPLETE;
@@ -4467,95 +5966,92 @@ _dbus_connection_run_builtin_filters_unlocked_no_update (DBusConnection *connect
 }
 
 /**
- * Processes any incoming data.
- *
- * If there's incoming raw data that has not yet been parsed, it is
- * parsed, which may or may not result in adding messages to the
- * incoming queue.
- *
- * The incoming data buffer is filled when the connection reads from
- * its underlying transport (such as a socket).  Reading usually
- * happens in dbus_watch_handle() or dbus_connection_read_write().
- * 
- * If there are complete messages in the incoming queue,
- * dbus_connection_dispatch() removes one message from the queue and
- * processes it. Processing has three steps.
- *
- * First, any method replies are passed to #DBusPendingCall or
- * dbus_connection_send_with_reply_and_block() in order to
- * complete the pending method call.
- * 
- * Second, any filters registered with dbus_connection_add_filter()
- * are run. If any filter returns #DBUS_HANDLER_RESULT_HANDLED
- * then processing stops after that filter.
- *
- * Third, if the message is a method call it is forwarded to
- * any registered object path handlers added with
- * dbus_connection_register_object_path() or
- * dbus_connection_register_fallback().
+ * Makes the list of filters to run on a message: the unkeyed
+ * filters, plus the filters keyed on the message's interface that
+ * match its type and member, in the order they were added.
  *
- * A single call to dbus_connection_dispatch() will process at most
- * one message; it will not clear the entire message queue.
- *
- * Be careful about calling dbus_connection_dispatch() from inside a
- * message handler, i.e. calling dbus_connection_dispatch()
- * recursively.  If threads have been initialized with a recursive
- * mutex function, then this will not deadlock; however, it can
- * certainly confuse your application.
- * 
- * @todo some FIXME in here about handling DBUS_HANDLER_RESULT_NEED_MEMORY
- * 
  * @param connection the connection
- * @returns dispatch status, see dbus_connection_get_dispatch_status()
+ * @param message the message being dispatched
+ * @param filters return location for the list
+ * @returns #FALSE if no memory
  */
-DBusDispatchStatus
-dbus_connection_dispatch (DBusConnection *connection)
+static dbus_bool_t
+_dbus_connection_copy_filters_unlocked (DBusConnection  *connection,
+                                        DBusMessage     *message,
+                                        DBusList       **filters)
+{
+  DBusFilterBucket *bucket;
+  const char *interface;
+  DBusList *unkeyed;
+  DBusList *keyed;
+
+  bucket = NULL;
+  interface = NULL;
+  if (connection->filter_index != NULL)
+    interface = dbus_message_get_interface (message);
+  if (interface != NULL)
+    bucket = _dbus_hash_table_lookup_string (connection->filter_index,
+                                             interface);
+
+  if (bucket == NULL)
+    return _dbus_list_copy (&connection->filter_list, filters);
+
+  *filters = NULL;
+
+  unkeyed = _dbus_list_get_first_link (&connection->filter_list);
+  keyed = _dbus_list_get_first_link (&bucket->filters);
+  while (unkeyed != NULL || keyed != NULL)
+    {
+      DBusMessageFilter *filter;
+
+      if (keyed == NULL ||
+          (unkeyed != NULL &&
+           ((DBusMessageFilter *) unkeyed->data)->order <
+           ((DBusMessageFilter *) keyed->data)->order))
+        {
+          filter = unkeyed->data;
+          unkeyed = _dbus_list_get_next_link (&connection->filter_list, unkeyed);
+        }
+      else
+        {
+          filter = keyed->data;
+          keyed = _dbus_list_get_next_link (&bucket->filters, keyed);
+
+          if (!_dbus_message_filter_matches (filter, message))
+            continue;
+        }
+
+      if (!_dbus_list_append (filters, filter))
+        {
+          _dbus_list_clear (filters);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Dispatches one message taken off the incoming queue, with the lock
+ * held, and returns with it held still. The dispatcher is acquired,
+ * or the message's sender and path claimed for concurrent dispatch.
+ * The caller puts the message back on the queue if the result is
+ * #DBUS_HANDLER_RESULT_NEED_MEMORY, and drops it otherwise;
+ * *no_memory_p is set if it did not even get as far as the filters.
+ */
+static DBusHandlerResult
+_dbus_connection_dispatch_message_unlocked (DBusConnection *connection,
+                                            DBusList       *message_link,
+                                            dbus_bool_t    *no_memory_p)
 {
   DBusMessage *message;
-  DBusList *link, *filter_list_copy, *message_link;
+  DBusList *link, *filter_list_copy;
   DBusHandlerResult result;
   DBusPendingCall *pending;
   dbus_int32_t reply_serial;
-  DBusDispatchStatus status;
-
-  _dbus_return_val_if_fail (connection != NULL, DBUS_DISPATCH_COMPLETE);
-
-  _dbus_verbose ("\n");
-  
-  CONNECTION_LOCK (connection);
-  status = _dbus_connection_get_dispatch_status_unlocked (connection);
-  if (status != DBUS_DISPATCH_DATA_REMAINS)
-    {
-      /* unlocks and calls out to user code */
-      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-      return status;
-    }
-  
-  /* We need to ref the connection since the callback could potentially
-   * drop the last ref to it
-   */
-  _dbus_connection_ref_unlocked (connection);
 
-  _dbus_connection_acquire_dispatch (connection);
   HAVE_LOCK_CHECK (connection);
 
-  message_link = _dbus_connection_pop_message_link_unlocked (connection);
-  if (message_link == NULL)
-    {
-      /* another thread dispatched our stuff */
-
-      _dbus_verbose ("another thread dispatched message (during acquire_dispatch above)\n");
-      
-      _dbus_connection_release_dispatch (connection);
-
-      status = _dbus_connection_get_dispatch_status_unlocked (connection);
-
-      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-      
-      dbus_connection_unref (connection);
-      
-      return status;
-    }
+  *no_memory_p = FALSE;
 
   message = message_link->data;
 
@@ -4598,22 +6094,11 @@ dbus_connection_dispatch (DBusConnection *connection)
   if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
     goto out;
  
-  if (!_dbus_list_copy (&connection->filter_list, &filter_list_copy))
+  if (!_dbus_connection_copy_filters_unlocked (connection, message,
+                                               &filter_list_copy))
     {
-      _dbus_connection_release_dispatch (connection);
-      HAVE_LOCK_CHECK (connection);
-      
-      _dbus_connection_failed_pop (connection, message_link);
-
-      /* unlocks and calls user code */
-      _dbus_connection_update_dispatch_status_and_unlock (connection,
-                                                          DBUS_DISPATCH_NEED_MEMORY);
-
-      if (pending)
-        dbus_pending_call_unref (pending);
-      dbus_connection_unref (connection);
-      
-      return DBUS_DISPATCH_NEED_MEMORY;
+      *no_memory_p = TRUE;
+      return DBUS_HANDLER_RESULT_NEED_MEMORY;
     }
   
   _dbus_list_foreach (&filter_list_copy,
@@ -4695,7 +6180,7 @@ dbus_connection_dispatch (DBusConnection *connection)
     {
       DBusMessage *reply;
       DBusString str;
-      DBusPreallocatedSend *preallocated;
+      DBusPreallocatedSend preallocated;
 
       _dbus_verbose ("  sending error %s\n",
                      DBUS_ERROR_UNKNOWN_METHOD);
@@ -4731,9 +6216,8 @@ dbus_connection_dispatch (DBusConnection *connection)
           goto out;
         }
       
-      preallocated = _dbus_connection_preallocate_send_unlocked (connection);
-
-      if (preallocated == NULL)
+      if (!_dbus_connection_init_preallocated_send_unlocked (connection,
+                                                             &preallocated))
         {
           dbus_message_unref (reply);
           result = DBUS_HANDLER_RESULT_NEED_MEMORY;
@@ -4741,7 +6225,7 @@ dbus_connection_dispatch (DBusConnection *connection)
           goto out;
         }
 
-      _dbus_connection_send_preallocated_unlocked_no_update (connection, preallocated,
+      _dbus_connection_send_preallocated_unlocked_no_update (connection, &preallocated,
                                                              reply, NULL);
 
       dbus_message_unref (reply);
@@ -4761,10 +6245,22 @@ dbus_connection_dispatch (DBusConnection *connection)
                  connection);
   
  out:
+  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+    _dbus_verbose ("out of memory\n");
+  else
+    _dbus_verbose (" ... done dispatching\n");
+
+  return result;
+}
+
+/* Ends the dispatch of a message popped with the dispatcher acquired */
+static void
+_dbus_connection_finish_message_link_unlocked (DBusConnection    *connection,
+                                               DBusList          *message_link,
+                                               DBusHandlerResult  result)
+{
   if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
     {
-      _dbus_verbose ("out of memory\n");
-      
       /* Put message back, and we'll start over.
        * Yes this means handlers must be idempotent if they
        * don't return HANDLED; c'est la vie.
@@ -4774,19 +6270,130 @@ dbus_connection_dispatch (DBusConnection *connection)
     }
   else
     {
-      _dbus_verbose (" ... done dispatching\n");
-      
-      _dbus_list_free_link (message_link);
-      dbus_message_unref (message); /* don't want the message to count in max message limits
-                                     * in computing dispatch status below
-                                     */
+      /* don't want the message to count in max message limits
+       * in computing dispatch status below
+       */
+      dbus_message_unref (message_link->data);
+    }
+}
+
+/**
+ * Processes any incoming data.
+ *
+ * If there's incoming raw data that has not yet been parsed, it is
+ * parsed, which may or may not result in adding messages to the
+ * incoming queue.
+ *
+ * The incoming data buffer is filled when the connection reads from
+ * its underlying transport (such as a socket).  Reading usually
+ * happens in dbus_watch_handle() or dbus_connection_read_write().
+ * 
+ * If there are complete messages in the incoming queue,
+ * dbus_connection_dispatch() removes one message from the queue and
+ * processes it. Processing has three steps.
+ *
+ * First, any method replies are passed to #DBusPendingCall or
+ * dbus_connection_send_with_reply_and_block() in order to
+ * complete the pending method call.
+ * 
+ * Second, any filters registered with dbus_connection_add_filter()
+ * are run. If any filter returns #DBUS_HANDLER_RESULT_HANDLED
+ * then processing stops after that filter.
+ *
+ * Third, if the message is a method call it is forwarded to
+ * any registered object path handlers added with
+ * dbus_connection_register_object_path() or
+ * dbus_connection_register_fallback().
+ *
+ * A single call to dbus_connection_dispatch() will process at most
+ * one message; it will not clear the entire message queue.
+ *
+ * Be careful about calling dbus_connection_dispatch() from inside a
+ * message handler, i.e. calling dbus_connection_dispatch()
+ * recursively.  If threads have been initialized with a recursive
+ * mutex function, then this will not deadlock; however, it can
+ * certainly confuse your application.
+ * 
+ * @todo some FIXME in here about handling DBUS_HANDLER_RESULT_NEED_MEMORY
+ * 
+ * @param connection the connection
+ * @returns dispatch status, see dbus_connection_get_dispatch_status()
+ */
+DBusDispatchStatus
+dbus_connection_dispatch (DBusConnection *connection)
+{
+  DBusList *message_link;
+  DBusDispatchStatus status;
+  DBusHandlerResult result;
+  dbus_bool_t no_memory;
+  dbus_bool_t concurrent;
+
+  _dbus_return_val_if_fail (connection != NULL, DBUS_DISPATCH_COMPLETE);
+
+  _dbus_verbose ("\n");
+  
+  CONNECTION_LOCK (connection);
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  if (status != DBUS_DISPATCH_DATA_REMAINS)
+    {
+      /* unlocks and calls out to user code */
+      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+      return status;
     }
   
-  _dbus_connection_release_dispatch (connection);
+  /* We need to ref the connection since the callback could potentially
+   * drop the last ref to it
+   */
+  _dbus_connection_ref_unlocked (connection);
+
+  concurrent = connection->concurrent_dispatch;
+  if (concurrent)
+    message_link = _dbus_connection_claim_message_link_unlocked (connection);
+  else
+    {
+      _dbus_connection_acquire_dispatch (connection);
+      message_link = _dbus_connection_pop_message_link_unlocked (connection);
+    }
+  HAVE_LOCK_CHECK (connection);
+
+  if (message_link == NULL)
+    {
+      /* another thread dispatched our stuff */
+
+      _dbus_verbose ("another thread dispatched message (during acquire_dispatch above)\n");
+      
+      if (!concurrent)
+        _dbus_connection_release_dispatch (connection);
+
+      status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+      
+      dbus_connection_unref (connection);
+      
+      return status;
+    }
+
+  result = _dbus_connection_dispatch_message_unlocked (connection,
+                                                       message_link,
+                                                       &no_memory);
+
+  if (concurrent)
+    _dbus_connection_unclaim_message_link_unlocked (connection, message_link,
+                                                    result);
+  else
+    {
+      _dbus_connection_finish_message_link_unlocked (connection, message_link,
+                                                     result);
+      _dbus_connection_release_dispatch (connection);
+    }
   HAVE_LOCK_CHECK (connection);
 
   _dbus_verbose ("before final status update\n");
-  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  if (no_memory)
+    status = DBUS_DISPATCH_NEED_MEMORY;
+  else
+    status = _dbus_connection_get_dispatch_status_unlocked (connection);
 
   /* unlocks and calls user code */
   _dbus_connection_update_dispatch_status_and_unlock (connection, status);
@@ -4796,6 +6403,101 @@ dbus_connection_dispatch (DBusConnection *connection)
   return status;
 }
 
+/**
+ * Like dbus_connection_dispatch(), but dispatches up to max_messages
+ * messages in one go. The dispatcher is acquired, and the dispatch
+ * status worked out and reported, once for the lot rather than once
+ * per message. Stops early when the queue runs dry or a message needs
+ * memory.
+ *
+ * @param connection the connection
+ * @param max_messages most messages to dispatch, at least 1
+ * @param n_dispatched_p if not #NULL, returns how many were dispatched
+ * @returns dispatch status, see dbus_connection_get_dispatch_status()
+ */
+DBusDispatchStatus
+_dbus_connection_dispatch_batch (DBusConnection *connection,
+                                 int             max_messages,
+                                 int            *n_dispatched_p)
+{
+  DBusDispatchStatus status;
+  dbus_bool_t no_memory;
+  int n_dispatched;
+  dbus_bool_t concurrent;
+
+  _dbus_assert (connection != NULL);
+  _dbus_assert (max_messages > 0);
+
+  n_dispatched = 0;
+  no_memory = FALSE;
+
+  CONNECTION_LOCK (connection);
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  if (status != DBUS_DISPATCH_DATA_REMAINS)
+    {
+      if (n_dispatched_p != NULL)
+        *n_dispatched_p = 0;
+
+      /* unlocks and calls out to user code */
+      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+      return status;
+    }
+
+  _dbus_connection_ref_unlocked (connection);
+
+  /* Concurrent dispatchers claim one message at a time instead */
+  concurrent = connection->concurrent_dispatch;
+  if (!concurrent)
+    _dbus_connection_acquire_dispatch (connection);
+  HAVE_LOCK_CHECK (connection);
+
+  while (n_dispatched < max_messages)
+    {
+      DBusList *message_link;
+      DBusHandlerResult result;
+
+      if (concurrent)
+        message_link = _dbus_connection_claim_message_link_unlocked (connection);
+      else
+        message_link = _dbus_connection_pop_message_link_unlocked (connection);
+      if (message_link == NULL)
+        break;
+
+      result = _dbus_connection_dispatch_message_unlocked (connection,
+                                                           message_link,
+                                                           &no_memory);
+      if (concurrent)
+        _dbus_connection_unclaim_message_link_unlocked (connection,
+                                                        message_link, result);
+      else
+        _dbus_connection_finish_message_link_unlocked (connection,
+                                                       message_link, result);
+      if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+        break;
+
+      n_dispatched += 1;
+    }
+
+  if (!concurrent)
+    _dbus_connection_release_dispatch (connection);
+  HAVE_LOCK_CHECK (connection);
+
+  if (no_memory)
+    status = DBUS_DISPATCH_NEED_MEMORY;
+  else
+    status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  if (n_dispatched_p != NULL)
+    *n_dispatched_p = n_dispatched;
+
+  /* unlocks and calls user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+  dbus_connection_unref (connection);
+
+  return status;
+}
+
 /**
  * Sets the watch functions for the connection. These functions are
  * responsible for making the application's main loop aware of file
@@ -4871,6 +6573,16 @@ dbus_connection_set_watch_functions (DBusConnection              *connection,
   
   CONNECTION_LOCK (connection);
 
+  /* Added before the functions are set, so they see it along with
+   * the transport's watches. Only threaded programs can have another
+   * thread to wake the main loop.
+   */
+  if (add_function != NULL &&
+      connection->wakeup_watch == NULL &&
+      _dbus_threads_get_initialized () &&
+      _dbus_connection_get_is_connected_unlocked (connection))
+    connection_add_wakeup_watch_unlocked (connection);
+
   retval = _dbus_watch_list_set_functions (connection->watches,
                                            add_function, remove_function,
                                            toggled_function,
@@ -4881,6 +6593,68 @@ dbus_connection_set_watch_functions (DBusConnection              *connection,
   return retval;
 }
 
+/**
+ * Makes the connection's transport watches edge-triggered. By default
+ * libdbus disables the read watch while too many received messages
+ * are outstanding and enables the write watch only while there is
+ * something to send, so under bursty traffic the
+ * DBusWatchToggledFunction runs for nearly every message.
+ *
+ * With edge-triggered watches, the transport's watches are enabled
+ * as soon as the connection wants them and then stay enabled until
+ * they are removed, so a main loop can register each file
+ * descriptor once, for example with EPOLLET. libdbus keeps track of
+ * what it wants to read and write itself, and each call to
+ * dbus_watch_handle() reads or writes until the socket would block,
+ * rather than stopping after a fair share as usual.
+ *
+ * The DBusWatchToggledFunction is then only called when libdbus wants
+ * I/O again after a pause, at a point where the socket may already be
+ * ready and no new edge would arrive; for example, when enough
+ * received messages have been freed to read again. The watch is still
+ * enabled then, and the main loop should re-arm it (with epoll,
+ * EPOLL_CTL_MOD with the same events), so that it reports the current
+ * state of the file descriptor.
+ *
+ * Watches owned by something other than the transport, such as the
+ * one used to wake the main loop from other threads, keep their usual
+ * semantics.
+ *
+ * @param connection the connection
+ * @param enabled #TRUE for edge-triggered watches
+ */
+void
+dbus_connection_set_edge_triggered_watches (DBusConnection *connection,
+                                            dbus_bool_t     enabled)
+{
+  _dbus_return_if_fail (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_edge_triggered_watches (connection->transport,
+                                              enabled);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Gets the value set by dbus_connection_set_edge_triggered_watches().
+ *
+ * @param connection the connection
+ * @returns #TRUE if the transport's watches are edge-triggered
+ */
+dbus_bool_t
+dbus_connection_get_edge_triggered_watches (DBusConnection *connection)
+{
+  dbus_bool_t res;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+
+  CONNECTION_LOCK (connection);
+  res = _dbus_transport_get_edge_triggered_watches (connection->transport);
+  CONNECTION_UNLOCK (connection);
+
+  return res;
+}
+
 /**
  * Sets the timeout functions for the connection. These functions are
  * responsible for making the application's main loop aware of timeouts.
@@ -5421,8 +7195,166 @@ dbus_connection_set_route_peer_messages (DBusConnection             *connection,
 }
 
 /**
- * Adds a message filter. Filters are handlers that are run on all
- * incoming messages, prior to the objects registered with
+ * Normally every message received on a #DBusConnection has its header
+ * and body fully validated before it is dispatched, so that a broken
+ * or malicious peer cannot make the application read out of bounds.
+ * Validating large string-heavy bodies is relatively expensive, so on
+ * a private connection to a peer that is known to run libdbus (for
+ * example another process of the same application), body validation
+ * can be turned off. Headers are still validated, since they are
+ * needed to split the stream into messages.
+ *
+ * A peer that then sends an invalid body can crash the application
+ * when it reads the message, so never set this on a connection to a
+ * message bus or to a peer that has not been authenticated as
+ * trusted.
+ *
+ * @param connection the connection
+ * @param value #TRUE to skip validation of message bodies received from the peer
+ */
+void
+dbus_connection_set_trust_peer_messages (DBusConnection             *connection,
+                                         dbus_bool_t                 value)
+{
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_trust_peer_messages (connection->transport, value);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Normally only one thread at a time dispatches a #DBusConnection's
+ * messages; a thread calling dbus_connection_dispatch() while another
+ * is inside a handler waits for it. On a connection whose handlers
+ * block, for example on disk or on calls of their own, this lets
+ * several threads each calling dbus_connection_dispatch() or
+ * dbus_connection_read_write_dispatch() handle messages at once: each
+ * takes the oldest message that no other thread is handling one with
+ * the same sender and object path as, so messages to one object from
+ * one peer are still handled in the order they arrived. The
+ * Disconnected signal is handled last, once every other message has
+ * been.
+ *
+ * Handlers then run concurrently with each other, so they must be
+ * thread-safe themselves, and dbus_threads_init_default() must have
+ * been called. Set this before any thread starts dispatching.
+ * dbus_connection_pop_message() and dbus_connection_borrow_message()
+ * don't take part in this ordering.
+ *
+ * @param connection the connection
+ * @param value #TRUE to let threads dispatch concurrently
+ */
+void
+dbus_connection_set_concurrent_dispatch (DBusConnection             *connection,
+                                         dbus_bool_t                 value)
+{
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  connection->concurrent_dispatch = value != FALSE;
+  CONNECTION_UNLOCK (connection);
+}
+
+static dbus_bool_t
+_dbus_connection_add_filter_internal (DBusConnection            *connection,
+                                      int                        message_type,
+                                      const char                *interface,
+                                      const char                *member,
+                                      DBusHandleMessageFunction  function,
+                                      void                      *user_data,
+                                      DBusFreeFunction           free_data_function)
+{
+  DBusMessageFilter *filter;
+  DBusList **list;
+
+  filter = dbus_new0 (DBusMessageFilter, 1);
+  if (filter == NULL)
+    return FALSE;
+
+  filter->refcount.value = 1;
+  filter->message_type = message_type;
+
+  if (interface != NULL)
+    {
+      filter->interface = _dbus_strdup (interface);
+      if (filter->interface == NULL)
+        goto nomem;
+    }
+
+  if (member != NULL)
+    {
+      filter->member = _dbus_strdup (member);
+      if (filter->member == NULL)
+        goto nomem;
+    }
+  
+  CONNECTION_LOCK (connection);
+
+  if (interface == NULL)
+    {
+      list = &connection->filter_list;
+    }
+  else
+    {
+      DBusFilterBucket *bucket;
+
+      if (connection->filter_index == NULL)
+        {
+          connection->filter_index =
+            _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                  _dbus_filter_bucket_free);
+          if (connection->filter_index == NULL)
+            goto nomem_locked;
+        }
+
+      bucket = _dbus_hash_table_lookup_string (connection->filter_index,
+                                               interface);
+      if (bucket == NULL)
+        {
+          bucket = dbus_new0 (DBusFilterBucket, 1);
+          if (bucket == NULL)
+            goto nomem_locked;
+
+          bucket->interface = _dbus_strdup (interface);
+          if (bucket->interface == NULL ||
+              !_dbus_hash_table_insert_string (connection->filter_index,
+                                               bucket->interface, bucket))
+            {
+              _dbus_filter_bucket_free (bucket);
+              goto nomem_locked;
+            }
+        }
+
+      list = &bucket->filters;
+    }
+
+  if (!_dbus_list_append (list, filter))
+    goto nomem_locked;
+
+  /* Fill in filter after all memory allocated,
+   * so we don't run the free_user_data_function
+   * if the add_filter() fails
+   */
+  
+  filter->order = connection->next_filter_order++;
+  filter->function = function;
+  filter->user_data = user_data;
+  filter->free_user_data_function = free_data_function;
+        
+  CONNECTION_UNLOCK (connection);
+  return TRUE;
+
+ nomem_locked:
+  CONNECTION_UNLOCK (connection);
+ nomem:
+  _dbus_message_filter_unref (filter);
+  return FALSE;
+}
+
+/**
+ * Adds a message filter. Filters are handlers that are run on all
+ * incoming messages, prior to the objects registered with
  * dbus_connection_register_object_path().  Filters are run in the
  * order that they were added.  The same handler can be added as a
  * filter more than once, in which case it will be run more than once.
@@ -5447,38 +7379,76 @@ dbus_connection_add_filter (DBusConnection            *connection,
                             void                      *user_data,
                             DBusFreeFunction           free_data_function)
 {
-  DBusMessageFilter *filter;
-  
   _dbus_return_val_if_fail (connection != NULL, FALSE);
   _dbus_return_val_if_fail (function != NULL, FALSE);
 
-  filter = dbus_new0 (DBusMessageFilter, 1);
-  if (filter == NULL)
-    return FALSE;
+  return _dbus_connection_add_filter_internal (connection,
+                                               DBUS_MESSAGE_TYPE_INVALID,
+                                               NULL, NULL,
+                                               function, user_data,
+                                               free_data_function);
+}
 
-  filter->refcount.value = 1;
-  
-  CONNECTION_LOCK (connection);
+/**
+ * Adds a message filter that only sees messages with the given
+ * interface, and optionally of the given type and with the given
+ * member; otherwise it behaves like one added with
+ * dbus_connection_add_filter(), and is removed the same way, with
+ * dbus_connection_remove_filter(). It still runs in the order it was
+ * added relative to the connection's other filters.
+ *
+ * Filters added this way are looked up by the message's interface,
+ * so a connection can have many of them without every message
+ * being passed through each one.
+ *
+ * @param connection the connection
+ * @param message_type the message type to filter, or #DBUS_MESSAGE_TYPE_INVALID for any
+ * @param interface the interface to filter
+ * @param member the member to filter, or #NULL for any
+ * @param function function to handle messages
+ * @param user_data user data to pass to the function
+ * @param free_data_function function to use for freeing user data
+ * @returns #TRUE on success, #FALSE if not enough memory.
+ */
+dbus_bool_t
+dbus_connection_add_filter_for (DBusConnection            *connection,
+                                int                        message_type,
+                                const char                *interface,
+                                const char                *member,
+                                DBusHandleMessageFunction  function,
+                                void                      *user_data,
+                                DBusFreeFunction           free_data_function)
+{
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (interface != NULL, FALSE);
+  _dbus_return_val_if_fail (function != NULL, FALSE);
+
+  return _dbus_connection_add_filter_internal (connection, message_type,
+                                               interface, member,
+                                               function, user_data,
+                                               free_data_function);
+}
+
+static DBusList *
+find_last_filter (DBusList                  **list,
+                  DBusHandleMessageFunction   function,
+                  void                       *user_data)
+{
+  DBusList *link;
 
-  if (!_dbus_list_append (&connection->filter_list,
-                          filter))
+  link = _dbus_list_get_last_link (list);
+  while (link != NULL)
     {
-      _dbus_message_filter_unref (filter);
-      CONNECTION_UNLOCK (connection);
-      return FALSE;
+      DBusMessageFilter *filter = link->data;
+
+      if (filter->function == function &&
+          filter->user_data == user_data)
+        return link;
+
+      link = _dbus_list_get_prev_link (list, link);
     }
 
-  /* Fill in filter after all memory allocated,
-   * so we don't run the free_user_data_function
-   * if the add_filter() fails
-   */
-  
-  filter->function = function;
-  filter->user_data = user_data;
-  filter->free_user_data_function = free_data_function;
-        
-  CONNECTION_UNLOCK (connection);
-  return TRUE;
+  return NULL;
 }
 
 /**
@@ -5499,6 +7469,8 @@ dbus_connection_remove_filter (DBusConnection            *connection,
                                void                      *user_data)
 {
   DBusList *link;
+  DBusList **list;
+  DBusFilterBucket *bucket;
   DBusMessageFilter *filter;
   
   _dbus_return_if_fail (connection != NULL);
@@ -5506,24 +7478,45 @@ dbus_connection_remove_filter (DBusConnection            *connection,
   
   CONNECTION_LOCK (connection);
 
+  bucket = NULL;
   filter = NULL;
+  list = &connection->filter_list;
   
-  link = _dbus_list_get_last_link (&connection->filter_list);
-  while (link != NULL)
+  link = find_last_filter (list, function, user_data);
+  if (link != NULL)
+    filter = link->data;
+
+  if (connection->filter_index != NULL)
     {
-      filter = link->data;
+      DBusHashIter iter;
 
-      if (filter->function == function &&
-          filter->user_data == user_data)
+      _dbus_hash_iter_init (connection->filter_index, &iter);
+      while (_dbus_hash_iter_next (&iter))
         {
-          _dbus_list_remove_link (&connection->filter_list, link);
-          filter->function = NULL;
-          
-          break;
+          DBusFilterBucket *b = _dbus_hash_iter_get_value (&iter);
+          DBusList *l;
+
+          l = find_last_filter (&b->filters, function, user_data);
+          if (l != NULL &&
+              (filter == NULL ||
+               ((DBusMessageFilter *) l->data)->order > filter->order))
+            {
+              link = l;
+              filter = l->data;
+              list = &b->filters;
+              bucket = b;
+            }
         }
-        
-      link = _dbus_list_get_prev_link (&connection->filter_list, link);
-      filter = NULL;
+    }
+
+  if (filter != NULL)
+    {
+      _dbus_list_remove_link (list, link);
+      filter->function = NULL;
+
+      if (bucket != NULL && bucket->filters == NULL)
+        _dbus_hash_table_remove_string (connection->filter_index,
+                                        bucket->interface);
     }
   
   CONNECTION_UNLOCK (connection);
@@ -5745,6 +7738,84 @@ dbus_connection_register_fallback (DBusConnection              *connection,
   return retval;
 }
 
+/**
+ * Registers a table of methods for a given path in the object
+ * hierarchy, instead of a #DBusObjectPathVTable whose message function
+ * has to work out which method each call is for. A method call to
+ * exactly the given path goes straight to the function of the table
+ * entry with its interface and member, once its arguments have been
+ * checked against the entry's signature. A call with the wrong
+ * arguments, or for a method that isn't in the table on an interface
+ * that is, gets an error reply without the application seeing it.
+ * Calls on interfaces the table doesn't have, and other messages, go
+ * on to the usual handlers, such as the default Introspect().
+ *
+ * The table ends with an entry whose interface is #NULL. Neither it
+ * nor the strings in it are copied, so they must stay valid until the
+ * path is unregistered; usually the table is a static array.
+ *
+ * @param connection the connection
+ * @param path a '/' delimited string of path elements
+ * @param methods the table of methods
+ * @param unregister_function function called when the path is unregistered, or #NULL
+ * @param user_data data to pass to the method functions and unregister_function
+ * @param error address where an error can be returned
+ * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY,
+ *    #DBUS_ERROR_OBJECT_PATH_IN_USE or, for a method in the table
+ *    twice, #DBUS_ERROR_INVALID_ARGS) is reported
+ */
+dbus_bool_t
+dbus_connection_register_object_interfaces (DBusConnection                   *connection,
+                                            const char                       *path,
+                                            const DBusObjectMethod           *methods,
+                                            DBusObjectPathUnregisterFunction  unregister_function,
+                                            void                             *user_data,
+                                            DBusError                        *error)
+{
+  char **decomposed_path;
+  dbus_bool_t retval;
+#ifndef DBUS_DISABLE_CHECKS
+  const DBusObjectMethod *method;
+#endif
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (path != NULL, FALSE);
+  _dbus_return_val_if_fail (path[0] == '/', FALSE);
+  _dbus_return_val_if_fail (methods != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+#ifndef DBUS_DISABLE_CHECKS
+  for (method = methods; method->interface != NULL; method++)
+    {
+      _dbus_return_val_if_fail (_dbus_check_is_valid_interface (method->interface), FALSE);
+      _dbus_return_val_if_fail (method->member != NULL, FALSE);
+      _dbus_return_val_if_fail (_dbus_check_is_valid_member (method->member), FALSE);
+      _dbus_return_val_if_fail (method->signature == NULL ||
+                                _dbus_check_is_valid_signature (method->signature), FALSE);
+      _dbus_return_val_if_fail (method->function != NULL, FALSE);
+    }
+#endif
+
+  if (!_dbus_decompose_path (path, strlen (path), &decomposed_path, NULL))
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  CONNECTION_LOCK (connection);
+
+  retval = _dbus_object_tree_register_methods (connection->objects,
+                                               (const char **) decomposed_path,
+                                               methods, unregister_function,
+                                               user_data, error);
+
+  CONNECTION_UNLOCK (connection);
+
+  dbus_free_string_array (decomposed_path);
+
+  return retval;
+}
+
 /**
  * Unregisters the handler registered with exactly the given path.
  * It's a bug to call this function for a path that isn't registered.
@@ -5813,6 +7884,42 @@ dbus_connection_get_object_path_data (DBusConnection *connection,
   return TRUE;
 }
 
+/**
+ * Sets XML describing the interfaces of the object registered at
+ * path. If the object's handler doesn't handle Introspect() itself,
+ * the default reply includes this XML as-is inside its &lt;node&gt;
+ * element, ahead of the child nodes. The XML is copied, and the
+ * reply built from it is kept until the object or its children
+ * change, so it only needs setting once.
+ *
+ * The XML is dropped when the object path is unregistered.
+ *
+ * @param connection the connection
+ * @param path the path the object was registered with
+ * @param interfaces_xml &lt;interface&gt; elements, or #NULL to remove them
+ * @returns #FALSE if not enough memory or nothing is registered at path
+ */
+dbus_bool_t
+dbus_connection_set_object_path_introspection (DBusConnection *connection,
+                                               const char     *path,
+                                               const char     *interfaces_xml)
+{
+  dbus_bool_t retval;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (path != NULL, FALSE);
+  _dbus_return_val_if_fail (path[0] == '/', FALSE);
+
+  CONNECTION_LOCK (connection);
+
+  retval = _dbus_object_tree_set_introspection_unlocked (connection->objects,
+                                                         path, interfaces_xml);
+
+  CONNECTION_UNLOCK (connection);
+
+  return retval;
+}
+
 /**
  * Lists the registered fallback handlers and object path handlers at
  * the given parent_path. The returned array should be freed with
@@ -5950,9 +8057,9 @@ dbus_connection_set_data (DBusConnection   *connection,
  * Retrieves data previously set with dbus_connection_set_data().
  * The slot must still be allocated (must not have been freed).
  *
- * @note This function does not take the
- * main thread lock on DBusConnection, which allows it to be
- * used from inside watch and timeout functions. (See the
+ * @note This function takes no lock on DBusConnection at all,
+ * which allows it to be used from inside watch and timeout
+ * functions and keeps it cheap enough to call per message. (See the
  * note in docs for dbus_connection_set_watch_functions().)
  * A side effect of this is that you need to know there's
  * a reference held on the connection while invoking
@@ -5970,14 +8077,11 @@ dbus_connection_get_data (DBusConnection   *connection,
   void *res;
 
   _dbus_return_val_if_fail (connection != NULL, NULL);
-  
-  SLOTS_LOCK (connection);
 
+  /* slot lists are safe to read without the lock */
   res = _dbus_data_slot_list_get (&slot_allocator,
                                   &connection->slot_list,
                                   slot);
-  
-  SLOTS_UNLOCK (connection);
 
   return res;
 }
@@ -6194,23 +8298,747 @@ dbus_connection_get_outgoing_size (DBusConnection *connection)
 }
 
 /**
- * Gets the approximate number of uni fds of all messages in the
- * outgoing message queue.
+ * Gets the approximate size in bytes of all messages that have been
+ * received and not yet finalized, which is what
+ * dbus_connection_set_max_received_size() limits.
  *
  * @param connection the connection
- * @returns the number of unix fds that have been queued up but not sent
+ * @returns the number of bytes held by received messages
  */
 long
-dbus_connection_get_outgoing_unix_fds (DBusConnection *connection)
+_dbus_connection_get_incoming_size (DBusConnection *connection)
 {
   long res;
 
-  _dbus_return_val_if_fail (connection != NULL, 0);
+  _dbus_assert (connection != NULL);
 
   CONNECTION_LOCK (connection);
-  res = _dbus_counter_get_unix_fd_value (connection->outgoing_counter);
+  res = _dbus_transport_get_live_messages_size (connection->transport);
   CONNECTION_UNLOCK (connection);
   return res;
 }
 
-/** @} */
+/**
+ * Gets how many bytes the connection's transport reads and writes
+ * at most per main loop iteration just now. These start small and
+ * grow while the peer keeps the connection busy.
+ *
+ * @param connection the connection
+ * @param read_budget_p return location for the read budget
+ * @param write_budget_p return location for the write budget
+ */
+void
+_dbus_connection_get_io_budgets (DBusConnection *connection,
+                                 int            *read_budget_p,
+                                 int            *write_budget_p)
+{
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_get_io_budgets (connection->transport, read_budget_p,
+                                  write_budget_p);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Has messages sent on the connection left queued rather than written
+ * straight away; function is told, and is then responsible for calling
+ * _dbus_connection_write_deferred(). It is told once for any number of
+ * sends until then. Only suitable where all sending happens on the
+ * thread that will call _dbus_connection_write_deferred(), because
+ * nothing wakes that thread up.
+ *
+ * @param connection the connection
+ * @param function function to call instead of writing, or #NULL to
+ *  write straight away again
+ * @param data data for function
+ */
+void
+_dbus_connection_set_defer_write_function (DBusConnection         *connection,
+                                           DBusDeferWriteFunction  function,
+                                           void                   *data)
+{
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  connection->defer_write_function = function;
+  connection->defer_write_data = data;
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Lets method returns and errors be queued ahead of messages from
+ * other senders that are waiting to be sent; see
+ * _dbus_connection_queue_outgoing_link(). A reply never overtakes
+ * anything from its own sender, but the peer can see it before a
+ * signal from someone else that was sent earlier, so the bus only
+ * does this for a client that asks for it. Off by default.
+ *
+ * @param connection the connection
+ * @param enabled #TRUE to let replies jump the queue
+ */
+void
+_dbus_connection_set_replies_jump_queue (DBusConnection *connection,
+                                         dbus_bool_t     enabled)
+{
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  connection->replies_jump_queue = enabled != FALSE;
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Writes out the messages whose writing was deferred, as many as the
+ * socket takes without blocking, with as few system calls as the
+ * transport manages. The main loop writes the rest when the socket
+ * becomes writable, as usual.
+ *
+ * @param connection the connection
+ */
+void
+_dbus_connection_write_deferred (DBusConnection *connection)
+{
+  DBusDispatchStatus status;
+
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+
+  if (connection->write_deferred)
+    {
+      connection->write_deferred = FALSE;
+      _dbus_connection_do_iteration_unlocked (connection,
+                                              NULL,
+                                              DBUS_ITERATION_DO_WRITING,
+                                              0);
+    }
+
+  /* A peer that went away makes the write fail and queues the
+   * Disconnected message; nothing else would tell the owner, since
+   * the watches are gone
+   */
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* this calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+}
+
+static dbus_bool_t
+body_check_trampoline (DBusBodyCheck *check,
+                       void          *data)
+{
+  DBusConnection *connection = data;
+
+  HAVE_LOCK_CHECK (connection);
+
+  return (* connection->body_check_function) (connection, check,
+                                              connection->body_check_data);
+}
+
+/**
+ * Has the bodies of messages of at least min_size bytes validated by
+ * function rather than while reading them, so that the thread that
+ * reads does not stall on a huge one. Until function's check is
+ * handed back with _dbus_connection_body_check_done(), the connection
+ * stops reading and holds back the message and everything after it.
+ *
+ * @param connection the connection
+ * @param min_size the smallest body to hand off
+ * @param function the function, or #NULL to validate everything while
+ *  reading again
+ * @param data data for function
+ */
+void
+_dbus_connection_set_body_check_function (DBusConnection                  *connection,
+                                          long                             min_size,
+                                          DBusConnectionBodyCheckFunction  function,
+                                          void                            *data)
+{
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  connection->body_check_function = function;
+  connection->body_check_data = data;
+  _dbus_transport_set_body_check_function (connection->transport, min_size,
+                                           function != NULL ? body_check_trampoline : NULL,
+                                           connection);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Hands back a check given to the connection's body check function,
+ * after _dbus_body_check_run(). The message is queued, or the
+ * connection disconnected if it was invalid, and reading resumes;
+ * the dispatch status function is told if there is now something to
+ * dispatch.
+ *
+ * @param connection the connection
+ * @param check the check
+ */
+void
+_dbus_connection_body_check_done (DBusConnection *connection,
+                                  DBusBodyCheck  *check)
+{
+  DBusDispatchStatus status;
+
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+
+  /* nothing more is read from a connection that has gone away */
+  if (!_dbus_transport_get_is_connected (connection->transport))
+    {
+      CONNECTION_UNLOCK (connection);
+      return;
+    }
+
+  _dbus_transport_body_check_done (connection->transport, check);
+
+  if (!_dbus_transport_queue_messages (connection->transport))
+    status = DBUS_DISPATCH_NEED_MEMORY;
+  else
+    status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* this calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+}
+
+/**
+ * Gets the number that stands for this connection in the flight
+ * recorder. The transport never changes, so this takes no lock.
+ *
+ * @param connection the connection
+ * @returns the flight id
+ */
+dbus_uint32_t
+_dbus_connection_get_flight_id (DBusConnection *connection)
+{
+  _dbus_assert (connection != NULL);
+
+  return _dbus_transport_get_flight_id (connection->transport);
+}
+
+/**
+ * Gets the approximate number of uni fds of all messages in the
+ * outgoing message queue.
+ *
+ * @param connection the connection
+ * @returns the number of unix fds that have been queued up but not sent
+ */
+long
+dbus_connection_get_outgoing_unix_fds (DBusConnection *connection)
+{
+  long res;
+
+  _dbus_return_val_if_fail (connection != NULL, 0);
+
+  CONNECTION_LOCK (connection);
+  res = _dbus_counter_get_unix_fd_value (connection->outgoing_counter);
+  CONNECTION_UNLOCK (connection);
+  return res;
+}
+
+/** @} */
+
+#ifdef DBUS_BUILD_TESTS
+
+typedef struct
+{
+  char order[8];        /**< First letter of each member handled */
+  int n_handled;
+} ConcurrentTestData;
+
+static void
+concurrent_test_new_connection (DBusServer     *server,
+                                DBusConnection *new_connection,
+                                void           *data)
+{
+  DBusConnection **peer = data;
+
+  *peer = dbus_connection_ref (new_connection);
+}
+
+static DBusHandlerResult
+concurrent_test_filter (DBusConnection *connection,
+                        DBusMessage    *message,
+                        void           *data)
+{
+  ConcurrentTestData *td = data;
+  const char *member;
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_SIGNAL ||
+      dbus_message_has_interface (message, DBUS_INTERFACE_LOCAL))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  member = dbus_message_get_member (message);
+  _dbus_assert (td->n_handled < (int) sizeof (td->order) - 1);
+  td->order[td->n_handled++] = member[0];
+
+  /* Stands in for a second thread dispatching while this one is busy:
+   * it may take B, but not the second message to /a
+   */
+  if (strcmp (member, "A1") == 0)
+    {
+      dbus_connection_dispatch (connection);
+      dbus_connection_dispatch (connection);
+    }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+concurrent_test_send (DBusConnection *connection,
+                      const char     *path,
+                      const char     *member)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal (path, "org.freedesktop.TestSuite",
+                                     member);
+  if (message == NULL || !dbus_connection_send (connection, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_unref (message);
+}
+
+/* Both ends are in this thread, so take turns until the connection
+ * has n_expected messages in
+ */
+static void
+test_read_incoming (DBusConnection *connection,
+                    DBusConnection *peer,
+                    int             n_expected)
+{
+  int n_incoming;
+  int i;
+
+  n_incoming = 0;
+  for (i = 0; i < 1000 && n_incoming < n_expected; i++)
+    {
+      dbus_connection_read_write (peer, 10);
+      dbus_connection_read_write (connection, 10);
+      dbus_connection_get_dispatch_status (connection);
+
+      CONNECTION_LOCK (connection);
+      n_incoming = connection->n_incoming;
+      CONNECTION_UNLOCK (connection);
+    }
+  _dbus_assert (n_incoming == n_expected);
+}
+
+typedef struct
+{
+  char *order;  /**< Where the filters note that they ran */
+  char letter;  /**< What this filter notes */
+  dbus_bool_t handle; /**< Whether it handles the message */
+} FilterForTestFilter;
+
+static DBusHandlerResult
+filter_for_test_filter (DBusConnection *connection,
+                        DBusMessage    *message,
+                        void           *data)
+{
+  FilterForTestFilter *f = data;
+  int len;
+
+  if (dbus_message_has_interface (message, DBUS_INTERFACE_LOCAL))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  len = strlen (f->order);
+  _dbus_assert (len < 7);
+  f->order[len] = f->letter;
+  f->order[len + 1] = '\0';
+
+  return f->handle ? DBUS_HANDLER_RESULT_HANDLED :
+    DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Sends a message from peer and checks which filters on connection
+ * saw it, and in what order
+ */
+static void
+filter_for_test_check (DBusConnection *connection,
+                       DBusConnection *peer,
+                       char           *order,
+                       int             type,
+                       const char     *interface,
+                       const char     *member,
+                       const char     *expected)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new (type);
+  if (message == NULL ||
+      !dbus_message_set_path (message, "/org/freedesktop/TestSuite") ||
+      !dbus_message_set_interface (message, interface) ||
+      !dbus_message_set_member (message, member))
+    _dbus_assert_not_reached ("no memory");
+
+  if (type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+    dbus_message_set_no_reply (message, TRUE);
+
+  if (!dbus_connection_send (peer, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  test_read_incoming (connection, peer, 1);
+
+  order[0] = '\0';
+  while (dbus_connection_dispatch (connection) == DBUS_DISPATCH_DATA_REMAINS)
+    ;
+
+  if (strcmp (order, expected) != 0)
+    _dbus_assert_not_reached ("filters ran in the wrong order or for the wrong messages");
+}
+
+#define FILTER_FOR_TEST_INTERFACE "org.freedesktop.TestSuite.Filter"
+
+static void
+filter_for_test (DBusConnection *connection,
+                 DBusConnection *peer)
+{
+  char order[8];
+  FilterForTestFilter first = { order, 'u', FALSE };
+  FilterForTestFilter any = { order, 'i', FALSE };
+  FilterForTestFilter hit = { order, 's', FALSE };
+  FilterForTestFilter method = { order, 'm', TRUE };
+  FilterForTestFilter last = { order, 'z', FALSE };
+
+  /* unkeyed filters before and after the keyed ones, to check that
+   * they all still run in the order they were added
+   */
+  if (!dbus_connection_add_filter (connection, filter_for_test_filter,
+                                   &first, NULL) ||
+      !dbus_connection_add_filter_for (connection, DBUS_MESSAGE_TYPE_INVALID,
+                                       FILTER_FOR_TEST_INTERFACE, NULL,
+                                       filter_for_test_filter, &any, NULL) ||
+      !dbus_connection_add_filter_for (connection, DBUS_MESSAGE_TYPE_SIGNAL,
+                                       FILTER_FOR_TEST_INTERFACE, "Hit",
+                                       filter_for_test_filter, &hit, NULL) ||
+      !dbus_connection_add_filter_for (connection, DBUS_MESSAGE_TYPE_METHOD_CALL,
+                                       FILTER_FOR_TEST_INTERFACE, "Hit",
+                                       filter_for_test_filter, &method, NULL) ||
+      !dbus_connection_add_filter (connection, filter_for_test_filter,
+                                   &last, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  filter_for_test_check (connection, peer, order, DBUS_MESSAGE_TYPE_SIGNAL,
+                         FILTER_FOR_TEST_INTERFACE, "Hit", "uisz");
+  filter_for_test_check (connection, peer, order, DBUS_MESSAGE_TYPE_SIGNAL,
+                         FILTER_FOR_TEST_INTERFACE, "Miss", "uiz");
+  filter_for_test_check (connection, peer, order, DBUS_MESSAGE_TYPE_SIGNAL,
+                         "org.freedesktop.TestSuite.Other", "Hit", "uz");
+  /* the method call filter handles it, so the last filter doesn't run */
+  filter_for_test_check (connection, peer, order, DBUS_MESSAGE_TYPE_METHOD_CALL,
+                         FILTER_FOR_TEST_INTERFACE, "Hit", "uim");
+
+  dbus_connection_remove_filter (connection, filter_for_test_filter, &hit);
+  filter_for_test_check (connection, peer, order, DBUS_MESSAGE_TYPE_SIGNAL,
+                         FILTER_FOR_TEST_INTERFACE, "Hit", "uiz");
+
+  dbus_connection_remove_filter (connection, filter_for_test_filter, &any);
+  dbus_connection_remove_filter (connection, filter_for_test_filter, &method);
+  filter_for_test_check (connection, peer, order, DBUS_MESSAGE_TYPE_SIGNAL,
+                         FILTER_FOR_TEST_INTERFACE, "Hit", "uz");
+  filter_for_test_check (connection, peer, order, DBUS_MESSAGE_TYPE_METHOD_CALL,
+                         FILTER_FOR_TEST_INTERFACE, "Hit", "uz");
+
+  /* the interface's bucket goes with its last filter */
+  CONNECTION_LOCK (connection);
+  _dbus_assert (connection->filter_index == NULL ||
+                _dbus_hash_table_lookup_string (connection->filter_index,
+                                                FILTER_FOR_TEST_INTERFACE) == NULL);
+  CONNECTION_UNLOCK (connection);
+
+  dbus_connection_remove_filter (connection, filter_for_test_filter, &first);
+  dbus_connection_remove_filter (connection, filter_for_test_filter, &last);
+  filter_for_test_check (connection, peer, order, DBUS_MESSAGE_TYPE_SIGNAL,
+                         FILTER_FOR_TEST_INTERFACE, "Hit", "");
+}
+
+static DBusMessage *
+send_batch_test_message (const char *member)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestSuite",
+                                     "org.freedesktop.TestSuite.Batch",
+                                     member);
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  return message;
+}
+
+static void
+send_batch_test_receive (DBusConnection *connection,
+                         const char     *member,
+                         dbus_uint32_t   serial)
+{
+  DBusMessage *message;
+
+  message = dbus_connection_pop_message (connection);
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_is_signal (message,
+                                        "org.freedesktop.TestSuite.Batch",
+                                        member));
+  _dbus_assert (dbus_message_get_serial (message) == serial);
+  dbus_message_unref (message);
+}
+
+static void
+send_batch_test (DBusConnection *connection,
+                 DBusConnection *peer)
+{
+  DBusMessage *batch[3];
+  DBusMessage *message;
+  dbus_uint32_t serials[3];
+  dbus_uint32_t before, after;
+  int n_outgoing;
+  int i, j;
+
+  /* Running out of memory for any of the queue links queues nothing.
+   * With the link cache empty each message needs one, so failing the
+   * i'th allocation fails after i links were got.
+   */
+  for (i = 0; i < 3; i++)
+    {
+      for (j = 0; j < 3; j++)
+        batch[j] = send_batch_test_message ("Lost");
+
+      CONNECTION_LOCK (peer);
+      _dbus_list_clear (&peer->link_cache);
+      n_outgoing = peer->n_outgoing;
+      CONNECTION_UNLOCK (peer);
+
+      _dbus_set_fail_alloc_counter (i);
+      if (dbus_connection_send_batch (peer, batch, 3, serials))
+        _dbus_assert_not_reached ("batch sent without memory for it");
+      _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
+
+      CONNECTION_LOCK (peer);
+      _dbus_assert (peer->n_outgoing == n_outgoing);
+      /* the links that were got are kept for next time */
+      _dbus_assert (_dbus_list_get_length (&peer->link_cache) == i);
+      CONNECTION_UNLOCK (peer);
+
+      for (j = 0; j < 3; j++)
+        {
+          _dbus_assert (dbus_message_get_serial (batch[j]) == 0);
+          dbus_message_unref (batch[j]);
+        }
+    }
+
+  /* An empty batch is fine */
+  if (!dbus_connection_send_batch (peer, NULL, 0, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  /* The batch keeps its order, nothing gets between its messages, and
+   * a message that already has a serial keeps it
+   */
+  message = send_batch_test_message ("Before");
+  if (!dbus_connection_send (peer, message, &before))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  batch[0] = send_batch_test_message ("First");
+  batch[1] = send_batch_test_message ("Second");
+  batch[2] = send_batch_test_message ("Third");
+  dbus_message_set_serial (batch[1], 1000);
+
+  if (!dbus_connection_send_batch (peer, batch, 3, serials))
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_assert (serials[0] == before + 1);
+  _dbus_assert (serials[1] == 1000);
+  _dbus_assert (serials[2] == before + 2);
+  for (i = 0; i < 3; i++)
+    {
+      _dbus_assert (dbus_message_get_serial (batch[i]) == serials[i]);
+      dbus_message_unref (batch[i]);
+    }
+
+  message = send_batch_test_message ("After");
+  if (!dbus_connection_send (peer, message, &after))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+  _dbus_assert (after == before + 3);
+
+  test_read_incoming (connection, peer, 5);
+
+  send_batch_test_receive (connection, "Before", before);
+  send_batch_test_receive (connection, "First", serials[0]);
+  send_batch_test_receive (connection, "Second", serials[1]);
+  send_batch_test_receive (connection, "Third", serials[2]);
+  send_batch_test_receive (connection, "After", after);
+}
+
+static dbus_bool_t
+replies_jump_queue_test_defer (DBusConnection *connection,
+                               void           *data)
+{
+  return TRUE;
+}
+
+static dbus_uint32_t
+replies_jump_queue_test_send (DBusConnection *peer,
+                              int             type,
+                              const char     *sender)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+
+  if (type == DBUS_MESSAGE_TYPE_SIGNAL)
+    {
+      message = send_batch_test_message ("Queued");
+    }
+  else
+    {
+      message = dbus_message_new (type);
+      if (message == NULL)
+        _dbus_assert_not_reached ("no memory");
+      if (type == DBUS_MESSAGE_TYPE_ERROR &&
+          !dbus_message_set_error_name (message, DBUS_ERROR_FAILED))
+        _dbus_assert_not_reached ("no memory");
+      if (!dbus_message_set_reply_serial (message, 1))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  if (!dbus_message_set_sender (message, sender) ||
+      !dbus_connection_send (peer, message, &serial))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  return serial;
+}
+
+/* Queues signals from two senders and then replies while writing is
+ * held back, and checks the order they arrive in
+ */
+static void
+replies_jump_queue_test (DBusConnection *connection,
+                         DBusConnection *peer,
+                         dbus_bool_t     enabled)
+{
+  dbus_uint32_t sent[6];
+  dbus_uint32_t expected[6];
+  DBusMessage *message;
+  int i;
+
+  _dbus_connection_set_defer_write_function (peer,
+                                             replies_jump_queue_test_defer,
+                                             NULL);
+  _dbus_connection_set_replies_jump_queue (peer, enabled);
+
+  sent[0] = replies_jump_queue_test_send (peer, DBUS_MESSAGE_TYPE_SIGNAL, ":1.1");
+  sent[1] = replies_jump_queue_test_send (peer, DBUS_MESSAGE_TYPE_SIGNAL, ":1.1");
+  sent[2] = replies_jump_queue_test_send (peer, DBUS_MESSAGE_TYPE_SIGNAL, ":1.3");
+  sent[3] = replies_jump_queue_test_send (peer, DBUS_MESSAGE_TYPE_METHOD_RETURN, ":1.2");
+  sent[4] = replies_jump_queue_test_send (peer, DBUS_MESSAGE_TYPE_ERROR, ":1.2");
+  sent[5] = replies_jump_queue_test_send (peer, DBUS_MESSAGE_TYPE_METHOD_RETURN, ":1.1");
+
+  _dbus_connection_set_defer_write_function (peer, NULL, NULL);
+  _dbus_connection_set_replies_jump_queue (peer, FALSE);
+  _dbus_connection_write_deferred (peer);
+
+  if (enabled)
+    {
+      /* The replies from :1.2 go straight behind the first message,
+       * in the order they were sent; the one from :1.1 only as far as
+       * the last signal from :1.1
+       */
+      expected[0] = sent[0];
+      expected[1] = sent[3];
+      expected[2] = sent[4];
+      expected[3] = sent[1];
+      expected[4] = sent[5];
+      expected[5] = sent[2];
+    }
+  else
+    {
+      for (i = 0; i < 6; i++)
+        expected[i] = sent[i];
+    }
+
+  test_read_incoming (connection, peer, 6);
+
+  for (i = 0; i < 6; i++)
+    {
+      message = dbus_connection_pop_message (connection);
+      _dbus_assert (message != NULL);
+      _dbus_assert (dbus_message_get_serial (message) == expected[i]);
+      dbus_message_unref (message);
+    }
+}
+
+/**
+ * @ingroup DBusConnectionInternals
+ * Unit test for concurrent dispatch, filtering, batched sending and
+ * reply reordering of a DBusConnection.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_connection_test (const char *test_data_dir)
+{
+  DBusServer *server;
+  DBusConnection *connection;
+  DBusConnection *peer;
+  ConcurrentTestData td;
+
+  server = dbus_server_listen ("debug-pipe:name=test-concurrent-dispatch",
+                               NULL);
+  if (server == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  peer = NULL;
+  dbus_server_set_new_connection_function (server,
+                                           concurrent_test_new_connection,
+                                           &peer, NULL);
+
+  connection = dbus_connection_open_private ("debug-pipe:name=test-concurrent-dispatch",
+                                             NULL);
+  if (connection == NULL || peer == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_connection_set_concurrent_dispatch (connection, TRUE);
+
+  _DBUS_ZERO (td);
+  if (!dbus_connection_add_filter (connection, concurrent_test_filter,
+                                   &td, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  concurrent_test_send (peer, "/a", "A1");
+  concurrent_test_send (peer, "/a", "A2");
+  concurrent_test_send (peer, "/b", "B");
+
+  test_read_incoming (connection, peer, 3);
+
+  while (dbus_connection_dispatch (connection) == DBUS_DISPATCH_DATA_REMAINS)
+    ;
+
+  /* B overtook the second message to /a, which still came after the first */
+  _dbus_assert (strcmp (td.order, "ABA") == 0);
+
+  CONNECTION_LOCK (connection);
+  _dbus_assert (connection->dispatching == NULL);
+  CONNECTION_UNLOCK (connection);
+
+  dbus_connection_remove_filter (connection, concurrent_test_filter, &td);
+
+  filter_for_test (connection, peer);
+  send_batch_test (connection, peer);
+  replies_jump_queue_test (connection, peer, FALSE);
+  replies_jump_queue_test (connection, peer, TRUE);
+
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+  dbus_connection_close (peer);
+  dbus_connection_unref (peer);
+  dbus_server_disconnect (server);
+  dbus_server_unref (server);
+
+  return TRUE;
+}
+#endif /* DBUS_BUILD_TESTS */
@@ -51,6 +51,8 @@ typedef struct DBusPendingCall DBusPendingCall;
 typedef struct DBusConnection DBusConnection;
 /** Set of functions that must be implemented to handle messages sent to a particular object path. */
 typedef struct DBusObjectPathVTable DBusObjectPathVTable;
+/** One method in a table of them to handle messages sent to a particular object path. */
+typedef struct DBusObjectMethod DBusObjectMethod;
 
 /**
  * Indicates the status of a #DBusWatch.
@@ -175,6 +177,9 @@ DBUS_EXPORT
 DBusConnection*    dbus_connection_open_private                 (const char                 *address,
                                                                  DBusError                  *error);
 DBUS_EXPORT
+DBusConnection*    dbus_connection_open_channel                 (DBusConnection             *connection,
+                                                                 DBusError                  *error);
+DBUS_EXPORT
 DBusConnection*    dbus_connection_ref                          (DBusConnection             *connection);
 DBUS_EXPORT
 void               dbus_connection_unref                        (DBusConnection             *connection);
@@ -227,6 +232,11 @@ dbus_bool_t        dbus_connection_send                         (DBusConnection
                                                                  DBusMessage                *message,
                                                                  dbus_uint32_t              *client_serial);
 DBUS_EXPORT
+dbus_bool_t        dbus_connection_send_batch                   (DBusConnection             *connection,
+                                                                 DBusMessage               **messages,
+                                                                 int                         n_messages,
+                                                                 dbus_uint32_t              *serials);
+DBUS_EXPORT
 dbus_bool_t        dbus_connection_send_with_reply              (DBusConnection             *connection,
                                                                  DBusMessage                *message,
                                                                  DBusPendingCall           **pending_return,
@@ -237,6 +247,13 @@ DBusMessage *      dbus_connection_send_with_reply_and_block    (DBusConnection
                                                                  int                         timeout_milliseconds,
                                                                  DBusError                  *error);
 DBUS_EXPORT
+dbus_bool_t        dbus_connection_call_many_and_block          (DBusConnection             *connection,
+                                                                 DBusMessage               **messages,
+                                                                 int                         n_messages,
+                                                                 int                         timeout_milliseconds,
+                                                                 DBusMessage               **replies,
+                                                                 DBusError                  *error);
+DBUS_EXPORT
 dbus_bool_t        dbus_connection_set_watch_functions          (DBusConnection             *connection,
                                                                  DBusAddWatchFunction        add_function,
                                                                  DBusRemoveWatchFunction     remove_function,
@@ -244,6 +261,11 @@ dbus_bool_t        dbus_connection_set_watch_functions          (DBusConnection
                                                                  void                       *data,
                                                                  DBusFreeFunction            free_data_function);
 DBUS_EXPORT
+void               dbus_connection_set_edge_triggered_watches   (DBusConnection             *connection,
+                                                                 dbus_bool_t                 enabled);
+DBUS_EXPORT
+dbus_bool_t        dbus_connection_get_edge_triggered_watches   (DBusConnection             *connection);
+DBUS_EXPORT
 dbus_bool_t        dbus_connection_set_timeout_functions        (DBusConnection             *connection,
                                                                  DBusAddTimeoutFunction      add_function,
                                                                  DBusRemoveTimeoutFunction   remove_function,
@@ -289,6 +311,12 @@ void               dbus_connection_set_allow_anonymous          (DBusConnection
 DBUS_EXPORT
 void               dbus_connection_set_route_peer_messages      (DBusConnection             *connection,
                                                                  dbus_bool_t                 value);
+DBUS_EXPORT
+void               dbus_connection_set_trust_peer_messages      (DBusConnection             *connection,
+                                                                 dbus_bool_t                 value);
+DBUS_EXPORT
+void               dbus_connection_set_concurrent_dispatch      (DBusConnection             *connection,
+                                                                 dbus_bool_t                 value);
 
 
 /* Filters */
@@ -299,6 +327,14 @@ dbus_bool_t dbus_connection_add_filter    (DBusConnection            *connection
                                            void                      *user_data,
                                            DBusFreeFunction           free_data_function);
 DBUS_EXPORT
+dbus_bool_t dbus_connection_add_filter_for (DBusConnection            *connection,
+                                            int                        message_type,
+                                            const char                *interface,
+                                            const char                *member,
+                                            DBusHandleMessageFunction  function,
+                                            void                      *user_data,
+                                            DBusFreeFunction           free_data_function);
+DBUS_EXPORT
 void        dbus_connection_remove_filter (DBusConnection            *connection,
                                            DBusHandleMessageFunction  function,
                                            void                      *user_data);
@@ -394,6 +430,19 @@ struct DBusObjectPathVTable
   void (* dbus_internal_pad4) (void *); /**< Reserved for future expansion */
 };
 
+/**
+ * One method in a table registered with
+ * dbus_connection_register_object_interfaces(). The table ends with
+ * an entry whose interface is #NULL.
+ */
+struct DBusObjectMethod
+{
+  const char                        *interface; /**< Interface the method is on */
+  const char                        *member;    /**< Name of the method */
+  const char                        *signature; /**< Signature its arguments must have, or #NULL for any */
+  DBusObjectPathMessageFunction      function;  /**< Function to handle calls to it */
+};
+
 DBUS_EXPORT
 dbus_bool_t dbus_connection_try_register_object_path (DBusConnection              *connection,
                                                       const char                  *path,
@@ -420,6 +469,13 @@ dbus_bool_t dbus_connection_register_fallback      (DBusConnection
                                                     const DBusObjectPathVTable  *vtable,
                                                     void                        *user_data);
 DBUS_EXPORT
+dbus_bool_t dbus_connection_register_object_interfaces (DBusConnection                   *connection,
+                                                        const char                       *path,
+                                                        const DBusObjectMethod           *methods,
+                                                        DBusObjectPathUnregisterFunction  unregister_function,
+                                                        void                             *user_data,
+                                                        DBusError                        *error);
+DBUS_EXPORT
 dbus_bool_t dbus_connection_unregister_object_path (DBusConnection              *connection,
                                                     const char                  *path);
 
@@ -428,6 +484,11 @@ dbus_bool_t dbus_connection_get_object_path_data   (DBusConnection
                                                     const char                  *path,
                                                     void                       **data_p);
 
+DBUS_EXPORT
+dbus_bool_t dbus_connection_set_object_path_introspection (DBusConnection       *connection,
+                                                           const char           *path,
+                                                           const char           *interfaces_xml);
+
 DBUS_EXPORT
 dbus_bool_t dbus_connection_list_registered        (DBusConnection              *connection,
                                                     const char                  *parent_path,
@@ -212,8 +212,50 @@ _dbus_data_slot_allocator_free (DBusDataSlotAllocator *allocator,
 void
 _dbus_data_slot_list_init (DBusDataSlotList *list)
 {
-  list->slots = NULL;
-  list->n_slots = 0;
+  list->array = NULL;
+}
+
+/* Grows the list to have room for the slot. The old array stays
+ * allocated until the list is freed, since a lock-free reader may
+ * still be looking at it.
+ */
+static dbus_bool_t
+data_slot_list_grow (DBusDataSlotList *list,
+                     int               slot)
+{
+  DBusDataSlotArray *old = list->array;
+  DBusDataSlotArray *array;
+  int n_slots;
+  int i;
+
+  n_slots = slot + 1;
+  if (old != NULL)
+    n_slots = MAX (n_slots, old->n_slots * 2);
+
+  array = dbus_malloc (_DBUS_STRUCT_OFFSET (DBusDataSlotArray, slots) +
+                       sizeof (DBusDataSlot) * n_slots);
+  if (array == NULL)
+    return FALSE;
+
+  array->n_slots = n_slots;
+  array->retired = old;
+
+  i = 0;
+  if (old != NULL)
+    {
+      for (; i < old->n_slots; i++)
+        array->slots[i] = old->slots[i];
+    }
+
+  for (; i < n_slots; i++)
+    {
+      array->slots[i].data = NULL;
+      array->slots[i].free_data_func = NULL;
+    }
+
+  _dbus_atomic_pointer_set ((void * volatile *) &list->array, array);
+
+  return TRUE;
 }
 
 /**
@@ -253,34 +295,20 @@ _dbus_data_slot_list_set  (DBusDataSlotAllocator *allocator,
   _dbus_mutex_unlock (*(allocator->lock_loc));
 #endif
   
-  if (slot >= list->n_slots)
+  if (list->array == NULL || slot >= list->array->n_slots)
     {
-      DBusDataSlot *tmp;
-      int i;
-      
-      tmp = dbus_realloc (list->slots,
-                          sizeof (DBusDataSlot) * (slot + 1));
-      if (tmp == NULL)
+      if (!data_slot_list_grow (list, slot))
         return FALSE;
-      
-      list->slots = tmp;
-      i = list->n_slots;
-      list->n_slots = slot + 1;
-      while (i < list->n_slots)
-        {
-          list->slots[i].data = NULL;
-          list->slots[i].free_data_func = NULL;
-          ++i;
-        }
     }
 
-  _dbus_assert (slot < list->n_slots);
+  _dbus_assert (slot < list->array->n_slots);
 
-  *old_data = list->slots[slot].data;
-  *old_free_func = list->slots[slot].free_data_func;
+  *old_data = list->array->slots[slot].data;
+  *old_free_func = list->array->slots[slot].free_data_func;
 
-  list->slots[slot].data = data;
-  list->slots[slot].free_data_func = free_data_func;
+  /* published, so that a reader sees data fully set up */
+  _dbus_atomic_pointer_set (&list->array->slots[slot].data, data);
+  list->array->slots[slot].free_data_func = free_data_func;
 
   return TRUE;
 }
@@ -289,6 +317,10 @@ _dbus_data_slot_list_set  (DBusDataSlotAllocator *allocator,
  * Retrieves data previously set with _dbus_data_slot_list_set_data().
  * The slot must still be allocated (must not have been freed).
  *
+ * Needs no lock, even while another thread sets a slot in the same
+ * list: the storage is published with _dbus_atomic_pointer_set() and
+ * never freed before the list is.
+ *
  * @param allocator the allocator slot was allocated from
  * @param list the data slot list
  * @param slot the slot to get data from
@@ -299,6 +331,8 @@ _dbus_data_slot_list_get  (DBusDataSlotAllocator *allocator,
                            DBusDataSlotList      *list,
                            int                    slot)
 {
+  DBusDataSlotArray *array;
+
 #ifndef DBUS_DISABLE_ASSERT
   /* We need to take the allocator lock here, because the allocator could
    * be e.g. realloc()ing allocated_slots. We avoid doing this if asserts
@@ -311,10 +345,12 @@ _dbus_data_slot_list_get  (DBusDataSlotAllocator *allocator,
   _dbus_mutex_unlock (*(allocator->lock_loc));
 #endif
 
-  if (slot >= list->n_slots)
+  array = _dbus_atomic_pointer_get ((void * volatile *) &list->array);
+
+  if (array == NULL || slot >= array->n_slots)
     return NULL;
   else
-    return list->slots[slot].data;
+    return _dbus_atomic_pointer_get (&array->slots[slot].data);
 }
 
 /**
@@ -329,12 +365,17 @@ _dbus_data_slot_list_clear (DBusDataSlotList *list)
   int i;
 
   i = 0;
-  while (i < list->n_slots)
+  while (list->array != NULL && i < list->array->n_slots)
     {
-      if (list->slots[i].free_data_func)
-        (* list->slots[i].free_data_func) (list->slots[i].data);
-      list->slots[i].data = NULL;
-      list->slots[i].free_data_func = NULL;
+      DBusDataSlot *slot = &list->array->slots[i];
+
+      if (slot->free_data_func)
+        (* slot->free_data_func) (slot->data);
+
+      /* the free function may have grown the list */
+      slot = &list->array->slots[i];
+      _dbus_atomic_pointer_set (&slot->data, NULL);
+      slot->free_data_func = NULL;
       ++i;
     }
 }
@@ -349,11 +390,20 @@ _dbus_data_slot_list_clear (DBusDataSlotList *list)
 void
 _dbus_data_slot_list_free (DBusDataSlotList *list)
 {
+  DBusDataSlotArray *array;
+
   _dbus_data_slot_list_clear (list);
-  
-  dbus_free (list->slots);
-  list->slots = NULL;
-  list->n_slots = 0;
+
+  array = list->array;
+  while (array != NULL)
+    {
+      DBusDataSlotArray *retired = array->retired;
+
+      dbus_free (array);
+      array = retired;
+    }
+
+  list->array = NULL;
 }
 
 /** @} */
@@ -60,14 +60,26 @@ struct DBusDataSlotAllocator
   DBusMutex **lock_loc;   /**< location of thread lock */
 };
 
+typedef struct DBusDataSlotArray DBusDataSlotArray;
+
+/**
+ * Storage for a slot list. It is replaced by a bigger one rather than
+ * resized, so that readers never see it move.
+ */
+struct DBusDataSlotArray
+{
+  int                n_slots; /**< Slots in this array */
+  DBusDataSlotArray *retired; /**< Smaller array this one replaced */
+  DBusDataSlot       slots[1]; /**< The slots, allocated inline */
+};
+
 /**
  * Data structure that stores the actual user data set at a given
  * slot.
  */
 struct DBusDataSlotList
 {
-  DBusDataSlot *slots;   /**< Data slots */
-  int           n_slots; /**< Slots we have storage for in data_slots */
+  DBusDataSlotArray *array; /**< Current storage, or #NULL */
 };
 
 dbus_bool_t _dbus_data_slot_allocator_init  (DBusDataSlotAllocator  *allocator);
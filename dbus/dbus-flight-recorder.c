@@ -0,0 +1,184 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-flight-recorder.c Ring of recent bus events
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-flight-recorder.h"
+#include <string.h>
+
+/**
+ * @defgroup DBusFlightRecorder flight recorder
+ * @ingroup  DBusInternals
+ * @brief The last few thousand things that happened on the bus
+ *
+ * When enabled, the events listed in #DBusFlightEvent are written as
+ * fixed-size binary records into a ring that keeps the most recent
+ * #DBUS_FLIGHT_RECORDER_SIZE of them, so that after a stall there is
+ * something to look at without having had verbose mode on. Recording
+ * is a clock read and six stores; when disabled it's a single test of
+ * a global.
+ *
+ * Like the latency histograms, the ring has no locking: only the bus
+ * daemon turns it on, and it runs its whole main loop in one thread.
+ *
+ * @{
+ */
+
+/** Whether events are being recorded, see _dbus_flight_recorder_set_enabled() */
+dbus_bool_t _dbus_flight_recorder_enabled = FALSE;
+
+static DBusFlightRecord *ring = NULL;
+/* total ever written; the next record goes at next % size */
+static unsigned long next = 0;
+
+static DBusAtomic next_flight_id = { 0 };
+
+static const char *event_names[DBUS_FLIGHT_N_EVENTS] = {
+  "accepted",
+  "authenticated",
+  "hello",
+  "read",
+  "write",
+  "dispatch",
+  "routed",
+  "dispatched",
+  "activating",
+  "activated",
+  "disconnected"
+};
+
+/**
+ * Turns recording on or off. Turning it on starts from an empty ring.
+ *
+ * @param enabled #TRUE to record events
+ * @returns #FALSE if there was no memory for the ring
+ */
+dbus_bool_t
+_dbus_flight_recorder_set_enabled (dbus_bool_t enabled)
+{
+  if (enabled && !_dbus_flight_recorder_enabled)
+    {
+      if (ring == NULL)
+        {
+          ring = dbus_new (DBusFlightRecord, DBUS_FLIGHT_RECORDER_SIZE);
+          if (ring == NULL)
+            return FALSE;
+        }
+
+      next = 0;
+    }
+
+  _dbus_flight_recorder_enabled = enabled;
+  return TRUE;
+}
+
+/**
+ * Writes a record into the ring, overwriting the oldest one if it is
+ * full. Use _dbus_flight_record() rather than calling this directly.
+ *
+ * @param event what happened
+ * @param connection the flight id of the connection it happened to
+ * @param serial the serial of the message it happened to
+ * @param payload more about it, see #DBusFlightEvent
+ */
+void
+_dbus_flight_recorder_add (DBusFlightEvent event,
+                           dbus_uint32_t   connection,
+                           dbus_uint32_t   serial,
+                           dbus_uint32_t   payload)
+{
+  DBusFlightRecord *record;
+  long sec, usec;
+
+  _dbus_assert (event < DBUS_FLIGHT_N_EVENTS);
+  _dbus_assert (ring != NULL);
+
+  _dbus_get_current_time (&sec, &usec);
+
+  record = &ring[next & (DBUS_FLIGHT_RECORDER_SIZE - 1)];
+  record->tv_sec = sec;
+  record->tv_usec = usec;
+  record->event = event;
+  record->connection = connection;
+  record->serial = serial;
+  record->payload = payload;
+
+  next += 1;
+}
+
+/**
+ * Copies out the ring, oldest record first.
+ *
+ * @param records array of #DBUS_FLIGHT_RECORDER_SIZE to fill in
+ * @returns the number of records copied, 0 if recording is off
+ */
+int
+_dbus_flight_recorder_get_records (DBusFlightRecord *records)
+{
+  unsigned long first;
+  int start;
+  int n;
+
+  if (!_dbus_flight_recorder_enabled)
+    return 0;
+
+  if (next <= DBUS_FLIGHT_RECORDER_SIZE)
+    {
+      memcpy (records, ring, next * sizeof (DBusFlightRecord));
+      return next;
+    }
+
+  first = next - DBUS_FLIGHT_RECORDER_SIZE;
+  start = first & (DBUS_FLIGHT_RECORDER_SIZE - 1);
+  n = DBUS_FLIGHT_RECORDER_SIZE - start;
+
+  memcpy (records, ring + start, n * sizeof (DBusFlightRecord));
+  memcpy (records + n, ring, start * sizeof (DBusFlightRecord));
+
+  return DBUS_FLIGHT_RECORDER_SIZE;
+}
+
+/**
+ * Gets the name of an event, for reports.
+ *
+ * @param event the event
+ * @returns a short lowercase name
+ */
+const char *
+_dbus_flight_event_name (DBusFlightEvent event)
+{
+  _dbus_assert (event < DBUS_FLIGHT_N_EVENTS);
+
+  return event_names[event];
+}
+
+/**
+ * Gets a number to tell a transport apart from others in the records.
+ * Numbers start from 1 and are not reused until they wrap.
+ *
+ * @returns a new flight id
+ */
+dbus_uint32_t
+_dbus_flight_id_new (void)
+{
+  return (dbus_uint32_t) _dbus_atomic_inc (&next_flight_id) + 1;
+}
+
+/** @} */
@@ -0,0 +1,82 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-flight-recorder.h Ring of recent bus events
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef DBUS_FLIGHT_RECORDER_H
+#define DBUS_FLIGHT_RECORDER_H
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+
+DBUS_BEGIN_DECLS
+
+/* The connection in each record is a transport's flight id, see
+ * _dbus_flight_id_new(); 0 means the bus itself.
+ */
+typedef enum
+{
+  DBUS_FLIGHT_ACCEPTED,      /**< bus took a connection; payload is its fd */
+  DBUS_FLIGHT_AUTHENTICATED, /**< auth finished; payload is the uid or -1 */
+  DBUS_FLIGHT_HELLO,         /**< named ":M.N"; payload is N */
+  DBUS_FLIGHT_READ,          /**< socket read; payload is the byte count */
+  DBUS_FLIGHT_WRITE,         /**< socket write; payload is the byte count */
+  DBUS_FLIGHT_DISPATCH,      /**< bus_dispatch() began; payload is the type */
+  DBUS_FLIGHT_ROUTED,        /**< matched; payload is the recipient count */
+  DBUS_FLIGHT_DISPATCHED,    /**< bus_dispatch() ended; payload is its result */
+  DBUS_FLIGHT_ACTIVATING,    /**< activation requested for this message */
+  DBUS_FLIGHT_ACTIVATED,     /**< an activation ended; payload is 0 if it failed */
+  DBUS_FLIGHT_DISCONNECTED,  /**< transport disconnected */
+  DBUS_FLIGHT_N_EVENTS
+} DBusFlightEvent;
+
+typedef struct
+{
+  dbus_uint32_t tv_sec;
+  dbus_uint32_t tv_usec;
+  dbus_uint32_t event;      /**< a #DBusFlightEvent */
+  dbus_uint32_t connection; /**< flight id of the connection, or 0 */
+  dbus_uint32_t serial;     /**< serial of the message, or 0 */
+  dbus_uint32_t payload;    /**< depends on the event */
+} DBusFlightRecord;
+
+/* A power of two; a few seconds of a busy system bus */
+#define DBUS_FLIGHT_RECORDER_SIZE 16384
+
+extern dbus_bool_t _dbus_flight_recorder_enabled;
+
+#define _dbus_flight_record(event, connection, serial, payload)          \
+  do {                                                                   \
+    if (_dbus_flight_recorder_enabled)                                   \
+      _dbus_flight_recorder_add ((event), (connection), (serial),        \
+                                 (payload));                             \
+  } while (0)
+
+dbus_bool_t   _dbus_flight_recorder_set_enabled (dbus_bool_t       enabled);
+void          _dbus_flight_recorder_add         (DBusFlightEvent   event,
+                                                 dbus_uint32_t     connection,
+                                                 dbus_uint32_t     serial,
+                                                 dbus_uint32_t     payload);
+int           _dbus_flight_recorder_get_records (DBusFlightRecord *records);
+const char   *_dbus_flight_event_name           (DBusFlightEvent   event);
+dbus_uint32_t _dbus_flight_id_new               (void);
+
+DBUS_END_DECLS
+
+#endif /* DBUS_FLIGHT_RECORDER_H */
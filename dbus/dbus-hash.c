@@ -78,6 +78,7 @@
 #include "dbus-hash.h"
 #include "dbus-internals.h"
 #include "dbus-mempool.h"
+#include "dbus-sysdeps.h"
 
 /**
  * @defgroup DBusHashTable Hash table
@@ -148,6 +149,12 @@ struct DBusHashEntry
                            */
   void *key;              /**< Hash key */
   void *value;            /**< Hash value */
+  unsigned int hash;      /**< Full hash of a string key, so that
+                           * chain walks can skip strcmp() on
+                           * most mismatches and rebuilding the
+                           * table need not rehash the strings.
+                           * Unused for other key types.
+                           */
 };
 
 /**
@@ -322,6 +329,9 @@ _dbus_hash_table_new (DBusHashType     type,
   table->mask = 3;
   table->key_type = type;
 
+  if (type == DBUS_HASH_STRING || type == DBUS_HASH_TWO_STRINGS)
+    _dbus_hash_key_init ();
+
   _dbus_assert (table->mask < table->n_buckets);
   
   switch (table->key_type)
@@ -801,16 +811,38 @@ _dbus_hash_iter_lookup (DBusHashTable *table,
   return TRUE;
 }
 
+/* The bucket an entry belongs in for the table's current size */
+static unsigned int
+entry_bucket_index (DBusHashTable *table,
+                    DBusHashEntry *entry)
+{
+  switch (table->key_type)
+    {
+    case DBUS_HASH_STRING:
+    case DBUS_HASH_TWO_STRINGS:
+      return entry->hash & table->mask;
+    case DBUS_HASH_INT:
+    case DBUS_HASH_UINTPTR:
+    case DBUS_HASH_POINTER:
+      return RANDOM_INDEX (table, entry->key);
+    default:
+      _dbus_assert_not_reached ("Unknown hash table type");
+      return 0;
+    }
+}
+
 static void
 add_allocated_entry (DBusHashTable   *table,
                      DBusHashEntry   *entry,
                      unsigned int     idx,
+                     unsigned int     hash,
                      void            *key,
                      DBusHashEntry ***bucket)
 {
   DBusHashEntry **b;  
   
   entry->key = key;
+  entry->hash = hash;
   
   b = &(table->buckets[idx]);
   entry->next = *b;
@@ -826,12 +858,19 @@ add_allocated_entry (DBusHashTable   *table,
    */
   if (table->n_entries >= table->hi_rebuild_size ||
       table->n_entries < table->lo_rebuild_size)
-    rebuild_table (table);
+    {
+      rebuild_table (table);
+
+      /* the entry is in a new bucket array now */
+      if (bucket)
+        *bucket = &(table->buckets[entry_bucket_index (table, entry)]);
+    }
 }
 
 static DBusHashEntry*
 add_entry (DBusHashTable        *table, 
            unsigned int          idx,
+           unsigned int          hash,
            void                 *key,
            DBusHashEntry      ***bucket,
            DBusPreallocatedHash *preallocated)
@@ -853,25 +892,111 @@ add_entry (DBusHashTable        *table,
       entry = (DBusHashEntry*) preallocated;
     }
 
-  add_allocated_entry (table, entry, idx, key, bucket);
+  add_allocated_entry (table, entry, idx, hash, key, bucket);
 
   return entry;
 }
 
-/* This is g_str_hash from GLib which was
- * extensively discussed/tested/profiled
+/* String keys are hashed with SipHash-1-3 under a key chosen at
+ * random once per process. Bus names, interfaces and match rule keys
+ * come from clients, and with an unkeyed hash a client can pick
+ * strings that all land in one bucket and turn every lookup into a
+ * walk of the whole table.
+ *
+ * The key is chosen when the first table of strings is created and
+ * never changes after that, so hashing reads it without the lock;
+ * only creating a table takes it.
+ */
+static dbus_uint64_t hash_key[2];
+static dbus_bool_t hash_key_set = FALSE;
+_DBUS_DEFINE_GLOBAL_LOCK (hash_key);
+
+/**
+ * Chooses the key that strings are hashed with, if that hasn't
+ * happened yet. #DBusHashTable does this when a table with string
+ * keys is created; callers that keep their own table of strings and
+ * hash them with _dbus_hash_string() must call it when they create
+ * the table, before hashing anything.
+ */
+void
+_dbus_hash_key_init (void)
+{
+  _DBUS_LOCK (hash_key);
+  if (!hash_key_set)
+    {
+      _dbus_generate_random_bytes_buffer ((char *) hash_key,
+                                          sizeof (hash_key));
+      hash_key_set = TRUE;
+    }
+  _DBUS_UNLOCK (hash_key);
+}
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                    \
+  do {                                                              \
+    v0 += v1; v1 = ROTL64 (v1, 13); v1 ^= v0; v0 = ROTL64 (v0, 32); \
+    v2 += v3; v3 = ROTL64 (v3, 16); v3 ^= v2;                       \
+    v0 += v3; v3 = ROTL64 (v3, 21); v3 ^= v0;                       \
+    v2 += v1; v1 = ROTL64 (v1, 17); v1 ^= v2; v2 = ROTL64 (v2, 32); \
+  } while (0)
+
+/* Hashes len bytes eight at a time. Words are read in host byte
+ * order, which is fine since the hashes never leave the process.
  */
 static unsigned int
-string_hash (const char *str)
+sip_hash (const char *data,
+          size_t      len)
 {
-  const char *p = str;
-  unsigned int h = *p;
+  const unsigned char *p = (const unsigned char *) data;
+  const unsigned char *end = p + (len & ~(size_t) 7);
+  dbus_uint64_t v0 = hash_key[0] ^ DBUS_UINT64_CONSTANT (0x736f6d6570736575);
+  dbus_uint64_t v1 = hash_key[1] ^ DBUS_UINT64_CONSTANT (0x646f72616e646f6d);
+  dbus_uint64_t v2 = hash_key[0] ^ DBUS_UINT64_CONSTANT (0x6c7967656e657261);
+  dbus_uint64_t v3 = hash_key[1] ^ DBUS_UINT64_CONSTANT (0x7465646279746573);
+  dbus_uint64_t m;
+  dbus_uint64_t b;
+
+  for (; p != end; p += 8)
+    {
+      memcpy (&m, p, 8);
+      v3 ^= m;
+      SIPROUND;
+      v0 ^= m;
+    }
+
+  b = ((dbus_uint64_t) len) << 56;
+  switch (len & 7)
+    {
+    case 7: b |= ((dbus_uint64_t) p[6]) << 48; /* fall through */
+    case 6: b |= ((dbus_uint64_t) p[5]) << 40; /* fall through */
+    case 5: b |= ((dbus_uint64_t) p[4]) << 32; /* fall through */
+    case 4: b |= ((dbus_uint64_t) p[3]) << 24; /* fall through */
+    case 3: b |= ((dbus_uint64_t) p[2]) << 16; /* fall through */
+    case 2: b |= ((dbus_uint64_t) p[1]) << 8;  /* fall through */
+    case 1: b |= ((dbus_uint64_t) p[0]);       /* fall through */
+    case 0: break;
+    }
+
+  v3 ^= b;
+  SIPROUND;
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
 
-  if (h)
-    for (p += 1; *p != '\0'; p++)
-      h = (h << 5) - h + *p;
+  b = v0 ^ v1 ^ v2 ^ v3;
 
-  return h;
+  return (unsigned int) (b ^ (b >> 32));
+}
+
+/* Only called on tables that exist, so the key has been set */
+static unsigned int
+string_hash (const char *str)
+{
+  return sip_hash (str, strlen (str));
 }
 
 #ifdef DBUS_BUILD_TESTS
@@ -881,26 +1006,38 @@ string_hash (const char *str)
 static unsigned int
 two_strings_hash (const char *str)
 {
-  const char *p = str;
-  unsigned int h = *p;
+  size_t len_a = strlen (str);
 
-  if (h)
-    for (p += 1; *p != '\0'; p++)
-      h = (h << 5) - h + *p;
-
-  for (p += 1; *p != '\0'; p++)
-    h = (h << 5) - h + *p;
-  
-  return h;
+  return sip_hash (str, len_a + 1 + strlen (str + len_a + 1));
 }
 #endif /* DBUS_BUILD_TESTS */
 
+/**
+ * Hashes a string the way string keys of a #DBusHashTable are
+ * hashed, for callers that keep their own table of strings. The
+ * value differs from one process to the next. _dbus_hash_key_init()
+ * must have been called first.
+ *
+ * @param str the string
+ * @param len its length in bytes
+ * @returns the hash
+ */
+unsigned int
+_dbus_hash_string (const char *str,
+                   size_t      len)
+{
+  _dbus_assert (hash_key_set);
+
+  return sip_hash (str, len);
+}
+
 /** Key comparison function */
 typedef int (* KeyCompareFunc) (const void *key_a, const void *key_b);
 
 static DBusHashEntry*
 find_generic_function (DBusHashTable        *table,
                        void                 *key,
+                       unsigned int          hash,
                        unsigned int          idx,
                        KeyCompareFunc        compare_func,
                        dbus_bool_t           create_if_not_found,
@@ -917,7 +1054,8 @@ find_generic_function (DBusHashTable        *table,
   while (entry != NULL)
     {
       if ((compare_func == NULL && key == entry->key) ||
-          (compare_func != NULL && (* compare_func) (key, entry->key) == 0))
+          (compare_func != NULL && hash == entry->hash &&
+           (* compare_func) (key, entry->key) == 0))
         {
           if (bucket)
             *bucket = &(table->buckets[idx]);
@@ -932,7 +1070,7 @@ find_generic_function (DBusHashTable        *table,
     }
 
   if (create_if_not_found)
-    entry = add_entry (table, idx, key, bucket, preallocated);
+    entry = add_entry (table, idx, hash, key, bucket, preallocated);
   else if (preallocated)
     _dbus_hash_table_free_preallocated_entry (table, preallocated);
   
@@ -946,11 +1084,13 @@ find_string_function (DBusHashTable        *table,
                       DBusHashEntry      ***bucket,
                       DBusPreallocatedHash *preallocated)
 {
+  unsigned int hash;
   unsigned int idx;
   
-  idx = string_hash (key) & table->mask;
+  hash = string_hash (key);
+  idx = hash & table->mask;
 
-  return find_generic_function (table, key, idx,
+  return find_generic_function (table, key, hash, idx,
                                 (KeyCompareFunc) strcmp, create_if_not_found, bucket,
                                 preallocated);
 }
@@ -983,11 +1123,13 @@ find_two_strings_function (DBusHashTable        *table,
                            DBusHashEntry      ***bucket,
                            DBusPreallocatedHash *preallocated)
 {
+  unsigned int hash;
   unsigned int idx;
   
-  idx = two_strings_hash (key) & table->mask;
+  hash = two_strings_hash (key);
+  idx = hash & table->mask;
 
-  return find_generic_function (table, key, idx,
+  return find_generic_function (table, key, hash, idx,
                                 (KeyCompareFunc) two_strings_cmp, create_if_not_found, bucket,
                                 preallocated);
 }
@@ -1005,7 +1147,7 @@ find_direct_function (DBusHashTable        *table,
   idx = RANDOM_INDEX (table, key) & table->mask;
 
 
-  return find_generic_function (table, key, idx,
+  return find_generic_function (table, key, 0, idx,
                                 NULL, create_if_not_found, bucket,
                                 preallocated);
 }
@@ -1102,29 +1244,7 @@ rebuild_table (DBusHashTable *table)
           DBusHashEntry **bucket;
           
           *old_chain = entry->next;
-          switch (table->key_type)
-            {
-            case DBUS_HASH_STRING:
-              idx = string_hash (entry->key) & table->mask;
-              break;
-            case DBUS_HASH_TWO_STRINGS:
-#ifdef DBUS_BUILD_TESTS
-              idx = two_strings_hash (entry->key) & table->mask;
-#else
-              idx = 0;
-              _dbus_assert_not_reached ("two-strings is not enabled");
-#endif
-              break;
-            case DBUS_HASH_INT:
-            case DBUS_HASH_UINTPTR:
-            case DBUS_HASH_POINTER:
-              idx = RANDOM_INDEX (table, entry->key);
-              break;
-            default:
-              idx = 0;
-              _dbus_assert_not_reached ("Unknown hash table type");
-              break;
-            }
+          idx = entry_bucket_index (table, entry);
           
           bucket = &(table->buckets[idx]);
           entry->next = *bucket;
@@ -1704,6 +1824,28 @@ _dbus_hash_table_get_n_entries (DBusHashTable *table)
   return table->n_entries;
 }
 
+/**
+ * Shrinks the bucket array to suit the number of entries left.
+ * Tables only resize while entries are added, so one that was
+ * once large keeps all its buckets after the entries are removed
+ * until this is called. Must not be called while iterating.
+ *
+ * @param table the hash table.
+ */
+void
+_dbus_hash_table_compact (DBusHashTable *table)
+{
+  while (table->n_entries < table->lo_rebuild_size)
+    {
+      int old_n_buckets = table->n_buckets;
+
+      rebuild_table (table);
+
+      if (table->n_buckets == old_n_buckets)
+        break; /* as small as it goes, or no memory */
+    }
+}
+
 /** @} */
 
 #ifdef DBUS_BUILD_TESTS
@@ -1910,9 +2052,28 @@ _dbus_hash_test (void)
       _dbus_assert (count_entries (table3) == i);
       _dbus_assert (count_entries (table4) == i);
 
+      /* shrinking leaves the rest findable */
+      if (i == N_HASH_KEYS / 8)
+        {
+          int j;
+
+          _dbus_hash_table_compact (table1);
+          _dbus_hash_table_compact (table2);
+          _dbus_assert (table2->n_entries >= table2->lo_rebuild_size);
+
+          for (j = 0; j < i; j++)
+            {
+              _dbus_assert (_dbus_hash_table_lookup_string (table1, keys[j]) != NULL);
+              _dbus_assert (_dbus_hash_table_lookup_int (table2, j) != NULL);
+            }
+        }
+
       --i;
     }
 
+  _dbus_hash_table_compact (table2);
+  _dbus_assert (table2->n_buckets == DBUS_SMALL_HASH_TABLE);
+
   _dbus_hash_table_ref (table1);
   _dbus_hash_table_ref (table2);
   _dbus_hash_table_ref (table3);
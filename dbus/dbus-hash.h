@@ -130,6 +130,10 @@ dbus_bool_t    _dbus_hash_table_insert_uintptr     (DBusHashTable    *table,
                                                     uintptr_t         key,
                                                     void             *value);
 int            _dbus_hash_table_get_n_entries      (DBusHashTable    *table);
+void           _dbus_hash_table_compact            (DBusHashTable    *table);
+void           _dbus_hash_key_init                 (void);
+unsigned int   _dbus_hash_string                   (const char       *str,
+                                                    size_t            len);
 
 /* Preallocation */
 
@@ -294,6 +294,34 @@ dbus_bool_t _dbus_test_oom_handling (const char             *description,
 #define _dbus_get_malloc_blocks_outstanding  (0)
 #endif /* !DBUS_BUILD_TESTS */
 
+/* What a block of memory is held for; the bus daemon reports how
+ * much each one holds
+ */
+typedef enum
+{
+  DBUS_MEMORY_MATCH_RULES,  /**< match rules added with AddMatch */
+  DBUS_MEMORY_POLICY,       /**< policy rules and per-connection policies */
+  DBUS_MEMORY_LOADERS,      /**< message loader buffers */
+  DBUS_MEMORY_OUTGOING,     /**< messages queued for sending, per queue */
+  DBUS_MEMORY_REGISTRY,     /**< services and their owners */
+  DBUS_MEMORY_ACTIVATION,   /**< activatable services and activations */
+  DBUS_MEMORY_N_TAGS
+} DBusMemoryTag;
+
+extern dbus_bool_t _dbus_memory_accounting_enabled;
+
+#define _dbus_memory_account(tag, bytes)                                 \
+  do {                                                                   \
+    if (_dbus_memory_accounting_enabled)                                 \
+      _dbus_memory_account_bytes ((tag), (bytes));                       \
+  } while (0)
+
+void        _dbus_memory_set_accounting (dbus_bool_t    enabled);
+void        _dbus_memory_account_bytes  (DBusMemoryTag  tag,
+                                         long           bytes);
+long        _dbus_memory_get_accounted  (DBusMemoryTag  tag);
+const char *_dbus_memory_tag_name       (DBusMemoryTag  tag);
+
 typedef void (* DBusShutdownFunction) (void *data);
 dbus_bool_t _dbus_register_shutdown_func (DBusShutdownFunction  function,
                                           void                 *data);
@@ -324,12 +352,17 @@ _DBUS_DECLARE_GLOBAL_LOCK (shared_connections);
 _DBUS_DECLARE_GLOBAL_LOCK (win_fds);
 _DBUS_DECLARE_GLOBAL_LOCK (sid_atom_cache);
 _DBUS_DECLARE_GLOBAL_LOCK (machine_uuid);
+/* 15-18 */
+_DBUS_DECLARE_GLOBAL_LOCK (keyring_cache);
+_DBUS_DECLARE_GLOBAL_LOCK (hash_key);
+_DBUS_DECLARE_GLOBAL_LOCK (signature_cache);
+_DBUS_DECLARE_GLOBAL_LOCK (autolaunch);
 
 #if !DBUS_USE_SYNC
 _DBUS_DECLARE_GLOBAL_LOCK (atomic);
-#define _DBUS_N_GLOBAL_LOCKS (15)
+#define _DBUS_N_GLOBAL_LOCKS (19)
 #else
-#define _DBUS_N_GLOBAL_LOCKS (14)
+#define _DBUS_N_GLOBAL_LOCKS (18)
 #endif
 
 dbus_bool_t _dbus_threads_init_debug (void);
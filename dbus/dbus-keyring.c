@@ -76,6 +76,15 @@
  */
 #define MAX_TIME_TRAVEL_SECONDS (60*5)
 
+/**
+ * How long a keyring read from the file is handed out again to the
+ * next auth conversation for the same user and context, instead of
+ * reading the file again. A client that is sent a key ID it doesn't
+ * have rereads the file anyway, so this only bounds how long a server
+ * keeps offering a key from a file someone deleted.
+ */
+#define KEYRING_CACHE_SECONDS 60
+
 /**
  * Maximum number of keys in the keyring before
  * we just ignore the rest
@@ -117,8 +126,19 @@ struct DBusKeyring
   DBusKey *keys; /**< Keys loaded from the file */
   int n_keys;    /**< Number of keys */
   DBusCredentials *credentials; /**< Credentials containing user the keyring is for */
+  long load_time; /**< When the keys were last read from the file */
 };
 
+/* Every auth conversation used to read the keyring file again, which
+ * on NFS home directories is what made DBUS_COOKIE_SHA1 slow. The last
+ * keyring opened is kept here and shared. A shared keyring can be used
+ * from more than one connection's thread, so this lock also covers its
+ * refcount and its keys.
+ */
+_DBUS_DEFINE_GLOBAL_LOCK (keyring_cache);
+static DBusKeyring *cached_keyring = NULL;
+static dbus_bool_t keyring_cache_shutdown_registered = FALSE;
+
 static DBusKeyring*
 _dbus_keyring_new (void)
 {
@@ -193,14 +213,21 @@ free_keys (DBusKey *keys,
 #define MAX_LOCK_TIMEOUTS 32
 /** Length of each timeout while waiting for a lock */
 #define LOCK_TIMEOUT_MILLISECONDS 250
+/** Length of the first timeout; doubled each time up to LOCK_TIMEOUT_MILLISECONDS.
+ * The lock is only held while a key is added, so it is usually free again
+ * long before a full timeout.
+ */
+#define FIRST_LOCK_TIMEOUT_MILLISECONDS 10
 
 static dbus_bool_t
 _dbus_keyring_lock (DBusKeyring *keyring)
 {
-  int n_timeouts;
+  int waited;
+  int timeout;
   
-  n_timeouts = 0;
-  while (n_timeouts < MAX_LOCK_TIMEOUTS)
+  waited = 0;
+  timeout = FIRST_LOCK_TIMEOUT_MILLISECONDS;
+  while (waited < MAX_LOCK_TIMEOUTS * LOCK_TIMEOUT_MILLISECONDS)
     {
       DBusError error = DBUS_ERROR_INIT;
 
@@ -209,20 +236,21 @@ _dbus_keyring_lock (DBusKeyring *keyring)
         break;
 
       _dbus_verbose ("Did not get lock file, sleeping %d milliseconds (%s)\n",
-                     LOCK_TIMEOUT_MILLISECONDS, error.message);
+                     timeout, error.message);
       dbus_error_free (&error);
 
-      _dbus_sleep_milliseconds (LOCK_TIMEOUT_MILLISECONDS);
-      
-      ++n_timeouts;
+      _dbus_sleep_milliseconds (timeout);
+
+      waited += timeout;
+      timeout = MIN (timeout * 2, LOCK_TIMEOUT_MILLISECONDS);
     }
 
-  if (n_timeouts == MAX_LOCK_TIMEOUTS)
+  if (waited >= MAX_LOCK_TIMEOUTS * LOCK_TIMEOUT_MILLISECONDS)
     {
       DBusError error = DBUS_ERROR_INIT;
 
-      _dbus_verbose ("Lock file timed out %d times, assuming stale\n",
-                     n_timeouts);
+      _dbus_verbose ("Lock file timed out after %d milliseconds, assuming stale\n",
+                     waited);
 
       if (!_dbus_delete_file (&keyring->filename_lock, &error))
         {
@@ -258,6 +286,17 @@ _dbus_keyring_unlock (DBusKeyring *keyring)
     }
 }
 
+/* realloc() moved the keys, and short secrets live inside them */
+static void
+relocate_keys (DBusKey *keys,
+               int      n_keys)
+{
+  int i;
+
+  for (i = 0; i < n_keys; i++)
+    _dbus_string_relocated (&keys[i].secret);
+}
+
 static DBusKey*
 find_key_by_id (DBusKey *keys,
                 int      n_keys,
@@ -346,6 +385,7 @@ add_new_key (DBusKey  **keys_p,
 
   keys = new;
   *keys_p = keys; /* otherwise *keys_p ends up invalid */
+  relocate_keys (keys, n_keys);
   n_keys += 1;
 
   if (!_dbus_string_init (&keys[n_keys-1].secret))
@@ -530,6 +570,7 @@ _dbus_keyring_reload (DBusKeyring *keyring,
         }
 
       keys = new;
+      relocate_keys (keys, n_keys);
       n_keys += 1;
 
       if (!_dbus_string_init (&keys[n_keys-1].secret))
@@ -613,6 +654,7 @@ _dbus_keyring_reload (DBusKeyring *keyring,
     free_keys (keyring->keys, keyring->n_keys);
   keyring->keys = keys;
   keyring->n_keys = n_keys;
+  keyring->load_time = now;
   keys = NULL;
   n_keys = 0;
   
@@ -668,7 +710,9 @@ _dbus_keyring_reload (DBusKeyring *keyring,
 DBusKeyring *
 _dbus_keyring_ref (DBusKeyring *keyring)
 {
+  _DBUS_LOCK (keyring_cache);
   keyring->refcount += 1;
+  _DBUS_UNLOCK (keyring_cache);
 
   return keyring;
 }
@@ -682,9 +726,14 @@ _dbus_keyring_ref (DBusKeyring *keyring)
 void
 _dbus_keyring_unref (DBusKeyring *keyring)
 {
+  dbus_bool_t last_unref;
+
+  _DBUS_LOCK (keyring_cache);
   keyring->refcount -= 1;
+  last_unref = keyring->refcount == 0;
+  _DBUS_UNLOCK (keyring_cache);
 
-  if (keyring->refcount == 0)
+  if (last_unref)
     {
       if (keyring->credentials)
         _dbus_credentials_unref (keyring->credentials);
@@ -697,11 +746,92 @@ _dbus_keyring_unref (DBusKeyring *keyring)
     }
 }
 
+static void
+keyring_cache_shutdown (void *data)
+{
+  DBusKeyring *keyring;
+
+  _DBUS_LOCK (keyring_cache);
+  keyring = cached_keyring;
+  cached_keyring = NULL;
+  keyring_cache_shutdown_registered = FALSE;
+  _DBUS_UNLOCK (keyring_cache);
+
+  if (keyring)
+    _dbus_keyring_unref (keyring);
+}
+
+/* Returns a new ref to the cached keyring if it is for the same user
+ * and file as @p candidate and was read recently enough, or #NULL.
+ */
+static DBusKeyring*
+keyring_cache_lookup (DBusKeyring *candidate)
+{
+  DBusKeyring *keyring;
+  long now;
+
+  _dbus_get_current_time (&now, NULL);
+
+  keyring = NULL;
+
+  _DBUS_LOCK (keyring_cache);
+
+  if (cached_keyring != NULL &&
+      now >= cached_keyring->load_time &&
+      now - cached_keyring->load_time < KEYRING_CACHE_SECONDS &&
+      _dbus_string_equal (&cached_keyring->filename, &candidate->filename) &&
+      _dbus_credentials_same_user (cached_keyring->credentials,
+                                   candidate->credentials))
+    {
+      keyring = cached_keyring;
+      keyring->refcount += 1;
+    }
+
+  _DBUS_UNLOCK (keyring_cache);
+
+  return keyring;
+}
+
+/* Makes @p keyring the one handed out by keyring_cache_lookup(). Only
+ * an optimization, so running out of memory just means not caching.
+ */
+static void
+keyring_cache_store (DBusKeyring *keyring)
+{
+  DBusKeyring *old;
+
+  _DBUS_LOCK (keyring_cache);
+
+  if (!keyring_cache_shutdown_registered)
+    {
+      if (!_dbus_register_shutdown_func (keyring_cache_shutdown, NULL))
+        {
+          _DBUS_UNLOCK (keyring_cache);
+          return;
+        }
+
+      keyring_cache_shutdown_registered = TRUE;
+    }
+
+  old = cached_keyring;
+  cached_keyring = keyring;
+  keyring->refcount += 1;
+
+  _DBUS_UNLOCK (keyring_cache);
+
+  if (old)
+    _dbus_keyring_unref (old);
+}
+
 /**
  * Creates a new keyring that lives in the ~/.dbus-keyrings directory
  * of the given user credentials. If the credentials are #NULL or
  * empty, uses those of the current process.
  *
+ * The keyring may be shared with earlier callers for the same user
+ * and context; the file is only reread when a key is missing or the
+ * shared copy is older than #KEYRING_CACHE_SECONDS.
+ *
  * @param username username to get keyring for, or #NULL
  * @param context which keyring to get
  * @param error return location for errors
@@ -717,6 +847,7 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
   dbus_bool_t error_set;
   DBusError tmp_error;
   DBusCredentials *our_credentials;
+  DBusKeyring *cached;
   
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   
@@ -792,6 +923,16 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
   if (!_dbus_string_append (&keyring->filename_lock, ".lock"))
     goto failed;
 
+  cached = keyring_cache_lookup (keyring);
+  if (cached != NULL)
+    {
+      _dbus_verbose ("reusing cached keyring %s\n",
+                     _dbus_string_get_const_data (&cached->filename));
+      _dbus_keyring_unref (keyring);
+      _dbus_string_free (&ringdir);
+      return cached;
+    }
+
   /* Reload keyring */
   dbus_error_init (&tmp_error);
   if (!_dbus_keyring_reload (keyring, FALSE, &tmp_error))
@@ -814,6 +955,8 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
       dbus_error_free (&tmp_error);
     }
 
+  keyring_cache_store (keyring);
+
   _dbus_string_free (&ringdir);
   
   return keyring;
@@ -945,30 +1088,40 @@ _dbus_keyring_get_best_key (DBusKeyring  *keyring,
                             DBusError    *error)
 {
   DBusKey *key;
+  int id;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-  
+
+  _DBUS_LOCK (keyring_cache);
+
+  id = -1;
+
   key = find_recent_key (keyring);
   if (key)
-    return key->id;
+    {
+      id = key->id;
+      goto out;
+    }
 
   /* All our keys are too old, or we've never loaded the
    * keyring. Create a new one.
    */
   if (!_dbus_keyring_reload (keyring, TRUE,
                              error))
-    return -1;
+    goto out;
 
   key = find_recent_key (keyring);
   if (key)
-    return key->id;
+    id = key->id;
   else
-    {
-      dbus_set_error_const (error,
-                            DBUS_ERROR_FAILED,
-                            "No recent-enough key found in keyring, and unable to create a new key");
-      return -1;
-    }
+    dbus_set_error_const (error,
+                          DBUS_ERROR_FAILED,
+                          "No recent-enough key found in keyring, and unable to create a new key");
+
+ out:
+  _DBUS_UNLOCK (keyring_cache);
+
+  return id;
 }
 
 /**
@@ -993,6 +1146,9 @@ _dbus_keyring_is_for_credentials (DBusKeyring           *keyring,
  * but empty key on any other error such as unknown
  * key ID.
  *
+ * An ID we don't have may be a key the server added after we read the
+ * file, so the file is read again once before giving up.
+ *
  * @param keyring the keyring
  * @param key_id the key ID
  * @param hex_key string to append hex-encoded key to
@@ -1004,16 +1160,42 @@ _dbus_keyring_get_hex_key (DBusKeyring       *keyring,
                            DBusString        *hex_key)
 {
   DBusKey *key;
+  dbus_bool_t retval;
+
+  _DBUS_LOCK (keyring_cache);
 
   key = find_key_by_id (keyring->keys,
                         keyring->n_keys,
                         key_id);
   if (key == NULL)
-    return TRUE; /* had enough memory, so TRUE */
+    {
+      DBusError error = DBUS_ERROR_INIT;
+
+      _dbus_verbose ("no key %d in keyring, rereading it\n", key_id);
+
+      if (!_dbus_keyring_reload (keyring, FALSE, &error))
+        {
+          retval = !dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY);
+          dbus_error_free (&error);
+          goto out;
+        }
+
+      key = find_key_by_id (keyring->keys,
+                            keyring->n_keys,
+                            key_id);
+    }
 
-  return _dbus_string_hex_encode (&key->secret, 0,
-                                  hex_key,
-                                  _dbus_string_get_length (hex_key));
+  if (key == NULL)
+    retval = TRUE; /* had enough memory, so TRUE */
+  else
+    retval = _dbus_string_hex_encode (&key->secret, 0,
+                                      hex_key,
+                                      _dbus_string_get_length (hex_key));
+
+ out:
+  _DBUS_UNLOCK (keyring_cache);
+
+  return retval;
 }
 
 /** @} */ /* end of exposed API */
@@ -1028,12 +1210,15 @@ _dbus_keyring_test (void)
   DBusString context;
   DBusKeyring *ring1;
   DBusKeyring *ring2;
+  DBusKeyring *ring3;
+  DBusString hex_key;
   int id;
   DBusError error;
   int i;
 
   ring1 = NULL;
   ring2 = NULL;
+  ring3 = NULL;
   
   /* Context validation */
   
@@ -1087,9 +1272,13 @@ _dbus_keyring_test (void)
       goto failure;
     }
 
+  /* Make ring2 read the file rather than share ring1 */
+  keyring_cache_shutdown (NULL);
+
   ring2 = _dbus_keyring_new_for_credentials (NULL, &context, &error);
   _dbus_assert (ring2 != NULL);
   _dbus_assert (error.name == NULL);
+  _dbus_assert (ring2 != ring1);
   
   if (ring1->n_keys != ring2->n_keys)
     {
@@ -1129,6 +1318,30 @@ _dbus_keyring_test (void)
 
   printf (" %d keys in test\n", ring1->n_keys);
 
+  /* The next auth conversation gets the keyring that was just read */
+  ring3 = _dbus_keyring_new_for_credentials (NULL, &context, &error);
+  _dbus_assert (ring3 == ring2);
+  _dbus_keyring_unref (ring3);
+
+  /* A key added to the file after ring2 read it is found by rereading */
+  if (!_dbus_keyring_reload (ring1, TRUE, &error))
+    {
+      fprintf (stderr, "Could not add a key: %s\n", error.message);
+      dbus_error_free (&error);
+      goto failure;
+    }
+
+  id = ring1->keys[ring1->n_keys - 1].id;
+  _dbus_assert (find_key_by_id (ring2->keys, ring2->n_keys, id) == NULL);
+
+  if (!_dbus_string_init (&hex_key))
+    _dbus_assert_not_reached ("no memory");
+  if (!_dbus_keyring_get_hex_key (ring2, id, &hex_key))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (find_key_by_id (ring2->keys, ring2->n_keys, id) != NULL);
+  _dbus_assert (_dbus_string_get_length (&hex_key) > 0);
+  _dbus_string_free (&hex_key);
+
   /* Test ref/unref */
   _dbus_keyring_ref (ring1);
   _dbus_keyring_ref (ring2);
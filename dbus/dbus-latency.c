@@ -0,0 +1,170 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-latency.c Per-stage latency histograms
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-latency.h"
+#include <string.h>
+
+/**
+ * @defgroup DBusLatency latency histograms
+ * @ingroup  DBusInternals
+ * @brief Time spent in each stage of moving a message
+ *
+ * When enabled, the stages listed in #DBusLatencyStage note how long
+ * each pass took in a log-linear histogram: exact microseconds up to
+ * 3, then four buckets for each power of two, so every bucket is
+ * within 25% of its neighbours. Recording is a clock read and an
+ * increment; when disabled it's a single test of a global.
+ *
+ * The histograms are plain process-wide counters with no locking.
+ * Only the bus daemon turns them on, and it runs its whole main loop
+ * in one thread.
+ *
+ * @{
+ */
+
+/** Whether stages are being timed, see _dbus_latency_set_enabled() */
+dbus_bool_t _dbus_latency_enabled = FALSE;
+
+static dbus_uint32_t histograms[DBUS_LATENCY_N_STAGES][DBUS_LATENCY_N_BUCKETS];
+
+static const char *stage_names[DBUS_LATENCY_N_STAGES] = {
+  "read",
+  "parse",
+  "dispatch",
+  "match",
+  "policy",
+  "write"
+};
+
+static int
+bucket_for_usec (long usec)
+{
+  int bit;
+  int bucket;
+
+  if (usec < 4)
+    return usec < 0 ? 0 : usec;
+
+  /* index of the highest set bit, at least 2 here */
+  bit = 2;
+  while ((usec >> (bit + 1)) != 0)
+    ++bit;
+
+  bucket = 4 + (bit - 2) * 4 + ((usec >> (bit - 2)) & 3);
+
+  return bucket < DBUS_LATENCY_N_BUCKETS ? bucket : DBUS_LATENCY_N_BUCKETS - 1;
+}
+
+/**
+ * Turns collection on or off. Turning it on starts the histograms
+ * again from empty.
+ *
+ * @param enabled #TRUE to time stages
+ */
+void
+_dbus_latency_set_enabled (dbus_bool_t enabled)
+{
+  if (enabled && !_dbus_latency_enabled)
+    memset (histograms, 0, sizeof (histograms));
+
+  _dbus_latency_enabled = enabled;
+}
+
+/**
+ * Notes that a stage begun at start has just finished. Use
+ * _dbus_latency_end() rather than calling this directly.
+ *
+ * @param stage the stage
+ * @param start filled in by _dbus_latency_begin()
+ */
+void
+_dbus_latency_record (DBusLatencyStage        stage,
+                      const DBusLatencyStart *start)
+{
+  long sec, usec;
+  long elapsed;
+
+  _dbus_assert (stage < DBUS_LATENCY_N_STAGES);
+
+  _dbus_get_current_time (&sec, &usec);
+
+  /* the last bucket starts below a minute; this keeps a long in range */
+  if (sec - start->tv_sec > 60)
+    elapsed = 60 * 1000000L;
+  else
+    elapsed = (sec - start->tv_sec) * 1000000L + (usec - start->tv_usec);
+
+  histograms[stage][bucket_for_usec (elapsed)] += 1;
+}
+
+/**
+ * Gets the name of a stage, for reports.
+ *
+ * @param stage the stage
+ * @returns a short lowercase name
+ */
+const char *
+_dbus_latency_stage_name (DBusLatencyStage stage)
+{
+  _dbus_assert (stage < DBUS_LATENCY_N_STAGES);
+
+  return stage_names[stage];
+}
+
+/**
+ * Gets the smallest latency that lands in a bucket; a bucket covers
+ * everything up to the next bucket's lower bound.
+ *
+ * @param bucket the bucket, less than #DBUS_LATENCY_N_BUCKETS
+ * @returns the lower bound in microseconds
+ */
+long
+_dbus_latency_bucket_lower_bound (int bucket)
+{
+  int bit;
+
+  _dbus_assert (bucket >= 0 && bucket < DBUS_LATENCY_N_BUCKETS);
+
+  if (bucket < 4)
+    return bucket;
+
+  bit = 2 + (bucket - 4) / 4;
+
+  return (long) (4 + (bucket - 4) % 4) << (bit - 2);
+}
+
+/**
+ * Copies out a stage's histogram.
+ *
+ * @param stage the stage
+ * @param counts array of #DBUS_LATENCY_N_BUCKETS to fill in
+ */
+void
+_dbus_latency_get_counts (DBusLatencyStage  stage,
+                          dbus_uint32_t    *counts)
+{
+  _dbus_assert (stage < DBUS_LATENCY_N_STAGES);
+
+  memcpy (counts, histograms[stage], sizeof (histograms[stage]));
+}
+
+/** @} */
@@ -0,0 +1,78 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-latency.h Per-stage latency histograms
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef DBUS_LATENCY_H
+#define DBUS_LATENCY_H
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+
+DBUS_BEGIN_DECLS
+
+/* Stages nest: reading includes parsing whatever was read, and
+ * dispatch includes matchmaking and policy checks.
+ */
+typedef enum
+{
+  DBUS_LATENCY_READ,     /**< do_reading() on a socket transport */
+  DBUS_LATENCY_PARSE,    /**< _dbus_message_loader_queue_messages() */
+  DBUS_LATENCY_DISPATCH, /**< bus_dispatch() */
+  DBUS_LATENCY_MATCH,    /**< bus_matchmaker_get_recipients() */
+  DBUS_LATENCY_POLICY,   /**< bus_context_check_security_policy() */
+  DBUS_LATENCY_WRITE,    /**< do_writing() on a socket transport */
+  DBUS_LATENCY_N_STAGES
+} DBusLatencyStage;
+
+/* 4 exact buckets for 0-3us, then 4 per power of two up to 2^25us */
+#define DBUS_LATENCY_N_BUCKETS 96
+
+typedef struct
+{
+  long tv_sec;  /**< -1 if collection was off when the stage began */
+  long tv_usec;
+} DBusLatencyStart;
+
+extern dbus_bool_t _dbus_latency_enabled;
+
+#define _dbus_latency_begin(start)                                       \
+  do {                                                                   \
+    (start)->tv_sec = -1;                                                \
+    if (_dbus_latency_enabled)                                           \
+      _dbus_get_current_time (&(start)->tv_sec, &(start)->tv_usec);      \
+  } while (0)
+
+#define _dbus_latency_end(stage, start)                                  \
+  do {                                                                   \
+    if ((start)->tv_sec >= 0)                                            \
+      _dbus_latency_record ((stage), (start));                           \
+  } while (0)
+
+void          _dbus_latency_set_enabled        (dbus_bool_t             enabled);
+void          _dbus_latency_record             (DBusLatencyStage        stage,
+                                                const DBusLatencyStart *start);
+const char   *_dbus_latency_stage_name         (DBusLatencyStage        stage);
+long          _dbus_latency_bucket_lower_bound (int                     bucket);
+void          _dbus_latency_get_counts         (DBusLatencyStage        stage,
+                                                dbus_uint32_t          *counts);
+
+DBUS_END_DECLS
+
+#endif /* DBUS_LATENCY_H */
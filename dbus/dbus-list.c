@@ -542,7 +542,7 @@ _dbus_list_remove_link (DBusList **list,
 /**
  * Frees all links in the list and sets the list head to #NULL. Does
  * not free the data in each link, for obvious reasons. This is a
- * linear-time operation.
+ * linear-time operation, but takes the link pool lock only once.
  *
  * @param list address of the list head.
  */
@@ -552,15 +552,28 @@ _dbus_list_clear (DBusList **list)
   DBusList *link;
 
   link = *list;
+  if (link == NULL)
+    return;
+
+  _DBUS_LOCK (list);
+  
   while (link != NULL)
     {
       DBusList *next = _dbus_list_get_next_link (list, link);
-      
-      free_link (link);
+
+      /* the pool can only become empty on the very last link */
+      if (_dbus_mem_pool_dealloc (list_pool, link))
+        {
+          _dbus_assert (next == NULL);
+          _dbus_mem_pool_free (list_pool);
+          list_pool = NULL;
+        }
       
       link = next;
     }
 
+  _DBUS_UNLOCK (list);
+
   *list = NULL;
 }
 
@@ -26,11 +26,17 @@
 
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-hash.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-socket-set.h>
 #include <dbus/dbus-sysdeps.h>
 
 #define MAINLOOP_SPEW 0
 
+/** Most messages dispatched in one go from a connection with no quantum */
+#define MAX_DISPATCH_BATCH 64
+
 #if MAINLOOP_SPEW
 #ifdef DBUS_ENABLE_VERBOSE_MODE
 static const char*
@@ -55,12 +61,19 @@ watch_flags_to_string (int flags)
 struct DBusLoop
 {
   int refcount;
-  DBusList *callbacks;
+  /** fd => DBusList** of WatchCallback, one entry per socket */
+  DBusHashTable *watches;
+  /** the sockets we wait on, kept registered across iterations */
+  DBusSocketSet *socket_set;
+  DBusList *timeouts;
   int callback_list_serial;
   int watch_count;
   int timeout_count;
   int depth; /**< number of recursive runs */
-  DBusList *need_dispatch;
+  DBusList *need_dispatch; /**< DispatchEntry for each connection with messages to dispatch */
+  DBusList *need_flush; /**< ref to each connection with deferred writes */
+  /** TRUE if some watch was skipped because it was OOM last time */
+  unsigned oom_watch_pending : 1;
 };
 
 typedef enum
@@ -82,6 +95,10 @@ typedef struct
   Callback callback;
   DBusWatchFunction function;
   DBusWatch *watch;
+  /* the socket we were registered under, which the watch forgets
+   * when it is invalidated
+   */
+  int fd;
   /* last watch handle failed due to OOM */
   unsigned int last_iteration_oom : 1;
 } WatchCallback;
@@ -95,6 +112,16 @@ typedef struct
   unsigned long last_tv_usec;
 } TimeoutCallback;
 
+/* A connection waiting in need_dispatch */
+typedef struct
+{
+  DBusConnection *connection;
+  /* messages it may dispatch before the next connection gets a
+   * turn, or 0 to dispatch all it has
+   */
+  int quantum;
+} DispatchEntry;
+
 #define WATCH_CALLBACK(callback)   ((WatchCallback*)callback)
 #define TIMEOUT_CALLBACK(callback) ((TimeoutCallback*)callback)
 
@@ -112,6 +139,7 @@ watch_callback_new (DBusWatch         *watch,
 
   cb->watch = watch;
   cb->function = function;
+  cb->fd = dbus_watch_get_socket (watch);
   cb->last_iteration_oom = FALSE;
   cb->callback.refcount = 1;
   cb->callback.type = CALLBACK_WATCH;
@@ -171,46 +199,102 @@ callback_unref (Callback *cb)
     }
 }
 
-static dbus_bool_t
-add_callback (DBusLoop  *loop,
-              Callback *cb)
+static void
+free_watch_table_entry (void *data)
 {
-  if (!_dbus_list_append (&loop->callbacks, cb))
-    return FALSE;
+  DBusList **watches = data;
+  Callback *cb;
 
-  loop->callback_list_serial += 1;
+  /* DBusHashTable may call the free function with NULL */
+  if (watches == NULL)
+    return;
+
+  for (cb = _dbus_list_pop_first (watches);
+       cb != NULL;
+       cb = _dbus_list_pop_first (watches))
+    callback_unref (cb);
+
+  dbus_free (watches);
+}
 
-  switch (cb->type)
+static DBusList **
+ensure_watch_table_entry (DBusLoop *loop,
+                          int       fd)
+{
+  DBusList **watches;
+
+  watches = _dbus_hash_table_lookup_int (loop->watches, fd);
+
+  if (watches == NULL)
     {
-    case CALLBACK_WATCH:
-      loop->watch_count += 1;
-      break;
-    case CALLBACK_TIMEOUT:
-      loop->timeout_count += 1;
-      break;
+      watches = dbus_new0 (DBusList *, 1);
+
+      if (watches == NULL)
+        return NULL;
+
+      if (!_dbus_hash_table_insert_int (loop->watches, fd, watches))
+        {
+          dbus_free (watches);
+          return NULL;
+        }
     }
-  
-  return TRUE;
+
+  return watches;
 }
 
 static void
-remove_callback (DBusLoop  *loop,
-                 DBusList *link)
+cull_watch_table_entry (DBusLoop  *loop,
+                        DBusList **watches,
+                        int        fd)
 {
-  Callback *cb = link->data;
-  
-  switch (cb->type)
+  if (*watches != NULL)
+    return;
+
+  _dbus_hash_table_remove_int (loop->watches, fd);
+}
+
+/* Several watches can share one socket (the transport has separate
+ * read and write watches), so the set is told about their union.
+ */
+static void
+refresh_watches_for_fd (DBusLoop  *loop,
+                        DBusList **watches,
+                        int        fd)
+{
+  DBusList *link;
+  unsigned int flags;
+  dbus_bool_t interested;
+
+  flags = 0;
+  interested = FALSE;
+
+  for (link = _dbus_list_get_first_link (watches);
+       link != NULL;
+       link = _dbus_list_get_next_link (watches, link))
     {
-    case CALLBACK_WATCH:
-      loop->watch_count -= 1;
-      break;
-    case CALLBACK_TIMEOUT:
-      loop->timeout_count -= 1;
-      break;
+      WatchCallback *wcb = link->data;
+
+      if (dbus_watch_get_enabled (wcb->watch) &&
+          !wcb->last_iteration_oom)
+        {
+          flags |= dbus_watch_get_flags (wcb->watch);
+          interested = TRUE;
+        }
     }
-  
-  callback_unref (cb);
-  _dbus_list_remove_link (&loop->callbacks, link);
+
+  if (interested)
+    _dbus_socket_set_enable (loop->socket_set, fd, flags);
+  else
+    _dbus_socket_set_disable (loop->socket_set, fd);
+}
+
+static void
+remove_timeout_link (DBusLoop *loop,
+                     DBusList *link)
+{
+  loop->timeout_count -= 1;
+  callback_unref (link->data);
+  _dbus_list_remove_link (&loop->timeouts, link);
   loop->callback_list_serial += 1;
 }
 
@@ -223,6 +307,23 @@ _dbus_loop_new (void)
   if (loop == NULL)
     return NULL;
 
+  loop->watches = _dbus_hash_table_new (DBUS_HASH_INT, NULL,
+                                        free_watch_table_entry);
+
+  loop->socket_set = _dbus_socket_set_new (0);
+
+  if (loop->watches == NULL || loop->socket_set == NULL)
+    {
+      if (loop->watches != NULL)
+        _dbus_hash_table_unref (loop->watches);
+
+      if (loop->socket_set != NULL)
+        _dbus_socket_set_free (loop->socket_set);
+
+      dbus_free (loop);
+      return NULL;
+    }
+
   loop->refcount = 1;
   
   return loop;
@@ -250,11 +351,20 @@ _dbus_loop_unref (DBusLoop *loop)
     {
       while (loop->need_dispatch)
         {
-          DBusConnection *connection = _dbus_list_pop_first (&loop->need_dispatch);
+          DispatchEntry *entry = _dbus_list_pop_first (&loop->need_dispatch);
 
-          dbus_connection_unref (connection);
+          dbus_connection_unref (entry->connection);
+          dbus_free (entry);
         }
-      
+
+      while (loop->need_flush)
+        dbus_connection_unref (_dbus_list_pop_first (&loop->need_flush));
+
+      while (loop->timeouts)
+        remove_timeout_link (loop, _dbus_list_get_first_link (&loop->timeouts));
+
+      _dbus_hash_table_unref (loop->watches);
+      _dbus_socket_set_free (loop->socket_set);
       dbus_free (loop);
     }
 }
@@ -267,19 +377,99 @@ _dbus_loop_add_watch (DBusLoop          *loop,
                       DBusFreeFunction  free_data_func)
 {
   WatchCallback *wcb;
+  DBusList **watches;
 
   wcb = watch_callback_new (watch, function, data, free_data_func);
   if (wcb == NULL)
     return FALSE;
 
-  if (!add_callback (loop, (Callback*) wcb))
+  _dbus_assert (wcb->fd != -1);
+
+  watches = ensure_watch_table_entry (loop, wcb->fd);
+
+  if (watches == NULL)
+    goto oom;
+
+  if (!_dbus_list_append (watches, wcb))
     {
-      wcb->callback.free_data_func = NULL; /* don't want to have this side effect */
-      callback_unref ((Callback*) wcb);
-      return FALSE;
+      cull_watch_table_entry (loop, watches, wcb->fd);
+      goto oom;
     }
-  
+
+  if (_dbus_list_length_is_one (watches))
+    {
+      /* first watch on this socket */
+      if (!_dbus_socket_set_add (loop->socket_set, wcb->fd,
+                                 dbus_watch_get_flags (watch),
+                                 dbus_watch_get_enabled (watch)))
+        {
+          _dbus_list_clear (watches);
+          cull_watch_table_entry (loop, watches, wcb->fd);
+          goto oom;
+        }
+    }
+  else
+    {
+      refresh_watches_for_fd (loop, watches, wcb->fd);
+    }
+
+  loop->callback_list_serial += 1;
+  loop->watch_count += 1;
+
   return TRUE;
+
+ oom:
+  wcb->callback.free_data_func = NULL; /* don't want to have this side effect */
+  callback_unref ((Callback*) wcb);
+  return FALSE;
+}
+
+static dbus_bool_t
+remove_watch_for_fd (DBusLoop          *loop,
+                     int                fd,
+                     DBusWatch         *watch,
+                     DBusWatchFunction  function,
+                     void              *data)
+{
+  DBusList **watches;
+  DBusList *link;
+
+  watches = _dbus_hash_table_lookup_int (loop->watches, fd);
+
+  if (watches == NULL)
+    return FALSE;
+
+  for (link = _dbus_list_get_first_link (watches);
+       link != NULL;
+       link = _dbus_list_get_next_link (watches, link))
+    {
+      WatchCallback *this = link->data;
+
+      if (this->watch == watch &&
+          this->callback.data == data &&
+          this->function == function)
+        {
+          _dbus_list_remove_link (watches, link);
+          callback_unref ((Callback *) this);
+
+          loop->callback_list_serial += 1;
+          loop->watch_count -= 1;
+
+          if (*watches == NULL)
+            {
+              _dbus_socket_set_remove (loop->socket_set, fd);
+              cull_watch_table_entry (loop, watches, fd);
+            }
+          else
+            {
+              refresh_watches_for_fd (loop, watches, fd);
+            }
+
+          return TRUE;
+        }
+    }
+
+  return FALSE;
 }
 
 void
@@ -288,31 +478,54 @@ _dbus_loop_remove_watch (DBusLoop          *loop,
                          DBusWatchFunction  function,
                          void             *data)
 {
-  DBusList *link;
-  
-  link = _dbus_list_get_first_link (&loop->callbacks);
-  while (link != NULL)
+  DBusHashIter iter;
+  int fd;
+
+  fd = dbus_watch_get_socket (watch);
+
+  if (fd != -1 &&
+      remove_watch_for_fd (loop, fd, watch, function, data))
+    return;
+
+  /* The watch was invalidated before being removed, so we no longer
+   * know its socket; fall back to looking through all of them.
+   */
+  _dbus_hash_iter_init (loop->watches, &iter);
+  while (_dbus_hash_iter_next (&iter))
     {
-      DBusList *next = _dbus_list_get_next_link (&loop->callbacks, link);
-      Callback *this = link->data;
+      fd = _dbus_hash_iter_get_int_key (&iter);
 
-      if (this->type == CALLBACK_WATCH &&
-          WATCH_CALLBACK (this)->watch == watch &&
-          this->data == data &&
-          WATCH_CALLBACK (this)->function == function)
-        {
-          remove_callback (loop, link);
-          
-          return;
-        }
-      
-      link = next;
+      if (remove_watch_for_fd (loop, fd, watch, function, data))
+        return;
     }
 
   _dbus_warn ("could not find watch %p function %p data %p to remove\n",
               watch, (void *)function, data);
 }
 
+/**
+ * Must be called by the watch's toggled function whenever
+ * dbus_watch_get_enabled() changes, since the loop no longer
+ * rechecks every watch on each iteration.
+ */
+void
+_dbus_loop_toggle_watch (DBusLoop          *loop,
+                         DBusWatch         *watch)
+{
+  DBusList **watches;
+  int fd;
+
+  fd = dbus_watch_get_socket (watch);
+
+  if (fd == -1)
+    return;
+
+  watches = _dbus_hash_table_lookup_int (loop->watches, fd);
+
+  if (watches != NULL)
+    refresh_watches_for_fd (loop, watches, fd);
+}
+
 dbus_bool_t
 _dbus_loop_add_timeout (DBusLoop            *loop,
                         DBusTimeout        *timeout,
@@ -326,12 +539,15 @@ _dbus_loop_add_timeout (DBusLoop            *loop,
   if (tcb == NULL)
     return FALSE;
 
-  if (!add_callback (loop, (Callback*) tcb))
+  if (!_dbus_list_append (&loop->timeouts, tcb))
     {
       tcb->callback.free_data_func = NULL; /* don't want to have this side effect */
       callback_unref ((Callback*) tcb);
       return FALSE;
     }
+
+  loop->callback_list_serial += 1;
+  loop->timeout_count += 1;
   
   return TRUE;
 }
@@ -344,18 +560,17 @@ _dbus_loop_remove_timeout (DBusLoop            *loop,
 {
   DBusList *link;
   
-  link = _dbus_list_get_first_link (&loop->callbacks);
+  link = _dbus_list_get_first_link (&loop->timeouts);
   while (link != NULL)
     {
-      DBusList *next = _dbus_list_get_next_link (&loop->callbacks, link);
+      DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
       Callback *this = link->data;
 
-      if (this->type == CALLBACK_TIMEOUT &&
-          TIMEOUT_CALLBACK (this)->timeout == timeout &&
+      if (TIMEOUT_CALLBACK (this)->timeout == timeout &&
           this->data == data &&
           TIMEOUT_CALLBACK (this)->function == function)
         {
-          remove_callback (loop, link);
+          remove_timeout_link (loop, link);
           
           return;
         }
@@ -460,9 +675,23 @@ check_timeout (unsigned long    tv_sec,
   return *timeout == 0;
 }
 
+/**
+ * Gives each connection waiting to be dispatched one turn, in the
+ * order they were queued. A connection queued with a quantum
+ * dispatches at most that many messages in its turn, then goes to the
+ * back of the queue if it has more; the loop won't block while any
+ * are left, so they get their next turn after the next poll. That
+ * way a connection flooding us with messages can't hold up the ones
+ * behind it for more than its quantum. The messages of a turn are
+ * dispatched as one batch, taking the connection's dispatcher once.
+ *
+ * @param loop the loop
+ * @returns #TRUE if any connection was dispatched
+ */
 dbus_bool_t
 _dbus_loop_dispatch (DBusLoop *loop)
 {
+  DBusList *round;
 
 #if MAINLOOP_SPEW
   _dbus_verbose ("  %d connections to dispatch\n", _dbus_list_get_length (&loop->need_dispatch));
@@ -470,27 +699,53 @@ _dbus_loop_dispatch (DBusLoop *loop)
   
   if (loop->need_dispatch == NULL)
     return FALSE;
+
+  /* connections queued meanwhile, or put back for another turn,
+   * wait for the next round
+   */
+  round = loop->need_dispatch;
+  loop->need_dispatch = NULL;
   
  next:
-  while (loop->need_dispatch != NULL)
+  while (round != NULL)
     {
-      DBusConnection *connection = _dbus_list_pop_first (&loop->need_dispatch);
+      DBusList *link = _dbus_list_pop_first_link (&round);
+      DispatchEntry *entry = link->data;
+      int n_dispatched;
+
+      n_dispatched = 0;
       
       while (TRUE)
         {
           DBusDispatchStatus status;
-          
-          status = dbus_connection_dispatch (connection);
+          int max_messages;
+          int n;
+
+          if (entry->quantum > 0)
+            max_messages = entry->quantum - n_dispatched;
+          else
+            max_messages = MAX_DISPATCH_BATCH;
+
+          status = _dbus_connection_dispatch_batch (entry->connection,
+                                                    max_messages, &n);
+          n_dispatched += n;
 
           if (status == DBUS_DISPATCH_COMPLETE)
             {
-              dbus_connection_unref (connection);
+              dbus_connection_unref (entry->connection);
+              dbus_free (entry);
+              _dbus_list_free_link (link);
               goto next;
             }
-          else
+          else if (status == DBUS_DISPATCH_NEED_MEMORY)
             {
-              if (status == DBUS_DISPATCH_NEED_MEMORY)
-                _dbus_wait_for_memory ();
+              _dbus_wait_for_memory ();
+            }
+          else if (entry->quantum > 0 &&
+                   n_dispatched >= entry->quantum)
+            {
+              _dbus_list_append_link (&loop->need_dispatch, link);
+              goto next;
             }
         }
     }
@@ -498,17 +753,90 @@ _dbus_loop_dispatch (DBusLoop *loop)
   return TRUE;
 }
 
+/**
+ * Queues a connection to have all its messages dispatched the next
+ * time the loop dispatches.
+ *
+ * @param loop the loop
+ * @param connection the connection
+ * @returns #FALSE if no memory
+ */
 dbus_bool_t
 _dbus_loop_queue_dispatch (DBusLoop       *loop,
                            DBusConnection *connection)
 {
-  if (_dbus_list_append (&loop->need_dispatch, connection))
+  return _dbus_loop_queue_dispatch_with_quantum (loop, connection, 0);
+}
+
+/**
+ * Queues a connection to be dispatched, at most quantum messages
+ * at a time; see _dbus_loop_dispatch().
+ *
+ * @param loop the loop
+ * @param connection the connection
+ * @param quantum messages per turn, or 0 for no limit
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_loop_queue_dispatch_with_quantum (DBusLoop       *loop,
+                                        DBusConnection *connection,
+                                        int             quantum)
+{
+  DispatchEntry *entry;
+
+  _dbus_assert (quantum >= 0);
+
+  entry = dbus_new (DispatchEntry, 1);
+  if (entry == NULL)
+    return FALSE;
+
+  entry->connection = connection;
+  entry->quantum = quantum;
+
+  if (_dbus_list_append (&loop->need_dispatch, entry))
     {
       dbus_connection_ref (connection);
       return TRUE;
     }
   else
+    {
+      dbus_free (entry);
+      return FALSE;
+    }
+}
+
+/**
+ * Queues a connection to have its deferred writes done at the end of
+ * this iteration, after the watches and dispatching that may send more
+ * to it; see _dbus_connection_set_defer_write_function(), whose
+ * function this may be called from.
+ *
+ * @param loop the loop
+ * @param connection the connection
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_loop_queue_flush (DBusLoop       *loop,
+                        DBusConnection *connection)
+{
+  if (!_dbus_list_append (&loop->need_flush, connection))
     return FALSE;
+
+  dbus_connection_ref (connection);
+  return TRUE;
+}
+
+/* Does the writes queued by _dbus_loop_queue_flush() */
+static void
+flush_connections (DBusLoop *loop)
+{
+  while (loop->need_flush != NULL)
+    {
+      DBusConnection *connection = _dbus_list_pop_first (&loop->need_flush);
+
+      _dbus_connection_write_deferred (connection);
+      dbus_connection_unref (connection);
+    }
 }
 
 /* Returns TRUE if we invoked any timeouts or have ready file
@@ -521,25 +849,16 @@ _dbus_loop_iterate (DBusLoop     *loop,
 {  
 #define N_STACK_DESCRIPTORS 64
   dbus_bool_t retval;
-  DBusPollFD *fds;
-  DBusPollFD stack_fds[N_STACK_DESCRIPTORS];
-  int n_fds;
-  WatchCallback **watches_for_fds;
-  WatchCallback *stack_watches_for_fds[N_STACK_DESCRIPTORS];
+  DBusSocketEvent ready_fds[N_STACK_DESCRIPTORS];
   int i;
   DBusList *link;
   int n_ready;
   int initial_serial;
   long timeout;
-  dbus_bool_t oom_watch_pending;
   int orig_depth;
   
   retval = FALSE;      
 
-  fds = NULL;
-  watches_for_fds = NULL;
-  n_fds = 0;
-  oom_watch_pending = FALSE;
   orig_depth = loop->depth;
   
 #if MAINLOOP_SPEW
@@ -547,97 +866,9 @@ _dbus_loop_iterate (DBusLoop     *loop,
                  block, loop->depth, loop->timeout_count, loop->watch_count);
 #endif
   
-  if (loop->callbacks == NULL)
+  if (loop->watch_count == 0 && loop->timeouts == NULL)
     goto next_iteration;
 
-  if (loop->watch_count > N_STACK_DESCRIPTORS)
-    {
-      fds = dbus_new0 (DBusPollFD, loop->watch_count);
-      
-      while (fds == NULL)
-        {
-          _dbus_wait_for_memory ();
-          fds = dbus_new0 (DBusPollFD, loop->watch_count);
-        }
-      
-      watches_for_fds = dbus_new (WatchCallback*, loop->watch_count);
-      while (watches_for_fds == NULL)
-        {
-          _dbus_wait_for_memory ();
-          watches_for_fds = dbus_new (WatchCallback*, loop->watch_count);
-        }
-    }
-  else
-    {      
-      fds = stack_fds;
-      watches_for_fds = stack_watches_for_fds;
-    }
-
-  /* fill our array of fds and watches */
-  n_fds = 0;
-  link = _dbus_list_get_first_link (&loop->callbacks);
-  while (link != NULL)
-    {
-      DBusList *next = _dbus_list_get_next_link (&loop->callbacks, link);
-      Callback *cb = link->data;
-      if (cb->type == CALLBACK_WATCH)
-        {
-          unsigned int flags;
-          WatchCallback *wcb = WATCH_CALLBACK (cb);
-
-          if (wcb->last_iteration_oom)
-            {
-              /* we skip this one this time, but reenable it next time,
-               * and have a timeout on this iteration
-               */
-              wcb->last_iteration_oom = FALSE;
-              oom_watch_pending = TRUE;
-              
-              retval = TRUE; /* return TRUE here to keep the loop going,
-                              * since we don't know the watch is inactive
-                              */
-
-#if MAINLOOP_SPEW
-              _dbus_verbose ("  skipping watch on fd %d as it was out of memory last time\n",
-                             dbus_watch_get_socket (wcb->watch));
-#endif
-            }
-          else if (dbus_watch_get_enabled (wcb->watch))
-            {
-              watches_for_fds[n_fds] = wcb;
-
-              callback_ref (cb);
-                  
-              flags = dbus_watch_get_flags (wcb->watch);
-                  
-              fds[n_fds].fd = dbus_watch_get_socket (wcb->watch);
-              fds[n_fds].revents = 0;
-              fds[n_fds].events = 0;
-              if (flags & DBUS_WATCH_READABLE)
-                fds[n_fds].events |= _DBUS_POLLIN;
-              if (flags & DBUS_WATCH_WRITABLE)
-                fds[n_fds].events |= _DBUS_POLLOUT;
-
-#if MAINLOOP_SPEW
-              _dbus_verbose ("  polling watch on fd %d  %s\n",
-                             fds[n_fds].fd, watch_flags_to_string (flags));
-#endif
-
-              n_fds += 1;
-            }
-          else
-            {
-#if MAINLOOP_SPEW
-              _dbus_verbose ("  skipping disabled watch on fd %d  %s\n",
-                             dbus_watch_get_socket (wcb->watch),
-                             watch_flags_to_string (dbus_watch_get_flags (wcb->watch)));
-#endif
-            }
-        }
-              
-      link = next;
-    }
-  
   timeout = -1;
   if (loop->timeout_count > 0)
     {
@@ -646,16 +877,14 @@ _dbus_loop_iterate (DBusLoop     *loop,
       
       _dbus_get_current_time (&tv_sec, &tv_usec);
           
-      link = _dbus_list_get_first_link (&loop->callbacks);
+      link = _dbus_list_get_first_link (&loop->timeouts);
       while (link != NULL)
         {
-          DBusList *next = _dbus_list_get_next_link (&loop->callbacks, link);
-          Callback *cb = link->data;
+          DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
+          TimeoutCallback *tcb = link->data;
 
-          if (cb->type == CALLBACK_TIMEOUT &&
-              dbus_timeout_get_enabled (TIMEOUT_CALLBACK (cb)->timeout))
+          if (dbus_timeout_get_enabled (tcb->timeout))
             {
-              TimeoutCallback *tcb = TIMEOUT_CALLBACK (cb);
               int msecs_remaining;
 
               check_timeout (tv_sec, tv_usec, tcb, &msecs_remaining);
@@ -676,7 +905,7 @@ _dbus_loop_iterate (DBusLoop     *loop,
                 break; /* it's not going to get shorter... */
             }
 #if MAINLOOP_SPEW
-          else if (cb->type == CALLBACK_TIMEOUT)
+          else
             {
               _dbus_verbose ("  skipping disabled timeout\n");
             }
@@ -686,8 +915,8 @@ _dbus_loop_iterate (DBusLoop     *loop,
         }
     }
 
-  /* Never block if we have stuff to dispatch */
-  if (!block || loop->need_dispatch != NULL)
+  /* Never block if we have stuff to dispatch or write */
+  if (!block || loop->need_dispatch != NULL || loop->need_flush != NULL)
     {
       timeout = 0;
 #if MAINLOOP_SPEW
@@ -695,17 +924,63 @@ _dbus_loop_iterate (DBusLoop     *loop,
 #endif
     }
 
-  /* if a watch is OOM, don't wait longer than the OOM
+  /* if a watch was OOM last time, don't wait longer than the OOM
    * wait to re-enable it
    */
-  if (oom_watch_pending)
-    timeout = MIN (timeout, _dbus_get_oom_wait ());
+  if (loop->oom_watch_pending)
+    {
+      if (timeout < 0)
+        timeout = _dbus_get_oom_wait ();
+      else
+        timeout = MIN (timeout, _dbus_get_oom_wait ());
+    }
 
 #if MAINLOOP_SPEW
-  _dbus_verbose ("  polling on %d descriptors timeout %ld\n", n_fds, timeout);
+  _dbus_verbose ("  polling on %d watches timeout %ld\n", loop->watch_count, timeout);
 #endif
   
-  n_ready = _dbus_poll (fds, n_fds, timeout);
+  n_ready = _dbus_socket_set_poll (loop->socket_set, ready_fds,
+                                   _DBUS_N_ELEMENTS (ready_fds), timeout);
+
+  /* re-enable any watches we skipped this time */
+  if (loop->oom_watch_pending)
+    {
+      DBusHashIter hash_iter;
+
+      loop->oom_watch_pending = FALSE;
+
+      _dbus_hash_iter_init (loop->watches, &hash_iter);
+
+      while (_dbus_hash_iter_next (&hash_iter))
+        {
+          DBusList **watches;
+          dbus_bool_t changed;
+
+          changed = FALSE;
+          watches = _dbus_hash_iter_get_value (&hash_iter);
+
+          for (link = _dbus_list_get_first_link (watches);
+               link != NULL;
+               link = _dbus_list_get_next_link (watches, link))
+            {
+              WatchCallback *wcb = link->data;
+
+              if (wcb->last_iteration_oom)
+                {
+                  wcb->last_iteration_oom = FALSE;
+                  changed = TRUE;
+                }
+            }
+
+          if (changed)
+            refresh_watches_for_fd (loop, watches,
+                                    _dbus_hash_iter_get_int_key (&hash_iter));
+        }
+
+      retval = TRUE; /* return TRUE here to keep the loop going,
+                      * since we don't know the watch is inactive
+                      */
+    }
 
   initial_serial = loop->callback_list_serial;
 
@@ -717,11 +992,11 @@ _dbus_loop_iterate (DBusLoop     *loop,
       _dbus_get_current_time (&tv_sec, &tv_usec);
 
       /* It'd be nice to avoid this O(n) thingy here */
-      link = _dbus_list_get_first_link (&loop->callbacks);
+      link = _dbus_list_get_first_link (&loop->timeouts);
       while (link != NULL)
         {
-          DBusList *next = _dbus_list_get_next_link (&loop->callbacks, link);
-          Callback *cb = link->data;
+          DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
+          TimeoutCallback *tcb = link->data;
 
           if (initial_serial != loop->callback_list_serial)
             goto next_iteration;
@@ -729,10 +1004,8 @@ _dbus_loop_iterate (DBusLoop     *loop,
           if (loop->depth != orig_depth)
             goto next_iteration;
               
-          if (cb->type == CALLBACK_TIMEOUT &&
-              dbus_timeout_get_enabled (TIMEOUT_CALLBACK (cb)->timeout))
+          if (dbus_timeout_get_enabled (tcb->timeout))
             {
-              TimeoutCallback *tcb = TIMEOUT_CALLBACK (cb);
               int msecs_remaining;
               
               if (check_timeout (tv_sec, tv_usec,
@@ -747,7 +1020,7 @@ _dbus_loop_iterate (DBusLoop     *loop,
 #endif
                   
                   (* tcb->function) (tcb->timeout,
-                                     cb->data);
+                                     tcb->callback.data);
 
                   retval = TRUE;
                 }
@@ -759,7 +1032,7 @@ _dbus_loop_iterate (DBusLoop     *loop,
                 }
             }
 #if MAINLOOP_SPEW
-          else if (cb->type == CALLBACK_TIMEOUT)
+          else
             {
               _dbus_verbose ("  skipping invocation of disabled timeout\n");
             }
@@ -768,62 +1041,92 @@ _dbus_loop_iterate (DBusLoop     *loop,
           link = next;
         }
     }
-      
-  if (n_ready > 0)
+
+  for (i = 0; i < n_ready; i++)
     {
-      i = 0;
-      while (i < n_fds)
+      DBusList **watches;
+      dbus_bool_t any_oom;
+
+      /* FIXME I think this "restart if we change the watches"
+       * approach could result in starving watches
+       * toward the end of the list.
+       */
+      if (initial_serial != loop->callback_list_serial)
+        goto next_iteration;
+
+      if (loop->depth != orig_depth)
+        goto next_iteration;
+
+      /* condition may be 0 if we got some weird POLLFOO thing like
+       * POLLWRBAND
+       */
+      if (ready_fds[i].flags == 0)
+        continue;
+
+      watches = _dbus_hash_table_lookup_int (loop->watches, ready_fds[i].fd);
+
+      if (watches == NULL)
+        continue;
+
+      any_oom = FALSE;
+
+      link = _dbus_list_get_first_link (watches);
+      while (link != NULL)
         {
-          /* FIXME I think this "restart if we change the watches"
-           * approach could result in starving watches
-           * toward the end of the list.
-           */
-          if (initial_serial != loop->callback_list_serial)
-            goto next_iteration;
+          DBusList *next = _dbus_list_get_next_link (watches, link);
+          WatchCallback *wcb = link->data;
+          unsigned int condition;
 
-          if (loop->depth != orig_depth)
-            goto next_iteration;
+          /* the events are for the whole socket, so only pass on
+           * the ones this particular watch asked for
+           */
+          condition = ready_fds[i].flags &
+            (dbus_watch_get_flags (wcb->watch) |
+             DBUS_WATCH_HANGUP | DBUS_WATCH_ERROR);
 
-          if (fds[i].revents != 0)
+          if (condition != 0 &&
+              !wcb->last_iteration_oom &&
+              dbus_watch_get_enabled (wcb->watch))
             {
-              WatchCallback *wcb;
-              unsigned int condition;
-                  
-              wcb = watches_for_fds[i];
-              
-              condition = 0;
-              if (fds[i].revents & _DBUS_POLLIN)
-                condition |= DBUS_WATCH_READABLE;
-              if (fds[i].revents & _DBUS_POLLOUT)
-                condition |= DBUS_WATCH_WRITABLE;
-              if (fds[i].revents & _DBUS_POLLHUP)
-                condition |= DBUS_WATCH_HANGUP;
-              if (fds[i].revents & _DBUS_POLLERR)
-                condition |= DBUS_WATCH_ERROR;
-
-              /* condition may still be 0 if we got some
-               * weird POLLFOO thing like POLLWRBAND
-               */
-                  
-              if (condition != 0 &&
-                  dbus_watch_get_enabled (wcb->watch))
+              dbus_bool_t oom;
+
+              callback_ref ((Callback *) wcb);
+
+              oom = !(* wcb->function) (wcb->watch,
+                                        condition,
+                                        ((Callback*)wcb)->data);
+
+              if (oom)
                 {
-                  if (!(* wcb->function) (wcb->watch,
-                                          condition,
-                                          ((Callback*)wcb)->data))
-                    wcb->last_iteration_oom = TRUE;
+                  wcb->last_iteration_oom = TRUE;
+                  loop->oom_watch_pending = TRUE;
+                  any_oom = TRUE;
+                }
 
 #if MAINLOOP_SPEW
-                  _dbus_verbose ("  Invoked watch, oom = %d\n",
-                                 wcb->last_iteration_oom);
+              _dbus_verbose ("  Invoked watch, oom = %d\n", oom);
 #endif
-                  
-                  retval = TRUE;
-                }
+
+              callback_unref ((Callback *) wcb);
+
+              retval = TRUE;
+
+              /* the callback may have removed watches, including
+               * this one, so "next" is not trustworthy any more
+               */
+              if (initial_serial != loop->callback_list_serial ||
+                  loop->depth != orig_depth)
+                goto next_iteration;
             }
-              
-          ++i;
+
+          link = next;
         }
+
+      /* we skip OOM watches on the next poll, but reenable them
+       * after it
+       */
+      if (any_oom)
+        refresh_watches_for_fd (loop, watches, ready_fds[i].fd);
     }
       
  next_iteration:
@@ -831,23 +1134,10 @@ _dbus_loop_iterate (DBusLoop     *loop,
   _dbus_verbose ("  moving to next iteration\n");
 #endif
   
-  if (fds && fds != stack_fds)
-    dbus_free (fds);
-  if (watches_for_fds)
-    {
-      i = 0;
-      while (i < n_fds)
-        {
-          callback_unref (&watches_for_fds[i]->callback);
-          ++i;
-        }
-      
-      if (watches_for_fds != stack_watches_for_fds)
-        dbus_free (watches_for_fds);
-    }
-  
   if (_dbus_loop_dispatch (loop))
     retval = TRUE;
+
+  flush_connections (loop);
   
 #if MAINLOOP_SPEW
   _dbus_verbose ("Returning %d\n", retval);
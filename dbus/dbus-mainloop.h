@@ -48,6 +48,8 @@ void        _dbus_loop_remove_watch   (DBusLoop            *loop,
                                        DBusWatch           *watch,
                                        DBusWatchFunction    function,
                                        void                *data);
+void        _dbus_loop_toggle_watch   (DBusLoop            *loop,
+                                       DBusWatch           *watch);
 dbus_bool_t _dbus_loop_add_timeout    (DBusLoop            *loop,
                                        DBusTimeout         *timeout,
                                        DBusTimeoutFunction  function,
@@ -60,6 +62,11 @@ void        _dbus_loop_remove_timeout (DBusLoop            *loop,
 
 dbus_bool_t _dbus_loop_queue_dispatch (DBusLoop            *loop,
                                        DBusConnection      *connection);
+dbus_bool_t _dbus_loop_queue_dispatch_with_quantum (DBusLoop       *loop,
+                                                    DBusConnection *connection,
+                                                    int             quantum);
+dbus_bool_t _dbus_loop_queue_flush    (DBusLoop            *loop,
+                                       DBusConnection      *connection);
 
 void        _dbus_loop_run            (DBusLoop            *loop);
 void        _dbus_loop_quit           (DBusLoop            *loop);
@@ -929,8 +929,64 @@ _dbus_swap_array (unsigned char *data,
 #endif
           d += 8;
         }
+      return;
+    }
+
+  _dbus_assert (alignment == 4 || alignment == 2);
+
+#ifdef DBUS_HAVE_INT64
+  /* Swap all the elements in an 8-byte word at once, which for big
+   * arrays is several times fewer loads and stores; the loops are also
+   * simple enough for the compiler to vectorize. The elements before
+   * the first 8-aligned one and after the last whole word are done
+   * one at a time below.
+   */
+  if (end - d >= 16)
+    {
+      unsigned char *words_end;
+
+      while (_DBUS_ALIGN_ADDRESS (d, 8) != d)
+        {
+          if (alignment == 4)
+            *((dbus_uint32_t*)d) = DBUS_UINT32_SWAP_LE_BE (*((dbus_uint32_t*)d));
+          else
+            *((dbus_uint16_t*)d) = DBUS_UINT16_SWAP_LE_BE (*((dbus_uint16_t*)d));
+          d += alignment;
+        }
+
+      words_end = d + ((end - d) & ~7);
+
+      if (alignment == 4)
+        {
+          while (d != words_end)
+            {
+              dbus_uint64_t v;
+
+              /* reversing all 8 bytes swaps the two elements too, so
+               * swap them back
+               */
+              v = DBUS_UINT64_SWAP_LE_BE (*((dbus_uint64_t*)d));
+              *((dbus_uint64_t*)d) = (v << 32) | (v >> 32);
+              d += 8;
+            }
+        }
+      else
+        {
+          while (d != words_end)
+            {
+              dbus_uint64_t v;
+
+              v = *((dbus_uint64_t*)d);
+              *((dbus_uint64_t*)d) =
+                ((v & DBUS_UINT64_CONSTANT (0x00ff00ff00ff00ff)) << 8) |
+                ((v >> 8) & DBUS_UINT64_CONSTANT (0x00ff00ff00ff00ff));
+              d += 8;
+            }
+        }
     }
-  else if (alignment == 4)
+#endif /* DBUS_HAVE_INT64 */
+
+  if (alignment == 4)
     {
       while (d != end)
         {
@@ -940,8 +996,6 @@ _dbus_swap_array (unsigned char *data,
     }
   else
     {
-      _dbus_assert (alignment == 2);
-      
       while (d != end)
         {
           *((dbus_uint16_t*)d) = DBUS_UINT16_SWAP_LE_BE (*((dbus_uint16_t*)d));
@@ -1662,6 +1716,46 @@ swap_test_array (void *array,
     DEMARSHAL_FIXED_ARRAY_AND_CHECK (typename, byte_order, literal);    \
   } while (0)
 
+static void
+check_swap_array (int alignment)
+{
+  /* 8-aligned buffer, so arrays can start on or off a word boundary */
+  dbus_uint64_t buf[8];
+  dbus_uint64_t orig[8];
+  int start;
+  int n;
+  int i;
+
+  for (start = 0; start < 8; start += alignment)
+    for (n = 0; n * alignment + start <= (int) sizeof (buf); n++)
+      {
+        unsigned char *data;
+        unsigned char *o;
+
+        for (i = 0; i < (int) sizeof (buf); i++)
+          ((unsigned char*) buf)[i] = i * 7 + 1;
+        memcpy (orig, buf, sizeof (buf));
+
+        data = ((unsigned char*) buf) + start;
+        o = ((unsigned char*) orig) + start;
+        _dbus_swap_array (data, n, alignment);
+
+        for (i = 0; i < n * alignment; i++)
+          {
+            int elem = i - i % alignment;
+
+            if (data[i] != o[elem + alignment - 1 - i % alignment])
+              _dbus_assert_not_reached ("element not byte-swapped");
+          }
+
+        /* nothing outside the array touched */
+        if (memcmp (buf, orig, start) != 0 ||
+            memcmp (data + n * alignment, o + n * alignment,
+                    sizeof (buf) - start - n * alignment) != 0)
+          _dbus_assert_not_reached ("byte-swapped outside the array");
+      }
+}
+
 dbus_bool_t
 _dbus_marshal_test (void)
 {
@@ -1698,6 +1792,10 @@ _dbus_marshal_test (void)
   const char *v_OBJECT_PATH;
   int byte_order;
 
+  check_swap_array (2);
+  check_swap_array (4);
+  check_swap_array (8);
+
   if (!_dbus_string_init (&str))
     _dbus_assert_not_reached ("failed to init string");
 
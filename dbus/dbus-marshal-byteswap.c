@@ -31,6 +31,70 @@
  * @{
  */
 
+static void
+swap_struct_array_by_plan (const DBusMarshalPlan *plan,
+                           int                    old_byte_order,
+                           unsigned char         *p,
+                           const unsigned char   *array_end)
+{
+  int i;
+
+  if (plan->fixed_size >= 0)
+    {
+      int stride;
+
+      /* every element has the same layout, and each starts 8-aligned */
+      stride = _DBUS_ALIGN_VALUE (plan->fixed_size, 8);
+
+      while (p < array_end)
+        {
+          for (i = 0; i < plan->n_members; i++)
+            {
+              if (plan->alignments[i] > 1)
+                _dbus_swap_array (p + plan->offsets[i], 1, plan->alignments[i]);
+            }
+
+          p += stride;
+        }
+
+      return;
+    }
+
+  while (p < array_end)
+    {
+      p = _DBUS_ALIGN_ADDRESS (p, 8);
+
+      for (i = 0; i < plan->n_members; i++)
+        {
+          p = _DBUS_ALIGN_ADDRESS (p, plan->alignments[i]);
+
+          switch (plan->types[i])
+            {
+            case DBUS_TYPE_STRING:
+            case DBUS_TYPE_OBJECT_PATH:
+              {
+                dbus_uint32_t len;
+
+                len = _dbus_unpack_uint32 (old_byte_order, p);
+                *((dbus_uint32_t*)p) = DBUS_UINT32_SWAP_LE_BE (*((dbus_uint32_t*)p));
+                p += 4 + len + 1; /* + 1 for nul */
+              }
+              break;
+
+            case DBUS_TYPE_SIGNATURE:
+              p += *p + 2; /* +2 for len and nul */
+              break;
+
+            default:
+              if (plan->alignments[i] > 1)
+                _dbus_swap_array (p, 1, plan->alignments[i]);
+              p += plan->alignments[i];
+              break;
+            }
+        }
+    }
+}
+
 static void
 byteswap_body_helper (DBusTypeReader       *reader,
                       dbus_bool_t           walk_reader_to_end,
@@ -116,19 +180,31 @@ byteswap_body_helper (DBusTypeReader       *reader,
                 else
                   {
                     DBusTypeReader sub;
-                    const unsigned char *array_end;
+                    DBusMarshalPlan plan;
+                    unsigned char *array_end;
 
                     array_end = p + array_len;
                     
                     _dbus_type_reader_recurse (reader, &sub);
 
-                    while (p < array_end)
+                    if ((elem_type == DBUS_TYPE_STRUCT ||
+                         elem_type == DBUS_TYPE_DICT_ENTRY) &&
+                        _dbus_marshal_plan_compile (&sub, &plan))
+                      {
+                        swap_struct_array_by_plan (&plan, old_byte_order,
+                                                   p, array_end);
+                        p = array_end;
+                      }
+                    else
                       {
-                        byteswap_body_helper (&sub,
-                                              FALSE,
-                                              old_byte_order,
-                                              new_byte_order,
-                                              p, &p);
+                        while (p < array_end)
+                          {
+                            byteswap_body_helper (&sub,
+                                                  FALSE,
+                                                  old_byte_order,
+                                                  new_byte_order,
+                                                  p, &p);
+                          }
                       }
                   }
               }
@@ -119,6 +119,14 @@ correct_header_padding (DBusHeader *header)
   header->padding = _dbus_string_get_length (&header->data) - unpadded_len;
 }
 
+/**
+ * Extra capacity given to a loaded header so that appending a SENDER
+ * field (up to 7 bytes of alignment, field code and signature, length,
+ * a unique name of a few dozen bytes and its nul) plus the temporary
+ * header padding fits without growing the string.
+ */
+#define HEADER_SENDER_FIELD_SLACK 64
+
 /** Compute the end of the header, ignoring padding */
 #define HEADER_END_BEFORE_PADDING(header) \
   (_dbus_string_get_length (&(header)->data) - (header)->padding)
@@ -219,6 +227,33 @@ _dbus_header_cache_revalidate (DBusHeader *header)
     }
 }
 
+#ifndef DBUS_DISABLE_ASSERT
+/**
+ * Asserts that the fields cache matches what a fresh walk of the
+ * header finds. Expensive, only for use after updating the cache in
+ * place.
+ *
+ * @param header the header
+ */
+static void
+_dbus_header_cache_assert_valid (DBusHeader *header)
+{
+  DBusHeaderField fields[DBUS_HEADER_FIELD_LAST + 1];
+  int i;
+
+  memcpy (fields, header->fields, sizeof (fields));
+
+  _dbus_header_cache_revalidate (header);
+
+  i = 0;
+  while (i <= DBUS_HEADER_FIELD_LAST)
+    {
+      _dbus_assert (fields[i].value_pos == header->fields[i].value_pos);
+      ++i;
+    }
+}
+#endif /* !DBUS_DISABLE_ASSERT */
+
 /**
  * Checks for a field, updating the cache if required.
  *
@@ -497,6 +532,32 @@ _dbus_header_copy (const DBusHeader *header,
   return TRUE;
 }
 
+/**
+ * Makes an already initialized header a copy of another one, reusing
+ * its data string rather than allocating a new one as
+ * _dbus_header_copy() does, so a header from the message cache can be
+ * stamped from a prebuilt one. Unlike _dbus_header_copy(), the serial
+ * is copied as is.
+ *
+ * @param header the header to overwrite
+ * @param source the header to copy
+ * @returns #FALSE if not enough memory, leaving header reinitialized
+ */
+dbus_bool_t
+_dbus_header_reinit_copy (DBusHeader       *header,
+                          const DBusHeader *source)
+{
+  _dbus_header_reinit (header, source->byte_order);
+
+  if (!_dbus_string_copy (&source->data, 0, &header->data, 0))
+    return FALSE;
+
+  memcpy (header->fields, source->fields, sizeof (header->fields));
+  header->padding = source->padding;
+
+  return TRUE;
+}
+
 /**
  * Fills in the primary fields of the header, so the header is ready
  * for use. #NULL may be specified for some or all of the fields to
@@ -637,6 +698,25 @@ _dbus_header_create (DBusHeader  *header,
   return FALSE;
 }
 
+/* The loader hands us messages at whatever offset they start at in
+ * its read buffer, so the lengths can't be read with the aligned
+ * marshaling functions.
+ */
+static dbus_uint32_t
+read_unaligned_uint32 (const DBusString *str,
+                       int               pos,
+                       int               byte_order)
+{
+  dbus_uint32_t v;
+
+  memcpy (&v, _dbus_string_get_const_data_len (str, pos, 4), 4);
+
+  if (byte_order == DBUS_LITTLE_ENDIAN)
+    return DBUS_UINT32_FROM_LE (v);
+  else
+    return DBUS_UINT32_FROM_BE (v);
+}
+
 /**
  * Given data long enough to contain the length of the message body
  * and the fields array, check whether the data is long enough to
@@ -650,7 +730,8 @@ _dbus_header_create (DBusHeader  *header,
  * @param header_len return location for claimed header length
  * @param body_len return location for claimed body length
  * @param str the data
- * @param start start of data, 8-aligned
+ * @param start start of data; need not be aligned, the lengths are
+ * unpacked from the raw bytes
  * @param len length of data
  * @returns #TRUE if the data is long enough for the claimed length, and the lengths were valid
  */
@@ -674,8 +755,6 @@ _dbus_header_have_message_untrusted (int                max_message_length,
   _dbus_assert (start < _DBUS_INT32_MAX / 2);
   _dbus_assert (len >= 0);
 
-  _dbus_assert (start == (int) _DBUS_ALIGN_VALUE (start, 8));
-
   *byte_order = _dbus_string_get_byte (str, start + BYTE_ORDER_OFFSET);
 
   if (*byte_order != DBUS_LITTLE_ENDIAN && *byte_order != DBUS_BIG_ENDIAN)
@@ -685,8 +764,8 @@ _dbus_header_have_message_untrusted (int                max_message_length,
     }
 
   _dbus_assert (FIELDS_ARRAY_LENGTH_OFFSET + 4 <= len);
-  fields_array_len_unsigned = _dbus_marshal_read_uint32 (str, start + FIELDS_ARRAY_LENGTH_OFFSET,
-                                                         *byte_order, NULL);
+  fields_array_len_unsigned =
+    read_unaligned_uint32 (str, start + FIELDS_ARRAY_LENGTH_OFFSET, *byte_order);
 
   if (fields_array_len_unsigned > (unsigned) max_message_length)
     {
@@ -695,8 +774,8 @@ _dbus_header_have_message_untrusted (int                max_message_length,
     }
 
   _dbus_assert (BODY_LENGTH_OFFSET + 4 < len);
-  body_len_unsigned = _dbus_marshal_read_uint32 (str, start + BODY_LENGTH_OFFSET,
-                                                 *byte_order, NULL);
+  body_len_unsigned =
+    read_unaligned_uint32 (str, start + BODY_LENGTH_OFFSET, *byte_order);
 
   if (body_len_unsigned > (unsigned) max_message_length)
     {
@@ -938,6 +1017,12 @@ load_and_validate_field (DBusHeader     *header,
  * _dbus_header_have_message_untrusted() is assumed to have been
  * already done.
  *
+ * Only the header bytes are read from the source string; they are
+ * copied into the header first and all validation is done on the
+ * copy, so the header does not have to be 8-aligned in @p str. That
+ * lets the message loader parse several messages out of one read
+ * buffer without moving the unparsed remainder after each one.
+ *
  * @param header the header (must be initialized)
  * @param mode whether to do validation
  * @param validity return location for invalidity reason
@@ -946,8 +1031,8 @@ load_and_validate_field (DBusHeader     *header,
  * @param body_len claimed length of body
  * @param header_len claimed length of header
  * @param str a string
- * @param start start of header, 8-aligned
- * @param len length of string to look at
+ * @param start start of header
+ * @param len length of data from @p start on
  * @returns #FALSE if no memory or data was invalid, #TRUE otherwise
  */
 dbus_bool_t
@@ -973,11 +1058,14 @@ _dbus_header_load (DBusHeader        *header,
   int padding_len;
   int i;
 
-  _dbus_assert (start == (int) _DBUS_ALIGN_VALUE (start, 8));
+  _dbus_assert (start >= 0);
   _dbus_assert (header_len <= len);
   _dbus_assert (_dbus_string_get_length (&header->data) == 0);
 
-  if (!_dbus_string_copy_len (str, start, header_len, &header->data, 0))
+  /* Leave room for the bus to add a SENDER field without reallocating */
+  if (!_dbus_string_alloc_space (&header->data,
+                                 header_len + HEADER_SENDER_FIELD_SLACK) ||
+      !_dbus_string_copy_len (str, start, header_len, &header->data, 0))
     {
       _dbus_verbose ("Failed to copy buffer into new header\n");
       *validity = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
@@ -986,14 +1074,14 @@ _dbus_header_load (DBusHeader        *header,
 
   if (mode == DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
     {
-      leftover = len - header_len - body_len - start;
+      leftover = header_len - (FIRST_FIELD_OFFSET + fields_array_len);
     }
   else
     {
       v = _dbus_validate_body_with_reason (&_dbus_header_signature_str, 0,
                                            byte_order,
                                            &leftover,
-                                           str, start, len);
+                                           &header->data, 0, header_len);
       
       if (v != DBUS_VALID)
         {
@@ -1002,16 +1090,16 @@ _dbus_header_load (DBusHeader        *header,
         }
     }
 
-  _dbus_assert (leftover < len);
+  _dbus_assert (leftover < header_len);
 
   padding_len = header_len - (FIRST_FIELD_OFFSET + fields_array_len);
-  padding_start = start + FIRST_FIELD_OFFSET + fields_array_len;
-  _dbus_assert (start + header_len == (int) _DBUS_ALIGN_VALUE (padding_start, 8));
-  _dbus_assert (start + header_len == padding_start + padding_len);
+  padding_start = FIRST_FIELD_OFFSET + fields_array_len;
+  _dbus_assert (header_len == (int) _DBUS_ALIGN_VALUE (padding_start, 8));
+  _dbus_assert (header_len == padding_start + padding_len);
 
   if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
     {
-      if (!_dbus_string_validate_nul (str, padding_start, padding_len))
+      if (!_dbus_string_validate_nul (&header->data, padding_start, padding_len))
         {
           *validity = DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
           goto invalid;
@@ -1033,7 +1121,7 @@ _dbus_header_load (DBusHeader        *header,
   _dbus_type_reader_init (&reader,
                           byte_order,
                           &_dbus_header_signature_str, 0,
-                          str, start);
+                          &header->data, 0);
 
   /* BYTE ORDER */
   _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_BYTE);
@@ -1230,6 +1318,88 @@ find_field_for_modification (DBusHeader     *header,
   return retval;
 }
 
+/**
+ * Sets a string-like field that is the last one in the header by
+ * writing over it where it is: nothing comes after it but padding, so
+ * unlike _dbus_type_reader_set_basic() nothing needs to move and no
+ * replacement needs marshalling first. Appending arguments to a
+ * message rewrites its signature each time, and the signature is
+ * nearly always the last field by then.
+ *
+ * @param header the header
+ * @param field the field to set, which must be present
+ * @param type the type of the value
+ * @param value the new value
+ * @returns #FALSE if the field isn't the last or no memory
+ */
+static dbus_bool_t
+set_last_string_field (DBusHeader *header,
+                       int         field,
+                       int         type,
+                       const char *value)
+{
+  int value_pos;
+  int len_size;
+  int old_len;
+  int len;
+  int new_end;
+  int padded_len;
+
+  value_pos = header->fields[field].value_pos;
+
+  if (type == DBUS_TYPE_SIGNATURE)
+    {
+      len_size = 1;
+      old_len = _dbus_string_get_byte (&header->data, value_pos);
+    }
+  else
+    {
+      len_size = 4;
+      old_len = _dbus_marshal_read_uint32 (&header->data, value_pos,
+                                           header->byte_order, NULL);
+    }
+
+  if (value_pos + len_size + old_len + 1 != HEADER_END_BEFORE_PADDING (header))
+    return FALSE;
+
+  len = strlen (value);
+  new_end = value_pos + len_size + len + 1;
+  padded_len = _DBUS_ALIGN_VALUE (new_end, 8);
+
+  /* Growing first is the only step that can fail */
+  if (padded_len > _dbus_string_get_length (&header->data) &&
+      !_dbus_string_lengthen (&header->data,
+                              padded_len - _dbus_string_get_length (&header->data)))
+    return FALSE;
+
+  _dbus_string_set_length (&header->data, new_end);
+
+  if (type == DBUS_TYPE_SIGNATURE)
+    _dbus_string_set_byte (&header->data, value_pos, len);
+  else
+    _dbus_marshal_set_uint32 (&header->data, value_pos, len,
+                              header->byte_order);
+
+  memcpy (_dbus_string_get_data_len (&header->data, value_pos + len_size,
+                                     len + 1),
+          value, len + 1);
+
+  _dbus_marshal_set_uint32 (&header->data, FIELDS_ARRAY_LENGTH_OFFSET,
+                            new_end - FIRST_FIELD_OFFSET,
+                            header->byte_order);
+
+  if (!_dbus_string_align_length (&header->data, 8))
+    _dbus_assert_not_reached ("couldn't pad header though enough padding was preallocated");
+
+  header->padding = padded_len - new_end;
+
+#ifndef DBUS_DISABLE_ASSERT
+  _dbus_header_cache_assert_valid (header); /* Expensive assertion ... */
+#endif
+
+  return TRUE;
+}
+
 /**
  * Sets the value of a field with basic type. If the value is a string
  * value, it isn't allowed to be #NULL. If the field doesn't exist,
@@ -1247,8 +1417,21 @@ _dbus_header_set_field_basic (DBusHeader       *header,
                               int               type,
                               const void       *value)
 {
+  int old_end;
+  int i;
+
   _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
 
+  if ((type == DBUS_TYPE_STRING ||
+       type == DBUS_TYPE_OBJECT_PATH ||
+       type == DBUS_TYPE_SIGNATURE) &&
+      _dbus_header_cache_check (header, field) &&
+      set_last_string_field (header, field, type,
+                             *(const char * const *) value))
+    return TRUE;
+
+  old_end = HEADER_END_BEFORE_PADDING (header);
+
   if (!reserve_header_padding (header))
     return FALSE;
 
@@ -1257,13 +1440,31 @@ _dbus_header_set_field_basic (DBusHeader       *header,
     {
       DBusTypeReader reader;
       DBusTypeReader realign_root;
+      int value_pos;
+      int shift;
 
       if (!find_field_for_modification (header, field,
                                         &reader, &realign_root))
         _dbus_assert_not_reached ("field was marked present in cache but wasn't found");
 
+      value_pos = header->fields[field].value_pos;
+
       if (!set_basic_field (&reader, field, type, value, &realign_root))
         return FALSE;
+
+      /* Fields are 8-aligned structs, so every field after this one
+       * moved by the same amount, which is also how far the end of the
+       * header moved; fields before it stay put.
+       */
+      shift = HEADER_END_BEFORE_PADDING (header) - old_end;
+
+      i = 0;
+      while (i <= DBUS_HEADER_FIELD_LAST)
+        {
+          if (header->fields[i].value_pos > value_pos)
+            header->fields[i].value_pos += shift;
+          ++i;
+        }
     }
   else
     {
@@ -1296,15 +1497,24 @@ _dbus_header_set_field_basic (DBusHeader       *header,
 
       if (!_dbus_type_writer_unrecurse (&writer, &array))
         _dbus_assert_not_reached ("unrecurse from ARRAY should not have used memory");
+
+      /* The new field is a struct at the next 8-aligned offset: the
+       * code byte, then the variant's one-character signature, then
+       * the value, which for every header field type lands 4 bytes in.
+       */
+      header->fields[field].value_pos = _DBUS_ALIGN_VALUE (old_end, 8) + 4;
     }
 
   correct_header_padding (header);
 
-  /* We could be smarter about this (only invalidate fields after the
-   * one we modified, or even only if the one we modified changed
-   * length). But this hack is a start.
+  /* The cache was kept up to date above instead of being invalidated,
+   * which would make the next getter walk all the fields again (the
+   * bus sets the sender on every message it routes, just before
+   * looking at the other fields).
    */
-  _dbus_header_cache_invalidate_all (header);
+#ifndef DBUS_DISABLE_ASSERT
+  _dbus_header_cache_assert_valid (header); /* Expensive assertion ... */
+#endif
 
   return TRUE;
 }
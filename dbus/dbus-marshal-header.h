@@ -64,6 +64,8 @@ dbus_bool_t   _dbus_header_init                   (DBusHeader        *header,
 void          _dbus_header_free                   (DBusHeader        *header);
 void          _dbus_header_reinit                 (DBusHeader        *header,
                                                    int                byte_order);
+dbus_bool_t   _dbus_header_reinit_copy            (DBusHeader        *header,
+                                                   const DBusHeader  *source);
 dbus_bool_t   _dbus_header_create                 (DBusHeader        *header,
                                                    int                type,
                                                    const char        *destination,
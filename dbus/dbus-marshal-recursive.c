@@ -960,6 +960,64 @@ _dbus_type_reader_read_fixed_multi (const DBusTypeReader  *reader,
 #endif
 }
 
+/**
+ * Like _dbus_type_reader_read_fixed_multi(), but for an array of
+ * structs whose members are all fixed-length. Compiles the element
+ * type into plan, and returns the block from the current point in the
+ * array to its end in place, starting at the first struct; elements
+ * are _DBUS_ALIGN_VALUE (plan->fixed_size, 8) apart.
+ *
+ * @param reader the reader to read from
+ * @param plan place to compile the element type into
+ * @param value place to return the block, #NULL if no elements remain
+ * @param n_elements place to return number of array elements
+ * @returns #FALSE if the elements aren't structs of fixed-length types
+ */
+dbus_bool_t
+_dbus_type_reader_read_fixed_struct_multi (const DBusTypeReader  *reader,
+                                           DBusMarshalPlan       *plan,
+                                           const void           **value,
+                                           int                   *n_elements)
+{
+  DBusTypeReader types;
+  int pos;
+  int end_pos;
+
+  _dbus_assert (!reader->klass->types_only);
+  _dbus_assert (reader->klass == &array_reader_class);
+
+  _dbus_type_reader_init_types_only (&types, reader->type_str,
+                                     reader->type_pos);
+
+  if (_dbus_type_reader_get_current_type (&types) != DBUS_TYPE_STRUCT ||
+      !_dbus_marshal_plan_compile (&types, plan) ||
+      plan->fixed_size < 0)
+    return FALSE;
+
+  pos = reader->value_pos;
+  end_pos = reader->u.array.start_pos + array_reader_get_array_len (reader);
+
+  _dbus_assert (pos <= end_pos);
+
+  if (pos == end_pos)
+    {
+      *value = NULL;
+      *n_elements = 0;
+      return TRUE;
+    }
+
+  /* value_pos may be just past the previous struct, not yet padded;
+   * the last element is not padded either
+   */
+  pos = _DBUS_ALIGN_VALUE (pos, 8);
+  *value = _dbus_string_get_const_data_len (reader->value_str,
+                                            pos, end_pos - pos);
+  *n_elements = (end_pos - pos - plan->fixed_size) /
+    _DBUS_ALIGN_VALUE (plan->fixed_size, 8) + 1;
+
+  return TRUE;
+}
+
 /**
  * Initialize a new reader pointing to the first type and
  * corresponding value that's a child of the current container. It's
@@ -2735,6 +2793,104 @@ _dbus_type_writer_set_enabled (DBusTypeWriter   *writer,
   writer->enabled = enabled != FALSE;
 }
 
+/**
+ * Checks whether the reader reads the values of a whole block, as one
+ * made with _dbus_type_reader_init() does, rather than the inside of
+ * a container or only types.
+ *
+ * @param reader the reader
+ * @returns #TRUE if it is a top-level values reader
+ */
+dbus_bool_t
+_dbus_type_reader_is_toplevel (const DBusTypeReader *reader)
+{
+  return reader->klass == &body_reader_class;
+}
+
+/**
+ * Moves a top-level reader straight to a value, as if it had been
+ * advanced there with _dbus_type_reader_next(). The positions must be
+ * ones such a reader has been at, or the end of the block.
+ *
+ * @param reader a reader for which _dbus_type_reader_is_toplevel() holds
+ * @param type_pos where the value's type is in the signature
+ * @param value_pos where the value is
+ */
+void
+_dbus_type_reader_set_position (DBusTypeReader *reader,
+                                int             type_pos,
+                                int             value_pos)
+{
+  _dbus_assert (_dbus_type_reader_is_toplevel (reader));
+
+  reader->type_pos = type_pos;
+  reader->value_pos = value_pos;
+  reader->finished = FALSE;
+}
+
+/**
+ * Compiles the struct or dict entry the reader is at into a plan, if
+ * all its members are basic types other than #DBUS_TYPE_UNIX_FD. The
+ * alignment of each member is looked up once here, and for a struct of
+ * only fixed types so is its offset, since such a struct has the same
+ * layout wherever it is (structs always start 8-aligned).
+ *
+ * @param reader a reader (types-only is fine) whose current type is a struct or dict entry
+ * @param plan the plan to fill in
+ * @returns #FALSE if the struct can't be compiled, in which case plan is garbage
+ */
+dbus_bool_t
+_dbus_marshal_plan_compile (DBusTypeReader  *reader,
+                            DBusMarshalPlan *plan)
+{
+  DBusTypeReader sub;
+  int current_type;
+  int offset;
+
+  _dbus_assert (_dbus_type_reader_get_current_type (reader) == DBUS_TYPE_STRUCT ||
+                _dbus_type_reader_get_current_type (reader) == DBUS_TYPE_DICT_ENTRY);
+
+  plan->n_members = 0;
+  offset = 0;
+
+  _dbus_type_reader_recurse (reader, &sub);
+
+  while ((current_type = _dbus_type_reader_get_current_type (&sub)) != DBUS_TYPE_INVALID)
+    {
+      int alignment;
+
+      if (!dbus_type_is_basic (current_type) ||
+          current_type == DBUS_TYPE_UNIX_FD ||
+          plan->n_members == DBUS_MARSHAL_PLAN_MAX_MEMBERS)
+        return FALSE;
+
+      alignment = _dbus_type_get_alignment (current_type);
+
+      plan->types[plan->n_members] = current_type;
+      plan->alignments[plan->n_members] = alignment;
+
+      if (offset >= 0)
+        {
+          if (dbus_type_is_fixed (current_type))
+            {
+              /* a fixed type is as big as its alignment */
+              offset = _DBUS_ALIGN_VALUE (offset, alignment);
+              plan->offsets[plan->n_members] = offset;
+              offset += alignment;
+            }
+          else
+            offset = -1;
+        }
+
+      plan->n_members += 1;
+      _dbus_type_reader_next (&sub);
+    }
+
+  plan->fixed_size = offset;
+
+  return TRUE;
+}
+
 /** @} */ /* end of DBusMarshal group */
 
 /* tests in dbus-marshal-recursive-util.c */
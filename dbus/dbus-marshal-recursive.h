@@ -31,6 +31,7 @@ typedef struct DBusTypeReader      DBusTypeReader;
 typedef struct DBusTypeWriter      DBusTypeWriter;
 typedef struct DBusTypeReaderClass DBusTypeReaderClass;
 typedef struct DBusArrayLenFixup   DBusArrayLenFixup;
+typedef struct DBusMarshalPlan     DBusMarshalPlan;
 
 /**
  * The type reader is an iterator for reading values from a block of
@@ -96,6 +97,23 @@ struct DBusArrayLenFixup
   int new_len;           /**< the new value of the length in the written-out block */
 };
 
+/** Most members a struct can have and still be compiled into a #DBusMarshalPlan */
+#define DBUS_MARSHAL_PLAN_MAX_MEMBERS 16
+
+/**
+ * A struct or dict entry made only of basic types, compiled from its
+ * signature once so that each element of an array of them can be
+ * walked without going back through a #DBusTypeReader.
+ */
+struct DBusMarshalPlan
+{
+  int n_members;                                            /**< Number of members */
+  unsigned char types[DBUS_MARSHAL_PLAN_MAX_MEMBERS];       /**< Typecode of each member */
+  unsigned char alignments[DBUS_MARSHAL_PLAN_MAX_MEMBERS];  /**< Alignment of each member */
+  unsigned char offsets[DBUS_MARSHAL_PLAN_MAX_MEMBERS];     /**< Offset of each member from the struct start, if fixed_size isn't -1 */
+  int fixed_size;                                           /**< Size of the struct if all members are fixed, otherwise -1 */
+};
+
 void        _dbus_type_reader_init                      (DBusTypeReader        *reader,
                                                          int                    byte_order,
                                                          const DBusString      *type_str,
@@ -116,6 +134,10 @@ void        _dbus_type_reader_read_fixed_multi          (const DBusTypeReader  *
                                                          int                   *n_elements);
 void        _dbus_type_reader_read_raw                  (const DBusTypeReader  *reader,
                                                          const unsigned char  **value_location);
+dbus_bool_t _dbus_type_reader_read_fixed_struct_multi   (const DBusTypeReader  *reader,
+                                                         DBusMarshalPlan       *plan,
+                                                         const void           **value,
+                                                         int                   *n_elements);
 void        _dbus_type_reader_recurse                   (DBusTypeReader        *reader,
                                                          DBusTypeReader        *subreader);
 dbus_bool_t _dbus_type_reader_next                      (DBusTypeReader        *reader);
@@ -187,5 +209,12 @@ dbus_bool_t _dbus_type_writer_write_reader_partial (DBusTypeWriter        *write
 void        _dbus_type_writer_set_enabled          (DBusTypeWriter        *writer,
                                                     dbus_bool_t            enabled);
 
+dbus_bool_t _dbus_type_reader_is_toplevel          (const DBusTypeReader  *reader);
+void        _dbus_type_reader_set_position         (DBusTypeReader        *reader,
+                                                    int                    type_pos,
+                                                    int                    value_pos);
+dbus_bool_t _dbus_marshal_plan_compile             (DBusTypeReader        *reader,
+                                                    DBusMarshalPlan       *plan);
+
 
 #endif /* DBUS_MARSHAL_RECURSIVE_H */
@@ -463,6 +463,19 @@ _dbus_marshal_validate_test (void)
       ++i;
     }
 
+  /* A cached signature is only reused for exactly the same bytes */
+  _dbus_string_init_const (&str, "a{sv}a{sv");
+  if (!_dbus_validate_signature (&str, 0, 5) ||
+      !_dbus_validate_signature (&str, 0, 5))
+    _dbus_assert_not_reached ("a{sv} should be valid, and again from the cache");
+  if (_dbus_validate_signature (&str, 5, 4) ||
+      _dbus_validate_signature (&str, 0, 4) ||
+      _dbus_validate_signature (&str, 1, 5))
+    _dbus_assert_not_reached ("part of a cached signature was valid");
+  if (_dbus_validate_signature_with_reason (&str, 5, 4) !=
+      DBUS_INVALID_DICT_ENTRY_STARTED_BUT_NOT_ENDED)
+    _dbus_assert_not_reached ("wrong reason for a{sv");
+
   /* Validate claimed length longer than real length */
   _dbus_string_init_const (&str, "abc.efg");
   if (_dbus_validate_bus_name (&str, 0, 8))
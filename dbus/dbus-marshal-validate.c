@@ -28,6 +28,9 @@
 #include "dbus-marshal-basic.h"
 #include "dbus-signature.h"
 #include "dbus-string.h"
+#include "dbus-hash.h"
+
+#include <string.h>
 
 /**
  * @addtogroup DBusMarshal
@@ -35,22 +38,83 @@
  * @{
  */
 
-/**
- * Verifies that the range of type_str from type_pos to type_end is a
- * valid signature.  If this function returns #TRUE, it will be safe
- * to iterate over the signature with a types-only #DBusTypeReader.
- * The range passed in should NOT include the terminating
- * nul/DBUS_TYPE_INVALID.
- *
- * @param type_str the string
- * @param type_pos where the typecodes start
- * @param len length of typecodes
- * @returns #DBUS_VALID if valid, reason why invalid otherwise
+/*
+ * Signatures that have been found valid, so that loading a message
+ * whose signature was seen before doesn't walk it again. Real traffic
+ * uses a few hundred distinct signatures at most. The cache is direct
+ * mapped: a signature that collides with another just replaces it,
+ * so there is nothing to evict and no way to make it grow. Only
+ * valid signatures go in, and a hit needs the same bytes, so the
+ * worst a client can do is make everything miss.
  */
-DBusValidity
-_dbus_validate_signature_with_reason (const DBusString *type_str,
-                                      int               type_pos,
-                                      int               len)
+
+/** Number of slots; a power of two */
+#define SIGNATURE_CACHE_SIZE 256
+/** Longest signature kept; longer ones are always validated */
+#define SIGNATURE_CACHE_MAX_LEN 55
+
+typedef struct
+{
+  unsigned int hash;                 /**< hash of sig */
+  unsigned char len;                 /**< length of sig, 0 if the slot is empty */
+  char sig[SIGNATURE_CACHE_MAX_LEN]; /**< the signature, not nul-terminated */
+} CachedSignature;
+
+static CachedSignature signature_cache[SIGNATURE_CACHE_SIZE];
+static dbus_bool_t signature_cache_hash_ready = FALSE;
+_DBUS_DEFINE_GLOBAL_LOCK (signature_cache);
+
+/* Also returns the hash of sig, for signature_cache_insert(); the
+ * first lookup sets up the key it's hashed with.
+ */
+static dbus_bool_t
+signature_cache_lookup (const char   *sig,
+                        int           len,
+                        unsigned int *hash_p)
+{
+  CachedSignature *slot;
+  unsigned int hash;
+  dbus_bool_t found;
+
+  _DBUS_LOCK (signature_cache);
+
+  if (!signature_cache_hash_ready)
+    {
+      _dbus_hash_key_init ();
+      signature_cache_hash_ready = TRUE;
+    }
+
+  hash = _dbus_hash_string (sig, len);
+  slot = &signature_cache[hash & (SIGNATURE_CACHE_SIZE - 1)];
+
+  found = slot->len == len && slot->hash == hash &&
+    memcmp (slot->sig, sig, len) == 0;
+  _DBUS_UNLOCK (signature_cache);
+
+  *hash_p = hash;
+  return found;
+}
+
+static void
+signature_cache_insert (const char   *sig,
+                        int           len,
+                        unsigned int  hash)
+{
+  CachedSignature *slot;
+
+  slot = &signature_cache[hash & (SIGNATURE_CACHE_SIZE - 1)];
+
+  _DBUS_LOCK (signature_cache);
+  slot->hash = hash;
+  slot->len = len;
+  memcpy (slot->sig, sig, len);
+  _DBUS_UNLOCK (signature_cache);
+}
+
+static DBusValidity
+validate_signature (const DBusString *type_str,
+                    int               type_pos,
+                    int               len)
 {
   const unsigned char *p;
   const unsigned char *end;
@@ -291,6 +355,278 @@ out:
   return result;
 }
 
+/**
+ * Verifies that the range of type_str from type_pos to type_end is a
+ * valid signature.  If this function returns #TRUE, it will be safe
+ * to iterate over the signature with a types-only #DBusTypeReader.
+ * The range passed in should NOT include the terminating
+ * nul/DBUS_TYPE_INVALID.
+ *
+ * Signatures found valid are remembered for the rest of the process,
+ * and seeing one again costs a hash and a compare.
+ *
+ * @param type_str the string
+ * @param type_pos where the typecodes start
+ * @param len length of typecodes
+ * @returns #DBUS_VALID if valid, reason why invalid otherwise
+ */
+DBusValidity
+_dbus_validate_signature_with_reason (const DBusString *type_str,
+                                      int               type_pos,
+                                      int               len)
+{
+  const char *sig;
+  unsigned int hash;
+  DBusValidity result;
+
+  _dbus_assert (type_str != NULL);
+  _dbus_assert (len >= 0);
+  _dbus_assert (type_pos >= 0);
+
+  if (len > SIGNATURE_CACHE_MAX_LEN)
+    return validate_signature (type_str, type_pos, len);
+
+  sig = _dbus_string_get_const_data_len (type_str, type_pos, len);
+
+  /* the empty signature and a single basic type or variant, which is
+   * what every header field has, are quicker to check than to look up
+   */
+  if (len == 0)
+    return DBUS_VALID;
+
+  if (len == 1)
+    {
+      switch (*sig)
+        {
+        case DBUS_TYPE_BYTE:
+        case DBUS_TYPE_BOOLEAN:
+        case DBUS_TYPE_INT16:
+        case DBUS_TYPE_UINT16:
+        case DBUS_TYPE_INT32:
+        case DBUS_TYPE_UINT32:
+        case DBUS_TYPE_UNIX_FD:
+        case DBUS_TYPE_INT64:
+        case DBUS_TYPE_UINT64:
+        case DBUS_TYPE_DOUBLE:
+        case DBUS_TYPE_STRING:
+        case DBUS_TYPE_OBJECT_PATH:
+        case DBUS_TYPE_SIGNATURE:
+        case DBUS_TYPE_VARIANT:
+          return DBUS_VALID;
+        default:
+          /* for the reason */
+          return validate_signature (type_str, type_pos, len);
+        }
+    }
+
+  if (signature_cache_lookup (sig, len, &hash))
+    return DBUS_VALID;
+
+  result = validate_signature (type_str, type_pos, len);
+
+  if (result == DBUS_VALID)
+    signature_cache_insert (sig, len, hash);
+
+  return result;
+}
+
+/* Validates one value of a basic type at p; the part of
+ * validate_body_helper() that doesn't need a type reader.
+ */
+static DBusValidity
+validate_basic_value (int                   type,
+                      int                   byte_order,
+                      const unsigned char  *p,
+                      const unsigned char  *end,
+                      const unsigned char **new_p)
+{
+  const unsigned char *a;
+  int alignment;
+
+  /* Guarantee that p has one byte to look at */
+  if (p == end)
+    return DBUS_INVALID_NOT_ENOUGH_DATA;
+
+  switch (type)
+    {
+    case DBUS_TYPE_BYTE:
+      ++p;
+      break;
+
+    case DBUS_TYPE_BOOLEAN:
+    case DBUS_TYPE_INT16:
+    case DBUS_TYPE_UINT16:
+    case DBUS_TYPE_INT32:
+    case DBUS_TYPE_UINT32:
+    case DBUS_TYPE_UNIX_FD:
+    case DBUS_TYPE_INT64:
+    case DBUS_TYPE_UINT64:
+    case DBUS_TYPE_DOUBLE:
+      alignment = _dbus_type_get_alignment (type);
+      a = _DBUS_ALIGN_ADDRESS (p, alignment);
+      if (a >= end)
+        return DBUS_INVALID_NOT_ENOUGH_DATA;
+      while (p != a)
+        {
+          if (*p != '\0')
+            return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+          ++p;
+        }
+      
+      if (type == DBUS_TYPE_BOOLEAN)
+        {
+          dbus_uint32_t v = _dbus_unpack_uint32 (byte_order,
+                                                 p);
+          if (!(v == 0 || v == 1))
+            return DBUS_INVALID_BOOLEAN_NOT_ZERO_OR_ONE;
+        }
+      
+      p += alignment;
+      break;
+
+    case DBUS_TYPE_STRING:
+    case DBUS_TYPE_OBJECT_PATH:
+      {
+        dbus_uint32_t claimed_len;
+        DBusString str;
+
+        a = _DBUS_ALIGN_ADDRESS (p, 4);
+        if (a + 4 > end)
+          return DBUS_INVALID_NOT_ENOUGH_DATA;
+        while (p != a)
+          {
+            if (*p != '\0')
+              return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+            ++p;
+          }
+
+        claimed_len = _dbus_unpack_uint32 (byte_order, p);
+        p += 4;
+
+        /* p may now be == end */
+        _dbus_assert (p <= end);
+
+        if (claimed_len > (unsigned long) (end - p))
+          return DBUS_INVALID_LENGTH_OUT_OF_BOUNDS;
+
+        _dbus_string_init_const_len (&str, p, claimed_len);
+        if (type == DBUS_TYPE_OBJECT_PATH)
+          {
+            if (!_dbus_validate_path (&str, 0,
+                                      _dbus_string_get_length (&str)))
+              return DBUS_INVALID_BAD_PATH;
+          }
+        else
+          {
+            if (!_dbus_string_validate_utf8 (&str, 0,
+                                             _dbus_string_get_length (&str)))
+              return DBUS_INVALID_BAD_UTF8_IN_STRING;
+          }
+
+        p += claimed_len;
+
+        /* check nul termination */
+        if (p == end)
+          return DBUS_INVALID_NOT_ENOUGH_DATA;
+
+        if (*p != '\0')
+          return DBUS_INVALID_STRING_MISSING_NUL;
+        ++p;
+      }
+      break;
+
+    case DBUS_TYPE_SIGNATURE:
+      {
+        dbus_uint32_t claimed_len;
+        DBusString str;
+        DBusValidity validity;
+
+        claimed_len = *p;
+        ++p;
+
+        /* 1 is for nul termination */
+        if (claimed_len + 1 > (unsigned long) (end - p))
+          return DBUS_INVALID_SIGNATURE_LENGTH_OUT_OF_BOUNDS;
+
+        _dbus_string_init_const_len (&str, p, claimed_len);
+        validity =
+          _dbus_validate_signature_with_reason (&str, 0,
+                                                _dbus_string_get_length (&str));
+
+        if (validity != DBUS_VALID)
+          return validity;
+
+        p += claimed_len;
+
+        _dbus_assert (p < end);
+        if (*p != DBUS_TYPE_INVALID)
+          return DBUS_INVALID_SIGNATURE_MISSING_NUL;
+
+        ++p;
+
+        _dbus_verbose ("p = %p end = %p claimed_len %u\n", p, end, claimed_len);
+      }
+      break;
+
+    default:
+      _dbus_assert_not_reached ("not a basic typecode");
+      break;
+    }
+
+  if (p > end)
+    return DBUS_INVALID_NOT_ENOUGH_DATA;
+
+  *new_p = p;
+
+  return DBUS_VALID;
+}
+
+/* Validates the elements of an array of structs whose signature was
+ * compiled into plan, the same way validate_body_helper() would one
+ * element at a time.
+ */
+static DBusValidity
+validate_struct_array_by_plan (const DBusMarshalPlan *plan,
+                               int                    byte_order,
+                               const unsigned char   *p,
+                               const unsigned char   *array_end,
+                               const unsigned char   *end,
+                               const unsigned char  **new_p)
+{
+  while (p < array_end)
+    {
+      const unsigned char *a;
+      int i;
+
+      if (p == end)
+        return DBUS_INVALID_NOT_ENOUGH_DATA;
+
+      a = _DBUS_ALIGN_ADDRESS (p, 8);
+      if (a > end)
+        return DBUS_INVALID_NOT_ENOUGH_DATA;
+      while (p != a)
+        {
+          if (*p != '\0')
+            return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+          ++p;
+        }
+
+      for (i = 0; i < plan->n_members; i++)
+        {
+          DBusValidity validity;
+
+          validity = validate_basic_value (plan->types[i], byte_order,
+                                           p, end, &p);
+          if (validity != DBUS_VALID)
+            return validity;
+        }
+    }
+
+  *new_p = p;
+
+  return DBUS_VALID;
+}
+
 /* note: this function is also used to validate the header's values,
  * since the header is a valid body with a particular signature.
  */
@@ -333,9 +669,6 @@ validate_body_helper (DBusTypeReader       *reader,
       switch (current_type)
         {
         case DBUS_TYPE_BYTE:
-          ++p;
-          break;
-
         case DBUS_TYPE_BOOLEAN:
         case DBUS_TYPE_INT16:
         case DBUS_TYPE_UINT16:
@@ -345,33 +678,23 @@ validate_body_helper (DBusTypeReader       *reader,
         case DBUS_TYPE_INT64:
         case DBUS_TYPE_UINT64:
         case DBUS_TYPE_DOUBLE:
-          alignment = _dbus_type_get_alignment (current_type);
-          a = _DBUS_ALIGN_ADDRESS (p, alignment);
-          if (a >= end)
-            return DBUS_INVALID_NOT_ENOUGH_DATA;
-          while (p != a)
-            {
-              if (*p != '\0')
-                return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
-              ++p;
-            }
-          
-          if (current_type == DBUS_TYPE_BOOLEAN)
-            {
-              dbus_uint32_t v = _dbus_unpack_uint32 (byte_order,
-                                                     p);
-              if (!(v == 0 || v == 1))
-                return DBUS_INVALID_BOOLEAN_NOT_ZERO_OR_ONE;
-            }
-          
-          p += alignment;
+        case DBUS_TYPE_STRING:
+        case DBUS_TYPE_OBJECT_PATH:
+        case DBUS_TYPE_SIGNATURE:
+          {
+            DBusValidity validity;
+
+            validity = validate_basic_value (current_type, byte_order,
+                                             p, end, &p);
+            if (validity != DBUS_VALID)
+              return validity;
+          }
           break;
 
         case DBUS_TYPE_ARRAY:
-        case DBUS_TYPE_STRING:
-        case DBUS_TYPE_OBJECT_PATH:
           {
             dbus_uint32_t claimed_len;
+            int array_elem_type;
 
             a = _DBUS_ALIGN_ADDRESS (p, 4);
             if (a + 4 > end)
@@ -389,60 +712,37 @@ validate_body_helper (DBusTypeReader       *reader,
             /* p may now be == end */
             _dbus_assert (p <= end);
 
-            if (current_type == DBUS_TYPE_ARRAY)
-              {
-                int array_elem_type = _dbus_type_reader_get_element_type (reader);
+            array_elem_type = _dbus_type_reader_get_element_type (reader);
 
-                if (!_dbus_type_is_valid (array_elem_type))
-                  {
-                    return DBUS_INVALID_UNKNOWN_TYPECODE;
-                  }
+            if (!_dbus_type_is_valid (array_elem_type))
+              {
+                return DBUS_INVALID_UNKNOWN_TYPECODE;
+              }
 
-                alignment = _dbus_type_get_alignment (array_elem_type);
+            alignment = _dbus_type_get_alignment (array_elem_type);
 
-                a = _DBUS_ALIGN_ADDRESS (p, alignment);
+            a = _DBUS_ALIGN_ADDRESS (p, alignment);
 
-                /* a may now be == end */
-                if (a > end)
-                  return DBUS_INVALID_NOT_ENOUGH_DATA;
+            /* a may now be == end */
+            if (a > end)
+              return DBUS_INVALID_NOT_ENOUGH_DATA;
 
-                while (p != a)
-                  {
-                    if (*p != '\0')
-                      return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
-                    ++p;
-                  }
+            while (p != a)
+              {
+                if (*p != '\0')
+                  return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+                ++p;
               }
 
             if (claimed_len > (unsigned long) (end - p))
               return DBUS_INVALID_LENGTH_OUT_OF_BOUNDS;
 
-            if (current_type == DBUS_TYPE_OBJECT_PATH)
-              {
-                DBusString str;
-                _dbus_string_init_const_len (&str, p, claimed_len);
-                if (!_dbus_validate_path (&str, 0,
-                                          _dbus_string_get_length (&str)))
-                  return DBUS_INVALID_BAD_PATH;
-
-                p += claimed_len;
-              }
-            else if (current_type == DBUS_TYPE_STRING)
-              {
-                DBusString str;
-                _dbus_string_init_const_len (&str, p, claimed_len);
-                if (!_dbus_string_validate_utf8 (&str, 0,
-                                                 _dbus_string_get_length (&str)))
-                  return DBUS_INVALID_BAD_UTF8_IN_STRING;
-
-                p += claimed_len;
-              }
-            else if (current_type == DBUS_TYPE_ARRAY && claimed_len > 0)
+            if (claimed_len > 0)
               {
                 DBusTypeReader sub;
+                DBusMarshalPlan plan;
                 DBusValidity validity;
                 const unsigned char *array_end;
-                int array_elem_type;
 
                 if (claimed_len > DBUS_MAXIMUM_ARRAY_LENGTH)
                   return DBUS_INVALID_ARRAY_LENGTH_EXCEEDS_MAXIMUM;
@@ -455,8 +755,6 @@ validate_body_helper (DBusTypeReader       *reader,
 
                 array_end = p + claimed_len;
 
-                array_elem_type = _dbus_type_reader_get_element_type (reader);
-
                 /* avoid recursive call to validate_body_helper if this is an array
                  * of fixed-size elements
                  */ 
@@ -487,6 +785,23 @@ validate_body_helper (DBusTypeReader       *reader,
                       }
                   }
 
+                /* for structs of basic types, compile the layout once
+                 * rather than walking the signature again per element
+                 * (the plan covers the 2 levels of nesting the generic
+                 * walk would go through)
+                 */
+                else if ((array_elem_type == DBUS_TYPE_STRUCT ||
+                          array_elem_type == DBUS_TYPE_DICT_ENTRY) &&
+                         total_depth + 2 <= DBUS_MAXIMUM_TYPE_RECURSION_DEPTH * 2 &&
+                         _dbus_marshal_plan_compile (&sub, &plan))
+                  {
+                    validity = validate_struct_array_by_plan (&plan, byte_order,
+                                                              p, array_end, end,
+                                                              &p);
+                    if (validity != DBUS_VALID)
+                      return validity;
+                  }
+
                 else
                   {
                     while (p < array_end)
@@ -502,50 +817,6 @@ validate_body_helper (DBusTypeReader       *reader,
                 if (p != array_end)
                   return DBUS_INVALID_ARRAY_LENGTH_INCORRECT;
               }
-
-            /* check nul termination */
-            if (current_type != DBUS_TYPE_ARRAY)
-              {
-                if (p == end)
-                  return DBUS_INVALID_NOT_ENOUGH_DATA;
-
-                if (*p != '\0')
-                  return DBUS_INVALID_STRING_MISSING_NUL;
-                ++p;
-              }
-          }
-          break;
-
-        case DBUS_TYPE_SIGNATURE:
-          {
-            dbus_uint32_t claimed_len;
-            DBusString str;
-            DBusValidity validity;
-
-            claimed_len = *p;
-            ++p;
-
-            /* 1 is for nul termination */
-            if (claimed_len + 1 > (unsigned long) (end - p))
-              return DBUS_INVALID_SIGNATURE_LENGTH_OUT_OF_BOUNDS;
-
-            _dbus_string_init_const_len (&str, p, claimed_len);
-            validity =
-              _dbus_validate_signature_with_reason (&str, 0,
-                                                    _dbus_string_get_length (&str));
-
-            if (validity != DBUS_VALID)
-              return validity;
-
-            p += claimed_len;
-
-            _dbus_assert (p < end);
-            if (*p != DBUS_TYPE_INVALID)
-              return DBUS_INVALID_SIGNATURE_MISSING_NUL;
-
-            ++p;
-
-            _dbus_verbose ("p = %p end = %p claimed_len %u\n", p, end, claimed_len);
           }
           break;
 
@@ -746,6 +1017,221 @@ _dbus_validate_body_with_reason (const DBusString *expected_signature,
     }
 }
 
+/* Returns whether validation failed only because the value goes on
+ * past the end of what has arrived
+ */
+static dbus_bool_t
+validity_is_truncation (DBusValidity validity)
+{
+  switch (validity)
+    {
+    case DBUS_INVALID_NOT_ENOUGH_DATA:
+    case DBUS_INVALID_LENGTH_OUT_OF_BOUNDS:
+    case DBUS_INVALID_SIGNATURE_LENGTH_OUT_OF_BOUNDS:
+    case DBUS_INVALID_VARIANT_SIGNATURE_LENGTH_OUT_OF_BOUNDS:
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+/* Starts validating the elements of the top-level array at p one at a
+ * time, for an array that hasn't all arrived; on success state points
+ * at its first element. Returns #DBUS_VALID without doing anything if
+ * not even the array's length and padding are there yet.
+ */
+static DBusValidity
+enter_arriving_array (DBusBodyValidation  *state,
+                      DBusTypeReader      *reader,
+                      int                  byte_order,
+                      const unsigned char *start,
+                      const unsigned char *p,
+                      const unsigned char *end,
+                      int                  body_len)
+{
+  const unsigned char *a;
+  dbus_uint32_t claimed_len;
+  int array_elem_type;
+
+  a = _DBUS_ALIGN_ADDRESS (p, 4);
+  if (a + 4 > end)
+    return DBUS_VALID;
+  while (p != a)
+    {
+      if (*p != '\0')
+        return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+      ++p;
+    }
+
+  claimed_len = _dbus_unpack_uint32 (byte_order, p);
+  p += 4;
+
+  array_elem_type = _dbus_type_reader_get_element_type (reader);
+  if (!_dbus_type_is_valid (array_elem_type))
+    return DBUS_INVALID_UNKNOWN_TYPECODE;
+
+  a = _DBUS_ALIGN_ADDRESS (p, _dbus_type_get_alignment (array_elem_type));
+  if (a > end)
+    return DBUS_VALID;
+  while (p != a)
+    {
+      if (*p != '\0')
+        return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+      ++p;
+    }
+
+  if (claimed_len > (unsigned long) (body_len - (p - start)))
+    return DBUS_INVALID_LENGTH_OUT_OF_BOUNDS;
+
+  if (claimed_len > DBUS_MAXIMUM_ARRAY_LENGTH)
+    return DBUS_INVALID_ARRAY_LENGTH_EXCEEDS_MAXIMUM;
+
+  state->validated = p - start;
+  state->array_end = state->validated + claimed_len;
+
+  return DBUS_VALID;
+}
+
+/**
+ * Starts validating a body that is still arriving with
+ * _dbus_validate_body_prefix().
+ *
+ * @param state the validation state
+ * @param signature_start where the body's signature starts
+ */
+void
+_dbus_body_validation_init (DBusBodyValidation *state,
+                            int                 signature_start)
+{
+  state->signature_pos = signature_start;
+  state->validated = 0;
+  state->array_end = 0;
+}
+
+/**
+ * Validates as much as possible of a body that is still arriving,
+ * carrying on from where the last call on the same state stopped.
+ * Each complete value is validated as with
+ * _dbus_validate_body_with_reason(); a value that runs past the end of
+ * what has arrived is not an error, since the rest of it may still be
+ * on its way, and is validated once it is complete. The elements of a
+ * big top-level array of containers or strings, which is what makes
+ * most messages big, are validated one at a time as they arrive.
+ *
+ * Once len is the whole body_len, anything left is validated and the
+ * body must be exactly as long as its signature says.
+ *
+ * value_pos must be 8-aligned in memory, as for
+ * _dbus_validate_body_with_reason(). Any pointer to the body may be
+ * passed each time, as long as its bytes are the same.
+ *
+ * @param state where validation got to, from _dbus_body_validation_init()
+ * @param expected_signature the string containing the body's signature
+ * @param byte_order the byte order of the body
+ * @param value_str the string containing the body
+ * @param value_pos where the body starts
+ * @param len bytes of the body that have arrived
+ * @param body_len bytes in the whole body
+ * @returns #DBUS_VALID if nothing that has arrived is invalid
+ */
+DBusValidity
+_dbus_validate_body_prefix (DBusBodyValidation *state,
+                            const DBusString   *expected_signature,
+                            int                 byte_order,
+                            const DBusString   *value_str,
+                            int                 value_pos,
+                            int                 len,
+                            int                 body_len)
+{
+  const char *type_str;
+  const unsigned char *start;
+  const unsigned char *p;
+  const unsigned char *end;
+  dbus_bool_t complete;
+
+  _dbus_assert (state->validated <= len);
+  _dbus_assert (len <= body_len);
+  _dbus_assert (value_pos <= _dbus_string_get_length (value_str) - len);
+
+  type_str = _dbus_string_get_const_data (expected_signature);
+  start = _dbus_string_get_const_data_len (value_str, value_pos, len);
+  p = start + state->validated;
+  end = start + len;
+  complete = len == body_len;
+
+  while (type_str[state->signature_pos] != DBUS_TYPE_INVALID)
+    {
+      DBusTypeReader reader;
+      DBusValidity validity;
+      const unsigned char *value_end;
+
+      _dbus_type_reader_init_types_only (&reader, expected_signature,
+                                         state->signature_pos);
+
+      if (state->array_end > 0)
+        {
+          DBusTypeReader sub;
+
+          _dbus_type_reader_recurse (&reader, &sub);
+
+          while (p < start + state->array_end)
+            {
+              validity = validate_body_helper (&sub, byte_order, FALSE, 1,
+                                               p, end, &value_end);
+              if (validity != DBUS_VALID)
+                {
+                  if (!complete && validity_is_truncation (validity))
+                    return DBUS_VALID;
+                  return validity;
+                }
+
+              p = value_end;
+              state->validated = p - start;
+            }
+
+          if (p != start + state->array_end)
+            return DBUS_INVALID_ARRAY_LENGTH_INCORRECT;
+
+          state->array_end = 0;
+        }
+      else
+        {
+          validity = validate_body_helper (&reader, byte_order, FALSE, 0,
+                                           p, end, &value_end);
+          if (validity != DBUS_VALID)
+            {
+              if (complete || !validity_is_truncation (validity))
+                return validity;
+
+              if (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_ARRAY &&
+                  !dbus_type_is_fixed (_dbus_type_reader_get_element_type (&reader)))
+                {
+                  validity = enter_arriving_array (state, &reader, byte_order,
+                                                   start, p, end, body_len);
+                  if (validity != DBUS_VALID || state->array_end == 0)
+                    return validity;
+
+                  /* go round again to start on the elements */
+                  p = start + state->validated;
+                  continue;
+                }
+
+              return DBUS_VALID;
+            }
+
+          p = value_end;
+          state->validated = p - start;
+        }
+
+      _dbus_type_signature_next (type_str, &state->signature_pos);
+    }
+
+  if (complete && p < end)
+    return DBUS_INVALID_TOO_MUCH_DATA;
+
+  return DBUS_VALID;
+}
+
 /**
  * Determine wether the given character is valid as the first character
  * in a name.
@@ -127,6 +127,28 @@ DBusValidity _dbus_validate_body_with_reason      (const DBusString *expected_si
                                                    int               value_pos,
                                                    int               len);
 
+/**
+ * Where _dbus_validate_body_prefix() has got to in a body
+ */
+typedef struct
+{
+  int signature_pos; /**< Next type to validate, in the signature's string */
+  int validated;     /**< Bytes of the body validated so far */
+  int array_end;     /**< Where the elements of a top-level array being
+                      * validated one at a time end, or 0
+                      */
+} DBusBodyValidation;
+
+void         _dbus_body_validation_init           (DBusBodyValidation *state,
+                                                   int                 signature_start);
+DBusValidity _dbus_validate_body_prefix           (DBusBodyValidation *state,
+                                                   const DBusString   *expected_signature,
+                                                   int                 byte_order,
+                                                   const DBusString   *value_str,
+                                                   int                 value_pos,
+                                                   int                 len,
+                                                   int                 body_len);
+
 const char *_dbus_validity_to_error_message (DBusValidity validity);
 
 dbus_bool_t _dbus_validate_path       (const DBusString *str,
@@ -748,6 +748,82 @@ _dbus_register_shutdown_func (DBusShutdownFunction  func,
   return TRUE;
 }
 
+/* Whether _dbus_memory_account() counts, see _dbus_memory_set_accounting() */
+dbus_bool_t _dbus_memory_accounting_enabled = FALSE;
+
+static long accounted_bytes[DBUS_MEMORY_N_TAGS];
+
+static const char *tag_names[DBUS_MEMORY_N_TAGS] = {
+  "MatchRules",
+  "Policy",
+  "Loaders",
+  "OutgoingQueues",
+  "Registry",
+  "Activation"
+};
+
+/**
+ * Turns on counting the bytes held by each #DBusMemoryTag. The
+ * counts are only right if this is done before anything they cover
+ * is allocated, and they are plain globals, so only a program that
+ * does all its work in one thread should turn them on; the bus
+ * daemon does.
+ *
+ * @param enabled #TRUE to count
+ */
+void
+_dbus_memory_set_accounting (dbus_bool_t enabled)
+{
+  _dbus_memory_accounting_enabled = enabled;
+}
+
+/**
+ * Adds to the bytes held for a tag, or takes away with a negative
+ * count. Use _dbus_memory_account() rather than calling this
+ * directly.
+ *
+ * @param tag what the memory is for
+ * @param bytes how much was allocated, negative if freed
+ */
+void
+_dbus_memory_account_bytes (DBusMemoryTag tag,
+                            long          bytes)
+{
+  _dbus_assert (tag < DBUS_MEMORY_N_TAGS);
+
+  accounted_bytes[tag] += bytes;
+}
+
+/**
+ * Gets the bytes currently held for a tag. This is what the code
+ * says it holds, not what malloc() has handed out, so overheads and
+ * anything not accounted for are missing.
+ *
+ * @param tag the tag
+ * @returns the number of bytes
+ */
+long
+_dbus_memory_get_accounted (DBusMemoryTag tag)
+{
+  _dbus_assert (tag < DBUS_MEMORY_N_TAGS);
+
+  return accounted_bytes[tag];
+}
+
+/**
+ * Gets the name of a tag, for reports.
+ *
+ * @param tag the tag
+ * @returns a short capitalized name
+ */
+const char *
+_dbus_memory_tag_name (DBusMemoryTag tag)
+{
+  _dbus_assert (tag < DBUS_MEMORY_N_TAGS);
+
+  return tag_names[tag];
+}
+
 /** @} */ /* End of private API docs block */
 
 
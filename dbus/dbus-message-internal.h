@@ -31,13 +31,29 @@
 DBUS_BEGIN_DECLS
 
 typedef struct DBusMessageLoader DBusMessageLoader;
+typedef struct DBusBodyCheck DBusBodyCheck;
+
+/**
+ * Called by the loader to have the body of a big message validated
+ * somewhere other than where the loader runs; see
+ * _dbus_message_loader_set_body_check_function().
+ *
+ * @returns #FALSE if the check was not taken on
+ */
+typedef dbus_bool_t (* DBusBodyCheckFunction) (DBusBodyCheck *check,
+                                               void          *data);
 
 void _dbus_message_get_network_data  (DBusMessage       *message,
 				      const DBusString **header,
-				      const DBusString **body);
+				      const DBusString **body,
+				      const DBusString **tail);
 void _dbus_message_get_unix_fds      (DBusMessage *message,
                                       const int **fds,
                                       unsigned *n_fds);
+long _dbus_message_get_size          (DBusMessage       *message);
+
+dbus_bool_t _dbus_message_iter_init_unswapped   (DBusMessage     *message,
+                                                 DBusMessageIter *iter);
 
 void        _dbus_message_lock                  (DBusMessage  *message);
 void        _dbus_message_unlock                (DBusMessage  *message);
@@ -48,6 +64,10 @@ void        _dbus_message_add_counter_link      (DBusMessage  *message,
 void        _dbus_message_remove_counter        (DBusMessage  *message,
                                                  DBusCounter  *counter,
                                                  DBusList    **link_return);
+void        _dbus_message_remove_counter_link   (DBusMessage  *message,
+                                                 DBusList     *link);
+DBusList*   _dbus_message_get_queue_link        (DBusMessage  *message);
+void        _dbus_message_queue_clear           (DBusList    **queue);
 
 DBusMessageLoader* _dbus_message_loader_new                   (void);
 DBusMessageLoader* _dbus_message_loader_ref                   (DBusMessageLoader  *loader);
@@ -84,6 +104,23 @@ void               _dbus_message_loader_set_max_message_unix_fds(DBusMessageLoad
                                                                  long                n);
 long               _dbus_message_loader_get_max_message_unix_fds(DBusMessageLoader  *loader);
 
+void               _dbus_message_loader_set_trust_bodies      (DBusMessageLoader  *loader,
+                                                               dbus_bool_t         trust);
+void               _dbus_message_loader_trim                  (DBusMessageLoader  *loader);
+void               _dbus_message_loader_set_body_check_function (DBusMessageLoader    *loader,
+                                                                 long                  min_size,
+                                                                 DBusBodyCheckFunction function,
+                                                                 void                 *data);
+dbus_bool_t        _dbus_message_loader_get_is_checking       (DBusMessageLoader  *loader);
+void               _dbus_message_loader_body_check_done       (DBusMessageLoader  *loader,
+                                                               DBusBodyCheck      *check);
+
+DBusBodyCheck *    _dbus_body_check_ref                       (DBusBodyCheck      *check);
+void               _dbus_body_check_unref                     (DBusBodyCheck      *check);
+void               _dbus_body_check_run                       (DBusBodyCheck      *check);
+
+void               _dbus_message_cache_trim                   (void);
+
 DBUS_END_DECLS
 
 #endif /* DBUS_MESSAGE_INTERNAL_H */
@@ -68,12 +68,34 @@ struct DBusMessageLoader
   long max_message_size; /**< Maximum size of a message */
   long max_message_unix_fds; /**< Maximum unix fds in a message */
 
+  int accounted;         /**< Bytes of data last reported to memory accounting */
+
+  DBusMessage *partial;  /**< Big message at the start of data whose header is
+                          * loaded while the rest of it arrives, or #NULL
+                          */
+  DBusBodyValidation partial_validation; /**< How much of partial's body
+                                          * has been validated
+                                          */
+  int partial_tried;     /**< Bytes of partial's body there were when
+                          * validation last stopped short
+                          */
+
+  DBusBodyCheck *check;  /**< Message whose body is being validated
+                          * elsewhere, held back with everything after
+                          * it until that is done, or #NULL
+                          */
+  long check_min_size;   /**< Bodies at least this big go to check_function */
+  DBusBodyCheckFunction check_function; /**< Validates big bodies elsewhere, or #NULL */
+  void *check_data;      /**< Data for check_function */
+
   DBusValidity corruption_reason; /**< why we were corrupted */
 
   unsigned int corrupted : 1; /**< We got broken data, and are no longer working */
 
   unsigned int buffer_outstanding : 1; /**< Someone is using the buffer to read */
 
+  unsigned int trust_bodies : 1; /**< Peer is trusted; skip body validation */
+
 #ifdef HAVE_UNIX_FD_PASSING
   unsigned int unix_fds_outstanding : 1; /**< Someone is using the unix fd array to read */
 
@@ -87,6 +109,19 @@ struct DBusMessageLoader
 /** How many bits are in the changed_stamp used to validate iterators */
 #define CHANGED_STAMP_BITS 21
 
+/**
+ * A message body buffer shared between a message and its copies made
+ * with dbus_message_copy(), or arrays handed out with
+ * dbus_message_iter_ref_fixed_array(). Whoever holds the last
+ * reference owns the buffer; any other holder copies it out before
+ * writing.
+ */
+struct DBusMessageBody
+{
+  DBusAtomic refcount; /**< Number of holders whose body points here */
+  DBusString data;     /**< The body bytes */
+};
+
 /**
  * @brief Internals of DBusMessage
  *
@@ -101,6 +136,7 @@ struct DBusMessage
   DBusHeader header; /**< Header network data and associated cache */
 
   DBusString body;   /**< Body network data. */
+  DBusMessageBody *shared_body; /**< If non-#NULL, body is a constant string pointing into this */
 
   char byte_order; /**< Message byte order. */
 
@@ -111,6 +147,8 @@ struct DBusMessage
 #endif
 
   DBusList *counters;   /**< 0-N DBusCounter used to track message size/unix fds. */
+
+  DBusList queue_link;  /**< Hook for the receive queue the message is in, see _dbus_message_get_queue_link() */
   long size_counter_delta;   /**< Size we incremented the size counters by.   */
 
   dbus_uint32_t changed_stamp : CHANGED_STAMP_BITS; /**< Incremented when iterators are invalidated. */
@@ -131,6 +169,27 @@ struct DBusMessage
 
   long unix_fd_counter_delta; /**< Size we incremented the unix fd counter by */
 #endif
+
+  int *arg_offsets; /**< For each top-level argument, where its type is
+                     * relative to the start of the signature and where
+                     * its value is in the body; built by
+                     * dbus_message_iter_seek(), #NULL if not built
+                     */
+  int n_args;       /**< Number of arguments in arg_offsets */
+
+  DBusString *signature; /**< Copy of the SIGNATURE field that appends
+                          * add their types to, kept between appends so
+                          * each one doesn't copy it out of the header
+                          * again; #NULL if not made yet
+                          */
+
+  DBusString tail;  /**< Caller-owned array appended by reference, sent
+                     * after the body; constant, empty if none
+                     */
+  DBusFreeFunction tail_free_function; /**< Frees tail_free_data once the
+                                        * tail is no longer needed
+                                        */
+  void *tail_free_data; /**< Passed to tail_free_function */
 };
 
 dbus_bool_t _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
@@ -27,6 +27,7 @@
 #include "dbus-test.h"
 #include "dbus-message-private.h"
 #include "dbus-marshal-recursive.h"
+#include "dbus-marshal-byteswap.h"
 #include "dbus-string.h"
 #ifdef HAVE_UNIX_FD_PASSING
 #include "dbus-sysdeps-unix.h"
@@ -125,6 +126,19 @@ print_validities_seen (dbus_bool_t not_seen)
     }
 }
 
+/* Keeps the check for the test to run and hand back itself */
+static dbus_bool_t
+take_body_check (DBusBodyCheck *check,
+                 void          *data)
+{
+  DBusBodyCheck **check_p = data;
+
+  _dbus_assert (*check_p == NULL);
+  *check_p = _dbus_body_check_ref (check);
+
+  return TRUE;
+}
+
 static void
 check_memleaks (void)
 {
@@ -948,11 +962,20 @@ verify_test_message (DBusMessage *message)
  *
  * @returns #TRUE on success.
  */
+static void
+count_free (void *data)
+{
+  int *n_freed = data;
+
+  *n_freed += 1;
+}
+
 dbus_bool_t
 _dbus_message_test (const char *test_data_dir)
 {
   DBusMessage *message, *message_without_unix_fds;
   DBusMessageLoader *loader;
+  DBusBodyCheck *check;
   int i;
   const char *data;
   DBusMessage *copy;
@@ -982,6 +1005,7 @@ _dbus_message_test (const char *test_data_dir)
   const dbus_bool_t *v_ARRAY_BOOLEAN = our_boolean_array;
   char sig[64];
   const char *s;
+  int n_freed;
   const char *v_STRING;
   double v_DOUBLE;
   dbus_int16_t v_INT16;
@@ -1125,6 +1149,479 @@ _dbus_message_test (const char *test_data_dir)
 
   dbus_message_unref (message);
 
+  /* Test reserving the body for a known argument list */
+  message = dbus_message_new_signal_with_capacity ("/org/freedesktop/TestPath",
+                                                   "Foo.TestInterface",
+                                                   "TestSignal",
+                                                   3);
+  _dbus_assert (message != NULL);
+  v_BYTE = 42;
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_BYTE, &v_BYTE,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("oom");
+
+  v_UINT16 = 0x123;
+  v_STRING = "Test string";
+  v_DOUBLE = 3.14159;
+  if (!dbus_message_reserve_body_for_args (message,
+                                           DBUS_TYPE_UINT16, &v_UINT16,
+                                           DBUS_TYPE_STRING, &v_STRING,
+                                           DBUS_TYPE_DOUBLE, &v_DOUBLE,
+                                           DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &v_ARRAY_UINT32,
+                                           _DBUS_N_ELEMENTS (our_uint32_array),
+                                           DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &v_ARRAY_STRING,
+                                           _DBUS_N_ELEMENTS (our_string_array),
+                                           DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("oom");
+
+  {
+    const char *reserved_data;
+
+    reserved_data = _dbus_string_get_const_data (&message->body);
+    if (!dbus_message_append_args (message,
+                                   DBUS_TYPE_UINT16, &v_UINT16,
+                                   DBUS_TYPE_STRING, &v_STRING,
+                                   DBUS_TYPE_DOUBLE, &v_DOUBLE,
+                                   DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &v_ARRAY_UINT32,
+                                   _DBUS_N_ELEMENTS (our_uint32_array),
+                                   DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &v_ARRAY_STRING,
+                                   _DBUS_N_ELEMENTS (our_string_array),
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("oom");
+
+    /* the whole list fit in what was reserved, so nothing moved */
+    _dbus_assert (_dbus_string_get_const_data (&message->body) == reserved_data);
+  }
+  _dbus_assert (dbus_message_has_signature (message, "yqsdauas"));
+  _dbus_assert (!dbus_message_reserve_body_for_args (message,
+                                                     DBUS_TYPE_VARIANT, &v_STRING,
+                                                     DBUS_TYPE_INVALID));
+  dbus_message_unref (message);
+
+  /* Test that a pre-marshalled block reads back as its signature says */
+  {
+    unsigned char block[15];
+    dbus_uint32_t len;
+    unsigned char our_byte;
+    dbus_uint32_t our_uint32;
+    const char *our_str;
+
+    /* "yus": a byte, padding, a uint32, then a string */
+    memset (block, 0, sizeof (block));
+    block[0] = 42;
+    v_UINT32 = 0x12345678;
+    memcpy (block + 4, &v_UINT32, 4);
+    len = 2;
+    memcpy (block + 8, &len, 4);
+    memcpy (block + 12, "hi", 3);
+
+    message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                       "Foo.TestInterface",
+                                       "TestSignal");
+    _dbus_assert (message != NULL);
+
+    if (!dbus_message_append_marshalled (message, "yus", block, sizeof (block)))
+      _dbus_assert_not_reached ("oom");
+
+    v_STRING = "after";
+    if (!dbus_message_append_args (message,
+                                   DBUS_TYPE_STRING, &v_STRING,
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("oom");
+
+    _dbus_assert (dbus_message_has_signature (message, "yuss"));
+
+    if (!dbus_message_get_args (message, NULL,
+                                DBUS_TYPE_BYTE, &our_byte,
+                                DBUS_TYPE_UINT32, &our_uint32,
+                                DBUS_TYPE_STRING, &our_str,
+                                DBUS_TYPE_STRING, &v_STRING,
+                                DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("could not get args from marshalled block");
+
+    _dbus_assert (our_byte == 42);
+    _dbus_assert (our_uint32 == 0x12345678);
+    _dbus_assert (strcmp (our_str, "hi") == 0);
+    _dbus_assert (strcmp (v_STRING, "after") == 0);
+
+    dbus_message_unref (message);
+  }
+
+  /* Test appending one argument at a time, with the signature the
+   * last header field and then not, and a string field rewritten in
+   * place once it is the last
+   */
+  {
+    DBusMessageIter iter;
+    DBusMessage *loaded;
+    DBusError error;
+    char expected[65];
+    char *marshalled;
+    int marshalled_len;
+    dbus_int32_t v_INT32;
+
+    message = dbus_message_new_method_call (NULL,
+                                            "/org/freedesktop/TestPath",
+                                            "Foo.TestInterface",
+                                            "TestMethod");
+    _dbus_assert (message != NULL);
+
+    for (i = 0; i < 64; i++)
+      {
+        if (i == 32 &&
+            !dbus_message_set_destination (message, "org.freedesktop.DBus.A"))
+          _dbus_assert_not_reached ("oom");
+
+        v_INT32 = i;
+        if (!dbus_message_append_args (message,
+                                       DBUS_TYPE_INT32, &v_INT32,
+                                       DBUS_TYPE_INVALID))
+          _dbus_assert_not_reached ("oom");
+
+        expected[i] = DBUS_TYPE_INT32;
+        expected[i + 1] = '\0';
+        _dbus_assert (dbus_message_has_signature (message, expected));
+      }
+
+    if (!dbus_message_set_destination (message, "org.freedesktop.DBus.LongerName"))
+      _dbus_assert_not_reached ("oom");
+    _dbus_assert (dbus_message_has_destination (message,
+                                                "org.freedesktop.DBus.LongerName"));
+
+    dbus_message_set_serial (message, 1);
+    if (!dbus_message_marshal (message, &marshalled, &marshalled_len))
+      _dbus_assert_not_reached ("oom");
+
+    dbus_error_init (&error);
+    loaded = dbus_message_demarshal (marshalled, marshalled_len, &error);
+    if (loaded == NULL)
+      _dbus_assert_not_reached ("could not demarshal message appended to in place");
+    dbus_free (marshalled);
+
+    _dbus_assert (dbus_message_has_signature (loaded, expected));
+    _dbus_assert (dbus_message_has_destination (loaded,
+                                                "org.freedesktop.DBus.LongerName"));
+
+    dbus_message_iter_init (loaded, &iter);
+    for (i = 0; i < 64; i++)
+      {
+        dbus_message_iter_get_basic (&iter, &v_INT32);
+        _dbus_assert (v_INT32 == i);
+        dbus_message_iter_next (&iter);
+      }
+
+    dbus_message_unref (loaded);
+    dbus_message_unref (message);
+  }
+
+  /* Test that copies share a big body until one of them is modified */
+  {
+    DBusMessage *copy;
+    DBusString big;
+    const char *big_data;
+
+    if (!_dbus_string_init (&big))
+      _dbus_assert_not_reached ("oom");
+    while (_dbus_string_get_length (&big) < 2000)
+      if (!_dbus_string_append (&big, "copy on write "))
+        _dbus_assert_not_reached ("oom");
+
+    message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                            "/org/freedesktop/TestPath",
+                                            "Foo.TestInterface",
+                                            "TestMethod");
+    _dbus_assert (message != NULL);
+    v_STRING = _dbus_string_get_const_data (&big);
+    if (!dbus_message_append_args (message,
+                                   DBUS_TYPE_STRING, &v_STRING,
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("oom");
+    big_data = _dbus_string_get_const_data (&message->body);
+
+    copy = dbus_message_copy (message);
+    _dbus_assert (copy != NULL);
+    _dbus_assert (_dbus_string_get_const_data (&copy->body) == big_data);
+    _dbus_assert (_dbus_string_get_const_data (&message->body) == big_data);
+
+    /* writing to the copy gives it a body of its own */
+    v_UINT32 = 42;
+    if (!dbus_message_append_args (copy,
+                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("oom");
+    _dbus_assert (_dbus_string_get_const_data (&copy->body) != big_data);
+    _dbus_assert (_dbus_string_get_const_data (&message->body) == big_data);
+    _dbus_assert (dbus_message_has_signature (copy, "su"));
+    _dbus_assert (dbus_message_has_signature (message, "s"));
+    _dbus_assert (_dbus_string_get_length (&copy->body) >
+                  _dbus_string_get_length (&message->body));
+    _dbus_assert (memcmp (_dbus_string_get_const_data (&copy->body), big_data,
+                          _dbus_string_get_length (&message->body)) == 0);
+    dbus_message_unref (copy);
+
+    /* once the last copy is gone, the original takes its buffer back */
+    copy = dbus_message_copy (message);
+    _dbus_assert (copy != NULL);
+    dbus_message_unref (copy);
+    if (!dbus_message_reserve_body (message, 0))
+      _dbus_assert_not_reached ("oom");
+    _dbus_assert (_dbus_string_get_const_data (&message->body) == big_data);
+    _dbus_assert (message->shared_body == NULL);
+
+    /* the original outlives its copy */
+    copy = dbus_message_copy (message);
+    _dbus_assert (copy != NULL);
+    dbus_message_unref (message);
+    _dbus_assert (dbus_message_has_signature (copy, "s"));
+    v_STRING = NULL;
+    if (!dbus_message_get_args (copy, NULL,
+                                DBUS_TYPE_STRING, &v_STRING,
+                                DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("could not read shared body");
+    _dbus_assert (strcmp (v_STRING, _dbus_string_get_const_data (&big)) == 0);
+    dbus_message_unref (copy);
+
+    _dbus_string_free (&big);
+  }
+
+  /* Test stamping messages out of a template */
+  {
+    DBusMessageTemplate *tmpl;
+    DBusMessage *fresh;
+
+    message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                       "Foo.TestInterface",
+                                       "TestSignal");
+    _dbus_assert (message != NULL);
+    if (!dbus_message_set_destination (message, "org.freedesktop.DBus.TestService"))
+      _dbus_assert_not_reached ("oom");
+    v_STRING = "Test string";
+    if (!dbus_message_append_args (message,
+                                   DBUS_TYPE_STRING, &v_STRING,
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("oom");
+    dbus_message_set_serial (message, 1234);
+
+    tmpl = dbus_message_template_new (message);
+    _dbus_assert (tmpl != NULL);
+    dbus_message_unref (message);
+
+    message = dbus_message_new_from_template (tmpl);
+    _dbus_assert (message != NULL);
+    _dbus_assert (dbus_message_get_serial (message) == 0);
+    _dbus_assert (dbus_message_has_signature (message, ""));
+    _dbus_assert (dbus_message_is_signal (message, "Foo.TestInterface", "TestSignal"));
+
+    v_UINT32 = 0x12300042;
+    if (!dbus_message_append_args (message,
+                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_STRING, &v_STRING,
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("oom");
+
+    /* it comes out byte for byte the same as one built by hand */
+    fresh = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+    _dbus_assert (fresh != NULL);
+    if (!dbus_message_set_destination (fresh, "org.freedesktop.DBus.TestService") ||
+        !dbus_message_append_args (fresh,
+                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_STRING, &v_STRING,
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("oom");
+
+    dbus_message_set_serial (message, 5678);
+    dbus_message_set_serial (fresh, 5678);
+    dbus_message_lock (message);
+    dbus_message_lock (fresh);
+    _dbus_assert (_dbus_string_equal (&message->header.data, &fresh->header.data));
+    _dbus_assert (_dbus_string_equal (&message->body, &fresh->body));
+
+    dbus_message_unref (fresh);
+    dbus_message_unref (message);
+    dbus_message_template_free (tmpl);
+  }
+
+  /* Test reading an array of fixed-layout structs in one go */
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  _dbus_assert (message != NULL);
+  {
+    typedef struct { dbus_int32_t a; dbus_int32_t b; dbus_uint32_t c; } Row;
+    static const int row_offsets[] = { _DBUS_STRUCT_OFFSET (Row, a),
+                                       _DBUS_STRUCT_OFFSET (Row, b),
+                                       _DBUS_STRUCT_OFFSET (Row, c) };
+    Row rows[4];
+    const void *view;
+    DBusMessageIter iter;
+    DBusMessageIter array;
+    DBusMessageIter element;
+    int n_rows;
+
+    dbus_message_iter_init_append (message, &iter);
+    if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(iiu)", &array))
+      _dbus_assert_not_reached ("oom");
+    for (i = 0; i < 3; i++)
+      {
+        v_INT32 = -i;
+        v_UINT32 = i * 1000;
+        if (!dbus_message_iter_open_container (&array, DBUS_TYPE_STRUCT, NULL, &element) ||
+            !dbus_message_iter_append_basic (&element, DBUS_TYPE_INT32, &v_INT32) ||
+            !dbus_message_iter_append_basic (&element, DBUS_TYPE_INT32, &i) ||
+            !dbus_message_iter_append_basic (&element, DBUS_TYPE_UINT32, &v_UINT32) ||
+            !dbus_message_iter_close_container (&array, &element))
+          _dbus_assert_not_reached ("oom");
+      }
+    if (!dbus_message_iter_close_container (&iter, &array))
+      _dbus_assert_not_reached ("oom");
+
+    dbus_message_iter_init (message, &iter);
+    dbus_message_iter_recurse (&iter, &array);
+
+    if (!dbus_message_iter_get_fixed_struct_array (&array, NULL, sizeof (Row),
+                                                   row_offsets, 3, 0, &n_rows))
+      _dbus_assert_not_reached ("couldn't count rows");
+    _dbus_assert (n_rows == 3);
+
+    if (!dbus_message_iter_get_fixed_struct_array (&array, rows, sizeof (Row),
+                                                   row_offsets, 3,
+                                                   _DBUS_N_ELEMENTS (rows), &n_rows))
+      _dbus_assert_not_reached ("couldn't read rows");
+    _dbus_assert (n_rows == 3);
+    for (i = 0; i < 3; i++)
+      _dbus_assert (rows[i].a == -i && rows[i].b == i &&
+                    rows[i].c == (dbus_uint32_t) i * 1000);
+
+    /* the rest of the array after reading one element by hand */
+    dbus_message_iter_next (&array);
+    if (!dbus_message_iter_get_fixed_struct_array (&array, rows, sizeof (Row),
+                                                   row_offsets, 3,
+                                                   _DBUS_N_ELEMENTS (rows), &n_rows))
+      _dbus_assert_not_reached ("couldn't read rows");
+    _dbus_assert (n_rows == 2 && rows[0].b == 1 && rows[1].b == 2);
+
+    /* 12-byte rows are 16 apart in the message, so no view */
+    _dbus_assert (!dbus_message_iter_get_fixed_struct_array_view (&array, sizeof (Row),
+                                                                  row_offsets, 3,
+                                                                  &view, &n_rows));
+    /* and the field count has to match */
+    _dbus_assert (!dbus_message_iter_get_fixed_struct_array (&array, rows, sizeof (Row),
+                                                             row_offsets, 2,
+                                                             _DBUS_N_ELEMENTS (rows),
+                                                             &n_rows));
+  }
+  dbus_message_unref (message);
+
+#ifdef DBUS_HAVE_INT64
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  _dbus_assert (message != NULL);
+  {
+    typedef struct { dbus_int64_t x; dbus_int32_t i; } Row;
+    static const int row_offsets[] = { _DBUS_STRUCT_OFFSET (Row, x),
+                                       _DBUS_STRUCT_OFFSET (Row, i) };
+    const Row *view;
+    DBusMessageIter iter;
+    DBusMessageIter array;
+    DBusMessageIter element;
+    int n_rows;
+
+    dbus_message_iter_init_append (message, &iter);
+    if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(xi)", &array))
+      _dbus_assert_not_reached ("oom");
+    for (i = 0; i < 3; i++)
+      {
+        v_INT64 = DBUS_INT64_CONSTANT (0x123456789) * i;
+        if (!dbus_message_iter_open_container (&array, DBUS_TYPE_STRUCT, NULL, &element) ||
+            !dbus_message_iter_append_basic (&element, DBUS_TYPE_INT64, &v_INT64) ||
+            !dbus_message_iter_append_basic (&element, DBUS_TYPE_INT32, &i) ||
+            !dbus_message_iter_close_container (&array, &element))
+          _dbus_assert_not_reached ("oom");
+      }
+    if (!dbus_message_iter_close_container (&iter, &array))
+      _dbus_assert_not_reached ("oom");
+
+    dbus_message_iter_init (message, &iter);
+    dbus_message_iter_recurse (&iter, &array);
+
+    /* same layout as the wire, so the rows are viewed in place */
+    if (sizeof (Row) == 16)
+      {
+        if (!dbus_message_iter_get_fixed_struct_array_view (&array, sizeof (Row),
+                                                            row_offsets, 2,
+                                                            (const void **) &view,
+                                                            &n_rows))
+          _dbus_assert_not_reached ("couldn't view rows");
+        _dbus_assert (n_rows == 3);
+        for (i = 0; i < 3; i++)
+          _dbus_assert (view[i].x == DBUS_INT64_CONSTANT (0x123456789) * i &&
+                        view[i].i == i);
+      }
+  }
+  dbus_message_unref (message);
+#endif /* DBUS_HAVE_INT64 */
+
+  /* Test reading a message in the byte order it arrived in */
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  _dbus_assert (message != NULL);
+  v_STRING = "Test string";
+  v_UINT32 = 0x12300042;
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &v_STRING,
+                                 DBUS_TYPE_UINT32, &v_UINT32,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &v_ARRAY_UINT32,
+                                 _DBUS_N_ELEMENTS (our_uint32_array),
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("oom");
+
+  {
+    DBusString signature;
+    DBusMessageIter iter;
+    DBusMessageIter array;
+    int opposite_order;
+    const char *s_value;
+    dbus_uint32_t u_value;
+    const dbus_uint32_t *array_value;
+    int n_elements;
+
+    opposite_order = DBUS_COMPILER_BYTE_ORDER == DBUS_LITTLE_ENDIAN ?
+      DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN;
+
+    /* make it look like it came from the other kind of host */
+    _dbus_string_init_const (&signature, dbus_message_get_signature (message));
+    _dbus_marshal_byteswap (&signature, 0, DBUS_COMPILER_BYTE_ORDER,
+                            opposite_order, &message->body, 0);
+    _dbus_header_byteswap (&message->header, opposite_order);
+    message->byte_order = opposite_order;
+
+    if (!_dbus_message_iter_init_unswapped (message, &iter))
+      _dbus_assert_not_reached ("no args");
+    dbus_message_iter_get_basic (&iter, &s_value);
+    _dbus_assert (strcmp (s_value, v_STRING) == 0);
+    dbus_message_iter_next (&iter);
+    dbus_message_iter_get_basic (&iter, &u_value);
+    _dbus_assert (u_value == v_UINT32);
+    _dbus_assert (message->byte_order == opposite_order);
+
+    /* handing out the array in place does swap the message */
+    dbus_message_iter_next (&iter);
+    dbus_message_iter_recurse (&iter, &array);
+    dbus_message_iter_get_fixed_array (&array, &array_value, &n_elements);
+    _dbus_assert (message->byte_order == DBUS_COMPILER_BYTE_ORDER);
+    _dbus_assert (n_elements == _DBUS_N_ELEMENTS (our_uint32_array));
+    _dbus_assert (memcmp (array_value, our_uint32_array,
+                          sizeof (our_uint32_array)) == 0);
+    _dbus_assert (strcmp (dbus_message_get_path (message),
+                          "/org/freedesktop/TestPath") == 0);
+  }
+  dbus_message_unref (message);
+
   /* Test the vararg functions */
   message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
                                           "/org/freedesktop/TestPath",
@@ -1424,6 +1921,420 @@ _dbus_message_test (const char *test_data_dir)
 
   dbus_message_unref (message);
 
+  /* A loader set to trust its peer skips body validation, so it
+   * accepts a string that is not valid UTF-8; the default does not.
+   */
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "Method");
+  s = "peaches";
+  if (!dbus_message_append_args (message, DBUS_TYPE_STRING, &s,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+
+  for (i = 0; i < 2; i++)
+    {
+      dbus_bool_t trusted = i != 0;
+      DBusMessage *loaded;
+      DBusString *buffer;
+
+      loader = _dbus_message_loader_new ();
+      if (loader == NULL)
+        _dbus_assert_not_reached ("no memory");
+
+      _dbus_message_loader_set_trust_bodies (loader, trusted);
+
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      if (!_dbus_string_copy (&message->header.data, 0, buffer, 0) ||
+          !_dbus_string_copy (&message->body, 0, buffer,
+                              _dbus_string_get_length (buffer)))
+        _dbus_assert_not_reached ("no memory");
+
+      /* turn the 'p' after the string's length word into a stray
+       * continuation byte
+       */
+      _dbus_string_set_byte (buffer,
+                             _dbus_string_get_length (&message->header.data) + 4,
+                             0x80);
+      _dbus_message_loader_return_buffer (loader, buffer,
+                                          _dbus_string_get_length (buffer));
+
+      if (!_dbus_message_loader_queue_messages (loader))
+        _dbus_assert_not_reached ("no memory to queue messages");
+
+      _dbus_assert (_dbus_message_loader_get_is_corrupted (loader) == !trusted);
+
+      loaded = _dbus_message_loader_pop_message (loader);
+      _dbus_assert ((loaded != NULL) == trusted);
+      if (loaded != NULL)
+        dbus_message_unref (loaded);
+
+      _dbus_message_loader_unref (loader);
+    }
+
+  /* A body handed to a check function holds back the message and
+   * everything after it until the check is done; here the first copy
+   * is valid and the second has the bad byte from above.
+   */
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_message_loader_set_body_check_function (loader, 1, take_body_check,
+                                                &check);
+  check = NULL;
+
+  for (i = 0; i < 2; i++)
+    {
+      DBusString *buffer;
+      int len;
+
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      len = _dbus_string_get_length (buffer);
+      if (!_dbus_string_copy (&message->header.data, 0, buffer, len) ||
+          !_dbus_string_copy (&message->body, 0, buffer,
+                              _dbus_string_get_length (buffer)))
+        _dbus_assert_not_reached ("no memory");
+
+      if (i == 1)
+        _dbus_string_set_byte (buffer,
+                               len + _dbus_string_get_length (&message->header.data) + 4,
+                               0x80);
+      _dbus_message_loader_return_buffer (loader, buffer,
+                                          _dbus_string_get_length (buffer) - len);
+    }
+
+  for (i = 0; i < 2; i++)
+    {
+      DBusMessage *loaded;
+
+      if (!_dbus_message_loader_queue_messages (loader))
+        _dbus_assert_not_reached ("no memory to queue messages");
+
+      _dbus_assert (check != NULL);
+      _dbus_assert (_dbus_message_loader_get_is_checking (loader));
+      _dbus_assert (_dbus_message_loader_pop_message (loader) == NULL);
+
+      _dbus_body_check_run (check);
+      _dbus_message_loader_body_check_done (loader, check);
+      _dbus_body_check_unref (check);
+      check = NULL;
+
+      if (!_dbus_message_loader_queue_messages (loader))
+        _dbus_assert_not_reached ("no memory to queue messages");
+
+      loaded = _dbus_message_loader_pop_message (loader);
+      _dbus_assert ((loaded != NULL) == (i == 0));
+      _dbus_assert (_dbus_message_loader_get_is_corrupted (loader) == (i == 1));
+      if (loaded != NULL)
+        dbus_message_unref (loaded);
+    }
+
+  _dbus_message_loader_unref (loader);
+
+  dbus_message_unref (message);
+
+  /* Seeking lands where stepping with dbus_message_iter_next() would;
+   * argument 2i is a string and 2i + 1 is the uint32 i
+   */
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "Method");
+  for (i = 0; i < 40; i++)
+    {
+      s = (i % 3 == 0) ? "x" : "a somewhat longer string";
+      v_UINT32 = i;
+      if (!dbus_message_append_args (message,
+                                     DBUS_TYPE_STRING, &s,
+                                     DBUS_TYPE_UINT32, &v_UINT32,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  dbus_message_iter_init (message, &iter);
+  for (i = 79; i >= 0; i -= 3)
+    {
+      if (!dbus_message_iter_seek (&iter, i))
+        _dbus_assert_not_reached ("argument missing");
+
+      if (i % 2 == 0)
+        {
+          _dbus_assert (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_STRING);
+        }
+      else
+        {
+          _dbus_assert (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_UINT32);
+          dbus_message_iter_get_basic (&iter, &v_UINT32);
+          _dbus_assert (v_UINT32 == (dbus_uint32_t) i / 2);
+        }
+    }
+
+  _dbus_assert (!dbus_message_iter_seek (&iter, 80));
+  _dbus_assert (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_INVALID);
+  _dbus_assert (dbus_message_iter_seek (&iter, 1));
+  _dbus_assert (dbus_message_iter_next (&iter));
+  _dbus_assert (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_STRING);
+
+  /* appending throws the table away, and moving the signature within
+   * the header doesn't upset it
+   */
+  v_UINT32 = 1234;
+  if (!dbus_message_append_args (message, DBUS_TYPE_UINT32, &v_UINT32,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_iter_init (message, &iter);
+  _dbus_assert (dbus_message_iter_seek (&iter, 80));
+  dbus_message_iter_get_basic (&iter, &v_UINT32);
+  _dbus_assert (v_UINT32 == 1234);
+
+  if (!dbus_message_set_sender (message, ":1.1234"))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_iter_init (message, &iter);
+  _dbus_assert (dbus_message_iter_seek (&iter, 79));
+  dbus_message_iter_get_basic (&iter, &v_UINT32);
+  _dbus_assert (v_UINT32 == 39);
+
+  dbus_message_unref (message);
+
+  /* An array appended by reference goes out after the body, padded
+   * and counted as if it were in it, and is copied in when read
+   */
+  n_freed = 0;
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "Method");
+  v_BYTE = 42;
+  dbus_message_iter_init_append (message, &iter);
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_BYTE, &v_BYTE) ||
+      !dbus_message_iter_append_fixed_array_by_reference (&iter, DBUS_TYPE_DOUBLE,
+                                                          &v_ARRAY_DOUBLE,
+                                                          _DBUS_N_ELEMENTS (our_double_array),
+                                                          count_free, &n_freed))
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_assert (_dbus_string_get_length (&message->body) == 8);
+  _dbus_assert (_dbus_string_get_const_data (&message->tail) ==
+                (const char *) our_double_array);
+
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  {
+    DBusString *buffer;
+    char *marshalled;
+    int len;
+
+    _dbus_message_loader_get_buffer (loader, &buffer);
+    if (!_dbus_string_copy (&message->header.data, 0, buffer, 0) ||
+        !_dbus_string_copy (&message->body, 0, buffer,
+                            _dbus_string_get_length (buffer)) ||
+        !_dbus_string_copy (&message->tail, 0, buffer,
+                            _dbus_string_get_length (buffer)))
+      _dbus_assert_not_reached ("no memory");
+
+    if (!dbus_message_marshal (message, &marshalled, &len))
+      _dbus_assert_not_reached ("no memory");
+    _dbus_assert (len == _dbus_string_get_length (buffer));
+    _dbus_assert (memcmp (marshalled, _dbus_string_get_const_data (buffer),
+                          len) == 0);
+    dbus_free (marshalled);
+
+    _dbus_message_loader_return_buffer (loader, buffer,
+                                        _dbus_string_get_length (buffer));
+  }
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
+
+  copy = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (copy != NULL);
+  _dbus_message_loader_unref (loader);
+
+  for (i = 0; i < 2; i++)
+    {
+      DBusMessage *m = i == 0 ? copy : message;
+      const double *doubles;
+      int n_doubles;
+
+      dbus_message_iter_init (m, &iter);
+      dbus_message_iter_get_basic (&iter, &v2_BYTE);
+      _dbus_assert (v2_BYTE == 42);
+      _dbus_assert (dbus_message_iter_next (&iter));
+      dbus_message_iter_recurse (&iter, &array_iter);
+      dbus_message_iter_get_fixed_array (&array_iter, &doubles, &n_doubles);
+      _dbus_assert (n_doubles == _DBUS_N_ELEMENTS (our_double_array));
+      _dbus_assert (memcmp (doubles, our_double_array,
+                            sizeof (our_double_array)) == 0);
+    }
+
+  /* reading the original copied the array in and let it go */
+  _dbus_assert (n_freed == 1);
+  _dbus_assert (_dbus_string_get_length (&message->tail) == 0);
+
+  dbus_message_unref (copy);
+  dbus_message_unref (message);
+  _dbus_assert (n_freed == 1);
+
+  /* otherwise it's let go with the message */
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "Signal");
+  dbus_message_iter_init_append (message, &iter);
+  if (!dbus_message_iter_append_fixed_array_by_reference (&iter, DBUS_TYPE_BYTE,
+                                                          &v_ARRAY_BYTE,
+                                                          _DBUS_N_ELEMENTS (our_byte_array),
+                                                          count_free, &n_freed))
+    _dbus_assert_not_reached ("no memory");
+
+  copy = dbus_message_copy (message);
+  if (copy == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (_dbus_string_get_length (&copy->tail) == 0);
+  _dbus_assert (_dbus_string_get_length (&copy->body) ==
+                4 + _DBUS_N_ELEMENTS (our_byte_array));
+  dbus_message_unref (copy);
+
+  _dbus_assert (n_freed == 1);
+  dbus_message_unref (message);
+  _dbus_assert (n_freed == 2);
+
+  /* A referenced array outlives its message and survives changes to it */
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "Signal");
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_DOUBLE, &v_ARRAY_DOUBLE,
+                                 _DBUS_N_ELEMENTS (our_double_array),
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+
+  {
+    DBusMessageBody *body;
+    const double *doubles;
+    int n_doubles;
+
+    dbus_message_iter_init (message, &iter);
+    dbus_message_iter_recurse (&iter, &array_iter);
+    body = dbus_message_iter_ref_fixed_array (&array_iter, &doubles, &n_doubles);
+    if (body == NULL)
+      _dbus_assert_not_reached ("no memory");
+
+    v_BYTE = 1;
+    if (!dbus_message_append_args (message, DBUS_TYPE_BYTE, &v_BYTE,
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("no memory");
+    dbus_message_unref (message);
+
+    _dbus_assert (n_doubles == _DBUS_N_ELEMENTS (our_double_array));
+    _dbus_assert (memcmp (doubles, our_double_array,
+                          sizeof (our_double_array)) == 0);
+    dbus_message_body_unref (body);
+  }
+
+  /* A big message is validated as it arrives, so a bad one is rejected
+   * before the rest of it is read
+   */
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "Signal");
+  dbus_message_iter_init_append (message, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING,
+                                         &array_iter))
+    _dbus_assert_not_reached ("no memory");
+  s = "a somewhat longer string";
+  for (i = 0; i < 4000; i++)
+    {
+      if (!dbus_message_iter_append_basic (&array_iter, DBUS_TYPE_STRING, &s))
+        _dbus_assert_not_reached ("no memory");
+    }
+  v_UINT32 = 1234;
+  if (!dbus_message_iter_close_container (&iter, &array_iter) ||
+      !dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &v_UINT32))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+
+  for (i = 0; i < 2; i++)
+    {
+      char *marshalled;
+      int len, pos;
+      char **strings;
+      int n_strings;
+
+      if (!dbus_message_marshal (message, &marshalled, &len))
+        _dbus_assert_not_reached ("no memory");
+
+      /* make the first string bad utf-8 */
+      if (i == 1)
+        marshalled[_dbus_string_get_length (&message->header.data) + 8] = 0xff;
+
+      loader = _dbus_message_loader_new ();
+      if (loader == NULL)
+        _dbus_assert_not_reached ("no memory");
+
+      pos = 0;
+      while (pos < len && !_dbus_message_loader_get_is_corrupted (loader))
+        {
+          DBusString *buffer;
+          int n = MIN (4096, len - pos);
+
+          _dbus_message_loader_get_buffer (loader, &buffer);
+          if (!_dbus_string_append_len (buffer, marshalled + pos, n))
+            _dbus_assert_not_reached ("no memory");
+          _dbus_message_loader_return_buffer (loader, buffer, n);
+
+          if (!_dbus_message_loader_queue_messages (loader))
+            _dbus_assert_not_reached ("no memory to queue messages");
+
+          pos += n;
+
+          if (i == 0 && pos < len && pos >= len / 2 && pos - n < len / 2)
+            _dbus_assert (loader->partial != NULL &&
+                          loader->partial_validation.validated > len / 4);
+        }
+
+      if (i == 0)
+        {
+          copy = _dbus_message_loader_pop_message (loader);
+          _dbus_assert (copy != NULL);
+          _dbus_assert (loader->partial == NULL);
+
+          v_UINT32 = 0;
+          if (!dbus_message_get_args (copy, NULL,
+                                      DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &strings, &n_strings,
+                                      DBUS_TYPE_UINT32, &v_UINT32,
+                                      DBUS_TYPE_INVALID))
+            _dbus_assert_not_reached ("could not get args");
+          _dbus_assert (n_strings == 4000);
+          _dbus_assert (v_UINT32 == 1234);
+          dbus_free_string_array (strings);
+          dbus_message_unref (copy);
+        }
+      else
+        {
+          _dbus_assert (_dbus_message_loader_get_is_corrupted (loader));
+          _dbus_assert (loader->corruption_reason == DBUS_INVALID_BAD_UTF8_IN_STRING);
+          _dbus_assert (pos < len);
+        }
+
+      _dbus_message_loader_unref (loader);
+      dbus_free (marshalled);
+    }
+
+  dbus_message_unref (message);
+
   /* Load all the sample messages from the message factory */
   {
     DBusMessageDataIter diter;
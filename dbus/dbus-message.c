@@ -34,6 +34,8 @@
 #include "dbus-memory.h"
 #include "dbus-list.h"
 #include "dbus-threads-internal.h"
+#include "dbus-latency.h"
+#include "dbus-probes.h"
 #ifdef HAVE_UNIX_FD_PASSING
 #include "dbus-sysdeps-unix.h"
 #endif
@@ -86,6 +88,28 @@ struct DBusMessageRealIter
   } u; /**< the type writer or reader that does all the work */
 };
 
+/* Forgets the table built by dbus_message_iter_seek(), once the
+ * body or signature it describes changes
+ */
+static void
+drop_arg_offsets (DBusMessage *message)
+{
+  dbus_free (message->arg_offsets);
+  message->arg_offsets = NULL;
+  message->n_args = 0;
+}
+
+static void
+drop_signature (DBusMessage *message)
+{
+  if (message->signature != NULL)
+    {
+      _dbus_string_free (message->signature);
+      dbus_free (message->signature);
+      message->signature = NULL;
+    }
+}
+
 static void
 get_const_signature (DBusHeader        *header,
                      const DBusString **type_str_p,
@@ -120,6 +144,9 @@ _dbus_message_byteswap (DBusMessage *message)
     return;
 
   _dbus_verbose ("Swapping message into compiler byte order\n");
+
+  /* only bodies in our own byte order are ever shared */
+  _dbus_assert (message->shared_body == NULL);
   
   get_const_signature (&message->header, &type_str, &type_pos);
   
@@ -143,25 +170,64 @@ _dbus_message_byteswap (DBusMessage *message)
  if (message->byte_order != DBUS_COMPILER_BYTE_ORDER)   \
    _dbus_message_byteswap (message)
 
+/* Calls the free function of an array appended with
+ * dbus_message_iter_append_fixed_array_by_reference(), and forgets it
+ */
+static void
+drop_tail (DBusMessage *message)
+{
+  DBusFreeFunction free_function;
+
+  free_function = message->tail_free_function;
+  message->tail_free_function = NULL;
+  _dbus_string_init_const_len (&message->tail, "", 0);
+
+  if (free_function != NULL)
+    (* free_function) (message->tail_free_data);
+
+  message->tail_free_data = NULL;
+}
+
 /**
  * Gets the data to be sent over the network for this message.
- * The header and then the body should be written out.
+ * The header, then the body, then the tail should be written out;
+ * the tail is an array appended by reference and is usually empty.
  * This function is guaranteed to always return the same
- * data once a message is locked (with dbus_message_lock()).
+ * data once a message is locked (with dbus_message_lock()), except
+ * that reading the message moves the tail onto the end of the body,
+ * so only the concatenation of the three stays the same.
  *
  * @param message the message.
  * @param header return location for message header data.
  * @param body return location for message body data.
+ * @param tail return location for the rest of the body.
  */
 void
 _dbus_message_get_network_data (DBusMessage          *message,
                                 const DBusString    **header,
-                                const DBusString    **body)
+                                const DBusString    **body,
+                                const DBusString    **tail)
 {
   _dbus_assert (message->locked);
 
   *header = &message->header.data;
   *body = &message->body;
+  *tail = &message->tail;
+}
+
+/**
+ * Gets the current size of the message's header and body in bytes,
+ * which is what it takes on the wire once locked.
+ *
+ * @param message the message
+ * @returns the size in bytes
+ */
+long
+_dbus_message_get_size (DBusMessage *message)
+{
+  return _dbus_string_get_length (&message->header.data) +
+    _dbus_string_get_length (&message->body) +
+    _dbus_string_get_length (&message->tail);
 }
 
 /**
@@ -232,9 +298,7 @@ _dbus_message_add_counter_link (DBusMessage  *message,
    */
   if (message->counters == NULL)
     {
-      message->size_counter_delta =
-        _dbus_string_get_length (&message->header.data) +
-        _dbus_string_get_length (&message->body);
+      message->size_counter_delta = _dbus_message_get_size (message);
 
 #ifdef HAVE_UNIX_FD_PASSING
       message->unix_fd_counter_delta = message->n_unix_fds;
@@ -299,12 +363,32 @@ _dbus_message_remove_counter (DBusMessage  *message,
                                counter);
   _dbus_assert (link != NULL);
 
-  _dbus_list_unlink (&message->counters,
-                     link);
+  _dbus_message_remove_counter_link (message, link);
+
   if (link_return)
     *link_return = link;
   else
     _dbus_list_free_link (link);
+}
+
+/**
+ * Like _dbus_message_remove_counter(), but takes the link that was
+ * passed to _dbus_message_add_counter_link() instead of searching
+ * for it. A message sent to many connections has one counter per
+ * recipient, so this avoids a linear search per recipient. The link
+ * is unlinked but not freed; ownership returns to the caller.
+ *
+ * @param message the message
+ * @param link the link holding the counter
+ */
+void
+_dbus_message_remove_counter_link (DBusMessage  *message,
+                                   DBusList     *link)
+{
+  DBusCounter *counter = link->data;
+
+  _dbus_list_unlink (&message->counters,
+                     link);
 
   _dbus_counter_adjust_size (counter, - message->size_counter_delta);
 
@@ -315,6 +399,47 @@ _dbus_message_remove_counter (DBusMessage  *message,
   _dbus_counter_unref (counter);
 }
 
+/**
+ * Gets the list link embedded in the message, whose data is the
+ * message itself. A message loader queues complete messages with it
+ * and a connection then moves the same link to its incoming queue,
+ * so receiving a message never allocates a list node. The link can
+ * be in only one list at a time, which holds since a received message
+ * is in exactly one loader or incoming queue until it is popped. The
+ * link is never freed; free the message instead.
+ *
+ * Outgoing queues don't use it: one message is often queued on many
+ * connections at once.
+ *
+ * @param message the message
+ * @returns the message's queue link
+ */
+DBusList*
+_dbus_message_get_queue_link (DBusMessage *message)
+{
+  _dbus_assert (message->queue_link.data == message);
+
+  return &message->queue_link;
+}
+
+/**
+ * Empties a queue of messages linked by _dbus_message_get_queue_link(),
+ * dropping the queue's reference to each message.
+ *
+ * @param queue the queue
+ */
+void
+_dbus_message_queue_clear (DBusList **queue)
+{
+  while (*queue != NULL)
+    {
+      DBusList *link = *queue;
+
+      _dbus_list_unlink (queue, link);
+      dbus_message_unref (link->data);
+    }
+}
+
 /**
  * Locks a message. Allows checking that applications don't keep a
  * reference to a message in the outgoing queue and change it
@@ -331,12 +456,16 @@ dbus_message_lock (DBusMessage  *message)
   if (!message->locked)
     {
       _dbus_header_update_lengths (&message->header,
-                                   _dbus_string_get_length (&message->body));
+                                   _dbus_string_get_length (&message->body) +
+                                   _dbus_string_get_length (&message->tail));
 
       /* must have a signature if you have a body */
       _dbus_assert (_dbus_string_get_length (&message->body) == 0 ||
                     dbus_message_get_signature (message) != NULL);
 
+      /* nothing more can be appended */
+      drop_signature (message);
+
       message->locked = TRUE;
     }
 }
@@ -393,6 +522,8 @@ _dbus_message_set_signature (DBusMessage *message,
   _dbus_return_val_if_fail (_dbus_string_get_length (&message->body) == 0 ||
                             signature != NULL);
 
+  drop_arg_offsets (message);
+
   return set_or_delete_string_field (message,
                                      DBUS_HEADER_FIELD_SIGNATURE,
                                      DBUS_TYPE_SIGNATURE,
@@ -444,13 +575,19 @@ _dbus_message_set_signature (DBusMessage *message,
  * If you implement the message_cache with a list, the primary reason
  * it's slower is that you add another thread lock (on the DBusList
  * mempool).
+ *
+ * The array is used as a stack: the most recently freed message is
+ * handed out first, since its memory is the most likely to still be
+ * in the CPU cache, and neither operation has to scan for a slot.
+ * That also makes a bigger cache free, so it is sized to absorb a
+ * burst of replies or a broadcast rather than a single round trip.
  */
 
 /** Avoid caching huge messages */
 #define MAX_MESSAGE_SIZE_TO_CACHE 10 * _DBUS_ONE_KILOBYTE
 
 /** Avoid caching too many messages */
-#define MAX_MESSAGE_CACHE_SIZE    5
+#define MAX_MESSAGE_CACHE_SIZE    32
 
 _DBUS_DEFINE_GLOBAL_LOCK (message_cache);
 static DBusMessage *message_cache[MAX_MESSAGE_CACHE_SIZE];
@@ -458,27 +595,48 @@ static int message_cache_count = 0;
 static dbus_bool_t message_cache_shutdown_registered = FALSE;
 
 static void
-dbus_message_cache_shutdown (void *data)
+message_cache_clear_unlocked (void)
 {
   int i;
 
-  _DBUS_LOCK (message_cache);
-
   i = 0;
-  while (i < MAX_MESSAGE_CACHE_SIZE)
+  while (i < message_cache_count)
     {
-      if (message_cache[i])
-        dbus_message_finalize (message_cache[i]);
+      dbus_message_finalize (message_cache[i]);
+      message_cache[i] = NULL;
 
       ++i;
     }
 
   message_cache_count = 0;
+}
+
+static void
+dbus_message_cache_shutdown (void *data)
+{
+  _DBUS_LOCK (message_cache);
+
+  message_cache_clear_unlocked ();
   message_cache_shutdown_registered = FALSE;
 
   _DBUS_UNLOCK (message_cache);
 }
 
+/**
+ * Frees the messages kept around for reuse. The cache fills up
+ * again as messages are unreferenced; this is for giving memory
+ * back when the process is asked to.
+ */
+void
+_dbus_message_cache_trim (void)
+{
+  _DBUS_LOCK (message_cache);
+
+  message_cache_clear_unlocked ();
+
+  _DBUS_UNLOCK (message_cache);
+}
+
 /**
  * Tries to get a message from the message cache.  The retrieved
  * message will have junk in it, so it still needs to be cleared out
@@ -490,9 +648,6 @@ static DBusMessage*
 dbus_message_get_cached (void)
 {
   DBusMessage *message;
-  int i;
-
-  message = NULL;
 
   _DBUS_LOCK (message_cache);
 
@@ -510,24 +665,16 @@ dbus_message_get_cached (void)
    */
   _dbus_assert (message_cache_shutdown_registered);
 
-  i = 0;
-  while (i < MAX_MESSAGE_CACHE_SIZE)
-    {
-      if (message_cache[i])
-        {
-          message = message_cache[i];
-          message_cache[i] = NULL;
-          message_cache_count -= 1;
-          break;
-        }
-      ++i;
-    }
+  message_cache_count -= 1;
+  message = message_cache[message_cache_count];
+  message_cache[message_cache_count] = NULL;
+
   _dbus_assert (message_cache_count >= 0);
-  _dbus_assert (i < MAX_MESSAGE_CACHE_SIZE);
   _dbus_assert (message != NULL);
 
   _dbus_assert (message->refcount.value == 0);
   _dbus_assert (message->counters == NULL);
+  _dbus_assert (message->queue_link.next == NULL);
   
   _DBUS_UNLOCK (message_cache);
 
@@ -602,8 +749,37 @@ dbus_message_cache_or_finalize (DBusMessage *message)
   close_unix_fds(message->unix_fds, &message->n_unix_fds);
 #endif
 
+  drop_arg_offsets (message);
+  drop_signature (message);
+  drop_tail (message);
+
   was_cached = FALSE;
 
+  /* No point taking the lock for a message we won't keep */
+  if ((_dbus_string_get_length (&message->header.data) +
+       _dbus_string_get_length (&message->body)) >
+      MAX_MESSAGE_SIZE_TO_CACHE)
+    {
+      dbus_message_finalize (message);
+      return;
+    }
+
+  /* A shared body is a constant string we can't reuse */
+  if (message->shared_body != NULL)
+    {
+      dbus_message_finalize (message);
+      return;
+    }
+
+  /* A body reserved with dbus_message_reserve_body() may have been
+   * allocated well past what ended up in it; don't keep that around.
+   */
+  if (!_dbus_string_compact (&message->body, MAX_MESSAGE_SIZE_TO_CACHE))
+    {
+      dbus_message_finalize (message);
+      return;
+    }
+
   _DBUS_LOCK (message_cache);
 
   if (!message_cache_shutdown_registered)
@@ -625,23 +801,11 @@ dbus_message_cache_or_finalize (DBusMessage *message)
 
   _dbus_assert (message_cache_count >= 0);
 
-  if ((_dbus_string_get_length (&message->header.data) +
-       _dbus_string_get_length (&message->body)) >
-      MAX_MESSAGE_SIZE_TO_CACHE)
-    goto out;
-
   if (message_cache_count >= MAX_MESSAGE_CACHE_SIZE)
     goto out;
 
-  /* Find empty slot */
-  i = 0;
-  while (message_cache[i] != NULL)
-    ++i;
-
-  _dbus_assert (i < MAX_MESSAGE_CACHE_SIZE);
-
-  _dbus_assert (message_cache[i] == NULL);
-  message_cache[i] = message;
+  _dbus_assert (message_cache[message_cache_count] == NULL);
+  message_cache[message_cache_count] = message;
   message_cache_count += 1;
   was_cached = TRUE;
 #ifndef DBUS_DISABLE_CHECKS
@@ -674,8 +838,9 @@ _dbus_message_iter_check (DBusMessageRealIter *iter)
           _dbus_warn_check_failed ("dbus message changed byte order since iterator was created\n");
           return FALSE;
         }
-      /* because we swap the message into compiler order when you init an iter */
-      _dbus_assert (iter->u.reader.byte_order == DBUS_COMPILER_BYTE_ORDER);
+      /* a reader may be in the sender's byte order, see
+       * _dbus_message_iter_init_unswapped()
+       */
     }
   else if (iter->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER)
     {
@@ -1036,10 +1201,114 @@ dbus_message_get_reply_serial  (DBusMessage *message)
     return 0;
 }
 
+/** Bodies at least this big are shared by dbus_message_copy() rather than copied */
+#define MIN_SHARED_BODY_SIZE 512
+
+static void
+shared_body_unref (DBusMessageBody *shared)
+{
+  if (_dbus_atomic_dec (&shared->refcount) == 1)
+    {
+      _dbus_string_free (&shared->data);
+      dbus_free (shared);
+    }
+}
+
+/**
+ * Makes the message's body shareable, moving its buffer into a
+ * #DBusMessageBody and leaving message->body a constant string
+ * pointing into it. Must be called with the message_cache lock held,
+ * since copies of a message may be made from several threads.
+ *
+ * @param message the message
+ * @returns #FALSE if no memory
+ */
+static dbus_bool_t
+share_body_unlocked (DBusMessage *message)
+{
+  DBusMessageBody *shared;
+
+  if (message->shared_body != NULL)
+    return TRUE;
+
+  shared = dbus_new (DBusMessageBody, 1);
+  if (shared == NULL)
+    return FALSE;
+
+  shared->refcount.value = 1;
+  shared->data = message->body;
+
+  _dbus_string_init_const_len (&message->body,
+                               _dbus_string_get_const_data (&shared->data),
+                               _dbus_string_get_length (&shared->data));
+  message->shared_body = shared;
+
+  return TRUE;
+}
+
+/**
+ * Gives the message a body of its own before it is modified, if it
+ * has been sharing one with a copy. If no copy holds the shared body
+ * any more, its buffer is simply taken back.
+ *
+ * @param message the message
+ * @returns #FALSE if no memory
+ */
+static dbus_bool_t
+unshare_body (DBusMessage *message)
+{
+  DBusMessageBody *shared;
+  DBusString body;
+
+  shared = message->shared_body;
+  if (shared == NULL)
+    return TRUE;
+
+  /* Nobody else can take a new reference: that would mean copying
+   * this message while it's being modified.
+   */
+  if (shared->refcount.value == 1)
+    {
+      message->body = shared->data;
+      message->shared_body = NULL;
+      dbus_free (shared);
+      return TRUE;
+    }
+
+  if (!_dbus_string_init_preallocated (&body,
+                                       _dbus_string_get_length (&message->body)))
+    return FALSE;
+
+  if (!_dbus_string_copy (&message->body, 0, &body, 0))
+    {
+      _dbus_string_free (&body);
+      return FALSE;
+    }
+
+  message->body = body;
+  message->shared_body = NULL;
+  shared_body_unref (shared);
+
+  return TRUE;
+}
+
+static void
+free_body (DBusMessage *message)
+{
+  _dbus_string_free (&message->body);
+
+  if (message->shared_body != NULL)
+    {
+      shared_body_unref (message->shared_body);
+      message->shared_body = NULL;
+    }
+}
+
 static void
 dbus_message_finalize (DBusMessage *message)
 {
   _dbus_assert (message->refcount.value == 0);
+  _dbus_assert (message->queue_link.next == NULL); /* no queue holds it */
 
   /* This calls application callbacks! */
   _dbus_data_slot_list_free (&message->slot_list);
@@ -1049,7 +1318,10 @@ dbus_message_finalize (DBusMessage *message)
   _dbus_list_clear (&message->counters);
 
   _dbus_header_free (&message->header);
-  _dbus_string_free (&message->body);
+  free_body (message);
+  dbus_free (message->arg_offsets);
+  drop_signature (message);
+  drop_tail (message);
 
 #ifdef HAVE_UNIX_FD_PASSING
   close_unix_fds(message->unix_fds, &message->n_unix_fds);
@@ -1098,6 +1370,16 @@ dbus_message_new_empty_header (void)
   message->counters = NULL;
   message->size_counter_delta = 0;
   message->changed_stamp = 0;
+  message->shared_body = NULL;
+  message->arg_offsets = NULL;
+  message->n_args = 0;
+  message->signature = NULL;
+  _dbus_string_init_const_len (&message->tail, "", 0);
+  message->tail_free_function = NULL;
+  message->tail_free_data = NULL;
+  message->queue_link.prev = NULL;
+  message->queue_link.next = NULL;
+  message->queue_link.data = message;
 
 #ifdef HAVE_UNIX_FD_PASSING
   message->n_unix_fds = 0;
@@ -1307,6 +1589,108 @@ dbus_message_new_signal (const char *path,
   return message;
 }
 
+/**
+ * Like dbus_message_new_method_call(), but allocates room for a body
+ * of the given size up front, so that appending arguments totalling
+ * up to that size doesn't have to reallocate the body as it grows.
+ * The size can be computed with dbus_message_reserve_body_for_args()
+ * instead, if the arguments are known by then.
+ *
+ * @param destination name that the message should be sent to or #NULL
+ * @param path object path the message should be sent to
+ * @param interface interface to invoke method on, or #NULL
+ * @param method method to invoke
+ * @param body_size number of bytes of body to allocate
+ * @returns a new DBusMessage, free with dbus_message_unref()
+ */
+DBusMessage*
+dbus_message_new_method_call_with_capacity (const char *destination,
+                                            const char *path,
+                                            const char *interface,
+                                            const char *method,
+                                            int         body_size)
+{
+  DBusMessage *message;
+
+  _dbus_return_val_if_fail (body_size >= 0, NULL);
+
+  message = dbus_message_new_method_call (destination, path, interface, method);
+  if (message == NULL)
+    return NULL;
+
+  if (!dbus_message_reserve_body (message, body_size))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  return message;
+}
+
+/**
+ * Like dbus_message_new_method_return(), but allocates room for a
+ * body of the given size up front.
+ *
+ * @see dbus_message_new_method_call_with_capacity
+ * @param method_call the message being replied to
+ * @param body_size number of bytes of body to allocate
+ * @returns a new DBusMessage, free with dbus_message_unref()
+ */
+DBusMessage*
+dbus_message_new_method_return_with_capacity (DBusMessage *method_call,
+                                              int          body_size)
+{
+  DBusMessage *message;
+
+  _dbus_return_val_if_fail (body_size >= 0, NULL);
+
+  message = dbus_message_new_method_return (method_call);
+  if (message == NULL)
+    return NULL;
+
+  if (!dbus_message_reserve_body (message, body_size))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  return message;
+}
+
+/**
+ * Like dbus_message_new_signal(), but allocates room for a body of
+ * the given size up front.
+ *
+ * @see dbus_message_new_method_call_with_capacity
+ * @param path the path to the object emitting the signal
+ * @param interface the interface the signal is emitted from
+ * @param name name of the signal
+ * @param body_size number of bytes of body to allocate
+ * @returns a new DBusMessage, free with dbus_message_unref()
+ */
+DBusMessage*
+dbus_message_new_signal_with_capacity (const char *path,
+                                       const char *interface,
+                                       const char *name,
+                                       int         body_size)
+{
+  DBusMessage *message;
+
+  _dbus_return_val_if_fail (body_size >= 0, NULL);
+
+  message = dbus_message_new_signal (path, interface, name);
+  if (message == NULL)
+    return NULL;
+
+  if (!dbus_message_reserve_body (message, body_size))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  return message;
+}
+
 /**
  * Creates a new message that is an error reply to another message.
  * Error replies are most common in response to method calls, but
@@ -1451,6 +1835,7 @@ dbus_message_copy (const DBusMessage *message)
   retval->refcount.value = 1;
   retval->byte_order = message->byte_order;
   retval->locked = FALSE;
+  retval->queue_link.data = retval;
 #ifndef DBUS_DISABLE_CHECKS
   retval->generation = message->generation;
 #endif
@@ -1461,17 +1846,55 @@ dbus_message_copy (const DBusMessage *message)
       return NULL;
     }
 
-  if (!_dbus_string_init_preallocated (&retval->body,
-                                       _dbus_string_get_length (&message->body)))
+  /* A big body is shared with the original until one of them is
+   * modified; only bodies in our byte order, since a swap would
+   * rewrite it in place.
+   */
+  _dbus_string_init_const_len (&retval->tail, "", 0);
+
+  if (_dbus_string_get_length (&message->body) >= MIN_SHARED_BODY_SIZE &&
+      message->byte_order == DBUS_COMPILER_BYTE_ORDER &&
+      _dbus_string_get_length (&message->tail) == 0)
     {
-      _dbus_header_free (&retval->header);
-      dbus_free (retval);
-      return NULL;
-    }
+      dbus_bool_t shared;
 
-  if (!_dbus_string_copy (&message->body, 0,
-			  &retval->body, 0))
-    goto failed_copy;
+      _DBUS_LOCK (message_cache);
+      shared = share_body_unlocked ((DBusMessage *) message);
+      if (shared)
+        _dbus_atomic_inc (&message->shared_body->refcount);
+      _DBUS_UNLOCK (message_cache);
+
+      if (!shared)
+        {
+          _dbus_header_free (&retval->header);
+          dbus_free (retval);
+          return NULL;
+        }
+
+      retval->shared_body = message->shared_body;
+      _dbus_string_init_const_len (&retval->body,
+                                   _dbus_string_get_const_data (&message->body),
+                                   _dbus_string_get_length (&message->body));
+    }
+  else
+    {
+      /* the copy gets its own copy of any array appended by reference */
+      if (!_dbus_string_init_preallocated (&retval->body,
+                                           _dbus_string_get_length (&message->body) +
+                                           _dbus_string_get_length (&message->tail)))
+        {
+          _dbus_header_free (&retval->header);
+          dbus_free (retval);
+          return NULL;
+        }
+
+      if (!_dbus_string_copy (&message->body, 0,
+                              &retval->body, 0) ||
+          !_dbus_string_copy (&message->tail, 0,
+                              &retval->body,
+                              _dbus_string_get_length (&retval->body)))
+        goto failed_copy;
+    }
 
 #ifdef HAVE_UNIX_FD_PASSING
   retval->unix_fds = dbus_new(int, message->n_unix_fds);
@@ -1496,7 +1919,7 @@ dbus_message_copy (const DBusMessage *message)
 
  failed_copy:
   _dbus_header_free (&retval->header);
-  _dbus_string_free (&retval->body);
+  free_body (retval);
 
 #ifdef HAVE_UNIX_FD_PASSING
   close_unix_fds(retval->unix_fds, &retval->n_unix_fds);
@@ -1508,6 +1931,107 @@ dbus_message_copy (const DBusMessage *message)
   return NULL;
 }
 
+/**
+ * A message header marshaled once, to stamp out messages from.
+ */
+struct DBusMessageTemplate
+{
+  DBusHeader header; /**< The header, without serial, body length, signature or unix fds */
+};
+
+/**
+ * Creates a template from a message, for sending many messages that
+ * differ only in their arguments, such as the same signal emitted over
+ * and over. Everything in the message's header is kept (type, flags,
+ * path, interface, member, destination and so on) except its serial,
+ * and the body and its signature are dropped.
+ * dbus_message_new_from_template() then creates messages by copying
+ * the marshaled header, without building and validating its fields
+ * again.
+ *
+ * The message is not modified and can be unreferenced afterwards. A
+ * template is never modified either, so any number of threads can use
+ * it at once.
+ *
+ * @param message the message to take the header from
+ * @returns the template, free with dbus_message_template_free(), or #NULL if no memory
+ */
+DBusMessageTemplate*
+dbus_message_template_new (DBusMessage *message)
+{
+  DBusMessageTemplate *tmpl;
+
+  _dbus_return_val_if_fail (message != NULL, NULL);
+
+  tmpl = dbus_new (DBusMessageTemplate, 1);
+  if (tmpl == NULL)
+    return NULL;
+
+  if (!_dbus_header_copy (&message->header, &tmpl->header))
+    {
+      dbus_free (tmpl);
+      return NULL;
+    }
+
+  if (!_dbus_header_delete_field (&tmpl->header,
+                                  DBUS_HEADER_FIELD_SIGNATURE) ||
+      !_dbus_header_delete_field (&tmpl->header,
+                                  DBUS_HEADER_FIELD_UNIX_FDS))
+    {
+      dbus_message_template_free (tmpl);
+      return NULL;
+    }
+
+  _dbus_header_update_lengths (&tmpl->header, 0);
+
+  return tmpl;
+}
+
+/**
+ * Frees a template created with dbus_message_template_new(). Messages
+ * created from it are not affected.
+ *
+ * @param tmpl the template
+ */
+void
+dbus_message_template_free (DBusMessageTemplate *tmpl)
+{
+  _dbus_return_if_fail (tmpl != NULL);
+
+  _dbus_header_free (&tmpl->header);
+  dbus_free (tmpl);
+}
+
+/**
+ * Creates a new message with the header of a template, as if built by
+ * the same calls that built the template's message, and with no
+ * arguments. Arguments are appended as to any new message.
+ *
+ * @param tmpl the template
+ * @returns a new DBusMessage, free with dbus_message_unref(), or #NULL if no memory
+ */
+DBusMessage*
+dbus_message_new_from_template (const DBusMessageTemplate *tmpl)
+{
+  DBusMessage *message;
+
+  _dbus_return_val_if_fail (tmpl != NULL, NULL);
+
+  message = dbus_message_new_empty_header ();
+  if (message == NULL)
+    return NULL;
+
+  if (!_dbus_header_reinit_copy (&message->header, &tmpl->header))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  message->byte_order = tmpl->header.byte_order;
+
+  return message;
+}
+
 
 /**
  * Increments the reference count of a DBusMessage.
@@ -1784,6 +2308,306 @@ dbus_message_append_args_valist (DBusMessage *message,
   return FALSE;
 }
 
+/**
+ * Appends arguments that have already been marshalled, for example by
+ * the code dbus-marshal-gen generates from introspection data. block
+ * holds the values of the complete types in signature, in the
+ * compiler's byte order, laid out as if block started the message
+ * body. So the body must be empty, or a multiple of 8 bytes long, for
+ * the alignment padding in block to still be right.
+ *
+ * The values aren't checked one by one as dbus_message_append_args()
+ * checks them; only builds with assertions validate block as a whole.
+ * A block that doesn't match its signature, or has strings that
+ * aren't valid UTF-8, gets the sender disconnected by the bus.
+ *
+ * Unix file descriptors can't be appended this way.
+ *
+ * @param message the message
+ * @param signature the types of the values in block
+ * @param block the marshalled values
+ * @param len the length of block in bytes
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_append_marshalled (DBusMessage *message,
+                                const char  *signature,
+                                const void  *block,
+                                int          len)
+{
+  DBusString sig;
+  const char *v_SIGNATURE;
+  int body_len;
+#ifndef DBUS_DISABLE_ASSERT
+  DBusString type_str;
+  DBusString value_str;
+#endif
+
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_fail (!message->locked, FALSE);
+  _dbus_return_val_if_fail (_dbus_string_get_length (&message->tail) == 0, FALSE);
+  _dbus_return_val_if_fail (message->byte_order == DBUS_COMPILER_BYTE_ORDER, FALSE);
+  _dbus_return_val_if_fail ((_dbus_string_get_length (&message->body) & 7) == 0, FALSE);
+  _dbus_return_val_if_fail (signature != NULL, FALSE);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_signature (signature), FALSE);
+  _dbus_return_val_if_fail (strchr (signature, DBUS_TYPE_UNIX_FD) == NULL, FALSE);
+  _dbus_return_val_if_fail (len >= 0, FALSE);
+  _dbus_return_val_if_fail (block != NULL || len == 0, FALSE);
+
+#ifndef DBUS_DISABLE_ASSERT
+  /* The validator checks padding against the address of each value,
+   * and block needn't be 8-aligned, so check a copy that is.
+   */
+  _dbus_string_init_const (&type_str, signature);
+  if (!_dbus_string_init (&value_str))
+    return FALSE;
+  if (!_dbus_string_append_len (&value_str, block, len))
+    {
+      _dbus_string_free (&value_str);
+      return FALSE;
+    }
+  _dbus_assert (_dbus_validate_body_with_reason (&type_str, 0,
+                                                 DBUS_COMPILER_BYTE_ORDER,
+                                                 NULL, &value_str, 0,
+                                                 len) == DBUS_VALID);
+  _dbus_string_free (&value_str);
+#endif
+
+  if (!unshare_body (message))
+    return FALSE;
+
+  drop_arg_offsets (message);
+  drop_signature (message);
+
+  if (!_dbus_string_init (&sig))
+    return FALSE;
+
+  if (!_dbus_string_append (&sig, dbus_message_get_signature (message)) ||
+      !_dbus_string_append (&sig, signature))
+    goto failed;
+
+  if (_dbus_string_get_length (&sig) > DBUS_MAXIMUM_SIGNATURE_LENGTH)
+    {
+      _dbus_warn_check_failed ("Appending \"%s\" would make the signature of the message too long\n",
+                               signature);
+      goto failed;
+    }
+
+  body_len = _dbus_string_get_length (&message->body);
+  if (!_dbus_string_append_len (&message->body, block, len))
+    goto failed;
+
+  v_SIGNATURE = _dbus_string_get_const_data (&sig);
+  if (!_dbus_header_set_field_basic (&message->header,
+                                     DBUS_HEADER_FIELD_SIGNATURE,
+                                     DBUS_TYPE_SIGNATURE,
+                                     &v_SIGNATURE))
+    {
+      _dbus_string_set_length (&message->body, body_len);
+      goto failed;
+    }
+
+  _dbus_string_free (&sig);
+  return TRUE;
+
+ failed:
+  _dbus_string_free (&sig);
+  return FALSE;
+}
+
+/**
+ * Makes sure the message body can grow by the given number of bytes
+ * without being reallocated. The body otherwise grows as arguments
+ * are appended, at least doubling each time it runs out of room;
+ * reserving allocates exactly what's asked for, once.
+ *
+ * @param message the message
+ * @param n_bytes number of bytes to make room for after the current body
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_reserve_body (DBusMessage *message,
+                           int          n_bytes)
+{
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_fail (!message->locked, FALSE);
+  _dbus_return_val_if_fail (n_bytes >= 0, FALSE);
+
+  if (!unshare_body (message))
+    return FALSE;
+
+  return _dbus_string_reserve (&message->body, n_bytes);
+}
+
+/**
+ * Adds the size of one string-like value at pos to pos, the way
+ * _dbus_marshal_write_basic() would lay it out.
+ */
+static int
+string_marshaled_end (int         type,
+                      int         pos,
+                      const char *value)
+{
+  if (type == DBUS_TYPE_SIGNATURE)
+    return pos + 1 + strlen (value) + 1;
+  else
+    return _DBUS_ALIGN_VALUE (pos, 4) + 4 + strlen (value) + 1;
+}
+
+/**
+ * Computes how many bytes dbus_message_append_args_valist() would add
+ * to a body currently body_len long, without writing anything; the
+ * same padding is counted, so the result is exact. Takes the same
+ * argument list.
+ *
+ * @param body_len current length of the body
+ * @param first_arg_type type of first argument
+ * @param var_args value of first argument, then list of type/value pairs
+ * @returns the number of bytes, or -1 for an unsupported type or a
+ * body that would exceed the maximum message length
+ */
+static int
+args_marshaled_size_valist (int          body_len,
+                            int          first_arg_type,
+                            va_list      var_args)
+{
+  int type;
+  int pos;
+
+  type = first_arg_type;
+  pos = body_len;
+
+  while (type != DBUS_TYPE_INVALID)
+    {
+      if (dbus_type_is_fixed (type))
+        {
+          /* fixed types are exactly as big as their alignment */
+          (void) va_arg (var_args, const DBusBasicValue*);
+          pos = _DBUS_ALIGN_VALUE (pos, _dbus_type_get_alignment (type)) +
+            _dbus_type_get_alignment (type);
+        }
+      else if (dbus_type_is_basic (type))
+        {
+          const char **value;
+
+          value = va_arg (var_args, const char**);
+          pos = string_marshaled_end (type, pos, *value);
+        }
+      else if (type == DBUS_TYPE_ARRAY)
+        {
+          int element_type;
+          int n_elements;
+
+          element_type = va_arg (var_args, int);
+
+          /* the length, then padding to the first element, which is
+           * there even if the array is empty
+           */
+          pos = _DBUS_ALIGN_VALUE (pos, 4) + 4;
+          pos = _DBUS_ALIGN_VALUE (pos, _dbus_type_get_alignment (element_type));
+
+          if (dbus_type_is_fixed (element_type) &&
+              element_type != DBUS_TYPE_UNIX_FD)
+            {
+              (void) va_arg (var_args, const DBusBasicValue**);
+              n_elements = va_arg (var_args, int);
+
+              if (n_elements > DBUS_MAXIMUM_ARRAY_LENGTH / _dbus_type_get_alignment (element_type))
+                return -1;
+
+              pos += n_elements * _dbus_type_get_alignment (element_type);
+            }
+          else if (element_type == DBUS_TYPE_STRING ||
+                   element_type == DBUS_TYPE_SIGNATURE ||
+                   element_type == DBUS_TYPE_OBJECT_PATH)
+            {
+              const char ***value_p;
+              int i;
+
+              value_p = va_arg (var_args, const char***);
+              n_elements = va_arg (var_args, int);
+
+              for (i = 0; i < n_elements && pos <= DBUS_MAXIMUM_MESSAGE_LENGTH; i++)
+                pos = string_marshaled_end (element_type, pos, (*value_p)[i]);
+            }
+          else
+            return -1;
+        }
+      else
+        return -1;
+
+      if (pos > DBUS_MAXIMUM_MESSAGE_LENGTH)
+        return -1;
+
+      type = va_arg (var_args, int);
+    }
+
+  return pos - body_len;
+}
+
+/**
+ * Reserves room in the message body for the given arguments, which
+ * are given exactly as to dbus_message_append_args(). The arguments
+ * are not appended; their marshaled size is computed (including
+ * alignment padding, from where the body currently ends) and that
+ * much is reserved with dbus_message_reserve_body(). A following
+ * dbus_message_append_args() with the same list then fills the body
+ * without reallocating it.
+ *
+ * @param message the message
+ * @param first_arg_type type of the first argument
+ * @param ... value of first argument, list of additional type-value pairs
+ * @returns #FALSE if not enough memory, or a type append_args doesn't support
+ */
+dbus_bool_t
+dbus_message_reserve_body_for_args (DBusMessage *message,
+                                    int          first_arg_type,
+                                    ...)
+{
+  dbus_bool_t retval;
+  va_list var_args;
+
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+
+  va_start (var_args, first_arg_type);
+  retval = dbus_message_reserve_body_for_args_valist (message,
+                                                      first_arg_type,
+                                                      var_args);
+  va_end (var_args);
+
+  return retval;
+}
+
+/**
+ * Like dbus_message_reserve_body_for_args() but takes a va_list for
+ * use by language bindings.
+ *
+ * @param message the message
+ * @param first_arg_type type of first argument
+ * @param var_args value of first argument, then list of type/value pairs
+ * @returns #FALSE if not enough memory, or a type append_args doesn't support
+ */
+dbus_bool_t
+dbus_message_reserve_body_for_args_valist (DBusMessage *message,
+                                           int          first_arg_type,
+                                           va_list      var_args)
+{
+  int size;
+
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_fail (!message->locked, FALSE);
+
+  size = args_marshaled_size_valist (_dbus_string_get_length (&message->body),
+                                     first_arg_type, var_args);
+  if (size < 0)
+    return FALSE;
+
+  if (!unshare_body (message))
+    return FALSE;
+
+  return _dbus_string_reserve (&message->body, size);
+}
+
 /**
  * Gets arguments from a message given a variable argument list.  The
  * supported types include those supported by
@@ -1890,6 +2714,28 @@ _dbus_message_iter_init_common (DBusMessage         *message,
   real->sig_refcount = 0;
 }
 
+/* Copies the array appended by reference onto the end of the body,
+ * so the body holds all the arguments again, as the readers expect.
+ * The bytes on the wire are the same either way.
+ */
+static void
+absorb_tail (DBusMessage *message)
+{
+  if (_dbus_string_get_length (&message->tail) == 0)
+    return;
+
+  /* there's no way to report oom to a reader, so wait for memory
+   * like the blocking calls in DBusConnection do
+   */
+  while (!unshare_body (message) ||
+         !_dbus_string_copy (&message->tail, 0,
+                             &message->body,
+                             _dbus_string_get_length (&message->body)))
+    _dbus_sleep_milliseconds (100);
+
+  drop_tail (message);
+}
+
 /**
  * Initializes a #DBusMessageIter for reading the arguments of the
  * message passed in.
@@ -1923,6 +2769,8 @@ dbus_message_iter_init (DBusMessage     *message,
   _dbus_return_val_if_fail (message != NULL, FALSE);
   _dbus_return_val_if_fail (iter != NULL, FALSE);
 
+  absorb_tail (message);
+
   get_const_signature (&message->header, &type_str, &type_pos);
 
   _dbus_message_iter_init_common (message, real,
@@ -1937,6 +2785,49 @@ dbus_message_iter_init (DBusMessage     *message,
   return _dbus_type_reader_get_current_type (&real->u.reader) != DBUS_TYPE_INVALID;
 }
 
+/**
+ * Like dbus_message_iter_init(), but reads the message in whatever
+ * byte order it arrived in instead of swapping it into ours first.
+ * Basic values are read correctly in either order, so code that only
+ * looks at a few of them, like matching a signal's arguments before
+ * forwarding it, can leave a foreign-endian message to go out
+ * untouched. dbus_message_iter_get_fixed_array() still swaps the
+ * message, since it hands out a pointer to the data; after that, only
+ * the iterator it was called on (and its sub-iterators made afterwards)
+ * is usable.
+ *
+ * @param message the message
+ * @param iter pointer to an iterator to initialize
+ * @returns #FALSE if the message has no arguments
+ */
+dbus_bool_t
+_dbus_message_iter_init_unswapped (DBusMessage     *message,
+                                   DBusMessageIter *iter)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  const DBusString *type_str;
+  int type_pos;
+
+  _dbus_assert (sizeof (DBusMessageRealIter) <= sizeof (DBusMessageIter));
+
+  absorb_tail (message);
+
+  get_const_signature (&message->header, &type_str, &type_pos);
+
+  real->message = message;
+  real->changed_stamp = message->changed_stamp;
+  real->iter_type = DBUS_MESSAGE_ITER_TYPE_READER;
+  real->sig_refcount = 0;
+
+  _dbus_type_reader_init (&real->u.reader,
+                          message->byte_order,
+                          type_str, type_pos,
+                          &message->body,
+                          0);
+
+  return _dbus_type_reader_get_current_type (&real->u.reader) != DBUS_TYPE_INVALID;
+}
+
 /**
  * Checks if an iterator has any more fields.
  *
@@ -1973,6 +2864,118 @@ dbus_message_iter_next (DBusMessageIter *iter)
   return _dbus_type_reader_next (&real->u.reader);
 }
 
+/* Records where each top-level argument is, so seeking to one is a
+ * lookup. Silently leaves the table unbuilt if there is no memory.
+ */
+static void
+build_arg_offsets (DBusMessage       *message,
+                   int                byte_order,
+                   const DBusString  *type_str,
+                   int                type_pos)
+{
+  DBusTypeReader reader;
+  int *offsets;
+  int max_args;
+  int n;
+
+  /* every argument has at least one typecode */
+  max_args = strlen (_dbus_string_get_const_data_len (type_str, type_pos, 0));
+  if (max_args == 0)
+    return;
+
+  offsets = dbus_new (int, 2 * max_args);
+  if (offsets == NULL)
+    return;
+
+  _dbus_type_reader_init (&reader, byte_order, type_str, type_pos,
+                          &message->body, 0);
+
+  n = 0;
+  while (_dbus_type_reader_get_current_type (&reader) != DBUS_TYPE_INVALID)
+    {
+      _dbus_assert (n < max_args);
+      offsets[2 * n] = reader.type_pos - type_pos;
+      offsets[2 * n + 1] = reader.value_pos;
+      n += 1;
+
+      _dbus_type_reader_next (&reader);
+    }
+
+  message->arg_offsets = offsets;
+  message->n_args = n;
+}
+
+/**
+ * Moves the iterator to the top-level argument with the given index,
+ * counting from 0, as if it had been made with
+ * dbus_message_iter_init() and then moved with dbus_message_iter_next()
+ * that many times. The iterator can be anywhere among the top-level
+ * arguments of the message beforehand, but not inside a container.
+ *
+ * The first call builds a table of where every argument is and keeps
+ * it with the message, so after that seeking to any argument takes
+ * the same time however far in it is. Appending to the message throws
+ * the table away again.
+ *
+ * @param iter an iterator made with dbus_message_iter_init()
+ * @param n index of the argument to move to
+ * @returns #TRUE if there is such an argument, #FALSE if the message has fewer, in which case the iterator is at the end
+ */
+dbus_bool_t
+dbus_message_iter_seek (DBusMessageIter *iter,
+                        int              n)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  DBusMessage *message;
+  const DBusString *type_str;
+  int type_pos;
+  int i;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_READER, FALSE);
+  _dbus_return_val_if_fail (_dbus_type_reader_is_toplevel (&real->u.reader), FALSE);
+  _dbus_return_val_if_fail (n >= 0, FALSE);
+
+  message = real->message;
+  get_const_signature (&message->header, &type_str, &type_pos);
+
+  if (message->arg_offsets == NULL)
+    build_arg_offsets (message, real->u.reader.byte_order,
+                       type_str, type_pos);
+
+  if (message->arg_offsets != NULL)
+    {
+      if (n < message->n_args)
+        {
+          _dbus_type_reader_set_position (&real->u.reader,
+                                          type_pos + message->arg_offsets[2 * n],
+                                          message->arg_offsets[2 * n + 1]);
+          return TRUE;
+        }
+
+      /* the end, where dbus_message_iter_next() would have stopped */
+      type_pos += strlen (_dbus_string_get_const_data_len (type_str,
+                                                           type_pos, 0));
+      _dbus_type_reader_set_position (&real->u.reader, type_pos,
+                                      _dbus_string_get_length (&message->body));
+      return FALSE;
+    }
+
+  /* no table, so walk there */
+  _dbus_type_reader_set_position (&real->u.reader, type_pos, 0);
+
+  if (_dbus_type_reader_get_current_type (&real->u.reader) == DBUS_TYPE_INVALID)
+    return FALSE;
+
+  for (i = 0; i < n; i++)
+    {
+      if (!_dbus_type_reader_next (&real->u.reader))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 /**
  * Returns the argument type of the argument that the message iterator
  * points to. If the iterator is at the end of the message, returns
@@ -2252,8 +3255,278 @@ dbus_message_iter_get_fixed_array (DBusMessageIter  *iter,
   _dbus_return_if_fail ((subtype == DBUS_TYPE_INVALID) ||
                         (dbus_type_is_fixed (subtype) && subtype != DBUS_TYPE_UNIX_FD));
 
+  /* Only readers from _dbus_message_iter_init_unswapped() get here
+   * in the wrong order; the array is returned in place, so swap.
+   */
+  if (real->u.reader.byte_order != DBUS_COMPILER_BYTE_ORDER)
+    {
+      ensure_byte_order (real->message);
+      real->u.reader.byte_order = DBUS_COMPILER_BYTE_ORDER;
+    }
+
+  _dbus_type_reader_read_fixed_multi (&real->u.reader,
+                                      value, n_elements);
+}
+
+/**
+ * Like dbus_message_iter_get_fixed_array(), but the array stays valid
+ * after the message is finalized, until the returned reference is
+ * released with dbus_message_body_unref(). This avoids copying a big
+ * array out of a message that is not going to be kept. The message
+ * body is shared between the message and the reference, as it is with
+ * copies made by dbus_message_copy(); if the message is modified
+ * meanwhile, it gets a body of its own.
+ *
+ * The array must not be modified, as it is still the message's.
+ *
+ * @param iter the iterator
+ * @param value location to store the block
+ * @param n_elements number of elements in the block
+ * @returns a reference keeping the array alive, or #NULL if not enough memory
+ */
+DBusMessageBody *
+dbus_message_iter_ref_fixed_array (DBusMessageIter  *iter,
+                                   void             *value,
+                                   int              *n_elements)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  DBusMessage *message;
+  DBusMessageBody *body;
+  int subtype;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), NULL);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_READER, NULL);
+  _dbus_return_val_if_fail (value != NULL, NULL);
+  _dbus_return_val_if_fail (n_elements != NULL, NULL);
+
+  subtype = _dbus_type_reader_get_current_type (&real->u.reader);
+  _dbus_return_val_if_fail ((subtype == DBUS_TYPE_INVALID) ||
+                            (dbus_type_is_fixed (subtype) && subtype != DBUS_TYPE_UNIX_FD),
+                            NULL);
+
+  message = real->message;
+
+  /* only bodies in our byte order are ever shared, so swap first */
+  if (real->u.reader.byte_order != DBUS_COMPILER_BYTE_ORDER)
+    {
+      ensure_byte_order (message);
+      real->u.reader.byte_order = DBUS_COMPILER_BYTE_ORDER;
+    }
+
+  body = NULL;
+
+  _DBUS_LOCK (message_cache);
+  if (share_body_unlocked (message))
+    {
+      body = message->shared_body;
+      _dbus_atomic_inc (&body->refcount);
+    }
+  _DBUS_UNLOCK (message_cache);
+
+  if (body == NULL)
+    return NULL;
+
+  /* message->body still points at the same bytes, now owned by body */
   _dbus_type_reader_read_fixed_multi (&real->u.reader,
                                       value, n_elements);
+
+  return body;
+}
+
+/**
+ * Releases a reference returned by dbus_message_iter_ref_fixed_array().
+ * The array is freed along with the last reference to the body.
+ *
+ * @param body the reference
+ */
+void
+dbus_message_body_unref (DBusMessageBody *body)
+{
+  _dbus_return_if_fail (body != NULL);
+
+  shared_body_unref (body);
+}
+
+/**
+ * Reads an array of structs of fixed-length types (like a(iiu) or
+ * a(xd)) into an array of C structs, in one call instead of recursing
+ * into each element and reading each field. The message iter should be
+ * "in" the array, as for dbus_message_iter_get_fixed_array(), and rows
+ * are read from the current position to the end of the array.
+ *
+ * Each row of rows is row_size bytes, and field i of the struct goes
+ * to field_offsets[i] bytes into its row (use offsetof()). The C
+ * fields must have the wire size of their D-Bus types: a dbus_int32_t
+ * for #DBUS_TYPE_INT32, a dbus_bool_t for #DBUS_TYPE_BOOLEAN and so
+ * on. Alignment padding in the message is taken care of here.
+ *
+ * At most max_rows rows are copied; *n_rows is set to the number
+ * remaining in the array, which may be more, so passing max_rows of 0
+ * is a way to find out how many rows to allocate. The iterator is not
+ * moved.
+ *
+ * If the layout of the C struct is the same as in the message, see
+ * dbus_message_iter_get_fixed_struct_array_view(), which avoids the
+ * copy.
+ *
+ * @param iter the iterator
+ * @param rows where to copy the rows, or #NULL if max_rows is 0
+ * @param row_size size of each row in bytes, typically sizeof the C struct
+ * @param field_offsets byte offset within a row of each struct field
+ * @param n_fields number of fields in the struct
+ * @param max_rows most rows to copy
+ * @param n_rows place to return the number of rows left in the array
+ * @returns #FALSE if the elements aren't structs with n_fields fixed-length fields
+ */
+dbus_bool_t
+dbus_message_iter_get_fixed_struct_array (DBusMessageIter *iter,
+                                          void            *rows,
+                                          int              row_size,
+                                          const int       *field_offsets,
+                                          int              n_fields,
+                                          int              max_rows,
+                                          int             *n_rows)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  DBusMarshalPlan plan;
+  const unsigned char *data;
+  unsigned char *dest;
+  int stride;
+  int n_copy;
+  int r;
+  int i;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_READER, FALSE);
+  _dbus_return_val_if_fail (rows != NULL || max_rows == 0, FALSE);
+  _dbus_return_val_if_fail (field_offsets != NULL, FALSE);
+  _dbus_return_val_if_fail (max_rows >= 0, FALSE);
+  _dbus_return_val_if_fail (n_rows != NULL, FALSE);
+
+  if (_dbus_type_reader_get_current_type (&real->u.reader) != DBUS_TYPE_INVALID &&
+      _dbus_type_reader_get_current_type (&real->u.reader) != DBUS_TYPE_STRUCT)
+    return FALSE;
+
+  /* the rows are read in place, so swap as get_fixed_array does */
+  if (real->u.reader.byte_order != DBUS_COMPILER_BYTE_ORDER)
+    {
+      ensure_byte_order (real->message);
+      real->u.reader.byte_order = DBUS_COMPILER_BYTE_ORDER;
+    }
+
+  if (!_dbus_type_reader_read_fixed_struct_multi (&real->u.reader, &plan,
+                                                  (const void **) &data,
+                                                  n_rows) ||
+      plan.n_members != n_fields)
+    return FALSE;
+
+  stride = _DBUS_ALIGN_VALUE (plan.fixed_size, 8);
+
+  n_copy = MIN (*n_rows, max_rows);
+  dest = rows;
+
+  for (r = 0; r < n_copy; r++)
+    {
+      for (i = 0; i < plan.n_members; i++)
+        {
+          const unsigned char *src = data + plan.offsets[i];
+          unsigned char *d = dest + field_offsets[i];
+
+          /* constant sizes so these turn into single moves */
+          switch (plan.alignments[i])
+            {
+            case 1:
+              *d = *src;
+              break;
+            case 2:
+              memcpy (d, src, 2);
+              break;
+            case 4:
+              memcpy (d, src, 4);
+              break;
+            default:
+              memcpy (d, src, 8);
+              break;
+            }
+        }
+
+      data += stride;
+      dest += row_size;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Like dbus_message_iter_get_fixed_struct_array(), but instead of
+ * copying returns a pointer to the rows inside the message, if they
+ * are laid out there exactly as described: row_size equal to the
+ * distance between structs in the message (structs are 8-aligned, so
+ * rows have to be a multiple of 8 bytes) and each field at its offset
+ * in the message. Otherwise returns #FALSE and the caller should copy.
+ *
+ * The returned rows are by reference and should not be freed; they
+ * stay valid as long as the message is not modified or freed.
+ *
+ * @param iter the iterator
+ * @param row_size size of each row in bytes, typically sizeof the C struct
+ * @param field_offsets byte offset within a row of each struct field
+ * @param n_fields number of fields in the struct
+ * @param rows place to return the rows
+ * @param n_rows place to return the number of rows
+ * @returns #FALSE if the rows can't be viewed in place with this layout
+ */
+dbus_bool_t
+dbus_message_iter_get_fixed_struct_array_view (DBusMessageIter  *iter,
+                                               int               row_size,
+                                               const int        *field_offsets,
+                                               int               n_fields,
+                                               const void      **rows,
+                                               int              *n_rows)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  DBusMarshalPlan plan;
+  const unsigned char *data;
+  int stride;
+  int i;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_READER, FALSE);
+  _dbus_return_val_if_fail (field_offsets != NULL, FALSE);
+  _dbus_return_val_if_fail (rows != NULL, FALSE);
+  _dbus_return_val_if_fail (n_rows != NULL, FALSE);
+
+  if (_dbus_type_reader_get_current_type (&real->u.reader) != DBUS_TYPE_INVALID &&
+      _dbus_type_reader_get_current_type (&real->u.reader) != DBUS_TYPE_STRUCT)
+    return FALSE;
+
+  /* the rows are read in place, so swap as get_fixed_array does */
+  if (real->u.reader.byte_order != DBUS_COMPILER_BYTE_ORDER)
+    {
+      ensure_byte_order (real->message);
+      real->u.reader.byte_order = DBUS_COMPILER_BYTE_ORDER;
+    }
+
+  if (!_dbus_type_reader_read_fixed_struct_multi (&real->u.reader, &plan,
+                                                  (const void **) &data,
+                                                  n_rows) ||
+      plan.n_members != n_fields)
+    return FALSE;
+
+  stride = _DBUS_ALIGN_VALUE (plan.fixed_size, 8);
+
+  if (row_size != stride)
+    return FALSE;
+
+  for (i = 0; i < plan.n_members; i++)
+    {
+      if (field_offsets[i] != plan.offsets[i])
+        return FALSE;
+    }
+
+  *rows = data;
+
+  return TRUE;
 }
 
 /**
@@ -2290,9 +3563,10 @@ dbus_message_iter_init_append (DBusMessage     *message,
 }
 
 /**
- * Creates a temporary signature string containing the current
- * signature, stores it in the iterator, and points the iterator to
- * the end of it. Used any time we write to the message.
+ * Points the iterator to the end of a copy of the current signature,
+ * which it adds the types it writes to. Used any time we write to
+ * the message. The copy is kept on the message between writes, so
+ * only the first one copies the signature out of the header.
  *
  * @param real an iterator without a type_str
  * @returns #FALSE if no memory
@@ -2300,6 +3574,7 @@ dbus_message_iter_init_append (DBusMessage     *message,
 static dbus_bool_t
 _dbus_message_iter_open_signature (DBusMessageRealIter *real)
 {
+  DBusMessage *message;
   DBusString *str;
   const DBusString *current_sig;
   int current_sig_pos;
@@ -2313,57 +3588,72 @@ _dbus_message_iter_open_signature (DBusMessageRealIter *real)
       return TRUE;
     }
 
-  str = dbus_new (DBusString, 1);
-  if (str == NULL)
+  message = real->message;
+
+  /* The writer points at message->body itself, so it stays valid */
+  if (!unshare_body (message))
     return FALSE;
 
-  if (!_dbus_header_get_field_raw (&real->message->header,
-                                   DBUS_HEADER_FIELD_SIGNATURE,
-                                   &current_sig, &current_sig_pos))
-    current_sig = NULL;
+  drop_arg_offsets (message);
 
-  if (current_sig)
+  if (message->signature == NULL)
     {
-      int current_len;
+      str = dbus_new (DBusString, 1);
+      if (str == NULL)
+        return FALSE;
 
-      current_len = _dbus_string_get_byte (current_sig, current_sig_pos);
-      current_sig_pos += 1; /* move on to sig data */
+      if (!_dbus_header_get_field_raw (&message->header,
+                                       DBUS_HEADER_FIELD_SIGNATURE,
+                                       &current_sig, &current_sig_pos))
+        current_sig = NULL;
 
-      if (!_dbus_string_init_preallocated (str, current_len + 4))
+      if (current_sig)
         {
-          dbus_free (str);
-          return FALSE;
-        }
+          int current_len;
 
-      if (!_dbus_string_copy_len (current_sig, current_sig_pos, current_len,
-                                  str, 0))
-        {
-          _dbus_string_free (str);
-          dbus_free (str);
-          return FALSE;
+          current_len = _dbus_string_get_byte (current_sig, current_sig_pos);
+          current_sig_pos += 1; /* move on to sig data */
+
+          if (!_dbus_string_init_preallocated (str, current_len + 4))
+            {
+              dbus_free (str);
+              return FALSE;
+            }
+
+          if (!_dbus_string_copy_len (current_sig, current_sig_pos, current_len,
+                                      str, 0))
+            {
+              _dbus_string_free (str);
+              dbus_free (str);
+              return FALSE;
+            }
         }
-    }
-  else
-    {
-      if (!_dbus_string_init_preallocated (str, 4))
+      else
         {
-          dbus_free (str);
-          return FALSE;
+          if (!_dbus_string_init_preallocated (str, 4))
+            {
+              dbus_free (str);
+              return FALSE;
+            }
         }
+
+      message->signature = str;
     }
 
   real->sig_refcount = 1;
 
   _dbus_type_writer_add_types (&real->u.writer,
-                               str, _dbus_string_get_length (str));
+                               message->signature,
+                               _dbus_string_get_length (message->signature));
   return TRUE;
 }
 
 /**
- * Sets the new signature as the message signature, frees the
- * signature string, and marks the iterator as not having a type_str
- * anymore. Frees the signature even if it fails, so you can't
- * really recover from failure. Kinda busted.
+ * Sets the new signature as the message signature, and marks the
+ * iterator as not having a type_str anymore. If that fails the
+ * message keeps its old signature, and the copy is dropped since it
+ * no longer matches; so you can't really recover from failure.
+ * Kinda busted.
  *
  * @param real an iterator without a type_str
  * @returns #FALSE if no memory
@@ -2371,7 +3661,6 @@ _dbus_message_iter_open_signature (DBusMessageRealIter *real)
 static dbus_bool_t
 _dbus_message_iter_close_signature (DBusMessageRealIter *real)
 {
-  DBusString *str;
   const char *v_STRING;
   dbus_bool_t retval;
 
@@ -2387,9 +3676,10 @@ _dbus_message_iter_close_signature (DBusMessageRealIter *real)
 
   retval = TRUE;
 
-  str = real->u.writer.type_str;
-
-  v_STRING = _dbus_string_get_const_data (str);
+  /* The signature is usually the last header field while arguments
+   * are appended, in which case this rewrites it in place.
+   */
+  v_STRING = _dbus_string_get_const_data (real->u.writer.type_str);
   if (!_dbus_header_set_field_basic (&real->message->header,
                                      DBUS_HEADER_FIELD_SIGNATURE,
                                      DBUS_TYPE_SIGNATURE,
@@ -2397,24 +3687,23 @@ _dbus_message_iter_close_signature (DBusMessageRealIter *real)
     retval = FALSE;
 
   _dbus_type_writer_remove_types (&real->u.writer);
-  _dbus_string_free (str);
-  dbus_free (str);
+
+  if (!retval)
+    drop_signature (real->message);
 
   return retval;
 }
 
 /**
- * Frees the signature string and marks the iterator as not having a
- * type_str anymore.  Since the new signature is not set, the message
- * will generally be hosed after this is called.
+ * Drops the copy of the signature and marks the iterator as not
+ * having a type_str anymore.  Since the new signature is not set,
+ * the message will generally be hosed after this is called.
  *
  * @param real an iterator without a type_str
  */
 static void
 _dbus_message_iter_abandon_signature (DBusMessageRealIter *real)
 {
-  DBusString *str;
-
   _dbus_assert (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER);
   _dbus_assert (real->u.writer.type_str != NULL);
   _dbus_assert (real->sig_refcount > 0);
@@ -2425,11 +3714,8 @@ _dbus_message_iter_abandon_signature (DBusMessageRealIter *real)
     return;
   _dbus_assert (real->sig_refcount == 0);
 
-  str = real->u.writer.type_str;
-
   _dbus_type_writer_remove_types (&real->u.writer);
-  _dbus_string_free (str);
-  dbus_free (str);
+  drop_signature (real->message);
 }
 
 #ifndef DBUS_DISABLE_CHECKS
@@ -2445,6 +3731,12 @@ _dbus_message_iter_append_check (DBusMessageRealIter *iter)
       return FALSE;
     }
 
+  if (_dbus_string_get_length (&iter->message->tail) > 0)
+    {
+      _dbus_warn_check_failed ("dbus append iterator can't be used: an array appended by reference must be the last argument\n");
+      return FALSE;
+    }
+
   return TRUE;
 }
 #endif /* DBUS_DISABLE_CHECKS */
@@ -2617,19 +3909,143 @@ dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
   DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
   dbus_bool_t ret;
 
-  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
-  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
-  _dbus_return_val_if_fail (dbus_type_is_fixed (element_type) && element_type != DBUS_TYPE_UNIX_FD, FALSE);
-  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_ARRAY, FALSE);
-  _dbus_return_val_if_fail (value != NULL, FALSE);
-  _dbus_return_val_if_fail (n_elements >= 0, FALSE);
-  _dbus_return_val_if_fail (n_elements <=
-                            DBUS_MAXIMUM_ARRAY_LENGTH / _dbus_type_get_alignment (element_type),
-                            FALSE);
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (dbus_type_is_fixed (element_type) && element_type != DBUS_TYPE_UNIX_FD, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_ARRAY, FALSE);
+  _dbus_return_val_if_fail (value != NULL, FALSE);
+  _dbus_return_val_if_fail (n_elements >= 0, FALSE);
+  _dbus_return_val_if_fail (n_elements <=
+                            DBUS_MAXIMUM_ARRAY_LENGTH / _dbus_type_get_alignment (element_type),
+                            FALSE);
+
+  ret = _dbus_type_writer_write_fixed_multi (&real->u.writer, element_type, value, n_elements);
+
+  return ret;
+}
+
+/**
+ * Appends an array of fixed-length elements as the last argument of
+ * the message, like dbus_message_iter_open_container(),
+ * dbus_message_iter_append_fixed_array() and
+ * dbus_message_iter_close_container() together, except that the
+ * elements are not copied into the message. The message refers to the
+ * caller's array until it is finalized, and the array is written to
+ * the socket straight from there, so it must not be modified or freed
+ * in the meantime; free_function is called with user_data once the
+ * message no longer needs it. This saves copying a large array, such
+ * as an image or audio buffer, which would otherwise be copied into
+ * the message only to be written out and thrown away.
+ *
+ * Nothing can be appended after the array. Reading the message with
+ * dbus_message_iter_init(), copying it with dbus_message_copy() or
+ * marshalling it with dbus_message_marshal() copies the array after
+ * all, and may call free_function early.
+ *
+ * The value is the address of the array, like for
+ * dbus_message_iter_append_fixed_array(). The iterator must be the
+ * top-level append iterator, not one for the inside of a container.
+ * If this returns #FALSE, the array still belongs to the caller and
+ * free_function is not called.
+ *
+ * @param iter the append iterator
+ * @param element_type the type of the array elements
+ * @param value the address of the array
+ * @param n_elements the number of elements in the array
+ * @param free_function function to call when the array is no longer needed, or #NULL
+ * @param user_data data to pass to free_function
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_append_fixed_array_by_reference (DBusMessageIter  *iter,
+                                                   int               element_type,
+                                                   const void       *value,
+                                                   int               n_elements,
+                                                   DBusFreeFunction  free_function,
+                                                   void             *user_data)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  DBusMessage *message;
+  DBusMessageIter sub;
+  char element_signature[2];
+  const void *empty;
+  int len_pos;
+  int n_bytes;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_INVALID, FALSE);
+  _dbus_return_val_if_fail (dbus_type_is_fixed (element_type) && element_type != DBUS_TYPE_UNIX_FD, FALSE);
+  _dbus_return_val_if_fail (value != NULL, FALSE);
+  _dbus_return_val_if_fail (n_elements >= 0, FALSE);
+  _dbus_return_val_if_fail (n_elements <=
+                            DBUS_MAXIMUM_ARRAY_LENGTH / _dbus_type_get_alignment (element_type),
+                            FALSE);
+
+  message = real->message;
+  element_signature[0] = element_type;
+  element_signature[1] = DBUS_TYPE_INVALID;
+
+  /* The caller's array is in our byte order, so a message in the
+   * other one gets a swapped copy; an empty array is not worth a tail
+   */
+  if (message->byte_order != DBUS_COMPILER_BYTE_ORDER || n_elements == 0)
+    {
+      if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                             element_signature, &sub))
+        return FALSE;
+
+      if (!dbus_message_iter_append_fixed_array (&sub, element_type,
+                                                 value, n_elements))
+        {
+          dbus_message_iter_abandon_container (iter, &sub);
+          return FALSE;
+        }
+
+      if (!dbus_message_iter_close_container (iter, &sub))
+        return FALSE;
+
+      if (free_function != NULL)
+        (* free_function) (user_data);
 
-  ret = _dbus_type_writer_write_fixed_multi (&real->u.writer, element_type, value, n_elements);
+      return TRUE;
+    }
 
-  return ret;
+  /* Write an empty array, which puts the length and the padding before
+   * the first element into the body, then make its length cover the
+   * elements that follow the body in the tail.
+   */
+  len_pos = _DBUS_ALIGN_VALUE (_dbus_string_get_length (&message->body), 4);
+  empty = NULL;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         element_signature, &sub))
+    return FALSE;
+
+  if (!dbus_message_iter_append_fixed_array (&sub, element_type,
+                                             &empty, 0))
+    {
+      dbus_message_iter_abandon_container (iter, &sub);
+      return FALSE;
+    }
+
+  if (!dbus_message_iter_close_container (iter, &sub))
+    return FALSE;
+
+  n_bytes = n_elements * _dbus_type_get_alignment (element_type);
+
+  _dbus_assert (_dbus_string_get_length (&message->body) %
+                _dbus_type_get_alignment (element_type) == 0);
+
+  _dbus_marshal_set_uint32 (&message->body, len_pos, n_bytes,
+                            message->byte_order);
+
+  _dbus_string_init_const_len (&message->tail,
+                               *(const char * const *) value, n_bytes);
+  message->tail_free_function = free_function;
+  message->tail_free_data = user_data;
+
+  return TRUE;
 }
 
 /**
@@ -3659,6 +5075,54 @@ dbus_message_contains_unix_fds(DBusMessage *message)
  */
 #define INITIAL_LOADER_DATA_LEN 32
 
+/* Brings the loader's share of DBUS_MEMORY_LOADERS up to date with
+ * what its buffer currently has allocated.
+ */
+static void
+loader_account (DBusMessageLoader *loader)
+{
+  int allocated;
+
+  if (!_dbus_memory_accounting_enabled)
+    return;
+
+  allocated = _dbus_string_get_allocated_size (&loader->data);
+  _dbus_memory_account_bytes (DBUS_MEMORY_LOADERS,
+                              allocated - loader->accounted);
+  loader->accounted = allocated;
+}
+
+/**
+ * The body of a message the loader has read, to be validated on
+ * another thread. The loader holds back the message and everything
+ * after it until _dbus_message_loader_body_check_done() is called
+ * with the check.
+ *
+ * Only _dbus_body_check_run() may be called from another thread; the
+ * reference count is not atomic, so the check is referenced and
+ * unreferenced where the loader runs.
+ */
+struct DBusBodyCheck
+{
+  int refcount;                 /**< Reference count */
+  DBusMessage *message;         /**< The message, with the header loaded */
+  const DBusString *type_str;   /**< The message's signature */
+  int type_pos;                 /**< Where the signature starts in type_str */
+  dbus_bool_t partial;          /**< #TRUE to carry on from state */
+  DBusBodyValidation state;     /**< How much stream_partial_message() did */
+  DBusValidity validity;        /**< Outcome of _dbus_body_check_run() */
+  dbus_bool_t done;             /**< Handed back to the loader */
+};
+
+/**
+ * How much unused space the loader keeps around once it has turned
+ * buffered data into messages. This is the size of one socket read
+ * (see max_bytes_read_per_iteration in dbus-transport-socket.c), so a
+ * busy connection doesn't shrink the buffer only to grow it again on
+ * the next read.
+ */
+#define MAX_LOADER_DATA_WASTE (8 * _DBUS_ONE_KILOBYTE)
+
 /**
  * Creates a new message loader. Returns #NULL if memory can't
  * be allocated.
@@ -3697,6 +5161,7 @@ _dbus_message_loader_new (void)
   /* preallocate the buffer for speed, ignore failure */
   _dbus_string_set_length (&loader->data, INITIAL_LOADER_DATA_LEN);
   _dbus_string_set_length (&loader->data, 0);
+  loader_account (loader);
 
 #ifdef HAVE_UNIX_FD_PASSING
   loader->unix_fds = NULL;
@@ -3737,10 +5202,16 @@ _dbus_message_loader_unref (DBusMessageLoader *loader)
       close_unix_fds(loader->unix_fds, &loader->n_unix_fds);
       dbus_free(loader->unix_fds);
 #endif
-      _dbus_list_foreach (&loader->messages,
-                          (DBusForeachFunction) dbus_message_unref,
-                          NULL);
-      _dbus_list_clear (&loader->messages);
+      _dbus_message_queue_clear (&loader->messages);
+      if (loader->partial != NULL)
+        dbus_message_unref (loader->partial);
+      if (loader->check != NULL)
+        {
+          /* the loader's reference, as for any queued message */
+          dbus_message_unref (loader->check->message);
+          _dbus_body_check_unref (loader->check);
+        }
+      _dbus_memory_account (DBUS_MEMORY_LOADERS, -loader->accounted);
       _dbus_string_free (&loader->data);
       dbus_free (loader);
     }
@@ -3794,6 +5265,7 @@ _dbus_message_loader_return_buffer (DBusMessageLoader  *loader,
   _dbus_assert (buffer == &loader->data);
 
   loader->buffer_outstanding = FALSE;
+  loader_account (loader);
 }
 
 /**
@@ -3872,9 +5344,108 @@ _dbus_message_loader_return_unix_fds(DBusMessageLoader  *loader,
 #endif
 }
 
+/* Validates the body of a message loaded by load_message() */
+static DBusValidity
+validate_loaded_body (DBusMessage        *message,
+                      const DBusString   *type_str,
+                      int                 type_pos,
+                      DBusBodyValidation *partial_state)
+{
+  int body_len;
+
+  body_len = _dbus_string_get_length (&message->body);
+
+  /* carry on from where stream_partial_message() got to */
+  if (partial_state != NULL)
+    return _dbus_validate_body_prefix (partial_state, type_str,
+                                       message->byte_order,
+                                       &message->body, 0,
+                                       body_len, body_len);
+
+  /* Because the bytes_remaining arg is NULL, this validates that the
+   * body is the right length
+   */
+  return _dbus_validate_body_with_reason (type_str, type_pos,
+                                          message->byte_order, NULL,
+                                          &message->body, 0, body_len);
+}
+
+static DBusBodyCheck *
+body_check_new (DBusMessage        *message,
+                DBusBodyValidation *partial_state)
+{
+  DBusBodyCheck *check;
+
+  check = dbus_new0 (DBusBodyCheck, 1);
+  if (check == NULL)
+    return NULL;
+
+  check->refcount = 1;
+  check->message = dbus_message_ref (message);
+  get_const_signature (&message->header, &check->type_str, &check->type_pos);
+  if (partial_state != NULL)
+    {
+      check->partial = TRUE;
+      check->state = *partial_state;
+    }
+  check->validity = DBUS_VALIDITY_UNKNOWN;
+
+  return check;
+}
+
+/**
+ * Increments the reference count of a body check.
+ *
+ * @param check the check
+ * @returns the check
+ */
+DBusBodyCheck *
+_dbus_body_check_ref (DBusBodyCheck *check)
+{
+  check->refcount += 1;
+
+  return check;
+}
+
+/**
+ * Decrements the reference count of a body check, freeing it and
+ * dropping its reference to the message when it reaches zero.
+ *
+ * @param check the check
+ */
+void
+_dbus_body_check_unref (DBusBodyCheck *check)
+{
+  check->refcount -= 1;
+  if (check->refcount == 0)
+    {
+      dbus_message_unref (check->message);
+      dbus_free (check);
+    }
+}
+
+/**
+ * Validates the body of the message. Touches nothing but the check
+ * and the message, which nothing else touches until the check is
+ * done, so it may be called from any thread.
+ *
+ * @param check the check
+ */
+void
+_dbus_body_check_run (DBusBodyCheck *check)
+{
+  check->validity = validate_loaded_body (check->message,
+                                          check->type_str,
+                                          check->type_pos,
+                                          check->partial ? &check->state : NULL);
+}
+
 /*
- * FIXME when we move the header out of the buffer, that memmoves all
- * buffered messages. Kind of crappy.
+ * The message starts at @p start in loader->data; the bytes before it
+ * belong to messages already loaded by the same
+ * _dbus_message_loader_queue_messages() call and are only deleted
+ * once that call is done, so a read buffer holding many small messages
+ * costs one memmove of the remainder rather than one per message.
  *
  * Also we copy the header and body, which is kind of crappy.  To
  * avoid this, we have to allow header and body to be in a single
@@ -3892,15 +5463,22 @@ _dbus_message_loader_return_unix_fds(DBusMessageLoader  *loader,
  * memmoved. Though I suppose we also don't have a chance of reading a
  * bunch of small messages at once, so the optimization may be stupid.
  *
- * Another approach would be to keep a "start" index into
- * loader->data and only delete it occasionally, instead of after
- * each message is loaded.
+ * The header and body are validated on their copies rather than in
+ * loader->data, because the validators want 8-aligned data and a
+ * message can start anywhere in the read buffer.
+ *
+ * If the message is loader->partial, its header is already loaded and
+ * the start of its body already validated by stream_partial_message().
+ *
+ * A big body may instead be handed to loader->check_function, in which
+ * case the message is left in loader->check rather than queued.
  *
  * load_message() returns FALSE if not enough memory OR the loader was corrupted
  */
 static dbus_bool_t
 load_message (DBusMessageLoader *loader,
               DBusMessage       *message,
+              int                start,
               int                byte_order,
               int                fields_array_len,
               int                header_len,
@@ -3911,29 +5489,37 @@ load_message (DBusMessageLoader *loader,
   const DBusString *type_str;
   int type_pos;
   DBusValidationMode mode;
+  DBusBodyValidation *partial_state;
+  DBusBodyCheck *check;
   dbus_uint32_t n_unix_fds = 0;
 
   mode = DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED;
+  check = NULL;
   
   oom = FALSE;
 
 #if 0
-  _dbus_verbose_bytes_of_string (&loader->data, 0, header_len /* + body_len */);
+  _dbus_verbose_bytes_of_string (&loader->data, start, header_len /* + body_len */);
 #endif
 
   /* 1. VALIDATE AND COPY OVER HEADER */
-  _dbus_assert (_dbus_string_get_length (&message->header.data) == 0);
-  _dbus_assert ((header_len + body_len) <= _dbus_string_get_length (&loader->data));
+  _dbus_assert ((start + header_len + body_len) <= _dbus_string_get_length (&loader->data));
 
-  if (!_dbus_header_load (&message->header,
+  if (message == loader->partial)
+    {
+      _dbus_assert (start == 0);
+      _dbus_assert (_dbus_string_get_length (&message->header.data) == header_len);
+      validity = DBUS_VALID;
+    }
+  else if (!_dbus_header_load (&message->header,
                           mode,
                           &validity,
                           byte_order,
                           fields_array_len,
                           header_len,
                           body_len,
-                          &loader->data, 0,
-                          _dbus_string_get_length (&loader->data)))
+                          &loader->data, start,
+                          _dbus_string_get_length (&loader->data) - start))
     {
       _dbus_verbose ("Failed to load header for new message code %d\n", validity);
 
@@ -3955,21 +5541,45 @@ load_message (DBusMessageLoader *loader,
 
   message->byte_order = byte_order;
 
-  /* 2. VALIDATE BODY */
-  if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
+  /* 2. COPY OVER AND VALIDATE BODY */
+  _dbus_assert (_dbus_string_get_length (&message->body) == 0);
+
+  if (!_dbus_string_copy_len (&loader->data, start + header_len, body_len,
+                              &message->body, 0))
     {
-      get_const_signature (&message->header, &type_str, &type_pos);
-      
-      /* Because the bytes_remaining arg is NULL, this validates that the
-       * body is the right length
+      _dbus_verbose ("Failed to copy body into new message\n");
+      oom = TRUE;
+      goto failed;
+    }
+
+  if (loader->trust_bodies)
+    {
+      /* The header was fully checked above and we know how long the
+       * body is, which is all we need to frame the next message; the
+       * recursive walk over the body is what we are asked to skip.
        */
-      validity = _dbus_validate_body_with_reason (type_str,
-                                                  type_pos,
-                                                  byte_order,
-                                                  NULL,
-                                                  &loader->data,
-                                                  header_len,
-                                                  body_len);
+      _dbus_verbose ("Not validating body of message from trusted peer\n");
+    }
+  else if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
+    {
+      partial_state = NULL;
+      if (message == loader->partial)
+        partial_state = &loader->partial_validation;
+
+      /* If there's no memory to hand it off, validate it here */
+      if (loader->check_function != NULL &&
+          body_len >= loader->check_min_size)
+        check = body_check_new (message, partial_state);
+
+      if (check != NULL)
+        validity = DBUS_VALID;
+      else
+        {
+          get_const_signature (&message->header, &type_str, &type_pos);
+          validity = validate_loaded_body (message, type_str, type_pos,
+                                           partial_state);
+        }
+
       if (validity != DBUS_VALID)
         {
           _dbus_verbose ("Failed to validate message body code %d\n", validity);
@@ -4015,7 +5625,9 @@ load_message (DBusMessageLoader *loader,
 
       message->n_unix_fds_allocated = message->n_unix_fds = n_unix_fds;
       loader->n_unix_fds -= n_unix_fds;
-      memmove(loader->unix_fds + n_unix_fds, loader->unix_fds, loader->n_unix_fds);
+      if (loader->n_unix_fds > 0)
+        memmove(loader->unix_fds, loader->unix_fds + n_unix_fds,
+                loader->n_unix_fds * sizeof(loader->unix_fds[0]));
     }
   else
     message->unix_fds = NULL;
@@ -4034,30 +5646,35 @@ load_message (DBusMessageLoader *loader,
 
 #endif
 
-  /* 3. COPY OVER BODY AND QUEUE MESSAGE */
+  /* 4. QUEUE MESSAGE, OR HOLD IT BACK UNTIL ITS BODY IS CHECKED */
 
-  if (!_dbus_list_append (&loader->messages, message))
+  if (check != NULL)
     {
-      _dbus_verbose ("Failed to append new message to loader queue\n");
-      oom = TRUE;
-      goto failed;
-    }
+      if ((* loader->check_function) (check, loader->check_data))
+        {
+          _dbus_verbose ("Validating body of message %p elsewhere\n", message);
+          loader->check = check;
+          return TRUE;
+        }
 
-  _dbus_assert (_dbus_string_get_length (&message->body) == 0);
-  _dbus_assert (_dbus_string_get_length (&loader->data) >=
-                (header_len + body_len));
+      _dbus_body_check_run (check);
+      validity = check->validity;
+      _dbus_body_check_unref (check);
+      check = NULL;
 
-  if (!_dbus_string_copy_len (&loader->data, header_len, body_len, &message->body, 0))
-    {
-      _dbus_verbose ("Failed to move body into new message\n");
-      oom = TRUE;
-      goto failed;
-    }
+      if (validity != DBUS_VALID)
+        {
+          _dbus_verbose ("Failed to validate message body code %d\n", validity);
 
-  _dbus_string_delete (&loader->data, 0, header_len + body_len);
+          loader->corrupted = TRUE;
+          loader->corruption_reason = validity;
+
+          goto failed;
+        }
+    }
 
-  /* don't waste more than 2k of memory */
-  _dbus_string_compact (&loader->data, 2048);
+  _dbus_list_append_link (&loader->messages,
+                          _dbus_message_get_queue_link (message));
 
   _dbus_assert (_dbus_string_get_length (&message->header.data) == header_len);
   _dbus_assert (_dbus_string_get_length (&message->body) == body_len);
@@ -4067,16 +5684,17 @@ load_message (DBusMessageLoader *loader,
   _dbus_assert (!oom);
   _dbus_assert (!loader->corrupted);
   _dbus_assert (loader->messages != NULL);
-  _dbus_assert (_dbus_list_find_last (&loader->messages, message) != NULL);
+  _dbus_assert (loader->messages->prev == &message->queue_link);
 
   return TRUE;
 
  failed:
 
-  /* Clean up */
+  if (check != NULL)
+    _dbus_body_check_unref (check);
 
-  /* does nothing if the message isn't in the list */
-  _dbus_list_remove_last (&loader->messages, message);
+  /* the message is only queued once nothing else can fail */
+  _dbus_assert (message->queue_link.next == NULL);
   
   if (oom)
     _dbus_assert (!loader->corrupted);
@@ -4088,6 +5706,105 @@ load_message (DBusMessageLoader *loader,
   return FALSE;
 }
 
+/* Messages at least this big are validated while they arrive */
+#define MIN_STREAMED_MESSAGE_SIZE (64 * 1024)
+
+/*
+ * Called when the start of a message that hasn't all arrived yet is at
+ * the start of loader->data. If it's a big one, its header is loaded
+ * into loader->partial as soon as that is complete, and then each
+ * argument of its body is validated once it is complete. A bad message
+ * is rejected without waiting for the rest of it, and there is little
+ * left to validate when the rest does arrive.
+ *
+ * Validation of an argument that is still arriving is only retried
+ * once the part of it we have has doubled, so that a big array of
+ * strings isn't walked again after every read.
+ *
+ * Running out of memory here just means the message is checked later.
+ */
+static void
+stream_partial_message (DBusMessageLoader *loader,
+                        int                byte_order,
+                        int                fields_array_len,
+                        int                header_len,
+                        int                body_len)
+{
+  DBusValidity validity;
+  const DBusString *type_str;
+  int type_pos;
+  int available;
+  int validated;
+
+  available = _dbus_string_get_length (&loader->data) - header_len;
+
+  if (loader->partial == NULL)
+    {
+      DBusMessage *message;
+
+      if (header_len + body_len < MIN_STREAMED_MESSAGE_SIZE || available < 0)
+        return;
+
+      message = dbus_message_new_empty_header ();
+      if (message == NULL)
+        return;
+
+      if (!_dbus_header_load (&message->header,
+                              DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED,
+                              &validity,
+                              byte_order,
+                              fields_array_len,
+                              header_len,
+                              body_len,
+                              &loader->data, 0,
+                              _dbus_string_get_length (&loader->data)))
+        {
+          dbus_message_unref (message);
+
+          if (validity != DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
+            {
+              _dbus_verbose ("Header of arriving message is invalid, code %d\n",
+                             validity);
+              loader->corrupted = TRUE;
+              loader->corruption_reason = validity;
+            }
+          return;
+        }
+
+      message->byte_order = byte_order;
+
+      get_const_signature (&message->header, &type_str, &type_pos);
+      loader->partial = message;
+      _dbus_body_validation_init (&loader->partial_validation, type_pos);
+      loader->partial_tried = 0;
+    }
+
+  if (loader->trust_bodies)
+    return;
+
+  validated = loader->partial_validation.validated;
+  if (available - validated < 2 * (loader->partial_tried - validated))
+    return;
+
+  get_const_signature (&loader->partial->header, &type_str, &type_pos);
+
+  validity = _dbus_validate_body_prefix (&loader->partial_validation,
+                                         type_str,
+                                         byte_order,
+                                         &loader->data, header_len,
+                                         available, body_len);
+  if (validity != DBUS_VALID)
+    {
+      _dbus_verbose ("Body of arriving message is invalid, code %d\n",
+                     validity);
+      loader->corrupted = TRUE;
+      loader->corruption_reason = validity;
+      return;
+    }
+
+  loader->partial_tried = available;
+}
+
 /**
  * Converts buffered data into messages, if we have enough data.  If
  * we don't have enough data, does nothing.
@@ -4105,11 +5822,50 @@ load_message (DBusMessageLoader *loader,
 dbus_bool_t
 _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
 {
+  DBusLatencyStart timing;
+  dbus_bool_t retval;
+  int start;
+  dbus_bool_t incomplete;
+  int byte_order, fields_array_len, header_len, body_len;
+
+  retval = TRUE;
+  start = 0;
+  incomplete = FALSE;
+
+  if (loader->check != NULL)
+    {
+      DBusBodyCheck *check = loader->check;
+
+      /* nothing after it can be queued before it is */
+      if (!check->done)
+        return TRUE;
+
+      loader->check = NULL;
+
+      if (check->validity == DBUS_VALID)
+        {
+          /* the loader's reference, as for any queued message */
+          _dbus_list_append_link (&loader->messages,
+                                  _dbus_message_get_queue_link (check->message));
+        }
+      else
+        {
+          _dbus_verbose ("Failed to validate message body code %d\n",
+                         check->validity);
+          loader->corrupted = TRUE;
+          loader->corruption_reason = check->validity;
+          dbus_message_unref (check->message);
+        }
+
+      _dbus_body_check_unref (check);
+    }
+
+  _dbus_latency_begin (&timing);
+
   while (!loader->corrupted &&
-         _dbus_string_get_length (&loader->data) >= DBUS_MINIMUM_HEADER_SIZE)
+         _dbus_string_get_length (&loader->data) - start >= DBUS_MINIMUM_HEADER_SIZE)
     {
       DBusValidity validity;
-      int byte_order, fields_array_len, header_len, body_len;
 
       if (_dbus_header_have_message_untrusted (loader->max_message_size,
                                                &validity,
@@ -4117,30 +5873,49 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
                                                &fields_array_len,
                                                &header_len,
                                                &body_len,
-                                               &loader->data, 0,
-                                               _dbus_string_get_length (&loader->data)))
+                                               &loader->data, start,
+                                               _dbus_string_get_length (&loader->data) - start))
         {
           DBusMessage *message;
 
           _dbus_assert (validity == DBUS_VALID);
 
-          message = dbus_message_new_empty_header ();
+          if (loader->partial != NULL)
+            message = loader->partial;
+          else
+            message = dbus_message_new_empty_header ();
+
           if (message == NULL)
-            return FALSE;
+            {
+              retval = FALSE;
+              break;
+            }
+
+          retval = load_message (loader, message, start,
+                                 byte_order, fields_array_len,
+                                 header_len, body_len);
+          loader->partial = NULL;
 
-          if (!load_message (loader, message,
-                             byte_order, fields_array_len,
-                             header_len, body_len))
+          if (!retval)
             {
               dbus_message_unref (message);
               /* load_message() returns false if corrupted or OOM; if
                * corrupted then return TRUE for not OOM
                */
-              return loader->corrupted;
+              retval = loader->corrupted;
+              break;
             }
 
+          start += header_len + body_len;
+
+          if (loader->check != NULL)
+            break;
+
           _dbus_assert (loader->messages != NULL);
-          _dbus_assert (_dbus_list_find_last (&loader->messages, message) != NULL);
+          _dbus_assert (loader->messages->prev == &message->queue_link);
+
+          _DBUS_PROBE2 (message__validated, message,
+                        (long) (header_len + body_len));
 	}
       else
         {
@@ -4151,11 +5926,31 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
               loader->corrupted = TRUE;
               loader->corruption_reason = validity;
             }
-          return TRUE;
+          else
+            incomplete = TRUE;
+          break;
         }
     }
 
-  return TRUE;
+  /* Drop everything we turned into messages in one go; whatever is
+   * left is the start of a message we don't have all of yet.
+   */
+  if (start > 0)
+    {
+      _dbus_string_delete (&loader->data, 0, start);
+
+      _dbus_string_compact (&loader->data, MAX_LOADER_DATA_WASTE);
+      loader_account (loader);
+
+      /* only passes that produced a message say anything about parsing */
+      _dbus_latency_end (DBUS_LATENCY_PARSE, &timing);
+    }
+
+  if (incomplete)
+    stream_partial_message (loader, byte_order, fields_array_len,
+                            header_len, body_len);
+
+  return retval;
 }
 
 /**
@@ -4185,12 +5980,17 @@ _dbus_message_loader_peek_message (DBusMessageLoader *loader)
 DBusMessage*
 _dbus_message_loader_pop_message (DBusMessageLoader *loader)
 {
-  return _dbus_list_pop_first (&loader->messages);
+  DBusList *link;
+
+  link = _dbus_message_loader_pop_message_link (loader);
+
+  return link != NULL ? link->data : NULL;
 }
 
 /**
- * Pops a loaded message inside a list link (passing ownership of the
- * message and link to the caller). Returns #NULL if no messages have
+ * Pops a loaded message as its queue link (passing ownership of the
+ * message to the caller; the link is part of the message, see
+ * _dbus_message_get_queue_link()). Returns #NULL if no messages have
  * been loaded.
  *
  * @param loader the loader.
@@ -4309,6 +6109,94 @@ _dbus_message_loader_get_max_message_unix_fds (DBusMessageLoader  *loader)
   return loader->max_message_unix_fds;
 }
 
+/**
+ * Sets whether message bodies are trusted to be valid, in which case
+ * only the header is validated. See
+ * dbus_connection_set_trust_peer_messages().
+ *
+ * @param loader the loader
+ * @param trust #TRUE to skip body validation
+ */
+void
+_dbus_message_loader_set_trust_bodies (DBusMessageLoader  *loader,
+                                       dbus_bool_t         trust)
+{
+  loader->trust_bodies = trust != FALSE;
+}
+
+/**
+ * Has the bodies of messages of at least min_size bytes validated by
+ * function rather than while loading them, so that a huge body does
+ * not hold up whoever runs the loader. The function is expected to
+ * arrange for _dbus_body_check_run() to be called on the check, then
+ * for _dbus_message_loader_body_check_done() to be called where the
+ * loader runs. Until then the message and everything read after it
+ * are held back.
+ *
+ * @param loader the loader
+ * @param min_size the smallest body to hand off
+ * @param function the function, or #NULL to validate everything here
+ * @param data data for function
+ */
+void
+_dbus_message_loader_set_body_check_function (DBusMessageLoader    *loader,
+                                              long                  min_size,
+                                              DBusBodyCheckFunction function,
+                                              void                 *data)
+{
+  loader->check_min_size = min_size;
+  loader->check_function = function;
+  loader->check_data = data;
+}
+
+/**
+ * Gets whether a message's body is being validated elsewhere, in
+ * which case nothing more can be loaded until it is done.
+ *
+ * @param loader the loader
+ * @returns #TRUE if a check has not been handed back yet
+ */
+dbus_bool_t
+_dbus_message_loader_get_is_checking (DBusMessageLoader *loader)
+{
+  return loader->check != NULL && !loader->check->done;
+}
+
+/**
+ * Hands back a check that _dbus_body_check_run() has been called on.
+ * The message is queued, or the loader corrupted, by the next
+ * _dbus_message_loader_queue_messages(). Does nothing if the check is
+ * not the loader's.
+ *
+ * @param loader the loader
+ * @param check the check
+ */
+void
+_dbus_message_loader_body_check_done (DBusMessageLoader *loader,
+                                      DBusBodyCheck     *check)
+{
+  if (loader->check == check)
+    check->done = TRUE;
+}
+
+/**
+ * Gives back whatever the read buffer has beyond what it holds.
+ * Parsing only compacts it down to #MAX_LOADER_DATA_WASTE, so a peer
+ * that once sent something big otherwise keeps paying for it while
+ * it sits idle. Does nothing while the buffer is lent out.
+ *
+ * @param loader the loader
+ */
+void
+_dbus_message_loader_trim (DBusMessageLoader  *loader)
+{
+  if (loader->buffer_outstanding)
+    return;
+
+  _dbus_string_compact (&loader->data, 0);
+  loader_account (loader);
+}
+
 static DBusDataSlotAllocator slot_allocator;
 _DBUS_DEFINE_GLOBAL_LOCK (message_slots);
 
@@ -4519,6 +6407,11 @@ dbus_message_marshal (DBusMessage  *msg,
 
   *len_p = _dbus_string_get_length (&tmp);
 
+  if (!_dbus_string_copy (&(msg->tail), 0, &tmp, *len_p))
+    goto fail;
+
+  *len_p = _dbus_string_get_length (&tmp);
+
   if (!_dbus_string_steal_data (&tmp, marshalled_data_p))
     goto fail;
 
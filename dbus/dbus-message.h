@@ -42,6 +42,10 @@ DBUS_BEGIN_DECLS
  */
 
 typedef struct DBusMessage DBusMessage;
+/** Opaque type representing a prebuilt message header, see dbus_message_template_new(). */
+typedef struct DBusMessageTemplate DBusMessageTemplate;
+/** Opaque type representing a reference to a received message's body, see dbus_message_iter_ref_fixed_array(). */
+typedef struct DBusMessageBody DBusMessageBody;
 /** Opaque type representing a message iterator. Can be copied by value, and contains no allocated memory so never needs to be freed and can be allocated on the stack. */
 typedef struct DBusMessageIter DBusMessageIter;
 
@@ -80,6 +84,20 @@ DBusMessage* dbus_message_new_signal        (const char  *path,
                                              const char  *interface,
                                              const char  *name);
 DBUS_EXPORT
+DBusMessage* dbus_message_new_method_call_with_capacity   (const char  *bus_name,
+                                                           const char  *path,
+                                                           const char  *interface,
+                                                           const char  *method,
+                                                           int          body_size);
+DBUS_EXPORT
+DBusMessage* dbus_message_new_method_return_with_capacity (DBusMessage *method_call,
+                                                           int          body_size);
+DBUS_EXPORT
+DBusMessage* dbus_message_new_signal_with_capacity        (const char  *path,
+                                                           const char  *interface,
+                                                           const char  *name,
+                                                           int          body_size);
+DBUS_EXPORT
 DBusMessage* dbus_message_new_error         (DBusMessage *reply_to,
                                              const char  *error_name,
                                              const char  *error_message);
@@ -92,6 +110,13 @@ DBusMessage* dbus_message_new_error_printf  (DBusMessage *reply_to,
 DBUS_EXPORT
 DBusMessage* dbus_message_copy              (const DBusMessage *message);
 
+DBUS_EXPORT
+DBusMessageTemplate* dbus_message_template_new      (DBusMessage               *message);
+DBUS_EXPORT
+void                 dbus_message_template_free     (DBusMessageTemplate       *tmpl);
+DBUS_EXPORT
+DBusMessage*         dbus_message_new_from_template (const DBusMessageTemplate *tmpl);
+
 DBUS_EXPORT
 DBusMessage*  dbus_message_ref              (DBusMessage   *message);
 DBUS_EXPORT
@@ -194,6 +219,22 @@ dbus_bool_t dbus_message_append_args_valist   (DBusMessage     *message,
 					       int              first_arg_type,
 					       va_list          var_args);
 DBUS_EXPORT
+dbus_bool_t dbus_message_append_marshalled    (DBusMessage     *message,
+                                               const char      *signature,
+                                               const void      *block,
+                                               int              len);
+DBUS_EXPORT
+dbus_bool_t dbus_message_reserve_body         (DBusMessage     *message,
+                                               int              n_bytes);
+DBUS_EXPORT
+dbus_bool_t dbus_message_reserve_body_for_args (DBusMessage     *message,
+                                                int              first_arg_type,
+                                                ...);
+DBUS_EXPORT
+dbus_bool_t dbus_message_reserve_body_for_args_valist (DBusMessage     *message,
+                                                       int              first_arg_type,
+                                                       va_list          var_args);
+DBUS_EXPORT
 dbus_bool_t dbus_message_get_args             (DBusMessage     *message,
 					       DBusError       *error,
 					       int              first_arg_type,
@@ -215,6 +256,9 @@ dbus_bool_t dbus_message_iter_has_next         (DBusMessageIter *iter);
 DBUS_EXPORT
 dbus_bool_t dbus_message_iter_next             (DBusMessageIter *iter);
 DBUS_EXPORT
+dbus_bool_t dbus_message_iter_seek             (DBusMessageIter *iter,
+                                                int              n);
+DBUS_EXPORT
 char*       dbus_message_iter_get_signature    (DBusMessageIter *iter);
 DBUS_EXPORT
 int         dbus_message_iter_get_arg_type     (DBusMessageIter *iter);
@@ -237,6 +281,27 @@ DBUS_EXPORT
 void        dbus_message_iter_get_fixed_array  (DBusMessageIter *iter,
                                                 void            *value,
                                                 int             *n_elements);
+DBUS_EXPORT
+DBusMessageBody *dbus_message_iter_ref_fixed_array (DBusMessageIter *iter,
+                                                    void            *value,
+                                                    int             *n_elements);
+DBUS_EXPORT
+void        dbus_message_body_unref            (DBusMessageBody *body);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_get_fixed_struct_array      (DBusMessageIter  *iter,
+                                                           void             *rows,
+                                                           int               row_size,
+                                                           const int        *field_offsets,
+                                                           int               n_fields,
+                                                           int               max_rows,
+                                                           int              *n_rows);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_get_fixed_struct_array_view (DBusMessageIter  *iter,
+                                                           int               row_size,
+                                                           const int        *field_offsets,
+                                                           int               n_fields,
+                                                           const void      **rows,
+                                                           int              *n_rows);
 
 
 DBUS_EXPORT
@@ -252,6 +317,13 @@ dbus_bool_t dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
                                                   const void      *value,
                                                   int              n_elements);
 DBUS_EXPORT
+dbus_bool_t dbus_message_iter_append_fixed_array_by_reference (DBusMessageIter  *iter,
+                                                               int               element_type,
+                                                               const void       *value,
+                                                               int               n_elements,
+                                                               DBusFreeFunction  free_function,
+                                                               void             *user_data);
+DBUS_EXPORT
 dbus_bool_t dbus_message_iter_open_container     (DBusMessageIter *iter,
                                                   int              type,
                                                   const char      *contained_signature,
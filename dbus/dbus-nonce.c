@@ -134,17 +134,17 @@ int
 _dbus_accept_with_noncefile (int listen_fd, const DBusNonceFile *noncefile)
 {
   int fd;
-  DBusString nonce;
 
   _dbus_assert (noncefile != NULL);
-  _dbus_string_init (&nonce);
-  //PENDING(kdab): set better errors
-  if (_dbus_read_nonce (_dbus_noncefile_get_path(noncefile), &nonce, NULL) != TRUE)
-    return -1;
+
+  /* The nonce was kept when the file was written; nobody else is
+   * supposed to be able to change the file, so there is no need to
+   * read it back for every client.
+   */
   fd = _dbus_accept (listen_fd);
   if (_dbus_socket_is_invalid (fd))
     return fd;
-  if (do_check_nonce(fd, &nonce, NULL) != TRUE) {
+  if (do_check_nonce(fd, &noncefile->nonce, NULL) != TRUE) {
     _dbus_verbose ("nonce check failed. Closing socket.\n");
     _dbus_close_socket(fd, NULL);
     return -1;
@@ -154,27 +154,19 @@ _dbus_accept_with_noncefile (int listen_fd, const DBusNonceFile *noncefile)
 }
 
 static dbus_bool_t
-generate_and_write_nonce (const DBusString *filename, DBusError *error)
+generate_and_write_nonce (const DBusString *filename,
+                          DBusString       *nonce,
+                          DBusError        *error)
 {
-  DBusString nonce;
-  dbus_bool_t ret;
-
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  _dbus_string_init (&nonce);
-
-  if (!_dbus_generate_random_bytes (&nonce, 16))
+  if (!_dbus_generate_random_bytes (nonce, 16))
     {
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
-      _dbus_string_free (&nonce);
       return FALSE;
     }
 
-  ret = _dbus_string_save_to_file (&nonce, filename, FALSE, error);
-
-  _dbus_string_free (&nonce);
-
-  return ret;
+  return _dbus_string_save_to_file (nonce, filename, FALSE, error);
 }
 
 /**
@@ -242,6 +234,12 @@ do_noncefile_create (DBusNonceFile *noncefile,
 
     _dbus_assert (noncefile);
 
+    if (!_dbus_string_init (&noncefile->nonce))
+      {
+        dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+        return FALSE;
+      }
+
     if (!_dbus_string_init (&randomStr))
       {
         dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
@@ -270,7 +268,7 @@ do_noncefile_create (DBusNonceFile *noncefile,
           }
         if (!_dbus_string_init (&noncefile->path)
             || !_dbus_string_copy (&noncefile->dir, 0, &noncefile->path, 0)
-            || !_dbus_string_append (&noncefile->dir, "/nonce"))
+            || !_dbus_string_append (&noncefile->path, "/nonce"))
           {
             dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
             goto on_error;
@@ -296,7 +294,7 @@ do_noncefile_create (DBusNonceFile *noncefile,
 
       }
 
-    if (!generate_and_write_nonce (&noncefile->path, error))
+    if (!generate_and_write_nonce (&noncefile->path, &noncefile->nonce, error))
       {
         _DBUS_ASSERT_ERROR_IS_SET (error);
         if (use_subdir)
@@ -313,6 +311,7 @@ do_noncefile_create (DBusNonceFile *noncefile,
       _dbus_delete_directory (&noncefile->dir, NULL);
     _dbus_string_free (&noncefile->dir);
     _dbus_string_free (&noncefile->path);
+    _dbus_string_free (&noncefile->nonce);
     _dbus_string_free (&randomStr);
     return FALSE;
 }
@@ -348,6 +347,7 @@ _dbus_noncefile_delete (DBusNonceFile *noncefile,
     _dbus_delete_file (&noncefile->path, error);
     _dbus_string_free (&noncefile->dir);
     _dbus_string_free (&noncefile->path);
+    _dbus_string_free (&noncefile->nonce);
     return TRUE;
 }
 
@@ -380,9 +380,11 @@ _dbus_noncefile_delete (DBusNonceFile *noncefile,
 {
     _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
+    _dbus_delete_file (&noncefile->path, NULL);
     _dbus_delete_directory (&noncefile->dir, error);
     _dbus_string_free (&noncefile->dir);
     _dbus_string_free (&noncefile->path);
+    _dbus_string_free (&noncefile->nonce);
     return TRUE;
 }
 #endif
@@ -403,7 +405,7 @@ _dbus_noncefile_get_path (const DBusNonceFile *noncefile)
 
 /**
  * reads data from a file descriptor and checks if the received data matches
- * the data in the given noncefile.
+ * the nonce written to the given noncefile when it was created.
  *
  * @param fd the file descriptor to read the nonce from
  * @param noncefile the nonce file to check the received data against
@@ -416,7 +418,7 @@ _dbus_noncefile_check_nonce (int fd,
                              const DBusNonceFile *noncefile,
                              DBusError* error)
 {
-    return do_check_nonce (fd, _dbus_noncefile_get_path (noncefile), error);
+    return do_check_nonce (fd, &noncefile->nonce, error);
 }
 
 
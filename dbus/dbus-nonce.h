@@ -36,6 +36,7 @@ struct DBusNonceFile
 {
   DBusString path;
   DBusString dir;
+  DBusString nonce; /**< What was written to path, to check clients against */
 };
 
 // server
@@ -60,6 +60,8 @@ struct DBusObjectTree
   DBusConnection     *connection; /**< Connection this tree belongs to */
 
   DBusObjectSubtree  *root;       /**< Root of the tree ("/" node) */
+
+  DBusHashTable      *paths;      /**< Subtrees with a handler, by full path */
 };
 
 /**
@@ -78,6 +80,10 @@ struct DBusObjectSubtree
   int                                n_subtrees;          /**< Number of child nodes */
   int                                max_subtrees;        /**< Number of allocated entries in subtrees */
   unsigned int                       invoke_as_fallback : 1; /**< Whether to invoke message_function when child nodes don't handle the message */
+  char                              *path;                /**< Full path while a handler is registered; our key in the tree's paths table */
+  char                              *interfaces_xml;      /**< Interface XML set with dbus_connection_set_object_path_introspection() */
+  char                              *introspection;       /**< Cached reply of the default Introspect handler, or #NULL */
+  DBusHashTable                     *methods;             /**< For a method table: tables of #DBusObjectMethod by member, by interface */
   char                               name[1]; /**< Allocated as large as necessary */
 };
 
@@ -104,6 +110,9 @@ _dbus_object_tree_new (DBusConnection *connection)
 
   tree->refcount = 1;
   tree->connection = connection;
+  tree->paths = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (tree->paths == NULL)
+    goto oom;
   tree->root = _dbus_object_subtree_new ("/", NULL, NULL);
   if (tree->root == NULL)
     goto oom;
@@ -114,6 +123,8 @@ _dbus_object_tree_new (DBusConnection *connection)
  oom:
   if (tree)
     {
+      if (tree->paths)
+        _dbus_hash_table_unref (tree->paths);
       dbus_free (tree);
     }
 
@@ -150,6 +161,7 @@ _dbus_object_tree_unref (DBusObjectTree *tree)
     {
       _dbus_object_tree_free_all_unlocked (tree);
 
+      _dbus_hash_table_unref (tree->paths);
       dbus_free (tree);
     }
 }
@@ -159,6 +171,16 @@ _dbus_object_tree_unref (DBusObjectTree *tree)
  */
 #define VERBOSE_FIND 0
 
+/* The cached Introspect reply lists a subtree's children and
+ * interfaces, so it goes whenever one of those changes.
+ */
+static void
+invalidate_introspection (DBusObjectSubtree *subtree)
+{
+  dbus_free (subtree->introspection);
+  subtree->introspection = NULL;
+}
+
 static DBusObjectSubtree*
 find_subtree_recurse (DBusObjectSubtree  *subtree,
                       const char        **path,
@@ -301,6 +323,7 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
 		   sizeof subtree->subtrees[0]);
 	}
       subtree->subtrees[child_pos] = child;
+      invalidate_introspection (subtree);
 
       if (index_in_parent)
         *index_in_parent = child_pos;
@@ -373,6 +396,78 @@ ensure_subtree (DBusObjectTree *tree,
   return find_subtree_recurse (tree->root, path, TRUE, NULL, NULL);
 }
 
+/** Longest object path find_handler_by_path() looks up without allocating */
+#define MAX_PREFIX_LOOKUP_LEN 255
+
+/**
+ * Like find_handler(), but takes the path as a string and finds the
+ * deepest handler with hash lookups of the path and then of each of its
+ * prefixes, instead of decomposing it and descending the tree. The
+ * subtree returned differs from find_handler()'s, but the handlers
+ * found walking up from it are the same.
+ *
+ * @param tree the object tree
+ * @param path the object path
+ * @param subtree_p return location for the deepest subtree with a handler, or #NULL
+ * @param exact_match return location for whether it is at path itself
+ * @returns #FALSE if no memory
+ */
+static dbus_bool_t
+find_handler_by_path (DBusObjectTree     *tree,
+                      const char         *path,
+                      DBusObjectSubtree **subtree_p,
+                      dbus_bool_t        *exact_match)
+{
+  char prefix[MAX_PREFIX_LOOKUP_LEN + 1];
+  DBusObjectSubtree *subtree;
+  int len;
+
+  *exact_match = FALSE;
+  *subtree_p = NULL;
+
+  subtree = _dbus_hash_table_lookup_string (tree->paths, path);
+  if (subtree != NULL)
+    {
+      *exact_match = TRUE;
+      *subtree_p = subtree;
+      return TRUE;
+    }
+
+  len = strlen (path);
+  if (len > MAX_PREFIX_LOOKUP_LEN)
+    {
+      char **decomposed;
+
+      if (!_dbus_decompose_path (path, len, &decomposed, NULL))
+        return FALSE;
+
+      *subtree_p = find_handler (tree, (const char **) decomposed, exact_match);
+      dbus_free_string_array (decomposed);
+      return TRUE;
+    }
+
+  memcpy (prefix, path, len + 1);
+
+  /* Chop off one component at a time, "/foo/bar" -> "/foo" -> "/" */
+  while (len > 1)
+    {
+      do
+        --len;
+      while (prefix[len] != '/');
+
+      prefix[len == 0 ? 1 : len] = '\0';
+
+      subtree = _dbus_hash_table_lookup_string (tree->paths, prefix);
+      if (subtree != NULL)
+        {
+          *subtree_p = subtree;
+          return TRUE;
+        }
+    }
+
+  return TRUE;
+}
+
 static char *flatten_path (const char **path);
 
 /**
@@ -396,6 +491,7 @@ _dbus_object_tree_register (DBusObjectTree              *tree,
                             DBusError                   *error)
 {
   DBusObjectSubtree  *subtree;
+  char               *flat;
 
   _dbus_assert (tree != NULL);
   _dbus_assert (vtable->message_function != NULL);
@@ -425,6 +521,21 @@ _dbus_object_tree_register (DBusObjectTree              *tree,
       return FALSE;
     }
 
+  flat = flatten_path (path);
+  if (flat == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_hash_table_insert_string (tree->paths, flat, subtree))
+    {
+      dbus_free (flat);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  subtree->path = flat;
   subtree->message_function = vtable->message_function;
   subtree->unregister_function = vtable->unregister_function;
   subtree->user_data = user_data;
@@ -433,6 +544,132 @@ _dbus_object_tree_register (DBusObjectTree              *tree,
   return TRUE;
 }
 
+/* Stands in for the message function of a path registered with a
+ * method table, so that it counts as registered everywhere else;
+ * dispatch looks the method up in the table instead of calling this.
+ */
+static DBusHandlerResult
+method_table_message_function (DBusConnection *connection,
+                               DBusMessage    *message,
+                               void           *user_data)
+{
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* The hash table calls this with NULL for a new entry, which
+ * _dbus_hash_table_unref() doesn't take
+ */
+static void
+free_members (void *data)
+{
+  if (data != NULL)
+    _dbus_hash_table_unref (data);
+}
+
+static DBusHashTable*
+build_method_table (const DBusObjectMethod *methods,
+                    DBusError              *error)
+{
+  DBusHashTable *interfaces;
+  const DBusObjectMethod *method;
+
+  interfaces = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, free_members);
+  if (interfaces == NULL)
+    goto oom;
+
+  for (method = methods; method->interface != NULL; method++)
+    {
+      DBusHashTable *members;
+
+      members = _dbus_hash_table_lookup_string (interfaces, method->interface);
+      if (members == NULL)
+        {
+          members = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+          if (members == NULL)
+            goto oom;
+
+          if (!_dbus_hash_table_insert_string (interfaces,
+                                               (char *) method->interface,
+                                               members))
+            {
+              _dbus_hash_table_unref (members);
+              goto oom;
+            }
+        }
+
+      if (_dbus_hash_table_lookup_string (members, method->member) != NULL)
+        {
+          dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                          "Method %s.%s is in the table twice",
+                          method->interface, method->member);
+          _dbus_hash_table_unref (interfaces);
+          return NULL;
+        }
+
+      if (!_dbus_hash_table_insert_string (members, (char *) method->member,
+                                           (void *) method))
+        goto oom;
+    }
+
+  return interfaces;
+
+ oom:
+  if (interfaces != NULL)
+    _dbus_hash_table_unref (interfaces);
+  _DBUS_SET_OOM (error);
+  return NULL;
+}
+
+/**
+ * Registers a method table at a path in the object tree. Calls to
+ * the path are looked up in the table by interface and member, see
+ * dbus_connection_register_object_interfaces().
+ *
+ * @param tree the global object tree
+ * @param path NULL-terminated array of path elements giving path to subtree
+ * @param methods the table, ending with an entry whose interface is #NULL
+ * @param unregister_function function called on unregister, or #NULL
+ * @param user_data user data to pass to the method functions
+ * @param error address where an error can be returned
+ * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY,
+ *    #DBUS_ERROR_OBJECT_PATH_IN_USE or #DBUS_ERROR_INVALID_ARGS) is reported
+ */
+dbus_bool_t
+_dbus_object_tree_register_methods (DBusObjectTree                    *tree,
+                                    const char                       **path,
+                                    const DBusObjectMethod            *methods,
+                                    DBusObjectPathUnregisterFunction   unregister_function,
+                                    void                              *user_data,
+                                    DBusError                         *error)
+{
+  DBusObjectPathVTable vtable;
+  DBusObjectSubtree *subtree;
+  DBusHashTable *table;
+
+  _dbus_assert (methods != NULL);
+
+  table = build_method_table (methods, error);
+  if (table == NULL)
+    return FALSE;
+
+  _DBUS_ZERO (vtable);
+  vtable.unregister_function = unregister_function;
+  vtable.message_function = method_table_message_function;
+
+  if (!_dbus_object_tree_register (tree, FALSE, path, &vtable, user_data,
+                                   error))
+    {
+      _dbus_hash_table_unref (table);
+      return FALSE;
+    }
+
+  subtree = lookup_subtree (tree, path);
+  _dbus_assert (subtree != NULL && subtree->methods == NULL);
+  subtree->methods = table;
+
+  return TRUE;
+}
+
 /**
  * Unregisters an object subtree that was registered with the
  * same path.
@@ -474,6 +711,20 @@ _dbus_object_tree_unregister_and_unlock (DBusObjectTree          *tree,
 
   subtree->message_function = NULL;
 
+  if (subtree->methods != NULL)
+    {
+      _dbus_hash_table_unref (subtree->methods);
+      subtree->methods = NULL;
+    }
+
+  _dbus_hash_table_remove_string (tree->paths, subtree->path);
+  dbus_free (subtree->path);
+  subtree->path = NULL;
+
+  dbus_free (subtree->interfaces_xml);
+  subtree->interfaces_xml = NULL;
+  invalidate_introspection (subtree);
+
   unregister_function = subtree->unregister_function;
   user_data = subtree->user_data;
 
@@ -492,6 +743,7 @@ _dbus_object_tree_unregister_and_unlock (DBusObjectTree          *tree,
                (subtree->parent->n_subtrees - i - 1) *
                sizeof (subtree->parent->subtrees[0]));
       subtree->parent->n_subtrees -= 1;
+      invalidate_introspection (subtree->parent);
 
       subtree->parent = NULL;
 
@@ -548,6 +800,14 @@ free_subtree_recurse (DBusConnection    *connection,
   subtree->message_function = NULL;
   subtree->unregister_function = NULL;
   subtree->user_data = NULL;
+  dbus_free (subtree->path);
+  subtree->path = NULL;
+
+  if (subtree->methods != NULL)
+    {
+      _dbus_hash_table_unref (subtree->methods);
+      subtree->methods = NULL;
+    }
 
   /* Now free ourselves */
   _dbus_object_subtree_unref (subtree);
@@ -562,6 +822,8 @@ free_subtree_recurse (DBusConnection    *connection,
 void
 _dbus_object_tree_free_all_unlocked (DBusObjectTree *tree)
 {
+  _dbus_hash_table_remove_all (tree->paths);
+
   if (tree->root)
     free_subtree_recurse (tree->connection,
                           tree->root);
@@ -612,15 +874,83 @@ _dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
   return retval != NULL;
 }
 
+static dbus_bool_t
+append_introspection (DBusObjectSubtree *subtree,
+                      DBusString        *xml)
+{
+  int i;
+
+  if (!_dbus_string_append (xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
+    return FALSE;
+  
+  if (!_dbus_string_append (xml, "<node>\n"))
+    return FALSE;
+
+  if (subtree != NULL)
+    {
+      if (subtree->interfaces_xml != NULL &&
+          !_dbus_string_append (xml, subtree->interfaces_xml))
+        return FALSE;
+
+      i = 0;
+      while (i < subtree->n_subtrees)
+        {
+          if (!_dbus_string_append_printf (xml, "  <node name=\"%s\"/>\n",
+                                           subtree->subtrees[i]->name))
+            return FALSE;
+
+          ++i;
+        }
+    }
+
+  if (!_dbus_string_append (xml, "</node>\n"))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * Appends the default Introspect() reply for a path, reusing the one
+ * built last time if nothing under the path has changed since.
+ *
+ * @param tree the object tree
+ * @param path the path being introspected
+ * @param xml string to append the XML to
+ * @returns #FALSE if no memory
+ */
+static dbus_bool_t
+get_introspection_unlocked (DBusObjectTree *tree,
+                            const char    **path,
+                            DBusString     *xml)
+{
+  DBusObjectSubtree *subtree;
+  int start;
+
+  subtree = lookup_subtree (tree, path);
+
+  if (subtree != NULL && subtree->introspection != NULL)
+    return _dbus_string_append (xml, subtree->introspection);
+
+  start = _dbus_string_get_length (xml);
+  if (!append_introspection (subtree, xml))
+    return FALSE;
+
+  /* Failing to cache it isn't an error */
+  if (subtree != NULL &&
+      _dbus_string_copy_data_len (xml, &subtree->introspection, start,
+                                  _dbus_string_get_length (xml) - start))
+    _dbus_verbose (" cached Introspect() reply\n");
+
+  return TRUE;
+}
+
 static DBusHandlerResult
 handle_default_introspect_and_unlock (DBusObjectTree          *tree,
-                                      DBusMessage             *message,
-                                      const char             **path)
+                                      DBusMessage             *message)
 {
   DBusString xml;
   DBusHandlerResult result;
-  char **children;
-  int i;
+  char **path;
   DBusMessage *reply;
   DBusMessageIter iter;
   const char *v_STRING;
@@ -666,27 +996,12 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
 
   result = DBUS_HANDLER_RESULT_NEED_MEMORY;
 
-  children = NULL;
-  if (!_dbus_object_tree_list_registered_unlocked (tree, path, &children))
-    goto out;
-
-  if (!_dbus_string_append (&xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
-    goto out;
-  
-  if (!_dbus_string_append (&xml, "<node>\n"))
+  path = NULL;
+  if (!dbus_message_get_path_decomposed (message, &path))
     goto out;
+  _dbus_assert (path != NULL);
 
-  i = 0;
-  while (children[i] != NULL)
-    {
-      if (!_dbus_string_append_printf (&xml, "  <node name=\"%s\"/>\n",
-                                       children[i]))
-        goto out;
-
-      ++i;
-    }
-
-  if (!_dbus_string_append (&xml, "</node>\n"))
+  if (!get_introspection_unlocked (tree, (const char**) path, &xml))
     goto out;
 
   reply = dbus_message_new_method_return (message);
@@ -723,13 +1038,142 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
     }
   
   _dbus_string_free (&xml);
-  dbus_free_string_array (children);
+  dbus_free_string_array (path);
   if (reply)
     dbus_message_unref (reply);
   
   return result;
 }
 
+/* Finds the method a call is for. A call without an interface may be
+ * for a method of that name on any interface in the table. Sets
+ * *known_interface if the table has the call's interface.
+ */
+static const DBusObjectMethod*
+find_method (DBusObjectSubtree *subtree,
+             DBusMessage       *message,
+             dbus_bool_t       *known_interface)
+{
+  const char *interface;
+  const char *member;
+  DBusHashTable *members;
+  DBusHashIter iter;
+
+  interface = dbus_message_get_interface (message);
+  member = dbus_message_get_member (message);
+
+  *known_interface = FALSE;
+
+  if (interface != NULL)
+    {
+      members = _dbus_hash_table_lookup_string (subtree->methods, interface);
+      if (members == NULL)
+        return NULL;
+
+      *known_interface = TRUE;
+      return _dbus_hash_table_lookup_string (members, member);
+    }
+
+  _dbus_hash_iter_init (subtree->methods, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      const DBusObjectMethod *method;
+
+      members = _dbus_hash_iter_get_value (&iter);
+      method = _dbus_hash_table_lookup_string (members, member);
+      if (method != NULL)
+        return method;
+    }
+
+  return NULL;
+}
+
+/* Hands a call to a path registered with a method table to the
+ * function for its method, or replies with an error itself if the
+ * table has the interface but not the method, or the arguments are
+ * wrong. Calls on other interfaces are left to the other handlers.
+ * Called and returns with the connection lock held.
+ */
+static DBusHandlerResult
+dispatch_method_table_unlocked (DBusObjectTree    *tree,
+                                DBusObjectSubtree *subtree,
+                                DBusMessage       *message)
+{
+  const DBusObjectMethod *method;
+  dbus_bool_t known_interface;
+  DBusHandlerResult result;
+  DBusMessage *reply;
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  method = find_method (subtree, message, &known_interface);
+  if (method == NULL && !known_interface)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (method != NULL &&
+      (method->signature == NULL ||
+       dbus_message_has_signature (message, method->signature)))
+    {
+      DBusObjectPathMessageFunction function;
+      void *user_data;
+
+      function = method->function;
+      user_data = subtree->user_data;
+
+#ifdef DBUS_BUILD_TESTS
+      if (tree->connection)
+#endif
+        {
+          _dbus_verbose ("unlock\n");
+          _dbus_connection_unlock (tree->connection);
+        }
+
+      result = (* function) (tree->connection, message, user_data);
+
+#ifdef DBUS_BUILD_TESTS
+      if (tree->connection)
+#endif
+        _dbus_connection_lock (tree->connection);
+
+      return result;
+    }
+
+  if (dbus_message_get_no_reply (message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  if (method == NULL)
+    reply = dbus_message_new_error_printf (message, DBUS_ERROR_UNKNOWN_METHOD,
+                                           "No method %s.%s on object %s",
+                                           dbus_message_get_interface (message),
+                                           dbus_message_get_member (message),
+                                           dbus_message_get_path (message));
+  else
+    reply = dbus_message_new_error_printf (message, DBUS_ERROR_INVALID_ARGS,
+                                           "Call to %s.%s has signature \"%s\" but should have \"%s\"",
+                                           method->interface, method->member,
+                                           dbus_message_get_signature (message),
+                                           method->signature);
+  if (reply == NULL)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  result = DBUS_HANDLER_RESULT_HANDLED;
+
+#ifdef DBUS_BUILD_TESTS
+  if (tree->connection)
+#endif
+    {
+      if (!_dbus_connection_send_and_unlock (tree->connection, reply, NULL))
+        result = DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+      _dbus_connection_lock (tree->connection);
+    }
+
+  dbus_message_unref (reply);
+
+  return result;
+}
+
 /**
  * Tries to dispatch a message by directing it to handler for the
  * object path listed in the message header, if any. Messages are
@@ -747,7 +1191,7 @@ DBusHandlerResult
 _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
                                        DBusMessage             *message)
 {
-  char **path;
+  const char *path;
   dbus_bool_t exact_match;
   DBusList *list;
   DBusList *link;
@@ -758,8 +1202,8 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
   _dbus_verbose ("Dispatch of message by object path\n");
 #endif
   
-  path = NULL;
-  if (!dbus_message_get_path_decomposed (message, &path))
+  path = dbus_message_get_path (message);
+  if (path == NULL)
     {
 #ifdef DBUS_BUILD_TESTS
       if (tree->connection)
@@ -769,12 +1213,12 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
           _dbus_connection_unlock (tree->connection);
         }
       
-      _dbus_verbose ("No memory to get decomposed path\n");
-
-      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+      _dbus_verbose ("No path field in message\n");
+      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
     }
-
-  if (path == NULL)
+  
+  /* Find the deepest path that covers the path in the message */
+  if (!find_handler_by_path (tree, path, &subtree, &exact_match))
     {
 #ifdef DBUS_BUILD_TESTS
       if (tree->connection)
@@ -783,14 +1227,12 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
           _dbus_verbose ("unlock\n");
           _dbus_connection_unlock (tree->connection);
         }
-      
-      _dbus_verbose ("No path field in message\n");
-      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+      _dbus_verbose ("No memory to get decomposed path\n");
+
+      return DBUS_HANDLER_RESULT_NEED_MEMORY;
     }
   
-  /* Find the deepest path that covers the path in the message */
-  subtree = find_handler (tree, (const char**) path, &exact_match);
-  
   /* Build a list of all paths that cover the path in the message */
 
   list = NULL;
@@ -830,7 +1272,14 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
       /* message_function is NULL if we're unregistered
        * due to reentrancy
        */
-      if (subtree->message_function)
+      if (subtree->message_function && subtree->methods != NULL)
+        {
+          result = dispatch_method_table_unlocked (tree, subtree, message);
+
+          if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
+            goto free_and_return;
+        }
+      else if (subtree->message_function)
         {
           DBusObjectPathMessageFunction message_function;
           void *user_data;
@@ -877,8 +1326,7 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
     {
       /* This hardcoded default handler does a minimal Introspect()
        */
-      result = handle_default_introspect_and_unlock (tree, message,
-                                                     (const char**) path);
+      result = handle_default_introspect_and_unlock (tree, message);
     }
   else
     {
@@ -897,8 +1345,6 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
       _dbus_object_subtree_unref (link->data);
       _dbus_list_remove_link (&list, link);
     }
-  
-  dbus_free_string_array (path);
 
   return result;
 }
@@ -933,6 +1379,86 @@ _dbus_object_tree_get_user_data_unlocked (DBusObjectTree *tree,
   return subtree->user_data;
 }
 
+/**
+ * Lists the full path of every registered handler, object paths and
+ * fallbacks alike, in no particular order.
+ *
+ * @param tree the global object tree
+ * @param paths_p returns #NULL-terminated array of paths
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_object_tree_list_paths_unlocked (DBusObjectTree *tree,
+                                       char         ***paths_p)
+{
+  DBusHashIter iter;
+  char **paths;
+  int i;
+
+  paths = dbus_new0 (char *, _dbus_hash_table_get_n_entries (tree->paths) + 1);
+  if (paths == NULL)
+    return FALSE;
+
+  i = 0;
+  _dbus_hash_iter_init (tree->paths, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      paths[i] = _dbus_strdup (_dbus_hash_iter_get_string_key (&iter));
+      if (paths[i] == NULL)
+        {
+          dbus_free_string_array (paths);
+          return FALSE;
+        }
+      ++i;
+    }
+
+  *paths_p = paths;
+  return TRUE;
+}
+
+/**
+ * Sets the interface XML the default Introspect() handler includes
+ * for the handler registered at the given path, replacing any set
+ * before. It's dropped when the handler is unregistered.
+ *
+ * @param tree the global object tree
+ * @param path the path the handler was registered at
+ * @param interfaces_xml the XML, or #NULL to remove it
+ * @returns #FALSE if no memory or no handler is registered at path
+ */
+dbus_bool_t
+_dbus_object_tree_set_introspection_unlocked (DBusObjectTree *tree,
+                                              const char     *path,
+                                              const char     *interfaces_xml)
+{
+  DBusObjectSubtree *subtree;
+  char *copy;
+
+  _dbus_assert (tree != NULL);
+  _dbus_assert (path != NULL);
+
+  subtree = _dbus_hash_table_lookup_string (tree->paths, path);
+  if (subtree == NULL)
+    {
+      _dbus_verbose ("No object at specified path found\n");
+      return FALSE;
+    }
+
+  copy = NULL;
+  if (interfaces_xml != NULL)
+    {
+      copy = _dbus_strdup (interfaces_xml);
+      if (copy == NULL)
+        return FALSE;
+    }
+
+  dbus_free (subtree->interfaces_xml);
+  subtree->interfaces_xml = copy;
+  invalidate_introspection (subtree);
+
+  return TRUE;
+}
+
 /**
  * Allocates a subtree object.
  *
@@ -992,6 +1518,10 @@ _dbus_object_subtree_new (const char                  *name,
   subtree->n_subtrees = 0;
   subtree->max_subtrees = 0;
   subtree->invoke_as_fallback = FALSE;
+  subtree->path = NULL;
+  subtree->interfaces_xml = NULL;
+  subtree->introspection = NULL;
+  subtree->methods = NULL;
 
   return subtree;
 
@@ -1017,7 +1547,10 @@ _dbus_object_subtree_unref (DBusObjectSubtree *subtree)
     {
       _dbus_assert (subtree->unregister_function == NULL);
       _dbus_assert (subtree->message_function == NULL);
+      _dbus_assert (subtree->methods == NULL);
 
+      dbus_free (subtree->interfaces_xml);
+      dbus_free (subtree->introspection);
       dbus_free (subtree->subtrees);
       dbus_free (subtree);
     }
@@ -1506,6 +2039,17 @@ object_tree_test_iteration (void *data)
   const char *path6[] = { "blah", "boof", NULL };
   const char *path7[] = { "blah", "boof", "this", "is", "really", "long", NULL };
   const char *path8[] = { "childless", NULL };
+  const char *path9[] = { "foo", "bar", "baz", "unregistered", NULL };
+  const char *path10[] = { "blah", "boof", "unregistered", NULL };
+  /* too long to look up without decomposing it */
+  const char *path11[] = { "blah", "boof", "this", "is", "really", "long",
+                           "and", "then", "it", "goes", "on",
+                           "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+                           "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb",
+                           "cccccccccccccccccccccccccccccccccccccccccccccccccc",
+                           "dddddddddddddddddddddddddddddddddddddddddddddddddd",
+                           "eeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeee",
+                           NULL };
   DBusObjectTree *tree;
   TreeTestData tree_test_data[9];
   int i;
@@ -1716,6 +2260,61 @@ object_tree_test_iteration (void *data)
       }
   }
 
+  /* test the default Introspect() reply and its cache */
+
+  {
+    DBusString xml;
+    const char *data;
+
+    if (!_dbus_string_init (&xml))
+      goto out;
+
+    if (!get_introspection_unlocked (tree, path2, &xml))
+      {
+        _dbus_string_free (&xml);
+        goto out;
+      }
+    data = _dbus_string_get_const_data (&xml);
+    _dbus_assert (strstr (data, "<node name=\"baz\"/>") != NULL);
+    _dbus_assert (strstr (data, "<node name=\"boo\"/>") != NULL);
+    _dbus_assert (strstr (data, "<interface") == NULL);
+
+    /* a second call gives the same reply, from the cache if it made it */
+    _dbus_string_set_length (&xml, 0);
+    if (!get_introspection_unlocked (tree, path2, &xml))
+      {
+        _dbus_string_free (&xml);
+        goto out;
+      }
+    _dbus_assert (find_subtree (tree, path2, NULL)->introspection == NULL ||
+                  strcmp (find_subtree (tree, path2, NULL)->introspection,
+                          _dbus_string_get_const_data (&xml)) == 0);
+
+    _dbus_assert (!_dbus_object_tree_set_introspection_unlocked (tree, "/foo/bar/nothing",
+                                                                  "<interface name=\"a.B\"/>\n"));
+
+    if (!_dbus_object_tree_set_introspection_unlocked (tree, "/foo/bar",
+                                                       "  <interface name=\"org.freedesktop.TestInterface\"/>\n"))
+      {
+        _dbus_string_free (&xml);
+        goto out;
+      }
+
+    /* setting the interfaces drops the cached reply */
+    _dbus_string_set_length (&xml, 0);
+    if (!get_introspection_unlocked (tree, path2, &xml))
+      {
+        _dbus_string_free (&xml);
+        goto out;
+      }
+    data = _dbus_string_get_const_data (&xml);
+    _dbus_assert (strstr (data, "  <interface name=\"org.freedesktop.TestInterface\"/>\n"
+                                "  <node name=\"baz\"/>\n") != NULL);
+    _dbus_assert (strstr (data, "<node name=\"boo\"/>") != NULL);
+
+    _dbus_string_free (&xml);
+  }
+
   /* Check that destroying tree calls unregister funcs */
   _dbus_object_tree_unref (tree);
 
@@ -1919,6 +2518,14 @@ object_tree_test_iteration (void *data)
     goto out;
   if (!do_test_dispatch (tree, path8, 8, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
     goto out;
+
+  /* Paths below a handler go to the fallbacks above them */
+  if (!do_test_dispatch (tree, path9, 3, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
+    goto out;
+  if (!do_test_dispatch (tree, path10, 5, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
+    goto out;
+  if (!do_test_dispatch (tree, path11, 7, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
+    goto out;
   
  out:
   if (tree)
@@ -1932,6 +2539,132 @@ object_tree_test_iteration (void *data)
   return TRUE;
 }
 
+static DBusHandlerResult
+method_table_test_function (DBusConnection *connection,
+                            DBusMessage    *message,
+                            void           *user_data)
+{
+  const char **called = user_data;
+
+  *called = dbus_message_get_member (message);
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectMethod method_table_test_methods[] = {
+  { "org.freedesktop.TestA", "Ping", "s", method_table_test_function },
+  { "org.freedesktop.TestA", "Pong", NULL, method_table_test_function },
+  { "org.freedesktop.TestB", "Echo", "", method_table_test_function },
+  { NULL, NULL, NULL, NULL }
+};
+
+static const DBusObjectMethod method_table_test_twice[] = {
+  { "org.freedesktop.TestA", "Ping", "s", method_table_test_function },
+  { "org.freedesktop.TestA", "Ping", "", method_table_test_function },
+  { NULL, NULL, NULL, NULL }
+};
+
+/* Dispatches a call to /m. Sets *called to the member of the method
+ * that handled it, "" if the tree handled it without one, or #NULL if
+ * nothing did. Returns #FALSE if there was no memory.
+ */
+static dbus_bool_t
+method_table_test_dispatch (DBusObjectTree  *tree,
+                            const char      *interface,
+                            const char      *member,
+                            const char      *arg,
+                            const char     **called)
+{
+  DBusMessage *message;
+  DBusHandlerResult result;
+
+  message = dbus_message_new_method_call (NULL, "/m", interface, member);
+  if (message == NULL)
+    return FALSE;
+
+  /* As if it had been received, so that it can be replied to */
+  dbus_message_set_serial (message, 1);
+
+  if (arg != NULL &&
+      !dbus_message_append_args (message, DBUS_TYPE_STRING, &arg,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  *called = NULL;
+  result = _dbus_object_tree_dispatch_and_unlock (tree, message);
+  dbus_message_unref (message);
+
+  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+    return FALSE;
+
+  if (result == DBUS_HANDLER_RESULT_HANDLED && *called == NULL)
+    *called = "";
+
+  return TRUE;
+}
+
+static dbus_bool_t
+method_table_test_iteration (void *data)
+{
+  const char *path[] = { "m", NULL };
+  DBusObjectTree *tree;
+  DBusError error;
+  const char *called;
+
+  dbus_error_init (&error);
+
+  tree = _dbus_object_tree_new (NULL);
+  if (tree == NULL)
+    return TRUE;
+
+  if (_dbus_object_tree_register_methods (tree, path, method_table_test_twice,
+                                          NULL, &called, &error))
+    _dbus_assert_not_reached ("registered a method twice");
+  if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+    goto out;
+  _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_INVALID_ARGS));
+  dbus_error_free (&error);
+
+  if (!_dbus_object_tree_register_methods (tree, path, method_table_test_methods,
+                                           NULL, &called, &error))
+    goto out;
+
+  if (!method_table_test_dispatch (tree, "org.freedesktop.TestA", "Ping",
+                                   "x", &called))
+    goto out;
+  _dbus_assert (called != NULL && strcmp (called, "Ping") == 0);
+
+  /* Calls without an interface find the method by name */
+  if (!method_table_test_dispatch (tree, NULL, "Echo", NULL, &called))
+    goto out;
+  _dbus_assert (called != NULL && strcmp (called, "Echo") == 0);
+
+  /* Wrong arguments and missing methods get an error from the tree */
+  if (!method_table_test_dispatch (tree, "org.freedesktop.TestA", "Ping",
+                                   NULL, &called))
+    goto out;
+  _dbus_assert (called != NULL && strcmp (called, "") == 0);
+
+  if (!method_table_test_dispatch (tree, "org.freedesktop.TestA", "Nope",
+                                   NULL, &called))
+    goto out;
+  _dbus_assert (called != NULL && strcmp (called, "") == 0);
+
+  /* Other interfaces are left to the other handlers */
+  if (!method_table_test_dispatch (tree, "org.freedesktop.TestC", "Ping",
+                                   "x", &called))
+    goto out;
+  _dbus_assert (called == NULL);
+
+ out:
+  dbus_error_free (&error);
+  _dbus_object_tree_unref (tree);
+
+  return TRUE;
+}
+
 /**
  * @ingroup DBusObjectTree
  * Unit test for DBusObjectTree
@@ -1944,6 +2677,10 @@ _dbus_object_tree_test (void)
                            object_tree_test_iteration,
                            NULL);
 
+  _dbus_test_oom_handling ("object tree method tables",
+                           method_table_test_iteration,
+                           NULL);
+
   return TRUE;
 }
 
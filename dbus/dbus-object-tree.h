@@ -39,12 +39,23 @@ dbus_bool_t       _dbus_object_tree_register               (DBusObjectTree
                                                             const DBusObjectPathVTable  *vtable,
                                                             void                        *user_data,
                                                             DBusError                   *error);
+dbus_bool_t       _dbus_object_tree_register_methods       (DBusObjectTree              *tree,
+                                                            const char                 **path,
+                                                            const DBusObjectMethod      *methods,
+                                                            DBusObjectPathUnregisterFunction unregister_function,
+                                                            void                        *user_data,
+                                                            DBusError                   *error);
 void              _dbus_object_tree_unregister_and_unlock  (DBusObjectTree              *tree,
                                                             const char                 **path);
 DBusHandlerResult _dbus_object_tree_dispatch_and_unlock    (DBusObjectTree              *tree,
                                                             DBusMessage                 *message);
 void*             _dbus_object_tree_get_user_data_unlocked (DBusObjectTree              *tree,
                                                             const char                 **path);
+dbus_bool_t       _dbus_object_tree_list_paths_unlocked    (DBusObjectTree              *tree,
+                                                            char                      ***paths_p);
+dbus_bool_t       _dbus_object_tree_set_introspection_unlocked (DBusObjectTree          *tree,
+                                                                const char              *path,
+                                                                const char              *interfaces_xml);
 void              _dbus_object_tree_free_all_unlocked      (DBusObjectTree              *tree);
 
 
@@ -27,6 +27,7 @@
 #include "dbus-pending-call-internal.h"
 #include "dbus-pending-call.h"
 #include "dbus-list.h"
+#include "dbus-message-internal.h"
 #include "dbus-threads.h"
 #include "dbus-test.h"
 
@@ -65,72 +66,61 @@ struct DBusPendingCall
   DBusDataSlotList slot_list;                     /**< Data stored by allocated integer ID */
   
   DBusPendingCallNotifyFunction function;         /**< Notifier when reply arrives. */
+  void *notify_user_data;                         /**< Data passed to the notifier */
+  DBusFreeFunction free_notify_user_data;         /**< Frees notify_user_data */
 
   DBusConnection *connection;                     /**< Connections we're associated with */
   DBusMessage *reply;                             /**< Reply (after we've received it) */
-  DBusTimeout *timeout;                           /**< Timeout */
+  int timeout_milliseconds;                       /**< Reply timeout, -1 for none */
+  int timer_index;                                /**< Position in the connection's pending call timer, -1 if not in it */
 
-  DBusList *timeout_link;                         /**< Preallocated timeout response */
+  DBusMessage *timeout_reply;                     /**< Preallocated timeout response */
+
+  DBusCondVar *reply_cond;                        /**< Created on demand for a thread waiting on the connection's I/O path */
   
   dbus_uint32_t reply_serial;                     /**< Expected serial of reply */
 
   unsigned int completed : 1;                     /**< TRUE if completed */
-  unsigned int timeout_added : 1;                 /**< Have added the timeout */
 };
 
-static dbus_int32_t notify_user_data_slot = -1;
-
 /**
  * Creates a new pending reply object.
  *
  * @param connection connection where reply will arrive
  * @param timeout_milliseconds length of timeout, -1 for default, INT_MAX for no timeout
- * @param timeout_handler timeout handler, takes pending call as data
  * @returns a new #DBusPendingCall or #NULL if no memory.
  */
 DBusPendingCall*
 _dbus_pending_call_new_unlocked (DBusConnection    *connection,
-                                 int                timeout_milliseconds,
-                                 DBusTimeoutHandler timeout_handler)
+                                 int                timeout_milliseconds)
 {
   DBusPendingCall *pending;
-  DBusTimeout *timeout;
 
   _dbus_assert (timeout_milliseconds >= 0 || timeout_milliseconds == -1);
  
   if (timeout_milliseconds == -1)
     timeout_milliseconds = _DBUS_DEFAULT_TIMEOUT_VALUE;
 
-  if (!dbus_pending_call_allocate_data_slot (&notify_user_data_slot))
-    return NULL;
-  
-  pending = dbus_new0 (DBusPendingCall, 1);
-  
-  if (pending == NULL)
+  pending = _dbus_connection_take_cached_pending_call_unlocked (connection);
+
+  if (pending != NULL)
+    _DBUS_ZERO (*pending);
+  else
     {
-      dbus_pending_call_free_data_slot (&notify_user_data_slot);
-      return NULL;
+      pending = dbus_new0 (DBusPendingCall, 1);
+      if (pending == NULL)
+        return NULL;
     }
 
+  /* The connection keeps the deadline; see
+   * _dbus_connection_attach_pending_call_unlocked()
+   */
   if (timeout_milliseconds != _DBUS_INT_MAX)
-    {
-      timeout = _dbus_timeout_new (timeout_milliseconds,
-                                   timeout_handler,
-                                   pending, NULL);  
-
-      if (timeout == NULL)
-        {
-          dbus_pending_call_free_data_slot (&notify_user_data_slot);
-          dbus_free (pending);
-          return NULL;
-        }
-
-      pending->timeout = timeout;
-    }
+    pending->timeout_milliseconds = timeout_milliseconds;
   else
-    {
-      pending->timeout = NULL;
-    }
+    pending->timeout_milliseconds = -1;
+
+  pending->timer_index = -1;
 
   _dbus_atomic_inc (&pending->refcount);
   pending->connection = connection;
@@ -155,8 +145,8 @@ _dbus_pending_call_set_reply_unlocked (DBusPendingCall *pending,
 {
   if (message == NULL)
     {
-      message = pending->timeout_link->data;
-      _dbus_list_clear (&pending->timeout_link);
+      message = pending->timeout_reply;
+      pending->timeout_reply = NULL;
     }
   else
     dbus_message_ref (message);
@@ -189,13 +179,7 @@ _dbus_pending_call_complete (DBusPendingCall *pending)
   pending->completed = TRUE;
 
   if (pending->function)
-    {
-      void *user_data;
-      user_data = dbus_pending_call_get_data (pending,
-                                              notify_user_data_slot);
-      
-      (* pending->function) (pending, user_data);
-    }
+    (* pending->function) (pending, pending->notify_user_data);
 }
 
 /**
@@ -211,57 +195,57 @@ _dbus_pending_call_queue_timeout_error_unlocked (DBusPendingCall *pending,
 {
   _dbus_assert (connection == pending->connection);
   
-  if (pending->timeout_link)
+  if (pending->timeout_reply)
     {
-      _dbus_connection_queue_synthesized_message_link (connection,
-						       pending->timeout_link);
-      pending->timeout_link = NULL;
+      DBusList *link = _dbus_message_get_queue_link (pending->timeout_reply);
+
+      _dbus_connection_queue_synthesized_message_link (connection, link);
+      pending->timeout_reply = NULL;
     }
 }
 
 /**
- * Checks to see if a timeout has been added
+ * Gets the reply timeout given when the call was created.
  *
  * @param pending the pending_call
- * @returns #TRUE if there is a timeout or #FALSE if not
+ * @returns the timeout in milliseconds, or -1 if the call never times out
  */
-dbus_bool_t 
-_dbus_pending_call_is_timeout_added_unlocked (DBusPendingCall  *pending)
+int
+_dbus_pending_call_get_timeout_unlocked (DBusPendingCall  *pending)
 {
   _dbus_assert (pending != NULL);
 
-  return pending->timeout_added;
+  return pending->timeout_milliseconds;
 }
 
-
 /**
- * Sets wether the timeout has been added
+ * Gets the call's position in its connection's timer, which only
+ * the connection uses.
  *
  * @param pending the pending_call
- * @param is_added whether or not a timeout is added
+ * @returns the index, or -1 if the call's deadline is not queued
  */
-void
-_dbus_pending_call_set_timeout_added_unlocked (DBusPendingCall  *pending,
-                                               dbus_bool_t       is_added)
+int
+_dbus_pending_call_get_timer_index_unlocked (DBusPendingCall  *pending)
 {
   _dbus_assert (pending != NULL);
 
-  pending->timeout_added = is_added;
+  return pending->timer_index;
 }
 
-
 /**
- * Retrives the timeout
+ * Records the call's position in its connection's timer.
  *
  * @param pending the pending_call
- * @returns a timeout object or NULL if call has no timeout
+ * @param index the new index, or -1 once the deadline is dequeued
  */
-DBusTimeout *
-_dbus_pending_call_get_timeout_unlocked (DBusPendingCall  *pending)
+void
+_dbus_pending_call_set_timer_index_unlocked (DBusPendingCall  *pending,
+                                             int               index)
 {
   _dbus_assert (pending != NULL);
 
-  return pending->timeout;
+  pending->timer_index = index;
 }
 
 /**
@@ -336,7 +320,6 @@ _dbus_pending_call_set_timeout_error_unlocked (DBusPendingCall *pending,
                                                DBusMessage     *message,
                                                dbus_uint32_t    serial)
 { 
-  DBusList *reply_link;
   DBusMessage *reply;
 
   reply = dbus_message_new_error (message, DBUS_ERROR_NO_REPLY,
@@ -348,14 +331,7 @@ _dbus_pending_call_set_timeout_error_unlocked (DBusPendingCall *pending,
   if (reply == NULL)
     return FALSE;
 
-  reply_link = _dbus_list_alloc_link (reply);
-  if (reply_link == NULL)
-    {
-      dbus_message_unref (reply);
-      return FALSE;
-    }
-
-  pending->timeout_link = reply_link;
+  pending->timeout_reply = reply;
 
   _dbus_pending_call_set_reply_serial_unlocked (pending, serial);
   
@@ -386,21 +362,20 @@ _dbus_pending_call_last_unref (DBusPendingCall *pending)
   /* If we get here, we should be already detached
    * from the connection, or never attached.
    */
-  _dbus_assert (!pending->timeout_added);  
+  _dbus_assert (pending->timer_index < 0);
 
   connection = pending->connection;
 
   /* this assumes we aren't holding connection lock... */
+  if (pending->free_notify_user_data)
+    (* pending->free_notify_user_data) (pending->notify_user_data);
+
   _dbus_data_slot_list_free (&pending->slot_list);
 
-  if (pending->timeout != NULL)
-    _dbus_timeout_unref (pending->timeout);
-      
-  if (pending->timeout_link)
+  if (pending->timeout_reply)
     {
-      dbus_message_unref ((DBusMessage *)pending->timeout_link->data);
-      _dbus_list_free_link (pending->timeout_link);
-      pending->timeout_link = NULL;
+      dbus_message_unref (pending->timeout_reply);
+      pending->timeout_reply = NULL;
     }
 
   if (pending->reply)
@@ -408,10 +383,13 @@ _dbus_pending_call_last_unref (DBusPendingCall *pending)
       dbus_message_unref (pending->reply);
       pending->reply = NULL;
     }
-      
-  dbus_free (pending);
 
-  dbus_pending_call_free_data_slot (&notify_user_data_slot);
+  if (pending->reply_cond)
+    _dbus_condvar_free (pending->reply_cond);
+
+  /* The connection can hand the memory to its next call */
+  if (!_dbus_connection_cache_pending_call (connection, pending))
+    dbus_free (pending);
 
   /* connection lock should not be held. */
   /* Free the connection last to avoid a weird state while
@@ -455,6 +433,24 @@ _dbus_pending_call_get_completed_unlocked (DBusPendingCall    *pending)
   return pending->completed;
 }
 
+/**
+ * Gets a condition variable private to this pending call, creating
+ * it the first time. A thread blocking for the reply sleeps on it
+ * so that the thread which reads the reply can wake it alone.
+ * Assumes connection lock is held.
+ *
+ * @param pending the pending call
+ * @returns the condition variable, or #NULL if no memory
+ */
+DBusCondVar*
+_dbus_pending_call_get_reply_condvar_unlocked (DBusPendingCall *pending)
+{
+  if (pending->reply_cond == NULL)
+    pending->reply_cond = _dbus_condvar_new ();
+
+  return pending->reply_cond;
+}
+
 static DBusDataSlotAllocator slot_allocator;
 _DBUS_DEFINE_GLOBAL_LOCK (pending_call_slots);
 
@@ -563,7 +559,8 @@ dbus_pending_call_unref (DBusPendingCall *pending)
  * @param function notifier function
  * @param user_data data to pass to notifier function
  * @param free_user_data function to free the user data
- * @returns #FALSE if not enough memory
+ * @returns #TRUE; the notifier is kept in the pending call itself, so
+ * setting it never runs out of memory
  */
 dbus_bool_t
 dbus_pending_call_set_notify (DBusPendingCall              *pending,
@@ -571,19 +568,26 @@ dbus_pending_call_set_notify (DBusPendingCall              *pending,
                               void                         *user_data,
                               DBusFreeFunction              free_user_data)
 {
+  void *old_user_data;
+  DBusFreeFunction old_free_user_data;
+
   _dbus_return_val_if_fail (pending != NULL, FALSE);
 
   CONNECTION_LOCK (pending->connection);
-  
-  /* could invoke application code! */
-  if (!_dbus_pending_call_set_data_unlocked (pending, notify_user_data_slot,
-                                             user_data, free_user_data))
-    return FALSE;
-  
+
+  old_user_data = pending->notify_user_data;
+  old_free_user_data = pending->free_notify_user_data;
+
   pending->function = function;
+  pending->notify_user_data = user_data;
+  pending->free_notify_user_data = free_user_data;
 
   CONNECTION_UNLOCK (pending->connection);
-  
+
+  /* could invoke application code! */
+  if (old_free_user_data)
+    (* old_free_user_data) (old_user_data);
+
   return TRUE;
 }
 
@@ -774,11 +778,10 @@ dbus_pending_call_get_data (DBusPendingCall   *pending,
 
   _dbus_return_val_if_fail (pending != NULL, NULL);
 
-  CONNECTION_LOCK (pending->connection);
+  /* slot lists are safe to read without the lock */
   res = _dbus_data_slot_list_get (&slot_allocator,
                                   &pending->slot_list,
                                   slot);
-  CONNECTION_UNLOCK (pending->connection);
 
   return res;
 }
@@ -786,6 +789,78 @@ dbus_pending_call_get_data (DBusPendingCall   *pending,
 /** @} */
 
 #ifdef DBUS_BUILD_TESTS
+#include "dbus-server.h"
+
+typedef struct
+{
+  DBusTimeout *timeout; /**< The one timeout the application was given */
+  int n_added;          /**< Times it was added */
+  int n_removed;        /**< Times it was removed */
+} TimerTestData;
+
+static dbus_bool_t
+timer_test_add (DBusTimeout *timeout,
+                void        *data)
+{
+  TimerTestData *td = data;
+
+  _dbus_assert (td->timeout == NULL);
+
+  td->timeout = timeout;
+  td->n_added += 1;
+  return TRUE;
+}
+
+static void
+timer_test_remove (DBusTimeout *timeout,
+                   void        *data)
+{
+  TimerTestData *td = data;
+
+  _dbus_assert (td->timeout == timeout);
+
+  td->timeout = NULL;
+  td->n_removed += 1;
+}
+
+static void
+timer_test_new_connection (DBusServer     *server,
+                           DBusConnection *new_connection,
+                           void           *data)
+{
+  DBusConnection **peer = data;
+
+  *peer = dbus_connection_ref (new_connection);
+}
+
+static void
+timer_test_free_count (void *data)
+{
+  int *n_freed = data;
+
+  *n_freed += 1;
+}
+
+static DBusPendingCall *
+timer_test_send (DBusConnection *connection,
+                 int             timeout_milliseconds)
+{
+  DBusMessage *message;
+  DBusPendingCall *pending;
+
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestSuite",
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Echo");
+  if (message == NULL ||
+      !dbus_connection_send_with_reply (connection, message, &pending,
+                                        timeout_milliseconds) ||
+      pending == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_unref (message);
+  return pending;
+}
 
 /**
  * @ingroup DBusPendingCallInternals
@@ -796,6 +871,101 @@ dbus_pending_call_get_data (DBusPendingCall   *pending,
 dbus_bool_t
 _dbus_pending_call_test (const char *test_data_dir)
 {  
+  DBusServer *server;
+  DBusConnection *connection;
+  DBusConnection *peer;
+  DBusPendingCall *pending[4];
+  DBusPendingCall *reused;
+  TimerTestData td;
+  int n_freed[2];
+  int interval;
+  int i;
+
+  server = dbus_server_listen ("debug-pipe:name=test-pending-timer", NULL);
+  if (server == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  /* The server side has to be kept, or the client is disconnected */
+  peer = NULL;
+  dbus_server_set_new_connection_function (server, timer_test_new_connection,
+                                           &peer, NULL);
+
+  connection = dbus_connection_open_private ("debug-pipe:name=test-pending-timer",
+                                             NULL);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _DBUS_ZERO (td);
+  if (!dbus_connection_set_timeout_functions (connection,
+                                              timer_test_add,
+                                              timer_test_remove,
+                                              NULL, &td, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  /* However many calls are outstanding, there is one timeout, and
+   * it is due with the earliest of them
+   */
+  pending[0] = timer_test_send (connection, 50000);
+  pending[1] = timer_test_send (connection, 10000);
+  pending[2] = timer_test_send (connection, _DBUS_INT_MAX);
+  pending[3] = timer_test_send (connection, 30000);
+
+  _dbus_assert (td.n_added == 1);
+  _dbus_assert (td.timeout != NULL);
+
+  interval = dbus_timeout_get_interval (td.timeout);
+  _dbus_assert (interval > 9000 && interval <= 10000);
+
+  /* Losing the earliest call leaves the timeout alone until it
+   * fires, when it moves on to the next deadline without timing
+   * anything out
+   */
+  dbus_pending_call_cancel (pending[1]);
+  _dbus_assert (dbus_timeout_get_interval (td.timeout) == interval);
+
+  dbus_timeout_handle (td.timeout);
+  interval = dbus_timeout_get_interval (td.timeout);
+  _dbus_assert (interval > 29000 && interval <= 30000);
+  _dbus_assert (!dbus_pending_call_get_completed (pending[3]));
+
+  dbus_pending_call_cancel (pending[3]);
+  dbus_pending_call_cancel (pending[0]);
+  _dbus_assert (td.n_removed == 1);
+  _dbus_assert (td.timeout == NULL);
+
+  /* A call without a timeout never needs one */
+  dbus_pending_call_cancel (pending[2]);
+  _dbus_assert (td.n_added == 1);
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (pending); i++)
+    dbus_pending_call_unref (pending[i]);
+
+  /* The connection kept the memory of the last call freed, and the
+   * notifier's data is freed when replaced and when the call goes
+   */
+  reused = timer_test_send (connection, 10000);
+  _dbus_assert (reused == pending[_DBUS_N_ELEMENTS (pending) - 1]);
+  _dbus_assert (!dbus_pending_call_get_completed (reused));
+
+  n_freed[0] = 0;
+  n_freed[1] = 0;
+  if (!dbus_pending_call_set_notify (reused, NULL, &n_freed[0],
+                                     timer_test_free_count) ||
+      !dbus_pending_call_set_notify (reused, NULL, &n_freed[1],
+                                     timer_test_free_count))
+    _dbus_assert_not_reached ("setting a notifier can't fail");
+  _dbus_assert (n_freed[0] == 1 && n_freed[1] == 0);
+
+  dbus_pending_call_cancel (reused);
+  dbus_pending_call_unref (reused);
+  _dbus_assert (n_freed[0] == 1 && n_freed[1] == 1);
+
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+  dbus_connection_close (peer);
+  dbus_connection_unref (peer);
+  dbus_server_disconnect (server);
+  dbus_server_unref (server);
 
   return TRUE;
 }
@@ -0,0 +1,1026 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-perf.c  Microbenchmarks of libdbus internals
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-test.h"
+#include "dbus-internals.h"
+#include "dbus-string.h"
+#include "dbus-hash.h"
+#include "dbus-mempool.h"
+#include "dbus-message-private.h"
+#include "dbus-marshal-basic.h"
+#include "dbus-marshal-validate.h"
+#include "dbus-marshal-byteswap.h"
+#include "dbus-object-tree.h"
+#include "dbus-signature.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef DBUS_BUILD_TESTS
+
+/* Each benchmark is run for at least this long, doubling the number
+ * of iterations until it is, so fast and slow operations both get a
+ * stable figure.
+ */
+#define MIN_RUN_USEC 200000
+
+#define N_HASH_KEYS 1000
+
+typedef void (* PerfFunc) (void *data, long n_iterations);
+
+static void
+die (const char *failure)
+{
+  fprintf (stderr, "Benchmark failed: %s\n", failure);
+  exit (1);
+}
+
+static long
+now_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  return tv_sec * 1000000 + tv_usec;
+}
+
+static void
+run_perf (const char *name,
+          const char *specific_test,
+          PerfFunc    func,
+          void       *data)
+{
+  long n_iterations = 1;
+  long elapsed;
+
+  if (specific_test != NULL && strcmp (specific_test, name) != 0)
+    return;
+
+  while (TRUE)
+    {
+      long start = now_usec ();
+
+      func (data, n_iterations);
+      elapsed = now_usec () - start;
+
+      if (elapsed >= MIN_RUN_USEC)
+        break;
+
+      n_iterations *= 2;
+    }
+
+  printf ("%s: %-24s %12.1f ns/op %12ld iterations\n", "dbus-perf",
+          name, elapsed * 1000.0 / n_iterations, n_iterations);
+}
+
+static void
+perf_string_append (void *data,
+                    long  n_iterations)
+{
+  long i;
+  int j;
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      DBusString str;
+
+      if (!_dbus_string_init (&str))
+        die ("no memory");
+
+      for (j = 0; j < 64; j++)
+        {
+          if (!_dbus_string_append (&str, "org.freedesktop.DBus."))
+            die ("no memory");
+        }
+
+      _dbus_string_free (&str);
+    }
+}
+
+static void
+perf_string_copy (void *data,
+                  long  n_iterations)
+{
+  const DBusString *source = data;
+  DBusString dest;
+  long i;
+
+  if (!_dbus_string_init (&dest))
+    die ("no memory");
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      _dbus_string_set_length (&dest, 0);
+      if (!_dbus_string_copy (source, 0, &dest, 0))
+        die ("no memory");
+    }
+
+  _dbus_string_free (&dest);
+}
+
+static void
+perf_string_find (void *data,
+                  long  n_iterations)
+{
+  const DBusString *source = data;
+  long i;
+  int found;
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      if (!_dbus_string_find (source, 0, "\r\n", &found))
+        die ("string not found");
+    }
+}
+
+/* Keys look like the unique names the bus hands out: a handful of
+ * short, nearly identical strings
+ */
+static void
+perf_hash_string (void *data,
+                  long  n_iterations)
+{
+  DBusHashTable *table = data;
+  char key[32];
+  long i;
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      snprintf (key, sizeof (key), ":1.%ld", (i * 7919) % N_HASH_KEYS);
+      if (_dbus_hash_table_lookup_string (table, key) == NULL)
+        die ("key not found");
+    }
+}
+
+/* Keys look like message serials: sequential integers */
+static void
+perf_hash_int (void *data,
+               long  n_iterations)
+{
+  DBusHashTable *table = data;
+  long i;
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      if (_dbus_hash_table_lookup_int (table,
+                                       1 + (i * 7919) % N_HASH_KEYS) == NULL)
+        die ("key not found");
+    }
+}
+
+static void
+perf_mem_pool (void *data,
+               long  n_iterations)
+{
+  DBusMemPool *pool = data;
+  void *elements[64];
+  long i;
+  int j;
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      for (j = 0; j < 64; j++)
+        {
+          elements[j] = _dbus_mem_pool_alloc (pool);
+          if (elements[j] == NULL)
+            die ("no memory");
+        }
+
+      for (j = 0; j < 64; j++)
+        _dbus_mem_pool_dealloc (pool, elements[j]);
+    }
+}
+
+static void
+append_a_sv (DBusMessage *message)
+{
+  DBusMessageIter iter, dict, entry, variant;
+  int i;
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}",
+                                         &dict))
+    die ("no memory");
+
+  for (i = 0; i < 10; i++)
+    {
+      const char *key = "SomeProperty";
+      dbus_uint32_t u = i;
+      const char *s = "a string value";
+
+      if (!dbus_message_iter_open_container (&dict, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry) ||
+          !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &key))
+        die ("no memory");
+
+      if (i % 2 == 0)
+        {
+          if (!dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                                                 "u", &variant) ||
+              !dbus_message_iter_append_basic (&variant, DBUS_TYPE_UINT32,
+                                               &u))
+            die ("no memory");
+        }
+      else
+        {
+          if (!dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                                                 "s", &variant) ||
+              !dbus_message_iter_append_basic (&variant, DBUS_TYPE_STRING,
+                                               &s))
+            die ("no memory");
+        }
+
+      if (!dbus_message_iter_close_container (&entry, &variant) ||
+          !dbus_message_iter_close_container (&dict, &entry))
+        die ("no memory");
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &dict))
+    die ("no memory");
+}
+
+static void
+append_a_ssuu (DBusMessage *message)
+{
+  DBusMessageIter iter, array, entry;
+  int i;
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(ssuu)",
+                                         &array))
+    die ("no memory");
+
+  for (i = 0; i < 10; i++)
+    {
+      const char *s1 = "org.freedesktop.Example";
+      const char *s2 = ":1.42";
+      dbus_uint32_t u1 = i, u2 = i * 2;
+
+      if (!dbus_message_iter_open_container (&array, DBUS_TYPE_STRUCT,
+                                             NULL, &entry) ||
+          !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &s1) ||
+          !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &s2) ||
+          !dbus_message_iter_append_basic (&entry, DBUS_TYPE_UINT32, &u1) ||
+          !dbus_message_iter_append_basic (&entry, DBUS_TYPE_UINT32, &u2) ||
+          !dbus_message_iter_close_container (&array, &entry))
+        die ("no memory");
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    die ("no memory");
+}
+
+static void
+append_ay (DBusMessage *message)
+{
+  static char bytes[4096];
+  const char *p = bytes;
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                 &p, (int) sizeof (bytes),
+                                 DBUS_TYPE_INVALID))
+    die ("no memory");
+}
+
+typedef void (* AppendFunc) (DBusMessage *message);
+
+static void
+append_nothing (DBusMessage *message)
+{
+}
+
+static DBusMessage*
+new_message (AppendFunc append)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal ("/org/freedesktop/Perf",
+                                     "org.freedesktop.Perf", "Changed");
+  if (message == NULL)
+    die ("no memory");
+
+  /* dbus_message_demarshal() rejects a zero serial */
+  dbus_message_set_serial (message, 1);
+  append (message);
+
+  return message;
+}
+
+static void
+recurse (DBusMessageIter *iter)
+{
+  do
+    {
+      int type = dbus_message_iter_get_arg_type (iter);
+
+      if (dbus_type_is_container (type))
+        {
+          DBusMessageIter sub;
+
+          dbus_message_iter_recurse (iter, &sub);
+          if (type == DBUS_TYPE_ARRAY &&
+              dbus_type_is_fixed (dbus_message_iter_get_element_type (iter)))
+            {
+              const void *values;
+              int n_values;
+
+              dbus_message_iter_get_fixed_array (&sub, &values, &n_values);
+            }
+          else if (dbus_message_iter_get_arg_type (&sub) != DBUS_TYPE_INVALID)
+            recurse (&sub);
+        }
+      else if (type != DBUS_TYPE_INVALID)
+        {
+          DBusBasicValue value;
+
+          dbus_message_iter_get_basic (iter, &value);
+        }
+    }
+  while (dbus_message_iter_next (iter));
+}
+
+static void
+perf_marshal (void *data,
+              long  n_iterations)
+{
+  AppendFunc *append = data;
+  long i;
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      DBusMessage *message = new_message (*append);
+      char *blob;
+      int len;
+
+      if (!dbus_message_marshal (message, &blob, &len))
+        die ("no memory");
+
+      dbus_free (blob);
+      dbus_message_unref (message);
+    }
+}
+
+typedef struct
+{
+  char *blob;
+  int len;
+} Blob;
+
+static void
+perf_demarshal (void *data,
+                long  n_iterations)
+{
+  Blob *blob = data;
+  long i;
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      DBusMessage *message;
+      DBusMessageIter iter;
+
+      message = dbus_message_demarshal (blob->blob, blob->len, NULL);
+      if (message == NULL)
+        die ("demarshal failed");
+
+      if (dbus_message_iter_init (message, &iter))
+        recurse (&iter);
+
+      dbus_message_unref (message);
+    }
+}
+
+typedef struct
+{
+  DBusString signature;
+  DBusString body;
+  int byte_order;
+} Body;
+
+static void
+body_init (Body        *body,
+           DBusMessage *message)
+{
+  const DBusString *header;
+  const DBusString *value;
+  const DBusString *tail;
+
+  dbus_message_lock (message);
+  _dbus_message_get_network_data (message, &header, &value, &tail);
+
+  if (!_dbus_string_init (&body->signature) ||
+      !_dbus_string_append (&body->signature,
+                            dbus_message_get_signature (message)) ||
+      !_dbus_string_init (&body->body) ||
+      !_dbus_string_copy (value, 0, &body->body, 0) ||
+      !_dbus_string_copy (tail, 0, &body->body,
+                          _dbus_string_get_length (&body->body)))
+    die ("no memory");
+
+  body->byte_order = message->byte_order;
+}
+
+static void
+body_free (Body *body)
+{
+  _dbus_string_free (&body->signature);
+  _dbus_string_free (&body->body);
+}
+
+static void
+perf_validate (void *data,
+               long  n_iterations)
+{
+  Body *body = data;
+  long i;
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      if (_dbus_validate_body_with_reason (&body->signature, 0,
+                                           body->byte_order, NULL,
+                                           &body->body, 0,
+                                           _dbus_string_get_length (&body->body))
+          != DBUS_VALID)
+        die ("body not valid");
+    }
+}
+
+/* Each iteration swaps the body to the other byte order and back,
+ * so it is left as it was.
+ */
+static void
+perf_byteswap (void *data,
+               long  n_iterations)
+{
+  Body *body = data;
+  int other = body->byte_order == DBUS_LITTLE_ENDIAN ?
+    DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN;
+  long i;
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      _dbus_marshal_byteswap (&body->signature, 0, body->byte_order, other,
+                              &body->body, 0);
+      _dbus_marshal_byteswap (&body->signature, 0, other, body->byte_order,
+                              &body->body, 0);
+    }
+}
+
+static void
+perf_decompose_path (void *data,
+                     long  n_iterations)
+{
+  const char *path = "/org/freedesktop/NetworkManager/Devices/0/Settings";
+  int len = strlen (path);
+  long i;
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      char **decomposed;
+      int n_elements;
+
+      if (!_dbus_decompose_path (path, len, &decomposed, &n_elements))
+        die ("no memory");
+
+      dbus_free_string_array (decomposed);
+    }
+}
+
+static void
+run_message_perfs (const char *suffix,
+                   const char *specific_test,
+                   AppendFunc  append)
+{
+  DBusMessage *message;
+  Blob blob;
+  Body body;
+  char name[64];
+
+  snprintf (name, sizeof (name), "marshal-%s", suffix);
+  run_perf (name, specific_test, perf_marshal, &append);
+
+  message = new_message (append);
+  if (!dbus_message_marshal (message, &blob.blob, &blob.len))
+    die ("no memory");
+  dbus_message_unref (message);
+
+  snprintf (name, sizeof (name), "demarshal-%s", suffix);
+  run_perf (name, specific_test, perf_demarshal, &blob);
+  dbus_free (blob.blob);
+
+  message = new_message (append);
+  body_init (&body, message);
+  dbus_message_unref (message);
+
+  snprintf (name, sizeof (name), "validate-%s", suffix);
+  run_perf (name, specific_test, perf_validate, &body);
+
+  snprintf (name, sizeof (name), "byteswap-%s", suffix);
+  run_perf (name, specific_test, perf_byteswap, &body);
+
+  body_free (&body);
+}
+
+/* The stress cases build inputs designed to be expensive to handle,
+ * at a base size and eight times that, and fail if the cost per unit
+ * of input grows by more than this: linear code stays near 1, code
+ * that is quadratic in the input comes out near 8.
+ */
+#define STRESS_SCALE     8
+#define STRESS_MAX_RATIO 3.0
+#define STRESS_MIN_USEC  50000
+
+/* Deep enough to be near DBUS_MAXIMUM_TYPE_RECURSION_DEPTH */
+#define STRESS_STRUCT_DEPTH 30
+
+/* Not a field the spec defines, so libdbus must skip over it */
+#define STRESS_UNKNOWN_FIELD 200
+
+typedef struct
+{
+  const char *name;
+  int base_size;
+  void* (* setup)    (int   size);
+  void  (* run)      (void *input);
+  void  (* teardown) (void *input);
+} StressCase;
+
+static Body*
+body_new (DBusMessage *message)
+{
+  Body *body = dbus_new (Body, 1);
+
+  if (body == NULL)
+    die ("no memory");
+
+  body_init (body, message);
+  dbus_message_unref (message);
+
+  return body;
+}
+
+static void
+append_nested (DBusMessageIter *iter,
+               int              depth)
+{
+  DBusMessageIter sub;
+  unsigned char byte = 0;
+
+  if (depth == 0)
+    {
+      if (!dbus_message_iter_append_basic (iter, DBUS_TYPE_BYTE, &byte))
+        die ("no memory");
+      return;
+    }
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_STRUCT, NULL, &sub))
+    die ("no memory");
+
+  append_nested (&sub, depth - 1);
+
+  if (!dbus_message_iter_close_container (iter, &sub))
+    die ("no memory");
+}
+
+/* size elements of (((...(y)...))) */
+static void*
+setup_nested_structs (int size)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array;
+  char signature[2 * STRESS_STRUCT_DEPTH + 2];
+  int i;
+
+  for (i = 0; i < STRESS_STRUCT_DEPTH; i++)
+    {
+      signature[i] = DBUS_STRUCT_BEGIN_CHAR;
+      signature[STRESS_STRUCT_DEPTH + 1 + i] = DBUS_STRUCT_END_CHAR;
+    }
+  signature[STRESS_STRUCT_DEPTH] = DBUS_TYPE_BYTE;
+  signature[2 * STRESS_STRUCT_DEPTH + 1] = '\0';
+
+  message = new_message (append_nothing);
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, signature,
+                                         &array))
+    die ("no memory");
+
+  for (i = 0; i < size; i++)
+    append_nested (&array, STRESS_STRUCT_DEPTH);
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    die ("no memory");
+
+  return body_new (message);
+}
+
+/* size variants each holding a single byte */
+static void*
+setup_tiny_variants (int size)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array, variant;
+  unsigned char byte = 0;
+  int i;
+
+  message = new_message (append_nothing);
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "v", &array))
+    die ("no memory");
+
+  for (i = 0; i < size; i++)
+    {
+      if (!dbus_message_iter_open_container (&array, DBUS_TYPE_VARIANT, "y",
+                                             &variant) ||
+          !dbus_message_iter_append_basic (&variant, DBUS_TYPE_BYTE, &byte) ||
+          !dbus_message_iter_close_container (&array, &variant))
+        die ("no memory");
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    die ("no memory");
+
+  return body_new (message);
+}
+
+/* size booleans, each of which is checked to be 0 or 1 */
+static void*
+setup_tiny_booleans (int size)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array;
+  dbus_bool_t value = TRUE;
+  int i;
+
+  message = new_message (append_nothing);
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "b", &array))
+    die ("no memory");
+
+  for (i = 0; i < size; i++)
+    {
+      if (!dbus_message_iter_append_basic (&array, DBUS_TYPE_BOOLEAN, &value))
+        die ("no memory");
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    die ("no memory");
+
+  return body_new (message);
+}
+
+static void
+run_validate (void *input)
+{
+  perf_validate (input, 1);
+}
+
+static void
+teardown_body (void *input)
+{
+  body_free (input);
+  dbus_free (input);
+}
+
+static void
+append_raw_uint32 (DBusString    *str,
+                   dbus_uint32_t  value)
+{
+  int pos = _dbus_string_get_length (str);
+
+  if (!_dbus_string_lengthen (str, 4))
+    die ("no memory");
+
+  _dbus_marshal_set_uint32 (str, pos, value, DBUS_LITTLE_ENDIAN);
+}
+
+static void
+append_raw_field (DBusString    *str,
+                  unsigned char  code,
+                  char           type,
+                  const char    *value)
+{
+  if (!_dbus_string_align_length (str, 8) ||
+      !_dbus_string_append_byte (str, code) ||
+      !_dbus_string_append_byte (str, 1) ||
+      !_dbus_string_append_byte (str, type) ||
+      !_dbus_string_append_byte (str, '\0'))
+    die ("no memory");
+
+  if (type == DBUS_TYPE_BYTE)
+    {
+      if (!_dbus_string_append_byte (str, *value))
+        die ("no memory");
+      return;
+    }
+
+  append_raw_uint32 (str, strlen (value));
+  if (!_dbus_string_append_len (str, value, strlen (value) + 1))
+    die ("no memory");
+}
+
+/* A method call with size header fields libdbus doesn't know; these
+ * can't be built through the API, so it's put together by hand.
+ */
+static void*
+setup_header_fields (int size)
+{
+  DBusString *str = dbus_new (DBusString, 1);
+  int i;
+
+  if (str == NULL || !_dbus_string_init (str))
+    die ("no memory");
+
+  if (!_dbus_string_append_byte (str, DBUS_LITTLE_ENDIAN) ||
+      !_dbus_string_append_byte (str, DBUS_MESSAGE_TYPE_METHOD_CALL) ||
+      !_dbus_string_append_byte (str, 0) ||
+      !_dbus_string_append_byte (str, DBUS_MAJOR_PROTOCOL_VERSION))
+    die ("no memory");
+
+  append_raw_uint32 (str, 0);   /* body length */
+  append_raw_uint32 (str, 1);   /* serial */
+  append_raw_uint32 (str, 0);   /* fields length, filled in below */
+
+  append_raw_field (str, DBUS_HEADER_FIELD_PATH, DBUS_TYPE_OBJECT_PATH, "/");
+  append_raw_field (str, DBUS_HEADER_FIELD_MEMBER, DBUS_TYPE_STRING, "M");
+
+  for (i = 0; i < size; i++)
+    append_raw_field (str, STRESS_UNKNOWN_FIELD, DBUS_TYPE_BYTE, "");
+
+  _dbus_marshal_set_uint32 (str, 12, _dbus_string_get_length (str) - 16,
+                            DBUS_LITTLE_ENDIAN);
+
+  if (!_dbus_string_align_length (str, 8))
+    die ("no memory");
+
+  return str;
+}
+
+static void
+run_demarshal (void *input)
+{
+  DBusString *str = input;
+  DBusMessage *message;
+
+  message = dbus_message_demarshal (_dbus_string_get_const_data (str),
+                                    _dbus_string_get_length (str), NULL);
+  if (message == NULL)
+    die ("hand-built message was rejected");
+
+  dbus_message_unref (message);
+}
+
+static void
+teardown_string (void *input)
+{
+  _dbus_string_free (input);
+  dbus_free (input);
+}
+
+/* Strings built from blocks of "Aa" and "BB", which hash the same
+ * under a multiply-by-31 hash, so every key collides with every other
+ */
+static void*
+setup_hash_collisions (int size)
+{
+  char **keys;
+  int i, j;
+
+  keys = dbus_new0 (char *, size + 1);
+  if (keys == NULL)
+    die ("no memory");
+
+  for (i = 0; i < size; i++)
+    {
+      keys[i] = dbus_malloc (2 * 16 + 1);
+      if (keys[i] == NULL)
+        die ("no memory");
+
+      for (j = 0; j < 16; j++)
+        memcpy (keys[i] + 2 * j, (i >> j) & 1 ? "BB" : "Aa", 2);
+      keys[i][2 * 16] = '\0';
+    }
+
+  return keys;
+}
+
+static void
+run_hash_collisions (void *input)
+{
+  char **keys = input;
+  DBusHashTable *table;
+  int i;
+
+  table = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (table == NULL)
+    die ("no memory");
+
+  for (i = 0; keys[i] != NULL; i++)
+    {
+      if (!_dbus_hash_table_insert_string (table, keys[i], keys[i]))
+        die ("no memory");
+    }
+
+  for (i = 0; keys[i] != NULL; i++)
+    {
+      if (_dbus_hash_table_lookup_string (table, keys[i]) != keys[i])
+        die ("key not found");
+    }
+
+  _dbus_hash_table_unref (table);
+}
+
+static void
+teardown_strv (void *input)
+{
+  dbus_free_string_array (input);
+}
+
+static const StressCase stress_cases[] = {
+  { "nested-structs", 1000, setup_nested_structs, run_validate, teardown_body },
+  { "tiny-variants", 10000, setup_tiny_variants, run_validate, teardown_body },
+  { "tiny-booleans", 10000, setup_tiny_booleans, run_validate, teardown_body },
+  { "header-fields", 1000, setup_header_fields, run_demarshal, teardown_string },
+  { "hash-collisions", 512, setup_hash_collisions, run_hash_collisions, teardown_strv }
+};
+
+/* Returns the time to handle one unit of an input of this size */
+static double
+time_stress (const StressCase *stress,
+             int               size)
+{
+  void *input = stress->setup (size);
+  long n_runs = 0;
+  long start, elapsed;
+
+  start = now_usec ();
+
+  do
+    {
+      stress->run (input);
+      n_runs += 1;
+      elapsed = now_usec () - start;
+    }
+  while (elapsed < STRESS_MIN_USEC);
+
+  stress->teardown (input);
+
+  return elapsed * 1000.0 / n_runs / size;
+}
+
+#endif /* DBUS_BUILD_TESTS */
+
+/**
+ * An exported symbol to be run in order to time the library's
+ * internals. Should not be used by any app other than our test app,
+ * this symbol won't exist in some builds of the library.
+ * (with --enable-tests=no)
+ *
+ * @param specific_test the only benchmark to run, or #NULL for all
+ */
+void
+dbus_internal_do_not_use_run_perf (const char *specific_test)
+{
+#ifdef DBUS_BUILD_TESTS
+  DBusString str;
+  DBusHashTable *table;
+  DBusMemPool *pool;
+  int i;
+
+  if (!_dbus_string_init (&str))
+    die ("no memory");
+
+  for (i = 0; i < 4096; i++)
+    {
+      if (!_dbus_string_append_byte (&str, 'a' + i % 26))
+        die ("no memory");
+    }
+
+  if (!_dbus_string_append (&str, "\r\n"))
+    die ("no memory");
+
+  run_perf ("string-append", specific_test, perf_string_append, NULL);
+  run_perf ("string-copy", specific_test, perf_string_copy, &str);
+  run_perf ("string-find", specific_test, perf_string_find, &str);
+
+  _dbus_string_free (&str);
+
+  table = _dbus_hash_table_new (DBUS_HASH_STRING, dbus_free, NULL);
+  if (table == NULL)
+    die ("no memory");
+
+  for (i = 0; i < N_HASH_KEYS; i++)
+    {
+      char *key = dbus_malloc (32);
+
+      if (key == NULL)
+        die ("no memory");
+
+      snprintf (key, 32, ":1.%d", i);
+      if (!_dbus_hash_table_insert_string (table, key, key))
+        die ("no memory");
+    }
+
+  run_perf ("hash-string", specific_test, perf_hash_string, table);
+  _dbus_hash_table_unref (table);
+
+  table = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+  if (table == NULL)
+    die ("no memory");
+
+  for (i = 1; i <= N_HASH_KEYS; i++)
+    {
+      if (!_dbus_hash_table_insert_int (table, i, table))
+        die ("no memory");
+    }
+
+  run_perf ("hash-int", specific_test, perf_hash_int, table);
+  _dbus_hash_table_unref (table);
+
+  pool = _dbus_mem_pool_new (64, FALSE);
+  if (pool == NULL)
+    die ("no memory");
+
+  run_perf ("mem-pool", specific_test, perf_mem_pool, pool);
+  _dbus_mem_pool_free (pool);
+
+  run_message_perfs ("a{sv}", specific_test, append_a_sv);
+  run_message_perfs ("a(ssuu)", specific_test, append_a_ssuu);
+  run_message_perfs ("ay", specific_test, append_ay);
+
+  run_perf ("decompose-path", specific_test, perf_decompose_path, NULL);
+
+  dbus_shutdown ();
+#else
+  printf ("Not compiled with unit tests, not running any benchmarks\n");
+#endif
+}
+
+/**
+ * An exported symbol to be run in order to check that handling
+ * hostile input costs no more than linear time in its size. Should
+ * not be used by any app other than our test app, this symbol won't
+ * exist in some builds of the library. (with --enable-tests=no)
+ *
+ * @param specific_test the only case to run, or #NULL for all
+ * @returns #FALSE if any case grew faster than linearly
+ */
+dbus_bool_t
+dbus_internal_do_not_use_run_stress (const char *specific_test)
+{
+#ifdef DBUS_BUILD_TESTS
+  dbus_bool_t ok = TRUE;
+  int i;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (stress_cases); i++)
+    {
+      const StressCase *stress = &stress_cases[i];
+      double small, large;
+
+      if (specific_test != NULL && strcmp (specific_test, stress->name) != 0)
+        continue;
+
+      small = time_stress (stress, stress->base_size);
+      large = time_stress (stress, stress->base_size * STRESS_SCALE);
+
+      printf ("%s: %-24s %8d -> %8d: %10.1f -> %10.1f ns/unit %s\n",
+              "dbus-stress", stress->name, stress->base_size,
+              stress->base_size * STRESS_SCALE, small, large,
+              large > small * STRESS_MAX_RATIO ? "SUPERLINEAR" : "ok");
+
+      if (large > small * STRESS_MAX_RATIO)
+        ok = FALSE;
+    }
+
+  dbus_shutdown ();
+
+  return ok;
+#else
+  printf ("Not compiled with unit tests, not running any stress cases\n");
+  return TRUE;
+#endif
+}
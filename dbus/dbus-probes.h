@@ -0,0 +1,65 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-probes.h Static tracepoints for SystemTap, bpftrace and friends
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef DBUS_PROBES_H
+#define DBUS_PROBES_H
+
+/* With DBUS_ENABLE_USDT each _DBUS_PROBE is a single nop plus a note
+ * in the ELF file telling a tracer where to find its arguments, so
+ * untraced it costs nothing but computing them; keep them to values
+ * already at hand. Without it they vanish.
+ *
+ * All probes are in the "dbus" provider, e.g. for bpftrace
+ * usdt:/usr/bin/dbus-daemon:dbus:message__routed.
+ *
+ * In libdbus:
+ *   read__done            (int fd, int bytes)
+ *   message__validated    (DBusMessage *message, long size)
+ *   message__received     (DBusConnection *connection, DBusMessage *message)
+ *   message__queued       (DBusConnection *connection, DBusMessage *message, int n_outgoing)
+ *   message__written      (DBusConnection *connection, DBusMessage *message)
+ *   auth__complete        (DBusConnection *connection)
+ *
+ * In the bus daemon:
+ *   connection__accepted  (DBusConnection *connection)
+ *   message__routed       (DBusConnection *sender, DBusMessage *message, int n_recipients)
+ *   message__dropped      (DBusConnection *recipient, DBusMessage *message, const char *reason)
+ *   name__acquired        (DBusConnection *connection, const char *name)
+ *   name__released        (DBusConnection *connection, const char *name)
+ */
+
+#ifdef DBUS_ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define _DBUS_PROBE1(name, a)          DTRACE_PROBE1 (dbus, name, a)
+#define _DBUS_PROBE2(name, a, b)       DTRACE_PROBE2 (dbus, name, a, b)
+#define _DBUS_PROBE3(name, a, b, c)    DTRACE_PROBE3 (dbus, name, a, b, c)
+
+#else /* !DBUS_ENABLE_USDT */
+
+#define _DBUS_PROBE1(name, a)          do { } while (0)
+#define _DBUS_PROBE2(name, a, b)       do { } while (0)
+#define _DBUS_PROBE3(name, a, b, c)    do { } while (0)
+
+#endif /* !DBUS_ENABLE_USDT */
+
+#endif /* DBUS_PROBES_H */
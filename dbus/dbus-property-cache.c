@@ -0,0 +1,987 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-property-cache.c Client-side cache of a remote object's properties
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-internals.h"
+#include "dbus-property-cache.h"
+#include "dbus-bus.h"
+#include "dbus-hash.h"
+#include "dbus-marshal-validate.h"
+#include "dbus-pending-call.h"
+#include "dbus-protocol.h"
+#include "dbus-string.h"
+#include "dbus-threads-internal.h"
+#include "dbus-test.h"
+#include <string.h>
+
+/**
+ * @defgroup DBusPropertyCache DBusPropertyCache
+ * @ingroup  DBus
+ * @brief Client-side cache of a remote object's properties
+ *
+ * A DBusPropertyCache keeps the properties of one interface on one
+ * remote object, so that reading them does not need a
+ * org.freedesktop.DBus.Properties.Get round trip each time. It asks
+ * for all of them once with GetAll, then keeps up to date by
+ * watching the object's PropertiesChanged signal. Properties the
+ * signal only invalidates are fetched again with Get the next time
+ * they are read. On a message bus, the cache also watches
+ * NameOwnerChanged and starts again from scratch when the
+ * destination gets a new owner.
+ *
+ * The cache only works for objects that emit PropertiesChanged for
+ * the interface; otherwise it will keep serving the values GetAll
+ * returned.
+ *
+ * The cache sees signals through a filter on the connection, so the
+ * connection has to be dispatched as usual.
+ *
+ * @{
+ */
+
+/**
+ * Internals of DBusPropertyCache
+ */
+struct DBusPropertyCache
+{
+  DBusAtomic refcount;          /**< Reference count */
+  DBusMutex *mutex;             /**< Protects everything below */
+
+  DBusConnection *connection;   /**< Connection the object is on */
+  char *destination;            /**< Bus name of the object's owner */
+  char *path;                   /**< Object path */
+  char *interface;              /**< Interface whose properties we cache */
+
+  char *changed_rule;           /**< Match rule for PropertiesChanged, #NULL if not on a bus */
+  char *owner_rule;             /**< Match rule for NameOwnerChanged, #NULL if not on a bus */
+
+  char *owner;                  /**< Unique name that answered GetAll, #NULL if unknown */
+  DBusHashTable *values;        /**< Property name to #DBusPropertyValue */
+  DBusPendingCall *get_all;     /**< Outstanding GetAll, or #NULL */
+  DBusMessage *get_all_error;   /**< Error reply to the last GetAll, or #NULL */
+  unsigned int generation;      /**< Bumped whenever the whole cache is thrown away */
+  unsigned int populated : 1;   /**< GetAll has succeeded since the last invalidation */
+  unsigned int have_filter : 1; /**< Our filter is on the connection */
+};
+
+/**
+ * A cached value: an iterator pointing at the variant holding the
+ * value, inside the message it arrived in. Received messages are
+ * never modified, so the iterator stays good while we hold a
+ * reference to the message.
+ */
+typedef struct
+{
+  DBusMessage *message;         /**< Message the value arrived in */
+  DBusMessageIter variant;      /**< Iterator at the variant */
+} DBusPropertyValue;
+
+#define CACHE_LOCK(cache)   _dbus_mutex_lock ((cache)->mutex)
+#define CACHE_UNLOCK(cache) _dbus_mutex_unlock ((cache)->mutex)
+
+static void
+property_value_free (void *data)
+{
+  DBusPropertyValue *value = data;
+
+  /* the hash table passes NULL when inserting a new entry */
+  if (value == NULL)
+    return;
+
+  dbus_message_unref (value->message);
+  dbus_free (value);
+}
+
+/* On failure the old value is dropped too, so that we fetch it again
+ * rather than serve something stale.
+ */
+static void
+store_value_unlocked (DBusPropertyCache *cache,
+                      const char        *name,
+                      DBusMessage       *message,
+                      DBusMessageIter   *variant)
+{
+  DBusPropertyValue *value;
+  char *key;
+
+  value = dbus_new (DBusPropertyValue, 1);
+  key = _dbus_strdup (name);
+
+  if (value == NULL || key == NULL)
+    goto failed;
+
+  value->message = dbus_message_ref (message);
+  value->variant = *variant;
+
+  if (!_dbus_hash_table_insert_string (cache->values, key, value))
+    {
+      dbus_message_unref (value->message);
+      goto failed;
+    }
+
+  return;
+
+ failed:
+  dbus_free (value);
+  dbus_free (key);
+  _dbus_hash_table_remove_string (cache->values, name);
+}
+
+/* iter points at an a{sv} */
+static void
+store_dict_unlocked (DBusPropertyCache *cache,
+                     DBusMessage       *message,
+                     DBusMessageIter   *iter)
+{
+  DBusMessageIter array;
+
+  dbus_message_iter_recurse (iter, &array);
+
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter entry;
+      const char *name;
+
+      dbus_message_iter_recurse (&array, &entry);
+      dbus_message_iter_get_basic (&entry, &name);
+      dbus_message_iter_next (&entry);
+
+      store_value_unlocked (cache, name, message, &entry);
+
+      dbus_message_iter_next (&array);
+    }
+}
+
+static void
+invalidate_unlocked (DBusPropertyCache *cache)
+{
+  if (cache->get_all != NULL)
+    {
+      dbus_pending_call_cancel (cache->get_all);
+      dbus_pending_call_unref (cache->get_all);
+      cache->get_all = NULL;
+    }
+
+  if (cache->get_all_error != NULL)
+    {
+      dbus_message_unref (cache->get_all_error);
+      cache->get_all_error = NULL;
+    }
+
+  _dbus_hash_table_remove_all (cache->values);
+
+  dbus_free (cache->owner);
+  cache->owner = NULL;
+
+  cache->populated = FALSE;
+  cache->generation += 1;
+}
+
+static void
+get_all_complete_unlocked (DBusPropertyCache *cache,
+                           DBusPendingCall   *pending)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter;
+
+  if (pending != cache->get_all)
+    return;
+
+  reply = dbus_pending_call_steal_reply (pending);
+  dbus_pending_call_unref (cache->get_all);
+  cache->get_all = NULL;
+
+  if (reply == NULL)
+    return;
+
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      cache->get_all_error = reply;
+      return;
+    }
+
+  if (!dbus_message_has_signature (reply, "a{sv}"))
+    {
+      _dbus_verbose ("GetAll for %s on %s returned signature %s\n",
+                     cache->interface, cache->path,
+                     dbus_message_get_signature (reply));
+      dbus_message_unref (reply);
+      return;
+    }
+
+  /* sender is NULL on a peer-to-peer connection; then we never
+   * check it
+   */
+  dbus_free (cache->owner);
+  cache->owner = _dbus_strdup (dbus_message_get_sender (reply));
+
+  dbus_message_iter_init (reply, &iter);
+  store_dict_unlocked (cache, reply, &iter);
+  cache->populated = TRUE;
+
+  dbus_message_unref (reply);
+}
+
+static void
+get_all_notify (DBusPendingCall *pending,
+                void            *user_data)
+{
+  DBusPropertyCache *cache = user_data;
+
+  CACHE_LOCK (cache);
+  get_all_complete_unlocked (cache, pending);
+  CACHE_UNLOCK (cache);
+}
+
+static dbus_bool_t
+start_get_all_unlocked (DBusPropertyCache *cache)
+{
+  DBusMessage *message;
+  DBusPendingCall *pending;
+
+  _dbus_assert (cache->get_all == NULL);
+
+  message = dbus_message_new_method_call (cache->destination,
+                                          cache->path,
+                                          DBUS_INTERFACE_PROPERTIES,
+                                          "GetAll");
+  if (message == NULL)
+    return FALSE;
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &cache->interface,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send_with_reply (cache->connection, message,
+                                        &pending, -1))
+    {
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  dbus_message_unref (message);
+
+  /* disconnected; the call fails as soon as we block on it */
+  if (pending == NULL)
+    return TRUE;
+
+  if (!dbus_pending_call_set_notify (pending, get_all_notify, cache, NULL))
+    {
+      dbus_pending_call_cancel (pending);
+      dbus_pending_call_unref (pending);
+      return FALSE;
+    }
+
+  cache->get_all = pending;
+
+  /* the reply may have been there already */
+  if (dbus_pending_call_get_completed (pending))
+    get_all_complete_unlocked (cache, pending);
+
+  return TRUE;
+}
+
+static void
+handle_properties_changed_unlocked (DBusPropertyCache *cache,
+                                    DBusMessage       *message)
+{
+  DBusMessageIter iter;
+  DBusMessageIter array;
+  const char *interface;
+  const char *sender;
+
+  if (!dbus_message_has_path (message, cache->path) ||
+      !dbus_message_has_signature (message, "sa{sv}as"))
+    return;
+
+  /* Before GetAll has answered we do not know who to listen to; it
+   * will tell us everything anyway
+   */
+  sender = dbus_message_get_sender (message);
+  if (cache->owner != NULL)
+    {
+      if (sender == NULL || strcmp (sender, cache->owner) != 0)
+        return;
+    }
+  else if (cache->changed_rule != NULL)
+    return;
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_get_basic (&iter, &interface);
+  if (strcmp (interface, cache->interface) != 0)
+    return;
+
+  dbus_message_iter_next (&iter);
+  store_dict_unlocked (cache, message, &iter);
+
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array);
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRING)
+    {
+      const char *name;
+
+      dbus_message_iter_get_basic (&array, &name);
+      _dbus_hash_table_remove_string (cache->values, name);
+      dbus_message_iter_next (&array);
+    }
+}
+
+static void
+handle_name_owner_changed_unlocked (DBusPropertyCache *cache,
+                                    DBusMessage       *message)
+{
+  const char *name;
+  const char *old_owner;
+  const char *new_owner;
+
+  if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS) ||
+      !dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_STRING, &old_owner,
+                              DBUS_TYPE_STRING, &new_owner,
+                              DBUS_TYPE_INVALID))
+    return;
+
+  if (strcmp (name, cache->destination) != 0)
+    return;
+
+  _dbus_verbose ("%s changed owner from '%s' to '%s', dropping cached properties\n",
+                 name, old_owner, new_owner);
+
+  invalidate_unlocked (cache);
+}
+
+static DBusHandlerResult
+property_cache_filter (DBusConnection *connection,
+                       DBusMessage    *message,
+                       void           *user_data)
+{
+  DBusPropertyCache *cache = user_data;
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_SIGNAL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  CACHE_LOCK (cache);
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_PROPERTIES,
+                              "PropertiesChanged"))
+    handle_properties_changed_unlocked (cache, message);
+  else if (cache->owner_rule != NULL &&
+           dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                                   "NameOwnerChanged"))
+    handle_name_owner_changed_unlocked (cache, message);
+
+  CACHE_UNLOCK (cache);
+
+  /* other code may well be interested in the same signals */
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static char *
+build_rule (const char *format,
+            ...)
+{
+  DBusString rule;
+  va_list args;
+  char *str;
+
+  if (!_dbus_string_init (&rule))
+    return NULL;
+
+  va_start (args, format);
+  if (!_dbus_string_append_printf_valist (&rule, format, args) ||
+      !_dbus_string_steal_data (&rule, &str))
+    str = NULL;
+  va_end (args);
+
+  _dbus_string_free (&rule);
+
+  return str;
+}
+
+static void
+property_cache_finalize (DBusPropertyCache *cache)
+{
+  if (cache->have_filter)
+    dbus_connection_remove_filter (cache->connection,
+                                   property_cache_filter, cache);
+
+  /* Without an error, these do not wait for the bus to answer */
+  if (cache->changed_rule != NULL)
+    dbus_bus_remove_match (cache->connection, cache->changed_rule, NULL);
+  if (cache->owner_rule != NULL)
+    dbus_bus_remove_match (cache->connection, cache->owner_rule, NULL);
+
+  if (cache->values != NULL)
+    invalidate_unlocked (cache);
+
+  if (cache->values != NULL)
+    _dbus_hash_table_unref (cache->values);
+
+  dbus_free (cache->changed_rule);
+  dbus_free (cache->owner_rule);
+  dbus_free (cache->destination);
+  dbus_free (cache->path);
+  dbus_free (cache->interface);
+
+  dbus_connection_unref (cache->connection);
+  _dbus_mutex_free_at_location (&cache->mutex);
+
+  dbus_free (cache);
+}
+
+/** @} */
+
+/**
+ * @addtogroup DBusPropertyCache
+ * @{
+ */
+
+/**
+ * Creates a cache for the properties of an interface on a remote
+ * object, and asks the object for all of them. The first read from
+ * the cache waits for that to finish, if it has not already; reads
+ * after that only leave the process for properties the object has
+ * invalidated.
+ *
+ * On a message bus connection, this adds match rules for the
+ * object's PropertiesChanged signals and for the destination's
+ * NameOwnerChanged signals, and blocks until the bus has accepted
+ * them. On a peer-to-peer connection, the peer's signals all arrive
+ * anyway.
+ *
+ * @param connection the connection the object is on
+ * @param destination the bus name of the object's owner
+ * @param path the object path
+ * @param interface the interface whose properties to cache
+ * @param error location to store an error, or #NULL
+ * @returns the new cache, or #NULL with error set
+ */
+DBusPropertyCache*
+dbus_property_cache_new (DBusConnection *connection,
+                         const char     *destination,
+                         const char     *path,
+                         const char     *interface,
+                         DBusError      *error)
+{
+  DBusPropertyCache *cache;
+  DBusError tmp_error;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (destination != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (destination), NULL);
+  _dbus_return_val_if_fail (path != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_path (path), NULL);
+  _dbus_return_val_if_fail (interface != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_interface (interface), NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  dbus_error_init (&tmp_error);
+
+  cache = dbus_new0 (DBusPropertyCache, 1);
+  if (cache == NULL)
+    goto oom;
+
+  cache->refcount.value = 1;
+  cache->connection = dbus_connection_ref (connection);
+
+  _dbus_mutex_new_at_location (&cache->mutex);
+  if (cache->mutex == NULL)
+    goto oom;
+
+  cache->destination = _dbus_strdup (destination);
+  cache->path = _dbus_strdup (path);
+  cache->interface = _dbus_strdup (interface);
+  cache->values = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                        dbus_free, property_value_free);
+
+  if (cache->destination == NULL || cache->path == NULL ||
+      cache->interface == NULL || cache->values == NULL)
+    goto oom;
+
+  if (!dbus_connection_add_filter (connection, property_cache_filter,
+                                   cache, NULL))
+    goto oom;
+  cache->have_filter = TRUE;
+
+  if (dbus_bus_get_unique_name (connection) != NULL)
+    {
+      cache->changed_rule =
+        build_rule ("type='signal',sender='%s',path='%s',"
+                    "interface='" DBUS_INTERFACE_PROPERTIES "',"
+                    "member='PropertiesChanged',arg0='%s'",
+                    destination, path, interface);
+      cache->owner_rule =
+        build_rule ("type='signal',sender='" DBUS_SERVICE_DBUS "',"
+                    "interface='" DBUS_INTERFACE_DBUS "',"
+                    "member='NameOwnerChanged',arg0='%s'",
+                    destination);
+
+      if (cache->changed_rule == NULL || cache->owner_rule == NULL)
+        goto oom;
+
+      /* Always wait for the bus; without the rules we would serve
+       * stale values forever
+       */
+      dbus_bus_add_match (connection, cache->changed_rule, &tmp_error);
+      if (dbus_error_is_set (&tmp_error))
+        {
+          dbus_free (cache->changed_rule);
+          cache->changed_rule = NULL;
+          goto failed;
+        }
+
+      dbus_bus_add_match (connection, cache->owner_rule, &tmp_error);
+      if (dbus_error_is_set (&tmp_error))
+        {
+          dbus_free (cache->owner_rule);
+          cache->owner_rule = NULL;
+          goto failed;
+        }
+    }
+
+  CACHE_LOCK (cache);
+  if (!start_get_all_unlocked (cache))
+    {
+      CACHE_UNLOCK (cache);
+      goto oom;
+    }
+  CACHE_UNLOCK (cache);
+
+  return cache;
+
+ oom:
+  _DBUS_SET_OOM (&tmp_error);
+ failed:
+  dbus_move_error (&tmp_error, error);
+  if (cache != NULL)
+    {
+      if (cache->mutex != NULL)
+        property_cache_finalize (cache);
+      else
+        {
+          dbus_connection_unref (cache->connection);
+          dbus_free (cache);
+        }
+    }
+  return NULL;
+}
+
+/**
+ * Increments the reference count on a property cache.
+ *
+ * @param cache the cache
+ * @returns the cache
+ */
+DBusPropertyCache*
+dbus_property_cache_ref (DBusPropertyCache *cache)
+{
+  _dbus_return_val_if_fail (cache != NULL, NULL);
+
+  _dbus_atomic_inc (&cache->refcount);
+
+  return cache;
+}
+
+/**
+ * Decrements the reference count on a property cache, freeing it
+ * and removing its match rules and filter if the count reaches 0.
+ *
+ * @param cache the cache
+ */
+void
+dbus_property_cache_unref (DBusPropertyCache *cache)
+{
+  dbus_int32_t old_refcount;
+
+  _dbus_return_if_fail (cache != NULL);
+
+  old_refcount = _dbus_atomic_dec (&cache->refcount);
+  _dbus_assert (old_refcount > 0);
+
+  if (old_refcount == 1)
+    property_cache_finalize (cache);
+}
+
+/**
+ * Reads a property. If the cache holds a value for it, nothing is
+ * sent; otherwise this blocks on GetAll, if it has not answered yet,
+ * or calls Get for the one property.
+ *
+ * On success, iter is initialized to read the value (that is, the
+ * contents of the variant) and the message it points into is
+ * returned. The iterator is only valid while you hold that message;
+ * unref it when done. Later changes to the property do not affect a
+ * value you already have.
+ *
+ * @param cache the cache
+ * @param name the property name
+ * @param iter iterator to initialize
+ * @param error location to store an error, or #NULL
+ * @returns the message holding the value, or #NULL with error set
+ */
+DBusMessage*
+dbus_property_cache_get (DBusPropertyCache *cache,
+                         const char        *name,
+                         DBusMessageIter   *iter,
+                         DBusError         *error)
+{
+  DBusPropertyValue *value;
+  DBusMessage *message;
+  DBusMessage *reply;
+  DBusMessageIter reply_iter;
+  unsigned int generation;
+
+  _dbus_return_val_if_fail (cache != NULL, NULL);
+  _dbus_return_val_if_fail (name != NULL, NULL);
+  _dbus_return_val_if_fail (iter != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  CACHE_LOCK (cache);
+
+  if (!cache->populated)
+    {
+      if (cache->get_all == NULL && cache->get_all_error == NULL &&
+          !start_get_all_unlocked (cache))
+        {
+          CACHE_UNLOCK (cache);
+          _DBUS_SET_OOM (error);
+          return NULL;
+        }
+
+      /* The notify function takes the lock, perhaps in this very
+       * thread while we block
+       */
+      if (cache->get_all != NULL)
+        {
+          DBusPendingCall *pending = dbus_pending_call_ref (cache->get_all);
+
+          CACHE_UNLOCK (cache);
+          dbus_pending_call_block (pending);
+          dbus_pending_call_unref (pending);
+          CACHE_LOCK (cache);
+        }
+
+      /* Report a failed GetAll once, then try again next time */
+      if (cache->get_all_error != NULL)
+        {
+          dbus_set_error_from_message (error, cache->get_all_error);
+          dbus_message_unref (cache->get_all_error);
+          cache->get_all_error = NULL;
+          CACHE_UNLOCK (cache);
+          return NULL;
+        }
+    }
+
+  value = _dbus_hash_table_lookup_string (cache->values, name);
+  if (value != NULL)
+    {
+      message = dbus_message_ref (value->message);
+      dbus_message_iter_recurse (&value->variant, iter);
+      CACHE_UNLOCK (cache);
+      return message;
+    }
+
+  generation = cache->generation;
+  CACHE_UNLOCK (cache);
+
+  message = dbus_message_new_method_call (cache->destination,
+                                          cache->path,
+                                          DBUS_INTERFACE_PROPERTIES,
+                                          "Get");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &cache->interface,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    {
+      if (message != NULL)
+        dbus_message_unref (message);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  reply = dbus_connection_send_with_reply_and_block (cache->connection,
+                                                     message, -1, error);
+  dbus_message_unref (message);
+
+  if (reply == NULL)
+    return NULL;
+
+  if (!dbus_message_has_signature (reply, DBUS_TYPE_VARIANT_AS_STRING))
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_SIGNATURE,
+                      "Get returned signature %s instead of v",
+                      dbus_message_get_signature (reply));
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  dbus_message_iter_init (reply, &reply_iter);
+
+  /* Unless the cache was thrown away meanwhile, this is as good as
+   * anything we have; if PropertiesChanged overtook the reply, its
+   * value was not cached, and it had better not be
+   */
+  CACHE_LOCK (cache);
+  if (cache->generation == generation && cache->populated &&
+      _dbus_hash_table_lookup_string (cache->values, name) == NULL)
+    store_value_unlocked (cache, name, reply, &reply_iter);
+  CACHE_UNLOCK (cache);
+
+  dbus_message_iter_recurse (&reply_iter, iter);
+  return reply;
+}
+
+/**
+ * Throws away everything in the cache and asks the object for all
+ * of its properties again. There is normally no need for this,
+ * unless the object does not always emit PropertiesChanged.
+ *
+ * @param cache the cache
+ */
+void
+dbus_property_cache_invalidate (DBusPropertyCache *cache)
+{
+  _dbus_return_if_fail (cache != NULL);
+
+  CACHE_LOCK (cache);
+  invalidate_unlocked (cache);
+
+  /* if this fails, the next read tries again */
+  start_get_all_unlocked (cache);
+  CACHE_UNLOCK (cache);
+}
+
+/** @} */
+
+#ifdef DBUS_BUILD_TESTS
+#include "dbus-server.h"
+
+static void
+cache_test_new_connection (DBusServer     *server,
+                           DBusConnection *connection,
+                           void           *data)
+{
+  DBusConnection **peer_p = data;
+
+  *peer_p = dbus_connection_ref (connection);
+}
+
+/* Both ends live in this thread, so each has to be kept moving while
+ * we wait for the other
+ */
+static void
+cache_test_iterate (DBusConnection *connection,
+                    DBusConnection *peer)
+{
+  dbus_connection_read_write (connection, 0);
+  dbus_connection_read_write (peer, 0);
+}
+
+static DBusMessage *
+cache_test_pop (DBusConnection *connection,
+                DBusConnection *peer)
+{
+  DBusMessage *message;
+
+  while ((message = dbus_connection_pop_message (peer)) == NULL)
+    cache_test_iterate (connection, peer);
+
+  return message;
+}
+
+static void
+cache_test_dispatch (DBusConnection *connection,
+                     DBusConnection *peer)
+{
+  while (dbus_connection_get_dispatch_status (connection) !=
+         DBUS_DISPATCH_DATA_REMAINS)
+    cache_test_iterate (connection, peer);
+
+  while (dbus_connection_dispatch (connection) == DBUS_DISPATCH_DATA_REMAINS)
+    ;
+}
+
+static void
+cache_test_append_int32 (DBusMessageIter *dict,
+                         const char      *name,
+                         dbus_int32_t     v)
+{
+  DBusMessageIter entry, variant;
+
+  if (!dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY,
+                                         NULL, &entry) ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &name) ||
+      !dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                                         DBUS_TYPE_INT32_AS_STRING,
+                                         &variant) ||
+      !dbus_message_iter_append_basic (&variant, DBUS_TYPE_INT32, &v) ||
+      !dbus_message_iter_close_container (&entry, &variant) ||
+      !dbus_message_iter_close_container (dict, &entry))
+    _dbus_assert_not_reached ("no memory");
+}
+
+static void
+cache_test_emit (DBusConnection *peer,
+                 const char     *interface,
+                 const char     *changed,
+                 dbus_int32_t    v,
+                 const char     *invalidated)
+{
+  DBusMessage *signal;
+  DBusMessageIter iter, dict, array;
+
+  signal = dbus_message_new_signal ("/org/freedesktop/Test",
+                                    DBUS_INTERFACE_PROPERTIES,
+                                    "PropertiesChanged");
+  if (signal == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_iter_init_append (signal, &iter);
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &interface) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}", &dict))
+    _dbus_assert_not_reached ("no memory");
+  if (changed != NULL)
+    cache_test_append_int32 (&dict, changed, v);
+  if (!dbus_message_iter_close_container (&iter, &dict) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING, &array))
+    _dbus_assert_not_reached ("no memory");
+  if (invalidated != NULL &&
+      !dbus_message_iter_append_basic (&array, DBUS_TYPE_STRING, &invalidated))
+    _dbus_assert_not_reached ("no memory");
+  if (!dbus_message_iter_close_container (&iter, &array) ||
+      !dbus_connection_send (peer, signal, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_unref (signal);
+}
+
+static dbus_int32_t
+cache_test_get_int32 (DBusPropertyCache *cache,
+                      const char        *name)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
+  dbus_int32_t v;
+
+  message = dbus_property_cache_get (cache, name, &iter, NULL);
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_INT32);
+  dbus_message_iter_get_basic (&iter, &v);
+  dbus_message_unref (message);
+
+  return v;
+}
+
+/**
+ * Unit test for DBusPropertyCache.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_property_cache_test (const char *test_data_dir)
+{
+  DBusServer *server;
+  DBusConnection *connection;
+  DBusConnection *peer;
+  DBusPropertyCache *cache;
+  DBusMessage *message;
+  DBusMessage *reply;
+  DBusMessageIter iter, dict;
+
+  server = dbus_server_listen ("debug-pipe:name=test-property-cache", NULL);
+  if (server == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  peer = NULL;
+  dbus_server_set_new_connection_function (server, cache_test_new_connection,
+                                           &peer, NULL);
+
+  connection = dbus_connection_open_private ("debug-pipe:name=test-property-cache",
+                                             NULL);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  /* Not on a bus, so no match rules; GetAll goes out straight away */
+  cache = dbus_property_cache_new (connection, "org.freedesktop.Test",
+                                   "/org/freedesktop/Test",
+                                   "org.freedesktop.Test", NULL);
+  if (cache == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_assert (peer != NULL);
+  message = cache_test_pop (connection, peer);
+  _dbus_assert (dbus_message_is_method_call (message, DBUS_INTERFACE_PROPERTIES,
+                                             "GetAll"));
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_iter_init_append (reply, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}", &dict))
+    _dbus_assert_not_reached ("no memory");
+  cache_test_append_int32 (&dict, "Answer", 42);
+  cache_test_append_int32 (&dict, "Question", 6);
+  if (!dbus_message_iter_close_container (&iter, &dict) ||
+      !dbus_connection_send (peer, reply, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (reply);
+  dbus_message_unref (message);
+
+  /* The first read waits for GetAll */
+  dbus_connection_flush (peer);
+  _dbus_assert (cache_test_get_int32 (cache, "Answer") == 42);
+  _dbus_assert (cache_test_get_int32 (cache, "Question") == 6);
+
+  /* Changes arrive with the signal; other interfaces are ignored */
+  cache_test_emit (peer, "org.freedesktop.Other", "Answer", 0, NULL);
+  cache_test_emit (peer, "org.freedesktop.Test", "Answer", 43, "Question");
+  while (_dbus_hash_table_lookup_string (cache->values, "Question") != NULL)
+    cache_test_dispatch (connection, peer);
+
+  _dbus_assert (cache_test_get_int32 (cache, "Answer") == 43);
+  _dbus_assert (_dbus_hash_table_lookup_string (cache->values, "Question") == NULL);
+
+  /* and none of those reads went to the peer */
+  cache_test_iterate (connection, peer);
+  _dbus_assert (dbus_connection_pop_message (peer) == NULL);
+
+  /* Invalidating everything asks again */
+  dbus_property_cache_invalidate (cache);
+  _dbus_assert (_dbus_hash_table_get_n_entries (cache->values) == 0);
+  message = cache_test_pop (connection, peer);
+  _dbus_assert (dbus_message_is_method_call (message, DBUS_INTERFACE_PROPERTIES,
+                                             "GetAll"));
+  dbus_message_unref (message);
+
+  dbus_property_cache_unref (cache);
+
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+  dbus_connection_close (peer);
+  dbus_connection_unref (peer);
+  dbus_server_disconnect (server);
+  dbus_server_unref (server);
+
+  return TRUE;
+}
+#endif /* DBUS_BUILD_TESTS */
@@ -0,0 +1,65 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-property-cache.h Client-side cache of a remote object's properties
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#if !defined (DBUS_INSIDE_DBUS_H) && !defined (DBUS_COMPILATION)
+#error "Only <dbus/dbus.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#ifndef DBUS_PROPERTY_CACHE_H
+#define DBUS_PROPERTY_CACHE_H
+
+#include <dbus/dbus-macros.h>
+#include <dbus/dbus-types.h>
+#include <dbus/dbus-connection.h>
+#include <dbus/dbus-errors.h>
+#include <dbus/dbus-message.h>
+
+DBUS_BEGIN_DECLS
+
+/**
+ * @addtogroup DBusPropertyCache
+ * @{
+ */
+
+typedef struct DBusPropertyCache DBusPropertyCache;
+
+DBUS_EXPORT
+DBusPropertyCache* dbus_property_cache_new        (DBusConnection    *connection,
+                                                   const char        *destination,
+                                                   const char        *path,
+                                                   const char        *interface,
+                                                   DBusError         *error);
+DBUS_EXPORT
+DBusPropertyCache* dbus_property_cache_ref        (DBusPropertyCache *cache);
+DBUS_EXPORT
+void               dbus_property_cache_unref      (DBusPropertyCache *cache);
+DBUS_EXPORT
+DBusMessage*       dbus_property_cache_get        (DBusPropertyCache *cache,
+                                                   const char        *name,
+                                                   DBusMessageIter   *iter,
+                                                   DBusError         *error);
+DBUS_EXPORT
+void               dbus_property_cache_invalidate (DBusPropertyCache *cache);
+
+/** @} */
+
+DBUS_END_DECLS
+
+#endif /* DBUS_PROPERTY_CACHE_H */
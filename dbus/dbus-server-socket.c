@@ -55,8 +55,19 @@ struct DBusServerSocket
   DBusWatch **watch; /**< File descriptor watch. */
   char *socket_name; /**< Name of domain socket, to unlink if appropriate */
   DBusNonceFile *noncefile; /**< Nonce file used to authenticate clients */
+  dbus_bool_t compression_possible; /**< Agree to compress accepted connections */
+  dbus_bool_t multiplex_possible; /**< Agree to carry channels over accepted connections */
+  DBusTcpOptions tcp_options; /**< Tuning for accepted connections, from the address */
 };
 
+/**
+ * How many pending connections to accept each time the listening
+ * socket becomes readable. Accepting until EAGAIN makes a reconnect
+ * storm cost one main loop iteration per batch rather than per client;
+ * the limit keeps it from starving connections already set up.
+ */
+#define MAX_ACCEPTS_PER_ITERATION 32
+
 static void
 socket_finalize (DBusServer *server)
 {
@@ -81,6 +92,53 @@ socket_finalize (DBusServer *server)
   dbus_free (server);
 }
 
+static void
+unref_server (void *data)
+{
+  dbus_server_unref (data);
+}
+
+/* Takes a channel a client opened over one of our connections, as if
+ * it had connected on its own; the return value is just for memory
+ */
+static dbus_bool_t
+handle_new_channel (DBusTransport *channel,
+                    void          *data)
+{
+  DBusServer *server = data;
+  DBusConnection *connection;
+  DBusNewConnectionFunction new_connection_function;
+  void *new_connection_data;
+
+  connection = _dbus_connection_new_for_transport (channel);
+  if (connection == NULL)
+    return FALSE;
+
+  SERVER_LOCK (server);
+
+  if (server->disconnected)
+    new_connection_function = NULL;
+  else
+    new_connection_function = server->new_connection_function;
+  new_connection_data = server->new_connection_data;
+
+  _dbus_server_ref_unlocked (server);
+  SERVER_UNLOCK (server);
+
+  if (new_connection_function)
+    {
+      (* new_connection_function) (server, connection,
+                                   new_connection_data);
+    }
+  dbus_server_unref (server);
+
+  /* If no one grabbed a reference, the channel will die. */
+  _dbus_connection_close_if_only_one_ref (connection);
+  dbus_connection_unref (connection);
+
+  return TRUE;
+}
+
 /* Return value is just for memory, not other failures. */
 static dbus_bool_t
 handle_new_client_fd_and_unlock (DBusServer *server,
@@ -97,12 +155,7 @@ handle_new_client_fd_and_unlock (DBusServer *server,
 
   HAVE_LOCK_CHECK (server);
 
-  if (!_dbus_set_fd_nonblocking (client_fd, NULL))
-    {
-      SERVER_UNLOCK (server);
-      return TRUE;
-    }
-
+  /* _dbus_accept() already made client_fd nonblocking */
   transport = _dbus_transport_new_for_socket (client_fd, &server->guid_hex, FALSE);
   if (transport == NULL)
     {
@@ -119,6 +172,16 @@ handle_new_client_fd_and_unlock (DBusServer *server,
       return FALSE;
     }
 
+  if (socket_server->compression_possible)
+    _dbus_transport_set_compression_possible (transport);
+
+  if (socket_server->multiplex_possible)
+    {
+      _dbus_server_ref_unlocked (server);
+      _dbus_transport_set_multiplex_possible (transport, handle_new_channel,
+                                              server, unref_server);
+    }
+
   /* note that client_fd is now owned by the transport, and will be
    * closed on transport disconnection/finalization
    */
@@ -186,32 +249,51 @@ socket_handle_watch (DBusWatch    *watch,
     {
       int client_fd;
       int listen_fd;
+      int n_accepted;
 
       listen_fd = dbus_watch_get_socket (watch);
 
-      if (socket_server->noncefile)
-          client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
-      else 
-          client_fd = _dbus_accept (listen_fd);
+      /* handle_new_client_fd_and_unlock() drops the lock and calls out
+       * to the application, which may unref or disconnect the server
+       */
+      _dbus_server_ref_unlocked (server);
 
-      if (client_fd < 0)
+      for (n_accepted = 0; n_accepted < MAX_ACCEPTS_PER_ITERATION; n_accepted++)
         {
-          /* EINTR handled for us */
+          if (server->disconnected)
+            break;
 
-          if (_dbus_get_is_errno_eagain_or_ewouldblock ())
-            _dbus_verbose ("No client available to accept after all\n");
+          if (socket_server->noncefile)
+              client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
           else
-            _dbus_verbose ("Failed to accept a client connection: %s\n",
-                           _dbus_strerror_from_errno ());
+              client_fd = _dbus_accept (listen_fd);
+
+          if (client_fd < 0)
+            {
+              /* EINTR handled for us */
+
+              if (_dbus_get_is_errno_eagain_or_ewouldblock ())
+                _dbus_verbose ("No client available to accept after all\n");
+              else
+                _dbus_verbose ("Failed to accept a client connection: %s\n",
+                               _dbus_strerror_from_errno ());
+
+              break;
+            }
+
+          _dbus_set_tcp_options (client_fd, &socket_server->tcp_options);
 
-          SERVER_UNLOCK (server);
-        }
-      else
-        {
           if (!handle_new_client_fd_and_unlock (server, client_fd))
             _dbus_verbose ("Rejected client connection due to lack of memory\n");
+
+          SERVER_LOCK (server);
         }
+
+      SERVER_UNLOCK (server);
+      dbus_server_unref (server);
     }
+  else
+    SERVER_UNLOCK (server);
 
   if (flags & DBUS_WATCH_ERROR)
     _dbus_verbose ("Error on server listening socket\n");
@@ -289,6 +371,11 @@ _dbus_server_new_for_socket (int              *fds,
     return NULL;
 
   socket_server->noncefile = noncefile;
+  socket_server->tcp_options.nodelay = -1;
+  socket_server->tcp_options.keepalive = -1;
+  socket_server->tcp_options.sndbuf = -1;
+  socket_server->tcp_options.rcvbuf = -1;
+  socket_server->tcp_options.busy_poll = -1;
 
   socket_server->fds = dbus_new (int, n_fds);
   if (!socket_server->fds)
@@ -482,6 +569,16 @@ _dbus_server_new_for_tcp_socket (const char     *host,
       goto failed_2;
     }
 
+  /* Clients only ask for compression where it pays off, so agree to
+   * it on any network connection
+   */
+  ((DBusServerSocket*) server)->compression_possible = TRUE;
+
+  /* Likewise channels, which save a remote client's helpers the round
+   * trips of connecting and authenticating
+   */
+  ((DBusServerSocket*) server)->multiplex_possible = TRUE;
+
   _dbus_string_free (&port_str);
   _dbus_string_free (&address);
   dbus_free(listen_fds);
@@ -531,6 +628,10 @@ _dbus_server_listen_socket (DBusAddressEntry *entry,
       const char *port;
       const char *bind;
       const char *family;
+      DBusTcpOptions options;
+
+      if (!_dbus_tcp_options_from_address (entry, &options, error))
+        return DBUS_SERVER_LISTEN_BAD_ADDRESS;
 
       host = dbus_address_entry_get_value (entry, "host");
       bind = dbus_address_entry_get_value (entry, "bind");
@@ -543,6 +644,7 @@ _dbus_server_listen_socket (DBusAddressEntry *entry,
       if (*server_p)
         {
           _DBUS_ASSERT_ERROR_IS_CLEAR(error);
+          ((DBusServerSocket *) *server_p)->tcp_options = options;
           return DBUS_SERVER_LISTEN_OK;
         }
       else
@@ -576,6 +678,27 @@ _dbus_server_socket_own_filename (DBusServer *server,
   socket_server->socket_name = filename;
 }
 
+/**
+ * Gets the sockets a server listens on, so that they can be handed
+ * to another process. The server keeps owning them.
+ *
+ * @param server a server
+ * @param fds return location for the sockets
+ * @returns number of sockets, 0 if this is not a socket server
+ */
+int
+_dbus_server_socket_get_fds (DBusServer  *server,
+                             const int  **fds)
+{
+  DBusServerSocket *socket_server = (DBusServerSocket*) server;
+
+  if (server->vtable != &socket_vtable)
+    return 0;
+
+  *fds = socket_server->fds;
+  return socket_server->n_fds;
+}
+
 
 /** @} */
 
@@ -46,6 +46,8 @@ DBusServerListenResult _dbus_server_listen_socket (DBusAddressEntry  *entry,
 
 void _dbus_server_socket_own_filename (DBusServer *server,
                                        char       *filename);
+int  _dbus_server_socket_get_fds      (DBusServer  *server,
+                                       const int  **fds);
 
 DBUS_END_DECLS
 
@@ -26,6 +26,7 @@
 #include "dbus-internals.h"
 #include "dbus-server-win.h"
 #include "dbus-server-socket.h"
+#include "dbus-sysdeps-win.h"
 
 /**
  * @defgroup DBusServerWin DBusServer implementations for Windows
@@ -83,6 +84,64 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
           return DBUS_SERVER_LISTEN_DID_NOT_CONNECT;
         }
     }
+#ifdef HAVE_AFUNIX_H
+  else if (strcmp (method, "unix") == 0)
+    {
+      const char *path;
+      DBusString address;
+      DBusString path_str;
+      char *path_copy;
+      int listen_fd;
+
+      path = dbus_address_entry_get_value (entry, "path");
+      if (path == NULL)
+        {
+          _dbus_set_bad_address (error, NULL, NULL,
+                                 "unix: address on Windows must specify path=");
+          return DBUS_SERVER_LISTEN_BAD_ADDRESS;
+        }
+
+      if (!_dbus_string_init (&address))
+        {
+          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          return DBUS_SERVER_LISTEN_DID_NOT_CONNECT;
+        }
+
+      _dbus_string_init_const (&path_str, path);
+      if (!_dbus_string_append (&address, "unix:path=") ||
+          !_dbus_address_append_escaped (&address, &path_str) ||
+          (path_copy = _dbus_strdup (path)) == NULL)
+        {
+          _dbus_string_free (&address);
+          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          return DBUS_SERVER_LISTEN_DID_NOT_CONNECT;
+        }
+
+      listen_fd = _dbus_listen_unix_socket (path, FALSE, error);
+      if (listen_fd < 0)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          dbus_free (path_copy);
+          _dbus_string_free (&address);
+          return DBUS_SERVER_LISTEN_DID_NOT_CONNECT;
+        }
+
+      *server_p = _dbus_server_new_for_socket (&listen_fd, 1, &address, 0);
+      _dbus_string_free (&address);
+
+      if (*server_p == NULL)
+        {
+          _dbus_close_socket (listen_fd, NULL);
+          dbus_free (path_copy);
+          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          return DBUS_SERVER_LISTEN_DID_NOT_CONNECT;
+        }
+
+      _dbus_server_socket_own_filename (*server_p, path_copy);
+
+      return DBUS_SERVER_LISTEN_OK;
+    }
+#endif
   else
     {
   _DBUS_ASSERT_ERROR_IS_CLEAR(error);
@@ -1130,15 +1130,12 @@ dbus_server_get_data (DBusServer   *server,
   void *res;
 
   _dbus_return_val_if_fail (server != NULL, NULL);
-  
-  SERVER_LOCK (server);
-  
+
+  /* slot lists are safe to read without the lock */
   res = _dbus_data_slot_list_get (&slot_allocator,
                                   &server->slot_list,
                                   slot);
 
-  SERVER_UNLOCK (server);
-  
   return res;
 }
 
@@ -0,0 +1,256 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-socket-set-epoll.c  Socket set implemented with Linux epoll(4)
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-socket-set.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+
+#ifdef DBUS_HAVE_LINUX_EPOLL
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+/* Sockets stay registered with the kernel across iterations, so a
+ * wakeup costs O(ready sockets) instead of O(registered sockets).
+ */
+
+typedef struct {
+    DBusSocketSet parent;
+    int epfd;
+} DBusSocketSetEpoll;
+
+/* epoll_create() ignores its argument since 2.6.8 but it must be > 0 */
+#define EPOLL_SIZE_HINT 64
+
+static DBusSocketSetEpoll *
+socket_set_epoll_cast (DBusSocketSet *set)
+{
+  return (DBusSocketSetEpoll *) set;
+}
+
+static uint32_t
+watch_flags_to_epoll_events (unsigned int flags)
+{
+  uint32_t events = 0;
+
+  if (flags & DBUS_WATCH_READABLE)
+    events |= EPOLLIN;
+  if (flags & DBUS_WATCH_WRITABLE)
+    events |= EPOLLOUT;
+
+  return events;
+}
+
+static unsigned int
+epoll_events_to_watch_flags (uint32_t events)
+{
+  unsigned int condition = 0;
+
+  if (events & EPOLLIN)
+    condition |= DBUS_WATCH_READABLE;
+  if (events & EPOLLOUT)
+    condition |= DBUS_WATCH_WRITABLE;
+  if (events & EPOLLHUP)
+    condition |= DBUS_WATCH_HANGUP;
+  if (events & EPOLLERR)
+    condition |= DBUS_WATCH_ERROR;
+
+  return condition;
+}
+
+static void
+socket_set_epoll_free (DBusSocketSet *set)
+{
+  DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
+
+  if (self->epfd >= 0)
+    close (self->epfd);
+
+  dbus_free (self);
+}
+
+static dbus_bool_t
+socket_set_epoll_add (DBusSocketSet *set,
+                      int            fd,
+                      unsigned int   flags,
+                      dbus_bool_t    enabled)
+{
+  DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
+  struct epoll_event event;
+
+  /* A disabled socket is simply not registered yet: epoll would
+   * still report EPOLLHUP and EPOLLERR for it, which would make the
+   * loop spin on a connection we deliberately stopped reading.
+   */
+  if (!enabled)
+    return TRUE;
+
+  _DBUS_ZERO (event);
+  event.data.fd = fd;
+  event.events = watch_flags_to_epoll_events (flags);
+
+  if (epoll_ctl (self->epfd, EPOLL_CTL_ADD, fd, &event) == 0)
+    return TRUE;
+
+  /* ENOMEM and ENOSPC are the only errors we can recover from, by
+   * making the caller retry; anything else is a programming error.
+   */
+  if (errno != ENOMEM && errno != ENOSPC)
+    _dbus_warn ("epoll_ctl (EPOLL_CTL_ADD) failed on fd %d: %s\n",
+                fd, _dbus_strerror (errno));
+
+  return FALSE;
+}
+
+static void
+socket_set_epoll_remove (DBusSocketSet *set,
+                         int            fd)
+{
+  DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
+  struct epoll_event dummy;
+
+  _DBUS_ZERO (dummy);
+
+  /* ENOENT means it was disabled; EBADF means it was closed before the
+   * watch was removed, and close() already dropped the registration.
+   */
+  if (epoll_ctl (self->epfd, EPOLL_CTL_DEL, fd, &dummy) != 0 &&
+      errno != ENOENT && errno != EBADF)
+    _dbus_warn ("epoll_ctl (EPOLL_CTL_DEL) failed on fd %d: %s\n",
+                fd, _dbus_strerror (errno));
+}
+
+static void
+socket_set_epoll_enable (DBusSocketSet *set,
+                         int            fd,
+                         unsigned int   flags)
+{
+  DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
+  struct epoll_event event;
+
+  _DBUS_ZERO (event);
+  event.data.fd = fd;
+  event.events = watch_flags_to_epoll_events (flags);
+
+  if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event) == 0)
+    return;
+
+  if (errno == ENOENT &&
+      epoll_ctl (self->epfd, EPOLL_CTL_ADD, fd, &event) == 0)
+    return;
+
+  /* There is no way to report this to the watch owner; the socket
+   * will simply not be serviced until the next toggle.
+   */
+  _dbus_warn ("failed to enable fd %d in epoll set: %s\n",
+              fd, _dbus_strerror (errno));
+}
+
+static void
+socket_set_epoll_disable (DBusSocketSet *set,
+                          int            fd)
+{
+  socket_set_epoll_remove (set, fd);
+}
+
+/* events we copy out per epoll_wait() call */
+#define N_STACK_EVENTS 64
+
+static int
+socket_set_epoll_poll (DBusSocketSet   *set,
+                       DBusSocketEvent *revents,
+                       int              max_events,
+                       int              timeout_ms)
+{
+  DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
+  struct epoll_event events[N_STACK_EVENTS];
+  int n_ready;
+  int i;
+
+  if (max_events > N_STACK_EVENTS)
+    max_events = N_STACK_EVENTS;
+
+  n_ready = epoll_wait (self->epfd, events, max_events, timeout_ms);
+
+  if (n_ready <= 0)
+    return 0;
+
+  for (i = 0; i < n_ready; i++)
+    {
+      revents[i].fd = events[i].data.fd;
+      revents[i].flags = epoll_events_to_watch_flags (events[i].events);
+    }
+
+  return n_ready;
+}
+
+static DBusSocketSetClass _dbus_socket_set_epoll_class = {
+  socket_set_epoll_free,
+  socket_set_epoll_add,
+  socket_set_epoll_remove,
+  socket_set_epoll_enable,
+  socket_set_epoll_disable,
+  socket_set_epoll_poll
+};
+
+DBusSocketSet *
+_dbus_socket_set_epoll_new (void)
+{
+  DBusSocketSetEpoll *self;
+
+  self = dbus_new0 (DBusSocketSetEpoll, 1);
+
+  if (self == NULL)
+    return NULL;
+
+  self->parent.cls = &_dbus_socket_set_epoll_class;
+
+  self->epfd = epoll_create (EPOLL_SIZE_HINT);
+
+  if (self->epfd < 0)
+    {
+      /* e.g. ENOSYS on kernels built without epoll; fall back to poll */
+      _dbus_verbose ("epoll_create failed: %s\n", _dbus_strerror (errno));
+      dbus_free (self);
+      return NULL;
+    }
+
+  _dbus_fd_set_close_on_exec (self->epfd);
+
+  return (DBusSocketSet *) self;
+}
+
+#else /* !DBUS_HAVE_LINUX_EPOLL */
+
+DBusSocketSet *
+_dbus_socket_set_epoll_new (void)
+{
+  return NULL;
+}
+
+#endif /* !DBUS_HAVE_LINUX_EPOLL */
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
@@ -0,0 +1,290 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-socket-set-poll.c  Socket set implemented with poll()
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-socket-set.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+
+/* The portable backend. It has to hand the whole set to the kernel
+ * on every iteration, so it is O(n) per wakeup, but it works
+ * everywhere _dbus_poll() does.
+ */
+
+typedef struct {
+    DBusSocketSet parent;
+    /* every registered socket; events is 0 while disabled */
+    DBusPollFD *fds;
+    int n_fds;
+    int n_allocated;
+    /* enabled sockets, rebuilt on each poll */
+    DBusPollFD *ready;
+    int n_ready_allocated;
+} DBusSocketSetPoll;
+
+#define MINIMUM_SIZE 8
+
+static DBusSocketSetPoll *
+socket_set_poll_cast (DBusSocketSet *set)
+{
+  return (DBusSocketSetPoll *) set;
+}
+
+static short
+watch_flags_to_poll_events (unsigned int flags)
+{
+  short events = 0;
+
+  if (flags & DBUS_WATCH_READABLE)
+    events |= _DBUS_POLLIN;
+  if (flags & DBUS_WATCH_WRITABLE)
+    events |= _DBUS_POLLOUT;
+
+  return events;
+}
+
+static unsigned int
+poll_revents_to_watch_flags (short revents)
+{
+  unsigned int condition = 0;
+
+  if (revents & _DBUS_POLLIN)
+    condition |= DBUS_WATCH_READABLE;
+  if (revents & _DBUS_POLLOUT)
+    condition |= DBUS_WATCH_WRITABLE;
+  if (revents & _DBUS_POLLHUP)
+    condition |= DBUS_WATCH_HANGUP;
+  if (revents & _DBUS_POLLERR)
+    condition |= DBUS_WATCH_ERROR;
+
+  return condition;
+}
+
+static int
+socket_set_poll_find (DBusSocketSetPoll *self,
+                      int                fd)
+{
+  int i;
+
+  for (i = 0; i < self->n_fds; i++)
+    {
+      if (self->fds[i].fd == fd)
+        return i;
+    }
+
+  return -1;
+}
+
+static void
+socket_set_poll_free (DBusSocketSet *set)
+{
+  DBusSocketSetPoll *self = socket_set_poll_cast (set);
+
+  dbus_free (self->fds);
+  dbus_free (self->ready);
+  dbus_free (self);
+}
+
+static dbus_bool_t
+socket_set_poll_add (DBusSocketSet *set,
+                     int            fd,
+                     unsigned int   flags,
+                     dbus_bool_t    enabled)
+{
+  DBusSocketSetPoll *self = socket_set_poll_cast (set);
+
+  _dbus_assert (socket_set_poll_find (self, fd) < 0);
+
+  if (self->n_fds == self->n_allocated)
+    {
+      DBusPollFD *new_fds;
+      int new_size;
+
+      new_size = MAX (self->n_allocated * 2, MINIMUM_SIZE);
+      new_fds = dbus_realloc (self->fds, sizeof (DBusPollFD) * new_size);
+
+      if (new_fds == NULL)
+        return FALSE;
+
+      self->fds = new_fds;
+      self->n_allocated = new_size;
+    }
+
+  self->fds[self->n_fds].fd = fd;
+  self->fds[self->n_fds].events = enabled ? watch_flags_to_poll_events (flags) : 0;
+  self->fds[self->n_fds].revents = 0;
+  self->n_fds += 1;
+
+  return TRUE;
+}
+
+static void
+socket_set_poll_remove (DBusSocketSet *set,
+                        int            fd)
+{
+  DBusSocketSetPoll *self = socket_set_poll_cast (set);
+  int i;
+
+  i = socket_set_poll_find (self, fd);
+  _dbus_assert (i >= 0);
+
+  if (i < 0)
+    return;
+
+  /* order doesn't matter, so fill the hole with the last element */
+  self->n_fds -= 1;
+  self->fds[i] = self->fds[self->n_fds];
+}
+
+static void
+socket_set_poll_enable (DBusSocketSet *set,
+                        int            fd,
+                        unsigned int   flags)
+{
+  DBusSocketSetPoll *self = socket_set_poll_cast (set);
+  int i;
+
+  i = socket_set_poll_find (self, fd);
+  _dbus_assert (i >= 0);
+
+  if (i >= 0)
+    self->fds[i].events = watch_flags_to_poll_events (flags);
+}
+
+static void
+socket_set_poll_disable (DBusSocketSet *set,
+                         int            fd)
+{
+  DBusSocketSetPoll *self = socket_set_poll_cast (set);
+  int i;
+
+  i = socket_set_poll_find (self, fd);
+  _dbus_assert (i >= 0);
+
+  if (i >= 0)
+    self->fds[i].events = 0;
+}
+
+static int
+socket_set_poll_poll (DBusSocketSet   *set,
+                      DBusSocketEvent *revents,
+                      int              max_events,
+                      int              timeout_ms)
+{
+  DBusSocketSetPoll *self = socket_set_poll_cast (set);
+  int i;
+  int n_enabled;
+  int n_ready;
+  int n_events;
+
+  if (self->n_ready_allocated < self->n_fds)
+    {
+      DBusPollFD *new_ready;
+
+      new_ready = dbus_realloc (self->ready, sizeof (DBusPollFD) * self->n_allocated);
+
+      if (new_ready == NULL)
+        {
+          /* not much we can do except wait and let the caller try
+           * again with more memory next time
+           */
+          _dbus_sleep_milliseconds (timeout_ms < 0 ? 500 : MIN (timeout_ms, 500));
+          return 0;
+        }
+
+      self->ready = new_ready;
+      self->n_ready_allocated = self->n_allocated;
+    }
+
+  /* Disabled sockets must not be passed in at all, because poll()
+   * reports hangups even for fds with no requested events.
+   */
+  n_enabled = 0;
+  for (i = 0; i < self->n_fds; i++)
+    {
+      if (self->fds[i].events != 0)
+        {
+          self->ready[n_enabled] = self->fds[i];
+          self->ready[n_enabled].revents = 0;
+          n_enabled += 1;
+        }
+    }
+
+  n_ready = _dbus_poll (self->ready, n_enabled, timeout_ms);
+
+  if (n_ready <= 0)
+    return 0;
+
+  n_events = 0;
+  for (i = 0; i < n_enabled && n_events < max_events; i++)
+    {
+      if (self->ready[i].revents != 0)
+        {
+          revents[n_events].fd = self->ready[i].fd;
+          revents[n_events].flags = poll_revents_to_watch_flags (self->ready[i].revents);
+          n_events += 1;
+        }
+    }
+
+  return n_events;
+}
+
+static DBusSocketSetClass _dbus_socket_set_poll_class = {
+  socket_set_poll_free,
+  socket_set_poll_add,
+  socket_set_poll_remove,
+  socket_set_poll_enable,
+  socket_set_poll_disable,
+  socket_set_poll_poll
+};
+
+DBusSocketSet *
+_dbus_socket_set_poll_new (int size_hint)
+{
+  DBusSocketSetPoll *ret;
+
+  if (size_hint <= 0)
+    size_hint = MINIMUM_SIZE;
+
+  ret = dbus_new0 (DBusSocketSetPoll, 1);
+
+  if (ret == NULL)
+    return NULL;
+
+  ret->parent.cls = &_dbus_socket_set_poll_class;
+  ret->n_fds = 0;
+  ret->n_allocated = size_hint;
+
+  ret->fds = dbus_new0 (DBusPollFD, size_hint);
+
+  if (ret->fds == NULL)
+    {
+      dbus_free (ret);
+      return NULL;
+    }
+
+  return (DBusSocketSet *) ret;
+}
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
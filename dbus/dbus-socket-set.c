@@ -0,0 +1,124 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-socket-set.c  Set of sockets the main loop waits on
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-socket-set.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+
+/**
+ * Creates a socket set using the most scalable backend available.
+ * Setting DBUS_LOOP_BACKEND=poll in the environment forces the
+ * portable poll() backend, which is mostly useful for debugging.
+ *
+ * @param size_hint expected number of sockets
+ * @returns the new set, or #NULL on OOM
+ */
+DBusSocketSet *
+_dbus_socket_set_new (int size_hint)
+{
+  DBusSocketSet *ret;
+  const char *backend;
+
+  backend = _dbus_getenv ("DBUS_LOOP_BACKEND");
+
+  if (backend == NULL || strcmp (backend, "poll") != 0)
+    {
+      ret = _dbus_socket_set_epoll_new ();
+
+      if (ret != NULL)
+        return ret;
+    }
+
+  return _dbus_socket_set_poll_new (size_hint);
+}
+
+void
+_dbus_socket_set_free (DBusSocketSet *self)
+{
+  (* self->cls->free) (self);
+}
+
+/**
+ * Registers a socket. Each socket may only be added once; the
+ * caller is responsible for merging the flags of several watches
+ * on the same socket.
+ */
+dbus_bool_t
+_dbus_socket_set_add (DBusSocketSet *self,
+                      int            fd,
+                      unsigned int   flags,
+                      dbus_bool_t    enabled)
+{
+  return (* self->cls->add) (self, fd, flags, enabled);
+}
+
+void
+_dbus_socket_set_remove (DBusSocketSet *self,
+                         int            fd)
+{
+  (* self->cls->remove) (self, fd);
+}
+
+/**
+ * Sets the conditions we are interested in for an already
+ * registered socket.
+ */
+void
+_dbus_socket_set_enable (DBusSocketSet *self,
+                         int            fd,
+                         unsigned int   flags)
+{
+  (* self->cls->enable) (self, fd, flags);
+}
+
+/**
+ * Stops reporting any events, including hangups and errors, for a
+ * registered socket until it is enabled again.
+ */
+void
+_dbus_socket_set_disable (DBusSocketSet *self,
+                          int            fd)
+{
+  (* self->cls->disable) (self, fd);
+}
+
+/**
+ * Waits for events on the enabled sockets.
+ *
+ * @param revents array to receive the events
+ * @param max_events size of revents
+ * @param timeout_ms timeout in milliseconds, -1 to block forever
+ * @returns number of events stored in revents, 0 on timeout or error
+ */
+int
+_dbus_socket_set_poll (DBusSocketSet   *self,
+                       DBusSocketEvent *revents,
+                       int              max_events,
+                       int              timeout_ms)
+{
+  return (* self->cls->poll) (self, revents, max_events, timeout_ms);
+}
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
@@ -0,0 +1,94 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-socket-set.h  Set of sockets the main loop waits on
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef DBUS_SOCKET_SET_H
+#define DBUS_SOCKET_SET_H
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <dbus/dbus.h>
+
+/**
+ * One readiness event reported by _dbus_socket_set_poll().
+ * The flags are #DBusWatchFlags values.
+ */
+typedef struct {
+    int fd;             /**< the socket that became ready */
+    unsigned int flags; /**< conditions that are ready, as #DBusWatchFlags */
+} DBusSocketEvent;
+
+typedef struct DBusSocketSet DBusSocketSet;
+
+/**
+ * Virtual table for a socket set backend. Each socket is registered
+ * once with add() and stays registered until remove(); enable() and
+ * disable() only change the interest set, so that backends with
+ * persistent kernel registration (epoll) do not have to rebuild
+ * anything per iteration.
+ */
+typedef struct {
+    void        (* free)    (DBusSocketSet   *self);
+    dbus_bool_t (* add)     (DBusSocketSet   *self,
+                             int              fd,
+                             unsigned int     flags,
+                             dbus_bool_t      enabled);
+    void        (* remove)  (DBusSocketSet   *self,
+                             int              fd);
+    void        (* enable)  (DBusSocketSet   *self,
+                             int              fd,
+                             unsigned int     flags);
+    void        (* disable) (DBusSocketSet   *self,
+                             int              fd);
+    int         (* poll)    (DBusSocketSet   *self,
+                             DBusSocketEvent *revents,
+                             int              max_events,
+                             int              timeout_ms);
+} DBusSocketSetClass;
+
+struct DBusSocketSet {
+    DBusSocketSetClass *cls; /**< backend implementation */
+};
+
+DBusSocketSet *_dbus_socket_set_new          (int              size_hint);
+void           _dbus_socket_set_free         (DBusSocketSet   *self);
+dbus_bool_t    _dbus_socket_set_add          (DBusSocketSet   *self,
+                                              int              fd,
+                                              unsigned int     flags,
+                                              dbus_bool_t      enabled);
+void           _dbus_socket_set_remove       (DBusSocketSet   *self,
+                                              int              fd);
+void           _dbus_socket_set_enable       (DBusSocketSet   *self,
+                                              int              fd,
+                                              unsigned int     flags);
+void           _dbus_socket_set_disable      (DBusSocketSet   *self,
+                                              int              fd);
+int            _dbus_socket_set_poll         (DBusSocketSet   *self,
+                                              DBusSocketEvent *revents,
+                                              int              max_events,
+                                              int              timeout_ms);
+
+/* backends, which return NULL if unavailable at runtime */
+DBusSocketSet *_dbus_socket_set_poll_new     (int              size_hint);
+DBusSocketSet *_dbus_socket_set_epoll_new    (void);
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
+
+#endif /* DBUS_SOCKET_SET_H */
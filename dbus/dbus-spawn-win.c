@@ -615,6 +615,27 @@ babysitter (void *parameter)
   return 0;
 }
 
+dbus_bool_t
+_dbus_spawn_start_launcher (DBusError *error)
+{
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "A spawn launcher is not available on Windows");
+  return FALSE;
+}
+
+dbus_bool_t
+_dbus_spawn_set_babysitter_helper (const char *path)
+{
+  return FALSE;
+}
+
+int
+_dbus_babysitter_helper_main (int    argc,
+                              char **argv)
+{
+  return 1;
+}
+
 dbus_bool_t
 _dbus_spawn_async_with_babysitter (DBusBabysitter           **sitter_p,
                                    char                     **argv,
@@ -35,6 +35,8 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
@@ -1089,6 +1091,529 @@ babysit (pid_t grandchild_pid,
   exit (1);
 }
 
+/* Runs in the immediate child of whoever spawns: forks the process
+ * that will exec() and babysits it.
+ */
+static void
+spawn_and_babysit (char                    **argv,
+                   char                    **env,
+                   DBusSpawnChildSetupFunc   child_setup,
+                   void                     *user_data,
+                   int                       child_err_report_fd,
+                   int                       babysitter_fd)
+{
+  pid_t grandchild_pid;
+
+  /* Be sure we crash if the parent exits
+   * and we write to the err_report_pipe
+   */
+  signal (SIGPIPE, SIG_DFL);
+
+  /* Create the child that will exec () */
+  grandchild_pid = fork ();
+
+  if (grandchild_pid < 0)
+    {
+      write_err_and_exit (babysitter_fd,
+                          CHILD_FORK_FAILED);
+      _dbus_assert_not_reached ("Got to code after write_err_and_exit()");
+    }
+  else if (grandchild_pid == 0)
+    {
+      do_exec (child_err_report_fd,
+               argv,
+               env,
+               child_setup, user_data);
+      _dbus_assert_not_reached ("Got to code after exec() - should have exited on error");
+    }
+  else
+    {
+      babysit (grandchild_pid, babysitter_fd);
+      _dbus_assert_not_reached ("Got to code after babysit()");
+    }
+}
+
+#ifdef HAVE_UNIX_FD_PASSING
+
+/*
+ * The launcher is a process forked while the caller is still small,
+ * typically as the bus daemon finishes starting up. Spawning through
+ * it means the babysitter is forked from the launcher rather than from
+ * a daemon that has grown to hold every connection and match rule, so
+ * the fork has far fewer pages to copy or mark copy-on-write.
+ *
+ * A request is three ints (argc, number of environment strings or -1
+ * to inherit the launcher's, byte length of the strings) followed by
+ * the NUL-terminated strings, argv first. The write end of the exec
+ * error pipe and the babysitter end of the babysitter socket travel
+ * with the ints. The launcher forks a babysitter which then carries on
+ * exactly as if the caller had forked it, except that it is not the
+ * caller's child; it quits once the caller closes its socket.
+ */
+
+#define LAUNCHER_HEADER_INTS 3
+
+/* Socket to the launcher, -1 if there is none or it went away */
+static int launcher_socket = -1;
+
+static dbus_bool_t
+launcher_read_all (int         fd,
+                   DBusString *str,
+                   int         len,
+                   int        *fds,
+                   int        *n_fds)
+{
+  int bytes;
+
+  while (_dbus_string_get_length (str) < len)
+    {
+      if (fds != NULL && _dbus_string_get_length (str) == 0)
+        bytes = _dbus_read_socket_with_unix_fds (fd, str,
+                                                 len - _dbus_string_get_length (str),
+                                                 fds, n_fds);
+      else
+        bytes = _dbus_read_socket (fd, str,
+                                   len - _dbus_string_get_length (str));
+
+      if (bytes < 0 && errno == EINTR)
+        continue;
+
+      if (bytes <= 0)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Splits n NUL-terminated strings off the front of data; returns the
+ * number of bytes used, or -1 if they don't fit in len
+ */
+static int
+launcher_split_strings (char  *data,
+                        int    len,
+                        int    n,
+                        char **strings)
+{
+  int i, pos;
+
+  pos = 0;
+  for (i = 0; i < n; i++)
+    {
+      char *end;
+
+      end = memchr (data + pos, '\0', len - pos);
+      if (end == NULL)
+        return -1;
+
+      strings[i] = data + pos;
+      pos = end - data + 1;
+    }
+  strings[n] = NULL;
+
+  return pos;
+}
+
+static void
+launcher_main (int sock)
+{
+  _dbus_verbose_reset ();
+  _dbus_verbose ("Launcher process has PID " DBUS_PID_FORMAT "\n",
+                 _dbus_getpid ());
+
+  /* babysitters report to whoever asked for them, not to us; let the
+   * kernel reap them
+   */
+  signal (SIGCHLD, SIG_IGN);
+  signal (SIGPIPE, SIG_IGN);
+
+  while (TRUE)
+    {
+      DBusString header;
+      DBusString body;
+      const int *ints;
+      int fds[2];
+      int n_fds;
+      char **argv;
+      char **env;
+      int used;
+      pid_t pid;
+
+      if (!_dbus_string_init (&header))
+        exit (1);
+      if (!_dbus_string_init (&body))
+        exit (1);
+
+      n_fds = _DBUS_N_ELEMENTS (fds);
+      if (!launcher_read_all (sock, &header, sizeof (int) * LAUNCHER_HEADER_INTS,
+                              fds, &n_fds))
+        {
+          _dbus_verbose ("Launcher lost its socket, exiting\n");
+          exit (0);
+        }
+
+      ints = (const int *) _dbus_string_get_const_data (&header);
+      if (n_fds != _DBUS_N_ELEMENTS (fds) ||
+          ints[0] < 1 || ints[1] < -1 || ints[2] < 0 ||
+          !launcher_read_all (sock, &body, ints[2], NULL, NULL))
+        {
+          _dbus_warn ("Launcher got a bad request, exiting\n");
+          exit (1);
+        }
+
+      argv = dbus_new (char *, ints[0] + 1);
+      env = ints[1] >= 0 ? dbus_new (char *, ints[1] + 1) : NULL;
+      if (argv == NULL || (ints[1] >= 0 && env == NULL))
+        exit (1);
+
+      used = launcher_split_strings (_dbus_string_get_data (&body),
+                                     ints[2], ints[0], argv);
+      if (used >= 0 && env != NULL)
+        {
+          int more;
+
+          more = launcher_split_strings (_dbus_string_get_data (&body) + used,
+                                         ints[2] - used, ints[1], env);
+          used = more < 0 ? -1 : used + more;
+        }
+
+      if (used != ints[2])
+        {
+          _dbus_warn ("Launcher got a bad request, exiting\n");
+          exit (1);
+        }
+
+      _dbus_verbose ("Launcher spawning %s\n", argv[0]);
+
+      pid = fork ();
+
+      if (pid == 0)
+        {
+          close (sock);
+          signal (SIGCHLD, SIG_DFL);
+          spawn_and_babysit (argv, env, NULL, NULL, fds[0], fds[1]);
+        }
+      else if (pid < 0)
+        {
+          int msg[2];
+
+          /* same report as a babysitter whose fork failed; if the
+           * requester is gone already, never mind
+           */
+          msg[0] = CHILD_FORK_FAILED;
+          msg[1] = errno;
+          if (write (fds[1], msg, sizeof (msg)) < 0)
+            /* ignore */;
+        }
+
+      close (fds[0]);
+      close (fds[1]);
+      dbus_free (argv);
+      dbus_free (env);
+      _dbus_string_free (&header);
+      _dbus_string_free (&body);
+    }
+}
+
+/* Returns FALSE if the launcher can't take the request; the caller
+ * then forks the babysitter itself
+ */
+static dbus_bool_t
+launcher_send_request (char **argv,
+                       char **env,
+                       int    child_err_report_fd,
+                       int    babysitter_fd)
+{
+  DBusString str;
+  int header[LAUNCHER_HEADER_INTS];
+  int fds[2];
+  int i, written, bytes;
+
+  if (launcher_socket < 0)
+    return FALSE;
+
+  if (!_dbus_string_init (&str))
+    return FALSE;
+
+  header[0] = 0;
+  header[1] = -1;
+  header[2] = 0;
+
+  if (!_dbus_string_append_len (&str, (const char *) header, sizeof (header)))
+    goto oom;
+
+  for (i = 0; argv[i] != NULL; i++)
+    {
+      if (!_dbus_string_append_len (&str, argv[i], strlen (argv[i]) + 1))
+        goto oom;
+      header[0] += 1;
+    }
+
+  if (env != NULL)
+    {
+      header[1] = 0;
+      for (i = 0; env[i] != NULL; i++)
+        {
+          if (!_dbus_string_append_len (&str, env[i], strlen (env[i]) + 1))
+            goto oom;
+          header[1] += 1;
+        }
+    }
+
+  header[2] = _dbus_string_get_length (&str) - sizeof (header);
+  memcpy (_dbus_string_get_data (&str), header, sizeof (header));
+
+  fds[0] = child_err_report_fd;
+  fds[1] = babysitter_fd;
+
+  written = 0;
+  while (written < _dbus_string_get_length (&str))
+    {
+      if (written == 0)
+        bytes = _dbus_write_socket_with_unix_fds (launcher_socket, &str, 0,
+                                                  _dbus_string_get_length (&str),
+                                                  fds, _DBUS_N_ELEMENTS (fds));
+      else
+        bytes = _dbus_write_socket (launcher_socket, &str, written,
+                                    _dbus_string_get_length (&str) - written);
+
+      if (bytes < 0 && errno == EINTR)
+        continue;
+
+      if (bytes <= 0)
+        {
+          /* The launcher died, or we are out of step with it now;
+           * stop using it.
+           */
+          _dbus_warn ("Lost the spawn launcher (%s), forking directly from now on\n",
+                      _dbus_strerror (errno));
+          _dbus_close_socket (launcher_socket, NULL);
+          launcher_socket = -1;
+
+          if (written == 0)
+            {
+              _dbus_string_free (&str);
+              return FALSE;
+            }
+
+          /* it may or may not have seen the fds; the babysitter
+           * socket tells the caller either way
+           */
+          break;
+        }
+
+      written += bytes;
+    }
+
+  _dbus_string_free (&str);
+  return TRUE;
+
+ oom:
+  _dbus_string_free (&str);
+  return FALSE;
+}
+
+#endif /* HAVE_UNIX_FD_PASSING */
+
+/**
+ * Starts a launcher process that later calls to
+ * _dbus_spawn_async_with_babysitter() without a child setup function
+ * hand their spawning to. Call this while the process is still small,
+ * since that is what makes forking from the launcher cheaper than
+ * forking from the caller. If the launcher goes away, spawning falls
+ * back to forking directly.
+ *
+ * @param error error object to be filled in if function fails
+ * @returns #TRUE on success, #FALSE if error is filled in
+ */
+dbus_bool_t
+_dbus_spawn_start_launcher (DBusError *error)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  int sockets[2];
+  pid_t pid;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (launcher_socket >= 0)
+    return TRUE;
+
+  if (!_dbus_full_duplex_pipe (&sockets[0], &sockets[1], TRUE, error))
+    return FALSE;
+
+  pid = fork ();
+
+  if (pid < 0)
+    {
+      dbus_set_error (error,
+		      DBUS_ERROR_SPAWN_FORK_FAILED,
+		      "Failed to fork spawn launcher (%s)",
+		      _dbus_strerror (errno));
+      _dbus_close_socket (sockets[0], NULL);
+      _dbus_close_socket (sockets[1], NULL);
+      return FALSE;
+    }
+  else if (pid == 0)
+    {
+      _dbus_close_socket (sockets[0], NULL);
+      launcher_main (sockets[1]);
+      _dbus_assert_not_reached ("Got to code after launcher_main()");
+    }
+
+  _dbus_close_socket (sockets[1], NULL);
+  launcher_socket = sockets[0];
+
+  _dbus_verbose ("Started spawn launcher %ld\n", (long) pid);
+
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "A spawn launcher needs unix fd passing");
+  return FALSE;
+#endif
+}
+
+/*
+ * The babysitter helper is a small program that runs
+ * spawn_and_babysit() for us. Starting it with vfork() and exec()
+ * means the caller's page tables are never copied, so spawning costs
+ * the same however large the caller has grown. It is used whenever
+ * there is no child setup function to run, since that can only run in
+ * a forked copy of the caller.
+ *
+ * Its arguments are the exec error pipe fd, the babysitter socket fd,
+ * and then the argv to spawn; its environment is the one to spawn
+ * with.
+ */
+
+/* Path to the babysitter helper, NULL to fork the babysitter */
+static const char *babysitter_helper = NULL;
+
+/**
+ * Sets the program that _dbus_spawn_async_with_babysitter() starts
+ * with vfork() as the babysitter when there is no child setup
+ * function, instead of forking the caller. The program's main()
+ * should just call _dbus_babysitter_helper_main(). Nothing changes if
+ * the program can't be executed.
+ *
+ * @param path absolute path to the helper, must stay valid
+ * @returns #TRUE if the helper will be used
+ */
+dbus_bool_t
+_dbus_spawn_set_babysitter_helper (const char *path)
+{
+  if (path != NULL && access (path, X_OK) != 0)
+    {
+      _dbus_verbose ("Not using babysitter helper %s: %s\n",
+                     path, _dbus_strerror (errno));
+      path = NULL;
+    }
+
+  babysitter_helper = path;
+
+  return babysitter_helper != NULL;
+}
+
+/**
+ * The main() of the babysitter helper set with
+ * _dbus_spawn_set_babysitter_helper(). Only returns if the arguments
+ * make no sense.
+ *
+ * @param argc argument count
+ * @param argv arguments as passed by _dbus_spawn_async_with_babysitter()
+ * @returns exit code for the helper
+ */
+int
+_dbus_babysitter_helper_main (int    argc,
+                              char **argv)
+{
+  long child_err_report_fd;
+  long babysitter_fd;
+  char *end;
+
+  if (argc < 4)
+    return 1;
+
+  child_err_report_fd = strtol (argv[1], &end, 10);
+  if (*end != '\0' || child_err_report_fd < 3)
+    return 1;
+
+  babysitter_fd = strtol (argv[2], &end, 10);
+  if (*end != '\0' || babysitter_fd < 3)
+    return 1;
+
+  /* the error pipe must close when the grandchild's exec succeeds */
+  _dbus_fd_set_close_on_exec (child_err_report_fd);
+  _dbus_fd_set_close_on_exec (babysitter_fd);
+
+  spawn_and_babysit (argv + 3, NULL, NULL, NULL,
+                     child_err_report_fd, babysitter_fd);
+  _dbus_assert_not_reached ("Got to code after spawn_and_babysit()");
+
+  return 1;
+}
+
+/* Starts the babysitter helper; returns its pid, or -1 with errno set */
+static pid_t
+spawn_babysitter_helper (char **argv,
+                         char **env,
+                         int    child_err_report_fd,
+                         int    babysitter_fd)
+{
+  char err_fd_str[16];
+  char sitter_fd_str[16];
+  char **helper_argv;
+  int argc;
+  pid_t pid;
+
+  for (argc = 0; argv[argc] != NULL; argc++)
+    ;
+
+  /* everything the child uses is set up here, since after vfork() it
+   * may only exec or _exit
+   */
+  helper_argv = dbus_new (char *, argc + 4);
+  if (helper_argv == NULL)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  snprintf (err_fd_str, sizeof (err_fd_str), "%d", child_err_report_fd);
+  snprintf (sitter_fd_str, sizeof (sitter_fd_str), "%d", babysitter_fd);
+
+  helper_argv[0] = (char *) babysitter_helper;
+  helper_argv[1] = err_fd_str;
+  helper_argv[2] = sitter_fd_str;
+  memcpy (helper_argv + 3, argv, (argc + 1) * sizeof (char *));
+
+  if (env == NULL)
+    env = environ;
+
+  pid = vfork ();
+
+  if (pid == 0)
+    {
+      int msg[2];
+
+      /* the child has its own fd table, so this doesn't touch ours */
+      fcntl (child_err_report_fd, F_SETFD, 0);
+      fcntl (babysitter_fd, F_SETFD, 0);
+
+      execve (helper_argv[0], helper_argv, env);
+
+      /* report it like a babysitter that couldn't fork */
+      msg[0] = CHILD_FORK_FAILED;
+      msg[1] = errno;
+      if (write (babysitter_fd, msg, sizeof (msg)) < 0)
+        /* ignore */;
+      _exit (1);
+    }
+
+  dbus_free (helper_argv);
+
+  return pid;
+}
+
 /**
  * Spawns a new process. The executable name and argv[0]
  * are the same, both are provided in argv[0]. The child_setup
@@ -1185,78 +1710,83 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   
-  pid = fork ();
-  
-  if (pid < 0)
+#ifdef HAVE_UNIX_FD_PASSING
+  /* the launcher can't run a child setup function for us */
+  if (child_setup == NULL &&
+      launcher_send_request (argv, env,
+                             child_err_report_pipe[WRITE_END],
+                             babysitter_pipe[1]))
     {
-      dbus_set_error (error,
-		      DBUS_ERROR_SPAWN_FORK_FAILED,
-		      "Failed to fork (%s)",
-		      _dbus_strerror (errno));
-      goto cleanup_and_fail;
+      /* the babysitter is the launcher's child, not ours, so there is
+       * nothing to reap; it quits when we close our end of its socket
+       */
+      pid = -1;
     }
-  else if (pid == 0)
+  else
+#endif
+  if (child_setup == NULL && babysitter_helper != NULL)
     {
-      /* Immediate child, this is the babysitter process. */
-      int grandchild_pid;
-      
-      /* Be sure we crash if the parent exits
-       * and we write to the err_report_pipe
-       */
-      signal (SIGPIPE, SIG_DFL);
-
-      /* Close the parent's end of the pipes. */
-      close_and_invalidate (&child_err_report_pipe[READ_END]);
-      close_and_invalidate (&babysitter_pipe[0]);
-      
-      /* Create the child that will exec () */
-      grandchild_pid = fork ();
-      
-      if (grandchild_pid < 0)
-	{
-	  write_err_and_exit (babysitter_pipe[1],
-			      CHILD_FORK_FAILED);
-          _dbus_assert_not_reached ("Got to code after write_err_and_exit()");
-	}
-      else if (grandchild_pid == 0)
-	{
-	  do_exec (child_err_report_pipe[WRITE_END],
-		   argv,
-		   env,
-		   child_setup, user_data);
-          _dbus_assert_not_reached ("Got to code after exec() - should have exited on error");
-	}
-      else
-	{
-          babysit (grandchild_pid, babysitter_pipe[1]);
-          _dbus_assert_not_reached ("Got to code after babysit()");
-	}
+      pid = spawn_babysitter_helper (argv, env,
+                                     child_err_report_pipe[WRITE_END],
+                                     babysitter_pipe[1]);
+      if (pid < 0)
+        {
+          dbus_set_error (error,
+                          DBUS_ERROR_SPAWN_FORK_FAILED,
+                          "Failed to start babysitter (%s)",
+                          _dbus_strerror (errno));
+          goto cleanup_and_fail;
+        }
     }
   else
-    {      
-      /* Close the uncared-about ends of the pipes */
-      close_and_invalidate (&child_err_report_pipe[WRITE_END]);
-      close_and_invalidate (&babysitter_pipe[1]);
+    {
+      pid = fork ();
 
-      sitter->socket_to_babysitter = babysitter_pipe[0];
-      babysitter_pipe[0] = -1;
-      
-      sitter->error_pipe_from_child = child_err_report_pipe[READ_END];
-      child_err_report_pipe[READ_END] = -1;
+      if (pid < 0)
+        {
+          dbus_set_error (error,
+                          DBUS_ERROR_SPAWN_FORK_FAILED,
+                          "Failed to fork (%s)",
+                          _dbus_strerror (errno));
+          goto cleanup_and_fail;
+        }
+      else if (pid == 0)
+        {
+          /* Immediate child, this is the babysitter process. */
 
-      sitter->sitter_pid = pid;
+          /* Close the parent's end of the pipes. */
+          close_and_invalidate (&child_err_report_pipe[READ_END]);
+          close_and_invalidate (&babysitter_pipe[0]);
 
-      if (sitter_p != NULL)
-        *sitter_p = sitter;
-      else
-        _dbus_babysitter_unref (sitter);
+          spawn_and_babysit (argv, env, child_setup, user_data,
+                             child_err_report_pipe[WRITE_END],
+                             babysitter_pipe[1]);
+          _dbus_assert_not_reached ("Got to code after spawn_and_babysit()");
+        }
+    }
 
-      dbus_free_string_array (env);
+  /* Close the uncared-about ends of the pipes */
+  close_and_invalidate (&child_err_report_pipe[WRITE_END]);
+  close_and_invalidate (&babysitter_pipe[1]);
 
-      _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-      
-      return TRUE;
-    }
+  sitter->socket_to_babysitter = babysitter_pipe[0];
+  babysitter_pipe[0] = -1;
+
+  sitter->error_pipe_from_child = child_err_report_pipe[READ_END];
+  child_err_report_pipe[READ_END] = -1;
+
+  sitter->sitter_pid = pid;
+
+  if (sitter_p != NULL)
+    *sitter_p = sitter;
+  else
+    _dbus_babysitter_unref (sitter);
+
+  dbus_free_string_array (env);
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  return TRUE;
 
  cleanup_and_fail:
 
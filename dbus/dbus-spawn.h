@@ -41,6 +41,10 @@ dbus_bool_t _dbus_spawn_async_with_babysitter     (DBusBabysitter           **si
                                                    DBusSpawnChildSetupFunc    child_setup,
                                                    void                      *user_data,
                                                    DBusError                 *error);
+dbus_bool_t _dbus_spawn_start_launcher            (DBusError                 *error);
+dbus_bool_t _dbus_spawn_set_babysitter_helper     (const char                *path);
+int         _dbus_babysitter_helper_main          (int                        argc,
+                                                   char                     **argv);
 DBusBabysitter* _dbus_babysitter_ref              (DBusBabysitter            *sitter);
 void        _dbus_babysitter_unref                (DBusBabysitter            *sitter);
 void        _dbus_babysitter_kill_child           (DBusBabysitter            *sitter);
@@ -26,6 +26,7 @@
 
 #include <dbus/dbus-memory.h>
 #include <dbus/dbus-types.h>
+#include <dbus/dbus-string.h>
 
 #ifndef DBUS_CAN_USE_DBUS_STRING_PRIVATE
 #error "Don't go including dbus-string-private.h for no good reason"
@@ -49,6 +50,9 @@ typedef struct
   unsigned int   locked : 1;     /**< DBusString has been locked and can't be changed */
   unsigned int   invalid : 1;    /**< DBusString is invalid (e.g. already freed) */
   unsigned int   align_offset : 3; /**< str - align_offset is the actual malloc block */
+  unsigned int   is_inline : 1;  /**< The block is inline_buf rather than malloced */
+  unsigned int   is_mapped : 1;  /**< The block came from _dbus_pages_alloc() rather than malloc */
+  unsigned char  inline_buf[_DBUS_STRING_INLINE_SIZE]; /**< Storage for short strings */
 } DBusRealString;
 
 
@@ -73,7 +77,7 @@ typedef struct
  *
  * @param real the DBusRealString
  */
-#define DBUS_GENERIC_STRING_PREAMBLE(real) _dbus_assert ((real) != NULL); _dbus_assert (!(real)->invalid); _dbus_assert ((real)->len >= 0); _dbus_assert ((real)->allocated >= 0); _dbus_assert ((real)->max_length >= 0); _dbus_assert ((real)->len <= ((real)->allocated - _DBUS_STRING_ALLOCATION_PADDING)); _dbus_assert ((real)->len <= (real)->max_length)
+#define DBUS_GENERIC_STRING_PREAMBLE(real) _dbus_assert ((real) != NULL); _dbus_assert (!(real)->invalid); _dbus_assert ((real)->len >= 0); _dbus_assert ((real)->allocated >= 0); _dbus_assert ((real)->max_length >= 0); _dbus_assert ((real)->len <= ((real)->allocated - _DBUS_STRING_ALLOCATION_PADDING)); _dbus_assert ((real)->len <= (real)->max_length); _dbus_assert (!(real)->is_inline || (real)->str == (real)->inline_buf + (real)->align_offset); _dbus_assert (!(real)->is_inline || !(real)->is_mapped)
 
 /**
  * Checks assertions about a string object that needs to be
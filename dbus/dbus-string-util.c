@@ -76,43 +76,6 @@ _dbus_string_ends_with_c_str (const DBusString *a,
   return TRUE;
 }
 
-/**
- * Find the given byte scanning backward from the given start.
- * Sets *found to -1 if the byte is not found.
- *
- * @param str the string
- * @param start the place to start scanning (will not find the byte at this point)
- * @param byte the byte to find
- * @param found return location for where it was found
- * @returns #TRUE if found
- */
-dbus_bool_t
-_dbus_string_find_byte_backward (const DBusString  *str,
-                                 int                start,
-                                 unsigned char      byte,
-                                 int               *found)
-{
-  int i;
-  DBUS_CONST_STRING_PREAMBLE (str);
-  _dbus_assert (start <= real->len);
-  _dbus_assert (start >= 0);
-  _dbus_assert (found != NULL);
-
-  i = start - 1;
-  while (i >= 0)
-    {
-      if (real->str[i] == byte)
-        break;
-      
-      --i;
-    }
-
-  if (found)
-    *found = i;
-
-  return i >= 0;
-}
-
 /** @} */
 
 #ifdef DBUS_BUILD_TESTS
@@ -848,6 +811,50 @@ _dbus_string_test (void)
     _dbus_string_free (&str);
   }
 
+  {
+    /* Strings crossing the mapped threshold move in and out of mapped
+     * memory without losing their contents (the platform may not map
+     * anything, in which case they just stay on the heap)
+     */
+    _dbus_string_set_mapped_threshold (64 * 1024);
+
+    if (!_dbus_string_init (&str))
+      _dbus_assert_not_reached ("no memory");
+
+    for (i = 0; i < 10000; i++)
+      if (!_dbus_string_append (&str, "abcdefghijklmnopqrstuvwxyz"))
+        _dbus_assert_not_reached ("no memory");
+
+    _dbus_assert (_dbus_string_get_length (&str) == 260000);
+    _dbus_assert (_dbus_string_get_byte (&str, 259999) == 'z');
+
+    if (!_dbus_string_lengthen (&str, 4 * 1024 * 1024))
+      _dbus_assert_not_reached ("no memory");
+
+    _dbus_assert (_dbus_string_get_byte (&str, 259974) == 'a');
+
+    if (!_dbus_string_init (&other))
+      _dbus_assert_not_reached ("no memory");
+
+    if (!_dbus_string_move (&str, 0, &other, 0))
+      _dbus_assert_not_reached ("no memory");
+
+    _dbus_assert (_dbus_string_get_length (&other) == 260000 + 4 * 1024 * 1024);
+
+    if (!_dbus_string_set_length (&other, 10) ||
+        !_dbus_string_compact (&other, 0))
+      _dbus_assert_not_reached ("failed to compact");
+
+    _dbus_assert (!((DBusRealString *) &other)->is_mapped);
+
+    if (!_dbus_string_equal_c_str (&other, "abcdefghij"))
+      _dbus_assert_not_reached ("unexpected content after compact");
+
+    _dbus_string_free (&str);
+    _dbus_string_free (&other);
+    _dbus_string_set_mapped_threshold (0);
+  }
+
   {
     const char two_strings[] = "one\ttwo";
 
@@ -937,6 +944,63 @@ _dbus_string_test (void)
     _dbus_string_free (&str);
   }
 
+  /* UTF-8 validation skips ASCII a word at a time, so put a nul, a
+   * stray continuation byte, an overlong sequence and a valid
+   * two-byte char at every offset of a longer string
+   */
+  {
+    static const struct {
+      const char *bytes;
+      int len;
+      dbus_bool_t valid;
+    } inserts[] = {
+      { "\0", 1, FALSE },
+      { "\x80", 1, FALSE },
+      { "\xc0\xaf", 2, FALSE },
+      { "\xc3\xa9", 2, TRUE }
+    };
+    int start;
+    int j;
+    int k;
+
+    if (!_dbus_string_init (&str))
+      _dbus_assert_not_reached ("no memory");
+
+    for (i = 0; i < 40; i++)
+      if (!_dbus_string_append_byte (&str, 'a'))
+        _dbus_assert_not_reached ("no memory");
+
+    for (start = 0; start < 8; start++)
+      if (!_dbus_string_validate_utf8 (&str, start,
+                                       _dbus_string_get_length (&str) - start))
+        _dbus_assert_not_reached ("ASCII failed UTF-8 validation");
+
+    for (i = 0; i < 39; i++)
+      {
+        for (j = 0; j < _DBUS_N_ELEMENTS (inserts); j++)
+          {
+            if (!_dbus_string_init (&other) ||
+                !_dbus_string_copy (&str, 0, &other, 0))
+              _dbus_assert_not_reached ("no memory");
+
+            for (k = 0; k < inserts[j].len; k++)
+              _dbus_string_set_byte (&other, i + k, inserts[j].bytes[k]);
+
+            for (start = 0; start <= i && start < 8; start++)
+              {
+                if (_dbus_string_validate_utf8 (&other, start,
+                                                _dbus_string_get_length (&other) - start)
+                    != inserts[j].valid)
+                  _dbus_assert_not_reached ("wrong UTF-8 validation result");
+              }
+
+            _dbus_string_free (&other);
+          }
+      }
+
+    _dbus_string_free (&str);
+  }
+
   return TRUE;
 }
 
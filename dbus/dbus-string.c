@@ -75,6 +75,35 @@
  * @{
  */
 
+/* Blocks at least this big come from _dbus_pages_alloc() rather than
+ * malloc; 0 means never
+ */
+static int mapped_threshold = 0;
+
+/**
+ * Makes strings whose buffers reach @p bytes keep them in memory
+ * mapped from the kernel, which can grow without being copied and
+ * may be backed by huge pages, instead of on the heap. Buffers
+ * already allocated move over the next time they are resized. Only
+ * meant to be called while no other thread is using strings, e.g. by
+ * the bus daemon when it loads its configuration.
+ *
+ * @param bytes the smallest mapped buffer, or 0 to map none
+ */
+void
+_dbus_string_set_mapped_threshold (int bytes)
+{
+  _dbus_assert (bytes >= 0);
+
+  mapped_threshold = bytes;
+}
+
+static dbus_bool_t
+want_mapped (int allocated)
+{
+  return mapped_threshold > 0 && allocated >= mapped_threshold;
+}
+
 static void
 fixup_alignment (DBusRealString *real)
 {
@@ -145,12 +174,37 @@ _dbus_string_init_preallocated (DBusString *str,
    * since we also use this function to reset
    * an existing string, e.g. in _dbus_string_steal_data()
    */
-  
-  real->str = dbus_malloc (_DBUS_STRING_ALLOCATION_PADDING + allocate_size);
-  if (real->str == NULL)
-    return FALSE;  
-  
-  real->allocated = _DBUS_STRING_ALLOCATION_PADDING + allocate_size;
+
+  if (_DBUS_STRING_ALLOCATION_PADDING + allocate_size <= _DBUS_STRING_INLINE_SIZE)
+    {
+      real->str = real->inline_buf;
+      real->allocated = _DBUS_STRING_INLINE_SIZE;
+      real->is_inline = TRUE;
+      real->is_mapped = FALSE;
+    }
+  else
+    {
+      int allocated = _DBUS_STRING_ALLOCATION_PADDING + allocate_size;
+      unsigned char *block = NULL;
+
+      if (want_mapped (allocated))
+        block = _dbus_pages_alloc (&allocated);
+
+      real->is_mapped = block != NULL;
+
+      if (block == NULL)
+        {
+          allocated = _DBUS_STRING_ALLOCATION_PADDING + allocate_size;
+          block = dbus_malloc (allocated);
+          if (block == NULL)
+            return FALSE;
+        }
+
+      real->str = block;
+      real->allocated = allocated;
+      real->is_inline = FALSE;
+    }
+
   real->len = 0;
   real->str[real->len] = '\0';
   
@@ -178,7 +232,6 @@ _dbus_string_init (DBusString *str)
   return _dbus_string_init_preallocated (str, 0);
 }
 
-#ifdef DBUS_BUILD_TESTS
 /* The max length thing is sort of a historical artifact
  * from a feature that turned out to be dumb; perhaps
  * we should purge it entirely. The problem with
@@ -195,7 +248,6 @@ set_max_length (DBusString *str,
 
   real->max_length = max_length;
 }
-#endif /* DBUS_BUILD_TESTS */
 
 /**
  * Initializes a constant string. The value parameter is not copied
@@ -248,6 +300,8 @@ _dbus_string_init_const_len (DBusString *str,
   real->locked = TRUE;
   real->invalid = FALSE;
   real->align_offset = 0;
+  real->is_inline = FALSE;
+  real->is_mapped = FALSE;
 
   /* We don't require const strings to be 8-byte aligned as the
    * memory is coming from elsewhere.
@@ -267,35 +321,114 @@ _dbus_string_free (DBusString *str)
   
   if (real->constant)
     return;
-  dbus_free (real->str - real->align_offset);
+
+  if (real->is_mapped)
+    _dbus_pages_free (real->str - real->align_offset, real->allocated);
+  else if (!real->is_inline)
+    dbus_free (real->str - real->align_offset);
 
   real->invalid = TRUE;
 }
 
+/* Resizes the block, moving an inline string out to the heap, and
+ * moving a string between the heap and mapped memory as it crosses
+ * the mapped threshold
+ */
+static dbus_bool_t
+reallocate_block (DBusRealString *real,
+                  int             new_allocated)
+{
+  unsigned char *old_block;
+  unsigned char *new_block;
+  dbus_bool_t mapped;
+  int allocated;
+
+  old_block = real->str - real->align_offset;
+  new_block = NULL;
+  allocated = new_allocated;
+
+  if (want_mapped (new_allocated))
+    {
+      if (real->is_mapped)
+        new_block = _dbus_pages_realloc (old_block, real->allocated,
+                                         &allocated);
+      else
+        new_block = _dbus_pages_alloc (&allocated);
+    }
+
+  /* If the kernel won't map it, the heap may still have room */
+  mapped = new_block != NULL;
+
+  if (!mapped)
+    {
+      allocated = new_allocated;
+
+      if (real->is_inline || real->is_mapped)
+        new_block = dbus_malloc (allocated);
+      else
+        new_block = dbus_realloc (old_block, allocated);
+
+      if (_DBUS_UNLIKELY (new_block == NULL))
+        return FALSE;
+    }
+
+  /* Unless the block was resized where it is, move the contents over */
+  if (real->is_inline || mapped != real->is_mapped)
+    {
+      memcpy (new_block, old_block, real->align_offset + real->len + 1);
+
+      if (real->is_mapped)
+        _dbus_pages_free (old_block, real->allocated);
+      else if (!real->is_inline)
+        dbus_free (old_block);
+    }
+
+  real->is_inline = FALSE;
+  real->is_mapped = mapped;
+  real->str = new_block + real->align_offset;
+  real->allocated = allocated;
+  fixup_alignment (real);
+
+  return TRUE;
+}
+
+/**
+ * Repairs a string after the memory holding the DBusString itself
+ * has been moved, for instance by realloc() of an array of structs
+ * containing it. A short string keeps its data inside the DBusString,
+ * and its data pointer refers to the old location until this is
+ * called. Strings must not otherwise be copied by assignment.
+ *
+ * @param str the string, at its new location
+ */
+void
+_dbus_string_relocated (DBusString *str)
+{
+  DBusRealString *real = (DBusRealString*) str;
+
+  if (real->is_inline)
+    {
+      real->str = real->inline_buf + real->align_offset;
+      fixup_alignment (real);
+    }
+}
+
 static dbus_bool_t
 compact (DBusRealString *real,
          int             max_waste)
 {
-  unsigned char *new_str;
-  int new_allocated;
   int waste;
 
+  /* nothing to give back */
+  if (real->is_inline)
+    return TRUE;
+
   waste = real->allocated - (real->len + _DBUS_STRING_ALLOCATION_PADDING);
 
   if (waste <= max_waste)
     return TRUE;
 
-  new_allocated = real->len + _DBUS_STRING_ALLOCATION_PADDING;
-
-  new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
-  if (_DBUS_UNLIKELY (new_str == NULL))
-    return FALSE;
-
-  real->str = new_str + real->align_offset;
-  real->allocated = new_allocated;
-  fixup_alignment (real);
-
-  return TRUE;
+  return reallocate_block (real, real->len + _DBUS_STRING_ALLOCATION_PADDING);
 }
 
 #ifdef DBUS_BUILD_TESTS
@@ -331,7 +464,6 @@ reallocate_for_length (DBusRealString *real,
                        int             new_length)
 {
   int new_allocated;
-  unsigned char *new_str;
 
   /* at least double our old allocation to avoid O(n), avoiding
    * overflow
@@ -362,15 +494,8 @@ reallocate_for_length (DBusRealString *real,
                        new_length + _DBUS_STRING_ALLOCATION_PADDING);
 
   _dbus_assert (new_allocated >= real->allocated); /* code relies on this */
-  new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
-  if (_DBUS_UNLIKELY (new_str == NULL))
-    return FALSE;
 
-  real->str = new_str + real->align_offset;
-  real->allocated = new_allocated;
-  fixup_alignment (real);
-
-  return TRUE;
+  return reallocate_block (real, new_allocated);
 }
 
 /**
@@ -393,6 +518,35 @@ _dbus_string_compact (DBusString *str,
   return compact (real, max_waste);
 }
 
+/**
+ * Makes sure the string can grow by the given number of bytes
+ * without reallocating. Unlike the growth done as the string is
+ * lengthened, which at least doubles the allocation, this allocates
+ * exactly what was asked for, so a caller that knows the final size
+ * in advance pays for one realloc and no slack.
+ *
+ * @param str the string
+ * @param extra number of bytes to make room for past the current length
+ * @returns #FALSE if no memory, or the string can't get that long
+ */
+dbus_bool_t
+_dbus_string_reserve (DBusString *str,
+                      int         extra)
+{
+  int new_allocated;
+  DBUS_STRING_PREAMBLE (str);
+  _dbus_assert (extra >= 0);
+
+  if (_DBUS_UNLIKELY (extra > real->max_length - real->len))
+    return FALSE;
+
+  new_allocated = real->len + extra + _DBUS_STRING_ALLOCATION_PADDING;
+  if (new_allocated <= real->allocated)
+    return TRUE;
+
+  return reallocate_block (real, new_allocated);
+}
+
 static dbus_bool_t
 set_length (DBusRealString *real,
             int             new_length)
@@ -645,12 +799,30 @@ _dbus_string_steal_data (DBusString        *str,
   _dbus_assert (data_return != NULL);
 
   undo_alignment (real);
-  
-  *data_return = (char*) real->str;
+
+  if (real->is_inline || real->is_mapped)
+    {
+      /* the caller frees what it gets, so it has to be malloced */
+      *data_return = dbus_malloc (real->len + 1);
+      if (*data_return == NULL)
+        {
+          fixup_alignment (real);
+          return FALSE;
+        }
+
+      memcpy (*data_return, real->str, real->len + 1);
+
+      if (real->is_mapped)
+        _dbus_pages_free (real->str, real->allocated);
+    }
+  else
+    *data_return = (char*) real->str;
 
   old_max_length = real->max_length;
   
-  /* reset the string */
+  /* reset the string; this can only fail if it wasn't inline, so
+   * there's always a malloc block to put back
+   */
   if (!_dbus_string_init (str))
     {
       /* hrm, put it back then */
@@ -785,7 +957,6 @@ _dbus_string_copy_to_buffer_with_nul (const DBusString  *str,
   memcpy (buffer, real->str, real->len+1);
 }
 
-#ifdef DBUS_BUILD_TESTS
 /**
  * Copies a segment of the string into a char*
  *
@@ -830,7 +1001,6 @@ _dbus_string_copy_data_len (const DBusString  *str,
   _dbus_string_free (&dest);
   return TRUE;
 }
-#endif /* DBUS_BUILD_TESTS */
 
 /* Only have the function if we don't have the macro */
 #ifndef _dbus_string_get_length
@@ -852,6 +1022,21 @@ _dbus_string_get_length (const DBusString  *str)
 }
 #endif /* !_dbus_string_get_length */
 
+/**
+ * Gets how many bytes are allocated for a string, which is at least
+ * its length and usually more.
+ *
+ * @param str the string
+ * @returns the allocated size
+ */
+int
+_dbus_string_get_allocated_size (const DBusString *str)
+{
+  DBUS_CONST_STRING_PREAMBLE (str);
+
+  return real->allocated;
+}
+
 /**
  * Makes a string longer by the given number of bytes.  Checks whether
  * adding additional_length to the current length would overflow an
@@ -1571,10 +1756,13 @@ _dbus_string_move_len (DBusString       *source,
     }
   else if (start == 0 &&
            len == real_source->len &&
-           real_dest->len == 0)
+           real_dest->len == 0 &&
+           !real_source->is_inline)
     {
       /* Short-circuit moving an entire existing string to an empty string
-       * by just swapping the buffers.
+       * by just swapping the buffers. An inline buffer can't be
+       * handed over, so a short source is copied below instead, and
+       * an inline dest just gives the source an empty one back.
        */
       /* we assume ->constant doesn't matter as you can't have
        * a constant string involved in a move.
@@ -1584,10 +1772,26 @@ _dbus_string_move_len (DBusString       *source,
         (a)->len = (b)->len;                    \
         (a)->allocated = (b)->allocated;        \
         (a)->align_offset = (b)->align_offset;  \
+        (a)->is_inline = (b)->is_inline;        \
+        (a)->is_mapped = (b)->is_mapped;        \
       } while (0)
       
       DBusRealString tmp;
 
+      if (real_dest->is_inline)
+        {
+          ASSIGN_DATA (real_dest, real_source);
+          real_source->str = real_source->inline_buf;
+          real_source->len = 0;
+          real_source->allocated = _DBUS_STRING_INLINE_SIZE;
+          real_source->align_offset = 0;
+          real_source->is_inline = TRUE;
+          real_source->is_mapped = FALSE;
+          real_source->str[0] = '\0';
+          fixup_alignment (real_source);
+          return TRUE;
+        }
+
       ASSIGN_DATA (&tmp, real_source);
       ASSIGN_DATA (real_source, real_dest);
       ASSIGN_DATA (real_dest, &tmp);
@@ -2039,6 +2243,43 @@ _dbus_string_find_to (const DBusString *str,
   return FALSE;  
 }
 
+/**
+ * Find the given byte scanning backward from the given start.
+ * Sets *found to -1 if the byte is not found.
+ *
+ * @param str the string
+ * @param start the place to start scanning (will not find the byte at this point)
+ * @param byte the byte to find
+ * @param found return location for where it was found
+ * @returns #TRUE if found
+ */
+dbus_bool_t
+_dbus_string_find_byte_backward (const DBusString  *str,
+                                 int                start,
+                                 unsigned char      byte,
+                                 int               *found)
+{
+  int i;
+  DBUS_CONST_STRING_PREAMBLE (str);
+  _dbus_assert (start <= real->len);
+  _dbus_assert (start >= 0);
+  _dbus_assert (found != NULL);
+
+  i = start - 1;
+  while (i >= 0)
+    {
+      if (real->str[i] == byte)
+        break;
+      
+      --i;
+    }
+
+  if (found)
+    *found = i;
+
+  return i >= 0;
+}
+
 /**
  * Finds a blank (space or tab) in the string. Returns #TRUE
  * if found, #FALSE otherwise. If a blank is not found sets
@@ -2465,7 +2706,6 @@ _dbus_string_equal_c_str (const DBusString *a,
   return TRUE;
 }
 
-#ifdef DBUS_BUILD_TESTS
 /**
  * Checks whether a string starts with the given C string.
  *
@@ -2501,7 +2741,6 @@ _dbus_string_starts_with_c_str (const DBusString *a,
   else
     return FALSE;
 }
-#endif /* DBUS_BUILD_TESTS */
 
 /**
  * Appends a two-character hex digit to a string, where the hex digit
@@ -2826,6 +3065,16 @@ _dbus_string_toupper_ascii (const DBusString *str,
     }
 }
 
+/* 0x0101...01 and 0x8080...80 for whatever width unsigned long has */
+#define ASCII_WORD_ONES  (((unsigned long) -1) / 0xff)
+#define ASCII_WORD_HIGHS (ASCII_WORD_ONES * 0x80)
+
+/* TRUE if no byte of the word has its high bit set or is zero; the
+ * second term is the usual "has a zero byte" bit trick.
+ */
+#define ASCII_WORD_IS_PLAIN(w) \
+  ((((w) | (((w) - ASCII_WORD_ONES) & ~(w))) & ASCII_WORD_HIGHS) == 0)
+
 /**
  * Checks that the given range of the string is valid UTF-8. If the
  * given range is not entirely contained in the string, returns
@@ -2872,6 +3121,23 @@ _dbus_string_validate_utf8  (const DBusString *str,
       int i, mask, char_len;
       dbus_unichar_t result;
 
+      /* Skip a word of plain ASCII at a time; most strings on the
+       * bus (names, paths, English text) are entirely ASCII.
+       */
+      while (end - p >= (int) sizeof (unsigned long))
+        {
+          unsigned long word;
+
+          memcpy (&word, p, sizeof (word));
+          if (!ASCII_WORD_IS_PLAIN (word))
+            break;
+
+          p += sizeof (word);
+        }
+
+      if (p == end)
+        break;
+
       /* nul bytes considered invalid */
       if (*p == '\0')
         break;
@@ -39,6 +39,12 @@ DBUS_BEGIN_DECLS
 
 typedef struct DBusString DBusString;
 
+/**
+ * Strings whose data fits in this many bytes, padding included, keep
+ * it inside the DBusString itself rather than in a malloc block.
+ */
+#define _DBUS_STRING_INLINE_SIZE 32
+
 struct DBusString
 {
 #if defined(DBUS_WIN) && defined(_DEBUG)
@@ -53,6 +59,9 @@ struct DBusString
   unsigned int dummy6 : 1; /**< placeholder */
   unsigned int dummy7 : 1; /**< placeholder */
   unsigned int dummy8 : 3; /**< placeholder */
+  unsigned int dummy9 : 1; /**< placeholder */
+  unsigned int dummy11 : 1; /**< placeholder */
+  unsigned char dummy10[_DBUS_STRING_INLINE_SIZE]; /**< placeholder */
 };
 
 #ifdef DBUS_DISABLE_ASSERT
@@ -77,9 +86,13 @@ void          _dbus_string_init_const_len        (DBusString        *str,
 dbus_bool_t   _dbus_string_init_preallocated     (DBusString        *str,
                                                   int                allocate_size);
 void          _dbus_string_free                  (DBusString        *str);
+void          _dbus_string_relocated             (DBusString        *str);
+void          _dbus_string_set_mapped_threshold  (int                bytes);
 void          _dbus_string_lock                  (DBusString        *str);
 dbus_bool_t   _dbus_string_compact               (DBusString        *str,
                                                   int                max_waste);
+dbus_bool_t   _dbus_string_reserve               (DBusString        *str,
+                                                  int                extra);
 #ifndef _dbus_string_get_data
 char*         _dbus_string_get_data              (DBusString        *str);
 #endif /* _dbus_string_get_data */
@@ -131,6 +144,7 @@ void          _dbus_string_copy_to_buffer_with_nul (const DBusString  *str,
 #ifndef _dbus_string_get_length
 int           _dbus_string_get_length            (const DBusString  *str);
 #endif /* !_dbus_string_get_length */
+int           _dbus_string_get_allocated_size    (const DBusString  *str);
 
 dbus_bool_t   _dbus_string_lengthen              (DBusString        *str,
                                                   int                additional_length);
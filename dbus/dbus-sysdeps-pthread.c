@@ -25,6 +25,7 @@
 #include "dbus-internals.h"
 #include "dbus-sysdeps.h"
 #include "dbus-threads.h"
+#include "dbus-threads-internal.h"
 
 #include <sys/time.h>
 #include <pthread.h>
@@ -43,6 +44,10 @@
  */
 static dbus_bool_t have_monotonic_clock = 0;
 
+#ifdef DBUS_NATIVE_MUTEXES
+/* A real recursive mutex, locked inline by _dbus_mutex_lock() */
+typedef DBusNativeMutex DBusMutexPThread;
+#else
 typedef struct {
   pthread_mutex_t lock; /**< lock protecting count field */
   volatile int count;   /**< count of how many times lock holder has recursively locked */
@@ -51,6 +56,7 @@ typedef struct {
                                 has ever been >0, uninitialized memory
                                 if count has never been >0 */
 } DBusMutexPThread;
+#endif /* !DBUS_NATIVE_MUTEXES */
 
 typedef struct {
   pthread_cond_t cond; /**< the condition */
@@ -77,6 +83,109 @@ typedef struct {
 } while (0)
 #endif /* !DBUS_DISABLE_ASSERT */
 
+#ifdef DBUS_NATIVE_MUTEXES
+
+static DBusMutex*
+_dbus_pthread_mutex_new (void)
+{
+  DBusMutexPThread *pmutex;
+  pthread_mutexattr_t attr;
+  int result;
+  
+  pmutex = dbus_new (DBusMutexPThread, 1);
+  if (pmutex == NULL)
+    return NULL;
+
+  pthread_mutexattr_init (&attr);
+  pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+  result = pthread_mutex_init (&pmutex->lock, &attr);
+  pthread_mutexattr_destroy (&attr);
+
+  if (result == ENOMEM || result == EAGAIN)
+    {
+      dbus_free (pmutex);
+      return NULL;
+    }
+  else
+    {
+      PTHREAD_CHECK ("pthread_mutex_init", result);
+    }
+
+  pmutex->depth = 0;
+
+  return DBUS_MUTEX (pmutex);
+}
+
+static void
+_dbus_pthread_mutex_free (DBusMutex *mutex)
+{
+  DBusMutexPThread *pmutex = DBUS_MUTEX_PTHREAD (mutex);
+
+  _dbus_assert (pmutex->depth == 0);
+  
+  PTHREAD_CHECK ("pthread_mutex_destroy", pthread_mutex_destroy (&pmutex->lock));
+
+  dbus_free (pmutex);
+}
+
+/* Only used before _dbus_threads_enable_native(); after that the
+ * callers do the same thing inline.
+ */
+static void
+_dbus_pthread_mutex_lock (DBusMutex *mutex)
+{
+  DBusMutexPThread *pmutex = DBUS_MUTEX_PTHREAD (mutex);
+
+  PTHREAD_CHECK ("pthread_mutex_lock", pthread_mutex_lock (&pmutex->lock));
+  pmutex->depth += 1;
+}
+
+static void
+_dbus_pthread_mutex_unlock (DBusMutex *mutex)
+{
+  DBusMutexPThread *pmutex = DBUS_MUTEX_PTHREAD (mutex);
+
+  _dbus_assert (pmutex->depth > 0);
+
+  pmutex->depth -= 1;
+  PTHREAD_CHECK ("pthread_mutex_unlock", pthread_mutex_unlock (&pmutex->lock));
+}
+
+/* Waiting on a condition only releases one level of a recursive
+ * mutex, so let go of the others first and take them back after.
+ */
+static int
+_dbus_pthread_mutex_release_to_one (DBusMutexPThread *pmutex)
+{
+  int old_depth = pmutex->depth;
+
+  _dbus_assert (old_depth > 0);
+
+  while (pmutex->depth > 1)
+    {
+      pmutex->depth -= 1;
+      PTHREAD_CHECK ("pthread_mutex_unlock", pthread_mutex_unlock (&pmutex->lock));
+    }
+
+  pmutex->depth = 0;
+
+  return old_depth;
+}
+
+static void
+_dbus_pthread_mutex_reacquire (DBusMutexPThread *pmutex,
+                               int               old_depth)
+{
+  int i;
+
+  for (i = 1; i < old_depth; i++)
+    PTHREAD_CHECK ("pthread_mutex_lock", pthread_mutex_lock (&pmutex->lock));
+
+  pmutex->depth = old_depth;
+}
+
+#else /* !DBUS_NATIVE_MUTEXES */
+
 static DBusMutex*
 _dbus_pthread_mutex_new (void)
 {
@@ -190,6 +299,8 @@ _dbus_pthread_mutex_unlock (DBusMutex *mutex)
   /* We leave pmutex->holder set to ourselves, its content is undefined if count is 0 */
 }
 
+#endif /* !DBUS_NATIVE_MUTEXES */
+
 static DBusCondVar *
 _dbus_pthread_condvar_new (void)
 {
@@ -240,7 +351,12 @@ _dbus_pthread_condvar_wait (DBusCondVar *cond,
   DBusMutexPThread *pmutex = DBUS_MUTEX_PTHREAD (mutex);
   DBusCondVarPThread *pcond = DBUS_COND_VAR_PTHREAD (cond);
   int old_count;
-  
+
+#ifdef DBUS_NATIVE_MUTEXES
+  old_count = _dbus_pthread_mutex_release_to_one (pmutex);
+  PTHREAD_CHECK ("pthread_cond_wait", pthread_cond_wait (&pcond->cond, &pmutex->lock));
+  _dbus_pthread_mutex_reacquire (pmutex, old_count);
+#else
   _dbus_assert (pmutex->count > 0);
   _dbus_assert (pthread_equal (pmutex->holder, pthread_self ()));
 
@@ -254,6 +370,7 @@ _dbus_pthread_condvar_wait (DBusCondVar *cond,
    * See the comments below at the end of _dbus_pthread_condvar_wait_timeout
    */
   pmutex->count = old_count;
+#endif /* !DBUS_NATIVE_MUTEXES */
 }
 
 static dbus_bool_t
@@ -268,8 +385,10 @@ _dbus_pthread_condvar_wait_timeout (DBusCondVar               *cond,
   int result;
   int old_count;
   
+#ifndef DBUS_NATIVE_MUTEXES
   _dbus_assert (pmutex->count > 0);
   _dbus_assert (pthread_equal (pmutex->holder, pthread_self ()));  
+#endif
 
 #ifdef HAVE_MONOTONIC_CLOCK
   if (have_monotonic_clock)
@@ -292,8 +411,12 @@ _dbus_pthread_condvar_wait_timeout (DBusCondVar               *cond,
       end_time.tv_nsec -= 1000*1000*1000;
     }
 
+#ifdef DBUS_NATIVE_MUTEXES
+  old_count = _dbus_pthread_mutex_release_to_one (pmutex);
+#else
   old_count = pmutex->count;
   pmutex->count = 0;
+#endif
   result = pthread_cond_timedwait (&pcond->cond, &pmutex->lock, &end_time);
   
   if (result != ETIMEDOUT)
@@ -301,6 +424,9 @@ _dbus_pthread_condvar_wait_timeout (DBusCondVar               *cond,
       PTHREAD_CHECK ("pthread_cond_timedwait", result);
     }
 
+#ifdef DBUS_NATIVE_MUTEXES
+  _dbus_pthread_mutex_reacquire (pmutex, old_count);
+#else
   _dbus_assert (pmutex->count == 0);
   pmutex->holder = pthread_self(); /* other threads may have locked the mutex in the meantime */
 
@@ -309,6 +435,7 @@ _dbus_pthread_condvar_wait_timeout (DBusCondVar               *cond,
    * get into the mutex without proper locking by passing the lock owner check.
    */
   pmutex->count = old_count;
+#endif /* !DBUS_NATIVE_MUTEXES */
   
   /* return true if we did not time out */
   return result != ETIMEDOUT;
@@ -369,5 +496,13 @@ dbus_bool_t
 _dbus_threads_init_platform_specific (void)
 {
   check_monotonic_clock ();
-  return dbus_threads_init (&pthread_functions);
+
+  if (!dbus_threads_init (&pthread_functions))
+    return FALSE;
+
+#ifdef DBUS_NATIVE_MUTEXES
+  _dbus_threads_enable_native (_dbus_pthread_mutex_lock);
+#endif
+
+  return TRUE;
 }
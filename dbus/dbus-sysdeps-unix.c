@@ -35,6 +35,7 @@
 #include "dbus-list.h"
 #include "dbus-credentials.h"
 #include "dbus-nonce.h"
+#include "dbus-address.h"
 
 #include <sys/types.h>
 #include <stdlib.h>
@@ -51,8 +52,10 @@
 #include <locale.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <grp.h>
 #include <cutils/sockets.h>
@@ -66,6 +69,9 @@
 #ifdef HAVE_POLL
 #include <sys/poll.h>
 #endif
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
 #ifdef HAVE_BACKTRACE
 #include <execinfo.h>
 #endif
@@ -230,6 +236,37 @@ _dbus_write_socket (int               fd,
 #endif
 }
 
+#ifdef HAVE_UNIX_FD_PASSING
+/* Whether recvmsg() honours MSG_CMSG_CLOEXEC. Kernels that predate it
+ * silently ignore the flag, so the first fd we receive is checked by
+ * hand and the answer is remembered; after that, kernels that do
+ * support it cost no extra system calls per fd. Threads racing on the
+ * first check just do it twice.
+ */
+static dbus_bool_t
+cmsg_cloexec_works (int fd)
+{
+#ifdef MSG_CMSG_CLOEXEC
+  static int works = -1;
+
+  if (works < 0)
+    {
+      int val;
+
+      val = fcntl (fd, F_GETFD, 0);
+      if (val < 0)
+        return FALSE;
+
+      works = (val & FD_CLOEXEC) != 0;
+    }
+
+  return works;
+#else
+  return FALSE;
+#endif
+}
+#endif
+
 /**
  * Like _dbus_read_socket() but also tries to read unix fds from the
  * socket. When there are more fds to read than space in the array
@@ -289,9 +326,11 @@ _dbus_read_socket_with_unix_fds (int               fd,
   m.msg_controllen = CMSG_SPACE(*n_fds * sizeof(int));
 
   /* It's probably safe to assume that systems with SCM_RIGHTS also
-     know alloca() */
+     know alloca(). There is no need to clear the buffer: recvmsg()
+     sets msg_controllen to what it actually wrote, and the CMSG
+     macros never look past that. Most reads carry no fds at all, so
+     clearing room for the maximum every time was pure overhead. */
   m.msg_control = alloca(m.msg_controllen);
-  memset(m.msg_control, 0, m.msg_controllen);
 
  again:
 
@@ -329,7 +368,13 @@ _dbus_read_socket_with_unix_fds (int               fd,
           return -1;
         }
 
-      for (cm = CMSG_FIRSTHDR(&m); cm; cm = CMSG_NXTHDR(&m, cm))
+      /* The common case: no control data, nothing to look at */
+      if (m.msg_controllen == 0)
+        cm = NULL;
+      else
+        cm = CMSG_FIRSTHDR(&m);
+
+      for (; cm; cm = CMSG_NXTHDR(&m, cm))
         if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
           {
             unsigned i;
@@ -340,11 +385,14 @@ _dbus_read_socket_with_unix_fds (int               fd,
             memcpy(fds, CMSG_DATA(cm), *n_fds * sizeof(int));
             found = TRUE;
 
-            /* Linux doesn't tell us whether MSG_CMSG_CLOEXEC actually
-               worked, hence we need to go through this list and set
-               CLOEXEC everywhere in any case */
-            for (i = 0; i < *n_fds; i++)
-              _dbus_fd_set_close_on_exec(fds[i]);
+            if (*n_fds > 0 && !cmsg_cloexec_works (fds[0]))
+              {
+                /* Linux doesn't tell us whether MSG_CMSG_CLOEXEC
+                   actually worked, hence we need to go through this
+                   list and set CLOEXEC everywhere */
+                for (i = 0; i < *n_fds; i++)
+                  _dbus_fd_set_close_on_exec(fds[i]);
+              }
 
             break;
           }
@@ -535,6 +583,63 @@ _dbus_write_socket_two (int               fd,
 #endif
 }
 
+/**
+ * Like _dbus_write_socket_two() but writes any number of chunks,
+ * up to #_DBUS_MAX_WRITE_CHUNKS, with a single system call. Used to
+ * send several queued messages at once.
+ *
+ * @param fd the file descriptor
+ * @param chunks the ranges to write, in order
+ * @param n_chunks number of ranges
+ * @returns total bytes written from all chunks, or -1 on error
+ */
+int
+_dbus_write_socket_chunks (int                   fd,
+                           const DBusWriteChunk *chunks,
+                           int                   n_chunks)
+{
+  struct iovec vectors[_DBUS_MAX_WRITE_CHUNKS];
+  int bytes_written;
+  int i;
+#ifdef MSG_NOSIGNAL
+  struct msghdr m;
+#endif
+
+  _dbus_assert (n_chunks > 0);
+  _dbus_assert (n_chunks <= _DBUS_MAX_WRITE_CHUNKS);
+
+  for (i = 0; i < n_chunks; i++)
+    {
+      _dbus_assert (chunks[i].start >= 0);
+      _dbus_assert (chunks[i].len >= 0);
+
+      vectors[i].iov_base = (char*) _dbus_string_get_const_data_len (chunks[i].buffer,
+                                                                     chunks[i].start,
+                                                                     chunks[i].len);
+      vectors[i].iov_len = chunks[i].len;
+    }
+
+ again:
+
+#ifdef MSG_NOSIGNAL
+  _DBUS_ZERO(m);
+  m.msg_iov = vectors;
+  m.msg_iovlen = n_chunks;
+
+  bytes_written = sendmsg (fd, &m, MSG_NOSIGNAL);
+#elif defined (HAVE_WRITEV)
+  bytes_written = writev (fd, vectors, n_chunks);
+#else
+  /* a short write is always allowed, so just do the first chunk */
+  bytes_written = write (fd, vectors[0].iov_base, vectors[0].iov_len);
+#endif
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+}
+
 dbus_bool_t
 _dbus_socket_is_invalid (int fd)
 {
@@ -1160,6 +1265,138 @@ _dbus_listen_systemd_sockets (int       **fds,
   return -1;
 }
 
+/**
+ * Replaces the current process image with a new program, passing it
+ * the given listening sockets the way systemd does, so the program can
+ * pick them up with _dbus_listen_systemd_sockets(). The sockets are
+ * moved to file descriptors 3 and up; everything else that is
+ * close-on-exec goes away with the old image.
+ *
+ * If exec() fails, the descriptors that were moved aside are put
+ * back, so the caller can carry on as before.
+ *
+ * @param path the program to run
+ * @param argv its arguments, including argv[0]
+ * @param fds the listening sockets
+ * @param n_fds number of sockets
+ * @param error return location for errors
+ * @returns #FALSE with error set; does not return on success
+ */
+dbus_bool_t
+_dbus_exec_with_listen_fds (const char  *path,
+                            char       **argv,
+                            const int   *fds,
+                            int          n_fds,
+                            DBusError   *error)
+{
+  int *moved;
+  int *saved;
+  int *saved_flags;
+  int first_free;
+  int i;
+  int saved_errno;
+  char buf[32];
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_assert (n_fds > 0);
+
+  if (access (path, X_OK) != 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Cannot execute %s: %s", path, _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  moved = dbus_new (int, n_fds);
+  saved = dbus_new (int, n_fds);
+  saved_flags = dbus_new (int, n_fds);
+  if (moved == NULL || saved == NULL || saved_flags == NULL)
+    {
+      dbus_free (moved);
+      dbus_free (saved);
+      dbus_free (saved_flags);
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return FALSE;
+    }
+
+  for (i = 0; i < n_fds; i++)
+    {
+      moved[i] = -1;
+      saved[i] = -1;
+      saved_flags[i] = 0;
+    }
+
+  first_free = SD_LISTEN_FDS_START + n_fds;
+
+  /* keep whatever sits where the sockets have to go, in case exec fails */
+  for (i = 0; i < n_fds; i++)
+    {
+      saved_flags[i] = fcntl (SD_LISTEN_FDS_START + i, F_GETFD);
+      if (saved_flags[i] < 0)
+        continue;
+
+      saved[i] = fcntl (SD_LISTEN_FDS_START + i, F_DUPFD, first_free);
+      if (saved[i] < 0)
+        goto failed;
+      _dbus_fd_set_close_on_exec (saved[i]);
+    }
+
+  /* and get the sockets out of the way of each other */
+  for (i = 0; i < n_fds; i++)
+    {
+      moved[i] = fcntl (fds[i], F_DUPFD, first_free);
+      if (moved[i] < 0)
+        goto failed;
+      _dbus_fd_set_close_on_exec (moved[i]);
+    }
+
+  /* dup2() leaves close-on-exec off, which is what we want */
+  for (i = 0; i < n_fds; i++)
+    {
+      if (dup2 (moved[i], SD_LISTEN_FDS_START + i) < 0)
+        goto failed;
+    }
+
+  snprintf (buf, sizeof (buf), "%lu", (unsigned long) getpid ());
+  if (!_dbus_setenv ("LISTEN_PID", buf))
+    goto failed;
+  snprintf (buf, sizeof (buf), "%d", n_fds);
+  if (!_dbus_setenv ("LISTEN_FDS", buf))
+    goto failed;
+
+  execv (path, argv);
+
+ failed:
+  saved_errno = errno;
+
+  _dbus_setenv ("LISTEN_PID", NULL);
+  _dbus_setenv ("LISTEN_FDS", NULL);
+
+  for (i = 0; i < n_fds; i++)
+    {
+      if (saved[i] >= 0)
+        {
+          dup2 (saved[i], SD_LISTEN_FDS_START + i);
+          fcntl (SD_LISTEN_FDS_START + i, F_SETFD, saved_flags[i]);
+          close (saved[i]);
+        }
+      else if (saved_flags[i] < 0)
+        close (SD_LISTEN_FDS_START + i);
+
+      if (moved[i] >= 0)
+        close (moved[i]);
+    }
+
+  dbus_free (moved);
+  dbus_free (saved);
+  dbus_free (saved_flags);
+
+  dbus_set_error (error, _dbus_error_from_errno (saved_errno),
+                  "Failed to execute %s: %s", path,
+                  _dbus_strerror (saved_errno));
+  return FALSE;
+}
+
 /**
  * Creates a socket and connects to a socket at the given host
  * and port. The connection fd is returned, and is set up as
@@ -1830,7 +2067,8 @@ _dbus_send_credentials_socket  (int              server_fd,
  * Accepts a connection on a listening socket.
  * Handles EINTR for you.
  *
- * This will enable FD_CLOEXEC for the returned socket.
+ * This will enable FD_CLOEXEC for the returned socket, and make it
+ * nonblocking. With accept4() both come for free with the accept.
  *
  * @param listen_fd the listen file descriptor
  * @returns the connection fd of the client, or -1 on error
@@ -1842,7 +2080,7 @@ _dbus_accept  (int listen_fd)
   struct sockaddr addr;
   socklen_t addrlen;
 #ifdef HAVE_ACCEPT4
-  dbus_bool_t cloexec_done;
+  dbus_bool_t flags_done;
 #endif
 
   addrlen = sizeof (addr);
@@ -1850,9 +2088,10 @@ _dbus_accept  (int listen_fd)
  retry:
 
 #ifdef HAVE_ACCEPT4
-  /* We assume that if accept4 is available SOCK_CLOEXEC is too */
-  client_fd = accept4 (listen_fd, &addr, &addrlen, SOCK_CLOEXEC);
-  cloexec_done = client_fd >= 0;
+  /* We assume that if accept4 is available SOCK_CLOEXEC and
+   * SOCK_NONBLOCK are too */
+  client_fd = accept4 (listen_fd, &addr, &addrlen, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  flags_done = client_fd >= 0;
 
   if (client_fd < 0 && errno == ENOSYS)
 #endif
@@ -1864,20 +2103,73 @@ _dbus_accept  (int listen_fd)
     {
       if (errno == EINTR)
         goto retry;
+
+      return client_fd;
     }
 
   _dbus_verbose ("client fd %d accepted\n", client_fd);
 
 #ifdef HAVE_ACCEPT4
-  if (!cloexec_done)
+  if (!flags_done)
 #endif
     {
       _dbus_fd_set_close_on_exec(client_fd);
+
+      if (!_dbus_set_fd_nonblocking (client_fd, NULL))
+        {
+          _dbus_close_socket (client_fd, NULL);
+          return -1;
+        }
     }
 
   return client_fd;
 }
 
+/**
+ * Applies the tuning from a TCP address to a connected socket. This
+ * is only ever a hint, so failures are logged and otherwise ignored;
+ * the connection works the same without it.
+ *
+ * @param fd the socket
+ * @param options what to set
+ */
+void
+_dbus_set_tcp_options (int                   fd,
+                       const DBusTcpOptions *options)
+{
+  if (options->nodelay >= 0 &&
+      setsockopt (fd, IPPROTO_TCP, TCP_NODELAY,
+                  &options->nodelay, sizeof (options->nodelay)) < 0)
+    _dbus_verbose ("Failed to set TCP_NODELAY on fd %d: %s\n",
+                   fd, _dbus_strerror (errno));
+
+  if (options->keepalive >= 0 &&
+      setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE,
+                  &options->keepalive, sizeof (options->keepalive)) < 0)
+    _dbus_verbose ("Failed to set SO_KEEPALIVE on fd %d: %s\n",
+                   fd, _dbus_strerror (errno));
+
+  if (options->sndbuf >= 0 &&
+      setsockopt (fd, SOL_SOCKET, SO_SNDBUF,
+                  &options->sndbuf, sizeof (options->sndbuf)) < 0)
+    _dbus_verbose ("Failed to set SO_SNDBUF on fd %d: %s\n",
+                   fd, _dbus_strerror (errno));
+
+  if (options->rcvbuf >= 0 &&
+      setsockopt (fd, SOL_SOCKET, SO_RCVBUF,
+                  &options->rcvbuf, sizeof (options->rcvbuf)) < 0)
+    _dbus_verbose ("Failed to set SO_RCVBUF on fd %d: %s\n",
+                   fd, _dbus_strerror (errno));
+
+#ifdef SO_BUSY_POLL
+  if (options->busy_poll >= 0 &&
+      setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL,
+                  &options->busy_poll, sizeof (options->busy_poll)) < 0)
+    _dbus_verbose ("Failed to set SO_BUSY_POLL on fd %d: %s\n",
+                   fd, _dbus_strerror (errno));
+#endif
+}
+
 /**
  * Checks to make sure the given directory is
  * private to the user
@@ -2390,6 +2682,54 @@ _dbus_atomic_dec (DBusAtomic *atomic)
 #endif
 }
 
+/**
+ * Reads a pointer published with _dbus_atomic_pointer_set(). Whatever
+ * was written to the object it points to before it was published is
+ * visible once the pointer is.
+ *
+ * @param location the pointer to read
+ * @returns its value
+ */
+void *
+_dbus_atomic_pointer_get (void * volatile *location)
+{
+#if DBUS_USE_SYNC
+  void *value = *location;
+
+  __sync_synchronize ();
+  return value;
+#else
+  void *value;
+
+  _DBUS_LOCK (atomic);
+  value = *location;
+  _DBUS_UNLOCK (atomic);
+  return value;
+#endif
+}
+
+/**
+ * Publishes a pointer for _dbus_atomic_pointer_get(): everything
+ * written before this call is visible to a thread that reads the new
+ * value.
+ *
+ * @param location the pointer to write
+ * @param value its new value
+ */
+void
+_dbus_atomic_pointer_set (void * volatile *location,
+                          void            *value)
+{
+#if DBUS_USE_SYNC
+  __sync_synchronize ();
+  *location = value;
+#else
+  _DBUS_LOCK (atomic);
+  *location = value;
+  _DBUS_UNLOCK (atomic);
+#endif
+}
+
 #ifdef DBUS_BUILD_TESTS
 /** Gets our GID
  * @returns process GID
@@ -2995,6 +3335,96 @@ _dbus_full_duplex_pipe (int        *fd1,
 #endif
 }
 
+/**
+ * Opens a nonblocking wakeup pipe: an eventfd where there is one,
+ * otherwise a full-duplex pipe.
+ *
+ * @param wakeup the pipe to open
+ * @param error error return
+ * @returns #FALSE on failure (if error is set)
+ */
+dbus_bool_t
+_dbus_wakeup_pipe_open (DBusWakeupPipe *wakeup,
+                        DBusError      *error)
+{
+#ifdef HAVE_EVENTFD
+  int fd;
+
+  /* Kernels too old for the flags fall back to the pipe */
+  fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd >= 0)
+    {
+      wakeup->read_fd = fd;
+      wakeup->write_fd = fd;
+      return TRUE;
+    }
+#endif
+
+  return _dbus_full_duplex_pipe (&wakeup->read_fd, &wakeup->write_fd,
+                                 FALSE, error);
+}
+
+/**
+ * Closes a wakeup pipe.
+ *
+ * @param wakeup the pipe
+ */
+void
+_dbus_wakeup_pipe_close (DBusWakeupPipe *wakeup)
+{
+  if (wakeup->write_fd != wakeup->read_fd)
+    _dbus_close (wakeup->write_fd, NULL);
+  _dbus_close (wakeup->read_fd, NULL);
+
+  wakeup->read_fd = -1;
+  wakeup->write_fd = -1;
+}
+
+/**
+ * Makes the wakeup pipe readable. Never blocks; if the pipe is full,
+ * it was readable already.
+ *
+ * @param wakeup the pipe
+ */
+void
+_dbus_wakeup_pipe_signal (DBusWakeupPipe *wakeup)
+{
+#ifdef HAVE_EVENTFD
+  if (wakeup->write_fd == wakeup->read_fd)
+    {
+      uint64_t one = 1;
+
+      while (write (wakeup->write_fd, &one, sizeof (one)) < 0 &&
+             errno == EINTR)
+        ;
+      return;
+    }
+#endif
+
+  while (write (wakeup->write_fd, "", 1) < 0 && errno == EINTR)
+    ;
+}
+
+/**
+ * Reads whatever _dbus_wakeup_pipe_signal() wrote, so the pipe is no
+ * longer readable.
+ *
+ * @param wakeup the pipe
+ */
+void
+_dbus_wakeup_pipe_drain (DBusWakeupPipe *wakeup)
+{
+  char buf[64];
+  ssize_t n;
+
+  /* One read empties an eventfd, since it is a counter */
+  do
+    {
+      n = read (wakeup->read_fd, buf, sizeof (buf));
+    }
+  while ((n < 0 && errno == EINTR) || n == (ssize_t) sizeof (buf));
+}
+
 /**
  * Measure the length of the given format string and arguments,
  * not including the terminating nul.
@@ -3319,6 +3749,229 @@ _dbus_get_autolaunch_address (DBusString *address,
   return retval;
 }
 
+/* Appends the name of the file where dbus-launch --autolaunch records
+ * the bus it started for this machine and display. This has to match
+ * get_session_file() in tools/dbus-launch-x11.c.
+ */
+static dbus_bool_t
+append_autolaunch_file_name (DBusString *filename)
+{
+  const char *display;
+  const char *home;
+  const DBusString *homedir;
+  DBusString uuid;
+  DBusString mangled;
+  dbus_bool_t retval = FALSE;
+  int colon;
+  int i;
+
+  display = _dbus_getenv ("DISPLAY");
+  if (display == NULL)
+    return FALSE;
+
+  if (!_dbus_string_init (&uuid))
+    return FALSE;
+
+  if (!_dbus_string_init (&mangled))
+    {
+      _dbus_string_free (&uuid);
+      return FALSE;
+    }
+
+  if (!_dbus_get_local_machine_uuid_encoded (&uuid) ||
+      !_dbus_string_append (&mangled, display))
+    goto out;
+
+  /* Drop the screen number, then the "localhost" spellings and a
+   * leading ':', then turn any ':' that's left into '_'
+   */
+  if (_dbus_string_find_byte_backward (&mangled,
+                                       _dbus_string_get_length (&mangled),
+                                       ':', &colon))
+    {
+      int dot;
+
+      if (_dbus_string_find (&mangled, colon, ".", &dot))
+        _dbus_string_set_length (&mangled, dot);
+    }
+
+  if (_dbus_string_starts_with_c_str (&mangled, "localhost.localdomain:"))
+    _dbus_string_delete (&mangled, 0, strlen ("localhost.localdomain:"));
+  else if (_dbus_string_starts_with_c_str (&mangled, "localhost:"))
+    _dbus_string_delete (&mangled, 0, strlen ("localhost:"));
+  else if (_dbus_string_starts_with_c_str (&mangled, ":"))
+    _dbus_string_delete (&mangled, 0, 1);
+
+  for (i = 0; i < _dbus_string_get_length (&mangled); i++)
+    {
+      if (_dbus_string_get_byte (&mangled, i) == ':')
+        _dbus_string_set_byte (&mangled, i, '_');
+    }
+
+  home = _dbus_getenv ("HOME");
+  if (home == NULL)
+    {
+      if (!_dbus_homedir_from_current_process (&homedir))
+        goto out;
+
+      home = _dbus_string_get_const_data (homedir);
+    }
+
+  retval = _dbus_string_append (filename, home) &&
+    _dbus_string_append (filename, "/.dbus/session-bus/") &&
+    _dbus_string_append (filename, _dbus_string_get_const_data (&uuid)) &&
+    _dbus_string_append (filename, "-") &&
+    _dbus_string_append (filename, _dbus_string_get_const_data (&mangled));
+
+ out:
+  _dbus_string_free (&uuid);
+  _dbus_string_free (&mangled);
+  return retval;
+}
+
+/* Copies the value from the "NAME=value" line of @p contents whose
+ * @p name (including the '=') is given
+ */
+static dbus_bool_t
+get_session_file_value (const DBusString *contents,
+                        const char       *name,
+                        DBusString       *value)
+{
+  int start;
+  int end;
+  int eol_len;
+  int found;
+
+  start = 0;
+  while (start < _dbus_string_get_length (contents))
+    {
+      _dbus_string_find_eol (contents, start, &end, &eol_len);
+
+      if (_dbus_string_find_to (contents, start, end, name, &found) &&
+          found == start)
+        {
+          start += strlen (name);
+          return _dbus_string_copy_len (contents, start, end - start, value,
+                                        _dbus_string_get_length (value));
+        }
+
+      start = end + eol_len;
+      if (eol_len == 0)
+        break;
+    }
+
+  return FALSE;
+}
+
+/* A unix:path= socket that is gone or isn't a socket any more means
+ * the bus that made it has exited
+ */
+static dbus_bool_t
+autolaunch_sockets_exist (const char *address)
+{
+  DBusAddressEntry **entries;
+  dbus_bool_t retval = TRUE;
+  int n_entries;
+  int i;
+
+  if (!dbus_parse_address (address, &entries, &n_entries, NULL))
+    return FALSE;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      const char *path;
+      struct stat sb;
+
+      if (strcmp (dbus_address_entry_get_method (entries[i]), "unix") != 0)
+        continue;
+
+      path = dbus_address_entry_get_value (entries[i], "path");
+      if (path != NULL && (stat (path, &sb) < 0 || !S_ISSOCK (sb.st_mode)))
+        retval = FALSE;
+    }
+
+  dbus_address_entries_free (entries);
+  return retval;
+}
+
+/**
+ * Looks for a session bus that dbus-launch --autolaunch already
+ * started for this machine, display and user, without running it.
+ * dbus-launch writes the bus address to a file under ~/.dbus when
+ * it starts one; the address is only used if the file belongs to
+ * us, the bus process it names is still there and any socket file
+ * in the address still exists. The caller still has to connect to
+ * be sure.
+ *
+ * If successful, returns #TRUE and appends the address to @p
+ * address. Returns #FALSE if there is no usable bus, or on OOM.
+ *
+ * @param address a DBusString where the address can be stored
+ * @returns #TRUE if an address was found
+ */
+dbus_bool_t
+_dbus_lookup_autolaunch_address (DBusString *address)
+{
+  DBusString filename;
+  DBusString contents;
+  DBusString value;
+  struct stat sb;
+  long pid;
+  dbus_bool_t retval = FALSE;
+
+  if (!_dbus_string_init (&filename))
+    return FALSE;
+
+  if (!_dbus_string_init (&contents))
+    {
+      _dbus_string_free (&filename);
+      return FALSE;
+    }
+
+  if (!_dbus_string_init (&value))
+    {
+      _dbus_string_free (&filename);
+      _dbus_string_free (&contents);
+      return FALSE;
+    }
+
+  if (!append_autolaunch_file_name (&filename))
+    goto out;
+
+  if (stat (_dbus_string_get_const_data (&filename), &sb) < 0 ||
+      !S_ISREG (sb.st_mode) || sb.st_uid != getuid ())
+    goto out;
+
+  if (!_dbus_file_get_contents (&contents, &filename, NULL))
+    goto out;
+
+  if (!get_session_file_value (&contents, "DBUS_SESSION_BUS_PID=", &value) ||
+      !_dbus_string_parse_int (&value, 0, &pid, NULL) ||
+      pid <= 0 || kill (pid, 0) < 0)
+    goto out;
+
+  _dbus_string_set_length (&value, 0);
+
+  if (!get_session_file_value (&contents, "DBUS_SESSION_BUS_ADDRESS=",
+                               &value) ||
+      _dbus_string_get_length (&value) == 0 ||
+      !autolaunch_sockets_exist (_dbus_string_get_const_data (&value)))
+    goto out;
+
+  _dbus_verbose ("using autolaunched bus %s from %s\n",
+                 _dbus_string_get_const_data (&value),
+                 _dbus_string_get_const_data (&filename));
+
+  retval = _dbus_string_copy (&value, 0, address,
+                              _dbus_string_get_length (address));
+
+ out:
+  _dbus_string_free (&filename);
+  _dbus_string_free (&contents);
+  _dbus_string_free (&value);
+  return retval;
+}
+
 /**
  * Reads the uuid of the machine we're running on from
  * the dbus configuration. Optionally try to create it
@@ -3574,6 +4227,109 @@ _dbus_flush_caches (void)
   _dbus_user_database_flush_system ();
 }
 
+/* Mapped blocks come in multiples of this, the usual transparent
+ * huge page size, so that the kernel can back them with huge pages
+ */
+#define PAGES_GRANULE (2 * 1024 * 1024)
+
+static dbus_bool_t
+round_to_granule (int *size)
+{
+  if (*size > _DBUS_INT_MAX - PAGES_GRANULE)
+    return FALSE;
+
+  *size = (*size + PAGES_GRANULE - 1) & ~(PAGES_GRANULE - 1);
+  return TRUE;
+}
+
+/**
+ * Maps an anonymous block of memory straight from the kernel, for
+ * buffers big enough that growing them by realloc() and copy would
+ * hurt. Where the kernel supports it the block is backed by huge
+ * pages, which take less TLB space, and can later be grown with
+ * _dbus_pages_realloc() without copying.
+ *
+ * @param size the size wanted; rounded up to what was mapped
+ * @returns the block, or #NULL if it could not be mapped
+ */
+void*
+_dbus_pages_alloc (int *size)
+{
+  void *block;
+
+  if (!round_to_granule (size))
+    return NULL;
+
+  block = mmap (NULL, *size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (block == MAP_FAILED)
+    return NULL;
+
+#ifdef MADV_HUGEPAGE
+  madvise (block, *size, MADV_HUGEPAGE);
+#endif
+
+  return block;
+}
+
+/**
+ * Resizes a block from _dbus_pages_alloc(), keeping its contents up
+ * to the smaller of the two sizes. The kernel moves the pages rather
+ * than their contents if it can.
+ *
+ * @param block the block
+ * @param old_size its size, as returned when it was mapped
+ * @param new_size the size wanted; rounded up to what was mapped
+ * @returns the block, possibly moved, or #NULL if it could not be
+ * resized, in which case the old one is untouched
+ */
+void*
+_dbus_pages_realloc (void *block,
+                     int   old_size,
+                     int  *new_size)
+{
+  void *new_block;
+
+  if (!round_to_granule (new_size))
+    return NULL;
+
+  if (*new_size == old_size)
+    return block;
+
+#ifdef MREMAP_MAYMOVE
+  new_block = mremap (block, old_size, *new_size, MREMAP_MAYMOVE);
+  if (new_block == MAP_FAILED)
+    return NULL;
+
+#ifdef MADV_HUGEPAGE
+  if (*new_size > old_size)
+    madvise (new_block, *new_size, MADV_HUGEPAGE);
+#endif
+#else
+  new_block = _dbus_pages_alloc (new_size);
+  if (new_block == NULL)
+    return NULL;
+
+  memcpy (new_block, block, MIN (old_size, *new_size));
+  munmap (block, old_size);
+#endif
+
+  return new_block;
+}
+
+/**
+ * Unmaps a block from _dbus_pages_alloc().
+ *
+ * @param block the block
+ * @param size its size, as returned when it was mapped
+ */
+void
+_dbus_pages_free (void *block,
+                  int   size)
+{
+  munmap (block, size);
+}
+
 /**
  * Appends the directory in which a keyring for the given credentials
  * should be stored.  The credentials should have either a Windows or
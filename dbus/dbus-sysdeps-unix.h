@@ -74,6 +74,11 @@ int _dbus_listen_unix_socket  (const char     *path,
 
 int _dbus_listen_systemd_sockets (int       **fd,
                                  DBusError *error);
+dbus_bool_t _dbus_exec_with_listen_fds (const char  *path,
+                                        char       **argv,
+                                        const int   *fds,
+                                        int          n_fds,
+                                        DBusError   *error);
 
 dbus_bool_t _dbus_read_credentials (int               client_fd,
                                     DBusCredentials  *credentials,
@@ -26,6 +26,7 @@
 #include "dbus-sysdeps.h"
 #include "dbus-sysdeps-unix.h"
 #include "dbus-internals.h"
+#include "dbus-list.h"
 #include "dbus-pipe.h"
 #include "dbus-protocol.h"
 #include "dbus-string.h"
@@ -47,6 +48,16 @@
 #include <dirent.h>
 #include <sys/un.h>
 #include <syslog.h>
+#include <pthread.h>
+#if defined(HAVE_SCHED_SETAFFINITY) || defined(HAVE_SCHED_SETSCHEDULER)
+#include <sched.h>
+#endif
+#ifdef HAVE_MLOCKALL
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_MALLOPT
+#include <malloc.h>
+#endif
 
 #ifdef HAVE_SYS_SYSLIMITS_H
 #include <sys/syslimits.h>
@@ -369,11 +380,417 @@ _dbus_change_to_daemon_user  (const char    *user,
 }
 #endif /* !HAVE_LIBAUDIT */
 
+/**
+ * Restricts the calling thread, and any threads it starts later, to
+ * the given CPUs. On a NUMA system the kernel then normally allocates
+ * memory touched from now on from the node those CPUs belong to.
+ *
+ * @param cpus list of CPU numbers, stored with _DBUS_INT_TO_POINTER()
+ * @param error return location for errors
+ * @returns #FALSE on failure
+ */
+dbus_bool_t
+_dbus_set_cpu_affinity (DBusList  **cpus,
+                        DBusError  *error)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+  cpu_set_t *set;
+  size_t size;
+  DBusList *link;
+  int max_cpu;
+
+  max_cpu = 0;
+  for (link = _dbus_list_get_first_link (cpus);
+       link != NULL;
+       link = _dbus_list_get_next_link (cpus, link))
+    max_cpu = MAX (max_cpu, _DBUS_POINTER_TO_INT (link->data));
+
+  set = CPU_ALLOC (max_cpu + 1);
+  if (set == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  size = CPU_ALLOC_SIZE (max_cpu + 1);
+  CPU_ZERO_S (size, set);
+
+  for (link = _dbus_list_get_first_link (cpus);
+       link != NULL;
+       link = _dbus_list_get_next_link (cpus, link))
+    CPU_SET_S (_DBUS_POINTER_TO_INT (link->data), size, set);
+
+  if (sched_setaffinity (0, size, set) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set CPU affinity: %s",
+                      _dbus_strerror (errno));
+      CPU_FREE (set);
+      return FALSE;
+    }
+
+  CPU_FREE (set);
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Setting CPU affinity is not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/** How much stack _dbus_become_realtime() faults in */
+#define REALTIME_STACK_PREFAULT (64 * 1024)
+
+/* Touches a chunk of stack now, so calls deeper than usual later on
+ * don't take page faults
+ */
+static void
+prefault_stack (void)
+{
+  volatile unsigned char stack[REALTIME_STACK_PREFAULT];
+  int i;
+
+  for (i = 0; i < REALTIME_STACK_PREFAULT; i += 1024)
+    stack[i] = 0;
+
+  (void) stack[0];
+}
+
+/**
+ * Trades memory for predictable latency: locks all current and
+ * future memory of the process into RAM, keeps malloc() from handing
+ * freed memory back to the kernel, and faults in some stack and
+ * reserve bytes of heap up front, so the main loop rarely takes a
+ * page fault. If priority is nonzero, the calling thread also moves
+ * to the SCHED_FIFO scheduling class at that priority, which needs
+ * privileges.
+ *
+ * Allocations still happen afterwards; they are merely served from
+ * memory that is already resident.
+ *
+ * @param priority SCHED_FIFO priority, or 0 to leave scheduling alone
+ * @param reserve bytes of heap to fault in
+ * @param error return location for errors
+ * @returns #FALSE on failure, in which case some steps may have
+ *  taken effect
+ */
+dbus_bool_t
+_dbus_become_realtime (int         priority,
+                       long        reserve,
+                       DBusError  *error)
+{
+#ifdef HAVE_MLOCKALL
+  if (mlockall (MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to lock memory: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+#if defined(HAVE_MALLOPT) && defined(M_TRIM_THRESHOLD) && defined(M_MMAP_MAX)
+  /* Freed memory would otherwise be unmapped, and faulted in again
+   * when next needed
+   */
+  mallopt (M_TRIM_THRESHOLD, -1);
+  mallopt (M_MMAP_MAX, 0);
+#endif
+
+  prefault_stack ();
+
+  if (reserve > 0)
+    {
+      unsigned char *heap;
+      long i;
+
+      heap = dbus_malloc (reserve);
+      if (heap == NULL)
+        {
+          _DBUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      for (i = 0; i < reserve; i += 1024)
+        heap[i] = 0;
+
+      dbus_free (heap);
+    }
+
+  if (priority > 0)
+    {
+#ifdef HAVE_SCHED_SETSCHEDULER
+      struct sched_param param;
+
+      param.sched_priority = priority;
+
+      if (sched_setscheduler (0, SCHED_FIFO, &param) < 0)
+        {
+          dbus_set_error (error, _dbus_error_from_errno (errno),
+                          "Failed to set SCHED_FIFO priority %d: %s",
+                          priority, _dbus_strerror (errno));
+          return FALSE;
+        }
+#else
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Real-time scheduling is not supported on this platform");
+      return FALSE;
+#endif
+    }
+
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Locking memory is not supported on this platform");
+  return FALSE;
+#endif
+}
+
 void 
 _dbus_init_system_log (void)
 {
   openlog ("dbus", LOG_PID, LOG_DAEMON);
 }
+
+/* Once the log thread is running, _dbus_system_logv() formats each
+ * message into this ring and returns; the thread does the syslog()
+ * call, which can block for as long as syslogd or journald likes.
+ * When the ring is full, messages are counted and dropped.
+ */
+#define SYSTEM_LOG_QUEUE_LENGTH 256
+#define SYSTEM_LOG_MAX_MESSAGE 1024
+
+typedef struct
+{
+  int flags;
+  char text[SYSTEM_LOG_MAX_MESSAGE];
+} SystemLogEntry;
+
+static pthread_mutex_t system_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t system_log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t system_log_thread;
+static dbus_bool_t system_log_running = FALSE;
+static dbus_bool_t system_log_stopping = FALSE;
+static dbus_bool_t system_log_atfork_installed = FALSE;
+static SystemLogEntry *system_log_queue = NULL;
+static unsigned int system_log_head = 0;
+static unsigned int system_log_count = 0;
+/* dropped since the thread last said so, and since startup */
+static unsigned long system_log_dropped = 0;
+static unsigned long system_log_total_dropped = 0;
+
+static void *
+system_log_thread_main (void *data)
+{
+  SystemLogEntry entry;
+  unsigned long dropped;
+
+  pthread_mutex_lock (&system_log_lock);
+
+  while (TRUE)
+    {
+      while (system_log_count == 0 && !system_log_stopping)
+        pthread_cond_wait (&system_log_cond, &system_log_lock);
+
+      if (system_log_count == 0)
+        break;
+
+      entry = system_log_queue[system_log_head];
+      system_log_head = (system_log_head + 1) % SYSTEM_LOG_QUEUE_LENGTH;
+      system_log_count -= 1;
+
+      dropped = 0;
+      if (system_log_count == 0)
+        {
+          dropped = system_log_dropped;
+          system_log_dropped = 0;
+        }
+
+      pthread_mutex_unlock (&system_log_lock);
+
+      syslog (entry.flags, "%s", entry.text);
+
+      if (dropped > 0)
+        syslog (LOG_DAEMON | LOG_WARNING,
+                "Dropped %lu log messages because the log queue was full",
+                dropped);
+
+      pthread_mutex_lock (&system_log_lock);
+    }
+
+  pthread_mutex_unlock (&system_log_lock);
+
+  return NULL;
+}
+
+static void
+system_log_atfork_prepare (void)
+{
+  pthread_mutex_lock (&system_log_lock);
+}
+
+static void
+system_log_atfork_parent (void)
+{
+  pthread_mutex_unlock (&system_log_lock);
+}
+
+static void
+system_log_atfork_child (void)
+{
+  /* The thread was not copied, so the child logs synchronously */
+  system_log_running = FALSE;
+  pthread_mutex_unlock (&system_log_lock);
+}
+
+/**
+ * Starts a thread that writes to the system log on behalf of
+ * _dbus_system_logv(), so that callers never wait for the system
+ * logger. Messages are queued in a bounded ring; if the logger falls
+ * so far behind that the ring fills up, further messages are dropped
+ * and the number dropped is logged once the ring drains.
+ *
+ * Messages still queued when the process exits without calling
+ * _dbus_system_log_stop_thread() are lost.
+ *
+ * @param error return location for errors
+ * @returns #FALSE if the thread could not be started
+ */
+dbus_bool_t
+_dbus_system_log_start_thread (DBusError *error)
+{
+  sigset_t all_signals;
+  sigset_t old_signals;
+  int rc;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (system_log_running)
+    return TRUE;
+
+  if (system_log_queue == NULL)
+    {
+      system_log_queue = dbus_new (SystemLogEntry, SYSTEM_LOG_QUEUE_LENGTH);
+      if (system_log_queue == NULL)
+        {
+          _DBUS_SET_OOM (error);
+          return FALSE;
+        }
+    }
+
+  if (!system_log_atfork_installed)
+    {
+      rc = pthread_atfork (system_log_atfork_prepare,
+                           system_log_atfork_parent,
+                           system_log_atfork_child);
+      if (rc != 0)
+        {
+          dbus_set_error (error, _dbus_error_from_errno (rc),
+                          "Failed to install fork handlers: %s",
+                          _dbus_strerror (rc));
+          return FALSE;
+        }
+
+      system_log_atfork_installed = TRUE;
+    }
+
+  system_log_stopping = FALSE;
+
+  /* Signals are for the main loop, not for the log thread */
+  sigfillset (&all_signals);
+  pthread_sigmask (SIG_SETMASK, &all_signals, &old_signals);
+  rc = pthread_create (&system_log_thread, NULL, system_log_thread_main,
+                       NULL);
+  pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+
+  if (rc != 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (rc),
+                      "Failed to start log thread: %s", _dbus_strerror (rc));
+      return FALSE;
+    }
+
+  pthread_mutex_lock (&system_log_lock);
+  system_log_running = TRUE;
+  pthread_mutex_unlock (&system_log_lock);
+
+  return TRUE;
+}
+
+/**
+ * Writes out everything queued by the log thread, then stops it.
+ * Afterwards _dbus_system_logv() logs synchronously again. Does
+ * nothing if the thread is not running.
+ */
+void
+_dbus_system_log_stop_thread (void)
+{
+  pthread_mutex_lock (&system_log_lock);
+
+  if (!system_log_running)
+    {
+      pthread_mutex_unlock (&system_log_lock);
+      return;
+    }
+
+  system_log_running = FALSE;
+  system_log_stopping = TRUE;
+  pthread_cond_signal (&system_log_cond);
+  pthread_mutex_unlock (&system_log_lock);
+
+  pthread_join (system_log_thread, NULL);
+}
+
+/**
+ * Gets the number of messages the log thread has had to drop since
+ * the process started.
+ *
+ * @returns the number of dropped messages
+ */
+unsigned long
+_dbus_system_log_get_dropped (void)
+{
+  unsigned long dropped;
+
+  pthread_mutex_lock (&system_log_lock);
+  dropped = system_log_total_dropped;
+  pthread_mutex_unlock (&system_log_lock);
+
+  return dropped;
+}
+
+/* Returns FALSE if the caller should log synchronously */
+static dbus_bool_t
+system_log_queuev (int flags, const char *msg, va_list args)
+{
+  SystemLogEntry *entry;
+
+  pthread_mutex_lock (&system_log_lock);
+
+  if (!system_log_running)
+    {
+      pthread_mutex_unlock (&system_log_lock);
+      return FALSE;
+    }
+
+  if (system_log_count == SYSTEM_LOG_QUEUE_LENGTH)
+    {
+      system_log_dropped += 1;
+      system_log_total_dropped += 1;
+      pthread_mutex_unlock (&system_log_lock);
+      return TRUE;
+    }
+
+  entry = &system_log_queue[(system_log_head + system_log_count) %
+                            SYSTEM_LOG_QUEUE_LENGTH];
+  entry->flags = flags;
+  vsnprintf (entry->text, sizeof (entry->text), msg, args);
+  system_log_count += 1;
+
+  pthread_cond_signal (&system_log_cond);
+  pthread_mutex_unlock (&system_log_lock);
+
+  return TRUE;
+}
 /**
  * Log a message to the system log file (e.g. syslog on Unix).
  *
@@ -422,6 +839,10 @@ _dbus_system_logv (DBusSystemLogSeverity severity, const char *msg, va_list args
         return;
     }
 
+  if (severity != DBUS_SYSTEM_LOG_FATAL &&
+      system_log_queuev (flags, msg, args))
+    return;
+
   vsyslog (flags, msg, args);
 
   if (severity == DBUS_SYSTEM_LOG_FATAL)
@@ -256,6 +256,42 @@ _dbus_change_to_daemon_user  (const char    *user,
   return TRUE;
 }
 
+/**
+ * Restricts the process to the given CPUs. Not implemented on
+ * Windows.
+ *
+ * @param cpus list of CPU numbers, stored with _DBUS_INT_TO_POINTER()
+ * @param error return location for errors
+ * @returns #FALSE, always
+ */
+dbus_bool_t
+_dbus_set_cpu_affinity (DBusList  **cpus,
+                        DBusError  *error)
+{
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Setting CPU affinity is not supported on this platform");
+  return FALSE;
+}
+
+/**
+ * Locks memory and raises scheduling priority for low latency. Not
+ * implemented on Windows.
+ *
+ * @param priority real-time priority, or 0
+ * @param reserve bytes of heap to fault in
+ * @param error return location for errors
+ * @returns #FALSE, always
+ */
+dbus_bool_t
+_dbus_become_realtime (int         priority,
+                       long        reserve,
+                       DBusError  *error)
+{
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Locking memory is not supported on this platform");
+  return FALSE;
+}
+
 void
 _dbus_init_system_log (void)
 {
@@ -313,6 +349,25 @@ _dbus_system_logv (DBusSystemLogSeverity severity, const char *msg, va_list args
     exit (1);
 }
 
+dbus_bool_t
+_dbus_system_log_start_thread (DBusError *error)
+{
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Asynchronous logging is not supported on this platform");
+  return FALSE;
+}
+
+void
+_dbus_system_log_stop_thread (void)
+{
+}
+
+unsigned long
+_dbus_system_log_get_dropped (void)
+{
+  return 0;
+}
+
 /** Installs a signal handler
  *
  * @param sig the signal to handle
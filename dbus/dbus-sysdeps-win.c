@@ -36,6 +36,16 @@
 #endif
 #endif
 
+/* Winsock's fd_set is an array of FD_SETSIZE sockets, 64 by default,
+ * and FD_SET() silently drops any beyond that; when select() is all
+ * we have (see _dbus_poll()), a bus with more clients than that would
+ * stop hearing from some of them. It has to be set before winsock2.h
+ * is first included.
+ */
+#ifndef FD_SETSIZE
+#define FD_SETSIZE 1024
+#endif
+
 #include "dbus-internals.h"
 #include "dbus-sysdeps.h"
 #include "dbus-threads.h"
@@ -84,6 +94,14 @@ extern BOOL WINAPI ConvertSidToStringSidA (PSID Sid, LPSTR *StringSid);
 #endif
 #endif // HAVE_WSPIAPI_H
 
+#ifdef HAVE_AFUNIX_H
+/* AF_UNIX sockets, Windows 10 1803 and later */
+#include <afunix.h>
+#ifndef PROCESS_QUERY_LIMITED_INFORMATION
+#define PROCESS_QUERY_LIMITED_INFORMATION 0x1000
+#endif
+#endif
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
@@ -447,6 +465,65 @@ _dbus_write_socket_two (int               fd,
   return bytes_written;
 }
 
+/**
+ * Like _dbus_write_socket_two() but writes any number of chunks,
+ * up to #_DBUS_MAX_WRITE_CHUNKS, with a single WSASend().
+ *
+ * @param fd the file descriptor
+ * @param chunks the ranges to write, in order
+ * @param n_chunks number of ranges
+ * @returns total bytes written from all chunks, or -1 on error
+ */
+int
+_dbus_write_socket_chunks (int                   fd,
+                           const DBusWriteChunk *chunks,
+                           int                   n_chunks)
+{
+  WSABUF vectors[_DBUS_MAX_WRITE_CHUNKS];
+  int rc;
+  int i;
+  DWORD bytes_written;
+
+  _dbus_assert (n_chunks > 0);
+  _dbus_assert (n_chunks <= _DBUS_MAX_WRITE_CHUNKS);
+
+  for (i = 0; i < n_chunks; i++)
+    {
+      _dbus_assert (chunks[i].start >= 0);
+      _dbus_assert (chunks[i].len >= 0);
+
+      vectors[i].buf = (char*) _dbus_string_get_const_data_len (chunks[i].buffer,
+                                                                chunks[i].start,
+                                                                chunks[i].len);
+      vectors[i].len = chunks[i].len;
+    }
+
+ again:
+
+  _dbus_verbose ("WSASend: %d chunks fd=%d\n", n_chunks, fd);
+  rc = WSASend (fd,
+                vectors,
+                n_chunks,
+                &bytes_written,
+                0,
+                NULL,
+                NULL);
+
+  if (rc == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      _dbus_verbose ("WSASend: failed: %s\n", _dbus_strerror_from_errno ());
+      bytes_written = -1;
+    }
+  else
+    _dbus_verbose ("WSASend: = %ld\n", bytes_written);
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+}
+
 dbus_bool_t
 _dbus_socket_is_invalid (int fd)
 {
@@ -913,7 +990,194 @@ out0:
 }
 
 /**
- * Wrapper for poll().
+ * Opens a nonblocking wakeup pipe, as a pair of sockets.
+ *
+ * @param wakeup the pipe to open
+ * @param error error return
+ * @returns #FALSE on failure (if error is set)
+ */
+dbus_bool_t
+_dbus_wakeup_pipe_open (DBusWakeupPipe *wakeup,
+                        DBusError      *error)
+{
+  return _dbus_full_duplex_pipe (&wakeup->read_fd, &wakeup->write_fd,
+                                 FALSE, error);
+}
+
+/**
+ * Closes a wakeup pipe.
+ *
+ * @param wakeup the pipe
+ */
+void
+_dbus_wakeup_pipe_close (DBusWakeupPipe *wakeup)
+{
+  _dbus_close_socket (wakeup->write_fd, NULL);
+  _dbus_close_socket (wakeup->read_fd, NULL);
+
+  wakeup->read_fd = -1;
+  wakeup->write_fd = -1;
+}
+
+/**
+ * Makes the wakeup pipe readable. Never blocks; if the pipe is full,
+ * it was readable already.
+ *
+ * @param wakeup the pipe
+ */
+void
+_dbus_wakeup_pipe_signal (DBusWakeupPipe *wakeup)
+{
+  send (wakeup->write_fd, "", 1, 0);
+}
+
+/**
+ * Reads whatever _dbus_wakeup_pipe_signal() wrote, so the pipe is no
+ * longer readable.
+ *
+ * @param wakeup the pipe
+ */
+void
+_dbus_wakeup_pipe_drain (DBusWakeupPipe *wakeup)
+{
+  char buf[64];
+
+  while (recv (wakeup->read_fd, buf, sizeof (buf), 0) == sizeof (buf))
+    ;
+}
+
+#ifndef DBUS_WINCE
+/* WSAPoll() only exists from Vista on and we still build for XP, so
+ * it is looked up at runtime, with its struct and flags declared here
+ * to match <winsock2.h>.
+ */
+typedef struct
+{
+  SOCKET fd;
+  SHORT events;
+  SHORT revents;
+} DBusWSAPollFD;
+
+#define DBUS_WSA_POLLERR    0x0001
+#define DBUS_WSA_POLLHUP    0x0002
+#define DBUS_WSA_POLLNVAL   0x0004
+#define DBUS_WSA_POLLWRNORM 0x0010
+#define DBUS_WSA_POLLRDNORM 0x0100
+
+typedef int (WSAAPI *DBusWSAPollFunc) (DBusWSAPollFD *fds,
+                                       ULONG          n_fds,
+                                       INT            timeout);
+
+/* Threads racing on the first lookup just do it twice */
+static DBusWSAPollFunc
+get_wsapoll (void)
+{
+  static dbus_bool_t looked_up = FALSE;
+  static DBusWSAPollFunc wsapoll = NULL;
+
+  if (!looked_up)
+    {
+      HMODULE ws2 = GetModuleHandleA ("ws2_32.dll");
+
+      if (ws2 != NULL)
+        wsapoll = (DBusWSAPollFunc) GetProcAddress (ws2, "WSAPoll");
+
+      looked_up = TRUE;
+    }
+
+  return wsapoll;
+}
+
+#define DBUS_STACK_WSAPOLLFDS 64
+
+/* Unlike select(), WSAPoll() takes any number of sockets and costs
+ * nothing to set up beyond filling in the array, which is the shape
+ * DBusPollFD already has. It never reports a failed connect(), but
+ * our connects are blocking, so that does not matter here.
+ */
+static int
+poll_with_wsapoll (DBusWSAPollFunc  wsapoll,
+                   DBusPollFD      *fds,
+                   int              n_fds,
+                   int              timeout_milliseconds)
+{
+  DBusWSAPollFD fds_on_stack[DBUS_STACK_WSAPOLLFDS];
+  DBusWSAPollFD *wfds;
+  int ready;
+  int i;
+
+  if (n_fds > DBUS_STACK_WSAPOLLFDS)
+    {
+      wfds = dbus_new (DBusWSAPollFD, n_fds);
+      if (wfds == NULL)
+        {
+          errno = ENOMEM;
+          return -1;
+        }
+    }
+  else
+    wfds = fds_on_stack;
+
+  for (i = 0; i < n_fds; i++)
+    {
+      wfds[i].fd = fds[i].fd;
+      wfds[i].events = 0;
+      wfds[i].revents = 0;
+
+      if (fds[i].events & _DBUS_POLLIN)
+        wfds[i].events |= DBUS_WSA_POLLRDNORM;
+
+      if (fds[i].events & _DBUS_POLLOUT)
+        wfds[i].events |= DBUS_WSA_POLLWRNORM;
+    }
+
+  ready = (* wsapoll) (wfds, n_fds, timeout_milliseconds);
+
+  if (DBUS_SOCKET_API_RETURNS_ERROR (ready))
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      if (errno != WSAEWOULDBLOCK)
+        _dbus_verbose ("WSAPoll: failed: %s\n", _dbus_strerror_from_errno ());
+    }
+  else
+    {
+      for (i = 0; i < n_fds; i++)
+        {
+          fds[i].revents = 0;
+
+          if (wfds[i].revents & DBUS_WSA_POLLRDNORM)
+            fds[i].revents |= _DBUS_POLLIN;
+
+          if (wfds[i].revents & DBUS_WSA_POLLWRNORM)
+            fds[i].revents |= _DBUS_POLLOUT;
+
+          if (wfds[i].revents & DBUS_WSA_POLLERR)
+            fds[i].revents |= _DBUS_POLLERR;
+
+          if (wfds[i].revents & DBUS_WSA_POLLHUP)
+            fds[i].revents |= _DBUS_POLLHUP;
+
+          if (wfds[i].revents & DBUS_WSA_POLLNVAL)
+            fds[i].revents |= _DBUS_POLLNVAL;
+        }
+    }
+
+  if (wfds != fds_on_stack)
+    dbus_free (wfds);
+
+  return ready;
+}
+#endif /* !DBUS_WINCE */
+
+static int
+poll_emulated (DBusPollFD *fds,
+               int         n_fds,
+               int         timeout_milliseconds);
+
+/**
+ * Wrapper for poll(). Uses WSAPoll() where Windows has it, and
+ * otherwise emulates it with select(), which is limited to
+ * FD_SETSIZE sockets.
  *
  * @param fds the file descriptors to poll
  * @param n_fds number of descriptors in the array
@@ -925,6 +1189,22 @@ _dbus_poll (DBusPollFD *fds,
             int         n_fds,
             int         timeout_milliseconds)
 {
+#ifndef DBUS_WINCE
+  DBusWSAPollFunc wsapoll;
+
+  wsapoll = get_wsapoll ();
+  if (wsapoll != NULL)
+    return poll_with_wsapoll (wsapoll, fds, n_fds, timeout_milliseconds);
+#endif
+
+  return poll_emulated (fds, n_fds, timeout_milliseconds);
+}
+
+static int
+poll_emulated (DBusPollFD *fds,
+               int         n_fds,
+               int         timeout_milliseconds)
+{
 #define USE_CHRIS_IMPL 0
 
 #if USE_CHRIS_IMPL
@@ -1571,10 +1851,253 @@ _dbus_listen_tcp_socket (const char     *host,
 }
 
 
+#ifdef HAVE_AFUNIX_H
+/**
+ * Creates a socket and connects it to the AF_UNIX socket at the
+ * given path. Windows 10 (1803) and later implement filesystem
+ * AF_UNIX sockets; there is no abstract namespace. The connection
+ * fd is returned, and is set up as nonblocking.
+ *
+ * @param path the path to the socket
+ * @param abstract must be #FALSE on Windows
+ * @param error return location for error code
+ * @returns connection file descriptor or -1 on error
+ */
+int
+_dbus_connect_unix_socket (const char     *path,
+                           dbus_bool_t     abstract,
+                           DBusError      *error)
+{
+  int fd;
+  size_t path_len;
+  struct sockaddr_un addr;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (abstract)
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Operating system does not support abstract socket namespace\n");
+      return -1;
+    }
+
+  path_len = strlen (path);
+  if (path_len >= sizeof (addr.sun_path))
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "Socket name too long\n");
+      return -1;
+    }
+
+  _dbus_win_startup_winsock ();
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (DBUS_SOCKET_IS_INVALID (fd))
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error,
+                      _dbus_error_from_errno (errno),
+                      "Failed to open socket: %s",
+                      _dbus_strerror_from_errno ());
+      return -1;
+    }
+
+  _DBUS_ZERO (addr);
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path, path_len);
+
+  if (connect (fd, (struct sockaddr*) &addr, sizeof (addr)) == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error,
+                      _dbus_error_from_errno (errno),
+                      "Failed to connect to socket %s: %s",
+                      path, _dbus_strerror_from_errno ());
+      closesocket (fd);
+      return -1;
+    }
+
+  if (!_dbus_set_fd_nonblocking (fd, error))
+    {
+      closesocket (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/**
+ * Creates an AF_UNIX socket and binds it to the given path, then
+ * listens on the socket. The socket is set to be nonblocking. A
+ * stale socket file left at the path by an earlier server is
+ * removed first, as on Unix.
+ *
+ * @param path the socket name
+ * @param abstract must be #FALSE on Windows
+ * @param error return location for errors
+ * @returns the listening file descriptor or -1 on error
+ */
+int
+_dbus_listen_unix_socket (const char     *path,
+                          dbus_bool_t     abstract,
+                          DBusError      *error)
+{
+  int listen_fd;
+  size_t path_len;
+  struct sockaddr_un addr;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (abstract)
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Operating system does not support abstract socket namespace\n");
+      return -1;
+    }
+
+  path_len = strlen (path);
+  if (path_len >= sizeof (addr.sun_path))
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "Socket name too long\n");
+      return -1;
+    }
+
+  _dbus_win_startup_winsock ();
+
+  listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (DBUS_SOCKET_IS_INVALID (listen_fd))
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to create socket \"%s\": %s",
+                      path, _dbus_strerror_from_errno ());
+      return -1;
+    }
+
+  /* As on Unix, remove a socket left behind by an earlier server.
+   * AF_UNIX sockets show up as reparse points; checking for that at
+   * least avoids deleting an ordinary file by accident.
+   */
+  {
+    DWORD attributes = GetFileAttributesA (path);
+
+    if (attributes != INVALID_FILE_ATTRIBUTES &&
+        (attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+      DeleteFileA (path);
+  }
+
+  _DBUS_ZERO (addr);
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path, path_len);
+
+  if (bind (listen_fd, (struct sockaddr*) &addr, sizeof (addr)) == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to bind socket \"%s\": %s",
+                      path, _dbus_strerror_from_errno ());
+      closesocket (listen_fd);
+      return -1;
+    }
+
+  if (listen (listen_fd, 30 /* backlog */) == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to listen on socket \"%s\": %s",
+                      path, _dbus_strerror_from_errno ());
+      closesocket (listen_fd);
+      return -1;
+    }
+
+  if (!_dbus_set_fd_nonblocking (listen_fd, error))
+    {
+      closesocket (listen_fd);
+      return -1;
+    }
+
+  return listen_fd;
+}
+
+/**
+ * Gets the credentials of the process at the other end of an
+ * AF_UNIX socket: its pid from the kernel, and the user SID of that
+ * process' token. Sockets of other families have no peer process,
+ * in which case nothing is added.
+ *
+ * @param handle the connected socket
+ * @param credentials credentials to add to
+ * @returns #FALSE if no memory
+ */
+static dbus_bool_t
+add_peer_credentials (int              handle,
+                      DBusCredentials *credentials)
+{
+  ULONG peer_pid = 0;
+  DWORD n;
+  HANDLE process = NULL;
+  HANDLE process_token = NULL;
+  TOKEN_USER *token_user = NULL;
+  char *sid = NULL;
+  dbus_bool_t retval = TRUE;
+
+  if (WSAIoctl (handle, SIO_AF_UNIX_GETPEERPID, NULL, 0,
+                &peer_pid, sizeof (peer_pid), &n, NULL, NULL) != 0 ||
+      peer_pid == 0)
+    return TRUE;
+
+  process = OpenProcess (PROCESS_QUERY_LIMITED_INFORMATION, FALSE, peer_pid);
+  if (process == NULL)
+    {
+      _dbus_win_warn_win_error ("OpenProcess failed", GetLastError ());
+      return TRUE;
+    }
+
+  if (!OpenProcessToken (process, TOKEN_QUERY, &process_token))
+    {
+      _dbus_win_warn_win_error ("OpenProcessToken failed", GetLastError ());
+      process_token = NULL;
+      goto out;
+    }
+
+  if ((!GetTokenInformation (process_token, TokenUser, NULL, 0, &n)
+       && GetLastError () != ERROR_INSUFFICIENT_BUFFER)
+      || (token_user = alloca (n)) == NULL
+      || !GetTokenInformation (process_token, TokenUser, token_user, n, &n))
+    {
+      _dbus_win_warn_win_error ("GetTokenInformation failed", GetLastError ());
+      goto out;
+    }
+
+  if (!IsValidSid (token_user->User.Sid) ||
+      !ConvertSidToStringSidA (token_user->User.Sid, &sid))
+    {
+      _dbus_verbose ("%s invalid sid\n", __FUNCTION__);
+      goto out;
+    }
+
+  if (!_dbus_credentials_add_unix_pid (credentials, peer_pid) ||
+      !_dbus_credentials_add_windows_sid (credentials, sid))
+    retval = FALSE;
+
+ out:
+  if (sid != NULL)
+    LocalFree (sid);
+  if (process_token != NULL)
+    CloseHandle (process_token);
+  CloseHandle (process);
+
+  return retval;
+}
+#endif /* HAVE_AFUNIX_H */
+
 /**
  * Accepts a connection on a listening socket.
  * Handles EINTR for you.
  *
+ * The returned socket is nonblocking.
+ *
  * @param listen_fd the listen file descriptor
  * @returns the connection fd of the client, or -1 on error
  */
@@ -1591,13 +2114,49 @@ _dbus_accept  (int listen_fd)
       DBUS_SOCKET_SET_ERRNO ();
       if (errno == EINTR)
         goto retry;
+
+      return client_fd;
     }
 
   _dbus_verbose ("client fd %d accepted\n", client_fd);
-  
+
+  if (!_dbus_set_fd_nonblocking (client_fd, NULL))
+    {
+      _dbus_close_socket (client_fd, NULL);
+      return -1;
+    }
+
   return client_fd;
 }
 
+/**
+ * Applies the tuning from a TCP address to a connected socket.
+ * Failures are ignored; there is no busy polling here.
+ *
+ * @param fd the socket
+ * @param options what to set
+ */
+void
+_dbus_set_tcp_options (int                   fd,
+                       const DBusTcpOptions *options)
+{
+  if (options->nodelay >= 0)
+    setsockopt (fd, IPPROTO_TCP, TCP_NODELAY,
+                (const char *) &options->nodelay, sizeof (options->nodelay));
+
+  if (options->keepalive >= 0)
+    setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE,
+                (const char *) &options->keepalive, sizeof (options->keepalive));
+
+  if (options->sndbuf >= 0)
+    setsockopt (fd, SOL_SOCKET, SO_SNDBUF,
+                (const char *) &options->sndbuf, sizeof (options->sndbuf));
+
+  if (options->rcvbuf >= 0)
+    setsockopt (fd, SOL_SOCKET, SO_RCVBUF,
+                (const char *) &options->rcvbuf, sizeof (options->rcvbuf));
+}
+
 
 
 
@@ -1697,6 +2256,17 @@ _dbus_read_credentials_socket  (int              handle,
       _dbus_string_free(&buf);
     }
 
+#ifdef HAVE_AFUNIX_H
+  if (!add_peer_credentials (handle, credentials))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return FALSE;
+    }
+
+  if (!_dbus_credentials_are_anonymous (credentials))
+    return TRUE;
+#endif
+
   _dbus_credentials_add_from_current_process (credentials);
   _dbus_verbose("FIXME: get faked credentials from current process");
 
@@ -2669,6 +3239,15 @@ _dbus_daemon_already_runs (DBusString *address)
   return bRet;
 }
 
+/* The shared memory lookup in _dbus_get_autolaunch_address() is
+ * already cheap and doesn't start anything when a bus is running
+ */
+dbus_bool_t
+_dbus_lookup_autolaunch_address (DBusString *address)
+{
+  return FALSE;
+}
+
 dbus_bool_t
 _dbus_get_autolaunch_address (DBusString *address, 
                               DBusError *error)
@@ -2892,6 +3471,36 @@ _dbus_atomic_dec (DBusAtomic *atomic)
   return InterlockedDecrement (&atomic->value) + 1;
 }
 
+/**
+ * Reads a pointer published with _dbus_atomic_pointer_set(). Whatever
+ * was written to the object it points to before it was published is
+ * visible once the pointer is.
+ *
+ * @param location the pointer to read
+ * @returns its value
+ */
+void *
+_dbus_atomic_pointer_get (void * volatile *location)
+{
+  /* exchanging NULL for NULL reads with a full barrier */
+  return InterlockedCompareExchangePointer ((void **) location, NULL, NULL);
+}
+
+/**
+ * Publishes a pointer for _dbus_atomic_pointer_get(): everything
+ * written before this call is visible to a thread that reads the new
+ * value.
+ *
+ * @param location the pointer to write
+ * @param value its new value
+ */
+void
+_dbus_atomic_pointer_set (void * volatile *location,
+                          void            *value)
+{
+  InterlockedExchangePointer ((void **) location, value);
+}
+
 /**
  * Called when the bus daemon is signaled to reload its configuration; any
  * caches should be nuked. Of course any caches that need explicit reload
@@ -2904,6 +3513,27 @@ _dbus_flush_caches (void)
 {
 }
 
+/* Not implemented; large strings stay on the heap */
+void*
+_dbus_pages_alloc (int *size)
+{
+  return NULL;
+}
+
+void*
+_dbus_pages_realloc (void *block,
+                     int   old_size,
+                     int  *new_size)
+{
+  return NULL;
+}
+
+void
+_dbus_pages_free (void *block,
+                  int   size)
+{
+}
+
 /**
  * See if errno is EAGAIN or EWOULDBLOCK (this has to be done differently
  * for Winsock so is abstracted)
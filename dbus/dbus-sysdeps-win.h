@@ -80,6 +80,15 @@ _dbus_win_sid_to_name_and_domain (dbus_uid_t uid,
 
 dbus_bool_t _dbus_file_exists (const char *filename);
 
+#ifdef HAVE_AFUNIX_H
+int _dbus_connect_unix_socket (const char     *path,
+                               dbus_bool_t     abstract,
+                               DBusError      *error);
+int _dbus_listen_unix_socket  (const char     *path,
+                               dbus_bool_t     abstract,
+                               DBusError      *error);
+#endif
+
 dbus_bool_t _dbus_get_config_file_name(DBusString *config_file, 
                                        char *s);
 
@@ -140,6 +140,23 @@ int         _dbus_write_socket_two (int               fd,
                                     int               start2,
                                     int               len2);
 
+/**
+ * A range of bytes in a string, for gathered writes.
+ */
+typedef struct
+{
+  const DBusString *buffer; /**< String to write from */
+  int start;                /**< First byte to write */
+  int len;                  /**< Number of bytes to write */
+} DBusWriteChunk;
+
+/** Largest number of chunks _dbus_write_socket_chunks() accepts */
+#define _DBUS_MAX_WRITE_CHUNKS 32
+
+int         _dbus_write_socket_chunks (int                   fd,
+                                       const DBusWriteChunk *chunks,
+                                       int                   n_chunks);
+
 int _dbus_read_socket_with_unix_fds      (int               fd,
                                           DBusString       *buffer,
                                           int               count,
@@ -180,6 +197,22 @@ int _dbus_listen_tcp_socket   (const char     *host,
                                DBusError      *error);
 int _dbus_accept              (int             listen_fd);
 
+/**
+ * Tuning for a TCP connection, as given in its address. Anything
+ * left at -1 stays at the system's default.
+ */
+typedef struct
+{
+  int nodelay;   /**< TCP_NODELAY, 0 or 1 */
+  int keepalive; /**< SO_KEEPALIVE, 0 or 1 */
+  int sndbuf;    /**< SO_SNDBUF in bytes */
+  int rcvbuf;    /**< SO_RCVBUF in bytes */
+  int busy_poll; /**< SO_BUSY_POLL in microseconds, where there is one */
+} DBusTcpOptions;
+
+void _dbus_set_tcp_options    (int                   fd,
+                               const DBusTcpOptions *options);
+
 
 dbus_bool_t _dbus_read_credentials_socket (int               client_fd,
                                            DBusCredentials  *credentials,
@@ -243,6 +276,10 @@ struct DBusAtomic
 dbus_int32_t _dbus_atomic_inc (DBusAtomic *atomic);
 dbus_int32_t _dbus_atomic_dec (DBusAtomic *atomic);
 
+void* _dbus_atomic_pointer_get (void * volatile *location);
+void  _dbus_atomic_pointer_set (void * volatile *location,
+                                void            *value);
+
 
 /* AIX uses different values for poll */
 
@@ -398,6 +435,22 @@ dbus_bool_t _dbus_full_duplex_pipe (int              *fd1,
                                     dbus_bool_t       blocking,
                                     DBusError        *error);
 
+/**
+ * A descriptor that other threads can make readable, to wake up
+ * whoever polls it.
+ */
+typedef struct
+{
+  int read_fd;  /**< Polled for reading */
+  int write_fd; /**< Written to wake the reader, may be read_fd itself */
+} DBusWakeupPipe;
+
+dbus_bool_t _dbus_wakeup_pipe_open   (DBusWakeupPipe   *wakeup,
+                                      DBusError        *error);
+void        _dbus_wakeup_pipe_close  (DBusWakeupPipe   *wakeup);
+void        _dbus_wakeup_pipe_signal (DBusWakeupPipe   *wakeup);
+void        _dbus_wakeup_pipe_drain  (DBusWakeupPipe   *wakeup);
+
 void        _dbus_print_backtrace  (void);
 
 dbus_bool_t _dbus_become_daemon   (const DBusString *pidfile,
@@ -408,6 +461,11 @@ dbus_bool_t _dbus_become_daemon   (const DBusString *pidfile,
 dbus_bool_t _dbus_verify_daemon_user    (const char *user);
 dbus_bool_t _dbus_change_to_daemon_user (const char *user,
                                          DBusError  *error);
+dbus_bool_t _dbus_set_cpu_affinity      (DBusList  **cpus,
+                                         DBusError  *error);
+dbus_bool_t _dbus_become_realtime       (int         priority,
+                                         long        reserve,
+                                         DBusError  *error);
 
 dbus_bool_t _dbus_write_pid_to_file_and_pipe (const DBusString *pidfile,
                                               DBusPipe         *print_pid_pipe,
@@ -439,6 +497,10 @@ typedef enum {
 void _dbus_system_log (DBusSystemLogSeverity severity, const char *msg, ...) _DBUS_GNUC_PRINTF (2, 3);
 void _dbus_system_logv (DBusSystemLogSeverity severity, const char *msg, va_list args);
 
+dbus_bool_t   _dbus_system_log_start_thread (DBusError *error);
+void          _dbus_system_log_stop_thread  (void);
+unsigned long _dbus_system_log_get_dropped  (void);
+
 /* Define DBUS_VA_COPY() to do the right thing for copying va_list variables.
  * config.h may have already defined DBUS_VA_COPY as va_copy or __va_copy.
  */
@@ -476,6 +538,7 @@ void _dbus_system_logv (DBusSystemLogSeverity severity, const char *msg, va_list
 
 dbus_bool_t _dbus_get_autolaunch_address (DBusString *address, 
 					  DBusError *error);
+dbus_bool_t _dbus_lookup_autolaunch_address (DBusString *address);
 
 dbus_bool_t _dbus_lookup_session_address (dbus_bool_t *supported,
                                           DBusString  *address,
@@ -514,6 +577,13 @@ dbus_bool_t _dbus_change_to_daemon_user (const char *user,
 
 void _dbus_flush_caches (void);
 
+void* _dbus_pages_alloc   (int  *size);
+void* _dbus_pages_realloc (void *block,
+                           int   old_size,
+                           int  *new_size);
+void  _dbus_pages_free    (void *block,
+                           int   size);
+
 /*
  * replaces the term DBUS_PREFIX in configure_time_path by the
  * current dbus installation directory. On unix this function is a noop
@@ -27,6 +27,7 @@
 #include "dbus-test.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #if HAVE_LOCALE_H
 #include <locale.h>
 #endif
@@ -41,6 +42,17 @@ main (int    argc,
 #if HAVE_SETLOCALE
   setlocale(LC_ALL, "");
 #endif
+
+  /* dbus-test --perf [BENCHMARK] times the internals instead */
+  if (argc > 1 && strcmp (argv[1], "--perf") == 0)
+    {
+      dbus_internal_do_not_use_run_perf (argc > 2 ? argv[2] : NULL);
+      return 0;
+    }
+
+  /* dbus-test --stress [CASE] fails if hostile input costs superlinear time */
+  if (argc > 1 && strcmp (argv[1], "--stress") == 0)
+    return dbus_internal_do_not_use_run_stress (argc > 2 ? argv[2] : NULL) ? 0 : 1;
   
   if (argc > 1)
     test_data_dir = argv[1];
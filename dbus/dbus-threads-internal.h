@@ -48,6 +48,65 @@ void         _dbus_condvar_wake_all          (DBusCondVar       *cond);
 void         _dbus_condvar_new_at_location   (DBusCondVar      **location_p);
 void         _dbus_condvar_free_at_location  (DBusCondVar      **location_p);
 
+dbus_bool_t  _dbus_threads_get_initialized   (void);
+
+#ifdef DBUS_SINGLE_THREADED
+/* Only built into a dbus-daemon linked with --enable-single-threaded-daemon.
+ * It never initializes threads, so every mutex is a no-op and the
+ * calls can go; the arguments are still evaluated for their side
+ * effects, of which there are none in practice.
+ */
+#define _dbus_mutex_lock(m)                  ((void) (m))
+#define _dbus_mutex_unlock(m)                ((void) (m))
+#define _dbus_condvar_wait(c, m)             ((void) (c), (void) (m))
+#define _dbus_condvar_wait_timeout(c, m, t)  ((void) (c), (void) (m), (void) (t), TRUE)
+#define _dbus_condvar_wake_one(c)            ((void) (c))
+#define _dbus_condvar_wake_all(c)            ((void) (c))
+
+#elif defined (DBUS_NATIVE_MUTEXES)
+#include <pthread.h>
+
+/* With the built-in pthread implementation, a DBusMutex is a real
+ * recursive pthread mutex and is locked right here rather than
+ * through the DBusThreadFunctions table; depth is how many times the
+ * holder has locked it, for condition variable waits. Mutexes from
+ * functions passed to dbus_threads_init() still go through the table.
+ */
+typedef struct DBusNativeMutex DBusNativeMutex;
+
+struct DBusNativeMutex
+{
+  pthread_mutex_t lock;
+  int depth;
+};
+
+extern dbus_bool_t _dbus_threads_native;
+
+void _dbus_threads_enable_native (DBusRecursiveMutexLockFunction lock_function);
+
+#define _dbus_mutex_lock(m) do {                                        \
+    DBusMutex *_dbus_mutex = (m);                                       \
+    if (_dbus_threads_native && _dbus_mutex != NULL)                    \
+      {                                                                 \
+        pthread_mutex_lock (&((DBusNativeMutex *) _dbus_mutex)->lock);  \
+        ((DBusNativeMutex *) _dbus_mutex)->depth += 1;                  \
+      }                                                                 \
+    else                                                                \
+      (_dbus_mutex_lock) (_dbus_mutex);                                 \
+  } while (0)
+
+#define _dbus_mutex_unlock(m) do {                                      \
+    DBusMutex *_dbus_mutex = (m);                                       \
+    if (_dbus_threads_native && _dbus_mutex != NULL)                    \
+      {                                                                 \
+        ((DBusNativeMutex *) _dbus_mutex)->depth -= 1;                  \
+        pthread_mutex_unlock (&((DBusNativeMutex *) _dbus_mutex)->lock); \
+      }                                                                 \
+    else                                                                \
+      (_dbus_mutex_unlock) (_dbus_mutex);                               \
+  } while (0)
+#endif /* DBUS_SINGLE_THREADED, DBUS_NATIVE_MUTEXES */
+
 DBUS_END_DECLS
 
 #endif /* DBUS_THREADS_INTERNAL_H */
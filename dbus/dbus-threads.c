@@ -37,6 +37,25 @@ static DBusThreadFunctions thread_functions =
 };
 
 static int thread_init_generation = 0;
+
+#ifdef DBUS_SINGLE_THREADED
+/* The real functions, still exported; callers inside libdbus get nothing */
+#undef _dbus_mutex_lock
+#undef _dbus_mutex_unlock
+#undef _dbus_condvar_wait
+#undef _dbus_condvar_wait_timeout
+#undef _dbus_condvar_wake_one
+#undef _dbus_condvar_wake_all
+#endif
+
+#ifdef DBUS_NATIVE_MUTEXES
+/* The real functions; callers get the inline versions */
+#undef _dbus_mutex_lock
+#undef _dbus_mutex_unlock
+
+/** #TRUE while the mutexes are DBusNativeMutex, see dbus-threads-internal.h */
+dbus_bool_t _dbus_threads_native = FALSE;
+#endif
  
 static DBusList *uninitialized_mutex_list = NULL;
 static DBusList *uninitialized_condvar_list = NULL;
@@ -434,7 +453,11 @@ init_locks (void)
     LOCK_ADDR (system_users),
     LOCK_ADDR (message_cache),
     LOCK_ADDR (shared_connections),
-    LOCK_ADDR (machine_uuid)
+    LOCK_ADDR (machine_uuid),
+    LOCK_ADDR (keyring_cache),
+    LOCK_ADDR (hash_key),
+    LOCK_ADDR (signature_cache),
+    LOCK_ADDR (autolaunch)
 #undef LOCK_ADDR
   };
 
@@ -608,6 +631,15 @@ dbus_threads_init (const DBusThreadFunctions *functions)
    */
   _dbus_assert ((functions->mask & ~DBUS_THREAD_FUNCTIONS_ALL_MASK) == 0);
 
+#ifdef DBUS_SINGLE_THREADED
+  /* The locks were compiled out, so there is nothing to install the
+   * functions into; saying yes would leave the caller unprotected.
+   */
+  _dbus_warn ("This libdbus was built for a single-threaded dbus-daemon "
+              "and cannot be used from more than one thread\n");
+  return FALSE;
+#endif
+
   if (thread_init_generation != _dbus_current_generation)
     thread_functions.mask = 0; /* allow re-init in new generation */
  
@@ -616,6 +648,11 @@ dbus_threads_init (const DBusThreadFunctions *functions)
    */ 
   if (thread_functions.mask != 0)
     return TRUE;
+
+#ifdef DBUS_NATIVE_MUTEXES
+  /* until _dbus_threads_enable_native() says these are ours */
+  _dbus_threads_native = FALSE;
+#endif
   
   thread_functions.mutex_new = functions->mutex_new;
   thread_functions.mutex_free = functions->mutex_free;
@@ -651,6 +688,35 @@ dbus_threads_init (const DBusThreadFunctions *functions)
   return TRUE;
 }
 
+/**
+ * Checks whether dbus_threads_init() has been called, so libdbus
+ * may be in use from more than one thread.
+ *
+ * @returns #TRUE if threads are initialized
+ */
+dbus_bool_t
+_dbus_threads_get_initialized (void)
+{
+  return thread_init_generation == _dbus_current_generation;
+}
+
+#ifdef DBUS_NATIVE_MUTEXES
+/**
+ * Lets _dbus_mutex_lock() and _dbus_mutex_unlock() lock mutexes
+ * directly, if the recursive mutex functions dbus_threads_init()
+ * installed are the built-in native ones. Does nothing if threads
+ * were initialized with other functions first.
+ *
+ * @param lock_function the native recursive_mutex_lock function
+ */
+void
+_dbus_threads_enable_native (DBusRecursiveMutexLockFunction lock_function)
+{
+  if (thread_functions.recursive_mutex_lock == lock_function)
+    _dbus_threads_native = TRUE;
+}
+#endif /* DBUS_NATIVE_MUTEXES */
+
 
 
 /* Default thread implemenation */
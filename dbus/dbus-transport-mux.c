@@ -0,0 +1,784 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-transport-mux.c Logical connections multiplexed over one transport
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-transport-mux.h"
+#include "dbus-connection-internal.h"
+#include "dbus-hash.h"
+#include "dbus-internals.h"
+#include "dbus-marshal-basic.h"
+#include "dbus-message-internal.h"
+
+#include <string.h>
+
+/**
+ * @defgroup DBusTransportMux Multiplexed transports
+ * @ingroup  DBusInternals
+ * @brief Several logical connections over the stream of one transport
+ *
+ * When both ends agree on it during authentication (see
+ * NEGOTIATE_MULTIPLEX in dbus-auth.c), everything after BEGIN is a
+ * sequence of frames: a 32-bit channel number and a 32-bit payload
+ * length, both big-endian, followed by the payload. Channel 0 is the
+ * connection that authenticated, the "link"; every other channel is
+ * a connection of its own, with its own transport of the class
+ * implemented here, sharing the link's authentication.
+ *
+ * A payload is one whole message. An empty frame opens a channel the
+ * receiver does not know yet, and closes one it does. Only clients
+ * open channels, with increasing numbers, so a server ignores frames
+ * for numbers it has already seen closed.
+ *
+ * Channel transports have no file descriptor and no watches: their
+ * outgoing messages are framed into the link's output as they are
+ * queued, and incoming frames are handed to them while the link
+ * reads. All the channels of a link must therefore be used from the
+ * thread and main loop that serve the link.
+ *
+ * @{
+ */
+
+/** Bytes in a frame header */
+#define FRAME_HEADER_LENGTH 8
+
+/** Most channels a server lets one link carry */
+#define MAX_CHANNELS_PER_LINK 1024
+
+/**
+ * State of the channels carried by one link transport.
+ */
+struct DBusMux
+{
+  DBusTransport *link;        /**< The transport whose stream we share; owns us */
+  DBusHashTable *channels;    /**< Open channels by number; weak references */
+  dbus_uint32_t last_id;      /**< Highest channel number opened so far */
+  DBusString incoming;        /**< Received bytes not yet demultiplexed */
+  DBusString outgoing;        /**< Frames not yet written */
+  int outgoing_written;       /**< Bytes of outgoing already written */
+  dbus_bool_t in_link_io;     /**< The link is handing us input, so its lock is held */
+};
+
+/**
+ * A logical connection carried by a link.
+ */
+typedef struct
+{
+  DBusTransport base;         /**< Parent instance */
+  DBusMux *mux;               /**< Mux of the link, or #NULL once closed */
+  dbus_uint32_t id;           /**< Channel number */
+  dbus_bool_t in_iteration;   /**< Running an iteration, so its connection's lock is held */
+} DBusTransportChannel;
+
+static dbus_bool_t
+append_frame_header (DBusString    *str,
+                     dbus_uint32_t  id,
+                     dbus_uint32_t  len)
+{
+  dbus_uint32_t header[2];
+
+  _dbus_pack_uint32 (id, DBUS_BIG_ENDIAN, (unsigned char *) &header[0]);
+  _dbus_pack_uint32 (len, DBUS_BIG_ENDIAN, (unsigned char *) &header[1]);
+
+  return _dbus_string_append_len (str, (const char *) header,
+                                  FRAME_HEADER_LENGTH);
+}
+
+/* Forgets whatever has been written, so appending does not grow the
+ * buffer without bound while the link keeps up
+ */
+static void
+reset_outgoing_if_written (DBusMux *mux)
+{
+  if (mux->outgoing_written > 0 &&
+      mux->outgoing_written == _dbus_string_get_length (&mux->outgoing))
+    {
+      _dbus_string_set_length (&mux->outgoing, 0);
+      mux->outgoing_written = 0;
+    }
+}
+
+static dbus_bool_t
+append_control_frame (DBusMux       *mux,
+                      dbus_uint32_t  id)
+{
+  reset_outgoing_if_written (mux);
+
+  return append_frame_header (&mux->outgoing, id, 0);
+}
+
+/* Frames the messages queued on connection, marking each as sent once
+ * it is in the link's output; returns FALSE if no memory, with the
+ * rest still queued
+ */
+static dbus_bool_t
+frame_messages (DBusMux        *mux,
+                dbus_uint32_t   id,
+                DBusConnection *connection,
+                int             max_bytes)
+{
+  int framed;
+
+  reset_outgoing_if_written (mux);
+
+  framed = 0;
+  while ((max_bytes < 0 || framed < max_bytes) &&
+         _dbus_connection_has_messages_to_send_unlocked (connection))
+    {
+      DBusMessage *message;
+      const DBusString *header;
+      const DBusString *body;
+      const DBusString *tail;
+      int message_len;
+      int orig_len;
+
+      message = _dbus_connection_get_message_to_send (connection);
+      dbus_message_lock (message);
+      _dbus_message_get_network_data (message, &header, &body, &tail);
+
+      message_len = _dbus_message_get_size (message);
+
+      orig_len = _dbus_string_get_length (&mux->outgoing);
+      if (!append_frame_header (&mux->outgoing, id, message_len) ||
+          !_dbus_string_copy (header, 0, &mux->outgoing,
+                              _dbus_string_get_length (&mux->outgoing)) ||
+          !_dbus_string_copy (body, 0, &mux->outgoing,
+                              _dbus_string_get_length (&mux->outgoing)) ||
+          !_dbus_string_copy (tail, 0, &mux->outgoing,
+                              _dbus_string_get_length (&mux->outgoing)))
+        {
+          _dbus_string_set_length (&mux->outgoing, orig_len);
+          return FALSE;
+        }
+
+      framed += message_len;
+      _dbus_connection_message_sent (connection, message);
+    }
+
+  return TRUE;
+}
+
+/* Gets the link to write whatever is in its output, unless it is
+ * busy with our input already; it will look at its output once that
+ * is done
+ */
+static void
+flush_link (DBusMux      *mux,
+            unsigned int  flags,
+            int           timeout_milliseconds)
+{
+  if (mux->in_link_io || mux->link->connection == NULL)
+    return;
+
+  if (_dbus_mux_has_output (mux))
+    flags |= DBUS_ITERATION_DO_WRITING;
+
+  _dbus_connection_iterate (mux->link->connection, flags,
+                            timeout_milliseconds);
+}
+
+static void
+channel_notify (DBusTransportChannel *channel)
+{
+  /* Whoever is iterating the channel looks at its input afterwards */
+  if (channel->in_iteration || channel->base.connection == NULL)
+    return;
+
+  _dbus_connection_update_dispatch_status (channel->base.connection);
+}
+
+static void
+channel_finalize (DBusTransport *transport)
+{
+  _dbus_transport_finalize_base (transport);
+
+  dbus_free (transport);
+}
+
+static dbus_bool_t
+channel_handle_watch (DBusTransport *transport,
+                      DBusWatch     *watch,
+                      unsigned int   flags)
+{
+  _dbus_assert_not_reached ("channels have no watches");
+  return TRUE;
+}
+
+static void
+channel_disconnect (DBusTransport *transport)
+{
+  DBusTransportChannel *channel = (DBusTransportChannel*) transport;
+  DBusMux *mux = channel->mux;
+
+  if (mux == NULL)
+    return;
+
+  _dbus_hash_table_remove_uintptr (mux->channels, channel->id);
+  channel->mux = NULL;
+
+  /* Best effort; if the peer never hears of it, the channel goes
+   * away with the link
+   */
+  if (append_control_frame (mux, channel->id))
+    flush_link (mux, 0, -1);
+}
+
+static dbus_bool_t
+channel_connection_set (DBusTransport *transport)
+{
+  return TRUE;
+}
+
+static void
+channel_do_iteration (DBusTransport *transport,
+                      unsigned int   flags,
+                      int            timeout_milliseconds)
+{
+  DBusTransportChannel *channel = (DBusTransportChannel*) transport;
+  DBusMux *mux = channel->mux;
+
+  if (mux == NULL)
+    return;
+
+  if ((flags & DBUS_ITERATION_DO_WRITING) &&
+      !frame_messages (mux, channel->id, transport->connection, -1))
+    _dbus_verbose ("No memory to frame messages on channel %u\n",
+                   channel->id);
+
+  channel->in_iteration = TRUE;
+
+  flush_link (mux, flags & ~DBUS_ITERATION_DO_WRITING, timeout_milliseconds);
+
+  /* A blocking write is expected to get the messages to the peer */
+  while ((flags & DBUS_ITERATION_DO_WRITING) &&
+         (flags & DBUS_ITERATION_BLOCK) &&
+         channel->mux != NULL &&
+         !mux->in_link_io &&
+         _dbus_mux_has_output (mux) &&
+         _dbus_transport_get_is_connected (mux->link))
+    flush_link (mux, DBUS_ITERATION_BLOCK, timeout_milliseconds);
+
+  channel->in_iteration = FALSE;
+
+  /* Like a socket read, so a caller blocking for a reply sees it */
+  if (!_dbus_transport_queue_messages (transport))
+    _dbus_verbose ("No memory to queue messages on channel %u\n",
+                   channel->id);
+}
+
+static void
+channel_live_messages_changed (DBusTransport *transport)
+{
+  /* Nothing to throttle: the link reads for everyone */
+}
+
+static dbus_bool_t
+channel_get_socket_fd (DBusTransport *transport,
+                       int           *fd_p)
+{
+  return FALSE;
+}
+
+static const DBusTransportVTable channel_vtable = {
+  channel_finalize,
+  channel_handle_watch,
+  channel_disconnect,
+  channel_connection_set,
+  channel_do_iteration,
+  channel_live_messages_changed,
+  channel_get_socket_fd,
+  NULL,
+  NULL,
+  NULL
+};
+
+static DBusTransportChannel*
+channel_new (DBusMux       *mux,
+             dbus_uint32_t  id)
+{
+  DBusTransportChannel *channel;
+  DBusTransport *link = mux->link;
+  DBusString guid;
+  DBusString address;
+  dbus_bool_t ok;
+
+  channel = dbus_new0 (DBusTransportChannel, 1);
+  if (channel == NULL)
+    return NULL;
+
+  /* The auth conversation made here is replaced by the link's */
+  if (link->is_server)
+    {
+      _dbus_string_init_const (&guid, "");
+      ok = _dbus_transport_init_base (&channel->base, &channel_vtable,
+                                      &guid, NULL);
+    }
+  else
+    {
+      _dbus_string_init_const (&address, link->address);
+      ok = _dbus_transport_init_base (&channel->base, &channel_vtable,
+                                      NULL, &address);
+    }
+
+  if (!ok)
+    {
+      dbus_free (channel);
+      return NULL;
+    }
+
+  if (!_dbus_hash_table_insert_uintptr (mux->channels, id, channel))
+    {
+      _dbus_transport_unref (&channel->base);
+      return NULL;
+    }
+
+  channel->mux = mux;
+  channel->id = id;
+
+  _dbus_auth_unref (channel->base.auth);
+  channel->base.auth = _dbus_auth_ref (link->auth);
+  channel->base.send_credentials_pending = FALSE;
+  channel->base.receive_credentials_pending = FALSE;
+  channel->base.authenticated = TRUE;
+  channel->base.unused_bytes_recovered = TRUE;
+  channel->base.allow_anonymous = link->allow_anonymous;
+
+  _dbus_transport_set_max_message_size (&channel->base,
+                                        _dbus_transport_get_max_message_size (link));
+  _dbus_transport_set_max_received_size (&channel->base,
+                                         _dbus_transport_get_max_received_size (link));
+
+  if (id > mux->last_id)
+    mux->last_id = id;
+
+  return channel;
+}
+
+/* Takes the channel on the server side, or refuses it; FALSE if no
+ * memory to even tell the peer
+ */
+static dbus_bool_t
+accept_channel (DBusMux       *mux,
+                dbus_uint32_t  id)
+{
+  DBusTransport *link = mux->link;
+  DBusTransportChannel *channel;
+
+  if (link->new_channel_function == NULL ||
+      _dbus_hash_table_get_n_entries (mux->channels) >= MAX_CHANNELS_PER_LINK)
+    {
+      _dbus_verbose ("Refusing channel %u\n", id);
+      mux->last_id = id;
+      return append_control_frame (mux, id);
+    }
+
+  channel = channel_new (mux, id);
+  if (channel == NULL)
+    return FALSE;
+
+  _dbus_verbose ("Accepting channel %u\n", id);
+
+  /* If that failed, the channel is gone and the peer has been told */
+  if (!(* link->new_channel_function) (&channel->base,
+                                       link->new_channel_data))
+    _dbus_transport_disconnect (&channel->base);
+
+  _dbus_transport_unref (&channel->base);
+  return TRUE;
+}
+
+static dbus_bool_t
+deliver_to_loader (DBusTransport    *transport,
+                   const DBusString *src,
+                   int               start,
+                   int               len)
+{
+  DBusString *buffer;
+  int orig_len;
+  dbus_bool_t succeeded;
+
+  _dbus_message_loader_get_buffer (transport->loader, &buffer);
+
+  orig_len = _dbus_string_get_length (buffer);
+  succeeded = _dbus_string_copy_len (src, start, len, buffer, orig_len);
+
+  _dbus_message_loader_return_buffer (transport->loader, buffer,
+                                      succeeded ? len : 0);
+
+  return succeeded;
+}
+
+/* Handles one complete frame; FALSE if no memory, to be retried */
+static dbus_bool_t
+handle_frame (DBusMux       *mux,
+              dbus_uint32_t  id,
+              int            start,
+              int            len)
+{
+  DBusTransportChannel *channel;
+
+  if (id == 0)
+    {
+      if (len == 0)
+        return TRUE;
+
+      return deliver_to_loader (mux->link, &mux->incoming, start, len);
+    }
+
+  channel = _dbus_hash_table_lookup_uintptr (mux->channels, id);
+
+  if (channel == NULL)
+    {
+      /* Late frames for a channel that is gone are dropped */
+      if (len == 0 && mux->link->is_server && id > mux->last_id)
+        return accept_channel (mux, id);
+
+      return TRUE;
+    }
+
+  if (len == 0)
+    {
+      _dbus_verbose ("Peer closed channel %u\n", id);
+
+      _dbus_transport_ref (&channel->base);
+      _dbus_hash_table_remove_uintptr (mux->channels, id);
+      channel->mux = NULL;
+      _dbus_transport_disconnect (&channel->base);
+      channel_notify (channel);
+      _dbus_transport_unref (&channel->base);
+
+      return TRUE;
+    }
+
+  if (!deliver_to_loader (&channel->base, &mux->incoming, start, len))
+    return FALSE;
+
+  _dbus_transport_ref (&channel->base);
+  channel_notify (channel);
+  _dbus_transport_unref (&channel->base);
+
+  return TRUE;
+}
+
+/**
+ * Creates the channel state for a link that negotiated multiplexing.
+ *
+ * @param link the transport whose stream carries the channels
+ * @returns the new mux, or #NULL if no memory
+ */
+DBusMux*
+_dbus_mux_new (DBusTransport *link)
+{
+  DBusMux *mux;
+
+  mux = dbus_new0 (DBusMux, 1);
+  if (mux == NULL)
+    return NULL;
+
+  mux->channels = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL, NULL);
+  if (mux->channels == NULL)
+    goto failed_0;
+
+  if (!_dbus_string_init (&mux->incoming))
+    goto failed_1;
+
+  if (!_dbus_string_init (&mux->outgoing))
+    goto failed_2;
+
+  mux->link = link;
+
+  return mux;
+
+ failed_2:
+  _dbus_string_free (&mux->incoming);
+ failed_1:
+  _dbus_hash_table_unref (mux->channels);
+ failed_0:
+  dbus_free (mux);
+  return NULL;
+}
+
+/**
+ * Frees the channel state of a link, which must have been
+ * disconnected already.
+ *
+ * @param mux the mux
+ */
+void
+_dbus_mux_free (DBusMux *mux)
+{
+  _dbus_assert (_dbus_hash_table_get_n_entries (mux->channels) == 0);
+
+  _dbus_hash_table_unref (mux->channels);
+  _dbus_string_free (&mux->incoming);
+  _dbus_string_free (&mux->outgoing);
+  dbus_free (mux);
+}
+
+/**
+ * Disconnects every channel, because the link they were carried by
+ * has gone.
+ *
+ * @param mux the mux
+ */
+void
+_dbus_mux_link_disconnected (DBusMux *mux)
+{
+  dbus_bool_t was_in_link_io = mux->in_link_io;
+
+  mux->in_link_io = TRUE;
+
+  /* Looking again each time round, since notifying one channel can
+   * run code that drops another
+   */
+  while (_dbus_hash_table_get_n_entries (mux->channels) > 0)
+    {
+      DBusHashIter iter;
+      DBusTransportChannel *channel;
+
+      _dbus_hash_iter_init (mux->channels, &iter);
+      _dbus_hash_iter_next (&iter);
+      channel = _dbus_hash_iter_get_value (&iter);
+      _dbus_hash_iter_remove_entry (&iter);
+
+      _dbus_transport_ref (&channel->base);
+      channel->mux = NULL;
+      _dbus_transport_disconnect (&channel->base);
+      channel_notify (channel);
+      _dbus_transport_unref (&channel->base);
+    }
+
+  mux->in_link_io = was_in_link_io;
+}
+
+/**
+ * Queues bytes read from the link for demultiplexing.
+ *
+ * @param mux the mux
+ * @param src the bytes
+ * @param start where they start in src
+ * @param len how many there are
+ * @returns #FALSE if no memory, in which case nothing was queued
+ */
+dbus_bool_t
+_dbus_mux_feed (DBusMux          *mux,
+                const DBusString *src,
+                int               start,
+                int               len)
+{
+  return _dbus_string_copy_len (src, start, len, &mux->incoming,
+                                _dbus_string_get_length (&mux->incoming));
+}
+
+/**
+ * Gets whether bytes have been queued that may not all have been
+ * demultiplexed yet, because of a partial frame or lack of memory.
+ *
+ * @param mux the mux
+ * @returns #TRUE if there is queued input
+ */
+dbus_bool_t
+_dbus_mux_has_input (DBusMux *mux)
+{
+  return _dbus_string_get_length (&mux->incoming) >= FRAME_HEADER_LENGTH;
+}
+
+/**
+ * Hands every complete frame queued so far to its channel; channel 0
+ * goes to the link's own message loader. Must be called with the
+ * link's connection locked. Servers accept the channels that clients
+ * open here, through the link's new_channel_function.
+ *
+ * @param mux the mux
+ * @param corrupt_p set to #TRUE if the peer sent something invalid
+ * @returns #FALSE if no memory, with the rest of the input still queued
+ */
+dbus_bool_t
+_dbus_mux_demux (DBusMux     *mux,
+                 dbus_bool_t *corrupt_p)
+{
+  dbus_bool_t was_in_link_io = mux->in_link_io;
+  dbus_bool_t succeeded;
+  int pos;
+
+  *corrupt_p = FALSE;
+  succeeded = TRUE;
+  pos = 0;
+
+  mux->in_link_io = TRUE;
+
+  while (_dbus_string_get_length (&mux->incoming) - pos >= FRAME_HEADER_LENGTH &&
+         !mux->link->disconnected)
+    {
+      dbus_uint32_t header[2];
+      dbus_uint32_t id;
+      dbus_uint32_t len;
+
+      /* Frames are not padded, so copy the header somewhere aligned */
+      memcpy (header,
+              _dbus_string_get_const_data_len (&mux->incoming, pos,
+                                               FRAME_HEADER_LENGTH),
+              FRAME_HEADER_LENGTH);
+      id = _dbus_unpack_uint32 (DBUS_BIG_ENDIAN,
+                                (const unsigned char *) &header[0]);
+      len = _dbus_unpack_uint32 (DBUS_BIG_ENDIAN,
+                                 (const unsigned char *) &header[1]);
+
+      if (len > DBUS_MAXIMUM_MESSAGE_LENGTH)
+        {
+          _dbus_verbose ("Frame of %u bytes on channel %u is too long\n",
+                         len, id);
+          *corrupt_p = TRUE;
+          break;
+        }
+
+      if ((dbus_uint32_t) (_dbus_string_get_length (&mux->incoming) - pos) <
+          FRAME_HEADER_LENGTH + len)
+        break;
+
+      if (!handle_frame (mux, id, pos + FRAME_HEADER_LENGTH, len))
+        {
+          succeeded = FALSE;
+          break;
+        }
+
+      pos += FRAME_HEADER_LENGTH + len;
+    }
+
+  mux->in_link_io = was_in_link_io;
+
+  _dbus_string_delete (&mux->incoming, 0, pos);
+  _dbus_string_compact (&mux->incoming, 2048);
+
+  return succeeded;
+}
+
+/**
+ * Frames the link's own outgoing messages as channel 0, marking them
+ * as sent. Must be called with the link's connection locked.
+ *
+ * @param mux the mux
+ * @param max_bytes stop after about this much, or -1 for no limit
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_mux_frame_link_messages (DBusMux *mux,
+                               int      max_bytes)
+{
+  return frame_messages (mux, 0, mux->link->connection, max_bytes);
+}
+
+/**
+ * Gets whether there are frames waiting to be written to the link.
+ *
+ * @param mux the mux
+ * @returns #TRUE if there is output
+ */
+dbus_bool_t
+_dbus_mux_has_output (DBusMux *mux)
+{
+  return mux->outgoing_written < _dbus_string_get_length (&mux->outgoing);
+}
+
+/**
+ * Gets the frames waiting to be written to the link.
+ *
+ * @param mux the mux
+ * @param buffer return location for the buffer holding them
+ * @param start return location for where they start in buffer
+ * @param len return location for how many bytes there are
+ */
+void
+_dbus_mux_get_output (DBusMux           *mux,
+                      const DBusString **buffer,
+                      int               *start,
+                      int               *len)
+{
+  *buffer = &mux->outgoing;
+  *start = mux->outgoing_written;
+  *len = _dbus_string_get_length (&mux->outgoing) - mux->outgoing_written;
+}
+
+/**
+ * Records that the link wrote some of the output.
+ *
+ * @param mux the mux
+ * @param bytes how many bytes were written
+ */
+void
+_dbus_mux_output_written (DBusMux *mux,
+                          int      bytes)
+{
+  mux->outgoing_written += bytes;
+  _dbus_assert (mux->outgoing_written <= _dbus_string_get_length (&mux->outgoing));
+
+  if (mux->outgoing_written == _dbus_string_get_length (&mux->outgoing))
+    {
+      _dbus_string_set_length (&mux->outgoing, 0);
+      _dbus_string_compact (&mux->outgoing, 2048);
+      mux->outgoing_written = 0;
+    }
+}
+
+/**
+ * Frees buffer space not currently in use.
+ *
+ * @param mux the mux
+ */
+void
+_dbus_mux_trim (DBusMux *mux)
+{
+  if (_dbus_string_get_length (&mux->incoming) == 0)
+    _dbus_string_compact (&mux->incoming, 0);
+
+  if (_dbus_string_get_length (&mux->outgoing) == 0)
+    _dbus_string_compact (&mux->outgoing, 0);
+}
+
+/**
+ * Opens a new channel on the client side of a link, and tells the
+ * server about it. Must be called with the link's connection locked.
+ *
+ * @param mux the mux
+ * @returns the channel's transport, or #NULL if no memory
+ */
+DBusTransport*
+_dbus_mux_open_channel (DBusMux *mux)
+{
+  DBusTransportChannel *channel;
+
+  _dbus_assert (!mux->link->is_server);
+
+  channel = channel_new (mux, mux->last_id + 1);
+  if (channel == NULL)
+    return NULL;
+
+  if (!append_control_frame (mux, channel->id))
+    {
+      _dbus_hash_table_remove_uintptr (mux->channels, channel->id);
+      channel->mux = NULL;
+      _dbus_transport_unref (&channel->base);
+      return NULL;
+    }
+
+  return &channel->base;
+}
+
+/** @} */
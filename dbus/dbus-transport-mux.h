@@ -0,0 +1,52 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-transport-mux.h Logical connections multiplexed over one transport
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef DBUS_TRANSPORT_MUX_H
+#define DBUS_TRANSPORT_MUX_H
+
+#include <dbus/dbus-transport-protected.h>
+
+DBUS_BEGIN_DECLS
+
+DBusMux*       _dbus_mux_new                 (DBusTransport     *link);
+void           _dbus_mux_free                (DBusMux           *mux);
+void           _dbus_mux_link_disconnected   (DBusMux           *mux);
+dbus_bool_t    _dbus_mux_feed                (DBusMux           *mux,
+                                              const DBusString  *src,
+                                              int                start,
+                                              int                len);
+dbus_bool_t    _dbus_mux_has_input           (DBusMux           *mux);
+dbus_bool_t    _dbus_mux_demux               (DBusMux           *mux,
+                                              dbus_bool_t       *corrupt_p);
+dbus_bool_t    _dbus_mux_frame_link_messages (DBusMux           *mux,
+                                              int                max_bytes);
+dbus_bool_t    _dbus_mux_has_output          (DBusMux           *mux);
+void           _dbus_mux_get_output          (DBusMux           *mux,
+                                              const DBusString **buffer,
+                                              int               *start,
+                                              int               *len);
+void           _dbus_mux_output_written      (DBusMux           *mux,
+                                              int                bytes);
+void           _dbus_mux_trim                (DBusMux           *mux);
+DBusTransport* _dbus_mux_open_channel        (DBusMux           *mux);
+
+DBUS_END_DECLS
+
+#endif /* DBUS_TRANSPORT_MUX_H */
@@ -33,6 +33,14 @@
 DBUS_BEGIN_DECLS
 
 typedef struct DBusTransportVTable DBusTransportVTable;
+typedef struct DBusMux DBusMux;
+
+/**
+ * Called on the server side of a multiplexed link when the client
+ * opens a channel; returns #FALSE if the channel was not taken.
+ */
+typedef dbus_bool_t (* DBusNewChannelFunction) (DBusTransport *channel,
+                                                void          *data);
 
 /**
  * The virtual table that must be implemented to
@@ -69,6 +77,19 @@ struct DBusTransportVTable
   dbus_bool_t (* get_socket_fd) (DBusTransport *transport,
                                  int           *fd_p);
   /**< Get socket file descriptor */
+
+  void        (* trim)                  (DBusTransport *transport);
+  /**< Free buffer space not currently in use; may be #NULL */
+
+  void        (* watch_mode_changed)    (DBusTransport *transport);
+  /**< edge_triggered_watches changed; may be #NULL */
+
+  void        (* get_io_budgets)        (DBusTransport *transport,
+                                         int           *read_budget_p,
+                                         int           *write_budget_p);
+  /**< Bytes one iteration reads and writes at most just now;
+   * may be #NULL
+   */
 };
 
 /**
@@ -99,6 +120,8 @@ struct DBusTransport
   char *address;                              /**< Address of the server we are connecting to (#NULL for the server side of a transport) */
 
   char *expected_guid;                        /**< GUID we expect the server to have, #NULL on server side or if we don't have an expectation */
+
+  dbus_uint32_t flight_id;                    /**< Names us in the flight recorder */
   
   DBusAllowUnixUserFunction unix_user_function; /**< Function for checking whether a user is authorized. */
   void *unix_user_data;                         /**< Data for unix_user_function */
@@ -109,6 +132,11 @@ struct DBusTransport
   void *windows_user_data;                            /**< Data for windows_user_function */
   
   DBusFreeFunction free_windows_user_data;            /**< Function to free windows_user_data */
+
+  DBusMux *mux;                                 /**< Channels carried over our stream, if multiplexing was negotiated */
+  DBusNewChannelFunction new_channel_function;  /**< Takes channels the peer opens */
+  void *new_channel_data;                       /**< Data for new_channel_function */
+  DBusFreeFunction free_new_channel_data;       /**< Function to free new_channel_data */
   
   unsigned int disconnected : 1;              /**< #TRUE if we are disconnected. */
   unsigned int authenticated : 1;             /**< Cache of auth state; use _dbus_transport_get_is_authenticated() to query value */
@@ -117,6 +145,8 @@ struct DBusTransport
   unsigned int is_server : 1;                 /**< #TRUE if on the server side */
   unsigned int unused_bytes_recovered : 1;    /**< #TRUE if we've recovered unused bytes from auth */
   unsigned int allow_anonymous : 1;           /**< #TRUE if an anonymous client can connect */
+  unsigned int edge_triggered_watches : 1;    /**< #TRUE if watches stay enabled, see dbus_connection_set_edge_triggered_watches() */
+  unsigned int read_paused : 1;               /**< #TRUE if the owner asked us to stop reading for now */
 };
 
 dbus_bool_t _dbus_transport_init_base     (DBusTransport             *transport,
@@ -124,6 +154,13 @@ dbus_bool_t _dbus_transport_init_base     (DBusTransport             *transport,
                                            const DBusString          *server_guid,
                                            const DBusString          *address);
 void        _dbus_transport_finalize_base (DBusTransport             *transport);
+void        _dbus_transport_set_multiplex_possible (DBusTransport          *transport,
+                                                    DBusNewChannelFunction  function,
+                                                    void                   *data,
+                                                    DBusFreeFunction        free_data_function);
+dbus_bool_t _dbus_transport_decompress_to_loader (DBusTransport  *transport,
+                                                  DBusCompressor *compressor,
+                                                  dbus_bool_t    *corrupt_p);
 
 
 typedef enum
@@ -27,8 +27,12 @@
 #include "dbus-nonce.h"
 #include "dbus-transport-socket.h"
 #include "dbus-transport-protected.h"
+#include "dbus-transport-mux.h"
 #include "dbus-watch.h"
 #include "dbus-credentials.h"
+#include "dbus-flight-recorder.h"
+#include "dbus-latency.h"
+#include "dbus-probes.h"
 
 /**
  * @defgroup DBusTransportSocket DBusTransport implementations for sockets
@@ -53,8 +57,12 @@ struct DBusTransportSocket
   DBusWatch *read_watch;                /**< Watch for readability. */
   DBusWatch *write_watch;               /**< Watch for writability. */
 
-  int max_bytes_read_per_iteration;     /**< To avoid blocking too long. */
-  int max_bytes_written_per_iteration;  /**< To avoid blocking too long. */
+  int max_bytes_read_per_iteration;     /**< To avoid blocking too long;
+                                         *   adapts, see adapt_budget()
+                                         */
+  int max_bytes_written_per_iteration;  /**< To avoid blocking too long;
+                                         *   adapts likewise
+                                         */
 
   int message_bytes_written;            /**< Number of bytes of current
                                          *   outgoing message that have
@@ -63,11 +71,137 @@ struct DBusTransportSocket
   DBusString encoded_outgoing;          /**< Encoded version of current
                                          *   outgoing message.
                                          */
+  int encoded_messages;                 /**< Number of messages in
+                                         *   encoded_outgoing, when it
+                                         *   holds a compressed batch
+                                         */
   DBusString encoded_incoming;          /**< Encoded version of current
                                          *   incoming data.
                                          */
+
+  int read_first_misses;                /**< Blocking iterations in a row
+                                         *   where reading before polling
+                                         *   found nothing
+                                         */
+  int read_first_skips;                 /**< Blocking iterations left to
+                                         *   poll straight away, after
+                                         *   too many misses
+                                         */
+  int read_spins;                       /**< Extra reads to try before
+                                         *   polling, from
+                                         *   DBUS_BLOCKING_READ_SPINS
+                                         */
+
+  dbus_bool_t want_read;                /**< We want to read; with
+                                         *   edge-triggered watches
+                                         *   the read watch stays
+                                         *   enabled regardless
+                                         */
+  dbus_bool_t want_write;               /**< We want to write, likewise */
+  dbus_bool_t readable;                 /**< No EAGAIN from reading
+                                         *   since the fd last became
+                                         *   readable
+                                         */
+  dbus_bool_t writable;                 /**< No EAGAIN from writing
+                                         *   since the fd last became
+                                         *   writable
+                                         */
+  dbus_bool_t read_busy;                /**< Read budget is above the
+                                         *   minimum, and counted in
+                                         *   busy_readers
+                                         */
+  dbus_bool_t write_busy;               /**< Likewise for writing */
 };
 
+/** After this many misses, reading before polling is only retried now and then */
+#define READ_FIRST_MAX_MISSES 4
+/** How often to retry reading before polling once it keeps missing */
+#define READ_FIRST_RETRY_INTERVAL 16
+/** Upper bound on DBUS_BLOCKING_READ_SPINS */
+#define MAX_READ_SPINS 1000
+
+/** Read budget a transport starts with and never goes below */
+#define MIN_READ_BUDGET 8192
+/** Write budget a transport starts with and never goes below */
+#define MIN_WRITE_BUDGET 2048
+/** Most a single transport's budget grows to */
+#define MAX_BUDGET (256 * 1024)
+/** What the busy transports in one direction share between them */
+#define TOTAL_BUSY_BUDGET (4 * 1024 * 1024)
+
+/* Transports in this process whose read or write budget has grown
+ * past the minimum, i.e. that are keeping their peer's data moving
+ * in bulk rather than trickling
+ */
+static DBusAtomic busy_readers = { 0 };
+static DBusAtomic busy_writers = { 0 };
+
+static dbus_int32_t
+count_busy (DBusAtomic *busy)
+{
+  /* There is no _dbus_atomic_get; _dbus_atomic_dec() returns the
+   * value from before it, which includes our own increment
+   */
+  _dbus_atomic_inc (busy);
+  return _dbus_atomic_dec (busy) - 1;
+}
+
+/* Whether an iteration may ignore its budget and carry on until
+ * EAGAIN. An edge-triggered watch needs that anyway; otherwise it is
+ * only fair when no other transport is busy, since then there is
+ * nobody for the main loop to get round to.
+ */
+static dbus_bool_t
+budget_is_unbounded (DBusTransport *transport,
+                     DBusAtomic    *busy,
+                     dbus_bool_t    self_busy)
+{
+  if (transport->edge_triggered_watches)
+    return TRUE;
+
+  return count_busy (busy) - (self_busy ? 1 : 0) <= 0;
+}
+
+/* Adjusts a budget after an iteration that moved total bytes. One
+ * that overran its budget doubles it, up to its share of
+ * TOTAL_BUSY_BUDGET among the busy transports, so a connection
+ * streaming in bulk takes fewer trips round the main loop while a
+ * crowd of them cannot starve everything else. One that used under a
+ * quarter of its budget halves it again, back towards the minimum.
+ */
+static void
+adapt_budget (int         *budget,
+              dbus_bool_t *self_busy,
+              DBusAtomic  *busy,
+              int          min,
+              int          total)
+{
+  int n_busy;
+  int cap;
+
+  n_busy = count_busy (busy) + (*self_busy ? 0 : 1);
+  cap = MIN (MAX_BUDGET, TOTAL_BUSY_BUDGET / n_busy);
+  cap = MAX (cap, min);
+
+  if (total > *budget)
+    *budget = MIN (*budget * 2, cap);
+  else if (total < *budget / 4)
+    *budget = MAX (*budget / 2, min);
+
+  /* Others may have got busy since, and the cap shrinks with them */
+  *budget = MIN (*budget, cap);
+
+  if (*self_busy != (*budget > min))
+    {
+      *self_busy = !*self_busy;
+
+      if (*self_busy)
+        _dbus_atomic_inc (busy);
+      else
+        _dbus_atomic_dec (busy);
+    }
+}
+
 static void
 free_watches (DBusTransport *transport)
 {
@@ -107,6 +241,11 @@ socket_finalize (DBusTransport *transport)
   
   free_watches (transport);
 
+  if (socket_transport->read_busy)
+    _dbus_atomic_dec (&busy_readers);
+  if (socket_transport->write_busy)
+    _dbus_atomic_dec (&busy_writers);
+
   _dbus_string_free (&socket_transport->encoded_outgoing);
   _dbus_string_free (&socket_transport->encoded_incoming);
   
@@ -118,6 +257,43 @@ socket_finalize (DBusTransport *transport)
   dbus_free (transport);
 }
 
+/* Normally whether we want a watch is just whether it is enabled.
+ * Edge-triggered watches stay enabled once we first want them, and
+ * the main loop only tells us about the fd again on its next edge;
+ * so when we come back to a fd that may be ready already, its edge
+ * has been and gone and we have to ask for the watch to be re-armed.
+ */
+static void
+set_watch_wanted (DBusTransport *transport,
+                  DBusWatch     *watch,
+                  dbus_bool_t   *wanted_p,
+                  dbus_bool_t    wanted,
+                  dbus_bool_t    ready)
+{
+  dbus_bool_t was_wanted = *wanted_p;
+
+  *wanted_p = wanted;
+
+  if (!transport->edge_triggered_watches)
+    _dbus_connection_toggle_watch_unlocked (transport->connection,
+                                            watch, wanted);
+  else if (wanted && !dbus_watch_get_enabled (watch))
+    _dbus_connection_toggle_watch_unlocked (transport->connection,
+                                            watch, TRUE);
+  else if (wanted && !was_wanted && ready)
+    _dbus_connection_rearm_watch_unlocked (transport->connection, watch);
+}
+
+/* Whether there is anything to write once authenticated; with
+ * multiplexing that includes other channels' frames
+ */
+static dbus_bool_t
+socket_has_output (DBusTransport *transport)
+{
+  return _dbus_connection_has_messages_to_send_unlocked (transport->connection) ||
+    (transport->mux != NULL && _dbus_mux_has_output (transport->mux));
+}
+
 static void
 check_write_watch (DBusTransport *transport)
 {
@@ -136,7 +312,7 @@ check_write_watch (DBusTransport *transport)
   _dbus_transport_ref (transport);
 
   if (_dbus_transport_get_is_authenticated (transport))
-    needed = _dbus_connection_has_messages_to_send_unlocked (transport->connection);
+    needed = socket_has_output (transport);
   else
     {
       if (transport->send_credentials_pending)
@@ -164,9 +340,9 @@ check_write_watch (DBusTransport *transport)
                  socket_transport->fd,
                  _dbus_connection_has_messages_to_send_unlocked (transport->connection));
 
-  _dbus_connection_toggle_watch_unlocked (transport->connection,
-                                          socket_transport->write_watch,
-                                          needed);
+  set_watch_wanted (transport, socket_transport->write_watch,
+                    &socket_transport->want_write, needed,
+                    socket_transport->writable);
 
   _dbus_transport_unref (transport);
 }
@@ -193,7 +369,10 @@ check_read_watch (DBusTransport *transport)
   if (_dbus_transport_get_is_authenticated (transport))
     need_read_watch =
       (_dbus_counter_get_size_value (transport->live_messages) < transport->max_live_messages_size) &&
-      (_dbus_counter_get_unix_fd_value (transport->live_messages) < transport->max_live_messages_unix_fds);
+      (_dbus_counter_get_unix_fd_value (transport->live_messages) < transport->max_live_messages_unix_fds) &&
+      /* nothing read now could be queued before the message being checked */
+      !_dbus_message_loader_get_is_checking (transport->loader) &&
+      !transport->read_paused;
   else
     {
       if (transport->receive_credentials_pending)
@@ -224,9 +403,9 @@ check_read_watch (DBusTransport *transport)
     }
 
   _dbus_verbose ("  setting read watch enabled = %d\n", need_read_watch);
-  _dbus_connection_toggle_watch_unlocked (transport->connection,
-                                          socket_transport->read_watch,
-                                          need_read_watch);
+  set_watch_wanted (transport, socket_transport->read_watch,
+                    &socket_transport->want_read, need_read_watch,
+                    socket_transport->readable);
 
   _dbus_transport_unref (transport);
 }
@@ -489,12 +668,325 @@ do_authentication (DBusTransport *transport,
     return TRUE;
 }
 
+static dbus_bool_t
+message_has_unix_fds (DBusMessage *message)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  const int *unix_fds;
+  unsigned n;
+
+  _dbus_message_get_unix_fds (message, &unix_fds, &n);
+
+  return n > 0;
+#else
+  return FALSE;
+#endif
+}
+
+/* messages gathered into one write; each needs a header and a body chunk */
+#define MAX_BATCH_MESSAGES (_DBUS_MAX_WRITE_CHUNKS / 2)
+
+/* a message can also have a tail, see _dbus_message_get_network_data() */
+#define MAX_MESSAGE_CHUNKS 3
+
+/* Adds chunks for the part of a locked message from offset on, and
+ * returns how many bytes they cover
+ */
+static int
+append_message_chunks (DBusMessage    *message,
+                       int             offset,
+                       DBusWriteChunk *chunks,
+                       int            *n_chunks_p)
+{
+  const DBusString *parts[MAX_MESSAGE_CHUNKS];
+  int n_bytes;
+  int i;
+
+  _dbus_message_get_network_data (message, &parts[0], &parts[1], &parts[2]);
+
+  n_bytes = 0;
+  for (i = 0; i < MAX_MESSAGE_CHUNKS; i++)
+    {
+      int len = _dbus_string_get_length (parts[i]);
+
+      if (offset < len)
+        {
+          chunks[*n_chunks_p].buffer = parts[i];
+          chunks[*n_chunks_p].start = offset;
+          chunks[*n_chunks_p].len = len - offset;
+          *n_chunks_p += 1;
+          n_bytes += len - offset;
+          offset = 0;
+        }
+      else
+        {
+          offset -= len;
+        }
+    }
+
+  return n_bytes;
+}
+
+/* Writes the unsent part of the first outgoing message, followed by as
+ * many of the next queued messages as fit in max_bytes, with a single
+ * system call. A message with unix fds ends the batch, because its fds
+ * have to go out with its first byte. Every message that was written
+ * completely is marked as sent, and message_bytes_written is left
+ * pointing into the first one that was not. Returns the number of
+ * bytes written, or -1 with errno set.
+ */
+static int
+write_message_batch (DBusTransport *transport,
+                     int            max_bytes)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusMessage *messages[MAX_BATCH_MESSAGES];
+  int remaining[MAX_BATCH_MESSAGES];
+  DBusWriteChunk chunks[_DBUS_MAX_WRITE_CHUNKS];
+  int n_messages;
+  int n_chunks;
+  int n_bytes;
+  int offset;
+  int bytes_written;
+  int unaccounted;
+  int i;
+
+  n_messages = _dbus_connection_get_messages_to_send (transport->connection,
+                                                      messages,
+                                                      MAX_BATCH_MESSAGES);
+  _dbus_assert (n_messages > 0);
+
+  n_chunks = 0;
+  n_bytes = 0;
+  offset = socket_transport->message_bytes_written;
+
+  for (i = 0; i < n_messages; i++)
+    {
+      if (i > 0)
+        {
+          if (n_bytes >= max_bytes ||
+              n_chunks + MAX_MESSAGE_CHUNKS > _DBUS_MAX_WRITE_CHUNKS)
+            break;
+
+          if (DBUS_TRANSPORT_CAN_SEND_UNIX_FD (transport) &&
+              message_has_unix_fds (messages[i]))
+            break;
+
+          dbus_message_lock (messages[i]);
+        }
+
+      remaining[i] = append_message_chunks (messages[i], offset,
+                                            chunks, &n_chunks);
+      _dbus_assert (remaining[i] > 0);
+
+      n_bytes += remaining[i];
+      offset = 0;
+    }
+
+  n_messages = i;
+
+  bytes_written = _dbus_write_socket_chunks (socket_transport->fd,
+                                             chunks, n_chunks);
+
+  if (bytes_written < 0)
+    return -1;
+
+  _dbus_verbose (" wrote %d bytes of %d in %d messages\n",
+                 bytes_written, n_bytes, n_messages);
+
+  unaccounted = bytes_written;
+  for (i = 0; i < n_messages && unaccounted > 0; i++)
+    {
+      if (unaccounted < remaining[i])
+        {
+          socket_transport->message_bytes_written += unaccounted;
+          break;
+        }
+
+      unaccounted -= remaining[i];
+      socket_transport->message_bytes_written = 0;
+
+      _dbus_connection_message_sent (transport->connection,
+                                     messages[i]);
+    }
+
+  return bytes_written;
+}
+
+/* Compresses the next batch of queued messages into encoded_outgoing,
+ * unless the previous batch has not all been written yet, and writes
+ * as much of it as the socket takes. message_bytes_written then counts
+ * bytes of encoded_outgoing, and the messages in a batch are only
+ * marked as sent once all of it has gone out. Returns the number of
+ * bytes written, or -1 with errno set; *oom_p is set instead if there
+ * was no memory to compress.
+ */
+static int
+write_compressed_batch (DBusTransport  *transport,
+                        DBusCompressor *compressor,
+                        int             max_bytes,
+                        dbus_bool_t    *oom_p)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  int total_bytes_to_write;
+  int bytes_written;
+
+  if (_dbus_string_get_length (&socket_transport->encoded_outgoing) == 0)
+    {
+      DBusMessage *messages[MAX_BATCH_MESSAGES];
+      DBusWriteChunk chunks[_DBUS_MAX_WRITE_CHUNKS];
+      int n_messages;
+      int n_chunks;
+      int n_bytes;
+      int i;
+
+      _dbus_assert (socket_transport->message_bytes_written == 0);
+
+      n_messages = _dbus_connection_get_messages_to_send (transport->connection,
+                                                          messages,
+                                                          MAX_BATCH_MESSAGES);
+      _dbus_assert (n_messages > 0);
+
+      n_chunks = 0;
+      n_bytes = 0;
+
+      for (i = 0; i < n_messages; i++)
+        {
+          if (i > 0 &&
+              (n_bytes >= max_bytes ||
+               n_chunks + MAX_MESSAGE_CHUNKS > _DBUS_MAX_WRITE_CHUNKS))
+            break;
+
+          dbus_message_lock (messages[i]);
+          n_bytes += append_message_chunks (messages[i], 0,
+                                            chunks, &n_chunks);
+        }
+
+      if (!_dbus_compressor_compress (compressor, chunks, n_chunks,
+                                      &socket_transport->encoded_outgoing))
+        {
+          *oom_p = TRUE;
+          return 0;
+        }
+
+      socket_transport->encoded_messages = i;
+
+      _dbus_verbose (" compressed %d bytes in %d messages to %d\n",
+                     n_bytes, i,
+                     _dbus_string_get_length (&socket_transport->encoded_outgoing));
+    }
+
+  total_bytes_to_write = _dbus_string_get_length (&socket_transport->encoded_outgoing);
+
+  bytes_written =
+    _dbus_write_socket (socket_transport->fd,
+                        &socket_transport->encoded_outgoing,
+                        socket_transport->message_bytes_written,
+                        total_bytes_to_write - socket_transport->message_bytes_written);
+
+  if (bytes_written < 0)
+    return -1;
+
+  socket_transport->message_bytes_written += bytes_written;
+  _dbus_assert (socket_transport->message_bytes_written <= total_bytes_to_write);
+
+  if (socket_transport->message_bytes_written == total_bytes_to_write)
+    {
+      for (; socket_transport->encoded_messages > 0;
+           socket_transport->encoded_messages--)
+        _dbus_connection_message_sent (transport->connection,
+                                       _dbus_connection_get_message_to_send (transport->connection));
+
+      socket_transport->message_bytes_written = 0;
+      _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
+      _dbus_string_compact (&socket_transport->encoded_outgoing, 2048);
+    }
+
+  return bytes_written;
+}
+
+/* With multiplexing, the other channels frame their messages into
+ * the mux's output as they queue them, and ours are framed here as
+ * channel 0 whenever that output has all been written. Returns false
+ * on oom.
+ */
+static dbus_bool_t
+do_writing_multiplexed (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusMux *mux = transport->mux;
+  dbus_bool_t unbounded;
+  int total;
+
+  unbounded = budget_is_unbounded (transport, &busy_writers,
+                                   socket_transport->write_busy);
+  total = 0;
+  while (!transport->disconnected)
+    {
+      const DBusString *buffer;
+      int start, len;
+      int bytes_written;
+
+      if (!unbounded &&
+          total > socket_transport->max_bytes_written_per_iteration)
+        {
+          _dbus_verbose ("%d bytes exceeds %d bytes written per iteration, returning\n",
+                         total, socket_transport->max_bytes_written_per_iteration);
+          break;
+        }
+
+      if (!_dbus_mux_has_output (mux))
+        {
+          if (!_dbus_connection_has_messages_to_send_unlocked (transport->connection))
+            break;
+
+          if (!_dbus_mux_frame_link_messages (mux,
+                                              socket_transport->max_bytes_written_per_iteration))
+            return FALSE;
+        }
+
+      _dbus_mux_get_output (mux, &buffer, &start, &len);
+      bytes_written = _dbus_write_socket (socket_transport->fd, buffer,
+                                          start, len);
+
+      if (bytes_written < 0)
+        {
+          /* EINTR already handled for us; see do_writing_internal()
+           * for EPIPE
+           */
+          if (_dbus_get_is_errno_eagain_or_ewouldblock () || _dbus_get_is_errno_epipe ())
+            socket_transport->writable = FALSE;
+          else
+            {
+              _dbus_verbose ("Error writing to remote app: %s\n",
+                             _dbus_strerror_from_errno ());
+              do_io_error (transport);
+            }
+          break;
+        }
+
+      _dbus_verbose (" wrote %d bytes of %d multiplexed\n", bytes_written, len);
+
+      socket_transport->writable = TRUE;
+      total += bytes_written;
+      _dbus_mux_output_written (mux, bytes_written);
+    }
+
+  adapt_budget (&socket_transport->max_bytes_written_per_iteration,
+                &socket_transport->write_busy, &busy_writers,
+                MIN_WRITE_BUDGET, total);
+
+  return TRUE;
+}
+
 /* returns false on oom */
 static dbus_bool_t
-do_writing (DBusTransport *transport)
+do_writing_internal (DBusTransport *transport)
 {
   int total;
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusCompressor *compressor;
+  dbus_bool_t unbounded;
   dbus_bool_t oom;
   
   /* No messages without authentication! */
@@ -516,8 +1008,14 @@ do_writing (DBusTransport *transport)
                  socket_transport->fd);
 #endif
   
+  if (transport->mux != NULL)
+    return do_writing_multiplexed (transport);
+
   oom = FALSE;
   total = 0;
+  compressor = _dbus_auth_get_compressor (transport->auth);
+  unbounded = budget_is_unbounded (transport, &busy_writers,
+                                   socket_transport->write_busy);
 
   while (!transport->disconnected &&
          _dbus_connection_has_messages_to_send_unlocked (transport->connection))
@@ -526,10 +1024,15 @@ do_writing (DBusTransport *transport)
       DBusMessage *message;
       const DBusString *header;
       const DBusString *body;
+      const DBusString *tail;
       int header_len, body_len;
       int total_bytes_to_write;
       
-      if (total > socket_transport->max_bytes_written_per_iteration)
+      /* An edge-triggered write watch only fires again once the
+       * socket has filled up, so then we keep going until it has
+       */
+      if (!unbounded &&
+          total > socket_transport->max_bytes_written_per_iteration)
         {
           _dbus_verbose ("%d bytes exceeds %d bytes written per iteration, returning\n",
                          total, socket_transport->max_bytes_written_per_iteration);
@@ -545,12 +1048,35 @@ do_writing (DBusTransport *transport)
 #endif
       
       _dbus_message_get_network_data (message,
-                                      &header, &body);
+                                      &header, &body, &tail);
 
       header_len = _dbus_string_get_length (header);
       body_len = _dbus_string_get_length (body);
 
-      if (_dbus_auth_needs_encoding (transport->auth))
+      if (compressor != NULL)
+        {
+          int max_bytes = socket_transport->max_bytes_written_per_iteration;
+
+          /* Only negotiated on TCP, where there are no fds to pass */
+          _dbus_assert (!DBUS_TRANSPORT_CAN_SEND_UNIX_FD (transport));
+
+          if (!unbounded)
+            max_bytes -= total;
+
+          bytes_written = write_compressed_batch (transport, compressor,
+                                                  max_bytes, &oom);
+          if (oom)
+            goto out;
+
+          if (bytes_written >= 0)
+            {
+              socket_transport->writable = TRUE;
+              total += bytes_written;
+              continue;
+            }
+
+        }
+      else if (_dbus_auth_needs_encoding (transport->auth))
         {
           /* Does fd passing even make sense with encoded data? */
           _dbus_assert(!DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport));
@@ -565,7 +1091,10 @@ do_writing (DBusTransport *transport)
                 }
               
               if (!_dbus_auth_encode_data (transport->auth,
-                                           body, &socket_transport->encoded_outgoing))
+                                           body, &socket_transport->encoded_outgoing) ||
+                  (_dbus_string_get_length (tail) > 0 &&
+                   !_dbus_auth_encode_data (transport->auth,
+                                            tail, &socket_transport->encoded_outgoing)))
                 {
                   _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
                   oom = TRUE;
@@ -588,7 +1117,8 @@ do_writing (DBusTransport *transport)
         }
       else
         {
-          total_bytes_to_write = header_len + body_len;
+          total_bytes_to_write = header_len + body_len +
+            _dbus_string_get_length (tail);
 
 #if 0
           _dbus_verbose ("message is %d bytes\n",
@@ -596,7 +1126,9 @@ do_writing (DBusTransport *transport)
 #endif
 
 #ifdef HAVE_UNIX_FD_PASSING
-          if (socket_transport->message_bytes_written <= 0 && DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport))
+          if (socket_transport->message_bytes_written <= 0 &&
+              DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport) &&
+              message_has_unix_fds (message))
             {
               /* Send the fds along with the first byte of the message */
               const int *unix_fds;
@@ -620,24 +1152,21 @@ do_writing (DBusTransport *transport)
           else
 #endif
             {
-              if (socket_transport->message_bytes_written < header_len)
-                {
-                  bytes_written =
-                    _dbus_write_socket_two (socket_transport->fd,
-                                            header,
-                                            socket_transport->message_bytes_written,
-                                            header_len - socket_transport->message_bytes_written,
-                                            body,
-                                            0, body_len);
-                }
-              else
+              int max_bytes = socket_transport->max_bytes_written_per_iteration;
+
+              if (!unbounded)
+                max_bytes -= total;
+
+              bytes_written = write_message_batch (transport, max_bytes);
+
+              /* the batch did its own accounting of which messages
+               * were completed, so only errors need the code below
+               */
+              if (bytes_written >= 0)
                 {
-                  bytes_written =
-                    _dbus_write_socket (socket_transport->fd,
-                                        body,
-                                        (socket_transport->message_bytes_written - header_len),
-                                        body_len -
-                                        (socket_transport->message_bytes_written - header_len));
+                  socket_transport->writable = TRUE;
+                  total += bytes_written;
+                  continue;
                 }
             }
         }
@@ -651,7 +1180,10 @@ do_writing (DBusTransport *transport)
            */
           
           if (_dbus_get_is_errno_eagain_or_ewouldblock () || _dbus_get_is_errno_epipe ())
-            goto out;
+            {
+              socket_transport->writable = FALSE;
+              goto out;
+            }
           else
             {
               _dbus_verbose ("Error writing to remote app: %s\n",
@@ -665,6 +1197,7 @@ do_writing (DBusTransport *transport)
           _dbus_verbose (" wrote %d bytes of %d\n", bytes_written,
                          total_bytes_to_write);
           
+          socket_transport->writable = TRUE;
           total += bytes_written;
           socket_transport->message_bytes_written += bytes_written;
 
@@ -684,29 +1217,110 @@ do_writing (DBusTransport *transport)
     }
 
  out:
+  if (total > 0)
+    _dbus_flight_record (DBUS_FLIGHT_WRITE, transport->flight_id, 0, total);
+
+  adapt_budget (&socket_transport->max_bytes_written_per_iteration,
+                &socket_transport->write_busy, &busy_writers,
+                MIN_WRITE_BUDGET, total);
+
   if (oom)
     return FALSE;
   else
     return TRUE;
 }
 
-/* returns false on out-of-memory */
 static dbus_bool_t
-do_reading (DBusTransport *transport)
+do_writing (DBusTransport *transport)
+{
+  DBusLatencyStart timing;
+  dbus_bool_t retval;
+
+  _dbus_latency_begin (&timing);
+  retval = do_writing_internal (transport);
+  _dbus_latency_end (DBUS_LATENCY_WRITE, &timing);
+
+  return retval;
+}
+
+/* returns false on out-of-memory; disconnects if the peer sent
+ * something that does not decompress
+ */
+static dbus_bool_t
+decompress_incoming (DBusTransport  *transport,
+                     DBusCompressor *compressor)
+{
+  dbus_bool_t corrupt;
+
+  if (!_dbus_transport_decompress_to_loader (transport, compressor, &corrupt))
+    {
+      _dbus_verbose ("Out of memory decompressing incoming data\n");
+      return FALSE;
+    }
+
+  if (corrupt)
+    {
+      _dbus_verbose ("Invalid compressed data from remote app\n");
+      do_io_error (transport);
+    }
+
+  return TRUE;
+}
+
+/* returns false on out-of-memory; disconnects if the peer sent
+ * frames that make no sense
+ */
+static dbus_bool_t
+demux_incoming (DBusTransport *transport)
+{
+  dbus_bool_t corrupt;
+  dbus_bool_t succeeded;
+
+  succeeded = _dbus_mux_demux (transport->mux, &corrupt);
+  if (!succeeded)
+    _dbus_verbose ("Out of memory demultiplexing incoming data\n");
+
+  if (corrupt)
+    {
+      _dbus_verbose ("Invalid frame from remote app\n");
+      do_io_error (transport);
+    }
+
+  /* Channels may have answered, or been closed, while we were at it */
+  check_write_watch (transport);
+
+  return succeeded;
+}
+
+/* returns false on out-of-memory; total_p, if not NULL, gets the
+ * number of bytes read
+ */
+static dbus_bool_t
+do_reading_internal (DBusTransport *transport,
+                     int           *total_p)
 {
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusCompressor *compressor;
   DBusString *buffer;
   int bytes_read;
   int total;
   dbus_bool_t oom;
+  dbus_bool_t drained;
+  dbus_bool_t unbounded;
 
   _dbus_verbose ("fd = %d\n",socket_transport->fd);
+
+  if (total_p != NULL)
+    *total_p = 0;
   
   /* No messages without authentication! */
   if (!_dbus_transport_get_is_authenticated (transport))
     return TRUE;
 
   oom = FALSE;
+  drained = FALSE;
+  unbounded = budget_is_unbounded (transport, &busy_readers,
+                                   socket_transport->read_busy);
   
   total = 0;
 
@@ -715,7 +1329,12 @@ do_reading (DBusTransport *transport)
   /* See if we've exceeded max messages and need to disable reading */
   check_read_watch (transport);
   
-  if (total > socket_transport->max_bytes_read_per_iteration)
+  /* As for writing, an edge-triggered watch needs us to read until
+   * EAGAIN; it will not fire again for data we leave behind. The
+   * live message limits in check_read_watch() still apply.
+   */
+  if (!unbounded &&
+      total > socket_transport->max_bytes_read_per_iteration)
     {
       _dbus_verbose ("%d bytes exceeds %d bytes read per iteration, returning\n",
                      total, socket_transport->max_bytes_read_per_iteration);
@@ -728,10 +1347,116 @@ do_reading (DBusTransport *transport)
   if (transport->disconnected)
     goto out;
 
-  if (!dbus_watch_get_enabled (socket_transport->read_watch))
-    return TRUE;
-  
-  if (_dbus_auth_needs_decoding (transport->auth))
+  if (!socket_transport->want_read)
+    goto out;
+
+  /* What arrived along with the end of the auth conversation comes
+   * before anything we read now; the framed and compressed streams
+   * below cannot be picked up half way through
+   */
+  if (!transport->unused_bytes_recovered)
+    {
+      if (!_dbus_transport_queue_messages (transport))
+        {
+          oom = TRUE;
+          goto out;
+        }
+
+      /* still held back by the limit on live messages */
+      if (!transport->unused_bytes_recovered)
+        goto out;
+    }
+
+  compressor = _dbus_auth_get_compressor (transport->auth);
+  if (transport->mux != NULL)
+    {
+      /* Input that running out of memory left undelivered goes first */
+      if (_dbus_mux_has_input (transport->mux) &&
+          !demux_incoming (transport))
+        {
+          oom = TRUE;
+          goto out;
+        }
+
+      if (transport->disconnected)
+        goto out;
+
+      if (_dbus_string_get_length (&socket_transport->encoded_incoming) > 0)
+        bytes_read = _dbus_string_get_length (&socket_transport->encoded_incoming);
+      else
+        bytes_read = _dbus_read_socket (socket_transport->fd,
+                                        &socket_transport->encoded_incoming,
+                                        socket_transport->max_bytes_read_per_iteration);
+
+      if (bytes_read > 0)
+        {
+          if (!_dbus_mux_feed (transport->mux,
+                               &socket_transport->encoded_incoming, 0,
+                               _dbus_string_get_length (&socket_transport->encoded_incoming)))
+            {
+              oom = TRUE;
+              goto out;
+            }
+
+          _dbus_string_set_length (&socket_transport->encoded_incoming, 0);
+          _dbus_string_compact (&socket_transport->encoded_incoming, 2048);
+
+          if (!demux_incoming (transport))
+            {
+              oom = TRUE;
+              goto out;
+            }
+
+          if (transport->disconnected)
+            goto out;
+        }
+    }
+  else if (compressor != NULL)
+    {
+      /* Input that running out of memory left in the compressor goes
+       * first, as there may be nothing more to read to get it moving
+       */
+      if (_dbus_compressor_has_input (compressor) &&
+          !decompress_incoming (transport, compressor))
+        {
+          oom = TRUE;
+          goto out;
+        }
+
+      if (transport->disconnected)
+        goto out;
+
+      if (_dbus_string_get_length (&socket_transport->encoded_incoming) > 0)
+        bytes_read = _dbus_string_get_length (&socket_transport->encoded_incoming);
+      else
+        bytes_read = _dbus_read_socket (socket_transport->fd,
+                                        &socket_transport->encoded_incoming,
+                                        socket_transport->max_bytes_read_per_iteration);
+
+      if (bytes_read > 0)
+        {
+          if (!_dbus_compressor_feed (compressor,
+                                      &socket_transport->encoded_incoming, 0,
+                                      _dbus_string_get_length (&socket_transport->encoded_incoming)))
+            {
+              oom = TRUE;
+              goto out;
+            }
+
+          _dbus_string_set_length (&socket_transport->encoded_incoming, 0);
+          _dbus_string_compact (&socket_transport->encoded_incoming, 2048);
+
+          if (!decompress_incoming (transport, compressor))
+            {
+              oom = TRUE;
+              goto out;
+            }
+
+          if (transport->disconnected)
+            goto out;
+        }
+    }
+  else if (_dbus_auth_needs_decoding (transport->auth))
     {
       /* Does fd passing even make sense with encoded data? */
       _dbus_assert(!DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport));
@@ -827,7 +1552,10 @@ do_reading (DBusTransport *transport)
           goto out;
         }
       else if (_dbus_get_is_errno_eagain_or_ewouldblock ())
-        goto out;
+        {
+          drained = TRUE;
+          goto out;
+        }
       else
         {
           _dbus_verbose ("Error reading from remote app: %s\n",
@@ -845,6 +1573,7 @@ do_reading (DBusTransport *transport)
   else
     {
       _dbus_verbose (" read %d bytes\n", bytes_read);
+      _DBUS_PROBE2 (read__done, socket_transport->fd, bytes_read);
       
       total += bytes_read;      
 
@@ -855,6 +1584,20 @@ do_reading (DBusTransport *transport)
           goto out;
         }
       
+      /* A short read means the socket buffer is empty, so reading
+       * again would only be a syscall that returns EAGAIN. The watch is
+       * level-triggered; if more data turns up before we return to the
+       * main loop it will just fire again. An edge-triggered one
+       * might not, if the short read stopped at fds passed along
+       * with the data rather than at the end of the buffer.
+       */
+      if (!transport->edge_triggered_watches &&
+          bytes_read < socket_transport->max_bytes_read_per_iteration)
+        {
+          drained = TRUE;
+          goto out;
+        }
+
       /* Try reading more data until we get EAGAIN and return, or
        * exceed max bytes per iteration.  If in blocking mode of
        * course we'll block instead of returning.
@@ -863,12 +1606,89 @@ do_reading (DBusTransport *transport)
     }
 
  out:
+  if (total_p != NULL)
+    *total_p = total;
+
+  if (total > 0)
+    _dbus_flight_record (DBUS_FLIGHT_READ, transport->flight_id, 0, total);
+
+  adapt_budget (&socket_transport->max_bytes_read_per_iteration,
+                &socket_transport->read_busy, &busy_readers,
+                MIN_READ_BUDGET, total);
+
+  socket_transport->readable = !drained;
+
   if (oom)
     return FALSE;
   else
     return TRUE;
 }
 
+static dbus_bool_t
+do_reading_counted (DBusTransport *transport,
+                    int           *total_p)
+{
+  DBusLatencyStart timing;
+  dbus_bool_t retval;
+
+  _dbus_latency_begin (&timing);
+  retval = do_reading_internal (transport, total_p);
+  _dbus_latency_end (DBUS_LATENCY_READ, &timing);
+
+  return retval;
+}
+
+static dbus_bool_t
+do_reading (DBusTransport *transport)
+{
+  return do_reading_counted (transport, NULL);
+}
+
+/* A blocking iteration is usually waiting for a reply, which on a
+ * busy host or a fast local peer is often in the socket buffer
+ * already; reading straight away saves the poll() and the sleep in
+ * it. Returns TRUE if that got some data (or an error), so there is
+ * no need to poll.
+ */
+static dbus_bool_t
+read_before_poll (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  int total;
+  int i;
+
+  /* With a slow peer this is a wasted syscall every time; stop
+   * guessing for a while once it keeps missing
+   */
+  if (socket_transport->read_first_skips > 0)
+    {
+      socket_transport->read_first_skips -= 1;
+      return FALSE;
+    }
+
+  do_reading_counted (transport, &total);
+
+  for (i = 0;
+       total == 0 && !transport->disconnected && i < socket_transport->read_spins;
+       i++)
+    do_reading_counted (transport, &total);
+
+  if (total > 0 || transport->disconnected)
+    {
+      socket_transport->read_first_misses = 0;
+      return TRUE;
+    }
+
+  socket_transport->read_first_misses += 1;
+  if (socket_transport->read_first_misses >= READ_FIRST_MAX_MISSES)
+    {
+      socket_transport->read_first_misses = READ_FIRST_MAX_MISSES;
+      socket_transport->read_first_skips = READ_FIRST_RETRY_INTERVAL;
+    }
+
+  return FALSE;
+}
+
 static dbus_bool_t
 unix_error_with_read_to_come (DBusTransport *itransport,
                               DBusWatch     *watch,
@@ -881,8 +1701,7 @@ unix_error_with_read_to_come (DBusTransport *itransport,
    
   /* If we have a read watch enabled ...
      we -might have data incoming ... => handle the HANGUP there */
-  if (watch != transport->read_watch &&
-      _dbus_watch_get_enabled (transport->read_watch))
+  if (watch != transport->read_watch && transport->want_read)
     return FALSE;
       
   return TRUE; 
@@ -918,6 +1737,8 @@ socket_handle_watch (DBusTransport *transport,
       _dbus_verbose ("handling read watch %p flags = %x\n",
                      watch, flags);
 #endif
+      socket_transport->readable = TRUE;
+
       if (!do_authentication (transport, TRUE, FALSE, &auth_finished))
         return FALSE;
 
@@ -947,6 +1768,8 @@ socket_handle_watch (DBusTransport *transport,
       _dbus_verbose ("handling write watch, have_outgoing_messages = %d\n",
                      _dbus_connection_has_messages_to_send_unlocked (transport->connection));
 #endif
+      socket_transport->writable = TRUE;
+
       if (!do_authentication (transport, FALSE, TRUE, NULL))
         return FALSE;
       
@@ -974,6 +1797,20 @@ socket_handle_watch (DBusTransport *transport,
     }
 #endif /* DBUS_ENABLE_VERBOSE_MODE */
 
+  /* Authentication, or having just finished it, can leave us wanting
+   * to read or write without having got as far as EAGAIN; with an
+   * edge-triggered watch nothing else would bring us back.
+   */
+  if (transport->edge_triggered_watches && !transport->disconnected)
+    {
+      if (watch == socket_transport->read_watch &&
+          socket_transport->want_read && socket_transport->readable)
+        _dbus_connection_rearm_watch_unlocked (transport->connection, watch);
+      else if (watch == socket_transport->write_watch &&
+               socket_transport->want_write && socket_transport->writable)
+        _dbus_connection_rearm_watch_unlocked (transport->connection, watch);
+    }
+
   return TRUE;
 }
 
@@ -1070,15 +1907,23 @@ socket_do_iteration (DBusTransport *transport,
       if ((flags & DBUS_ITERATION_DO_WRITING) &&
           !(flags & (DBUS_ITERATION_DO_READING | DBUS_ITERATION_BLOCK)) &&
           !transport->disconnected &&
-          _dbus_connection_has_messages_to_send_unlocked (transport->connection))
+          socket_has_output (transport))
         {
           do_writing (transport);
 
           if (transport->disconnected ||
-              !_dbus_connection_has_messages_to_send_unlocked (transport->connection))
+              !socket_has_output (transport))
             goto out;
         }
 
+      /* Likewise, if we are only waiting to read, try that first */
+      if ((flags & DBUS_ITERATION_DO_READING) &&
+          (flags & DBUS_ITERATION_BLOCK) &&
+          !transport->disconnected &&
+          !socket_has_output (transport) &&
+          read_before_poll (transport))
+        goto out;
+
       /* If we get here, we decided to do the poll() after all */
       _dbus_assert (socket_transport->read_watch);
       if (flags & DBUS_ITERATION_DO_READING)
@@ -1195,6 +2040,23 @@ socket_live_messages_changed (DBusTransport *transport)
   check_read_watch (transport);
 }
 
+static void
+socket_watch_mode_changed (DBusTransport *transport)
+{
+  check_read_watch (transport);
+  check_write_watch (transport);
+}
+
+static void
+socket_get_io_budgets (DBusTransport *transport,
+                       int           *read_budget_p,
+                       int           *write_budget_p)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  *read_budget_p = socket_transport->max_bytes_read_per_iteration;
+  *write_budget_p = socket_transport->max_bytes_written_per_iteration;
+}
 
 static dbus_bool_t
 socket_get_socket_fd (DBusTransport *transport,
@@ -1207,6 +2069,27 @@ socket_get_socket_fd (DBusTransport *transport,
   return TRUE;
 }
 
+static void
+socket_trim (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusCompressor *compressor;
+
+  /* a partly written or decoded message is still in use */
+  if (_dbus_string_get_length (&socket_transport->encoded_outgoing) == 0)
+    _dbus_string_compact (&socket_transport->encoded_outgoing, 0);
+
+  if (_dbus_string_get_length (&socket_transport->encoded_incoming) == 0)
+    _dbus_string_compact (&socket_transport->encoded_incoming, 0);
+
+  compressor = _dbus_auth_get_compressor (transport->auth);
+  if (compressor != NULL)
+    _dbus_compressor_trim (compressor);
+
+  if (transport->mux != NULL)
+    _dbus_mux_trim (transport->mux);
+}
+
 static const DBusTransportVTable socket_vtable = {
   socket_finalize,
   socket_handle_watch,
@@ -1214,7 +2097,10 @@ static const DBusTransportVTable socket_vtable = {
   socket_connection_set,
   socket_do_iteration,
   socket_live_messages_changed,
-  socket_get_socket_fd
+  socket_get_socket_fd,
+  socket_trim,
+  socket_watch_mode_changed,
+  socket_get_io_budgets
 };
 
 /**
@@ -1271,9 +2157,37 @@ _dbus_transport_new_for_socket (int               fd,
   socket_transport->fd = fd;
   socket_transport->message_bytes_written = 0;
   
-  /* These values should probably be tunable or something. */     
-  socket_transport->max_bytes_read_per_iteration = 2048;
-  socket_transport->max_bytes_written_per_iteration = 2048;
+  /* The read size is large enough to pick up a burst of small
+   * messages in one syscall; the loader parses them all out of the
+   * one buffer. Both grow for a connection that keeps using them up.
+   */
+  socket_transport->max_bytes_read_per_iteration = MIN_READ_BUDGET;
+  socket_transport->max_bytes_written_per_iteration = MIN_WRITE_BUDGET;
+  socket_transport->read_busy = FALSE;
+  socket_transport->write_busy = FALSE;
+
+  /* Spinning only pays off when the peer answers within microseconds
+   * on another CPU, and it holds the connection lock, so it is opt-in
+   */
+  socket_transport->read_first_misses = 0;
+  socket_transport->read_first_skips = 0;
+  socket_transport->read_spins = 0;
+  {
+    const char *s = _dbus_getenv ("DBUS_BLOCKING_READ_SPINS");
+    DBusString str;
+    long spins;
+
+    if (s != NULL)
+      {
+        _dbus_string_init_const (&str, s);
+        if (_dbus_string_parse_int (&str, 0, &spins, NULL) && spins > 0)
+          socket_transport->read_spins = MIN (spins, MAX_READ_SPINS);
+      }
+  }
+
+  /* Nothing tells us otherwise until we have tried */
+  socket_transport->readable = TRUE;
+  socket_transport->writable = TRUE;
   
   return (DBusTransport*) socket_transport;
 
@@ -1372,6 +2286,93 @@ error:
   return NULL;
 }
 
+static dbus_bool_t
+parse_tcp_boolean (DBusAddressEntry *entry,
+                   const char       *key,
+                   int              *value_p,
+                   DBusError        *error)
+{
+  const char *value;
+
+  value = dbus_address_entry_get_value (entry, key);
+  if (value == NULL)
+    return TRUE;
+
+  if (strcmp (value, "true") == 0)
+    *value_p = 1;
+  else if (strcmp (value, "false") == 0)
+    *value_p = 0;
+  else
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "%s in tcp address must be true or false", key);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+parse_tcp_number (DBusAddressEntry *entry,
+                  const char       *key,
+                  const char       *unit,
+                  int              *value_p,
+                  DBusError        *error)
+{
+  const char *value;
+  DBusString str;
+  long l;
+  int end;
+
+  value = dbus_address_entry_get_value (entry, key);
+  if (value == NULL)
+    return TRUE;
+
+  _dbus_string_init_const (&str, value);
+  if (!_dbus_string_parse_int (&str, 0, &l, &end) ||
+      end != _dbus_string_get_length (&str) ||
+      l < 0 || l > _DBUS_INT_MAX)
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "%s in tcp address must be a number of %s",
+                      key, unit);
+      return FALSE;
+    }
+
+  *value_p = l;
+  return TRUE;
+}
+
+/**
+ * Reads the socket tuning out of a tcp or nonce-tcp address:
+ * nodelay and keepalive take true or false, sndbuf and rcvbuf a
+ * size in bytes and busypoll a time in microseconds. Keys that are
+ * not there are left at -1.
+ *
+ * @param entry the address entry
+ * @param options return location for the tuning
+ * @param error set if one of the keys has a bad value
+ * @returns #FALSE if error was set
+ */
+dbus_bool_t
+_dbus_tcp_options_from_address (DBusAddressEntry *entry,
+                                DBusTcpOptions   *options,
+                                DBusError        *error)
+{
+  options->nodelay = -1;
+  options->keepalive = -1;
+  options->sndbuf = -1;
+  options->rcvbuf = -1;
+  options->busy_poll = -1;
+
+  return parse_tcp_boolean (entry, "nodelay", &options->nodelay, error) &&
+    parse_tcp_boolean (entry, "keepalive", &options->keepalive, error) &&
+    parse_tcp_number (entry, "sndbuf", "bytes", &options->sndbuf, error) &&
+    parse_tcp_number (entry, "rcvbuf", "bytes", &options->rcvbuf, error) &&
+    parse_tcp_number (entry, "busypoll", "microseconds",
+                      &options->busy_poll, error);
+}
+
 /**
  * Opens a TCP socket transport.
  * 
@@ -1401,12 +2402,35 @@ _dbus_transport_open_socket(DBusAddressEntry  *entry,
       const char *port = dbus_address_entry_get_value (entry, "port");
       const char *family = dbus_address_entry_get_value (entry, "family");
       const char *noncefile = dbus_address_entry_get_value (entry, "noncefile");
+      const char *compression = dbus_address_entry_get_value (entry, "compression");
+      const char *multiplex = dbus_address_entry_get_value (entry, "multiplex");
+      DBusTcpOptions options;
 
       if ((isNonceTcp == TRUE) != (noncefile != NULL)) {
           _dbus_set_bad_address (error, method, "noncefile", NULL);
           return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
       }
 
+      if (compression != NULL &&
+          strcmp (compression, DBUS_COMPRESSION_DEFLATE) != 0)
+        {
+          _dbus_set_bad_address (error, NULL, NULL,
+                                 "Unknown compression algorithm in tcp address");
+          return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+        }
+
+      if (multiplex != NULL &&
+          strcmp (multiplex, "true") != 0 &&
+          strcmp (multiplex, "false") != 0)
+        {
+          _dbus_set_bad_address (error, NULL, NULL,
+                                 "multiplex in tcp address must be true or false");
+          return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+        }
+
+      if (!_dbus_tcp_options_from_address (entry, &options, error))
+        return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+
       if (port == NULL)
         {
           _dbus_set_bad_address (error, method, "port", NULL);
@@ -1421,6 +2445,18 @@ _dbus_transport_open_socket(DBusAddressEntry  *entry,
         }
       else
         {
+          /* Only asked for if the address says so; the server's end
+           * of a network connection is always willing
+           */
+          _dbus_set_tcp_options (((DBusTransportSocket *) *transport_p)->fd,
+                                 &options);
+
+          if (compression != NULL)
+            _dbus_transport_set_compression_possible (*transport_p);
+
+          if (multiplex != NULL && strcmp (multiplex, "true") == 0)
+            _dbus_transport_set_multiplex_possible (*transport_p, NULL, NULL, NULL);
+
           _DBUS_ASSERT_ERROR_IS_CLEAR (error);
           return DBUS_TRANSPORT_OPEN_OK;
         }
@@ -38,6 +38,9 @@ DBusTransport*          _dbus_transport_new_for_tcp_socket (const char        *h
 DBusTransportOpenResult _dbus_transport_open_socket        (DBusAddressEntry  *entry,
                                                             DBusTransport    **transport_p,
                                                             DBusError         *error);
+dbus_bool_t             _dbus_tcp_options_from_address     (DBusAddressEntry  *entry,
+                                                            DBusTcpOptions    *options,
+                                                            DBusError         *error);
 
 
 
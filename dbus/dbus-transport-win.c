@@ -38,6 +38,66 @@
  * @{
  */
 
+#ifdef HAVE_AFUNIX_H
+/**
+ * Creates a new transport for the given AF_UNIX socket path.
+ *
+ * @param path the path to the socket.
+ * @param error address where an error can be returned.
+ * @returns a new transport, or #NULL on failure.
+ */
+static DBusTransport*
+_dbus_transport_new_for_domain_socket (const char     *path,
+                                       DBusError      *error)
+{
+  int fd;
+  DBusTransport *transport;
+  DBusString address;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!_dbus_string_init (&address))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return NULL;
+    }
+
+  if (!_dbus_string_append (&address, "unix:path=") ||
+      !_dbus_string_append (&address, path))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed_0;
+    }
+
+  fd = _dbus_connect_unix_socket (path, FALSE, error);
+  if (fd < 0)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed_0;
+    }
+
+  _dbus_verbose ("Successfully connected to unix socket %s\n",
+                 path);
+
+  transport = _dbus_transport_new_for_socket (fd, NULL, &address);
+  if (transport == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed_1;
+    }
+
+  _dbus_string_free (&address);
+
+  return transport;
+
+ failed_1:
+  _dbus_close_socket (fd, NULL);
+ failed_0:
+  _dbus_string_free (&address);
+  return NULL;
+}
+#endif /* HAVE_AFUNIX_H */
+
 /**
  * Opens platform specific transport types.
  * 
@@ -61,6 +121,32 @@ _dbus_transport_open_platform_specific (DBusAddressEntry  *entry,
   method = dbus_address_entry_get_method (entry);
   _dbus_assert (method != NULL);
 
+#ifdef HAVE_AFUNIX_H
+  if (strcmp (method, "unix") == 0)
+    {
+      const char *path = dbus_address_entry_get_value (entry, "path");
+
+      if (path == NULL)
+        {
+          _dbus_set_bad_address (error, NULL, NULL,
+                                 "unix: address on Windows must specify path=");
+          return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+        }
+
+      *transport_p = _dbus_transport_new_for_domain_socket (path, error);
+      if (*transport_p == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          return DBUS_TRANSPORT_OPEN_DID_NOT_CONNECT;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          return DBUS_TRANSPORT_OPEN_OK;
+        }
+    }
+#endif
+
   if (strcmp (method, "nonce-tcp") != 0)
     {
       _DBUS_ASSERT_ERROR_IS_CLEAR (error);
@@ -25,13 +25,16 @@
 #include "dbus-transport-protected.h"
 #include "dbus-transport-unix.h"
 #include "dbus-transport-socket.h"
+#include "dbus-transport-mux.h"
 #include "dbus-connection-internal.h"
 #include "dbus-watch.h"
 #include "dbus-auth.h"
 #include "dbus-address.h"
 #include "dbus-credentials.h"
+#include "dbus-flight-recorder.h"
 #include "dbus-message-private.h"
 #include "dbus-marshal-header.h"
+#include "dbus-probes.h"
 #ifdef DBUS_BUILD_TESTS
 #include "dbus-server-debug-pipe.h"
 #endif
@@ -175,8 +178,15 @@ _dbus_transport_init_base (DBusTransport             *transport,
   transport->windows_user_function = NULL;
   transport->windows_user_data = NULL;
   transport->free_windows_user_data = NULL;
+
+  transport->mux = NULL;
+  transport->new_channel_function = NULL;
+  transport->new_channel_data = NULL;
+  transport->free_new_channel_data = NULL;
   
   transport->expected_guid = NULL;
+
+  transport->flight_id = _dbus_flight_id_new ();
   
   /* Try to default to something that won't totally hose the system,
    * but doesn't impose too much of a limitation.
@@ -219,6 +229,12 @@ _dbus_transport_finalize_base (DBusTransport *transport)
 
   if (transport->free_windows_user_data != NULL)
     (* transport->free_windows_user_data) (transport->windows_user_data);
+
+  if (transport->mux != NULL)
+    _dbus_mux_free (transport->mux);
+
+  if (transport->free_new_channel_data != NULL)
+    (* transport->free_new_channel_data) (transport->new_channel_data);
   
   _dbus_message_loader_unref (transport->loader);
   _dbus_auth_unref (transport->auth);
@@ -265,10 +281,128 @@ check_address (const char *address, DBusError *error)
   return transport;
 }
 
+/* The address autolaunch last found for this process, and the
+ * DISPLAY it was found for (autolaunched buses are per display)
+ */
+static char *autolaunch_address = NULL;
+static char *autolaunch_display = NULL;
+static dbus_bool_t autolaunch_shutdown_registered = FALSE;
+_DBUS_DEFINE_GLOBAL_LOCK (autolaunch);
+
+static void
+autolaunch_cache_shutdown (void *data)
+{
+  _DBUS_LOCK (autolaunch);
+
+  dbus_free (autolaunch_address);
+  dbus_free (autolaunch_display);
+  autolaunch_address = NULL;
+  autolaunch_display = NULL;
+  autolaunch_shutdown_registered = FALSE;
+
+  _DBUS_UNLOCK (autolaunch);
+}
+
+/* Returns a copy of the remembered address if it's for the current
+ * display, or #NULL
+ */
+static char*
+autolaunch_cache_lookup (void)
+{
+  const char *display;
+  char *address = NULL;
+
+  display = _dbus_getenv ("DISPLAY");
+
+  _DBUS_LOCK (autolaunch);
+
+  if (autolaunch_address != NULL &&
+      ((display == NULL && autolaunch_display == NULL) ||
+       (display != NULL && autolaunch_display != NULL &&
+        strcmp (display, autolaunch_display) == 0)))
+    address = _dbus_strdup (autolaunch_address);
+
+  _DBUS_UNLOCK (autolaunch);
+
+  return address;
+}
+
+/* Remembers @p address, or forgets the old one if it's #NULL.
+ * Failing to remember is harmless, so OOM is ignored.
+ */
+static void
+autolaunch_cache_set (const char *address)
+{
+  const char *display;
+
+  display = _dbus_getenv ("DISPLAY");
+
+  _DBUS_LOCK (autolaunch);
+
+  if (!autolaunch_shutdown_registered)
+    {
+      if (!_dbus_register_shutdown_func (autolaunch_cache_shutdown, NULL))
+        goto out;
+
+      autolaunch_shutdown_registered = TRUE;
+    }
+
+  dbus_free (autolaunch_address);
+  dbus_free (autolaunch_display);
+  autolaunch_address = NULL;
+  autolaunch_display = NULL;
+
+  if (address == NULL)
+    goto out;
+
+  autolaunch_address = _dbus_strdup (address);
+  if (display != NULL)
+    autolaunch_display = _dbus_strdup (display);
+
+  if (autolaunch_address == NULL ||
+      (display != NULL && autolaunch_display == NULL))
+    {
+      dbus_free (autolaunch_address);
+      dbus_free (autolaunch_display);
+      autolaunch_address = NULL;
+      autolaunch_display = NULL;
+    }
+
+ out:
+  _DBUS_UNLOCK (autolaunch);
+}
+
+/* Connects to an address autolaunch found without starting anything;
+ * if that fails, the bus has gone away and is forgotten
+ */
+static DBusTransport*
+try_known_autolaunch_address (const char *address)
+{
+  DBusTransport *result;
+  DBusError tmp_error = DBUS_ERROR_INIT;
+
+  result = check_address (address, &tmp_error);
+  if (result == NULL)
+    {
+      _dbus_verbose ("autolaunched bus %s has gone away: %s\n",
+                     address, tmp_error.message);
+      dbus_error_free (&tmp_error);
+      autolaunch_cache_set (NULL);
+    }
+
+  return result;
+}
+
 /**
  * Creates a new transport for the "autostart" method.
  * This creates a client-side of a transport.
  *
+ * Running dbus-launch to find the bus means a fork, an exec and a
+ * round trip to the X server, so the address it gave is remembered
+ * for the rest of the process, and the one it recorded for other
+ * processes is tried next; either is only used if connecting to it
+ * works.
+ *
  * @param error address where an error can be returned.
  * @returns a new transport, or #NULL on failure.
  */
@@ -277,15 +411,34 @@ _dbus_transport_new_for_autolaunch (DBusError      *error)
 {
   DBusString address;
   DBusTransport *result = NULL;
+  char *known;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
+  known = autolaunch_cache_lookup ();
+  if (known != NULL)
+    {
+      result = try_known_autolaunch_address (known);
+      dbus_free (known);
+      if (result != NULL)
+        return result;
+    }
+
   if (!_dbus_string_init (&address))
     {
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       return NULL;
     }
 
+  if (_dbus_lookup_autolaunch_address (&address))
+    {
+      result = try_known_autolaunch_address (_dbus_string_get_const_data (&address));
+      if (result != NULL)
+        goto out;
+
+      _dbus_string_set_length (&address, 0);
+    }
+
   if (!_dbus_get_autolaunch_address (&address, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
@@ -299,6 +452,9 @@ _dbus_transport_new_for_autolaunch (DBusError      *error)
     _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
  out:
+  if (result != NULL)
+    autolaunch_cache_set (_dbus_string_get_const_data (&address));
+
   _dbus_string_free (&address);
   return result;
 }
@@ -505,6 +661,11 @@ _dbus_transport_disconnect (DBusTransport *transport)
   
   transport->disconnected = TRUE;
 
+  _dbus_flight_record (DBUS_FLIGHT_DISCONNECTED, transport->flight_id, 0, 0);
+
+  if (transport->mux != NULL)
+    _dbus_mux_link_disconnected (transport->mux);
+
   _dbus_verbose ("end\n");
 }
 
@@ -785,8 +946,26 @@ _dbus_transport_get_is_authenticated (DBusTransport *transport)
             maybe_authenticated = FALSE;
         }
 
+      if (maybe_authenticated && transport->mux == NULL &&
+          _dbus_auth_get_multiplexed (transport->auth))
+        {
+          transport->mux = _dbus_mux_new (transport);
+          if (transport->mux == NULL)
+            {
+              _dbus_verbose ("No memory to set up multiplexing\n");
+              maybe_authenticated = FALSE;
+            }
+        }
+
       transport->authenticated = maybe_authenticated;
 
+      if (maybe_authenticated)
+        {
+          _DBUS_PROBE1 (auth__complete, transport->connection);
+          _dbus_flight_record (DBUS_FLIGHT_AUTHENTICATED, transport->flight_id, 0,
+                               _dbus_credentials_get_unix_uid (_dbus_auth_get_identity (transport->auth)));
+        }
+
       _dbus_connection_unref_unlocked (transport->connection);
       return maybe_authenticated;
     }
@@ -839,6 +1018,19 @@ _dbus_transport_get_address (DBusTransport *transport)
   return transport->address;
 }
 
+/**
+ * Gets the number that stands for this transport in the flight
+ * recorder. It never changes, so needs no lock.
+ *
+ * @param transport the transport
+ * @returns the flight id
+ */
+dbus_uint32_t
+_dbus_transport_get_flight_id (DBusTransport *transport)
+{
+  return transport->flight_id;
+}
+
 /**
  * Gets the id of the server we are connected to (see
  * dbus_server_get_id()). Only works on client side.
@@ -987,7 +1179,49 @@ _dbus_transport_do_iteration (DBusTransport  *transport,
 static dbus_bool_t
 recover_unused_bytes (DBusTransport *transport)
 {
-  if (_dbus_auth_needs_decoding (transport->auth))
+  DBusCompressor *compressor;
+
+  compressor = _dbus_auth_get_compressor (transport->auth);
+  if (transport->mux != NULL)
+    {
+      const DBusString *bytes;
+      dbus_bool_t corrupt;
+
+      /* Whatever followed BEGIN is already framed */
+      _dbus_auth_get_unused_bytes (transport->auth, &bytes);
+      if (!_dbus_mux_feed (transport->mux, bytes, 0,
+                           _dbus_string_get_length (bytes)))
+        goto nomem;
+
+      _dbus_auth_delete_unused_bytes (transport->auth);
+
+      if (!_dbus_mux_demux (transport->mux, &corrupt))
+        goto nomem;
+
+      if (corrupt)
+        _dbus_transport_disconnect (transport);
+    }
+  else if (compressor != NULL)
+    {
+      const DBusString *bytes;
+      dbus_bool_t corrupt;
+
+      /* Whatever followed BEGIN is already compressed */
+      _dbus_auth_get_unused_bytes (transport->auth, &bytes);
+      if (!_dbus_compressor_feed (compressor, bytes, 0,
+                                  _dbus_string_get_length (bytes)))
+        goto nomem;
+
+      _dbus_auth_delete_unused_bytes (transport->auth);
+
+      if (!_dbus_transport_decompress_to_loader (transport, compressor,
+                                                 &corrupt))
+        goto nomem;
+
+      if (corrupt)
+        _dbus_transport_disconnect (transport);
+    }
+  else if (_dbus_auth_needs_decoding (transport->auth))
     {
       DBusString plaintext;
       const DBusString *encoded;
@@ -1073,6 +1307,36 @@ recover_unused_bytes (DBusTransport *transport)
   return FALSE;
 }
 
+/**
+ * Decompresses whatever the compressor has been fed into the message
+ * loader's buffer. Even on #FALSE return, the output produced so far
+ * is kept and the rest of the input stays queued in the compressor.
+ *
+ * @param transport the transport
+ * @param compressor the transport's compressor
+ * @param corrupt_p set to #TRUE if the peer sent invalid data
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_transport_decompress_to_loader (DBusTransport  *transport,
+                                      DBusCompressor *compressor,
+                                      dbus_bool_t    *corrupt_p)
+{
+  DBusString *buffer;
+  dbus_bool_t succeeded;
+  int orig_len;
+
+  _dbus_message_loader_get_buffer (transport->loader, &buffer);
+
+  orig_len = _dbus_string_get_length (buffer);
+  succeeded = _dbus_compressor_decompress (compressor, buffer, corrupt_p);
+
+  _dbus_message_loader_return_buffer (transport->loader, buffer,
+                                      _dbus_string_get_length (buffer) - orig_len);
+
+  return succeeded;
+}
+
 /**
  * Reports our current dispatch status (whether there's buffered
  * data to be queued as messages, or not, or we need memory).
@@ -1165,6 +1429,90 @@ _dbus_transport_queue_messages (DBusTransport *transport)
   return status != DBUS_DISPATCH_NEED_MEMORY;
 }
 
+/**
+ * Lets the auth conversation negotiate compression of the message
+ * stream. Clients only ask for it when their address says so; servers
+ * only agree on transports where the saved bandwidth is worth the
+ * CPU, i.e. TCP.
+ *
+ * @param transport the transport
+ */
+void
+_dbus_transport_set_compression_possible (DBusTransport *transport)
+{
+  _dbus_auth_set_compression_possible (transport->auth, TRUE);
+}
+
+/**
+ * Lets the auth conversation negotiate carrying several logical
+ * connections over the stream, see dbus-transport-mux.c. Clients only
+ * ask for it when their address says so, passing #NULL for function;
+ * servers pass the function that takes the channels clients open.
+ *
+ * @param transport the transport
+ * @param function called with each channel the peer opens, or #NULL
+ * @param data data for function
+ * @param free_data_function function to free data, or #NULL
+ */
+void
+_dbus_transport_set_multiplex_possible (DBusTransport          *transport,
+                                        DBusNewChannelFunction  function,
+                                        void                   *data,
+                                        DBusFreeFunction        free_data_function)
+{
+  _dbus_assert (transport->new_channel_function == NULL);
+
+  _dbus_auth_set_multiplex_possible (transport->auth, TRUE);
+
+  transport->new_channel_function = function;
+  transport->new_channel_data = data;
+  transport->free_new_channel_data = free_data_function;
+}
+
+/**
+ * See dbus_connection_open_channel().
+ *
+ * @param transport the transport of the link
+ * @param error address where an error can be returned
+ * @returns the transport of the new channel, or #NULL on failure
+ */
+DBusTransport*
+_dbus_transport_open_channel (DBusTransport *transport,
+                              DBusError     *error)
+{
+  DBusTransport *channel;
+
+  if (transport->disconnected)
+    {
+      dbus_set_error (error, DBUS_ERROR_DISCONNECTED,
+                      "Connection is closed");
+      return NULL;
+    }
+
+  if (!_dbus_transport_get_is_authenticated (transport))
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Connection is not authenticated yet");
+      return NULL;
+    }
+
+  if (transport->mux == NULL || transport->is_server)
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Connection does not carry channels");
+      return NULL;
+    }
+
+  channel = _dbus_mux_open_channel (transport->mux);
+  if (channel == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  return channel;
+}
+
 /**
  * See dbus_connection_set_max_message_size().
  *
@@ -1191,6 +1539,147 @@ _dbus_transport_set_max_message_unix_fds (DBusTransport  *transport,
   _dbus_message_loader_set_max_message_unix_fds (transport->loader, n);
 }
 
+/**
+ * See dbus_connection_set_trust_peer_messages().
+ *
+ * @param transport the transport
+ * @param value #TRUE to skip validating message bodies
+ */
+void
+_dbus_transport_set_trust_peer_messages (DBusTransport  *transport,
+                                         dbus_bool_t     value)
+{
+  _dbus_message_loader_set_trust_bodies (transport->loader, value);
+}
+
+/**
+ * Has the bodies of big messages validated by function, see
+ * _dbus_message_loader_set_body_check_function(). While a check is
+ * out, transports that read through a watch stop reading.
+ *
+ * @param transport the transport
+ * @param min_size the smallest body to hand off
+ * @param function the function, or #NULL to validate everything here
+ * @param data data for function
+ */
+void
+_dbus_transport_set_body_check_function (DBusTransport         *transport,
+                                         long                   min_size,
+                                         DBusBodyCheckFunction  function,
+                                         void                  *data)
+{
+  _dbus_message_loader_set_body_check_function (transport->loader, min_size,
+                                                function, data);
+}
+
+/**
+ * Hands back a body check made by the transport's loader, and starts
+ * reading again if it was what held reading up.
+ *
+ * @param transport the transport
+ * @param check the check, which _dbus_body_check_run() has been called on
+ */
+void
+_dbus_transport_body_check_done (DBusTransport *transport,
+                                 DBusBodyCheck *check)
+{
+  _dbus_message_loader_body_check_done (transport->loader, check);
+
+  if (transport->vtable->live_messages_changed)
+    (* transport->vtable->live_messages_changed) (transport);
+}
+
+/**
+ * Stops reading new messages, or starts again. Whatever was already
+ * read stays queued; this only holds back what is still in the
+ * socket, so the peer sees ordinary backpressure.
+ *
+ * @param transport the transport
+ * @param paused #TRUE to stop reading
+ */
+void
+_dbus_transport_set_read_paused (DBusTransport *transport,
+                                 dbus_bool_t    paused)
+{
+  if (transport->read_paused == (paused != FALSE))
+    return;
+
+  transport->read_paused = paused != FALSE;
+
+  if (transport->vtable->live_messages_changed)
+    (* transport->vtable->live_messages_changed) (transport);
+}
+
+/**
+ * Frees the spare capacity of the read buffer and of any buffers
+ * the transport implementation keeps, leaving what is in use.
+ *
+ * @param transport the transport
+ */
+void
+_dbus_transport_trim (DBusTransport  *transport)
+{
+  _dbus_message_loader_trim (transport->loader);
+
+  if (transport->vtable->trim != NULL)
+    (* transport->vtable->trim) (transport);
+}
+
+/**
+ * Gets how many bytes the transport currently reads and writes at
+ * most in one iteration before going back to the main loop. Both
+ * are 0 for a transport that does not keep such budgets.
+ *
+ * @param transport the transport
+ * @param read_budget_p return location for the read budget
+ * @param write_budget_p return location for the write budget
+ */
+void
+_dbus_transport_get_io_budgets (DBusTransport *transport,
+                                int           *read_budget_p,
+                                int           *write_budget_p)
+{
+  *read_budget_p = 0;
+  *write_budget_p = 0;
+
+  if (transport->vtable->get_io_budgets != NULL)
+    (* transport->vtable->get_io_budgets) (transport, read_budget_p,
+                                           write_budget_p);
+}
+
+/**
+ * See dbus_connection_set_edge_triggered_watches().
+ *
+ * @param transport the transport
+ * @param enabled #TRUE for edge-triggered watches
+ */
+void
+_dbus_transport_set_edge_triggered_watches (DBusTransport *transport,
+                                            dbus_bool_t    enabled)
+{
+  enabled = enabled != FALSE;
+
+  if (transport->edge_triggered_watches == enabled)
+    return;
+
+  transport->edge_triggered_watches = enabled;
+
+  if (transport->vtable->watch_mode_changed != NULL)
+    (* transport->vtable->watch_mode_changed) (transport);
+}
+
+/**
+ * See dbus_connection_get_edge_triggered_watches().
+ *
+ * @param transport the transport
+ * @returns #TRUE for edge-triggered watches
+ */
+dbus_bool_t
+_dbus_transport_get_edge_triggered_watches (DBusTransport *transport)
+{
+  return transport->edge_triggered_watches;
+}
+
 /**
  * See dbus_connection_get_max_message_size().
  *
@@ -1263,6 +1752,20 @@ _dbus_transport_get_max_received_size (DBusTransport  *transport)
   return transport->max_live_messages_size;
 }
 
+/**
+ * Gets the number of bytes held by messages that have been read
+ * from the transport and not yet finalized, the figure that is
+ * checked against the max received size.
+ *
+ * @param transport the transport
+ * @returns bytes in live messages
+ */
+long
+_dbus_transport_get_live_messages_size (DBusTransport  *transport)
+{
+  return _dbus_counter_get_size_value (transport->live_messages);
+}
+
 /**
  * See dbus_connection_set_max_received_unix_fds().
  *
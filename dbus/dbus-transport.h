@@ -27,6 +27,7 @@
 #include <dbus/dbus-connection.h>
 #include <dbus/dbus-protocol.h>
 #include <dbus/dbus-address.h>
+#include <dbus/dbus-message-internal.h>
 
 DBUS_BEGIN_DECLS
 
@@ -43,6 +44,7 @@ dbus_bool_t        _dbus_transport_get_is_anonymous       (DBusTransport
 dbus_bool_t        _dbus_transport_can_pass_unix_fd       (DBusTransport              *transport);
 
 const char*        _dbus_transport_get_address            (DBusTransport              *transport);
+dbus_uint32_t      _dbus_transport_get_flight_id          (DBusTransport              *transport);
 const char*        _dbus_transport_get_server_id          (DBusTransport              *transport);
 dbus_bool_t        _dbus_transport_handle_watch           (DBusTransport              *transport,
                                                            DBusWatch                  *watch,
@@ -61,6 +63,7 @@ long               _dbus_transport_get_max_message_size   (DBusTransport
 void               _dbus_transport_set_max_received_size  (DBusTransport              *transport,
                                                            long                        size);
 long               _dbus_transport_get_max_received_size  (DBusTransport              *transport);
+long               _dbus_transport_get_live_messages_size (DBusTransport              *transport);
 
 void               _dbus_transport_set_max_message_unix_fds (DBusTransport              *transport,
                                                              long                        n);
@@ -68,6 +71,26 @@ long               _dbus_transport_get_max_message_unix_fds (DBusTransport
 void               _dbus_transport_set_max_received_unix_fds(DBusTransport              *transport,
                                                              long                        n);
 long               _dbus_transport_get_max_received_unix_fds(DBusTransport              *transport);
+void               _dbus_transport_set_trust_peer_messages (DBusTransport              *transport,
+                                                            dbus_bool_t                 value);
+void               _dbus_transport_set_body_check_function (DBusTransport             *transport,
+                                                            long                       min_size,
+                                                            DBusBodyCheckFunction      function,
+                                                            void                      *data);
+void               _dbus_transport_body_check_done        (DBusTransport              *transport,
+                                                           DBusBodyCheck              *check);
+void               _dbus_transport_set_read_paused        (DBusTransport              *transport,
+                                                           dbus_bool_t                 paused);
+void               _dbus_transport_trim                   (DBusTransport              *transport);
+void               _dbus_transport_get_io_budgets         (DBusTransport              *transport,
+                                                           int                        *read_budget_p,
+                                                           int                        *write_budget_p);
+void               _dbus_transport_set_compression_possible (DBusTransport            *transport);
+DBusTransport*     _dbus_transport_open_channel           (DBusTransport              *transport,
+                                                           DBusError                  *error);
+void               _dbus_transport_set_edge_triggered_watches (DBusTransport          *transport,
+                                                               dbus_bool_t             enabled);
+dbus_bool_t        _dbus_transport_get_edge_triggered_watches (DBusTransport          *transport);
 
 dbus_bool_t        _dbus_transport_get_socket_fd          (DBusTransport              *transport,
                                                            int                        *fd_p);
@@ -45,7 +45,6 @@ _dbus_is_console_user (dbus_uid_t uid,
 		       DBusError *error)
 {
 
-  DBusUserDatabase *db;
   const DBusUserInfo *info;
   dbus_bool_t result = FALSE; 
 
@@ -77,25 +76,11 @@ _dbus_is_console_user (dbus_uid_t uid,
 
 #endif /* HAVE_CONSOLE_OWNER_FILE */
 
-  _dbus_user_database_lock_system ();
-
-  db = _dbus_user_database_get_system ();
-  if (db == NULL)
-    {
-      dbus_set_error (error, DBUS_ERROR_FAILED, "Could not get system database.");
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
-
   /* TPTD: this should be cache-safe, we've locked the DB and
     _dbus_user_at_console doesn't pass it on. */
-  info = _dbus_user_database_lookup (db, uid, NULL, error);
-
+  info = _dbus_user_database_lock_system_user (uid, NULL, error);
   if (info == NULL)
-    {
-      _dbus_user_database_unlock_system ();
-       return FALSE;
-    }
+    return FALSE;
 
   result = _dbus_user_at_console (info->username, error);
 
@@ -166,23 +151,11 @@ _dbus_get_user_id_and_primary_group (const DBusString  *username,
                                      dbus_uid_t        *uid_p,
                                      dbus_gid_t        *gid_p)
 {
-  DBusUserDatabase *db;
   const DBusUserInfo *info;
-  _dbus_user_database_lock_system ();
 
-  db = _dbus_user_database_get_system ();
-  if (db == NULL)
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
-
-  if (!_dbus_user_database_get_username (db, username,
-                                         &info, NULL))
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
+  info = _dbus_user_database_lock_system_user (DBUS_UID_UNSET, username, NULL);
+  if (info == NULL)
+    return FALSE;
 
   if (uid_p)
     *uid_p = info->uid;
@@ -356,26 +329,13 @@ _dbus_groups_from_uid (dbus_uid_t         uid,
                        dbus_gid_t       **group_ids,
                        int               *n_group_ids)
 {
-  DBusUserDatabase *db;
   const DBusUserInfo *info;
   *group_ids = NULL;
   *n_group_ids = 0;
 
-  _dbus_user_database_lock_system ();
-
-  db = _dbus_user_database_get_system ();
-  if (db == NULL)
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
-
-  if (!_dbus_user_database_get_uid (db, uid,
-                                    &info, NULL))
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
+  info = _dbus_user_database_lock_system_user (uid, NULL, NULL);
+  if (info == NULL)
+    return FALSE;
 
   _dbus_assert (info->uid == uid);
   
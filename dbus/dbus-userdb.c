@@ -112,41 +112,28 @@ _dbus_is_a_number (const DBusString *str,
     return FALSE;
 }
 
-/**
- * Looks up a uid or username in the user database.  Only one of name
- * or UID can be provided. There are wrapper functions for this that
- * are better to use, this one does no locking or anything on the
- * database and otherwise sort of sucks.
- *
- * @param db the database
- * @param uid the user ID or #DBUS_UID_UNSET
- * @param username username or #NULL 
- * @param error error to fill in
- * @returns the entry in the database
+/* Returns the cached entry, if any; uid is set if username is
+ * really a number
  */
-DBusUserInfo*
-_dbus_user_database_lookup (DBusUserDatabase *db,
-                            dbus_uid_t        uid,
-                            const DBusString *username,
-                            DBusError        *error)
+static DBusUserInfo *
+database_find_user (DBusUserDatabase *db,
+                    dbus_uid_t       *uid,
+                    const DBusString *username)
 {
   DBusUserInfo *info;
 
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-  _dbus_assert (uid != DBUS_UID_UNSET || username != NULL);
-
   /* See if the username is really a number */
-  if (uid == DBUS_UID_UNSET)
+  if (*uid == DBUS_UID_UNSET)
     {
       unsigned long n;
 
       if (_dbus_is_a_number (username, &n))
-        uid = n;
+        *uid = n;
     }
 
 #ifdef DBUS_ENABLE_USERDB_CACHE  
-  if (uid != DBUS_UID_UNSET)
-    info = _dbus_hash_table_lookup_uintptr (db->users, uid);
+  if (*uid != DBUS_UID_UNSET)
+    info = _dbus_hash_table_lookup_uintptr (db->users, *uid);
   else
     info = _dbus_hash_table_lookup_string (db->users_by_name, _dbus_string_get_const_data (username));
 
@@ -156,82 +143,162 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
                      info->uid);
       return info;
     }
-  else
-#else 
-  if (1)
+#else
+  info = NULL;
 #endif
-    {
-      if (uid != DBUS_UID_UNSET)
-	_dbus_verbose ("No cache for UID "DBUS_UID_FORMAT"\n",
-		       uid);
-      else
-	_dbus_verbose ("No cache for user \"%s\"\n",
-		       _dbus_string_get_const_data (username));
-      
-      info = dbus_new0 (DBusUserInfo, 1);
-      if (info == NULL)
-        {
-          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
-          return NULL;
-        }
 
-      if (uid != DBUS_UID_UNSET)
-        {
-          if (!_dbus_user_info_fill_uid (info, uid, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_user_info_free_allocated (info);
-              return NULL;
-            }
-        }
-      else
-        {
-          if (!_dbus_user_info_fill (info, username, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_user_info_free_allocated (info);
-              return NULL;
-            }
-        }
+  if (*uid != DBUS_UID_UNSET)
+    _dbus_verbose ("No cache for UID "DBUS_UID_FORMAT"\n",
+                   *uid);
+  else
+    _dbus_verbose ("No cache for user \"%s\"\n",
+                   _dbus_string_get_const_data (username));
 
-      /* be sure we don't use these after here */
-      uid = DBUS_UID_UNSET;
-      username = NULL;
+  return info;
+}
+
+/* Asks the system; touches no database, so needs no lock */
+static DBusUserInfo *
+fill_user_info (dbus_uid_t        uid,
+                const DBusString *username,
+                DBusError        *error)
+{
+  DBusUserInfo *info;
 
-      /* insert into hash */
-      if (!_dbus_hash_table_insert_uintptr (db->users, info->uid, info))
+  info = dbus_new0 (DBusUserInfo, 1);
+  if (info == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return NULL;
+    }
+
+  if (uid != DBUS_UID_UNSET)
+    {
+      if (!_dbus_user_info_fill_uid (info, uid, error))
         {
-          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          _DBUS_ASSERT_ERROR_IS_SET (error);
           _dbus_user_info_free_allocated (info);
           return NULL;
         }
-
-      if (!_dbus_hash_table_insert_string (db->users_by_name,
-                                           info->username,
-                                           info))
+    }
+  else
+    {
+      if (!_dbus_user_info_fill (info, username, error))
         {
-          _dbus_hash_table_remove_uintptr (db->users, info->uid);
-          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          _dbus_user_info_free_allocated (info);
           return NULL;
         }
-      
-      return info;
     }
+
+  return info;
+}
+
+/* Takes ownership of info. If another thread added the same user
+ * while info was being filled in without the lock, info is dropped
+ * and their entry returned.
+ */
+static DBusUserInfo *
+database_add_user (DBusUserDatabase *db,
+                   DBusUserInfo     *info,
+                   DBusError        *error)
+{
+#ifdef DBUS_ENABLE_USERDB_CACHE
+  DBusUserInfo *existing;
+
+  existing = _dbus_hash_table_lookup_uintptr (db->users, info->uid);
+  if (existing != NULL)
+    {
+      _dbus_user_info_free_allocated (info);
+      return existing;
+    }
+#endif
+
+  /* insert into hash */
+  if (!_dbus_hash_table_insert_uintptr (db->users, info->uid, info))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      _dbus_user_info_free_allocated (info);
+      return NULL;
+    }
+
+  if (!_dbus_hash_table_insert_string (db->users_by_name,
+                                       info->username,
+                                       info))
+    {
+      _dbus_hash_table_remove_uintptr (db->users, info->uid);
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return NULL;
+    }
+
+  return info;
+}
+
+/**
+ * Looks up a uid or username in the user database.  Only one of name
+ * or UID can be provided. There are wrapper functions for this that
+ * are better to use, this one does no locking or anything on the
+ * database and otherwise sort of sucks.
+ *
+ * @param db the database
+ * @param uid the user ID or #DBUS_UID_UNSET
+ * @param username username or #NULL 
+ * @param error error to fill in
+ * @returns the entry in the database
+ */
+DBusUserInfo*
+_dbus_user_database_lookup (DBusUserDatabase *db,
+                            dbus_uid_t        uid,
+                            const DBusString *username,
+                            DBusError        *error)
+{
+  DBusUserInfo *info;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_assert (uid != DBUS_UID_UNSET || username != NULL);
+
+  info = database_find_user (db, &uid, username);
+  if (info != NULL)
+    return info;
+
+  info = fill_user_info (uid, username, error);
+  if (info == NULL)
+    return NULL;
+
+  return database_add_user (db, info, error);
 }
 
 static dbus_bool_t database_locked = FALSE;
 static DBusUserDatabase *system_db = NULL;
-static DBusString process_username;
-static DBusString process_homedir;
-      
+
+/* Who the process runs as doesn't change, so it's looked up once and
+ * then read without taking the system_users lock.
+ */
+typedef struct
+{
+  DBusString username;
+  DBusString homedir;
+} ProcessIdentity;
+
+static ProcessIdentity * volatile process_identity = NULL;
+
 static void
 shutdown_system_db (void *data)
 {
   if (system_db != NULL)
     _dbus_user_database_unref (system_db);
   system_db = NULL;
-  _dbus_string_free (&process_username);
-  _dbus_string_free (&process_homedir);
+}
+
+static void
+shutdown_process_identity (void *data)
+{
+  ProcessIdentity *identity = process_identity;
+
+  process_identity = NULL;
+  _dbus_string_free (&identity->username);
+  _dbus_string_free (&identity->homedir);
+  dbus_free (identity);
 }
 
 static dbus_bool_t
@@ -241,66 +308,88 @@ init_system_db (void)
     
   if (system_db == NULL)
     {
-      DBusError error = DBUS_ERROR_INIT;
-      const DBusUserInfo *info;
-      
       system_db = _dbus_user_database_new ();
       if (system_db == NULL)
         return FALSE;
 
-      if (!_dbus_user_database_get_uid (system_db,
-                                        _dbus_getuid (),
-                                        &info,
-                                        &error))
-        {
-          _dbus_user_database_unref (system_db);
-          system_db = NULL;
-          
-          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
-            {
-              dbus_error_free (&error);
-              return FALSE;
-            }
-          else
-            {
-              /* This really should not happen. */
-              _dbus_warn ("Could not get password database information for UID of current process: %s\n",
-                          error.message);
-              dbus_error_free (&error);
-              return FALSE;
-            }
-        }
-
-      if (!_dbus_string_init (&process_username))
+      if (!_dbus_register_shutdown_func (shutdown_system_db, NULL))
         {
           _dbus_user_database_unref (system_db);
           system_db = NULL;
           return FALSE;
         }
+    }
 
-      if (!_dbus_string_init (&process_homedir))
-        {
-          _dbus_string_free (&process_username);
-          _dbus_user_database_unref (system_db);
-          system_db = NULL;
-          return FALSE;
-        }
+  return TRUE;
+}
 
-      if (!_dbus_string_append (&process_username,
-                                info->username) ||
-          !_dbus_string_append (&process_homedir,
-                                info->homedir) ||
-          !_dbus_register_shutdown_func (shutdown_system_db, NULL))
+static ProcessIdentity *
+get_process_identity (void)
+{
+  ProcessIdentity *identity;
+  DBusError error = DBUS_ERROR_INIT;
+  const DBusUserInfo *info;
+
+  identity = _dbus_atomic_pointer_get ((void * volatile *) &process_identity);
+  if (identity != NULL)
+    return identity;
+
+  /* Only the first callers get here; the lock keeps them from all
+   * asking the system at once, and the entry is cached for anyone
+   * looking up the same user later.
+   */
+  info = _dbus_user_database_lock_system_user (_dbus_getuid (), NULL, &error);
+  if (info == NULL)
+    {
+      if (!dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
         {
-          _dbus_string_free (&process_username);
-          _dbus_string_free (&process_homedir);
-          _dbus_user_database_unref (system_db);
-          system_db = NULL;
-          return FALSE;
+          /* This really should not happen. */
+          _dbus_warn ("Could not get password database information for UID of current process: %s\n",
+                      error.message);
         }
+      dbus_error_free (&error);
+      return NULL;
     }
 
-  return TRUE;
+  identity = process_identity;
+  if (identity != NULL)
+    goto out;
+
+  identity = dbus_new (ProcessIdentity, 1);
+  if (identity == NULL)
+    goto out;
+
+  if (!_dbus_string_init (&identity->username))
+    {
+      dbus_free (identity);
+      identity = NULL;
+      goto out;
+    }
+
+  if (!_dbus_string_init (&identity->homedir))
+    {
+      _dbus_string_free (&identity->username);
+      dbus_free (identity);
+      identity = NULL;
+      goto out;
+    }
+
+  if (!_dbus_string_append (&identity->username, info->username) ||
+      !_dbus_string_append (&identity->homedir, info->homedir) ||
+      !_dbus_register_shutdown_func (shutdown_process_identity, NULL))
+    {
+      _dbus_string_free (&identity->username);
+      _dbus_string_free (&identity->homedir);
+      dbus_free (identity);
+      identity = NULL;
+      goto out;
+    }
+
+  _dbus_atomic_pointer_set ((void * volatile *) &process_identity, identity);
+
+ out:
+  _dbus_user_database_unlock_system ();
+  return identity;
 }
 
 /**
@@ -339,6 +428,72 @@ _dbus_user_database_get_system (void)
   return system_db;
 }
 
+/**
+ * Looks up a user in the system global user database, and returns
+ * with its lock held. Unlike _dbus_user_database_lookup(), a user
+ * that isn't cached yet is looked up without the lock held, so other
+ * threads aren't stuck behind a slow password database.
+ *
+ * The returned entry is valid until _dbus_user_database_unlock_system();
+ * if #NULL is returned, the lock isn't held.
+ *
+ * @param uid the user ID or #DBUS_UID_UNSET
+ * @param username username or #NULL
+ * @param error error to fill in
+ * @returns the entry, or #NULL with error set
+ */
+const DBusUserInfo*
+_dbus_user_database_lock_system_user (dbus_uid_t        uid,
+                                      const DBusString *username,
+                                      DBusError        *error)
+{
+  DBusUserDatabase *db;
+  DBusUserInfo *info;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_assert (uid != DBUS_UID_UNSET || username != NULL);
+
+  _dbus_user_database_lock_system ();
+
+  db = _dbus_user_database_get_system ();
+  if (db == NULL)
+    goto oom;
+
+  info = database_find_user (db, &uid, username);
+  if (info != NULL)
+    return info;
+
+  _dbus_user_database_unlock_system ();
+
+  info = fill_user_info (uid, username, error);
+  if (info == NULL)
+    return NULL;
+
+  _dbus_user_database_lock_system ();
+
+  /* flushed in the meantime */
+  db = _dbus_user_database_get_system ();
+  if (db == NULL)
+    {
+      _dbus_user_info_free_allocated (info);
+      goto oom;
+    }
+
+  info = database_add_user (db, info, error);
+  if (info == NULL)
+    {
+      _dbus_user_database_unlock_system ();
+      return NULL;
+    }
+
+  return info;
+
+ oom:
+  _dbus_user_database_unlock_system ();
+  dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+  return NULL;
+}
+
 /**
  * Flushes the system global user database;
  */
@@ -363,15 +518,13 @@ _dbus_user_database_flush_system (void)
 dbus_bool_t
 _dbus_username_from_current_process (const DBusString **username)
 {
-  _dbus_user_database_lock_system ();
-  if (!init_system_db ())
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
-  *username = &process_username;
-  _dbus_user_database_unlock_system ();  
+  ProcessIdentity *identity;
 
+  identity = get_process_identity ();
+  if (identity == NULL)
+    return FALSE;
+
+  *username = &identity->username;
   return TRUE;
 }
 
@@ -385,15 +538,13 @@ _dbus_username_from_current_process (const DBusString **username)
 dbus_bool_t
 _dbus_homedir_from_current_process (const DBusString  **homedir)
 {
-  _dbus_user_database_lock_system ();
-  if (!init_system_db ())
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
-  *homedir = &process_homedir;
-  _dbus_user_database_unlock_system ();
+  ProcessIdentity *identity;
 
+  identity = get_process_identity ();
+  if (identity == NULL)
+    return FALSE;
+
+  *homedir = &identity->homedir;
   return TRUE;
 }
 
@@ -408,32 +559,18 @@ dbus_bool_t
 _dbus_homedir_from_username (const DBusString *username,
                              DBusString       *homedir)
 {
-  DBusUserDatabase *db;
   const DBusUserInfo *info;
-  _dbus_user_database_lock_system ();
+  dbus_bool_t retval;
 
-  db = _dbus_user_database_get_system ();
-  if (db == NULL)
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
+  info = _dbus_user_database_lock_system_user (DBUS_UID_UNSET, username,
+                                               NULL);
+  if (info == NULL)
+    return FALSE;
 
-  if (!_dbus_user_database_get_username (db, username,
-                                         &info, NULL))
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
+  retval = _dbus_string_append (homedir, info->homedir);
 
-  if (!_dbus_string_append (homedir, info->homedir))
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
-  
   _dbus_user_database_unlock_system ();
-  return TRUE;
+  return retval;
 }
 
 /**
@@ -447,32 +584,17 @@ dbus_bool_t
 _dbus_homedir_from_uid (dbus_uid_t         uid,
                         DBusString        *homedir)
 {
-  DBusUserDatabase *db;
   const DBusUserInfo *info;
-  _dbus_user_database_lock_system ();
+  dbus_bool_t retval;
 
-  db = _dbus_user_database_get_system ();
-  if (db == NULL)
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
+  info = _dbus_user_database_lock_system_user (uid, NULL, NULL);
+  if (info == NULL)
+    return FALSE;
 
-  if (!_dbus_user_database_get_uid (db, uid,
-                                    &info, NULL))
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
+  retval = _dbus_string_append (homedir, info->homedir);
 
-  if (!_dbus_string_append (homedir, info->homedir))
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
-  
   _dbus_user_database_unlock_system ();
-  return TRUE;
+  return retval;
 }
 
 /**
@@ -493,33 +615,18 @@ dbus_bool_t
 _dbus_credentials_add_from_user (DBusCredentials  *credentials,
                                  const DBusString *username)
 {
-  DBusUserDatabase *db;
   const DBusUserInfo *info;
+  dbus_uid_t uid;
 
-  _dbus_user_database_lock_system ();
-
-  db = _dbus_user_database_get_system ();
-  if (db == NULL)
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
-
-  if (!_dbus_user_database_get_username (db, username,
-                                         &info, NULL))
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
+  info = _dbus_user_database_lock_system_user (DBUS_UID_UNSET, username,
+                                               NULL);
+  if (info == NULL)
+    return FALSE;
 
-  if (!_dbus_credentials_add_unix_uid(credentials, info->uid))
-    {
-      _dbus_user_database_unlock_system ();
-      return FALSE;
-    }
-  
+  uid = info->uid;
   _dbus_user_database_unlock_system ();
-  return TRUE;
+
+  return _dbus_credentials_add_unix_uid (credentials, uid);
 }
 
 /**
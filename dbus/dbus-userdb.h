@@ -86,6 +86,9 @@ void           _dbus_group_info_free_allocated  (DBusGroupInfo    *info);
 #endif /* DBUS_USERDB_INCLUDES_PRIVATE */
 
 DBusUserDatabase* _dbus_user_database_get_system    (void);
+const DBusUserInfo* _dbus_user_database_lock_system_user (dbus_uid_t        uid,
+                                                          const DBusString *username,
+                                                          DBusError        *error);
 void              _dbus_user_database_lock_system   (void);
 void              _dbus_user_database_unlock_system (void);
 void              _dbus_user_database_flush_system  (void);
@@ -436,6 +436,33 @@ _dbus_watch_list_toggle_watch (DBusWatchList           *watch_list,
     }
 }
 
+/**
+ * Invokes the application's DBusWatchToggledFunction for an enabled
+ * watch whose enabled state has not changed. This is how
+ * edge-triggered watches ask to be re-armed: the watch's owner may
+ * have consumed the last readiness edge without using it up, so the
+ * main loop should look at the fd again.
+ *
+ * @param watch_list the watch list.
+ * @param watch the watch to re-arm.
+ */
+void
+_dbus_watch_list_rearm_watch (DBusWatchList *watch_list,
+                              DBusWatch     *watch)
+{
+  if (!watch->enabled)
+    return;
+
+  if (watch_list->watch_toggled_function != NULL)
+    {
+      _dbus_verbose ("Re-arming watch %p on fd %d\n",
+                     watch, dbus_watch_get_socket (watch));
+
+      (* watch_list->watch_toggled_function) (watch,
+                                              watch_list->watch_data);
+    }
+}
+
 /**
  * Sets the handler for the watch.
  *
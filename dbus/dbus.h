@@ -30,11 +30,13 @@
 #include <dbus/dbus-address.h>
 #include <dbus/dbus-bus.h>
 #include <dbus/dbus-connection.h>
+#include <dbus/dbus-connection-pool.h>
 #include <dbus/dbus-errors.h>
 #include <dbus/dbus-macros.h>
 #include <dbus/dbus-message.h>
 #include <dbus/dbus-misc.h>
 #include <dbus/dbus-pending-call.h>
+#include <dbus/dbus-property-cache.h>
 #include <dbus/dbus-protocol.h>
 #include <dbus/dbus-server.h>
 #include <dbus/dbus-shared.h>
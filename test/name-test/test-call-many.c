@@ -0,0 +1,324 @@
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-internals.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define RESPONDER_NAME "org.freedesktop.DBus.TestSuite.CallMany"
+#define RESPONDER_PATH "/org/freedesktop/TestSuite"
+#define RESPONDER_INTERFACE "org.freedesktop.TestSuite.CallMany"
+#define NO_SUCH_NAME "org.freedesktop.DBus.TestSuite.CallMany.NoSuchName"
+
+#define N_CALLS 5
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "*** test-call-many: %s", message);
+  exit (1);
+}
+
+static DBusConnection *
+open_private (void)
+{
+  DBusError error;
+  DBusConnection *connection;
+
+  dbus_error_init (&error);
+  connection = dbus_bus_get_private (DBUS_BUS_SESSION, &error);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "*** Failed to open connection to session bus: %s\n",
+               error.message);
+      exit (1);
+    }
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+
+  return connection;
+}
+
+/* Answers the two Echo calls in the opposite order to the one they
+ * came in, never answers Ignore, and exits on Quit
+ */
+static void
+run_responder (void)
+{
+  DBusConnection *connection;
+  DBusMessage *message;
+  DBusMessage *echoes[2];
+  DBusMessage *reply;
+  int n_echoes;
+  int i;
+
+  connection = open_private ();
+  if (dbus_bus_request_name (connection, RESPONDER_NAME, 0, NULL) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    die ("Responder couldn't get its name\n");
+
+  n_echoes = 0;
+  while (dbus_connection_read_write (connection, -1))
+    {
+      while ((message = dbus_connection_pop_message (connection)) != NULL)
+        {
+          if (dbus_message_is_method_call (message, RESPONDER_INTERFACE, "Echo"))
+            {
+              if (n_echoes == 2)
+                die ("Responder got more than two Echo calls\n");
+              echoes[n_echoes++] = message;
+
+              if (n_echoes == 2)
+                {
+                  for (i = 1; i >= 0; i--)
+                    {
+                      const char *s;
+
+                      if (!dbus_message_get_args (echoes[i], NULL,
+                                                  DBUS_TYPE_STRING, &s,
+                                                  DBUS_TYPE_INVALID))
+                        die ("Echo call without a string\n");
+
+                      reply = dbus_message_new_method_return (echoes[i]);
+                      if (reply == NULL ||
+                          !dbus_message_append_args (reply,
+                                                     DBUS_TYPE_STRING, &s,
+                                                     DBUS_TYPE_INVALID) ||
+                          !dbus_connection_send (connection, reply, NULL))
+                        die ("No memory\n");
+                      dbus_message_unref (reply);
+                      dbus_message_unref (echoes[i]);
+                    }
+                }
+              continue;
+            }
+
+          if (dbus_message_is_method_call (message, RESPONDER_INTERFACE, "Quit"))
+            {
+              dbus_message_unref (message);
+              dbus_connection_close (connection);
+              dbus_connection_unref (connection);
+              exit (0);
+            }
+
+          dbus_message_unref (message);
+        }
+    }
+
+  die ("Responder disconnected before Quit\n");
+}
+
+static DBusMessage *
+new_call (const char *destination,
+          const char *path,
+          const char *interface,
+          const char *method,
+          const char *arg)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_method_call (destination, path, interface,
+                                          method);
+  if (message == NULL)
+    die ("No memory\n");
+
+  if (arg != NULL &&
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &arg,
+                                 DBUS_TYPE_INVALID))
+    die ("No memory\n");
+
+  return message;
+}
+
+static void
+check_string_reply (DBusMessage *reply,
+                    const char  *expected)
+{
+  DBusError error;
+  const char *s;
+
+  dbus_error_init (&error);
+  if (dbus_set_error_from_message (&error, reply))
+    {
+      fprintf (stderr, "*** Expected \"%s\", got error %s: %s\n",
+               expected, error.name, error.message);
+      exit (1);
+    }
+
+  if (!dbus_message_get_args (reply, &error,
+                              DBUS_TYPE_STRING, &s,
+                              DBUS_TYPE_INVALID))
+    die ("Reply without a string\n");
+
+  if (strcmp (s, expected) != 0)
+    {
+      fprintf (stderr, "*** Expected \"%s\", got \"%s\"\n", expected, s);
+      exit (1);
+    }
+}
+
+static void
+check_error_reply (DBusMessage *reply,
+                   const char  *expected)
+{
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_ERROR ||
+      !dbus_message_is_error (reply, expected))
+    {
+      fprintf (stderr, "*** Expected error %s, got %s\n", expected,
+               dbus_message_type_to_string (dbus_message_get_type (reply)));
+      exit (1);
+    }
+}
+
+static void
+wait_for_responder (DBusConnection *connection)
+{
+  int i;
+
+  for (i = 0; i < 100; i++)
+    {
+      if (dbus_bus_name_has_owner (connection, RESPONDER_NAME, NULL))
+        return;
+      usleep (50000);
+    }
+
+  die ("Responder never showed up\n");
+}
+
+static void
+test_replies (DBusConnection *connection)
+{
+  DBusError error;
+  DBusMessage *messages[N_CALLS];
+  DBusMessage *replies[N_CALLS];
+  int i;
+
+  /* Replies from two peers, in a different order to the calls, an
+   * error from the bus and a call nobody answers
+   */
+  messages[0] = new_call (RESPONDER_NAME, RESPONDER_PATH, RESPONDER_INTERFACE,
+                          "Echo", "first");
+  messages[1] = new_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                          "GetNameOwner", NO_SUCH_NAME);
+  messages[2] = new_call (RESPONDER_NAME, RESPONDER_PATH, RESPONDER_INTERFACE,
+                          "Ignore", NULL);
+  messages[3] = new_call (RESPONDER_NAME, RESPONDER_PATH, RESPONDER_INTERFACE,
+                          "Echo", "second");
+  messages[4] = new_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                          "GetNameOwner", DBUS_SERVICE_DBUS);
+
+  dbus_error_init (&error);
+  if (!dbus_connection_call_many_and_block (connection, messages, N_CALLS,
+                                            1000, replies, &error))
+    {
+      fprintf (stderr, "*** dbus_connection_call_many_and_block failed: %s\n",
+               error.message);
+      exit (1);
+    }
+
+  for (i = 0; i < N_CALLS; i++)
+    {
+      if (replies[i] == NULL)
+        die ("Call without a reply\n");
+      if (dbus_message_get_reply_serial (replies[i]) !=
+          dbus_message_get_serial (messages[i]))
+        die ("Reply matched to the wrong call\n");
+    }
+
+  check_string_reply (replies[0], "first");
+  check_error_reply (replies[1], DBUS_ERROR_NAME_HAS_NO_OWNER);
+  check_error_reply (replies[2], DBUS_ERROR_NO_REPLY);
+  check_string_reply (replies[3], "second");
+  check_string_reply (replies[4], DBUS_SERVICE_DBUS);
+
+  for (i = 0; i < N_CALLS; i++)
+    {
+      dbus_message_unref (messages[i]);
+      dbus_message_unref (replies[i]);
+    }
+
+  /* nothing to do is not an error */
+  if (!dbus_connection_call_many_and_block (connection, NULL, 0, -1, NULL,
+                                            &error))
+    die ("Empty batch of calls failed\n");
+}
+
+static void
+test_disconnected (void)
+{
+  DBusError error;
+  DBusConnection *connection;
+  DBusMessage *message;
+  DBusMessage *reply;
+
+  connection = open_private ();
+  dbus_connection_close (connection);
+
+  message = new_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                      "GetId", NULL);
+
+  dbus_error_init (&error);
+  reply = NULL;
+  if (dbus_connection_call_many_and_block (connection, &message, 1, -1,
+                                           &reply, &error))
+    die ("Calls sent on a closed connection\n");
+  if (!dbus_error_has_name (&error, DBUS_ERROR_DISCONNECTED))
+    {
+      fprintf (stderr, "*** Expected %s, got %s\n",
+               DBUS_ERROR_DISCONNECTED, error.name);
+      exit (1);
+    }
+  if (reply != NULL)
+    die ("Reply returned for calls that weren't sent\n");
+
+  dbus_error_free (&error);
+  dbus_message_unref (message);
+  dbus_connection_unref (connection);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  DBusConnection *connection;
+  DBusMessage *message;
+  pid_t pid;
+  int status;
+
+  pid = fork ();
+  if (pid < 0)
+    die ("fork failed\n");
+  if (pid == 0)
+    run_responder ();
+
+  connection = open_private ();
+  wait_for_responder (connection);
+
+  test_replies (connection);
+  test_disconnected ();
+
+  message = new_call (RESPONDER_NAME, RESPONDER_PATH, RESPONDER_INTERFACE,
+                      "Quit", NULL);
+  dbus_message_set_no_reply (message, TRUE);
+  if (!dbus_connection_send (connection, message, NULL))
+    die ("No memory\n");
+  dbus_message_unref (message);
+  dbus_connection_flush (connection);
+
+  if (waitpid (pid, &status, 0) != pid ||
+      !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    die ("Responder failed\n");
+
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+  dbus_shutdown ();
+
+  _dbus_verbose ("*** Test call many exiting\n");
+
+  return 0;
+}
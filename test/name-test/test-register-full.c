@@ -0,0 +1,222 @@
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-internals.h>
+
+#define NAME_A "org.freedesktop.DBus.TestSuite.RegisterFull.A"
+#define NAME_B "org.freedesktop.DBus.TestSuite.RegisterFull.B"
+#define RULE "type='signal',interface='org.freedesktop.DBus.TestSuite.RegisterFull'"
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "*** test-register-full: %s", message);
+  exit (1);
+}
+
+/* A connection that has not said Hello yet */
+static DBusConnection *
+open_unregistered (void)
+{
+  DBusError error;
+  DBusConnection *connection;
+  const char *address;
+
+  address = getenv ("DBUS_SESSION_BUS_ADDRESS");
+  if (address == NULL)
+    die ("DBUS_SESSION_BUS_ADDRESS not set\n");
+
+  dbus_error_init (&error);
+  connection = dbus_connection_open_private (address, &error);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "*** Failed to open connection to session bus: %s\n",
+               error.message);
+      exit (1);
+    }
+
+  return connection;
+}
+
+static void
+close_connection (DBusConnection *connection)
+{
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+}
+
+/* Sends a signal matching RULE from sender and checks whether receiver
+ * gets it, which tells us whether RULE was added on receiver.
+ */
+static dbus_bool_t
+rule_is_active (DBusConnection *sender,
+                DBusConnection *receiver)
+{
+  DBusMessage *message;
+  dbus_bool_t found;
+  int i;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestSuite",
+                                     "org.freedesktop.DBus.TestSuite.RegisterFull",
+                                     "Ping");
+  if (message == NULL || !dbus_connection_send (sender, message, NULL))
+    die ("No memory\n");
+  dbus_message_unref (message);
+  dbus_connection_flush (sender);
+
+  /* round trip to the bus so the signal has been routed when it returns */
+  dbus_bus_name_has_owner (receiver, NAME_A, NULL);
+
+  found = FALSE;
+  for (i = 0; i < 10 && !found; i++)
+    {
+      dbus_connection_read_write (receiver, 100);
+
+      while ((message = dbus_connection_pop_message (receiver)) != NULL)
+        {
+          if (dbus_message_is_signal (message,
+                                      "org.freedesktop.DBus.TestSuite.RegisterFull",
+                                      "Ping"))
+            found = TRUE;
+          dbus_message_unref (message);
+        }
+    }
+
+  return found;
+}
+
+static void
+test_success (void)
+{
+  DBusError error;
+  DBusConnection *connection, *other;
+  const char *rules[] = { RULE, NULL };
+  const char *names[] = { NAME_A, NAME_B, NULL };
+  const char *other_names[] = { NAME_A, NULL };
+  const char *unique_name;
+  int results[2];
+  int other_results[1];
+
+  dbus_error_init (&error);
+  connection = open_unregistered ();
+
+  results[0] = results[1] = -1;
+  if (!dbus_bus_register_full (connection, rules, names, 0, results, &error))
+    {
+      fprintf (stderr, "*** dbus_bus_register_full failed: %s\n", error.message);
+      exit (1);
+    }
+
+  unique_name = dbus_bus_get_unique_name (connection);
+  if (unique_name == NULL || unique_name[0] != ':')
+    die ("No unique name after dbus_bus_register_full\n");
+
+  if (results[0] != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER ||
+      results[1] != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    die ("Names not acquired by dbus_bus_register_full\n");
+
+  /* a second connection sees the names taken, and since it is
+   * registered already it gets no new unique name
+   */
+  other = open_unregistered ();
+  if (!dbus_bus_register (other, &error))
+    die ("dbus_bus_register failed\n");
+  unique_name = dbus_bus_get_unique_name (other);
+
+  if (!dbus_bus_register_full (other, NULL, other_names,
+                               DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                               other_results, &error))
+    die ("dbus_bus_register_full failed on a registered connection\n");
+
+  if (strcmp (unique_name, dbus_bus_get_unique_name (other)) != 0)
+    die ("dbus_bus_register_full said Hello a second time\n");
+
+  if (other_results[0] != DBUS_REQUEST_NAME_REPLY_EXISTS)
+    die ("Name owned by the first connection was handed out again\n");
+
+  if (!rule_is_active (other, connection))
+    die ("Match rule not added by dbus_bus_register_full\n");
+
+  /* nothing to do is not an error */
+  if (!dbus_bus_register_full (other, NULL, NULL, 0, NULL, &error))
+    die ("dbus_bus_register_full failed with nothing to do\n");
+
+  close_connection (other);
+  close_connection (connection);
+}
+
+static void
+test_errors (void)
+{
+  DBusError error;
+  DBusConnection *connection;
+  const char *bad_rules[] = { "type='nonsense'", NULL };
+  const char *names[] = { NAME_A, NULL };
+  const char *bus_names[] = { NAME_B, DBUS_SERVICE_DBUS, NULL };
+  int results[2];
+
+  dbus_error_init (&error);
+
+  /* a rejected match rule fails the whole call, though Hello went
+   * through before it
+   */
+  connection = open_unregistered ();
+  if (dbus_bus_register_full (connection, bad_rules, names, 0, NULL, &error))
+    die ("Invalid match rule accepted by dbus_bus_register_full\n");
+  if (!dbus_error_has_name (&error, DBUS_ERROR_MATCH_RULE_INVALID))
+    {
+      fprintf (stderr, "*** Expected %s, got %s\n",
+               DBUS_ERROR_MATCH_RULE_INVALID, error.name);
+      exit (1);
+    }
+  dbus_error_free (&error);
+
+  if (dbus_bus_get_unique_name (connection) == NULL)
+    die ("Hello reply dropped after a later error\n");
+
+  /* a rejected name request after a successful one */
+  if (dbus_bus_register_full (connection, NULL, bus_names, 0, results, &error))
+    die ("Request for the bus name accepted by dbus_bus_register_full\n");
+  if (!dbus_error_has_name (&error, DBUS_ERROR_INVALID_ARGS))
+    {
+      fprintf (stderr, "*** Expected %s, got %s\n",
+               DBUS_ERROR_INVALID_ARGS, error.name);
+      exit (1);
+    }
+  dbus_error_free (&error);
+
+  if (results[0] != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    die ("Result of the name request before the error not stored\n");
+
+  close_connection (connection);
+
+  /* a closed connection */
+  connection = open_unregistered ();
+  dbus_connection_close (connection);
+  if (dbus_bus_register_full (connection, NULL, names, 0, NULL, &error))
+    die ("dbus_bus_register_full succeeded on a closed connection\n");
+  if (!dbus_error_has_name (&error, DBUS_ERROR_DISCONNECTED))
+    {
+      fprintf (stderr, "*** Expected %s, got %s\n",
+               DBUS_ERROR_DISCONNECTED, error.name);
+      exit (1);
+    }
+  dbus_error_free (&error);
+  dbus_connection_unref (connection);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  test_success ();
+  test_errors ();
+
+  dbus_shutdown ();
+
+  _dbus_verbose ("*** Test register full exiting\n");
+
+  return 0;
+}
@@ -0,0 +1,269 @@
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-internals.h>
+
+#define WATCHED_NAME "org.freedesktop.DBus.TestSuite.WatchName"
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "*** test-watch-name: %s", message);
+  exit (1);
+}
+
+static DBusConnection *
+open_private (void)
+{
+  DBusError error;
+  DBusConnection *connection;
+
+  dbus_error_init (&error);
+  connection = dbus_bus_get_private (DBUS_BUS_SESSION, &error);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "*** Failed to open connection to session bus: %s\n",
+               error.message);
+      exit (1);
+    }
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+
+  return connection;
+}
+
+static void
+close_connection (DBusConnection *connection)
+{
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+}
+
+/* Returns whether the cached owner is expected, which may be NULL */
+static dbus_bool_t
+cached_owner_is (DBusConnection *watcher,
+                 const char     *expected)
+{
+  DBusError error;
+  char *owner;
+  dbus_bool_t retval;
+
+  dbus_error_init (&error);
+  owner = dbus_bus_get_cached_name_owner (watcher, WATCHED_NAME, &error);
+  if (dbus_error_is_set (&error))
+    {
+      fprintf (stderr, "*** Failed to get owner: %s\n", error.message);
+      exit (1);
+    }
+
+  if (expected == NULL)
+    retval = owner == NULL;
+  else
+    retval = owner != NULL && strcmp (owner, expected) == 0;
+
+  dbus_free (owner);
+
+  /* both agree */
+  if (retval &&
+      dbus_bus_name_has_owner (watcher, WATCHED_NAME, NULL) != (expected != NULL))
+    die ("dbus_bus_name_has_owner disagrees with the cached owner\n");
+
+  return retval;
+}
+
+/* The cache only changes when NameOwnerChanged is dispatched */
+static void
+dispatch_until_owner_is (DBusConnection *watcher,
+                         const char     *expected)
+{
+  int i;
+
+  for (i = 0; i < 50; i++)
+    {
+      if (cached_owner_is (watcher, expected))
+        return;
+      dbus_connection_read_write_dispatch (watcher, 100);
+    }
+
+  die ("Cached owner not updated by NameOwnerChanged\n");
+}
+
+static void
+request_name (DBusConnection *owner)
+{
+  if (dbus_bus_request_name (owner, WATCHED_NAME, 0, NULL) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    die ("Couldn't get the watched name\n");
+}
+
+static void
+watch_name (DBusConnection *watcher)
+{
+  DBusError error;
+
+  dbus_error_init (&error);
+  if (!dbus_bus_watch_name (watcher, WATCHED_NAME, &error))
+    {
+      fprintf (stderr, "*** Failed to watch name: %s\n", error.message);
+      exit (1);
+    }
+}
+
+static void
+test_updates (void)
+{
+  DBusConnection *watcher, *owner;
+  const char *unique_name;
+
+  watcher = open_private ();
+  owner = open_private ();
+  unique_name = dbus_bus_get_unique_name (owner);
+
+  /* seeded from the bus: nobody owns the name yet */
+  watch_name (watcher);
+  if (!cached_owner_is (watcher, NULL))
+    die ("Unowned name has a cached owner\n");
+
+  /* Until the watcher dispatches, it still answers from its cache,
+   * without asking the bus
+   */
+  request_name (owner);
+  if (!cached_owner_is (watcher, NULL))
+    die ("Cached owner changed without dispatching\n");
+  dispatch_until_owner_is (watcher, unique_name);
+
+  if (dbus_bus_release_name (owner, WATCHED_NAME, NULL) !=
+      DBUS_RELEASE_NAME_REPLY_RELEASED)
+    die ("Couldn't release the watched name\n");
+  dispatch_until_owner_is (watcher, NULL);
+
+  /* calls nest */
+  watch_name (watcher);
+  dbus_bus_unwatch_name (watcher, WATCHED_NAME);
+
+  /* the owner going away releases the name */
+  request_name (owner);
+  dispatch_until_owner_is (watcher, unique_name);
+  close_connection (owner);
+  dispatch_until_owner_is (watcher, NULL);
+
+  /* Once the last watch is undone, the bus is asked each time, so a
+   * new owner shows up without dispatching
+   */
+  dbus_bus_unwatch_name (watcher, WATCHED_NAME);
+  owner = open_private ();
+  request_name (owner);
+  if (!cached_owner_is (watcher, dbus_bus_get_unique_name (owner)))
+    die ("Unwatched name answered from the cache\n");
+
+  close_connection (owner);
+  close_connection (watcher);
+}
+
+static void
+test_disconnect (void)
+{
+  DBusError error;
+  DBusConnection *watcher, *owner;
+  char *cached;
+
+  watcher = open_private ();
+  owner = open_private ();
+
+  request_name (owner);
+  watch_name (watcher);
+  if (!cached_owner_is (watcher, dbus_bus_get_unique_name (owner)))
+    die ("Watched name not seeded with its owner\n");
+
+  /* Once the watcher is disconnected, the cached owner is stale and
+   * must not be returned
+   */
+  dbus_connection_close (watcher);
+
+  dbus_error_init (&error);
+  cached = dbus_bus_get_cached_name_owner (watcher, WATCHED_NAME, &error);
+  if (cached != NULL)
+    die ("Cached owner returned after disconnecting\n");
+  if (!dbus_error_has_name (&error, DBUS_ERROR_DISCONNECTED))
+    {
+      fprintf (stderr, "*** Expected %s, got %s\n",
+               DBUS_ERROR_DISCONNECTED,
+               error.name ? error.name : "no error");
+      exit (1);
+    }
+  dbus_error_free (&error);
+
+  if (dbus_bus_name_has_owner (watcher, WATCHED_NAME, &error))
+    die ("Cached owner used by dbus_bus_name_has_owner after disconnecting\n");
+  if (!dbus_error_is_set (&error))
+    die ("dbus_bus_name_has_owner set no error after disconnecting\n");
+  dbus_error_free (&error);
+
+  dbus_bus_unwatch_name (watcher, WATCHED_NAME);
+
+  dbus_connection_unref (watcher);
+  close_connection (owner);
+}
+
+/* The bus sends one NameOwnerChanged to all its recipients, numbered
+ * by the first connection it goes out on; an observer with a low
+ * serial that gets it before the watcher mustn't make the watcher
+ * think it's older than the GetNameOwner reply
+ */
+static void
+test_low_serial_subscriber (void)
+{
+  DBusError error;
+  DBusConnection *watcher, *observer, *owner;
+  int i;
+
+  watcher = open_private ();
+
+  /* the bus's serials for the watcher run well ahead of the observer's */
+  for (i = 0; i < 100; i++)
+    dbus_bus_name_has_owner (watcher, WATCHED_NAME, NULL);
+
+  /* the bus finds the watcher's arg0 rule before this one, and sends
+   * to the last recipient it found first
+   */
+  observer = open_private ();
+  dbus_error_init (&error);
+  dbus_bus_add_match (observer,
+                      "type='signal',interface='" DBUS_INTERFACE_DBUS "',"
+                      "member='NameOwnerChanged'",
+                      &error);
+  if (dbus_error_is_set (&error))
+    {
+      fprintf (stderr, "*** Failed to add match: %s\n", error.message);
+      exit (1);
+    }
+
+  watch_name (watcher);
+  if (!cached_owner_is (watcher, NULL))
+    die ("Unowned name has a cached owner\n");
+
+  owner = open_private ();
+  request_name (owner);
+  dispatch_until_owner_is (watcher, dbus_bus_get_unique_name (owner));
+
+  dbus_bus_unwatch_name (watcher, WATCHED_NAME);
+  close_connection (owner);
+  close_connection (observer);
+  close_connection (watcher);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  test_updates ();
+  test_disconnect ();
+  test_low_serial_subscriber ();
+
+  dbus_shutdown ();
+
+  _dbus_verbose ("*** Test watch name exiting\n");
+
+  return 0;
+}
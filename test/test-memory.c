@@ -0,0 +1,611 @@
+/* test-memory.c  Measure what the bus holds per connection, rule, name and reply
+ *
+ * Starts a bus on a generated configuration with its limits out of the
+ * way and grows it in steps: first to N connections, then to M match
+ * rules on each of them, K owned names on each and P pending replies
+ * from each, which are calls to the next connection that it never
+ * answers. After every step it reads the resident set size of the bus
+ * from /proc and the Memory<Tag> counters and StateBytes from GetStats.
+ *
+ * Prints one key=value line per step, and one per stage with what each
+ * connection, rule, name or pending reply added, so that a change to
+ * how any of them is stored shows up as a change in its cost.
+ */
+
+#include <config.h>
+
+#include <dbus/dbus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* enough for DBUS_MEMORY_N_TAGS */
+#define MAX_COUNTERS 16
+
+#define TEST_INTERFACE "org.freedesktop.DBus.MemoryTest"
+
+/* The client's own descriptors besides the connections */
+#define SPARE_FDS 16
+
+typedef struct
+{
+  char name[48];
+  long long bytes;
+} Counter;
+
+typedef struct
+{
+  long long rss;          /**< bytes, or -1 if /proc can't tell */
+  long long state_bytes;
+  long long accounted;    /**< sum of the counters */
+  Counter counters[MAX_COUNTERS];
+  int n_counters;
+} Sample;
+
+static const char *address;
+static DBusConnection *control;
+static DBusConnection **connections;
+static long n_connections;
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "*** test-memory: %s\n", message);
+  exit (1);
+}
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr, "Usage: %s [--daemon=PATH] [--connections=N] [--rules=M] [--names=K] [--replies=P] [--steps=S]\n", name);
+  exit (1);
+}
+
+static void
+write_config (const char *dir)
+{
+  char path[1024];
+  FILE *f;
+
+  snprintf (path, sizeof (path), "%s/bus.conf", dir);
+  f = fopen (path, "w");
+  if (f == NULL)
+    die ("can't write the configuration");
+
+  fprintf (f,
+           "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\"\n"
+           " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+           "<busconfig>\n"
+           "  <type>session</type>\n"
+           "  <listen>unix:path=%s/bus.sock</listen>\n"
+           "  <policy context=\"default\">\n"
+           "    <allow send_destination=\"*\" eavesdrop=\"true\"/>\n"
+           "    <allow eavesdrop=\"true\"/>\n"
+           "    <allow own=\"*\"/>\n"
+           "  </policy>\n"
+           "  <limit name=\"max_incoming_bytes\">1000000000</limit>\n"
+           "  <limit name=\"max_outgoing_bytes\">1000000000</limit>\n"
+           "  <limit name=\"max_completed_connections\">1000000</limit>\n"
+           "  <limit name=\"max_connections_per_user\">1000000</limit>\n"
+           "  <limit name=\"max_names_per_connection\">1000000</limit>\n"
+           "  <limit name=\"max_match_rules_per_connection\">1000000</limit>\n"
+           "  <limit name=\"max_replies_per_connection\">1000000</limit>\n"
+           "</busconfig>\n",
+           dir);
+
+  if (fclose (f) != 0)
+    die ("can't write the configuration");
+}
+
+static void
+remove_config (const char *dir)
+{
+  char path[1024];
+
+  snprintf (path, sizeof (path), "%s/bus.conf", dir);
+  unlink (path);
+  /* left behind, since the bus is killed */
+  snprintf (path, sizeof (path), "%s/bus.sock", dir);
+  unlink (path);
+  rmdir (dir);
+}
+
+static pid_t
+start_daemon (const char *daemon,
+              const char *dir)
+{
+  static char address_buf[1024];
+  char config_arg[1024];
+  char address_arg[32];
+  int fds[2];
+  int len = 0;
+  pid_t pid;
+
+  if (pipe (fds) < 0)
+    die ("can't create a pipe");
+
+  pid = fork ();
+  if (pid < 0)
+    die ("can't fork");
+
+  if (pid == 0)
+    {
+      close (fds[0]);
+      snprintf (config_arg, sizeof (config_arg), "--config-file=%s/bus.conf",
+                dir);
+      snprintf (address_arg, sizeof (address_arg), "--print-address=%d",
+                fds[1]);
+      execlp (daemon, daemon, config_arg, address_arg, "--nofork", NULL);
+      _exit (1);
+    }
+
+  close (fds[1]);
+
+  while (len < (int) sizeof (address_buf) - 1)
+    {
+      ssize_t n = read (fds[0], address_buf + len, 1);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0 || address_buf[len] == '\n')
+        break;
+      len += n;
+    }
+
+  address_buf[len] = '\0';
+  close (fds[0]);
+
+  if (len == 0)
+    die ("the bus didn't start");
+
+  address = address_buf;
+
+  return pid;
+}
+
+/* Every connection is a descriptor here as well as in the bus, which
+ * inherits the limit
+ */
+static void
+raise_fd_limit (long n)
+{
+  struct rlimit limit;
+
+  if (getrlimit (RLIMIT_NOFILE, &limit) < 0)
+    die ("can't get the descriptor limit");
+
+  if (limit.rlim_cur != RLIM_INFINITY &&
+      limit.rlim_cur < (rlim_t) (n + SPARE_FDS))
+    {
+      limit.rlim_cur = limit.rlim_max;
+      if (limit.rlim_cur != RLIM_INFINITY &&
+          limit.rlim_cur < (rlim_t) (n + SPARE_FDS))
+        die ("the descriptor limit is too low for that many connections");
+
+      if (setrlimit (RLIMIT_NOFILE, &limit) < 0)
+        die ("can't raise the descriptor limit");
+    }
+}
+
+static DBusConnection *
+open_connection (void)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private (address, &error);
+  if (connection == NULL || !dbus_bus_register (connection, &error))
+    {
+      fprintf (stderr, "*** test-memory: %s\n", error.message);
+      exit (1);
+    }
+
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+
+  return connection;
+}
+
+/* Nothing is dispatched, so calls sit unanswered; popping the queue
+ * also keeps what arrives from piling up in this process
+ */
+static void
+drain (DBusConnection *connection)
+{
+  DBusMessage *message;
+
+  while ((message = dbus_connection_pop_message (connection)) != NULL)
+    dbus_message_unref (message);
+}
+
+/* The bus handles each connection's messages in order, so once a call
+ * comes back everything sent before it has been dealt with.
+ */
+static void
+sync_all (void)
+{
+  DBusError error;
+  long i;
+
+  dbus_error_init (&error);
+
+  for (i = 0; i < n_connections; i++)
+    {
+      char *id = dbus_bus_get_id (connections[i], &error);
+
+      if (id == NULL)
+        {
+          fprintf (stderr, "*** test-memory: %s\n", error.message);
+          exit (1);
+        }
+
+      dbus_free (id);
+      drain (connections[i]);
+    }
+}
+
+static long long
+read_rss (pid_t pid)
+{
+  char path[64];
+  long size, resident;
+  FILE *f;
+  int n;
+
+  snprintf (path, sizeof (path), "/proc/%ld/statm", (long) pid);
+  f = fopen (path, "r");
+  if (f == NULL)
+    return -1;
+
+  n = fscanf (f, "%ld %ld", &size, &resident);
+  fclose (f);
+
+  if (n != 2)
+    return -1;
+
+  return (long long) resident * sysconf (_SC_PAGESIZE);
+}
+
+static void
+take_sample (pid_t   pid,
+             Sample *sample)
+{
+  DBusMessage *message, *reply;
+  DBusMessageIter iter, dict;
+  DBusError error;
+
+  memset (sample, 0, sizeof (Sample));
+  sample->rss = read_rss (pid);
+
+  dbus_error_init (&error);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                          "org.freedesktop.DBus.Debug.Stats",
+                                          "GetStats");
+  if (message == NULL)
+    die ("No memory");
+
+  reply = dbus_connection_send_with_reply_and_block (control, message, -1,
+                                                     &error);
+  dbus_message_unref (message);
+  if (reply == NULL)
+    {
+      fprintf (stderr, "*** test-memory: GetStats: %s\n", error.message);
+      exit (1);
+    }
+
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &dict);
+
+  while (dbus_message_iter_get_arg_type (&dict) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter entry, variant;
+      const char *key;
+      int type;
+
+      dbus_message_iter_recurse (&dict, &entry);
+      dbus_message_iter_get_basic (&entry, &key);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_recurse (&entry, &variant);
+      type = dbus_message_iter_get_arg_type (&variant);
+
+      if (strncmp (key, "Memory", 6) == 0 && type == DBUS_TYPE_UINT64 &&
+          sample->n_counters < MAX_COUNTERS)
+        {
+          dbus_uint64_t value;
+          Counter *counter = &sample->counters[sample->n_counters++];
+
+          dbus_message_iter_get_basic (&variant, &value);
+          snprintf (counter->name, sizeof (counter->name), "%s", key);
+          counter->bytes = value;
+          sample->accounted += value;
+        }
+      else if (strcmp (key, "StateBytes") == 0 && type == DBUS_TYPE_UINT32)
+        {
+          dbus_uint32_t value;
+
+          dbus_message_iter_get_basic (&variant, &value);
+          sample->state_bytes = value;
+        }
+
+      dbus_message_iter_next (&dict);
+    }
+
+  dbus_message_unref (reply);
+}
+
+static void
+print_step (const char   *stage,
+            long          count,
+            const Sample *sample)
+{
+  int i;
+
+  printf ("step stage=%s count=%ld rss_kb=%lld state_bytes=%lld accounted_bytes=%lld",
+          stage, count, sample->rss >= 0 ? sample->rss / 1024 : -1,
+          sample->state_bytes, sample->accounted);
+
+  for (i = 0; i < sample->n_counters; i++)
+    printf (" %s=%lld", sample->counters[i].name, sample->counters[i].bytes);
+
+  printf ("\n");
+  fflush (stdout);
+}
+
+/* What one unit cost over the whole stage; the counters come back in
+ * the same order every time, so they can be paired up by position
+ */
+static void
+print_cost (const char   *stage,
+            long long     units,
+            const Sample *before,
+            const Sample *after)
+{
+  int i;
+
+  if (units == 0)
+    return;
+
+  printf ("cost stage=%s units=%lld", stage, units);
+
+  if (before->rss >= 0 && after->rss >= 0)
+    printf (" rss_bytes=%lld", (after->rss - before->rss) / units);
+
+  printf (" state_bytes=%lld accounted_bytes=%lld",
+          (after->state_bytes - before->state_bytes) / units,
+          (after->accounted - before->accounted) / units);
+
+  for (i = 0; i < after->n_counters && i < before->n_counters; i++)
+    printf (" %s=%lld", after->counters[i].name,
+            (after->counters[i].bytes - before->counters[i].bytes) / units);
+
+  printf ("\n");
+  fflush (stdout);
+}
+
+static void
+add_match_rules (long from,
+                 long to)
+{
+  char rule[256];
+  long i, j;
+
+  /* distinct rules, so nothing can share them */
+  for (i = 0; i < n_connections; i++)
+    for (j = from; j < to; j++)
+      {
+        snprintf (rule, sizeof (rule),
+                  "type='signal',interface='" TEST_INTERFACE "',member='M%ld',path='/c%ld'",
+                  j, i);
+        dbus_bus_add_match (connections[i], rule, NULL);
+      }
+}
+
+static void
+request_names (long from,
+               long to)
+{
+  char name[256];
+  long i, j;
+
+  for (i = 0; i < n_connections; i++)
+    for (j = from; j < to; j++)
+      {
+        const char *name_p = name;
+        dbus_uint32_t flags = DBUS_NAME_FLAG_DO_NOT_QUEUE;
+        DBusMessage *message;
+
+        snprintf (name, sizeof (name), TEST_INTERFACE ".C%ld.N%ld", i, j);
+
+        message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                                DBUS_PATH_DBUS,
+                                                DBUS_INTERFACE_DBUS,
+                                                "RequestName");
+        if (message == NULL ||
+            !dbus_message_append_args (message,
+                                       DBUS_TYPE_STRING, &name_p,
+                                       DBUS_TYPE_UINT32, &flags,
+                                       DBUS_TYPE_INVALID))
+          die ("No memory");
+
+        dbus_message_set_no_reply (message, TRUE);
+        if (!dbus_connection_send (connections[i], message, NULL))
+          die ("No memory");
+        dbus_message_unref (message);
+      }
+}
+
+/* Each connection calls the next one, which never replies, so the bus
+ * holds one pending reply per call until the end
+ */
+static void
+send_unanswered_calls (long from,
+                       long to)
+{
+  long i, j;
+
+  for (i = 0; i < n_connections; i++)
+    {
+      const char *callee;
+
+      callee = dbus_bus_get_unique_name (connections[(i + 1) % n_connections]);
+
+      for (j = from; j < to; j++)
+        {
+          DBusMessage *message;
+
+          message = dbus_message_new_method_call (callee, "/",
+                                                  TEST_INTERFACE, "Wait");
+          if (message == NULL ||
+              !dbus_connection_send (connections[i], message, NULL))
+            die ("No memory");
+          dbus_message_unref (message);
+        }
+    }
+}
+
+typedef void (* GrowFunction) (long from,
+                               long to);
+
+/* Grows the bus to per_connection units on every connection in the
+ * given number of steps
+ */
+static void
+run_stage (pid_t         pid,
+           const char   *stage,
+           GrowFunction  grow,
+           long          per_connection,
+           int           n_steps)
+{
+  Sample before, after;
+  long done = 0;
+  int step;
+
+  if (per_connection == 0)
+    return;
+
+  take_sample (pid, &before);
+
+  for (step = 1; step <= n_steps; step++)
+    {
+      long target = per_connection * step / n_steps;
+
+      (* grow) (done, target);
+      done = target;
+
+      sync_all ();
+      take_sample (pid, &after);
+      print_step (stage, done, &after);
+    }
+
+  print_cost (stage, (long long) per_connection * n_connections,
+              &before, &after);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  const char *daemon = getenv ("DBUS_TEST_DAEMON");
+  char dir[] = "/tmp/dbus-test-memory-XXXXXX";
+  long max_connections = 1000;
+  long n_rules = 10;
+  long n_names = 2;
+  long n_replies = 2;
+  int n_steps = 4;
+  Sample before, after;
+  pid_t pid;
+  int status;
+  int step;
+  long i;
+
+  if (daemon == NULL)
+    daemon = "dbus-daemon";
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strncmp (arg, "--daemon=", 9) == 0)
+        daemon = arg + 9;
+      else if (strncmp (arg, "--connections=", 14) == 0)
+        max_connections = atol (arg + 14);
+      else if (strncmp (arg, "--rules=", 8) == 0)
+        n_rules = atol (arg + 8);
+      else if (strncmp (arg, "--names=", 8) == 0)
+        n_names = atol (arg + 8);
+      else if (strncmp (arg, "--replies=", 10) == 0)
+        n_replies = atol (arg + 10);
+      else if (strncmp (arg, "--steps=", 8) == 0)
+        n_steps = atoi (arg + 8);
+      else
+        usage (argv[0]);
+    }
+
+  if (max_connections <= 0 || n_rules < 0 || n_names < 0 || n_replies < 0 ||
+      n_steps <= 0)
+    usage (argv[0]);
+
+  raise_fd_limit (max_connections);
+
+  if (mkdtemp (dir) == NULL)
+    die ("can't create a temporary directory");
+
+  write_config (dir);
+  pid = start_daemon (daemon, dir);
+
+  connections = dbus_new0 (DBusConnection *, max_connections);
+  control = open_connection ();
+  if (connections == NULL)
+    die ("No memory");
+
+  take_sample (pid, &before);
+  print_step ("start", 0, &before);
+
+  for (step = 1; step <= n_steps; step++)
+    {
+      long target = max_connections * step / n_steps;
+
+      while (n_connections < target)
+        {
+          connections[n_connections] = open_connection ();
+          n_connections++;
+        }
+
+      sync_all ();
+      take_sample (pid, &after);
+      print_step ("connections", n_connections, &after);
+    }
+
+  print_cost ("connections", n_connections, &before, &after);
+
+  run_stage (pid, "rules", add_match_rules, n_rules, n_steps);
+  run_stage (pid, "names", request_names, n_names, n_steps);
+  run_stage (pid, "replies", send_unanswered_calls, n_replies, n_steps);
+
+  kill (pid, SIGTERM);
+  while (waitpid (pid, &status, 0) < 0 && errno == EINTR)
+    ;
+
+  for (i = 0; i < n_connections; i++)
+    {
+      dbus_connection_close (connections[i]);
+      dbus_connection_unref (connections[i]);
+    }
+
+  dbus_free (connections);
+  dbus_connection_close (control);
+  dbus_connection_unref (control);
+
+  remove_config (dir);
+
+  return 0;
+}
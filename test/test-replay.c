@@ -0,0 +1,623 @@
+/* test-replay.c  Replay a capture against a test bus and time it
+ *
+ * Reads a capture written by dbus-monitor --pcap, opens one connection
+ * per unique name in it and sends every captured message again from
+ * the connection standing in for its original sender, keeping the
+ * original spacing (or a multiple of it). Calls to the bus driver are
+ * replayed too, so names and match rules set up while capturing are
+ * set up again; names owned before the capture started are inferred
+ * from who answered calls to them.
+ *
+ * Prints key=value lines: how many messages were replayed, the
+ * delivery latency of those seen arriving, and the CPU time and peak
+ * RSS of the bus if it was started here.
+ */
+
+#include <config.h>
+
+#include "test-utils.h"
+#define DBUS_COMPILATION /* Cheat and use private stuff */
+#include <dbus/dbus-hash.h>
+#undef DBUS_COMPILATION
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define PCAP_MAGIC         0xa1b2c3d4u
+#define PCAP_MAGIC_SWAPPED 0xd4c3b2a1u
+#define PCAP_LINKTYPE_DBUS 231
+
+/* Sent messages whose arrival we're still waiting for; a slot that's
+ * reused first just loses that sample.
+ */
+#define N_IN_FLIGHT 65536
+
+/* How long to wait at the end for the last messages to arrive */
+#define DRAIN_USEC 5000000
+
+typedef struct
+{
+  char *original_name;
+  DBusConnection *connection;
+  int index;
+} ReplayConnection;
+
+typedef struct
+{
+  int index;                  /**< -1 if the slot is free */
+  dbus_uint32_t serial;
+  unsigned long long usec;
+} InFlight;
+
+typedef struct
+{
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+  dbus_bool_t swapped;
+} Capture;
+
+static DBusLoop *loop;
+static const char *address = NULL;
+
+/* original unique name -> ReplayConnection */
+static DBusHashTable *by_original_name;
+/* unique name on the test bus -> ReplayConnection */
+static DBusHashTable *by_replayed_name;
+static int n_connections = 0;
+
+static InFlight in_flight[N_IN_FLIGHT];
+static int n_in_flight = 0;
+
+static unsigned long long *samples = NULL;
+static int n_samples = 0;
+static int n_samples_allocated = 0;
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "*** test-replay: %s\n", message);
+  exit (1);
+}
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr, "Usage: %s [--address=ADDRESS | --config-file=FILE [--daemon=PATH]] [--speed=FACTOR] CAPTURE\n", name);
+  exit (1);
+}
+
+static unsigned long long
+now_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  return tv_sec * 1000000ULL + tv_usec;
+}
+
+static dbus_uint32_t
+get_uint32 (const unsigned char *data,
+            dbus_bool_t          swapped)
+{
+  dbus_uint32_t v;
+
+  memcpy (&v, data, 4);
+
+  if (swapped)
+    v = ((v & 0x000000ffu) << 24) | ((v & 0x0000ff00u) << 8) |
+        ((v & 0x00ff0000u) >> 8) | ((v & 0xff000000u) >> 24);
+
+  return v;
+}
+
+static void
+capture_open (Capture    *capture,
+              const char *filename)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) < 0 || st.st_size < 24)
+    die ("can't open the capture, or it's empty");
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    die ("can't map the capture");
+
+  close (fd);
+
+  capture->data = map;
+  capture->len = st.st_size;
+
+  if (get_uint32 (capture->data, FALSE) == PCAP_MAGIC)
+    capture->swapped = FALSE;
+  else if (get_uint32 (capture->data, FALSE) == PCAP_MAGIC_SWAPPED)
+    capture->swapped = TRUE;
+  else
+    die ("not a pcap file");
+
+  if (get_uint32 (capture->data + 20, capture->swapped) != PCAP_LINKTYPE_DBUS)
+    die ("capture does not contain D-Bus messages");
+}
+
+static void
+capture_rewind (Capture *capture)
+{
+  capture->pos = 24;
+}
+
+/* Returns the next message that can be decoded, or NULL at the end */
+static DBusMessage*
+capture_next (Capture            *capture,
+              unsigned long long *usec)
+{
+  while (capture->len - capture->pos >= 16)
+    {
+      const unsigned char *record = capture->data + capture->pos;
+      dbus_uint32_t captured, size;
+      DBusMessage *message;
+
+      *usec = get_uint32 (record, capture->swapped) * 1000000ULL +
+        get_uint32 (record + 4, capture->swapped);
+      captured = get_uint32 (record + 8, capture->swapped);
+      size = get_uint32 (record + 12, capture->swapped);
+
+      if (captured > capture->len - capture->pos - 16)
+        return NULL;
+
+      capture->pos += 16 + captured;
+
+      if (captured != size)
+        continue;
+
+      message = dbus_message_demarshal ((const char *) record + 16, captured,
+                                        NULL);
+      if (message != NULL)
+        return message;
+    }
+
+  return NULL;
+}
+
+static dbus_bool_t
+is_unique_name (const char *name)
+{
+  return name != NULL && name[0] == ':';
+}
+
+static InFlight*
+in_flight_slot (int           index,
+                dbus_uint32_t serial)
+{
+  return &in_flight[((dbus_uint32_t) index * 40503u ^ serial * 2654435761u) %
+                    N_IN_FLIGHT];
+}
+
+static void
+add_sample (unsigned long long usec)
+{
+  if (n_samples == n_samples_allocated)
+    {
+      int n = n_samples_allocated ? n_samples_allocated * 2 : 1024;
+      unsigned long long *p = dbus_realloc (samples, n * sizeof (*p));
+
+      if (p == NULL)
+        die ("No memory");
+
+      samples = p;
+      n_samples_allocated = n;
+    }
+
+  samples[n_samples++] = usec;
+}
+
+/* Everything sent to our connections ends up here; messages we sent
+ * are recognised by who sent them and their serial, or for the bus
+ * driver's replies by the serial they answer.
+ */
+static DBusHandlerResult
+replay_filter (DBusConnection *connection,
+               DBusMessage    *message,
+               void           *user_data)
+{
+  ReplayConnection *rc = user_data;
+  const char *sender = dbus_message_get_sender (message);
+  ReplayConnection *from;
+  InFlight *slot;
+  int index;
+  dbus_uint32_t serial;
+
+  if (sender != NULL && strcmp (sender, DBUS_SERVICE_DBUS) == 0)
+    {
+      index = rc->index;
+      serial = dbus_message_get_reply_serial (message);
+    }
+  else if (sender != NULL &&
+           (from = _dbus_hash_table_lookup_string (by_replayed_name,
+                                                   sender)) != NULL)
+    {
+      index = from->index;
+      serial = dbus_message_get_serial (message);
+    }
+  else
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  slot = in_flight_slot (index, serial);
+  if (slot->index == index && slot->serial == serial)
+    {
+      add_sample (now_usec () - slot->usec);
+      slot->index = -1;
+      n_in_flight -= 1;
+    }
+
+  /* Never let libdbus answer a replayed call with UnknownMethod */
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static ReplayConnection*
+ensure_connection (const char *original_name)
+{
+  ReplayConnection *rc;
+  DBusError error;
+
+  rc = _dbus_hash_table_lookup_string (by_original_name, original_name);
+  if (rc != NULL)
+    return rc;
+
+  rc = dbus_new0 (ReplayConnection, 1);
+  if (rc == NULL || (rc->original_name = _dbus_strdup (original_name)) == NULL)
+    die ("No memory");
+
+  dbus_error_init (&error);
+  rc->connection = dbus_connection_open_private (address, &error);
+  if (rc->connection == NULL || !dbus_bus_register (rc->connection, &error))
+    {
+      fprintf (stderr, "*** test-replay: %s\n", error.message);
+      exit (1);
+    }
+
+  rc->index = n_connections++;
+
+  if (!test_connection_setup (loop, rc->connection) ||
+      !dbus_connection_add_filter (rc->connection, replay_filter, rc, NULL) ||
+      !_dbus_hash_table_insert_string (by_original_name, rc->original_name,
+                                       rc) ||
+      !_dbus_hash_table_insert_string (by_replayed_name,
+                                       (char *) dbus_bus_get_unique_name (rc->connection),
+                                       rc))
+    die ("No memory");
+
+  return rc;
+}
+
+/* A name that answered a call before anything in the capture asked
+ * for it was owned before the capture started: claim it up front.
+ */
+static void
+claim_name (ReplayConnection *rc,
+            const char       *name)
+{
+  DBusError error;
+
+  dbus_error_init (&error);
+  dbus_bus_request_name (rc->connection, name, DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                         &error);
+  if (dbus_error_is_set (&error))
+    {
+      fprintf (stderr, "*** test-replay: can't own %s: %s\n", name,
+               error.message);
+      dbus_error_free (&error);
+    }
+}
+
+/* First pass: a connection for every unique name, and the names
+ * they owned
+ */
+static void
+prepare (Capture *capture)
+{
+  DBusHashTable *calls;
+  DBusMessage *message;
+  unsigned long long usec;
+  char key[64];
+
+  /* "sender serial" -> the well-known name the call went to */
+  calls = _dbus_hash_table_new (DBUS_HASH_STRING, dbus_free, dbus_free);
+  if (calls == NULL)
+    die ("No memory");
+
+  capture_rewind (capture);
+
+  while ((message = capture_next (capture, &usec)) != NULL)
+    {
+      const char *sender = dbus_message_get_sender (message);
+      const char *destination = dbus_message_get_destination (message);
+      char *name;
+
+      if (is_unique_name (sender))
+        ensure_connection (sender);
+      if (is_unique_name (destination))
+        ensure_connection (destination);
+
+      if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+          sender != NULL && destination != NULL &&
+          !is_unique_name (destination) &&
+          strcmp (destination, DBUS_SERVICE_DBUS) != 0)
+        {
+          char *k, *v;
+
+          snprintf (key, sizeof (key), "%s %u", sender,
+                    dbus_message_get_serial (message));
+          k = _dbus_strdup (key);
+          v = _dbus_strdup (destination);
+          if (k == NULL || v == NULL ||
+              !_dbus_hash_table_insert_string (calls, k, v))
+            die ("No memory");
+        }
+      else if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+               is_unique_name (sender) && destination != NULL)
+        {
+          snprintf (key, sizeof (key), "%s %u", destination,
+                    dbus_message_get_reply_serial (message));
+          name = _dbus_hash_table_lookup_string (calls, key);
+          if (name != NULL)
+            {
+              ReplayConnection *rc = ensure_connection (sender);
+
+              if (!dbus_bus_name_has_owner (rc->connection, name, NULL))
+                claim_name (rc, name);
+              _dbus_hash_table_remove_string (calls, key);
+            }
+        }
+
+      dbus_message_unref (message);
+    }
+
+  _dbus_hash_table_unref (calls);
+}
+
+static void
+replay_message (DBusMessage *message)
+{
+  const char *sender = dbus_message_get_sender (message);
+  const char *destination = dbus_message_get_destination (message);
+  ReplayConnection *rc;
+  InFlight *slot;
+
+  /* The bus will say whatever it has to say itself */
+  if (!is_unique_name (sender))
+    return;
+
+  rc = ensure_connection (sender);
+
+  if (is_unique_name (destination))
+    {
+      ReplayConnection *to = ensure_connection (destination);
+
+      if (!dbus_message_set_destination (message,
+                                         dbus_bus_get_unique_name (to->connection)))
+        die ("No memory");
+    }
+
+  if (!dbus_message_set_sender (message, NULL))
+    die ("No memory");
+
+  /* The serial is kept: each of our connections sends exactly what
+   * its original did, so serials stay unique and reply serials still
+   * match up. Broadcasts may have no one listening, so only
+   * addressed messages are waited for.
+   */
+  if (destination != NULL)
+    {
+      slot = in_flight_slot (rc->index, dbus_message_get_serial (message));
+      if (slot->index < 0)
+        n_in_flight += 1;
+      slot->index = rc->index;
+      slot->serial = dbus_message_get_serial (message);
+      slot->usec = now_usec ();
+    }
+
+  if (!dbus_connection_send (rc->connection, message, NULL))
+    die ("No memory");
+}
+
+/* Runs the loop until the given time */
+static void
+run_until (unsigned long long usec)
+{
+  unsigned long long now;
+
+  while ((now = now_usec ()) < usec)
+    {
+      if (!_dbus_loop_iterate (loop, FALSE))
+        usleep (usec - now > 1000 ? 1000 : usec - now);
+    }
+}
+
+static pid_t
+start_daemon (const char *daemon,
+              const char *config_file)
+{
+  static char address_buf[1024];
+  char config_arg[1024];
+  char address_arg[32];
+  int fds[2];
+  int len = 0;
+  pid_t pid;
+
+  if (pipe (fds) < 0)
+    die ("can't create a pipe");
+
+  pid = fork ();
+  if (pid < 0)
+    die ("can't fork");
+
+  if (pid == 0)
+    {
+      close (fds[0]);
+      snprintf (config_arg, sizeof (config_arg), "--config-file=%s",
+                config_file);
+      snprintf (address_arg, sizeof (address_arg), "--print-address=%d",
+                fds[1]);
+      execlp (daemon, daemon, config_arg, address_arg, "--nofork", NULL);
+      _exit (1);
+    }
+
+  close (fds[1]);
+
+  while (len < (int) sizeof (address_buf) - 1)
+    {
+      ssize_t n = read (fds[0], address_buf + len, 1);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0 || address_buf[len] == '\n')
+        break;
+      len += n;
+    }
+
+  address_buf[len] = '\0';
+  close (fds[0]);
+
+  if (len == 0)
+    die ("the bus didn't start");
+
+  address = address_buf;
+
+  return pid;
+}
+
+static int
+compare_usec (const void *a,
+              const void *b)
+{
+  unsigned long long u1 = *(const unsigned long long *) a;
+  unsigned long long u2 = *(const unsigned long long *) b;
+
+  return u1 < u2 ? -1 : (u1 > u2 ? 1 : 0);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  const char *config_file = NULL;
+  const char *daemon = getenv ("DBUS_TEST_DAEMON");
+  const char *filename = NULL;
+  double speed = 1.0;
+  Capture capture = { 0 };
+  DBusMessage *message;
+  unsigned long long usec, first_usec = 0, start, elapsed;
+  unsigned long n_replayed = 0;
+  pid_t pid = -1;
+  int i;
+
+  if (daemon == NULL)
+    daemon = "dbus-daemon";
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strncmp (arg, "--address=", 10) == 0)
+        address = arg + 10;
+      else if (strncmp (arg, "--config-file=", 14) == 0)
+        config_file = arg + 14;
+      else if (strncmp (arg, "--daemon=", 9) == 0)
+        daemon = arg + 9;
+      else if (strncmp (arg, "--speed=", 8) == 0)
+        speed = atof (arg + 8);
+      else if (arg[0] == '-' || filename != NULL)
+        usage (argv[0]);
+      else
+        filename = arg;
+    }
+
+  if (filename == NULL || (address == NULL) == (config_file == NULL) ||
+      speed < 0)
+    usage (argv[0]);
+
+  for (i = 0; i < N_IN_FLIGHT; i++)
+    in_flight[i].index = -1;
+
+  capture_open (&capture, filename);
+
+  if (config_file != NULL)
+    pid = start_daemon (daemon, config_file);
+
+  loop = _dbus_loop_new ();
+  by_original_name = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  by_replayed_name = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (loop == NULL || by_original_name == NULL || by_replayed_name == NULL)
+    die ("No memory");
+
+  prepare (&capture);
+
+  capture_rewind (&capture);
+  start = now_usec ();
+
+  while ((message = capture_next (&capture, &usec)) != NULL)
+    {
+      if (n_replayed == 0)
+        first_usec = usec;
+
+      /* A speed of 0 sends everything as fast as possible */
+      if (speed > 0 && usec > first_usec)
+        run_until (start + (unsigned long long) ((usec - first_usec) / speed));
+      else
+        while (_dbus_loop_iterate (loop, FALSE))
+          ;
+
+      replay_message (message);
+      dbus_message_unref (message);
+      n_replayed += 1;
+    }
+
+  elapsed = now_usec () - start;
+
+  /* Give what's still on its way a chance to arrive */
+  usec = now_usec () + DRAIN_USEC;
+  while (n_in_flight > 0 && now_usec () < usec)
+    run_until (now_usec () + 1000);
+
+  printf ("replay messages=%lu connections=%d elapsed_usec=%llu unarrived=%d\n",
+          n_replayed, n_connections, elapsed, n_in_flight);
+
+  if (n_samples > 0)
+    {
+      qsort (samples, n_samples, sizeof (unsigned long long), compare_usec);
+      printf ("latency samples=%d p50_usec=%llu p90_usec=%llu p99_usec=%llu max_usec=%llu\n",
+              n_samples, samples[n_samples / 2],
+              samples[(long) n_samples * 90 / 100],
+              samples[(long) n_samples * 99 / 100], samples[n_samples - 1]);
+    }
+
+  fflush (stdout);
+
+  if (pid > 0)
+    {
+      struct rusage usage;
+      int status;
+
+      kill (pid, SIGTERM);
+      if (wait4 (pid, &status, 0, &usage) == pid)
+        printf ("daemon user_usec=%ld sys_usec=%ld maxrss_kb=%ld\n",
+                usage.ru_utime.tv_sec * 1000000L + usage.ru_utime.tv_usec,
+                usage.ru_stime.tv_sec * 1000000L + usage.ru_stime.tv_usec,
+                usage.ru_maxrss);
+    }
+
+  return 0;
+}
@@ -0,0 +1,366 @@
+/* test-startup.c  Time bus startup and reload against generated configs
+ *
+ * For every combination of the requested sizes, writes a configuration
+ * with that many policy rules and a service directory with that many
+ * .service files into a temporary directory, starts a bus on it with
+ * --print-startup-timings, asks it to reload once with SIGHUP and
+ * stops it again.
+ *
+ * Prints one key=value line per startup and reload, so that runs at
+ * growing sizes give the scaling curve of each phase and a regression
+ * in one of them stands out.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* enough for BUS_N_PHASES */
+#define MAX_PHASES 16
+
+/* Well below the bus' limit of a megabyte per file */
+#define RULES_PER_FILE 5000
+
+/* How long to wait for the bus to report a reload */
+#define TIMEOUT_MSEC 60000
+
+typedef struct
+{
+  char name[32];
+  long usec;
+} Phase;
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "*** test-startup: %s\n", message);
+  exit (1);
+}
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr, "Usage: %s [--daemon=PATH] [--rules=N,...] [--services=N,...]\n", name);
+  exit (1);
+}
+
+static int
+parse_sizes (const char *list,
+             long       *sizes,
+             int         max)
+{
+  int n = 0;
+
+  while (*list != '\0' && n < max)
+    {
+      char *end;
+
+      sizes[n++] = strtol (list, &end, 10);
+      if (end == list || (*end != ',' && *end != '\0'))
+        return -1;
+
+      list = *end == ',' ? end + 1 : end;
+    }
+
+  return n;
+}
+
+static FILE *
+open_file (const char *dir,
+           const char *name)
+{
+  char path[1024];
+  FILE *f;
+
+  snprintf (path, sizeof (path), "%s/%s", dir, name);
+  f = fopen (path, "w");
+  if (f == NULL)
+    die ("can't write the configuration");
+
+  return f;
+}
+
+static void
+close_file (FILE *f)
+{
+  if (fclose (f) != 0)
+    die ("can't write the configuration");
+}
+
+static void
+write_config (const char *dir,
+              long        n_rules,
+              long        n_services)
+{
+  char name[64];
+  FILE *f;
+  long i;
+
+  f = open_file (dir, "bus.conf");
+  fprintf (f,
+           "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\"\n"
+           " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+           "<busconfig>\n"
+           "  <type>session</type>\n"
+           "  <listen>unix:path=%s/bus.sock</listen>\n"
+           "  <servicedir>%s/services</servicedir>\n"
+           "  <includedir>%s/bus.d</includedir>\n"
+           "  <policy context=\"default\">\n"
+           "    <allow send_destination=\"*\" eavesdrop=\"true\"/>\n"
+           "    <allow eavesdrop=\"true\"/>\n"
+           "    <allow own=\"*\"/>\n"
+           "  </policy>\n"
+           "</busconfig>\n",
+           dir, dir, dir);
+  close_file (f);
+
+  snprintf (name, sizeof (name), "%s/bus.d", dir);
+  if (mkdir (name, 0700) < 0)
+    die ("can't create the configuration directory");
+
+  /* distinct rules, so nothing can share them, spread over files
+   * since the bus refuses any over a megabyte
+   */
+  f = NULL;
+  for (i = 0; i < n_rules; i++)
+    {
+      if (i % RULES_PER_FILE == 0)
+        {
+          snprintf (name, sizeof (name), "bus.d/rules-%ld.conf",
+                    i / RULES_PER_FILE);
+          f = open_file (dir, name);
+          fprintf (f, "<busconfig>\n  <policy context=\"default\">\n");
+        }
+
+      fprintf (f, "    <deny send_destination=\"org.test.R%ld\" send_path=\"/\"/>\n",
+               i);
+
+      if (i % RULES_PER_FILE == RULES_PER_FILE - 1 || i == n_rules - 1)
+        {
+          fprintf (f, "  </policy>\n</busconfig>\n");
+          close_file (f);
+        }
+    }
+
+  snprintf (name, sizeof (name), "%s/services", dir);
+  if (mkdir (name, 0700) < 0)
+    die ("can't create the service directory");
+
+  for (i = 0; i < n_services; i++)
+    {
+      snprintf (name, sizeof (name), "services/scale-%ld.service", i);
+      f = open_file (dir, name);
+      fprintf (f,
+               "[D-BUS Service]\n"
+               "Name=org.freedesktop.ScaleTest.S%ld\n"
+               "Exec=/bin/false\n",
+               i);
+      close_file (f);
+    }
+}
+
+static void
+remove_config (const char *dir,
+               long        n_rules,
+               long        n_services)
+{
+  char path[1024];
+  long i;
+
+  for (i = 0; i * RULES_PER_FILE < n_rules; i++)
+    {
+      snprintf (path, sizeof (path), "%s/bus.d/rules-%ld.conf", dir, i);
+      unlink (path);
+    }
+
+  for (i = 0; i < n_services; i++)
+    {
+      snprintf (path, sizeof (path), "%s/services/scale-%ld.service", dir, i);
+      unlink (path);
+    }
+
+  snprintf (path, sizeof (path), "%s/bus.d", dir);
+  rmdir (path);
+  snprintf (path, sizeof (path), "%s/services", dir);
+  rmdir (path);
+  snprintf (path, sizeof (path), "%s/bus.conf", dir);
+  unlink (path);
+  /* left behind, since the bus is killed */
+  snprintf (path, sizeof (path), "%s/bus.sock", dir);
+  unlink (path);
+  rmdir (dir);
+}
+
+/* Reads "startup Parse: 1.234 ms" lines until the Total one of the
+ * given kind; anything else the bus says is passed through.
+ */
+static int
+read_phases (FILE       *from,
+             int         fd,
+             const char *kind,
+             Phase      *phases)
+{
+  char line[1024];
+  int n = 0;
+
+  for (;;)
+    {
+      struct pollfd pfd;
+      char what[16];
+      char name[32];
+      long msec, frac;
+
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+
+      /* the stream is unbuffered, so this sees what's left */
+      if (poll (&pfd, 1, TIMEOUT_MSEC) <= 0)
+        die ("the bus didn't report its timings");
+
+      if (fgets (line, sizeof (line), from) == NULL)
+        die ("the bus exited");
+
+      if (sscanf (line, "%15s %31[^:]: %ld.%ld ms", what, name,
+                  &msec, &frac) != 4 ||
+          strcmp (what, kind) != 0)
+        {
+          fputs (line, stderr);
+          continue;
+        }
+
+      if (n < MAX_PHASES)
+        {
+          strcpy (phases[n].name, name);
+          phases[n].usec = msec * 1000 + frac;
+          n++;
+        }
+
+      if (strcmp (name, "Total") == 0)
+        return n;
+    }
+}
+
+static void
+print_phases (const char  *kind,
+              long         n_rules,
+              long         n_services,
+              const Phase *phases,
+              int          n_phases)
+{
+  int i;
+
+  printf ("%s rules=%ld services=%ld", kind, n_rules, n_services);
+
+  for (i = 0; i < n_phases; i++)
+    printf (" %s_usec=%ld", phases[i].name, phases[i].usec);
+
+  printf ("\n");
+  fflush (stdout);
+}
+
+static void
+run_one (const char *daemon,
+         long        n_rules,
+         long        n_services)
+{
+  char dir[] = "/tmp/dbus-test-startup-XXXXXX";
+  char config_arg[1024];
+  Phase phases[MAX_PHASES];
+  int n_phases;
+  int fds[2];
+  FILE *from;
+  pid_t pid;
+  int status;
+
+  if (mkdtemp (dir) == NULL)
+    die ("can't create a temporary directory");
+
+  write_config (dir, n_rules, n_services);
+
+  if (pipe (fds) < 0)
+    die ("can't create a pipe");
+
+  pid = fork ();
+  if (pid < 0)
+    die ("can't fork");
+
+  if (pid == 0)
+    {
+      close (fds[0]);
+      dup2 (fds[1], 2);
+      close (fds[1]);
+      snprintf (config_arg, sizeof (config_arg), "--config-file=%s/bus.conf",
+                dir);
+      execlp (daemon, daemon, config_arg, "--nofork",
+              "--print-startup-timings", NULL);
+      _exit (1);
+    }
+
+  close (fds[1]);
+  from = fdopen (fds[0], "r");
+  if (from == NULL)
+    die ("No memory");
+  setvbuf (from, NULL, _IONBF, 0);
+
+  n_phases = read_phases (from, fds[0], "startup", phases);
+  print_phases ("startup", n_rules, n_services, phases, n_phases);
+
+  kill (pid, SIGHUP);
+  n_phases = read_phases (from, fds[0], "reload", phases);
+  print_phases ("reload", n_rules, n_services, phases, n_phases);
+
+  kill (pid, SIGTERM);
+  while (waitpid (pid, &status, 0) < 0 && errno == EINTR)
+    ;
+
+  fclose (from);
+  remove_config (dir, n_rules, n_services);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  const char *daemon = getenv ("DBUS_TEST_DAEMON");
+  long rules[32] = { 0, 1000, 10000 };
+  long services[32] = { 0, 100, 1000 };
+  int n_rules = 3;
+  int n_services = 3;
+  int i, j;
+
+  if (daemon == NULL)
+    daemon = "dbus-daemon";
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strncmp (arg, "--daemon=", 9) == 0)
+        daemon = arg + 9;
+      else if (strncmp (arg, "--rules=", 8) == 0)
+        n_rules = parse_sizes (arg + 8, rules, 32);
+      else if (strncmp (arg, "--services=", 11) == 0)
+        n_services = parse_sizes (arg + 11, services, 32);
+      else
+        usage (argv[0]);
+
+      if (n_rules <= 0 || n_services <= 0)
+        usage (argv[0]);
+    }
+
+  for (i = 0; i < n_rules; i++)
+    for (j = 0; j < n_services; j++)
+      run_one (daemon, rules[i], services[j]);
+
+  return 0;
+}
@@ -38,6 +38,15 @@ remove_watch (DBusWatch *watch,
                            watch, connection_watch_callback, cd);  
 }
 
+static void
+toggle_watch (DBusWatch      *watch,
+              void           *data)
+{
+  CData *cd = data;
+
+  _dbus_loop_toggle_watch (cd->loop, watch);
+}
+
 static void
 connection_timeout_callback (DBusTimeout   *timeout,
                              void          *data)
@@ -133,7 +142,7 @@ test_connection_setup (DBusLoop       *loop,
   if (!dbus_connection_set_watch_functions (connection,
                                             add_watch,
                                             remove_watch,
-                                            NULL,
+                                            toggle_watch,
                                             cd, cdata_free))
     goto nomem;
 
@@ -259,6 +268,15 @@ remove_server_watch (DBusWatch  *watch,
                            watch, server_watch_callback, context);
 }
 
+static void
+toggle_server_watch (DBusWatch      *watch,
+                     void           *data)
+{
+  ServerData *context = data;
+
+  _dbus_loop_toggle_watch (context->loop, watch);
+}
+
 static void
 server_timeout_callback (DBusTimeout   *timeout,
                          void          *data)
@@ -300,7 +318,7 @@ test_server_setup (DBusLoop      *loop,
   if (!dbus_server_set_watch_functions (server,
                                         add_server_watch,
                                         remove_server_watch,
-                                        NULL,
+                                        toggle_server_watch,
                                         sd,
                                         serverdata_free))
     {
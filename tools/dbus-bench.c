@@ -0,0 +1,714 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-bench.c  Utility program to measure message bus performance
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <dbus/dbus.h>
+
+#define BENCH_INTERFACE "org.freedesktop.DBus.Bench"
+#define BENCH_PATH      "/org/freedesktop/DBus/Bench"
+
+typedef struct
+{
+  const char *name;
+  void (* run) (void);
+} Scenario;
+
+static DBusBusType type = DBUS_BUS_SESSION;
+static const char *address = NULL;
+static int count = 10000;
+static int n_subscribers = 10;
+static int n_rules = 1;
+static int payload_size = 1024 * 1024;
+
+static void
+usage (char *name, int ecode)
+{
+  fprintf (stderr, "Usage: %s [--system | --session | --address=ADDRESS] [--count=N] [--subscribers=N] [--rules=N] [--size=BYTES] [SCENARIO...]\n", name);
+  fprintf (stderr, "Scenarios: latency throughput fanout payload connect match (default: all)\n");
+  exit (ecode);
+}
+
+static void
+die (const char *message,
+     DBusError  *error)
+{
+  if (error != NULL && dbus_error_is_set (error))
+    fprintf (stderr, "%s: %s\n", message, error->message);
+  else
+    fprintf (stderr, "%s\n", message);
+
+  exit (1);
+}
+
+static unsigned long long
+now_usec (void)
+{
+  struct timeval t;
+
+  gettimeofday (&t, NULL);
+
+  return t.tv_sec * 1000000ULL + t.tv_usec;
+}
+
+static DBusConnection*
+connect_bus (void)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  if (address != NULL)
+    {
+      connection = dbus_connection_open_private (address, &error);
+      if (connection != NULL && !dbus_bus_register (connection, &error))
+        {
+          dbus_connection_close (connection);
+          dbus_connection_unref (connection);
+          connection = NULL;
+        }
+    }
+  else
+    connection = dbus_bus_get_private (type, &error);
+
+  if (connection == NULL)
+    die ("Failed to connect to the bus", &error);
+
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+
+  return connection;
+}
+
+static void
+close_bus (DBusConnection *connection)
+{
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+}
+
+static void
+write_all (int         fd,
+           const void *data,
+           size_t      len)
+{
+  const char *p = data;
+
+  while (len > 0)
+    {
+      ssize_t n = write (fd, p, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        _exit (1);
+
+      p += n;
+      len -= n;
+    }
+}
+
+static void
+read_all (int     fd,
+          void   *data,
+          size_t  len)
+{
+  char *p = data;
+
+  while (len > 0)
+    {
+      ssize_t n = read (fd, p, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        die ("A helper process went away", NULL);
+
+      p += n;
+      len -= n;
+    }
+}
+
+static void
+print_result (const char         *scenario,
+              unsigned long       n,
+              unsigned long long  elapsed,
+              const char         *extra)
+{
+  printf ("scenario=%s count=%lu elapsed_usec=%llu rate_per_sec=%.1f%s%s\n",
+          scenario, n, elapsed,
+          elapsed > 0 ? n * 1000000.0 / elapsed : 0.0,
+          extra ? " " : "", extra ? extra : "");
+  fflush (stdout);
+}
+
+/* The server answers Ping, with the payload it was sent if any, and
+ * exits on Quit.
+ */
+static DBusHandlerResult
+server_filter (DBusConnection *connection,
+               DBusMessage    *message,
+               void           *user_data)
+{
+  dbus_bool_t *quit = user_data;
+  DBusMessage *reply;
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    {
+      *quit = TRUE;
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  if (dbus_message_is_method_call (message, BENCH_INTERFACE, "Quit"))
+    *quit = TRUE;
+  else if (!dbus_message_is_method_call (message, BENCH_INTERFACE, "Ping"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_get_no_reply (message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    die ("Out of memory", NULL);
+
+  dbus_connection_send (connection, reply, NULL);
+  dbus_message_unref (reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Forks a process that serves Ping; returns its unique name */
+static char*
+start_server (pid_t *pid)
+{
+  DBusConnection *connection;
+  dbus_bool_t quit = FALSE;
+  char name[256];
+  int fds[2];
+  int len;
+
+  if (pipe (fds) < 0)
+    die ("Failed to create a pipe", NULL);
+
+  *pid = fork ();
+  if (*pid < 0)
+    die ("Failed to fork", NULL);
+
+  if (*pid == 0)
+    {
+      close (fds[0]);
+      connection = connect_bus ();
+
+      if (!dbus_connection_add_filter (connection, server_filter, &quit, NULL))
+        _exit (1);
+
+      len = strlen (dbus_bus_get_unique_name (connection));
+      write_all (fds[1], &len, sizeof (len));
+      write_all (fds[1], dbus_bus_get_unique_name (connection), len);
+      close (fds[1]);
+
+      while (!quit && dbus_connection_read_write_dispatch (connection, -1))
+        ;
+
+      dbus_connection_flush (connection);
+      _exit (0);
+    }
+
+  close (fds[1]);
+  read_all (fds[0], &len, sizeof (len));
+  if (len <= 0 || len >= (int) sizeof (name))
+    die ("Server sent a bad name", NULL);
+  read_all (fds[0], name, len);
+  name[len] = '\0';
+  close (fds[0]);
+
+  return strdup (name);
+}
+
+static DBusMessage*
+new_ping (const char *server)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_method_call (server, BENCH_PATH,
+                                          BENCH_INTERFACE, "Ping");
+  if (message == NULL)
+    die ("Out of memory", NULL);
+
+  return message;
+}
+
+static void
+call_and_block (DBusConnection *connection,
+                DBusMessage    *message)
+{
+  DBusMessage *reply;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  reply = dbus_connection_send_with_reply_and_block (connection, message,
+                                                     -1, &error);
+  if (reply == NULL)
+    die ("Call failed", &error);
+
+  dbus_message_unref (reply);
+}
+
+static void
+stop_server (DBusConnection *connection,
+             const char     *server,
+             pid_t           pid)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_method_call (server, BENCH_PATH,
+                                          BENCH_INTERFACE, "Quit");
+  if (message == NULL)
+    die ("Out of memory", NULL);
+
+  call_and_block (connection, message);
+  dbus_message_unref (message);
+  waitpid (pid, NULL, 0);
+}
+
+static int
+compare_usec (const void *a,
+              const void *b)
+{
+  unsigned long long u1 = *(const unsigned long long *) a;
+  unsigned long long u2 = *(const unsigned long long *) b;
+
+  return u1 < u2 ? -1 : (u1 > u2 ? 1 : 0);
+}
+
+static void
+run_latency (void)
+{
+  DBusConnection *connection;
+  unsigned long long *samples;
+  unsigned long long start, total = 0;
+  char extra[256];
+  char *server;
+  pid_t pid;
+  int i;
+
+  server = start_server (&pid);
+  connection = connect_bus ();
+
+  samples = malloc (count * sizeof (unsigned long long));
+  if (samples == NULL)
+    die ("Out of memory", NULL);
+
+  for (i = 0; i < count; i++)
+    {
+      DBusMessage *message = new_ping (server);
+
+      start = now_usec ();
+      call_and_block (connection, message);
+      samples[i] = now_usec () - start;
+      total += samples[i];
+
+      dbus_message_unref (message);
+    }
+
+  qsort (samples, count, sizeof (unsigned long long), compare_usec);
+
+  snprintf (extra, sizeof (extra),
+            "p50_usec=%llu p90_usec=%llu p99_usec=%llu max_usec=%llu",
+            samples[count / 2], samples[count * 90 / 100],
+            samples[count * 99 / 100], samples[count - 1]);
+  print_result ("latency", count, total, extra);
+
+  free (samples);
+  stop_server (connection, server, pid);
+  close_bus (connection);
+  free (server);
+}
+
+static void
+run_throughput (void)
+{
+  DBusConnection *connection;
+  unsigned long long start;
+  char *server;
+  pid_t pid;
+  int i;
+
+  server = start_server (&pid);
+  connection = connect_bus ();
+
+  start = now_usec ();
+
+  for (i = 0; i < count; i++)
+    {
+      DBusMessage *message = new_ping (server);
+
+      dbus_message_set_no_reply (message, TRUE);
+      if (!dbus_connection_send (connection, message, NULL))
+        die ("Out of memory", NULL);
+      dbus_message_unref (message);
+    }
+
+  /* Messages are delivered in order, so once this is answered all
+   * the one-way ones have been too
+   */
+  stop_server (connection, server, pid);
+
+  print_result ("throughput", count, now_usec () - start, NULL);
+
+  close_bus (connection);
+  free (server);
+}
+
+static void
+run_payload (void)
+{
+  DBusConnection *connection;
+  unsigned long long start, elapsed;
+  char extra[128];
+  char *payload;
+  char *server;
+  pid_t pid;
+  int n, i;
+
+  server = start_server (&pid);
+  connection = connect_bus ();
+
+  payload = calloc (1, payload_size);
+  if (payload == NULL)
+    die ("Out of memory", NULL);
+
+  /* Large messages are slow; keep the run to a similar length */
+  n = count / 100 > 0 ? count / 100 : 1;
+
+  start = now_usec ();
+
+  for (i = 0; i < n; i++)
+    {
+      DBusMessage *message = new_ping (server);
+
+      if (!dbus_message_append_args (message,
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                     &payload, payload_size,
+                                     DBUS_TYPE_INVALID))
+        die ("Out of memory", NULL);
+
+      call_and_block (connection, message);
+      dbus_message_unref (message);
+    }
+
+  elapsed = now_usec () - start;
+
+  snprintf (extra, sizeof (extra), "size=%d bytes_per_sec=%.0f",
+            payload_size,
+            elapsed > 0 ? (double) n * payload_size * 1000000.0 / elapsed : 0.0);
+  print_result ("payload", n, elapsed, extra);
+
+  free (payload);
+  stop_server (connection, server, pid);
+  close_bus (connection);
+  free (server);
+}
+
+static DBusHandlerResult
+subscriber_filter (DBusConnection *connection,
+                   DBusMessage    *message,
+                   void           *user_data)
+{
+  int *received = user_data;
+
+  if (dbus_message_is_signal (message, BENCH_INTERFACE, "Tick"))
+    {
+      *received += 1;
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  if (dbus_message_is_signal (message, BENCH_INTERFACE, "Done") ||
+      dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    {
+      *received = -(*received) - 1;
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Each subscriber installs n_rules rules, only one of which matches
+ * the signals sent, writes a byte when it's ready and then the number
+ * of signals it got once it sees Done.
+ */
+static void
+run_subscriber (int fd)
+{
+  DBusConnection *connection;
+  DBusError error;
+  char rule[256];
+  int received = 0;
+  int i;
+
+  connection = connect_bus ();
+  dbus_error_init (&error);
+
+  if (!dbus_connection_add_filter (connection, subscriber_filter,
+                                   &received, NULL))
+    _exit (1);
+
+  for (i = 1; i < n_rules; i++)
+    {
+      snprintf (rule, sizeof (rule),
+                "type='signal',interface='" BENCH_INTERFACE "',member='Other%d'",
+                i);
+      dbus_bus_add_match (connection, rule, &error);
+      if (dbus_error_is_set (&error))
+        die ("AddMatch failed", &error);
+    }
+
+  dbus_bus_add_match (connection,
+                      "type='signal',interface='" BENCH_INTERFACE "'",
+                      &error);
+  if (dbus_error_is_set (&error))
+    die ("AddMatch failed", &error);
+
+  write_all (fd, "", 1);
+
+  while (received >= 0 &&
+         dbus_connection_read_write_dispatch (connection, -1))
+    ;
+
+  received = received < 0 ? -received - 1 : received;
+  write_all (fd, &received, sizeof (received));
+  _exit (0);
+}
+
+static void
+run_fanout (void)
+{
+  DBusConnection *connection;
+  unsigned long long start;
+  unsigned long total = 0;
+  char extra[128];
+  pid_t *pids;
+  int fds[2];
+  int i;
+
+  if (pipe (fds) < 0)
+    die ("Failed to create a pipe", NULL);
+
+  pids = malloc (n_subscribers * sizeof (pid_t));
+  if (pids == NULL)
+    die ("Out of memory", NULL);
+
+  for (i = 0; i < n_subscribers; i++)
+    {
+      pids[i] = fork ();
+      if (pids[i] < 0)
+        die ("Failed to fork", NULL);
+
+      if (pids[i] == 0)
+        {
+          close (fds[0]);
+          run_subscriber (fds[1]);
+        }
+    }
+
+  close (fds[1]);
+
+  for (i = 0; i < n_subscribers; i++)
+    {
+      char ready;
+
+      read_all (fds[0], &ready, 1);
+    }
+
+  connection = connect_bus ();
+
+  start = now_usec ();
+
+  for (i = 0; i <= count; i++)
+    {
+      DBusMessage *message;
+
+      message = dbus_message_new_signal (BENCH_PATH, BENCH_INTERFACE,
+                                         i < count ? "Tick" : "Done");
+      if (message == NULL || !dbus_connection_send (connection, message, NULL))
+        die ("Out of memory", NULL);
+      dbus_message_unref (message);
+    }
+
+  dbus_connection_flush (connection);
+
+  for (i = 0; i < n_subscribers; i++)
+    {
+      int received;
+
+      read_all (fds[0], &received, sizeof (received));
+      total += received;
+    }
+
+  snprintf (extra, sizeof (extra),
+            "subscribers=%d rules=%d delivered=%lu", n_subscribers, n_rules,
+            total);
+  print_result ("fanout", count, now_usec () - start, extra);
+
+  for (i = 0; i < n_subscribers; i++)
+    waitpid (pids[i], NULL, 0);
+
+  close (fds[0]);
+  free (pids);
+  close_bus (connection);
+}
+
+static void
+run_connect (void)
+{
+  unsigned long long start;
+  int n, i;
+
+  n = count / 10 > 0 ? count / 10 : 1;
+
+  start = now_usec ();
+
+  for (i = 0; i < n; i++)
+    close_bus (connect_bus ());
+
+  print_result ("connect", n, now_usec () - start, NULL);
+}
+
+static void
+run_match (void)
+{
+  DBusConnection *connection;
+  unsigned long long start;
+  DBusError error;
+  char rule[256];
+  int i;
+
+  connection = connect_bus ();
+  dbus_error_init (&error);
+
+  start = now_usec ();
+
+  for (i = 0; i < count; i++)
+    {
+      snprintf (rule, sizeof (rule),
+                "type='signal',interface='" BENCH_INTERFACE "',member='Churn%d'",
+                i);
+
+      dbus_bus_add_match (connection, rule, &error);
+      if (!dbus_error_is_set (&error))
+        dbus_bus_remove_match (connection, rule, &error);
+      if (dbus_error_is_set (&error))
+        die ("Match rule churn failed", &error);
+    }
+
+  print_result ("match", count, now_usec () - start, NULL);
+
+  close_bus (connection);
+}
+
+static const Scenario scenarios[] = {
+  { "latency", run_latency },
+  { "throughput", run_throughput },
+  { "fanout", run_fanout },
+  { "payload", run_payload },
+  { "connect", run_connect },
+  { "match", run_match },
+  { NULL, NULL }
+};
+
+int
+main (int argc, char *argv[])
+{
+  const char *selected[sizeof (scenarios) / sizeof (scenarios[0])];
+  int n_selected = 0;
+  int i, j;
+
+  for (i = 1; i < argc; i++)
+    {
+      char *arg = argv[i];
+
+      if (!strcmp (arg, "--system"))
+        type = DBUS_BUS_SYSTEM;
+      else if (!strcmp (arg, "--session"))
+        type = DBUS_BUS_SESSION;
+      else if (strncmp (arg, "--address=", 10) == 0)
+        address = arg + 10;
+      else if (strncmp (arg, "--count=", 8) == 0)
+        count = atoi (arg + 8);
+      else if (strncmp (arg, "--subscribers=", 14) == 0)
+        n_subscribers = atoi (arg + 14);
+      else if (strncmp (arg, "--rules=", 8) == 0)
+        n_rules = atoi (arg + 8);
+      else if (strncmp (arg, "--size=", 7) == 0)
+        payload_size = atoi (arg + 7);
+      else if (!strcmp (arg, "--help"))
+        usage (argv[0], 0);
+      else if (arg[0] == '-')
+        usage (argv[0], 1);
+      else
+        {
+          for (j = 0; scenarios[j].name != NULL; j++)
+            {
+              if (!strcmp (arg, scenarios[j].name))
+                break;
+            }
+
+          if (scenarios[j].name == NULL ||
+              n_selected == (int) (sizeof (selected) / sizeof (selected[0])) - 1)
+            usage (argv[0], 1);
+
+          selected[n_selected++] = arg;
+        }
+    }
+
+  if (count <= 0 || n_subscribers <= 0 || n_rules <= 0 || payload_size < 0)
+    usage (argv[0], 1);
+
+  /* A subscriber that dies must not take us with it */
+  signal (SIGPIPE, SIG_IGN);
+
+  for (j = 0; scenarios[j].name != NULL; j++)
+    {
+      if (n_selected > 0)
+        {
+          for (i = 0; i < n_selected; i++)
+            {
+              if (!strcmp (selected[i], scenarios[j].name))
+                break;
+            }
+
+          if (i == n_selected)
+            continue;
+        }
+
+      scenarios[j].run ();
+    }
+
+  return 0;
+}
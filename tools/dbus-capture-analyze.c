@@ -0,0 +1,574 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-capture-analyze.c  Summarize a capture written by dbus-monitor --pcap
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <dbus/dbus.h>
+
+#define PCAP_MAGIC         0xa1b2c3d4u
+#define PCAP_MAGIC_SWAPPED 0xd4c3b2a1u
+#define PCAP_LINKTYPE_DBUS 231
+
+/* Pages we've walked past are handed back to the kernel every so
+ * often, so a multi-gigabyte capture doesn't end up resident.
+ */
+#define RELEASE_CHUNK (64 * 1024 * 1024)
+
+/* Calls still waiting for their reply. A call whose slot is reused
+ * before the reply arrives is just counted as unmatched; this keeps
+ * memory use fixed however long the capture is.
+ */
+#define N_PENDING_CALLS 65536
+
+typedef struct Stat Stat;
+
+struct Stat
+{
+  Stat *next;
+  char *name;
+  unsigned long n_messages;
+  unsigned long long n_bytes;
+  unsigned long n_replies;
+  unsigned long long reply_usec;
+  unsigned long long max_reply_usec;
+};
+
+typedef struct
+{
+  Stat **buckets;
+  unsigned int n_buckets;
+  unsigned int n_entries;
+} StatTable;
+
+typedef struct
+{
+  dbus_uint32_t caller_hash;
+  dbus_uint32_t serial;       /**< 0 if the slot is free */
+  unsigned long long usec;
+  Stat *member;
+} PendingCall;
+
+typedef struct
+{
+  int fd;
+  const unsigned char *map;   /**< NULL if reading a pipe */
+  size_t map_len;
+  size_t pos;
+  size_t released;
+  unsigned char *buf;
+  size_t buf_size;
+} CaptureReader;
+
+static StatTable senders;
+static StatTable interfaces;
+static StatTable members;
+static PendingCall pending[N_PENDING_CALLS];
+
+static unsigned long n_messages = 0;
+static unsigned long n_undecodable = 0;
+static unsigned long n_unmatched_calls = 0;
+static unsigned long long n_bytes = 0;
+
+static void
+usage (char *name, int ecode)
+{
+  fprintf (stderr, "Usage: %s [--top=N] [FILE]\n", name);
+  exit (ecode);
+}
+
+static void
+oom (void)
+{
+  fprintf (stderr, "Out of memory\n");
+  exit (1);
+}
+
+static dbus_uint32_t
+hash_string (const char *str)
+{
+  dbus_uint32_t h = 5381;
+
+  while (*str)
+    h = h * 33 + (unsigned char) *str++;
+
+  return h;
+}
+
+static Stat*
+stat_table_lookup (StatTable  *table,
+                   const char *name)
+{
+  dbus_uint32_t h;
+  Stat *stat;
+
+  if (table->n_entries >= table->n_buckets * 2)
+    {
+      unsigned int n_buckets = table->n_buckets ? table->n_buckets * 4 : 64;
+      Stat **buckets;
+      unsigned int i;
+
+      buckets = calloc (n_buckets, sizeof (Stat *));
+      if (buckets == NULL)
+        oom ();
+
+      for (i = 0; i < table->n_buckets; i++)
+        {
+          while (table->buckets[i] != NULL)
+            {
+              stat = table->buckets[i];
+              table->buckets[i] = stat->next;
+              h = hash_string (stat->name) % n_buckets;
+              stat->next = buckets[h];
+              buckets[h] = stat;
+            }
+        }
+
+      free (table->buckets);
+      table->buckets = buckets;
+      table->n_buckets = n_buckets;
+    }
+
+  h = hash_string (name) % table->n_buckets;
+
+  for (stat = table->buckets[h]; stat != NULL; stat = stat->next)
+    {
+      if (strcmp (stat->name, name) == 0)
+        return stat;
+    }
+
+  stat = calloc (1, sizeof (Stat));
+  if (stat == NULL || (stat->name = strdup (name)) == NULL)
+    oom ();
+
+  stat->next = table->buckets[h];
+  table->buckets[h] = stat;
+  table->n_entries += 1;
+
+  return stat;
+}
+
+static void
+stat_add (Stat          *stat,
+          dbus_uint32_t  size)
+{
+  stat->n_messages += 1;
+  stat->n_bytes += size;
+}
+
+static PendingCall*
+pending_slot (dbus_uint32_t caller_hash,
+              dbus_uint32_t serial)
+{
+  return &pending[(caller_hash ^ (serial * 2654435761u)) %
+                  N_PENDING_CALLS];
+}
+
+static void
+record_message (DBusMessage        *message,
+                dbus_uint32_t       size,
+                unsigned long long  usec)
+{
+  const char *sender = dbus_message_get_sender (message);
+  const char *interface = dbus_message_get_interface (message);
+  const char *member = dbus_message_get_member (message);
+  const char *destination = dbus_message_get_destination (message);
+  Stat *member_stat = NULL;
+  PendingCall *call;
+
+  stat_add (stat_table_lookup (&senders, sender ? sender : "(none)"), size);
+
+  if (interface != NULL)
+    stat_add (stat_table_lookup (&interfaces, interface), size);
+
+  if (member != NULL)
+    {
+      char *name;
+
+      name = malloc (strlen (interface ? interface : "") +
+                     strlen (member) + 2);
+      if (name == NULL)
+        oom ();
+
+      sprintf (name, "%s.%s", interface ? interface : "", member);
+      member_stat = stat_table_lookup (&members, name);
+      stat_add (member_stat, size);
+      free (name);
+    }
+
+  switch (dbus_message_get_type (message))
+    {
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+      if (sender == NULL || dbus_message_get_no_reply (message))
+        break;
+
+      call = pending_slot (hash_string (sender),
+                           dbus_message_get_serial (message));
+      if (call->serial != 0)
+        n_unmatched_calls += 1;
+
+      call->caller_hash = hash_string (sender);
+      call->serial = dbus_message_get_serial (message);
+      call->usec = usec;
+      call->member = member_stat;
+      break;
+
+    case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+    case DBUS_MESSAGE_TYPE_ERROR:
+      if (destination == NULL)
+        break;
+
+      call = pending_slot (hash_string (destination),
+                           dbus_message_get_reply_serial (message));
+      if (call->serial == dbus_message_get_reply_serial (message) &&
+          call->caller_hash == hash_string (destination))
+        {
+          if (call->member != NULL && usec >= call->usec)
+            {
+              unsigned long long latency = usec - call->usec;
+
+              call->member->n_replies += 1;
+              call->member->reply_usec += latency;
+              if (latency > call->member->max_reply_usec)
+                call->member->max_reply_usec = latency;
+            }
+
+          call->serial = 0;
+        }
+      break;
+    }
+}
+
+static dbus_bool_t
+reader_open (CaptureReader *reader,
+             const char    *filename)
+{
+  struct stat st;
+
+  memset (reader, 0, sizeof (CaptureReader));
+
+  if (filename == NULL || strcmp (filename, "-") == 0)
+    reader->fd = 0;
+  else
+    reader->fd = open (filename, O_RDONLY);
+
+  if (reader->fd < 0)
+    return FALSE;
+
+  if (fstat (reader->fd, &st) == 0 && S_ISREG (st.st_mode) &&
+      st.st_size > 0)
+    {
+      void *map;
+
+      map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+      if (map != MAP_FAILED)
+        {
+          reader->map = map;
+          reader->map_len = st.st_size;
+#ifdef MADV_SEQUENTIAL
+          madvise (map, st.st_size, MADV_SEQUENTIAL);
+#endif
+        }
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+read_fully (int            fd,
+            unsigned char *buf,
+            size_t         len)
+{
+  while (len > 0)
+    {
+      ssize_t n = read (fd, buf, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+
+      buf += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+/* Returns the next len bytes, valid until the next call, or NULL
+ * at the end of the capture.
+ */
+static const unsigned char*
+reader_get (CaptureReader *reader,
+            size_t         len)
+{
+  const unsigned char *data;
+
+  if (reader->map == NULL)
+    {
+      if (len > reader->buf_size)
+        {
+          unsigned char *buf = realloc (reader->buf, len);
+
+          if (buf == NULL)
+            oom ();
+
+          reader->buf = buf;
+          reader->buf_size = len;
+        }
+
+      return read_fully (reader->fd, reader->buf, len) ? reader->buf : NULL;
+    }
+
+  if (len > reader->map_len - reader->pos)
+    return NULL;
+
+  data = reader->map + reader->pos;
+  reader->pos += len;
+
+  if (reader->pos - reader->released > RELEASE_CHUNK)
+    {
+      size_t end = reader->pos & ~((size_t) sysconf (_SC_PAGESIZE) - 1);
+
+#ifdef MADV_DONTNEED
+      madvise ((void *) (reader->map + reader->released),
+               end - reader->released, MADV_DONTNEED);
+#endif
+      reader->released = end;
+    }
+
+  return data;
+}
+
+static dbus_uint32_t
+get_uint32 (const unsigned char *data,
+            dbus_bool_t          swapped)
+{
+  dbus_uint32_t v;
+
+  memcpy (&v, data, 4);
+
+  if (swapped)
+    v = ((v & 0x000000ffu) << 24) | ((v & 0x0000ff00u) << 8) |
+        ((v & 0x00ff0000u) >> 8) | ((v & 0xff000000u) >> 24);
+
+  return v;
+}
+
+static int
+compare_stats (const void *a,
+               const void *b)
+{
+  const Stat *s1 = *(const Stat * const *) a;
+  const Stat *s2 = *(const Stat * const *) b;
+
+  if (s1->n_bytes != s2->n_bytes)
+    return s1->n_bytes < s2->n_bytes ? 1 : -1;
+
+  return strcmp (s1->name, s2->name);
+}
+
+static void
+print_table (const char *title,
+             StatTable  *table,
+             double      seconds,
+             int         top,
+             dbus_bool_t with_latency)
+{
+  Stat **sorted;
+  unsigned int i, n = 0;
+
+  if (table->n_entries == 0)
+    return;
+
+  sorted = malloc (table->n_entries * sizeof (Stat *));
+  if (sorted == NULL)
+    oom ();
+
+  for (i = 0; i < table->n_buckets; i++)
+    {
+      Stat *stat;
+
+      for (stat = table->buckets[i]; stat != NULL; stat = stat->next)
+        sorted[n++] = stat;
+    }
+
+  qsort (sorted, n, sizeof (Stat *), compare_stats);
+
+  printf ("\n%s:\n", title);
+  printf ("%10s %10s %12s %12s", "messages", "msgs/s", "bytes", "bytes/s");
+  if (with_latency)
+    printf (" %8s %10s %10s", "replies", "avg usec", "max usec");
+  printf ("  name\n");
+
+  for (i = 0; i < n && (top <= 0 || i < (unsigned int) top); i++)
+    {
+      Stat *stat = sorted[i];
+
+      printf ("%10lu %10.1f %12llu %12.0f", stat->n_messages,
+              stat->n_messages / seconds, stat->n_bytes,
+              stat->n_bytes / seconds);
+
+      if (with_latency)
+        {
+          if (stat->n_replies > 0)
+            printf (" %8lu %10llu %10llu", stat->n_replies,
+                    stat->reply_usec / stat->n_replies,
+                    stat->max_reply_usec);
+          else
+            printf (" %8s %10s %10s", "-", "-", "-");
+        }
+
+      printf ("  %s\n", stat->name);
+    }
+
+  free (sorted);
+}
+
+int
+main (int argc, char *argv[])
+{
+  CaptureReader reader;
+  const unsigned char *data;
+  const char *filename = NULL;
+  unsigned long long first_usec = 0, last_usec = 0;
+  dbus_bool_t swapped;
+  double seconds;
+  int top = 20;
+  int i;
+
+  for (i = 1; i < argc; i++)
+    {
+      char *arg = argv[i];
+
+      if (strncmp (arg, "--top=", 6) == 0)
+        top = atoi (arg + 6);
+      else if (!strcmp (arg, "--help"))
+        usage (argv[0], 0);
+      else if (arg[0] == '-' && arg[1] != '\0')
+        usage (argv[0], 1);
+      else if (filename == NULL)
+        filename = arg;
+      else
+        usage (argv[0], 1);
+    }
+
+  if (!reader_open (&reader, filename))
+    {
+      fprintf (stderr, "Failed to open %s: %s\n", filename, strerror (errno));
+      exit (1);
+    }
+
+  data = reader_get (&reader, 24);
+  if (data == NULL)
+    {
+      fprintf (stderr, "Capture is empty or truncated\n");
+      exit (1);
+    }
+
+  if (get_uint32 (data, FALSE) == PCAP_MAGIC)
+    swapped = FALSE;
+  else if (get_uint32 (data, FALSE) == PCAP_MAGIC_SWAPPED)
+    swapped = TRUE;
+  else
+    {
+      fprintf (stderr, "Not a pcap file\n");
+      exit (1);
+    }
+
+  if (get_uint32 (data + 20, swapped) != PCAP_LINKTYPE_DBUS)
+    {
+      fprintf (stderr, "Capture does not contain D-Bus messages\n");
+      exit (1);
+    }
+
+  while ((data = reader_get (&reader, 16)) != NULL)
+    {
+      unsigned long long usec;
+      dbus_uint32_t captured, size;
+      DBusMessage *message;
+      DBusError error;
+
+      usec = get_uint32 (data, swapped) * 1000000ULL +
+        get_uint32 (data + 4, swapped);
+      captured = get_uint32 (data + 8, swapped);
+      size = get_uint32 (data + 12, swapped);
+
+      data = reader_get (&reader, captured);
+      if (data == NULL)
+        {
+          fprintf (stderr, "Capture ends in the middle of a message\n");
+          break;
+        }
+
+      if (n_messages == 0)
+        first_usec = usec;
+      last_usec = usec;
+      n_messages += 1;
+      n_bytes += size;
+
+      dbus_error_init (&error);
+      message = NULL;
+      if (captured == size)
+        message = dbus_message_demarshal ((const char *) data, captured,
+                                          &error);
+
+      if (message == NULL)
+        {
+          n_undecodable += 1;
+          dbus_error_free (&error);
+          continue;
+        }
+
+      record_message (message, size, usec);
+      dbus_message_unref (message);
+    }
+
+  for (i = 0; i < N_PENDING_CALLS; i++)
+    {
+      if (pending[i].serial != 0)
+        n_unmatched_calls += 1;
+    }
+
+  seconds = (last_usec - first_usec) / 1000000.0;
+  if (seconds <= 0)
+    seconds = 1;
+
+  printf ("%lu messages, %llu bytes in %.3f seconds\n",
+          n_messages, n_bytes, seconds);
+  if (n_undecodable > 0)
+    printf ("%lu messages could not be decoded\n", n_undecodable);
+  if (n_unmatched_calls > 0)
+    printf ("%lu method calls had no reply in the capture\n",
+            n_unmatched_calls);
+
+  print_table ("Senders", &senders, seconds, top, FALSE);
+  print_table ("Interfaces", &interfaces, seconds, top, FALSE);
+  print_table ("Members", &members, seconds, top, TRUE);
+
+  return 0;
+}
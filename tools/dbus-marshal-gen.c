@@ -0,0 +1,910 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-marshal-gen.c  Generate marshallers from introspection data
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <dbus/dbus.h>
+
+/* For each method and signal in the introspection data, writes a C
+ * function that marshals its arguments straight into a buffer and
+ * hands that to dbus_message_append_marshalled(). Where the offset of
+ * a value doesn't depend on the length of a string or array before
+ * it, the generated code writes it at a constant offset; only after
+ * the first string or array is the padding worked out as it runs.
+ *
+ * Only basic types, and arrays of fixed-length basic types, are
+ * supported; members with other arguments are skipped with a comment.
+ * The parser only understands as much XML as introspection data uses.
+ */
+
+#define MAX_ATTRIBUTES 8
+#define MAX_ARGS 32
+
+/* Values up to this size are marshalled on the stack */
+#define STACK_BLOCK_SIZE 256
+
+typedef struct
+{
+  char *name;
+  int is_end;     /**< </name> */
+  int is_empty;   /**< <name/> */
+  int n_attributes;
+  char *attribute_names[MAX_ATTRIBUTES];
+  char *attribute_values[MAX_ATTRIBUTES];
+} Tag;
+
+typedef struct
+{
+  char *name;
+  const char *type;
+  int is_out;
+} Arg;
+
+typedef struct
+{
+  const char *interface;
+  const char *name;
+  int is_signal;
+  int n_args;
+  Arg args[MAX_ARGS];
+} Member;
+
+typedef struct
+{
+  const char *prefix;   /**< From --prefix, or NULL to use the interface's */
+  int header;           /**< Write prototypes only */
+  int n_written;
+} Output;
+
+static void
+usage (char *name, int ecode)
+{
+  fprintf (stderr, "Usage: %s [--prefix=NAME] [--header] [FILE]\n", name);
+  exit (ecode);
+}
+
+static void
+oom (void)
+{
+  fprintf (stderr, "Out of memory\n");
+  exit (1);
+}
+
+static char *
+read_file (const char *filename)
+{
+  FILE *f;
+  char *data = NULL;
+  size_t len = 0;
+  size_t allocated = 0;
+
+  if (filename == NULL)
+    f = stdin;
+  else
+    f = fopen (filename, "r");
+
+  if (f == NULL)
+    return NULL;
+
+  for (;;)
+    {
+      size_t n;
+
+      if (allocated - len < 4096)
+        {
+          allocated = allocated ? allocated * 2 : 16384;
+          data = realloc (data, allocated);
+          if (data == NULL)
+            oom ();
+        }
+
+      n = fread (data + len, 1, allocated - len - 1, f);
+      len += n;
+      if (n == 0)
+        break;
+    }
+
+  data[len] = '\0';
+
+  if (f != stdin)
+    fclose (f);
+
+  return data;
+}
+
+/* Reads the tag starting at p, just after its '<', nul-terminating
+ * its name and attribute values in place. Returns where the tag ends,
+ * or NULL if the XML is broken.
+ */
+static char *
+parse_tag (char *p,
+           Tag  *tag)
+{
+  memset (tag, 0, sizeof (Tag));
+
+  if (*p == '/')
+    {
+      tag->is_end = 1;
+      p++;
+    }
+
+  tag->name = p;
+  while (*p != '\0' && !isspace ((unsigned char) *p) && *p != '>' && *p != '/')
+    p++;
+
+  for (;;)
+    {
+      char *name;
+      char quote;
+
+      if (*p == '\0')
+        return NULL;
+
+      if (*p == '>')
+        {
+          *p = '\0';
+          return p + 1;
+        }
+
+      if (*p == '/' && p[1] == '>')
+        {
+          *p = '\0';
+          tag->is_empty = 1;
+          return p + 2;
+        }
+
+      if (isspace ((unsigned char) *p))
+        {
+          *p++ = '\0';
+          continue;
+        }
+
+      name = p;
+      while (*p != '\0' && *p != '=' && !isspace ((unsigned char) *p))
+        p++;
+      while (isspace ((unsigned char) *p))
+        *p++ = '\0';
+      if (*p != '=')
+        return NULL;
+      *p++ = '\0';
+      while (isspace ((unsigned char) *p))
+        p++;
+
+      quote = *p;
+      if (quote != '"' && quote != '\'')
+        return NULL;
+      p++;
+
+      if (tag->n_attributes < MAX_ATTRIBUTES)
+        {
+          tag->attribute_names[tag->n_attributes] = name;
+          tag->attribute_values[tag->n_attributes] = p;
+          tag->n_attributes++;
+        }
+
+      p = strchr (p, quote);
+      if (p == NULL)
+        return NULL;
+      *p++ = '\0';
+    }
+}
+
+static const char *
+get_attribute (const Tag  *tag,
+               const char *name)
+{
+  int i;
+
+  for (i = 0; i < tag->n_attributes; i++)
+    if (strcmp (tag->attribute_names[i], name) == 0)
+      return tag->attribute_values[i];
+
+  return NULL;
+}
+
+/* GetNameOwner becomes get_name_owner */
+static char *
+to_lower_case (const char *name)
+{
+  char *result;
+  char *q;
+  size_t i;
+
+  result = malloc (strlen (name) * 2 + 1);
+  if (result == NULL)
+    oom ();
+
+  q = result;
+  for (i = 0; name[i] != '\0'; i++)
+    {
+      unsigned char c = name[i];
+
+      if (isupper (c) && i > 0 &&
+          (islower ((unsigned char) name[i - 1]) ||
+           isdigit ((unsigned char) name[i - 1]) ||
+           (isupper ((unsigned char) name[i - 1]) &&
+            islower ((unsigned char) name[i + 1]))))
+        *q++ = '_';
+
+      *q++ = isalnum (c) ? tolower (c) : '_';
+    }
+  *q = '\0';
+
+  return result;
+}
+
+static const char *c_keywords[] = {
+  "auto", "break", "case", "char", "const", "continue", "default", "do",
+  "double", "else", "enum", "extern", "float", "for", "goto", "if",
+  "inline", "int", "long", "register", "restrict", "return", "short",
+  "signed", "sizeof", "static", "struct", "switch", "typedef", "union",
+  "unsigned", "void", "volatile", "while", "message", NULL
+};
+
+/* A C identifier for an argument, which doesn't clash with a keyword,
+ * the message parameter or the generated code's own variables
+ */
+static char *
+arg_identifier (const char *name,
+                int         index)
+{
+  char buf[32];
+  char *result;
+  size_t len;
+  int i;
+
+  if (name == NULL || *name == '\0')
+    {
+      snprintf (buf, sizeof (buf), "arg%d", index);
+      name = buf;
+    }
+
+  result = to_lower_case (name);
+  if (isdigit ((unsigned char) result[0]) ||
+      strncmp (result, "mg_", 3) == 0 ||
+      strncmp (result, "n_", 2) == 0)
+    goto mangle;
+
+  for (i = 0; c_keywords[i] != NULL; i++)
+    if (strcmp (result, c_keywords[i]) == 0)
+      goto mangle;
+
+  return result;
+
+ mangle:
+  len = strlen (result);
+  result = realloc (result, len + 3);
+  if (result == NULL)
+    oom ();
+  memmove (result + 2, result, len + 1);
+  result[0] = 'a';
+  result[1] = '_';
+  return result;
+}
+
+/* Size and C type of the fixed-length basic types, 0 for others */
+static int
+fixed_size (char type,
+            const char **c_type)
+{
+  switch (type)
+    {
+    case DBUS_TYPE_BYTE:
+      *c_type = "unsigned char";
+      return 1;
+    case DBUS_TYPE_BOOLEAN:
+      *c_type = "dbus_bool_t";
+      return 4;
+    case DBUS_TYPE_INT16:
+      *c_type = "dbus_int16_t";
+      return 2;
+    case DBUS_TYPE_UINT16:
+      *c_type = "dbus_uint16_t";
+      return 2;
+    case DBUS_TYPE_INT32:
+      *c_type = "dbus_int32_t";
+      return 4;
+    case DBUS_TYPE_UINT32:
+      *c_type = "dbus_uint32_t";
+      return 4;
+    case DBUS_TYPE_INT64:
+      *c_type = "dbus_int64_t";
+      return 8;
+    case DBUS_TYPE_UINT64:
+      *c_type = "dbus_uint64_t";
+      return 8;
+    case DBUS_TYPE_DOUBLE:
+      *c_type = "double";
+      return 8;
+    default:
+      return 0;
+    }
+}
+
+static int
+is_string_type (char type)
+{
+  return type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH ||
+    type == DBUS_TYPE_SIGNATURE;
+}
+
+static int
+is_supported (const char *type)
+{
+  const char *c_type;
+
+  if (type[0] == DBUS_TYPE_ARRAY)
+    return type[2] == '\0' && fixed_size (type[1], &c_type) > 0;
+
+  return type[1] == '\0' &&
+    (fixed_size (type[0], &c_type) > 0 || is_string_type (type[0]));
+}
+
+static int
+align_value (int value,
+             int alignment)
+{
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static void
+write_prototype (const Output *output,
+                 const Member *member,
+                 int           is_out,
+                 const char   *function)
+{
+  int i;
+
+  printf ("dbus_bool_t\n%s (DBusMessage *message", function);
+
+  for (i = 0; i < member->n_args; i++)
+    {
+      const Arg *arg = &member->args[i];
+      const char *c_type;
+
+      if (arg->is_out != is_out)
+        continue;
+
+      if (arg->type[0] == DBUS_TYPE_ARRAY)
+        {
+          fixed_size (arg->type[1], &c_type);
+          printf (",\n    const %s *%s,\n    int n_%s", c_type, arg->name,
+                  arg->name);
+        }
+      else if (is_string_type (arg->type[0]))
+        printf (",\n    const char *%s", arg->name);
+      else
+        {
+          fixed_size (arg->type[0], &c_type);
+          printf (",\n    %s %s", c_type, arg->name);
+        }
+    }
+
+  printf (")%s\n", output->header ? ";" : "");
+}
+
+/* Writes the code that works out mg_size. While *known is set, the
+ * size so far is *offset and nothing needs to be computed.
+ */
+static void
+write_size (const Arg *arg,
+            int       *known,
+            int       *offset)
+{
+  char type = arg->type[0];
+  const char *c_type;
+  int size;
+
+  if (type == DBUS_TYPE_ARRAY)
+    {
+      size = fixed_size (arg->type[1], &c_type);
+      if (*known)
+        printf ("  mg_size = %d + (size_t) n_%s * %d;\n",
+                align_value (align_value (*offset, 4) + 4, size),
+                arg->name, size);
+      else
+        printf ("  mg_size = DBUS_MG_ALIGN (DBUS_MG_ALIGN (mg_size, 4) + 4, %d) + (size_t) n_%s * %d;\n",
+                size, arg->name, size);
+      *known = 0;
+    }
+  else if (type == DBUS_TYPE_SIGNATURE)
+    {
+      if (*known)
+        printf ("  mg_size = %d + mg_len_%s + 1;\n", *offset + 1, arg->name);
+      else
+        printf ("  mg_size += 1 + mg_len_%s + 1;\n", arg->name);
+      *known = 0;
+    }
+  else if (is_string_type (type))
+    {
+      if (*known)
+        printf ("  mg_size = %d + mg_len_%s + 1;\n",
+                align_value (*offset, 4) + 4, arg->name);
+      else
+        printf ("  mg_size = DBUS_MG_ALIGN (mg_size, 4) + 4 + mg_len_%s + 1;\n",
+                arg->name);
+      *known = 0;
+    }
+  else
+    {
+      size = fixed_size (type, &c_type);
+      if (*known)
+        *offset = align_value (*offset, size) + size;
+      else if (size == 1)
+        printf ("  mg_size += 1;\n");
+      else
+        printf ("  mg_size = DBUS_MG_ALIGN (mg_size, %d) + %d;\n", size, size);
+    }
+}
+
+/* Writes the padding that brings the position up to alignment */
+static void
+write_padding (int *known,
+               int *offset,
+               int  alignment)
+{
+  int aligned;
+
+  if (alignment == 1)
+    return;
+
+  if (!*known)
+    {
+      printf ("  DBUS_MG_PAD (mg_block, mg_pos, %d);\n", alignment);
+      return;
+    }
+
+  aligned = align_value (*offset, alignment);
+  if (aligned > *offset)
+    printf ("  memset (mg_block + %d, 0, %d);\n", *offset, aligned - *offset);
+  *offset = aligned;
+}
+
+/* Writes the code that puts the value of arg into mg_block. While
+ * *known is set, its offset is the constant *offset; once it's not,
+ * it's mg_pos. is_last leaves out moving mg_pos past the value.
+ */
+static void
+write_value (const Arg *arg,
+             int       *known,
+             int       *offset,
+             int        is_last)
+{
+  char type = arg->type[0];
+  const char *c_type;
+  char pos[32];
+  int size;
+
+  if (type == DBUS_TYPE_ARRAY)
+    {
+      size = fixed_size (arg->type[1], &c_type);
+      write_padding (known, offset, 4);
+
+      if (*known)
+        snprintf (pos, sizeof (pos), "%d", *offset);
+      else
+        snprintf (pos, sizeof (pos), "mg_pos");
+
+      printf ("  mg_u32 = (dbus_uint32_t) n_%s * %d;\n", arg->name, size);
+      printf ("  memcpy (mg_block + %s, &mg_u32, 4);\n", pos);
+
+      if (*known)
+        *offset += 4;
+      else
+        printf ("  mg_pos += 4;\n");
+
+      write_padding (known, offset, size);
+
+      if (*known)
+        {
+          printf ("  memcpy (mg_block + %d, %s, (size_t) n_%s * %d);\n",
+                  *offset, arg->name, arg->name, size);
+          if (!is_last)
+            printf ("  mg_pos = %d + (size_t) n_%s * %d;\n",
+                    *offset, arg->name, size);
+        }
+      else
+        {
+          printf ("  memcpy (mg_block + mg_pos, %s, (size_t) n_%s * %d);\n",
+                  arg->name, arg->name, size);
+          if (!is_last)
+            printf ("  mg_pos += (size_t) n_%s * %d;\n", arg->name, size);
+        }
+
+      *known = 0;
+    }
+  else if (is_string_type (type))
+    {
+      int len_size = type == DBUS_TYPE_SIGNATURE ? 1 : 4;
+
+      write_padding (known, offset, len_size);
+
+      if (*known)
+        snprintf (pos, sizeof (pos), "%d", *offset);
+      else
+        snprintf (pos, sizeof (pos), "mg_pos");
+
+      if (len_size == 1)
+        printf ("  mg_block[%s] = (unsigned char) mg_len_%s;\n", pos, arg->name);
+      else
+        {
+          printf ("  mg_u32 = (dbus_uint32_t) mg_len_%s;\n", arg->name);
+          printf ("  memcpy (mg_block + %s, &mg_u32, 4);\n", pos);
+        }
+
+      printf ("  memcpy (mg_block + %s + %d, %s, mg_len_%s + 1);\n",
+              pos, len_size, arg->name, arg->name);
+
+      if (!is_last)
+        {
+          if (*known)
+            printf ("  mg_pos = %d + mg_len_%s + 1;\n",
+                    *offset + len_size, arg->name);
+          else
+            printf ("  mg_pos += %d + mg_len_%s + 1;\n", len_size, arg->name);
+        }
+
+      *known = 0;
+    }
+  else
+    {
+      size = fixed_size (type, &c_type);
+      write_padding (known, offset, size);
+
+      if (*known)
+        snprintf (pos, sizeof (pos), "%d", *offset);
+      else
+        snprintf (pos, sizeof (pos), "mg_pos");
+
+      if (type == DBUS_TYPE_BOOLEAN)
+        {
+          printf ("  mg_u32 = %s ? TRUE : FALSE;\n", arg->name);
+          printf ("  memcpy (mg_block + %s, &mg_u32, 4);\n", pos);
+        }
+      else if (size == 1)
+        printf ("  mg_block[%s] = %s;\n", pos, arg->name);
+      else
+        printf ("  memcpy (mg_block + %s, &%s, %d);\n", pos, arg->name, size);
+
+      if (*known)
+        *offset += size;
+      else if (!is_last)
+        printf ("  mg_pos += %d;\n", size);
+    }
+}
+
+static void
+write_function (Output       *output,
+                const Member *member,
+                int           is_out,
+                const char   *prefix)
+{
+  char signature[DBUS_MAXIMUM_SIGNATURE_LENGTH + 1];
+  char function[512];
+  char *lower;
+  const Arg *args[MAX_ARGS];
+  int n_args;
+  int known;
+  int offset;
+  int uses_u32;
+  int uses_pos;
+  int i;
+
+  n_args = 0;
+  signature[0] = '\0';
+  uses_u32 = 0;
+  for (i = 0; i < member->n_args; i++)
+    {
+      const Arg *arg = &member->args[i];
+
+      if (arg->is_out != is_out)
+        continue;
+
+      if (strlen (signature) + strlen (arg->type) > DBUS_MAXIMUM_SIGNATURE_LENGTH)
+        {
+          printf ("/* %s.%s: signature too long, skipped */\n\n",
+                  member->interface, member->name);
+          return;
+        }
+
+      strcat (signature, arg->type);
+      args[n_args++] = arg;
+
+      if (arg->type[0] == DBUS_TYPE_ARRAY ||
+          arg->type[0] == DBUS_TYPE_BOOLEAN ||
+          arg->type[0] == DBUS_TYPE_STRING ||
+          arg->type[0] == DBUS_TYPE_OBJECT_PATH)
+        uses_u32 = 1;
+    }
+
+  if (n_args == 0)
+    return;
+
+  lower = to_lower_case (member->name);
+  snprintf (function, sizeof (function), "%s_%s_append_%s",
+            prefix, lower,
+            member->is_signal || !is_out ? "args" : "reply");
+  free (lower);
+
+  if (output->header)
+    {
+      write_prototype (output, member, is_out, function);
+      printf ("\n");
+      output->n_written++;
+      return;
+    }
+
+  /* mg_pos is only needed from the first string or array on, and
+   * only if something comes after that
+   */
+  uses_pos = 0;
+  for (i = 0; i < n_args - 1; i++)
+    if (args[i]->type[0] == DBUS_TYPE_ARRAY ||
+        is_string_type (args[i]->type[0]))
+      {
+        uses_pos = 1;
+        break;
+      }
+
+  printf ("/* %s.%s %s, \"%s\" */\n", member->interface, member->name,
+          member->is_signal ? "signal" : is_out ? "reply" : "call",
+          signature);
+  write_prototype (output, member, is_out, function);
+  printf ("{\n");
+  printf ("  unsigned char mg_stack[%d];\n", STACK_BLOCK_SIZE);
+  printf ("  unsigned char *mg_block;\n");
+  printf ("  size_t mg_size;\n");
+  if (uses_pos)
+    printf ("  size_t mg_pos;\n");
+  if (uses_u32)
+    printf ("  dbus_uint32_t mg_u32;\n");
+  for (i = 0; i < n_args; i++)
+    if (is_string_type (args[i]->type[0]))
+      printf ("  size_t mg_len_%s;\n", args[i]->name);
+  printf ("  dbus_bool_t mg_ret;\n\n");
+
+  for (i = 0; i < n_args; i++)
+    {
+      if (is_string_type (args[i]->type[0]))
+        printf ("  mg_len_%s = strlen (%s);\n", args[i]->name, args[i]->name);
+      else if (args[i]->type[0] == DBUS_TYPE_ARRAY)
+        {
+          const char *c_type;
+
+          printf ("  if (n_%s < 0 || (size_t) n_%s > DBUS_MAXIMUM_ARRAY_LENGTH / %d)\n"
+                  "    return FALSE;\n",
+                  args[i]->name, args[i]->name,
+                  fixed_size (args[i]->type[1], &c_type));
+        }
+    }
+
+  known = 1;
+  offset = 0;
+  for (i = 0; i < n_args; i++)
+    write_size (args[i], &known, &offset);
+  if (known)
+    printf ("  mg_size = %d;\n", offset);
+
+  printf ("\n"
+          "  if (mg_size > DBUS_MAXIMUM_MESSAGE_LENGTH)\n"
+          "    return FALSE;\n"
+          "\n"
+          "  if (mg_size <= sizeof (mg_stack))\n"
+          "    mg_block = mg_stack;\n"
+          "  else\n"
+          "    mg_block = dbus_malloc (mg_size);\n"
+          "  if (mg_block == NULL)\n"
+          "    return FALSE;\n"
+          "\n");
+
+  known = 1;
+  offset = 0;
+  for (i = 0; i < n_args; i++)
+    write_value (args[i], &known, &offset, i == n_args - 1);
+
+  printf ("\n"
+          "  mg_ret = dbus_message_append_marshalled (message, \"%s\",\n"
+          "                                           mg_block, (int) mg_size);\n"
+          "\n"
+          "  if (mg_block != mg_stack)\n"
+          "    dbus_free (mg_block);\n"
+          "\n"
+          "  return mg_ret;\n"
+          "}\n\n", signature);
+
+  output->n_written++;
+}
+
+static void
+write_member (Output       *output,
+              const Member *member)
+{
+  const char *dot;
+  char *prefix;
+  int i;
+
+  for (i = 0; i < member->n_args; i++)
+    {
+      if (!is_supported (member->args[i].type))
+        {
+          printf ("/* %s.%s: argument %s has type \"%s\", which isn't supported; use DBusMessageIter */\n\n",
+                  member->interface, member->name, member->args[i].name,
+                  member->args[i].type);
+          return;
+        }
+    }
+
+  if (output->prefix != NULL)
+    prefix = to_lower_case (output->prefix);
+  else
+    {
+      dot = strrchr (member->interface, '.');
+      prefix = to_lower_case (dot != NULL ? dot + 1 : member->interface);
+    }
+
+  /* A signal's arguments are all sent by its emitter, so count as out */
+  if (!member->is_signal)
+    write_function (output, member, 0, prefix);
+  write_function (output, member, 1, prefix);
+
+  free (prefix);
+}
+
+static void
+write_preamble (const Output *output,
+                const char   *filename)
+{
+  printf ("/* Generated by dbus-marshal-gen from %s; do not edit */\n\n",
+          filename != NULL ? filename : "standard input");
+
+  if (output->header)
+    {
+      printf ("#include <dbus/dbus.h>\n\n");
+      return;
+    }
+
+  printf ("#include <string.h>\n"
+          "#include <dbus/dbus.h>\n"
+          "\n"
+          "#ifndef DBUS_MG_ALIGN\n"
+          "#define DBUS_MG_ALIGN(n, a) (((n) + (a) - 1) & ~((size_t) (a) - 1))\n"
+          "#define DBUS_MG_PAD(block, pos, a) while ((pos) & ((a) - 1)) (block)[(pos)++] = 0\n"
+          "#endif\n"
+          "\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+  Output output;
+  const char *filename = NULL;
+  const char *interface = NULL;
+  Member member;
+  int in_member = 0;
+  char *data;
+  char *p;
+  int i;
+
+  memset (&output, 0, sizeof (output));
+
+  for (i = 1; i < argc; i++)
+    {
+      char *arg = argv[i];
+
+      if (strncmp (arg, "--prefix=", 9) == 0)
+        output.prefix = arg + 9;
+      else if (!strcmp (arg, "--header"))
+        output.header = 1;
+      else if (!strcmp (arg, "--help"))
+        usage (argv[0], 0);
+      else if (arg[0] == '-' && arg[1] != '\0')
+        usage (argv[0], 1);
+      else if (filename == NULL)
+        filename = arg;
+      else
+        usage (argv[0], 1);
+    }
+
+  data = read_file (filename);
+  if (data == NULL)
+    {
+      fprintf (stderr, "Failed to open %s: %s\n", filename, strerror (errno));
+      exit (1);
+    }
+
+  write_preamble (&output, filename);
+
+  p = data;
+  while ((p = strchr (p, '<')) != NULL)
+    {
+      Tag tag;
+
+      p++;
+
+      /* Comments, <?xml ...?> and <!DOCTYPE ...> */
+      if (strncmp (p, "!--", 3) == 0)
+        {
+          p = strstr (p, "-->");
+          if (p == NULL)
+            break;
+          continue;
+        }
+      if (*p == '?' || *p == '!')
+        continue;
+
+      p = parse_tag (p, &tag);
+      if (p == NULL)
+        {
+          fprintf (stderr, "Can't parse the introspection data\n");
+          exit (1);
+        }
+
+      if (strcmp (tag.name, "interface") == 0)
+        interface = tag.is_end ? NULL : get_attribute (&tag, "name");
+      else if (strcmp (tag.name, "method") == 0 ||
+               strcmp (tag.name, "signal") == 0)
+        {
+          if (!tag.is_end)
+            {
+              memset (&member, 0, sizeof (member));
+              member.interface = interface != NULL ? interface : "";
+              member.name = get_attribute (&tag, "name");
+              member.is_signal = tag.name[0] == 's';
+              in_member = member.name != NULL && interface != NULL;
+            }
+
+          if ((tag.is_end || tag.is_empty) && in_member)
+            {
+              write_member (&output, &member);
+              in_member = 0;
+            }
+        }
+      else if (strcmp (tag.name, "arg") == 0 && in_member && !tag.is_end)
+        {
+          const char *type = get_attribute (&tag, "type");
+          const char *direction = get_attribute (&tag, "direction");
+          Arg *arg;
+
+          if (type == NULL || member.n_args == MAX_ARGS)
+            {
+              fprintf (stderr, "%s.%s: too many arguments, or one without a type\n",
+                       member.interface, member.name);
+              exit (1);
+            }
+
+          arg = &member.args[member.n_args];
+          arg->name = arg_identifier (get_attribute (&tag, "name"),
+                                      member.n_args);
+          arg->type = type;
+          arg->is_out = member.is_signal ||
+            (direction != NULL && strcmp (direction, "out") == 0);
+          member.n_args++;
+        }
+    }
+
+  if (output.n_written == 0)
+    fprintf (stderr, "No methods or signals with supported arguments found\n");
+
+  return 0;
+}
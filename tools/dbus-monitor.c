@@ -29,6 +29,8 @@
 #undef interface
 #else
 #include <sys/time.h>
+#include <errno.h>
+#include <unistd.h>
 #endif
 
 #include <time.h>
@@ -207,10 +209,92 @@ profile_filter_func (DBusConnection	*connection,
 static void
 usage (char *name, int ecode)
 {
-  fprintf (stderr, "Usage: %s [--system | --session | --address ADDRESS] [--monitor | --profile ] [watch expressions]\n", name);
+  fprintf (stderr, "Usage: %s [--system | --session | --address ADDRESS] [--monitor | --profile | --pcap ] [watch expressions]\n", name);
   exit (ecode);
 }
 
+#ifndef DBUS_WIN
+/* Has the bus itself write a pcap stream of the matching messages
+ * into a pipe, and copies that to stdout: nothing is formatted and the
+ * monitor isn't a recipient of the messages, so it keeps up with a
+ * busy bus.
+ */
+static void
+run_capture (DBusConnection *connection,
+             char          **filters,
+             int             n_filters)
+{
+  DBusMessage *message, *reply;
+  DBusError error;
+  int fds[2];
+  char buf[65536];
+
+  dbus_error_init (&error);
+
+  if (!dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD))
+    {
+      fprintf (stderr, "The bus connection can't pass file descriptors, needed by --pcap\n");
+      exit (1);
+    }
+
+  if (pipe (fds) < 0)
+    {
+      fprintf (stderr, "Couldn't create a pipe: %s\n", strerror (errno));
+      exit (1);
+    }
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                          "org.freedesktop.DBus.Debug.Capture",
+                                          "StartCapture");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_UNIX_FD, &fds[1],
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &filters, n_filters,
+                                 DBUS_TYPE_INVALID))
+    {
+      fprintf (stderr, "Out of memory\n");
+      exit (1);
+    }
+
+  reply = dbus_connection_send_with_reply_and_block (connection, message,
+                                                     -1, &error);
+  dbus_message_unref (message);
+  close (fds[1]);
+
+  if (reply == NULL)
+    {
+      fprintf (stderr, "Failed to start capture: %s\n", error.message);
+      dbus_error_free (&error);
+      exit (1);
+    }
+
+  dbus_message_unref (reply);
+
+  /* the bus closes its end when the capture stops */
+  while (TRUE)
+    {
+      ssize_t n_read, n_written, done;
+
+      n_read = read (fds[0], buf, sizeof (buf));
+      if (n_read < 0 && errno == EINTR)
+        continue;
+      if (n_read <= 0)
+        break;
+
+      for (done = 0; done < n_read; done += n_written)
+        {
+          n_written = write (STDOUT_FILENO, buf + done, n_read - done);
+          if (n_written < 0 && errno == EINTR)
+            n_written = 0;
+          else if (n_written < 0)
+            exit (1);
+        }
+    }
+
+  exit (0);
+}
+#endif
+
 static dbus_bool_t sigint_received = FALSE;
 
 static void
@@ -226,6 +310,7 @@ main (int argc, char *argv[])
   DBusError error;
   DBusBusType type = DBUS_BUS_SESSION;
   DBusHandleMessageFunction filter_func = monitor_filter_func;
+  dbus_bool_t pcap = FALSE;
   char *address = NULL;
   
   int i = 0, j = 0, numFilters = 0;
@@ -266,6 +351,10 @@ main (int argc, char *argv[])
 	filter_func = monitor_filter_func;
       else if (!strcmp (arg, "--profile"))
 	filter_func = profile_filter_func;
+#ifndef DBUS_WIN
+      else if (!strcmp (arg, "--pcap"))
+	pcap = TRUE;
+#endif
       else if (!strcmp (arg, "--"))
 	continue;
       else if (arg[0] == '-')
@@ -323,6 +412,11 @@ main (int argc, char *argv[])
       exit (1);
     }
 
+#ifndef DBUS_WIN
+  if (pcap)
+    run_capture (connection, filters, numFilters);
+#endif
+
   if (numFilters)
     {
       for (i = 0; i < j; i++)
@@ -51,7 +51,8 @@ static const char *appname;
 static void
 usage (int ecode)
 {
-  fprintf (stderr, "Usage: %s [--help] [--system | --session | --address=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply=(literal)] [--reply-timeout=MSEC] <destination object path> <message name> [contents ...]\n", appname);
+  fprintf (stderr, "Usage: %s [--help] [--system | --session | --address=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply=(literal)] [--reply-timeout=MSEC] <destination object path> <message name> [contents ...]\n"
+           "       %s [--system | --session | --address=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply=(literal)] [--reply-timeout=MSEC] --batch [--pipeline=DEPTH] < FILE\n", appname, appname);
   exit (ecode);
 }
 
@@ -223,135 +224,72 @@ type_from_name (const char *arg)
   return type;
 }
 
-int
-main (int argc, char *argv[])
+/* What one message is made of; --batch reads one of these per line,
+ * starting from whatever the command line said.
+ */
+typedef struct
 {
-  DBusConnection *connection;
-  DBusError error;
-  DBusMessage *message;
+  const char *dest;
+  const char *type_str;
+  int message_type;
   int print_reply;
   int print_reply_literal;
   int reply_timeout;
-  DBusMessageIter iter;
-  int i;
-  DBusBusType type = DBUS_BUS_SESSION;
-  const char *dest = NULL;
-  const char *name = NULL;
-  const char *path = NULL;
-  int message_type = DBUS_MESSAGE_TYPE_SIGNAL;
-  const char *type_str = NULL;
-  const char *address = NULL;
-  int session_or_system = FALSE;
-
-  appname = argv[0];
-  
-  if (argc < 3)
-    usage (1);
+} SendOptions;
 
-  print_reply = FALSE;
-  print_reply_literal = FALSE;
-  reply_timeout = -1;
-  
-  for (i = 1; i < argc && name == NULL; i++)
+/* Returns TRUE if arg was an option about the message itself */
+static int
+parse_message_option (SendOptions *opts,
+                      const char  *arg)
+{
+  if (strncmp (arg, "--print-reply", 13) == 0)
     {
-      char *arg = argv[i];
-
-      if (strcmp (arg, "--system") == 0)
-        {
-	  type = DBUS_BUS_SYSTEM;
-          session_or_system = TRUE;
-        }
-      else if (strcmp (arg, "--session") == 0)
-        {
-	  type = DBUS_BUS_SESSION;
-          session_or_system = TRUE;
-        }
-      else if (strstr (arg, "--address") == arg)
-        {
-          address = strchr (arg, '=');
-
-          if (address == NULL) 
-            {
-              fprintf (stderr, "\"--address=\" requires an ADDRESS\n");
-              usage (1);
-            }
-          else
-            {
-              address = address + 1;
-            }
-        }
-      else if (strncmp (arg, "--print-reply", 13) == 0)
-	{
-	  print_reply = TRUE;
-	  message_type = DBUS_MESSAGE_TYPE_METHOD_CALL;
-	  if (*(arg + 13) != '\0')
-	    print_reply_literal = TRUE;
-	}
-      else if (strstr (arg, "--reply-timeout=") == arg)
-	{
-	  reply_timeout = strtol (strchr (arg, '=') + 1,
-				  NULL, 10);
-	}
-      else if (strstr (arg, "--dest=") == arg)
-	dest = strchr (arg, '=') + 1;
-      else if (strstr (arg, "--type=") == arg)
-	type_str = strchr (arg, '=') + 1;
-      else if (!strcmp(arg, "--help"))
-	usage (0);
-      else if (arg[0] == '-')
-	usage (1);
-      else if (path == NULL)
-        path = arg;
-      else if (name == NULL)
-        name = arg;
-      else
-        usage (1);
+      opts->print_reply = TRUE;
+      opts->message_type = DBUS_MESSAGE_TYPE_METHOD_CALL;
+      if (*(arg + 13) != '\0')
+        opts->print_reply_literal = TRUE;
     }
+  else if (strstr (arg, "--reply-timeout=") == arg)
+    opts->reply_timeout = strtol (strchr (arg, '=') + 1, NULL, 10);
+  else if (strstr (arg, "--dest=") == arg)
+    opts->dest = strchr (arg, '=') + 1;
+  else if (strstr (arg, "--type=") == arg)
+    opts->type_str = strchr (arg, '=') + 1;
+  else
+    return FALSE;
 
-  if (name == NULL)
-    usage (1);
-
-  if (session_or_system &&
-      (address != NULL))
-    {
-      fprintf (stderr, "\"--address\" may not be used with \"--system\" or \"--session\"\n");
-      usage (1);
-    }
+  return TRUE;
+}
 
-  if (type_str != NULL)
+static void
+resolve_message_type (SendOptions *opts)
+{
+  if (opts->type_str != NULL)
     {
-      message_type = dbus_message_type_from_string (type_str);
-      if (!(message_type == DBUS_MESSAGE_TYPE_METHOD_CALL ||
-            message_type == DBUS_MESSAGE_TYPE_SIGNAL))
+      opts->message_type = dbus_message_type_from_string (opts->type_str);
+      if (!(opts->message_type == DBUS_MESSAGE_TYPE_METHOD_CALL ||
+            opts->message_type == DBUS_MESSAGE_TYPE_SIGNAL))
         {
           fprintf (stderr, "Message type \"%s\" is not supported\n",
-                   type_str);
+                   opts->type_str);
           exit (1);
         }
     }
-  
-  dbus_error_init (&error);
-
-  if (address != NULL)
-    {
-      connection = dbus_connection_open (address, &error);
-    }
-  else
-    {
-      connection = dbus_bus_get (type, &error);
-    }
+}
 
-  if (connection == NULL)
-    {
-      fprintf (stderr, "Failed to open connection to \"%s\" message bus: %s\n",
-               (address != NULL) ? address :
-                 ((type == DBUS_BUS_SYSTEM) ? "system" : "session"),
-               error.message);
-      dbus_error_free (&error);
-      exit (1);
-    }
+/* Builds the message from the path, name and contents in argv[i..] */
+static DBusMessage *
+build_message (const SendOptions *opts,
+               const char        *path,
+               char              *name,
+               int                argc,
+               char             **argv,
+               int                i)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
 
-  if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+  if (opts->message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
     {
       char *last_dot;
 
@@ -368,9 +306,10 @@ main (int argc, char *argv[])
                                               path,
                                               name,
                                               last_dot + 1);
-      dbus_message_set_auto_start (message, TRUE);
+      if (message != NULL)
+        dbus_message_set_auto_start (message, TRUE);
     }
-  else if (message_type == DBUS_MESSAGE_TYPE_SIGNAL)
+  else if (opts->message_type == DBUS_MESSAGE_TYPE_SIGNAL)
     {
       char *last_dot;
 
@@ -397,7 +336,7 @@ main (int argc, char *argv[])
       exit (1);
     }
 
-  if (dest && !dbus_message_set_destination (message, dest))
+  if (opts->dest && !dbus_message_set_destination (message, opts->dest))
     {
       fprintf (stderr, "Not enough memory\n");
       exit (1);
@@ -421,7 +360,7 @@ main (int argc, char *argv[])
 
       if (c == NULL)
 	{
-	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
+	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
 	  exit (1);
 	}
 
@@ -442,7 +381,7 @@ main (int argc, char *argv[])
 	  c = strchr (arg, ':');
 	  if (c == NULL)
 	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
 	      exit (1);
 	    }
 	  *(c++) = 0;
@@ -460,7 +399,7 @@ main (int argc, char *argv[])
 	  c = strchr (c, ':');
 	  if (c == NULL)
 	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
 	      exit (1);
 	    }
 	  *(c++) = 0;
@@ -508,13 +447,439 @@ main (int argc, char *argv[])
 	}
     }
 
-  if (print_reply)
+  return message;
+}
+
+/* Reads a whole line, however long; NULL at the end of input */
+static char *
+read_line (FILE *in)
+{
+  char *line = NULL;
+  size_t allocated = 0;
+  size_t len = 0;
+
+  for (;;)
+    {
+      if (allocated - len < 256)
+        {
+          char *p;
+
+          allocated = allocated == 0 ? 1024 : allocated * 2;
+          p = realloc (line, allocated);
+          if (p == NULL)
+            {
+              fprintf (stderr, "Not enough memory\n");
+              exit (1);
+            }
+          line = p;
+        }
+
+      if (fgets (line + len, allocated - len, in) == NULL)
+        break;
+
+      len += strlen (line + len);
+      if (len > 0 && line[len - 1] == '\n')
+        {
+          line[--len] = '\0';
+          return line;
+        }
+    }
+
+  if (len > 0)
+    return line;
+
+  free (line);
+  return NULL;
+}
+
+/* Splits a line into words in place, the way a shell would for the
+ * simple cases: words are separated by spaces or tabs, '...' and
+ * "..." quote, and a backslash escapes the next character outside
+ * single quotes. A line starting with # is a comment.
+ */
+static int
+split_line (char   *line,
+            char ***words_p)
+{
+  char **words;
+  char *in, *out;
+  int n_words = 0;
+  int allocated = 8;
+
+  words = malloc (allocated * sizeof (char *));
+  if (words == NULL)
+    {
+      fprintf (stderr, "Not enough memory\n");
+      exit (1);
+    }
+
+  in = out = line;
+  while (*in == ' ' || *in == '\t')
+    in++;
+
+  if (*in == '#')
+    *in = '\0';
+
+  while (*in != '\0')
+    {
+      char quote = '\0';
+
+      if (n_words == allocated)
+        {
+          char **p;
+
+          allocated *= 2;
+          p = realloc (words, allocated * sizeof (char *));
+          if (p == NULL)
+            {
+              fprintf (stderr, "Not enough memory\n");
+              exit (1);
+            }
+          words = p;
+        }
+
+      words[n_words++] = out;
+
+      while (*in != '\0' && (quote != '\0' || (*in != ' ' && *in != '\t')))
+        {
+          if (quote == '\0' && (*in == '\'' || *in == '"'))
+            quote = *in++;
+          else if (quote != '\0' && *in == quote)
+            {
+              quote = '\0';
+              in++;
+            }
+          else if (*in == '\\' && quote != '\'' && in[1] != '\0')
+            {
+              *out++ = in[1];
+              in += 2;
+            }
+          else
+            *out++ = *in++;
+        }
+
+      if (quote != '\0')
+        {
+          fprintf (stderr, "%s: Unterminated quote\n", appname);
+          exit (1);
+        }
+
+      /* the terminator can overwrite the separator we stopped at */
+      if (*in != '\0')
+        in++;
+      *out++ = '\0';
+
+      while (*in == ' ' || *in == '\t')
+        in++;
+    }
+
+  *words_p = words;
+  return n_words;
+}
+
+static void
+print_reply_or_error (DBusMessage *reply,
+                      int          literal,
+                      int         *failed)
+{
+  DBusError error;
+
+  dbus_error_init (&error);
+  if (dbus_set_error_from_message (&error, reply))
+    {
+      fprintf (stderr, "Error %s: %s\n", error.name, error.message);
+      dbus_error_free (&error);
+      *failed = TRUE;
+    }
+  else
+    print_message (reply, literal);
+
+  fflush (stdout);
+}
+
+/* Method calls sent with --batch --pipeline and not yet answered */
+typedef struct
+{
+  DBusPendingCall *pending;
+  int literal;
+} PendingReply;
+
+static void
+finish_oldest (PendingReply *queue,
+               int          *n_queued,
+               int          *failed)
+{
+  DBusMessage *reply;
+
+  dbus_pending_call_block (queue[0].pending);
+  reply = dbus_pending_call_steal_reply (queue[0].pending);
+  dbus_pending_call_unref (queue[0].pending);
+
+  if (reply != NULL)
+    {
+      print_reply_or_error (reply, queue[0].literal, failed);
+      dbus_message_unref (reply);
+    }
+
+  *n_queued -= 1;
+  memmove (queue, queue + 1, *n_queued * sizeof (PendingReply));
+}
+
+/* Sends one message per line of stdin over the one connection. With
+ * a pipeline depth above 1, that many method calls may be waiting for
+ * their replies at once; the replies are still printed in order.
+ */
+static int
+run_batch (DBusConnection    *connection,
+           const SendOptions *defaults,
+           int                pipeline)
+{
+  PendingReply *queue;
+  int n_queued = 0;
+  int failed = FALSE;
+  int line_number = 0;
+  char *line;
+
+  queue = malloc (pipeline * sizeof (PendingReply));
+  if (queue == NULL)
+    {
+      fprintf (stderr, "Not enough memory\n");
+      exit (1);
+    }
+
+  while ((line = read_line (stdin)) != NULL)
+    {
+      SendOptions opts = *defaults;
+      DBusMessage *message;
+      const char *path = NULL;
+      char *name = NULL;
+      char **words;
+      int n_words;
+      int i;
+
+      line_number += 1;
+      n_words = split_line (line, &words);
+
+      for (i = 0; i < n_words && name == NULL; i++)
+        {
+          if (parse_message_option (&opts, words[i]))
+            ;
+          else if (words[i][0] == '-')
+            {
+              fprintf (stderr, "%s: Option \"%s\" can't be used in a batch\n",
+                       appname, words[i]);
+              exit (1);
+            }
+          else if (path == NULL)
+            path = words[i];
+          else
+            name = words[i];
+        }
+
+      if (n_words == 0)
+        ;
+      else if (name == NULL)
+        {
+          fprintf (stderr, "%s: Expected an object path and a message name on line %d\n",
+                   appname, line_number);
+          exit (1);
+        }
+      else
+        {
+          resolve_message_type (&opts);
+          message = build_message (&opts, path, name, n_words, words, i);
+
+          if (!opts.print_reply)
+            {
+              if (!dbus_connection_send (connection, message, NULL))
+                {
+                  fprintf (stderr, "Not enough memory\n");
+                  exit (1);
+                }
+            }
+          else
+            {
+              DBusPendingCall *pending;
+
+              if (n_queued == pipeline)
+                finish_oldest (queue, &n_queued, &failed);
+
+              if (!dbus_connection_send_with_reply (connection, message,
+                                                    &pending,
+                                                    opts.reply_timeout))
+                {
+                  fprintf (stderr, "Not enough memory\n");
+                  exit (1);
+                }
+
+              if (pending == NULL)
+                {
+                  fprintf (stderr, "Error %s: %s\n", DBUS_ERROR_DISCONNECTED,
+                           "Connection was disconnected before a reply was received");
+                  exit (1);
+                }
+
+              queue[n_queued].pending = pending;
+              queue[n_queued].literal = opts.print_reply_literal;
+              n_queued += 1;
+
+              /* without pipelining, wait here as the one-shot form does */
+              if (pipeline == 1)
+                finish_oldest (queue, &n_queued, &failed);
+            }
+
+          dbus_message_unref (message);
+        }
+
+      free (words);
+      free (line);
+    }
+
+  while (n_queued > 0)
+    finish_oldest (queue, &n_queued, &failed);
+
+  dbus_connection_flush (connection);
+  free (queue);
+
+  return failed ? 1 : 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  DBusConnection *connection;
+  DBusError error;
+  DBusMessage *message;
+  SendOptions opts;
+  int i;
+  DBusBusType type = DBUS_BUS_SESSION;
+  char *name = NULL;
+  const char *path = NULL;
+  const char *address = NULL;
+  int session_or_system = FALSE;
+  int batch = FALSE;
+  int pipeline = 1;
+
+  appname = argv[0];
+  
+  if (argc < 2)
+    usage (1);
+
+  opts.dest = NULL;
+  opts.type_str = NULL;
+  opts.message_type = DBUS_MESSAGE_TYPE_SIGNAL;
+  opts.print_reply = FALSE;
+  opts.print_reply_literal = FALSE;
+  opts.reply_timeout = -1;
+  
+  for (i = 1; i < argc && name == NULL; i++)
+    {
+      char *arg = argv[i];
+
+      if (strcmp (arg, "--system") == 0)
+        {
+	  type = DBUS_BUS_SYSTEM;
+          session_or_system = TRUE;
+        }
+      else if (strcmp (arg, "--session") == 0)
+        {
+	  type = DBUS_BUS_SESSION;
+          session_or_system = TRUE;
+        }
+      else if (strstr (arg, "--address") == arg)
+        {
+          address = strchr (arg, '=');
+
+          if (address == NULL) 
+            {
+              fprintf (stderr, "\"--address=\" requires an ADDRESS\n");
+              usage (1);
+            }
+          else
+            {
+              address = address + 1;
+            }
+        }
+      else if (strcmp (arg, "--batch") == 0)
+        batch = TRUE;
+      else if (strstr (arg, "--pipeline=") == arg)
+        {
+          pipeline = strtol (strchr (arg, '=') + 1, NULL, 10);
+          if (pipeline < 1)
+            usage (1);
+        }
+      else if (parse_message_option (&opts, arg))
+        ;
+      else if (!strcmp(arg, "--help"))
+	usage (0);
+      else if (arg[0] == '-')
+	usage (1);
+      else if (batch)
+        usage (1);
+      else if (path == NULL)
+        path = arg;
+      else if (name == NULL)
+        name = arg;
+      else
+        usage (1);
+    }
+
+  if (name == NULL && !batch)
+    usage (1);
+
+  if (pipeline > 1 && !batch)
+    {
+      fprintf (stderr, "\"--pipeline\" may only be used with \"--batch\"\n");
+      usage (1);
+    }
+
+  if (session_or_system &&
+      (address != NULL))
+    {
+      fprintf (stderr, "\"--address\" may not be used with \"--system\" or \"--session\"\n");
+      usage (1);
+    }
+
+  dbus_error_init (&error);
+
+  if (address != NULL)
+    {
+      connection = dbus_connection_open (address, &error);
+    }
+  else
+    {
+      connection = dbus_bus_get (type, &error);
+    }
+
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Failed to open connection to \"%s\" message bus: %s\n",
+               (address != NULL) ? address :
+                 ((type == DBUS_BUS_SYSTEM) ? "system" : "session"),
+               error.message);
+      dbus_error_free (&error);
+      exit (1);
+    }
+
+  if (batch)
+    {
+      /* the lines' own --type= and --print-reply apply on top */
+      int status = run_batch (connection, &opts, pipeline);
+
+      dbus_connection_unref (connection);
+      exit (status);
+    }
+
+  resolve_message_type (&opts);
+  message = build_message (&opts, path, name, argc, argv, i);
+
+  if (opts.print_reply)
     {
       DBusMessage *reply;
 
       dbus_error_init (&error);
       reply = dbus_connection_send_with_reply_and_block (connection,
-                                                         message, reply_timeout,
+                                                         message, opts.reply_timeout,
                                                          &error);
       if (dbus_error_is_set (&error))
         {
@@ -526,7 +891,7 @@ main (int argc, char *argv[])
 
       if (reply)
         {
-          print_message (reply, print_reply_literal);
+          print_message (reply, opts.print_reply_literal);
           dbus_message_unref (reply);
         }
     }
@@ -0,0 +1,598 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-top.c  Utility program to watch the busiest clients of a message bus
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <dbus/dbus.h>
+
+#define STATS_INTERFACE "org.freedesktop.DBus.Debug.Stats"
+
+/* One connection as of the last two samples. The counters that only
+ * grow are turned into rates; the rest are shown as they are.
+ */
+typedef struct
+{
+  char *unique_name;
+  char *names;                          /**< Well-known names, comma-separated */
+  dbus_bool_t seen;                     /**< Still on the bus at the last sample */
+  unsigned long long messages;          /**< IncomingMessages + OutgoingMessages */
+  unsigned long long bytes;             /**< IncomingBytes + OutgoingBytes */
+  double messages_per_sec;
+  double bytes_per_sec;
+  unsigned long queue_bytes;            /**< IncomingQueueBytes + OutgoingQueueBytes */
+  unsigned long match_rules;
+  unsigned long pending_replies;
+  unsigned long policy_denials;
+} Client;
+
+typedef enum
+{
+  SORT_MESSAGES,
+  SORT_BYTES,
+  SORT_QUEUE,
+  SORT_RULES,
+  SORT_REPLIES,
+  SORT_DENIALS
+} SortKey;
+
+static const char *sort_names[] =
+{
+  "messages", "bytes", "queue", "rules", "replies", "denials", NULL
+};
+
+static DBusBusType type = DBUS_BUS_SESSION;
+static const char *address = NULL;
+static int interval = 2;
+static int iterations = 0;
+static int max_rows = 20;
+static SortKey sort_key = SORT_MESSAGES;
+
+static Client *clients = NULL;
+static int n_clients = 0;
+
+static void
+usage (char *name, int ecode)
+{
+  fprintf (stderr, "Usage: %s [--system | --session | --address=ADDRESS] [--interval=SECONDS] [--iterations=N] [--rows=N] [--sort=messages|bytes|queue|rules|replies|denials]\n", name);
+  exit (ecode);
+}
+
+static void
+die (const char *message,
+     DBusError  *error)
+{
+  if (error != NULL && dbus_error_is_set (error))
+    fprintf (stderr, "%s: %s\n", message, error->message);
+  else
+    fprintf (stderr, "%s\n", message);
+
+  exit (1);
+}
+
+static unsigned long long
+now_usec (void)
+{
+  struct timeval t;
+
+  gettimeofday (&t, NULL);
+
+  return t.tv_sec * 1000000ULL + t.tv_usec;
+}
+
+static DBusConnection*
+connect_bus (void)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  if (address != NULL)
+    {
+      connection = dbus_connection_open_private (address, &error);
+      if (connection != NULL && !dbus_bus_register (connection, &error))
+        {
+          dbus_connection_close (connection);
+          dbus_connection_unref (connection);
+          connection = NULL;
+        }
+    }
+  else
+    connection = dbus_bus_get_private (type, &error);
+
+  if (connection == NULL)
+    die ("Failed to connect to the bus", &error);
+
+  return connection;
+}
+
+static DBusPendingCall*
+start_call (DBusConnection *connection,
+            const char     *interface,
+            const char     *method,
+            const char     *arg)
+{
+  DBusMessage *message;
+  DBusPendingCall *pending;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                          interface, method);
+  if (message == NULL ||
+      (arg != NULL &&
+       !dbus_message_append_args (message, DBUS_TYPE_STRING, &arg,
+                                  DBUS_TYPE_INVALID)) ||
+      !dbus_connection_send_with_reply (connection, message, &pending, -1) ||
+      pending == NULL)
+    die ("Out of memory", NULL);
+
+  dbus_message_unref (message);
+
+  return pending;
+}
+
+/* Returns NULL if the bus answered with an error, which is set */
+static DBusMessage*
+finish_call (DBusPendingCall *pending,
+             DBusError       *error)
+{
+  DBusMessage *reply;
+
+  dbus_pending_call_block (pending);
+  reply = dbus_pending_call_steal_reply (pending);
+  dbus_pending_call_unref (pending);
+
+  if (reply == NULL)
+    die ("Out of memory", NULL);
+
+  if (dbus_set_error_from_message (error, reply))
+    {
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  return reply;
+}
+
+static Client*
+find_client (const char *unique_name)
+{
+  int i;
+
+  for (i = 0; i < n_clients; i++)
+    {
+      if (!strcmp (clients[i].unique_name, unique_name))
+        return &clients[i];
+    }
+
+  return NULL;
+}
+
+static Client*
+add_client (const char *unique_name)
+{
+  Client *client;
+
+  clients = realloc (clients, (n_clients + 1) * sizeof (Client));
+  if (clients == NULL)
+    die ("Out of memory", NULL);
+
+  client = &clients[n_clients++];
+  memset (client, 0, sizeof (Client));
+  client->unique_name = strdup (unique_name);
+  if (client->unique_name == NULL)
+    die ("Out of memory", NULL);
+
+  return client;
+}
+
+static void
+add_name (Client     *client,
+          const char *name)
+{
+  size_t old_len = client->names ? strlen (client->names) : 0;
+
+  client->names = realloc (client->names, old_len + strlen (name) + 2);
+  if (client->names == NULL)
+    die ("Out of memory", NULL);
+
+  if (old_len > 0)
+    client->names[old_len++] = ',';
+  strcpy (client->names + old_len, name);
+}
+
+/* Forget the connections that went away since the last sample */
+static void
+drop_unseen_clients (void)
+{
+  int i, j;
+
+  for (i = 0, j = 0; i < n_clients; i++)
+    {
+      if (clients[i].seen)
+        clients[j++] = clients[i];
+      else
+        {
+          free (clients[i].unique_name);
+          free (clients[i].names);
+        }
+    }
+
+  n_clients = j;
+}
+
+/* Reads the numbers we show out of a GetConnectionStats reply */
+static void
+read_stats (DBusMessage        *reply,
+            unsigned long long *messages,
+            unsigned long long *bytes,
+            Client             *client)
+{
+  DBusMessageIter iter, dict;
+
+  *messages = 0;
+  *bytes = 0;
+  client->queue_bytes = 0;
+  client->match_rules = 0;
+  client->pending_replies = 0;
+  client->policy_denials = 0;
+
+  if (!dbus_message_has_signature (reply, "a{sv}"))
+    return;
+
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &dict);
+
+  while (dbus_message_iter_get_arg_type (&dict) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter entry, variant;
+      unsigned long long value;
+      const char *key;
+
+      dbus_message_iter_recurse (&dict, &entry);
+      dbus_message_iter_get_basic (&entry, &key);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_recurse (&entry, &variant);
+
+      if (dbus_message_iter_get_arg_type (&variant) == DBUS_TYPE_UINT64)
+        {
+          dbus_uint64_t v;
+
+          dbus_message_iter_get_basic (&variant, &v);
+          value = v;
+        }
+      else if (dbus_message_iter_get_arg_type (&variant) == DBUS_TYPE_UINT32)
+        {
+          dbus_uint32_t v;
+
+          dbus_message_iter_get_basic (&variant, &v);
+          value = v;
+        }
+      else
+        {
+          dbus_message_iter_next (&dict);
+          continue;
+        }
+
+      if (!strcmp (key, "IncomingMessages") ||
+          !strcmp (key, "OutgoingMessages"))
+        *messages += value;
+      else if (!strcmp (key, "IncomingBytes") ||
+               !strcmp (key, "OutgoingBytes"))
+        *bytes += value;
+      else if (!strcmp (key, "IncomingQueueBytes") ||
+               !strcmp (key, "OutgoingQueueBytes"))
+        client->queue_bytes += value;
+      else if (!strcmp (key, "MatchRules"))
+        client->match_rules = value;
+      else if (!strcmp (key, "PendingReplies"))
+        client->pending_replies = value;
+      else if (!strcmp (key, "PolicyDenials"))
+        client->policy_denials = value;
+
+      dbus_message_iter_next (&dict);
+    }
+}
+
+/* Takes one sample of every connection on the bus. All the calls are
+ * sent before any reply is waited for, so a busy bus costs us one
+ * round trip per refresh rather than one per client.
+ */
+static void
+sample (DBusConnection *connection,
+        double          elapsed_sec)
+{
+  DBusPendingCall **stats_calls;
+  DBusPendingCall **owner_calls;
+  DBusMessage *reply;
+  DBusError error;
+  char **names;
+  int n_names;
+  int i;
+
+  dbus_error_init (&error);
+
+  reply = finish_call (start_call (connection, DBUS_INTERFACE_DBUS,
+                                   "ListNames", NULL), &error);
+  if (reply == NULL)
+    die ("ListNames failed", &error);
+
+  if (!dbus_message_get_args (reply, &error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                              &names, &n_names,
+                              DBUS_TYPE_INVALID))
+    die ("ListNames returned something odd", &error);
+
+  dbus_message_unref (reply);
+
+  stats_calls = calloc (n_names + 1, sizeof (DBusPendingCall *));
+  owner_calls = calloc (n_names + 1, sizeof (DBusPendingCall *));
+  if (stats_calls == NULL || owner_calls == NULL)
+    die ("Out of memory", NULL);
+
+  for (i = 0; i < n_names; i++)
+    {
+      if (names[i][0] == ':')
+        stats_calls[i] = start_call (connection, STATS_INTERFACE,
+                                     "GetConnectionStats", names[i]);
+      else if (strcmp (names[i], DBUS_SERVICE_DBUS) != 0)
+        owner_calls[i] = start_call (connection, DBUS_INTERFACE_DBUS,
+                                     "GetNameOwner", names[i]);
+    }
+
+  for (i = 0; i < n_clients; i++)
+    {
+      clients[i].seen = FALSE;
+      free (clients[i].names);
+      clients[i].names = NULL;
+    }
+
+  for (i = 0; i < n_names; i++)
+    {
+      unsigned long long messages, bytes;
+      Client *client;
+      dbus_bool_t is_new;
+
+      if (stats_calls[i] == NULL)
+        continue;
+
+      reply = finish_call (stats_calls[i], &error);
+      if (reply == NULL)
+        {
+          if (dbus_error_has_name (&error, DBUS_ERROR_UNKNOWN_METHOD) ||
+              dbus_error_has_name (&error, DBUS_ERROR_ACCESS_DENIED))
+            die ("Cannot read the bus statistics (is it built with "
+                 "--enable-stats, and are we allowed to call "
+                 STATS_INTERFACE "?)", &error);
+
+          /* The client went away between ListNames and now */
+          dbus_error_free (&error);
+          continue;
+        }
+
+      client = find_client (names[i]);
+      is_new = client == NULL;
+      if (is_new)
+        client = add_client (names[i]);
+
+      read_stats (reply, &messages, &bytes, client);
+      dbus_message_unref (reply);
+
+      if (is_new || elapsed_sec <= 0)
+        {
+          client->messages_per_sec = 0;
+          client->bytes_per_sec = 0;
+        }
+      else
+        {
+          client->messages_per_sec = (messages - client->messages) / elapsed_sec;
+          client->bytes_per_sec = (bytes - client->bytes) / elapsed_sec;
+        }
+
+      client->messages = messages;
+      client->bytes = bytes;
+      client->seen = TRUE;
+    }
+
+  drop_unseen_clients ();
+
+  for (i = 0; i < n_names; i++)
+    {
+      const char *owner;
+      Client *client;
+
+      if (owner_calls[i] == NULL)
+        continue;
+
+      reply = finish_call (owner_calls[i], &error);
+      if (reply == NULL)
+        {
+          dbus_error_free (&error);
+          continue;
+        }
+
+      if (dbus_message_get_args (reply, NULL, DBUS_TYPE_STRING, &owner,
+                                 DBUS_TYPE_INVALID) &&
+          (client = find_client (owner)) != NULL)
+        add_name (client, names[i]);
+
+      dbus_message_unref (reply);
+    }
+
+  free (stats_calls);
+  free (owner_calls);
+  dbus_free_string_array (names);
+}
+
+static double
+sort_value (const Client *client)
+{
+  switch (sort_key)
+    {
+    case SORT_MESSAGES:
+      return client->messages_per_sec;
+    case SORT_BYTES:
+      return client->bytes_per_sec;
+    case SORT_QUEUE:
+      return client->queue_bytes;
+    case SORT_RULES:
+      return client->match_rules;
+    case SORT_REPLIES:
+      return client->pending_replies;
+    case SORT_DENIALS:
+      return client->policy_denials;
+    }
+
+  return 0;
+}
+
+static int
+compare_clients (const void *a,
+                 const void *b)
+{
+  double v1 = sort_value (a);
+  double v2 = sort_value (b);
+
+  if (v1 != v2)
+    return v1 > v2 ? -1 : 1;
+
+  return strcmp (((const Client *) a)->unique_name,
+                 ((const Client *) b)->unique_name);
+}
+
+static void
+print_table (const char *own_name,
+             dbus_bool_t clear)
+{
+  double total_messages = 0, total_bytes = 0;
+  int i;
+
+  qsort (clients, n_clients, sizeof (Client), compare_clients);
+
+  for (i = 0; i < n_clients; i++)
+    {
+      total_messages += clients[i].messages_per_sec;
+      total_bytes += clients[i].bytes_per_sec;
+    }
+
+  /* Home the cursor and clear the screen */
+  if (clear)
+    printf ("\033[H\033[2J");
+
+  printf ("%d connections, %.1f msg/s, %.1f KiB/s, sorted by %s\n\n",
+          n_clients, total_messages, total_bytes / 1024, sort_names[sort_key]);
+  printf ("%-12s %9s %10s %9s %6s %7s %7s  %s\n",
+          "CONNECTION", "MSG/S", "KIB/S", "QUEUE", "RULES", "REPLIES",
+          "DENIED", "NAMES");
+
+  for (i = 0; i < n_clients && (max_rows <= 0 || i < max_rows); i++)
+    {
+      const Client *client = &clients[i];
+
+      printf ("%-12s %9.1f %10.1f %9lu %6lu %7lu %7lu  %s%s\n",
+              client->unique_name, client->messages_per_sec,
+              client->bytes_per_sec / 1024, client->queue_bytes,
+              client->match_rules, client->pending_replies,
+              client->policy_denials,
+              client->names ? client->names : "",
+              !strcmp (client->unique_name, own_name) ? "(dbus-top)" : "");
+    }
+
+  if (!clear)
+    printf ("\n");
+
+  fflush (stdout);
+}
+
+int
+main (int argc, char *argv[])
+{
+  DBusConnection *connection;
+  unsigned long long last = 0, now;
+  dbus_bool_t clear;
+  int i, j;
+
+  for (i = 1; i < argc; i++)
+    {
+      char *arg = argv[i];
+
+      if (!strcmp (arg, "--system"))
+        type = DBUS_BUS_SYSTEM;
+      else if (!strcmp (arg, "--session"))
+        type = DBUS_BUS_SESSION;
+      else if (strncmp (arg, "--address=", 10) == 0)
+        address = arg + 10;
+      else if (strncmp (arg, "--interval=", 11) == 0)
+        interval = atoi (arg + 11);
+      else if (strncmp (arg, "--iterations=", 13) == 0)
+        iterations = atoi (arg + 13);
+      else if (strncmp (arg, "--rows=", 7) == 0)
+        max_rows = atoi (arg + 7);
+      else if (strncmp (arg, "--sort=", 7) == 0)
+        {
+          for (j = 0; sort_names[j] != NULL; j++)
+            {
+              if (!strcmp (arg + 7, sort_names[j]))
+                break;
+            }
+
+          if (sort_names[j] == NULL)
+            usage (argv[0], 1);
+
+          sort_key = j;
+        }
+      else if (!strcmp (arg, "--help"))
+        usage (argv[0], 0);
+      else
+        usage (argv[0], 1);
+    }
+
+  if (interval <= 0 || iterations < 0)
+    usage (argv[0], 1);
+
+  connection = connect_bus ();
+
+  /* Redraw in place on a terminal; append when logging to a file */
+  clear = isatty (STDOUT_FILENO);
+
+  /* The first sample has nothing to take a rate against, so it is
+   * not shown
+   */
+  for (i = 0; iterations == 0 || i <= iterations; i++)
+    {
+      now = now_usec ();
+      sample (connection, last > 0 ? (now - last) / 1000000.0 : 0);
+      last = now;
+
+      if (i > 0)
+        print_table (dbus_bus_get_unique_name (connection), clear);
+
+      if (iterations == 0 || i < iterations)
+        sleep (interval);
+    }
+
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+
+  return 0;
+}